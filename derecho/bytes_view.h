@@ -0,0 +1,74 @@
+/**
+ * @file bytes_view.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <cstring>
+#include <functional>
+#include <memory>
+
+#include "mutils-serialization/SerializationSupport.hpp"
+
+namespace derecho {
+
+/**
+ * A byte array that can be passed to an RPC function without being copied out
+ * of the message it arrived in. When an RPC function takes a
+ * const BytesView& argument, the argument is deserialized with
+ * from_bytes_noalloc(), so it points directly into the delivered message and
+ * is only valid until the function returns; a function that needs the bytes
+ * afterwards must copy them. On the sending side, a BytesView can wrap any
+ * buffer that outlives the send call.
+ */
+class BytesView : public mutils::ByteRepresentable {
+    const char* data_ptr;
+    std::size_t data_size;
+    /** Set only when the bytes were copied by from_bytes() */
+    std::unique_ptr<char[]> owned_data;
+
+public:
+    BytesView() : data_ptr(nullptr), data_size(0) {}
+    BytesView(const char* data, std::size_t size) : data_ptr(data), data_size(size) {}
+    BytesView(BytesView&&) = default;
+
+    const char* data() const { return data_ptr; }
+    std::size_t size() const { return data_size; }
+
+    std::size_t to_bytes(char* v) const {
+        ((std::size_t*)v)[0] = data_size;
+        if(data_size > 0) {
+            memcpy(v + sizeof(std::size_t), data_ptr, data_size);
+        }
+        return bytes_size();
+    }
+
+    void post_object(const std::function<void(char const* const, std::size_t)>& func) const {
+        func((char const*)&data_size, sizeof(data_size));
+        func(data_ptr, data_size);
+    }
+
+    std::size_t bytes_size() const {
+        return sizeof(std::size_t) + data_size;
+    }
+
+    void ensure_registered(mutils::DeserializationManager&) {}
+
+    /** Copies the bytes, so the result owns them. */
+    static std::unique_ptr<BytesView> from_bytes(mutils::DeserializationManager*, char const* const v) {
+        auto view = std::make_unique<BytesView>();
+        view->data_size = ((std::size_t const*)v)[0];
+        view->owned_data.reset(new char[view->data_size]);
+        memcpy(view->owned_data.get(), v + sizeof(std::size_t), view->data_size);
+        view->data_ptr = view->owned_data.get();
+        return view;
+    }
+
+    /** Points into the serialized bytes, without copying them. */
+    static mutils::context_ptr<BytesView> from_bytes_noalloc(mutils::DeserializationManager*, char const* const v) {
+        return mutils::context_ptr<BytesView>{new BytesView(v + sizeof(std::size_t), ((std::size_t const*)v)[0])};
+    }
+};
+}  // namespace derecho
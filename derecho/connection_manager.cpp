@@ -3,13 +3,16 @@
 #include <cassert>
 #include <iostream>
 #include <set>
+#include <sys/epoll.h>
+#include <unistd.h>
 
 namespace tcp {
 bool tcp_connections::add_connection(const node_id_t other_id,
                                      const ip_addr_t& other_ip) {
     if(other_id < my_id) {
+        socket s;
         try {
-            sockets[other_id] = socket(other_ip, port);
+            s = socket(other_ip, port);
         } catch(exception) {
             std::cerr << "WARNING: failed to node " << other_id << " at "
                       << other_ip << ":" << port << std::endl;
@@ -17,20 +20,19 @@ bool tcp_connections::add_connection(const node_id_t other_id,
         }
 
         uint32_t remote_id = 0;
-        if(!sockets[other_id].exchange(my_id, remote_id)) {
+        if(!s.exchange(my_id, remote_id)) {
             std::cerr << "WARNING: failed to exchange rank with node "
                       << other_id << " at " << other_ip << ":" << port
                       << std::endl;
-            sockets.erase(other_id);
             return false;
         } else if(remote_id != other_id) {
             std::cerr << "WARNING: node at " << other_ip << ":" << port
                       << " replied with wrong id (expected " << other_id
                       << " but got " << remote_id << ")" << std::endl;
 
-            sockets.erase(other_id);
             return false;
         }
+        insert_connection(other_id, std::move(s));
         return true;
     } else if(other_id > my_id) {
         while(true) {
@@ -43,7 +45,7 @@ bool tcp_connections::add_connection(const node_id_t other_id,
                               << std::endl;
                     return false;
                 } else {
-                    sockets[remote_id] = std::move(s);
+                    insert_connection(remote_id, std::move(s));
                     //If the connection we got wasn't the intended node, keep
                     //looping and try again; there must be multiple nodes connecting
                     //simultaneously
@@ -64,57 +66,102 @@ bool tcp_connections::add_connection(const node_id_t other_id,
 void tcp_connections::establish_node_connections(const std::map<node_id_t, ip_addr_t>& ip_addrs) {
     conn_listener = std::make_unique<connection_listener>(port);
 
-    for(auto it = ip_addrs.begin(); it != ip_addrs.end(); it++) {
-        //Check that there isn't already a connection to this ID,
-        //since an earlier add_connection could have connected to it by "mistake"
-        if(it->first != my_id && sockets.count(it->first) == 0) {
-            if(!add_connection(it->first, it->second)) {
-                std::cerr << "WARNING: failed to connect to node " << it->first
-                          << " at " << it->second << std::endl;
-            }
+    //Skip IDs there is already a connection to, then connect to the rest at once
+    std::map<node_id_t, ip_addr_t> new_addrs;
+    for(const auto& id_addr : ip_addrs) {
+        if(id_addr.first != my_id && sockets.count(id_addr.first) == 0) {
+            new_addrs.insert(id_addr);
+        }
+    }
+    std::map<node_id_t, socket> new_sockets = connect_to_all(*conn_listener, new_addrs, my_id, port);
+    std::lock_guard<std::mutex> lock(sockets_mutex);
+    for(auto& id_addr : new_addrs) {
+        if(new_sockets.count(id_addr.first) == 0) {
+            std::cerr << "WARNING: failed to connect to node " << id_addr.first
+                      << " at " << id_addr.second << std::endl;
         }
     }
+    for(auto& id_socket : new_sockets) {
+        insert_connection(id_socket.first, std::move(id_socket.second));
+    }
 }
 
 tcp_connections::tcp_connections(node_id_t _my_id,
                                  const std::map<node_id_t, ip_addr_t>& ip_addrs,
                                  uint32_t _port)
-        : my_id(_my_id), port(_port) {
+        : my_id(_my_id), port(_port), epoll_fd(epoll_create1(EPOLL_CLOEXEC)) {
+    if(epoll_fd < 0) {
+        throw connection_failure();
+    }
     establish_node_connections(ip_addrs);
 }
 
+tcp_connections::~tcp_connections() {
+    destroy();
+    close(epoll_fd);
+}
+
+void tcp_connections::insert_connection(node_id_t node_id, socket&& sock) {
+    auto conn = std::make_shared<connection>(std::move(sock));
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.u32 = node_id;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->sock.get_fd(), &event) != 0) {
+        std::cerr << "WARNING: failed to watch the socket for node " << node_id
+                  << " for incoming data" << std::endl;
+    }
+    sockets[node_id] = conn;
+}
+
+std::shared_ptr<tcp_connections::connection> tcp_connections::get_connection(node_id_t node_id) {
+    std::lock_guard<std::mutex> lock(sockets_mutex);
+    const auto it = sockets.find(node_id);
+    if(it == sockets.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
 void tcp_connections::destroy() {
     std::lock_guard<std::mutex> lock(sockets_mutex);
+    for(auto& p : sockets) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p.second->sock.get_fd(), nullptr);
+    }
     sockets.clear();
     conn_listener.reset();
 }
 
 bool tcp_connections::write(node_id_t node_id, char const* buffer,
                             size_t size) {
-    std::lock_guard<std::mutex> lock(sockets_mutex);
-    const auto it = sockets.find(node_id);
-    assert(it != sockets.end());
-    return it->second.write(buffer, size);
+    auto conn = get_connection(node_id);
+    assert(conn);
+    std::lock_guard<std::mutex> lock(conn->mtx);
+    return conn->sock.write(buffer, size);
 }
 
 bool tcp_connections::write_all(char const* buffer, size_t size) {
-    std::lock_guard<std::mutex> lock(sockets_mutex);
+    std::map<node_id_t, std::shared_ptr<connection>> all_sockets;
+    {
+        std::lock_guard<std::mutex> lock(sockets_mutex);
+        all_sockets = sockets;
+    }
     bool success = true;
-    for(auto& p : sockets) {
+    for(auto& p : all_sockets) {
         if(p.first == my_id) {
             continue;
         }
-        success = success && p.second.write(buffer, size);
+        std::lock_guard<std::mutex> lock(p.second->mtx);
+        success = success && p.second->sock.write(buffer, size);
     }
     return success;
 }
 
 bool tcp_connections::read(node_id_t node_id, char* buffer,
                            size_t size) {
-    std::lock_guard<std::mutex> lock(sockets_mutex);
-    const auto it = sockets.find(node_id);
-    assert(it != sockets.end());
-    return it->second.read(buffer, size);
+    auto conn = get_connection(node_id);
+    assert(conn);
+    std::lock_guard<std::mutex> lock(conn->mtx);
+    return conn->sock.read(buffer, size);
 }
 
 bool tcp_connections::add_node(node_id_t new_id, const ip_addr_t new_ip_addr) {
@@ -127,14 +174,28 @@ bool tcp_connections::add_node(node_id_t new_id, const ip_addr_t new_ip_addr) {
 }
 
 bool tcp_connections::delete_node(node_id_t remove_id) {
-    std::lock_guard<std::mutex> lock(sockets_mutex);
-    return (sockets.erase(remove_id) > 0);
+    std::shared_ptr<connection> removed;
+    {
+        std::lock_guard<std::mutex> lock(sockets_mutex);
+        const auto it = sockets.find(remove_id);
+        if(it == sockets.end()) {
+            return false;
+        }
+        removed = it->second;
+        sockets.erase(it);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, removed->sock.get_fd(), nullptr);
+    }
+    // Let any read or write in progress finish before the socket is closed,
+    // since a LockedReference from get_socket doesn't keep it alive
+    std::lock_guard<std::mutex> lock(removed->mtx);
+    return true;
 }
 
 int32_t tcp_connections::probe_all() {
     std::lock_guard<std::mutex> lock(sockets_mutex);
     for(auto& p : sockets) {
-        bool new_data_available = p.second.probe();
+        std::lock_guard<std::mutex> conn_lock(p.second->mtx);
+        bool new_data_available = p.second->sock.probe();
         if(new_data_available == true) {
             return p.first;
         }
@@ -142,7 +203,50 @@ int32_t tcp_connections::probe_all() {
     return -1;
 }
 
+int32_t tcp_connections::wait_for_data(int timeout_ms) {
+    epoll_event event;
+    int num_events = epoll_wait(epoll_fd, &event, 1, timeout_ms);
+    if(num_events <= 0) {
+        return -1;
+    }
+    node_id_t node_id = event.data.u32;
+    auto conn = get_connection(node_id);
+    if(!conn) {
+        return -1;
+    }
+    // Data that was pending when epoll reported it may have been consumed
+    // since by someone holding the socket through get_socket
+    bool has_data;
+    {
+        std::lock_guard<std::mutex> lock(conn->mtx);
+        has_data = conn->sock.probe();
+    }
+    if(!has_data) {
+        // Once the other end has hung up there will never be anything to
+        // read, and re-arming would just report the hangup over and over
+        if(!(event.events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+            resume_watching(node_id);
+        }
+        return -1;
+    }
+    return node_id;
+}
+
+void tcp_connections::resume_watching(node_id_t node_id) {
+    std::lock_guard<std::mutex> lock(sockets_mutex);
+    const auto it = sockets.find(node_id);
+    if(it == sockets.end()) {
+        return;
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.u32 = node_id;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, it->second->sock.get_fd(), &event);
+}
+
 derecho::LockedReference<std::unique_lock<std::mutex>, socket> tcp_connections::get_socket(node_id_t node_id) {
-    return derecho::LockedReference<std::unique_lock<std::mutex>, socket>(sockets.at(node_id), sockets_mutex);
+    auto conn = get_connection(node_id);
+    assert(conn);
+    return derecho::LockedReference<std::unique_lock<std::mutex>, socket>(conn->sock, conn->mtx);
 }
 }
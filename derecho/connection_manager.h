@@ -2,6 +2,7 @@
 
 #include <cassert>
 #include <map>
+#include <memory>
 #include <mutex>
 
 #include "locked_reference.h"
@@ -11,20 +12,38 @@ namespace tcp {
 using ip_addr_t = std::string;
 using node_id_t = uint32_t;
 class tcp_connections {
+    /** A socket together with the lock that serializes reads and writes on it. */
+    struct connection {
+        socket sock;
+        std::mutex mtx;
+        connection(socket&& sock) : sock(std::move(sock)) {}
+    };
+
+    /** Protects the sockets map itself. Reads and writes only hold it long
+     * enough to find their connection, then lock that connection alone. */
     std::mutex sockets_mutex;
 
     node_id_t my_id;
     const uint32_t port;
     std::unique_ptr<connection_listener> conn_listener;
-    std::map<node_id_t, socket> sockets;
+    std::map<node_id_t, std::shared_ptr<connection>> sockets;
+    /** An epoll instance watching every socket in sockets for incoming data.
+     * Each socket is registered as one-shot, keyed by node ID, so it is
+     * reported once and then ignored until resume_watching is called. */
+    int epoll_fd;
     bool add_connection(const node_id_t other_id,
                         const ip_addr_t& other_ip);
     void establish_node_connections(const std::map<node_id_t, ip_addr_t>& ip_addrs);
+    /** Stores a new connection and starts watching it with epoll. Must be
+     * called with sockets_mutex held. */
+    void insert_connection(node_id_t node_id, socket&& sock);
+    std::shared_ptr<connection> get_connection(node_id_t node_id);
 
 public:
     tcp_connections(node_id_t _my_id,
                     const std::map<node_id_t, ip_addr_t>& ip_addrs,
                     uint32_t _port);
+    ~tcp_connections();
     void destroy();
     bool write(node_id_t node_id, char const* buffer, size_t size);
     bool write_all(char const* buffer, size_t size);
@@ -33,12 +52,24 @@ public:
     bool delete_node(node_id_t remove_id);
     template <class T>
     bool exchange(node_id_t node_id, T local, T& remote) {
-        std::lock_guard<std::mutex> lock(sockets_mutex);
-        const auto it = sockets.find(node_id);
-        assert(it != sockets.end());
-        return it->second.exchange(local, remote);
+        auto conn = get_connection(node_id);
+        assert(conn);
+        std::lock_guard<std::mutex> lock(conn->mtx);
+        return conn->sock.exchange(local, remote);
     }
     int32_t probe_all();
+    /**
+     * Waits until some socket has data to read. The socket that is returned
+     * is not reported again until resume_watching is called for it, so only
+     * one thread should wait for data at a time.
+     * @param timeout_ms The longest time to wait, in milliseconds
+     * @return The ID of the node whose socket has data, or -1 if the timeout
+     * expired first
+     */
+    int32_t wait_for_data(int timeout_ms);
+    /** Starts reporting incoming data on a node's socket again, once the
+     * data that wait_for_data reported has been read. */
+    void resume_watching(node_id_t node_id);
     derecho::LockedReference<std::unique_lock<std::mutex>, socket> get_socket(node_id_t node_id);
 };
 }
@@ -0,0 +1,91 @@
+/**
+ * @file delivery_executor.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <pthread.h>
+#include <queue>
+#include <thread>
+
+#include "thread_placement.h"
+
+namespace derecho {
+
+/**
+ * A thread that runs the delivery upcalls of one subgroup, in the order they
+ * were posted, so that the SST predicate thread that decides which messages
+ * are delivered only has to queue them. The upcalls must not refer to the
+ * buffers of the messages, which are reused as soon as they are queued.
+ */
+class DeliveryExecutor {
+    std::mutex queue_mutex;
+    /** Notified when an upcall is posted or the executor shuts down */
+    std::condition_variable work_cv;
+    /** Notified when the queue has emptied and no upcall is running */
+    std::condition_variable idle_cv;
+    std::queue<std::function<void()>> upcalls;
+    bool running = false;
+    bool shutdown = false;
+    std::thread thread;
+
+    void run() {
+        pthread_setname_np(pthread_self(), "delivery");
+        place_this_thread("delivery");
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        while(true) {
+            work_cv.wait(lock, [this]() { return shutdown || !upcalls.empty(); });
+            if(upcalls.empty()) {
+                return;
+            }
+            std::function<void()> upcall = std::move(upcalls.front());
+            upcalls.pop();
+            running = true;
+            lock.unlock();
+            upcall();
+            lock.lock();
+            running = false;
+            if(upcalls.empty()) {
+                idle_cv.notify_all();
+            }
+        }
+    }
+
+public:
+    DeliveryExecutor() : thread(&DeliveryExecutor::run, this) {}
+
+    /** Runs the upcalls that are still queued, then stops the thread. */
+    ~DeliveryExecutor() {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            shutdown = true;
+        }
+        work_cv.notify_all();
+        thread.join();
+    }
+
+    DeliveryExecutor(const DeliveryExecutor&) = delete;
+    DeliveryExecutor& operator=(const DeliveryExecutor&) = delete;
+
+    /** Queues an upcall to run after all the ones posted before it. */
+    void post(std::function<void()> upcall) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            upcalls.push(std::move(upcall));
+        }
+        work_cv.notify_one();
+    }
+
+    /** Waits until every upcall posted so far has finished running. */
+    void drain() {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        idle_cv.wait(lock, [this]() { return upcalls.empty() && !running; });
+    }
+};
+
+}  // namespace derecho
@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include "bytes_view.h"
 #include "derecho_exception.h"
 #include "derecho_ports.h"
 #include "group.h"
@@ -36,4 +36,12 @@ struct empty_reference_exception : public derecho_exception {
 struct invalid_subgroup_exception : public derecho_exception {
     invalid_subgroup_exception(const std::string& message) : derecho_exception(message) {}
 };
+
+/**
+ * Exception that means a linearizable read was asked of a node that doesn't
+ * hold its shard's read lease, so it has to be made with an ordered query.
+ */
+struct read_lease_exception : public derecho_exception {
+    read_lease_exception(const std::string& message) : derecho_exception(message) {}
+};
 }
@@ -3,6 +3,12 @@
 namespace derecho {
 enum class Mode {
     ORDERED,
-    RAW
+    RAW,
+    /** Each sender's messages are delivered in the order it sent them, as
+     * soon as every member of the shard has received them, without waiting
+     * for the other senders' turns in the round-robin order. Messages from
+     * different senders may be delivered in different orders at different
+     * members, so the subgroup's state can't be persisted or logged. */
+    FIFO
 };
 }
@@ -4,6 +4,52 @@
 
 namespace derecho {
 
+std::vector<sst::FieldLayout> DerechoSST::field_layout(const uint32_t num_members, const uint32_t num_subgroups,
+                                                       const uint32_t num_received_size, const uint32_t window_size) {
+    const int S = num_subgroups;
+    const int R = num_received_size;
+    const int ll = sizeof(long long int);
+    return {{"seq_num", S * ll},
+            {"stable_num", S * ll},
+            {"delivered_num", S * ll},
+            {"persisted_num", S * ll},
+            {"num_received", R * ll},
+            {"num_received_sst", R * ll},
+            {"fifo_delivered_num", R * ll},
+            {"skipped_index", R * ll},
+            {"subtree_min", 2 * S * ll},
+            {"shard_min", 2 * S * ll},
+            {"local_stability_frontier", S * (int)sizeof(uint64_t)},
+            {"heartbeat", sizeof(uint64_t)},
+            {"read_lease_request", S * (int)sizeof(uint64_t)},
+            {"read_lease_grant", S * (int)sizeof(uint64_t)},
+            {"vid", sizeof(int), true},
+            {"suspected", (int)num_members * (int)sizeof(bool)},
+            {"changes", (100 + (int)num_members) * (int)sizeof(node_id_t)},
+            {"joiner_ips", (100 + (int)num_members) * (int)sizeof(uint32_t)},
+            {"joiner_capacities", (100 + (int)num_members) * (int)sizeof(NodeCapacity)},
+            {"num_changes", sizeof(int)},
+            {"num_committed", sizeof(int)},
+            {"num_acked", sizeof(int)},
+            {"num_installed", sizeof(int)},
+            {"wedged", sizeof(bool)},
+            {"global_min", R * (int)sizeof(int)},
+            {"global_min_ready", S * (int)sizeof(bool)},
+            {"subgroup_wedged", S * (int)sizeof(bool)},
+            {"rdmc_group_wanted", R * (int)sizeof(int32_t)},
+            {"rdmc_group_target", R * (int)sizeof(int64_t)},
+            {"rdmc_group_round", sizeof(int32_t)},
+            {"rdmc_group_round_done", sizeof(int32_t)},
+            {"slots", (int)window_size * S * (int)sizeof(sst::Message), true},
+            {"barrier_steps", (int)(barrier_steps_per_scope(num_members) * (num_subgroups + 1) * sizeof(int64_t)), true},
+            {"collective_words", (int)(collective_words_per_subgroup * num_subgroups * sizeof(int64_t))},
+            {"lock_words", (int)(locks_per_subgroup * num_subgroups * sizeof(uint64_t))},
+            {"checkpoint_cut", sizeof(uint64_t)},
+            {"checkpoint_target", (int)max_checkpoint_target},
+            {"checkpoint_done", (int)num_members * (int)sizeof(uint64_t)},
+            {"checkpoint_ok", (int)num_members * (int)sizeof(bool)}};
+}
+
 void DerechoSST::init_local_row_from_previous(const DerechoSST& old_sst, const int row, const int num_changes_installed) {
     const int local_row = get_local_index();
     static thread_local std::mutex copy_mutex;
@@ -12,16 +58,22 @@ void DerechoSST::init_local_row_from_previous(const DerechoSST& old_sst, const i
     memcpy(const_cast<node_id_t*>(changes[local_row]),
            const_cast<const node_id_t*>(old_sst.changes[row] + num_changes_installed),
            (old_sst.changes.size() - num_changes_installed) * sizeof(node_id_t));
-    //Do the same thing with the joiner_ips arrays
+    //Do the same thing with the joiner_ips and joiner_capacities arrays
     memcpy(const_cast<uint32_t*>(joiner_ips[local_row]),
            const_cast<const uint32_t*>(old_sst.joiner_ips[row] + num_changes_installed),
            (old_sst.joiner_ips.size() - num_changes_installed) * sizeof(uint32_t));
+    memcpy(const_cast<NodeCapacity*>(joiner_capacities[local_row]),
+           const_cast<const NodeCapacity*>(old_sst.joiner_capacities[row] + num_changes_installed),
+           (old_sst.joiner_capacities.size() - num_changes_installed) * sizeof(NodeCapacity));
     for(size_t i = 0; i < suspected.size(); ++i) {
         suspected[local_row][i] = false;
     }
     for(size_t i = 0; i < global_min_ready.size(); ++i) {
         global_min_ready[local_row][i] = false;
     }
+    for(size_t i = 0; i < subgroup_wedged.size(); ++i) {
+        subgroup_wedged[local_row][i] = false;
+    }
     for(size_t i = 0; i < global_min.size(); ++i) {
         global_min[local_row][i] = 0;
     }
@@ -42,6 +94,9 @@ void DerechoSST::init_local_change_proposals(const int other_row) {
     memcpy(const_cast<node_id_t*>(joiner_ips[local_row]),
            const_cast<const node_id_t*>(joiner_ips[other_row]),
            joiner_ips.size() * sizeof(node_id_t));
+    memcpy(const_cast<NodeCapacity*>(joiner_capacities[local_row]),
+           const_cast<const NodeCapacity*>(joiner_capacities[other_row]),
+           joiner_capacities.size() * sizeof(NodeCapacity));
     num_changes[local_row] = num_changes[other_row];
     num_committed[local_row] = num_committed[other_row];
     num_acked[local_row] = num_acked[other_row];
@@ -7,6 +7,7 @@
 #include <sstream>
 #include <string>
 
+#include "node_capacity.h"
 #include "sst/multicast_msg.h"
 #include "sst/sst.h"
 
@@ -48,6 +49,14 @@ public:
      * at this node. Messages are only delievered once stable, so it must be
      * at least stable_num. */
     SSTFieldVector<long long int> delivered_num;
+    /** Only used with tree aggregation; two entries per subgroup: the least
+     * seq_num and the least stable_num in this node's subtree of its shard's
+     * aggregation tree. Written only to the node's parent. */
+    SSTFieldVector<long long int> subtree_min;
+    /** Only used with tree aggregation; two entries per subgroup: the least
+     * seq_num and the least stable_num in the whole shard, as computed by the
+     * root of the tree. Each node writes it only to its children. */
+    SSTFieldVector<long long int> shard_min;
     /** This represents the highest sequence number that has been persisted
      * to disk at this node, if persistence is enabled. Messages are only
      * persisted to disk once delivered to the application. */
@@ -71,6 +80,9 @@ public:
      *  representation is necessary because SST doesn't support variable-length
      *  strings. */
     SSTFieldVector<uint32_t> joiner_ips;
+    /** If changes[i] is a Join, joiner_capacities[i] is the capacity that the
+     *  joining node advertised. */
+    SSTFieldVector<NodeCapacity> joiner_capacities;
     /** How many changes to the view have been proposed. Monotonically increases.
      * num_changes - num_committed is the number of pending changes, which should never
      * exceed the number of members in the current view. If num_changes == num_committed
@@ -96,12 +108,98 @@ public:
     /** Array indicating whether each shard leader (indexed by subgroup number)
      * has published a global_min for the current view change*/
     SSTFieldVector<bool> global_min_ready;
+    /** Indexed by subgroup number; with DerechoParams::scoped_wedge, reports
+     * that this member has wedged that subgroup ahead of the rest of the view */
+    SSTFieldVector<bool> subgroup_wedged;
+    /** Only used with DerechoParams::lazy_rdmc_groups; indexed like
+     * num_received, and written only in the sender's own column. Counts the
+     * times the sender has changed its mind about its RDMC group: odd if it
+     * wants the group to exist, even if not. */
+    SSTFieldVector<int32_t> rdmc_group_wanted;
+    /** Only written in the leader's row: for each sender's column, the last
+     * rdmc_group_wanted that a round has acted on, in the low 32 bits, and
+     * that round in the high 32 bits, so that both are read together. */
+    SSTFieldVector<int64_t> rdmc_group_target;
+    /** Only written in the leader's row: the last round of RDMC group changes
+     * it has started */
+    SSTField<int32_t> rdmc_group_round;
+    /** The last round of RDMC group changes this member has carried out */
+    SSTField<int32_t> rdmc_group_round_done;
     /** for SST multicast */
     SSTFieldVector<sst::Message> slots;
     SSTFieldVector<long long int> num_received_sst;
+    /** Only used in subgroups in Mode::FIFO; indexed like num_received. For
+     * each sender k, the index of the latest message from k that has been
+     * delivered at this node. */
+    SSTFieldVector<long long int> fifo_delivered_num;
+    /** Only used with DerechoParams::skip_idle_senders; indexed like
+     * num_received, and written only in the sender's own column. The last
+     * index the sender has skipped the turns up to, without sending
+     * anything in them; the receivers count those turns as received null
+     * messages. */
+    SSTFieldVector<long long int> skipped_index;
 
-    /** to check for failures - used by the thread running check_failures_loop in derecho_group **/
+    /** to check for failures - used by check_failures in MulticastGroup **/
     SSTFieldVector<uint64_t> local_stability_frontier;
+    /** Incremented by the heartbeat thread every heartbeat interval, if
+     * heartbeats are enabled, so that a member that hangs can be suspected */
+    SSTField<uint64_t> heartbeat;
+    /** Only used with DerechoParams::read_lease_duration_us; written only by
+     * the leader of each shard, in its own row. The time, by the leader's
+     * steady clock in nanoseconds, at which it last asked the shard to renew
+     * its read lease. */
+    SSTFieldVector<uint64_t> read_lease_request;
+    /** The latest read_lease_request of the shard leader that this member
+     * has granted; the leader holds the lease for a while after the least
+     * of its members' grants */
+    SSTFieldVector<uint64_t> read_lease_grant;
+    /** The steps of the dissemination barriers, in blocks of
+     * barrier_steps_per_scope(): the first for barriers of the whole group,
+     * then one for each subgroup, whose barriers are among the members of a
+     * shard. Entry m of a block is the last barrier this member has reached
+     * in step m, and is only written to the one member it signals in that
+     * step. */
+    SSTFieldVector<int64_t> barrier_steps;
+    /** The words of the collectives, four for each subgroup, whose
+     * collectives are among the members of a shard: the word this member
+     * contributed to its last even round and to its last odd one, followed
+     * by the numbers of those rounds. A member can't get two rounds ahead of
+     * another, so a round's words stay until everyone has read them. */
+    SSTFieldVector<int64_t> collective_words;
+    /** The number of collective_words entries of each subgroup */
+    static constexpr uint32_t collective_words_per_subgroup = 4;
+    /** The words of the shard locks, locks_per_subgroup for each subgroup.
+     * Only the copies in the row of a shard's leader are used, and only with
+     * RDMA atomics (see ViewManager::try_lock): how many times the lock has
+     * been acquired in this view in the high 32 bits, and one more than its
+     * holder's node ID in the low ones, or 0 if it is free. The SST is new in
+     * every view, so every lock is free when a view starts. */
+    SSTFieldVector<uint64_t> lock_words;
+    /** The number of lock_words entries of each subgroup */
+    static constexpr uint32_t locks_per_subgroup = 4;
+    /** The cut, in microseconds of HLC time, of the latest coordinated
+     * checkpoint this member has asked for (see ViewManager::checkpoint), or
+     * 0, and the directory it is to be written to, NUL-terminated */
+    SSTField<uint64_t> checkpoint_cut;
+    SSTFieldVector<char> checkpoint_target;
+    /** The size of checkpoint_target */
+    static constexpr uint32_t max_checkpoint_target = 256;
+    /** Indexed by the row of the member that asked for a checkpoint: the cut
+     * of the latest of its checkpoints that this member has finished its
+     * part of, and whether that succeeded. Each entry is only written to
+     * that member. */
+    SSTFieldVector<uint64_t> checkpoint_done;
+    SSTFieldVector<bool> checkpoint_ok;
+
+    /** @return The number of steps a dissemination barrier among this many
+     * members takes, the ceiling of their log base 2 */
+    static uint32_t barrier_steps_per_scope(const uint32_t num_members) {
+        uint32_t steps = 0;
+        while((1ull << steps) < num_members) {
+            ++steps;
+        }
+        return steps;
+    }
     /**
      * Constructs an SST, and initializes the GMS fields to "safe" initial values
      * (0, false, etc.). Initializing the MulticastGroup fields is left to MulticastGroup.
@@ -113,21 +211,51 @@ public:
               seq_num(num_subgroups),
               stable_num(num_subgroups),
               delivered_num(num_subgroups),
+              subtree_min(2 * num_subgroups),
+              shard_min(2 * num_subgroups),
               persisted_num(num_subgroups),
               suspected(parameters.members.size()),
               changes(100 + parameters.members.size()),
               joiner_ips(100 + parameters.members.size()),
+              joiner_capacities(100 + parameters.members.size()),
               num_received(num_received_size),
               global_min(num_received_size),
               global_min_ready(num_subgroups),
+              subgroup_wedged(num_subgroups),
+              rdmc_group_wanted(num_received_size),
+              rdmc_group_target(num_received_size),
               slots(window_size * num_subgroups),
               num_received_sst(num_received_size),
-              local_stability_frontier(num_subgroups) {
-        SSTInit(seq_num, stable_num, delivered_num,
-                persisted_num, vid, suspected, changes, joiner_ips,
+              fifo_delivered_num(num_received_size),
+              skipped_index(num_received_size),
+              local_stability_frontier(num_subgroups),
+              read_lease_request(num_subgroups),
+              read_lease_grant(num_subgroups),
+              barrier_steps(barrier_steps_per_scope(parameters.members.size()) * (num_subgroups + 1)),
+              collective_words(collective_words_per_subgroup * num_subgroups),
+              lock_words(locks_per_subgroup * num_subgroups),
+              checkpoint_target(max_checkpoint_target),
+              checkpoint_done(parameters.members.size()),
+              checkpoint_ok(parameters.members.size()) {
+        // The counters that change with every message come first, packed
+        // together, then the membership state, which changes only in view
+        // changes, and then the SST multicast slots, each group starting on
+        // its own cache line, followed by the barrier steps, the words of the
+        // collectives, the lock words and the checkpoint requests. The membership
+        // fields are put in contiguous ranges from suspected to num_installed,
+        // so they must stay in order. field_layout() lists the same fields.
+        SSTInit(seq_num, stable_num, delivered_num, persisted_num,
+                num_received, num_received_sst, fifo_delivered_num, skipped_index,
+                subtree_min, shard_min, local_stability_frontier, heartbeat,
+                read_lease_request, read_lease_grant,
+                sst::cache_line_break,
+                vid, suspected, changes, joiner_ips, joiner_capacities,
                 num_changes, num_committed, num_acked, num_installed,
-                num_received, wedged, global_min, global_min_ready,
-                slots, num_received_sst, local_stability_frontier);
+                wedged, global_min, global_min_ready, subgroup_wedged,
+                rdmc_group_wanted, rdmc_group_target, rdmc_group_round, rdmc_group_round_done,
+                sst::cache_line_break,
+                slots, sst::cache_line_break, barrier_steps, collective_words, lock_words,
+                checkpoint_cut, checkpoint_target, checkpoint_done, checkpoint_ok);
         //Once superclass constructor has finished, table entries can be initialized
         for(int row = 0; row < get_num_rows(); ++row) {
             vid[row] = 0;
@@ -140,15 +268,42 @@ public:
             for(size_t i = 0; i < global_min_ready.size(); ++i) {
                 global_min_ready[row][i] = false;
             }
+            for(size_t i = 0; i < subgroup_wedged.size(); ++i) {
+                subgroup_wedged[row][i] = false;
+            }
             for(size_t i = 0; i < global_min.size(); ++i) {
                 global_min[row][i] = 0;
             }
             memset(const_cast<uint32_t*>(joiner_ips[row]), 0, joiner_ips.size());
+            memset(const_cast<NodeCapacity*>(joiner_capacities[row]), 0, joiner_capacities.size() * sizeof(NodeCapacity));
             num_changes[row] = 0;
             num_committed[row] = 0;
             num_installed[row] = 0;
             num_acked[row] = 0;
             wedged[row] = false;
+            heartbeat[row] = 0;
+            for(size_t i = 0; i < read_lease_request.size(); ++i) {
+                read_lease_request[row][i] = 0;
+                read_lease_grant[row][i] = 0;
+            }
+            for(size_t i = 0; i < rdmc_group_wanted.size(); ++i) {
+                rdmc_group_wanted[row][i] = 0;
+                rdmc_group_target[row][i] = 0;
+            }
+            rdmc_group_round[row] = 0;
+            rdmc_group_round_done[row] = 0;
+            for(size_t i = 0; i < barrier_steps.size(); ++i) {
+                barrier_steps[row][i] = 0;
+            }
+            for(size_t i = 0; i < collective_words.size(); ++i) {
+                collective_words[row][i] = 0;
+            }
+            checkpoint_cut[row] = 0;
+            memset(const_cast<char*>(checkpoint_target[row]), 0, checkpoint_target.size());
+            for(size_t i = 0; i < checkpoint_done.size(); ++i) {
+                checkpoint_done[row][i] = 0;
+                checkpoint_ok[row][i] = false;
+            }
             // start off local_stability_frontier with the current time
             struct timespec start_time;
             clock_gettime(CLOCK_REALTIME, &start_time);
@@ -159,6 +314,14 @@ public:
         }
     }
 
+    /**
+     * @return The fields of a DerechoSST with these sizes, in the order the
+     * constructor gives them to SSTInit, with their lengths; must be kept in
+     * step with it. Lets a layout be sized without creating the SST.
+     */
+    static std::vector<sst::FieldLayout> field_layout(const uint32_t num_members, const uint32_t num_subgroups,
+                                                      const uint32_t num_received_size, const uint32_t window_size);
+
     /**
      * Initializes the local row of this SST based on the specified row of the
      * previous View's SST. Copies num_changes, num_committed, and num_acked,
@@ -0,0 +1,411 @@
+/*
+ * A benchmark driver that runs the scenarios of a config file and writes their
+ * results as JSON and CSV, so that they can be compared across releases. Every
+ * node runs the driver with the same config file; each run of a scenario is a
+ * new group, made in a child process of its own, since a group can't be torn
+ * down and rebuilt within one process.
+ *
+ * The parameters of a scenario are
+ *   workload      bandwidth (send as fast as the window allows) or latency
+ *                 (wait for each message to be delivered before sending the next)
+ *   message_size  payload size in bytes, at least 8
+ *   window_size
+ *   block_size    in bytes, or auto to pick it from the message size
+ *   senders       all, half, or one
+ *   subgroups     the number of subgroups, each of which has every node in it
+ *   mode          ordered, raw, or fifo
+ *   num_messages  per sender and subgroup
+ *   poll_policy   how the SST predicate threads wait: busy, low_power, or default
+ *   repetitions   how many times each combination of parameters is run
+ */
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "benchmark_config.h"
+#include "block_size.h"
+#include "cpu_efficiency.h"
+#include "derecho/derecho.h"
+#include "rdmc/rdmc.h"
+#include "rdmc/util.h"
+#include "sst/sst.h"
+
+using std::cout;
+using std::endl;
+using std::map;
+using std::string;
+using std::vector;
+
+using namespace derecho;
+
+/** The results of one run; the same on every node, since each is averaged over the nodes */
+struct run_result {
+    double throughput_gbps;
+    double latency_mean_us;
+    double latency_p50_us;
+    double latency_p90_us;
+    double latency_p99_us;
+    double latency_p999_us;
+    /** The CPU time the process used per second of the run */
+    double cpu_cores;
+    /** The CPU time the process used per message it delivered */
+    double cpu_us_per_message;
+    double wall_time_s;
+};
+constexpr size_t num_result_fields = sizeof(run_result) / sizeof(double);
+
+class BenchmarkSST : public sst::SST<BenchmarkSST> {
+public:
+    sst::SSTFieldVector<double> results;
+    BenchmarkSST(const sst::SSTParams& params)
+            : SST<BenchmarkSST>(this, params), results(num_result_fields) {
+        SSTInit(results);
+    }
+};
+
+/** @return Each field of this node's result, averaged over every node */
+run_result average_over_nodes(const vector<uint32_t>& members, uint32_t node_id, const run_result& local) {
+    BenchmarkSST sst(sst::SSTParams(members, node_id));
+    const uint32_t my_row = sst.get_local_index();
+    for(size_t i = 0; i < num_result_fields; ++i) {
+        sst.results[my_row][i] = reinterpret_cast<const double*>(&local)[i];
+    }
+    sst.put();
+    sst.sync_with_members();
+    run_result average;
+    for(size_t i = 0; i < num_result_fields; ++i) {
+        double sum = 0;
+        for(uint32_t row = 0; row < members.size(); ++row) {
+            sum += sst.results[row][i];
+        }
+        reinterpret_cast<double*>(&average)[i] = sum / members.size();
+    }
+    return average;
+}
+
+double percentile(const vector<uint64_t>& sorted_values, double q) {
+    if(sorted_values.empty()) {
+        return 0;
+    }
+    size_t rank = std::min(sorted_values.size() - 1, (size_t)std::ceil(q * sorted_values.size()) - 1);
+    return sorted_values[rank];
+}
+
+const benchmark_point_t default_parameters = {
+        {"workload", "bandwidth"},
+        {"message_size", "10240"},
+        {"window_size", "16"},
+        {"block_size", "auto"},
+        {"senders", "all"},
+        {"subgroups", "1"},
+        {"mode", "ordered"},
+        {"num_messages", "1000"},
+        {"poll_policy", "default"},
+        {"repetitions", "1"}};
+
+/** Runs one combination of parameters as this node, and exits the process. */
+[[noreturn]] void run_point(const benchmark_point_t& point, uint32_t node_id,
+                            map<uint32_t, string>& node_addresses, int result_fd) {
+    const uint32_t server_rank = 0;
+    const uint32_t num_nodes = node_addresses.size();
+    vector<uint32_t> members(num_nodes);
+    for(uint32_t i = 0; i < num_nodes; ++i) {
+        members[i] = i;
+    }
+    const bool latency_workload = point.at("workload") == "latency";
+    const long long unsigned int message_size = std::stoull(point.at("message_size"));
+    if(message_size < sizeof(uint64_t)) {
+        throw std::invalid_argument("message_size must be at least 8 bytes, for the send timestamp");
+    }
+    const long long unsigned int block_size = point.at("block_size") == "auto"
+                                                      ? get_block_size(message_size)
+                                                      : std::stoull(point.at("block_size"));
+    const unsigned int window_size = std::stoul(point.at("window_size"));
+    const uint32_t num_subgroups = std::stoul(point.at("subgroups"));
+    const uint64_t num_messages = std::stoull(point.at("num_messages"));
+    const string senders = point.at("senders");
+    Mode mode = Mode::ORDERED;
+    if(point.at("mode") == "raw") {
+        mode = Mode::RAW;
+    } else if(point.at("mode") == "fifo") {
+        mode = Mode::FIFO;
+    }
+    // The nodes of rank at least first_sender_rank send, as in derecho_bw_test
+    uint32_t first_sender_rank = 0;
+    if(senders == "half") {
+        first_sender_rank = (num_nodes - 1) / 2 + 1;
+    } else if(senders == "one") {
+        first_sender_rank = num_nodes - 1;
+    }
+    const uint64_t num_senders = num_nodes - first_sender_rank;
+
+    // Upcalls all come from the one SST predicate thread
+    std::atomic<uint64_t> num_delivered{0};
+    std::atomic<uint64_t> num_own_delivered{0};
+    vector<uint64_t> latencies;
+    latencies.reserve(num_subgroups * num_messages);
+    auto stability_callback = [&](uint32_t subgroup, int sender_id, long long int index, char* buf,
+                                  long long int msg_size) {
+        if((uint32_t)sender_id == node_id) {
+            latencies.push_back(get_time() - *(uint64_t*)buf);
+            num_own_delivered++;
+        }
+        num_delivered++;
+    };
+
+    auto membership_function = [num_nodes, num_subgroups, mode, first_sender_rank](
+            const View& curr_view, int& next_unassigned_rank, bool previous_was_successful) {
+        const auto num_members = curr_view.members.size();
+        if(num_members < num_nodes) {
+            throw derecho::subgroup_provisioning_exception();
+        }
+        std::vector<int> is_sender(num_members, 1);
+        for(uint i = 0; i < first_sender_rank; ++i) {
+            is_sender[i] = 0;
+        }
+        subgroup_shard_layout_t subgroup_vector(num_subgroups);
+        for(uint32_t i = 0; i < num_subgroups; ++i) {
+            subgroup_vector[i].emplace_back(curr_view.make_subview(curr_view.members, mode, is_sender));
+        }
+        next_unassigned_rank = curr_view.members.size();
+        return subgroup_vector;
+    };
+    std::map<std::type_index, shard_view_generator_t> subgroup_map = {{std::type_index(typeid(RawObject)), membership_function}};
+    derecho::SubgroupInfo raw_subgroups(subgroup_map);
+
+    derecho::DerechoParams derecho_params{message_size, block_size, std::string(), window_size};
+    derecho_params.sst_poll_mode = parse_poll_mode(point.at("poll_policy"));
+
+    std::unique_ptr<derecho::Group<>> managed_group;
+    if(node_id == server_rank) {
+        managed_group = std::make_unique<derecho::Group<>>(
+                node_id, node_addresses[node_id],
+                derecho::CallbackSet{stability_callback, nullptr},
+                raw_subgroups,
+                derecho_params);
+    } else {
+        // Give the leader's previous run time to exit and its new one time to listen
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        managed_group = std::make_unique<derecho::Group<>>(
+                node_id, node_addresses[node_id],
+                node_addresses[server_rank],
+                derecho::CallbackSet{stability_callback, nullptr},
+                raw_subgroups);
+    }
+    while(managed_group->get_members().size() < num_nodes) {
+    }
+    auto members_order = managed_group->get_members();
+    const uint32_t node_rank = std::find(members_order.begin(), members_order.end(), node_id) - members_order.begin();
+    const bool is_sender = node_rank >= first_sender_rank;
+
+    vector<RawSubgroup*> subgroups;
+    for(uint32_t i = 0; i < num_subgroups; ++i) {
+        subgroups.push_back(&managed_group->get_subgroup<RawObject>(i));
+    }
+    managed_group->barrier_sync();
+
+    const uint64_t start_time = get_time();
+    const uint64_t start_process_time = get_process_time();
+    if(is_sender) {
+        for(uint64_t i = 0; i < num_messages; ++i) {
+            for(uint32_t j = 0; j < num_subgroups; ++j) {
+                char* buf = subgroups[j]->get_sendbuffer_ptr(message_size);
+                while(!buf) {
+                    buf = subgroups[j]->get_sendbuffer_ptr(message_size);
+                }
+                *(uint64_t*)buf = get_time();
+                subgroups[j]->send();
+                if(latency_workload) {
+                    const uint64_t num_sent = i * num_subgroups + j + 1;
+                    while(num_own_delivered < num_sent) {
+                    }
+                }
+            }
+        }
+    }
+    const uint64_t num_expected = num_subgroups * num_senders * num_messages;
+    while(num_delivered < num_expected) {
+    }
+    const uint64_t elapsed = get_time() - start_time;
+    const uint64_t process_time = get_process_time() - start_process_time;
+
+    std::sort(latencies.begin(), latencies.end());
+    run_result local;
+    local.throughput_gbps = (double)(message_size * num_expected) / elapsed;
+    local.latency_mean_us = latencies.empty() ? 0 : std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size() / 1e3;
+    local.latency_p50_us = percentile(latencies, 0.5) / 1e3;
+    local.latency_p90_us = percentile(latencies, 0.9) / 1e3;
+    local.latency_p99_us = percentile(latencies, 0.99) / 1e3;
+    local.latency_p999_us = percentile(latencies, 0.999) / 1e3;
+    local.cpu_cores = (double)process_time / elapsed;
+    local.cpu_us_per_message = (double)process_time / num_expected / 1e3;
+    local.wall_time_s = elapsed / 1e9;
+    // Nodes that don't send have no latencies, so only the senders' are averaged
+    run_result average = average_over_nodes(members, node_id, local);
+    run_result senders_only = average_over_nodes(members, node_id, is_sender ? local : run_result{});
+    average.latency_mean_us = senders_only.latency_mean_us * num_nodes / num_senders;
+    average.latency_p50_us = senders_only.latency_p50_us * num_nodes / num_senders;
+    average.latency_p90_us = senders_only.latency_p90_us * num_nodes / num_senders;
+    average.latency_p99_us = senders_only.latency_p99_us * num_nodes / num_senders;
+    average.latency_p999_us = senders_only.latency_p999_us * num_nodes / num_senders;
+    if(write(result_fd, &average, sizeof(average)) != sizeof(average)) {
+        perror("Writing the result");
+    }
+
+    managed_group->barrier_sync();
+    // Like the other experiments, exit rather than tearing the group down
+    exit(0);
+}
+
+const vector<string> parameter_columns = {"workload", "message_size", "window_size", "block_size",
+                                          "senders", "subgroups", "mode", "num_messages", "poll_policy"};
+const vector<string> result_columns = {"throughput_gbps", "latency_mean_us", "latency_p50_us", "latency_p90_us",
+                                       "latency_p99_us", "latency_p999_us", "cpu_cores", "cpu_us_per_message",
+                                       "wall_time_s"};
+
+struct run_record {
+    string scenario;
+    benchmark_point_t point;
+    uint32_t repetition;
+    bool succeeded;
+    run_result result;
+};
+
+void write_csv(std::ostream& out, uint32_t num_nodes, const vector<run_record>& records) {
+    out << "scenario,repetition,num_nodes";
+    for(const auto& column : parameter_columns) {
+        out << "," << column;
+    }
+    for(const auto& column : result_columns) {
+        out << "," << column;
+    }
+    out << ",succeeded\n";
+    for(const auto& record : records) {
+        out << record.scenario << "," << record.repetition << "," << num_nodes;
+        for(const auto& column : parameter_columns) {
+            out << "," << record.point.at(column);
+        }
+        for(size_t i = 0; i < num_result_fields; ++i) {
+            out << "," << reinterpret_cast<const double*>(&record.result)[i];
+        }
+        out << "," << record.succeeded << "\n";
+    }
+}
+
+void write_json(std::ostream& out, uint32_t num_nodes, const vector<run_record>& records) {
+    out << "[";
+    for(size_t r = 0; r < records.size(); ++r) {
+        const auto& record = records[r];
+        out << (r == 0 ? "" : ",") << "\n  {\"scenario\": \"" << record.scenario
+            << "\", \"repetition\": " << record.repetition << ", \"num_nodes\": " << num_nodes;
+        for(const auto& column : parameter_columns) {
+            out << ", \"" << column << "\": \"" << record.point.at(column) << "\"";
+        }
+        out << ", \"succeeded\": " << (record.succeeded ? "true" : "false");
+        for(size_t i = 0; i < num_result_fields; ++i) {
+            out << ", \"" << result_columns[i] << "\": " << reinterpret_cast<const double*>(&record.result)[i];
+        }
+        out << "}";
+    }
+    out << "\n]\n";
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 2) {
+        cout << "Usage: " << argv[0] << " <config file> [--scenario name]... [--json file] [--csv file]" << endl;
+        return 1;
+    }
+    pthread_setname_np(pthread_self(), "benchmark");
+    string json_file = "benchmark_results.json";
+    string csv_file = "benchmark_results.csv";
+    std::set<string> selected_scenarios;
+    for(int i = 2; i + 1 < argc; i += 2) {
+        const string option = argv[i];
+        if(option == "--scenario") {
+            selected_scenarios.insert(argv[i + 1]);
+        } else if(option == "--json") {
+            json_file = argv[i + 1];
+        } else if(option == "--csv") {
+            csv_file = argv[i + 1];
+        } else {
+            cout << "Unknown option " << option << endl;
+            return 1;
+        }
+    }
+    vector<BenchmarkScenario> scenarios;
+    try {
+        scenarios = read_benchmark_config(argv[1]);
+    } catch(const std::exception& e) {
+        cout << e.what() << endl;
+        return 1;
+    }
+    for(const auto& scenario : scenarios) {
+        for(const auto& parameter : scenario.parameters) {
+            if(default_parameters.find(parameter.first) == default_parameters.end()) {
+                cout << "Scenario " << scenario.name << " has an unknown parameter " << parameter.first << endl;
+                return 1;
+            }
+        }
+    }
+
+    uint32_t node_id;
+    map<uint32_t, string> node_addresses;
+    rdmc::query_addresses(node_addresses, node_id);
+    const uint32_t num_nodes = node_addresses.size();
+
+    vector<run_record> records;
+    for(const auto& scenario : scenarios) {
+        if(!selected_scenarios.empty() && selected_scenarios.count(scenario.name) == 0) {
+            continue;
+        }
+        for(const auto& point : scenario.expand(default_parameters)) {
+            const uint32_t repetitions = std::stoul(point.at("repetitions"));
+            for(uint32_t repetition = 0; repetition < repetitions; ++repetition) {
+                cout << "Running " << scenario.name << ", repetition " << repetition << endl;
+                int result_pipe[2];
+                if(pipe(result_pipe) != 0) {
+                    perror("pipe");
+                    return 1;
+                }
+                const pid_t child = fork();
+                if(child == 0) {
+                    close(result_pipe[0]);
+                    try {
+                        run_point(point, node_id, node_addresses, result_pipe[1]);
+                    } catch(const std::exception& e) {
+                        cout << "Exception in run: " << e.what() << endl;
+                        exit(1);
+                    }
+                }
+                close(result_pipe[1]);
+                run_record record{scenario.name, point, repetition, false, run_result{}};
+                record.succeeded = read(result_pipe[0], &record.result, sizeof(record.result)) == sizeof(record.result);
+                close(result_pipe[0]);
+                int status;
+                waitpid(child, &status, 0);
+                record.succeeded = record.succeeded && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+                records.push_back(record);
+            }
+        }
+    }
+
+    // Every node has the same results, so only the leader writes them
+    if(node_id == 0) {
+        std::ofstream json(json_file);
+        write_json(json, num_nodes, records);
+        std::ofstream csv(csv_file);
+        write_csv(csv, num_nodes, records);
+        cout << "Wrote " << records.size() << " results to " << json_file << " and " << csv_file << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "benchmark_config.h"
+
+namespace {
+std::string trim(const std::string& str) {
+    const auto first = str.find_first_not_of(" \t\r");
+    if(first == std::string::npos) {
+        return std::string();
+    }
+    const auto last = str.find_last_not_of(" \t\r");
+    return str.substr(first, last - first + 1);
+}
+}  // namespace
+
+std::vector<benchmark_point_t> BenchmarkScenario::expand(const benchmark_point_t& defaults) const {
+    std::vector<benchmark_point_t> points{defaults};
+    for(const auto& parameter : parameters) {
+        std::vector<benchmark_point_t> expanded;
+        for(const auto& point : points) {
+            for(const auto& value : parameter.second) {
+                expanded.push_back(point);
+                expanded.back()[parameter.first] = value;
+            }
+        }
+        points.swap(expanded);
+    }
+    return points;
+}
+
+std::vector<BenchmarkScenario> read_benchmark_config(const std::string& filename) {
+    std::ifstream config(filename);
+    if(!config) {
+        throw std::runtime_error("Can't read benchmark config " + filename);
+    }
+    std::vector<BenchmarkScenario> scenarios;
+    std::string line;
+    for(int line_number = 1; std::getline(config, line); ++line_number) {
+        line = trim(line.substr(0, line.find('#')));
+        if(line.empty()) {
+            continue;
+        }
+        const std::string location = filename + ":" + std::to_string(line_number);
+        if(line.front() == '[') {
+            if(line.back() != ']' || line.size() < 3) {
+                throw std::runtime_error(location + ": bad scenario name " + line);
+            }
+            scenarios.emplace_back();
+            scenarios.back().name = trim(line.substr(1, line.size() - 2));
+            continue;
+        }
+        const auto equals = line.find('=');
+        if(equals == std::string::npos) {
+            throw std::runtime_error(location + ": expected parameter = values");
+        }
+        if(scenarios.empty()) {
+            throw std::runtime_error(location + ": parameter outside of a scenario");
+        }
+        std::vector<std::string> values;
+        std::istringstream value_list(line.substr(equals + 1));
+        std::string value;
+        while(std::getline(value_list, value, ',')) {
+            values.push_back(trim(value));
+            if(values.back().empty()) {
+                throw std::runtime_error(location + ": empty value");
+            }
+        }
+        if(values.empty()) {
+            throw std::runtime_error(location + ": no values");
+        }
+        scenarios.back().parameters.emplace_back(trim(line.substr(0, equals)), values);
+    }
+    return scenarios;
+}
@@ -0,0 +1,38 @@
+#ifndef BENCHMARK_CONFIG_H
+#define BENCHMARK_CONFIG_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** The parameters of one run of a benchmark scenario, by name */
+using benchmark_point_t = std::map<std::string, std::string>;
+
+/**
+ * A named benchmark scenario. Each parameter has a list of values, and the
+ * scenario is run once for every combination of them.
+ */
+struct BenchmarkScenario {
+    std::string name;
+    /** In the order they appear in the config file, which is the order the
+     * sweep nests them in, with the last one varying fastest */
+    std::vector<std::pair<std::string, std::vector<std::string>>> parameters;
+
+    /**
+     * @param defaults The values of the parameters the scenario doesn't set
+     * @return Every combination of the scenario's parameter values
+     */
+    std::vector<benchmark_point_t> expand(const benchmark_point_t& defaults) const;
+};
+
+/**
+ * Reads benchmark scenarios from a config file. Each scenario starts with its
+ * name in brackets, on a line of its own, and is followed by lines of the form
+ * "parameter = value, value, ...". Blank lines and everything after a '#' are
+ * ignored.
+ * @throws std::runtime_error if the file can't be read or a line can't be parsed
+ */
+std::vector<BenchmarkScenario> read_benchmark_config(const std::string& filename);
+
+#endif /* BENCHMARK_CONFIG_H */
@@ -0,0 +1,127 @@
+#ifndef CPU_EFFICIENCY_H
+#define CPU_EFFICIENCY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#include "sst/sst.h"
+#include "time/time.h"
+
+/**
+ * @return The CPU time, in nanoseconds, that each live thread of this process
+ * has used, summed over the threads that share a name. Read from /proc, since
+ * getrusage can only report on the calling thread; the kernel counts in clock
+ * ticks, so runs should last long enough for that not to matter.
+ */
+inline std::map<std::string, uint64_t> get_thread_times() {
+    std::map<std::string, uint64_t> thread_times;
+    const uint64_t ns_per_tick = 1000000000ull / sysconf(_SC_CLK_TCK);
+    DIR* tasks = opendir("/proc/self/task");
+    if(!tasks) {
+        return thread_times;
+    }
+    while(dirent* task = readdir(tasks)) {
+        if(task->d_name[0] == '.') {
+            continue;
+        }
+        std::ifstream stat_file(std::string("/proc/self/task/") + task->d_name + "/stat");
+        std::string stat;
+        if(!std::getline(stat_file, stat)) {
+            continue;
+        }
+        // The name is in parentheses and can contain spaces
+        const auto name_start = stat.find('(');
+        const auto name_end = stat.rfind(')');
+        if(name_start == std::string::npos || name_end == std::string::npos) {
+            continue;
+        }
+        std::istringstream fields(stat.substr(name_end + 2));
+        std::string skipped;
+        // utime and stime are the 12th and 13th fields after the name
+        for(int i = 0; i < 11; ++i) {
+            fields >> skipped;
+        }
+        uint64_t utime = 0, stime = 0;
+        fields >> utime >> stime;
+        thread_times[stat.substr(name_start + 1, name_end - name_start - 1)] += (utime + stime) * ns_per_tick;
+    }
+    closedir(tasks);
+    return thread_times;
+}
+
+/**
+ * Measures the CPU cost of delivering messages: the microseconds of CPU time
+ * this process, and each of its threads by name, used per delivered message
+ * between start() and stop(). Polling threads make throughput look good
+ * while they burn whole cores, so configurations should be compared on this
+ * as well as on their peak rates.
+ */
+class CpuEfficiency {
+    uint64_t start_time = 0;
+    uint64_t start_process_time = 0;
+    std::map<std::string, uint64_t> start_thread_times;
+
+public:
+    uint64_t wall_time = 0;
+    uint64_t process_time = 0;
+    std::map<std::string, uint64_t> thread_times;
+
+    void start() {
+        start_thread_times = get_thread_times();
+        start_process_time = get_process_time();
+        start_time = get_time();
+    }
+
+    void stop() {
+        wall_time = get_time() - start_time;
+        process_time = get_process_time() - start_process_time;
+        thread_times = get_thread_times();
+        for(auto& thread : thread_times) {
+            auto start = start_thread_times.find(thread.first);
+            if(start != start_thread_times.end()) {
+                thread.second -= std::min(thread.second, start->second);
+            }
+        }
+    }
+
+    /** @return The number of cores the process kept busy on average */
+    double cores() const {
+        return wall_time == 0 ? 0.0 : double(process_time) / wall_time;
+    }
+
+    /**
+     * Appends one line per thread name, then one for the whole process, of
+     * the form "label thread_name us_per_message cores".
+     */
+    void log(const std::string& label, uint64_t num_delivered, const std::string& filename) const {
+        std::ofstream fout(filename, std::ofstream::app);
+        const double messages = num_delivered == 0 ? 1.0 : double(num_delivered);
+        for(const auto& thread : thread_times) {
+            fout << label << " " << thread.first << " " << thread.second / 1000.0 / messages
+                 << " " << (wall_time == 0 ? 0.0 : double(thread.second) / wall_time) << std::endl;
+        }
+        fout << label << " process " << process_time / 1000.0 / messages << " " << cores() << std::endl;
+    }
+};
+
+/**
+ * Parses the polling policy argument of the experiments: "busy" polls all
+ * the time and "low_power" sleeps on a futex once idle; anything else is the
+ * default of sleeping for a fixed time once idle.
+ */
+inline sst::PollMode parse_poll_mode(const std::string& policy) {
+    if(policy == "busy") {
+        return sst::PollMode::BUSY_POLL;
+    } else if(policy == "low_power") {
+        return sst::PollMode::SPIN_THEN_FUTEX;
+    }
+    return sst::PollMode::SPIN_THEN_SLEEP;
+}
+
+#endif /* CPU_EFFICIENCY_H */
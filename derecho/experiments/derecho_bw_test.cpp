@@ -1,3 +1,4 @@
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <map>
@@ -8,6 +9,7 @@
 #include "aggregate_bandwidth.h"
 #include "block_size.h"
 #include "block_size.h"
+#include "cpu_efficiency.h"
 #include "derecho/derecho.h"
 #include "log_results.h"
 #include "rdmc/rdmc.h"
@@ -41,7 +43,8 @@ int main(int argc, char *argv[]) {
     try {
         if(argc < 7) {
             cout << "Insufficient number of command line arguments" << endl;
-            cout << "Enter max_msg_size, num_senders_selector, window_size, num_messages, raw_mode" << endl;
+            cout << "Enter max_msg_size, num_senders_selector, window_size, num_messages, raw_mode, poll_policy" << endl;
+            cout << "where poll_policy is busy, low_power or default" << endl;
             cout << "Thank you" << endl;
             exit(1);
         }
@@ -68,15 +71,19 @@ int main(int argc, char *argv[]) {
         const unsigned int window_size = atoi(argv[3]);
         const int num_messages = atoi(argv[4]);
         const int raw_mode = atoi(argv[5]);
+        const std::string poll_policy = argv[6];
 
         volatile bool done = false;
+        std::atomic<uint64_t> num_delivered{0};
         auto stability_callback = [
             &num_messages,
             &done,
             &num_nodes,
+            &num_delivered,
             num_senders_selector,
             num_last_received = 0u
         ](uint32_t subgroup, int sender_id, long long int index, char *buf, long long int msg_size) mutable {
+            num_delivered.fetch_add(1, std::memory_order_relaxed);
             // cout << "In stability callback; sender = " << sender_id
             // << ", index = " << index << endl;
             if(num_senders_selector == 0) {
@@ -130,13 +137,16 @@ int main(int argc, char *argv[]) {
         std::map<std::type_index, shard_view_generator_t> subgroup_map = {{std::type_index(typeid(RawObject)), membership_function}};
         derecho::SubgroupInfo one_raw_group(subgroup_map);
 
+        derecho::DerechoParams derecho_params{max_msg_size, block_size, std::string(), window_size};
+        derecho_params.sst_poll_mode = parse_poll_mode(poll_policy);
+
         std::unique_ptr<derecho::Group<>> managed_group;
         if(node_id == server_rank) {
             managed_group = std::make_unique<derecho::Group<>>(
                     node_id, node_addresses[node_id],
                     derecho::CallbackSet{stability_callback, nullptr},
                     one_raw_group,
-                    derecho::DerechoParams{max_msg_size, block_size, std::string(), window_size});
+                    derecho_params);
         } else {
             managed_group = std::make_unique<derecho::Group<>>(
                     node_id, node_addresses[node_id],
@@ -174,9 +184,12 @@ int main(int argc, char *argv[]) {
             }
         };
 
+        CpuEfficiency cpu_efficiency;
+        const uint64_t start_delivered = num_delivered;
         struct timespec start_time;
         // start timer
         clock_gettime(CLOCK_REALTIME, &start_time);
+        cpu_efficiency.start();
         if(num_senders_selector == 0) {
             send_all();
         } else if(num_senders_selector == 1) {
@@ -192,6 +205,7 @@ int main(int argc, char *argv[]) {
         }
         struct timespec end_time;
         clock_gettime(CLOCK_REALTIME, &end_time);
+        cpu_efficiency.stop();
         long long int nanoseconds_elapsed = (end_time.tv_sec - start_time.tv_sec) * (long long int)1e9 + (end_time.tv_nsec - start_time.tv_nsec);
         double bw;
         if(num_senders_selector == 0) {
@@ -208,6 +222,11 @@ int main(int argc, char *argv[]) {
                                    raw_mode, avg_bw},
                         "data_derecho_bw");
         }
+        // Every node logs its own cost, since the receivers pay too
+        cpu_efficiency.log(std::to_string(num_nodes) + " " + std::to_string(num_senders_selector) + " "
+                                   + std::to_string(max_msg_size) + " " + std::to_string(window_size) + " "
+                                   + std::to_string(raw_mode) + " " + poll_policy,
+                           num_delivered - start_delivered, "data_derecho_bw_cpu");
 
         managed_group->barrier_sync();
         // managed_group->leave();
@@ -130,6 +130,17 @@ int main(int argc, char* argv[]) {
     derecho::Replicated<test1_str>& rpc_handle = managed_group->get_subgroup<test1_str>(0);
     output_result<int>(rpc_handle.ordered_query<RPC_NAME(read_state)>({}).get());
 
+    // the same query in callback mode, which prints each reply as it arrives
+    cout << "Reading everyone's state with a callback" << endl;
+    rpc_handle.ordered_query_with_callback<RPC_NAME(read_state)>(
+            {}, [](const derecho::node_id_t& nid, const int* state) {
+                if(state) {
+                    cout << "Reply from node " << nid << ": " << *state << endl;
+                } else {
+                    cout << "Reply from node " << nid << " is an exception" << endl;
+                }
+            });
+
     cout << "Done" << endl;
     cout << "Reached here" << endl;
     // wait forever
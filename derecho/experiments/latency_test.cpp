@@ -1,3 +1,4 @@
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <cstdlib>
@@ -14,6 +15,7 @@ using namespace std;
 #include "rdmc/util.h"
 
 #include "block_size.h"
+#include "cpu_efficiency.h"
 #include "derecho/derecho.h"
 #include "log_results.h"
 
@@ -49,7 +51,8 @@ int main(int argc, char *argv[]) {
     try {
         if(argc < 6) {
             cout << "Insufficient number of command line arguments" << endl;
-            cout << "Enter num_nodes, msg_size, window_size, send_medium, raw_mode" << endl;
+            cout << "Enter num_nodes, msg_size, window_size, send_medium, raw_mode, [poll_policy], [inline_sends]" << endl;
+            cout << "where poll_policy is busy, low_power or default, and inline_sends is 0 or 1" << endl;
             cout << "Thank you" << endl;
             exit(1);
         }
@@ -67,15 +70,19 @@ int main(int argc, char *argv[]) {
         const unsigned int window_size = atoi(argv[3]);
         const int send_medium = atoi(argv[4]);
         const int raw_mode = atoi(argv[5]);
+        const std::string poll_policy = argc > 6 ? argv[6] : "default";
+        const bool inline_sends = argc > 7 && atoi(argv[7]);
 
         int num_messages = 1000;
 	// only used by node 0
         vector<uint64_t> start_times(num_messages), end_times(num_messages);
 
         volatile bool done = false;
-        auto stability_callback = [&num_messages, &done, &num_nodes, &end_times](
+        std::atomic<uint64_t> num_delivered{0};
+        auto stability_callback = [&num_messages, &done, &num_nodes, &end_times, &num_delivered](
                 int32_t subgroup, int sender_id, long long int index, char *buf,
                 long long int msg_size) mutable {
+            num_delivered.fetch_add(1, std::memory_order_relaxed);
             // cout << buf << endl;
             // cout << "Delivered a message" << endl;
             // DERECHO_LOG(sender_id, index, "complete_send");
@@ -99,6 +106,8 @@ int main(int argc, char *argv[]) {
 
         derecho::CallbackSet callbacks{stability_callback, nullptr};
         derecho::DerechoParams param_object{max_msg_size, block_size, std::string(), window_size};
+        param_object.sst_poll_mode = parse_poll_mode(poll_policy);
+        param_object.inline_sends = inline_sends;
         std::unique_ptr<derecho::Group<>> managed_group;
 
         if(node_id == leader_id) {
@@ -106,7 +115,7 @@ int main(int argc, char *argv[]) {
                     node_id, my_ip,
                     callbacks,
                     *one_raw_group,
-                    derecho::DerechoParams{max_msg_size, block_size, std::string(), window_size});
+                    param_object);
         } else {
             managed_group = std::make_unique<derecho::Group<>>(
                     node_id, my_ip,
@@ -147,6 +156,9 @@ int main(int argc, char *argv[]) {
         }
 
         derecho::RawSubgroup &group_as_subgroup = managed_group->get_subgroup<derecho::RawObject>();
+        CpuEfficiency cpu_efficiency;
+        const uint64_t start_delivered = num_delivered;
+        cpu_efficiency.start();
         for(int i = 0; i < num_messages; ++i) {
             char *buf = group_as_subgroup.get_sendbuffer_ptr(msg_size, send_medium);
             while(!buf) {
@@ -166,6 +178,11 @@ int main(int argc, char *argv[]) {
         }
         while(!done) {
         }
+        cpu_efficiency.stop();
+        cpu_efficiency.log(std::to_string(num_nodes) + " " + std::to_string(max_msg_size) + " "
+                                   + std::to_string(window_size) + " " + std::to_string(send_medium) + " "
+                                   + std::to_string(raw_mode) + " " + poll_policy,
+                           num_delivered - start_delivered, "data_latency_cpu");
 
         uint64_t total_time = 0;
         for(int i = 0; i < num_messages; ++i) {
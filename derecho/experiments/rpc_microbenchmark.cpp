@@ -0,0 +1,201 @@
+/*
+ * Microbenchmarks of the marshaling and dispatch that every RPC goes through,
+ * run in a loop without any networking: mutils serialization of typical
+ * argument types, building an invocation and its header in RemoteInvoker,
+ * looking up the receive function of an opcode, and RemoteInvocable's
+ * receive_call, which deserializes the arguments, calls the function and
+ * serializes its reply. Each result is in nanoseconds per operation.
+ *
+ * Usage: rpc_microbenchmark [iterations]
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <string>
+#include <typeindex>
+#include <vector>
+
+#include "derecho/remote_invocable.h"
+#include "derecho/rpc_utils.h"
+#include <mutils-serialization/SerializationSupport.hpp>
+
+using namespace derecho;
+using namespace derecho::rpc::remote_invocation_utilities;
+
+/** Keeps the compiler from dropping the results of the loops */
+volatile std::size_t sink;
+
+/** @return The time one call of op took, averaged over iterations calls after a warm-up */
+template <typename Op>
+double ns_per_op(uint64_t iterations, const Op& op) {
+    for(uint64_t i = 0; i < iterations / 10 + 1; ++i) {
+        op();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    for(uint64_t i = 0; i < iterations; ++i) {
+        op();
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+void print_result(const std::string& operation, const std::string& type, std::size_t size, double ns) {
+    printf("%-26s %-22s %8zu bytes %10.1f ns/op\n", operation.c_str(), type.c_str(), size, ns);
+}
+
+struct Point {
+    int64_t x;
+    int64_t y;
+    int64_t z;
+};
+
+class Item : public mutils::ByteRepresentable {
+public:
+    std::string key;
+    std::vector<int64_t> values;
+
+    Item(const std::string& key, const std::vector<int64_t>& values) : key(key), values(values) {}
+    DEFAULT_SERIALIZATION_SUPPORT(Item, key, values);
+};
+
+/** A ByteRepresentable that has other ByteRepresentables in it */
+class Batch : public mutils::ByteRepresentable {
+public:
+    std::string name;
+    std::vector<Item> items;
+
+    Batch(const std::string& name, const std::vector<Item>& items) : name(name), items(items) {}
+    DEFAULT_SERIALIZATION_SUPPORT(Batch, name, items);
+};
+
+/** The class the benchmarked RPC functions nominally belong to */
+struct BenchmarkClass {};
+
+template <typename T>
+void bench_serialization(uint64_t iterations, const std::string& type, const T& value) {
+    std::vector<char> buffer(mutils::bytes_size(value));
+    print_result("to_bytes", type, buffer.size(), ns_per_op(iterations, [&]() {
+                     sink = mutils::to_bytes(value, buffer.data());
+                 }));
+    mutils::DeserializationManager dsm{{}};
+    print_result("from_bytes", type, buffer.size(), ns_per_op(iterations, [&]() {
+                     sink = mutils::bytes_size(*mutils::from_bytes<T>(&dsm, buffer.data()));
+                 }));
+    print_result("from_bytes_noalloc", type, buffer.size(), ns_per_op(iterations, [&]() {
+                     sink = mutils::bytes_size(*mutils::from_bytes_noalloc<T>(&dsm, buffer.data()));
+                 }));
+}
+
+constexpr rpc::FunctionTag benchmark_tag = 1;
+
+/**
+ * Benchmarks the sending and receiving sides of an RPC function. The receive
+ * functions are looked up among those of several subgroups and functions,
+ * like in a group with a few replicated objects.
+ */
+template <typename Ret, typename... Args>
+void bench_rpc(uint64_t iterations, const std::string& type, std::function<Ret(Args...)> function,
+               const std::decay_t<Args>&... args) {
+    using function_type = std::function<Ret(Args...)>;
+    std::map<rpc::Opcode, rpc::receive_fun_t> receivers;
+    const std::type_index class_id(typeid(BenchmarkClass));
+    rpc::RemoteInvoker<benchmark_tag, function_type> invoker(class_id, 0, receivers);
+    rpc::RemoteInvocable<benchmark_tag, function_type> invocable(class_id, 0, receivers, function);
+    for(uint32_t subgroup_id = 0; subgroup_id < 8; ++subgroup_id) {
+        for(rpc::FunctionTag tag = 100; tag < 116; ++tag) {
+            for(bool is_reply : {false, true}) {
+                receivers[rpc::Opcode{class_id, subgroup_id, tag, is_reply}] = nullptr;
+            }
+        }
+    }
+    rpc::DispatchTable dispatch_table;
+    dispatch_table.build(receivers, 0, 1 << 12);
+
+    std::vector<char> message(header_space() + rpc::invocation_size(args...));
+    auto out_alloc = [&](int size) { return message.data() + header_space(); };
+    long int invocation_id = 0;
+    print_result("serialize_invocation", type, message.size(), ns_per_op(iterations, [&]() {
+                     auto invocation = invoker.serialize_invocation(++invocation_id, out_alloc, args...);
+                     populate_header(invocation.buf - header_space(), invocation.size, invoker.invoke_opcode, 0);
+                     sink = invocation.size;
+                 }));
+    print_result("RemoteInvoker::send", type, message.size(), ns_per_op(iterations, [&]() {
+                     auto sent = invoker.send(out_alloc, args...);
+                     populate_header(sent.buf - header_space(), sent.size, invoker.invoke_opcode, 0);
+                     sink = sent.size;
+                 }));
+
+    // The message the receiving side handles over and over
+    auto invocation = invoker.serialize_invocation(1, out_alloc, args...);
+    populate_header(message.data(), invocation.size, invoker.invoke_opcode, 0);
+    const rpc::Opcode opcode = invoker.invoke_opcode;
+    print_result("opcode lookup (map)", type, message.size(), ns_per_op(iterations, [&]() {
+                     sink = (std::size_t)&receivers.at(opcode);
+                 }));
+    print_result("opcode lookup (table)", type, message.size(), ns_per_op(iterations, [&]() {
+                     sink = (std::size_t)dispatch_table.find(opcode);
+                 }));
+    mutils::RemoteDeserialization_v rdv{};
+    std::vector<char> reply(1 << 20);
+    auto reply_alloc = [&](int size) { return reply.data() + header_space(); };
+    print_result("receive_call", type, message.size(), ns_per_op(iterations, [&]() {
+                     std::size_t payload_size;
+                     rpc::Opcode received_opcode;
+                     node_id_t received_from;
+                     retrieve_header(&rdv, message.data(), payload_size, received_opcode, received_from);
+                     const rpc::receive_fun_t& receive = *dispatch_table.find(received_opcode);
+                     sink = receive(&rdv, received_from, message.data() + header_space(), reply_alloc).size;
+                 }));
+}
+
+int main(int argc, char* argv[]) {
+    const uint64_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+
+    const Point point{1, 2, 3};
+    const std::string text(64, 'x');
+    const std::vector<int64_t> numbers(64, 42);
+    std::map<int, std::string> dictionary;
+    for(int i = 0; i < 16; ++i) {
+        dictionary[i] = std::string(16, 'a' + i);
+    }
+    std::vector<Item> items;
+    for(int i = 0; i < 8; ++i) {
+        items.emplace_back("item" + std::to_string(i), std::vector<int64_t>(8, i));
+    }
+    const Batch batch("batch", items);
+
+    bench_serialization(iterations, "POD struct", point);
+    bench_serialization(iterations, "string(64)", text);
+    bench_serialization(iterations, "vector<int64_t>(64)", numbers);
+    bench_serialization(iterations, "map<int,string>(16)", dictionary);
+    bench_serialization(iterations, "nested ByteRepresentable", batch);
+    printf("\n");
+
+    bench_rpc(iterations, "(int64_t, int64_t)",
+              std::function<int64_t(int64_t, int64_t)>([](int64_t a, int64_t b) { return a + b; }),
+              int64_t{1}, int64_t{2});
+    bench_rpc(iterations, "(Point)",
+              std::function<int64_t(const Point&)>([](const Point& p) { return p.x + p.y + p.z; }),
+              point);
+    bench_rpc(iterations, "(string)",
+              std::function<std::size_t(const std::string&)>([](const std::string& s) { return s.size(); }),
+              text);
+    bench_rpc(iterations, "(vector<int64_t>)",
+              std::function<std::size_t(const std::vector<int64_t>&)>(
+                      [](const std::vector<int64_t>& v) { return v.size(); }),
+              numbers);
+    bench_rpc(iterations, "(map<int,string>)",
+              std::function<std::size_t(const std::map<int, std::string>&)>(
+                      [](const std::map<int, std::string>& m) { return m.size(); }),
+              dictionary);
+    bench_rpc(iterations, "(string, Batch)",
+              std::function<std::size_t(const std::string&, const Batch&)>(
+                      [](const std::string& s, const Batch& b) { return s.size() + b.items.size(); }),
+              text, batch);
+    bench_rpc(iterations, "() -> string",
+              std::function<std::string()>([&text]() { return text; }));
+    return 0;
+}
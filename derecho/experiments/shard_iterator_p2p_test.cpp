@@ -121,6 +121,12 @@ int main(int argc, char** argv) {
             cout << "Reply from shard " << cnt++ << ": " << reply_map.begin()->second.get() << endl;
         }
         std::cout << "Done getting the replies" << std::endl;
+        // the same query, sent to all shards at once
+        auto combined_results = shard_iterator.p2p_query_all<Foo::READ_STATE>();
+        for(auto& reply_pair : combined_results.get()) {
+            cout << "Reply from node " << reply_pair.first << ": " << reply_pair.second.get() << endl;
+        }
+        std::cout << "Done getting the combined replies" << std::endl;
     }
     group->barrier_sync();
     exit(0);
@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <iostream>
 #include <map>
+#include <set>
 #include <sstream>
 #include <string>
 #include <tuple>
@@ -84,23 +85,54 @@ int main(int argc, char** argv) {
     auto load_balancer_factory = [](PersistentRegistry*) { return std::make_unique<LoadBalancer>(); };
     auto cache_factory = [](PersistentRegistry*) { return std::make_unique<Cache>(); };
 
-    derecho::SubgroupAllocationPolicy load_balancer_policy = derecho::one_subgroup_policy(derecho::even_sharding_policy(1, 3));
-    derecho::SubgroupAllocationPolicy cache_policy = derecho::one_subgroup_policy(derecho::even_sharding_policy(3, 3));
+    derecho::SubgroupAllocationPolicy load_balancer_policy = derecho::minimal_movement_policy(
+            derecho::one_subgroup_policy(derecho::even_sharding_policy(1, 3)));
+    derecho::SubgroupAllocationPolicy cache_policy = derecho::minimal_movement_policy(
+            derecho::one_subgroup_policy(derecho::even_sharding_policy(3, 3)));
     derecho::SubgroupInfo subgroup_info({
             {std::type_index(typeid(LoadBalancer)), derecho::DefaultSubgroupAllocator(load_balancer_policy)},
             {std::type_index(typeid(Cache)), derecho::DefaultSubgroupAllocator(cache_policy)}},
     keys_as_list(subgroup_info.subgroup_membership_functions));
 
+    //Reports, after each view change, how many members ended up in a shard they weren't in before
+    std::map<std::pair<derecho::subgroup_id_t, uint32_t>, std::set<derecho::node_id_t>> last_shard_members;
+    auto count_moved_members = [&last_shard_members](const derecho::View& view) {
+        if(view.subgroup_shard_views.empty()) {
+            cout << "View " << view.vid << " is inadequately provisioned" << endl;
+            return;
+        }
+        std::map<std::pair<derecho::subgroup_id_t, uint32_t>, std::set<derecho::node_id_t>> shard_members;
+        std::size_t moved_members = 0;
+        for(derecho::subgroup_id_t subgroup_id = 0; subgroup_id < view.subgroup_shard_views.size(); ++subgroup_id) {
+            for(uint32_t shard = 0; shard < view.subgroup_shard_views[subgroup_id].size(); ++shard) {
+                const auto& members = view.subgroup_shard_views[subgroup_id][shard].members;
+                std::set<derecho::node_id_t> member_set(members.begin(), members.end());
+                auto previous_members = last_shard_members.find({subgroup_id, shard});
+                if(previous_members != last_shard_members.end()) {
+                    for(derecho::node_id_t member : member_set) {
+                        if(previous_members->second.count(member) == 0) {
+                            moved_members++;
+                        }
+                    }
+                }
+                shard_members[{subgroup_id, shard}] = std::move(member_set);
+            }
+        }
+        cout << "View " << view.vid << ": " << view.departed.size() << " members left, "
+             << moved_members << " members moved into a different shard" << endl;
+        last_shard_members = std::move(shard_members);
+    };
+
     std::unique_ptr<derecho::Group<LoadBalancer, Cache>> group;
     if(my_ip == leader_ip) {
         group = std::make_unique<derecho::Group<LoadBalancer, Cache>>(
                 node_id, my_ip, callback_set, subgroup_info, derecho_params,
-                std::vector<derecho::view_upcall_t>{}, derecho::derecho_gms_port,
+                std::vector<derecho::view_upcall_t>{count_moved_members}, derecho::derecho_gms_port,
                 load_balancer_factory, cache_factory);
     } else {
         group = std::make_unique<derecho::Group<LoadBalancer, Cache>>(
                 node_id, my_ip, leader_ip, callback_set, subgroup_info,
-                std::vector<derecho::view_upcall_t>{}, derecho::derecho_gms_port,
+                std::vector<derecho::view_upcall_t>{count_moved_members}, derecho::derecho_gms_port,
                 load_balancer_factory, cache_factory);
     }
     cout << "Finished constructing/joining Group" << endl;
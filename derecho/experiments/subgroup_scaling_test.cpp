@@ -50,7 +50,7 @@ int main(int argc, char *argv[]) {
     try {
         if(argc < 3) {
             cout << "Insufficient number of command line arguments" << endl;
-            cout << "Enter max_msg_size, subgroup_size" << endl;
+            cout << "Enter max_msg_size, subgroup_size, [num_sender_threads]" << endl;
             cout << "Thank you" << endl;
             exit(1);
         }
@@ -79,6 +79,7 @@ int main(int argc, char *argv[]) {
 
         // will resize is as and when convenient
         uint32_t subgroup_size = atoi(argv[2]);
+        const unsigned int num_sender_threads = (argc > 3) ? atoi(argv[3]) : 1;
         auto num_subgroups = num_nodes;
         vector<uint32_t> send_subgroup_indices;
         map<uint32_t, uint32_t> subgroup_to_local_index;
@@ -133,7 +134,8 @@ int main(int argc, char *argv[]) {
                     node_id, node_addresses[node_id],
                     derecho::CallbackSet{stability_callback, nullptr},
                     raw_groups,
-                    derecho::DerechoParams{max_msg_size, block_size, std::string(), window_size});
+                    derecho::DerechoParams{max_msg_size, block_size, std::string(), window_size,
+                                           1, rdmc::BINOMIAL_SEND, derecho_rpc_port, num_sender_threads});
         } else {
             managed_group = std::make_unique<derecho::Group<>>(
                     node_id, node_addresses[node_id],
@@ -0,0 +1,436 @@
+/*
+ * Measures how long traffic stalls during a view change. Every subgroup is
+ * kept under a steady send load while a join, a clean leave, a reported
+ * failure, or a crash is injected, and each run reports the longest gap
+ * between two deliveries in each subgroup and how long the phases of the view
+ * change took at the members that went through it. Like the benchmark
+ * driver, every node runs this with the same config file, and each run is a
+ * new group made in a child process; its results are written as CSV.
+ *
+ * The parameters of a scenario are
+ *   event          join, leave, report (a member reports another as failed),
+ *                  crash (a member kills its process), or none
+ *   members        how many nodes are in the group before the event, or all;
+ *                  for a join, one more node is needed, which joins the group
+ *   subgroups      the number of subgroups, each of which has every member in it
+ *   message_size   payload size in bytes
+ *   window_size
+ *   mode           ordered or raw
+ *   event_time_ms  how long after the load starts the event is injected
+ *   duration_ms    how long the load runs, at least until the view is installed
+ *   repetitions    how many times each combination of parameters is run
+ *
+ * The node that leaves, fails or crashes is the last of the members, and the
+ * one that reports the failure is node 0, which writes the results.
+ */
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <signal.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "benchmark_config.h"
+#include "block_size.h"
+#include "derecho/derecho.h"
+#include "derecho/metrics.h"
+#include "rdmc/rdmc.h"
+#include "rdmc/util.h"
+#include "sst/sst.h"
+
+using std::cout;
+using std::endl;
+using std::map;
+using std::string;
+using std::vector;
+
+using namespace derecho;
+
+/** The results of one run, averaged over the members that went through the view change */
+struct run_result {
+    /** The longest time between two deliveries in any subgroup */
+    double max_gap_ms;
+    /** The longest time between two deliveries in a subgroup, averaged over the subgroups */
+    double mean_gap_ms;
+    /** The view changes the event took */
+    double view_changes;
+    /** From the start of a view change, when the view is wedged, until it is installed */
+    double view_change_ms;
+    /** From the start of a view change until the ragged edge is cleaned up */
+    double ragged_edge_ms;
+    /** Setting up the next view's SST and RDMC groups */
+    double transport_rebuild_ms;
+    /** Sending and receiving subgroup state */
+    double state_transfer_ms;
+    double wall_time_s;
+    /** 1 if this node's result is part of the average; the joiner's isn't */
+    double counted;
+};
+constexpr size_t num_result_fields = sizeof(run_result) / sizeof(double);
+
+class BenchmarkSST : public sst::SST<BenchmarkSST> {
+public:
+    sst::SSTFieldVector<double> results;
+    BenchmarkSST(const sst::SSTParams& params)
+            : SST<BenchmarkSST>(this, params), results(num_result_fields) {
+        SSTInit(results);
+    }
+};
+
+/** @return Each field of this node's result, averaged over the counted results of the members */
+run_result average_over_nodes(const vector<uint32_t>& members, uint32_t node_id, const run_result& local) {
+    BenchmarkSST sst(sst::SSTParams(members, node_id));
+    const uint32_t my_row = sst.get_local_index();
+    for(size_t i = 0; i < num_result_fields; ++i) {
+        sst.results[my_row][i] = reinterpret_cast<const double*>(&local)[i];
+    }
+    sst.put();
+    sst.sync_with_members();
+    const size_t counted_field = offsetof(run_result, counted) / sizeof(double);
+    run_result average{};
+    double num_counted = 0;
+    for(uint32_t row = 0; row < members.size(); ++row) {
+        if(sst.results[row][counted_field] == 0) {
+            continue;
+        }
+        num_counted++;
+        for(size_t i = 0; i < num_result_fields; ++i) {
+            reinterpret_cast<double*>(&average)[i] += sst.results[row][i];
+        }
+    }
+    for(size_t i = 0; i < num_result_fields && num_counted > 0; ++i) {
+        reinterpret_cast<double*>(&average)[i] /= num_counted;
+    }
+    sst.sync_with_members();
+    return average;
+}
+
+/** The sum and count of a view change histogram, to tell the event's view changes from the earlier ones */
+struct phase_totals {
+    uint64_t view_changes = 0;
+    uint64_t view_change_ns = 0;
+    uint64_t ragged_edge_ns = 0;
+    uint64_t transport_rebuild_ns = 0;
+    uint64_t state_transfer_ns = 0;
+};
+
+phase_totals read_phase_totals() {
+    const metrics::Registry& registry = metrics::registry();
+    phase_totals totals;
+    const metrics::HistogramSnapshot view_change = registry.view_change_ns.snapshot();
+    totals.view_changes = view_change.count;
+    totals.view_change_ns = view_change.sum;
+    totals.ragged_edge_ns = registry.ragged_edge_ns.snapshot().sum;
+    totals.transport_rebuild_ns = registry.transport_rebuild_ns.snapshot().sum;
+    totals.state_transfer_ns = registry.state_transfer_ns.snapshot().sum;
+    return totals;
+}
+
+const benchmark_point_t default_parameters = {
+        {"event", "crash"},
+        {"members", "all"},
+        {"subgroups", "1"},
+        {"message_size", "10240"},
+        {"window_size", "16"},
+        {"mode", "ordered"},
+        {"event_time_ms", "1000"},
+        {"duration_ms", "3000"},
+        {"repetitions", "1"}};
+
+/** @return The number of members before the event, or 0 if this many nodes can't run the point */
+uint32_t initial_members(const benchmark_point_t& point, uint32_t num_nodes) {
+    const string& event = point.at("event");
+    const uint32_t available = event == "join" ? num_nodes - 1 : num_nodes;
+    const uint32_t members = point.at("members") == "all" ? available : std::stoul(point.at("members"));
+    // A failure needs a majority of the members to survive it
+    const uint32_t needed = (event == "leave" || event == "report" || event == "crash") ? 3 : 2;
+    if(members > available || members < needed) {
+        return 0;
+    }
+    return members;
+}
+
+/** Runs one combination of parameters as this node, and exits the process. */
+[[noreturn]] void run_point(const benchmark_point_t& point, uint32_t node_id,
+                            map<uint32_t, string>& node_addresses, int result_fd) {
+    const uint32_t num_members = initial_members(point, node_addresses.size());
+    const string event = point.at("event");
+    const bool join = event == "join";
+    const bool is_joiner = join && node_id == num_members;
+    if(node_id >= num_members && !is_joiner) {
+        // Not in this run
+        exit(0);
+    }
+    const uint32_t victim = num_members - 1;
+    const bool is_victim = !join && event != "none" && node_id == victim;
+    uint32_t final_size = num_members;
+    if(join) {
+        final_size = num_members + 1;
+    } else if(event != "none") {
+        final_size = num_members - 1;
+    }
+    const long long unsigned int message_size = std::stoull(point.at("message_size"));
+    const unsigned int window_size = std::stoul(point.at("window_size"));
+    const uint32_t num_subgroups = std::stoul(point.at("subgroups"));
+    const Mode mode = point.at("mode") == "raw" ? Mode::RAW : Mode::ORDERED;
+    const uint64_t event_time = std::stoull(point.at("event_time_ms")) * 1000000ull;
+    const uint64_t duration = std::stoull(point.at("duration_ms")) * 1000000ull;
+
+    // Upcalls all come from the one SST predicate thread
+    vector<uint64_t> last_delivery(num_subgroups, 0);
+    vector<uint64_t> max_gap(num_subgroups, 0);
+    auto stability_callback = [&](uint32_t subgroup, int sender_id, long long int index, char* buf,
+                                  long long int msg_size) {
+        const uint64_t now = get_time();
+        if(last_delivery[subgroup] != 0) {
+            max_gap[subgroup] = std::max(max_gap[subgroup], now - last_delivery[subgroup]);
+        }
+        last_delivery[subgroup] = now;
+    };
+
+    // Only the first members send, so the joiner doesn't hold up ordered delivery
+    auto membership_function = [num_members, num_subgroups, mode](
+            const View& curr_view, int& next_unassigned_rank, bool previous_was_successful) {
+        std::vector<int> is_sender(curr_view.members.size());
+        for(uint i = 0; i < curr_view.members.size(); ++i) {
+            is_sender[i] = curr_view.members[i] < num_members;
+        }
+        subgroup_shard_layout_t subgroup_vector(num_subgroups);
+        for(uint32_t i = 0; i < num_subgroups; ++i) {
+            subgroup_vector[i].emplace_back(curr_view.make_subview(curr_view.members, mode, is_sender));
+        }
+        next_unassigned_rank = curr_view.members.size();
+        return subgroup_vector;
+    };
+    std::map<std::type_index, shard_view_generator_t> subgroup_map = {{std::type_index(typeid(RawObject)), membership_function}};
+    derecho::SubgroupInfo raw_subgroups(subgroup_map);
+    derecho::DerechoParams derecho_params{message_size, get_block_size(message_size), std::string(), window_size};
+    derecho::CallbackSet callbacks{stability_callback, nullptr};
+
+    std::unique_ptr<derecho::Group<>> managed_group;
+    uint64_t start_time;
+    if(is_joiner) {
+        // Give the members time to start, then join during their load
+        std::this_thread::sleep_for(std::chrono::seconds(2) + std::chrono::nanoseconds(event_time));
+        start_time = get_time();
+        managed_group = std::make_unique<derecho::Group<>>(
+                node_id, node_addresses[node_id], node_addresses[0], callbacks, raw_subgroups);
+    } else {
+        // Give the previous run time to exit
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        vector<node_id_t> members(num_members);
+        vector<ip_addr> member_ips(num_members);
+        for(uint32_t i = 0; i < num_members; ++i) {
+            members[i] = i;
+            member_ips[i] = node_addresses[i];
+        }
+        managed_group = std::make_unique<derecho::Group<>>(
+                node_id, members, member_ips, callbacks, raw_subgroups, derecho_params);
+        managed_group->barrier_sync();
+        start_time = get_time();
+    }
+    const phase_totals before = read_phase_totals();
+
+    vector<RawSubgroup*> subgroups;
+    for(uint32_t i = 0; i < num_subgroups; ++i) {
+        subgroups.push_back(&managed_group->get_subgroup<RawObject>(i));
+    }
+    auto membership_is_final = [&]() {
+        return managed_group->get_members().size() == final_size;
+    };
+    if(!is_joiner) {
+        // Send in every subgroup that has room, until the load has run its
+        // course and the event's view is installed; only the victim stops early
+        const uint64_t stop_time = start_time + (is_victim ? event_time : duration);
+        bool event_injected = false;
+        while(true) {
+            const uint64_t now = get_time();
+            if(node_id == 0 && event == "report" && !event_injected && now >= start_time + event_time) {
+                managed_group->report_failure(victim);
+                event_injected = true;
+            }
+            if(now >= stop_time && (is_victim || membership_is_final())) {
+                break;
+            }
+            for(uint32_t j = 0; j < num_subgroups; ++j) {
+                char* buf = subgroups[j]->get_sendbuffer_ptr(message_size);
+                if(buf) {
+                    subgroups[j]->send();
+                }
+            }
+        }
+    } else {
+        while(!membership_is_final()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    if(is_victim) {
+        if(event == "crash") {
+            kill(getpid(), SIGKILL);
+        } else if(event == "leave") {
+            managed_group->leave();
+        } else {
+            // Wait to be told that this node was reported as failed
+            std::this_thread::sleep_for(std::chrono::nanoseconds(duration) + std::chrono::seconds(10));
+        }
+        exit(0);
+    }
+    const uint64_t elapsed = get_time() - start_time;
+    const phase_totals after = read_phase_totals();
+
+    run_result local{};
+    for(uint32_t j = 0; j < num_subgroups; ++j) {
+        local.max_gap_ms = std::max(local.max_gap_ms, max_gap[j] / 1e6);
+        local.mean_gap_ms += max_gap[j] / 1e6 / num_subgroups;
+    }
+    const uint64_t view_changes = after.view_changes - before.view_changes;
+    if(view_changes > 0) {
+        local.view_changes = view_changes;
+        local.view_change_ms = (after.view_change_ns - before.view_change_ns) / 1e6 / view_changes;
+        local.ragged_edge_ms = (after.ragged_edge_ns - before.ragged_edge_ns) / 1e6 / view_changes;
+        local.transport_rebuild_ms = (after.transport_rebuild_ns - before.transport_rebuild_ns) / 1e6 / view_changes;
+        local.state_transfer_ms = (after.state_transfer_ns - before.state_transfer_ns) / 1e6 / view_changes;
+    }
+    local.wall_time_s = elapsed / 1e9;
+    local.counted = !is_joiner;
+
+    managed_group->barrier_sync();
+    run_result average = average_over_nodes(managed_group->get_members(), node_id, local);
+    if(write(result_fd, &average, sizeof(average)) != sizeof(average)) {
+        perror("Writing the result");
+    }
+    managed_group->barrier_sync();
+    // Like the other experiments, exit rather than tearing the group down
+    exit(0);
+}
+
+const vector<string> parameter_columns = {"event", "members", "subgroups", "message_size", "window_size",
+                                          "mode", "event_time_ms", "duration_ms"};
+const vector<string> result_columns = {"max_gap_ms", "mean_gap_ms", "view_changes", "view_change_ms",
+                                       "ragged_edge_ms", "transport_rebuild_ms", "state_transfer_ms",
+                                       "wall_time_s"};
+
+struct run_record {
+    string scenario;
+    benchmark_point_t point;
+    uint32_t repetition;
+    bool succeeded;
+    run_result result;
+};
+
+void write_csv(std::ostream& out, const vector<run_record>& records) {
+    out << "scenario,repetition";
+    for(const auto& column : parameter_columns) {
+        out << "," << column;
+    }
+    for(const auto& column : result_columns) {
+        out << "," << column;
+    }
+    out << ",succeeded\n";
+    for(const auto& record : records) {
+        out << record.scenario << "," << record.repetition;
+        for(const auto& column : parameter_columns) {
+            out << "," << record.point.at(column);
+        }
+        for(size_t i = 0; i < result_columns.size(); ++i) {
+            out << "," << reinterpret_cast<const double*>(&record.result)[i];
+        }
+        out << "," << record.succeeded << "\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 2) {
+        cout << "Usage: " << argv[0] << " <config file> [--scenario name]... [--csv file]" << endl;
+        return 1;
+    }
+    pthread_setname_np(pthread_self(), "benchmark");
+    string csv_file = "view_change_results.csv";
+    std::set<string> selected_scenarios;
+    for(int i = 2; i + 1 < argc; i += 2) {
+        const string option = argv[i];
+        if(option == "--scenario") {
+            selected_scenarios.insert(argv[i + 1]);
+        } else if(option == "--csv") {
+            csv_file = argv[i + 1];
+        } else {
+            cout << "Unknown option " << option << endl;
+            return 1;
+        }
+    }
+    vector<BenchmarkScenario> scenarios;
+    try {
+        scenarios = read_benchmark_config(argv[1]);
+    } catch(const std::exception& e) {
+        cout << e.what() << endl;
+        return 1;
+    }
+    for(const auto& scenario : scenarios) {
+        for(const auto& parameter : scenario.parameters) {
+            if(default_parameters.find(parameter.first) == default_parameters.end()) {
+                cout << "Scenario " << scenario.name << " has an unknown parameter " << parameter.first << endl;
+                return 1;
+            }
+        }
+    }
+
+    uint32_t node_id;
+    map<uint32_t, string> node_addresses;
+    rdmc::query_addresses(node_addresses, node_id);
+    const uint32_t num_nodes = node_addresses.size();
+
+    vector<run_record> records;
+    for(const auto& scenario : scenarios) {
+        if(!selected_scenarios.empty() && selected_scenarios.count(scenario.name) == 0) {
+            continue;
+        }
+        for(const auto& point : scenario.expand(default_parameters)) {
+            if(initial_members(point, num_nodes) == 0) {
+                cout << "Skipping " << scenario.name << " with " << point.at("members") << " members of "
+                     << num_nodes << " nodes for event " << point.at("event") << endl;
+                continue;
+            }
+            const uint32_t repetitions = std::stoul(point.at("repetitions"));
+            for(uint32_t repetition = 0; repetition < repetitions; ++repetition) {
+                cout << "Running " << scenario.name << ", repetition " << repetition << endl;
+                int result_pipe[2];
+                if(pipe(result_pipe) != 0) {
+                    perror("pipe");
+                    return 1;
+                }
+                const pid_t child = fork();
+                if(child == 0) {
+                    close(result_pipe[0]);
+                    try {
+                        run_point(point, node_id, node_addresses, result_pipe[1]);
+                    } catch(const std::exception& e) {
+                        cout << "Exception in run: " << e.what() << endl;
+                        exit(1);
+                    }
+                }
+                close(result_pipe[1]);
+                run_record record{scenario.name, point, repetition, false, run_result{}};
+                record.succeeded = read(result_pipe[0], &record.result, sizeof(record.result)) == sizeof(record.result);
+                close(result_pipe[0]);
+                int status;
+                waitpid(child, &status, 0);
+                record.succeeded = record.succeeded && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+                records.push_back(record);
+            }
+        }
+    }
+
+    // Every node has the same results, so only node 0, which is never the victim, writes them
+    if(node_id == 0) {
+        std::ofstream csv(csv_file);
+        write_csv(csv, records);
+        cout << "Wrote " << records.size() << " results to " << csv_file << endl;
+    }
+    return 0;
+}
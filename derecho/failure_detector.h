@@ -0,0 +1,115 @@
+/**
+ * @file failure_detector.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace derecho {
+
+/**
+ * A phi-accrual failure detector over the heartbeat counters that every
+ * member writes into its SST row. For each peer it keeps the mean and
+ * variance of the times between the heartbeats this node has seen, and
+ * suspects the peer once the time since its last heartbeat is so unlikely
+ * under a normal distribution with those statistics that
+ * phi = -log10(P(a heartbeat this late)) exceeds a threshold. Until a peer has
+ * sent a few heartbeats, the statistics start from the configured interval.
+ * It is only used by the heartbeat thread, so nothing here is synchronized.
+ */
+class PhiAccrualDetector {
+public:
+    /** The number of most recent intervals the statistics are computed over */
+    static constexpr std::size_t window_size = 64;
+
+private:
+    struct Peer {
+        uint64_t last_heartbeat = 0;
+        uint64_t last_arrival_ns = 0;
+        /** Recent intervals between heartbeats, in nanoseconds, as a ring buffer */
+        std::vector<double> intervals;
+        std::size_t next_interval = 0;
+        double sum = 0;
+        double sum_of_squares = 0;
+    };
+
+    std::vector<Peer> peers;
+    double threshold;
+    /** The smallest standard deviation assumed, so that perfectly regular
+     * heartbeats don't make a single late one look impossible */
+    double min_stddev_ns;
+
+    void add_interval(Peer& peer, double interval_ns) {
+        if(peer.intervals.size() < window_size) {
+            peer.intervals.push_back(interval_ns);
+        } else {
+            const double oldest = peer.intervals[peer.next_interval];
+            peer.sum -= oldest;
+            peer.sum_of_squares -= oldest * oldest;
+            peer.intervals[peer.next_interval] = interval_ns;
+            peer.next_interval = (peer.next_interval + 1) % window_size;
+        }
+        peer.sum += interval_ns;
+        peer.sum_of_squares += interval_ns * interval_ns;
+    }
+
+public:
+    /**
+     * @param num_peers The number of rows in the SST
+     * @param heartbeat_interval_ns How often members write their heartbeats
+     * @param threshold The phi above which a peer is suspected; 8 means a
+     * heartbeat that late would be expected once in 10^8 intervals
+     * @param now_ns The current time, which counts as every peer's first heartbeat
+     */
+    PhiAccrualDetector(std::size_t num_peers, uint64_t heartbeat_interval_ns, double threshold, uint64_t now_ns)
+            : peers(num_peers), threshold(threshold), min_stddev_ns(heartbeat_interval_ns / 4.0) {
+        for(Peer& peer : peers) {
+            peer.last_arrival_ns = now_ns;
+            add_interval(peer, heartbeat_interval_ns);
+        }
+    }
+
+    /**
+     * Records a peer's heartbeat counter as read at time now_ns.
+     * @return True if it has changed since it was last read
+     */
+    bool observe(std::size_t peer_index, uint64_t heartbeat, uint64_t now_ns) {
+        Peer& peer = peers[peer_index];
+        if(heartbeat == peer.last_heartbeat) {
+            return false;
+        }
+        add_interval(peer, now_ns - peer.last_arrival_ns);
+        peer.last_heartbeat = heartbeat;
+        peer.last_arrival_ns = now_ns;
+        return true;
+    }
+
+    /** @return The suspicion level of a peer at time now_ns. */
+    double phi(std::size_t peer_index, uint64_t now_ns) const {
+        const Peer& peer = peers[peer_index];
+        const double count = peer.intervals.size();
+        const double mean = peer.sum / count;
+        const double variance = std::max(peer.sum_of_squares / count - mean * mean, 0.0);
+        const double stddev = std::max(std::sqrt(variance), min_stddev_ns);
+        const double y = (now_ns - peer.last_arrival_ns - mean) / stddev;
+        // A logistic approximation of the normal distribution's tail, which
+        // doesn't lose all its precision far from the mean the way 1 - CDF does
+        const double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+        if(y > 0) {
+            return -std::log10(e / (1.0 + e));
+        }
+        return -std::log10(1.0 - 1.0 / (1.0 + e));
+    }
+
+    /** @return True if a peer should be suspected at time now_ns. */
+    bool suspect(std::size_t peer_index, uint64_t now_ns) const {
+        return phi(peer_index, now_ns) > threshold;
+    }
+};
+}  // namespace derecho
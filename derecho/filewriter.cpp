@@ -1,17 +1,23 @@
 
 #include "filewriter.h"
+#include "thread_placement.h"
 #include "mutils-serialization/SerializationSupport.hpp"
 
+#include <algorithm>
+#include <climits>
 #include <cstring>
-#include <fstream>
+#include <fcntl.h>
 #include <functional>
 #include <iostream>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <thread>
+#include <unistd.h>
 #include <utility>
+#include <vector>
 
 using std::mutex;
 using std::unique_lock;
-using std::ofstream;
 
 namespace derecho {
 
@@ -20,9 +26,10 @@ using namespace persistence;
 const uint8_t MAGIC_NUMBER[8] = {'D', 'E', 'R', 'E', 'C', 'H', 'O', 29};
 
 FileWriter::FileWriter(const std::function<void(message)>& _message_written_upcall,
-                       const std::string& filename)
+                       const std::string& filename, uint64_t compaction_threshold)
         : message_written_upcall(_message_written_upcall),
           exit(false),
+          compaction_threshold(compaction_threshold),
           writer_thread(&FileWriter::perform_writes, this, filename),
           callback_thread(&FileWriter::issue_callbacks, this) {}
 
@@ -45,57 +52,228 @@ void FileWriter::set_message_written_upcall(
     message_written_upcall = _message_written_upcall;
 }
 
+/**
+ * Writes all of the buffers to a file descriptor, continuing after partial
+ * writes. @return False if a write failed
+ */
+static bool write_all(int fd, std::vector<struct iovec>& buffers) {
+    std::size_t first = 0;
+    while(first < buffers.size()) {
+        const int count = std::min(buffers.size() - first, (std::size_t)IOV_MAX);
+        ssize_t written = writev(fd, &buffers[first], count);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        // Skip the buffers that were written completely, and the part of the
+        // next one that was written
+        while(first < buffers.size() && written >= (ssize_t)buffers[first].iov_len) {
+            written -= buffers[first].iov_len;
+            ++first;
+        }
+        if(written > 0) {
+            buffers[first].iov_base = (char*)buffers[first].iov_base + written;
+            buffers[first].iov_len -= written;
+        }
+    }
+    return true;
+}
+
 void FileWriter::perform_writes(std::string filename) {
     pthread_setname_np(pthread_self(), "writer_thread");
-    ofstream data_file(filename, std::ios::app);
-    ofstream metadata_file(filename + METADATA_EXTENSION, std::ios::app);
-
-    unique_lock<mutex> writes_lock(pending_writes_mutex);
-
-    uint64_t current_offset = 0;
-
-    persistence::header h;
-    memcpy(h.magic, MAGIC_NUMBER, sizeof(MAGIC_NUMBER));
-    h.version = 0;
-    metadata_file.write((char*)&h, sizeof(h));
+    place_this_thread("writer_thread");
+    const mode_t file_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    int data_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, file_mode);
+    int metadata_fd = open((filename + METADATA_EXTENSION).c_str(), O_WRONLY | O_CREAT | O_APPEND, file_mode);
+    if(data_fd < 0 || metadata_fd < 0) {
+        std::cerr << "FileWriter failed to open " << filename << ": " << strerror(errno) << std::endl;
+        return;
+    }
 
-    while(!exit) {
-        pending_writes_cv.wait(writes_lock);
+    // Offsets in the metadata are from the start of the data file, which may
+    // already hold the messages of an earlier run
+    uint64_t current_offset = lseek(data_fd, 0, SEEK_END);
+    uint64_t preallocated_end = current_offset;
 
-        while(!pending_writes.empty()) {
-            using namespace std::placeholders;
+    const std::size_t metadata_size = mutils::bytes_size(message_metadata{});
+    if(lseek(metadata_fd, 0, SEEK_END) == 0) {
+        persistence::header h;
+        memcpy(h.magic, MAGIC_NUMBER, sizeof(MAGIC_NUMBER));
+        h.version = 0;
+        std::vector<struct iovec> header_buffer{{&h, sizeof(h)}};
+        write_all(metadata_fd, header_buffer);
+    } else if(compaction_threshold > 0) {
+        // The earlier runs' messages can be compacted too, once this run is
+        // far enough along
+        std::ifstream old_metadata(filename + METADATA_EXTENSION, std::ios::binary);
+        old_metadata.seekg(sizeof(persistence::header));
+        std::vector<char> buffer(metadata_size);
+        while(old_metadata.read(buffer.data(), metadata_size)) {
+            logged_messages.push_back({*mutils::from_bytes<message_metadata>(nullptr, buffer.data()), -1});
+        }
+    }
+    unique_lock<mutex> writes_lock(pending_writes_mutex);
+    while(true) {
+        pending_writes_cv.wait(writes_lock, [this]() { return exit || !pending_writes.empty(); });
+        if(pending_writes.empty()) {
+            break;
+        }
+        // Everything that queued up during the last batch's sync goes in the next one
+        std::queue<message> batch;
+        std::swap(batch, pending_writes);
+        writes_lock.unlock();
 
-            message m = pending_writes.front();
-            pending_writes.pop();
+        std::vector<struct iovec> data_buffers;
+        std::vector<char> metadata_buffer(batch.size() * metadata_size);
+        std::vector<message> written;
+        data_buffers.reserve(batch.size());
+        written.reserve(batch.size());
+        uint64_t batch_offset = current_offset;
+        while(!batch.empty()) {
+            message m = batch.front();
+            batch.pop();
 
             message_metadata metadata;
             metadata.view_id = m.view_id;
             metadata.sender = m.sender;
             metadata.index = m.index;
-            metadata.offset = current_offset;
+            metadata.offset = batch_offset;
             metadata.length = m.length;
             metadata.is_cooked = m.cooked;
             metadata.subgroup_num = m.subgroup_num;
+            mutils::to_bytes(metadata, metadata_buffer.data() + written.size() * metadata_size);
 
-            data_file.write(m.data, m.length);
-            mutils::post_object(std::bind(&std::ofstream::write, &metadata_file, _1, _2), metadata);
+            if(m.length > 0) {
+                data_buffers.push_back({m.data, m.length});
+            }
+            batch_offset += m.length;
+            written.push_back(m);
+            if(compaction_threshold > 0) {
+                logged_messages.push_back({metadata, m.sequence_number});
+            }
+        }
 
-            data_file.flush();
-            metadata_file.flush();
+        // Allocating the file's blocks ahead of the writes keeps each sync
+        // from also having to update the file's extents
+        if(batch_offset > preallocated_end) {
+            const uint64_t new_end = std::max(batch_offset, preallocated_end + preallocation_size);
+            if(fallocate(data_fd, FALLOC_FL_KEEP_SIZE, preallocated_end, new_end - preallocated_end) == 0) {
+                preallocated_end = new_end;
+            } else {
+                preallocated_end = batch_offset;
+            }
+        }
 
-            current_offset += m.length;
+        // The data is written and synced before the metadata that points to
+        // it, so a crash never leaves metadata for a message that isn't there
+        std::vector<struct iovec> metadata_buffers{{metadata_buffer.data(), metadata_buffer.size()}};
+        if(!write_all(data_fd, data_buffers) || fdatasync(data_fd) < 0
+           || !write_all(metadata_fd, metadata_buffers) || fdatasync(metadata_fd) < 0) {
+            std::cerr << "FileWriter failed to write to " << filename << ": " << strerror(errno) << std::endl;
+            break;
+        }
+        current_offset = batch_offset;
 
-            {
-                unique_lock<mutex> callbacks_lock(pending_callbacks_mutex);
+        {
+            unique_lock<mutex> callbacks_lock(pending_callbacks_mutex);
+            for(const message& m : written) {
                 pending_callbacks.push(std::bind(message_written_upcall, m));
             }
-            pending_callbacks_cv.notify_all();
         }
+        pending_callbacks_cv.notify_all();
+        if(compaction_threshold > 0) {
+            compact(filename, data_fd, metadata_fd);
+        }
+        writes_lock.lock();
+    }
+    close(data_fd);
+    close(metadata_fd);
+}
+
+void FileWriter::compact(const std::string& filename, int data_fd, int& metadata_fd) {
+    std::map<uint32_t, long long int> frontier;
+    {
+        std::lock_guard<std::mutex> lock(checkpoints_mutex);
+        frontier = checkpoints;
+    }
+    // Only a prefix of the log can be dropped, so what's left is still the
+    // tail of the log that recovery expects. Messages from earlier runs are
+    // older than any of this run's, so they go once this run has a checkpoint.
+    std::size_t num_dropped = 0;
+    for(const logged_message& logged : logged_messages) {
+        auto checkpoint = frontier.find(logged.metadata.subgroup_num);
+        if(logged.sequence_number >= 0
+           && (checkpoint == frontier.end() || logged.sequence_number > checkpoint->second)) {
+            break;
+        }
+        if(logged.sequence_number < 0 && frontier.empty()) {
+            break;
+        }
+        ++num_dropped;
+    }
+    if(num_dropped == 0) {
+        return;
+    }
+    const message_metadata& last_dropped = logged_messages[num_dropped - 1].metadata;
+    const uint64_t dropped_end = last_dropped.offset + last_dropped.length;
+    if(dropped_end < compacted_offset + compaction_threshold) {
+        return;
     }
+
+    // The checkpoint goes first, so that a crash during compaction can leave
+    // a log that starts later than it says, but never an unaccounted gap
+    persist_object(last_dropped, filename + CHECKPOINT_EXTENSION);
+
+    const std::string metadata_filename = filename + METADATA_EXTENSION;
+    const std::string swap_filename = metadata_filename + SWAP_FILE_EXTENSION;
+    const mode_t file_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    int new_metadata_fd = open(swap_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, file_mode);
+    if(new_metadata_fd < 0) {
+        std::cerr << "FileWriter failed to compact " << metadata_filename << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    const std::size_t metadata_size = mutils::bytes_size(message_metadata{});
+    std::vector<char> contents(sizeof(persistence::header) + (logged_messages.size() - num_dropped) * metadata_size);
+    persistence::header h;
+    memcpy(h.magic, MAGIC_NUMBER, sizeof(MAGIC_NUMBER));
+    h.version = 0;
+    memcpy(contents.data(), &h, sizeof(h));
+    char* next_record = contents.data() + sizeof(h);
+    for(std::size_t i = num_dropped; i < logged_messages.size(); ++i) {
+        mutils::to_bytes(logged_messages[i].metadata, next_record);
+        next_record += metadata_size;
+    }
+    std::vector<struct iovec> buffers{{contents.data(), contents.size()}};
+    if(!write_all(new_metadata_fd, buffers) || fdatasync(new_metadata_fd) < 0
+       || std::rename(swap_filename.c_str(), metadata_filename.c_str()) < 0) {
+        std::cerr << "FileWriter failed to compact " << metadata_filename << ": " << strerror(errno) << std::endl;
+        close(new_metadata_fd);
+        return;
+    }
+    close(metadata_fd);
+    metadata_fd = new_metadata_fd;
+
+    // The dropped messages' bytes can be freed now that nothing points to them
+    if(fallocate(data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 compacted_offset, dropped_end - compacted_offset)
+       < 0) {
+        std::cerr << "FileWriter failed to free compacted space in " << filename << ": " << strerror(errno) << std::endl;
+    }
+    compacted_offset = dropped_end;
+    logged_messages.erase(logged_messages.begin(), logged_messages.begin() + num_dropped);
+}
+
+void FileWriter::checkpoint(uint32_t subgroup_num, long long int sequence_number) {
+    std::lock_guard<std::mutex> lock(checkpoints_mutex);
+    long long int& checkpoint = checkpoints.emplace(subgroup_num, -1).first->second;
+    checkpoint = std::max(checkpoint, sequence_number);
 }
 
 void FileWriter::issue_callbacks() {
     pthread_setname_np(pthread_self(), "clbk_thread");
+    place_this_thread("clbk_thread");
     unique_lock<mutex> lock(pending_callbacks_mutex);
 
     while(!exit) {
@@ -3,7 +3,9 @@
 #include <atomic>
 #include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <fstream>
+#include <map>
 #include <mutex>
 #include <queue>
 #include <string>
@@ -33,15 +35,59 @@ private:
 
     bool exit;
 
+    /** How far ahead of its end the data file's blocks are allocated */
+    static constexpr uint64_t preallocation_size = 64 << 20;
+
+    /** A message in the log, as the writer thread remembers it for compaction */
+    struct logged_message {
+        persistence::message_metadata metadata;
+        /** The message's sequence number in its subgroup, or -1 if it was
+         * written by an earlier run */
+        long long int sequence_number;
+    };
+    /** The messages in the metadata file, in order. Only used by the writer thread */
+    std::deque<logged_message> logged_messages;
+
+    /** Protects checkpoints. */
+    std::mutex checkpoints_mutex;
+    /** By subgroup number, the latest sequence number up to which every
+     * member of this node's shard has persisted the subgroup's messages */
+    std::map<uint32_t, long long int> checkpoints;
+    /** How much superseded data has to build up at the front of the log
+     * before it is compacted; 0 if the log is never compacted */
+    uint64_t compaction_threshold;
+    /** Where the data file's hole of compacted-away messages ends. Only
+     * used by the writer thread */
+    uint64_t compacted_offset = 0;
+
+    /**
+     * Drops the messages at the front of the log that every shard member has
+     * persisted, once there are compaction_threshold bytes of them: the last
+     * one dropped is saved as the log's checkpoint, the metadata file is
+     * rewritten without them, and their space in the data file is freed by
+     * punching a hole in it, which leaves the offsets of the others as they
+     * were. Called by the writer thread between batches.
+     */
+    void compact(const std::string& filename, int data_fd, int& metadata_fd);
+
     std::thread writer_thread;
     std::thread callback_thread;
 
+    /** Writes the pending messages in batches: each batch's data is written
+     * with one writev and synced, followed by its metadata, and then the
+     * messages' callbacks are queued. This function implements the writer
+     * thread. */
     void perform_writes(std::string filename);
     void issue_callbacks();
 
 public:
+    /**
+     * @param compaction_threshold How many bytes of messages that every
+     * shard member has persisted can build up at the front of the log before
+     * they are compacted away; 0 to keep the whole log
+     */
     FileWriter(const std::function<void(persistence::message)>& _message_written_upcall,
-               const std::string& filename);
+               const std::string& filename, uint64_t compaction_threshold = 0);
     ~FileWriter();
 
     FileWriter(FileWriter&) = delete;
@@ -53,5 +99,11 @@ public:
     void set_message_written_upcall(const std::function<void(persistence::message)>&
                                             _message_written_upcall);
     void write_message(persistence::message m);
+    /**
+     * Records that every member of this node's shard of a subgroup has
+     * persisted its messages up to a sequence number, so that they no longer
+     * need to be kept in this node's log for recovery.
+     */
+    void checkpoint(uint32_t subgroup_num, long long int sequence_number);
 };
 }
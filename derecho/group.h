@@ -12,6 +12,7 @@
 #include <queue>
 #include <string>
 #include <typeindex>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -22,6 +23,8 @@
 #include "raw_subgroup.h"
 #include "replicated.h"
 #include "rpc_manager.h"
+#include "shard_router.h"
+#include "state_transfer.h"
 #include "subgroup_info.h"
 #include "view_manager.h"
 #include "persistence_manager.h"
@@ -82,6 +85,10 @@ private:
      * ExternalCaller for subgroup i of type T can be used to contact any member
      * of any shard of that subgroup, so shards are not indexed. */
     mutils::KindMap<external_caller_index_map, ReplicatedTypes...> external_callers;
+    /** Pushes a new view's layout to each ShardRouter made by
+     * get_shard_router, returning false once the router is gone */
+    std::list<std::function<bool(const View&)>> shard_router_subscriptions;
+    std::mutex shard_router_subscriptions_mutex;
     /** Alternate view of the Replicated<T>s, indexed by subgroup ID. The entry at
      * index X is a reference to the Replicated<T> for this node's shard of
      * subgroup X, which may or may not be valid. The references are the abstract
@@ -89,7 +96,10 @@ private:
      * Note that this is a std::map solely so that we can initialize it out-of-order;
      * its keys are continuous integers starting at 0 and it should be a std::vector. */
     std::map<subgroup_id_t, std::reference_wrapper<ReplicatedObject>> objects_by_subgroup_id;
-    
+    /** Sends object state to new shard members in the background, while this
+     * node carries on with the view they joined in. */
+    state_transfer::StateSender state_sender;
+
     /* get_subgroup is actually implemented in these two methods. This is an
      * ugly hack to allow us to specialize get_subgroup<RawObject> to behave differently than
      * get_subgroup<T>. The unnecessary unused parameter is for overload selection. */
@@ -114,7 +124,11 @@ private:
     /**
      * Updates the state of the replicated objects that correspond to subgroups
      * identified in the provided map, by receiving serialized state from the
-     * shard leader whose ID is paired with that subgroup ID.
+     * shard leader whose ID is paired with that subgroup ID. Persistent fields
+     * are caught up from the entries this node's logs are missing if it kept
+     * its logs from before it left, or copied whole otherwise. Objects from
+     * different leaders are received in parallel, and each object is
+     * deserialized while the next one from the same leader is received.
      * @param subgroups_and_leaders Pairs of (subgroup ID, leader's node ID) for
      * subgroups that need to have their state initialized from the leader.
      */
@@ -185,6 +199,11 @@ private:
           const int gms_port,
           Factory<ReplicatedTypes>... factories);
 
+    /** @return The subgroup ID of the subgroup of SubgroupType with this index
+     * @throws invalid_subgroup_exception if there is no such subgroup */
+    template <typename SubgroupType>
+    subgroup_id_t subgroup_id_of(uint32_t subgroup_index);
+
 public:
     /**
      * Constructor that starts a new managed Derecho group with this node as
@@ -280,6 +299,43 @@ public:
           const int gms_port = derecho_gms_port,
           Factory<ReplicatedTypes>... factories);
 
+    /**
+     * Constructor that starts a new managed Derecho group from a membership
+     * that every member is given, so that the members connect to each other
+     * at once and install the first view together, instead of joining the
+     * leader one at a time. Every member must be started with the same
+     * members, member_ips, subgroup_info and derecho_params. Nodes that join
+     * the group later use the joining constructor.
+     *
+     * @param my_id The node ID of the node executing this code, which must be
+     * one of members
+     * @param members The node IDs of the group's first members, in rank
+     * order; the first is the leader
+     * @param member_ips The IP addresses of the members, in the same order
+     * @param callbacks The set of callback functions for message delivery
+     * events in this group.
+     * @param subgroup_info The set of functions that define how membership in
+     * each subgroup and shard will be determined in this group.
+     * @param derecho_params The assorted configuration parameters for this
+     * Derecho group instance, such as message size and logfile name
+     * @param _view_upcalls A list of functions to be called when the group
+     * experiences a View-Change event (optional).
+     * @param gms_port The port to contact other group members on when sending
+     * group-management messages
+     * @param factories A variable number of Factory functions, one for each
+     * template parameter of Group, providing a way to construct instances of
+     * each Replicated Object
+     */
+    Group(const node_id_t my_id,
+          const std::vector<node_id_t>& members,
+          const std::vector<ip_addr>& member_ips,
+          const CallbackSet& callbacks,
+          const SubgroupInfo& subgroup_info,
+          const DerechoParams& derecho_params,
+          std::vector<view_upcall_t> _view_upcalls = {},
+          const int gms_port = derecho_gms_port,
+          Factory<ReplicatedTypes>... factories);
+
     ~Group();
 
     /**
@@ -324,6 +380,28 @@ public:
     template <typename SubgroupType>
     ShardIterator<SubgroupType> get_shard_iterator(uint32_t subgroup_index = 0);
 
+    /**
+     * Makes a ShardRouter for a subgroup of the specified type and index that
+     * this node is not a member of, which maps keys to the subgroup's shards
+     * by consistent hashing and spreads queries across each shard's members.
+     * The router starts with the current view's shards, and each later view
+     * that changes them pushes it the new ones, for as long as it is kept.
+     *
+     * @param subgroup_index The index of the subgroup within the set of
+     * subgroups that replicate the same type of object.
+     * @param selection How to choose which member of a shard to query
+     * @param is_local For ReplicaSelection::LOCAL_FIRST, a function returning
+     * true for the nodes local to this one, such as those in its rack
+     * @tparam SubgroupType The object type identifying the subgroup
+     * @throws invalid_subgroup_exception If this node is actually a member of
+     * the requested subgroup, or if no such subgroup exists
+     */
+    template <typename SubgroupType>
+    std::shared_ptr<ShardRouter<SubgroupType>> get_shard_router(
+            uint32_t subgroup_index = 0,
+            ReplicaSelection selection = ReplicaSelection::LEAST_OUTSTANDING,
+            std::function<bool(node_id_t)> is_local = nullptr);
+
     /** Causes this node to cleanly leave the group by setting itself to "failed." */
     void leave();
     /** Creates and returns a vector listing the nodes that are currently members of the group. */
@@ -333,6 +411,76 @@ public:
     void report_failure(const node_id_t who);
     /** Waits until all members of the group have called this function. */
     void barrier_sync();
+    /** Waits until all members of this node's shard of the specified
+     * subgroup have called this function for it. It only involves them, so
+     * shards can coordinate without stopping the rest of the group.
+     * @throws invalid_subgroup_exception if this node is not in the subgroup */
+    template <typename SubgroupType>
+    void barrier_sync(uint32_t subgroup_index);
+    /**
+     * Gathers a small value from every member of this node's shard of the
+     * specified subgroup, through the SST. Every member of the shard must
+     * call it, for the same subgroup, as many times as the others.
+     * @param value This node's value, of a trivially copyable type of at
+     * most 8 bytes
+     * @return The values, indexed by shard rank; a member suspected of
+     * failing before it gave its value gets a value-initialized T
+     * @throws invalid_subgroup_exception if this node is not in the subgroup
+     */
+    template <typename SubgroupType, typename T>
+    std::vector<T> allgather(uint32_t subgroup_index, const T& value);
+    /**
+     * Combines a small value from every member of this node's shard of the
+     * specified subgroup, like allgather, and reduces them with op, such as
+     * std::plus<T>(), in shard rank order, so every member gets the same
+     * result. A member suspected of failing before it gave its value is left
+     * out.
+     * @throws invalid_subgroup_exception if this node is not in the subgroup
+     */
+    template <typename SubgroupType, typename T, typename ReduceOp>
+    T allreduce(uint32_t subgroup_index, const T& value, ReduceOp op);
+    /**
+     * Tries to acquire one of the locks of this node's shard of the
+     * specified subgroup. The lock's word is kept at the shard's leader and
+     * changed with RDMA atomics, so an uncontended acquire or release takes
+     * one round trip, instead of the round of stability of an ordered
+     * multicast. A lock is held until it is released or the view changes.
+     * @param lock_index Which of the shard's DerechoSST::locks_per_subgroup locks
+     * @return A fencing token, which is greater for every later holder of
+     * the lock, even in later views, so that what the lock guards can turn
+     * away an old holder; or 0 if another member holds the lock
+     * @throws invalid_subgroup_exception if this node is not in the subgroup
+     */
+    template <typename SubgroupType>
+    uint64_t try_lock(uint32_t subgroup_index, uint32_t lock_index = 0);
+    /** Acquires a lock like try_lock, waiting until it is free. */
+    template <typename SubgroupType>
+    uint64_t lock(uint32_t subgroup_index, uint32_t lock_index = 0);
+    /**
+     * Releases a lock that this node acquired, given the token it got.
+     * @return False if the lock was already lost to a view change
+     */
+    template <typename SubgroupType>
+    bool unlock(uint32_t subgroup_index, uint64_t token, uint32_t lock_index = 0);
+    /**
+     * Takes a checkpoint of the whole group that is consistent across its
+     * shards, at the current time, without pausing it. The leader of each
+     * shard waits until the shard is stable past the cut, then copies the
+     * logs of its Persistent<T> fields, up to the last version no later than
+     * the cut, into a directory of target_path named for the subgroup and
+     * shard; the shards do this in parallel and go on handling messages.
+     * This must not be called from a delivery upcall, which would keep the
+     * shards from becoming stable.
+     * @param target_path A directory that names the same place on every
+     * member, such as one on a shared file system
+     * @return The cut, in microseconds, or 0 if the checkpoint failed or a
+     * view change interrupted it, in which case it should be taken again
+     */
+    uint64_t checkpoint(const std::string& target_path);
+    /** Takes a checkpoint like checkpoint(), at a given cut in microseconds
+     * of CLOCK_REALTIME, which must be later than the last one this node
+     * asked for in the view. @return True if it succeeded */
+    bool checkpoint_at(const std::string& target_path, uint64_t cut_us);
     void debug_print_status() const;
 
     void log_event(const std::string& event_text) {
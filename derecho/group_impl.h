@@ -4,6 +4,9 @@
  * @date Apr 22, 2016
  */
 
+#include <cstring>
+#include <future>
+
 #include <mutils-serialization/SerializationSupport.hpp>
 
 #include "derecho_internal.h"
@@ -143,11 +146,44 @@ Group<ReplicatedTypes...>::Group(const std::string& recovery_filename,
           factories(make_kind_map(factories...)),
           raw_subgroups(construct_raw_subgroups(view_manager.get_current_view().get())) {
     //TODO: This is the recover-from-saved-file constructor; I don't know how it will work
+    // The objects' logs are loaded one at a time as they are constructed, so
+    // check and read ahead all of them in parallel first
+    for(const std::string& invalid_log : FilePersistLog::preload()) {
+        logger->warn("Persistent log {} is invalid and cannot be recovered", invalid_log);
+    }
     construct_objects<ReplicatedTypes...>(view_manager.get_current_view().get(), std::unique_ptr<vector_int64_2d>());
     set_up_components();
     view_manager.start();
 }
 
+template <typename... ReplicatedTypes>
+Group<ReplicatedTypes...>::Group(const node_id_t my_id,
+                                 const std::vector<node_id_t>& members,
+                                 const std::vector<ip_addr>& member_ips,
+                                 const CallbackSet& callbacks,
+                                 const SubgroupInfo& subgroup_info,
+                                 const DerechoParams& derecho_params,
+                                 std::vector<view_upcall_t> _view_upcalls,
+                                 const int gms_port,
+                                 Factory<ReplicatedTypes>... factories)
+        : logger(create_logger()),
+          my_id(my_id),
+          persistence_manager(callbacks.local_persistence_callback),
+          view_manager(my_id, members, member_ips, callbacks, subgroup_info, derecho_params,
+                       persistence_manager.get_callbacks(),
+                       _view_upcalls, gms_port),
+          rpc_manager(my_id, view_manager),
+          factories(make_kind_map(factories...)),
+          raw_subgroups(construct_raw_subgroups(view_manager.get_current_view().get())) {
+    //Every member starts in view 0, so there is no state to receive
+    construct_objects<ReplicatedTypes...>(view_manager.get_current_view().get(), std::unique_ptr<vector_int64_2d>());
+    set_up_components();
+    persistence_manager.set_objects(std::addressof(replicated_objects));
+    persistence_manager.set_view_manager(std::addressof(view_manager));
+    view_manager.start();
+    persistence_manager.start();
+}
+
 template <typename... ReplicatedTypes>
 Group<ReplicatedTypes...>::~Group() {
     // shutdown the persistence manager
@@ -235,14 +271,47 @@ std::vector<RawSubgroup> Group<ReplicatedTypes...>::construct_raw_subgroups(cons
 template <typename... ReplicatedTypes>
 void Group<ReplicatedTypes...>::set_up_components() {
     SharedLockedReference<View> curr_view = view_manager.get_current_view();
-    curr_view.get().multicast_group->register_rpc_callback([this](subgroup_id_t subgroup, node_id_t sender, char* buf, uint32_t size) {
-        rpc_manager.rpc_message_handler(subgroup, sender, buf, size);
-    });
+    //Bound at compile time, so that delivery calls straight into the RPCManager
+    curr_view.get().multicast_group->register_rpc_callback(
+            rpc_handler_t::bind<rpc::RPCManager, &rpc::RPCManager::rpc_message_handler>(rpc_manager));
+    curr_view.get().multicast_group->register_rpc_batch_callback(
+            rpc_batch_handler_t::bind<rpc::RPCManager, &rpc::RPCManager::rpc_batch_handler>(rpc_manager));
     view_manager.add_view_upcall([this](const View& new_view) {
         rpc_manager.new_view_callback(new_view);
     });
+    view_manager.add_view_upcall([this](const View& new_view) {
+        std::lock_guard<std::mutex> lock(shard_router_subscriptions_mutex);
+        shard_router_subscriptions.remove_if([&new_view](const std::function<bool(const View&)>& push) {
+            return !push(new_view);
+        });
+    });
     view_manager.register_send_object_upcall([this](subgroup_id_t subgroup_id, node_id_t new_node_id) {
-        objects_by_subgroup_id.at(subgroup_id).get().send_object(rpc_manager.get_socket(new_node_id).get());
+        ReplicatedObject* object = &objects_by_subgroup_id.at(subgroup_id).get();
+        // Serialize it now, so the new member gets the state as of this view
+        // change even though the transfer finishes later. Persistent fields
+        // are only referenced, since a member rejoining with its old logs
+        // needs just the entries it missed, which depend on what it has.
+        auto frontier = std::make_shared<std::vector<char>>(object->log_frontier());
+        auto state = std::make_shared<state_transfer::StateBuffer>(object->object_size_by_reference());
+        object->serialize_object_by_reference(state->data());
+        state_sender.start(new_node_id, [this, new_node_id, object, frontier, state]() {
+            LockedReference<std::unique_lock<std::mutex>, tcp::socket> socket
+                    = rpc_manager.get_socket(new_node_id);
+            std::vector<char> receiver_frontier;
+            if(!state_transfer::receive_buffer(socket.get(), receiver_frontier)) {
+                logger->warn("Failed to receive the log frontier of node {}", new_node_id);
+                return;
+            }
+            // Reading the log is safe here, since entries past the frontier
+            // are only ever appended and it doesn't look at them
+            std::vector<char> catch_up = object->log_catch_up(receiver_frontier.data(), frontier->data());
+            state_transfer::StateBuffer catch_up_state(catch_up.size());
+            memcpy(catch_up_state.data(), catch_up.data(), catch_up.size());
+            if(!state_transfer::send_state(socket.get(), catch_up_state)
+               || !state_transfer::send_state(socket.get(), *state)) {
+                logger->warn("Failed to send object state to node {}", new_node_id);
+            }
+        });
     });
     view_manager.register_initialize_objects_upcall([this](node_id_t my_id, const View& view,
                                                            const vector_int64_2d& old_shard_leaders) {
@@ -252,6 +321,15 @@ void Group<ReplicatedTypes...>::set_up_components() {
         receive_objects(subgroups_and_leaders);
         raw_subgroups = construct_raw_subgroups(view);
     });
+    view_manager.register_checkpoint_upcall([this](subgroup_id_t subgroup_id, const std::string& target_path,
+                                                   uint64_t cut_us) -> persistence_version_t {
+        auto object = objects_by_subgroup_id.find(subgroup_id);
+        // Raw subgroups have no logs to copy
+        if(object == objects_by_subgroup_id.end()) {
+            return -1;
+        }
+        return object->second.get().checkpoint_logs(target_path, HLC{cut_us, 0});
+    });
 }
 
 template <typename... ReplicatedTypes>
@@ -338,17 +416,85 @@ ShardIterator<SubgroupType> Group<ReplicatedTypes...>::get_shard_iterator(uint32
     }
 }
 
+template <typename... ReplicatedTypes>
+template <typename SubgroupType>
+std::shared_ptr<ShardRouter<SubgroupType>> Group<ReplicatedTypes...>::get_shard_router(
+        uint32_t subgroup_index, ReplicaSelection selection, std::function<bool(node_id_t)> is_local) {
+    try {
+        auto& EC = external_callers.template get<SubgroupType>().at(subgroup_index);
+        auto shard_members_in = [subgroup_index](const View& view) {
+            auto subgroup_id = view.subgroup_ids_by_type.at(typeid(SubgroupType)).at(subgroup_index);
+            std::vector<std::vector<node_id_t>> shard_members;
+            for(const SubView& shard_view : view.subgroup_shard_views.at(subgroup_id)) {
+                shard_members.push_back(shard_view.members);
+            }
+            return shard_members;
+        };
+        std::shared_ptr<ShardRouter<SubgroupType>> router;
+        {
+            // Subscribing with the view locked means no view change is missed
+            SharedLockedReference<View> curr_view = view_manager.get_current_view();
+            router = std::make_shared<ShardRouter<SubgroupType>>(
+                    EC, shard_members_in(curr_view.get()), selection, std::move(is_local), 64, curr_view.get().vid);
+            std::weak_ptr<ShardRouter<SubgroupType>> subscriber = router;
+            std::lock_guard<std::mutex> lock(shard_router_subscriptions_mutex);
+            shard_router_subscriptions.emplace_back([subscriber, shard_members_in](const View& new_view) {
+                auto router = subscriber.lock();
+                if(!router) {
+                    return false;
+                }
+                if(new_view.is_adequately_provisioned) {
+                    router->update_layout(new_view.vid, shard_members_in(new_view));
+                }
+                return true;
+            });
+        }
+        return router;
+    } catch(std::out_of_range& ex) {
+        throw invalid_subgroup_exception("No ExternalCaller exists for the requested subgroup; this node may be a member of the subgroup");
+    }
+}
+
 template <typename... ReplicatedTypes>
 void Group<ReplicatedTypes...>::receive_objects(const std::set<std::pair<subgroup_id_t, node_id_t>>& subgroups_and_leaders) {
-    //This will receive one object from each shard leader in ascending order of subgroup ID
+    //Each leader sends its objects in ascending order of subgroup ID
+    std::map<node_id_t, std::vector<subgroup_id_t>> subgroups_by_leader;
     for(const auto& subgroup_and_leader : subgroups_and_leaders) {
-        LockedReference<std::unique_lock<std::mutex>, tcp::socket> leader_socket
-                = rpc_manager.get_socket(subgroup_and_leader.second);
-        std::size_t buffer_size;
-        bool success = leader_socket.get().read((char*)&buffer_size, sizeof(buffer_size));
-        assert(success);
-        char buffer[buffer_size];
-        objects_by_subgroup_id.at(subgroup_and_leader.first).get().receive_object(buffer);
+        subgroups_by_leader[subgroup_and_leader.second].push_back(subgroup_and_leader.first);
+    }
+    std::vector<std::future<void>> leaders_done;
+    for(const auto& leader_and_subgroups : subgroups_by_leader) {
+        leaders_done.emplace_back(std::async(std::launch::async, [this, &leader_and_subgroups]() {
+            const node_id_t leader = leader_and_subgroups.first;
+            LockedReference<std::unique_lock<std::mutex>, tcp::socket> leader_socket
+                    = rpc_manager.get_socket(leader);
+            std::future<void> deserialized;
+            for(subgroup_id_t subgroup_id : leader_and_subgroups.second) {
+                ReplicatedObject& object = objects_by_subgroup_id.at(subgroup_id).get();
+                // The leader sends only what our logs are missing
+                std::shared_ptr<state_transfer::StateBuffer> catch_up;
+                std::shared_ptr<state_transfer::StateBuffer> state;
+                if(!state_transfer::send_buffer(leader_socket.get(), object.log_frontier())
+                   || !(catch_up = state_transfer::receive_state(leader_socket.get()))
+                   || !(state = state_transfer::receive_state(leader_socket.get()))) {
+                    throw derecho_exception("Failed to receive the state of subgroup "
+                                            + std::to_string(subgroup_id) + " from node " + std::to_string(leader));
+                }
+                if(deserialized.valid()) {
+                    deserialized.get();
+                }
+                deserialized = std::async(std::launch::async, [&object, catch_up, state]() {
+                    object.apply_log_catch_up(catch_up->data());
+                    object.receive_object(state->data());
+                });
+            }
+            if(deserialized.valid()) {
+                deserialized.get();
+            }
+        }));
+    }
+    for(auto& leader_done : leaders_done) {
+        leader_done.get();
     }
 }
 
@@ -372,6 +518,92 @@ void Group<ReplicatedTypes...>::barrier_sync() {
     view_manager.barrier_sync();
 }
 
+template <typename... ReplicatedTypes>
+template <typename SubgroupType>
+subgroup_id_t Group<ReplicatedTypes...>::subgroup_id_of(uint32_t subgroup_index) {
+    View& curr_view = view_manager.get_current_view().get();
+    try {
+        return curr_view.subgroup_ids_by_type.at(std::type_index(typeid(SubgroupType))).at(subgroup_index);
+    } catch(std::out_of_range& ex) {
+        throw invalid_subgroup_exception("No subgroup of the requested type and index exists");
+    }
+}
+
+template <typename... ReplicatedTypes>
+template <typename SubgroupType>
+void Group<ReplicatedTypes...>::barrier_sync(uint32_t subgroup_index) {
+    view_manager.barrier_sync(subgroup_id_of<SubgroupType>(subgroup_index));
+}
+
+template <typename... ReplicatedTypes>
+template <typename SubgroupType, typename T>
+std::vector<T> Group<ReplicatedTypes...>::allgather(uint32_t subgroup_index, const T& value) {
+    static_assert(std::is_trivially_copyable<T>::value && sizeof(T) <= sizeof(int64_t),
+                  "allgather values must be trivially copyable and fit in 8 bytes");
+    int64_t word = 0;
+    memcpy(&word, &value, sizeof(T));
+    std::vector<T> values;
+    for(const auto& gathered : view_manager.allgather_word(subgroup_id_of<SubgroupType>(subgroup_index), word)) {
+        values.emplace_back();
+        if(gathered.second) {
+            memcpy(&values.back(), &gathered.first, sizeof(T));
+        }
+    }
+    return values;
+}
+
+template <typename... ReplicatedTypes>
+template <typename SubgroupType>
+uint64_t Group<ReplicatedTypes...>::try_lock(uint32_t subgroup_index, uint32_t lock_index) {
+    return view_manager.try_lock(subgroup_id_of<SubgroupType>(subgroup_index), lock_index);
+}
+
+template <typename... ReplicatedTypes>
+template <typename SubgroupType>
+uint64_t Group<ReplicatedTypes...>::lock(uint32_t subgroup_index, uint32_t lock_index) {
+    return view_manager.lock(subgroup_id_of<SubgroupType>(subgroup_index), lock_index);
+}
+
+template <typename... ReplicatedTypes>
+template <typename SubgroupType>
+bool Group<ReplicatedTypes...>::unlock(uint32_t subgroup_index, uint64_t token, uint32_t lock_index) {
+    return view_manager.unlock(subgroup_id_of<SubgroupType>(subgroup_index), lock_index, token);
+}
+
+template <typename... ReplicatedTypes>
+template <typename SubgroupType, typename T, typename ReduceOp>
+T Group<ReplicatedTypes...>::allreduce(uint32_t subgroup_index, const T& value, ReduceOp op) {
+    static_assert(std::is_trivially_copyable<T>::value && sizeof(T) <= sizeof(int64_t),
+                  "allreduce values must be trivially copyable and fit in 8 bytes");
+    int64_t word = 0;
+    memcpy(&word, &value, sizeof(T));
+    std::experimental::optional<T> result;
+    for(const auto& gathered : view_manager.allgather_word(subgroup_id_of<SubgroupType>(subgroup_index), word)) {
+        if(!gathered.second) {
+            continue;
+        }
+        T member_value;
+        memcpy(&member_value, &gathered.first, sizeof(T));
+        result = result ? op(*result, member_value) : member_value;
+    }
+    // This node's own value always arrives
+    return *result;
+}
+
+template <typename... ReplicatedTypes>
+bool Group<ReplicatedTypes...>::checkpoint_at(const std::string& target_path, uint64_t cut_us) {
+    return view_manager.checkpoint(target_path, cut_us);
+}
+
+template <typename... ReplicatedTypes>
+uint64_t Group<ReplicatedTypes...>::checkpoint(const std::string& target_path) {
+    // The same clock as the message timestamps the stability frontier uses
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const uint64_t cut_us = now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+    return checkpoint_at(target_path, cut_us) ? cut_us : 0;
+}
+
 template <typename... ReplicatedTypes>
 void Group<ReplicatedTypes...>::debug_print_status() const {
     view_manager.debug_print_status();
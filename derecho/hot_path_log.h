@@ -0,0 +1,42 @@
+/**
+ * @file hot_path_log.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+/**
+ * Log statements on the paths that every message takes, which compile to
+ * nothing, arguments and all, unless their level is at least
+ * DERECHO_LOG_ACTIVE_LEVEL, so production builds don't pay for a level
+ * check and the formatting arguments per message. The levels are those of
+ * spdlog: 0 is trace, 1 debug, 2 info and so on. Statements that are compiled
+ * in still obey the logger's level at runtime, like the plain logger calls
+ * used everywhere else, which stay runtime-configurable.
+ */
+#ifndef DERECHO_LOG_ACTIVE_LEVEL
+#ifdef NDEBUG
+#define DERECHO_LOG_ACTIVE_LEVEL 2
+#else
+#define DERECHO_LOG_ACTIVE_LEVEL 0
+#endif
+#endif
+
+#if DERECHO_LOG_ACTIVE_LEVEL <= 0
+#define DERECHO_HOT_TRACE(logger, ...) (logger)->trace(__VA_ARGS__)
+#else
+#define DERECHO_HOT_TRACE(logger, ...) \
+    do {                               \
+    } while(0)
+#endif
+
+#if DERECHO_LOG_ACTIVE_LEVEL <= 1
+#define DERECHO_HOT_DEBUG(logger, ...) (logger)->debug(__VA_ARGS__)
+#else
+#define DERECHO_HOT_DEBUG(logger, ...) \
+    do {                               \
+    } while(0)
+#endif
@@ -29,10 +29,22 @@ int main(int argc, char* argv[]) {
     //of the file is the latest one.
     message_metadata dummy_for_size;
     std::size_t size_of_metadata = mutils::bytes_size(dummy_for_size);
-    metadata_file.seekg(-1 * size_of_metadata, std::ios::end);
-    char buffer[size_of_metadata];
-    metadata_file.read(buffer, size_of_metadata);
-    std::unique_ptr<message_metadata> metadata = mutils::from_bytes<message_metadata>(nullptr, buffer);
+    metadata_file.seekg(0, std::ios::end);
+    std::unique_ptr<message_metadata> metadata;
+    if(metadata_file.tellg() >= (std::streamoff)(sizeof(header) + size_of_metadata)) {
+        metadata_file.seekg(-1 * size_of_metadata, std::ios::end);
+        char buffer[size_of_metadata];
+        metadata_file.read(buffer, size_of_metadata);
+        metadata = mutils::from_bytes<message_metadata>(nullptr, buffer);
+    } else {
+        //Everything in the log has been compacted away, so the latest
+        //message is the one recorded in the checkpoint
+        metadata = load_object<message_metadata>(filename + CHECKPOINT_EXTENSION);
+    }
+    if(!metadata) {
+        std::cout << "0 0 0" << std::endl;
+        return 0;
+    }
     std::cout << metadata->view_id << " " << metadata->sender << " " << metadata->index << std::endl;
     return 0;
 }
@@ -0,0 +1,221 @@
+/**
+ * @file log_shipping.cpp
+ *
+ * @date Oct 14, 2026
+ */
+
+#include "log_shipping.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "thread_placement.h"
+
+namespace derecho {
+
+namespace log_shipping {
+
+static bool send_frontier(tcp::socket& socket, const std::vector<char>& frontier) {
+    const uint64_t size = frontier.size();
+    const struct iovec buffers[2] = {{(void*)&size, sizeof(size)},
+                                     {(void*)frontier.data(), frontier.size()}};
+    return socket.write_vectored(buffers, 2);
+}
+
+static bool receive_frontier(tcp::socket& socket, std::vector<char>& frontier) {
+    uint64_t size;
+    if(!socket.read((char*)&size, sizeof(size))) {
+        return false;
+    }
+    frontier.resize(size);
+    return socket.read(frontier.data(), size);
+}
+}  // namespace log_shipping
+
+LogShipper::LogShipper(ReplicatedObject& object, subgroup_id_t subgroup_num,
+                       const std::string& receiver_host, uint16_t receiver_port,
+                       ns_persistent::LogCompression codec)
+        : object(object),
+          subgroup_num(subgroup_num),
+          receiver_host(receiver_host),
+          receiver_port(receiver_port),
+          codec(ns_persistent::codecAvailable(codec) ? codec : ns_persistent::LC_NONE),
+          logger(spdlog::get("debug_log")),
+          shipper_thread(&LogShipper::ship_loop, this) {}
+
+LogShipper::~LogShipper() {
+    {
+        std::lock_guard<std::mutex> lock(frontier_mutex);
+        shutdown = true;
+        if(connection_fd >= 0) {
+            ::shutdown(connection_fd, SHUT_RDWR);
+        }
+    }
+    frontier_cv.notify_all();
+    shipper_thread.join();
+}
+
+void LogShipper::persisted(subgroup_id_t subgroup_num, persistence_version_t version) {
+    if(subgroup_num != this->subgroup_num) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(frontier_mutex);
+        if(version <= persisted_frontier) {
+            return;
+        }
+        persisted_frontier = version;
+    }
+    frontier_cv.notify_all();
+}
+
+void LogShipper::ship_loop() {
+    pthread_setname_np(pthread_self(), "log_shipper");
+    place_this_thread("log_shipper");
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(frontier_mutex);
+            if(shutdown) {
+                return;
+            }
+        }
+        try {
+            tcp::socket receiver_socket(receiver_host, receiver_port, log_shipping::reconnect_interval_ms);
+            {
+                std::lock_guard<std::mutex> lock(frontier_mutex);
+                if(shutdown) {
+                    return;
+                }
+                connection_fd = receiver_socket.get_fd();
+            }
+            ship_to(receiver_socket);
+            std::lock_guard<std::mutex> lock(frontier_mutex);
+            connection_fd = -1;
+            if(shutdown) {
+                return;
+            }
+        } catch(tcp::connection_failure&) {
+            // The receiver isn't up yet; keep trying.
+            continue;
+        }
+        if(logger) {
+            logger->warn("Lost the connection to the log receiver at {}:{} for subgroup {}",
+                         receiver_host, receiver_port, subgroup_num);
+        }
+        std::unique_lock<std::mutex> lock(frontier_mutex);
+        frontier_cv.wait_for(lock, std::chrono::milliseconds(log_shipping::reconnect_interval_ms),
+                             [this]() { return shutdown; });
+    }
+}
+
+void LogShipper::ship_to(tcp::socket& receiver_socket) {
+    std::vector<char> receiver_frontier;
+    if(!log_shipping::receive_frontier(receiver_socket, receiver_frontier)) {
+        return;
+    }
+    std::vector<char> compressed;
+    persistence_version_t shipped = -1;
+    while(true) {
+        persistence_version_t upto;
+        {
+            std::unique_lock<std::mutex> lock(frontier_mutex);
+            frontier_cv.wait(lock, [&]() { return shutdown || persisted_frontier > shipped; });
+            if(shutdown) {
+                return;
+            }
+            upto = persisted_frontier;
+        }
+        // The logs are read outside the lock, so persisted() never waits for them.
+        const std::vector<char> batch = object.log_shipment(receiver_frontier.data(), upto);
+        log_shipping::batch_header header{upto, ns_persistent::LC_NONE, batch.size(), batch.size()};
+        const char* payload = batch.data();
+        if(codec != ns_persistent::LC_NONE && batch.size() >= log_shipping::compress_threshold) {
+            const uint64_t compressed_size = ns_persistent::compressData(codec, batch.data(), batch.size(), compressed);
+            if(compressed_size > 0) {
+                header.codec = codec;
+                header.wire_size = compressed_size;
+                payload = compressed.data();
+            }
+        }
+        const struct iovec buffers[2] = {{&header, sizeof(header)},
+                                         {(void*)payload, header.wire_size}};
+        if(!receiver_socket.write_vectored(buffers, 2)
+           || !log_shipping::receive_frontier(receiver_socket, receiver_frontier)) {
+            return;
+        }
+        shipped = upto;
+        shipped_frontier = upto;
+    }
+}
+
+LogReceiver::LogReceiver(ReplicatedObject& object, uint16_t port)
+        : object(object),
+          listener(port),
+          logger(spdlog::get("debug_log")),
+          receiver_thread(&LogReceiver::receive_loop, this) {}
+
+LogReceiver::~LogReceiver() {
+    shutdown = true;
+    {
+        std::lock_guard<std::mutex> lock(connection_mutex);
+        if(connection_fd >= 0) {
+            ::shutdown(connection_fd, SHUT_RDWR);
+        }
+    }
+    receiver_thread.join();
+}
+
+void LogReceiver::receive_loop() {
+    pthread_setname_np(pthread_self(), "log_receiver");
+    place_this_thread("log_receiver");
+    while(!shutdown && !diverged) {
+        try {
+            tcp::socket shipper_socket = listener.accept(log_shipping::reconnect_interval_ms);
+            {
+                std::lock_guard<std::mutex> lock(connection_mutex);
+                if(shutdown) {
+                    return;
+                }
+                connection_fd = shipper_socket.get_fd();
+            }
+            receive_from(shipper_socket);
+            std::lock_guard<std::mutex> lock(connection_mutex);
+            connection_fd = -1;
+        } catch(tcp::connection_failure&) {
+            // No shipper connected; check for shutdown and keep listening.
+        }
+    }
+}
+
+void LogReceiver::receive_from(tcp::socket& shipper_socket) {
+    std::vector<char> batch;
+    std::vector<char> compressed;
+    // The frontier tells the shipper where to resume.
+    while(log_shipping::send_frontier(shipper_socket, object.log_frontier())) {
+        log_shipping::batch_header header;
+        if(!shipper_socket.read((char*)&header, sizeof(header))) {
+            return;
+        }
+        std::vector<char>& wire = (header.codec == ns_persistent::LC_NONE) ? batch : compressed;
+        wire.resize(header.wire_size);
+        if(!shipper_socket.read(wire.data(), header.wire_size)) {
+            return;
+        }
+        if(header.codec != ns_persistent::LC_NONE) {
+            ns_persistent::inflateBytes((ns_persistent::LogCompression)header.codec, compressed.data(),
+                                        header.wire_size, header.raw_size, batch);
+        }
+        const std::vector<std::string> values = object.apply_log_shipment(batch.data());
+        if(!values.empty()) {
+            if(logger) {
+                logger->error("The log of {} can no longer follow on from the shipper's, {} fields in all; "
+                              "this copy needs a state transfer",
+                              values.front(), values.size());
+            }
+            diverged = true;
+            return;
+        }
+        received_frontier = header.upto;
+    }
+}
+}  // namespace derecho
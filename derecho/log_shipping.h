@@ -0,0 +1,162 @@
+/**
+ * @file log_shipping.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "persistent/FilePersistLog.hpp"
+#include "spdlog/spdlog.h"
+#include "tcp/tcp.h"
+
+#include "derecho_internal.h"
+#include "replicated.h"
+
+namespace derecho {
+
+/**
+ * Asynchronous log shipping to a warm standby at another site: a LogShipper
+ * on a member of a shard tails the logs of the shard's replicated object up
+ * to the global persistence frontier and streams them in batches over TCP to
+ * a LogReceiver, which appends them to the logs of a copy of the object in
+ * another Derecho group, or in a process that only reads it.
+ *
+ * The shipper never holds up the group: it is told about new frontiers
+ * through the global persistence callback, which only records the frontier,
+ * and reads the logs on its own thread. Flow control is one batch in flight,
+ * acknowledged with the receiver's log frontier. Whatever persists while a
+ * batch is in flight goes out in the next one, so over a slow link batches
+ * grow instead of queueing, and the shipper's memory doesn't grow with the
+ * lag. Each batch follows on from the frontier the receiver acknowledged, so
+ * a shipper that reconnects, or a new one after a failover at the source,
+ * resumes from the version the standby already has.
+ */
+namespace log_shipping {
+
+/** Precedes each batch on the wire */
+struct batch_header {
+    /** The global persistence frontier the batch brings the receiver up to */
+    persistence_version_t upto;
+    /** How the batch is compressed, see ns_persistent::LogCompression */
+    uint32_t codec;
+    /** The size of the batch before and after compression */
+    uint64_t raw_size;
+    uint64_t wire_size;
+};
+
+/** Batches smaller than this aren't worth compressing */
+constexpr uint64_t compress_threshold = 4096;
+/** How long the shipper waits between attempts to reach the receiver */
+constexpr int reconnect_interval_ms = 1000;
+}  // namespace log_shipping
+
+/**
+ * Ships the logs of one subgroup's replicated object to a LogReceiver. The
+ * object must outlive the shipper.
+ */
+class LogShipper {
+    ReplicatedObject& object;
+    const subgroup_id_t subgroup_num;
+    const std::string receiver_host;
+    const uint16_t receiver_port;
+    const ns_persistent::LogCompression codec;
+    std::shared_ptr<spdlog::logger> logger;
+
+    std::mutex frontier_mutex;
+    std::condition_variable frontier_cv;
+    /** Protected by frontier_mutex; the latest global persistence frontier */
+    persistence_version_t persisted_frontier = -1;
+    /** Protected by frontier_mutex; the socket of the connection being used,
+     * or -1, so that it can be shut down to stop the shipper */
+    int connection_fd = -1;
+    bool shutdown = false;
+    /** The latest version the receiver acknowledged */
+    std::atomic<persistence_version_t> shipped_frontier{-1};
+    std::thread shipper_thread;
+
+    void ship_loop();
+    /** Ships batches over a connection until it fails or the shipper stops */
+    void ship_to(tcp::socket& receiver_socket);
+
+public:
+    /**
+     * @param object The replicated object whose logs are shipped
+     * @param subgroup_num The subgroup of the object, whose global persistence
+     * frontiers persisted() takes
+     * @param receiver_host The address of the LogReceiver
+     * @param receiver_port The port the LogReceiver listens on
+     * @param codec How to compress the batches, if the codec is built in
+     */
+    LogShipper(ReplicatedObject& object, subgroup_id_t subgroup_num,
+               const std::string& receiver_host, uint16_t receiver_port,
+               ns_persistent::LogCompression codec = ns_persistent::LC_NONE);
+    ~LogShipper();
+
+    /**
+     * Reports a global persistence frontier; it has the signature of the
+     * global persistence callback, and ignores the frontiers of other
+     * subgroups. It only records the frontier, so it never blocks for long.
+     */
+    void persisted(subgroup_id_t subgroup_num, persistence_version_t version);
+
+    /** @return The latest version the receiver has acknowledged, or -1 */
+    persistence_version_t get_shipped_version() const {
+        return shipped_frontier;
+    }
+};
+
+/**
+ * Receives the batches of a LogShipper, one shipper at a time, and appends
+ * them to the logs of a copy of the replicated object. The object must
+ * outlive the receiver, and shouldn't be updated by anything else meanwhile.
+ * If a batch carries a field as a value, the copy's log has diverged from the
+ * source or the source no longer has the entries it needs, and a log can't
+ * take a value; the receiver then stops, and the copy needs a state transfer.
+ */
+class LogReceiver {
+    ReplicatedObject& object;
+    tcp::connection_listener listener;
+    std::shared_ptr<spdlog::logger> logger;
+
+    std::mutex connection_mutex;
+    /** Protected by connection_mutex; the socket of the shipper being
+     * served, or -1 */
+    int connection_fd = -1;
+    std::atomic<bool> shutdown{false};
+    std::atomic<bool> diverged{false};
+    /** The frontier of the latest batch applied */
+    std::atomic<persistence_version_t> received_frontier{-1};
+    std::thread receiver_thread;
+
+    void receive_loop();
+    /** Applies batches from a shipper until the connection fails */
+    void receive_from(tcp::socket& shipper_socket);
+
+public:
+    /**
+     * @param object The copy of the replicated object to append to
+     * @param port The port to listen for the shipper on
+     */
+    LogReceiver(ReplicatedObject& object, uint16_t port);
+    ~LogReceiver();
+
+    /** @return The frontier of the latest batch applied, or -1 */
+    persistence_version_t get_received_version() const {
+        return received_frontier;
+    }
+    /** @return True if the receiver stopped because the copy's logs can't
+     * follow on from the shipper's any more */
+    bool has_diverged() const {
+        return diverged;
+    }
+};
+}  // namespace derecho
@@ -11,6 +11,7 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <tuple>
 
 #include "persistence.h"
 #include <mutils-serialization/SerializationSupport.hpp>
@@ -45,9 +46,28 @@ int main(int argc, char* argv[]) {
     //Scan through the metadata blocks until we find the one with the right sequence number
     uint32_t vid = 0, sender = 0;
     uint64_t index = 0;
-    while(!(vid == target_vid && sender == target_sender && index == target_index) && metadata_file) {
-        metadata_file.read(buffer, size_of_metadata);
+    bool first_record = true;
+    bool whole_log = false;
+    while(!(vid == target_vid && sender == target_sender && index == target_index)
+          && metadata_file.read(buffer, size_of_metadata)) {
         auto metadata = mutils::from_bytes<message_metadata>(nullptr, buffer);
+        if(first_record) {
+            first_record = false;
+            //If the target message is older than the first one left after
+            //compaction, the whole log is the tail
+            const uint32_t first_vid = metadata->view_id, first_sender = metadata->sender;
+            const uint64_t first_index = metadata->index;
+            if(std::make_tuple(first_vid, first_index, first_sender)
+               > std::make_tuple(target_vid, target_index, target_sender)) {
+                whole_log = true;
+                if(print_metadata) {
+                    target_offset = sizeof(file_header);
+                } else {
+                    target_offset = metadata->offset;
+                }
+                break;
+            }
+        }
         vid = metadata->view_id;
         sender = metadata->sender;
         index = metadata->index;
@@ -58,12 +78,16 @@ int main(int argc, char* argv[]) {
             target_size = metadata->length;
         }
     }
+    if(whole_log) {
+        target_size = 0;
+    }
     //Get the size of the whole file, so we can subtract from it
     std::streamoff file_size = 0;
     if(print_metadata) {
+        metadata_file.clear();
         metadata_file.seekg(0, std::ios::end);
         file_size = metadata_file.tellg();
-        target_size = size_of_metadata;
+        target_size = whole_log ? 0 : size_of_metadata;
     } else {
         std::ifstream logfile(filename, std::ios::binary);
         logfile.seekg(0, std::ios::end);
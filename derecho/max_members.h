@@ -1 +0,0 @@
-static constexpr int MAX_MEMBERS = 2;
@@ -0,0 +1,102 @@
+/**
+ * @file message_stages.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <mutex>
+
+#include "metrics.h"
+
+namespace derecho {
+
+/**
+ * Stamps each of this node's messages in a subgroup with the time it reached
+ * each stage of its life, and once it has reached its last stage, records the
+ * time it took to get from each stage to the next in the subgroup's metrics.
+ * Messages are identified by their index among this node's messages. The
+ * stamps are taken on several threads, so the tracker has a lock of its own;
+ * it is only made when stage tracking is turned on.
+ */
+class MessageStageTracker {
+    using stamps_t = std::array<uint64_t, metrics::NUM_MESSAGE_STAGES>;
+    /** Beyond this many messages in flight, the oldest are given up on, so
+     * that messages that never reach their last stage don't pile up */
+    static constexpr std::size_t max_tracked_messages = 1 << 16;
+
+    std::mutex mutex;
+    std::map<long long int, stamps_t> messages;
+    /** The index of the message whose buffer was handed out last */
+    long long int last_acquired = -1;
+    const metrics::MessageStage last_stage;
+    metrics::SubgroupMetrics& subgroup_metrics;
+
+    void record(const stamps_t& stamps) {
+        for(unsigned stage = metrics::SEND_ISSUED; stage < metrics::NUM_MESSAGE_STAGES; ++stage) {
+            if(stamps[stage] != 0 && stamps[stage - 1] != 0 && stamps[stage] >= stamps[stage - 1]) {
+                subgroup_metrics.message_stage_ns[stage - 1].record(stamps[stage] - stamps[stage - 1]);
+            }
+        }
+    }
+
+    void stamp_locked(std::map<long long int, stamps_t>::iterator message, metrics::MessageStage stage, uint64_t time) {
+        if(message->second[stage] == 0) {
+            message->second[stage] = time;
+        }
+        if(stage == last_stage) {
+            record(message->second);
+            messages.erase(message);
+        }
+    }
+
+public:
+    /**
+     * @param last_stage The last stage messages in the subgroup reach, which
+     * depends on its delivery mode
+     */
+    MessageStageTracker(metrics::MessageStage last_stage, metrics::SubgroupMetrics& subgroup_metrics)
+            : last_stage(last_stage), subgroup_metrics(subgroup_metrics) {}
+
+    /** Starts tracking a message, whose buffer was just handed out. */
+    void acquired(long long int index, uint64_t time) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(messages.size() >= max_tracked_messages) {
+            messages.erase(messages.begin());
+        }
+        messages[index][metrics::BUFFER_ACQUIRED] = time;
+        last_acquired = index;
+    }
+
+    /** Stamps a message with the time it reached a later stage than
+     * BUFFER_ACQUIRED, if it is being tracked. */
+    void stamp(long long int index, metrics::MessageStage stage, uint64_t time) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto message = messages.find(index);
+        if(message != messages.end()) {
+            stamp_locked(message, stage, time);
+        }
+    }
+
+    /** Stamps the message whose buffer was handed out last. */
+    void stamp_last_acquired(metrics::MessageStage stage, uint64_t time) {
+        stamp(last_acquired, stage, time);
+    }
+
+    /** Stamps every message up to an index that hasn't reached a stage yet. */
+    void stamp_through(long long int max_index, metrics::MessageStage stage, uint64_t time) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto message = messages.begin(); message != messages.end() && message->first <= max_index;) {
+            auto next = std::next(message);
+            stamp_locked(message, stage, time);
+            message = next;
+        }
+    }
+};
+
+}  // namespace derecho
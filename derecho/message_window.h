@@ -0,0 +1,184 @@
+/**
+ * @file message_window.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace derecho {
+
+/**
+ * An ordered collection of messages keyed by sequence number, stored in a ring
+ * of preallocated slots indexed by sequence number modulo the ring's capacity.
+ * It replaces a std::map on the message delivery path: the keys that are live
+ * at any one time always fall within a few windows of each other, so lookups,
+ * insertions and removals are array operations that never touch the allocator.
+ * If the live keys ever span more than the capacity (for example, when a
+ * sender skips many turns at once), the ring doubles in size; this happens
+ * rarely, and never shrinks back.
+ * @tparam T The message type; it must be default-constructible and movable.
+ */
+template <typename T>
+class MessageWindow {
+    struct Slot {
+        bool used = false;
+        long long int seq = 0;
+        T value;
+    };
+
+    std::vector<Slot> slots;
+    std::size_t mask;
+    /** The smallest sequence number that may be in the window. */
+    long long int low_seq = 0;
+    /** One more than the largest sequence number in the window. */
+    long long int high_seq = 0;
+    std::size_t count = 0;
+
+    Slot& slot_for(long long int seq) {
+        return slots[static_cast<std::size_t>(seq) & mask];
+    }
+
+    /** Grows the ring until the range [low, high) fits in it. */
+    void grow_to_fit(long long int low, long long int high) {
+        std::size_t capacity = slots.size();
+        while(static_cast<std::size_t>(high - low) > capacity) {
+            capacity *= 2;
+        }
+        if(capacity == slots.size()) {
+            return;
+        }
+        std::vector<Slot> old_slots(capacity);
+        old_slots.swap(slots);
+        mask = capacity - 1;
+        for(Slot& slot : old_slots) {
+            if(slot.used) {
+                slot_for(slot.seq) = std::move(slot);
+            }
+        }
+    }
+
+    /** Moves low_seq forward to the first occupied slot. */
+    void advance_low() {
+        if(count == 0) {
+            low_seq = high_seq;
+            return;
+        }
+        while(!slot_for(low_seq).used) {
+            ++low_seq;
+        }
+    }
+
+public:
+    /**
+     * @param min_capacity The number of slots to preallocate; rounded up to a
+     * power of 2. This should cover all the messages that can be in flight at
+     * once, e.g. the window size times the number of senders.
+     */
+    explicit MessageWindow(std::size_t min_capacity = 1) {
+        std::size_t capacity = 1;
+        while(capacity < min_capacity) {
+            capacity *= 2;
+        }
+        slots.resize(capacity);
+        mask = capacity - 1;
+    }
+    MessageWindow(MessageWindow&&) = default;
+    MessageWindow& operator=(MessageWindow&&) = default;
+
+    bool empty() const { return count == 0; }
+    std::size_t size() const { return count; }
+
+    /** @return A pointer to the message with this sequence number, or nullptr if there is none. */
+    T* find(long long int seq) {
+        if(count == 0 || seq < low_seq || seq >= high_seq) {
+            return nullptr;
+        }
+        Slot& slot = slot_for(seq);
+        return (slot.used && slot.seq == seq) ? &slot.value : nullptr;
+    }
+
+    /**
+     * Stores a message under a sequence number, replacing any message that
+     * already has that sequence number.
+     * @return A reference to the stored message.
+     */
+    T& insert(long long int seq, T&& value) {
+        if(count == 0) {
+            low_seq = seq;
+            high_seq = seq + 1;
+        } else {
+            long long int new_low = std::min(low_seq, seq);
+            long long int new_high = std::max(high_seq, seq + 1);
+            grow_to_fit(new_low, new_high);
+            low_seq = new_low;
+            high_seq = new_high;
+        }
+        Slot& slot = slot_for(seq);
+        if(!slot.used) {
+            slot.used = true;
+            slot.seq = seq;
+            ++count;
+        }
+        slot.value = std::move(value);
+        return slot.value;
+    }
+
+    /** @return The smallest sequence number in the window. The window must not be empty. */
+    long long int front_seq() {
+        advance_low();
+        return low_seq;
+    }
+
+    /** @return The message with the smallest sequence number. The window must not be empty. */
+    T& front() {
+        return slot_for(front_seq()).value;
+    }
+
+    /** Removes the message with the smallest sequence number. The window must not be empty. */
+    void pop_front() {
+        erase(front_seq());
+    }
+
+    /** Removes the message with this sequence number, if there is one. */
+    void erase(long long int seq) {
+        if(!find(seq)) {
+            return;
+        }
+        Slot& slot = slot_for(seq);
+        slot.used = false;
+        slot.value = T();
+        --count;
+        if(seq == low_seq) {
+            advance_low();
+        }
+    }
+
+    /** Calls f(seq, message) for every message in the window, in sequence order. */
+    template <typename F>
+    void for_each(F&& f) {
+        for(long long int seq = low_seq; count > 0 && seq < high_seq; ++seq) {
+            Slot& slot = slot_for(seq);
+            if(slot.used && slot.seq == seq) {
+                f(seq, slot.value);
+            }
+        }
+    }
+
+    void clear() {
+        for(Slot& slot : slots) {
+            if(slot.used) {
+                slot.used = false;
+                slot.value = T();
+            }
+        }
+        count = 0;
+        low_seq = high_seq;
+    }
+};
+}  // namespace derecho
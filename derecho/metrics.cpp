@@ -0,0 +1,189 @@
+#include <memory>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+
+#include "metrics.h"
+#include "thread_placement.h"
+#include "tcp/tcp.h"
+
+namespace derecho {
+namespace metrics {
+
+const char* const message_stage_names[NUM_MESSAGE_STAGES] = {
+        "buffer_acquired", "send_issued", "sent", "stable", "delivered", "persisted", "globally_persisted"};
+
+constexpr unsigned Histogram::sub_bucket_bits;
+constexpr uint64_t Histogram::sub_buckets;
+constexpr std::size_t Histogram::num_buckets;
+
+uint64_t HistogramSnapshot::percentile(double q) const {
+    if(count == 0) {
+        return 0;
+    }
+    const uint64_t rank = std::max<uint64_t>(1, uint64_t(q * count + 0.5));
+    uint64_t seen = 0;
+    for(std::size_t bucket = 0; bucket < bucket_counts.size(); ++bucket) {
+        seen += bucket_counts[bucket];
+        if(seen >= rank) {
+            // The middle of the bucket, but never more than the largest value
+            const uint64_t lower = Histogram::bucket_lower_bound(bucket);
+            const uint64_t upper = bucket + 1 < Histogram::num_buckets
+                                           ? Histogram::bucket_lower_bound(bucket + 1) - 1
+                                           : UINT64_MAX;
+            return std::min(max, lower + (upper - lower) / 2);
+        }
+    }
+    return max;
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+    HistogramSnapshot snapshot;
+    snapshot.count = count.load(std::memory_order_relaxed);
+    snapshot.sum = sum.load(std::memory_order_relaxed);
+    snapshot.max = max.load(std::memory_order_relaxed);
+    snapshot.bucket_counts.resize(num_buckets);
+    for(std::size_t bucket = 0; bucket < num_buckets; ++bucket) {
+        snapshot.bucket_counts[bucket] = bucket_counts[bucket].load(std::memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+namespace {
+const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/**
+ * Writes a histogram as a Prometheus summary.
+ * @param labels The labels of the series, without braces, possibly empty
+ * @param scale What to multiply the recorded values by, e.g. to convert
+ * nanoseconds to the seconds Prometheus expects
+ */
+void write_summary(std::ostream& out, const std::string& name, const std::string& labels,
+                   const Histogram& histogram, double scale) {
+    const HistogramSnapshot snapshot = histogram.snapshot();
+    const std::string separator = labels.empty() ? "" : ",";
+    for(double q : quantiles) {
+        out << name << "{" << labels << separator << "quantile=\"" << q << "\"} "
+            << snapshot.percentile(q) * scale << "\n";
+    }
+    const std::string braced_labels = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << braced_labels << " " << snapshot.sum * scale << "\n";
+    out << name << "_count" << braced_labels << " " << snapshot.count << "\n";
+}
+
+void write_type(std::ostream& out, const std::string& name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+}
+}  // namespace
+
+void Registry::write_prometheus(std::ostream& out) const {
+    std::lock_guard<std::mutex> lock(subgroups_mutex);
+    auto per_subgroup = [&](const std::string& name, const char* type, const char* help,
+                            const std::function<void(const std::string&, const SubgroupMetrics&)>& write) {
+        write_type(out, name, type, help);
+        for(uint32_t subgroup_id = 0; subgroup_id < subgroups.size(); ++subgroup_id) {
+            write("subgroup=\"" + std::to_string(subgroup_id) + "\"", subgroups[subgroup_id]);
+        }
+    };
+    auto summary = [&](const std::string& name, const char* help, Histogram SubgroupMetrics::*histogram,
+                       double scale) {
+        per_subgroup(name, "summary", help, [&](const std::string& labels, const SubgroupMetrics& metrics) {
+            write_summary(out, name, labels, metrics.*histogram, scale);
+        });
+    };
+    auto counter = [&](const std::string& name, const char* help, Counter SubgroupMetrics::*counter) {
+        per_subgroup(name, "counter", help, [&](const std::string& labels, const SubgroupMetrics& metrics) {
+            out << name << "{" << labels << "} " << (metrics.*counter).get() << "\n";
+        });
+    };
+    auto gauge = [&](const std::string& name, const char* help, Gauge SubgroupMetrics::*gauge) {
+        per_subgroup(name, "gauge", help, [&](const std::string& labels, const SubgroupMetrics& metrics) {
+            out << name << "{" << labels << "} " << (metrics.*gauge).get() << "\n";
+        });
+    };
+    summary("derecho_send_to_stability_seconds", "Time from sending a message until it was stable",
+            &SubgroupMetrics::send_to_stability_ns, 1e-9);
+    summary("derecho_stability_to_delivery_seconds", "Time from a message being stable until its delivery upcall returned",
+            &SubgroupMetrics::stability_to_delivery_ns, 1e-9);
+    summary("derecho_delivery_to_persist_seconds", "Time from delivering a message until its version was persisted",
+            &SubgroupMetrics::delivery_to_persist_ns, 1e-9);
+    summary("derecho_persist_batch_versions", "Versions persisted by one persist call",
+            &SubgroupMetrics::persist_batch_size, 1);
+    counter("derecho_messages_sent_total", "Messages sent by this node", &SubgroupMetrics::messages_sent);
+    counter("derecho_messages_delivered_total", "Messages delivered at this node", &SubgroupMetrics::messages_delivered);
+    counter("derecho_delivered_bytes_total", "Bytes of messages delivered at this node", &SubgroupMetrics::bytes_delivered);
+    counter("derecho_sends_throttled_total", "Sends turned away by the subgroup's send limit",
+            &SubgroupMetrics::sends_throttled);
+    gauge("derecho_pending_sends", "Messages waiting to be sent by RDMC", &SubgroupMetrics::pending_sends);
+    gauge("derecho_send_window_occupancy", "Messages sent that some shard member isn't done with",
+          &SubgroupMetrics::window_occupancy);
+
+    per_subgroup("derecho_message_stage_seconds", "summary",
+                 "Time each of this node's messages took to reach a stage from the one before it",
+                 [&](const std::string& labels, const SubgroupMetrics& metrics) {
+                     for(unsigned stage = SEND_ISSUED; stage < NUM_MESSAGE_STAGES; ++stage) {
+                         if(metrics.message_stage_ns[stage - 1].num_recorded() == 0) {
+                             continue;
+                         }
+                         write_summary(out, "derecho_message_stage_seconds",
+                                       labels + ",stage=\"" + message_stage_names[stage] + "\"",
+                                       metrics.message_stage_ns[stage - 1], 1e-9);
+                     }
+                 });
+
+    write_type(out, "derecho_view_change_seconds", "summary", "Time from the start of a view change until it was installed");
+    write_summary(out, "derecho_view_change_seconds", "", view_change_ns, 1e-9);
+    write_type(out, "derecho_view_change_ragged_edge_seconds", "summary",
+               "Time from the start of a view change until its ragged edge was cleaned up");
+    write_summary(out, "derecho_view_change_ragged_edge_seconds", "", ragged_edge_ns, 1e-9);
+    write_type(out, "derecho_view_change_transport_rebuild_seconds", "summary",
+               "Time a view change spent setting up the next view's SST and RDMC groups");
+    write_summary(out, "derecho_view_change_transport_rebuild_seconds", "", transport_rebuild_ns, 1e-9);
+    write_type(out, "derecho_view_change_state_transfer_seconds", "summary",
+               "Time a view change spent transferring subgroup state to new members");
+    write_summary(out, "derecho_view_change_state_transfer_seconds", "", state_transfer_ns, 1e-9);
+    write_type(out, "derecho_p2p_rtt_seconds", "summary", "Round-trip time of peer-to-peer RPC calls");
+    write_summary(out, "derecho_p2p_rtt_seconds", "", p2p_rtt_ns, 1e-9);
+}
+
+Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+void start_prometheus_endpoint(uint16_t port) {
+    static std::once_flag started;
+    std::call_once(started, [port]() {
+        auto listener = std::make_shared<tcp::connection_listener>(port);
+        std::thread server([listener]() {
+            pthread_setname_np(pthread_self(), "metrics");
+            place_this_thread("metrics");
+            while(true) {
+                tcp::socket client = listener->accept();
+                // The request is ignored, but has to be read before replying
+                std::string request;
+                char buffer[1024];
+                ssize_t received;
+                while(request.find("\r\n\r\n") == std::string::npos
+                      && (received = recv(client.get_fd(), buffer, sizeof(buffer), 0)) > 0) {
+                    request.append(buffer, received);
+                }
+                std::ostringstream body;
+                registry().write_prometheus(body);
+                const std::string text = body.str();
+                const std::string response = "HTTP/1.0 200 OK\r\n"
+                                             "Content-Type: text/plain; version=0.0.4\r\n"
+                                             "Content-Length: "
+                                             + std::to_string(text.size()) + "\r\n\r\n" + text;
+                client.write(response.data(), response.size());
+            }
+        });
+        server.detach();
+    });
+}
+
+}  // namespace metrics
+}  // namespace derecho
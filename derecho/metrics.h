@@ -0,0 +1,236 @@
+/**
+ * @file metrics.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace derecho {
+
+/**
+ * Always-on metrics for capacity planning: counters, gauges, and latency
+ * histograms that are cheap enough to update on every message, since they are
+ * only relaxed atomic operations on memory the metric owns. They are kept in
+ * one registry per process, which outlives the views (and MulticastGroups)
+ * and can be scraped at any time, either through the accessors here or as
+ * Prometheus text, optionally served over HTTP.
+ */
+namespace metrics {
+
+/** @return The steady clock's time in nanoseconds, which latencies are measured with */
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+class Counter {
+    std::atomic<uint64_t> value{0};
+
+public:
+    void add(uint64_t amount = 1) {
+        value.fetch_add(amount, std::memory_order_relaxed);
+    }
+    uint64_t get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+class Gauge {
+    std::atomic<int64_t> value{0};
+
+public:
+    void set(int64_t new_value) {
+        value.store(new_value, std::memory_order_relaxed);
+    }
+    int64_t get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+/** A copy of a Histogram's counts at one moment */
+struct HistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    std::vector<uint64_t> bucket_counts;
+
+    /** @return A value that about a fraction q of the recorded values are at
+     * most, to within the bucket's width, or 0 if there are none */
+    uint64_t percentile(double q) const;
+    double mean() const {
+        return count == 0 ? 0.0 : double(sum) / count;
+    }
+};
+
+/**
+ * A histogram of nonnegative integers in the style of HdrHistogram: each
+ * power of 2 is split into sub_buckets linear buckets, so a value is counted
+ * to within 1/sub_buckets of itself whatever its magnitude, and a fixed array
+ * of buckets covers every 64-bit value.
+ */
+class Histogram {
+public:
+    static constexpr unsigned sub_bucket_bits = 4;
+    static constexpr uint64_t sub_buckets = 1 << sub_bucket_bits;
+    /** Values below sub_buckets have a bucket each; every later power of 2 has
+     * sub_buckets of them */
+    static constexpr std::size_t num_buckets = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+    static std::size_t bucket_of(uint64_t value) {
+        if(value < sub_buckets) {
+            return value;
+        }
+        const unsigned exponent = 63 - __builtin_clzll(value);
+        return ((exponent - sub_bucket_bits + 1) << sub_bucket_bits)
+               | ((value >> (exponent - sub_bucket_bits)) & (sub_buckets - 1));
+    }
+    /** @return The smallest value counted in a bucket */
+    static uint64_t bucket_lower_bound(std::size_t bucket) {
+        if(bucket < sub_buckets) {
+            return bucket;
+        }
+        const unsigned exponent = (bucket >> sub_bucket_bits) + sub_bucket_bits - 1;
+        return (sub_buckets | (bucket & (sub_buckets - 1))) << (exponent - sub_bucket_bits);
+    }
+
+    void record(uint64_t value) {
+        bucket_counts[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t old_max = max.load(std::memory_order_relaxed);
+        while(value > old_max && !max.compare_exchange_weak(old_max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    /** @return The number of values recorded */
+    uint64_t num_recorded() const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    /** The counts are read one at a time, so a snapshot taken while values
+     * are being recorded can be off by those values */
+    HistogramSnapshot snapshot() const;
+
+private:
+    std::atomic<uint64_t> bucket_counts[num_buckets] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+};
+
+/** The stages of the life of one of this node's messages, in order */
+enum MessageStage : unsigned {
+    /** get_sendbuffer_ptr handed out its buffer */
+    BUFFER_ACQUIRED,
+    /** It was handed to RDMC or the SST multicast */
+    SEND_ISSUED,
+    /** The transport finished sending it; for RDMC, its last block was sent */
+    SENT,
+    /** Every shard member had received it, so it could be delivered */
+    STABLE,
+    /** Its delivery upcall at this node had returned */
+    DELIVERED,
+    /** This node had persisted its version */
+    PERSISTED,
+    /** Every shard member had persisted its version */
+    GLOBALLY_PERSISTED,
+    NUM_MESSAGE_STAGES
+};
+
+extern const char* const message_stage_names[NUM_MESSAGE_STAGES];
+
+/** The metrics of one subgroup, as seen by this node. Latencies are in ns. */
+struct SubgroupMetrics {
+    /** From when this node sent a message until every shard member had
+     * received it and it could be delivered */
+    Histogram send_to_stability_ns;
+    /** From when a message could be delivered until its delivery upcall had
+     * returned, including any time it waited for the delivery thread */
+    Histogram stability_to_delivery_ns;
+    /** From when a message was delivered until its version was persisted */
+    Histogram delivery_to_persist_ns;
+    /** The number of versions persisted together by one persist call */
+    Histogram persist_batch_size;
+    Counter messages_sent;
+    Counter messages_delivered;
+    Counter bytes_delivered;
+    /** The number of messages waiting to be handed to RDMC */
+    Gauge pending_sends;
+    /** The number of this node's messages that have been sent but that some
+     * shard member isn't done with, out of the send window */
+    Gauge window_occupancy;
+    /** The sends turned away by the subgroup's SendLimit */
+    Counter sends_throttled;
+    /** If message stages are tracked, the time each of this node's messages
+     * took to reach a stage from the one before it, indexed by the stage - 1 */
+    Histogram message_stage_ns[NUM_MESSAGE_STAGES - 1];
+};
+
+class Registry {
+    mutable std::mutex subgroups_mutex;
+    /** A deque, so that the references handed out stay valid as it grows */
+    std::deque<SubgroupMetrics> subgroups;
+
+public:
+    /** The time from the start of each view change until this node had
+     * installed the new view */
+    Histogram view_change_ns;
+    /** The part of a view change until every subgroup's ragged edge had been
+     * cleaned up and the whole view was wedged */
+    Histogram ragged_edge_ns;
+    /** The part of a view change spent making the next view's SST and RDMC
+     * groups, connecting to any joiners, and syncing with the new members */
+    Histogram transport_rebuild_ns;
+    /** The part of a view change spent sending subgroup state to new shard
+     * members and initializing this node's subgroup objects, which includes
+     * receiving their state if it is a new shard member */
+    Histogram state_transfer_ns;
+    /** The round-trip time of peer-to-peer RPC calls, from sending the
+     * request until the reply had been received */
+    Histogram p2p_rtt_ns;
+
+    /** @return The metrics of a subgroup, which live as long as the process;
+     * callers on hot paths should look them up once and keep the reference */
+    SubgroupMetrics& subgroup(uint32_t subgroup_id) {
+        std::lock_guard<std::mutex> lock(subgroups_mutex);
+        while(subgroups.size() <= subgroup_id) {
+            subgroups.emplace_back();
+        }
+        return subgroups[subgroup_id];
+    }
+
+    void for_each_subgroup(const std::function<void(uint32_t, const SubgroupMetrics&)>& visitor) const {
+        std::lock_guard<std::mutex> lock(subgroups_mutex);
+        for(uint32_t subgroup_id = 0; subgroup_id < subgroups.size(); ++subgroup_id) {
+            visitor(subgroup_id, subgroups[subgroup_id]);
+        }
+    }
+
+    /** Writes every metric in the Prometheus text exposition format, with
+     * each histogram as a summary of some quantiles. */
+    void write_prometheus(std::ostream& out) const;
+};
+
+/** @return The registry of this process */
+Registry& registry();
+
+/**
+ * Starts serving the registry's metrics as Prometheus text over HTTP on a
+ * port, from a thread of its own, to any path that is requested. Only the
+ * first call for a process starts a server; later ones do nothing.
+ */
+void start_prometheus_endpoint(uint16_t port);
+
+}  // namespace metrics
+}  // namespace derecho
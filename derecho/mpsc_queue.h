@@ -0,0 +1,172 @@
+/**
+ * @file mpsc_queue.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+namespace derecho {
+
+/**
+ * A bounded, lock-free queue for many producers and a single consumer. Cells
+ * carry a sequence number, as in Vyukov's bounded queue, so producers claim a
+ * slot with a single compare-and-swap and never block each other. Pushing never
+ * makes a system call unless the consumer has gone to sleep: the consumer
+ * spins for a while when the queue is empty, then parks on a futex that the
+ * next producer wakes.
+ * @tparam T The element type; it is copied in and out of the ring.
+ * @tparam Capacity The number of slots in the ring; must be a power of 2.
+ */
+template <typename T, std::size_t Capacity>
+class MPSCQueue {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                  "MPSCQueue capacity must be a power of 2");
+
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T data;
+    };
+
+    /** The number of times the consumer polls an empty queue before it sleeps. */
+    static constexpr int spin_iterations = 2048;
+    /** The longest time the consumer sleeps before checking again on its own. */
+    static constexpr long sleep_timeout_ns = 10 * 1000 * 1000;
+
+    Cell cells[Capacity];
+    alignas(64) std::atomic<std::size_t> enqueue_pos;
+    alignas(64) std::size_t dequeue_pos;
+    /** 1 while the consumer is (about to be) asleep on the futex, 0 otherwise. */
+    alignas(64) std::atomic<int> consumer_sleeping;
+
+    void futex_wake() {
+        syscall(SYS_futex, reinterpret_cast<int*>(&consumer_sleeping), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+
+    void futex_wait() {
+        struct timespec timeout = {0, sleep_timeout_ns};
+        syscall(SYS_futex, reinterpret_cast<int*>(&consumer_sleeping), FUTEX_WAIT_PRIVATE, 1, &timeout, nullptr, 0);
+    }
+
+public:
+    MPSCQueue() : enqueue_pos(0), dequeue_pos(0), consumer_sleeping(0) {
+        for(std::size_t i = 0; i < Capacity; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+    /**
+     * Adds an element to the queue without blocking.
+     * @return False if the queue is full.
+     */
+    bool try_push(const T& value) {
+        std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while(true) {
+            Cell& cell = cells[pos & (Capacity - 1)];
+            std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0) {
+                if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    break;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        // Only wake the consumer if it has actually gone to sleep
+        if(consumer_sleeping.load(std::memory_order_seq_cst) == 1
+           && consumer_sleeping.exchange(0, std::memory_order_seq_cst) == 1) {
+            futex_wake();
+        }
+        return true;
+    }
+
+    /**
+     * Adds an element to the queue, yielding the processor while the queue is
+     * full until the consumer makes room.
+     */
+    void push(const T& value) {
+        while(!try_push(value)) {
+            std::this_thread::yield();
+        }
+    }
+
+    /**
+     * Removes an element from the queue without blocking. Must only be called
+     * by the consumer thread.
+     * @return False if the queue is empty.
+     */
+    bool try_pop(T& value) {
+        Cell& cell = cells[dequeue_pos & (Capacity - 1)];
+        std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+        if((intptr_t)seq - (intptr_t)(dequeue_pos + 1) < 0) {
+            return false;
+        }
+        value = cell.data;
+        cell.sequence.store(dequeue_pos + Capacity, std::memory_order_release);
+        dequeue_pos++;
+        return true;
+    }
+
+    /**
+     * Removes an element from the queue, waiting for one to arrive if the
+     * queue is empty. The consumer spins first, then sleeps on a futex.
+     * @param stop When this becomes true, gives up waiting and returns false.
+     * Whoever sets it should call wake() afterwards.
+     * @return True if an element was removed, false if stop was set.
+     */
+    bool pop(T& value, const std::atomic<bool>& stop) {
+        for(int i = 0; i < spin_iterations; ++i) {
+            if(try_pop(value)) {
+                return true;
+            }
+        }
+        while(true) {
+            if(try_pop(value)) {
+                return true;
+            }
+            if(stop) {
+                return false;
+            }
+            consumer_sleeping.store(1, std::memory_order_seq_cst);
+            // A producer may have pushed after the last check but before it
+            // could see consumer_sleeping, so check once more before sleeping
+            if(try_pop(value)) {
+                consumer_sleeping.store(0, std::memory_order_relaxed);
+                return true;
+            }
+            futex_wait();
+            consumer_sleeping.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /** Wakes up the consumer if it is sleeping in pop(). */
+    void wake() {
+        if(consumer_sleeping.exchange(0, std::memory_order_seq_cst) == 1) {
+            futex_wake();
+        }
+    }
+
+    /** @return True if the queue has no elements. Only meaningful on the consumer thread. */
+    bool empty() const {
+        return (intptr_t)cells[dequeue_pos & (Capacity - 1)].sequence.load(std::memory_order_acquire)
+                       - (intptr_t)(dequeue_pos + 1)
+               < 0;
+    }
+};
+}  // namespace derecho
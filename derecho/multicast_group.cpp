@@ -1,12 +1,19 @@
 #include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cstring>
+#include <functional>
+#include <future>
 #include <limits>
 #include <thread>
 
 #include "derecho_internal.h"
+#include "failure_detector.h"
+#include "hot_path_log.h"
 #include "multicast_group.h"
+#include "thread_placement.h"
 #include "rdmc/util.h"
+#include "time/fast_clock.h"
 
 namespace derecho {
 
@@ -49,16 +56,47 @@ size_t index_of(T container, U elem) {
  * issued.
  */
 
+/** @return The last stage a message reaches in a subgroup with a delivery mode */
+static metrics::MessageStage last_message_stage(Mode mode) {
+    switch(mode) {
+        case Mode::ORDERED:
+            return metrics::GLOBALLY_PERSISTED;
+        case Mode::FIFO:
+            return metrics::DELIVERED;
+        default:
+            // Raw messages are delivered as they are received
+            return metrics::SENT;
+    }
+}
+
+/** @return Pointers to the registry's metrics of subgroups 0 to num_subgroups - 1 */
+static std::vector<metrics::SubgroupMetrics*> metrics_of_subgroups(uint32_t num_subgroups) {
+    std::vector<metrics::SubgroupMetrics*> subgroup_metrics(num_subgroups);
+    for(uint32_t subgroup_num = 0; subgroup_num < num_subgroups; ++subgroup_num) {
+        subgroup_metrics[subgroup_num] = &metrics::registry().subgroup(subgroup_num);
+    }
+    return subgroup_metrics;
+}
+
+static std::vector<std::shared_ptr<SendLimiter>> limiters_of_subgroups(SendLimiters& table, uint32_t num_subgroups) {
+    std::vector<std::shared_ptr<SendLimiter>> limiters(num_subgroups);
+    for(uint32_t subgroup_num = 0; subgroup_num < num_subgroups; ++subgroup_num) {
+        limiters[subgroup_num] = table.of(subgroup_num);
+    }
+    return limiters;
+}
+
 MulticastGroup::MulticastGroup(
         std::vector<node_id_t> _members, node_id_t my_node_id,
         std::shared_ptr<DerechoSST> sst,
         CallbackSet callbacks,
         uint32_t total_num_subgroups,
-        const std::map<subgroup_id_t, std::pair<uint32_t, uint32_t>>& subgroup_to_shard_and_rank,
-        const std::map<subgroup_id_t, std::pair<std::vector<int>, int>>& subgroup_to_senders_and_sender_rank,
-        const std::map<subgroup_id_t, uint32_t>& subgroup_to_num_received_offset,
-        const std::map<subgroup_id_t, std::vector<node_id_t>>& subgroup_to_membership,
-        const std::map<subgroup_id_t, Mode>& subgroup_to_mode,
+        SubgroupMap<std::pair<uint32_t, uint32_t>> _subgroup_to_shard_and_rank,
+        SubgroupMap<std::pair<std::vector<int>, int>> _subgroup_to_senders_and_sender_rank,
+        SubgroupMap<uint32_t> _subgroup_to_num_received_offset,
+        SubgroupMap<std::vector<node_id_t>> _subgroup_to_membership,
+        SubgroupMap<Mode> _subgroup_to_mode,
+        const std::set<subgroup_id_t>& latency_critical_subgroups,
         const DerechoParams derecho_params,
         const persistence_manager_callbacks_t& _persistence_manager_callbacks,
         std::vector<char> already_failed)
@@ -70,30 +108,82 @@ MulticastGroup::MulticastGroup(
           max_msg_size(compute_max_msg_size(derecho_params.max_payload_size, derecho_params.block_size)),
           type(derecho_params.type),
           window_size(derecho_params.window_size),
+          min_window_size(derecho_params.min_window_size),
+          adaptive_window(derecho_params.adaptive_window),
+          num_sender_threads(std::max(derecho_params.num_sender_threads, 1u)),
+          sst_multicast_threshold(derecho_params.sst_multicast_threshold),
+          adaptive_transport(derecho_params.adaptive_transport),
+          packed_sst_multicast(derecho_params.packed_sst_multicast),
+          adaptive_block_size(derecho_params.adaptive_block_size),
+          aggregation_fanout(derecho_params.aggregation_fanout),
+          skip_idle_senders(derecho_params.skip_idle_senders),
+          offload_delivery(derecho_params.offload_delivery),
+          track_message_stages(derecho_params.track_message_stages),
+          lazy_rdmc_groups(derecho_params.lazy_rdmc_groups),
+          rdmc_group_idle_timeout_ms(derecho_params.rdmc_group_idle_timeout_ms),
+          raw_send_rings(derecho_params.raw_send_rings),
+          inline_sends(derecho_params.inline_sends),
+          max_rdmc_sends_in_flight(derecho_params.max_rdmc_sends_in_flight),
+          rdmc_block_writes(derecho_params.rdmc_block_writes),
+          small_message_buffer_size(derecho_params.small_message_buffer_size),
+          medium_message_buffer_size(derecho_params.medium_message_buffer_size),
+          remote_persistence_replicas(derecho_params.filename.empty() ? derecho_params.remote_persistence_replicas : 0),
+          read_lease_duration_us(derecho_params.read_lease_duration_us),
           callbacks(callbacks),
           total_num_subgroups(total_num_subgroups),
-          subgroup_to_shard_and_rank(subgroup_to_shard_and_rank),
-          subgroup_to_senders_and_sender_rank(subgroup_to_senders_and_sender_rank),
-          subgroup_to_num_received_offset(subgroup_to_num_received_offset),
-          received_intervals(sst->num_received.size(), {-1, -1}),
-          subgroup_to_membership(subgroup_to_membership),
-          subgroup_to_mode(subgroup_to_mode),
+          subgroup_to_shard_and_rank(std::move(_subgroup_to_shard_and_rank)),
+          subgroup_to_senders_and_sender_rank(std::move(_subgroup_to_senders_and_sender_rank)),
+          subgroup_to_num_received_offset(std::move(_subgroup_to_num_received_offset)),
+          received_windows(sst->num_received.size(), ReceivedWindow(window_size)),
+          subgroup_to_membership(std::move(_subgroup_to_membership)),
+          subgroup_to_mode(std::move(_subgroup_to_mode)),
+          latency_critical_subgroups(latency_critical_subgroups),
+          critical_service_level(derecho_params.critical_service_level),
           rdmc_group_num_offset(0),
+          free_message_buffers(total_num_subgroups),
           future_message_indices(total_num_subgroups, 0),
           next_sends(total_num_subgroups),
           pending_sends(total_num_subgroups),
           current_sends(total_num_subgroups),
+          current_receives(total_num_subgroups),
+          locally_stable_rdmc_messages(total_num_subgroups),
+          locally_stable_sst_messages(total_num_subgroups),
+          pending_message_timestamps(total_num_subgroups),
+          pending_persistence(total_num_subgroups),
+          non_persistent_messages(total_num_subgroups),
+          non_persistent_sst_messages(total_num_subgroups),
           next_message_to_deliver(total_num_subgroups),
+          subgroup_mutexes(total_num_subgroups),
           sender_timeout(derecho_params.timeout_ms),
+          subgroup_wedged(total_num_subgroups),
+          heartbeat_interval_us(derecho_params.heartbeat_interval_us),
+          failure_phi_threshold(derecho_params.failure_phi_threshold),
           sst(sst),
           sst_multicast_group_ptrs(total_num_subgroups),
           last_transfer_medium(total_num_subgroups),
-          persistence_manager_callbacks(_persistence_manager_callbacks) {
+          transport_selectors(total_num_subgroups),
+          window_controllers(total_num_subgroups),
+          subgroup_metrics(metrics_of_subgroups(total_num_subgroups)),
+          stage_trackers(total_num_subgroups),
+          send_frontiers(total_num_subgroups),
+          delivery_batches(total_num_subgroups),
+          send_rings(total_num_subgroups),
+          receive_allocators(std::make_shared<ReceiveAllocators>()),
+          stream_assemblies(std::make_shared<StreamAssemblies>()),
+          send_limiter_table(std::make_shared<SendLimiters>()),
+          send_limiters(limiters_of_subgroups(*send_limiter_table, total_num_subgroups)),
+          persistence_manager_callbacks(_persistence_manager_callbacks),
+          delivery_executors(total_num_subgroups) {
     assert(window_size >= 1);
 
     if(!derecho_params.filename.empty()) {
         file_writer = std::make_unique<FileWriter>(make_file_written_callback(),
-                                                   derecho_params.filename);
+                                                   derecho_params.filename,
+                                                   derecho_params.log_compaction_threshold);
+    }
+
+    if(callbacks.global_persistence_callback) {
+        persistence_notifier = std::make_unique<PersistenceNotifier>(callbacks.global_persistence_callback);
     }
 
     for(uint i = 0; i < num_members; ++i) {
@@ -102,11 +192,23 @@ MulticastGroup::MulticastGroup(
 
     for(const auto p : subgroup_to_shard_and_rank) {
         auto num_shard_members = subgroup_to_membership.at(p.first).size();
-        while(free_message_buffers[p.first].size() < window_size * num_shard_members) {
-            free_message_buffers[p.first].emplace_back(max_msg_size);
+        free_message_buffers[p.first] = MessageBufferPool(max_msg_size, small_message_buffer_size,
+                                                          medium_message_buffer_size, block_size);
+        free_message_buffers[p.first].fill(window_size * num_shard_members);
+        preallocate_message_windows(p.first);
+        if(offload_delivery) {
+            delivery_executors[p.first] = std::make_unique<DeliveryExecutor>();
+        }
+        if(track_message_stages && subgroup_to_senders_and_sender_rank.at(p.first).second >= 0) {
+            stage_trackers[p.first] = std::make_unique<MessageStageTracker>(
+                    last_message_stage(subgroup_to_mode.at(p.first)), *subgroup_metrics[p.first]);
+        }
+        if(subgroup_to_senders_and_sender_rank.at(p.first).second >= 0) {
+            send_frontiers[p.first] = std::make_shared<SendFrontiers>();
         }
     }
 
+    initialize_send_states();
     initialize_sst_row();
     bool no_member_failed = true;
     if(already_failed.size()) {
@@ -121,9 +223,19 @@ MulticastGroup::MulticastGroup(
         // if groups are created successfully, rdmc_sst_groups_created will be set to true
         rdmc_sst_groups_created = create_rdmc_sst_groups();
     }
+    create_raw_send_rings();
     register_predicates();
-    sender_thread = std::thread(&MulticastGroup::send_loop, this);
-    timeout_thread = std::thread(&MulticastGroup::check_failures_loop, this);
+    for(uint32_t thread_index = 0; thread_index < sender_thread_subgroups.size(); ++thread_index) {
+        sender_threads.emplace_back(&MulticastGroup::send_loop, this, thread_index);
+    }
+    if(lazy_rdmc_groups && rdmc_sst_groups_created) {
+        rdmc_group_thread = std::thread(&MulticastGroup::rdmc_group_loop, this);
+    }
+    failure_check_timer = sst::timer_wheel::shared().schedule_every(
+            std::chrono::milliseconds(sender_timeout), [this]() { check_failures(); });
+    if(heartbeat_interval_us > 0) {
+        heartbeat_thread = std::thread(&MulticastGroup::heartbeat_loop, this);
+    }
 }
 
 MulticastGroup::MulticastGroup(
@@ -131,11 +243,12 @@ MulticastGroup::MulticastGroup(
         std::shared_ptr<DerechoSST> sst,
         MulticastGroup&& old_group,
         uint32_t total_num_subgroups,
-        const std::map<subgroup_id_t, std::pair<uint32_t, uint32_t>>& subgroup_to_shard_and_rank,
-        const std::map<subgroup_id_t, std::pair<std::vector<int>, int>>& subgroup_to_senders_and_sender_rank,
-        const std::map<subgroup_id_t, uint32_t>& subgroup_to_num_received_offset,
-        const std::map<subgroup_id_t, std::vector<node_id_t>>& subgroup_to_membership,
-        const std::map<subgroup_id_t, Mode>& subgroup_to_mode,
+        SubgroupMap<std::pair<uint32_t, uint32_t>> _subgroup_to_shard_and_rank,
+        SubgroupMap<std::pair<std::vector<int>, int>> _subgroup_to_senders_and_sender_rank,
+        SubgroupMap<uint32_t> _subgroup_to_num_received_offset,
+        SubgroupMap<std::vector<node_id_t>> _subgroup_to_membership,
+        SubgroupMap<Mode> _subgroup_to_mode,
+        const std::set<subgroup_id_t>& latency_critical_subgroups,
         const persistence_manager_callbacks_t& _persistence_manager_callbacks,
         std::vector<char> already_failed, uint32_t rpc_port)
         : logger(old_group.logger),
@@ -146,35 +259,96 @@ MulticastGroup::MulticastGroup(
           max_msg_size(old_group.max_msg_size),
           type(old_group.type),
           window_size(old_group.window_size),
+          min_window_size(old_group.min_window_size),
+          adaptive_window(old_group.adaptive_window),
+          num_sender_threads(old_group.num_sender_threads),
+          sst_multicast_threshold(old_group.sst_multicast_threshold),
+          adaptive_transport(old_group.adaptive_transport),
+          packed_sst_multicast(old_group.packed_sst_multicast),
+          adaptive_block_size(old_group.adaptive_block_size),
+          aggregation_fanout(old_group.aggregation_fanout),
+          skip_idle_senders(old_group.skip_idle_senders),
+          offload_delivery(old_group.offload_delivery),
+          track_message_stages(old_group.track_message_stages),
+          lazy_rdmc_groups(old_group.lazy_rdmc_groups),
+          rdmc_group_idle_timeout_ms(old_group.rdmc_group_idle_timeout_ms),
+          raw_send_rings(old_group.raw_send_rings),
+          inline_sends(old_group.inline_sends),
+          max_rdmc_sends_in_flight(old_group.max_rdmc_sends_in_flight),
+          rdmc_block_writes(old_group.rdmc_block_writes),
+          small_message_buffer_size(old_group.small_message_buffer_size),
+          medium_message_buffer_size(old_group.medium_message_buffer_size),
+          remote_persistence_replicas(old_group.remote_persistence_replicas),
+          read_lease_duration_us(old_group.read_lease_duration_us),
           callbacks(old_group.callbacks),
           total_num_subgroups(total_num_subgroups),
-          subgroup_to_shard_and_rank(subgroup_to_shard_and_rank),
-          subgroup_to_senders_and_sender_rank(subgroup_to_senders_and_sender_rank),
-          subgroup_to_num_received_offset(subgroup_to_num_received_offset),
-          received_intervals(sst->num_received.size(), {-1, -1}),
-          subgroup_to_membership(subgroup_to_membership),
-          subgroup_to_mode(subgroup_to_mode),
+          subgroup_to_shard_and_rank(std::move(_subgroup_to_shard_and_rank)),
+          subgroup_to_senders_and_sender_rank(std::move(_subgroup_to_senders_and_sender_rank)),
+          subgroup_to_num_received_offset(std::move(_subgroup_to_num_received_offset)),
+          received_windows(sst->num_received.size(), ReceivedWindow(window_size)),
+          subgroup_to_membership(std::move(_subgroup_to_membership)),
+          subgroup_to_mode(std::move(_subgroup_to_mode)),
+          latency_critical_subgroups(latency_critical_subgroups),
+          critical_service_level(old_group.critical_service_level),
           rpc_callback(old_group.rpc_callback),
+          rpc_batch_callback(old_group.rpc_batch_callback),
           rdmc_group_num_offset(old_group.rdmc_group_num_offset + old_group.num_members),
+          free_message_buffers(total_num_subgroups),
           future_message_indices(total_num_subgroups, 0),
           next_sends(total_num_subgroups),
           pending_sends(total_num_subgroups),
           current_sends(total_num_subgroups),
+          current_receives(total_num_subgroups),
+          locally_stable_rdmc_messages(total_num_subgroups),
+          locally_stable_sst_messages(total_num_subgroups),
+          pending_message_timestamps(total_num_subgroups),
+          pending_persistence(total_num_subgroups),
+          non_persistent_messages(total_num_subgroups),
+          non_persistent_sst_messages(total_num_subgroups),
           next_message_to_deliver(total_num_subgroups),
+          subgroup_mutexes(total_num_subgroups),
           sender_timeout(old_group.sender_timeout),
+          subgroup_wedged(total_num_subgroups),
+          heartbeat_interval_us(old_group.heartbeat_interval_us),
+          failure_phi_threshold(old_group.failure_phi_threshold),
           sst(sst),
           sst_multicast_group_ptrs(total_num_subgroups),
           last_transfer_medium(total_num_subgroups),
-          persistence_manager_callbacks(_persistence_manager_callbacks) {
+          transport_selectors(total_num_subgroups),
+          window_controllers(total_num_subgroups),
+          subgroup_metrics(metrics_of_subgroups(total_num_subgroups)),
+          stage_trackers(total_num_subgroups),
+          send_frontiers(total_num_subgroups),
+          delivery_batches(total_num_subgroups),
+          send_rings(total_num_subgroups),
+          receive_allocators(old_group.receive_allocators),
+          stream_assemblies(old_group.stream_assemblies),
+          send_limiter_table(old_group.send_limiter_table),
+          send_limiters(limiters_of_subgroups(*send_limiter_table, total_num_subgroups)),
+          persistence_manager_callbacks(_persistence_manager_callbacks),
+          delivery_executors(total_num_subgroups) {
     // Make sure rdmc_group_num_offset didn't overflow.
     assert(old_group.rdmc_group_num_offset <= std::numeric_limits<uint16_t>::max() - old_group.num_members - num_members);
 
     // Just in case
     old_group.wedge();
+    // Nothing delivered in the old view may run after the new one starts
+    for(auto& executor : old_group.delivery_executors) {
+        if(executor) {
+            executor->drain();
+        }
+    }
+    old_group.wait_out_read_leases(members);
+
+    if(callbacks.global_persistence_callback) {
+        persistence_notifier = std::make_unique<PersistenceNotifier>(callbacks.global_persistence_callback);
+    }
 
     for(uint i = 0; i < num_members; ++i) {
         node_id_to_sst_index[members[i]] = i;
     }
+    // The objects that departed members were streaming will never be finished
+    stream_assemblies->drop_senders_not_in(members);
 
     // Convience function that takes a msg from the old group and
     // produces one suitable for this group.
@@ -182,7 +356,8 @@ MulticastGroup::MulticastGroup(
         msg.sender_id = members[member_index];
         msg.index = future_message_indices[subgroup_num]++;
 
-        header* h = (header*)msg.message_buffer.buffer.get();
+        header* h = (header*)msg.message_buffer.buffer();
+        h->vid = this->sst->vid[member_index];
         future_message_indices[subgroup_num] += h->pause_sending_turns;
 
         return std::move(msg);
@@ -202,59 +377,98 @@ MulticastGroup::MulticastGroup(
 
     for(const auto p : subgroup_to_shard_and_rank) {
         auto num_shard_members = subgroup_to_membership.at(p.first).size();
-        while(free_message_buffers[p.first].size() < window_size * num_shard_members) {
-            free_message_buffers[p.first].emplace_back(max_msg_size);
+        free_message_buffers[p.first] = MessageBufferPool(max_msg_size, small_message_buffer_size,
+                                                          medium_message_buffer_size, block_size);
+        free_message_buffers[p.first].fill(window_size * num_shard_members);
+        preallocate_message_windows(p.first);
+        if(offload_delivery) {
+            delivery_executors[p.first] = std::make_unique<DeliveryExecutor>();
+        }
+        if(track_message_stages && subgroup_to_senders_and_sender_rank.at(p.first).second >= 0) {
+            stage_trackers[p.first] = std::make_unique<MessageStageTracker>(
+                    last_message_stage(subgroup_to_mode.at(p.first)), *subgroup_metrics[p.first]);
+        }
+        if(subgroup_to_senders_and_sender_rank.at(p.first).second >= 0) {
+            send_frontiers[p.first] = std::make_shared<SendFrontiers>();
+        }
+    }
+
+    bool no_member_failed = true;
+    if(already_failed.size()) {
+        for(uint i = 0; i < num_members; ++i) {
+            if(already_failed[i]) {
+                no_member_failed = false;
+                break;
+            }
         }
     }
+    // Done before taking the old group's locks, since its upcalls may still
+    // be finishing a message in the groups that are kept
+    take_over_rdmc_groups(old_group, !already_failed.size() || no_member_failed);
 
     // Reclaim RDMCMessageBuffers from the old group, and supplement them with
-    // additional if the group has grown.
-    std::lock_guard<std::mutex> lock(old_group.msg_state_mtx);
+    // additional if the group has grown. This group's locks are needed too,
+    // since the groups it took over can already call its upcalls.
+    std::vector<std::unique_lock<std::mutex>> old_group_locks;
+    for(auto& subgroup_mutex : old_group.subgroup_mutexes) {
+        old_group_locks.emplace_back(subgroup_mutex);
+    }
+    std::vector<std::unique_lock<std::mutex>> new_group_locks;
+    for(auto& subgroup_mutex : subgroup_mutexes) {
+        new_group_locks.emplace_back(subgroup_mutex);
+    }
     for(const auto p : subgroup_to_shard_and_rank) {
         const auto subgroup_num = p.first;
         auto num_shard_members = subgroup_to_membership.at(p.first).size();
         // for later: don't move extra message buffers
-        free_message_buffers[subgroup_num].swap(old_group.free_message_buffers[subgroup_num]);
-        while(free_message_buffers[subgroup_num].size() < old_group.window_size * num_shard_members) {
-            free_message_buffers[subgroup_num].emplace_back(max_msg_size);
+        if(subgroup_num < old_group.free_message_buffers.size()) {
+            std::swap(free_message_buffers[subgroup_num], old_group.free_message_buffers[subgroup_num]);
         }
+        if(!free_message_buffers[subgroup_num].configured()) {
+            free_message_buffers[subgroup_num] = MessageBufferPool(max_msg_size, small_message_buffer_size,
+                                                                   medium_message_buffer_size, block_size);
+        }
+        free_message_buffers[subgroup_num].fill(old_group.window_size * num_shard_members);
     }
 
-    for(auto& msg : old_group.current_receives) {
-        free_message_buffers[msg.first.first].push_back(std::move(msg.second.message_buffer));
+    for(subgroup_id_t subgroup_num = 0; subgroup_num < old_group.current_receives.size(); ++subgroup_num) {
+        for(auto& msg : old_group.current_receives[subgroup_num]) {
+            if(msg && subgroup_num < free_message_buffers.size()) {
+                recycle_message_buffer(subgroup_num, std::move(msg->message_buffer));
+            }
+        }
     }
     old_group.current_receives.clear();
 
     // Assume that any locally stable messages failed. If we were the sender
     // than re-attempt, otherwise discard. TODO: Presumably the ragged edge
     // cleanup will want the chance to deliver some of these.
-    for(auto& p : old_group.locally_stable_rdmc_messages) {
-        if(p.second.size() == 0) {
+    for(subgroup_id_t subgroup_num = 0; subgroup_num < old_group.locally_stable_rdmc_messages.size(); ++subgroup_num) {
+        if(old_group.locally_stable_rdmc_messages[subgroup_num].empty()) {
             continue;
         }
 
-        for(auto& q : p.second) {
-            if(q.second.sender_id == members[member_index]) {
-                pending_sends[p.first].push(convert_msg(q.second, p.first));
-            } else {
-                free_message_buffers[p.first].push_back(std::move(q.second.message_buffer));
-            }
-        }
+        old_group.locally_stable_rdmc_messages[subgroup_num].for_each(
+                [&](long long int seq_num, RDMCMessage& msg) {
+                    if(msg.sender_id == members[member_index]) {
+                        pending_sends[subgroup_num].push(convert_msg(msg, subgroup_num));
+                    } else {
+                        recycle_message_buffer(subgroup_num, std::move(msg.message_buffer));
+                    }
+                });
     }
     old_group.locally_stable_rdmc_messages.clear();
 
-    for(auto& p : old_group.locally_stable_sst_messages) {
-        if(p.second.size() == 0) {
-            continue;
-        }
-    }
     old_group.locally_stable_sst_messages.clear();
 
     // Any messages that were being sent should be re-attempted.
     for(auto p : subgroup_to_shard_and_rank) {
         auto subgroup_num = p.first;
-        if(old_group.current_sends.size() > subgroup_num && old_group.current_sends[subgroup_num]) {
-            pending_sends[subgroup_num].push(convert_msg(*old_group.current_sends[subgroup_num], subgroup_num));
+        if(old_group.current_sends.size() > subgroup_num) {
+            for(RDMCMessage& msg : old_group.current_sends[subgroup_num]) {
+                pending_sends[subgroup_num].push(convert_msg(msg, subgroup_num));
+            }
+            old_group.current_sends[subgroup_num].clear();
         }
 
         if(old_group.pending_sends.size() > subgroup_num) {
@@ -263,22 +477,31 @@ MulticastGroup::MulticastGroup(
                 old_group.pending_sends[subgroup_num].pop();
             }
         }
+        subgroup_metrics[subgroup_num]->pending_sends.set(pending_sends[subgroup_num].size());
 
         if(old_group.next_sends.size() > subgroup_num && old_group.next_sends[subgroup_num]) {
             next_sends[subgroup_num] = convert_msg(*old_group.next_sends[subgroup_num], subgroup_num);
         }
 
-        for(auto& entry : old_group.non_persistent_messages[subgroup_num]) {
-            non_persistent_messages[subgroup_num].emplace(entry.first,
-                                                          convert_msg(entry.second, subgroup_num));
+        if(subgroup_num < old_group.non_persistent_messages.size()) {
+            old_group.non_persistent_messages[subgroup_num].for_each(
+                    [&](long long int seq_num, RDMCMessage& msg) {
+                        non_persistent_messages[subgroup_num].insert(seq_num, convert_msg(msg, subgroup_num));
+                    });
+            old_group.non_persistent_messages[subgroup_num].clear();
         }
-        old_group.non_persistent_messages.clear();
-        for(auto& entry : old_group.non_persistent_sst_messages[subgroup_num]) {
-            non_persistent_sst_messages[subgroup_num].emplace(entry.first,
-                                                              convert_sst_msg(entry.second, subgroup_num));
+        if(subgroup_num < old_group.non_persistent_sst_messages.size()) {
+            for(auto& entry : old_group.non_persistent_sst_messages[subgroup_num]) {
+                non_persistent_sst_messages[subgroup_num].emplace(entry.first,
+                                                                  convert_sst_msg(entry.second, subgroup_num));
+            }
+            old_group.non_persistent_sst_messages[subgroup_num].clear();
         }
-        old_group.non_persistent_sst_messages.clear();
     }
+    // Released before initialize_sst_row waits for the other members, which
+    // may be waiting for this node's RDMC upcalls to finish a message
+    new_group_locks.clear();
+    old_group_locks.clear();
 
     // If the old group was using persistence, we should transfer its state to the new group
     file_writer = std::move(old_group.file_writer);
@@ -286,48 +509,44 @@ MulticastGroup::MulticastGroup(
         file_writer->set_message_written_upcall(make_file_written_callback());
     }
 
+    initialize_send_states();
     initialize_sst_row();
-    bool no_member_failed = true;
-    if(already_failed.size()) {
-        for(uint i = 0; i < num_members; ++i) {
-            if(already_failed[i]) {
-                no_member_failed = false;
-                break;
-            }
-        }
-    }
     if(!already_failed.size() || no_member_failed) {
         // if groups are created successfully, rdmc_sst_groups_created will be set to true
         rdmc_sst_groups_created = create_rdmc_sst_groups();
     }
+    create_raw_send_rings();
+    take_over_raw_send_rings(old_group);
     register_predicates();
-    sender_thread = std::thread(&MulticastGroup::send_loop, this);
-    timeout_thread = std::thread(&MulticastGroup::check_failures_loop, this);
+    for(uint32_t thread_index = 0; thread_index < sender_thread_subgroups.size(); ++thread_index) {
+        sender_threads.emplace_back(&MulticastGroup::send_loop, this, thread_index);
+    }
+    if(lazy_rdmc_groups && rdmc_sst_groups_created) {
+        rdmc_group_thread = std::thread(&MulticastGroup::rdmc_group_loop, this);
+    }
+    failure_check_timer = sst::timer_wheel::shared().schedule_every(
+            std::chrono::milliseconds(sender_timeout), [this]() { check_failures(); });
+    if(heartbeat_interval_us > 0) {
+        heartbeat_thread = std::thread(&MulticastGroup::heartbeat_loop, this);
+    }
 }
 
 std::function<void(persistence::message)> MulticastGroup::make_file_written_callback() {
     return [this](persistence::message m) {
-        // callbacks.local_persistence_callback(m.subgroup_num, m.sender, m.index, m.data,
-        //                                     m.length);
-        //m.sender is an ID, not a rank
-        uint sender_rank;
-        for(sender_rank = 0; sender_rank < num_members; ++sender_rank) {
-            if(members[sender_rank] == m.sender) break;
-        }
-        // m.data points to the char[] buffer in a MessageBuffer, so we need to find
-        // the msg corresponding to m and put its MessageBuffer on free_message_buffers
-        auto sequence_number = m.index * num_members + sender_rank;
-
         // notify the use about the callback.
-        callbacks.local_persistence_callback(m.subgroup_num, sequence_number);
+        callbacks.local_persistence_callback(m.subgroup_num, m.sequence_number);
         {
-            std::lock_guard<std::mutex> lock(msg_state_mtx);
-            auto find_result = non_persistent_messages[m.subgroup_num].find(sequence_number);
-            assert(find_result != non_persistent_messages[m.subgroup_num].end());
-            RDMCMessage& m_msg = find_result->second;
-            free_message_buffers[m.subgroup_num].push_back(std::move(m_msg.message_buffer));
-            non_persistent_messages[m.subgroup_num].erase(find_result);
-            sst->persisted_num[member_index][m.subgroup_num] = sequence_number;
+            std::lock_guard<std::mutex> lock(subgroup_mutexes[m.subgroup_num]);
+            // m.data points into the message's own receive buffer (or SST
+            // slot), which was written out as it was and can only be reused now
+            RDMCMessage* m_msg = non_persistent_messages[m.subgroup_num].find(m.sequence_number);
+            if(m_msg) {
+                recycle_message_buffer(m.subgroup_num, std::move(m_msg->message_buffer));
+                non_persistent_messages[m.subgroup_num].erase(m.sequence_number);
+            } else {
+                non_persistent_sst_messages[m.subgroup_num].erase(m.sequence_number);
+            }
+            sst->persisted_num[member_index][m.subgroup_num] = m.sequence_number;
             sst->put(get_shard_sst_indices(m.subgroup_num),
                      (char*)std::addressof(sst->persisted_num[0][m.subgroup_num]) - sst->getBaseAddress(),
                      sizeof(long long int));
@@ -336,17 +555,247 @@ std::function<void(persistence::message)> MulticastGroup::make_file_written_call
     };
 }
 
+std::vector<node_id_t> MulticastGroup::rotated_shard_members(subgroup_id_t subgroup_num, uint32_t shard_rank) const {
+    const std::vector<node_id_t>& shard_members = subgroup_to_membership.at(subgroup_num);
+    std::vector<node_id_t> rotated(shard_members.size());
+    for(uint k = 0; k < shard_members.size(); ++k) {
+        rotated[k] = shard_members[(shard_rank + k) % shard_members.size()];
+    }
+    return rotated;
+}
+
+std::pair<rdmc::incoming_message_callback_t, rdmc::completion_callback_t> MulticastGroup::make_rdmc_upcalls(
+        subgroup_id_t subgroup_num, uint32_t shard_rank, uint32_t sender_rank) {
+    const std::vector<node_id_t>& shard_members = subgroup_to_membership.at(subgroup_num);
+    std::size_t num_shard_members = shard_members.size();
+    uint32_t num_shard_senders = get_num_senders(subgroup_to_senders_and_sender_rank.at(subgroup_num).first);
+    auto shard_sst_indices = get_shard_sst_indices(subgroup_num);
+    auto node_id = shard_members[shard_rank];
+    // When RDMC receives a message, it should store it in
+    // locally_stable_rdmc_messages and update the received count
+    rdmc::completion_callback_t rdmc_receive_handler;
+    rdmc_receive_handler = [this, subgroup_num, shard_rank, sender_rank,
+                            node_id, num_shard_members, num_shard_senders,
+                            shard_sst_indices](char* data, size_t size) {
+        assert(this->sst);
+        uint32_t num_received_offset = subgroup_to_num_received_offset.at(subgroup_num);
+        std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+        header* h = (header*)data;
+        long long int index = h->index;
+        auto beg_index = index;
+        long long int sequence_number = index * num_shard_senders + sender_rank;
+
+        // A group kept from the previous view can still deliver a message
+        // that was sent in that view, after this node has moved on
+        if(node_id != members[member_index] && h->vid < sst->vid[member_index]) {
+            auto& receive = current_receives[subgroup_num][sender_rank];
+            if(receive) {
+                recycle_message_buffer(subgroup_num, std::move(receive->message_buffer));
+                receive = std::experimental::nullopt;
+            }
+            return;
+        }
+
+        DERECHO_HOT_DEBUG(logger, "Locally received message in subgroup {}, sender rank {}, index {}", subgroup_num, shard_rank, index);
+
+        // Move message from current_receives to locally_stable_rdmc_messages.
+        if(node_id == members[member_index] && send_rings[subgroup_num]
+           && (current_sends[subgroup_num].empty() || current_sends[subgroup_num].front().index != index)) {
+            // The message stays in its slot of the ring, which only lends it
+            // out; RDMC finishes ring and queued messages in the order they
+            // were posted, so if the oldest queued one isn't this, it is the
+            // ring's oldest
+            locally_stable_rdmc_messages[subgroup_num].insert(
+                    sequence_number, RDMCMessage{node_id, index, size, MessageBuffer(send_rings[subgroup_num]->oldest_in_flight().mr)});
+            send_rings[subgroup_num]->mark_completed();
+        } else if(node_id == members[member_index]) {
+            // RDMC finishes a sender's messages in the order they were sent
+            assert(!current_sends[subgroup_num].empty() && current_sends[subgroup_num].front().index == index);
+            if(stage_trackers[subgroup_num]) {
+                stage_trackers[subgroup_num]->stamp(index, metrics::SENT, get_time());
+            }
+            locally_stable_rdmc_messages[subgroup_num].insert(sequence_number, std::move(current_sends[subgroup_num].front()));
+            current_sends[subgroup_num].pop_front();
+        } else {
+            auto& receive = current_receives[subgroup_num][sender_rank];
+            assert(receive && receive->index == index);
+            locally_stable_rdmc_messages[subgroup_num].insert(sequence_number, std::move(*receive));
+            receive = std::experimental::nullopt;
+        }
+        // Add empty messages to locally_stable_rdmc_messages for each turn that the sender is skipping.
+        for(unsigned int j = 0; j < h->pause_sending_turns; ++j) {
+            index++;
+            sequence_number += num_shard_senders;
+            locally_stable_rdmc_messages[subgroup_num].insert(sequence_number, {node_id, index, 0, 0});
+        }
+
+        auto new_num_received = resolve_num_received(beg_index, index, num_received_offset + sender_rank);
+        // deliver immediately if in raw mode
+        if(subgroup_to_mode.at(subgroup_num) == Mode::RAW) {
+            // issue stability upcalls for the recently sequenced messages
+            for(uint i = sst->num_received[member_index][num_received_offset + sender_rank] + 1; i <= new_num_received; ++i) {
+                auto seq_num = i * num_shard_senders + sender_rank;
+                if(!locally_stable_sst_messages[subgroup_num].empty()
+                   && locally_stable_sst_messages[subgroup_num].front_seq() == seq_num) {
+                    auto& msg = locally_stable_sst_messages[subgroup_num].front();
+                    if(msg.size > 0) {
+                        char* buf = const_cast<char*>(msg.buf);
+                        header* h = (header*)(buf);
+                        callbacks.global_stability_callback(subgroup_num, msg.sender_id,
+                                                            msg.index, buf + h->header_size,
+                                                            msg.size - h->header_size);
+                        if(node_id == members[member_index]) {
+                            pending_message_timestamps[subgroup_num].erase(h->timestamp);
+                        }
+                    }
+                    locally_stable_sst_messages[subgroup_num].pop_front();
+                } else {
+                    assert(!locally_stable_rdmc_messages[subgroup_num].empty());
+                    assert(locally_stable_rdmc_messages[subgroup_num].front_seq() == seq_num);
+                    auto& msg = locally_stable_rdmc_messages[subgroup_num].front();
+                    if(msg.size > 0) {
+                        char* buf = msg.message_buffer.buffer();
+                        header* h = (header*)(buf);
+                        callbacks.global_stability_callback(subgroup_num, msg.sender_id,
+                                                            msg.index, buf + h->header_size,
+                                                            msg.size - h->header_size);
+                        recycle_message_buffer(subgroup_num, std::move(msg.message_buffer));
+                        if(node_id == members[member_index]) {
+                            pending_message_timestamps[subgroup_num].erase(h->timestamp);
+                        }
+                    }
+                    locally_stable_rdmc_messages[subgroup_num].pop_front();
+                }
+            }
+        }
+        if(new_num_received > sst->num_received[member_index][num_received_offset + sender_rank]) {
+            sst->num_received[member_index][num_received_offset + sender_rank] = new_num_received;
+            // std::atomic_signal_fence(std::memory_order_acq_rel);
+            auto* min_ptr = std::min_element(&sst->num_received[member_index][num_received_offset],
+                                             &sst->num_received[member_index][num_received_offset + num_shard_senders]);
+            uint min_index = std::distance(&sst->num_received[member_index][num_received_offset], min_ptr);
+            auto new_seq_num = (*min_ptr + 1) * num_shard_senders + min_index - 1;
+            if((long long int)new_seq_num > sst->seq_num[member_index][subgroup_num]) {
+                DERECHO_HOT_DEBUG(logger, "Updating seq_num for subgroup {} to {}", subgroup_num, new_seq_num);
+                sst->seq_num[member_index][subgroup_num] = new_seq_num;
+                // std::atomic_signal_fence(std::memory_order_acq_rel);
+                DERECHO_TRACE_POINT(subgroup_num, new_seq_num, -1, "received_message");
+                // With tree aggregation, seq_num only travels inside subtree_min
+                if(!aggregation_fanout) {
+                    sst->put(shard_sst_indices,
+                             (char*)std::addressof(sst->seq_num[0][subgroup_num]) - sst->getBaseAddress(),
+                             sizeof(long long int));
+                }
+                DERECHO_TRACE_POINT(subgroup_num, new_seq_num, -1, "updated_seq_num");
+            }
+            sst->put(shard_sst_indices,
+                     (char*)std::addressof(sst->num_received[0][num_received_offset + sender_rank]) - sst->getBaseAddress(),
+                     sizeof(long long int));
+        }
+    };
+
+    if(node_id == members[member_index]) {
+        // This node is the sender, so only self-receives happen
+        auto receive_handler_plus_notify =
+                [this, rdmc_receive_handler](char* data, size_t size) {
+                    rdmc_receive_handler(data, size);
+                    // signal background writer thread
+                    notify_senders();
+                };
+        return {[](size_t length) -> rdmc::receive_destination {
+                    assert(false);
+                    return {nullptr, 0};
+                },
+                receive_handler_plus_notify};
+    }
+    auto incoming_upcall = [this, subgroup_num, node_id, sender_rank](size_t length) {
+        std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+        //Create a Message struct to receive the data into.
+        RDMCMessage msg;
+        msg.sender_id = node_id;
+        msg.index = sst->num_received[member_index][subgroup_to_num_received_offset.at(subgroup_num) + sender_rank] + 1;
+        msg.size = length;
+        auto user_mr = allocate_user_receive(subgroup_num, node_id, length);
+        if(user_mr) {
+            // The message lands where the application wants it, and recycling
+            // the buffer after delivery hands it back
+            msg.message_buffer = MessageBuffer(std::move(user_mr));
+        } else {
+            assert(!free_message_buffers[subgroup_num].empty());
+            msg.message_buffer = free_message_buffers[subgroup_num].take(length);
+        }
+
+        rdmc::receive_destination ret{msg.message_buffer.mr, 0};
+        current_receives[subgroup_num][sender_rank] = std::move(msg);
+
+        assert(ret.mr->buffer != nullptr);
+        return ret;
+    };
+    return {incoming_upcall, rdmc_receive_handler};
+}
+
+void MulticastGroup::take_over_rdmc_groups(MulticastGroup& old_group, bool groups_needed) {
+    // Lazily created groups are created again when their senders need them,
+    // and the old view must not be changing its groups while they are taken
+    old_group.stop_rdmc_group_thread();
+    // The groups this view needs, with the shard rank and sender rank of their senders
+    std::map<rdmc_group_key_t, std::pair<uint32_t, uint32_t>> needed_groups;
+    if(groups_needed && !lazy_rdmc_groups) {
+        for(const auto& p : subgroup_to_membership) {
+            const std::vector<int>& shard_senders = subgroup_to_senders_and_sender_rank.at(p.first).first;
+            if(p.second.size() <= 1) {
+                continue;
+            }
+            for(uint32_t shard_rank = 0, sender_rank = 0; shard_rank < p.second.size(); ++shard_rank) {
+                if(shard_senders[shard_rank]) {
+                    needed_groups[{p.first, rotated_shard_members(p.first, shard_rank)}] = {shard_rank, sender_rank++};
+                }
+            }
+        }
+    }
+    std::vector<uint16_t> unneeded_groups;
+    for(const auto& old_rdmc_group : old_group.rdmc_groups) {
+        auto needed = needed_groups.find(old_rdmc_group.first);
+        if(needed == needed_groups.end()) {
+            unneeded_groups.push_back(old_rdmc_group.second);
+            continue;
+        }
+        const subgroup_id_t subgroup_num = old_rdmc_group.first.first;
+        auto upcalls = make_rdmc_upcalls(subgroup_num, needed->second.first, needed->second.second);
+        // A message still in progress finishes with the previous view's
+        // upcalls, since the new ones can only take over between messages.
+        // Every member of the group is alive, so it does finish.
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(sender_timeout);
+        bool rebound;
+        while(!(rebound = rdmc::rebind_group(old_rdmc_group.second, upcalls.first, upcalls.second))
+              && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::yield();
+        }
+        if(!rebound) {
+            // A member has stopped responding, so the next view change will
+            // remove it and this group with it
+            logger->warn("RDMC group {} in subgroup {} did not finish its message from the previous view",
+                         old_rdmc_group.second, subgroup_num);
+            unneeded_groups.push_back(old_rdmc_group.second);
+            continue;
+        }
+        rdmc_groups.insert(old_rdmc_group);
+    }
+    old_group.rdmc_groups.clear();
+    rdmc::destroy_groups(unneeded_groups);
+    logger->debug("Kept {} RDMC groups from the previous view", rdmc_groups.size());
+}
+
 bool MulticastGroup::create_rdmc_sst_groups() {
     for(const auto& p : subgroup_to_membership) {
         uint32_t subgroup_num = p.first;
         const std::vector<node_id_t>& shard_members = p.second;
         std::size_t num_shard_members = shard_members.size();
-        uint32_t num_shard_senders;
         std::vector<int> shard_senders;
         shard_senders = subgroup_to_senders_and_sender_rank.at(subgroup_num).first;
-        num_shard_senders = get_num_senders(shard_senders);
         auto shard_sst_indices = get_shard_sst_indices(subgroup_num);
-        sst_multicast_group_ptrs[subgroup_num] = std::make_unique<sst::multicast_group<DerechoSST>>(sst, shard_sst_indices, window_size, shard_senders, subgroup_to_num_received_offset.at(subgroup_num), window_size * subgroup_num);
+        sst_multicast_group_ptrs[subgroup_num] = std::make_unique<sst::multicast_group<DerechoSST>>(sst, shard_sst_indices, window_size, shard_senders, subgroup_to_num_received_offset.at(subgroup_num), window_size * subgroup_num,
+                                                                                            packed_sst_multicast);
         for(uint shard_rank = 0, sender_rank = -1; shard_rank < num_shard_members; ++shard_rank) {
             // don't create RDMC group if the shard member is never going to send
             if(!shard_senders[shard_rank]) {
@@ -354,182 +803,198 @@ bool MulticastGroup::create_rdmc_sst_groups() {
             }
             sender_rank++;
             auto node_id = shard_members[shard_rank];
-            // When RDMC receives a message, it should store it in
-            // locally_stable_rdmc_messages and update the received count
-            rdmc::completion_callback_t rdmc_receive_handler;
-            rdmc_receive_handler = [this, subgroup_num, shard_rank, sender_rank,
-                                    node_id, num_shard_members, num_shard_senders,
-                                    shard_sst_indices](char* data, size_t size) {
-                assert(this->sst);
-                uint32_t num_received_offset = subgroup_to_num_received_offset.at(subgroup_num);
-                std::lock_guard<std::mutex> lock(msg_state_mtx);
-                header* h = (header*)data;
-                long long int index = h->index;
-                auto beg_index = index;
-                long long int sequence_number = index * num_shard_senders + sender_rank;
-
-                logger->debug("Locally received message in subgroup {}, sender rank {}, index {}", subgroup_num, shard_rank, index);
-
-                // Move message from current_receives to locally_stable_rdmc_messages.
-                if(node_id == members[member_index]) {
-                    assert(current_sends[subgroup_num]);
-                    locally_stable_rdmc_messages[subgroup_num][sequence_number] = std::move(*current_sends[subgroup_num]);
-                    current_sends[subgroup_num] = std::experimental::nullopt;
-                } else {
-                    auto it = current_receives.find({subgroup_num, sequence_number});
-                    assert(it != current_receives.end());
-                    auto& message = it->second;
-                    locally_stable_rdmc_messages[subgroup_num].emplace(sequence_number, std::move(message));
-                    current_receives.erase(it);
-                }
-                // Add empty messages to locally_stable_rdmc_messages for each turn that the sender is skipping.
-                for(unsigned int j = 0; j < h->pause_sending_turns; ++j) {
-                    index++;
-                    sequence_number += num_shard_senders;
-                    locally_stable_rdmc_messages[subgroup_num][sequence_number] = {node_id, index, 0, 0};
-                }
-
-                auto new_num_received = resolve_num_received(beg_index, index, num_received_offset + sender_rank);
-                // deliver immediately if in raw mode
-                if(subgroup_to_mode.at(subgroup_num) == Mode::RAW) {
-                    // issue stability upcalls for the recently sequenced messages
-                    for(uint i = sst->num_received[member_index][num_received_offset + sender_rank] + 1; i <= new_num_received; ++i) {
-                        auto seq_num = i * num_shard_senders + sender_rank;
-                        if(!locally_stable_sst_messages[subgroup_num].empty()
-                           && locally_stable_sst_messages[subgroup_num].begin()->first == seq_num) {
-                            auto& msg = locally_stable_sst_messages[subgroup_num].begin()->second;
-                            if(msg.size > 0) {
-                                char* buf = const_cast<char*>(msg.buf);
-                                header* h = (header*)(buf);
-                                callbacks.global_stability_callback(subgroup_num, msg.sender_id,
-                                                                    msg.index, buf + h->header_size,
-                                                                    msg.size - h->header_size);
-                                if(node_id == members[member_index]) {
-                                    pending_message_timestamps[subgroup_num].erase(h->timestamp);
-                                }
-                            }
-                            locally_stable_sst_messages[subgroup_num].erase(locally_stable_sst_messages[subgroup_num].begin());
-                        } else {
-                            assert(!locally_stable_rdmc_messages[subgroup_num].empty());
-                            auto it2 = locally_stable_rdmc_messages[subgroup_num].begin();
-                            assert(it2->first == seq_num);
-                            auto& msg = it2->second;
-                            if(msg.size > 0) {
-                                char* buf = msg.message_buffer.buffer.get();
-                                header* h = (header*)(buf);
-                                callbacks.global_stability_callback(subgroup_num, msg.sender_id,
-                                                                    msg.index, buf + h->header_size,
-                                                                    msg.size - h->header_size);
-                                free_message_buffers[subgroup_num].push_back(std::move(msg.message_buffer));
-                                if(node_id == members[member_index]) {
-                                    pending_message_timestamps[subgroup_num].erase(h->timestamp);
-                                }
-                            }
-                            locally_stable_rdmc_messages[subgroup_num].erase(it2);
-                        }
-                    }
-                }
-                if(new_num_received > sst->num_received[member_index][num_received_offset + sender_rank]) {
-                    sst->num_received[member_index][num_received_offset + sender_rank] = new_num_received;
-                    // std::atomic_signal_fence(std::memory_order_acq_rel);
-                    auto* min_ptr = std::min_element(&sst->num_received[member_index][num_received_offset],
-                                                     &sst->num_received[member_index][num_received_offset + num_shard_senders]);
-                    uint min_index = std::distance(&sst->num_received[member_index][num_received_offset], min_ptr);
-                    auto new_seq_num = (*min_ptr + 1) * num_shard_senders + min_index - 1;
-                    if((long long int)new_seq_num > sst->seq_num[member_index][subgroup_num]) {
-                        logger->debug("Updating seq_num for subgroup {} to {}", subgroup_num, new_seq_num);
-                        sst->seq_num[member_index][subgroup_num] = new_seq_num;
-                        // std::atomic_signal_fence(std::memory_order_acq_rel);
-                        // DERECHO_LOG(node_id, index, "received_message");
-                        // DERECHO_LOG(-1, -1, "stable_num_put_start");
-                        sst->put(shard_sst_indices,
-                                 (char*)std::addressof(sst->seq_num[0][subgroup_num]) - sst->getBaseAddress(),
-                                 sizeof(long long int));
-                        // DERECHO_LOG(node_id, new_seq_num, "updated_seq_num");
-                        // DERECHO_LOG(-1, -1, "stable_num_put_end");
-                    }
-                    // DERECHO_LOG(-1, -1, "num_received_put_start");
-                    sst->put(shard_sst_indices,
-                             (char*)std::addressof(sst->num_received[0][num_received_offset + sender_rank]) - sst->getBaseAddress(),
-                             sizeof(long long int));
-                    // DERECHO_LOG(-1, -1, "num_received_put_end");
-                }
-            };
-            // Capture rdmc_receive_handler by copy! The reference to it won't be valid after this constructor ends!
-            auto receive_handler_plus_notify =
-                    [this, rdmc_receive_handler](char* data, size_t size) {
-                        rdmc_receive_handler(data, size);
-                        // signal background writer thread
-                        sender_cv.notify_all();
-                    };
-
-            // Create a "rotated" vector of members in which the currently selected shard member (shard_rank) is first
-            std::vector<uint32_t> rotated_shard_members(shard_members.size());
-            for(uint k = 0; k < num_shard_members; ++k) {
-                rotated_shard_members[k] = shard_members[(shard_rank + k) % num_shard_members];
-            }
 
             // don't create rdmc group if there's only one member in the shard
             if(num_shard_members <= 1) {
                 continue;
             }
 
-            if(node_id == members[member_index]) {
-                //Create a group in which this node is the sender, and only self-receives happen
-                if(!rdmc::create_group(
-                           rdmc_group_num_offset, rotated_shard_members, block_size, type,
-                           [this](size_t length) -> rdmc::receive_destination {
-                               assert(false);
-                               return {nullptr, 0};
-                           },
-                           receive_handler_plus_notify,
-                           [](std::experimental::optional<uint32_t>) {})) {
-                    return false;
+            // A "rotated" vector of members in which the currently selected shard member (shard_rank) is first
+            std::vector<node_id_t> rotated_members = rotated_shard_members(subgroup_num, shard_rank);
+            auto kept_group = rdmc_groups.find({subgroup_num, rotated_members});
+            if(kept_group != rdmc_groups.end()) {
+                // Taken over from the previous view, already with this view's upcalls
+                if(node_id == members[member_index]) {
+                    subgroup_to_rdmc_group[subgroup_num] = kept_group->second;
                 }
-                subgroup_to_rdmc_group[subgroup_num] = rdmc_group_num_offset;
-                rdmc_group_num_offset++;
-            } else {
-                if(!rdmc::create_group(
-                           rdmc_group_num_offset, rotated_shard_members, block_size, type,
-                           [this, subgroup_num, node_id, sender_rank, num_shard_senders](size_t length) {
-                               std::lock_guard<std::mutex> lock(msg_state_mtx);
-                               assert(!free_message_buffers[subgroup_num].empty());
-                               //Create a Message struct to receive the data into.
-                               RDMCMessage msg;
-                               msg.sender_id = node_id;
-                               msg.index = sst->num_received[member_index][subgroup_to_num_received_offset.at(subgroup_num) + sender_rank] + 1;
-                               msg.size = length;
-                               msg.message_buffer = std::move(free_message_buffers[subgroup_num].back());
-                               free_message_buffers[subgroup_num].pop_back();
-
-                               rdmc::receive_destination ret{msg.message_buffer.mr, 0};
-                               auto sequence_number = msg.index * num_shard_senders + sender_rank;
-                               current_receives[{subgroup_num, sequence_number}] = std::move(msg);
-
-                               assert(ret.mr->buffer != nullptr);
-                               return ret;
-                           },
-                           rdmc_receive_handler, [](std::experimental::optional<uint32_t>) {})) {
-                    return false;
+                continue;
+            }
+
+            if(lazy_rdmc_groups) {
+                // Only the number is reserved for now
+                LazyRDMCGroup& lazy_group = lazy_groups[subgroup_to_num_received_offset.at(subgroup_num) + sender_rank];
+                lazy_group.subgroup_num = subgroup_num;
+                lazy_group.shard_rank = shard_rank;
+                lazy_group.sender_rank = sender_rank;
+                lazy_group.rotated_members = rotated_members;
+                lazy_group.group_number = rdmc_group_num_offset;
+                lazy_group.member_rows = shard_sst_indices;
+                if(node_id == members[member_index]) {
+                    subgroup_to_rdmc_group[subgroup_num] = rdmc_group_num_offset;
                 }
                 rdmc_group_num_offset++;
+                continue;
+            }
+
+            auto upcalls = make_rdmc_upcalls(subgroup_num, shard_rank, sender_rank);
+            if(!rdmc::create_group(
+                       rdmc_group_num_offset, rotated_members, block_size, type,
+                       upcalls.first, upcalls.second,
+                       [](std::experimental::optional<uint32_t>) {}, adaptive_block_size,
+                       rdmc_block_writes ? max_msg_size : 0, rdmc_service_level_of(subgroup_num))) {
+                return false;
+            }
+            rdmc_groups[{subgroup_num, rotated_members}] = rdmc_group_num_offset;
+            if(node_id == members[member_index]) {
+                subgroup_to_rdmc_group[subgroup_num] = rdmc_group_num_offset;
             }
+            rdmc_group_num_offset++;
         }
     }
-    //    std::cout << "The members are" << std::endl;
-    //    for(uint i = 0; i < num_members; ++i) {
-    //        std::cout << members[i] << " ";
-    //    }
-    //    std::cout << std::endl;
     return true;
 }
 
+void MulticastGroup::create_raw_send_rings() {
+    if(!raw_send_rings || lazy_rdmc_groups || !rdmc_sst_groups_created) {
+        return;
+    }
+    for(const auto& p : subgroup_to_rdmc_group) {
+        const subgroup_id_t subgroup_num = p.first;
+        const SubgroupSendState& state = subgroup_send_states[subgroup_num];
+        if(!state.raw_mode || !state.is_sender) {
+            continue;
+        }
+        send_rings[subgroup_num] = std::make_shared<RawSendRing>(
+                window_size, max_msg_size, sst->vid[member_index], sst,
+                state.num_received_column, state.shard_sst_indices,
+                future_message_indices[subgroup_num], p.second,
+                subgroup_metrics[subgroup_num]->messages_sent,
+                [this]() {
+                    if(idle_sender_threads) {
+                        notify_senders();
+                    }
+                });
+    }
+}
+
+void MulticastGroup::take_over_raw_send_rings(MulticastGroup& old_group) {
+    for(subgroup_id_t subgroup_num = 0; subgroup_num < old_group.send_rings.size(); ++subgroup_num) {
+        const std::shared_ptr<RawSendRing>& old_ring = old_group.send_rings[subgroup_num];
+        if(!old_ring) {
+            continue;
+        }
+        old_ring->close();
+        if(subgroup_num < send_rings.size() && send_rings[subgroup_num]) {
+            send_rings[subgroup_num]->take_over(*old_ring);
+            continue;
+        }
+        if(subgroup_num >= total_num_subgroups || !subgroup_send_states[subgroup_num].is_sender) {
+            continue;
+        }
+        // Without a ring in this view, the messages are queued like the others
+        std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+        old_ring->for_each_unfinished([&](const char* message, long long unsigned int size) {
+            if(free_message_buffers[subgroup_num].empty()) {
+                return;
+            }
+            RDMCMessage msg;
+            msg.sender_id = members[member_index];
+            msg.index = future_message_indices[subgroup_num];
+            msg.size = size;
+            msg.message_buffer = free_message_buffers[subgroup_num].take(size);
+            memcpy(msg.message_buffer.buffer(), message, size);
+            header* h = (header*)msg.message_buffer.buffer();
+            h->index = msg.index;
+            h->vid = sst->vid[member_index];
+            future_message_indices[subgroup_num] += h->pause_sending_turns + 1;
+            pending_sends[subgroup_num].push(std::move(msg));
+        });
+        subgroup_metrics[subgroup_num]->pending_sends.set(pending_sends[subgroup_num].size());
+    }
+}
+
+void MulticastGroup::preallocate_message_windows(subgroup_id_t subgroup_num) {
+    auto num_shard_members = subgroup_to_membership.at(subgroup_num).size();
+    auto num_shard_senders = get_num_senders(subgroup_to_senders_and_sender_rank.at(subgroup_num).first);
+    current_receives[subgroup_num].resize(num_shard_senders);
+    locally_stable_rdmc_messages[subgroup_num] = MessageWindow<RDMCMessage>(window_size * num_shard_members);
+    locally_stable_sst_messages[subgroup_num] = MessageWindow<SSTMessage>(window_size * num_shard_members);
+    non_persistent_messages[subgroup_num] = MessageWindow<RDMCMessage>(window_size * num_shard_members);
+}
+
+void MulticastGroup::initialize_send_states() {
+    subgroup_send_states.resize(total_num_subgroups);
+    for(const auto& p : subgroup_to_senders_and_sender_rank) {
+        subgroup_id_t subgroup_num = p.first;
+        SubgroupSendState& state = subgroup_send_states[subgroup_num];
+        state.shard_sender_index = p.second.second;
+        state.is_sender = state.shard_sender_index >= 0;
+        state.raw_mode = subgroup_to_mode.at(subgroup_num) == Mode::RAW;
+        state.fifo_mode = subgroup_to_mode.at(subgroup_num) == Mode::FIFO;
+        state.num_shard_senders = get_num_senders(p.second.first);
+        state.num_received_column = subgroup_to_num_received_offset.at(subgroup_num)
+                                    + std::max(state.shard_sender_index, 0);
+        state.shard_sst_indices = get_shard_sst_indices(subgroup_num);
+        // Latencies are only measured at delivery, which raw subgroups skip
+        transport_selectors[subgroup_num].configure(sst_multicast_threshold,
+                                                    adaptive_transport && !state.raw_mode);
+        // The delivery lag is measured with delivered_num, which only
+        // ordered subgroups keep
+        window_controllers[subgroup_num].configure(min_window_size, window_size,
+                                                   adaptive_window && !state.raw_mode && !state.fifo_mode);
+    }
+
+    // Deal the subgroups this node sends in out to the sender threads, but
+    // don't start more threads than there are such subgroups. The
+    // latency-critical ones get a thread of their own on top of those, so
+    // that their messages never wait for a bulk send to be posted
+    std::vector<subgroup_id_t> sending_subgroups;
+    std::vector<subgroup_id_t> critical_sending_subgroups;
+    for(subgroup_id_t subgroup_num = 0; subgroup_num < total_num_subgroups; ++subgroup_num) {
+        if(!subgroup_send_states[subgroup_num].is_sender) {
+            continue;
+        }
+        if(latency_critical_subgroups.count(subgroup_num)) {
+            critical_sending_subgroups.push_back(subgroup_num);
+        } else {
+            sending_subgroups.push_back(subgroup_num);
+        }
+    }
+    auto num_threads = std::max<std::size_t>(critical_sending_subgroups.empty() ? 1 : 0,
+                                             std::min<std::size_t>(num_sender_threads, sending_subgroups.size()));
+    sender_thread_subgroups.assign(num_threads, {});
+    for(std::size_t i = 0; i < sending_subgroups.size(); ++i) {
+        sender_thread_subgroups[i % num_threads].push_back(sending_subgroups[i]);
+    }
+    if(!critical_sending_subgroups.empty()) {
+        sender_thread_subgroups.push_back(critical_sending_subgroups);
+    }
+}
+
+long long int MulticastGroup::compute_send_frontier(const SubgroupSendState& state,
+                                                     subgroup_id_t subgroup_num) {
+    if(state.raw_mode) {
+        return sst->reduce_min(sst->num_received, state.num_received_column, state.shard_sst_indices);
+    }
+    // FIFO subgroups are never logged, so persisted_num doesn't hold them back
+    if(state.fifo_mode) {
+        return sst->reduce_min(sst->fifo_delivered_num, state.num_received_column, state.shard_sst_indices);
+    }
+    long long int frontier = sst->reduce_min(sst->delivered_num, subgroup_num, state.shard_sst_indices);
+    if(file_writer) {
+        frontier = std::min(frontier, sst->reduce_min(sst->persisted_num, subgroup_num, state.shard_sst_indices));
+    }
+    return frontier;
+}
+
 void MulticastGroup::initialize_sst_row() {
     auto num_received_size = sst->num_received.size();
     auto seq_num_size = sst->seq_num.size();
     for(uint i = 0; i < num_members; ++i) {
         for(uint j = 0; j < num_received_size; ++j) {
             sst->num_received[i][j] = -1;
+            sst->fifo_delivered_num[i][j] = -1;
+            sst->skipped_index[i][j] = -1;
         }
         for(uint j = 0; j < seq_num_size; ++j) {
             sst->seq_num[i][j] = -1;
@@ -537,31 +1002,85 @@ void MulticastGroup::initialize_sst_row() {
             sst->delivered_num[i][j] = -1;
             sst->persisted_num[i][j] = -1;
         }
+        for(uint j = 0; j < sst->subtree_min.size(); ++j) {
+            sst->subtree_min[i][j] = -1;
+            sst->shard_min[i][j] = -1;
+        }
     }
     sst->put();
     sst->sync_with_members();
 }
 
+MulticastGroup::AggregationTree MulticastGroup::make_aggregation_tree(const std::vector<node_id_t>& shard_members) const {
+    AggregationTree tree;
+    const uint32_t num_shard_members = shard_members.size();
+    const uint32_t rank = index_of(shard_members, members[member_index]);
+    const uint32_t fanout = std::max(aggregation_fanout, 1u);
+    tree.is_root = rank == 0;
+    if(!tree.is_root) {
+        tree.parent_row.push_back(node_id_to_sst_index.at(shard_members[(rank - 1) / fanout]));
+    }
+    for(uint32_t child = rank * fanout + 1; child <= rank * fanout + fanout && child < num_shard_members; ++child) {
+        tree.child_rows.push_back(node_id_to_sst_index.at(shard_members[child]));
+    }
+    return tree;
+}
+
+void MulticastGroup::aggregate_stability(DerechoSST& sst, subgroup_id_t subgroup_num, const AggregationTree& tree) {
+    const uint32_t seq_index = 2 * subgroup_num;
+    const uint32_t stable_index = 2 * subgroup_num + 1;
+    // Up the tree: the minimums over this node and its children's subtrees
+    long long int min_seq_num = sst.seq_num[member_index][subgroup_num];
+    long long int min_stable_num = sst.stable_num[member_index][subgroup_num];
+    for(auto child_row : tree.child_rows) {
+        min_seq_num = std::min(min_seq_num, (long long int)sst.subtree_min[child_row][seq_index]);
+        min_stable_num = std::min(min_stable_num, (long long int)sst.subtree_min[child_row][stable_index]);
+    }
+    if(min_seq_num > sst.subtree_min[member_index][seq_index]
+       || min_stable_num > sst.subtree_min[member_index][stable_index]) {
+        sst.subtree_min[member_index][seq_index] = std::max(min_seq_num, (long long int)sst.subtree_min[member_index][seq_index]);
+        sst.subtree_min[member_index][stable_index] = std::max(min_stable_num, (long long int)sst.subtree_min[member_index][stable_index]);
+        if(!tree.is_root) {
+            sst.put(tree.parent_row, (char*)std::addressof(sst.subtree_min[0][seq_index]) - sst.getBaseAddress(),
+                    2 * sizeof(long long int));
+        }
+    }
+    // Down the tree: the root's subtree is the whole shard
+    const uint32_t source_row = tree.is_root ? member_index : tree.parent_row[0];
+    long long int shard_seq_num = tree.is_root ? sst.subtree_min[member_index][seq_index] : sst.shard_min[source_row][seq_index];
+    long long int shard_stable_num = tree.is_root ? sst.subtree_min[member_index][stable_index] : sst.shard_min[source_row][stable_index];
+    if(shard_seq_num > sst.shard_min[member_index][seq_index]
+       || shard_stable_num > sst.shard_min[member_index][stable_index]) {
+        sst.shard_min[member_index][seq_index] = std::max(shard_seq_num, (long long int)sst.shard_min[member_index][seq_index]);
+        sst.shard_min[member_index][stable_index] = std::max(shard_stable_num, (long long int)sst.shard_min[member_index][stable_index]);
+        if(!tree.child_rows.empty()) {
+            sst.put(tree.child_rows, (char*)std::addressof(sst.shard_min[0][seq_index]) - sst.getBaseAddress(),
+                    2 * sizeof(long long int));
+        }
+    }
+    // Every message up to the shard's least seq_num has reached every member
+    if(sst.shard_min[member_index][seq_index] > sst.stable_num[member_index][subgroup_num]) {
+        DERECHO_HOT_DEBUG(logger, "Subgroup {}, updating stable_num to {}", subgroup_num, sst.shard_min[member_index][seq_index]);
+        sst.stable_num[member_index][subgroup_num] = sst.shard_min[member_index][seq_index];
+    }
+}
+
 void MulticastGroup::deliver_message(RDMCMessage& msg, subgroup_id_t subgroup_num) {
+    DERECHO_TRACE_POINT(subgroup_num, msg.index, -1, "deliver_message");
     if(msg.size > 0) {
-        char* buf = msg.message_buffer.buffer.get();
+        char* buf = msg.message_buffer.buffer();
         header* h = (header*)(buf);
-        // cooked send
-        if(h->cooked_send) {
-            buf += h->header_size;
-            auto payload_size = msg.size - h->header_size;
-            rpc_callback(subgroup_num, msg.sender_id, buf, payload_size);
-        }
-        // raw send
-        else {
-            callbacks.global_stability_callback(subgroup_num, msg.sender_id, msg.index,
-                                                buf + h->header_size, msg.size - h->header_size);
-        }
-        if(file_writer) {
+        if(msg.sender_id == members[member_index]) {
+            record_delivery_latency(subgroup_num, msg.size, false, h->timestamp);
+        }
+        deliver_to_application(subgroup_num, msg.sender_id, msg.index, buf, msg.size);
+        // The message log replays messages in the round-robin order, which
+        // FIFO subgroups don't deliver in
+        if(file_writer && subgroup_to_mode.at(subgroup_num) == Mode::ORDERED) {
             persistence::message msg_for_filewriter{buf + h->header_size,
-                                                    msg.size, (uint32_t)sst->vid[member_index],
+                                                    msg.size - h->header_size, (uint32_t)sst->vid[member_index],
                                                     msg.sender_id, (uint64_t)msg.index,
-                                                    h->cooked_send};
+                                                    h->cooked_send, subgroup_num};
             //the sequence number needs to use the sender's within-shard rank, not its ID
             auto& shard_members = subgroup_to_membership.at(subgroup_num);
             std::vector<int> shard_senders = subgroup_to_senders_and_sender_rank.at(subgroup_num).first;
@@ -574,37 +1093,31 @@ void MulticastGroup::deliver_message(RDMCMessage& msg, subgroup_id_t subgroup_nu
                     sender_rank++;
             }
             auto sequence_number = msg.index * num_shard_senders + sender_rank;
-            non_persistent_messages[subgroup_num].emplace(sequence_number, std::move(msg));
+            msg_for_filewriter.sequence_number = sequence_number;
+            non_persistent_messages[subgroup_num].insert(sequence_number, std::move(msg));
             file_writer->write_message(msg_for_filewriter);
         } else {
-            free_message_buffers[subgroup_num].push_back(std::move(msg.message_buffer));
+            recycle_message_buffer(subgroup_num, std::move(msg.message_buffer));
         }
     }
 }
 
 void MulticastGroup::deliver_message(SSTMessage& msg, subgroup_id_t subgroup_num) {
-    // DERECHO_LOG(-1, -1, "deliver_message()");
+    DERECHO_TRACE_POINT(subgroup_num, msg.index, -1, "deliver_message");
     if(msg.size > 0) {
         char* buf = const_cast<char*>(msg.buf);
         header* h = (header*)(buf);
-        // cooked send
-        if(h->cooked_send) {
-            buf += h->header_size;
-            auto payload_size = msg.size - h->header_size;
-            rpc_callback(subgroup_num, msg.sender_id, buf, payload_size);
-        }
-        // raw send
-        else {
-            // DERECHO_LOG(-1, -1, "start_stability_callback");
-            callbacks.global_stability_callback(subgroup_num, msg.sender_id, msg.index,
-                                                buf + h->header_size, msg.size - h->header_size);
-            // DERECHO_LOG(-1, -1, "end_stability_callback");
-        }
-        if(file_writer) {
+        if(msg.sender_id == members[member_index]) {
+            record_delivery_latency(subgroup_num, msg.size, true, h->timestamp);
+        }
+        deliver_to_application(subgroup_num, msg.sender_id, msg.index, buf, msg.size);
+        // The message log replays messages in the round-robin order, which
+        // FIFO subgroups don't deliver in
+        if(file_writer && subgroup_to_mode.at(subgroup_num) == Mode::ORDERED) {
             persistence::message msg_for_filewriter{buf + h->header_size,
-                                                    msg.size, (uint32_t)sst->vid[member_index],
+                                                    msg.size - h->header_size, (uint32_t)sst->vid[member_index],
                                                     msg.sender_id, (uint64_t)msg.index,
-                                                    h->cooked_send};
+                                                    h->cooked_send, subgroup_num};
             //the sequence number needs to use the sender's within-shard rank, not its ID
             auto& shard_members = subgroup_to_membership.at(subgroup_num);
             std::vector<int> shard_senders = subgroup_to_senders_and_sender_rank.at(subgroup_num).first;
@@ -617,101 +1130,331 @@ void MulticastGroup::deliver_message(SSTMessage& msg, subgroup_id_t subgroup_num
                     sender_rank++;
             }
             auto sequence_number = msg.index * num_shard_senders + sender_rank;
+            msg_for_filewriter.sequence_number = sequence_number;
             non_persistent_sst_messages[subgroup_num].emplace(sequence_number, std::move(msg));
             file_writer->write_message(msg_for_filewriter);
         }
     }
 }
 
-void MulticastGroup::deliver_messages_upto(
-        const std::vector<long long int>& max_indices_for_senders,
-        subgroup_id_t subgroup_num, uint32_t num_shard_senders) {
-    // DERECHO_LOG(-1, -1, "deliver_messages_upto");
-    assert(max_indices_for_senders.size() == (size_t)num_shard_senders);
-    std::lock_guard<std::mutex> lock(msg_state_mtx);
-    auto curr_seq_num = sst->delivered_num[member_index][subgroup_num];
-    auto max_seq_num = curr_seq_num;
-    for(uint sender = 0; sender < num_shard_senders; sender++) {
-        max_seq_num = std::max(max_seq_num,
-                               max_indices_for_senders[sender] * num_shard_senders + sender);
+void MulticastGroup::record_delivery_latency(subgroup_id_t subgroup_num, uint32_t msg_size,
+                                             bool via_sst, uint64_t send_timestamp) {
+    auto now = get_time();
+    // The timestamps come from the realtime clock, which can jump backwards
+    if(now > send_timestamp) {
+        transport_selectors[subgroup_num].record_delivery(msg_size, via_sst, now - send_timestamp);
+        subgroup_metrics[subgroup_num]->send_to_stability_ns.record(now - send_timestamp);
     }
-    // DERECHO_LOG(-1, -1, "deliver_messages_upto_loop");
-    for(auto seq_num = curr_seq_num; seq_num <= max_seq_num; seq_num++) {
-        auto msg_ptr = locally_stable_rdmc_messages[subgroup_num].find(seq_num);
-        if(msg_ptr != locally_stable_rdmc_messages[subgroup_num].end()) {
-            deliver_message(msg_ptr->second, subgroup_num);
-            // DERECHO_LOG(-1, -1, "erase_message");
-            locally_stable_rdmc_messages[subgroup_num].erase(msg_ptr);
-            // DERECHO_LOG(-1, -1, "erase_message_done");
-        } else {
-            auto sst_msg_ptr = locally_stable_sst_messages[subgroup_num].find(seq_num);
-            if(sst_msg_ptr != locally_stable_sst_messages[subgroup_num].end()) {
-                deliver_message(sst_msg_ptr->second, subgroup_num);
-                // DERECHO_LOG(-1, -1, "erase_message");
-                locally_stable_sst_messages[subgroup_num].erase(sst_msg_ptr);
-                // DERECHO_LOG(-1, -1, "erase_message_done");
-            }
-        }
+}
+
+void MulticastGroup::make_version(subgroup_id_t subgroup_num, long long int seq_num, uint64_t msg_ts) {
+    uint64_t msg_ts_us = msg_ts / 1e3;
+    if(msg_ts_us == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        msg_ts_us = (uint64_t)now.tv_sec * 1e6 + now.tv_nsec / 1e3;
     }
+    // The version has to be made after the message's upcall has changed
+    // the object, so in a batch it is made after the last message's upcall
+    DeliveryBatch& batch = delivery_batches[subgroup_num];
+    if(!batch.deliveries.empty()) {
+        batch.deliveries.back().versions.emplace_back(seq_num, msg_ts_us);
+        return;
+    }
+    run_in_delivery_order(subgroup_num, [this, subgroup_num, seq_num, msg_ts_us]() {
+        std::get<0>(persistence_manager_callbacks)(subgroup_num, (persistence_version_t)seq_num, HLC{msg_ts_us, 0});
+    });
 }
 
-void MulticastGroup::register_predicates() {
-    for(const auto& p : subgroup_to_shard_and_rank) {
-        subgroup_id_t subgroup_num = p.first;
-        uint32_t shard_num, shard_index;
-        std::tie(shard_num, shard_index) = p.second;
-        std::vector<node_id_t> shard_members = subgroup_to_membership.at(subgroup_num);
-        auto num_shard_members = shard_members.size();
-        auto num_received_offset = subgroup_to_num_received_offset.at(subgroup_num);
-        std::vector<int> shard_senders = subgroup_to_senders_and_sender_rank.at(subgroup_num).first;
-        auto num_shard_senders = get_num_senders(shard_senders);
-        std::map<uint32_t, uint32_t> shard_ranks_by_sender_rank;
-        for(uint j = 0, l = 0; j < num_shard_members; ++j) {
-            if(shard_senders[j]) {
-                shard_ranks_by_sender_rank[l] = j;
-                l++;
+void MulticastGroup::deliver_to_application(subgroup_id_t subgroup_num, node_id_t sender_id, long long int index,
+                                            char* buf, long long int size) {
+    header* h = (header*)(buf);
+    char* payload = buf + h->header_size;
+    long long int payload_size = size - h->header_size;
+    const bool cooked_send = h->cooked_send;
+    metrics::SubgroupMetrics& delivery_metrics = *subgroup_metrics[subgroup_num];
+    // The message became stable when its delivery was decided, just now
+    const uint64_t stable_time = get_time();
+    MessageStageTracker* stage_tracker = sender_id == members[member_index]
+                                                 ? stage_trackers[subgroup_num].get()
+                                                 : nullptr;
+    SendFrontiers* own_frontiers = sender_id == members[member_index]
+                                           ? send_frontiers[subgroup_num].get()
+                                           : nullptr;
+    if(stage_tracker) {
+        stage_tracker->stamp(index, metrics::STABLE, stable_time);
+    }
+    if(own_frontiers) {
+        own_frontiers->advance(metrics::STABLE, index);
+    }
+    // A fragment of a streamed object is only added to it, and the object is
+    // delivered, once, with its last fragment
+    std::vector<char> object;
+    if(h->fragment != Fragment::WHOLE) {
+        if(!stream_assemblies->add(subgroup_num, sender_id, h->fragment, payload, payload_size, object)) {
+            if(stage_tracker) {
+                stage_tracker->stamp(index, metrics::DELIVERED, stable_time);
             }
-        }
-
-        auto receiver_pred = [this, subgroup_num, shard_members, num_shard_members,
-                              shard_ranks_by_sender_rank, num_shard_senders,
-                              num_received_offset](const DerechoSST& sst) {
-            for(uint j = 0; j < num_shard_senders; ++j) {
-                auto num_received = sst.num_received_sst[member_index][num_received_offset + j] + 1;
-                uint32_t slot = num_received % window_size;
-                if((long long int)sst.slots[node_id_to_sst_index.at(shard_members[shard_ranks_by_sender_rank.at(j)])]
-                                           [subgroup_num * window_size + slot]
-                                                   .next_seq
-                   == num_received / window_size + 1) {
-                    return true;
-                }
+            if(own_frontiers) {
+                own_frontiers->advance(metrics::DELIVERED, index);
             }
-            return false;
-        };
-        auto num_times = window_size / 2;
-        if(!num_times) {
-            num_times = 1;
+            return;
         }
-        auto sst_receive_handler = [this, subgroup_num, shard_members, num_shard_members,
-                                    shard_ranks_by_sender_rank, num_shard_senders,
+        payload = object.data();
+        payload_size = object.size();
+    }
+    delivery_metrics.messages_delivered.add();
+    delivery_metrics.bytes_delivered.add(payload_size);
+    if(batches_deliveries()) {
+        DeliveryBatch& batch = delivery_batches[subgroup_num];
+        const bool owned = h->fragment != Fragment::WHOLE;
+        if(owned) {
+            batch.payloads.push_back(std::move(object));
+            payload = batch.payloads.back().data();
+        }
+        batch.messages.push_back({sender_id, index, payload, payload_size});
+        batch.deliveries.push_back({cooked_send, owned, stable_time, stage_tracker, own_frontiers, {}});
+        return;
+    }
+    if(!delivery_executors[subgroup_num]) {
+        if(cooked_send) {
+            rpc_callback(subgroup_num, sender_id, payload, payload_size);
+        } else {
+            callbacks.global_stability_callback(subgroup_num, sender_id, index, payload, payload_size);
+        }
+        const uint64_t delivered_time = get_time();
+        delivery_metrics.stability_to_delivery_ns.record(delivered_time - stable_time);
+        if(stage_tracker) {
+            stage_tracker->stamp(index, metrics::DELIVERED, delivered_time);
+        }
+        if(own_frontiers) {
+            own_frontiers->advance(metrics::DELIVERED, index);
+        }
+        return;
+    }
+    // The message's buffer is reused as soon as it is delivered, so the
+    // upcall gets a copy of the payload, unless it is a streamed object
+    if(h->fragment == Fragment::WHOLE) {
+        object.assign(payload, payload + payload_size);
+    }
+    delivery_executors[subgroup_num]->post(
+            [this, subgroup_num, sender_id, index, cooked_send, stable_time, &delivery_metrics, stage_tracker,
+             own_frontiers, data = std::move(object)]() mutable {
+                if(cooked_send) {
+                    rpc_callback(subgroup_num, sender_id, data.data(), data.size());
+                } else {
+                    callbacks.global_stability_callback(subgroup_num, sender_id, index, data.data(), data.size());
+                }
+                const uint64_t delivered_time = get_time();
+                delivery_metrics.stability_to_delivery_ns.record(delivered_time - stable_time);
+                if(stage_tracker) {
+                    stage_tracker->stamp(index, metrics::DELIVERED, delivered_time);
+                }
+                if(own_frontiers) {
+                    own_frontiers->advance(metrics::DELIVERED, index);
+                }
+            });
+}
+
+void MulticastGroup::flush_delivery_batch(subgroup_id_t subgroup_num) {
+    DeliveryBatch& batch = delivery_batches[subgroup_num];
+    if(batch.messages.empty()) {
+        return;
+    }
+    if(!delivery_executors[subgroup_num]) {
+        deliver_batch(subgroup_num, batch);
+        batch.clear();
+        return;
+    }
+    // The message buffers are reused once the pass is over, so the executor
+    // gets copies of the payloads that are in them
+    auto posted = std::make_shared<DeliveryBatch>(std::move(batch));
+    batch.clear();
+    for(std::size_t i = 0; i < posted->messages.size(); ++i) {
+        DeliveredMessage& message = posted->messages[i];
+        if(!posted->deliveries[i].owned) {
+            posted->payloads.emplace_back(message.buf, message.buf + message.size);
+            message.buf = posted->payloads.back().data();
+        }
+    }
+    delivery_executors[subgroup_num]->post([this, subgroup_num, posted]() {
+        deliver_batch(subgroup_num, *posted);
+    });
+}
+
+void MulticastGroup::deliver_batch(subgroup_id_t subgroup_num, DeliveryBatch& batch) {
+    metrics::SubgroupMetrics& delivery_metrics = *subgroup_metrics[subgroup_num];
+    auto delivered = [&](std::size_t i) {
+        const DeliveryBatch::Delivery& delivery = batch.deliveries[i];
+        for(const auto& version : delivery.versions) {
+            std::get<0>(persistence_manager_callbacks)(subgroup_num, (persistence_version_t)version.first,
+                                                       HLC{version.second, 0});
+        }
+        const uint64_t delivered_time = get_time();
+        delivery_metrics.stability_to_delivery_ns.record(delivered_time - delivery.stable_time);
+        if(delivery.stage_tracker) {
+            delivery.stage_tracker->stamp(batch.messages[i].index, metrics::DELIVERED, delivered_time);
+        }
+        if(delivery.send_frontiers) {
+            delivery.send_frontiers->advance(metrics::DELIVERED, batch.messages[i].index);
+        }
+    };
+    // Each run of RPC messages or of raw ones goes to its own upcall
+    std::size_t start = 0;
+    while(start < batch.messages.size()) {
+        const bool cooked_send = batch.deliveries[start].cooked_send;
+        std::size_t end = start + 1;
+        while(end < batch.messages.size() && batch.deliveries[end].cooked_send == cooked_send) {
+            ++end;
+        }
+        if(cooked_send && rpc_batch_callback) {
+            auto delivered_from_start = [&](std::size_t i) { delivered(start + i); };
+            rpc_batch_callback(subgroup_num, &batch.messages[start], end - start,
+                               batch_delivered_t::to(delivered_from_start));
+        } else if(!cooked_send && callbacks.global_stability_batch_callback) {
+            callbacks.global_stability_batch_callback(subgroup_num, &batch.messages[start], end - start);
+            for(std::size_t i = start; i < end; ++i) {
+                delivered(i);
+            }
+        } else {
+            for(std::size_t i = start; i < end; ++i) {
+                const DeliveredMessage& message = batch.messages[i];
+                if(cooked_send) {
+                    rpc_callback(subgroup_num, message.sender_id, message.buf, message.size);
+                } else {
+                    callbacks.global_stability_callback(subgroup_num, message.sender_id, message.index,
+                                                        message.buf, message.size);
+                }
+                delivered(i);
+            }
+        }
+        start = end;
+    }
+}
+
+void MulticastGroup::run_in_delivery_order(subgroup_id_t subgroup_num, std::function<void()> step) {
+    if(delivery_executors[subgroup_num]) {
+        delivery_executors[subgroup_num]->post(std::move(step));
+    } else {
+        step();
+    }
+}
+
+void MulticastGroup::deliver_messages_upto(
+        const std::vector<long long int>& max_indices_for_senders,
+        subgroup_id_t subgroup_num, uint32_t num_shard_senders) {
+    assert(max_indices_for_senders.size() == (size_t)num_shard_senders);
+    std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+    auto curr_seq_num = sst->delivered_num[member_index][subgroup_num];
+    auto max_seq_num = curr_seq_num;
+    for(uint sender = 0; sender < num_shard_senders; sender++) {
+        max_seq_num = std::max(max_seq_num,
+                               max_indices_for_senders[sender] * num_shard_senders + sender);
+    }
+    for(auto seq_num = curr_seq_num; seq_num <= max_seq_num; seq_num++) {
+        RDMCMessage* msg_ptr = locally_stable_rdmc_messages[subgroup_num].find(seq_num);
+        if(msg_ptr) {
+            deliver_message(*msg_ptr, subgroup_num);
+            // The version has to be made here too, or the logs of the
+            // persistent fields would lag behind the objects
+            if(msg_ptr->size > 0 && subgroup_to_mode.at(subgroup_num) == Mode::ORDERED) {
+                make_version(subgroup_num, seq_num, ((header*)msg_ptr->message_buffer.buffer())->timestamp);
+            }
+            locally_stable_rdmc_messages[subgroup_num].erase(seq_num);
+        } else {
+            SSTMessage* sst_msg_ptr = locally_stable_sst_messages[subgroup_num].find(seq_num);
+            if(sst_msg_ptr) {
+                deliver_message(*sst_msg_ptr, subgroup_num);
+                if(sst_msg_ptr->size > 0 && subgroup_to_mode.at(subgroup_num) == Mode::ORDERED) {
+                    make_version(subgroup_num, seq_num, ((header*)sst_msg_ptr->buf)->timestamp);
+                }
+                locally_stable_sst_messages[subgroup_num].erase(seq_num);
+            }
+        }
+    }
+    flush_delivery_batch(subgroup_num);
+    // The view change that cleans up the ragged edge goes on once the
+    // messages of the old view have all reached the application
+    if(delivery_executors[subgroup_num]) {
+        delivery_executors[subgroup_num]->drain();
+    }
+}
+
+void MulticastGroup::register_predicates() {
+    for(const auto& p : subgroup_to_shard_and_rank) {
+        subgroup_id_t subgroup_num = p.first;
+        // A latency-critical subgroup's predicates are evaluated ahead of the
+        // others, and again after every other trigger
+        const sst::PredicateType recurrent = latency_critical_subgroups.count(subgroup_num)
+                                                     ? sst::PredicateType::URGENT
+                                                     : sst::PredicateType::RECURRENT;
+        uint32_t shard_num, shard_index;
+        std::tie(shard_num, shard_index) = p.second;
+        std::vector<node_id_t> shard_members = subgroup_to_membership.at(subgroup_num);
+        auto num_shard_members = shard_members.size();
+        auto num_received_offset = subgroup_to_num_received_offset.at(subgroup_num);
+        std::vector<int> shard_senders = subgroup_to_senders_and_sender_rank.at(subgroup_num).first;
+        auto num_shard_senders = get_num_senders(shard_senders);
+        std::map<uint32_t, uint32_t> shard_ranks_by_sender_rank;
+        for(uint j = 0, l = 0; j < num_shard_members; ++j) {
+            if(shard_senders[j]) {
+                shard_ranks_by_sender_rank[l] = j;
+                l++;
+            }
+        }
+
+        // The SST rows of the shard's senders, by sender rank
+        std::vector<uint32_t> sender_rows(num_shard_senders);
+        for(uint j = 0; j < num_shard_senders; ++j) {
+            sender_rows[j] = node_id_to_sst_index.at(shard_members[shard_ranks_by_sender_rank.at(j)]);
+        }
+        auto receiver_pred = [this, subgroup_num, sender_rows, num_shard_senders,
+                              num_received_offset](const DerechoSST& sst) {
+            auto& sst_multicast_group = *sst_multicast_group_ptrs[subgroup_num];
+            for(uint j = 0; j < num_shard_senders; ++j) {
+                if(skip_idle_senders
+                   && sst.skipped_index[sender_rows[j]][num_received_offset + j]
+                              > sst.num_received[member_index][num_received_offset + j]) {
+                    return true;
+                }
+                auto num_received = sst.num_received_sst[member_index][num_received_offset + j] + 1;
+                if(packed_sst_multicast) {
+                    if(*sst_multicast_group.published_count(sender_rows[j]) > (uint64_t)num_received) {
+                        return true;
+                    }
+                    continue;
+                }
+                uint32_t slot = num_received % window_size;
+                if((long long int)sst.slots[sender_rows[j]][subgroup_num * window_size + slot].next_seq
+                   == num_received / window_size + 1) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        auto sst_receive_handler = [this, subgroup_num, shard_members, num_shard_members,
+                                    shard_ranks_by_sender_rank, num_shard_senders,
                                     num_received_offset](uint32_t sender_rank, uint64_t index_ignored,
                                                          volatile char* data, uint32_t size) {
             header* h = (header*)data;
             long long int index = h->index;
             auto beg_index = index;
             long long int sequence_number = index * num_shard_senders + sender_rank;
-            logger->debug("Locally received message in subgroup {}, sender rank {}, index {}", subgroup_num, sender_rank, index);
+            DERECHO_HOT_DEBUG(logger, "Locally received message in subgroup {}, sender rank {}, index {}", subgroup_num, sender_rank, index);
 
             auto node_id = shard_members[shard_ranks_by_sender_rank.at(sender_rank)];
 
-            // DERECHO_LOG(node_id, index, "received_message");
-            locally_stable_sst_messages[subgroup_num][sequence_number] = {node_id, index, size, data};
+            DERECHO_TRACE_POINT(subgroup_num, sequence_number, -1, "received_message");
+            if(node_id == members[member_index] && stage_trackers[subgroup_num]) {
+                stage_trackers[subgroup_num]->stamp(index, metrics::SENT, get_time());
+            }
+            locally_stable_sst_messages[subgroup_num].insert(sequence_number, SSTMessage{node_id, index, size, data});
 
             // Add empty messages to locally_stable_sst_messages for each turn that the sender is skipping.
             for(unsigned int j = 0; j < h->pause_sending_turns; ++j) {
                 index++;
                 sequence_number += num_shard_senders;
-                locally_stable_sst_messages[subgroup_num][sequence_number] = {node_id, index, 0, 0};
+                locally_stable_sst_messages[subgroup_num].insert(sequence_number, SSTMessage{node_id, index, 0, 0});
             }
 
             auto new_num_received = resolve_num_received(beg_index, index, num_received_offset + sender_rank);
@@ -720,8 +1463,8 @@ void MulticastGroup::register_predicates() {
                 for(uint i = sst->num_received[member_index][num_received_offset + sender_rank] + 1; i <= new_num_received; ++i) {
                     auto seq_num = i * num_shard_senders + sender_rank;
                     if(!locally_stable_sst_messages[subgroup_num].empty()
-                       && locally_stable_sst_messages[subgroup_num].begin()->first == seq_num) {
-                        auto& msg = locally_stable_sst_messages[subgroup_num].begin()->second;
+                       && locally_stable_sst_messages[subgroup_num].front_seq() == seq_num) {
+                        auto& msg = locally_stable_sst_messages[subgroup_num].front();
                         if(msg.size > 0) {
                             char* buf = const_cast<char*>(msg.buf);
                             header* h = (header*)(buf);
@@ -732,113 +1475,156 @@ void MulticastGroup::register_predicates() {
                                 pending_message_timestamps[subgroup_num].erase(h->timestamp);
                             }
                         }
-                        locally_stable_sst_messages[subgroup_num].erase(locally_stable_sst_messages[subgroup_num].begin());
+                        locally_stable_sst_messages[subgroup_num].pop_front();
                     } else {
                         assert(!locally_stable_rdmc_messages[subgroup_num].empty());
-                        auto it2 = locally_stable_rdmc_messages[subgroup_num].begin();
-                        assert(it2->first == seq_num);
-                        auto& msg = it2->second;
+                        assert(locally_stable_rdmc_messages[subgroup_num].front_seq() == seq_num);
+                        auto& msg = locally_stable_rdmc_messages[subgroup_num].front();
                         if(msg.size > 0) {
-                            char* buf = msg.message_buffer.buffer.get();
+                            char* buf = msg.message_buffer.buffer();
                             header* h = (header*)(buf);
                             callbacks.global_stability_callback(subgroup_num, msg.sender_id,
                                                                 msg.index, buf + h->header_size,
                                                                 msg.size - h->header_size);
-                            free_message_buffers[subgroup_num].push_back(std::move(msg.message_buffer));
+                            recycle_message_buffer(subgroup_num, std::move(msg.message_buffer));
                             if(node_id == members[member_index]) {
                                 pending_message_timestamps[subgroup_num].erase(h->timestamp);
                             }
                         }
-                        locally_stable_rdmc_messages[subgroup_num].erase(it2);
+                        locally_stable_rdmc_messages[subgroup_num].pop_front();
                     }
                 }
             }
             sst->num_received[member_index][num_received_offset + sender_rank] = new_num_received;
         };
         uint64_t receiver_cnt = 0;
-        auto receiver_trig = [this, num_times, sst_receive_handler, subgroup_num, shard_members,
-                              num_shard_members, shard_ranks_by_sender_rank,
-                              num_shard_senders, num_received_offset, receiver_cnt](DerechoSST& sst) mutable {
+        // In packed mode, how far this node has read into each sender's ring
+        std::vector<uint64_t> ring_read_positions(num_shard_senders, 0);
+        // The counters are only read by the shard's members, so they are
+        // only written to them
+        const std::vector<uint32_t> shard_sst_indices = get_shard_sst_indices(subgroup_num);
+        auto receiver_trig = [this, sst_receive_handler, subgroup_num, shard_members,
+                              shard_ranks_by_sender_rank, sender_rows,
+                              num_shard_senders, num_received_offset, receiver_cnt,
+                              ring_read_positions, shard_sst_indices](DerechoSST& sst) mutable {
             receiver_cnt++;
-            // DERECHO_LOG(receiver_cnt, -1, "in receiver_trig");
-            std::lock_guard<std::mutex> lock(msg_state_mtx);
-            for(uint i = 0; i < num_times; ++i) {
+            std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+            // Take every message that has arrived, from every sender, and
+            // publish the counters once for the whole batch. Senders can't
+            // reuse a slot until that publication, so this ends after at most
+            // a window's worth of messages from each of them.
+            bool received_any = false;
+            for(bool progress = true; progress;) {
+                progress = false;
                 for(uint j = 0; j < num_shard_senders; ++j) {
-                    auto num_received = sst.num_received_sst[member_index][num_received_offset + j] + 1;
-                    uint32_t slot = num_received % window_size;
-                    long long int next_seq = (long long int)sst.slots[node_id_to_sst_index.at(shard_members[shard_ranks_by_sender_rank.at(j)])][subgroup_num * window_size + slot].next_seq;
-                    if(next_seq == num_received / window_size + 1) {
-                        sst_receive_handler(j, num_received,
-                                            sst.slots[node_id_to_sst_index.at(shard_members[shard_ranks_by_sender_rank.at(j)])][subgroup_num * window_size + slot].buf,
-                                            sst.slots[node_id_to_sst_index.at(shard_members[shard_ranks_by_sender_rank.at(j)])][subgroup_num * window_size + slot].size);
+                    while(true) {
+                        auto num_received = sst.num_received_sst[member_index][num_received_offset + j] + 1;
+                        volatile char* buf;
+                        uint32_t size;
+                        if(packed_sst_multicast) {
+                            buf = sst_multicast_group_ptrs[subgroup_num]->next_packed_message(
+                                    sender_rows[j], ring_read_positions[j], num_received, size);
+                            if(!buf) {
+                                break;
+                            }
+                        } else {
+                            auto& slot = sst.slots[sender_rows[j]][subgroup_num * window_size + num_received % window_size];
+                            if((long long int)slot.next_seq != num_received / window_size + 1) {
+                                break;
+                            }
+                            buf = slot.buf;
+                            size = slot.size;
+                        }
+                        sst_receive_handler(j, num_received, buf, size);
                         sst.num_received_sst[member_index][num_received_offset + j] = num_received;
+                        progress = true;
+                        received_any = true;
                     }
                 }
             }
-            sst.put((char*)std::addressof(sst.num_received_sst[0][num_received_offset]) - sst.getBaseAddress(),
-                    sizeof(sst.num_received_sst[0][0]) * num_shard_senders);
+            if(received_any) {
+                sst.put(shard_sst_indices,
+                        (char*)std::addressof(sst.num_received_sst[0][num_received_offset]) - sst.getBaseAddress(),
+                        sizeof(sst.num_received_sst[0][0]) * num_shard_senders);
+            }
+            bool skipped_any = false;
+            // A sender only skips turns once everything it sent before them
+            // has been received everywhere, so all the turns between this
+            // node's num_received and the skipped index are empty
+            for(uint j = 0; skip_idle_senders && j < num_shard_senders; ++j) {
+                auto node_id = shard_members[shard_ranks_by_sender_rank.at(j)];
+                long long int skipped_index = sst.skipped_index[sender_rows[j]][num_received_offset + j];
+                long long int num_received = sst.num_received[member_index][num_received_offset + j];
+                if(skipped_index <= num_received) {
+                    continue;
+                }
+                for(long long int index = num_received + 1; index <= skipped_index; ++index) {
+                    locally_stable_sst_messages[subgroup_num].insert(index * num_shard_senders + j,
+                                                                     SSTMessage{node_id, index, 0, 0});
+                }
+                sst.num_received[member_index][num_received_offset + j]
+                        = resolve_num_received(num_received + 1, skipped_index, num_received_offset + j);
+                skipped_any = true;
+            }
+            if(!received_any && !skipped_any) {
+                return;
+            }
             // std::atomic_signal_fence(std::memory_order_acq_rel);
             auto* min_ptr = std::min_element(&sst.num_received[member_index][num_received_offset],
                                              &sst.num_received[member_index][num_received_offset + num_shard_senders]);
             int min_index = std::distance(&sst.num_received[member_index][num_received_offset], min_ptr);
             auto new_seq_num = (*min_ptr + 1) * num_shard_senders + min_index - 1;
             if(new_seq_num > sst.seq_num[member_index][subgroup_num]) {
-                logger->debug("Updating seq_num for subgroup {} to {}", subgroup_num, new_seq_num);
+                DERECHO_HOT_DEBUG(logger, "Updating seq_num for subgroup {} to {}", subgroup_num, new_seq_num);
                 sst.seq_num[member_index][subgroup_num] = new_seq_num;
-                sst.put((char*)std::addressof(sst.seq_num[0][subgroup_num]) - sst.getBaseAddress(),
-                        sizeof(long long int));
+                if(!aggregation_fanout) {
+                    sst.put(shard_sst_indices,
+                            (char*)std::addressof(sst.seq_num[0][subgroup_num]) - sst.getBaseAddress(),
+                            sizeof(long long int));
+                }
             }
-            sst.put((char*)std::addressof(sst.num_received[0][num_received_offset]) - sst.getBaseAddress(),
+            sst.put(shard_sst_indices,
+                    (char*)std::addressof(sst.num_received[0][num_received_offset]) - sst.getBaseAddress(),
                     sizeof(long long int) * num_shard_senders);
+            notify_sendbuffer_waiters();
         };
-        receiver_pred_handles.emplace_back(sst->predicates.insert(receiver_pred, receiver_trig,
-                                                                  sst::PredicateType::RECURRENT));
+        receiver_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(receiver_pred, receiver_trig,
+                                                                  recurrent));
 
-        if(subgroup_to_mode.at(subgroup_num) != Mode::RAW) {
+        if(subgroup_to_mode.at(subgroup_num) == Mode::ORDERED) {
             auto stability_pred = [this](
                     const DerechoSST& sst) { return true; };
             auto shard_sst_indices = get_shard_sst_indices(subgroup_num);
+            const AggregationTree tree = make_aggregation_tree(shard_members);
             auto stability_trig =
-                    [this, subgroup_num, shard_members, num_shard_members, shard_sst_indices](DerechoSST& sst) mutable {
-                        // DERECHO_LOG(stability_cnt, -1, "in stability_trig");
-                        // compute the min of the seq_num
-                        long long int min_seq_num
-                                = sst.seq_num[node_id_to_sst_index.at(shard_members[0])][subgroup_num];
-                        for(uint i = 0; i < num_shard_members; ++i) {
-                            if(sst.seq_num[node_id_to_sst_index.at(shard_members[i])][subgroup_num] < min_seq_num) {
-                                min_seq_num
-                                        = sst.seq_num[node_id_to_sst_index.at(shard_members[i])][subgroup_num];
-                            }
+                    [this, subgroup_num, shard_members, num_shard_members, shard_sst_indices, tree](DerechoSST& sst) mutable {
+                        if(aggregation_fanout) {
+                            aggregate_stability(sst, subgroup_num, tree);
+                            return;
                         }
+                        // compute the min of the seq_num
+                        long long int min_seq_num = sst.reduce_min(sst.seq_num, subgroup_num, shard_sst_indices);
                         if(min_seq_num > sst.stable_num[member_index][subgroup_num]) {
-                            logger->debug("Subgroup {}, updating stable_num to {}", subgroup_num, min_seq_num);
+                            DERECHO_HOT_DEBUG(logger, "Subgroup {}, updating stable_num to {}", subgroup_num, min_seq_num);
                             sst.stable_num[member_index][subgroup_num] = min_seq_num;
-                            // DERECHO_LOG(stability_cnt, min_seq_num, "stability_trig");
-                            // DERECHO_LOG(-1, -1, "stability_put_start");
                             sst.put(shard_sst_indices,
                                     (char*)std::addressof(sst.stable_num[0][subgroup_num]) - sst.getBaseAddress(),
                                     sizeof(long long int));
-                            // DERECHO_LOG(-1, -1, "stability_put_end");
-                            // DERECHO_LOG(stability_cnt, min_seq_num, "updated_stable_num");
+                            DERECHO_TRACE_POINT(subgroup_num, min_seq_num, -1, "updated_stable_num");
                         }
                     };
-            stability_pred_handles.emplace_back(sst->predicates.insert(
-                    stability_pred, stability_trig, sst::PredicateType::RECURRENT));
+            stability_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(
+                    stability_pred, stability_trig, recurrent));
 
             auto delivery_pred = [this](
                     const DerechoSST& sst) { return true; };
-            auto delivery_trig = [this, subgroup_num, shard_members, num_shard_members](
+            auto delivery_trig = [this, subgroup_num, shard_members, num_shard_members, shard_sst_indices](
                     DerechoSST& sst) mutable {
-                // DERECHO_LOG(delivery_cnt, -1, "in delivery_trig");
-                std::lock_guard<std::mutex> lock(msg_state_mtx);
+                std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
                 // compute the min of the stable_num
-                long long int min_stable_num
-                        = sst.stable_num[node_id_to_sst_index.at(shard_members[0])][subgroup_num];
-                for(uint i = 0; i < num_shard_members; ++i) {
-                    if(sst.stable_num[node_id_to_sst_index.at(shard_members[i])][subgroup_num] < min_stable_num) {
-                        min_stable_num = sst.stable_num[node_id_to_sst_index.at(shard_members[i])][subgroup_num];
-                    }
-                }
+                long long int min_stable_num = aggregation_fanout
+                                                       ? sst.shard_min[member_index][2 * subgroup_num + 1]
+                                                       : sst.reduce_min(sst.stable_num, subgroup_num, shard_sst_indices);
 
                 bool update_sst = false;
                 while(true) {
@@ -848,43 +1634,35 @@ void MulticastGroup::register_predicates() {
                     long long int least_undelivered_rdmc_seq_num, least_undelivered_sst_seq_num;
                     least_undelivered_rdmc_seq_num = least_undelivered_sst_seq_num = std::numeric_limits<long long int>::max();
                     if(!locally_stable_rdmc_messages[subgroup_num].empty()) {
-                        least_undelivered_rdmc_seq_num = locally_stable_rdmc_messages[subgroup_num].begin()->first;
+                        least_undelivered_rdmc_seq_num = locally_stable_rdmc_messages[subgroup_num].front_seq();
                     }
                     if(!locally_stable_sst_messages[subgroup_num].empty()) {
-                        least_undelivered_sst_seq_num = locally_stable_sst_messages[subgroup_num].begin()->first;
+                        least_undelivered_sst_seq_num = locally_stable_sst_messages[subgroup_num].front_seq();
                     }
                     if(least_undelivered_rdmc_seq_num < least_undelivered_sst_seq_num && least_undelivered_rdmc_seq_num <= min_stable_num) {
                         update_sst = true;
-                        logger->debug("Subgroup {}, can deliver a locally stable RDMC message: min_stable_num={} and least_undelivered_seq_num={}",
-                                      subgroup_num, min_stable_num, least_undelivered_rdmc_seq_num);
-                        RDMCMessage& msg = locally_stable_rdmc_messages[subgroup_num].begin()->second;
+                        DERECHO_HOT_DEBUG(logger, "Subgroup {}, can deliver a locally stable RDMC message: min_stable_num={} and least_undelivered_seq_num={}",
+                                          subgroup_num, min_stable_num, least_undelivered_rdmc_seq_num);
+                        RDMCMessage& msg = locally_stable_rdmc_messages[subgroup_num].front();
                         uint64_t msg_ts = 0;
                         if(msg.size > 0) {
-                          char* buf = msg.message_buffer.buffer.get();
+                          char* buf = msg.message_buffer.buffer();
                           header* h = (header*)(buf);
                           msg_ts = h->timestamp;
                           deliver_message(msg, subgroup_num);
                           if (msg.sender_id == members[member_index]) {
-                            pending_persistence[subgroup_num][locally_stable_rdmc_messages[subgroup_num].begin()->first] = msg_ts;
+                            pending_persistence[subgroup_num][least_undelivered_rdmc_seq_num] = msg_ts;
                           }
                           // make a version for persistent<t>/volatile<t>
-                          uint64_t msg_ts_us = msg_ts/1e3;
-                          if(msg_ts_us == 0) {
-                            struct timespec now;
-                            clock_gettime(CLOCK_REALTIME,&now);
-                            msg_ts_us = (uint64_t)now.tv_sec*1e6 + now.tv_nsec/1e3;
-                          }
-                          std::get<0>(persistence_manager_callbacks)(subgroup_num, (persistence_version_t)least_undelivered_rdmc_seq_num, HLC{msg_ts_us,0});
+                          make_version(subgroup_num, least_undelivered_rdmc_seq_num, msg_ts);
                         }
-                        // DERECHO_LOG(-1, -1, "deliver_message() done");
                         sst.delivered_num[member_index][subgroup_num] = least_undelivered_rdmc_seq_num;
-                        locally_stable_rdmc_messages[subgroup_num].erase(locally_stable_rdmc_messages[subgroup_num].begin());
-                        // DERECHO_LOG(-1, -1, "message_erase_done");
+                        locally_stable_rdmc_messages[subgroup_num].pop_front();
                     } else if(least_undelivered_sst_seq_num < least_undelivered_rdmc_seq_num && least_undelivered_sst_seq_num <= min_stable_num) {
                         update_sst = true;
-                        logger->debug("Subgroup {}, can deliver a locally stable SST message: min_stable_num={} and least_undelivered_seq_num={}",
-                                      subgroup_num, min_stable_num, least_undelivered_sst_seq_num);
-                        SSTMessage& msg = locally_stable_sst_messages[subgroup_num].begin()->second;
+                        DERECHO_HOT_DEBUG(logger, "Subgroup {}, can deliver a locally stable SST message: min_stable_num={} and least_undelivered_seq_num={}",
+                                          subgroup_num, min_stable_num, least_undelivered_sst_seq_num);
+                        SSTMessage& msg = locally_stable_sst_messages[subgroup_num].front();
                         uint64_t msg_ts = 0;
                         if(msg.size > 0) {
                           char* buf = const_cast<char*>(msg.buf);
@@ -892,56 +1670,87 @@ void MulticastGroup::register_predicates() {
                           msg_ts = h->timestamp;
                           deliver_message(msg, subgroup_num);
                           if(msg.sender_id == members[member_index]) {
-                            pending_persistence[subgroup_num][locally_stable_sst_messages[subgroup_num].begin()->first] = msg_ts;
+                            pending_persistence[subgroup_num][locally_stable_sst_messages[subgroup_num].front_seq()] = msg_ts;
                           }
                           // make a version for persistent<t>/volatile<t>
-                          uint64_t msg_ts_us = msg_ts/1e3;
-                          if(msg_ts_us == 0) {
-                            struct timespec now;
-                            clock_gettime(CLOCK_REALTIME,&now);
-                            msg_ts_us = (uint64_t)now.tv_sec*1e6 + now.tv_nsec/1e3;
-                          }
-                          std::get<0>(persistence_manager_callbacks)(subgroup_num, (persistence_version_t)least_undelivered_sst_seq_num, HLC{msg_ts_us,0});
+                          make_version(subgroup_num, least_undelivered_sst_seq_num, msg_ts);
                         }
-                        // DERECHO_LOG(-1, -1, "deliver_message() done");
                         sst.delivered_num[member_index][subgroup_num] = least_undelivered_sst_seq_num;
-                        locally_stable_sst_messages[subgroup_num].erase(locally_stable_sst_messages[subgroup_num].begin());
-                        // DERECHO_LOG(-1, -1, "message_erase_done");
+                        locally_stable_sst_messages[subgroup_num].pop_front();
                     } else {
                         break;
                     }
                 }
+                flush_delivery_batch(subgroup_num);
                 if(update_sst) {
-                    // DERECHO_LOG(-1, -1, "delivery_put_start");
                     sst.put(get_shard_sst_indices(subgroup_num),
                             (char*)std::addressof(sst.delivered_num[0][subgroup_num]) - sst.getBaseAddress(),
                             sizeof(long long int));
                     // locally_stable_messages[subgroup_num].erase(locally_stable_messages[subgroup_num].begin());
                     //make post persistence request for ordered mode.
                     if(subgroup_to_mode.at(subgroup_num) != Mode::RAW) {
-                        std::get<1>(persistence_manager_callbacks)(subgroup_num, (persistence_version_t)sst.delivered_num[member_index][subgroup_num]);
+                        persistence_version_t version = sst.delivered_num[member_index][subgroup_num];
+                        run_in_delivery_order(subgroup_num, [this, subgroup_num, version]() {
+                            std::get<1>(persistence_manager_callbacks)(subgroup_num, version);
+                            // The version is in this node's log now, so it
+                            // counts towards remote persistence before the
+                            // persistence thread flushes it
+                            if(remote_persistence_replicas > 0) {
+                                this->sst->persisted_num[member_index][subgroup_num] = version;
+                                this->sst->put(get_shard_sst_indices(subgroup_num),
+                                               (char*)std::addressof(this->sst->persisted_num[0][subgroup_num]) - this->sst->getBaseAddress(),
+                                               sizeof(long long int));
+                            }
+                        });
                     }
+                    notify_sendbuffer_waiters();
                 }
             };
 
-            delivery_pred_handles.emplace_back(sst->predicates.insert(delivery_pred, delivery_trig, sst::PredicateType::RECURRENT));
+            delivery_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(delivery_pred, delivery_trig, recurrent));
 
             auto persistence_pred = [this]( const DerechoSST& sst) {return true;};
-            auto persistence_trig = [this, subgroup_num, shard_members, num_shard_members] (DerechoSST& sst) mutable {
-                std::lock_guard<std::mutex> lock(msg_state_mtx);
+            auto persistence_trig = [this, subgroup_num, shard_sst_indices, last_checkpoint = -1ll] (DerechoSST& sst) mutable {
+                std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
                 // compute the min of the persisted_num
-                long long int min_persisted_num
-                    = sst.persisted_num[node_id_to_sst_index.at(shard_members[0])][subgroup_num];
-                for(uint i = 0; i < num_shard_members; ++i) {
-                    if(sst.persisted_num[node_id_to_sst_index.at(shard_members[i])][subgroup_num] < min_persisted_num) {
-                        min_persisted_num = sst.persisted_num[node_id_to_sst_index.at(shard_members[i])][subgroup_num];
+                long long int min_persisted_num = compute_persistence_frontier(sst, subgroup_num, shard_sst_indices);
+                // Messages the whole shard has logged needn't stay in this node's log
+                if(file_writer && min_persisted_num > last_checkpoint) {
+                    file_writer->checkpoint(subgroup_num, min_persisted_num);
+                    last_checkpoint = min_persisted_num;
+                }
+                // The callback runs on the notifier's thread, and only when
+                // the frontier advances
+                if(persistence_notifier) {
+                    persistence_notifier->update(subgroup_num, min_persisted_num);
+                }
+                if(send_frontiers[subgroup_num]) {
+                    // Versions are sequence numbers; turn them into the index
+                    // of the last of this node's messages they cover
+                    const auto& senders_and_rank = subgroup_to_senders_and_sender_rank.at(subgroup_num);
+                    const long long int num_senders = get_num_senders(senders_and_rank.first);
+                    const long long int sender_rank = senders_and_rank.second;
+                    auto own_index = [&](long long int seq_num) {
+                        return seq_num < sender_rank ? -1 : (seq_num - sender_rank) / num_senders;
+                    };
+                    const long long int persisted_index = own_index(sst.persisted_num[member_index][subgroup_num]);
+                    const long long int globally_persisted_index = own_index(min_persisted_num);
+                    send_frontiers[subgroup_num]->advance(metrics::PERSISTED, persisted_index);
+                    send_frontiers[subgroup_num]->advance(metrics::GLOBALLY_PERSISTED, globally_persisted_index);
+                    if(stage_trackers[subgroup_num]) {
+                        const uint64_t now = get_time();
+                        stage_trackers[subgroup_num]->stamp_through(persisted_index, metrics::PERSISTED, now);
+                        stage_trackers[subgroup_num]->stamp_through(globally_persisted_index,
+                                                                    metrics::GLOBALLY_PERSISTED, now);
                     }
                 }
-                // callbacks
-                callbacks.global_persistence_callback(subgroup_num, min_persisted_num);
             };
 
-            persistence_pred_handles.emplace_back(sst->predicates.insert(persistence_pred, persistence_trig, sst::PredicateType::RECURRENT));
+            persistence_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(persistence_pred, persistence_trig, recurrent));
+
+            if(read_lease_duration_us) {
+                register_read_lease_predicates(subgroup_num, shard_members, shard_sst_indices, recurrent);
+            }
 
             int shard_sender_index;
             std::tie(shard_senders, shard_sender_index) = subgroup_to_senders_and_sender_rank.at(subgroup_num);
@@ -958,11 +1767,146 @@ void MulticastGroup::register_predicates() {
                     return true;
                 };
                 auto sender_trig = [this, subgroup_num](DerechoSST& sst) {
-                    sender_cv.notify_all();
                     next_message_to_deliver[subgroup_num]++;
+                    notify_senders();
+                    notify_sendbuffer_waiters();
                 };
-                sender_pred_handles.emplace_back(sst->predicates.insert(sender_pred, sender_trig,
-                                                                        sst::PredicateType::RECURRENT));
+                sender_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(sender_pred, sender_trig,
+                                                                        recurrent));
+                if(skip_idle_senders) {
+                    // This node's turns can be skipped once another sender is
+                    // ahead of it and everything it has sent has been
+                    // delivered (and persisted) everywhere. That rules out a
+                    // send that has only been reserved, and keeps the window
+                    // check of a send that is about to reserve the next index
+                    // valid after the skip.
+                    auto own_turns_done = [this, subgroup_num, shard_sender_index, num_shard_senders,
+                                           shard_sst_indices](const DerechoSST& sst, long long int next_index) {
+                        long long int last_seq_num = (next_index - 1) * num_shard_senders + shard_sender_index;
+                        return sst.reduce_min(sst.delivered_num, subgroup_num, shard_sst_indices) >= last_seq_num
+                               && (!file_writer || sst.reduce_min(sst.persisted_num, subgroup_num, shard_sst_indices) >= last_seq_num);
+                    };
+                    auto skip_pred = [this, subgroup_num, num_received_offset, shard_sender_index,
+                                      num_shard_senders, own_turns_done](const DerechoSST& sst) {
+                        long long int next_index = future_message_indices[subgroup_num];
+                        bool others_ahead = false;
+                        for(uint j = 0; j < num_shard_senders && !others_ahead; ++j) {
+                            others_ahead = (int)j != shard_sender_index
+                                           && sst.num_received[member_index][num_received_offset + j] >= next_index;
+                        }
+                        return others_ahead && own_turns_done(sst, next_index);
+                    };
+                    auto skip_trig = [this, subgroup_num, num_received_offset, shard_sender_index,
+                                      num_shard_senders, shard_sst_indices, own_turns_done](DerechoSST& sst) {
+                        std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+                        long long int next_index = future_message_indices[subgroup_num];
+                        // A send may have been reserved since the predicate ran
+                        if(!own_turns_done(sst, next_index)) {
+                            return;
+                        }
+                        long long int skip_to = next_index - 1;
+                        for(uint j = 0; j < num_shard_senders; ++j) {
+                            if((int)j != shard_sender_index) {
+                                skip_to = std::max(skip_to, (long long int)sst.num_received[member_index][num_received_offset + j]);
+                            }
+                        }
+                        if(skip_to < next_index) {
+                            return;
+                        }
+                        DERECHO_HOT_DEBUG(logger, "Subgroup {}, skipping this node's turns {} to {}", subgroup_num, next_index, skip_to);
+                        future_message_indices[subgroup_num] = skip_to + 1;
+                        sst.skipped_index[member_index][num_received_offset + shard_sender_index] = skip_to;
+                        sst.put(shard_sst_indices,
+                                (char*)std::addressof(sst.skipped_index[0][num_received_offset + shard_sender_index]) - sst.getBaseAddress(),
+                                sizeof(long long int));
+                    };
+                    sender_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(skip_pred, skip_trig,
+                                                                            recurrent));
+                }
+            }
+        } else if(subgroup_to_mode.at(subgroup_num) == Mode::FIFO) {
+            auto shard_sst_indices = get_shard_sst_indices(subgroup_num);
+            auto delivery_pred = [this](
+                    const DerechoSST& sst) { return true; };
+            auto delivery_trig = [this, subgroup_num, num_shard_senders, num_received_offset, shard_sst_indices](
+                    DerechoSST& sst) mutable {
+                std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+                bool update_sst = false;
+                for(uint j = 0; j < num_shard_senders; ++j) {
+                    // A sender's message is stable once every member of the
+                    // shard has received it, whatever the other senders did
+                    long long int stable_index = sst.reduce_min(sst.num_received, num_received_offset + j, shard_sst_indices);
+                    volatile long long int& delivered_index = sst.fifo_delivered_num[member_index][num_received_offset + j];
+                    for(long long int index = delivered_index + 1; index <= stable_index; ++index) {
+                        long long int seq_num = index * num_shard_senders + j;
+                        RDMCMessage* msg_ptr = locally_stable_rdmc_messages[subgroup_num].find(seq_num);
+                        // Nothing is persisted in FIFO mode, so this node's
+                        // messages are done with once delivered, as in raw mode
+                        if(msg_ptr) {
+                            if(msg_ptr->size > 0) {
+                                uint64_t msg_ts = ((header*)msg_ptr->message_buffer.buffer())->timestamp;
+                                bool own_message = msg_ptr->sender_id == members[member_index];
+                                deliver_message(*msg_ptr, subgroup_num);
+                                if(own_message) {
+                                    pending_message_timestamps[subgroup_num].erase(msg_ts);
+                                }
+                            }
+                            locally_stable_rdmc_messages[subgroup_num].erase(seq_num);
+                        } else {
+                            SSTMessage* sst_msg_ptr = locally_stable_sst_messages[subgroup_num].find(seq_num);
+                            assert(sst_msg_ptr);
+                            if(sst_msg_ptr->size > 0) {
+                                deliver_message(*sst_msg_ptr, subgroup_num);
+                                if(sst_msg_ptr->sender_id == members[member_index]) {
+                                    pending_message_timestamps[subgroup_num].erase(((header*)sst_msg_ptr->buf)->timestamp);
+                                }
+                            }
+                            locally_stable_sst_messages[subgroup_num].erase(seq_num);
+                        }
+                        delivered_index = index;
+                        update_sst = true;
+                    }
+                }
+                flush_delivery_batch(subgroup_num);
+                if(update_sst) {
+                    // delivered_num is kept as the longest prefix of the
+                    // round-robin order that was delivered here, which is
+                    // where the ragged edge cleanup starts
+                    auto* min_ptr = std::min_element(&sst.fifo_delivered_num[member_index][num_received_offset],
+                                                     &sst.fifo_delivered_num[member_index][num_received_offset + num_shard_senders]);
+                    int min_index = std::distance(&sst.fifo_delivered_num[member_index][num_received_offset], min_ptr);
+                    sst.delivered_num[member_index][subgroup_num] = (*min_ptr + 1) * num_shard_senders + min_index - 1;
+                    sst.put(shard_sst_indices,
+                            (char*)std::addressof(sst.fifo_delivered_num[0][num_received_offset]) - sst.getBaseAddress(),
+                            sizeof(long long int) * num_shard_senders);
+                    sst.put(shard_sst_indices,
+                            (char*)std::addressof(sst.delivered_num[0][subgroup_num]) - sst.getBaseAddress(),
+                            sizeof(long long int));
+                    notify_sendbuffer_waiters();
+                }
+            };
+            delivery_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(delivery_pred, delivery_trig, recurrent));
+
+            int shard_sender_index;
+            std::tie(shard_senders, shard_sender_index) = subgroup_to_senders_and_sender_rank.at(subgroup_num);
+            num_shard_senders = get_num_senders(shard_senders);
+            if(shard_sender_index >= 0) {
+                auto sender_pred = [this, subgroup_num, shard_members, num_shard_members, shard_sender_index, num_received_offset](const DerechoSST& sst) {
+                    for(uint i = 0; i < num_shard_members; ++i) {
+                        if(sst.fifo_delivered_num[node_id_to_sst_index.at(shard_members[i])][num_received_offset + shard_sender_index]
+                           < next_message_to_deliver[subgroup_num]) {
+                            return false;
+                        }
+                    }
+                    return true;
+                };
+                auto sender_trig = [this, subgroup_num](DerechoSST& sst) {
+                    next_message_to_deliver[subgroup_num]++;
+                    notify_senders();
+                    notify_sendbuffer_waiters();
+                };
+                sender_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(sender_pred, sender_trig,
+                                                                        recurrent));
             }
         } else {
             int shard_sender_index;
@@ -980,10 +1924,11 @@ void MulticastGroup::register_predicates() {
                     return true;
                 };
                 auto sender_trig = [this, subgroup_num](DerechoSST& sst) {
-                    sender_cv.notify_all();
+                    notify_senders();
+                    notify_sendbuffer_waiters();
                 };
-                sender_pred_handles.emplace_back(sst->predicates.insert(sender_pred, sender_trig,
-                                                                        sst::PredicateType::RECURRENT));
+                sender_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(sender_pred, sender_trig,
+                                                                        recurrent));
             }
         }
     }
@@ -991,9 +1936,24 @@ void MulticastGroup::register_predicates() {
 
 MulticastGroup::~MulticastGroup() {
     wedge();
-    if(timeout_thread.joinable()) {
-        timeout_thread.join();
+    // Messages that haven't reached a stage by now won't in this view
+    for(const auto& frontiers : send_frontiers) {
+        if(frontiers) {
+            frontiers->close();
+        }
     }
+    sst::timer_wheel::shared().cancel(failure_check_timer);
+    heartbeat_shutdown = true;
+    if(heartbeat_thread.joinable()) {
+        heartbeat_thread.join();
+    }
+    stop_rdmc_group_thread();
+    // Any groups the next view needed have been taken over by it
+    std::vector<uint16_t> group_numbers;
+    for(const auto& rdmc_group : rdmc_groups) {
+        group_numbers.push_back(rdmc_group.second);
+    }
+    rdmc::destroy_groups(group_numbers);
 }
 
 long long unsigned int MulticastGroup::compute_max_msg_size(
@@ -1011,118 +1971,252 @@ void MulticastGroup::wedge() {
     if(thread_shutdown_existing) {  // Wedge has already been called
         return;
     }
+    {
+        // Rounds the leader has already started still run everywhere
+        std::lock_guard<std::mutex> lock(rdmc_round_mutex);
+        rdmc_rounds_stopped = true;
+    }
+    for(const auto& ring : send_rings) {
+        if(ring) {
+            ring->close();
+        }
+    }
 
     //Consume and remove all the predicate handles
-    for(auto handle_iter = sender_pred_handles.begin(); handle_iter != sender_pred_handles.end();) {
-        sst->predicates.remove(*handle_iter);
-        handle_iter = sender_pred_handles.erase(handle_iter);
+    for(const auto& p : subgroup_to_membership) {
+        remove_pred_handles(sender_pred_handles, p.first);
+        remove_pred_handles(receiver_pred_handles, p.first);
+        remove_pred_handles(stability_pred_handles, p.first);
+        remove_pred_handles(delivery_pred_handles, p.first);
+        remove_pred_handles(persistence_pred_handles, p.first);
+        remove_pred_handles(read_lease_pred_handles, p.first);
     }
-    for(auto handle_iter = receiver_pred_handles.begin(); handle_iter != receiver_pred_handles.end();) {
-        sst->predicates.remove(*handle_iter);
-        handle_iter = receiver_pred_handles.erase(handle_iter);
+
+    notify_senders();
+    {
+        std::lock_guard<std::mutex> lock(sendbuffer_mtx);
+        send_window_epoch++;
     }
-    for(auto handle_iter = stability_pred_handles.begin(); handle_iter != stability_pred_handles.end();) {
-        sst->predicates.remove(*handle_iter);
-        handle_iter = stability_pred_handles.erase(handle_iter);
+    sendbuffer_cv.notify_all();
+    for(auto& sender_thread : sender_threads) {
+        if(sender_thread.joinable()) {
+            sender_thread.join();
+        }
     }
-    for(auto handle_iter = delivery_pred_handles.begin(); handle_iter != delivery_pred_handles.end();) {
-        sst->predicates.remove(*handle_iter);
-        handle_iter = delivery_pred_handles.erase(handle_iter);
+}
+
+void MulticastGroup::remove_pred_handles(std::map<subgroup_id_t, std::list<pred_handle>>& handles,
+                                         subgroup_id_t subgroup_num) {
+    auto subgroup_handles = handles.find(subgroup_num);
+    if(subgroup_handles == handles.end()) {
+        return;
     }
-    for(auto handle_iter = persistence_pred_handles.begin(); handle_iter != persistence_pred_handles.end();) {
+    for(auto handle_iter = subgroup_handles->second.begin(); handle_iter != subgroup_handles->second.end();) {
         sst->predicates.remove(*handle_iter);
-        handle_iter = persistence_pred_handles.erase(handle_iter);
+        handle_iter = subgroup_handles->second.erase(handle_iter);
     }
+    handles.erase(subgroup_handles);
+}
 
-    for(uint i = 0; i < num_members; ++i) {
-        rdmc::destroy_group(i + rdmc_group_num_offset);
+void MulticastGroup::wedge_subgroups(const std::set<subgroup_id_t>& subgroups) {
+    if(thread_shutdown) {
+        return;
     }
-
-    sender_cv.notify_all();
-    if(sender_thread.joinable()) {
-        sender_thread.join();
+    for(subgroup_id_t subgroup_num : subgroups) {
+        if(subgroup_to_membership.find(subgroup_num) == subgroup_to_membership.end()) {
+            continue;
+        }
+        {
+            // Once the flag is set under the lock, the sender thread won't
+            // start another message in this subgroup
+            std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+            if(subgroup_wedged[subgroup_num].exchange(true)) {
+                continue;
+            }
+        }
+        if(send_rings[subgroup_num]) {
+            send_rings[subgroup_num]->close();
+        }
+        logger->debug("Wedging subgroup {} ahead of the rest of the view", subgroup_num);
+        remove_pred_handles(sender_pred_handles, subgroup_num);
+        remove_pred_handles(receiver_pred_handles, subgroup_num);
+        remove_pred_handles(stability_pred_handles, subgroup_num);
+        remove_pred_handles(delivery_pred_handles, subgroup_num);
+        remove_pred_handles(persistence_pred_handles, subgroup_num);
+        remove_pred_handles(read_lease_pred_handles, subgroup_num);
+    }
+    // Wake up anyone waiting to send in the wedged subgroups
+    {
+        std::lock_guard<std::mutex> lock(sendbuffer_mtx);
+        send_window_epoch++;
     }
+    sendbuffer_cv.notify_all();
 }
 
-void MulticastGroup::send_loop() {
-    pthread_setname_np(pthread_self(), "sender_thread");
-    subgroup_id_t subgroup_to_send = 0;
-    auto should_send_to_subgroup = [&](subgroup_id_t subgroup_num) {
-        if(!rdmc_sst_groups_created) {
+bool MulticastGroup::ready_to_send(subgroup_id_t subgroup_num) {
+    if(!rdmc_sst_groups_created) {
+        return false;
+    }
+    if(pending_sends[subgroup_num].empty()) {
+        return false;
+    }
+    RDMCMessage& msg = pending_sends[subgroup_num].front();
+    SubgroupSendState& state = subgroup_send_states[subgroup_num];
+    assert(state.is_sender);
+
+    if(lazy_rdmc_groups) {
+        // The RDMC group thread wakes the sender thread once the group is ready
+        auto lazy_group = lazy_groups.find(state.num_received_column);
+        if(lazy_group != lazy_groups.end() && !lazy_group->second.ready) {
+            lazy_group->second.requested = true;
             return false;
         }
-        if(pending_sends[subgroup_num].empty()) {
-            return false;
+    }
+
+    // RDMC sends this node's messages one after another, and only so many
+    // of them may be in flight at once
+    if(sst->num_received[member_index][state.num_received_column] < msg.index - (long long int)max_rdmc_sends_in_flight) {
+        return false;
+    }
+
+    // In ordered mode, the message that last used this slot of the window
+    // must have been delivered (and persisted) everywhere; in FIFO mode,
+    // it must have been delivered everywhere; in raw mode, it must have
+    // been received everywhere
+    long long int required_frontier;
+    if(state.fifo_mode) {
+        required_frontier = msg.index - window_size;
+    } else if(!state.raw_mode) {
+        required_frontier = (msg.index - window_size) * state.num_shard_senders + state.shard_sender_index;
+    } else {
+        required_frontier = future_message_indices[subgroup_num] - 1 - window_size;
+    }
+    if(state.min_frontier < required_frontier) {
+        state.min_frontier = compute_send_frontier(state, subgroup_num);
+    }
+    return state.min_frontier >= required_frontier;
+}
+
+void MulticastGroup::issue_next_send(subgroup_id_t subgroup_num, std::unique_lock<std::mutex>& lock) {
+    current_sends[subgroup_num].push_back(std::move(pending_sends[subgroup_num].front()));
+    const RDMCMessage& msg = current_sends[subgroup_num].back();
+    DERECHO_HOT_DEBUG(logger, "Calling send in subgroup {} on message {} from sender {}", subgroup_num, msg.index, msg.sender_id);
+    auto rdmc_group = subgroup_to_rdmc_group.find(subgroup_num);
+    auto rdmc_group_num = rdmc_group == subgroup_to_rdmc_group.end() ? 0 : rdmc_group->second;
+    auto mr = msg.message_buffer.mr;
+    auto size = msg.size;
+    pending_sends[subgroup_num].pop();
+    subgroup_metrics[subgroup_num]->pending_sends.set(pending_sends[subgroup_num].size());
+    if(lazy_rdmc_groups) {
+        auto lazy_group = lazy_groups.find(subgroup_send_states[subgroup_num].num_received_column);
+        if(lazy_group != lazy_groups.end()) {
+            lazy_group->second.last_send_index = msg.index;
+            lazy_group->second.last_send_time = get_time();
         }
-        RDMCMessage& msg = pending_sends[subgroup_num].front();
-        uint32_t shard_num;
-        uint32_t shard_index;
+    }
+    if(stage_trackers[subgroup_num]) {
+        stage_trackers[subgroup_num]->stamp(msg.index, metrics::SEND_ISSUED, get_time());
+    }
+    // ready_to_send won't pass another message until enough of these have
+    // been received, and RDMC queues the sends in the order they are made,
+    // so the subgroup's lock isn't needed while RDMC posts the first block
+    lock.unlock();
+    if(!rdmc::send(rdmc_group_num, mr, 0, size)) {
+        throw std::runtime_error("rdmc::send returned false");
+    }
+    DERECHO_TRACE_POINT(subgroup_num, -1, -1, "issued_rdmc_send");
+}
 
-        std::tie(shard_num, shard_index) = subgroup_to_shard_and_rank.at(subgroup_num);
-        uint32_t num_shard_senders;
-        int shard_sender_index;
-        std::vector<int> shard_senders;
-        std::tie(shard_senders, shard_sender_index) = subgroup_to_senders_and_sender_rank.at(subgroup_num);
-        num_shard_senders = get_num_senders(shard_senders);
-        assert(shard_sender_index >= 0);
+bool MulticastGroup::try_inline_send(subgroup_id_t subgroup_num, std::unique_lock<std::mutex>& lock) {
+    if(!inline_sends || thread_shutdown || subgroup_wedged[subgroup_num] || !ready_to_send(subgroup_num)) {
+        return false;
+    }
+    issue_next_send(subgroup_num, lock);
+    return true;
+}
 
-        // std::cout << "num_received offset = " << subgroup_to_num_received_offset.at(subgroup_num) + shard_sender_index <<
-        //         ", num_received entry " <<  sst->num_received[member_index][subgroup_to_num_received_offset.at(subgroup_num) + shard_sender_index] <<
-        //         ", message index = " << msg.index << std::endl;
-        if(sst->num_received[member_index][subgroup_to_num_received_offset.at(subgroup_num) + shard_sender_index] < msg.index - 1) {
+void MulticastGroup::send_loop(uint32_t thread_index) {
+    pthread_setname_np(pthread_self(), "sender_thread");
+    place_this_thread("sender_thread");
+    const std::vector<subgroup_id_t>& my_subgroups = sender_thread_subgroups[thread_index];
+    std::size_t next_subgroup = 0;
+    // The sends left in the current subgroup's turn, of its SendLimit weight
+    uint32_t turn_sends_left = 0;
+    // Posts the next message of a subgroup's RawSendRing, which needs none of
+    // the subgroup's state beyond its own num_received
+    auto send_from_ring = [&](subgroup_id_t subgroup_num) {
+        RawSendRing& ring = *send_rings[subgroup_num];
+        if(thread_shutdown || subgroup_wedged[subgroup_num] || !ring.has_unposted()) {
             return false;
         }
-
-        std::vector<node_id_t> shard_members = subgroup_to_membership.at(subgroup_num);
-        auto num_shard_members = shard_members.size();
-        assert(num_shard_members >= 1);
-        if(subgroup_to_mode.at(subgroup_num) != Mode::RAW) {
-            for(uint i = 0; i < num_shard_members; ++i) {
-                if(sst->delivered_num[node_id_to_sst_index.at(shard_members[i])][subgroup_num] < (long long int)((msg.index - window_size) * num_shard_senders + shard_sender_index)
-                   || (file_writer && sst->persisted_num[node_id_to_sst_index.at(shard_members[i])][subgroup_num] < (long long int)((msg.index - window_size) * num_shard_senders + shard_sender_index))) {
-                    return false;
-                }
-            }
-        } else {
-            for(uint i = 0; i < num_shard_members; ++i) {
-                auto num_received_offset = subgroup_to_num_received_offset.at(subgroup_num);
-                if(sst->num_received[node_id_to_sst_index.at(shard_members[i])][num_received_offset + shard_sender_index] < (long long int)(future_message_indices[subgroup_num] - 1 - window_size)) {
-                    return false;
-                }
-            }
+        const RawSendRing::Slot& slot = ring.next_unposted();
+        // This node's messages are still sent in index order
+        const long long int index = ((header*)slot.mr->buffer)->index;
+        if(sst->num_received[member_index][subgroup_send_states[subgroup_num].num_received_column]
+           < index - (long long int)max_rdmc_sends_in_flight) {
+            return false;
         }
-
+        ring.mark_posted();
+        if(!rdmc::send(ring.rdmc_group_number, slot.mr, 0, slot.size)) {
+            throw std::runtime_error("rdmc::send returned false");
+        }
+        DERECHO_TRACE_POINT(subgroup_num, -1, -1, "issued_rdmc_send");
         return true;
     };
-    auto should_send = [&]() {
-        for(uint i = 1; i <= total_num_subgroups; ++i) {
-            auto subgroup_num = (subgroup_to_send + i) % total_num_subgroups;
-            if(should_send_to_subgroup(subgroup_num)) {
-                subgroup_to_send = subgroup_num;
+    // Starts a subgroup's turn, or continues it, after sending in it
+    auto sent_in = [&](std::size_t position, bool same_turn) {
+        if(!same_turn) {
+            turn_sends_left = send_limiters[my_subgroups[position]]->weight();
+        }
+        next_subgroup = position;
+        --turn_sends_left;
+    };
+    // Sends the next message in the subgroup whose turn it is, if its turn
+    // isn't over, or else in the first subgroup after it that has a message
+    // ready, and returns false if none does. A subgroup's turn lasts up to
+    // its weight in messages, so busy subgroups share the thread by weight.
+    auto send_next = [&]() {
+        const std::size_t first = turn_sends_left > 0 ? 0 : 1;
+        for(std::size_t i = first; i < first + my_subgroups.size(); ++i) {
+            auto position = (next_subgroup + i) % my_subgroups.size();
+            subgroup_id_t subgroup_num = my_subgroups[position];
+            if(send_rings[subgroup_num] && send_from_ring(subgroup_num)) {
+                sent_in(position, i == 0);
                 return true;
             }
+            std::unique_lock<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+            if(thread_shutdown) {
+                return false;
+            }
+            if(subgroup_wedged[subgroup_num] || !ready_to_send(subgroup_num)) {
+                continue;
+            }
+            sent_in(position, i == 0);
+            issue_next_send(subgroup_num, lock);
+            return true;
         }
+        turn_sends_left = 0;
         return false;
     };
-    auto should_wake = [&]() { return thread_shutdown || should_send(); };
     try {
-        std::unique_lock<std::mutex> lock(msg_state_mtx);
         while(!thread_shutdown) {
-            sender_cv.wait(lock, should_wake);
-            // DERECHO_LOG(send_cnt, -1, "sender thread woke up");
-            if(!thread_shutdown) {
-                current_sends[subgroup_to_send] = std::move(pending_sends[subgroup_to_send].front());
-                // DERECHO_LOG(-1, -1, "got_current_send");
-                logger->debug("Calling send in subgroup {} on message {} from sender {}", subgroup_to_send, current_sends[subgroup_to_send]->index, current_sends[subgroup_to_send]->sender_id);
-                // DERECHO_LOG(-1, -1, "did_log_event");
-                if(!rdmc::send(subgroup_to_rdmc_group[subgroup_to_send],
-                               current_sends[subgroup_to_send]->message_buffer.mr, 0,
-                               current_sends[subgroup_to_send]->size)) {
-                    throw std::runtime_error("rdmc::send returned false");
-                }
-                // DERECHO_LOG(-1, -1, "issued_rdmc_send");
-                pending_sends[subgroup_to_send].pop();
+            uint64_t epoch;
+            {
+                std::lock_guard<std::mutex> lock(sender_mtx);
+                epoch = sender_epoch;
+            }
+            // Counted before the last look for work, so that a RawSendRing
+            // publishing after that look sees it and notifies this thread
+            idle_sender_threads++;
+            if(send_next()) {
+                idle_sender_threads--;
+                continue;
             }
+            std::unique_lock<std::mutex> lock(sender_mtx);
+            sender_cv.wait(lock, [&]() {
+                return sender_epoch != epoch || thread_shutdown;
+            });
+            idle_sender_threads--;
         }
         std::cout << "DerechoGroup send thread shutting down" << std::endl;
     } catch(const std::exception& e) {
@@ -1130,10 +2224,16 @@ void MulticastGroup::send_loop() {
     }
 }
 
+void MulticastGroup::notify_senders() {
+    {
+        std::lock_guard<std::mutex> lock(sender_mtx);
+        sender_epoch++;
+    }
+    sender_cv.notify_all();
+}
+
 uint64_t MulticastGroup::get_time() {
-    struct timespec start_time;
-    clock_gettime(CLOCK_REALTIME, &start_time);
-    return start_time.tv_sec * 1e9 + start_time.tv_nsec;
+    return fast_clock::realtime_ns();
 }
 
 const uint64_t MulticastGroup::compute_global_stability_frontier(uint32_t subgroup_num) {
@@ -1145,40 +2245,389 @@ const uint64_t MulticastGroup::compute_global_stability_frontier(uint32_t subgro
     return global_stability_frontier;
 }
 
-void MulticastGroup::check_failures_loop() {
-    pthread_setname_np(pthread_self(), "timeout_thread");
-    while(!thread_shutdown) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(sender_timeout));
-        if(sst) {
-            std::unique_lock<std::mutex> lock(msg_state_mtx);
-            auto current_time = get_time();
-            for(auto p : subgroup_to_membership) {
-                auto subgroup_num = p.first;
-                auto members = p.second;
-                auto sst_indices = get_shard_sst_indices(subgroup_num);
-                // clean up timestamps of persisted messages
-                auto min_persisted_num = sst->persisted_num[member_index][subgroup_num];
-                for(auto i : sst_indices) {
-                    if(min_persisted_num < sst->persisted_num[i][subgroup_num]) {
-                        min_persisted_num = sst->persisted_num[i][subgroup_num];
-                    }
+persistence_version_t MulticastGroup::compute_global_persistence_frontier(uint32_t subgroup_num) {
+    return sst->reduce_min(sst->persisted_num, subgroup_num, get_shard_sst_indices(subgroup_num));
+}
+
+long long int MulticastGroup::compute_persistence_frontier(const DerechoSST& sst, subgroup_id_t subgroup_num,
+                                                          const std::vector<uint32_t>& shard_sst_indices) const {
+    if(remote_persistence_replicas == 0 || shard_sst_indices.empty()) {
+        return sst.reduce_min(sst.persisted_num, subgroup_num, shard_sst_indices);
+    }
+    std::vector<long long int> persisted;
+    persisted.reserve(shard_sst_indices.size());
+    for(uint32_t index : shard_sst_indices) {
+        persisted.push_back((long long int)sst.persisted_num[index][subgroup_num]);
+    }
+    // The replicas-th greatest, or the least if the shard is smaller
+    const std::size_t rank = std::min<std::size_t>(remote_persistence_replicas, persisted.size()) - 1;
+    std::nth_element(persisted.begin(), persisted.begin() + rank, persisted.end(), std::greater<long long int>());
+    return persisted[rank];
+}
+
+/** The steady clock that read lease requests are stamped with, in nanoseconds */
+static uint64_t read_lease_clock_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+void MulticastGroup::register_read_lease_predicates(subgroup_id_t subgroup_num,
+                                                    const std::vector<node_id_t>& shard_members,
+                                                    const std::vector<uint32_t>& shard_sst_indices,
+                                                    sst::PredicateType type) {
+    const uint32_t leader_row = node_id_to_sst_index.at(shard_members[0]);
+    auto always = [](const DerechoSST& sst) { return true; };
+    if(leader_row == member_index) {
+        // Renewing well before the lease runs out keeps it held while the
+        // members are responsive
+        const uint64_t renew_interval_ns = read_lease_duration_us * 1000ull / 4;
+        auto renew_trig = [this, subgroup_num, shard_sst_indices, renew_interval_ns,
+                           last_request = 0ull](DerechoSST& sst) mutable {
+            const uint64_t now = read_lease_clock_ns();
+            if(now - last_request < renew_interval_ns) {
+                return;
+            }
+            last_request = now;
+            gmssst::set(sst.read_lease_grant[member_index][subgroup_num], now);
+            gmssst::set(sst.read_lease_request[member_index][subgroup_num], now);
+            sst.put(shard_sst_indices,
+                    (char*)std::addressof(sst.read_lease_request[0][subgroup_num]) - sst.getBaseAddress(),
+                    sizeof(uint64_t));
+        };
+        read_lease_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(always, renew_trig, type));
+        return;
+    }
+    auto request_pred = [this, subgroup_num, leader_row](const DerechoSST& sst) {
+        return sst.read_lease_request[leader_row][subgroup_num] > sst.read_lease_grant[member_index][subgroup_num];
+    };
+    auto grant_trig = [this, subgroup_num, leader_row, leader = shard_members[0]](DerechoSST& sst) {
+        const uint64_t request = sst.read_lease_request[leader_row][subgroup_num];
+        {
+            // The grant is recorded before the leader can see it, and lasts
+            // from now, which is after the leader's request
+            std::lock_guard<std::mutex> lock(read_lease_mutex);
+            read_lease_grants[subgroup_num] = {leader, std::chrono::steady_clock::now()
+                                                               + std::chrono::microseconds(read_lease_duration_us)};
+        }
+        gmssst::set(sst.read_lease_grant[member_index][subgroup_num], request);
+        sst.put(std::vector<uint32_t>{leader_row},
+                (char*)std::addressof(sst.read_lease_grant[0][subgroup_num]) - sst.getBaseAddress(),
+                sizeof(uint64_t));
+    };
+    read_lease_pred_handles[subgroup_num].emplace_back(sst->predicates.insert(request_pred, grant_trig, type));
+}
+
+bool MulticastGroup::holds_read_lease(subgroup_id_t subgroup_num) {
+    if(!read_lease_duration_us || subgroup_num >= subgroup_wedged.size() || is_wedged(subgroup_num)
+       || !subgroup_to_membership.count(subgroup_num) || subgroup_to_mode.at(subgroup_num) != Mode::ORDERED
+       || subgroup_to_membership.at(subgroup_num)[0] != members[member_index]) {
+        return false;
+    }
+    uint64_t granted = std::numeric_limits<uint64_t>::max();
+    for(uint32_t row : get_shard_sst_indices(subgroup_num)) {
+        granted = std::min(granted, (uint64_t)sst->read_lease_grant[row][subgroup_num]);
+    }
+    // The leader gives up the lease an eighth early, which covers the
+    // members' clocks running up to that much faster than its own
+    return granted > 0 && read_lease_clock_ns() < granted + read_lease_duration_us * 1000ull * 7 / 8;
+}
+
+bool MulticastGroup::wait_for_linearizable_read(subgroup_id_t subgroup_num) {
+    // A message delivered anywhere was received everywhere first, this node
+    // included, so the greatest sequence number it has received bounds them
+    long long int read_index = -1;
+    {
+        std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+        if(!holds_read_lease(subgroup_num)) {
+            return false;
+        }
+        const uint32_t num_shard_senders = get_num_senders(subgroup_to_senders_and_sender_rank.at(subgroup_num).first);
+        const uint32_t num_received_offset = subgroup_to_num_received_offset.at(subgroup_num);
+        for(uint32_t sender_rank = 0; sender_rank < num_shard_senders; ++sender_rank) {
+            const long long int received = sst->num_received[member_index][num_received_offset + sender_rank];
+            if(received >= 0) {
+                read_index = std::max(read_index, received * num_shard_senders + sender_rank);
+            }
+        }
+    }
+    // Deliveries bump send_window_epoch, like the window updates they cause
+    num_sendbuffer_waiters++;
+    bool delivered = false;
+    while(!is_wedged(subgroup_num)) {
+        uint64_t epoch;
+        {
+            std::lock_guard<std::mutex> lock(sendbuffer_mtx);
+            epoch = send_window_epoch;
+        }
+        if(sst->delivered_num[member_index][subgroup_num] >= read_index) {
+            delivered = true;
+            break;
+        }
+        std::unique_lock<std::mutex> lock(sendbuffer_mtx);
+        sendbuffer_cv.wait_for(lock, std::chrono::milliseconds(sender_timeout), [&]() {
+            return send_window_epoch != epoch || is_wedged(subgroup_num);
+        });
+    }
+    num_sendbuffer_waiters--;
+    if(delivered && delivery_executors[subgroup_num]) {
+        // The upcalls of the messages counted as delivered may still be queued
+        auto fence = std::make_shared<std::promise<void>>();
+        std::future<void> upcalls_done = fence->get_future();
+        {
+            std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+            run_in_delivery_order(subgroup_num, [fence]() { fence->set_value(); });
+        }
+        upcalls_done.wait();
+    }
+    return delivered;
+}
+
+void MulticastGroup::wait_out_read_leases(const std::vector<node_id_t>& next_members) {
+    auto expiry = std::chrono::steady_clock::time_point::min();
+    {
+        std::lock_guard<std::mutex> lock(read_lease_mutex);
+        for(const auto& grant : read_lease_grants) {
+            if(std::find(next_members.begin(), next_members.end(), grant.second.leader) == next_members.end()) {
+                expiry = std::max(expiry, grant.second.expiry);
+            }
+        }
+    }
+    if(expiry > std::chrono::steady_clock::now()) {
+        logger->debug("Waiting for the read leases granted to departed shard leaders to run out");
+        std::this_thread::sleep_until(expiry);
+    }
+}
+
+void MulticastGroup::check_failures() {
+    if(thread_shutdown || !sst) {
+        return;
+    }
+    auto current_time = get_time();
+    for(auto p : subgroup_to_membership) {
+        auto subgroup_num = p.first;
+        std::lock_guard<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+        auto members = p.second;
+        auto sst_indices = get_shard_sst_indices(subgroup_num);
+        // clean up timestamps of persisted messages
+        auto min_persisted_num = sst->persisted_num[member_index][subgroup_num];
+        for(auto i : sst_indices) {
+            if(min_persisted_num < sst->persisted_num[i][subgroup_num]) {
+                min_persisted_num = sst->persisted_num[i][subgroup_num];
+            }
+        }
+        while(!pending_persistence[subgroup_num].empty() && pending_persistence[subgroup_num].begin()->first <= min_persisted_num) {
+            auto timestamp = pending_persistence[subgroup_num].begin()->second;
+            pending_persistence[subgroup_num].erase(pending_persistence[subgroup_num].begin());
+            pending_message_timestamps[subgroup_num].erase(timestamp);
+        }
+        uint64_t frontier = current_time;
+        if(!pending_message_timestamps[subgroup_num].empty()) {
+            frontier = std::min(frontier, pending_message_timestamps[subgroup_num].min());
+        }
+        uint64_t oldest_in_ring;
+        if(send_rings[subgroup_num] && send_rings[subgroup_num]->oldest_pending_timestamp(oldest_in_ring)) {
+            frontier = std::min(frontier, oldest_in_ring);
+        }
+        sst->local_stability_frontier[member_index][subgroup_num] = frontier;
+    }
+    sst->put_with_completion((char*)std::addressof(sst->local_stability_frontier[0][0]) - sst->getBaseAddress(), sizeof(sst->local_stability_frontier[0][0]) * sst->local_stability_frontier.size());
+}
+
+void MulticastGroup::rdmc_group_loop() {
+    pthread_setname_np(pthread_self(), "rdmc_groups");
+    while(!rdmc_group_thread_shutdown) {
+        if(!thread_shutdown) {
+            update_rdmc_group_requests();
+        }
+        if(member_index == 0) {
+            start_rdmc_group_round();
+        }
+        const int32_t round = sst->rdmc_group_round[0];
+        if(round > sst->rdmc_group_round_done[member_index]) {
+            run_rdmc_group_round(round);
+        }
+        // A sender's group is ready once the round that last acted on what
+        // the sender wants (and so created the group) is over at every member
+        for(auto& column_group : lazy_groups) {
+            LazyRDMCGroup& group = column_group.second;
+            if(group.rotated_members[0] != members[member_index] || !group.created || group.ready) {
+                continue;
+            }
+            const int64_t target = sst->rdmc_group_target[0][column_group.first];
+            if((int32_t)target != sst->rdmc_group_wanted[member_index][column_group.first]) {
+                continue;
+            }
+            const int32_t target_round = target >> 32;
+            bool done_everywhere = true;
+            for(uint32_t row : group.member_rows) {
+                done_everywhere = done_everywhere && sst->rdmc_group_round_done[row] >= target_round;
+            }
+            if(done_everywhere) {
+                group.ready = true;
+                notify_senders();
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // The next view has been agreed on, so any round the leader started
+    // before it wedged is visible by now, and the other members of its
+    // groups are waiting for this one to join in
+    const int32_t round = sst->rdmc_group_round[0];
+    if(round > sst->rdmc_group_round_done[member_index]) {
+        run_rdmc_group_round(round);
+    }
+}
+
+void MulticastGroup::update_rdmc_group_requests() {
+    for(auto& column_group : lazy_groups) {
+        const uint32_t column = column_group.first;
+        LazyRDMCGroup& group = column_group.second;
+        if(group.rotated_members[0] != members[member_index]) {
+            continue;
+        }
+        int32_t wanted = sst->rdmc_group_wanted[member_index][column];
+        if(wanted % 2 == 0 && group.requested) {
+            group.requested = false;
+            wanted++;
+        } else if(wanted % 2 == 1 && group.ready && rdmc_group_idle_timeout_ms > 0) {
+            std::lock_guard<std::mutex> lock(subgroup_mutexes[group.subgroup_num]);
+            // Idle, and every message sent in it has been received everywhere,
+            // so no member still has a transfer in progress
+            const bool idle = pending_sends[group.subgroup_num].empty()
+                              && current_sends[group.subgroup_num].empty()
+                              && get_time() - group.last_send_time > rdmc_group_idle_timeout_ms * 1000000ull
+                              && sst->reduce_min(sst->num_received, column, group.member_rows) >= group.last_send_index;
+            if(!idle) {
+                continue;
+            }
+            // Cleared under the lock, so the sender thread can't start another message in it
+            group.ready = false;
+            wanted++;
+        } else {
+            continue;
+        }
+        logger->debug("{} the RDMC group of subgroup {}", wanted % 2 ? "Requesting" : "Giving up", group.subgroup_num);
+        sst->rdmc_group_wanted[member_index][column] = wanted;
+        sst->put((char*)std::addressof(sst->rdmc_group_wanted[0][column]) - sst->getBaseAddress(),
+                 sizeof(sst->rdmc_group_wanted[0][column]));
+    }
+}
+
+void MulticastGroup::start_rdmc_group_round() {
+    std::lock_guard<std::mutex> lock(rdmc_round_mutex);
+    if(rdmc_rounds_stopped) {
+        return;
+    }
+    const int32_t round = sst->rdmc_group_round[member_index];
+    for(uint32_t row = 0; row < num_members; ++row) {
+        if(sst->rdmc_group_round_done[row] < round) {
+            return;
+        }
+    }
+    const uint32_t num_columns = sst->rdmc_group_wanted.size();
+    bool changed = false;
+    for(uint32_t column = 0; column < num_columns; ++column) {
+        // Only the column's sender writes anything but 0 to it, and it only grows
+        int32_t wanted = 0;
+        for(uint32_t row = 0; row < num_members; ++row) {
+            wanted = std::max(wanted, (int32_t)sst->rdmc_group_wanted[row][column]);
+        }
+        if(wanted != (int32_t)sst->rdmc_group_target[member_index][column]) {
+            sst->rdmc_group_target[member_index][column] = ((int64_t)(round + 1) << 32) | (uint32_t)wanted;
+            changed = true;
+        }
+    }
+    if(!changed) {
+        return;
+    }
+    // The targets are written before the round, so a member that sees the
+    // round also sees them
+    sst->put((char*)std::addressof(sst->rdmc_group_target[0][0]) - sst->getBaseAddress(),
+             num_columns * sizeof(sst->rdmc_group_target[0][0]));
+    sst->rdmc_group_round[member_index] = round + 1;
+    sst->put((char*)std::addressof(sst->rdmc_group_round[0]) - sst->getBaseAddress(),
+             sizeof(sst->rdmc_group_round[0]));
+}
+
+void MulticastGroup::run_rdmc_group_round(int32_t round) {
+    for(auto& column_group : lazy_groups) {
+        LazyRDMCGroup& group = column_group.second;
+        const bool wanted = (int32_t)sst->rdmc_group_target[0][column_group.first] % 2 == 1;
+        if(wanted && !group.created) {
+            auto upcalls = make_rdmc_upcalls(group.subgroup_num, group.shard_rank, group.sender_rank);
+            try {
+                group.created = rdmc::create_group(
+                        group.group_number, group.rotated_members, block_size, type,
+                        upcalls.first, upcalls.second,
+                        [](std::experimental::optional<uint32_t>) {}, adaptive_block_size,
+                        rdmc_block_writes ? max_msg_size : 0, rdmc_service_level_of(group.subgroup_num));
+            } catch(const rdma::exception&) {
+                group.created = false;
+            }
+            if(!group.created) {
+                logger->warn("Failed to create RDMC group {} in subgroup {}", group.group_number, group.subgroup_num);
+                continue;
+            }
+            rdmc_groups[{group.subgroup_num, group.rotated_members}] = group.group_number;
+        } else if(!wanted && group.created) {
+            group.ready = false;
+            rdmc::destroy_group(group.group_number);
+            rdmc_groups.erase({group.subgroup_num, group.rotated_members});
+            group.created = false;
+        }
+    }
+    sst->rdmc_group_round_done[member_index] = round;
+    sst->put((char*)std::addressof(sst->rdmc_group_round_done[0]) - sst->getBaseAddress(),
+             sizeof(sst->rdmc_group_round_done[0]));
+}
+
+void MulticastGroup::stop_rdmc_group_thread() {
+    rdmc_group_thread_shutdown = true;
+    if(rdmc_group_thread.joinable()) {
+        rdmc_group_thread.join();
+    }
+}
+
+void MulticastGroup::heartbeat_loop() {
+    pthread_setname_np(pthread_self(), "heartbeat");
+    place_this_thread("heartbeat");
+    using std::chrono::steady_clock;
+    auto steady_ns = []() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       steady_clock::now().time_since_epoch())
+                .count();
+    };
+    const auto interval = std::chrono::microseconds(heartbeat_interval_us);
+    const int num_rows = sst->get_num_rows();
+    PhiAccrualDetector detector(num_rows, heartbeat_interval_us * 1000ull, failure_phi_threshold, steady_ns());
+    std::vector<bool> suspected(num_rows, false);
+    auto next_beat = steady_clock::now();
+    while(!heartbeat_shutdown) {
+        gmssst::set(sst->heartbeat[member_index], sst->heartbeat[member_index] + 1);
+        sst->put((char*)std::addressof(sst->heartbeat[0]) - sst->getBaseAddress(), sizeof(sst->heartbeat[0]));
+        // Once this group is wedged its failures are the next view's business
+        if(!thread_shutdown) {
+            const uint64_t now = steady_ns();
+            for(int row = 0; row < num_rows; ++row) {
+                if(row == member_index || suspected[row]) {
+                    continue;
                 }
-                while(!pending_persistence[subgroup_num].empty() && pending_persistence[subgroup_num].begin()->first <= min_persisted_num) {
-                    auto timestamp = pending_persistence[subgroup_num].begin()->second;
-                    pending_persistence[subgroup_num].erase(pending_persistence[subgroup_num].begin());
-                    pending_message_timestamps[subgroup_num].erase(timestamp);
+                // A wedged member may have stopped its heartbeats for the view change
+                if(detector.observe(row, sst->heartbeat[row], now) || sst->wedged[row]) {
+                    continue;
                 }
-                if(pending_message_timestamps[subgroup_num].empty()) {
-                    sst->local_stability_frontier[member_index][subgroup_num] = current_time;
-                } else {
-                    sst->local_stability_frontier[member_index][subgroup_num] = std::min(current_time, *pending_message_timestamps[subgroup_num].begin());
+                if(detector.suspect(row, now)) {
+                    logger->debug("Suspecting node {}, whose heartbeats stopped (phi = {})",
+                                  members[row], detector.phi(row, now));
+                    suspected[row] = true;
+                    sst->freeze(row);
                 }
             }
-            sst->put_with_completion((char*)std::addressof(sst->local_stability_frontier[0][0]) - sst->getBaseAddress(), sizeof(sst->local_stability_frontier[0][0]) * sst->local_stability_frontier.size());
         }
+        next_beat += interval;
+        std::this_thread::sleep_until(next_beat);
     }
-
-    std::cout << "timeout_thread shutting down" << std::endl;
 }
 
 char* MulticastGroup::get_sendbuffer_ptr(subgroup_id_t subgroup_num,
@@ -1186,7 +2635,7 @@ char* MulticastGroup::get_sendbuffer_ptr(subgroup_id_t subgroup_num,
                                          int pause_sending_turns,
                                          bool cooked_send, bool null_send) {
     // if rdmc groups were not created because of failures, return NULL
-    if(!rdmc_sst_groups_created) {
+    if(!rdmc_sst_groups_created || subgroup_wedged[subgroup_num]) {
         return NULL;
     }
     long long unsigned int msg_size = payload_size + sizeof(header);
@@ -1216,91 +2665,353 @@ char* MulticastGroup::get_sendbuffer_ptr(subgroup_id_t subgroup_num,
     num_shard_senders = get_num_senders(shard_senders);
     assert(shard_sender_index >= 0);
 
-    if(subgroup_to_mode.at(subgroup_num) != Mode::RAW) {
+    const bool via_sst = transport_selectors[subgroup_num].choose(msg_size);
+    auto& sst_multicast_group = *sst_multicast_group_ptrs[subgroup_num];
+    // A packed SST multicast is limited by the space left in the ring rather
+    // than by the window, so the window only has to bound the smallest messages
+    long long int send_window = window_controllers[subgroup_num].window();
+    if(via_sst && packed_sst_multicast) {
+        send_window = sst_multicast_group.max_packed_messages(sizeof(header));
+    }
+    // The index of this node's latest message that every shard member is done with
+    long long int done_index = future_message_indices[subgroup_num];
+    if(subgroup_to_mode.at(subgroup_num) == Mode::FIFO) {
+        auto num_received_offset = subgroup_to_num_received_offset.at(subgroup_num);
         for(uint i = 0; i < num_shard_members; ++i) {
-            if(sst->delivered_num[node_id_to_sst_index.at(shard_members[i])][subgroup_num] < (long long int)((future_message_indices[subgroup_num] - window_size) * num_shard_senders + shard_sender_index)) {
+            long long int delivered_index = sst->fifo_delivered_num[node_id_to_sst_index.at(shard_members[i])][num_received_offset + shard_sender_index];
+            if(delivered_index < (long long int)(future_message_indices[subgroup_num] - send_window)) {
                 return nullptr;
             }
+            done_index = std::min(done_index, delivered_index);
+        }
+    } else if(subgroup_to_mode.at(subgroup_num) != Mode::RAW) {
+        bool window_full = false;
+        // The most messages per sender some member has received but not delivered
+        long long int delivery_backlog = 0;
+        for(uint i = 0; i < num_shard_members; ++i) {
+            const int member_sst_index = node_id_to_sst_index.at(shard_members[i]);
+            long long int delivered_num = sst->delivered_num[member_sst_index][subgroup_num];
+            delivery_backlog = std::max(delivery_backlog,
+                                        (sst->seq_num[member_sst_index][subgroup_num] - delivered_num) / (long long int)num_shard_senders);
+            if(delivered_num < (long long int)((future_message_indices[subgroup_num] - send_window) * num_shard_senders + shard_sender_index)) {
+                window_full = true;
+                continue;
+            }
+            long long int delivered_index = delivered_num < shard_sender_index
+                                                    ? -1
+                                                    : (delivered_num - shard_sender_index) / (long long int)num_shard_senders;
+            done_index = std::min(done_index, delivered_index);
+        }
+        window_controllers[subgroup_num].observe(delivery_backlog, window_full);
+        if(window_full) {
+            return nullptr;
         }
     } else {
         for(uint i = 0; i < num_shard_members; ++i) {
             auto num_received_offset = subgroup_to_num_received_offset.at(subgroup_num);
-            if(sst->num_received[node_id_to_sst_index.at(shard_members[i])][num_received_offset + shard_sender_index] < (long long int)(future_message_indices[subgroup_num] - window_size)) {
+            long long int num_received = sst->num_received[node_id_to_sst_index.at(shard_members[i])][num_received_offset + shard_sender_index];
+            if(num_received < (long long int)(future_message_indices[subgroup_num] - send_window)) {
                 return nullptr;
             }
+            done_index = std::min(done_index, num_received);
         }
     }
 
-    if(thread_shutdown) {
+    subgroup_metrics[subgroup_num]->window_occupancy.set(std::max(0LL, (long long int)future_message_indices[subgroup_num] - 1 - done_index));
+
+    if(is_wedged(subgroup_num)) {
         return nullptr;
     }
 
-    if(msg_size > sst::max_msg_size) {
-        std::unique_lock<std::mutex> lock(msg_state_mtx);
+    SendLimiter& limiter = *send_limiters[subgroup_num];
+    if(!limiter.admits(get_time())) {
+        subgroup_metrics[subgroup_num]->sends_throttled.add();
+        return nullptr;
+    }
+
+    if(!via_sst) {
+        std::unique_lock<std::mutex> lock(subgroup_mutexes[subgroup_num]);
         if(free_message_buffers[subgroup_num].empty()) return nullptr;
+        if(limiter.max_pending_sends() && pending_sends[subgroup_num].size() >= limiter.max_pending_sends()) {
+            subgroup_metrics[subgroup_num]->sends_throttled.add();
+            return nullptr;
+        }
+        limiter.charge(msg_size);
 
         // Create new Message
         RDMCMessage msg;
         msg.sender_id = members[member_index];
         msg.index = future_message_indices[subgroup_num];
         msg.size = msg_size;
-        msg.message_buffer = std::move(free_message_buffers[subgroup_num].back());
-        free_message_buffers[subgroup_num].pop_back();
+        msg.message_buffer = free_message_buffers[subgroup_num].take(msg_size);
 
         auto current_time = get_time();
         pending_message_timestamps[subgroup_num].insert(current_time);
+        subgroup_metrics[subgroup_num]->messages_sent.add();
+        if(stage_trackers[subgroup_num]) {
+            stage_trackers[subgroup_num]->acquired(msg.index, current_time);
+        }
+        if(send_frontiers[subgroup_num]) {
+            send_frontiers[subgroup_num]->acquired(msg.index);
+        }
 
         // Fill header
-        char* buf = msg.message_buffer.buffer.get();
+        char* buf = msg.message_buffer.buffer();
         ((header*)buf)->header_size = sizeof(header);
         ((header*)buf)->pause_sending_turns = pause_sending_turns;
         ((header*)buf)->index = msg.index;
         ((header*)buf)->timestamp = current_time;
         ((header*)buf)->cooked_send = cooked_send;
+        ((header*)buf)->vid = sst->vid[member_index];
+        ((header*)buf)->fragment = Fragment::WHOLE;
 
         next_sends[subgroup_num] = std::move(msg);
         future_message_indices[subgroup_num] += pause_sending_turns + 1;
 
         last_transfer_medium[subgroup_num] = true;
-        // DERECHO_LOG(-1, -1, "provided a buffer");
         return buf + sizeof(header);
     } else {
-        std::unique_lock<std::mutex> lock(msg_state_mtx);
-        char* buf = (char*)sst_multicast_group_ptrs[subgroup_num]->get_buffer(msg_size);
+        std::unique_lock<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+        char* buf;
+        if(packed_sst_multicast) {
+            sst_multicast_group.reclaim(done_index);
+            buf = (char*)sst_multicast_group.get_packed_buffer(msg_size, future_message_indices[subgroup_num]);
+        } else {
+            buf = (char*)sst_multicast_group.get_buffer(msg_size);
+        }
         if(!buf) {
             return nullptr;
         }
+        limiter.charge(msg_size);
         auto current_time = get_time();
         pending_message_timestamps[subgroup_num].insert(current_time);
+        subgroup_metrics[subgroup_num]->messages_sent.add();
+        if(stage_trackers[subgroup_num]) {
+            stage_trackers[subgroup_num]->acquired(future_message_indices[subgroup_num], current_time);
+        }
+        if(send_frontiers[subgroup_num]) {
+            send_frontiers[subgroup_num]->acquired(future_message_indices[subgroup_num]);
+        }
 
         ((header*)buf)->header_size = sizeof(header);
         ((header*)buf)->pause_sending_turns = pause_sending_turns;
         ((header*)buf)->index = future_message_indices[subgroup_num];
         ((header*)buf)->timestamp = current_time;
         ((header*)buf)->cooked_send = cooked_send;
+        ((header*)buf)->vid = sst->vid[member_index];
+        ((header*)buf)->fragment = Fragment::WHOLE;
         future_message_indices[subgroup_num] += pause_sending_turns + 1;
 
         last_transfer_medium[subgroup_num] = false;
-        // DERECHO_LOG(-1, -1, "provided a buffer");
         return buf + sizeof(header);
     }
 }
 
+void MulticastGroup::recycle_message_buffer(subgroup_id_t subgroup_num, MessageBuffer&& buffer) {
+    if(buffer.user_owned) {
+        // Dropping the memory region tells the application, once RDMC has
+        // also let go of it
+        MessageBuffer released(std::move(buffer));
+        return;
+    }
+    free_message_buffers[subgroup_num].give_back(std::move(buffer));
+}
+
+void MulticastGroup::set_send_limit(subgroup_id_t subgroup_num, const SendLimit& limit) {
+    send_limiter_table->of(subgroup_num)->configure(limit);
+    // Senders waiting on the old limit may be admitted by the new one
+    notify_sendbuffer_waiters();
+}
+
+void MulticastGroup::set_receive_allocator(subgroup_id_t subgroup_num, receive_allocator_t allocator) {
+    std::lock_guard<std::mutex> lock(receive_allocators->mutex);
+    if(allocator) {
+        receive_allocators->allocators[subgroup_num] = std::move(allocator);
+    } else {
+        receive_allocators->allocators.erase(subgroup_num);
+    }
+}
+
+std::shared_ptr<rdma::memory_region> MulticastGroup::allocate_user_receive(subgroup_id_t subgroup_num, node_id_t sender,
+                                                                         long long unsigned int size) {
+    receive_allocator_t allocator;
+    {
+        std::lock_guard<std::mutex> lock(receive_allocators->mutex);
+        auto it = receive_allocators->allocators.find(subgroup_num);
+        if(it == receive_allocators->allocators.end()) {
+            return nullptr;
+        }
+        allocator = it->second;
+    }
+    auto mr = allocator(sender, size);
+    if(mr && mr->size < size) {
+        logger->warn("Receive allocator for subgroup {} gave {} bytes for a {} byte message; using Derecho's buffer instead",
+                     subgroup_num, mr->size, size);
+        return nullptr;
+    }
+    return mr;
+}
+
+bool MulticastGroup::send_user_buffer(subgroup_id_t subgroup_num, char* buffer,
+                                      long long unsigned int payload_size,
+                                      std::function<void()> on_release,
+                                      int pause_sending_turns, bool cooked_send) {
+    if(is_wedged(subgroup_num) || !rdmc_sst_groups_created) {
+        return false;
+    }
+    const long long unsigned int msg_size = payload_size + sizeof(header);
+    // Receivers still put the message in one of their own buffers
+    if(msg_size > max_msg_size) {
+        return false;
+    }
+    auto region = rdma::memory_region::for_user_buffer(buffer, msg_size);
+    std::shared_ptr<rdma::memory_region> mr(region.release(), [on_release](rdma::memory_region* r) {
+        delete r;
+        if(on_release) {
+            on_release();
+        }
+    });
+    return send_user_buffer(subgroup_num, std::move(mr), payload_size, pause_sending_turns, cooked_send);
+}
+
+bool MulticastGroup::send_user_buffer(subgroup_id_t subgroup_num, std::shared_ptr<rdma::memory_region> mr,
+                                      long long unsigned int payload_size,
+                                      int pause_sending_turns, bool cooked_send) {
+    if(is_wedged(subgroup_num) || !rdmc_sst_groups_created) {
+        return false;
+    }
+    const long long unsigned int msg_size = payload_size + sizeof(header);
+    if(msg_size > max_msg_size || msg_size > mr->size) {
+        return false;
+    }
+    char* const buffer = mr->buffer;
+
+    {
+        std::unique_lock<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+        // The message handed out by get_sendbuffer_ptr has the earlier index,
+        // so it has to be queued first
+        if(next_sends[subgroup_num]) {
+            return false;
+        }
+        SendLimiter& limiter = *send_limiters[subgroup_num];
+        if(!limiter.admits(get_time())
+           || (limiter.max_pending_sends() && pending_sends[subgroup_num].size() >= limiter.max_pending_sends())) {
+            subgroup_metrics[subgroup_num]->sends_throttled.add();
+            return false;
+        }
+        limiter.charge(msg_size);
+        RDMCMessage msg;
+        msg.sender_id = members[member_index];
+        msg.index = future_message_indices[subgroup_num];
+        msg.size = msg_size;
+        msg.message_buffer = MessageBuffer(std::move(mr));
+
+        auto current_time = get_time();
+        pending_message_timestamps[subgroup_num].insert(current_time);
+        subgroup_metrics[subgroup_num]->messages_sent.add();
+        if(stage_trackers[subgroup_num]) {
+            stage_trackers[subgroup_num]->acquired(msg.index, current_time);
+        }
+        if(send_frontiers[subgroup_num]) {
+            send_frontiers[subgroup_num]->acquired(msg.index);
+        }
+
+        ((header*)buffer)->header_size = sizeof(header);
+        ((header*)buffer)->pause_sending_turns = pause_sending_turns;
+        ((header*)buffer)->index = msg.index;
+        ((header*)buffer)->timestamp = current_time;
+        ((header*)buffer)->cooked_send = cooked_send;
+        ((header*)buffer)->vid = sst->vid[member_index];
+        ((header*)buffer)->fragment = Fragment::WHOLE;
+
+        future_message_indices[subgroup_num] += pause_sending_turns + 1;
+        pending_sends[subgroup_num].push(std::move(msg));
+        subgroup_metrics[subgroup_num]->pending_sends.set(pending_sends[subgroup_num].size());
+        if(try_inline_send(subgroup_num, lock)) {
+            return true;
+        }
+    }
+    notify_senders();
+    return true;
+}
+
+void MulticastGroup::notify_sendbuffer_waiters() {
+    if(num_sendbuffer_waiters == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sendbuffer_mtx);
+        send_window_epoch++;
+    }
+    sendbuffer_cv.notify_all();
+}
+
+char* MulticastGroup::wait_for_sendbuffer_ptr(subgroup_id_t subgroup_num,
+                                              long long unsigned int payload_size,
+                                              const std::chrono::steady_clock::time_point& deadline,
+                                              int pause_sending_turns,
+                                              bool cooked_send, bool null_send) {
+    // these failures are permanent, so there is no point in waiting for them
+    if(!rdmc_sst_groups_created || payload_size + sizeof(header) > max_msg_size) {
+        return get_sendbuffer_ptr(subgroup_num, payload_size, pause_sending_turns, cooked_send, null_send);
+    }
+    // Registering as a waiter before checking the window ensures that every
+    // window update that happens after the check bumps send_window_epoch
+    num_sendbuffer_waiters++;
+    char* buf = nullptr;
+    while(!is_wedged(subgroup_num)) {
+        uint64_t epoch;
+        {
+            std::lock_guard<std::mutex> lock(sendbuffer_mtx);
+            epoch = send_window_epoch;
+        }
+        buf = get_sendbuffer_ptr(subgroup_num, payload_size, pause_sending_turns, cooked_send, null_send);
+        auto now = std::chrono::steady_clock::now();
+        if(buf || now >= deadline) {
+            break;
+        }
+        // Not every window update is signalled (e.g. stability of SST
+        // multicasts at remote nodes), so never sleep longer than the sender timeout
+        auto wake_time = std::min(deadline, now + std::chrono::milliseconds(sender_timeout));
+        // A send the SendLimiter throttled can be made once the tokens come back
+        const uint64_t throttle_ns = send_limiters[subgroup_num]->wait_ns(get_time());
+        if(throttle_ns) {
+            wake_time = std::min(wake_time, now + std::chrono::nanoseconds(throttle_ns));
+        }
+        std::unique_lock<std::mutex> lock(sendbuffer_mtx);
+        sendbuffer_cv.wait_until(lock, wake_time, [&]() {
+            return send_window_epoch != epoch || is_wedged(subgroup_num);
+        });
+    }
+    num_sendbuffer_waiters--;
+    return buf;
+}
+
 bool MulticastGroup::send(subgroup_id_t subgroup_num) {
-    if(thread_shutdown || !rdmc_sst_groups_created) {
+    if(is_wedged(subgroup_num) || !rdmc_sst_groups_created) {
         return false;
     }
     if(last_transfer_medium[subgroup_num]) {
-        std::lock_guard<std::mutex> lock(msg_state_mtx);
-        assert(next_sends[subgroup_num]);
-        pending_sends[subgroup_num].push(std::move(*next_sends[subgroup_num]));
-        next_sends[subgroup_num] = std::experimental::nullopt;
-        sender_cv.notify_all();
-        // DERECHO_LOG(-1, -1, "user_send_finished");
+        {
+            std::unique_lock<std::mutex> lock(subgroup_mutexes[subgroup_num]);
+            assert(next_sends[subgroup_num]);
+            pending_sends[subgroup_num].push(std::move(*next_sends[subgroup_num]));
+            next_sends[subgroup_num] = std::experimental::nullopt;
+            subgroup_metrics[subgroup_num]->pending_sends.set(pending_sends[subgroup_num].size());
+            if(try_inline_send(subgroup_num, lock)) {
+                DERECHO_TRACE_POINT(subgroup_num, -1, -1, "user_send_finished");
+                return true;
+            }
+        }
+        notify_senders();
+        DERECHO_TRACE_POINT(subgroup_num, -1, -1, "user_send_finished");
         return true;
     } else {
+        if(stage_trackers[subgroup_num]) {
+            stage_trackers[subgroup_num]->stamp_last_acquired(metrics::SEND_ISSUED, get_time());
+        }
         sst_multicast_group_ptrs[subgroup_num]->send();
-        // DERECHO_LOG(-1, -1, "user_send_finished");
+        DERECHO_TRACE_POINT(subgroup_num, -1, -1, "user_send_finished");
         return true;
     }
 }
@@ -1349,4 +3060,128 @@ void MulticastGroup::debug_print() {
     }
 }
 
+RawSendRing::RawSendRing(unsigned int num_slots, long long unsigned int max_msg_size, int32_t vid,
+                         std::shared_ptr<DerechoSST> sst, uint32_t num_received_column,
+                         std::vector<uint32_t> shard_sst_indices, long long int first_index,
+                         uint32_t rdmc_group_number, metrics::Counter& messages_sent,
+                         std::function<void()> wake_sender)
+        : slots(num_slots),
+          max_msg_size(max_msg_size),
+          vid(vid),
+          sst(std::move(sst)),
+          num_received_column(num_received_column),
+          shard_sst_indices(std::move(shard_sst_indices)),
+          messages_sent(messages_sent),
+          wake_sender(std::move(wake_sender)),
+          next_index(first_index),
+          rdmc_group_number(rdmc_group_number) {
+    assert(num_slots >= 1);
+    for(Slot& slot : slots) {
+        slot.mr = rdma::memory_region::allocate(max_msg_size);
+    }
+}
+
+char* RawSendRing::claim(long long unsigned int payload_size, int pause_sending_turns, bool null_send) {
+    if(closed) {
+        return nullptr;
+    }
+    long long unsigned int msg_size = payload_size + sizeof(header);
+    if(!payload_size) {
+        msg_size = max_msg_size;
+    }
+    if(null_send) {
+        msg_size = sizeof(header);
+    }
+    if(msg_size > max_msg_size) {
+        return nullptr;
+    }
+    Slot& next = slot(num_published.load(std::memory_order_relaxed));
+    if(next.last_index > min_received) {
+        min_received = sst->reduce_min(sst->num_received, num_received_column, shard_sst_indices);
+        if(next.last_index > min_received) {
+            return nullptr;
+        }
+    }
+    char* buf = next.mr->buffer;
+    // The same clock as MulticastGroup::get_time, for the stability frontier
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ((header*)buf)->header_size = sizeof(header);
+    ((header*)buf)->pause_sending_turns = pause_sending_turns;
+    ((header*)buf)->index = next_index;
+    ((header*)buf)->timestamp = now.tv_sec * 1000000000ull + now.tv_nsec;
+    ((header*)buf)->cooked_send = false;
+    ((header*)buf)->vid = vid;
+    ((header*)buf)->fragment = Fragment::WHOLE;
+    next.size = msg_size;
+    slot_claimed = true;
+    return buf + sizeof(header);
+}
+
+bool RawSendRing::publish() {
+    if(!slot_claimed) {
+        return false;
+    }
+    // Paired with close(): either it sees this call, or this call sees it
+    active_publishers++;
+    if(closed) {
+        active_publishers--;
+        return false;
+    }
+    const uint64_t position = num_published.load(std::memory_order_relaxed);
+    Slot& next = slot(position);
+    next.last_index = next_index + ((header*)next.mr->buffer)->pause_sending_turns;
+    next_index = next.last_index + 1;
+    slot_claimed = false;
+    messages_sent.add();
+    num_published = position + 1;
+    wake_sender();
+    active_publishers--;
+    return true;
+}
+
+long long unsigned int RawSendRing::claimed_payload_size() const {
+    return slot_claimed ? slot(num_published.load(std::memory_order_relaxed)).size - sizeof(header) : 0;
+}
+
+void RawSendRing::close() {
+    closed = true;
+    while(active_publishers) {
+        std::this_thread::yield();
+    }
+}
+
+bool RawSendRing::oldest_pending_timestamp(uint64_t& timestamp) const {
+    const uint64_t completed = num_completed.load(std::memory_order_acquire);
+    if(completed >= num_published) {
+        return false;
+    }
+    timestamp = ((header*)slot(completed).mr->buffer)->timestamp;
+    return true;
+}
+
+void RawSendRing::for_each_unfinished(const std::function<void(const char*, long long unsigned int)>& f) const {
+    const uint64_t published = num_published;
+    for(uint64_t position = num_completed.load(std::memory_order_acquire); position < published; ++position) {
+        f(slot(position).mr->buffer, slot(position).size);
+    }
+}
+
+void RawSendRing::take_over(const RawSendRing& old_ring) {
+    old_ring.for_each_unfinished([this](const char* message, long long unsigned int size) {
+        const uint64_t position = num_published.load(std::memory_order_relaxed);
+        Slot& next = slot(position);
+        // This ring is new, so it can't run out of slots for them
+        assert(next.last_index < 0 && size <= max_msg_size);
+        memcpy(next.mr->buffer, message, size);
+        header* h = (header*)next.mr->buffer;
+        h->index = next_index;
+        h->vid = vid;
+        next.size = size;
+        next.last_index = next_index + h->pause_sending_turns;
+        next_index = next.last_index + 1;
+        num_published = position + 1;
+    });
+}
+
 }  // namespace derecho
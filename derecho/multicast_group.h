@@ -1,9 +1,14 @@
 #pragma once
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <experimental/optional>
 #include <functional>
+#include <limits>
 #include <list>
 #include <map>
 #include <memory>
@@ -16,17 +21,31 @@
 
 #include "derecho_internal.h"
 #include "connection_manager.h"
+#include "delivery_executor.h"
 #include "derecho_modes.h"
 #include "derecho_ports.h"
 #include "derecho_sst.h"
 #include "filewriter.h"
+#include "message_stages.h"
+#include "message_window.h"
+#include "metrics.h"
+#include "send_receipt.h"
 #include "mutils-serialization/SerializationMacros.hpp"
 #include "mutils-serialization/SerializationSupport.hpp"
+#include "pending_timestamps.h"
+#include "persistence_notifier.h"
 #include "rdmc/rdmc.h"
+#include "received_window.h"
+#include "send_limiter.h"
 #include "spdlog/spdlog.h"
 #include "sst/multicast.h"
 #include "sst/sst.h"
+#include "sst/timer_wheel.h"
+#include "static_callback.h"
 #include "subgroup_info.h"
+#include "subgroup_map.h"
+#include "transport_selector.h"
+#include "window_controller.h"
 
 namespace derecho {
 
@@ -38,7 +57,46 @@ namespace derecho {
 /** Alias for the type of std::function that is used for message delivery event callbacks. */
 using message_callback_t = std::function<void(subgroup_id_t, node_id_t, long long int, char*, long long int)>;
 using persistence_callback_t = std::function<void(subgroup_id_t, persistence_version_t)>;
-using rpc_handler_t = std::function<void(subgroup_id_t, node_id_t, char*, uint32_t)>;
+/** Handles a delivered RPC message; bound by Group to its RPCManager without
+ * a std::function, since it is called for every message */
+using rpc_handler_t = StaticCallback<void(subgroup_id_t, node_id_t, char*, uint32_t)>;
+
+/** A message delivered in a batch: its sender, its index among the sender's
+ * messages, and its payload */
+struct DeliveredMessage {
+    node_id_t sender_id;
+    long long int index;
+    char* buf;
+    long long int size;
+};
+/**
+ * Alias for the type of std::function that is called with the messages
+ * delivered in a subgroup by one pass of its delivery predicate, in delivery
+ * order, instead of a message_callback_t once per message. The payloads are
+ * only valid during the call.
+ */
+using batch_callback_t = std::function<void(subgroup_id_t, const DeliveredMessage*, std::size_t)>;
+/** Called by an rpc_batch_handler_t for each message it has handled */
+using batch_delivered_t = StaticCallback<void(std::size_t)>;
+/** Handles a batch of delivered RPC messages in order, and must call
+ * delivered(i) as soon as it has handled the i-th one */
+using rpc_batch_handler_t = StaticCallback<void(subgroup_id_t, const DeliveredMessage*, std::size_t,
+                                                const batch_delivered_t& delivered)>;
+/**
+ * Called when a message of this many bytes, header included, starts arriving
+ * over RDMC from a sender in a subgroup that has one. It may return a
+ * registered memory region of at least that size for the message to be
+ * received into, at its start, so that the data the delivery upcall is given
+ * points into it; Derecho drops its reference to the region once the message
+ * has been delivered, and the region must not be changed before then.
+ * Returning null receives the message into one of Derecho's own buffers. A
+ * region from rdma::memory_region::for_device_buffer() receives it straight
+ * into GPU memory, and then the upcall's payload pointer is into the region's
+ * CPU mapping; such messages should be raw sends, since RPC arguments would be
+ * deserialized through that mapping. It is called on an RDMC thread with the subgroup locked, so it must not call
+ * back into Derecho.
+ */
+using receive_allocator_t = std::function<std::shared_ptr<rdma::memory_region>(node_id_t sender, long long unsigned int size)>;
 
 /**
  * Bundles together a set of callback functions for message delivery events.
@@ -49,6 +107,24 @@ struct CallbackSet {
     message_callback_t global_stability_callback;
     persistence_callback_t local_persistence_callback = nullptr;
     persistence_callback_t global_persistence_callback = nullptr;
+    /** If set, called instead of global_stability_callback with all the
+     * messages each delivery pass delivers, so that high-rate small
+     * messages pay for one upcall per pass. Subgroups in Mode::RAW, which
+     * deliver each message as it arrives, still use
+     * global_stability_callback. */
+    batch_callback_t global_stability_batch_callback = nullptr;
+};
+
+/**
+ * How peer-to-peer RPC calls are divided among the P2P handler threads.
+ * Calls with the same key are handled one at a time in the order they
+ * arrived in, and calls with different keys may run concurrently.
+ */
+enum class P2PHandlerAffinity {
+    /** Calls are keyed by the subgroup (replicated object) they are made on */
+    OBJECT,
+    /** Calls are keyed by the subgroup and the RPC function they call */
+    FUNCTION
 };
 
 struct DerechoParams : public mutils::ByteRepresentable {
@@ -59,6 +135,164 @@ struct DerechoParams : public mutils::ByteRepresentable {
     unsigned int timeout_ms = 1;
     rdmc::send_algorithm type = rdmc::BINOMIAL_SEND;
     uint32_t rpc_port = derecho_rpc_port;
+    /** The number of threads that send multicasts; the subgroups this node
+     * sends in are divided among them. */
+    unsigned int num_sender_threads = 1;
+    /** If true, peer-to-peer RPC messages are sent with RDMA writes instead
+     * of over TCP, when they fit in the RDMA message slots. */
+    bool p2p_over_rdma = false;
+    /** The largest message, including its header, that is sent by SST
+     * multicast rather than RDMC; at most the size of an SST slot. */
+    uint32_t sst_multicast_threshold = sst::max_msg_size;
+    /** If true, the choice between SST multicast and RDMC for messages that
+     * fit in an SST slot is calibrated from measured delivery latencies,
+     * and sst_multicast_threshold is ignored. */
+    bool adaptive_transport = false;
+    /** If true, SST multicasts are packed back to back into each subgroup's
+     * slots, with a length header each, instead of taking a whole slot per
+     * message, so that many more small messages can be in flight at once. */
+    bool packed_sst_multicast = false;
+    /** If true, block_size is only the largest RDMC block size, and each
+     * RDMC message's block size is chosen from the message's size. */
+    bool adaptive_block_size = false;
+    /** If nonzero, the least seq_num and stable_num in each shard are
+     * computed up a tree with this many children per node and passed back
+     * down, instead of every member writing them to and reading them from
+     * every other member. */
+    uint32_t aggregation_fanout = 0;
+    /** If nonzero, every member writes a heartbeat into the SST this often,
+     * in microseconds, and a member whose heartbeats stop is suspected by a
+     * phi-accrual detector rather than only when an RDMA write to it fails. */
+    unsigned int heartbeat_interval_us = 0;
+    /** The phi above which a member whose heartbeats are late is suspected */
+    double failure_phi_threshold = 8.0;
+    /** If true, a proposed view change at first wedges only the subgroups
+     * whose shard membership it changes, and the others keep sending and
+     * delivering in the current view until those have finished their
+     * ragged-edge cleanup. */
+    bool scoped_wedge = false;
+    /** If nonzero, and filename is set, the front of the message log is
+     * compacted away once this many bytes of it have been persisted by
+     * every member of their shards. */
+    uint64_t log_compaction_threshold = 0;
+    /** If true, a sender in an ordered subgroup that has nothing to send
+     * while other senders are ahead of it announces through the SST that it
+     * skips its turns up to theirs, so that their messages can be delivered
+     * without waiting for it to send null messages. */
+    bool skip_idle_senders = false;
+    /** If nonzero, peer-to-peer RPC calls to this node are handled by this
+     * many threads instead of by the thread that receives them, so that a
+     * slow handler doesn't hold up the calls behind it. */
+    unsigned int num_p2p_handler_threads = 0;
+    /** How P2P calls are divided among the handler threads, if there are any */
+    P2PHandlerAffinity p2p_handler_affinity = P2PHandlerAffinity::OBJECT;
+    /** If true, each subgroup's delivered messages are handed to the RPC
+     * handlers or the stability callback, and their versions made, by a
+     * thread of the subgroup's own in delivery order, so that the SST
+     * predicate thread only queues them and slow handlers don't hold up the
+     * predicates of other subgroups and of the membership protocol. */
+    bool offload_delivery = false;
+    /** If nonzero, this node serves its metrics as Prometheus text over HTTP
+     * on this port. */
+    uint16_t metrics_port = 0;
+    /** If true, this node's messages are stamped with the time they reach
+     * each stage from getting a buffer to being persisted by the whole shard,
+     * and the time between stages is recorded in the subgroups' metrics. */
+    bool track_message_stages = false;
+    /** How the SST's predicate threads wait when nothing is happening;
+     * BUSY_POLL has the lowest latency, but keeps a core busy at all times. */
+    sst::PollMode sst_poll_mode = sst::PollMode::SPIN_THEN_SLEEP;
+    /** If true, a sender's RDMC group in a subgroup is only created, by all
+     * of its members at once, when the sender first has a message for it,
+     * instead of every potential sender's group being created with the view. */
+    bool lazy_rdmc_groups = false;
+    /** With lazy_rdmc_groups, how long in milliseconds a sender's RDMC group
+     * can go unused before it is torn down again; 0 keeps it for the view. */
+    unsigned int rdmc_group_idle_timeout_ms = 10000;
+    /** If true, RawSubgroups send through a RawSendRing of preregistered
+     * buffers that their senders post straight to RDMC, instead of through
+     * the send queues of ordered mode. Not used with lazy_rdmc_groups. */
+    bool raw_send_rings = false;
+    /** If true, the thread that calls send() sends its message by RDMC
+     * itself when nothing stands in the way, instead of always waking the
+     * sender thread to do it. */
+    bool inline_sends = false;
+    /** How many of a sender's RDMC messages in a subgroup can be in flight
+     * at once. RDMC starts each one as soon as the sender has sent its part
+     * of the one before, so the next message's first blocks go out while the
+     * previous one's last blocks are still being relayed. */
+    unsigned int max_rdmc_sends_in_flight = 1;
+    /** If true, RDMC writes each block straight into a buffer of the largest
+     * message size that every receiver advertises, instead of sending it
+     * into a receive posted for it, which saves a ready-for-block handshake
+     * per block but costs each receiver that much memory per RDMC group and
+     * a copy of each message. */
+    bool rdmc_block_writes = false;
+    /** If not empty, the RDMA devices to use, as a comma-separated list of
+     * device names, each optionally followed by a colon and a port. RDMC
+     * stripes its blocks across all of them and stops using one that fails;
+     * the first also carries RDMC's control traffic. Every member must be
+     * given the same number of them. */
+    std::string rdma_rails = std::string();
+    /** The index in rdma_rails of the device the SST uses */
+    unsigned int sst_rail = 0;
+    /** The InfiniBand service levels of the SST's and RDMC's queue pairs. The
+     * SST carries heartbeats and the membership protocol, so giving it a
+     * higher-priority level than RDMC's bulk traffic, in a fabric set up to
+     * honor them, keeps its latency bounded under load. */
+    unsigned int sst_service_level = 0;
+    unsigned int rdmc_service_level = 0;
+    /** If nonzero, the rate in bytes per second that this node posts RDMC
+     * blocks at, so that large messages leave room on the link for the SST. */
+    uint64_t rdmc_pacing_rate = 0;
+    /** Whether SST rows are written to members on the same host through a
+     * shared memory mapping of their tables, with plain stores, instead of
+     * through the NIC's loopback. */
+    bool shared_memory_sst = false;
+    /** If true, the number of its own messages a node may have in flight in
+     * an ordered subgroup adapts to how far the shard's deliveries lag its
+     * receives, between min_window_size and window_size; buffers are still
+     * allocated for window_size. */
+    bool adaptive_window = false;
+    /** The smallest window that adaptive_window shrinks to */
+    unsigned int min_window_size = 1;
+    /** The service level of the RDMC queue pairs of the subgroups in
+     * SubgroupInfo::latency_critical_types, or -1 to use rdmc_service_level */
+    int critical_service_level = -1;
+    /** Whether the SST tables and the message buffers are locked into
+     * memory, which faults in all their pages before the first message */
+    bool lock_memory = false;
+    /** The rounds of full-row SST writes that the members exchange when the
+     * group starts and after each view change, before the view upcalls
+     * report it ready, so that the first messages don't pay for the NICs'
+     * first translations of the new tables */
+    unsigned int warm_up_rounds = 0;
+    /** If nonzero, the replies to ordered queries that a node sends to the
+     * same caller within this many microseconds are written to it together,
+     * as one P2P write, instead of one by one */
+    unsigned int reply_batch_window_us = 0;
+    /** If nonzero, the size, header included, of the RDMC buffers that are
+     * registered up front, one per window slot, instead of buffers of the
+     * largest message size; larger messages get a buffer of
+     * medium_message_buffer_size, or one of their own size that is
+     * registered when they are sent or received and released after */
+    long long unsigned int small_message_buffer_size = 0;
+    /** The size of the RDMC buffers, registered as they are first needed and
+     * then reused, for messages larger than small_message_buffer_size; 0 to
+     * give every such message a buffer of its own size */
+    long long unsigned int medium_message_buffer_size = 0;
+    /** If nonzero, a version of an ordered subgroup counts as persisted once
+     * this many members of the shard have delivered it and logged it in
+     * their memory, rather than once every member has flushed it to disk;
+     * the local flushes still happen, but in the background. Not used with
+     * filename, whose log has to reach the disk before messages are sent on. */
+    uint32_t remote_persistence_replicas = 0;
+    /** If nonzero, the leader of each shard of an ordered subgroup holds a
+     * read lease from the other members, renewed through the SST, that lets
+     * it serve linearizable reads locally; a member that granted the lease
+     * waits this long, in microseconds, after its last grant before it takes
+     * part in a view that the leader isn't in */
+    unsigned int read_lease_duration_us = 0;
 
     DerechoParams(long long unsigned int max_payload_size,
                   long long unsigned int block_size,
@@ -66,17 +300,120 @@ struct DerechoParams : public mutils::ByteRepresentable {
                   unsigned int window_size = 3,
                   unsigned int timeout_ms = 1,
                   rdmc::send_algorithm type = rdmc::BINOMIAL_SEND,
-                  uint32_t rpc_port = derecho_rpc_port)
+                  uint32_t rpc_port = derecho_rpc_port,
+                  unsigned int num_sender_threads = 1,
+                  bool p2p_over_rdma = false,
+                  uint32_t sst_multicast_threshold = sst::max_msg_size,
+                  bool adaptive_transport = false,
+                  bool packed_sst_multicast = false,
+                  bool adaptive_block_size = false,
+                  uint32_t aggregation_fanout = 0,
+                  unsigned int heartbeat_interval_us = 0,
+                  double failure_phi_threshold = 8.0,
+                  bool scoped_wedge = false,
+                  uint64_t log_compaction_threshold = 0,
+                  bool skip_idle_senders = false,
+                  unsigned int num_p2p_handler_threads = 0,
+                  P2PHandlerAffinity p2p_handler_affinity = P2PHandlerAffinity::OBJECT,
+                  bool offload_delivery = false,
+                  uint16_t metrics_port = 0,
+                  bool track_message_stages = false,
+                  sst::PollMode sst_poll_mode = sst::PollMode::SPIN_THEN_SLEEP,
+                  bool lazy_rdmc_groups = false,
+                  unsigned int rdmc_group_idle_timeout_ms = 10000,
+                  bool raw_send_rings = false,
+                  bool inline_sends = false,
+                  unsigned int max_rdmc_sends_in_flight = 1,
+                  bool rdmc_block_writes = false,
+                  std::string rdma_rails = std::string(),
+                  unsigned int sst_rail = 0,
+                  unsigned int sst_service_level = 0,
+                  unsigned int rdmc_service_level = 0,
+                  uint64_t rdmc_pacing_rate = 0,
+                  bool shared_memory_sst = false,
+                  bool adaptive_window = false,
+                  unsigned int min_window_size = 1,
+                  int critical_service_level = -1,
+                  bool lock_memory = false,
+                  unsigned int warm_up_rounds = 0,
+                  unsigned int reply_batch_window_us = 0,
+                  long long unsigned int small_message_buffer_size = 0,
+                  long long unsigned int medium_message_buffer_size = 0,
+                  uint32_t remote_persistence_replicas = 0,
+                  unsigned int read_lease_duration_us = 0)
             : max_payload_size(max_payload_size),
               block_size(block_size),
               filename(filename),
               window_size(window_size),
               timeout_ms(timeout_ms),
               type(type),
-              rpc_port(rpc_port) {
+              rpc_port(rpc_port),
+              num_sender_threads(num_sender_threads),
+              p2p_over_rdma(p2p_over_rdma),
+              sst_multicast_threshold(sst_multicast_threshold),
+              adaptive_transport(adaptive_transport),
+              packed_sst_multicast(packed_sst_multicast),
+              adaptive_block_size(adaptive_block_size),
+              aggregation_fanout(aggregation_fanout),
+              heartbeat_interval_us(heartbeat_interval_us),
+              failure_phi_threshold(failure_phi_threshold),
+              scoped_wedge(scoped_wedge),
+              log_compaction_threshold(log_compaction_threshold),
+              skip_idle_senders(skip_idle_senders),
+              num_p2p_handler_threads(num_p2p_handler_threads),
+              p2p_handler_affinity(p2p_handler_affinity),
+              offload_delivery(offload_delivery),
+              metrics_port(metrics_port),
+              track_message_stages(track_message_stages),
+              sst_poll_mode(sst_poll_mode),
+              lazy_rdmc_groups(lazy_rdmc_groups),
+              rdmc_group_idle_timeout_ms(rdmc_group_idle_timeout_ms),
+              raw_send_rings(raw_send_rings),
+              inline_sends(inline_sends),
+              max_rdmc_sends_in_flight(max_rdmc_sends_in_flight),
+              rdmc_block_writes(rdmc_block_writes),
+              rdma_rails(rdma_rails),
+              sst_rail(sst_rail),
+              sst_service_level(sst_service_level),
+              rdmc_service_level(rdmc_service_level),
+              rdmc_pacing_rate(rdmc_pacing_rate),
+              shared_memory_sst(shared_memory_sst),
+              adaptive_window(adaptive_window),
+              min_window_size(min_window_size),
+              critical_service_level(critical_service_level),
+              lock_memory(lock_memory),
+              warm_up_rounds(warm_up_rounds),
+              reply_batch_window_us(reply_batch_window_us),
+              small_message_buffer_size(small_message_buffer_size),
+              medium_message_buffer_size(medium_message_buffer_size),
+              remote_persistence_replicas(remote_persistence_replicas),
+              read_lease_duration_us(read_lease_duration_us) {
     }
 
-    DEFAULT_SERIALIZATION_SUPPORT(DerechoParams, max_payload_size, block_size, filename, window_size, timeout_ms, type, rpc_port);
+    DEFAULT_SERIALIZATION_SUPPORT(DerechoParams, max_payload_size, block_size, filename, window_size, timeout_ms, type, rpc_port, num_sender_threads, p2p_over_rdma,
+                                  sst_multicast_threshold, adaptive_transport, packed_sst_multicast, adaptive_block_size,
+                                  aggregation_fanout, heartbeat_interval_us, failure_phi_threshold, scoped_wedge,
+                                  log_compaction_threshold, skip_idle_senders, num_p2p_handler_threads,
+                                  p2p_handler_affinity, offload_delivery, metrics_port,
+                                  track_message_stages, sst_poll_mode, lazy_rdmc_groups,
+                                  rdmc_group_idle_timeout_ms, raw_send_rings, inline_sends,
+                                  max_rdmc_sends_in_flight, rdmc_block_writes, rdma_rails, sst_rail,
+                                  sst_service_level, rdmc_service_level, rdmc_pacing_rate,
+                                  shared_memory_sst, adaptive_window, min_window_size,
+                                  critical_service_level, lock_memory, warm_up_rounds,
+                                  reply_batch_window_us, small_message_buffer_size,
+                                  medium_message_buffer_size, remote_persistence_replicas,
+                                  read_lease_duration_us);
+};
+
+/** Where a message falls in an object that ViewManager::send_stream sent in
+ * pieces, because it was larger than the largest message */
+enum class Fragment : uint8_t {
+    /** The message is not a piece of a larger object */
+    WHOLE,
+    FIRST,
+    MIDDLE,
+    LAST
 };
 
 struct __attribute__((__packed__)) header {
@@ -85,6 +422,10 @@ struct __attribute__((__packed__)) header {
     uint32_t index;
     uint64_t timestamp;
     bool cooked_send;
+    /** The view the message was sent in, so that a receiver can discard one
+     * that arrives late through an RDMC group kept from an earlier view */
+    int32_t vid;
+    Fragment fragment;
 };
 
 /**
@@ -94,22 +435,171 @@ struct __attribute__((__packed__)) header {
  * This is a move-only type, since memory regions can't be copied.
  */
 struct MessageBuffer {
-    std::unique_ptr<char[]> buffer;
+    /** Owns the buffer as well as its registration; the memory may be a
+     * piece of rdma's memory arena. */
     std::shared_ptr<rdma::memory_region> mr;
+    /** True if the memory belongs to the application (see
+     * MulticastGroup::send_user_buffer) or to a RawSendRing, so the buffer
+     * must not be reused. */
+    bool user_owned = false;
 
     MessageBuffer() {}
     MessageBuffer(size_t size) {
         if(size != 0) {
-            buffer = std::unique_ptr<char[]>(new char[size]);
-            mr = std::make_shared<rdma::memory_region>(buffer.get(), size);
+            mr = rdma::memory_region::allocate(size);
         }
     }
+    explicit MessageBuffer(std::shared_ptr<rdma::memory_region> user_mr)
+            : mr(std::move(user_mr)), user_owned(true) {}
+    char* buffer() const { return mr->buffer; }
     MessageBuffer(const MessageBuffer&) = delete;
     MessageBuffer(MessageBuffer&&) = default;
     MessageBuffer& operator=(const MessageBuffer&) = delete;
     MessageBuffer& operator=(MessageBuffer&&) = default;
 };
 
+/**
+ * The free RDMC buffers of one subgroup, in up to three size classes so that
+ * registered memory follows the sizes of the messages actually sent rather
+ * than window slots times the largest message size. Small buffers are
+ * registered up front, medium ones as they are first needed and then kept,
+ * and large ones, for messages bigger than both, are registered for each
+ * message at its own size and released when it has been delivered. Taking
+ * a buffer also takes one of the pool's slots, which are what bound the
+ * messages a subgroup can have in flight; returning it gives the slot back.
+ * With only a small class of the largest message size, this is the single
+ * list of equal buffers it replaces.
+ */
+class MessageBufferPool {
+    long long unsigned int small_size = 0;
+    long long unsigned int medium_size = 0;
+    long long unsigned int block_size = 1;
+    std::size_t free_slots = 0;
+    /** The slots the pool was last filled to, which also bounds the
+     * medium buffers it keeps */
+    std::size_t target_slots = 0;
+    std::vector<MessageBuffer> small_buffers;
+    std::vector<MessageBuffer> medium_buffers;
+
+public:
+    MessageBufferPool() {}
+    /**
+     * @param max_msg_size The largest message size, header included
+     * @param small_size The small buffers' size, or 0 for max_msg_size
+     * @param medium_size The medium buffers' size, or 0 for no medium class
+     * @param block_size Large buffers are rounded up to whole RDMC blocks
+     */
+    MessageBufferPool(long long unsigned int max_msg_size, long long unsigned int small_size,
+                      long long unsigned int medium_size, long long unsigned int block_size)
+            : small_size(small_size && small_size < max_msg_size ? small_size : max_msg_size),
+              medium_size(medium_size > this->small_size ? std::min(medium_size, max_msg_size) : 0),
+              block_size(block_size ? block_size : 1) {}
+
+    /** Adds slots, and small buffers for them, until there are at least num_slots free */
+    void fill(std::size_t num_slots) {
+        target_slots = num_slots;
+        while(small_buffers.size() < num_slots) {
+            small_buffers.emplace_back(small_size);
+        }
+        free_slots = std::max(free_slots, num_slots);
+    }
+
+    /** @return False for a default-constructed pool, which has no sizes yet */
+    bool configured() const { return small_size != 0; }
+
+    bool empty() const { return free_slots == 0; }
+
+    /** @return A buffer of at least size bytes, or one without a memory
+     * region if no slot is free */
+    MessageBuffer take(long long unsigned int size) {
+        if(free_slots == 0) {
+            return MessageBuffer();
+        }
+        --free_slots;
+        MessageBuffer buffer;
+        if(size <= small_size && !small_buffers.empty()) {
+            buffer = std::move(small_buffers.back());
+            small_buffers.pop_back();
+        } else if(size <= medium_size) {
+            if(medium_buffers.empty()) {
+                return MessageBuffer(medium_size);
+            }
+            buffer = std::move(medium_buffers.back());
+            medium_buffers.pop_back();
+        } else {
+            return MessageBuffer((size + block_size - 1) / block_size * block_size);
+        }
+        return buffer;
+    }
+
+    /** Returns a buffer that take() handed out, and its slot */
+    void give_back(MessageBuffer&& buffer) {
+        ++free_slots;
+        if(!buffer.mr) {
+            return;
+        }
+        if(buffer.mr->size == small_size) {
+            small_buffers.push_back(std::move(buffer));
+        } else if(buffer.mr->size == medium_size && medium_buffers.size() < target_slots) {
+            medium_buffers.push_back(std::move(buffer));
+        }
+        // Anything else was a large buffer, which is released here
+    }
+};
+
+/** The receive allocators the application has set, by subgroup ID, shared by
+ * the MulticastGroups of successive views so that they survive view changes */
+struct ReceiveAllocators {
+    std::mutex mutex;
+    std::map<subgroup_id_t, receive_allocator_t> allocators;
+};
+
+/** The objects being put back together from the fragments of streams, by
+ * subgroup ID and sender, shared by the MulticastGroups of successive views,
+ * since a sender's undelivered fragments are sent again in the next view */
+struct StreamAssemblies {
+    std::mutex mutex;
+    std::map<std::pair<subgroup_id_t, node_id_t>, std::vector<char>> assemblies;
+
+    /**
+     * Appends a delivered fragment to its sender's object in the subgroup.
+     * @param object Set to the whole object when the last fragment arrives
+     * @return True if the fragment was the last one of an object. A stream
+     * whose first fragment was delivered before this node joined is never
+     * complete here, so its fragments are dropped.
+     */
+    bool add(subgroup_id_t subgroup_num, node_id_t sender, Fragment fragment,
+             const char* data, std::size_t size, std::vector<char>& object) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto assembly = assemblies.find({subgroup_num, sender});
+        if(fragment == Fragment::FIRST) {
+            assembly = assemblies.emplace(std::make_pair(subgroup_num, sender), std::vector<char>()).first;
+            assembly->second.clear();
+        } else if(assembly == assemblies.end()) {
+            return false;
+        }
+        assembly->second.insert(assembly->second.end(), data, data + size);
+        if(fragment != Fragment::LAST) {
+            return false;
+        }
+        object = std::move(assembly->second);
+        assemblies.erase(assembly);
+        return true;
+    }
+
+    /** Drops the unfinished objects of senders that are no longer members */
+    void drop_senders_not_in(const std::vector<node_id_t>& members) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto assembly = assemblies.begin(); assembly != assemblies.end();) {
+            if(std::find(members.begin(), members.end(), assembly->first.second) == members.end()) {
+                assembly = assemblies.erase(assembly);
+            } else {
+                ++assembly;
+            }
+        }
+    }
+};
+
 struct RDMCMessage {
     /** The unique node ID of the message's sender. */
     uint32_t sender_id;
@@ -122,6 +612,34 @@ struct RDMCMessage {
     MessageBuffer message_buffer;
 };
 
+/** The messages that one pass of a subgroup's delivery predicate delivered,
+ * waiting to be handed to the application together when the pass ends */
+struct DeliveryBatch {
+    struct Delivery {
+        bool cooked_send;
+        /** True if the payload is in payloads rather than a message buffer */
+        bool owned;
+        uint64_t stable_time;
+        MessageStageTracker* stage_tracker;
+        /** Null unless the message is this node's */
+        SendFrontiers* send_frontiers;
+        /** The versions, as sequence numbers and times in microseconds, to
+         * make once the message has been delivered */
+        std::vector<std::pair<long long int, uint64_t>> versions;
+    };
+    std::vector<DeliveredMessage> messages;
+    /** Indexed like messages */
+    std::vector<Delivery> deliveries;
+    /** Payloads that are not in message buffers, such as streamed objects */
+    std::list<std::vector<char>> payloads;
+
+    void clear() {
+        messages.clear();
+        deliveries.clear();
+        payloads.clear();
+    }
+};
+
 struct SSTMessage {
     /** The unique node ID of the message's sender. */
     uint32_t sender_id;
@@ -133,6 +651,121 @@ struct SSTMessage {
     volatile char* buf;
 };
 
+/**
+ * The fast path for sending in a raw subgroup (see DerechoParams::raw_send_rings):
+ * a ring of window_size message buffers, registered once when the view is
+ * installed, that the application fills in place. claim() hands out the next
+ * buffer and publish() passes it to the subgroup's sender thread, which posts
+ * it straight to RDMC. Neither takes a lock, looks anything up in a map or
+ * allocates; they are atomic operations on the ring and reads of the SST, so
+ * only one application thread may use a ring at a time. A buffer is reused
+ * once every shard member has received the message in it, which is the send
+ * window of raw mode. A ring belongs to one view: it is closed when the view
+ * is wedged, and the messages it had not finished sending move on to the next
+ * view's ring.
+ */
+class RawSendRing {
+public:
+    struct Slot {
+        std::shared_ptr<rdma::memory_region> mr;
+        /** The size of the message in the slot, including its header */
+        long long unsigned int size = 0;
+        /** The last index the message in the slot takes up, counting the
+         * turns it skips, or -1 if the slot hasn't been used */
+        long long int last_index = -1;
+    };
+
+private:
+    std::vector<Slot> slots;
+    const long long unsigned int max_msg_size;
+    const int32_t vid;
+    const std::shared_ptr<DerechoSST> sst;
+    const uint32_t num_received_column;
+    const std::vector<uint32_t> shard_sst_indices;
+    metrics::Counter& messages_sent;
+    /** Wakes the sender thread, if it may be waiting; only called while the
+     * ring is open, since it calls into the MulticastGroup */
+    const std::function<void()> wake_sender;
+
+    /** The rest is only used by the application's thread */
+    long long int next_index;
+    /** A lower bound on the smallest num_received for this node's messages
+     * in the shard, which only has to be recomputed when it is too low to
+     * reuse the next slot */
+    long long int min_received = -1;
+    bool slot_claimed = false;
+
+    std::atomic<uint64_t> num_published{0};
+    /** Only changed by the sender thread */
+    std::atomic<uint64_t> num_posted{0};
+    /** Only changed by the RDMC completion upcall */
+    std::atomic<uint64_t> num_completed{0};
+    std::atomic<bool> closed{false};
+    /** The number of publish() calls that found the ring open and haven't
+     * returned yet */
+    std::atomic<uint32_t> active_publishers{0};
+
+    Slot& slot(uint64_t position) { return slots[position % slots.size()]; }
+    const Slot& slot(uint64_t position) const { return slots[position % slots.size()]; }
+
+public:
+    /** The RDMC group this node sends the ring's messages in */
+    const uint32_t rdmc_group_number;
+
+    RawSendRing(unsigned int num_slots, long long unsigned int max_msg_size, int32_t vid,
+                std::shared_ptr<DerechoSST> sst, uint32_t num_received_column,
+                std::vector<uint32_t> shard_sst_indices, long long int first_index,
+                uint32_t rdmc_group_number, metrics::Counter& messages_sent,
+                std::function<void()> wake_sender);
+
+    /**
+     * Hands out the buffer of the next slot, with the message header filled
+     * in. Claiming again before publishing hands out the same slot again.
+     * @return A pointer to the payload in the buffer, or nullptr if the ring
+     * is closed, the message is too large, or the next slot's last message
+     * hasn't been received everywhere yet.
+     */
+    char* claim(long long unsigned int payload_size, int pause_sending_turns, bool null_send);
+    /**
+     * Passes the claimed slot to the sender thread.
+     * @return False if nothing was claimed or the ring was closed before the
+     * message could be published, in which case it won't be sent.
+     */
+    bool publish();
+    /** @return The payload size of the message in the claimed slot */
+    long long unsigned int claimed_payload_size() const;
+    bool is_closed() const { return closed; }
+    long long unsigned int get_max_msg_size() const { return max_msg_size; }
+    /** Closes the ring, once any publish() that found it open has returned */
+    void close();
+
+    /** Called by the sender thread: true if there is a message to post */
+    bool has_unposted() const { return num_posted.load(std::memory_order_relaxed) < num_published; }
+    const Slot& next_unposted() const { return slot(num_posted.load(std::memory_order_relaxed)); }
+    void mark_posted() { num_posted.fetch_add(1, std::memory_order_release); }
+
+    /** Called by the RDMC completion upcall, under the subgroup's lock; RDMC
+     * finishes the messages in the order they were posted */
+    const Slot& oldest_in_flight() const { return slot(num_completed.load(std::memory_order_relaxed)); }
+    void mark_completed() { num_completed.fetch_add(1, std::memory_order_release); }
+
+    /**
+     * Gets the send timestamp of the oldest message whose sending hasn't
+     * finished, if there is one, for the local stability frontier.
+     */
+    bool oldest_pending_timestamp(uint64_t& timestamp) const;
+
+    /**
+     * Copies the messages a closed ring of the previous view had published
+     * but not finished sending into this ring, in order, and publishes them.
+     * Must be called before this ring is handed out.
+     */
+    void take_over(const RawSendRing& old_ring);
+    /** Calls f(message, size), oldest first, on each message, header and
+     * all, that was published but hasn't finished sending */
+    void for_each_unfinished(const std::function<void(const char*, long long unsigned int)>& f) const;
+};
+
 /** Implements the low-level mechanics of tracking multicasts in a Derecho group,
  * using RDMC to deliver messages and SST to track their arrival and stability.
  * This class should only be used as part of a Group, since it does not know how
@@ -158,7 +791,48 @@ public:  //consts can be public, right?
     /** Send algorithm for constructing a multicast from point-to-point unicast.
      *  Binomial pipeline by default. */
     const rdmc::send_algorithm type;
+    /** The most messages of its own a node may have in flight in a
+     * subgroup, which buffers and SST slots are allocated for */
     const unsigned int window_size;
+    /** The smallest window of an adaptive window */
+    const unsigned int min_window_size;
+    /** True if the window of each ordered subgroup adapts to its delivery lag */
+    const bool adaptive_window;
+    /** The largest number of sender threads to start */
+    const unsigned int num_sender_threads;
+    /** The largest message sent by SST multicast, unless adaptive_transport is set */
+    const uint32_t sst_multicast_threshold;
+    /** True if each subgroup's choice of transport adapts to measured latencies */
+    const bool adaptive_transport;
+    /** True if SST multicasts are packed into each subgroup's slots as a byte ring */
+    const bool packed_sst_multicast;
+    /** True if RDMC chooses each message's block size, up to block_size */
+    const bool adaptive_block_size;
+    /** The fanout of each shard's aggregation tree, or 0 for all-to-all */
+    const uint32_t aggregation_fanout;
+    /** True if idle senders in ordered subgroups skip their turns through the SST */
+    const bool skip_idle_senders;
+    /** True if delivery upcalls run on the subgroups' delivery executors */
+    const bool offload_delivery;
+    /** True if the stages of this node's messages are tracked */
+    const bool track_message_stages;
+    /** True if RDMC groups are only created once their senders need them */
+    const bool lazy_rdmc_groups;
+    /** How long a lazily created RDMC group can be idle, in ms; 0 for ever */
+    const unsigned int rdmc_group_idle_timeout_ms;
+    const bool raw_send_rings;
+    const bool inline_sends;
+    const unsigned int max_rdmc_sends_in_flight;
+    const bool rdmc_block_writes;
+    /** The sizes of the small and medium RDMC buffers (see MessageBufferPool) */
+    const long long unsigned int small_message_buffer_size;
+    const long long unsigned int medium_message_buffer_size;
+    /** How many members of a shard must have logged a version in memory for
+     * it to count as persisted, or 0 if every member must have flushed it */
+    const uint32_t remote_persistence_replicas;
+    /** How long a read lease grant lasts, in microseconds; 0 if shard
+     * leaders don't hold read leases */
+    const unsigned int read_lease_duration_us;
 
 private:
     /** Message-delivery event callbacks, supplied by the client, for "raw" sends */
@@ -166,29 +840,88 @@ private:
     uint32_t total_num_subgroups;
     /** Maps subgroup IDs (for subgroups this node is a member of) to the pair
      * (this node's shard number, this node's shard rank)*/
-    const std::map<subgroup_id_t, std::pair<uint32_t, uint32_t>> subgroup_to_shard_and_rank;
-    const std::map<subgroup_id_t, std::pair<std::vector<int>, int>> subgroup_to_senders_and_sender_rank;
+    const SubgroupMap<std::pair<uint32_t, uint32_t>> subgroup_to_shard_and_rank;
+    const SubgroupMap<std::pair<std::vector<int>, int>> subgroup_to_senders_and_sender_rank;
     /** Maps subgroup IDs (for subgroups this node is a member of) to the offset
      * of this node's num_received counter within that subgroup's SST section */
-    const std::map<subgroup_id_t, uint32_t> subgroup_to_num_received_offset;
-    /** Used for synchronizing receives by RDMC and SST */
-    std::vector<std::list<long long int>> received_intervals;
+    const SubgroupMap<uint32_t> subgroup_to_num_received_offset;
+    /** Used for synchronizing receives by RDMC and SST, indexed like num_received */
+    std::vector<ReceivedWindow> received_windows;
     /** Maps subgroup IDs (for subgroups this node is a member of) to the members
      * of this node's shard of that subgroup */
-    const std::map<subgroup_id_t, std::vector<node_id_t>> subgroup_to_membership;
+    const SubgroupMap<std::vector<node_id_t>> subgroup_to_membership;
     /** Maps subgroup IDs to operation mode */
-    const std::map<subgroup_id_t, Mode> subgroup_to_mode;
-    std::map<subgroup_id_t, uint32_t> subgroup_to_rdmc_group;
+    const SubgroupMap<Mode> subgroup_to_mode;
+    /** The subgroups of the SubgroupInfo's latency-critical types */
+    const std::set<subgroup_id_t> latency_critical_subgroups;
+    /** The service level of their RDMC groups, or -1 for the default */
+    const int critical_service_level;
+    /** @return The service level to create the subgroup's RDMC groups with,
+     * or -1 for the one RDMC was set up with */
+    int rdmc_service_level_of(subgroup_id_t subgroup_num) const {
+        return latency_critical_subgroups.count(subgroup_num) ? critical_service_level : -1;
+    }
+    SubgroupMap<uint32_t> subgroup_to_rdmc_group;
+    /** Identifies an RDMC group by its subgroup and its members in rank
+     * order, which start with the sender */
+    using rdmc_group_key_t = std::pair<subgroup_id_t, std::vector<node_id_t>>;
+    /** The numbers of the RDMC groups this node belongs to. A group whose
+     * members are the same in the next view is handed to that view's
+     * MulticastGroup instead of being destroyed and re-created. */
+    std::map<rdmc_group_key_t, uint16_t> rdmc_groups;
     /** These two callbacks are internal, not exposed to clients, so they're not in CallbackSet */
     rpc_handler_t rpc_callback;
+    rpc_batch_handler_t rpc_batch_callback;
 
     /** Offset to add to member ranks to form RDMC group numbers. */
     uint16_t rdmc_group_num_offset;
     /** false if RDMC groups haven't been created successfully */
     bool rdmc_sst_groups_created = false;
-    /** Stores message buffers not currently in use. Protected by
-     * msg_state_mtx */
-    std::map<uint32_t, std::vector<MessageBuffer>> free_message_buffers;
+
+    /**
+     * With lazy_rdmc_groups, an RDMC group that is only created once its
+     * sender has a message for it, and destroyed again once it has been idle
+     * for long enough. Its number is reserved when the view starts, as if it
+     * had been created then, so that every member agrees on it.
+     */
+    struct LazyRDMCGroup {
+        subgroup_id_t subgroup_num;
+        uint32_t shard_rank;
+        uint32_t sender_rank;
+        std::vector<node_id_t> rotated_members;
+        uint16_t group_number;
+        /** The SST rows of the group's members */
+        std::vector<uint32_t> member_rows;
+        /** Whether the group exists at this node; only used by the RDMC group thread */
+        bool created = false;
+        // The rest is only used at the group's sender
+        /** Set by the sender thread when it has a message for the group but
+         * the group isn't ready */
+        std::atomic<bool> requested{false};
+        /** Set once the group exists at every member */
+        std::atomic<bool> ready{false};
+        /** The index of the last message sent in the group and the time it
+         * was sent; protected by the subgroup's lock */
+        long long int last_send_index = -1;
+        uint64_t last_send_time = 0;
+    };
+    /** The lazily created groups of the subgroups this node is a member of,
+     * keyed by the num_received column of their senders, which orders them
+     * the same way at every member */
+    std::map<uint32_t, LazyRDMCGroup> lazy_groups;
+    /** Protects rdmc_rounds_stopped, so that the leader can't start a round
+     * of group changes once wedge() has returned */
+    std::mutex rdmc_round_mutex;
+    bool rdmc_rounds_stopped = false;
+    /** Stops the RDMC group thread, which keeps running after the group is
+     * wedged so that it finishes any round the leader has already started */
+    std::atomic<bool> rdmc_group_thread_shutdown{false};
+    /** Creates and destroys the lazy RDMC groups, if there are any */
+    std::thread rdmc_group_thread;
+    /** Stores message buffers not currently in use, indexed by subgroup ID.
+     * Each subgroup's small buffers are allocated and registered up front,
+     * so taking and returning one never allocates. */
+    std::vector<MessageBufferPool> free_message_buffers;
 
     /** Index to be used the next time get_sendbuffer_ptr is called.
      * When next_message is not none, then next_message.index = future_message_index-1 */
@@ -199,37 +932,115 @@ private:
     std::vector<std::experimental::optional<RDMCMessage>> next_sends;
     /** Messages that are ready to be sent, but must wait until the current send finishes. */
     std::vector<std::queue<RDMCMessage>> pending_sends;
-    /** Vector of messages that are currently being sent out using RDMC, or boost::none otherwise. */
-    /** one per subgroup */
-    std::vector<std::experimental::optional<RDMCMessage>> current_sends;
-
-    /** Messages that are currently being received. */
-    std::map<std::pair<uint32_t, long long int>, RDMCMessage> current_receives;
-
-    /** Messages that have finished sending/receiving but aren't yet globally stable */
-    std::map<uint32_t, std::map<long long int, RDMCMessage>> locally_stable_rdmc_messages;
-    /** Parallel map for SST messages */
-    std::map<uint32_t, std::map<long long int, SSTMessage>> locally_stable_sst_messages;
-    std::map<uint32_t, std::set<uint64_t>> pending_message_timestamps;
-    std::map<uint32_t, std::map<int64_t, uint64_t>> pending_persistence;
+    /** The messages that have been handed to RDMC but haven't finished
+     * sending, in sending order; at most max_rdmc_sends_in_flight of them
+     * per subgroup */
+    std::vector<std::deque<RDMCMessage>> current_sends;
+
+    /** Messages that are currently being received, indexed by subgroup ID and
+     * then by sender rank. RDMC receives at most one message at a time from
+     * each sender, so one slot per sender is enough. */
+    std::vector<std::vector<std::experimental::optional<RDMCMessage>>> current_receives;
+
+    /** Messages that have finished sending/receiving but aren't yet globally
+     * stable, indexed by subgroup ID and then by sequence number */
+    std::vector<MessageWindow<RDMCMessage>> locally_stable_rdmc_messages;
+    /** Parallel window for SST messages */
+    std::vector<MessageWindow<SSTMessage>> locally_stable_sst_messages;
+    /** The send timestamps of this node's messages that aren't yet stable
+     * (in raw mode) or persisted, indexed by subgroup ID */
+    std::vector<PendingTimestamps> pending_message_timestamps;
+    std::vector<std::map<int64_t, uint64_t>> pending_persistence;
     /** Messages that are currently being written to persistent storage */
-    std::map<uint32_t, std::map<long long int, RDMCMessage>> non_persistent_messages;
+    std::vector<MessageWindow<RDMCMessage>> non_persistent_messages;
     /** Messages that are currently being written to persistent storage */
-    std::map<uint32_t, std::map<long long int, SSTMessage>> non_persistent_sst_messages;
+    std::vector<std::map<long long int, SSTMessage>> non_persistent_sst_messages;
 
     std::vector<long long int> next_message_to_deliver;
-    std::mutex msg_state_mtx;
+
+    /** Everything send_loop needs to decide whether this node may send its
+     * next message in a subgroup, computed once per view so that the check
+     * does no map lookups and copies no vectors. */
+    struct SubgroupSendState {
+        /** True if this node is a sender in the subgroup */
+        bool is_sender = false;
+        bool raw_mode = false;
+        bool fifo_mode = false;
+        uint32_t num_shard_senders = 0;
+        int shard_sender_index = -1;
+        /** The num_received column that counts this node's messages in the subgroup */
+        uint32_t num_received_column = 0;
+        /** The SST rows of the members of this node's shard */
+        std::vector<uint32_t> shard_sst_indices;
+        /** A lower bound on the smallest delivered_num (and persisted_num, if
+         * persistence is on) in the shard, or on the smallest num_received for
+         * this node's messages in raw mode, or on the smallest
+         * fifo_delivered_num for them in FIFO mode. Those counters only grow,
+         * so the bound only has to be recomputed when it is too low to allow
+         * a send. */
+        long long int min_frontier = std::numeric_limits<long long int>::min();
+    };
+    /** Indexed by subgroup ID. */
+    std::vector<SubgroupSendState> subgroup_send_states;
+    /** The subgroups each sender thread is responsible for, indexed by the
+     * thread's position in sender_threads */
+    std::vector<std::vector<subgroup_id_t>> sender_thread_subgroups;
+
+    /** One lock per subgroup, indexed by subgroup ID. Each one protects that
+     * subgroup's entries in all of the per-subgroup vectors above, so that
+     * sending, receiving and delivery in different subgroups never contend.
+     * No thread holds more than one of these at a time, except a new
+     * MulticastGroup taking over the state of a wedged one. */
+    std::vector<std::mutex> subgroup_mutexes;
+
+    /** Protects sender_epoch; sender_cv waits on it. */
+    std::mutex sender_mtx;
+    /** Notified when some subgroup may have a message ready to send. */
     std::condition_variable sender_cv;
+    /** Incremented every time sender_cv is notified, so that a sender thread
+     * can tell whether it missed a notification. Protected by sender_mtx */
+    uint64_t sender_epoch = 0;
+    /** The number of sender threads that may be about to wait on sender_cv,
+     * so that publishing into a RawSendRing only has to notify them when it
+     * is nonzero */
+    std::atomic<uint32_t> idle_sender_threads{0};
+
+    /** Protects send_window_epoch; sendbuffer_cv waits on it. */
+    std::mutex sendbuffer_mtx;
+    /** Notified when a slot in some subgroup's send window may have become
+     * free, to wake up threads blocked in wait_for_sendbuffer_ptr. */
+    std::condition_variable sendbuffer_cv;
+    /** Incremented every time sendbuffer_cv is notified, so that a waiter
+     * can tell whether it missed a notification. Protected by sendbuffer_mtx */
+    uint64_t send_window_epoch = 0;
+    /** Number of threads currently blocked in wait_for_sendbuffer_ptr. The
+     * predicate thread skips notifying sendbuffer_cv when this is 0. */
+    std::atomic<uint32_t> num_sendbuffer_waiters{0};
 
     /** The time, in milliseconds, that a sender can wait to send a message before it is considered failed. */
     unsigned int sender_timeout;
 
     /** Indicates that the group is being destroyed. */
     std::atomic<bool> thread_shutdown{false};
-    /** The background thread that sends messages with RDMC. */
-    std::thread sender_thread;
+    /** Indexed by subgroup ID; set for the subgroups that wedge_subgroups has
+     * stopped ahead of the rest of the group. */
+    std::vector<std::atomic<bool>> subgroup_wedged;
+    /** The background threads that send messages with RDMC. Each subgroup
+     * is sent in by exactly one of them, so a subgroup that is waiting for
+     * its window to open does not hold up sends in the others. */
+    std::vector<std::thread> sender_threads;
 
-    std::thread timeout_thread;
+    /** Runs check_failures every sender_timeout on the shared timer wheel */
+    sst::timer_wheel::timer_id failure_check_timer = 0;
+
+    /** How often this node writes its heartbeat, in microseconds; 0 if it doesn't */
+    unsigned int heartbeat_interval_us;
+    double failure_phi_threshold;
+    /** Stops the heartbeat thread, which keeps running after the group is
+     * wedged so that the other members don't suspect this one during the
+     * view change. */
+    std::atomic<bool> heartbeat_shutdown{false};
+    std::thread heartbeat_thread;
 
     /** The SST, shared between this group and its GMS. */
     std::shared_ptr<DerechoSST> sst;
@@ -238,36 +1049,213 @@ private:
     std::vector<std::unique_ptr<sst::multicast_group<DerechoSST>>> sst_multicast_group_ptrs;
 
     using pred_handle = typename sst::Predicates<DerechoSST>::pred_handle;
-    std::list<pred_handle> receiver_pred_handles;
-    std::list<pred_handle> stability_pred_handles;
-    std::list<pred_handle> delivery_pred_handles;
-    std::list<pred_handle> persistence_pred_handles;
-    std::list<pred_handle> sender_pred_handles;
+    /** The predicates of each subgroup, by subgroup ID, so that one subgroup
+     * can be wedged without the others */
+    std::map<subgroup_id_t, std::list<pred_handle>> receiver_pred_handles;
+    std::map<subgroup_id_t, std::list<pred_handle>> stability_pred_handles;
+    std::map<subgroup_id_t, std::list<pred_handle>> delivery_pred_handles;
+    std::map<subgroup_id_t, std::list<pred_handle>> persistence_pred_handles;
+    std::map<subgroup_id_t, std::list<pred_handle>> sender_pred_handles;
+    std::map<subgroup_id_t, std::list<pred_handle>> read_lease_pred_handles;
 
-    std::vector<bool> last_transfer_medium;
+    /** Indexed by subgroup ID; a char rather than a bool because subgroups are
+     * updated concurrently and std::vector<bool> packs them into shared words */
+    std::vector<char> last_transfer_medium;
+    /** Chooses the transport for each message this node sends, indexed by subgroup ID */
+    std::vector<TransportSelector> transport_selectors;
+    /** Sets each subgroup's window of this node's messages, indexed by subgroup ID */
+    std::vector<WindowController> window_controllers;
+    /** Indexed by subgroup ID; this node's metrics of each subgroup, which
+     * are in the process-wide registry so that they outlive the view */
+    std::vector<metrics::SubgroupMetrics*> subgroup_metrics;
+    /** Indexed by subgroup ID; tracks the stages of this node's messages in
+     * the subgroup if track_message_stages is set and this node is a sender
+     * in it, otherwise null */
+    std::vector<std::unique_ptr<MessageStageTracker>> stage_trackers;
+    /** Indexed by subgroup ID; the stages this node's messages in the
+     * subgroup have reached, for the receipts of its sends, if this node is
+     * a sender in it, otherwise null. Shared with the receipts, which may
+     * outlive the view. */
+    std::vector<std::shared_ptr<SendFrontiers>> send_frontiers;
+    /** A read lease this node granted the leader of its shard of a subgroup */
+    struct ReadLeaseGrant {
+        node_id_t leader;
+        /** When the grant runs out, by this node's steady clock */
+        std::chrono::steady_clock::time_point expiry;
+    };
+    /** Guards read_lease_grants, which the predicate thread writes and the
+     * next view's MulticastGroup reads */
+    std::mutex read_lease_mutex;
+    /** The latest read lease this node granted in each subgroup, by subgroup ID */
+    std::map<subgroup_id_t, ReadLeaseGrant> read_lease_grants;
+    /** Indexed by subgroup ID; the messages delivered by the delivery pass
+     * in progress, if deliveries are batched */
+    std::vector<DeliveryBatch> delivery_batches;
+    /** With raw_send_rings, the RawSendRing of each raw subgroup in which this
+     * node sends by RDMC, indexed by subgroup ID; null for the others */
+    std::vector<std::shared_ptr<RawSendRing>> send_rings;
+    const std::shared_ptr<ReceiveAllocators> receive_allocators;
+    const std::shared_ptr<StreamAssemblies> stream_assemblies;
+    const std::shared_ptr<SendLimiters> send_limiter_table;
+    /** Indexed by subgroup ID; the limits on this node's sending in each
+     * subgroup, from send_limiter_table */
+    const std::vector<std::shared_ptr<SendLimiter>> send_limiters;
 
     std::unique_ptr<FileWriter> file_writer;
+    /** Calls the global persistence callback off the SST predicate thread,
+     * if there is one */
+    std::unique_ptr<PersistenceNotifier> persistence_notifier;
 
     /** persistence manager callbacks */
     persistence_manager_callbacks_t persistence_manager_callbacks;
 
+    /** Indexed by subgroup ID; the thread that runs the subgroup's delivery
+     * upcalls if offload_delivery is set, otherwise null. Declared after
+     * everything the upcalls use, so that it is destroyed first. */
+    std::vector<std::unique_ptr<DeliveryExecutor>> delivery_executors;
+
+    /** Removes a subgroup's predicates of one kind from the SST. */
+    void remove_pred_handles(std::map<subgroup_id_t, std::list<pred_handle>>& handles,
+                             subgroup_id_t subgroup_num);
+
     /** Continuously waits for a new pending send, then sends it. This function
      * implements the sender thread. */
-    void send_loop();
+    void send_loop(uint32_t thread_index);
+    /** Wakes up the sender threads to check their subgroups for messages to send. */
+    void notify_senders();
+    /** @return True if the first of this node's queued messages in a subgroup
+     * can be sent now; the caller holds the subgroup's lock */
+    bool ready_to_send(subgroup_id_t subgroup_num);
+    /** Hands the first queued message in a subgroup to RDMC, releasing the
+     * subgroup's lock, which the caller holds, once it is no longer needed */
+    void issue_next_send(subgroup_id_t subgroup_num, std::unique_lock<std::mutex>& lock);
+    /** With inline_sends, sends the first queued message in a subgroup from
+     * the calling thread if it is ready, and returns false if it wasn't sent */
+    bool try_inline_send(subgroup_id_t subgroup_num, std::unique_lock<std::mutex>& lock);
 
     uint64_t get_time();
 
-    /** Checks for failures when a sender reaches its timeout. This function
-     * implements the timeout thread. */
-    void check_failures_loop();
+    /**
+     * Creates and destroys lazy RDMC groups in rounds. A sender that wants
+     * its group created or destroyed says so in its rdmc_group_wanted
+     * entry; the leader (the member in row 0) gathers those wishes into
+     * rdmc_group_target and starts a round once every member has finished
+     * the last one; and every member then creates and destroys the groups
+     * of its subgroups that the round changes, in the order of their
+     * columns. Creating a group exchanges queue pair details with the other
+     * members over shared TCP connections, so every member has to create
+     * the groups it shares with another in the same order. This function
+     * implements the RDMC group thread.
+     */
+    void rdmc_group_loop();
+    /** Requests this node's lazy RDMC groups that the sender threads need,
+     * and gives back the ones that have been idle for too long. */
+    void update_rdmc_group_requests();
+    /** At the leader, starts a round if some sender wants a change and the
+     * last round is over everywhere. */
+    void start_rdmc_group_round();
+    /** Makes the changes to this node's lazy RDMC groups that a round calls for. */
+    void run_rdmc_group_round(int32_t round);
+    /** Stops the RDMC group thread and waits for it. */
+    void stop_rdmc_group_thread();
+
+    /** Checks for failures when a sender reaches its timeout, and publishes
+     * this node's local stability frontier. Runs on the timer wheel. */
+    void check_failures();
+
+    /** Writes this node's heartbeat into the SST and checks the other
+     * members' heartbeats, freezing the rows of those it suspects. This
+     * function implements the heartbeat thread. */
+    void heartbeat_loop();
 
     std::function<void(persistence::message)> make_file_written_callback();
     bool create_rdmc_sst_groups();
+    /** @return The members of the shard in the RDMC group in which the member
+     * at shard_rank sends, starting with it */
+    std::vector<node_id_t> rotated_shard_members(subgroup_id_t subgroup_num, uint32_t shard_rank) const;
+    /** Makes the functions RDMC calls for an incoming message, and for a
+     * message that has been received, in the group of the member at
+     * shard_rank, which is the sender_rank'th sender of its shard. */
+    std::pair<rdmc::incoming_message_callback_t, rdmc::completion_callback_t> make_rdmc_upcalls(
+            subgroup_id_t subgroup_num, uint32_t shard_rank, uint32_t sender_rank);
+    /**
+     * Takes the RDMC groups of the previous view that this view needs with the
+     * same members, once each is between messages, and destroys the others.
+     * @param groups_needed False if this view will not create RDMC groups,
+     * because some of its members have already failed
+     */
+    void take_over_rdmc_groups(MulticastGroup& old_group, bool groups_needed);
+    /** With raw_send_rings, makes the RawSendRings of the raw subgroups in
+     * which this node sends by RDMC; called once the RDMC groups exist. */
+    void create_raw_send_rings();
+    /** Moves the messages the old view's rings had not finished sending into
+     * this view's rings, or into the send queues if there is no ring. */
+    void take_over_raw_send_rings(MulticastGroup& old_group);
+    /** Sizes the receive slots and message windows of a subgroup for its
+     * senders and window size, so the data path never has to grow them. */
+    void preallocate_message_windows(subgroup_id_t subgroup_num);
+    void initialize_send_states();
+    /** Scans the shard's SST rows for the current value of state.min_frontier. */
+    long long int compute_send_frontier(const SubgroupSendState& state, subgroup_id_t subgroup_num);
     void initialize_sst_row();
     void register_predicates();
+    /** Registers the predicates that renew a shard leader's read lease: the
+     * leader's, which asks for renewals, or a member's, which grants them */
+    void register_read_lease_predicates(subgroup_id_t subgroup_num,
+                                        const std::vector<node_id_t>& shard_members,
+                                        const std::vector<uint32_t>& shard_sst_indices,
+                                        sst::PredicateType type);
+
+    /** This node's neighbors in a shard's aggregation tree, as SST rows. The
+     * tree is a complete tree over the shard ranks, rooted at rank 0. */
+    struct AggregationTree {
+        bool is_root;
+        /** The parent's row, or nothing at the root */
+        std::vector<uint32_t> parent_row;
+        std::vector<uint32_t> child_rows;
+    };
+    AggregationTree make_aggregation_tree(const std::vector<node_id_t>& shard_members) const;
+    /** Moves this node's subtree minimums up the tree and the shard minimums
+     * down it, updating this node's stable_num from them. */
+    void aggregate_stability(DerechoSST& sst, subgroup_id_t subgroup_num, const AggregationTree& tree);
 
     void deliver_message(RDMCMessage& msg, uint32_t subgroup_num);
     void deliver_message(SSTMessage& msg, uint32_t subgroup_num);
+    /** Makes the version of the subgroup's persistent state for a delivered
+     * message, stamped with the message's send time (or the current time if
+     * it has none). */
+    void make_version(subgroup_id_t subgroup_num, long long int seq_num, uint64_t msg_ts);
+    /** Hands a delivered message to the RPC handlers if it is a cooked send
+     * or to the stability callback if it is not, on the subgroup's delivery
+     * executor if it has one. buf starts with the message's header. */
+    void deliver_to_application(subgroup_id_t subgroup_num, node_id_t sender_id, long long int index,
+                                char* buf, long long int size);
+    /** Runs a step of delivery now, or after the upcalls queued before it if
+     * the subgroup has a delivery executor. */
+    void run_in_delivery_order(subgroup_id_t subgroup_num, std::function<void()> step);
+    /** @return True if delivered messages are batched, because the
+     * application or the RPC handlers take them in batches */
+    bool batches_deliveries() const {
+        return rpc_batch_callback || callbacks.global_stability_batch_callback;
+    }
+    /** Hands the messages the current delivery pass delivered in the
+     * subgroup to the application, on its delivery executor if it has one.
+     * Must be called before the pass releases the subgroup's lock, since
+     * the messages' buffers can be reused after that. */
+    void flush_delivery_batch(subgroup_id_t subgroup_num);
+    /** Makes the upcalls for a batch, and the versions that follow them */
+    void deliver_batch(subgroup_id_t subgroup_num, DeliveryBatch& batch);
+
+    /** Wakes up any threads blocked in wait_for_sendbuffer_ptr; called from
+     * the predicates that advance the send window. */
+    void notify_sendbuffer_waiters();
+    /** Puts a message buffer that is no longer needed back in the subgroup's
+     * pool, or lets it go if it belongs to the application. */
+    void recycle_message_buffer(subgroup_id_t subgroup_num, MessageBuffer&& buffer);
+    /** @return The region the subgroup's receive allocator, if it has one,
+     * gives for an incoming message, or null */
+    std::shared_ptr<rdma::memory_region> allocate_user_receive(subgroup_id_t subgroup_num, node_id_t sender,
+                                                             long long unsigned int size);
 
     uint32_t get_num_senders(std::vector<int> shard_senders) {
         uint32_t num = 0;
@@ -280,42 +1268,7 @@ private:
     };
 
     long long int resolve_num_received(long long beg_index, long long end_index, uint32_t num_received_entry) {
-        // std::cout << "num_received_entry = " << num_received_entry << std::endl;
-        // std::cout << "beg_index = " << beg_index << std::endl;
-        // std::cout << "end_index = " << end_index << std::endl;
-        auto it = received_intervals[num_received_entry].end();
-        it--;
-        while(*it > beg_index) {
-            it--;
-        }
-        if(std::next(it) == received_intervals[num_received_entry].end()) {
-            if(*it == beg_index - 1) {
-                *it = end_index;
-            } else {
-                received_intervals[num_received_entry].push_back(beg_index);
-                received_intervals[num_received_entry].push_back(end_index);
-            }
-        } else {
-            auto next_it = std::next(it);
-            if(*it != beg_index - 1) {
-                received_intervals[num_received_entry].insert(next_it, beg_index);
-                if(*next_it != end_index + 1) {
-                    received_intervals[num_received_entry].insert(next_it, end_index);
-                } else {
-                    received_intervals[num_received_entry].erase(next_it);
-                }
-            } else {
-                if(*next_it != end_index + 1) {
-                    received_intervals[num_received_entry].insert(next_it, end_index);
-                } else {
-                    received_intervals[num_received_entry].erase(next_it);
-                }
-                received_intervals[num_received_entry].erase(it);
-            }
-        }
-        // std::cout << "Returned value: "
-        //           << *std::next(received_intervals[num_received_entry].begin()) << std::endl;
-        return *std::next(received_intervals[num_received_entry].begin());
+        return received_windows[num_received_entry].receive(beg_index, end_index);
     }
 
 public:
@@ -324,11 +1277,12 @@ public:
             std::shared_ptr<DerechoSST> _sst,
             CallbackSet callbacks,
             uint32_t total_num_subgroups,
-            const std::map<subgroup_id_t, std::pair<uint32_t, uint32_t>>& subgroup_to_shard_and_rank,
-            const std::map<subgroup_id_t, std::pair<std::vector<int>, int>>& subgroup_to_senders_and_sender_rank,
-            const std::map<subgroup_id_t, uint32_t>& subgroup_to_num_received_offset,
-            const std::map<subgroup_id_t, std::vector<node_id_t>>& subgroup_to_membership,
-            const std::map<subgroup_id_t, Mode>& subgroup_to_mode,
+            SubgroupMap<std::pair<uint32_t, uint32_t>> _subgroup_to_shard_and_rank,
+            SubgroupMap<std::pair<std::vector<int>, int>> _subgroup_to_senders_and_sender_rank,
+            SubgroupMap<uint32_t> _subgroup_to_num_received_offset,
+            SubgroupMap<std::vector<node_id_t>> _subgroup_to_membership,
+            SubgroupMap<Mode> _subgroup_to_mode,
+            const std::set<subgroup_id_t>& latency_critical_subgroups,
             const DerechoParams derecho_params,
             const persistence_manager_callbacks_t & _persistence_manager_callbacks,
             std::vector<char> already_failed = {});
@@ -339,11 +1293,12 @@ public:
             std::shared_ptr<DerechoSST> _sst,
             MulticastGroup&& old_group,
             uint32_t total_num_subgroups,
-            const std::map<subgroup_id_t, std::pair<uint32_t, uint32_t>>& subgroup_to_shard_and_rank,
-            const std::map<subgroup_id_t, std::pair<std::vector<int>, int>>& subgroup_to_senders_and_sender_rank,
-            const std::map<subgroup_id_t, uint32_t>& subgroup_to_num_received_offset,
-            const std::map<subgroup_id_t, std::vector<node_id_t>>& subgroup_to_membership,
-            const std::map<subgroup_id_t, Mode>& subgroup_to_mode,
+            SubgroupMap<std::pair<uint32_t, uint32_t>> _subgroup_to_shard_and_rank,
+            SubgroupMap<std::pair<std::vector<int>, int>> _subgroup_to_senders_and_sender_rank,
+            SubgroupMap<uint32_t> _subgroup_to_num_received_offset,
+            SubgroupMap<std::vector<node_id_t>> _subgroup_to_membership,
+            SubgroupMap<Mode> _subgroup_to_mode,
+            const std::set<subgroup_id_t>& latency_critical_subgroups,
             const persistence_manager_callbacks_t & _persistence_manager_callbacks,
             std::vector<char> already_failed = {}, uint32_t rpc_port = derecho_rpc_port);
 
@@ -354,21 +1309,149 @@ public:
      * @param handler A function that will handle RPC messages.
      */
     void register_rpc_callback(rpc_handler_t handler) { rpc_callback = std::move(handler); }
+    /** Registers a function to handle the RPC messages of each delivery
+     * pass together, which is used instead of the RPC callback */
+    void register_rpc_batch_callback(rpc_batch_handler_t handler) { rpc_batch_callback = std::move(handler); }
 
+    /** Tells the subgroup's TransportSelector how long one of this node's
+     * messages took to be delivered, given the timestamp in its header. */
+    void record_delivery_latency(subgroup_id_t subgroup_num, uint32_t msg_size,
+                                 bool via_sst, uint64_t send_timestamp);
     void deliver_messages_upto(const std::vector<long long int>& max_indices_for_senders, uint32_t subgroup_num, uint32_t num_shard_senders);
     /** Get a pointer into the current buffer, to write data into it before sending */
     char* get_sendbuffer_ptr(subgroup_id_t subgroup_num, long long unsigned int payload_size,
 			     int pause_sending_turns = 0,
                              bool cooked_send = false, bool null_send = false);
+    /**
+     * Same as get_sendbuffer_ptr, but if the send window for this subgroup is
+     * full, parks the calling thread on a condition variable until a slot
+     * frees up instead of returning nullptr immediately.
+     * @param deadline The time after which the caller gives up waiting
+     * @return A pointer into the send buffer, or nullptr if the deadline
+     * passed, the group was wedged, or the message can never be sent
+     */
+    char* wait_for_sendbuffer_ptr(subgroup_id_t subgroup_num, long long unsigned int payload_size,
+                                  const std::chrono::steady_clock::time_point& deadline,
+                                  int pause_sending_turns = 0,
+                                  bool cooked_send = false, bool null_send = false);
     /** Note that get_sendbuffer_ptr and send are called one after the another - regexp for using the two is (get_sendbuffer_ptr.send)*
      * This still allows making multiple send calls without acknowledgement; at a single point in time, however,
      * there is only one message per sender in the RDMC pipeline */
     bool send(subgroup_id_t subgroup_num);
+    /**
+     * @return A receipt for the message whose buffer get_sendbuffer_ptr
+     * handed out last in a subgroup, or an empty one if this node doesn't
+     * send in it. Call it before the next get_sendbuffer_ptr, under the same
+     * lock as the send.
+     */
+    SendReceipt last_send_receipt(subgroup_id_t subgroup_num) const {
+        if(subgroup_num >= send_frontiers.size() || !send_frontiers[subgroup_num]) {
+            return SendReceipt();
+        }
+        return SendReceipt(send_frontiers[subgroup_num], send_frontiers[subgroup_num]->get_last_acquired());
+    }
+    /**
+     * @return The RawSendRing of a raw subgroup, or null if it doesn't have
+     * one in this view
+     */
+    std::shared_ptr<RawSendRing> get_raw_send_ring(subgroup_id_t subgroup_num) const {
+        return subgroup_num < send_rings.size() ? send_rings[subgroup_num] : nullptr;
+    }
+    /**
+     * Sets the function that gives destinations for the subgroup's incoming
+     * RDMC messages, in this view and the following ones; null goes back to
+     * receiving them into Derecho's own buffers.
+     */
+    void set_receive_allocator(subgroup_id_t subgroup_num, receive_allocator_t allocator);
+    /**
+     * Limits this node's sending in a subgroup, in this view and the
+     * following ones. A send the limit doesn't admit yet gets nullptr from
+     * get_sendbuffer_ptr, or false from send_user_buffer, as if the window
+     * were full, and wait_for_sendbuffer_ptr waits for it; the subgroup's
+     * sends_throttled counter counts them.
+     */
+    void set_send_limit(subgroup_id_t subgroup_num, const SendLimit& limit);
+    /**
+     * Sends a message straight out of a buffer the application owns, by RDMC,
+     * instead of copying it into one from get_sendbuffer_ptr. The buffer must
+     * start with sizeof(header) bytes of space for Derecho's header, followed
+     * by the payload, and must stay untouched until on_release is called.
+     * That happens once the message has been delivered, or dropped, and RDMC
+     * is done with it; it is called on one of Derecho's own threads, so it
+     * must not block. If the buffer will be freed rather than reused, call
+     * rdma::memory_region::forget_user_buffer() first. The message is queued
+     * right away and sent as soon as the send window allows.
+     * @return False if the message can't be sent: the group is wedged, the
+     * message is larger than the maximum message size, or a buffer from
+     * get_sendbuffer_ptr hasn't been sent yet.
+     */
+    bool send_user_buffer(subgroup_id_t subgroup_num, char* buffer,
+                          long long unsigned int payload_size,
+                          std::function<void()> on_release,
+                          int pause_sending_turns = 0, bool cooked_send = false);
+    /**
+     * Sends a message out of a memory region the application has registered,
+     * such as GPU memory from rdma::memory_region::for_device_buffer(), which
+     * RDMC then moves straight into the receivers' destinations; receivers
+     * that want it in GPU memory too return such regions from their
+     * receive_allocator_t. The region starts with the header space and
+     * payload as for the other send_user_buffer, and Derecho's reference to
+     * it is dropped once RDMC is done with the message.
+     * @return False if the message can't be sent, as for the other
+     * send_user_buffer, or if it is larger than the region.
+     */
+    bool send_user_buffer(subgroup_id_t subgroup_num, std::shared_ptr<rdma::memory_region> mr,
+                          long long unsigned int payload_size,
+                          int pause_sending_turns = 0, bool cooked_send = false);
 
     const uint64_t compute_global_stability_frontier(uint32_t subgroup_num);
 
+    /** @return The latest version that every member of this node's shard of
+     * the subgroup has persisted */
+    persistence_version_t compute_global_persistence_frontier(uint32_t subgroup_num);
+
+    /** @return The latest version that counts as persisted in the shard: the
+     * least persisted_num of its members, or with remote_persistence_replicas
+     * the greatest that that many of them have reached */
+    long long int compute_persistence_frontier(const DerechoSST& sst, subgroup_id_t subgroup_num,
+                                               const std::vector<uint32_t>& shard_sst_indices) const;
+
+    /**
+     * Waits until the read leases this node granted in this group to shard
+     * leaders that aren't in the next view have run out, so that no leader
+     * left behind can still be serving reads while the next view takes
+     * writes. Called on the old group, once it is wedged.
+     */
+    void wait_out_read_leases(const std::vector<node_id_t>& next_members);
     /** Stops all sending and receiving in this group, in preparation for shutting it down. */
     void wedge();
+    /**
+     * Stops sending and receiving in some of this node's subgroups only,
+     * leaving the others running until wedge() is called.
+     * @param subgroups The IDs of the subgroups to wedge; those this node
+     * isn't a member of are ignored
+     */
+    void wedge_subgroups(const std::set<subgroup_id_t>& subgroups);
+    /** @return True if the subgroup has been wedged, alone or with the whole group */
+    bool is_wedged(subgroup_id_t subgroup_num) const {
+        return thread_shutdown || subgroup_wedged[subgroup_num];
+    }
+    /**
+     * @return True if this node is the leader of its shard of an ordered
+     * subgroup and holds the shard's read lease: every member has granted it
+     * recently enough, in this view, that none of them can have taken part in
+     * a view without it since. Wedging the subgroup revokes the lease.
+     */
+    bool holds_read_lease(subgroup_id_t subgroup_num);
+    /**
+     * If this node holds the read lease of a subgroup, waits until it has
+     * delivered every message it has received in the subgroup, which
+     * includes every message that had been delivered anywhere before the
+     * call, so that a read of its replica made next is linearizable.
+     * @return False, without waiting, if this node doesn't hold the lease, or
+     * if the subgroup was wedged before those messages were delivered
+     */
+    bool wait_for_linearizable_read(subgroup_id_t subgroup_num);
     /** Debugging function; prints the current state of the SST to stdout. */
     void debug_print();
     static long long unsigned int compute_max_msg_size(
@@ -376,10 +1459,10 @@ public:
             const long long unsigned int block_size);
     /** Maps subgroup IDs (for subgroups this node is a member of) to the pair
      * (this node's shard number, this node's shard rank)*/
-    const std::map<subgroup_id_t, std::pair<uint32_t, uint32_t>>& get_subgroup_to_shard_and_rank() {
+    const SubgroupMap<std::pair<uint32_t, uint32_t>>& get_subgroup_to_shard_and_rank() {
         return subgroup_to_shard_and_rank;
     }
-    const std::map<subgroup_id_t, uint32_t>& get_subgroup_to_num_received_offset() {
+    const SubgroupMap<uint32_t>& get_subgroup_to_num_received_offset() {
         return subgroup_to_num_received_offset;
     }
     std::vector<uint32_t> get_shard_sst_indices(uint32_t subgroup_num);
@@ -0,0 +1,94 @@
+/**
+ * @file node_capacity.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace derecho {
+
+/**
+ * The resources a node advertises when it joins the group, which
+ * capacity-weighted subgroup allocation uses to give larger nodes more
+ * shards. The units only need to be comparable from one node to the next.
+ * This is a plain struct so that it can go in the SST, and be serialized in
+ * a View, as it is.
+ */
+struct NodeCapacity {
+    /** CPU cores */
+    uint32_t cores;
+    /** NIC bandwidth, in Gb/s */
+    uint32_t nic_gbps;
+    /** Storage for persistent state, in GB */
+    uint32_t storage_gb;
+};
+
+/** The resource that the shards of a subgroup are limited by */
+enum class CapacityResource {
+    CORES,
+    NIC_BANDWIDTH,
+    STORAGE
+};
+
+/** The capacity of a node that hasn't advertised one, such as the members of
+ * a static membership, which start without a join */
+inline NodeCapacity unit_capacity() {
+    return NodeCapacity{1, 1, 1};
+}
+
+/** @return How much of a resource a node has, counting nothing as 1 */
+inline uint32_t capacity_amount(const NodeCapacity& capacity, CapacityResource resource) {
+    switch(resource) {
+        case CapacityResource::CORES:
+            return std::max(capacity.cores, 1u);
+        case CapacityResource::NIC_BANDWIDTH:
+            return std::max(capacity.nic_gbps, 1u);
+        case CapacityResource::STORAGE:
+            return std::max(capacity.storage_gb, 1u);
+    }
+    return 1;
+}
+
+/**
+ * The capacity this node advertises when it joins, from the environment
+ * variable DERECHO_NODE_CAPACITY, which has entries of the form cores=N,
+ * nic_gbps=N and storage_gb=N separated by commas. A resource it leaves out
+ * counts as 1, except for cores, which are the hardware threads of this
+ * machine.
+ */
+inline NodeCapacity local_node_capacity() {
+    NodeCapacity capacity = unit_capacity();
+    capacity.cores = std::max(std::thread::hardware_concurrency(), 1u);
+    const char* setting = std::getenv("DERECHO_NODE_CAPACITY");
+    if(!setting) {
+        return capacity;
+    }
+    std::istringstream entries(setting);
+    std::string entry;
+    while(std::getline(entries, entry, ',')) {
+        const std::size_t equals = entry.find('=');
+        if(equals == std::string::npos) {
+            continue;
+        }
+        const std::string name = entry.substr(0, equals);
+        const uint32_t amount = std::strtoul(entry.c_str() + equals + 1, nullptr, 10);
+        if(name == "cores") {
+            capacity.cores = amount;
+        } else if(name == "nic_gbps") {
+            capacity.nic_gbps = amount;
+        } else if(name == "storage_gb") {
+            capacity.storage_gb = amount;
+        }
+    }
+    return capacity;
+}
+
+}  // namespace derecho
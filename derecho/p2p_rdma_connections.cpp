@@ -0,0 +1,124 @@
+/**
+ * @file p2p_rdma_connections.cpp
+ *
+ * @date Oct 14, 2026
+ */
+
+#include "p2p_rdma_connections.h"
+
+#include <cstring>
+#include <thread>
+
+namespace derecho {
+
+/** Rounds n up to a multiple of 8, so that the words after it are aligned. */
+static std::size_t align_up(std::size_t n) {
+    return (n + 7) & ~static_cast<std::size_t>(7);
+}
+
+P2PRDMAConnections::P2PRDMAConnections(std::size_t max_msg_size)
+        : max_msg_size(max_msg_size),
+          footer_offset(align_up(max_msg_size)),
+          slot_size(footer_offset + sizeof(slot_footer)),
+          consumed_offset(num_slots * slot_size),
+          region_size(consumed_offset + sizeof(uint64_t)) {}
+
+std::shared_ptr<P2PRDMAConnections::connection> P2PRDMAConnections::get_connection(node_id_t node_id) {
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    auto it = connections.find(node_id);
+    if(it == connections.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+void P2PRDMAConnections::add_node(node_id_t node_id) {
+    auto conn = std::make_shared<connection>();
+    conn->node_id = node_id;
+    conn->incoming.reset(new char[region_size]());
+    conn->outgoing.reset(new char[region_size]());
+    conn->res = std::make_unique<sst::resources>(node_id, conn->incoming.get(), conn->outgoing.get(),
+                                                 region_size, region_size);
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    connections[node_id] = conn;
+    connections_version++;
+}
+
+bool P2PRDMAConnections::delete_node(node_id_t node_id) {
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    auto it = connections.find(node_id);
+    if(it == connections.end()) {
+        return false;
+    }
+    it->second->closed = true;
+    connections.erase(it);
+    connections_version++;
+    return true;
+}
+
+bool P2PRDMAConnections::contains(node_id_t node_id) {
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    return connections.count(node_id) > 0;
+}
+
+bool P2PRDMAConnections::write(node_id_t node_id, const char* buffer, std::size_t size) {
+    if(size > max_msg_size) {
+        return false;
+    }
+    auto conn = get_connection(node_id);
+    if(!conn) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(conn->send_mutex);
+    const uint64_t seq = conn->next_send_seq;
+    // The slot is free once the peer has consumed the message that last used
+    // it, which also means the NIC is done reading our copy of that message
+    while(seq - *consumed_count(conn->incoming.get()) >= num_slots) {
+        if(conn->closed) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    const std::size_t offset = (seq % num_slots) * slot_size;
+    memcpy(conn->outgoing.get() + offset, buffer, size);
+    slot_footer* footer = footer_at(conn->outgoing.get(), seq);
+    footer->size = size;
+    footer->seq = seq + 1;
+    // Writes on one queue pair are placed in order, so the footer can't
+    // arrive before the message
+    conn->res->post_remote_write(0, offset, size);
+    conn->res->post_remote_write(0, offset + footer_offset, sizeof(slot_footer));
+    conn->next_send_seq++;
+    return true;
+}
+
+bool P2PRDMAConnections::receive(const std::function<void(node_id_t, char*, std::size_t)>& handler) {
+    if(receive_connections_version != connections_version) {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        receive_connections.clear();
+        for(const auto& p : connections) {
+            receive_connections.push_back(p.second);
+        }
+        receive_connections_version = connections_version;
+    }
+    const std::size_t num_connections = receive_connections.size();
+    for(std::size_t i = 0; i < num_connections; ++i) {
+        const std::size_t index = (next_receive_index + i) % num_connections;
+        connection& conn = *receive_connections[index];
+        const uint64_t seq = conn.next_receive_seq;
+        volatile slot_footer* footer = footer_at(conn.incoming.get(), seq);
+        if(footer->seq != seq + 1) {
+            continue;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        handler(conn.node_id, conn.incoming.get() + (seq % num_slots) * slot_size, footer->size);
+        conn.next_receive_seq++;
+        // Hand the slot back to the sender
+        *consumed_count(conn.outgoing.get()) = conn.next_receive_seq;
+        conn.res->post_remote_write(0, consumed_offset, sizeof(uint64_t));
+        next_receive_index = (index + 1) % num_connections;
+        return true;
+    }
+    return false;
+}
+}  // namespace derecho
@@ -0,0 +1,131 @@
+/**
+ * @file p2p_rdma_connections.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "sst/verbs.h"
+
+namespace derecho {
+
+using node_id_t = uint32_t;
+
+/**
+ * An RDMA transport for peer-to-peer RPC messages, as an alternative to the
+ * TCP sockets in tcp::tcp_connections. Each pair of nodes shares two rings of
+ * preregistered message slots, one in each node's memory; a sender copies a
+ * message into the next free slot of the receiver's ring with one-sided RDMA
+ * writes, and the receiver finds it by polling the slot's footer. When the
+ * receiver is done with a slot it writes its count of consumed messages back
+ * into the sender's memory, which is how the sender knows it can reuse the
+ * slot. The queue pairs and memory regions are the SST's sst::resources, so
+ * the SST's verbs state must be initialized before any node is added.
+ */
+class P2PRDMAConnections {
+public:
+    /** The number of message slots in each ring. */
+    static constexpr std::size_t num_slots = 4;
+
+private:
+    /** Written after a message's bytes, so that a receiver that sees the
+     * footer knows the message has fully arrived. */
+    struct slot_footer {
+        uint64_t size;
+        /** One more than the message's sequence number, so that a zeroed
+         * slot never looks like it holds a message. */
+        uint64_t seq;
+    };
+
+    struct connection {
+        node_id_t node_id;
+        /** Written remotely by the peer: its messages to this node, followed
+         * by the number of this node's messages that it has consumed. */
+        std::unique_ptr<char[]> incoming;
+        /** Staging area with the same layout, copied by RDMA writes into the
+         * same offsets of the peer's incoming region. */
+        std::unique_ptr<char[]> outgoing;
+        std::unique_ptr<sst::resources> res;
+        /** Serializes senders to this peer, and protects next_send_seq. */
+        std::mutex send_mutex;
+        uint64_t next_send_seq = 0;
+        /** Only used by the thread that calls receive(). */
+        uint64_t next_receive_seq = 0;
+        /** Set when the peer has been removed, to stop senders waiting for it. */
+        std::atomic<bool> closed{false};
+    };
+
+    /** The largest message that fits in a slot */
+    const std::size_t max_msg_size;
+    /** The offset of a slot's footer from the start of the slot */
+    const std::size_t footer_offset;
+    const std::size_t slot_size;
+    /** The offset of the consumed-message count in a region */
+    const std::size_t consumed_offset;
+    const std::size_t region_size;
+
+    /** Protects connections */
+    std::mutex connections_mutex;
+    std::map<node_id_t, std::shared_ptr<connection>> connections;
+    /** Incremented whenever connections changes, so that the receiving thread
+     * knows when to refresh its copy of the connection list. */
+    std::atomic<uint64_t> connections_version{0};
+
+    /** The receiving thread's copy of the connections, so that polling them
+     * takes no lock. */
+    std::vector<std::shared_ptr<connection>> receive_connections;
+    uint64_t receive_connections_version = 0;
+    /** Where the next receive() starts polling, so that no peer starves the others */
+    std::size_t next_receive_index = 0;
+
+    std::shared_ptr<connection> get_connection(node_id_t node_id);
+    slot_footer* footer_at(char* region, uint64_t seq) const {
+        return reinterpret_cast<slot_footer*>(region + (seq % num_slots) * slot_size + footer_offset);
+    }
+    volatile uint64_t* consumed_count(char* region) const {
+        return reinterpret_cast<volatile uint64_t*>(region + consumed_offset);
+    }
+
+public:
+    /** @param max_msg_size The largest message that will be sent, in bytes */
+    P2PRDMAConnections(std::size_t max_msg_size);
+
+    /**
+     * Sets up the rings shared with a node. This exchanges connection data over
+     * the SST's TCP connection to the node, so the node must be adding this
+     * node at the same time, and the SST must already be connected to it.
+     */
+    void add_node(node_id_t node_id);
+    /** Forgets a node, waking up any sender that is waiting for it. */
+    bool delete_node(node_id_t node_id);
+    /** @return True if messages to this node can be sent over RDMA */
+    bool contains(node_id_t node_id);
+
+    /**
+     * Sends a message to a node, waiting for a free slot in its ring if all of
+     * them are in use.
+     * @return False if there is no RDMA connection to the node or the message
+     * is too large for a slot, in which case nothing was sent.
+     */
+    bool write(node_id_t node_id, const char* buffer, std::size_t size);
+
+    /**
+     * Checks every node's ring for a new message, and if one has arrived,
+     * calls the handler on it and then frees its slot. The message is only
+     * valid until the handler returns. Only one thread may call this.
+     * @param handler A function taking the sender's ID, a pointer to the
+     * message, and its size.
+     * @return True if a message was handled, false if there were none.
+     */
+    bool receive(const std::function<void(node_id_t, char*, std::size_t)>& handler);
+};
+}  // namespace derecho
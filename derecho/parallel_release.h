@@ -0,0 +1,44 @@
+/**
+ * @file parallel_release.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace derecho {
+
+/** The most threads release_in_parallel uses */
+constexpr std::size_t max_release_threads = 8;
+
+/**
+ * Resets every pointer in owners, spread over a few threads. Tearing down
+ * RDMA resources is mostly waiting for the device to destroy queue pairs and
+ * deregister memory, which it can do for several owners at once, so this is
+ * much faster than releasing them in a loop when a node with many groups or
+ * peers shuts down. Returns once all of them have been released.
+ */
+template <typename Pointer>
+void release_in_parallel(std::vector<Pointer>& owners) {
+    const std::size_t num_threads = std::max<std::size_t>(std::min(owners.size(), max_release_threads), 1);
+    auto release_every_nth = [&owners, num_threads](std::size_t first) {
+        for(std::size_t i = first; i < owners.size(); i += num_threads) {
+            owners[i].reset();
+        }
+    };
+    std::vector<std::thread> threads;
+    for(std::size_t first = 1; first < num_threads; ++first) {
+        threads.emplace_back(release_every_nth, first);
+    }
+    release_every_nth(0);
+    for(auto& thread : threads) {
+        thread.join();
+    }
+}
+
+}  // namespace derecho
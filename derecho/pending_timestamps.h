@@ -0,0 +1,112 @@
+/**
+ * @file pending_timestamps.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace derecho {
+
+/**
+ * The send timestamps of this node's messages in a subgroup that aren't yet
+ * stable or persisted, from which the local stability frontier is computed.
+ * The timestamps are added in sending order and almost always removed in the
+ * same order, so they are kept in a ring buffer in the order they were added
+ * rather than in a tree: adding one and removing the oldest are constant
+ * time and allocate nothing once the ring is big enough for the send window.
+ * A timestamp removed out of order is only marked, and skipped once it
+ * reaches the head. The oldest timestamp is the smallest unless the clock
+ * went backwards, in which case the smallest is searched for until the
+ * ring has emptied. It is protected by the subgroup's lock, like the other
+ * per-subgroup state of MulticastGroup.
+ */
+class PendingTimestamps {
+    struct Entry {
+        uint64_t timestamp;
+        bool removed;
+    };
+    /** The ring; its size is always a power of 2 */
+    std::vector<Entry> ring;
+    std::size_t head = 0;
+    std::size_t count = 0;
+    /** The number of entries in the ring that are marked removed */
+    std::size_t num_removed = 0;
+    /** False once a timestamp smaller than the one before it was added */
+    bool monotonic = true;
+
+    Entry& at(std::size_t i) {
+        return ring[(head + i) & (ring.size() - 1)];
+    }
+    const Entry& at(std::size_t i) const {
+        return ring[(head + i) & (ring.size() - 1)];
+    }
+
+    void grow() {
+        std::vector<Entry> bigger(std::max<std::size_t>(16, ring.size() * 2));
+        for(std::size_t i = 0; i < count; ++i) {
+            bigger[i] = at(i);
+        }
+        ring.swap(bigger);
+        head = 0;
+    }
+
+    void pop_removed() {
+        while(count > 0 && at(0).removed) {
+            head = (head + 1) & (ring.size() - 1);
+            --count;
+            --num_removed;
+        }
+        if(count == 0) {
+            monotonic = true;
+        }
+    }
+
+public:
+    void insert(uint64_t timestamp) {
+        if(count == ring.size()) {
+            grow();
+        }
+        if(count > 0 && timestamp < at(count - 1).timestamp) {
+            monotonic = false;
+        }
+        at(count) = Entry{timestamp, false};
+        ++count;
+    }
+
+    /** Removes one occurrence of a timestamp, if it is there. */
+    void erase(uint64_t timestamp) {
+        for(std::size_t i = 0; i < count; ++i) {
+            Entry& entry = at(i);
+            if(!entry.removed && entry.timestamp == timestamp) {
+                entry.removed = true;
+                ++num_removed;
+                pop_removed();
+                return;
+            }
+        }
+    }
+
+    bool empty() const {
+        return count == num_removed;
+    }
+
+    /** @return The smallest timestamp; the ring must not be empty */
+    uint64_t min() const {
+        if(monotonic) {
+            return at(0).timestamp;
+        }
+        uint64_t smallest = UINT64_MAX;
+        for(std::size_t i = 0; i < count; ++i) {
+            if(!at(i).removed) {
+                smallest = std::min(smallest, at(i).timestamp);
+            }
+        }
+        return smallest;
+    }
+};
+}  // namespace derecho
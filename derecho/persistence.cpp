@@ -0,0 +1,165 @@
+/**
+ * @file persistence.cpp
+ *
+ * @date Oct 14, 2026
+ */
+
+#include "persistence.h"
+
+#include <array>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "thread_placement.h"
+
+namespace derecho {
+namespace persistence {
+
+uint32_t crc32(const char* data, std::size_t size) {
+    static const std::array<uint32_t, 256> table = []() {
+        std::array<uint32_t, 256> entries;
+        for(uint32_t i = 0; i < 256; ++i) {
+            uint32_t entry = i;
+            for(int bit = 0; bit < 8; ++bit) {
+                entry = (entry & 1) ? (entry >> 1) ^ 0xEDB88320u : entry >> 1;
+            }
+            entries[i] = entry;
+        }
+        return entries;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for(std::size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+void write_saved_object(const std::string& filename, const std::vector<char>& contents) {
+    const std::string swap_filename = filename + SWAP_FILE_EXTENSION;
+    int fd = open(swap_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(fd < 0) {
+        std::cerr << "Error opening saved-state swap file " << swap_filename << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    std::size_t written = 0;
+    while(written < contents.size()) {
+        ssize_t result = ::write(fd, contents.data() + written, contents.size() - written);
+        if(result < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error writing saved-state swap file " << swap_filename << ": " << strerror(errno) << std::endl;
+            close(fd);
+            return;
+        }
+        written += result;
+    }
+    // The rename must not reach the disk before the contents do
+    if(fsync(fd) < 0) {
+        std::cerr << "Error syncing saved-state swap file " << swap_filename << ": " << strerror(errno) << std::endl;
+    }
+    close(fd);
+
+    if(std::rename(swap_filename.c_str(), filename.c_str()) < 0) {
+        std::cerr << "Error updating saved-state file on disk! " << strerror(errno) << std::endl;
+    }
+}
+
+MappedSavedObject::MappedSavedObject(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return;
+    }
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) < 0 || file_stat.st_size == 0) {
+        close(fd);
+        return;
+    }
+    mapping_size = file_stat.st_size;
+    mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) {
+        mapping = nullptr;
+        return;
+    }
+    const char* contents = static_cast<const char*>(mapping);
+    if(mapping_size >= sizeof(saved_object_header)
+       && std::equal(std::begin(SAVED_OBJECT_MAGIC), std::end(SAVED_OBJECT_MAGIC), (const uint8_t*)contents)) {
+        saved_object_header header;
+        std::memcpy(&header, contents, sizeof(header));
+        const char* body = contents + sizeof(header);
+        if(header.version == SAVED_OBJECT_VERSION
+           && header.size <= mapping_size - sizeof(header)
+           && crc32(body, header.size) == header.checksum) {
+            object = body;
+        }
+        return;
+    }
+    // The older format is just the size of the object followed by the object
+    std::size_t legacy_size;
+    if(mapping_size >= sizeof(legacy_size)) {
+        std::memcpy(&legacy_size, contents, sizeof(legacy_size));
+        if(legacy_size <= mapping_size - sizeof(legacy_size)) {
+            object = contents + sizeof(legacy_size);
+        }
+    }
+}
+
+MappedSavedObject::~MappedSavedObject() {
+    if(mapping) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+SavedObjectWriter::SavedObjectWriter() : writer_thread(&SavedObjectWriter::write_loop, this) {}
+
+SavedObjectWriter::~SavedObjectWriter() {
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        shutdown = true;
+    }
+    pending_cv.notify_all();
+    writer_thread.join();
+}
+
+void SavedObjectWriter::write(const std::string& filename, std::vector<char> contents) {
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        pending[filename] = std::move(contents);
+    }
+    pending_cv.notify_all();
+}
+
+void SavedObjectWriter::flush() {
+    std::unique_lock<std::mutex> lock(pending_mutex);
+    pending_cv.wait(lock, [this]() { return pending.empty() && !writing; });
+}
+
+void SavedObjectWriter::write_loop() {
+    pthread_setname_np(pthread_self(), "state_writer");
+    place_this_thread("state_writer");
+    std::unique_lock<std::mutex> lock(pending_mutex);
+    while(true) {
+        pending_cv.wait(lock, [this]() { return !pending.empty() || shutdown; });
+        // Everything pending is written before shutting down
+        if(pending.empty()) {
+            return;
+        }
+        auto next = pending.begin();
+        const std::string filename = next->first;
+        std::vector<char> contents = std::move(next->second);
+        pending.erase(next);
+        writing = true;
+        lock.unlock();
+        write_saved_object(filename, contents);
+        lock.lock();
+        writing = false;
+        pending_cv.notify_all();
+    }
+}
+
+}  // namespace persistence
+}  // namespace derecho
@@ -1,10 +1,19 @@
 #pragma once
 
+#include <algorithm>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <mutils-serialization/SerializationSupport.hpp>
 
@@ -22,6 +31,9 @@ struct message {
     uint64_t index;
     bool cooked;
     uint32_t subgroup_num;
+    /** The message's sequence number in its subgroup, which identifies it
+     * to the upcall made once it has been written */
+    long long int sequence_number;
 };
 
 struct __attribute__((__packed__)) header {
@@ -47,28 +59,137 @@ static const std::string METADATA_EXTENSION = ".metadata";
 static const std::string PAXOS_STATE_EXTENSION = ".paxosstate";
 static const std::string PARAMATERS_EXTENSION = ".params";
 static const std::string SWAP_FILE_EXTENSION = ".swp";
+/** The file holding the metadata of the last message compacted out of a log */
+static const std::string CHECKPOINT_EXTENSION = ".checkpoint";
+
+/** The start of a file holding one saved object, such as a View */
+struct __attribute__((__packed__)) saved_object_header {
+    uint8_t magic[8];
+    uint32_t version;
+    /** CRC-32 of the serialized object */
+    uint32_t checksum;
+    /** Size of the serialized object, which follows the header */
+    uint64_t size;
+};
+
+static const uint8_t SAVED_OBJECT_MAGIC[8] = {'D', 'R', 'C', 'H', 'O', 'B', 'J', 0};
+static const uint32_t SAVED_OBJECT_VERSION = 1;
+
+/** @return The CRC-32 (as used by zlib) of a buffer. */
+uint32_t crc32(const char* data, std::size_t size);
+
+/**
+ * Serializes an object into the contents of a saved-object file: a
+ * saved_object_header followed by the object's mutils serialization.
+ */
+template <typename T>
+std::vector<char> saved_object_bytes(const T& object) {
+    const std::size_t size = mutils::bytes_size(object);
+    std::vector<char> contents(sizeof(saved_object_header) + size);
+    char* const body = contents.data() + sizeof(saved_object_header);
+    mutils::to_bytes(object, body);
+    saved_object_header header;
+    std::copy(std::begin(SAVED_OBJECT_MAGIC), std::end(SAVED_OBJECT_MAGIC), header.magic);
+    header.version = SAVED_OBJECT_VERSION;
+    header.checksum = crc32(body, size);
+    header.size = size;
+    std::memcpy(contents.data(), &header, sizeof(header));
+    return contents;
+}
+
+/**
+ * Writes the contents of a saved-object file using the "safe save" method:
+ * the contents are written and synced to a swap file first, which is then
+ * atomically renamed over the old file, so a crash leaves either the old
+ * file or the new one complete.
+ */
+void write_saved_object(const std::string& filename, const std::vector<char>& contents);
+
+/**
+ * A saved-object file mapped into memory, whose serialized object can be
+ * deserialized in place. Files in the older format (the size of the object
+ * followed by the object, with no header) are still accepted.
+ */
+class MappedSavedObject {
+    void* mapping = nullptr;
+    std::size_t mapping_size = 0;
+    const char* object = nullptr;
+
+public:
+    /** Maps the file; whether it holds a complete, uncorrupted object can be
+     * checked with valid(). */
+    explicit MappedSavedObject(const std::string& filename);
+    ~MappedSavedObject();
+    MappedSavedObject(const MappedSavedObject&) = delete;
+    MappedSavedObject& operator=(const MappedSavedObject&) = delete;
+    /** @return True if the file exists and its object is complete and matches its checksum. */
+    bool valid() const { return object != nullptr; }
+    /** @return The serialized object, or nullptr if the file isn't valid. */
+    const char* data() const { return object; }
+};
 
 /**
- * Persists an object to disk, using mutils-serialization functions. Uses the
- * "safe save" method (writing to a swap file first) to handle crashes during
- * the write to disk. The created file will first contain the size of the
- * serialized object, followed by the serialized object itself.
+ * Writes saved-object files on a background thread, so that saving an
+ * object (e.g. the View at every view change) doesn't wait for the disk.
+ * If an object is saved again before its previous version has been
+ * written, only the newest version is written.
+ */
+class SavedObjectWriter {
+    std::mutex pending_mutex;
+    std::condition_variable pending_cv;
+    /** Protected by pending_mutex; the contents to write, by filename */
+    std::map<std::string, std::vector<char>> pending;
+    /** Protected by pending_mutex; true while the thread is writing a file */
+    bool writing = false;
+    bool shutdown = false;
+    std::thread writer_thread;
+
+    void write_loop();
+
+public:
+    SavedObjectWriter();
+    /** Writes anything still pending before returning. */
+    ~SavedObjectWriter();
+    /** Queues the contents of a saved-object file to be written. */
+    void write(const std::string& filename, std::vector<char> contents);
+    /** Waits until everything queued so far has been written. */
+    void flush();
+};
+
+/**
+ * Persists an object to disk, using mutils-serialization functions, in a
+ * saved-object file: a header with the size and checksum of the serialized
+ * object, followed by the serialized object itself. The file is replaced
+ * atomically with write_saved_object, to handle crashes during the write.
  * @param object Any object that is serializable using mutils::to_bytes
  * @param filename The name of the file to create when saving this object to disk.
  */
 template <typename T>
 void persist_object(const T& object, const std::string& filename) {
-    std::ofstream swap_file(filename + SWAP_FILE_EXTENSION);
-    auto swap_file_write_func = [&](char const* const c, std::size_t n) {
-        swap_file.write(c, n);
-    };
-    mutils::post_object(swap_file_write_func, mutils::bytes_size(object));
-    mutils::post_object(swap_file_write_func, object);
-    swap_file.close();
-
-    if(std::rename((filename + SWAP_FILE_EXTENSION).c_str(), filename.c_str()) < 0) {
-        std::cerr << "Error updating saved-state file on disk! " << strerror(errno) << std::endl;
+    write_saved_object(filename, saved_object_bytes(object));
+}
+
+/**
+ * Same as persist_object, but the file is written by a SavedObjectWriter in
+ * the background; the object is serialized before this returns.
+ */
+template <typename T>
+void persist_object_async(const T& object, const std::string& filename, SavedObjectWriter& writer) {
+    writer.write(filename, saved_object_bytes(object));
+}
+
+/**
+ * Loads an object from a saved-object file, if the file holds a complete,
+ * uncorrupted one.
+ * @return A new object of type T, or nullptr
+ */
+template <typename T>
+std::unique_ptr<T> load_object_file(const std::string& filename) {
+    MappedSavedObject file(filename);
+    if(!file.valid()) {
+        return nullptr;
     }
+    return mutils::from_bytes<T>(nullptr, file.data());
 }
 
 /**
@@ -76,50 +197,23 @@ void persist_object(const T& object, const std::string& filename) {
  * mutils-serialization deserialize functions. This function tries to load the
  * object from both the given filename and its corresponding swap file, and
  * returns the object from the swap file if (and only if) the object from the
- * expected file is empty or incomplete.
+ * expected file is missing, incomplete, or corrupted.
  * @param filename The name of the file to read for a serialized object
  * @return (by pointer) A new object of type T constructed with the data in this file
  */
 template <typename T>
 std::unique_ptr<T> load_object(const std::string& filename) {
-    std::ifstream file(filename);
-    std::ifstream swap_file(filename + persistence::SWAP_FILE_EXTENSION);
-    std::unique_ptr<T> object;
-    std::unique_ptr<T> swap_object;
-    //The expected saved-parameters file might not exist, in which case we'll fall back to the swap file
-    if(file.good()) {
-        //Each file contains the size of the object (an int copied as bytes),
-        //followed by a serialized object
-        std::size_t size_of_object;
-        file.read((char*)&size_of_object, sizeof(size_of_object));
-        char buffer[size_of_object];
-        file.read(buffer, size_of_object);
-        //If the file doesn't contain a complete object (due to a crash
-        //during writing), the read() call will set failbit. In that case,
-        //leave object a null pointer.
-        if(!file.fail()) {
-            object = mutils::from_bytes<T>(nullptr, buffer);
-        }
-    }
-    if(swap_file.good()) {
-        std::size_t size_of_object;
-        swap_file.read((char*)&size_of_object, sizeof(size_of_object));
-        char buffer[size_of_object];
-        swap_file.read(buffer, size_of_object);
-        if(!swap_file.fail()) {
-            swap_object = mutils::from_bytes<T>(nullptr, buffer);
-        }
-    }
+    std::unique_ptr<T> object = load_object_file<T>(filename);
     if(object == nullptr) {
-        return swap_object;
-    } else {
-        return object;
+        return load_object_file<T>(filename + SWAP_FILE_EXTENSION);
     }
+    return object;
 }
 
 }  // namespace persistence
 
 using persistence::persist_object;
+using persistence::persist_object_async;
 using persistence::load_object;
 
 }  // namespace derecho
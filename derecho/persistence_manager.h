@@ -9,12 +9,14 @@
 #include <atomic>
 #include <chrono>
 #include <errno.h>
-#include <queue>
-#include <semaphore.h>
+#include <map>
 #include <thread>
 
 #include "derecho_internal.h"
+#include "metrics.h"
+#include "mpsc_queue.h"
 #include "replicated.h"
+#include "thread_placement.h"
 
 #include "mutils-containers/KindMap.hpp"
 #include "persistent/Persistent.hpp"
@@ -24,7 +26,11 @@ namespace derecho {
 
 template <typename T>
 using replicated_index_map = std::map<uint32_t, Replicated<T>>;
-using persistence_request_t = std::tuple<subgroup_id_t, persistence_version_t>;
+/** A subgroup, the version to persist, and when the request was posted, by
+ * metrics::now_ns() */
+using persistence_request_t = std::tuple<subgroup_id_t, persistence_version_t, uint64_t>;
+/** The maximum number of outstanding persistence requests */
+#define PERSISTENCE_REQUEST_QUEUE_SIZE (4096)
 
 /**
    * PersistenceManager is responsible for persisting all the data in a group.
@@ -39,10 +45,9 @@ private:
     std::thread persist_thread;
     /** A flag to singal the persistent thread to shutdown; set to true when the group is destroyed. */
     std::atomic<bool> thread_shutdown;
-    /** The semaphore for persistence request the persistent thread */
-    sem_t persistence_request_sem;
-    /** a queue for the requests */
-    std::queue<persistence_request_t> persistence_request_queue;
+    /** a queue for the requests; the delivery path pushes onto it without
+     * any system calls, and the persistent thread pops from it */
+    MPSCQueue<persistence_request_t, PERSISTENCE_REQUEST_QUEUE_SIZE> persistence_request_queue;
 
     /** persistence callback */
     persistence_callback_t persistence_callback;
@@ -51,6 +56,41 @@ private:
     /** View Manager pointer. Need to access the SST for the purpose of updating persisted_num*/
     ViewManager *view_manager;
 
+    /**
+     * Persists all versions up to version of the subgroup, publishes the new
+     * persisted_num in the SST, and calls the persistence callback.
+     */
+    void persist_and_update_sst(const subgroup_id_t &subgroup_id, const persistence_version_t &version) {
+        try {
+            this->replicated_objects->for_each([&](auto *pkey, replicated_index_map<auto> &map) {
+                auto search = map.find(subgroup_id);
+                if(search != map.end()) {
+                    search->second.persist(version);
+                }
+            });
+            // read lock the view
+            std::shared_lock<std::shared_timed_mutex> read_lock(view_manager->view_mutex);
+            // update the persisted_num in SST, unless the delivery path
+            // already did for remote persistence
+
+            View &Vc = *view_manager->curr_view;
+            if(Vc.multicast_group->remote_persistence_replicas == 0) {
+                Vc.gmsSST->persisted_num[Vc.gmsSST->get_local_index()][subgroup_id] = version;
+                Vc.gmsSST->put(Vc.multicast_group->get_shard_sst_indices(subgroup_id),
+                               (char *)std::addressof(Vc.gmsSST->persisted_num[0][subgroup_id]) - Vc.gmsSST->getBaseAddress(),
+                               sizeof(long long int));
+            }
+        } catch(uint64_t exp) {
+            logger->debug("exception on persist():subgroup={},ver={},exp={}.", subgroup_id, version, exp);
+            std::cout << "exception on persistent:subgroup=" << subgroup_id << ",ver=" << version << "exception=0x" << std::hex << exp << std::endl;
+        }
+
+        // callback
+        if(this->persistence_callback != nullptr) {
+            this->persistence_callback(subgroup_id, version);
+        }
+    }
+
 public:
     /** Constructor
      * @param pro pointer to the replicated_objects.
@@ -62,10 +102,6 @@ public:
               thread_shutdown(false),
               persistence_callback(_persistence_callback),
               replicated_objects(pro) {
-        // initialize semaphore
-        if(sem_init(&persistence_request_sem, 1, 0) != 0) {
-            throw derecho_exception("Cannot initialize persistent_request_sem:errno=" + std::to_string(errno));
-        }
     }
 
     /** default Constructor
@@ -76,7 +112,6 @@ public:
     /** default Destructor
      */
     virtual ~PersistenceManager() {
-        sem_destroy(&persistence_request_sem);
     }
 
     /**
@@ -106,40 +141,39 @@ public:
         // if(replicated_objects == nullptr) return;
 
         this->persist_thread = std::thread{[this]() {
+            pthread_setname_np(pthread_self(), "persist_thread");
+            place_this_thread("persist_thread");
 	    std::cout << "The persist thread started" << std::endl;
             do {
-                // wait for semaphore
-                sem_wait(&persistence_request_sem);
-                subgroup_id_t subgroup_id = std::get<0>(persistence_request_queue.front());
-                persistence_version_t version = std::get<1>(persistence_request_queue.front());
-                persistence_request_queue.pop();
-
-                // persist
-
-                try {
-                    this->replicated_objects->for_each([&](auto *pkey, replicated_index_map<auto> &map) {
-                        auto search = map.find(subgroup_id);
-                        if(search != map.end()) {
-                            search->second.persist(version);
-                        }
-                    });
-                    // read lock the view
-                    std::shared_lock<std::shared_timed_mutex> read_lock(view_manager->view_mutex);
-                    // update the persisted_num in SST
-
-                    View &Vc = *view_manager->curr_view;
-                    Vc.gmsSST->persisted_num[Vc.gmsSST->get_local_index()][subgroup_id] = version;
-                    Vc.gmsSST->put(Vc.multicast_group->get_shard_sst_indices(subgroup_id),
-                                   (char *)std::addressof(Vc.gmsSST->persisted_num[0][subgroup_id]) - Vc.gmsSST->getBaseAddress(),
-                                   sizeof(long long int));
-                } catch(uint64_t exp) {
-                    logger->debug("exception on persist():subgroup={},ver={},exp={}.", subgroup_id, version, exp);
-                    std::cout << "exception on persistent:subgroup=" << subgroup_id << ",ver=" << version << "exception=0x" << std::hex << exp << std::endl;
+                // wait for a request: spins for a while, then sleeps
+                persistence_request_t request;
+                if(!persistence_request_queue.pop(request, thread_shutdown)) {
+                    continue;
                 }
-
-                // callback
-                if(this->persistence_callback != nullptr) {
-                    this->persistence_callback(subgroup_id, version);
+                // Group commit: drain every request that is already queued and
+                // keep only the latest version of each subgroup, since
+                // persisting version v also persists all versions before it.
+                std::map<subgroup_id_t, persistence_version_t> latest_versions;
+                std::map<subgroup_id_t, std::vector<uint64_t>> post_times;
+                do {
+                    subgroup_id_t subgroup_id = std::get<0>(request);
+                    persistence_version_t version = std::get<1>(request);
+                    auto search = latest_versions.find(subgroup_id);
+                    if(search == latest_versions.end() || search->second < version) {
+                        latest_versions[subgroup_id] = version;
+                    }
+                    post_times[subgroup_id].push_back(std::get<2>(request));
+                } while(persistence_request_queue.try_pop(request));
+
+                for(const auto &subgroup_and_version : latest_versions) {
+                    persist_and_update_sst(subgroup_and_version.first, subgroup_and_version.second);
+                    const std::vector<uint64_t> &times = post_times[subgroup_and_version.first];
+                    metrics::SubgroupMetrics &subgroup_metrics = metrics::registry().subgroup(subgroup_and_version.first);
+                    subgroup_metrics.persist_batch_size.record(times.size());
+                    const uint64_t now = metrics::now_ns();
+                    for(uint64_t post_time : times) {
+                        subgroup_metrics.delivery_to_persist_ns.record(now - post_time);
+                    }
                 }
 
             } while(!this->thread_shutdown || !this->persistence_request_queue.empty());
@@ -149,10 +183,18 @@ public:
 
     /** post a persistence request */
     void post_persist_request(const subgroup_id_t & subgroup_id, const persistence_version_t & version) {
-        // request enqueue
-        persistence_request_queue.push(std::make_tuple(subgroup_id, version));
-        // post semaphore
-        sem_post(&persistence_request_sem);
+        // objects in coalesced versioning mode make their versions for the
+        // whole batch now, on the delivery thread
+        if(replicated_objects != nullptr) {
+            this->replicated_objects->for_each([&](auto *pkey, replicated_index_map<auto> &map) {
+                auto search = map.find(subgroup_id);
+                if(search != map.end()) {
+                    search->second.make_pending_version();
+                }
+            });
+        }
+        // request enqueue; this only makes a system call if the persist thread is asleep
+        persistence_request_queue.push(std::make_tuple(subgroup_id, version, metrics::now_ns()));
     }
 
     /** make a version */
@@ -175,6 +217,7 @@ public:
         if(replicated_objects == nullptr) return;  //skip for raw subgroups
 
         thread_shutdown = true;
+        persistence_request_queue.wake();
         if(wait) {
             this->persist_thread.join();
         }
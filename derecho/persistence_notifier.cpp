@@ -0,0 +1,61 @@
+/**
+ * @file persistence_notifier.cpp
+ *
+ * @date Oct 14, 2026
+ */
+
+#include "persistence_notifier.h"
+
+#include <pthread.h>
+
+#include "thread_placement.h"
+
+namespace derecho {
+
+PersistenceNotifier::PersistenceNotifier(const std::function<void(subgroup_id_t, persistence_version_t)>& callback)
+        : callback(callback),
+          notifier_thread(&PersistenceNotifier::notify_loop, this) {}
+
+PersistenceNotifier::~PersistenceNotifier() {
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        shutdown = true;
+    }
+    pending_cv.notify_all();
+    notifier_thread.join();
+}
+
+bool PersistenceNotifier::update(subgroup_id_t subgroup_num, persistence_version_t frontier) {
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        auto last = frontiers.find(subgroup_num);
+        if(last != frontiers.end() && last->second >= frontier) {
+            return false;
+        }
+        frontiers[subgroup_num] = frontier;
+        pending[subgroup_num] = frontier;
+    }
+    pending_cv.notify_all();
+    return true;
+}
+
+void PersistenceNotifier::notify_loop() {
+    pthread_setname_np(pthread_self(), "persist_notify");
+    place_this_thread("persist_notify");
+    std::unique_lock<std::mutex> lock(pending_mutex);
+    while(true) {
+        pending_cv.wait(lock, [this]() { return !pending.empty() || shutdown; });
+        // Everything pending is delivered before shutting down
+        if(pending.empty()) {
+            return;
+        }
+        std::map<subgroup_id_t, persistence_version_t> batch;
+        batch.swap(pending);
+        lock.unlock();
+        for(const auto& subgroup_and_frontier : batch) {
+            callback(subgroup_and_frontier.first, subgroup_and_frontier.second);
+        }
+        lock.lock();
+    }
+}
+}  // namespace derecho
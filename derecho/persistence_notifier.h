@@ -0,0 +1,54 @@
+/**
+ * @file persistence_notifier.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "derecho_internal.h"
+
+namespace derecho {
+
+/**
+ * Tracks the global persistence frontier of each subgroup, the smallest
+ * persisted_num in its shard, and calls the global persistence callback on
+ * its own thread. The persistence predicate only reports a frontier when it
+ * advances, which doesn't wait for the callback, so a slow callback can't
+ * hold up the SST predicate thread. If a subgroup's frontier advances
+ * several times while the callbacks are running, only the latest one is
+ * delivered; the frontiers of all the subgroups that advanced meanwhile are
+ * delivered together in the next batch.
+ */
+class PersistenceNotifier {
+    std::function<void(subgroup_id_t, persistence_version_t)> callback;
+    std::mutex pending_mutex;
+    std::condition_variable pending_cv;
+    /** Protected by pending_mutex; the frontiers not delivered yet */
+    std::map<subgroup_id_t, persistence_version_t> pending;
+    /** Protected by pending_mutex; the latest frontier of each subgroup */
+    std::map<subgroup_id_t, persistence_version_t> frontiers;
+    bool shutdown = false;
+    std::thread notifier_thread;
+
+    void notify_loop();
+
+public:
+    PersistenceNotifier(const std::function<void(subgroup_id_t, persistence_version_t)>& callback);
+    /** Delivers anything still pending before returning. */
+    ~PersistenceNotifier();
+    /**
+     * Reports a subgroup's global persistence frontier. It is ignored unless
+     * it is past the last one reported.
+     * @return True if the frontier advanced
+     */
+    bool update(subgroup_id_t subgroup_num, persistence_version_t frontier);
+};
+}  // namespace derecho
@@ -0,0 +1,108 @@
+/**
+ * @file pooled_allocator.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace derecho {
+
+/**
+ * A free list of memory blocks that are all the same size, which keeps the
+ * blocks that are freed and hands them out again instead of going back to the
+ * heap. Blocks may be freed on a different thread from the one that allocated
+ * them, as the replies to an RPC call are, so the list has a lock; it is held
+ * only to push or pop one pointer.
+ */
+template <std::size_t BlockSize, std::size_t Alignment>
+class BlockPool {
+    /** The most freed blocks the pool keeps; any more go back to the heap */
+    static constexpr std::size_t max_free_blocks = 4096;
+    std::mutex free_blocks_mutex;
+    std::vector<void*> free_blocks;
+
+    BlockPool() { free_blocks.reserve(max_free_blocks); }
+
+public:
+    /** The pool for this size. It is never destroyed, since blocks may be
+     * freed by static destructors that run after it would have been. */
+    static BlockPool& instance() {
+        static BlockPool* pool = new BlockPool();
+        return *pool;
+    }
+
+    void* allocate() {
+        {
+            std::lock_guard<std::mutex> lock(free_blocks_mutex);
+            if(!free_blocks.empty()) {
+                void* block = free_blocks.back();
+                free_blocks.pop_back();
+                return block;
+            }
+        }
+        return ::operator new(BlockSize);
+    }
+
+    void deallocate(void* block) {
+        {
+            std::lock_guard<std::mutex> lock(free_blocks_mutex);
+            if(free_blocks.size() < max_free_blocks) {
+                free_blocks.push_back(block);
+                return;
+            }
+        }
+        ::operator delete(block);
+    }
+};
+
+/**
+ * A standard allocator that takes single objects from the BlockPool for their
+ * size, for the small objects that are made and freed once per RPC call, such
+ * as a call's PendingResults (with std::allocate_shared), its promises' shared
+ * states and the nodes of the maps that track it. Once a node has sent a few
+ * calls, making these is a pop from a free list rather than a trip through
+ * the heap. Arrays of more than one object come from the heap as usual.
+ */
+template <typename T>
+struct PooledAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = PooledAllocator<U>;
+    };
+
+    PooledAllocator() noexcept = default;
+    template <typename U>
+    PooledAllocator(const PooledAllocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        static_assert(alignof(T) <= alignof(std::max_align_t),
+                      "PooledAllocator can't allocate over-aligned types");
+        if(n == 1) {
+            return static_cast<T*>(BlockPool<sizeof(T), alignof(T)>::instance().allocate());
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        if(n == 1) {
+            BlockPool<sizeof(T), alignof(T)>::instance().deallocate(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const PooledAllocator<T>&, const PooledAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const PooledAllocator<T>&, const PooledAllocator<U>&) { return false; }
+
+}  // namespace derecho
@@ -4,13 +4,66 @@
  * @date Feb 17, 2017
  */
 
+#include <cstring>
+#include <thread>
+
 #include "raw_subgroup.h"
 
 namespace derecho {
 
+RawSendRing* RawSubgroup::current_send_ring() {
+    if(!send_ring || send_ring->is_closed()) {
+        send_ring = group_view_manager.get_raw_send_ring(subgroup_id);
+    }
+    return send_ring.get();
+}
+
 char* RawSubgroup::get_sendbuffer_ptr(unsigned long long int payload_size, int pause_sending_turns, bool null_send) {
     if(is_valid()) {
-        return group_view_manager.get_sendbuffer_ptr(subgroup_id, payload_size, pause_sending_turns, false, null_send);
+        claimed_ring.reset();
+        RawSendRing* ring = use_send_ring ? current_send_ring() : nullptr;
+        if(!ring) {
+            return group_view_manager.get_sendbuffer_ptr(subgroup_id, payload_size, pause_sending_turns, false, null_send);
+        }
+        char* buf = ring->claim(payload_size, pause_sending_turns, null_send);
+        if(buf) {
+            claimed_ring = send_ring;
+            claimed_payload = buf;
+            claimed_pause_sending_turns = pause_sending_turns;
+            claimed_null_send = null_send;
+        }
+        return buf;
+    } else {
+        throw derecho::empty_reference_exception{"Attempted to use an empty RawSubgroup"};
+    }
+}
+
+char* RawSubgroup::wait_for_sendbuffer_ptr(unsigned long long int payload_size,
+                                           std::chrono::nanoseconds timeout,
+                                           uint64_t* wait_time_ns,
+                                           int pause_sending_turns, bool null_send) {
+    if(is_valid()) {
+        RawSendRing* ring = use_send_ring ? current_send_ring() : nullptr;
+        if(!ring) {
+            return group_view_manager.wait_for_sendbuffer_ptr(subgroup_id, payload_size, timeout, wait_time_ns,
+                                                              pause_sending_turns, false, null_send);
+        }
+        // No slot will ever fit it, so there is no point in waiting
+        if(payload_size + sizeof(header) > ring->get_max_msg_size()) {
+            return nullptr;
+        }
+        const auto start_time = std::chrono::steady_clock::now();
+        char* buf;
+        while(!(buf = get_sendbuffer_ptr(payload_size, pause_sending_turns, null_send))
+              && std::chrono::steady_clock::now() - start_time < timeout) {
+            std::this_thread::yield();
+        }
+        if(wait_time_ns) {
+            *wait_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    std::chrono::steady_clock::now() - start_time)
+                                    .count();
+        }
+        return buf;
     } else {
         throw derecho::empty_reference_exception{"Attempted to use an empty RawSubgroup"};
     }
@@ -18,7 +71,44 @@ char* RawSubgroup::get_sendbuffer_ptr(unsigned long long int payload_size, int p
 
 void RawSubgroup::send() {
     if(is_valid()) {
-        group_view_manager.send(subgroup_id);
+        if(!claimed_ring) {
+            group_view_manager.send(subgroup_id);
+            return;
+        }
+        std::shared_ptr<RawSendRing> closed_ring = std::move(claimed_ring);
+        if(closed_ring->publish()) {
+            return;
+        }
+        // The view changed after the buffer was handed out. The closed ring
+        // is kept until its message has been copied into the new view.
+        const char* payload = claimed_payload;
+        const unsigned long long int payload_size = closed_ring->claimed_payload_size();
+        const int pause_sending_turns = claimed_pause_sending_turns;
+        const bool null_send = claimed_null_send;
+        while(true) {
+            char* buf = get_sendbuffer_ptr(payload_size, pause_sending_turns, null_send);
+            if(!buf) {
+                std::this_thread::yield();
+                continue;
+            }
+            memcpy(buf, payload, payload_size);
+            if(!claimed_ring) {
+                group_view_manager.send(subgroup_id);
+                return;
+            }
+            std::shared_ptr<RawSendRing> ring = std::move(claimed_ring);
+            if(ring->publish()) {
+                return;
+            }
+        }
+    } else {
+        throw derecho::empty_reference_exception{"Attempted to use an empty RawSubgroup"};
+    }
+}
+
+void RawSubgroup::send_stream(const char* data, unsigned long long int size) {
+    if(is_valid()) {
+        group_view_manager.send_stream(subgroup_id, data, size);
     } else {
         throw derecho::empty_reference_exception{"Attempted to use an empty RawSubgroup"};
     }
@@ -31,4 +121,20 @@ uint64_t RawSubgroup::compute_global_stability_frontier() {
         throw derecho::empty_reference_exception{"Attempted to use an empty RawSubgroup"};
     }
 }
+
+void RawSubgroup::set_send_limit(const SendLimit& limit) {
+    if(is_valid()) {
+        group_view_manager.set_send_limit(subgroup_id, limit);
+    } else {
+        throw derecho::empty_reference_exception{"Attempted to use an empty RawSubgroup"};
+    }
+}
+
+void RawSubgroup::set_receive_allocator(receive_allocator_t allocator) {
+    if(is_valid()) {
+        group_view_manager.set_receive_allocator(subgroup_id, std::move(allocator));
+    } else {
+        throw derecho::empty_reference_exception{"Attempted to use an empty RawSubgroup"};
+    }
+}
 }
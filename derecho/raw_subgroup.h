@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include <chrono>
+
 #include "derecho_internal.h"
 #include "derecho_exception.h"
 #include "view_manager.h"
@@ -18,6 +20,21 @@ private:
     const subgroup_id_t subgroup_id;
     ViewManager& group_view_manager;
     bool valid;
+    /** True if the subgroup sends through a RawSendRing in the views that
+     * give it one */
+    const bool use_send_ring;
+    /** The ring of the latest view this RawSubgroup has sent in */
+    std::shared_ptr<RawSendRing> send_ring;
+    /** The ring the last buffer was handed out from, if it was, and what
+     * to claim in the next view's ring if it closes before send() */
+    std::shared_ptr<RawSendRing> claimed_ring;
+    const char* claimed_payload = nullptr;
+    int claimed_pause_sending_turns = 0;
+    bool claimed_null_send = false;
+
+    /** @return The current view's ring, which is only looked up again once
+     * the one from the last view has been closed, or null if there is none */
+    RawSendRing* current_send_ring();
 
 public:
     RawSubgroup(node_id_t node_id,
@@ -26,12 +43,14 @@ public:
             : node_id(node_id),
               subgroup_id(subgroup_id),
               group_view_manager(view_manager),
-              valid(true) {}
+              valid(true),
+              use_send_ring(view_manager.uses_raw_send_rings()) {}
 
     RawSubgroup(node_id_t node_id, ViewManager& view_manager) : node_id(node_id),
                                                                 subgroup_id(0),
                                                                 group_view_manager(view_manager),
-                                                                valid(false) {}
+                                                                valid(false),
+                                                                use_send_ring(false) {}
 
     /**
      * @return True if this RawSubgroup is a valid reference to a raw subgroup,
@@ -42,18 +61,56 @@ public:
 
     /**
      * Gets a pointer into the send buffer for multicasts to this subgroup.
+     * With DerechoParams::raw_send_rings, the buffer is the next slot of the
+     * subgroup's RawSendRing, and only one thread may send at a time.
      * @param payload_size The size of the payload that the caller intends to
      * send, in bytes.
      * @param pause_sending_turns
      * @return
      */
     char* get_sendbuffer_ptr(unsigned long long int payload_size, int pause_sending_turns = 0, bool null_send = false);
+    /**
+     * Blocking version of get_sendbuffer_ptr: waits, without spinning, until
+     * the send window has room for another message or the timeout expires.
+     * A RawSendRing has nothing to sleep on, so waiting for one of its slots
+     * yields the CPU between tries instead.
+     * @param payload_size The size of the payload that the caller intends to
+     * send, in bytes.
+     * @param timeout The maximum amount of time to wait
+     * @param wait_time_ns If not null, set to the time the caller spent waiting
+     * @return A pointer into the send buffer, or nullptr on timeout
+     */
+    char* wait_for_sendbuffer_ptr(unsigned long long int payload_size,
+                                  std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max(),
+                                  uint64_t* wait_time_ns = nullptr,
+                                  int pause_sending_turns = 0, bool null_send = false);
     uint64_t compute_global_stability_frontier();
+    /**
+     * Lets the application give the memory that messages to this subgroup
+     * are received into, so that the delivery upcall finds them already in
+     * place; see receive_allocator_t. Null goes back to Derecho's own buffers.
+     */
+    void set_receive_allocator(receive_allocator_t allocator);
+    /**
+     * Limits this node's sending in the subgroup; see SendLimit. A send the
+     * limit doesn't admit yet gets nullptr from get_sendbuffer_ptr.
+     */
+    void set_send_limit(const SendLimit& limit);
 
     /**
      * Submits the contents of the send buffer to be sent on the next ordered
-     * multicast to the subgroup.
+     * multicast to the subgroup. If the buffer came from a RawSendRing that
+     * was closed by a view change in the meantime, the message is copied
+     * into a buffer of the new view and sent from there.
      */
     void send();
+    /**
+     * Multicasts a message that may be larger than max_payload_size, in
+     * fragments, and blocks until they have all been handed to Derecho; see
+     * ViewManager::send_stream. The delivery upcall gets the whole message
+     * once. Not for subgroups in Mode::RAW, or for use while a buffer from
+     * get_sendbuffer_ptr is waiting to be sent.
+     */
+    void send_stream(const char* data, unsigned long long int size);
 };
 }
@@ -0,0 +1,76 @@
+/**
+ * @file rdma_device.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+extern "C" {
+#include <infiniband/verbs.h>
+}
+
+namespace derecho {
+
+/**
+ * How the SST and RDMC address their queue pairs on the device they open, so
+ * that they run over any verbs provider: InfiniBand, RoCE NICs, and the
+ * kernel's Soft-RoCE driver (rdma_rxe), which gives a host whose Ethernet NIC
+ * has no RDMA support a verbs device of its own. Header-only, like
+ * thread_placement.h, since both libraries use it.
+ */
+namespace rdma_device {
+
+/** @return True if the GID is an IPv4 address mapped into IPv6 (::ffff:a.b.c.d) */
+inline bool is_ipv4_mapped(const ibv_gid& gid) {
+    static const uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    return memcmp(gid.raw, prefix, sizeof(prefix)) == 0;
+}
+
+/** @return The type the kernel gives a GID, such as "RoCE v2", or "" if it doesn't say */
+inline std::string gid_type(ibv_context* ctx, int port, int index) {
+    std::ifstream type_file(std::string("/sys/class/infiniband/") + ibv_get_device_name(ctx->device)
+                            + "/ports/" + std::to_string(port) + "/gid_attrs/types/" + std::to_string(index));
+    std::string type;
+    std::getline(type_file, type);
+    return type;
+}
+}  // namespace rdma_device
+
+/**
+ * Chooses the GID index to connect queue pairs with. DERECHO_GID_INDEX sets
+ * it outright. Otherwise, on InfiniBand it is 0, and on Ethernet it is the
+ * first GID that carries the port's IPv4 address, preferring RoCE v2, which
+ * is routable; the default GID there is a link-local address that only works
+ * within one subnet. Every node must make the same kind of choice.
+ */
+inline int choose_gid_index(ibv_context* ctx, int port, const ibv_port_attr& port_attr) {
+    const char* configured = getenv("DERECHO_GID_INDEX");
+    if(configured) {
+        return atoi(configured);
+    }
+    if(port_attr.link_layer != IBV_LINK_LAYER_ETHERNET) {
+        return 0;
+    }
+    int ipv4_index = -1;
+    for(int index = 0; index < port_attr.gid_tbl_len; ++index) {
+        ibv_gid gid;
+        if(ibv_query_gid(ctx, port, index, &gid) || !rdma_device::is_ipv4_mapped(gid)) {
+            continue;
+        }
+        if(rdma_device::gid_type(ctx, port, index) == "RoCE v2") {
+            return index;
+        }
+        if(ipv4_index < 0) {
+            ipv4_index = index;
+        }
+    }
+    return ipv4_index >= 0 ? ipv4_index : 0;
+}
+
+}  // namespace derecho
@@ -0,0 +1,101 @@
+/**
+ * @file received_window.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace derecho {
+
+/**
+ * Tracks which message indices have been received from one sender, when
+ * they can arrive out of order (a sender's RDMC and SST multicasts overtake
+ * each other), to compute how many have been received in order. The indices
+ * past the first missing one are bits in a ring of 64-bit words, addressed by
+ * index, so marking a range sets a few bits and advancing past it counts
+ * trailing ones, without allocating. The ring starts out covering the send
+ * window and doubles if a range lands beyond it, which only a sender
+ * skipping many turns at once can cause.
+ */
+class ReceivedWindow {
+    std::vector<uint64_t> words;
+    std::size_t mask;
+    /** The first index that has not been received */
+    long long int next = 0;
+
+    uint64_t& word_for(long long int word_num) {
+        return words[static_cast<std::size_t>(word_num) & mask];
+    }
+
+    /** Grows the ring until the word holding index last fits in it. */
+    void grow_to_fit(long long int last) {
+        const long long int first_word = next >> 6;
+        std::size_t capacity = words.size();
+        while(static_cast<std::size_t>((last >> 6) - first_word) >= capacity) {
+            capacity *= 2;
+        }
+        if(capacity == words.size()) {
+            return;
+        }
+        std::vector<uint64_t> old_words(capacity, 0);
+        old_words.swap(words);
+        const std::size_t old_mask = mask;
+        mask = capacity - 1;
+        for(std::size_t i = 0; i < old_words.size(); ++i) {
+            word_for(first_word + i) = old_words[(first_word + i) & old_mask];
+        }
+    }
+
+public:
+    /**
+     * @param window_size The number of indices that can be outstanding at
+     * once; the ring is preallocated to cover them.
+     */
+    explicit ReceivedWindow(std::size_t window_size = 64) {
+        std::size_t capacity = 1;
+        while(capacity * 64 < window_size + 64) {
+            capacity *= 2;
+        }
+        words.assign(capacity, 0);
+        mask = capacity - 1;
+    }
+
+    /**
+     * Marks the indices from beg_index to end_index, inclusive, as received.
+     * @return The largest index up to which every index has been received,
+     * or -1 if index 0 hasn't been
+     */
+    long long int receive(long long int beg_index, long long int end_index) {
+        if(beg_index < next) {
+            beg_index = next;
+        }
+        if(beg_index <= end_index) {
+            grow_to_fit(end_index);
+            for(long long int w = beg_index >> 6; w <= (end_index >> 6); ++w) {
+                const int lo = (w == (beg_index >> 6)) ? (beg_index & 63) : 0;
+                const int hi = (w == (end_index >> 6)) ? (end_index & 63) : 63;
+                const uint64_t bits = (hi == 63 ? ~0ull : ((1ull << (hi + 1)) - 1)) & ~((1ull << lo) - 1);
+                word_for(w) |= bits;
+            }
+        }
+        // Skip the received indices; a word is cleared for reuse once all
+        // of its indices have been passed
+        while(true) {
+            uint64_t& word = word_for(next >> 6);
+            const uint64_t missing = ~word >> (next & 63);
+            if(missing != 0) {
+                next += __builtin_ctzll(missing);
+                break;
+            }
+            word = 0;
+            next = ((next >> 6) + 1) << 6;
+        }
+        return next - 1;
+    }
+};
+}  // namespace derecho
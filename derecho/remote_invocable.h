@@ -6,13 +6,19 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstring>
 #include <functional>
+#include <memory>
 #include <numeric>
+#include <tuple>
+#include <utility>
 
 #include "mutils-serialization/SerializationSupport.hpp"
 #include "mutils/FunctionalMap.hpp"
 #include "mutils/tuple_extras.hpp"
 
+#include "metrics.h"
 #include "rpc_utils.h"
 
 namespace derecho {
@@ -28,6 +34,90 @@ struct RemoteInvocable;
 template <FunctionTag, typename>
 struct RemoteInvoker;
 
+/**
+ * True if every type in the list is a POD type, which mutils serializes by
+ * copying its bytes; an RPC call whose arguments are all POD has a size known
+ * at compile time and can be serialized with plain memcpys.
+ */
+template <typename... Ts>
+struct all_pod : std::true_type {};
+
+template <typename T, typename... Rest>
+struct all_pod<T, Rest...>
+        : std::integral_constant<bool, std::is_pod<std::decay_t<T>>::value && all_pod<Rest...>::value> {};
+
+/** The total size of a list of types; the serialized size of POD arguments. */
+template <typename... Ts>
+struct pod_size : std::integral_constant<std::size_t, 0> {};
+
+template <typename T, typename... Rest>
+struct pod_size<T, Rest...>
+        : std::integral_constant<std::size_t, sizeof(std::decay_t<T>) + pod_size<Rest...>::value> {};
+
+/**
+ * The serialized size of an RPC return value; the size of its bytes if it is
+ * POD, since that is how mutils lays out POD types.
+ */
+template <typename T>
+std::size_t value_bytes_size(const T& value) {
+    if(std::is_pod<T>::value) {
+        return sizeof(T);
+    }
+    return mutils::bytes_size(value);
+}
+
+template <typename T>
+std::size_t value_to_bytes(std::true_type, const T& value, char* buf) {
+    memcpy(buf, &value, sizeof(T));
+    return sizeof(T);
+}
+
+template <typename T>
+std::size_t value_to_bytes(std::false_type, const T& value, char* buf) {
+    return mutils::to_bytes(value, buf);
+}
+
+/** Serializes an RPC return value, with a single memcpy if it is POD. */
+template <typename T>
+std::size_t value_to_bytes(const T& value, char* buf) {
+    return value_to_bytes(std::integral_constant<bool, std::is_pod<T>::value>{}, value, buf);
+}
+
+template <typename T>
+T value_from_bytes(std::true_type, mutils::DeserializationManager*, const char* buf) {
+    T value;
+    memcpy(&value, buf, sizeof(T));
+    return value;
+}
+
+template <typename T>
+T value_from_bytes(std::false_type, mutils::DeserializationManager* dsm, const char* buf) {
+    return std::move(*mutils::from_bytes<T>(dsm, buf));
+}
+
+/**
+ * Deserializes an RPC return value written by value_to_bytes, copying it out
+ * of the buffer with a single memcpy if it is POD rather than allocating it.
+ */
+template <typename T>
+T value_from_bytes(mutils::DeserializationManager* dsm, const char* buf) {
+    return value_from_bytes<T>(std::integral_constant<bool, std::is_pod<T>::value>{}, dsm, buf);
+}
+
+/**
+ * Computes the size of the body of an RPC message (the invocation ID followed
+ * by the serialized arguments), at compile time if all the arguments are POD.
+ */
+template <typename... Args>
+std::size_t invocation_size(const Args&... a) {
+    if(all_pod<Args...>::value) {
+        return sizeof(long int) + pod_size<Args...>::value;
+    }
+    std::size_t size = sizeof(long int);
+    auto t = {std::size_t{0}, std::size_t{0}, mutils::bytes_size(a)...};
+    return size + std::accumulate(t.begin(), t.end(), std::size_t{0});
+}
+
 /**
  * Provides functions to implement RPC sends for function calls to a single
  * function, identified by its compile-time "tag" or ID.
@@ -44,10 +134,33 @@ struct RemoteInvoker<Tag, std::function<Ret(Args...)>> {
     const Opcode invoke_opcode;
     const Opcode reply_opcode;
 
-    //Maps invocation-instance IDs to results sets
-    std::map<std::size_t, PendingResults<Ret>> results_map;
+    //Maps invocation-instance IDs to results sets. The results are owned by
+    //the caller's QueryResults; an entry is removed once every node has
+    //replied, or when a reply finds that its QueryResults is gone. There is
+    //an entry per call, so its nodes come from the pools of PooledAllocator.
+    std::map<std::size_t, std::weak_ptr<PendingResults<Ret>>, std::less<std::size_t>,
+             PooledAllocator<std::pair<const std::size_t, std::weak_ptr<PendingResults<Ret>>>>>
+            results_map;
     std::mutex map_lock;
     using lock_t = std::unique_lock<std::mutex>;
+    /** Entries whose QueryResults are gone, but whose nodes never replied,
+     * are swept out of results_map once every this many sends. */
+    static constexpr std::size_t results_sweep_interval = 1024;
+    std::size_t sends_since_sweep = 0;
+
+    /** The number of queries sent with send_with_callback that can be awaiting
+     * replies at once; a reply to an older query than that is dropped. */
+    static constexpr std::size_t num_callback_slots = 256;
+    /** Where the callback for a query sent in callback mode waits for replies. */
+    struct CallbackSlot {
+        /** A spinlock, so that the callback isn't replaced while it's running */
+        std::atomic<bool> busy{false};
+        long int invocation_id = 0;
+        reply_callback_t<Ret> callback;
+    };
+    /** Indexed by callback-mode invocation ID, modulo num_callback_slots. */
+    std::unique_ptr<CallbackSlot[]> callback_slots;
+    std::atomic<uint64_t> next_callback_seq{0};
 
     /* use this from within a derived class to retrieve precisely this RemoteInvoker
      * (this way, all the inherited RemoteInvoker methods in the subclass do not need
@@ -73,6 +186,15 @@ struct RemoteInvoker<Tag, std::function<Ret(Args...)>> {
         return serialize_one(v, args...);
     }
 
+    inline std::size_t copy_pod(barray) { return 0; }
+
+    /** Serializes POD arguments by copying their bytes, as mutils would. */
+    template <typename A, typename... Rest>
+    inline std::size_t copy_pod(barray v, const A& a, const Rest&... rest) {
+        memcpy(v, &a, sizeof(A));
+        return sizeof(A) + copy_pod(v + sizeof(A), rest...);
+    }
+
     /**
      * Return type for the send function. Contains the RPC-invoking message
      * (in a buffer of size "size"), a set of futures for the results, and
@@ -94,25 +216,95 @@ struct RemoteInvoker<Tag, std::function<Ret(Args...)>> {
      */
     send_return send(const std::function<char*(int)>& out_alloc,
                      const std::decay_t<Args>&... a) {
-        auto invocation_id = mutils::long_rand();
-        std::size_t size = mutils::bytes_size(invocation_id);
-        {
-            auto t = {std::size_t{0}, std::size_t{0}, mutils::bytes_size(a)...};
-            size += std::accumulate(t.begin(), t.end(), 0);
+        // Callback-mode IDs are the only ones with callback_invocation_bit set
+        long int invocation_id = mutils::long_rand() & ~callback_invocation_bit;
+        auto serialized = serialize_invocation(invocation_id, out_alloc, a...);
+
+        // The results and their control block are one block from the pool,
+        // which is returned when the caller's QueryResults lets go of it
+        auto pending_results = std::allocate_shared<PendingResults<Ret>>(PooledAllocator<PendingResults<Ret>>{});
+        lock_t l{map_lock};
+        if(++sends_since_sweep == results_sweep_interval) {
+            sends_since_sweep = 0;
+            for(auto it = results_map.begin(); it != results_map.end();) {
+                it = it->second.expired() ? results_map.erase(it) : std::next(it);
+            }
         }
+        results_map[invocation_id] = pending_results;
+
+        return send_return{serialized.size, serialized.buf, pending_results->get_future(),
+                           *pending_results};
+    }
+
+    /**
+     * Return type for the send_with_callback function. Contains the
+     * RPC-invoking message, in a buffer of size "size".
+     */
+    struct send_callback_return {
+        std::size_t size;
+        char* buf;
+    };
+
+    /**
+     * Like send, but instead of creating promises and futures for the
+     * results, arranges for each reply to be handed straight to a callback
+     * when it is received. Only the most recent num_callback_slots queries
+     * sent this way can receive replies. The callback runs on the thread that
+     * receives the reply, so it should be short and must not block.
+     * @param out_alloc A function that can allocate buffers, which will be
+     * used to store the constructed message
+     * @param callback The function to call with each reply
+     * @param a The arguments to be used when calling the remote-invocable function
+     */
+    send_callback_return send_with_callback(const std::function<char*(int)>& out_alloc,
+                                            reply_callback_t<Ret> callback,
+                                            const std::decay_t<Args>&... a) {
+        const uint64_t seq = next_callback_seq++;
+        const long int invocation_id = callback_invocation_bit
+                                       | static_cast<long int>(seq & (callback_invocation_bit - 1));
+        auto serialized = serialize_invocation(invocation_id, out_alloc, a...);
+        CallbackSlot& slot = callback_slots[seq % num_callback_slots];
+        while(slot.busy.exchange(true, std::memory_order_acquire)) {
+        }
+        slot.invocation_id = invocation_id;
+        slot.callback = std::move(callback);
+        slot.busy.store(false, std::memory_order_release);
+        return serialized;
+    }
+
+    /**
+     * Writes an invocation ID and a list of arguments into a buffer allocated
+     * by out_alloc, forming the body of an RPC message.
+     */
+    send_callback_return serialize_invocation(long int invocation_id,
+                                              const std::function<char*(int)>& out_alloc,
+                                              const std::decay_t<Args>&... a) {
+        const std::size_t size = invocation_size(a...);
         char* serialized_args = out_alloc(size);
-        {
-            auto v = serialized_args + mutils::to_bytes(invocation_id, serialized_args);
-            auto check_size = mutils::bytes_size(invocation_id) + serialize_all(v, a...);
+        ((long int*)serialized_args)[0] = invocation_id;
+        auto v = serialized_args + sizeof(long int);
+        if(all_pod<Args...>::value) {
+            // Fast path: the size was known at compile time, so just copy the bytes
+            copy_pod(v, a...);
+        } else {
+            auto check_size = sizeof(long int) + serialize_all(v, a...);
             assert(check_size == size);
         }
+        return send_callback_return{size, serialized_args};
+    }
 
-        lock_t l{map_lock};
-        // default-initialize the maps
-        PendingResults<Ret>& pending_results = results_map[invocation_id];
-
-        return send_return{size, serialized_args, pending_results.get_future(),
-                           pending_results};
+    /**
+     * Hands a reply to a query sent in callback mode to its callback, unless
+     * the query's slot has since been reused by a newer query.
+     */
+    void complete_callback(long int invocation_id, const node_id_t& nid, const Ret* value) {
+        CallbackSlot& slot = callback_slots[(invocation_id & ~callback_invocation_bit) % num_callback_slots];
+        while(slot.busy.exchange(true, std::memory_order_acquire)) {
+        }
+        if(slot.invocation_id == invocation_id && slot.callback) {
+            slot.callback(nid, value);
+        }
+        slot.busy.store(false, std::memory_order_release);
     }
 
     /**
@@ -129,13 +321,42 @@ struct RemoteInvoker<Tag, std::function<Ret(Args...)>> {
             const std::function<definitely_char*(int)>&) {
         bool is_exception = response[0];
         long int invocation_id = ((long int*)(response + 1))[0];
-        assert(results_map.count(invocation_id));
+        if(invocation_id & callback_invocation_bit) {
+            if(is_exception) {
+                complete_callback(invocation_id, nid, nullptr);
+            } else {
+                const Ret value = value_from_bytes<Ret>(dsm, response + 1 + sizeof(invocation_id));
+                complete_callback(invocation_id, nid, &value);
+            }
+            return recv_ret{Opcode(), 0, nullptr, nullptr};
+        }
+        // Deserialize the reply before taking the lock that every reply to
+        // this function needs
+        std::unique_ptr<Ret> value;
+        if(!is_exception) {
+            value = std::make_unique<Ret>(value_from_bytes<Ret>(dsm, response + 1 + sizeof(invocation_id)));
+        }
         lock_t l{map_lock};
-        // TODO: garbage collection for the responses.
+        auto entry = results_map.find(invocation_id);
+        if(entry == results_map.end()) {
+            return recv_ret{Opcode(), 0, nullptr, nullptr};
+        }
+        auto pending_results = entry->second.lock();
+        // A reply to a query whose QueryResults was cancelled or destroyed is dropped
+        if(!pending_results) {
+            results_map.erase(entry);
+            return recv_ret{Opcode(), 0, nullptr, nullptr};
+        }
         if(is_exception) {
-            results_map.at(invocation_id).set_exception(nid, std::make_exception_ptr(remote_exception_occurred{nid}));
+            pending_results->set_exception(nid, std::make_exception_ptr(remote_exception_occurred{nid}));
         } else {
-            results_map.at(invocation_id).set_value(nid, *mutils::from_bytes<Ret>(dsm, response + 1 + sizeof(invocation_id)));
+            pending_results->set_value(nid, *value);
+        }
+        if(uint64_t send_time = pending_results->p2p_send_time.load(std::memory_order_relaxed)) {
+            metrics::registry().p2p_rtt_ns.record(metrics::now_ns() - send_time);
+        }
+        if(pending_results->all_replied()) {
+            results_map.erase(entry);
         }
         return recv_ret{Opcode(), 0, nullptr, nullptr};
     }
@@ -178,7 +399,10 @@ struct RemoteInvoker<Tag, std::function<Ret(Args...)>> {
      * @param who The list of nodes that will service this RPC call
      */
     inline void fulfill_pending_results_map(long int invocation_id, const node_list_t& who) {
-        results_map.at(invocation_id).fulfill_map(who);
+        lock_t l{map_lock};
+        if(auto pending_results = results_map.at(invocation_id).lock()) {
+            pending_results->fulfill_map(who);
+        }
     }
 
     /**
@@ -195,7 +419,8 @@ struct RemoteInvoker<Tag, std::function<Ret(Args...)>> {
     RemoteInvoker(const std::type_index& class_id, uint32_t instance_id,
                   std::map<Opcode, receive_fun_t>& receivers)
             : invoke_opcode{class_id, instance_id, Tag, false},
-              reply_opcode{class_id, instance_id, Tag, true} {
+              reply_opcode{class_id, instance_id, Tag, true},
+              callback_slots(new CallbackSlot[num_callback_slots]) {
         receivers[reply_opcode] = [this](auto... a) {
             return this->receive_response(a...);
         };
@@ -234,11 +459,13 @@ struct RemoteInvocable<Tag, std::function<Ret(Args...)>> {
     }
 
     template <typename fst, typename... rst>
-    std::tuple<std::unique_ptr<fst>, std::unique_ptr<rst>...> _deserialize(
+    std::tuple<mutils::context_ptr<fst>, mutils::context_ptr<rst>...> _deserialize(
             mutils::DeserializationManager* dsm, char const* const buf, fst*,
             rst*... rest) {
         using Type = std::decay_t<fst>;
-        auto ds = mutils::from_bytes<Type>(dsm, buf);
+        // Types that support it are deserialized in place, pointing into the
+        // message buffer, which stays valid until the RPC function returns
+        auto ds = mutils::from_bytes_noalloc<Type>(dsm, buf);
         const auto size = mutils::bytes_size(*ds);
         return std::tuple_cat(std::make_tuple(std::move(ds)),
                               _deserialize(dsm, buf + size, rest...));
@@ -246,16 +473,47 @@ struct RemoteInvocable<Tag, std::function<Ret(Args...)>> {
 
     /**
      * Deserializes a buffer containing a list of arguments into a tuple
-     * containing the arguments, deserialized.
+     * containing the arguments, deserialized. Arguments whose types can be
+     * deserialized in place (such as POD types and BytesView) point into the
+     * buffer rather than being copied, so the tuple must not outlive it.
      * @param dsm
      * @param buf The buffer containing serialized objects
      * @return A tuple of deserialized objects
      */
-    std::tuple<std::unique_ptr<std::decay_t<Args>>...> deserialize(
+    std::tuple<mutils::context_ptr<std::decay_t<Args>>...> deserialize(
             mutils::DeserializationManager* dsm, char const* const buf) {
         return _deserialize(dsm, buf, ((std::decay_t<Args>*)(nullptr))...);
     }
 
+    /** Calls the function with its arguments deserialized by mutils. */
+    inline Ret invoke_from_bytes(std::false_type, mutils::DeserializationManager* dsm, char const* const buf) {
+        return mutils::callFunc([&](const auto&... args) { return remote_invocable_function(*args...); },
+                                deserialize(dsm, buf));
+    }
+
+    /**
+     * Calls the function with POD arguments, which the sender packed back to
+     * back with copy_pod, copied straight out of the buffer with one memcpy
+     * each; the buffer isn't aligned for them, so they can't be used in place.
+     */
+    template <std::size_t... I>
+    inline Ret invoke_pod(char const* buf, std::index_sequence<I...>) {
+        std::tuple<std::decay_t<Args>...> args;
+        (void)std::initializer_list<int>{
+                (memcpy(&std::get<I>(args), buf, sizeof(std::get<I>(args))), buf += sizeof(std::get<I>(args)), 0)...};
+        (void)buf;
+        return remote_invocable_function(std::get<I>(args)...);
+    }
+
+    inline Ret invoke_from_bytes(std::true_type, mutils::DeserializationManager*, char const* const buf) {
+        return invoke_pod(buf, std::index_sequence_for<Args...>{});
+    }
+
+    /** Calls the function with the arguments serialized in buf. */
+    inline Ret invoke_from_bytes(mutils::DeserializationManager* dsm, char const* const buf) {
+        return invoke_from_bytes(std::integral_constant<bool, all_pod<Args...>::value>{}, dsm, buf);
+    }
+
     /**
      * Specialization of receive_call for non-void functions. After calling the
      * function locally, it constructs a message containing the return value to
@@ -270,14 +528,13 @@ struct RemoteInvocable<Tag, std::function<Ret(Args...)>> {
         long int invocation_id = ((long int*)_recv_buf)[0];
         auto recv_buf = _recv_buf + sizeof(long int);
         try {
-            const auto result = mutils::callFunc([&](const auto&... args) { return remote_invocable_function(*args...); },
-                                                 deserialize(dsm, recv_buf));
+            const auto result = invoke_from_bytes(dsm, recv_buf);
             // const auto result = remote_invocable_function(*deserialize<Args>(dsm, recv_buf)...);
-            const auto result_size = mutils::bytes_size(result) + sizeof(long int) + 1;
+            const auto result_size = value_bytes_size(result) + sizeof(long int) + 1;
             auto out = out_alloc(result_size);
             out[0] = false;
             ((long int*)(out + 1))[0] = invocation_id;
-            mutils::to_bytes(result, out + sizeof(invocation_id) + 1);
+            value_to_bytes(result, out + sizeof(invocation_id) + 1);
             return recv_ret{reply_opcode, result_size, out, nullptr};
         } catch(...) {
             char* out = out_alloc(sizeof(long int) + 1);
@@ -298,8 +555,7 @@ struct RemoteInvocable<Tag, std::function<Ret(Args...)>> {
                                  const std::function<char*(int)>&) {
         //TODO: Need to catch exceptions here, and possibly send them back, since void functions can still throw exceptions!
         auto recv_buf = _recv_buf + sizeof(long int);
-        mutils::callFunc([&](const auto&... args) { remote_invocable_function(*args...); },
-                         deserialize(dsm, recv_buf));
+        invoke_from_bytes(dsm, recv_buf);
         //remote_invocable_function(*deserialize<Args>(dsm, recv_buf)...);
         return recv_ret{reply_opcode, 0, nullptr};
     }
@@ -536,15 +792,22 @@ public:
             : RemoteInvocablePairs<WrappedFuns...>(std::type_index(typeid(IdentifyingClass)), instance_id, rvrs, fs.fun...),
               nid(nid) {}
 
+    /**
+     * Calls the method identified by the tag on the local instance of the
+     * wrapped class, without sending an RPC message.
+     * @param args The arguments to the method
+     * @return The method's return value
+     */
+    template <FunctionTag Tag, typename... Args>
+    auto invoke_local(Args&&... args) {
+        constexpr std::integral_constant<FunctionTag, Tag>* choice{nullptr};
+        auto& handler = this->get_handler(choice, args...);
+        return handler.remote_invocable_function(std::forward<Args>(args)...);
+    }
+
     template <FunctionTag Tag, typename... Args>
     std::size_t get_size(Args&&... a) {
-        auto invocation_id = mutils::long_rand();
-        std::size_t size = mutils::bytes_size(invocation_id);
-        {
-            auto t = {std::size_t{0}, std::size_t{0}, mutils::bytes_size(a)...};
-            size += std::accumulate(t.begin(), t.end(), 0);
-        }
-        return size;
+        return invocation_size(a...);
     }
 
     /**
@@ -587,6 +850,32 @@ public:
                            sent_return.pending};
     }
 
+    /**
+     * Constructs a message that will remotely invoke a method of this class
+     * in callback mode: each reply will be handed to the callback as soon as
+     * it arrives, rather than being stored in a QueryResults.
+     * @param out_alloc A function that can allocate a buffer for the message
+     * @param callback The function to call with each reply
+     * @param args The arguments that should be given to the method when
+     * invoking it
+     */
+    template <FunctionTag Tag, typename Callback, typename... Args>
+    void send_with_callback(const std::function<char*(int)>& out_alloc, Callback&& callback, Args&&... args) {
+        using namespace remote_invocation_utilities;
+
+        constexpr std::integral_constant<FunctionTag, Tag>* choice{nullptr};
+        auto& invoker = this->get_invoker(choice, args...);
+        const auto header_size = header_space();
+        auto sent_return = invoker.send_with_callback(
+                [&out_alloc, &header_size](std::size_t size) {
+                    return out_alloc(size + header_size) + header_size;
+                },
+                std::forward<Callback>(callback), std::forward<Args>(args)...);
+
+        char* buf = sent_return.buf - header_size;
+        populate_header(buf, sent_return.size, invoker.invoke_opcode, nid);
+    }
+
     using specialized_to = IdentifyingClass;
     RemoteInvocableClass& for_class(IdentifyingClass*) {
         return *this;
@@ -663,6 +952,32 @@ public:
         return send_return{std::move(sent_return.results),
                            sent_return.pending};
     }
+
+    /**
+     * Constructs a message that will remotely invoke a method of this class
+     * in callback mode: each reply will be handed to the callback as soon as
+     * it arrives, rather than being stored in a QueryResults.
+     * @param out_alloc A function that can allocate a buffer for the message
+     * @param callback The function to call with each reply
+     * @param args The arguments that should be given to the method when
+     * invoking it
+     */
+    template <FunctionTag Tag, typename Callback, typename... Args>
+    void send_with_callback(const std::function<char*(int)>& out_alloc, Callback&& callback, Args&&... args) {
+        using namespace remote_invocation_utilities;
+
+        constexpr std::integral_constant<FunctionTag, Tag>* choice{nullptr};
+        auto& invoker = this->get_invoker(choice, args...);
+        const auto header_size = header_space();
+        auto sent_return = invoker.send_with_callback(
+                [&out_alloc, &header_size](std::size_t size) {
+                    return out_alloc(size + header_size) + header_size;
+                },
+                std::forward<Callback>(callback), std::forward<Args>(args)...);
+
+        char* buf = sent_return.buf - header_size;
+        populate_header(buf, sent_return.size, invoker.invoke_opcode, nid);
+    }
 };
 
 /**
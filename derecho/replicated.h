@@ -6,11 +6,21 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <future>
+#include <iterator>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <tuple>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "mutils-serialization/SerializationSupport.hpp"
 #include "persistent/Persistent.hpp"
@@ -21,6 +31,8 @@
 #include "remote_invocable.h"
 #include "rpc_manager.h"
 #include "rpc_utils.h"
+#include "send_receipt.h"
+#include "snapshot.h"
 
 using namespace ns_persistent;
 
@@ -39,6 +51,15 @@ public:
     virtual ~ReplicatedObject() = default;
     virtual bool is_valid() const = 0;
     virtual std::size_t object_size() const = 0;
+    virtual void serialize_object(char* buffer) const = 0;
+    virtual std::size_t object_size_by_reference() = 0;
+    virtual void serialize_object_by_reference(char* buffer) = 0;
+    virtual std::vector<char> log_frontier() = 0;
+    virtual std::vector<char> log_catch_up(const char* receiver_frontier, const char* frontier) = 0;
+    virtual void apply_log_catch_up(const char* catch_up) = 0;
+    virtual std::vector<char> log_shipment(const char* receiver_frontier, persistence_version_t upto) = 0;
+    virtual std::vector<std::string> apply_log_shipment(const char* shipment) = 0;
+    virtual persistence_version_t checkpoint_logs(const std::string& target_path, const HLC& cut) = 0;
     virtual void send_object(tcp::socket& receiver_socket) const = 0;
     virtual void send_object_raw(tcp::socket& receiver_socket) const = 0;
     virtual std::size_t receive_object(char* buffer) = 0;
@@ -68,18 +89,90 @@ private:
     rpc::RPCManager& group_rpc_manager;
     /** The actual implementation of Replicated<T>, hiding its ugly template parameters. */
     std::unique_ptr<rpc::RemoteInvocableOf<T>> wrapped_this;
-    /** Buffer for replying to P2P messages, cached here so it doesn't need to be
-     * created in every p2p_send call. */
-    std::unique_ptr<char[]> p2pSendBuffer;
+    /** The time, in nanoseconds, that the most recent ordered send or query
+     * spent waiting for space in the send window. */
+    std::atomic<uint64_t> last_send_wait_ns{0};
+    /** If true, make_version() only records the version, and the persistent
+     * fields are versioned once per persistence request, see
+     * set_coalesced_versioning(). */
+    bool coalesce_versions = false;
+    /** The latest version recorded by make_version() in coalesced mode and
+     * not yet made, or -1 */
+    persistence_version_t pending_version = -1;
+    HLC pending_hlc;
+    /** The latest version delivered to this replica, which stable_query waits on */
+    struct VersionFrontier {
+        std::mutex mutex;
+        std::condition_variable cv;
+        persistence_version_t version = -1;
+    };
+    std::unique_ptr<VersionFrontier> delivered_frontier;
+    /** The snapshots asked for and not captured yet, which the next
+     * make_version() captures */
+    struct SnapshotRequests {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<snapshot::request>> pending;
+        /** Whether pending is non-empty, checked without the mutex */
+        std::atomic<bool> any{false};
+    };
+    std::unique_ptr<SnapshotRequests> snapshot_requests;
 
+    std::vector<std::unique_ptr<snapshot::request>> take_snapshot_requests() {
+        std::lock_guard<std::mutex> lock(snapshot_requests->mutex);
+        snapshot_requests->any = false;
+        std::vector<std::unique_ptr<snapshot::request>> requests;
+        requests.swap(snapshot_requests->pending);
+        return requests;
+    }
+
+    /** Captures the snapshots asked for with the object's own snapshot_state() */
+    void capture_snapshots(const persistence_version_t& ver, std::true_type) {
+        using state_t = typename decltype(std::declval<const T&>().snapshot_state())::element_type;
+        std::shared_ptr<state_t> state((*user_object_ptr)->snapshot_state());
+        snapshot::serialize_in_background(ver,
+                                          [state](std::vector<char>& buffer) {
+                                              buffer.resize(mutils::bytes_size(*state));
+                                              mutils::to_bytes(*state, buffer.data());
+                                          },
+                                          take_snapshot_requests());
+    }
+
+    /** Captures the snapshots asked for in a forked copy of the process */
+    void capture_snapshots(const persistence_version_t& ver, std::false_type) {
+        const T& object = **user_object_ptr;
+        PersistentRegistry* registry = persistent_registry_ptr.get();
+        snapshot::fork_and_serialize(ver,
+                                     [&object, registry](const snapshot::writer_t& write) {
+                                         // A state transfer in progress elsewhere doesn't apply here.
+                                         registry->setSerializeByReference(false);
+                                         mutils::post_object(write, object);
+                                     },
+                                     take_snapshot_requests());
+    }
+
+    /** Sends an ordered invocation; if receipt isn't null, it is set to the
+     * receipt of the message, or of the last one of a stream */
     template <rpc::FunctionTag tag, typename... Args>
-    auto ordered_send_or_query(const std::vector<node_id_t>& destination_nodes,
+    auto ordered_send_or_query(const std::vector<node_id_t>& destination_nodes, SendReceipt* receipt,
                                Args&&... args) {
         if(is_valid()) {
-            char* buffer;
-            while(!(buffer = group_rpc_manager.view_manager.get_sendbuffer_ptr(subgroup_id, wrapped_this->template get_size<tag>(std::forward<Args>(args)...), 0, true))) {
-            };
+            const std::size_t invocation_size = rpc::remote_invocation_utilities::header_space()
+                                                + wrapped_this->template get_size<tag>(std::forward<Args>(args)...);
+            const std::size_t nodelist_size = sizeof(std::size_t) + destination_nodes.size() * sizeof(node_id_t);
+            if(nodelist_size + invocation_size > group_rpc_manager.view_manager.derecho_params.max_payload_size) {
+                return ordered_stream_send_or_query<tag>(destination_nodes, receipt,
+                                                         nodelist_size + invocation_size,
+                                                         std::forward<Args>(args)...);
+            }
+            uint64_t wait_time_ns;
+            char* buffer = group_rpc_manager.view_manager.wait_for_sendbuffer_ptr(
+                    subgroup_id, wrapped_this->template get_size<tag>(std::forward<Args>(args)...),
+                    std::chrono::nanoseconds::max(), &wait_time_ns, 0, true);
+            last_send_wait_ns = wait_time_ns;
             std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+            if(receipt) {
+                *receipt = group_rpc_manager.view_manager.curr_view->multicast_group->last_send_receipt(subgroup_id);
+            }
 
             std::size_t max_payload_size;
             int buffer_offset = group_rpc_manager.populate_nodelist_header(destination_nodes,
@@ -103,6 +196,34 @@ private:
         }
     }
 
+    /** Sends an ordered invocation too large for one message as a stream,
+     * which its receivers put back together before they handle it */
+    template <rpc::FunctionTag tag, typename... Args>
+    auto ordered_stream_send_or_query(const std::vector<node_id_t>& destination_nodes, SendReceipt* receipt,
+                                      std::size_t message_size, Args&&... args) {
+        std::vector<char> message(message_size);
+        char* buffer = message.data();
+        {
+            std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+            std::size_t unused_max_payload_size;
+            buffer += group_rpc_manager.populate_nodelist_header(destination_nodes, buffer,
+                                                                 unused_max_payload_size);
+        }
+        const std::size_t capacity = message.data() + message.size() - buffer;
+        auto send_return_struct = wrapped_this->template send<tag>(
+                [&buffer, capacity](size_t size) -> char* {
+                    return size <= capacity ? buffer : nullptr;
+                },
+                std::forward<Args>(args)...);
+        group_rpc_manager.finish_rpc_stream_send(subgroup_id, destination_nodes, message,
+                                                 send_return_struct.pending);
+        if(receipt) {
+            std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+            *receipt = group_rpc_manager.view_manager.curr_view->multicast_group->last_send_receipt(subgroup_id);
+        }
+        return std::move(send_return_struct.results);
+    }
+
     template <rpc::FunctionTag tag, typename... Args>
     auto p2p_send_or_query(node_id_t dest_node, Args&&... args) {
         if(is_valid()) {
@@ -110,24 +231,39 @@ private:
             //Ensure a view change isn't in progress
             std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
             size_t size;
+            char* send_buffer = group_rpc_manager.p2p_send_buffer();
             auto max_payload_size = group_rpc_manager.view_manager.curr_view->multicast_group->max_msg_size - sizeof(header);
             auto return_pair = wrapped_this->template send<tag>(
-                    [this, &max_payload_size, &size](size_t _size) -> char* {
+                    [&send_buffer, &max_payload_size, &size](size_t _size) -> char* {
                         size = _size;
                         if(size <= max_payload_size) {
-                            return p2pSendBuffer.get();
+                            return send_buffer;
                         } else {
                             return nullptr;
                         }
                     },
                     std::forward<Args>(args)...);
-            group_rpc_manager.finish_p2p_send(dest_node, p2pSendBuffer.get(), size, return_pair.pending);
+            group_rpc_manager.finish_p2p_send(dest_node, send_buffer, size, return_pair.pending);
             return std::move(return_pair.results);
         } else {
             throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
         }
     }
 
+    /** The size of an invocation whose arguments are in a tuple, including its RPC header. */
+    template <rpc::FunctionTag tag, typename Tuple, std::size_t... I>
+    std::size_t batched_invocation_size(const Tuple& args, std::index_sequence<I...>) {
+        return rpc::remote_invocation_utilities::header_space()
+               + wrapped_this->template get_size<tag>(std::get<I>(args)...);
+    }
+
+    /** Writes an invocation whose arguments are in a tuple, like ordered_send_or_query. */
+    template <rpc::FunctionTag tag, typename Tuple, std::size_t... I>
+    auto send_batched_invocation(const std::function<char*(int)>& out_alloc, const Tuple& args,
+                                 std::index_sequence<I...>) {
+        return wrapped_this->template send<tag>(out_alloc, std::get<I>(args)...);
+    }
+
 public:
     /**
      * Constructs a Replicated<T> that enables sending and receiving RPC
@@ -148,7 +284,8 @@ public:
               subgroup_id(subgroup_id),
               group_rpc_manager(group_rpc_manager),
               wrapped_this(group_rpc_manager.make_remote_invocable_class(user_object_ptr.get(), subgroup_id, T::register_functions())),
-              p2pSendBuffer(new char[group_rpc_manager.view_manager.derecho_params.max_payload_size]) {
+              delivered_frontier(std::make_unique<VersionFrontier>()),
+              snapshot_requests(std::make_unique<SnapshotRequests>()) {
 #ifdef _DEBUG
         std::cout << "address of Replicated<T>=" << (void*)this << std::endl;
 #endif  //_DEBUG
@@ -173,7 +310,8 @@ public:
               subgroup_id(subgroup_id),
               group_rpc_manager(group_rpc_manager),
               wrapped_this(group_rpc_manager.make_remote_invocable_class(user_object_ptr.get(), subgroup_id, T::register_functions())),
-              p2pSendBuffer(new char[group_rpc_manager.view_manager.derecho_params.max_payload_size]) {}
+              delivered_frontier(std::make_unique<VersionFrontier>()),
+              snapshot_requests(std::make_unique<SnapshotRequests>()) {}
 
     // Replicated(Replicated&&) = default;
     Replicated(Replicated&& rhs) : persistent_registry_ptr(std::move(rhs.persistent_registry_ptr)),
@@ -182,7 +320,12 @@ public:
                                    subgroup_id(rhs.subgroup_id),
                                    group_rpc_manager(rhs.group_rpc_manager),
                                    wrapped_this(std::move(rhs.wrapped_this)),
-                                   p2pSendBuffer(std::move(rhs.p2pSendBuffer)) {
+                                   last_send_wait_ns(rhs.last_send_wait_ns.load()),
+                                   coalesce_versions(rhs.coalesce_versions),
+                                   pending_version(rhs.pending_version),
+                                   pending_hlc(rhs.pending_hlc),
+                                   delivered_frontier(std::move(rhs.delivered_frontier)),
+                                   snapshot_requests(std::move(rhs.snapshot_requests)) {
         persistent_registry_ptr->updateTemporalFrontierProvider(this);
     }
     Replicated(const Replicated&) = delete;
@@ -203,24 +346,115 @@ public:
      * template parameter, but does not wait for a response. This should only be
      * used for RPC functions whose return type is void.
      * @param args The arguments to the RPC function being invoked
+     * @return A receipt that tells when the message has become stable, been
+     * delivered here, or been persisted, without any replies
      */
     template <rpc::FunctionTag tag, typename... Args>
-    void ordered_send(const std::vector<node_id_t>& destination_nodes,
-                      Args&&... args) {
-        ordered_send_or_query<tag>(destination_nodes, std::forward<Args>(args)...);
+    SendReceipt ordered_send(const std::vector<node_id_t>& destination_nodes,
+                             Args&&... args) {
+        SendReceipt receipt;
+        ordered_send_or_query<tag>(destination_nodes, &receipt, std::forward<Args>(args)...);
+        return receipt;
     }
 
     /**
      * Sends a multicast to the entire subgroup that replicates this Replicated<T>,
      * invoking the RPC function identified by the FunctionTag template parameter,
      * but does not wait for a response. This should only be used for RPC functions
-     * whose return type is void.
+     * whose return type is void. An invocation larger than max_payload_size is
+     * sent as a stream of messages (see ViewManager::send_stream), and this
+     * blocks until all of them have been handed to Derecho.
      * @param args The arguments to the RPC function being invoked
+     * @return A receipt for the message, or for the last message of the stream
      */
     template <rpc::FunctionTag tag, typename... Args>
-    void ordered_send(Args&&... args) {
+    SendReceipt ordered_send(Args&&... args) {
+        // empty nodes means that the destination is the entire group
+        return ordered_send<tag>({}, std::forward<Args>(args)...);
+    }
+
+    /**
+     * Invokes the RPC function identified by the FunctionTag template
+     * parameter once for each set of arguments in a sequence, like a series
+     * of ordered_sends, but packs as many of the invocations as fit into each
+     * multicast message. The members of the subgroup run them in order, one
+     * message at a time, so small RPCs don't each pay the cost of a message.
+     * This should only be used for RPC functions whose return type is void.
+     * @param destination_nodes The IDs of the nodes that should be sent the
+     * RPC messages; if empty, the whole shard receives them
+     * @param arg_tuples A sequence of std::tuples, each holding the arguments
+     * of one invocation
+     */
+    template <rpc::FunctionTag tag, typename ArgTuples>
+    void ordered_send_batch(const std::vector<node_id_t>& destination_nodes,
+                            const ArgTuples& arg_tuples) {
+        if(!is_valid()) {
+            throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
+        }
+        using Tuple = std::decay_t<decltype(*std::begin(arg_tuples))>;
+        constexpr auto indices = std::make_index_sequence<std::tuple_size<Tuple>::value>{};
+        // Space for the list of destinations and the number of invocations
+        const std::size_t batch_header_size = 2 * sizeof(std::size_t) + destination_nodes.size() * sizeof(node_id_t);
+        const std::size_t max_batch_size = group_rpc_manager.view_manager.derecho_params.max_payload_size - batch_header_size;
+        std::vector<std::size_t> invocation_sizes;
+        std::vector<std::shared_ptr<rpc::PendingBase>> pending_results;
+        auto next = std::begin(arg_tuples);
+        const auto end = std::end(arg_tuples);
+        while(next != end) {
+            // Take as many invocations as fit in a message, but at least one
+            invocation_sizes.clear();
+            std::size_t batch_size = 0;
+            for(auto it = next; it != end; ++it) {
+                std::size_t size = batched_invocation_size<tag>(*it, indices);
+                if(!invocation_sizes.empty() && batch_size + size > max_batch_size) {
+                    break;
+                }
+                invocation_sizes.push_back(size);
+                batch_size += size;
+            }
+            uint64_t wait_time_ns;
+            char* buffer = group_rpc_manager.view_manager.wait_for_sendbuffer_ptr(
+                    subgroup_id, batch_header_size + batch_size,
+                    std::chrono::nanoseconds::max(), &wait_time_ns, 0, true);
+            last_send_wait_ns = wait_time_ns;
+            std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+
+            std::size_t max_payload_size;
+            buffer += group_rpc_manager.populate_batch_header(destination_nodes, invocation_sizes.size(),
+                                                              buffer, max_payload_size);
+            pending_results.clear();
+            for(std::size_t i = 0; i < invocation_sizes.size(); ++i, ++next) {
+                std::size_t written = 0;
+                auto send_return_struct = send_batched_invocation<tag>(
+                        [&buffer, &max_payload_size, &written](size_t size) -> char* {
+                            if(size <= max_payload_size) {
+                                written = size;
+                                return buffer;
+                            } else {
+                                return nullptr;
+                            }
+                        },
+                        *next, indices);
+                // Nothing waits for these results, so this keeps them alive
+                // until the batch has been sent
+                pending_results.emplace_back(send_return_struct.results.pending);
+                buffer += written;
+                max_payload_size -= written;
+            }
+            group_rpc_manager.finish_rpc_batch_send(subgroup_id, destination_nodes, pending_results);
+        }
+    }
+
+    /**
+     * Like ordered_send_batch, but sends the invocations to the entire
+     * subgroup that replicates this Replicated<T>.
+     * @param arg_tuples A sequence of std::tuples, each holding the arguments
+     * of one invocation
+     */
+    template <rpc::FunctionTag tag, typename ArgTuples>
+    void ordered_send_batch(const ArgTuples& arg_tuples) {
         // empty nodes means that the destination is the entire group
-        ordered_send<tag>({}, std::forward<Args>(args)...);
+        ordered_send_batch<tag>({}, arg_tuples);
     }
 
     /**
@@ -236,7 +470,7 @@ public:
     template <rpc::FunctionTag tag, typename... Args>
     auto ordered_query(const std::vector<node_id_t>& destination_nodes,
                        Args&&... args) {
-        return ordered_send_or_query<tag>(destination_nodes, std::forward<Args>(args)...);
+        return ordered_send_or_query<tag>(destination_nodes, nullptr, std::forward<Args>(args)...);
     }
 
     /**
@@ -254,6 +488,157 @@ public:
         return ordered_query<tag>({}, std::forward<Args>(args)...);
     }
 
+    /**
+     * Sends a multicast to the given nodes in the subgroup, like ordered_query,
+     * but hands each node's reply to a callback as soon as it is received
+     * instead of returning a QueryResults. This avoids allocating promises
+     * and futures for every query, but the callback only receives replies
+     * to one of the most recent few hundred callback-mode queries of this
+     * function, and is not told if a node fails before replying.
+     * @param destination_nodes The nodes in the subgroup that should receive
+     * the RPC message; if empty, the whole shard receives it
+     * @param callback A function taking the replying node's ID and a pointer
+     * to its reply (null if it threw an exception), which runs on the thread
+     * that delivers the reply and must not block
+     * @param args The arguments to the RPC function
+     */
+    template <rpc::FunctionTag tag, typename Callback, typename... Args>
+    void ordered_query_with_callback(const std::vector<node_id_t>& destination_nodes,
+                                     Callback&& callback, Args&&... args) {
+        if(is_valid()) {
+            uint64_t wait_time_ns;
+            char* buffer = group_rpc_manager.view_manager.wait_for_sendbuffer_ptr(
+                    subgroup_id, wrapped_this->template get_size<tag>(std::forward<Args>(args)...),
+                    std::chrono::nanoseconds::max(), &wait_time_ns, 0, true);
+            last_send_wait_ns = wait_time_ns;
+            std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+
+            std::size_t max_payload_size;
+            int buffer_offset = group_rpc_manager.populate_nodelist_header(destination_nodes,
+                                                                           buffer, max_payload_size);
+            buffer += buffer_offset;
+            wrapped_this->template send_with_callback<tag>(
+                    [&buffer, &max_payload_size](size_t size) -> char* {
+                        if(size <= max_payload_size) {
+                            return buffer;
+                        } else {
+                            return nullptr;
+                        }
+                    },
+                    std::forward<Callback>(callback), std::forward<Args>(args)...);
+            group_rpc_manager.finish_rpc_send_with_callback(subgroup_id);
+        } else {
+            throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
+        }
+    }
+
+    /**
+     * Runs the RPC function identified by the FunctionTag template parameter
+     * on this node's replica only, without sending any message. It waits for
+     * the delivery of any ordered message that is in progress, and the
+     * function sees the state left by the latest message delivered here,
+     * which other replicas may not have delivered yet. The function must not
+     * change the object or send messages in this subgroup.
+     * @param args The arguments to the RPC function
+     * @return The RPC function's return value
+     */
+    template <rpc::FunctionTag tag, typename... Args>
+    auto local_query(Args&&... args) {
+        if(!is_valid()) {
+            throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
+        }
+        std::shared_lock<std::shared_timed_mutex> delivery_lock(group_rpc_manager.delivery_locks.at(subgroup_id));
+        return wrapped_this->template invoke_local<tag>(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Like local_query, but first waits until this node's replica has
+     * delivered the message with the given version, so that the function
+     * sees at least the state after that message. Versions are the sequence
+     * numbers given to the persistent fields, so this is only useful in
+     * ordered subgroups.
+     * @param version The version the replica must have delivered
+     * @param args The arguments to the RPC function
+     * @return The RPC function's return value
+     */
+    template <rpc::FunctionTag tag, typename... Args>
+    auto stable_query(const persistence_version_t& version, Args&&... args) {
+        if(!is_valid()) {
+            throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
+        }
+        {
+            std::unique_lock<std::mutex> lock(delivered_frontier->mutex);
+            delivered_frontier->cv.wait(lock, [&]() { return delivered_frontier->version >= version; });
+        }
+        return local_query<tag>(std::forward<Args>(args)...);
+    }
+
+    /**
+     * @return True if this node is the leader of its shard and holds the
+     * shard's read lease, so that it can serve linearizable_query
+     */
+    bool holds_read_lease() {
+        std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+        return group_rpc_manager.view_manager.curr_view->multicast_group->holds_read_lease(subgroup_id);
+    }
+
+    /**
+     * Like local_query, but linearizable: the function sees every update that
+     * had been delivered at any replica before the call. This node must be
+     * the leader of its shard and hold the shard's read lease (see
+     * DerechoParams::read_lease_duration_us); the query then sends no
+     * messages, and only waits for the delivery of the ones this node has
+     * already received.
+     * @param args The arguments to the RPC function
+     * @return The RPC function's return value
+     * @throws read_lease_exception If this node doesn't hold the read lease,
+     * as during a view change; the caller can use ordered_query instead
+     */
+    template <rpc::FunctionTag tag, typename... Args>
+    auto linearizable_query(Args&&... args) {
+        if(!is_valid()) {
+            throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
+        }
+        bool leased;
+        {
+            std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+            leased = group_rpc_manager.view_manager.curr_view->multicast_group->wait_for_linearizable_read(subgroup_id);
+        }
+        if(!leased) {
+            throw derecho::read_lease_exception{"This node doesn't hold the read lease of subgroup "
+                                                + std::to_string(subgroup_id)};
+        }
+        return local_query<tag>(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Takes a snapshot of the object's state at the next version delivered to
+     * this replica, without holding up delivery while it is serialized; see
+     * derecho::snapshot for how it is captured. If nothing is delivered, the
+     * snapshot waits for the next message.
+     * @param sink Takes the serialized state on a background thread, e.g.
+     * to write it to disk or hand it to a state transfer
+     * @return A future for the version of the snapshot, ready once the sink
+     * has returned, or holding what it or the serialization threw
+     */
+    std::future<persistence_version_t> snapshot(const snapshot_sink_t& sink) {
+        auto request = std::make_unique<snapshot::request>();
+        request->sink = sink;
+        std::future<persistence_version_t> done = request->done.get_future();
+        std::lock_guard<std::mutex> lock(snapshot_requests->mutex);
+        snapshot_requests->pending.push_back(std::move(request));
+        snapshot_requests->any = true;
+        return done;
+    }
+
+    /**
+     * Takes a snapshot like snapshot(), and writes it to a file durably; the
+     * state can be read back with receive_object().
+     */
+    std::future<persistence_version_t> snapshot_to_file(const std::string& filename) {
+        return snapshot(snapshot::file_sink(filename));
+    }
+
     /**
      * Sends a peer-to-peer message over TCP to a single member of the subgroup
      * that replicates this Replicated<T>, invoking the RPC function identified
@@ -284,6 +669,41 @@ public:
         return p2p_send_or_query<tag>(dest_node, std::forward<Args>(args)...);
     }
 
+    /**
+     * Sends a peer-to-peer query to a single member of the subgroup, like
+     * p2p_query, but hands the reply to a callback as soon as it is received
+     * instead of returning a QueryResults. See ordered_query_with_callback for
+     * the limits of callback mode.
+     * @param dest_node The ID of the node that the P2P message should be sent to
+     * @param callback A function taking the replying node's ID and a pointer
+     * to its reply (null if it threw an exception)
+     * @param args The arguments to the RPC function being invoked
+     */
+    template <rpc::FunctionTag tag, typename Callback, typename... Args>
+    void p2p_query_with_callback(node_id_t dest_node, Callback&& callback, Args&&... args) {
+        if(is_valid()) {
+            assert(dest_node != node_id);
+            //Ensure a view change isn't in progress
+            std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+            size_t size;
+            char* send_buffer = group_rpc_manager.p2p_send_buffer();
+            auto max_payload_size = group_rpc_manager.view_manager.curr_view->multicast_group->max_msg_size - sizeof(header);
+            wrapped_this->template send_with_callback<tag>(
+                    [&send_buffer, &max_payload_size, &size](size_t _size) -> char* {
+                        size = _size;
+                        if(size <= max_payload_size) {
+                            return send_buffer;
+                        } else {
+                            return nullptr;
+                        }
+                    },
+                    std::forward<Callback>(callback), std::forward<Args>(args)...);
+            group_rpc_manager.finish_p2p_send_with_callback(dest_node, send_buffer, size);
+        } else {
+            throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
+        }
+    }
+
     /**
      * Gets a pointer into the send buffer for this subgroup, for the purpose of
      * doing a "raw send" (not an RPC send).
@@ -297,6 +717,32 @@ public:
                                                                  payload_size, pause_sending_turns, false, null_send);
     }
 
+    /**
+     * Like get_sendbuffer_ptr, but if the send window is full, blocks the
+     * caller until a buffer is available or the timeout expires.
+     * @param payload_size The size of the payload that the caller intends to
+     * send, in bytes.
+     * @param timeout The maximum amount of time to wait
+     * @param wait_time_ns If not null, set to the time the caller spent waiting
+     * @return A pointer into the send buffer, or nullptr on timeout
+     */
+    char* wait_for_sendbuffer_ptr(unsigned long long int payload_size,
+                                  std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max(),
+                                  uint64_t* wait_time_ns = nullptr,
+                                  int pause_sending_turns = 0, bool null_send = false) {
+        return group_rpc_manager.view_manager.wait_for_sendbuffer_ptr(subgroup_id, payload_size, timeout,
+                                                                      wait_time_ns, pause_sending_turns,
+                                                                      false, null_send);
+    }
+
+    /**
+     * @return The time, in nanoseconds, that the most recent ordered_send or
+     * ordered_query spent blocked waiting for space in the send window.
+     */
+    uint64_t get_last_send_wait_time() const {
+        return last_send_wait_ns;
+    }
+
     const uint64_t compute_global_stability_frontier() {
         return group_rpc_manager.view_manager.compute_global_stability_frontier(subgroup_id);
     }
@@ -307,6 +753,12 @@ public:
         return hlc;
     }
 
+    /** Keeps the retention policies of the Persistent<T> fields from
+     * trimming versions that a member of the shard may still need */
+    int64_t getPersistenceFrontier() {
+        return group_rpc_manager.view_manager.compute_global_persistence_frontier(subgroup_id);
+    }
+
     /**
      * Submits the contents of the send buffer to be multicast to the subgroup,
      * assuming it has been previously filled with a call to get_sendbuffer_ptr().
@@ -315,6 +767,33 @@ public:
         group_rpc_manager.view_manager.send(subgroup_id);
     }
 
+    /**
+     * Lets the object give the memory that large messages to this subgroup
+     * are received into, so that, for instance, a blob passed to an RPC
+     * function as a const BytesView& argument is already in its final place
+     * when the function is called. See receive_allocator_t; null goes back
+     * to Derecho's own buffers.
+     */
+    void set_receive_allocator(receive_allocator_t allocator) {
+        if(!is_valid()) {
+            throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
+        }
+        group_rpc_manager.view_manager.set_receive_allocator(subgroup_id, std::move(allocator));
+    }
+
+    /**
+     * Limits how fast, and how far ahead of the subgroup, this node may send
+     * in it, and how much of the sender thread it gets when other subgroups
+     * are busy too; see SendLimit. An ordered_send the limit doesn't admit
+     * yet waits, as it does for a full window.
+     */
+    void set_send_limit(const SendLimit& limit) {
+        if(!is_valid()) {
+            throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
+        }
+        group_rpc_manager.view_manager.set_send_limit(subgroup_id, limit);
+    }
+
     /**
      * @return The serialized size of the object, of type T, that holds the
      * state of this Replicated<T>.
@@ -323,6 +802,114 @@ public:
         return mutils::bytes_size(**user_object_ptr);
     }
 
+    /**
+     * Serializes the state of the "wrapped" object (of type T) for this
+     * Replicated<T> into a buffer of at least object_size() bytes.
+     */
+    void serialize_object(char* buffer) const {
+        mutils::to_bytes(**user_object_ptr, buffer);
+    }
+
+    /**
+     * @return The serialized size of the object with its Persistent<T> fields
+     * replaced by references to their latest versions, as written by
+     * serialize_object_by_reference().
+     */
+    std::size_t object_size_by_reference() {
+        persistent_registry_ptr->setSerializeByReference(true);
+        try {
+            std::size_t size = object_size();
+            persistent_registry_ptr->setSerializeByReference(false);
+            return size;
+        } catch(...) {
+            persistent_registry_ptr->setSerializeByReference(false);
+            throw;
+        }
+    }
+
+    /**
+     * Serializes the state of the "wrapped" object like serialize_object(),
+     * except that each Persistent<T> field is written as a reference to its
+     * latest logged version rather than as its value. A receiver can only
+     * deserialize it after applying a catch-up from log_catch_up() for the
+     * frontier taken at the same time, which carries those values or the log
+     * entries leading up to them.
+     */
+    void serialize_object_by_reference(char* buffer) {
+        persistent_registry_ptr->setSerializeByReference(true);
+        try {
+            serialize_object(buffer);
+        } catch(...) {
+            persistent_registry_ptr->setSerializeByReference(false);
+            throw;
+        }
+        persistent_registry_ptr->setSerializeByReference(false);
+    }
+
+    /**
+     * @return The version and timestamp of the latest log entry of each
+     * Persistent<T> field, serialized.
+     */
+    std::vector<char> log_frontier() {
+        return persistent_registry_ptr->getLogFrontier();
+    }
+
+    /**
+     * Builds what a copy of this object on another node needs to catch its
+     * Persistent<T> fields up to a frontier taken from this object: the log
+     * entries that copy is missing, or the values of fields whose logs it
+     * can't be caught up from.
+     * @param receiver_frontier The log_frontier() of the other copy
+     * @param frontier A log_frontier() of this object, taken when it was
+     * serialized by reference
+     */
+    std::vector<char> log_catch_up(const char* receiver_frontier, const char* frontier) {
+        return persistent_registry_ptr->getCatchUp(receiver_frontier, frontier);
+    }
+
+    /**
+     * Builds the next batch of log entries for a copy of this object's
+     * Persistent<T> fields at another site, for apply_log_shipment(). Only
+     * the entries up to a version are included, so a log shipper can stop at
+     * the global persistence frontier.
+     * @param receiver_frontier The log_frontier() of the other copy
+     * @param upto The latest version to include
+     */
+    std::vector<char> log_shipment(const char* receiver_frontier, persistence_version_t upto) {
+        return persistent_registry_ptr->getLogShipment(receiver_frontier, upto);
+    }
+
+    /**
+     * Copies the logs of this object's Persistent<T> fields, up to the last
+     * version no later than a cut, into a directory, while the object goes on
+     * being updated. Sealed log segments are hard-linked where they can be.
+     * @param target_path The directory, which is created if it doesn't exist
+     * @param cut The cut, which should be stable in this object's shard
+     * @return The last version copied, or INVALID_VERSION if it is empty
+     */
+    persistence_version_t checkpoint_logs(const std::string& target_path, const HLC& cut) {
+        return persistent_registry_ptr->checkpoint(target_path, cut);
+    }
+
+    /**
+     * Applies a catch-up from log_catch_up() before the object is replaced
+     * with receive_object().
+     */
+    void apply_log_catch_up(const char* catch_up) {
+        persistent_registry_ptr->applyCatchUp(catch_up);
+    }
+
+    /**
+     * Appends the log entries of a batch from log_shipment() of a copy of
+     * this object at another site.
+     * @return The names of the fields that came as values instead, because
+     * their logs here have diverged from the sender's or the sender's logs no
+     * longer go back far enough; such a copy needs a state transfer.
+     */
+    std::vector<std::string> apply_log_shipment(const char* shipment) {
+        return persistent_registry_ptr->applyLogShipment(shipment);
+    }
+
     /**
      * Serializes and sends the state of the "wrapped" object (of type T) for
      * this Replicated<T> over the given socket. (This includes sending the
@@ -331,9 +918,9 @@ public:
      * @param receiver_socket
      */
     void send_object(tcp::socket& receiver_socket) const {
-        auto bind_socket_write = [&receiver_socket](const char* bytes, std::size_t size) { receiver_socket.write(bytes, size); };
-        mutils::post_object(bind_socket_write, object_size());
-        send_object_raw(receiver_socket);
+        tcp::buffered_writer writer(receiver_socket, true);
+        writer.write_pod(object_size());
+        write_object(writer);
     }
 
     /**
@@ -345,8 +932,17 @@ public:
      * @param receiver_socket
      */
     void send_object_raw(tcp::socket& receiver_socket) const {
-        auto bind_socket_write = [&receiver_socket](const char* bytes, std::size_t size) { receiver_socket.write(bytes, size); };
-        mutils::post_object(bind_socket_write, **user_object_ptr);
+        tcp::buffered_writer writer(receiver_socket, true);
+        write_object(writer);
+    }
+
+    /**
+     * Serializes the "wrapped" object into a buffered writer, which copies its
+     * small fields together and sends large ones without copying them.
+     */
+    void write_object(tcp::buffered_writer& writer) const {
+        mutils::post_object([&writer](const char* bytes, std::size_t size) { writer.write(bytes, size); },
+                            **user_object_ptr);
     }
 
     /**
@@ -373,9 +969,50 @@ public:
      * @param ver - the version number to be made
      */
     virtual void make_version(const persistence_version_t& ver, const HLC& hlc) noexcept(false) {
-        persistent_registry_ptr->makeVersion(ver, hlc);
+        if(coalesce_versions) {
+            pending_version = ver;
+            pending_hlc = hlc;
+        } else {
+            // a version recorded before coalescing was turned off comes first
+            make_pending_version();
+            persistent_registry_ptr->makeVersion(ver, hlc);
+        }
+        {
+            std::lock_guard<std::mutex> lock(delivered_frontier->mutex);
+            delivered_frontier->version = ver;
+        }
+        delivered_frontier->cv.notify_all();
+        if(snapshot_requests->any.load(std::memory_order_relaxed) && is_valid()) {
+            capture_snapshots(ver, snapshot::has_snapshot_state<T>{});
+        }
     };
 
+    /**
+     * In coalesced mode, makes the latest version recorded by make_version()
+     * for all the persistent<T> members. The persistence manager calls this
+     * before it requests a persist, on the same thread as make_version().
+     */
+    void make_pending_version() noexcept(false) {
+        if(pending_version != -1) {
+            const persistence_version_t ver = pending_version;
+            pending_version = -1;
+            persistent_registry_ptr->makeVersion(ver, pending_hlc);
+        }
+    }
+
+    /**
+     * Turns coalesced versioning on or off. In coalesced mode, the versions
+     * delivered between two persistence requests are only recorded, and the
+     * persistent<T> members are serialized and logged once, at the latest of
+     * them, when the persist is requested. This saves a serialization and an
+     * append per message for workloads with many small updates, but temporal
+     * and versioned queries only see the state at the end of each batch.
+     * It should be set before the group starts delivering messages.
+     */
+    void set_coalesced_versioning(bool enable) {
+        coalesce_versions = enable;
+    }
+
     /**
      * persist the data to the latest version
      */
@@ -424,12 +1061,33 @@ private:
     rpc::RPCManager& group_rpc_manager;
     /** The actual implementation of ExternalCaller, which has lots of ugly template parameters */
     std::unique_ptr<rpc::RemoteInvokerFor<T>> wrapped_this;
-    /** Buffer for replying to P2P messages, cached here so it doesn't need to be
-     * created in every p2p_send call. */
-    std::unique_ptr<char[]> p2pSendBuffer;
 
     //This is literally copied and pasted from Replicated<T>. I wish I could let them share code with inheritance,
     //but I'm afraid that will introduce unnecessary overheads.
+    /** Sends an ordered invocation too large for one message as a stream,
+     * which its receivers put back together before they handle it */
+    template <rpc::FunctionTag tag, typename... Args>
+    auto ordered_stream_send_or_query(const std::vector<node_id_t>& destination_nodes,
+                                      std::size_t message_size, Args&&... args) {
+        std::vector<char> message(message_size);
+        char* buffer = message.data();
+        {
+            std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+            std::size_t unused_max_payload_size;
+            buffer += group_rpc_manager.populate_nodelist_header(destination_nodes, buffer,
+                                                                 unused_max_payload_size);
+        }
+        const std::size_t capacity = message.data() + message.size() - buffer;
+        auto send_return_struct = wrapped_this->template send<tag>(
+                [&buffer, capacity](size_t size) -> char* {
+                    return size <= capacity ? buffer : nullptr;
+                },
+                std::forward<Args>(args)...);
+        group_rpc_manager.finish_rpc_stream_send(subgroup_id, destination_nodes, message,
+                                                 send_return_struct.pending);
+        return std::move(send_return_struct.results);
+    }
+
     template <rpc::FunctionTag tag, typename... Args>
     auto p2p_send_or_query(node_id_t dest_node, Args&&... args) {
         if(is_valid()) {
@@ -437,18 +1095,51 @@ private:
             //Ensure a view change isn't in progress
             std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
             size_t size;
+            char* send_buffer = group_rpc_manager.p2p_send_buffer();
+            auto max_payload_size = group_rpc_manager.view_manager.curr_view->multicast_group->max_msg_size - sizeof(header);
+            auto return_pair = wrapped_this->template send<tag>(
+                    [&send_buffer, &max_payload_size, &size](size_t _size) -> char* {
+                        size = _size;
+                        if(size <= max_payload_size) {
+                            return send_buffer;
+                        } else {
+                            return nullptr;
+                        }
+                    },
+                    std::forward<Args>(args)...);
+            group_rpc_manager.finish_p2p_send(dest_node, send_buffer, size, return_pair.pending);
+            return std::move(return_pair.results);
+        } else {
+            throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
+        }
+    }
+
+    /**
+     * Like p2p_send_or_query, but sends the same message to several nodes:
+     * the arguments are serialized once, the message is sent to every node
+     * before waiting for any reply, and all the replies arrive in a single
+     * QueryResults.
+     */
+    template <rpc::FunctionTag tag, typename... Args>
+    auto p2p_send_or_query_all(const std::vector<node_id_t>& dest_nodes, Args&&... args) {
+        if(is_valid()) {
+            assert(std::find(dest_nodes.begin(), dest_nodes.end(), node_id) == dest_nodes.end());
+            //Ensure a view change isn't in progress
+            std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+            size_t size;
+            char* send_buffer = group_rpc_manager.p2p_send_buffer();
             auto max_payload_size = group_rpc_manager.view_manager.curr_view->multicast_group->max_msg_size - sizeof(header);
             auto return_pair = wrapped_this->template send<tag>(
-                    [this, &max_payload_size, &size](size_t _size) -> char* {
+                    [&send_buffer, &max_payload_size, &size](size_t _size) -> char* {
                         size = _size;
                         if(size <= max_payload_size) {
-                            return p2pSendBuffer.get();
+                            return send_buffer;
                         } else {
                             return nullptr;
                         }
                     },
                     std::forward<Args>(args)...);
-            group_rpc_manager.finish_p2p_send(dest_node, p2pSendBuffer.get(), size, return_pair.pending);
+            group_rpc_manager.finish_p2p_fanout(dest_nodes, send_buffer, size, return_pair.pending);
             return std::move(return_pair.results);
         } else {
             throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
@@ -460,8 +1151,7 @@ public:
             : node_id(nid),
               subgroup_id(subgroup_id),
               group_rpc_manager(group_rpc_manager),
-              wrapped_this(group_rpc_manager.make_remote_invoker<T>(subgroup_id, T::register_functions())),
-              p2pSendBuffer(new char[group_rpc_manager.view_manager.derecho_params.max_payload_size]) {}
+              wrapped_this(group_rpc_manager.make_remote_invoker<T>(subgroup_id, T::register_functions())) {}
 
     ExternalCaller(ExternalCaller&&) = default;
     ExternalCaller(const ExternalCaller&) = delete;
@@ -497,6 +1187,57 @@ public:
     auto p2p_query(node_id_t dest_node, Args&&... args) {
         return p2p_send_or_query<tag>(dest_node, std::forward<Args>(args)...);
     }
+
+    /**
+     * Sends a peer-to-peer query to a single member of the subgroup, like
+     * p2p_query, but hands the reply to a callback as soon as it is received
+     * instead of returning a QueryResults. See ordered_query_with_callback for
+     * the limits of callback mode.
+     * @param dest_node The ID of the node that the P2P message should be sent to
+     * @param callback A function taking the replying node's ID and a pointer
+     * to its reply (null if it threw an exception)
+     * @param args The arguments to the RPC function being invoked
+     */
+    template <rpc::FunctionTag tag, typename Callback, typename... Args>
+    void p2p_query_with_callback(node_id_t dest_node, Callback&& callback, Args&&... args) {
+        if(is_valid()) {
+            assert(dest_node != node_id);
+            //Ensure a view change isn't in progress
+            std::shared_lock<std::shared_timed_mutex> view_read_lock(group_rpc_manager.view_manager.view_mutex);
+            size_t size;
+            char* send_buffer = group_rpc_manager.p2p_send_buffer();
+            auto max_payload_size = group_rpc_manager.view_manager.curr_view->multicast_group->max_msg_size - sizeof(header);
+            wrapped_this->template send_with_callback<tag>(
+                    [&send_buffer, &max_payload_size, &size](size_t _size) -> char* {
+                        size = _size;
+                        if(size <= max_payload_size) {
+                            return send_buffer;
+                        } else {
+                            return nullptr;
+                        }
+                    },
+                    std::forward<Callback>(callback), std::forward<Args>(args)...);
+            group_rpc_manager.finish_p2p_send_with_callback(dest_node, send_buffer, size);
+        } else {
+            throw derecho::empty_reference_exception{"Attempted to use an empty Replicated<T>"};
+        }
+    }
+
+    /**
+     * Sends a peer-to-peer message over TCP to each of several members of
+     * the subgroup that this ExternalCaller targets, invoking the RPC function
+     * identified by the FunctionTag template parameter. The arguments are
+     * serialized only once, and the message is sent to all the nodes before
+     * any reply is awaited, so the query takes about one round trip in total.
+     * @param dest_nodes The IDs of the nodes that the message should be sent to
+     * @param args The arguments to the RPC function being invoked
+     * @return An instance of rpc::QueryResults<Ret> whose ReplyMap contains
+     * one reply for each node in dest_nodes
+     */
+    template <rpc::FunctionTag tag, typename... Args>
+    auto p2p_query_all(const std::vector<node_id_t>& dest_nodes, Args&&... args) {
+        return p2p_send_or_query_all<tag>(dest_nodes, std::forward<Args>(args)...);
+    }
 };
 
 template <typename T>
@@ -512,9 +1253,7 @@ public:
     }
     template <rpc::FunctionTag tag, typename... Args>
     void p2p_send(Args&&... args) {
-        for(auto nid : shard_reps) {
-            EC.template p2p_send<tag>(nid, std::forward<Args>(args)...);
-        }
+        EC.template p2p_query_all<tag>(shard_reps, std::forward<Args>(args)...);
     }
 
     template <rpc::FunctionTag tag, typename... Args>
@@ -526,7 +1265,42 @@ public:
         for(uint i = 1; i < shard_reps.size(); ++i) {
             query_result_vec.emplace_back(EC.template p2p_query<tag>(shard_reps[i], std::forward<Args>(args)...));
         }
-	return query_result_vec;
+        return query_result_vec;
+    }
+
+    /**
+     * Queries one member of every shard at once. Unlike p2p_query, this
+     * serializes the arguments once and sends to all the shards before
+     * waiting for any of them, and the replies all arrive in one
+     * QueryResults, keyed by the ID of the node that answered for each
+     * shard.
+     */
+    template <rpc::FunctionTag tag, typename... Args>
+    auto p2p_query_all(Args&&... args) {
+        return EC.template p2p_query_all<tag>(shard_reps, std::forward<Args>(args)...);
+    }
+
+    /**
+     * Runs a temporal query at one consistent cut across every shard. The
+     * cut is the time snapshot_us, in microseconds, which the RPC function
+     * gets as its first argument. The function should call
+     * Persistent<T>::waitForFrontier(HLC{snapshot_us, 0}, ...) before it reads
+     * any version at that time. Then no shard answers before every version
+     * up to the cut is stable in it. The query goes to all the shards at once
+     * like p2p_query_all, so they wait in parallel. A cut taken at the
+     * current time costs one round trip plus about one stability frontier
+     * update.
+     */
+    template <rpc::FunctionTag tag, typename... Args>
+    auto p2p_query_at(uint64_t snapshot_us, Args&&... args) {
+        return EC.template p2p_query_all<tag>(shard_reps, snapshot_us, std::forward<Args>(args)...);
+    }
+
+    /** @return The current time in microseconds, for a cut with p2p_query_at. */
+    static uint64_t snapshot_now() {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
     }
 };
 }
@@ -7,17 +7,53 @@
 #include <cassert>
 #include <iostream>
 
+#include "metrics.h"
 #include "rpc_manager.h"
+#include "thread_placement.h"
 
 namespace derecho {
 
 namespace rpc {
 
+void RPCManager::build_dispatch_table(subgroup_id_t subgroup_id) {
+    if(dispatch_tables.size() <= subgroup_id) {
+        dispatch_tables.resize(subgroup_id + 1);
+    }
+    if(!dispatch_tables[subgroup_id].build(*receivers, subgroup_id, max_dispatch_table_size)) {
+        logger->debug("The functions of subgroup {} have no dispatch table, dispatching them by map lookup", subgroup_id);
+    }
+}
+
+const receive_fun_t& RPCManager::find_receiver(const Opcode& opcode) const {
+    if(opcode.subgroup_id < dispatch_tables.size()) {
+        if(const receive_fun_t* receive = dispatch_tables[opcode.subgroup_id].find(opcode)) {
+            return *receive;
+        }
+    }
+    return receivers->at(opcode);
+}
+
 RPCManager::~RPCManager() {
     thread_shutdown = true;
     if(rpc_thread.joinable()) {
         rpc_thread.join();
     }
+    {
+        std::lock_guard<std::mutex> lock(reply_batches_mutex);
+    }
+    reply_batches_cv.notify_all();
+    if(reply_flush_thread.joinable()) {
+        reply_flush_thread.join();
+    }
+    for(auto& worker : p2p_workers) {
+        {
+            std::lock_guard<std::mutex> lock(worker->queue_mutex);
+        }
+        worker->queue_cv.notify_all();
+        if(worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
     connections.destroy();
 }
 
@@ -33,7 +69,7 @@ std::exception_ptr RPCManager::handle_receive(
     auto reply_header_size = header_space();
     //TODO: Check that the given Opcode is actually in our receivers map,
     //and reply with a "no such method error" if it is not
-    recv_ret reply_return = receivers->at(indx)(
+    recv_ret reply_return = find_receiver(indx)(
             &rdv, received_from, buf,
             [&out_alloc, &reply_header_size](std::size_t size) {
                 return out_alloc(size + reply_header_size) + reply_header_size;
@@ -61,9 +97,26 @@ std::exception_ptr RPCManager::handle_receive(
 }
 
 void RPCManager::rpc_message_handler(subgroup_id_t subgroup_id, node_id_t sender_id, char* msg_buf, uint32_t payload_size) {
+    std::unique_lock<std::shared_timed_mutex> delivery_lock;
+    handle_rpc_message(subgroup_id, sender_id, msg_buf, payload_size, delivery_lock);
+}
+
+void RPCManager::rpc_batch_handler(subgroup_id_t subgroup_id, const DeliveredMessage* messages, std::size_t num_messages,
+                                   const batch_delivered_t& delivered) {
+    std::unique_lock<std::shared_timed_mutex> delivery_lock;
+    for(std::size_t i = 0; i < num_messages; ++i) {
+        handle_rpc_message(subgroup_id, messages[i].sender_id, messages[i].buf, messages[i].size, delivery_lock);
+        delivered(i);
+    }
+}
+
+void RPCManager::handle_rpc_message(subgroup_id_t subgroup_id, node_id_t sender_id, char* msg_buf,
+                                    uint32_t payload_size, std::unique_lock<std::shared_timed_mutex>& delivery_lock) {
     // WARNING: This assumes the current view doesn't change during execution! (It accesses curr_view without a lock).
     // extract the destination vector
     size_t dest_size = ((size_t*)msg_buf)[0];
+    const bool batch = dest_size & batch_message_bit;
+    dest_size &= ~batch_message_bit;
     msg_buf += sizeof(size_t);
     payload_size -= sizeof(size_t);
     bool in_dest = false;
@@ -75,34 +128,131 @@ void RPCManager::rpc_message_handler(subgroup_id_t subgroup_id, node_id_t sender
             in_dest = true;
         }
     }
-    if(in_dest || dest_size == 0) {
-        auto max_payload_size = view_manager.curr_view->multicast_group->max_msg_size - sizeof(header);
-        size_t reply_size = 0;
-        handle_receive(msg_buf, payload_size, [this, &reply_size, &max_payload_size](size_t size) -> char* {
-            reply_size = size;
-            if(reply_size <= max_payload_size) {
-                return replySendBuffer.get();
-            } else {
-                return nullptr;
-            }
-        });
-        if(reply_size > 0) {
-            if(sender_id == nid) {
-                handle_receive(
-                        replySendBuffer.get(), reply_size,
-                        [](size_t size) -> char* { assert(false); });
-                if(dest_size == 0) {
-                    //Destination was "all nodes in my shard of the subgroup"
-                    int my_shard = view_manager.curr_view->multicast_group->get_subgroup_to_shard_and_rank().at(subgroup_id).first;
-                    std::lock_guard<std::mutex> lock(pending_results_mutex);
-                    toFulfillQueue.front().get().fulfill_map(
+    if(!in_dest && dest_size != 0) {
+        return;
+    }
+    if(!delivery_lock.owns_lock()) {
+        auto delivery_lock_it = delivery_locks.find(subgroup_id);
+        if(delivery_lock_it != delivery_locks.end()) {
+            delivery_lock = std::unique_lock<std::shared_timed_mutex>(delivery_lock_it->second);
+        }
+    }
+    if(!batch) {
+        process_rpc_invocation(subgroup_id, sender_id, msg_buf, payload_size, dest_size);
+        return;
+    }
+    // The invocations of a batch follow its count back to back, and each
+    // one's size is in its own RPC header
+    size_t num_invocations = ((size_t*)msg_buf)[0];
+    msg_buf += sizeof(size_t);
+    for(size_t i = 0; i < num_invocations; ++i) {
+        size_t invocation_size = remote_invocation_utilities::header_space() + ((size_t*)msg_buf)[0];
+        process_rpc_invocation(subgroup_id, sender_id, msg_buf, invocation_size, dest_size);
+        msg_buf += invocation_size;
+    }
+}
+
+void RPCManager::process_rpc_invocation(subgroup_id_t subgroup_id, node_id_t sender_id, char* msg_buf,
+                                        std::size_t payload_size, std::size_t dest_size) {
+    auto max_payload_size = view_manager.curr_view->multicast_group->max_msg_size - sizeof(header);
+    // Subgroups with delivery executors deliver on threads of their own, so
+    // each thread builds its replies in a buffer of its own
+    thread_local std::vector<char> reply_buffer;
+    if(reply_buffer.size() < max_payload_size) {
+        reply_buffer.resize(max_payload_size);
+    }
+    size_t reply_size = 0;
+    handle_receive(msg_buf, payload_size, [&reply_size, &max_payload_size](size_t size) -> char* {
+        reply_size = size;
+        if(reply_size <= max_payload_size) {
+            return reply_buffer.data();
+        } else {
+            return nullptr;
+        }
+    });
+    if(reply_size > 0) {
+        if(sender_id == nid) {
+            handle_receive(
+                    reply_buffer.data(), reply_size,
+                    [](size_t size) -> char* { assert(false); });
+            //Queries sent in callback mode have no entry in toFulfillQueue
+            const bool callback_mode = remote_invocation_utilities::is_callback_invocation(
+                    msg_buf + remote_invocation_utilities::header_space());
+            if(dest_size == 0 && !callback_mode) {
+                //Destination was "all nodes in my shard of the subgroup"
+                int my_shard = view_manager.curr_view->multicast_group->get_subgroup_to_shard_and_rank().at(subgroup_id).first;
+                std::lock_guard<std::mutex> lock(pending_results_mutex);
+                if(auto pending = toFulfillQueue.front().lock()) {
+                    pending->fulfill_map(
                             view_manager.curr_view->subgroup_shard_views.at(subgroup_id).at(my_shard).members);
-                    fulfilledList.push_back(std::move(toFulfillQueue.front()));
-                    toFulfillQueue.pop();
+                    fulfilledList.push_back(pending);
                 }
-            } else {
-                connections.write(sender_id, replySendBuffer.get(), reply_size);
+                toFulfillQueue.pop();
             }
+        } else {
+            send_reply(sender_id, reply_buffer.data(), reply_size);
+        }
+    }
+}
+
+void RPCManager::send_reply(node_id_t dest_node, const char* reply, std::size_t size) {
+    if(!reply_flush_thread.joinable()) {
+        p2p_write(dest_node, reply, size);
+        return;
+    }
+    // A batch must fit in one RDMA slot, like any other P2P message
+    const std::size_t max_batch_size = view_manager.curr_view->multicast_group->max_msg_size - sizeof(header);
+    std::vector<char> full_batch;
+    {
+        std::lock_guard<std::mutex> lock(reply_batches_mutex);
+        ReplyBatch& batch = reply_batches[dest_node];
+        if(!batch.replies.empty() && batch.replies.size() + size > max_batch_size) {
+            full_batch.swap(batch.replies);
+        }
+        if(batch.replies.empty()) {
+            batch.first_reply = std::chrono::steady_clock::now();
+        }
+        batch.replies.insert(batch.replies.end(), reply, reply + size);
+    }
+    reply_batches_cv.notify_one();
+    if(!full_batch.empty()) {
+        p2p_write(dest_node, full_batch.data(), full_batch.size());
+    }
+}
+
+void RPCManager::reply_flush_loop() {
+    pthread_setname_np(pthread_self(), "reply_flush");
+    place_this_thread("reply_flush");
+    using clock = std::chrono::steady_clock;
+    const std::chrono::microseconds window(view_manager.derecho_params.reply_batch_window_us);
+    std::unique_lock<std::mutex> lock(reply_batches_mutex);
+    while(!thread_shutdown) {
+        clock::time_point next_deadline = clock::time_point::max();
+        std::vector<std::pair<node_id_t, std::vector<char>>> due_batches;
+        const clock::time_point now = clock::now();
+        for(auto& dest_batch : reply_batches) {
+            ReplyBatch& batch = dest_batch.second;
+            if(batch.replies.empty()) {
+                continue;
+            }
+            const clock::time_point deadline = batch.first_reply + window;
+            if(deadline <= now) {
+                due_batches.emplace_back(dest_batch.first, std::move(batch.replies));
+                batch.replies.clear();
+            } else if(deadline < next_deadline) {
+                next_deadline = deadline;
+            }
+        }
+        if(!due_batches.empty()) {
+            lock.unlock();
+            for(auto& due_batch : due_batches) {
+                p2p_write(due_batch.first, due_batch.second.data(), due_batch.second.size());
+            }
+            lock.lock();
+        } else if(next_deadline == clock::time_point::max()) {
+            reply_batches_cv.wait_for(lock, std::chrono::milliseconds(p2p_wait_timeout_ms));
+        } else {
+            reply_batches_cv.wait_until(lock, next_deadline);
         }
     }
 }
@@ -116,21 +266,105 @@ void RPCManager::p2p_message_handler(node_id_t sender_id, char* msg_buf, uint32_
     node_id_t received_from;
     retrieve_header(nullptr, msg_buf, payload_size, indx, received_from);
     connections.read(sender_id, msg_buf + header_size, payload_size);
+    dispatch_p2p_message(msg_buf, msg_buf, buffer_size);
+}
+
+void RPCManager::process_p2p_message(char* msg_buf, char* reply_buf, uint32_t reply_buf_size) {
+    using namespace remote_invocation_utilities;
+    std::size_t payload_size;
+    Opcode indx;
+    node_id_t received_from;
+    retrieve_header(nullptr, msg_buf, payload_size, indx, received_from);
     size_t reply_size = 0;
-    handle_receive(indx, received_from, msg_buf + header_size, payload_size,
-                   [&msg_buf, &buffer_size, &reply_size](size_t _size) -> char* {
+    handle_receive(indx, received_from, msg_buf + header_space(), payload_size,
+                   [&reply_buf, &reply_buf_size, &reply_size](size_t _size) -> char* {
                        reply_size = _size;
-                       if(reply_size <= buffer_size) {
-                           return msg_buf;
+                       if(reply_size <= reply_buf_size) {
+                           return reply_buf;
                        } else {
                            return nullptr;
                        }
                    });
     if(reply_size > 0) {
-        connections.write(received_from, msg_buf, reply_size);
+        p2p_write(received_from, reply_buf, reply_size);
     }
 }
 
+void RPCManager::dispatch_p2p_messages(char* msg_buf, std::size_t size, char* reply_buf, uint32_t reply_buf_size) {
+    using namespace remote_invocation_utilities;
+    std::size_t offset = 0;
+    while(offset + header_space() <= size) {
+        std::size_t payload_size;
+        Opcode indx;
+        node_id_t received_from;
+        retrieve_header(nullptr, msg_buf + offset, payload_size, indx, received_from);
+        dispatch_p2p_message(msg_buf + offset, reply_buf, reply_buf_size);
+        offset += header_space() + payload_size;
+    }
+}
+
+void RPCManager::dispatch_p2p_message(char* msg_buf, char* reply_buf, uint32_t reply_buf_size) {
+    using namespace remote_invocation_utilities;
+    std::size_t payload_size;
+    Opcode indx;
+    node_id_t received_from;
+    retrieve_header(nullptr, msg_buf, payload_size, indx, received_from);
+    // Replies only fulfill promises, and must not wait behind a handler
+    // that is itself waiting for one
+    if(p2p_workers.empty() || indx.is_reply) {
+        process_p2p_message(msg_buf, reply_buf, reply_buf_size);
+        return;
+    }
+    std::size_t key = indx.subgroup_id;
+    if(view_manager.derecho_params.p2p_handler_affinity == P2PHandlerAffinity::FUNCTION) {
+        key = key * 31 + std::hash<FunctionTag>{}(indx.function_id);
+    }
+    P2PHandlerWorker& worker = *p2p_workers[key % p2p_workers.size()];
+    {
+        std::lock_guard<std::mutex> lock(worker.queue_mutex);
+        worker.messages.emplace(msg_buf, msg_buf + header_space() + payload_size);
+    }
+    worker.queue_cv.notify_one();
+}
+
+void RPCManager::p2p_worker_loop(P2PHandlerWorker& worker) {
+    pthread_setname_np(pthread_self(), "p2p_worker");
+    place_this_thread("p2p_worker");
+    const uint32_t max_payload_size = view_manager.curr_view->multicast_group->max_msg_size - sizeof(header);
+    std::unique_ptr<char[]> reply_buf(new char[max_payload_size]);
+    while(true) {
+        std::vector<char> message;
+        {
+            std::unique_lock<std::mutex> lock(worker.queue_mutex);
+            worker.queue_cv.wait(lock, [&]() { return thread_shutdown || !worker.messages.empty(); });
+            if(thread_shutdown) {
+                return;
+            }
+            message = std::move(worker.messages.front());
+            worker.messages.pop();
+        }
+        process_p2p_message(message.data(), reply_buf.get(), max_payload_size);
+    }
+}
+
+char* RPCManager::p2p_send_buffer() {
+    // Each thread builds its P2P messages in a buffer of its own, so that any
+    // number of threads can have messages in flight to the same node at once;
+    // their replies are matched to them by invocation ID
+    thread_local std::vector<char> buffer;
+    if(buffer.size() < view_manager.derecho_params.max_payload_size) {
+        buffer.resize(view_manager.derecho_params.max_payload_size);
+    }
+    return buffer.data();
+}
+
+void RPCManager::p2p_write(node_id_t dest_node, const char* buffer, std::size_t size) {
+    if(rdma_connections && rdma_connections->write(dest_node, buffer, size)) {
+        return;
+    }
+    connections.write(dest_node, buffer, size);
+}
+
 void RPCManager::new_view_callback(const View& new_view) {
     if(std::find(new_view.joined.begin(), new_view.joined.end(), nid) != new_view.joined.end()) {
         //If this node is in the joined list, we need to set up a connection to everyone
@@ -138,6 +372,12 @@ void RPCManager::new_view_callback(const View& new_view) {
             if(new_view.members[i] != nid) {
                 connections.add_node(new_view.members[i], new_view.member_ips[i]);
                 logger->debug("Established a TCP connection to node {}", new_view.members[i]);
+                // Every node adds its peers in the order they appear in the
+                // view, so these pairwise handshakes can't deadlock
+                if(rdma_connections) {
+                    rdma_connections->add_node(new_view.members[i]);
+                    logger->debug("Established an RDMA connection to node {}", new_view.members[i]);
+                }
             }
         }
     } else {
@@ -146,18 +386,32 @@ void RPCManager::new_view_callback(const View& new_view) {
             connections.add_node(joiner_id,
                                  new_view.member_ips[new_view.rank_of(joiner_id)]);
             logger->debug("Established a TCP connection to node {}", joiner_id);
+            if(rdma_connections) {
+                rdma_connections->add_node(joiner_id);
+                logger->debug("Established an RDMA connection to node {}", joiner_id);
+            }
         }
         for(const node_id_t& removed_id : new_view.departed) {
             logger->debug("Removing TCP connection for failed node {}", removed_id);
             connections.delete_node(removed_id);
+            if(rdma_connections) {
+                rdma_connections->delete_node(removed_id);
+            }
         }
     }
 
     std::lock_guard<std::mutex> lock(pending_results_mutex);
-    for(auto& pending : fulfilledList) {
+    for(auto it = fulfilledList.begin(); it != fulfilledList.end();) {
+        auto pending = it->lock();
+        // The QueryResults of this query is gone, so nobody needs its results
+        if(!pending) {
+            it = fulfilledList.erase(it);
+            continue;
+        }
         for(auto removed_id : new_view.departed) {
-            pending.get().set_exception_for_removed_node(removed_id);
+            pending->set_exception_for_removed_node(removed_id);
         }
+        ++it;
     }
 }
 
@@ -179,35 +433,125 @@ int RPCManager::populate_nodelist_header(const std::vector<node_id_t>& dest_node
     return header_size;
 }
 
+int RPCManager::populate_batch_header(const std::vector<node_id_t>& dest_nodes, std::size_t num_invocations,
+                                      char* buffer, std::size_t& max_payload_size) {
+    int header_size = populate_nodelist_header(dest_nodes, buffer, max_payload_size);
+    ((size_t*)buffer)[0] |= batch_message_bit;
+    ((size_t*)(buffer + header_size))[0] = num_invocations;
+    header_size += sizeof(size_t);
+    max_payload_size -= sizeof(size_t);
+    return header_size;
+}
+
+void RPCManager::finish_rpc_batch_send(uint32_t subgroup_id, const std::vector<node_id_t>& dest_nodes,
+                                       const std::vector<std::shared_ptr<PendingBase>>& pending_results_handles) {
+    while(!view_manager.curr_view->multicast_group->send(subgroup_id)) {
+    }
+    std::lock_guard<std::mutex> lock(pending_results_mutex);
+    for(auto& pending_results_handle : pending_results_handles) {
+        if(dest_nodes.size()) {
+            pending_results_handle->fulfill_map(dest_nodes);
+            fulfilledList.push_back(pending_results_handle);
+        } else {
+            toFulfillQueue.push(pending_results_handle);
+        }
+    }
+}
+
 void RPCManager::finish_rpc_send(uint32_t subgroup_id, const std::vector<node_id_t>& dest_nodes, PendingBase& pending_results_handle) {
     while(!view_manager.curr_view->multicast_group->send(subgroup_id)) {
     }
     std::lock_guard<std::mutex> lock(pending_results_mutex);
     if(dest_nodes.size()) {
         pending_results_handle.fulfill_map(dest_nodes);
-        fulfilledList.push_back(pending_results_handle);
+        fulfilledList.push_back(pending_results_handle.shared_from_this());
     } else {
-        toFulfillQueue.push(pending_results_handle);
+        toFulfillQueue.push(pending_results_handle.shared_from_this());
+    }
+}
+
+void RPCManager::finish_rpc_stream_send(uint32_t subgroup_id, const std::vector<node_id_t>& dest_nodes,
+                                        const std::vector<char>& message, PendingBase& pending_results_handle) {
+    view_manager.send_stream(subgroup_id, message.data(), message.size(), true);
+    std::lock_guard<std::mutex> lock(pending_results_mutex);
+    if(dest_nodes.size()) {
+        pending_results_handle.fulfill_map(dest_nodes);
+        fulfilledList.push_back(pending_results_handle.shared_from_this());
+    } else {
+        toFulfillQueue.push(pending_results_handle.shared_from_this());
     }
 }
 
 void RPCManager::finish_p2p_send(node_id_t dest_node, char* msg_buf, std::size_t size, PendingBase& pending_results_handle) {
-    connections.write(dest_node, msg_buf, size);
+    // The reply can arrive as soon as the message is written, so the
+    // promise for it must exist first
     pending_results_handle.fulfill_map({dest_node});
-    std::lock_guard<std::mutex> lock(pending_results_mutex);
-    fulfilledList.push_back(pending_results_handle);
+    pending_results_handle.p2p_send_time.store(metrics::now_ns(), std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(pending_results_mutex);
+        fulfilledList.push_back(pending_results_handle.shared_from_this());
+    }
+    p2p_write(dest_node, msg_buf, size);
+}
+
+void RPCManager::finish_rpc_send_with_callback(uint32_t subgroup_id) {
+    while(!view_manager.curr_view->multicast_group->send(subgroup_id)) {
+    }
+}
+
+void RPCManager::finish_p2p_send_with_callback(node_id_t dest_node, char* msg_buf, std::size_t size) {
+    p2p_write(dest_node, msg_buf, size);
+}
+
+void RPCManager::finish_p2p_fanout(const std::vector<node_id_t>& dest_nodes, char* msg_buf, std::size_t size,
+                                   PendingBase& pending_results_handle) {
+    pending_results_handle.fulfill_map(dest_nodes);
+    pending_results_handle.p2p_send_time.store(metrics::now_ns(), std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(pending_results_mutex);
+        fulfilledList.push_back(pending_results_handle.shared_from_this());
+    }
+    for(const node_id_t& dest_node : dest_nodes) {
+        p2p_write(dest_node, msg_buf, size);
+    }
 }
 
 void RPCManager::p2p_receive_loop() {
     pthread_setname_np(pthread_self(), "rpc_thread");
+    place_this_thread("rpc_thread");
     auto max_payload_size = view_manager.curr_view->multicast_group->max_msg_size - sizeof(header);
     std::unique_ptr<char[]> rpcBuffer = std::unique_ptr<char[]>(new char[max_payload_size]);
+    int idle_polls = 0;
     while(!thread_shutdown) {
-        auto other_id = connections.probe_all();
+        if(rdma_connections) {
+            // Messages that arrived over RDMA can only be found by polling, so
+            // spin while messages are arriving and back off once they stop
+            bool received = rdma_connections->receive([&](node_id_t sender_id, char* msg_buf, std::size_t size) {
+                dispatch_p2p_messages(msg_buf, size, rpcBuffer.get(), max_payload_size);
+            });
+            if(received) {
+                idle_polls = 0;
+                continue;
+            }
+        }
+        int timeout_ms = p2p_wait_timeout_ms;
+        if(rdma_connections) {
+            if(idle_polls < p2p_rdma_spin_iterations) {
+                timeout_ms = 0;
+                idle_polls++;
+            } else {
+                timeout_ms = 1;
+            }
+        }
+        // Sleep in epoll until a socket has data, waking up now and then to
+        // check thread_shutdown
+        auto other_id = connections.wait_for_data(timeout_ms);
         if(other_id < 0) {
             continue;
         }
+        idle_polls = 0;
         p2p_message_handler(other_id, rpcBuffer.get(), max_payload_size);
+        connections.resume_watching(other_id);
     }
 }
 }
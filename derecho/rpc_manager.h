@@ -6,15 +6,20 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <exception>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <queue>
+#include <shared_mutex>
 #include <vector>
 
 #include "derecho_internal.h"
 #include "mutils-serialization/SerializationSupport.hpp"
+#include "p2p_rdma_connections.h"
 #include "remote_invocable.h"
 #include "rpc_utils.h"
 #include "view.h"
@@ -38,6 +43,19 @@ class RPCManager {
      * from the targets of an earlier remote call.
      * Note that a FunctionID is (class ID, subgroup ID, Function Tag). */
     std::unique_ptr<std::map<Opcode, receive_fun_t>> receivers;
+    /** Indexed by subgroup ID; rebuilt along with receivers each time a
+     * subgroup's functions are registered. A subgroup whose functions can't
+     * be given distinct slots has an empty table and is dispatched through
+     * receivers instead. */
+    std::vector<DispatchTable> dispatch_tables;
+    /** The largest dispatch table built before falling back on receivers */
+    static constexpr std::size_t max_dispatch_table_size = 1 << 12;
+
+    /** Rebuilds the dispatch table of a subgroup from receivers. */
+    void build_dispatch_table(subgroup_id_t subgroup_id);
+    /** Finds the receive function for an opcode, through its subgroup's
+     * dispatch table if it has one; throws std::out_of_range if there is none. */
+    const receive_fun_t& find_receiver(const Opcode& opcode) const;
     /** An emtpy DeserializationManager, in case we need it later. */
     // mutils::DeserializationManager dsm{{}};
     // Weijia: I prefer the deserialization context vector.
@@ -53,17 +71,45 @@ class RPCManager {
 
     /** Contains a TCP connection to each member of the group. */
     tcp::tcp_connections connections;
+    /** Contains an RDMA connection to each member of the group, if P2P
+     * messages are sent over RDMA; otherwise null. */
+    std::unique_ptr<P2PRDMAConnections> rdma_connections;
 
-    std::mutex pending_results_mutex;
-    std::queue<std::reference_wrapper<PendingBase>> toFulfillQueue;
-    std::list<std::reference_wrapper<PendingBase>> fulfilledList;
+    /** One lock per subgroup with a replicated object, indexed by subgroup
+     * ID. Delivering an ordered RPC message holds it exclusively, and local
+     * queries hold it shared, so that they see the object between deliveries.
+     * Like receivers, it only grows while the replicated objects are built. */
+    std::map<subgroup_id_t, std::shared_timed_mutex> delivery_locks;
 
-    /** This is not accessed outside invocations of cooked_send_callback,
-     * it's just a member so it won't be newly allocated every time. */
-    std::unique_ptr<char[]> replySendBuffer;
+    std::mutex pending_results_mutex;
+    /** The results of queries that are weak_ptrs because the QueryResults
+     * own them, and may give them up before the queries are answered. */
+    std::queue<std::weak_ptr<PendingBase>> toFulfillQueue;
+    std::list<std::weak_ptr<PendingBase>> fulfilledList;
 
     std::atomic<bool> thread_shutdown{false};
     std::thread rpc_thread;
+    /** The longest time p2p_receive_loop waits for incoming data before
+     * checking thread_shutdown, in milliseconds. */
+    static constexpr int p2p_wait_timeout_ms = 100;
+    /** When P2P messages arrive over RDMA, the number of times p2p_receive_loop
+     * polls without finding a message before it starts sleeping between polls. */
+    static constexpr int p2p_rdma_spin_iterations = 10000;
+
+    /** A thread that handles P2P calls, with the calls queued for it. */
+    struct P2PHandlerWorker {
+        std::mutex queue_mutex;
+        std::condition_variable queue_cv;
+        /** The calls to handle, oldest first, each with its RPC header */
+        std::queue<std::vector<char>> messages;
+        std::thread thread;
+    };
+    /** The P2P handler threads, if DerechoParams::num_p2p_handler_threads is
+     * nonzero. Fixed once the RPCManager is constructed. */
+    std::vector<std::unique_ptr<P2PHandlerWorker>> p2p_workers;
+
+    /** Handles the calls queued for one P2P handler thread until shutdown. */
+    void p2p_worker_loop(P2PHandlerWorker& worker);
 
     /** Listens for P2P RPC calls over the TCP connections and handles them. */
     void p2p_receive_loop();
@@ -77,6 +123,76 @@ class RPCManager {
      */
     void p2p_message_handler(node_id_t sender_id, char* msg_buf, uint32_t buffer_size);
 
+    /**
+     * Handles a peer-to-peer message that has been fully received, and sends
+     * the reply to it, if any.
+     * @param msg_buf A buffer containing the message
+     * @param reply_buf A buffer to construct the reply in; may be msg_buf
+     * @param reply_buf_size The size of reply_buf, in bytes
+     */
+    void process_p2p_message(char* msg_buf, char* reply_buf, uint32_t reply_buf_size);
+
+    /**
+     * Handles a peer-to-peer message that has been fully received on the
+     * receiving thread if it is a reply or there are no P2P handler threads,
+     * and otherwise queues a copy of it for the handler thread its key maps to.
+     * The arguments are those of process_p2p_message.
+     */
+    void dispatch_p2p_message(char* msg_buf, char* reply_buf, uint32_t reply_buf_size);
+
+    /**
+     * Handles one invocation of an ordered RPC message addressed to this
+     * node, and delivers or sends the reply to it, if any.
+     * @param msg_buf A buffer containing the invocation, starting with its
+     * RPC header
+     * @param payload_size The size of the invocation, in bytes
+     * @param dest_size The number of destination nodes of the message, or 0
+     * if it was sent to the whole shard
+     */
+    void process_rpc_invocation(subgroup_id_t subgroup_id, node_id_t sender_id, char* msg_buf,
+                                std::size_t payload_size, std::size_t dest_size);
+    /**
+     * Handles an ordered RPC message, if it is addressed to this node, for
+     * rpc_message_handler and rpc_batch_handler.
+     * @param delivery_lock Locked on the subgroup's delivery lock before the
+     * message is handled, if it isn't already, and left locked
+     */
+    void handle_rpc_message(subgroup_id_t subgroup_id, node_id_t sender_id, char* msg_buf,
+                            uint32_t payload_size, std::unique_lock<std::shared_timed_mutex>& delivery_lock);
+
+    /** Sends a peer-to-peer message over RDMA if possible, otherwise over TCP. */
+    void p2p_write(node_id_t dest_node, const char* buffer, std::size_t size);
+
+    /** The replies to ordered queries waiting to be written to one caller */
+    struct ReplyBatch {
+        /** The replies back to back, each with its RPC header */
+        std::vector<char> replies;
+        /** When the first of them was added */
+        std::chrono::steady_clock::time_point first_reply;
+    };
+    /** The replies that have not been written yet, by destination, if
+     * DerechoParams::reply_batch_window_us is nonzero */
+    std::map<node_id_t, ReplyBatch> reply_batches;
+    std::mutex reply_batches_mutex;
+    std::condition_variable reply_batches_cv;
+    /** Writes out each batch of replies once it has waited for the window */
+    std::thread reply_flush_thread;
+
+    /**
+     * Sends the reply to an ordered query to its caller, adding it to the
+     * caller's batch of replies if replies are batched. A batch is written
+     * early if the reply would not fit in it.
+     */
+    void send_reply(node_id_t dest_node, const char* reply, std::size_t size);
+    /** Body of reply_flush_thread. */
+    void reply_flush_loop();
+
+    /**
+     * Handles each of the messages that one RDMA write delivered, which is
+     * several if they are a batch of replies; each has its own RPC header.
+     */
+    void dispatch_p2p_messages(char* msg_buf, std::size_t size, char* reply_buf, uint32_t reply_buf_size);
+
 public:
     RPCManager(node_id_t node_id, ViewManager& group_view_manager)
             : nid(node_id),
@@ -85,9 +201,22 @@ public:
               view_manager(group_view_manager),
               //Connections is initially empty, all connections are added in the new view callback
               connections(node_id, std::map<node_id_t, ip_addr>(),
-                          group_view_manager.derecho_params.rpc_port),
-              replySendBuffer(new char[group_view_manager.derecho_params.max_payload_size]) {
+                          group_view_manager.derecho_params.rpc_port) {
+        if(group_view_manager.derecho_params.p2p_over_rdma) {
+            rdma_connections = std::make_unique<P2PRDMAConnections>(
+                    MulticastGroup::compute_max_msg_size(group_view_manager.derecho_params.max_payload_size,
+                                                         group_view_manager.derecho_params.block_size)
+                    - sizeof(header));
+        }
+        for(unsigned int i = 0; i < group_view_manager.derecho_params.num_p2p_handler_threads; ++i) {
+            p2p_workers.emplace_back(std::make_unique<P2PHandlerWorker>());
+            p2p_workers.back()->thread = std::thread(&RPCManager::p2p_worker_loop, this,
+                                                     std::ref(*p2p_workers.back()));
+        }
         rpc_thread = std::thread(&RPCManager::p2p_receive_loop, this);
+        if(group_view_manager.derecho_params.reply_batch_window_us > 0) {
+            reply_flush_thread = std::thread(&RPCManager::reply_flush_loop, this);
+        }
     }
 
     ~RPCManager();
@@ -113,11 +242,14 @@ public:
         //FunctionTuple is a std::tuple of partial_wrapped<Tag, Ret, UserProvidedClass, Args>,
         //which is the result of the user calling tag<Tag>(&UserProvidedClass::method) on each RPC method
         //Use callFunc to unpack the tuple into a variadic parameter pack for build_remoteinvocableclass
-        return mutils::callFunc([&](const auto&... unpacked_functions) {
+        delivery_locks[instance_id];
+        auto invocable_class = mutils::callFunc([&](const auto&... unpacked_functions) {
             return build_remote_invocable_class<UserProvidedClass>(nid, instance_id, *receivers,
                                                                    bind_to_instance(cls, unpacked_functions)...);
         },
-                                funs);
+                                                funs);
+        build_dispatch_table(instance_id);
+        return invocable_class;
     }
 
     /**
@@ -137,7 +269,7 @@ public:
      */
     template <typename UserProvidedClass, typename FunctionTuple>
     auto make_remote_invoker(uint32_t instance_id, FunctionTuple funs) {
-        return mutils::callFunc([&](const auto&... unpacked_functions) {
+        auto invoker = mutils::callFunc([&](const auto&... unpacked_functions) {
             //Supply the template parameters for build_remote_invoker_for_class by
             //asking bind_to_instance for the type of the wrapped<> that corresponds to each partial_wrapped<>
             return build_remote_invoker_for_class<UserProvidedClass,
@@ -146,7 +278,9 @@ public:
                                                           unpacked_functions))...>(
                     nid, instance_id, *receivers);
         },
-                                funs);
+                                        funs);
+        build_dispatch_table(instance_id);
+        return invoker;
     }
 
     /**
@@ -201,6 +335,13 @@ public:
      * @param payload_size The size of the message in the buffer, in bytes
      */
     void rpc_message_handler(subgroup_id_t subgroup_id, node_id_t sender_id, char* msg_buf, uint32_t payload_size);
+    /**
+     * Handles the RPC messages of one delivery pass in a subgroup, in order,
+     * holding the subgroup's delivery lock once for all of them.
+     * @param delivered Called right after each message has been handled
+     */
+    void rpc_batch_handler(subgroup_id_t subgroup_id, const DeliveredMessage* messages, std::size_t num_messages,
+                           const batch_delivered_t& delivered);
 
     /**
      * Returns a LockedReference to the TCP socket connected to the specified
@@ -223,6 +364,21 @@ public:
     int populate_nodelist_header(const std::vector<node_id_t>& dest_nodes, char* buffer,
                                  std::size_t& max_payload_size);
 
+    /**
+     * Writes the header of an RPC message that carries a batch of
+     * invocations: the list of destination nodes, marked as a batch, followed
+     * by the number of invocations. The invocations, each with its own RPC
+     * header, follow it back to back, and are delivered in that order.
+     * @param dest_nodes The list of destination nodes
+     * @param num_invocations The number of invocations in the batch
+     * @param buffer The buffer in which to write the header
+     * @param max_payload_size Out parameter: the maximum total size of the
+     * invocations that can be written to this buffer after the header.
+     * @return The size of the header.
+     */
+    int populate_batch_header(const std::vector<node_id_t>& dest_nodes, std::size_t num_invocations,
+                              char* buffer, std::size_t& max_payload_size);
+
     /**
      * Sends the next message in the MulticastGroup's send buffer (which is
      * assumed to be an RPC message prepared by earlier functions) and registers
@@ -233,6 +389,25 @@ public:
      */
     void finish_rpc_send(uint32_t subgroup_id, const std::vector<node_id_t>& dest_nodes, PendingBase& pending_results_handle);
 
+    /**
+     * Like finish_rpc_send, but for a message prepared with
+     * populate_batch_header, whose invocations each have a "promise object".
+     * @param dest_nodes The list of node IDs the message is being sent to
+     * @param pending_results_handles The "promise objects" of the
+     * invocations, in the order they appear in the message.
+     */
+    void finish_rpc_batch_send(uint32_t subgroup_id, const std::vector<node_id_t>& dest_nodes,
+                               const std::vector<std::shared_ptr<PendingBase>>& pending_results_handles);
+
+    /**
+     * Like finish_rpc_send, but for an RPC message too large for the send
+     * buffer, which was prepared in its own buffer and is sent as a stream
+     * (see ViewManager::send_stream). The view lock must not be held.
+     * @param message The whole message, starting with its nodelist header
+     */
+    void finish_rpc_stream_send(uint32_t subgroup_id, const std::vector<node_id_t>& dest_nodes,
+                                const std::vector<char>& message, PendingBase& pending_results_handle);
+
     /**
      * Sends the message in msg_buf to the node identified by dest_node over a
      * TCP connection, and registers the "promise object" in pending_results_handle
@@ -244,6 +419,43 @@ public:
      * send_return for this send.
      */
     void finish_p2p_send(node_id_t dest_node, char* msg_buf, std::size_t size, PendingBase& pending_results_handle);
+
+    /**
+     * @return A buffer, owned by the calling thread, that is large enough to
+     * build any peer-to-peer RPC message in. It stays valid until the thread
+     * exits, and is reused by the thread's next call.
+     */
+    char* p2p_send_buffer();
+
+    /**
+     * Sends the same peer-to-peer message to each of a list of nodes, one
+     * after another without waiting for any replies, and registers the
+     * "promise object" in pending_results_handle to await a reply from each
+     * of them.
+     * @param dest_nodes The nodes to send the message to
+     * @param msg_buf A buffer containing the message
+     * @param size The size of the message, in bytes
+     * @param pending_results_handle A reference to the "promise object" in the
+     * send_return for this send.
+     */
+    void finish_p2p_fanout(const std::vector<node_id_t>& dest_nodes, char* msg_buf, std::size_t size,
+                           PendingBase& pending_results_handle);
+
+    /**
+     * Sends the next message in the subgroup's send buffer, for an ordered
+     * query sent in callback mode, which has no "promise object" to register.
+     * @param subgroup_id The subgroup to send in
+     */
+    void finish_rpc_send_with_callback(uint32_t subgroup_id);
+
+    /**
+     * Sends a peer-to-peer message for a query sent in callback mode, which
+     * has no "promise object" to register.
+     * @param dest_node The node to send the message to
+     * @param msg_buf A buffer containing the message
+     * @param size The size of the message, in bytes
+     */
+    void finish_p2p_send_with_callback(node_id_t dest_node, char* msg_buf, std::size_t size);
 };
 
 //Now that RPCManager is finished being declared, we can declare these convenience types
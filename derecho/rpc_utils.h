@@ -6,12 +6,18 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <exception>
 #include <functional>
 #include <future>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
@@ -24,6 +30,8 @@
 #include <mutils-serialization/SerializationSupport.hpp>
 #include <mutils/macro_utils.hpp>
 
+#include "pooled_allocator.h"
+
 namespace derecho {
 
 //Copied-and-pasted from derecho_sst.h to avoid creating another header just for this type.
@@ -107,6 +115,18 @@ struct node_removed_from_group_exception : public std::exception {
     }
 };
 
+/**
+ * Indicates that no reply to an RPC call will be received from a node because
+ * the caller cancelled the query before the node replied.
+ */
+struct query_cancelled_exception : public std::exception {
+    node_id_t who;
+    query_cancelled_exception(node_id_t who) : who(who) {}
+    virtual const char* what() const noexcept override {
+        return "The query was cancelled before the node replied";
+    }
+};
+
 /**
  * Return type of all the RemoteInvocable::receive_* methods. If the method is
  * receive_call, this struct contains the message to send in reply, along with
@@ -130,6 +150,75 @@ using receive_fun_t = std::function<recv_ret(
         mutils::RemoteDeserialization_v *rdv, const node_id_t&, const char* recv_buf,
         const std::function<char*(int)>& out_alloc)>;
 
+/**
+ * The receive functions of one subgroup, in slots indexed by the low bits of
+ * their function tags (doubled, plus 1 for replies), so that a message is
+ * dispatched with one array access instead of a search of the map of every
+ * receive function. The table is made just large enough for no two of the
+ * subgroup's functions to share a slot; a subgroup can only have functions of
+ * one class, so the class ID doesn't need to be compared.
+ */
+struct DispatchTable {
+    struct Slot {
+        FunctionTag function_id;
+        bool is_reply;
+        /** Points into the map the table was built from, whose entries never move; null if empty */
+        const receive_fun_t* receive = nullptr;
+    };
+    std::vector<Slot> slots;
+    std::size_t mask = 0;
+
+    /**
+     * Builds the table of a subgroup's functions in receivers.
+     * @return False, leaving the table empty, if the functions can't be given
+     * distinct slots in a table of at most max_size slots
+     */
+    bool build(const std::map<Opcode, receive_fun_t>& receivers, uint32_t subgroup_id, std::size_t max_size) {
+        std::vector<std::pair<const Opcode*, const receive_fun_t*>> functions;
+        for(const auto& receiver : receivers) {
+            if(receiver.first.subgroup_id == subgroup_id) {
+                functions.emplace_back(&receiver.first, &receiver.second);
+            }
+        }
+        slots.clear();
+        mask = 0;
+        // Double the table until the functions' slots are all distinct
+        for(std::size_t size = 2; size <= max_size; size *= 2) {
+            if(size < 2 * functions.size()) {
+                continue;
+            }
+            std::vector<Slot> new_slots(size);
+            bool distinct = true;
+            for(const auto& function : functions) {
+                auto& slot = new_slots[(function.first->function_id * 2 + function.first->is_reply) & (size - 1)];
+                if(slot.receive) {
+                    distinct = false;
+                    break;
+                }
+                slot = {function.first->function_id, function.first->is_reply, function.second};
+            }
+            if(distinct) {
+                slots = std::move(new_slots);
+                mask = size - 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** @return The receive function of an opcode of the table's subgroup, or null if it isn't in the table */
+    const receive_fun_t* find(const Opcode& opcode) const {
+        if(slots.empty()) {
+            return nullptr;
+        }
+        const Slot& slot = slots[(opcode.function_id * 2 + opcode.is_reply) & mask];
+        if(slot.receive && slot.function_id == opcode.function_id && slot.is_reply == opcode.is_reply) {
+            return slot.receive;
+        }
+        return nullptr;
+    }
+};
+
 /**
  * The type of map contained in a QueryResults::ReplyMap. The template parameter
  * should be the return type of the query.
@@ -137,6 +226,9 @@ using receive_fun_t = std::function<recv_ret(
 template <typename T>
 using reply_map = std::map<node_id_t, std::future<T>>;
 
+template <typename Ret>
+struct PendingResults;
+
 /**
  * Data structure that (indirectly) holds a set of futures for a single RPC
  * function call; there is one future for each node contacted to make the
@@ -154,7 +246,11 @@ struct QueryResults {
     using type = Ret;
 
     map_fut pending_rmap;
-    QueryResults(map_fut pm) : pending_rmap(std::move(pm)) {}
+    /** The promises of the query; the only owner of them, so that they are
+     * freed as soon as this QueryResults is destroyed or cancelled. */
+    std::shared_ptr<PendingResults<Ret>> pending;
+    QueryResults(map_fut pm, std::shared_ptr<PendingResults<Ret>> pending)
+            : pending_rmap(std::move(pm)), pending(std::move(pending)) {}
 
     struct ReplyMap {
     private:
@@ -182,6 +278,23 @@ struct QueryResults {
 
         auto end() { return std::end(rmap); }
 
+        /** Returns true if this node's reply (or exception) has arrived. */
+        bool ready(const node_id_t& nid) {
+            return rmap.count(nid)
+                   && rmap.at(nid).wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        /** Returns the nodes whose replies (or exceptions) have arrived. */
+        std::vector<node_id_t> ready_nodes() {
+            std::vector<node_id_t> nodes;
+            for(auto& reply : rmap) {
+                if(reply.second.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                    nodes.push_back(reply.first);
+                }
+            }
+            return nodes;
+        }
+
         Ret get(const node_id_t& nid) {
             if(rmap.size() == 0) {
                 assert(parent.pending_rmap.valid());
@@ -200,9 +313,39 @@ private:
 public:
     QueryResults(QueryResults&& o)
             : pending_rmap{std::move(o.pending_rmap)},
-              replies{std::move(o.replies)} {}
+              pending{std::move(o.pending)} {
+        // The ReplyMap must refer to this QueryResults, not the moved-from one
+        replies.rmap = std::move(o.replies.rmap);
+    }
     QueryResults(const QueryResults&) = delete;
 
+    /**
+     * Hands these results to a continuation once the first k replies have
+     * arrived (or all of them, by default, or if fewer than k nodes were
+     * contacted), instead of a thread waiting for them, so that any number of
+     * queries can be in flight without a thread each. This QueryResults is
+     * moved into the query's pending state until then, so it must be an
+     * rvalue, e.g. straight from ordered_query or p2p_query. An exception,
+     * such as the one for a node that was removed from the group, counts as
+     * a reply; a cancelled query is continued at once.
+     * @param continuation Takes the results, whose replies so far can be
+     * read with get() without blocking. It runs on the thread that records
+     * the last reply it waits for, so it should be short and must not block;
+     * it may send more queries. The results are destroyed when it returns,
+     * dropping later replies, unless it moves them somewhere.
+     * @param k The number of replies to wait for
+     */
+    void then(std::function<void(QueryResults&)> continuation,
+              std::size_t k = std::numeric_limits<std::size_t>::max()) && {
+        std::shared_ptr<PendingResults<Ret>> query = pending;
+        if(!query) {
+            // A cancelled query has all the replies it will ever get
+            continuation(*this);
+            return;
+        }
+        query->continue_with(std::make_unique<QueryResults>(std::move(*this)), std::move(continuation), k);
+    }
+
     /**
      * Wait the specified duration; if a ReplyMap is available
      * after that duration, return it. Otherwise return nullptr.
@@ -232,6 +375,59 @@ public:
             }
         }
     }
+
+    /**
+     * Wait the specified duration for the first k replies (or all of them,
+     * if fewer than k nodes were contacted); if they have arrived by then,
+     * return the ReplyMap, whose ready() and ready_nodes() tell which nodes
+     * replied. Otherwise return nullptr. An exception, such as the one for a
+     * node that was removed from the group, counts as a reply.
+     */
+    template <typename Time>
+    ReplyMap* wait_for_replies(std::size_t k, Time t) {
+        const auto deadline = std::chrono::steady_clock::now() + t;
+        if(replies.rmap.size() == 0) {
+            if(pending_rmap.wait_until(deadline) != std::future_status::ready) {
+                return nullptr;
+            }
+            replies.rmap = std::move(*pending_rmap.get());
+        }
+        if(!pending) {
+            return &replies;
+        }
+        const std::size_t needed = std::min(k, replies.rmap.size());
+        std::unique_lock<std::mutex> lock(pending->mutex);
+        if(!pending->reply_cv.wait_until(lock, deadline, [&]() { return pending->responded_nodes.size() >= needed; })) {
+            return nullptr;
+        }
+        return &replies;
+    }
+
+    /**
+     * Block until the first k replies have arrived, as in wait_for_replies(),
+     * then return the ReplyMap by reference.
+     */
+    ReplyMap& get_replies(std::size_t k) {
+        using namespace std::chrono;
+        while(true) {
+            if(auto rmap = wait_for_replies(k, 5min)) {
+                return *rmap;
+            }
+        }
+    }
+
+    /**
+     * Give up on the replies that haven't arrived yet: getting them throws
+     * query_cancelled_exception, and the promises for them are freed at once,
+     * so that replies arriving later are dropped. If the query hasn't been
+     * sent yet, waiting for its ReplyMap throws std::future_error instead.
+     */
+    void cancel() {
+        if(pending) {
+            pending->cancel();
+            pending.reset();
+        }
+    }
 };
 
 template <>
@@ -240,15 +436,43 @@ struct QueryResults<void> {
     /* This currently has no functionality; Ken suggested a "flush," which
        we might want to have in both this and the non-void variant.
     */
+    /** Owns the query's (empty) PendingResults while it is being sent */
+    std::shared_ptr<PendingResults<void>> pending;
 };
 
+/**
+ * A function that receives one node's reply to a query sent in callback mode,
+ * instead of the reply being stored in a QueryResults. The reply pointer is
+ * null if the remote function threw an exception, and is only valid until the
+ * callback returns.
+ */
+template <typename Ret>
+using reply_callback_t = std::function<void(const node_id_t&, const Ret*)>;
+
+/**
+ * Invocation IDs with this bit set belong to queries sent in callback mode,
+ * whose replies are handed to a reply_callback_t instead of a PendingResults.
+ */
+constexpr long int callback_invocation_bit = 1L << 62;
+
+/**
+ * The count of destination nodes at the front of an ordered RPC message has
+ * this bit set if the message carries a batch of invocations rather than just
+ * one, see RPCManager::populate_batch_header().
+ */
+constexpr std::size_t batch_message_bit = std::size_t{1} << 63;
+
 /**
  * Abstract base type for PendingResults. This allows us to store a pointer to
  * any template specialization of PendingResults without knowing the template
  * parameter.
  */
-class PendingBase {
+class PendingBase : public std::enable_shared_from_this<PendingBase> {
 public:
+    /** When the call was sent, by metrics::now_ns(), if it was a peer-to-peer
+     * call, or else 0; the round-trip times of its replies are measured from it */
+    std::atomic<uint64_t> p2p_send_time{0};
+
     virtual void fulfill_map(const node_list_t&) = 0;
     virtual void set_exception_for_removed_node(const node_id_t&) = 0;
     virtual ~PendingBase() {}
@@ -264,11 +488,28 @@ public:
  */
 template <typename Ret>
 struct PendingResults : public PendingBase {
-    std::promise<std::unique_ptr<reply_map<Ret>>> pending_map;
-    std::map<node_id_t, std::promise<Ret>> populated_promises;
+    /** The bookkeeping for a call is made and freed once per call, so it
+     * comes from the pools of PooledAllocator */
+    using node_set = std::set<node_id_t, std::less<node_id_t>, PooledAllocator<node_id_t>>;
+    using promise_map = std::map<node_id_t, std::promise<Ret>, std::less<node_id_t>,
+                                 PooledAllocator<std::pair<const node_id_t, std::promise<Ret>>>>;
+
+    std::promise<std::unique_ptr<reply_map<Ret>>> pending_map{std::allocator_arg,
+                                                              PooledAllocator<std::unique_ptr<reply_map<Ret>>>{}};
+    promise_map populated_promises;
 
     bool map_fulfilled = false;
-    std::set<node_id_t> dest_nodes, responded_nodes;
+    node_set dest_nodes, responded_nodes;
+    /** Guards the members above, which the sending thread, the threads that
+     * receive replies, and view changes all update. */
+    std::mutex mutex;
+    /** Notified each time a reply or exception is recorded */
+    std::condition_variable reply_cv;
+    /** Set by QueryResults::then(), and cleared when the continuation runs;
+     * the results keep this PendingResults alive until then. */
+    std::function<void(QueryResults<Ret>&)> continuation;
+    std::unique_ptr<QueryResults<Ret>> continued_results;
+    std::size_t continuation_replies = 0;
 
     /**
      * Fill the result map with an entry for each node that will be contacted
@@ -276,37 +517,111 @@ struct PendingResults : public PendingBase {
      * @param who A list of nodes that will be contacted
      */
     void fulfill_map(const node_list_t& who) {
+        std::unique_lock<std::mutex> lock(mutex);
         map_fulfilled = true;
         std::unique_ptr<reply_map<Ret>> to_add = std::make_unique<reply_map<Ret>>();
         for(const auto& e : who) {
-            to_add->emplace(e, populated_promises[e].get_future());
+            to_add->emplace(e, promise_for(e).get_future());
         }
         dest_nodes.insert(who.begin(), who.end());
         pending_map.set_value(std::move(to_add));
+        run_continuation_if_ready(lock);
     }
 
     void set_exception_for_removed_node(const node_id_t& removed_nid) {
+        std::unique_lock<std::mutex> lock(mutex);
         assert(map_fulfilled);
         if(dest_nodes.find(removed_nid) != dest_nodes.end()
            && responded_nodes.find(removed_nid) == responded_nodes.end()) {
-            set_exception(removed_nid,
-                          std::make_exception_ptr(
-                                  node_removed_from_group_exception{removed_nid}));
+            record_exception(removed_nid,
+                             std::make_exception_ptr(
+                                     node_removed_from_group_exception{removed_nid}));
+            run_continuation_if_ready(lock);
         }
     }
 
     void set_value(const node_id_t& nid, const Ret& v) {
+        std::unique_lock<std::mutex> lock(mutex);
         responded_nodes.insert(nid);
-        populated_promises[nid].set_value(v);
+        promise_for(nid).set_value(v);
+        reply_cv.notify_all();
+        run_continuation_if_ready(lock);
     }
 
     void set_exception(const node_id_t& nid, const std::exception_ptr e) {
-        responded_nodes.insert(nid);
-        populated_promises[nid].set_exception(e);
+        std::unique_lock<std::mutex> lock(mutex);
+        record_exception(nid, e);
+        run_continuation_if_ready(lock);
+    }
+
+    /** Returns true once every node the query was sent to has replied. */
+    bool all_replied() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return map_fulfilled
+               && std::includes(responded_nodes.begin(), responded_nodes.end(),
+                                dest_nodes.begin(), dest_nodes.end());
+    }
+
+    /** Sets query_cancelled_exception for every node that hasn't replied. */
+    void cancel() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(const node_id_t& nid : dest_nodes) {
+            if(responded_nodes.find(nid) == responded_nodes.end()) {
+                record_exception(nid, std::make_exception_ptr(query_cancelled_exception{nid}));
+            }
+        }
+        run_continuation_if_ready(lock);
+    }
+
+    /** Registers the continuation of QueryResults::then(), and runs it at
+     * once if its replies are already in. */
+    void continue_with(std::unique_ptr<QueryResults<Ret>> results,
+                       std::function<void(QueryResults<Ret>&)> next, std::size_t k) {
+        std::unique_lock<std::mutex> lock(mutex);
+        continued_results = std::move(results);
+        continuation = std::move(next);
+        continuation_replies = k;
+        run_continuation_if_ready(lock);
     }
 
     QueryResults<Ret> get_future() {
-        return QueryResults<Ret>{pending_map.get_future()};
+        return QueryResults<Ret>{pending_map.get_future(),
+                                 std::static_pointer_cast<PendingResults<Ret>>(shared_from_this())};
+    }
+
+private:
+    /**
+     * Runs the continuation, if there is one and enough replies are in,
+     * after releasing the lock, so that it can send more queries. This
+     * PendingResults may be freed with the results once it returns.
+     */
+    void run_continuation_if_ready(std::unique_lock<std::mutex>& lock) {
+        if(!continuation || !map_fulfilled
+           || responded_nodes.size() < std::min(continuation_replies, dest_nodes.size())) {
+            return;
+        }
+        std::function<void(QueryResults<Ret>&)> next = std::move(continuation);
+        continuation = nullptr;
+        std::unique_ptr<QueryResults<Ret>> results = std::move(continued_results);
+        lock.unlock();
+        next(*results);
+    }
+
+    /** @return The promise of nid's reply, whose shared state also comes
+     * from the pools; mutex must be held. */
+    std::promise<Ret>& promise_for(const node_id_t& nid) {
+        auto entry = populated_promises.find(nid);
+        if(entry == populated_promises.end()) {
+            entry = populated_promises.emplace(nid, std::promise<Ret>(std::allocator_arg, PooledAllocator<Ret>{})).first;
+        }
+        return entry->second;
+    }
+
+    /** Records an exception as a node's reply; mutex must be held. */
+    void record_exception(const node_id_t& nid, const std::exception_ptr e) {
+        responded_nodes.insert(nid);
+        promise_for(nid).set_exception(e);
+        reply_cv.notify_all();
     }
 };
 
@@ -318,7 +633,9 @@ struct PendingResults<void> : public PendingBase {
 
     void fulfill_map(const node_list_t&) {}
     void set_exception_for_removed_node(const node_id_t&) {}
-    QueryResults<void> get_future() { return QueryResults<void>{}; }
+    QueryResults<void> get_future() {
+        return QueryResults<void>{std::static_pointer_cast<PendingResults<void>>(shared_from_this())};
+    }
 };
 
 /**
@@ -353,6 +670,14 @@ inline void retrieve_header(mutils::RemoteDeserialization_v *rdv,
     op = ((Opcode const* const)(sizeof(std::size_t) + reply_buf))[0];
     from = ((node_id_t const* const)(sizeof(std::size_t) + sizeof(Opcode) + reply_buf))[0];
 }
+
+/**
+ * @return True if the RPC message whose payload (the part after the header)
+ * starts at this address was sent in callback mode.
+ */
+inline bool is_callback_invocation(char const* const payload) {
+    return ((long int const* const)payload)[0] & callback_invocation_bit;
+}
 }  // namespace remote_invocation_utilities
 
 }  // namespace rpc
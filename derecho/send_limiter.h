@@ -0,0 +1,169 @@
+/**
+ * @file send_limiter.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "derecho_internal.h"
+
+namespace derecho {
+
+/**
+ * How much of the sending capacity one subgroup may take, so that a subgroup
+ * with an aggressive sender can't take the whole window and the sender
+ * threads away from the others. The defaults leave a subgroup unlimited.
+ */
+struct SendLimit {
+    /** The messages per second this node may send in the subgroup, or 0 for no limit */
+    double messages_per_second = 0;
+    /** The bytes per second, headers included, or 0 for no limit */
+    double bytes_per_second = 0;
+    /** The messages that may be sent at once after an idle period; 0 means
+     * 10 ms worth of messages_per_second, but at least one */
+    double burst_messages = 0;
+    /** The bytes that may be sent at once after an idle period; 0 means
+     * 10 ms worth of bytes_per_second */
+    double burst_bytes = 0;
+    /** The most messages that may wait to be handed to RDMC, or 0 for as
+     * many as the window allows */
+    std::size_t max_pending_sends = 0;
+    /** The number of messages a sender thread sends in the subgroup at a
+     * turn before it moves on to its next subgroup */
+    uint32_t weight = 1;
+};
+
+/**
+ * Applies a SendLimit to one subgroup. The rate limits are token buckets,
+ * one for messages and one for bytes: a send is admitted while both buckets
+ * have tokens left, and then takes its cost out of them, which may leave
+ * them in debt, so a message larger than the burst is still sent, just
+ * followed by a longer pause. Senders check admits() before taking a
+ * buffer, so a throttled send gets nullptr from get_sendbuffer_ptr, the same
+ * backpressure signal as a full window. The limit can be changed from any
+ * thread, so it is guarded by a mutex, but the checks made by subgroups
+ * without a limit are lock-free.
+ */
+class SendLimiter {
+    std::mutex mutex;
+    SendLimit limit;
+    double message_tokens = 0;
+    double byte_tokens = 0;
+    uint64_t last_refill_ns = 0;
+    std::atomic<bool> rate_limited{false};
+    std::atomic<std::size_t> pending_limit{0};
+    std::atomic<uint32_t> turn_weight{1};
+
+    /** Adds the tokens earned since the last refill; mutex must be held */
+    void refill(uint64_t now_ns) {
+        if(now_ns > last_refill_ns) {
+            const double seconds = (now_ns - last_refill_ns) / 1e9;
+            message_tokens = std::min(message_tokens + seconds * limit.messages_per_second, limit.burst_messages);
+            byte_tokens = std::min(byte_tokens + seconds * limit.bytes_per_second, limit.burst_bytes);
+        }
+        last_refill_ns = now_ns;
+    }
+
+public:
+    void configure(const SendLimit& new_limit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        limit = new_limit;
+        if(limit.burst_messages <= 0) {
+            limit.burst_messages = std::max(1.0, limit.messages_per_second / 100);
+        }
+        if(limit.burst_bytes <= 0) {
+            limit.burst_bytes = limit.bytes_per_second / 100;
+        }
+        // A subgroup without a limit on one of them always has that token
+        if(limit.messages_per_second <= 0) {
+            limit.burst_messages = 1;
+        }
+        if(limit.bytes_per_second <= 0) {
+            limit.burst_bytes = 1;
+        }
+        message_tokens = limit.burst_messages;
+        byte_tokens = limit.burst_bytes;
+        last_refill_ns = 0;
+        rate_limited = limit.messages_per_second > 0 || limit.bytes_per_second > 0;
+        pending_limit = limit.max_pending_sends;
+        turn_weight = std::max<uint32_t>(limit.weight, 1);
+    }
+
+    /** @return True if a message may be sent now */
+    bool admits(uint64_t now_ns) {
+        if(!rate_limited.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        refill(now_ns);
+        return message_tokens > 0 && byte_tokens > 0;
+    }
+
+    /** Takes the cost of an admitted message out of the buckets */
+    void charge(uint64_t msg_size) {
+        if(!rate_limited.load(std::memory_order_relaxed)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if(limit.messages_per_second > 0) {
+            message_tokens -= 1;
+        }
+        if(limit.bytes_per_second > 0) {
+            byte_tokens -= msg_size;
+        }
+    }
+
+    /** @return How long from now_ns until admits() will return true, in ns */
+    uint64_t wait_ns(uint64_t now_ns) {
+        if(!rate_limited.load(std::memory_order_relaxed)) {
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        refill(now_ns);
+        double seconds = 0;
+        if(message_tokens <= 0) {
+            seconds = std::max(seconds, (1e-9 - message_tokens) / limit.messages_per_second);
+        }
+        if(byte_tokens <= 0) {
+            seconds = std::max(seconds, (1e-9 - byte_tokens) / limit.bytes_per_second);
+        }
+        return seconds * 1e9 + 1;
+    }
+
+    /** @return The most messages that may wait for RDMC, or 0 for no limit */
+    std::size_t max_pending_sends() const {
+        return pending_limit.load(std::memory_order_relaxed);
+    }
+
+    /** @return The messages a sender thread sends in the subgroup at a turn */
+    uint32_t weight() const {
+        return turn_weight.load(std::memory_order_relaxed);
+    }
+};
+
+/** The SendLimiters of the subgroups, by subgroup ID, shared by the
+ * MulticastGroups of successive views so that the limits, and the tokens
+ * left, survive view changes */
+struct SendLimiters {
+    std::mutex mutex;
+    std::map<subgroup_id_t, std::shared_ptr<SendLimiter>> limiters;
+
+    /** @return The subgroup's limiter, which is created unlimited the first time */
+    std::shared_ptr<SendLimiter> of(subgroup_id_t subgroup_num) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<SendLimiter>& limiter = limiters[subgroup_num];
+        if(!limiter) {
+            limiter = std::make_shared<SendLimiter>();
+        }
+        return limiter;
+    }
+};
+}  // namespace derecho
@@ -0,0 +1,156 @@
+/**
+ * @file send_receipt.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include "metrics.h"
+
+namespace derecho {
+
+/**
+ * The stages this node's messages in one subgroup have reached, as the index
+ * of the latest of its messages to reach each, for the SendReceipts of its
+ * sends. The stages are those of MessageStageTracker; only STABLE, DELIVERED,
+ * PERSISTED and GLOBALLY_PERSISTED are kept. Messages reach each stage in
+ * order, so a frontier is enough. Advancing a frontier only takes the lock if
+ * someone is waiting.
+ */
+class SendFrontiers {
+    std::array<std::atomic<long long int>, metrics::NUM_MESSAGE_STAGES> frontiers;
+    /** The index of the message whose buffer was handed out last */
+    std::atomic<long long int> last_acquired{-1};
+    std::atomic<int> waiters{0};
+    /** Set when the view ends; messages that hadn't reached a stage by then
+     * can't be followed into the next view */
+    std::atomic<bool> closed{false};
+    std::mutex mutex;
+    std::condition_variable advanced;
+
+    void notify_waiters() {
+        if(waiters.load() > 0) {
+            // Taking the lock keeps a waiter from missing the notification
+            // between checking the frontier and starting to wait
+            std::lock_guard<std::mutex> lock(mutex);
+            advanced.notify_all();
+        }
+    }
+
+public:
+    SendFrontiers() {
+        for(auto& frontier : frontiers) {
+            frontier.store(-1, std::memory_order_relaxed);
+        }
+    }
+
+    void acquired(long long int index) {
+        last_acquired.store(index, std::memory_order_relaxed);
+    }
+    long long int get_last_acquired() const {
+        return last_acquired.load(std::memory_order_relaxed);
+    }
+
+    /** Records that the messages up to an index have reached a stage. */
+    void advance(metrics::MessageStage stage, long long int index) {
+        if(index <= frontiers[stage].load(std::memory_order_relaxed)) {
+            return;
+        }
+        frontiers[stage].store(index);
+        notify_waiters();
+    }
+
+    /** Wakes the waiters for good, once the view has ended. */
+    void close() {
+        closed = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        advanced.notify_all();
+    }
+
+    bool reached(metrics::MessageStage stage, long long int index) const {
+        return frontiers[stage].load() >= index;
+    }
+
+    /**
+     * Waits until a message reaches a stage, the view ends, or a deadline.
+     * @return True if the message reached the stage
+     */
+    bool wait_until(metrics::MessageStage stage, long long int index,
+                    std::chrono::steady_clock::time_point deadline) {
+        if(reached(stage, index)) {
+            return true;
+        }
+        ++waiters;
+        std::unique_lock<std::mutex> lock(mutex);
+        advanced.wait_until(lock, deadline, [&]() { return reached(stage, index) || closed; });
+        --waiters;
+        return reached(stage, index);
+    }
+
+    bool is_closed() const {
+        return closed;
+    }
+};
+
+/**
+ * A handle on one ordered_send, which tells when the message has reached a
+ * stage at the sender: STABLE, once every member of the shard has received
+ * it; DELIVERED, once its upcall here has returned; PERSISTED, once this node
+ * has persisted its version; GLOBALLY_PERSISTED, once the whole shard has.
+ * It completes from the frontiers this node already tracks, so it costs no
+ * reply messages; a pipelined writer can keep the receipts of its sends and
+ * check or wait on them later. If the view changes before the message reaches
+ * a stage, the message may still get there in the next view, where the
+ * receipt can't follow it, and waiting returns false.
+ */
+class SendReceipt {
+    std::shared_ptr<SendFrontiers> frontiers;
+    long long int index = -1;
+
+public:
+    /** An empty receipt, for a send that couldn't be tracked */
+    SendReceipt() = default;
+    SendReceipt(std::shared_ptr<SendFrontiers> frontiers, long long int index)
+            : frontiers(std::move(frontiers)), index(index) {}
+
+    /** @return False for an empty receipt */
+    bool valid() const {
+        return frontiers != nullptr;
+    }
+    /** @return The message's index among this node's messages in the view */
+    long long int get_index() const {
+        return index;
+    }
+
+    /** @return True if the message has reached a stage */
+    bool reached(metrics::MessageStage stage) const {
+        return frontiers && frontiers->reached(stage, index);
+    }
+
+    /**
+     * Blocks until the message reaches a stage, or the view ends.
+     * @return True if the message reached the stage
+     */
+    bool wait(metrics::MessageStage stage) const {
+        return frontiers && frontiers->wait_until(stage, index, std::chrono::steady_clock::time_point::max());
+    }
+
+    /**
+     * Blocks until the message reaches a stage, the view ends, or a timeout.
+     * @return True if the message reached the stage
+     */
+    template <typename Rep, typename Period>
+    bool wait_for(metrics::MessageStage stage, const std::chrono::duration<Rep, Period>& timeout) const {
+        return frontiers && frontiers->wait_until(stage, index, std::chrono::steady_clock::now() + timeout);
+    }
+};
+
+}  // namespace derecho
@@ -0,0 +1,322 @@
+/**
+ * @file shard_router.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "derecho_internal.h"
+#include "replicated.h"
+
+namespace derecho {
+
+/** How a ShardRouter chooses which member of a shard to send a query to */
+enum class ReplicaSelection {
+    /** The member with the fewest of this router's queries still unanswered */
+    LEAST_OUTSTANDING,
+    /** A member chosen uniformly at random */
+    RANDOM,
+    /** The least-outstanding of the members that the router's locality
+     * function says are local, such as those in this node's rack, or of all
+     * the members if none of them is */
+    LOCAL_FIRST
+};
+
+/**
+ * Routes requests about keys to the shards of a subgroup that this node is
+ * not a member of, and spreads them across each shard's members. Keys are
+ * placed on the shards by consistent hashing: each shard owns the arcs of a
+ * hash ring that end at points_per_shard points derived from its index, so
+ * the same key always goes to the same shard, and adding or removing shards
+ * moves only the keys on the arcs that change owner. Within a shard, queries
+ * go to the member chosen by the ReplicaSelection, rather than always to the
+ * first member as with ShardIterator. The routers made by
+ * Group::get_shard_router are subscribed to view changes, which push them
+ * the subgroup's new layout when it changes, so they always route to the
+ * current members without asking the group. A member that a caller finds
+ * unreachable before the view changes can be passed to mark_unreachable,
+ * so that the retry goes to another member at once. A router may be used
+ * from several threads at once.
+ */
+template <typename T>
+class ShardRouter {
+    ExternalCaller<T>& EC;
+    const ReplicaSelection selection;
+    const std::function<bool(node_id_t)> is_local;
+    const uint32_t points_per_shard;
+
+    /** Guards everything below, which changes when a new layout is pushed */
+    mutable std::mutex mutex;
+    /** The view whose layout the router has */
+    int32_t vid;
+    std::vector<std::vector<node_id_t>> shard_members;
+    /** The ring's points, sorted, each with the shard that owns the arc ending at it */
+    std::vector<std::pair<uint64_t, uint32_t>> ring;
+    /** For each member, by shard and rank, a check for each of its queries
+     * that may still be unanswered, which returns false once it is answered */
+    std::vector<std::vector<std::vector<std::function<bool()>>>> pending_checks;
+    /** Members that callers found unreachable since the layout last changed */
+    std::set<node_id_t> unreachable;
+    /** Where the scan for the least-outstanding member starts, so that ties
+     * don't all go to the first member */
+    uint32_t next_start = 0;
+
+    static uint64_t mix(uint64_t x) {
+        // The SplitMix64 finalizer, so that std::hash's identity hash of
+        // integers still spreads over the ring
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    /** Places points_per_shard ring points for each shard; mutex must be held */
+    void build_ring() {
+        ring.clear();
+        for(uint32_t shard = 0; shard < shard_members.size(); ++shard) {
+            for(uint32_t point = 0; point < points_per_shard; ++point) {
+                ring.emplace_back(mix(((uint64_t)shard << 32) | point), shard);
+            }
+        }
+        std::sort(ring.begin(), ring.end());
+    }
+
+    /** mutex must be held */
+    uint32_t locked_shard_of_hash(uint64_t hash) const {
+        if(ring.empty()) {
+            throw derecho_exception("The subgroup has no shards to route to");
+        }
+        auto owner = std::lower_bound(ring.begin(), ring.end(), std::make_pair(mix(hash), uint32_t{0}));
+        return owner == ring.end() ? ring.front().second : owner->second;
+    }
+
+    /** @return The number of the member's queries that are still unanswered;
+     * mutex must be held */
+    std::size_t outstanding(uint32_t shard, uint32_t rank) {
+        auto& checks = pending_checks[shard][rank];
+        checks.erase(std::remove_if(checks.begin(), checks.end(),
+                                    [](const std::function<bool()>& pending) { return !pending(); }),
+                     checks.end());
+        return checks.size();
+    }
+
+    /** @return The rank of the candidate member with the fewest outstanding
+     * queries; mutex must be held */
+    uint32_t least_outstanding(uint32_t shard, const std::vector<uint32_t>& candidates) {
+        const uint32_t start = next_start++;
+        uint32_t best = candidates[start % candidates.size()];
+        std::size_t best_outstanding = outstanding(shard, best);
+        for(std::size_t i = 1; i < candidates.size(); ++i) {
+            const uint32_t rank = candidates[(start + i) % candidates.size()];
+            const std::size_t rank_outstanding = outstanding(shard, rank);
+            if(rank_outstanding < best_outstanding) {
+                best = rank;
+                best_outstanding = rank_outstanding;
+            }
+        }
+        return best;
+    }
+
+    /** @return The rank of the member of the shard to send to; mutex must be held */
+    uint32_t pick_rank(uint32_t shard) {
+        const std::vector<node_id_t>& members = shard_members.at(shard);
+        if(members.empty()) {
+            throw derecho_exception("Shard " + std::to_string(shard) + " has no members to route to");
+        }
+        // Unreachable members are skipped, unless the shard has no others
+        std::vector<uint32_t> reachable;
+        for(uint32_t rank = 0; rank < members.size(); ++rank) {
+            if(unreachable.count(members[rank]) == 0) {
+                reachable.push_back(rank);
+            }
+        }
+        if(reachable.empty()) {
+            for(uint32_t rank = 0; rank < members.size(); ++rank) {
+                reachable.push_back(rank);
+            }
+        }
+        if(selection == ReplicaSelection::RANDOM) {
+            thread_local std::mt19937 engine{std::random_device{}()};
+            return reachable[std::uniform_int_distribution<std::size_t>(0, reachable.size() - 1)(engine)];
+        }
+        std::vector<uint32_t> candidates;
+        if(selection == ReplicaSelection::LOCAL_FIRST && is_local) {
+            for(uint32_t rank : reachable) {
+                if(is_local(members[rank])) {
+                    candidates.push_back(rank);
+                }
+            }
+        }
+        return least_outstanding(shard, candidates.empty() ? reachable : candidates);
+    }
+
+public:
+    /**
+     * @param EC The ExternalCaller of the subgroup
+     * @param shard_members The members of each of the subgroup's shards
+     * @param selection How to choose a member of a shard
+     * @param is_local For LOCAL_FIRST, returns true for the nodes that are
+     * local to this one
+     * @param points_per_shard The number of ring points each shard has; more
+     * points share the keys more evenly among the shards
+     * @param vid The view that shard_members come from
+     */
+    ShardRouter(ExternalCaller<T>& EC, std::vector<std::vector<node_id_t>> shard_members,
+                ReplicaSelection selection = ReplicaSelection::LEAST_OUTSTANDING,
+                std::function<bool(node_id_t)> is_local = nullptr,
+                uint32_t points_per_shard = 64,
+                int32_t vid = 0)
+            : EC(EC),
+              selection(selection),
+              is_local(std::move(is_local)),
+              points_per_shard(points_per_shard),
+              vid(vid),
+              shard_members(std::move(shard_members)) {
+        for(const auto& members : this->shard_members) {
+            pending_checks.emplace_back(members.size());
+        }
+        build_ring();
+    }
+
+    /**
+     * Replaces the layout with a newer view's. The outstanding queries of
+     * members that are still in their shard keep counting, and members
+     * marked unreachable are tried again. The ring is only rebuilt if the
+     * number of shards changed, so keys stay on their shards otherwise.
+     * @return False if the router already had this view's layout or a
+     * newer one, which it keeps
+     */
+    bool update_layout(int32_t new_vid, const std::vector<std::vector<node_id_t>>& new_shard_members) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(new_vid <= vid) {
+            return false;
+        }
+        vid = new_vid;
+        unreachable.clear();
+        if(new_shard_members == shard_members) {
+            return true;
+        }
+        std::vector<std::vector<std::vector<std::function<bool()>>>> new_pending_checks;
+        for(uint32_t shard = 0; shard < new_shard_members.size(); ++shard) {
+            new_pending_checks.emplace_back(new_shard_members[shard].size());
+            if(shard >= shard_members.size()) {
+                continue;
+            }
+            for(uint32_t rank = 0; rank < new_shard_members[shard].size(); ++rank) {
+                auto old_rank = std::find(shard_members[shard].begin(), shard_members[shard].end(),
+                                          new_shard_members[shard][rank]);
+                if(old_rank != shard_members[shard].end()) {
+                    new_pending_checks[shard][rank] = std::move(pending_checks[shard][old_rank - shard_members[shard].begin()]);
+                }
+            }
+        }
+        const bool shards_changed = new_shard_members.size() != shard_members.size();
+        shard_members = new_shard_members;
+        pending_checks = std::move(new_pending_checks);
+        if(shards_changed) {
+            build_ring();
+        }
+        return true;
+    }
+
+    /** Stops sending to a member that a query found unreachable, until the
+     * layout next changes */
+    void mark_unreachable(node_id_t node) {
+        std::lock_guard<std::mutex> lock(mutex);
+        unreachable.insert(node);
+    }
+
+    /** @return The view that the router's layout is from */
+    int32_t get_vid() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return vid;
+    }
+
+    uint32_t num_shards() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return shard_members.size();
+    }
+
+    /** @return The shard that owns a key with this hash */
+    uint32_t shard_of_hash(uint64_t hash) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return locked_shard_of_hash(hash);
+    }
+
+    /** @return The shard that owns the key, hashed with std::hash */
+    template <typename Key>
+    uint32_t shard_of(const Key& key) const {
+        return shard_of_hash(std::hash<Key>{}(key));
+    }
+
+    /** @return The member of the shard that the next query to it should go to */
+    node_id_t pick_replica(uint32_t shard) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return shard_members.at(shard)[pick_rank(shard)];
+    }
+
+    /** @return The member of the key's shard that the next query should go to */
+    template <typename Key>
+    node_id_t replica_for(const Key& key) {
+        const uint64_t hash = std::hash<Key>{}(key);
+        std::lock_guard<std::mutex> lock(mutex);
+        const uint32_t shard = locked_shard_of_hash(hash);
+        return shard_members[shard][pick_rank(shard)];
+    }
+
+    /**
+     * Sends a peer-to-peer query about the key to a member of its shard,
+     * chosen by the router's ReplicaSelection. The query counts as
+     * outstanding at that member until its reply arrives or the returned
+     * QueryResults is destroyed or cancelled.
+     */
+    template <rpc::FunctionTag tag, typename Key, typename... Args>
+    auto p2p_query(const Key& key, Args&&... args) {
+        const uint64_t hash = std::hash<Key>{}(key);
+        node_id_t dest_node;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const uint32_t shard = locked_shard_of_hash(hash);
+            dest_node = shard_members[shard][pick_rank(shard)];
+        }
+        auto results = EC.template p2p_query<tag>(dest_node, std::forward<Args>(args)...);
+        if(selection != ReplicaSelection::RANDOM && results.pending) {
+            std::weak_ptr<typename decltype(results.pending)::element_type> pending = results.pending;
+            std::lock_guard<std::mutex> lock(mutex);
+            // The layout may have changed while the query was sent
+            const uint32_t shard = locked_shard_of_hash(hash);
+            auto rank = std::find(shard_members[shard].begin(), shard_members[shard].end(), dest_node);
+            if(rank == shard_members[shard].end()) {
+                return results;
+            }
+            pending_checks[shard][rank - shard_members[shard].begin()].emplace_back([pending, dest_node]() {
+                auto query = pending.lock();
+                if(!query) {
+                    return false;
+                }
+                std::lock_guard<std::mutex> query_lock(query->mutex);
+                return query->responded_nodes.count(dest_node) == 0;
+            });
+        }
+        return results;
+    }
+
+    /** Sends a peer-to-peer message about the key to a member of its shard,
+     * for RPC functions whose return type is void */
+    template <rpc::FunctionTag tag, typename Key, typename... Args>
+    void p2p_send(const Key& key, Args&&... args) {
+        EC.template p2p_send<tag>(replica_for(key), std::forward<Args>(args)...);
+    }
+};
+}  // namespace derecho
@@ -0,0 +1,167 @@
+/**
+ * @file snapshot.cpp
+ *
+ * @date Oct 14, 2026
+ */
+
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+#include "derecho_exception.h"
+
+namespace derecho {
+namespace snapshot {
+
+static void deliver(persistence_version_t version, std::vector<char>& state,
+                    std::vector<std::unique_ptr<request>>& requests) {
+    for(auto& request : requests) {
+        try {
+            request->sink(version, state);
+            request->done.set_value(version);
+        } catch(...) {
+            request->done.set_exception(std::current_exception());
+        }
+    }
+}
+
+static void fail(std::vector<std::unique_ptr<request>>& requests, const std::string& message) {
+    for(auto& request : requests) {
+        request->done.set_exception(std::make_exception_ptr(derecho_exception(message)));
+    }
+}
+
+void fork_and_serialize(persistence_version_t version,
+                        const std::function<void(const writer_t&)>& serialize,
+                        std::vector<std::unique_ptr<request>> requests) {
+    int pipe_fds[2];
+    if(pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        fail(requests, std::string("Snapshot pipe failed: ") + strerror(errno));
+        return;
+    }
+    const pid_t child = fork();
+    if(child < 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        fail(requests, std::string("Snapshot fork failed: ") + strerror(errno));
+        return;
+    }
+    if(child == 0) {
+        // Only this thread exists in the child, so nothing else may run here.
+        close(pipe_fds[0]);
+        bool ok = true;
+        serialize([&](const char* bytes, std::size_t size) {
+            while(ok && size > 0) {
+                const ssize_t written = write(pipe_fds[1], bytes, size);
+                if(written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if(written <= 0) {
+                    ok = false;
+                    break;
+                }
+                bytes += written;
+                size -= written;
+            }
+        });
+        _exit(ok ? 0 : 1);
+    }
+    close(pipe_fds[1]);
+    std::thread reader([version, child, fd = pipe_fds[0], requests = std::move(requests)]() mutable {
+        pthread_setname_np(pthread_self(), "snapshot");
+        std::vector<char> state;
+        std::size_t size = 0;
+        bool ok = true;
+        while(true) {
+            if(state.size() - size < 1 << 16) {
+                state.resize(std::max<std::size_t>(2 * state.size(), size + (1 << 20)));
+            }
+            const ssize_t got = read(fd, state.data() + size, state.size() - size);
+            if(got < 0 && errno == EINTR) {
+                continue;
+            }
+            if(got <= 0) {
+                ok = (got == 0);
+                break;
+            }
+            size += got;
+        }
+        close(fd);
+        int status;
+        while(waitpid(child, &status, 0) < 0 && errno == EINTR) {
+        }
+        if(!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fail(requests, "The snapshot process failed to serialize the state");
+            return;
+        }
+        state.resize(size);
+        deliver(version, state, requests);
+    });
+    reader.detach();
+}
+
+void serialize_in_background(persistence_version_t version,
+                             std::function<void(std::vector<char>&)> serialize,
+                             std::vector<std::unique_ptr<request>> requests) {
+    std::thread serializer([version, serialize = std::move(serialize), requests = std::move(requests)]() mutable {
+        pthread_setname_np(pthread_self(), "snapshot");
+        std::vector<char> state;
+        try {
+            serialize(state);
+        } catch(...) {
+            for(auto& request : requests) {
+                request->done.set_exception(std::current_exception());
+            }
+            return;
+        }
+        deliver(version, state, requests);
+    });
+    serializer.detach();
+}
+
+snapshot_sink_t file_sink(const std::string& filename) {
+    return [filename](persistence_version_t, std::vector<char>& state) {
+        const std::string swap_file = filename + ".swp";
+        const int fd = open(swap_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) {
+            throw derecho_exception("Can't open snapshot file " + swap_file + ": " + strerror(errno));
+        }
+        std::size_t ofst = 0;
+        while(ofst < state.size()) {
+            const ssize_t written = write(fd, state.data() + ofst, state.size() - ofst);
+            if(written < 0 && errno == EINTR) {
+                continue;
+            }
+            if(written <= 0) {
+                const int error = errno;
+                close(fd);
+                throw derecho_exception("Can't write snapshot file " + swap_file + ": " + strerror(error));
+            }
+            ofst += written;
+        }
+        if(fsync(fd) != 0 || close(fd) != 0) {
+            throw derecho_exception("Can't sync snapshot file " + swap_file + ": " + strerror(errno));
+        }
+        if(rename(swap_file.c_str(), filename.c_str()) != 0) {
+            throw derecho_exception("Can't rename snapshot file to " + filename + ": " + strerror(errno));
+        }
+        // The rename is only durable once the directory is synced.
+        std::vector<char> path(filename.begin(), filename.end());
+        path.push_back('\0');
+        const int dir_fd = open(dirname(path.data()), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    };
+}
+}  // namespace snapshot
+}  // namespace derecho
@@ -0,0 +1,94 @@
+/**
+ * @file snapshot.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "derecho_internal.h"
+
+namespace derecho {
+
+/**
+ * Takes a snapshot of a replicated object's serialized state, as
+ * Replicated<T>::receive_object() reads it, at a delivered version. It runs
+ * on a background thread, and may keep the state.
+ */
+using snapshot_sink_t = std::function<void(persistence_version_t version, std::vector<char>& state)>;
+
+/**
+ * Background snapshots of replicated objects. A snapshot is captured on the
+ * delivery thread, between two deliveries, so it is the state at a delivered
+ * version, but it is serialized on a background thread while delivery goes
+ * on. The capture is one of two kinds:
+ *  - A type can provide its own versioned structure with a const method
+ *    snapshot_state() that returns a std::unique_ptr to an object that
+ *    serializes like a T at that point, such as a copy sharing immutable
+ *    structure with the original. The capture costs whatever that method
+ *    does.
+ *  - Otherwise the process forks, and the child, which has a copy-on-write
+ *    image of the object frozen at that point, serializes it into a pipe.
+ *    The capture costs a fork, and the pages the group writes before the
+ *    child is done are copied once. The child only runs the serializer, so
+ *    it must not take locks that other threads may hold. Memory registered
+ *    for RDMA keeps working in the parent on kernels that copy pinned pages
+ *    at fork (5.12 and later); on older ones, set RDMAV_FORK_SAFE.
+ */
+namespace snapshot {
+
+/** Whether T provides snapshot_state() for snapshots without a fork */
+template <typename T, typename = void>
+struct has_snapshot_state : std::false_type {};
+
+template <typename T>
+struct has_snapshot_state<T, decltype((void)std::declval<const T&>().snapshot_state())> : std::true_type {};
+
+/** A snapshot that was asked for and not captured yet */
+struct request {
+    snapshot_sink_t sink;
+    /** Set after the sink returns, to the version of the snapshot */
+    std::promise<persistence_version_t> done;
+};
+
+/** Writes out a serialized state in pieces, like mutils::post_object */
+using writer_t = std::function<void(const char* bytes, std::size_t size)>;
+
+/**
+ * Captures a state in a forked child and, on a background thread, reads what
+ * it serializes and hands it to the requests' sinks.
+ * @param version The delivered version being captured
+ * @param serialize Serializes the state through a writer; runs in the child
+ * @param requests The requests the snapshot is for
+ */
+void fork_and_serialize(persistence_version_t version,
+                        const std::function<void(const writer_t&)>& serialize,
+                        std::vector<std::unique_ptr<request>> requests);
+
+/**
+ * Hands a serialized state to the requests' sinks on a background thread,
+ * after serializing it there.
+ * @param serialize Serializes the captured state into a buffer; runs on the
+ * background thread, so it must own what it serializes
+ */
+void serialize_in_background(persistence_version_t version,
+                             std::function<void(std::vector<char>&)> serialize,
+                             std::vector<std::unique_ptr<request>> requests);
+
+/**
+ * @return A sink that writes the state to a file through a temporary one in
+ * the same directory, so that the file is either the complete snapshot, on
+ * disk, or what it was before
+ */
+snapshot_sink_t file_sink(const std::string& filename);
+}  // namespace snapshot
+}  // namespace derecho
@@ -0,0 +1,174 @@
+/**
+ * @file sst_budget.cpp
+ *
+ * @date Oct 14, 2026
+ */
+
+#include <algorithm>
+#include <iomanip>
+#include <numeric>
+#include <sstream>
+
+#include "derecho_sst.h"
+#include "sst_budget.h"
+#include "subgroup_functions.h"
+
+namespace derecho {
+
+std::unique_ptr<View> make_planning_view(const SubgroupInfo& subgroup_info, uint32_t num_members) {
+    std::vector<node_id_t> members(num_members);
+    std::iota(members.begin(), members.end(), 0);
+    std::vector<ip_addr> member_ips;
+    for(uint32_t rank = 0; rank < num_members; ++rank) {
+        member_ips.push_back("10.0." + std::to_string(rank / 256) + "." + std::to_string(rank % 256));
+    }
+    auto view = std::make_unique<View>(0, members, member_ips, std::vector<char>(num_members, 0));
+    int32_t type_position = 0;
+    for(const auto& subgroup_type : subgroup_info.membership_function_order) {
+        subgroup_shard_layout_t subgroup_shard_views;
+        view->allocating_type_position = type_position++;
+        try {
+            subgroup_shard_views = subgroup_info.subgroup_membership_functions.at(subgroup_type)(
+                    *view, view->next_unassigned_rank, true);
+        } catch(subgroup_provisioning_exception& ex) {
+            view->allocating_type_position = -1;
+            view->is_adequately_provisioned = false;
+            view->subgroup_shard_views.clear();
+            view->subgroup_ids_by_type.clear();
+            return view;
+        }
+        // Subgroup IDs are handed out as in ViewManager::make_subgroup_maps
+        view->subgroup_ids_by_type[subgroup_type] = std::vector<subgroup_id_t>(subgroup_shard_views.size());
+        for(uint32_t subgroup_index = 0; subgroup_index < subgroup_shard_views.size(); ++subgroup_index) {
+            view->subgroup_ids_by_type[subgroup_type][subgroup_index] = view->subgroup_shard_views.size();
+            for(SubView& shard_view : subgroup_shard_views[subgroup_index]) {
+                shard_view.my_rank = shard_view.rank_of(view->members[view->my_rank]);
+            }
+            view->subgroup_shard_views.emplace_back(std::move(subgroup_shard_views[subgroup_index]));
+        }
+    }
+    view->allocating_type_position = -1;
+    return view;
+}
+
+SSTBudget plan_sst_budget(const View& view, const DerechoParams& derecho_params) {
+    SSTBudget budget;
+    budget.num_members = view.num_members;
+    budget.num_subgroups = view.subgroup_shard_views.size();
+    if(!view.is_adequately_provisioned) {
+        budget.warnings.push_back("The membership functions could not provision the subgroups with "
+                                  + std::to_string(view.num_members) + " members");
+    }
+
+    // num_received has a column for each member of the largest shard that
+    // has senders, as ViewManager::make_subgroup_maps sizes it
+    uint32_t num_received_size = 0;
+    uint32_t max_shard_size = 0;
+    uint32_t max_shard_senders = 0;
+    std::vector<uint32_t> subgroups_of_member(view.num_members, 0);
+    std::vector<uint64_t> rdmc_buffer_bytes(view.num_members, 0);
+    const uint64_t max_msg_size = MulticastGroup::compute_max_msg_size(derecho_params.max_payload_size,
+                                                                       derecho_params.block_size);
+    // Only the small buffers are registered up front (see MessageBufferPool)
+    const uint64_t buffer_size = derecho_params.small_message_buffer_size
+                                         ? std::min<uint64_t>(derecho_params.small_message_buffer_size, max_msg_size)
+                                         : max_msg_size;
+    for(const auto& shard_views : view.subgroup_shard_views) {
+        uint32_t subgroup_senders = 0;
+        for(const SubView& shard_view : shard_views) {
+            if(shard_view.num_senders() > subgroup_senders) {
+                subgroup_senders = shard_view.members.size();
+            }
+            max_shard_size = std::max<uint32_t>(max_shard_size, shard_view.members.size());
+            max_shard_senders = std::max(max_shard_senders, shard_view.num_senders());
+            for(const node_id_t member : shard_view.members) {
+                const int rank = view.rank_of(member);
+                ++subgroups_of_member[rank];
+                // MulticastGroup keeps window_size buffers per shard member
+                rdmc_buffer_bytes[rank] += derecho_params.window_size * shard_view.members.size() * buffer_size;
+            }
+        }
+        num_received_size += subgroup_senders;
+    }
+
+    const std::vector<sst::FieldLayout> layout = DerechoSST::field_layout(
+            view.num_members, budget.num_subgroups, num_received_size, derecho_params.window_size);
+    std::vector<int> offsets;
+    budget.row_bytes = sst::layout_row(layout, offsets);
+    budget.table_bytes = budget.row_bytes * view.num_members;
+    budget.slot_bytes = 0;
+    for(std::size_t i = 0; i < layout.size(); ++i) {
+        const uint64_t end = i + 1 < layout.size() ? offsets[i + 1] : budget.row_bytes;
+        budget.fields.push_back({layout[i].name, end - offsets[i]});
+        if(layout[i].name == "slots") {
+            budget.slot_bytes = end - offsets[i];
+        }
+    }
+    budget.max_rdmc_buffer_bytes = rdmc_buffer_bytes.empty()
+                                           ? 0
+                                           : *std::max_element(rdmc_buffer_bytes.begin(), rdmc_buffer_bytes.end());
+
+    const uint32_t shard_destinations = max_shard_size > 0 ? max_shard_size - 1 : 0;
+    const uint32_t all_destinations = view.num_members > 0 ? view.num_members - 1 : 0;
+    const uint64_t counter = sizeof(long long int);
+    budget.put_paths = {{"RDMC receive (num_received)", counter, shard_destinations},
+                        {"seq_num", counter, shard_destinations},
+                        {"stable_num, delivered_num or persisted_num", counter, shard_destinations},
+                        {"SST multicast message (one slot)", sizeof(sst::Message), shard_destinations},
+                        {"SST multicast receive (num_received_sst)", counter * max_shard_senders, shard_destinations},
+                        {"SST multicast receive (num_received)", counter * max_shard_senders, shard_destinations},
+                        {"heartbeat", sizeof(uint64_t), all_destinations},
+                        {"full row (installing a view)", budget.row_bytes, all_destinations}};
+
+    auto mib = [](uint64_t bytes) {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1) << bytes / double(1 << 20) << " MiB";
+        return out.str();
+    };
+    if(budget.table_bytes > sst_budget_table_warning_bytes) {
+        budget.warnings.push_back("Every node registers an SST table of " + mib(budget.table_bytes)
+                                  + " (" + std::to_string(budget.row_bytes) + " bytes per row)");
+    }
+    if(budget.row_bytes > 0 && budget.slot_bytes * 2 > budget.row_bytes) {
+        std::string warning = "SST multicast slots are " + std::to_string(100 * budget.slot_bytes / budget.row_bytes)
+                              + "% of each row: window_size slots of sst::max_msg_size ("
+                              + std::to_string(sst::max_msg_size) + ") bytes for every subgroup";
+        if(derecho_params.sst_multicast_threshold == 0 && !derecho_params.adaptive_transport) {
+            warning += ", though sst_multicast_threshold is 0, so they are never used";
+        }
+        budget.warnings.push_back(warning);
+    }
+    if(budget.num_subgroups > 0 && budget.row_bytes > 0) {
+        const auto least = std::min_element(subgroups_of_member.begin(), subgroups_of_member.end());
+        const uint64_t unused_slot_bytes = (budget.num_subgroups - *least) * (budget.slot_bytes / budget.num_subgroups);
+        if(unused_slot_bytes * 2 > budget.row_bytes) {
+            budget.warnings.push_back("Node " + std::to_string(view.members[least - subgroups_of_member.begin()])
+                                      + " is in " + std::to_string(*least) + " of " + std::to_string(budget.num_subgroups)
+                                      + " subgroups, so " + std::to_string(100 * unused_slot_bytes / budget.row_bytes)
+                                      + "% of each row it registers is slots of subgroups it is not in;"
+                                      + " fewer subgroups (see CrossProductPolicy::multiplex_sources) would shrink it");
+        }
+    }
+    return budget;
+}
+
+std::ostream& operator<<(std::ostream& out, const SSTBudget& budget) {
+    out << budget.num_members << " members, " << budget.num_subgroups << " subgroups" << std::endl;
+    out << "SST row fields:" << std::endl;
+    for(const SSTBudget::Field& field : budget.fields) {
+        out << "  " << std::left << std::setw(28) << field.name << std::right << std::setw(12) << field.row_bytes << " B" << std::endl;
+    }
+    out << "Row: " << budget.row_bytes << " B; table registered per node: " << budget.table_bytes << " B" << std::endl;
+    out << "RDMC message buffers registered by the busiest node: " << budget.max_rdmc_buffer_bytes << " B" << std::endl;
+    out << "Bytes per put:" << std::endl;
+    for(const SSTBudget::PutPath& path : budget.put_paths) {
+        out << "  " << std::left << std::setw(44) << path.name << std::right << std::setw(12) << path.bytes
+            << " B to up to " << path.destinations << " members" << std::endl;
+    }
+    for(const std::string& warning : budget.warnings) {
+        out << "Warning: " << warning << std::endl;
+    }
+    return out;
+}
+
+}  // namespace derecho
@@ -0,0 +1,80 @@
+/**
+ * @file sst_budget.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "multicast_group.h"
+#include "subgroup_info.h"
+#include "view.h"
+
+namespace derecho {
+
+/**
+ * What a group layout costs in SST and RDMC memory, worked out from the
+ * subgroup layout and the DerechoParams without creating the group, so that
+ * layouts can be tuned before they are deployed. The SST's row grows with
+ * window_size * sst::max_msg_size for every subgroup, and every node
+ * registers a row for every member, so it is easy to end up with large
+ * registered regions without noticing.
+ */
+struct SSTBudget {
+    struct Field {
+        std::string name;
+        /** The bytes the field takes in each row, with its padding */
+        uint64_t row_bytes;
+    };
+    /** How much a put on one of the paths that run per message writes */
+    struct PutPath {
+        std::string name;
+        /** The bytes written by one put */
+        uint64_t bytes;
+        /** The most members one such put is written to */
+        uint32_t destinations;
+    };
+    std::vector<Field> fields;
+    uint32_t num_members;
+    uint32_t num_subgroups;
+    /** The length of a row, which is what a full-row put writes */
+    uint64_t row_bytes;
+    /** The SST table every node registers, a row per member */
+    uint64_t table_bytes;
+    /** The bytes of each row that are slots of SST multicast */
+    uint64_t slot_bytes;
+    /** The RDMC message buffers the node that needs the most registers */
+    uint64_t max_rdmc_buffer_bytes;
+    std::vector<PutPath> put_paths;
+    /** The ways the layout wastes memory on the NIC, if any */
+    std::vector<std::string> warnings;
+};
+
+/** The table size above which plan_sst_budget warns. */
+constexpr uint64_t sst_budget_table_warning_bytes = 64ull << 20;
+
+/**
+ * Provisions the subgroups of a View of num_members nodes with the
+ * membership functions, as ViewManager does for the first View, so that its
+ * layout can be planned. The nodes get made-up IDs and IP addresses.
+ * @return The View, which is inadequately provisioned if the membership
+ * functions couldn't provision it with that many nodes
+ */
+std::unique_ptr<View> make_planning_view(const SubgroupInfo& subgroup_info, uint32_t num_members);
+
+/**
+ * Works out what the layout of a provisioned View costs with these
+ * parameters.
+ */
+SSTBudget plan_sst_budget(const View& view, const DerechoParams& derecho_params);
+
+/** Prints the budget as a table, with its warnings. */
+std::ostream& operator<<(std::ostream& out, const SSTBudget& budget);
+
+}  // namespace derecho
@@ -0,0 +1,49 @@
+/**
+ * @file sst_budget_planner.cpp
+ *
+ * @date Oct 14, 2026
+ */
+
+#include <iostream>
+#include <string>
+#include <typeindex>
+
+#include "sst_budget.h"
+#include "subgroup_functions.h"
+
+struct PlannedType {};
+
+/*
+ * Prints what a layout of identical, evenly sharded subgroups costs in SST
+ * and RDMC memory and in bytes per put, and warns if it wastes NIC memory.
+ * Layouts with other membership functions can be planned the same way, with
+ * derecho::make_planning_view and derecho::plan_sst_budget.
+ */
+int main(int argc, char* argv[]) {
+    if(argc < 5) {
+        std::cout << "Usage: " << argv[0]
+                  << " <num_members> <num_subgroups> <shards_per_subgroup> <members_per_shard>"
+                  << " [window_size] [max_payload_size] [block_size] [sst_multicast_threshold]" << std::endl;
+        return -1;
+    }
+    const uint32_t num_members = std::stoul(argv[1]);
+    const int num_subgroups = std::stoi(argv[2]);
+    const int num_shards = std::stoi(argv[3]);
+    const int shard_size = std::stoi(argv[4]);
+    const unsigned int window_size = argc > 5 ? std::stoul(argv[5]) : 3;
+    const long long unsigned int max_payload_size = argc > 6 ? std::stoull(argv[6]) : 10240;
+    const long long unsigned int block_size = argc > 7 ? std::stoull(argv[7]) : 1024;
+    const uint32_t sst_multicast_threshold = argc > 8 ? std::stoul(argv[8]) : sst::max_msg_size;
+
+    derecho::SubgroupInfo subgroup_info{
+            {{std::type_index(typeid(PlannedType)),
+              derecho::DefaultSubgroupAllocator(derecho::identical_subgroups_policy(
+                      num_subgroups, derecho::even_sharding_policy(num_shards, shard_size)))}}};
+    derecho::DerechoParams derecho_params(max_payload_size, block_size, std::string(), window_size, 1,
+                                          rdmc::BINOMIAL_SEND, derecho::derecho_rpc_port, 1, false,
+                                          sst_multicast_threshold);
+
+    auto view = derecho::make_planning_view(subgroup_info, num_members);
+    std::cout << derecho::plan_sst_budget(*view, derecho_params);
+    return 0;
+}
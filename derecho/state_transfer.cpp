@@ -0,0 +1,243 @@
+/**
+ * @file state_transfer.cpp
+ *
+ * @date Oct 14, 2026
+ */
+
+#include "state_transfer.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <pthread.h>
+#include <vector>
+
+#include "thread_placement.h"
+
+namespace derecho {
+namespace state_transfer {
+
+/** Sent by the sender to start a transfer */
+struct state_offer {
+    uint64_t size;
+    uint64_t address;
+    uint32_t rkey;
+    /** Whether the state can be read with RDMA at address and rkey */
+    uint8_t registered;
+} __attribute__((packed));
+
+/** Sent by the receiver for a piece of the state it wants over the socket;
+ * a length of 0 means the receiver has all of the state. */
+struct chunk_request {
+    uint64_t offset;
+    uint64_t length;
+} __attribute__((packed));
+
+/** The reads of one transfer that have completed, filled in by RDMC's
+ * polling thread */
+struct read_tracker {
+    std::mutex mutex;
+    std::condition_variable read_completed;
+    std::vector<uint64_t> completed_chunks;
+};
+
+/** A read's wr_id is its transfer's ID followed by this many bits of chunk
+ * number */
+static constexpr unsigned int chunk_bits = 24;
+
+static std::mutex trackers_mutex;
+static std::map<uint64_t, std::shared_ptr<read_tracker>> trackers;
+static uint64_t next_transfer_id = 0;
+
+static const rdma::message_type& read_type() {
+    static rdma::message_type type(
+            "derecho::state_transfer", nullptr, nullptr, nullptr,
+            [](uint64_t tag, uint32_t, size_t) {
+                std::shared_ptr<read_tracker> tracker;
+                {
+                    std::lock_guard<std::mutex> lock(trackers_mutex);
+                    auto it = trackers.find(tag >> chunk_bits);
+                    if(it == trackers.end()) {
+                        // The transfer gave up on this read and moved on
+                        return;
+                    }
+                    tracker = it->second;
+                }
+                std::lock_guard<std::mutex> lock(tracker->mutex);
+                tracker->completed_chunks.push_back(tag & ((1ull << chunk_bits) - 1));
+                tracker->read_completed.notify_one();
+            });
+    return type;
+}
+
+StateBuffer::StateBuffer(std::size_t size) : size(size) {
+    try {
+        mr = rdma::memory_region::allocate(size);
+        buffer = mr->buffer;
+    } catch(rdma::exception&) {
+        unregistered_buffer = std::unique_ptr<char[]>(new char[size]);
+        buffer = unregistered_buffer.get();
+    }
+}
+
+bool send_state(tcp::socket& socket, const StateBuffer& state) {
+    state_offer offer;
+    offer.size = state.size;
+    offer.address = reinterpret_cast<uintptr_t>(state.data());
+    offer.rkey = state.region() ? state.region()->get_rkey() : 0;
+    offer.registered = state.region() != nullptr;
+    uint8_t use_rdma;
+    if(!socket.write((char*)&offer, sizeof(offer)) || !socket.read((char*)&use_rdma, sizeof(use_rdma))) {
+        return false;
+    }
+    // The receiver reads the buffer through this until it is done
+    std::unique_ptr<rdma::queue_pair> qp;
+    if(use_rdma) {
+        try {
+            qp = std::make_unique<rdma::queue_pair>(socket, max_outstanding_reads);
+        } catch(rdma::exception&) {
+            // The receiver will ask for everything over the socket
+        }
+    }
+    while(true) {
+        chunk_request request;
+        if(!socket.read((char*)&request, sizeof(request))) {
+            return false;
+        }
+        if(request.length == 0) {
+            return true;
+        }
+        if(request.offset > state.size || request.length > state.size - request.offset
+           || !socket.write(state.data() + request.offset, request.length)) {
+            return false;
+        }
+    }
+}
+
+/**
+ * Reads as much of the offered state as possible with RDMA, marking the
+ * chunks that arrived in received.
+ */
+static void read_chunks(tcp::socket& socket, const state_offer& offer,
+                        const StateBuffer& state, std::vector<bool>& received) {
+    rdma::queue_pair qp(socket, max_outstanding_reads);
+    const rdma::remote_memory_region remote_mr(offer.address, offer.size, offer.rkey);
+    const uint64_t num_chunks = received.size();
+    auto tracker = std::make_shared<read_tracker>();
+    uint64_t transfer_id;
+    {
+        std::lock_guard<std::mutex> lock(trackers_mutex);
+        transfer_id = next_transfer_id++;
+        trackers[transfer_id] = tracker;
+    }
+    uint64_t next_chunk = 0;
+    std::size_t outstanding = 0;
+    auto post_reads = [&]() {
+        while(next_chunk < num_chunks && outstanding < max_outstanding_reads) {
+            const std::size_t offset = next_chunk * chunk_size;
+            const std::size_t length = std::min(chunk_size, state.size - offset);
+            if(!qp.post_read(*state.region(), offset, length, (transfer_id << chunk_bits) | next_chunk,
+                             remote_mr, offset, read_type())) {
+                // Leave the rest to the socket
+                next_chunk = num_chunks;
+                return;
+            }
+            ++next_chunk;
+            ++outstanding;
+        }
+    };
+    post_reads();
+    while(outstanding > 0) {
+        std::vector<uint64_t> completed;
+        {
+            std::unique_lock<std::mutex> lock(tracker->mutex);
+            if(!tracker->read_completed.wait_for(lock, read_stall_timeout,
+                                                 [&]() { return !tracker->completed_chunks.empty(); })) {
+                // Failed reads are never reported, so this is how they show up
+                break;
+            }
+            std::swap(completed, tracker->completed_chunks);
+        }
+        for(uint64_t chunk : completed) {
+            received[chunk] = true;
+        }
+        outstanding -= completed.size();
+        post_reads();
+    }
+    std::lock_guard<std::mutex> lock(trackers_mutex);
+    trackers.erase(transfer_id);
+}
+
+std::unique_ptr<StateBuffer> receive_state(tcp::socket& socket) {
+    state_offer offer;
+    if(!socket.read((char*)&offer, sizeof(offer))) {
+        return nullptr;
+    }
+    const std::size_t size = offer.size;
+    auto state = std::make_unique<StateBuffer>(size);
+    const uint8_t use_rdma = offer.registered && state->region();
+    if(!socket.write((char*)&use_rdma, sizeof(use_rdma))) {
+        return nullptr;
+    }
+    std::vector<bool> received((size + chunk_size - 1) / chunk_size, false);
+    if(use_rdma) {
+        try {
+            read_chunks(socket, offer, *state, received);
+        } catch(rdma::exception&) {
+            // The queue pair couldn't be set up, so none of it came over RDMA
+        }
+    }
+    // Whatever didn't arrive over RDMA comes over the socket
+    for(uint64_t chunk = 0; chunk < received.size(); ++chunk) {
+        if(received[chunk]) {
+            continue;
+        }
+        chunk_request request{chunk * chunk_size, std::min(chunk_size, size - chunk * chunk_size)};
+        if(!socket.write((char*)&request, sizeof(request))
+           || !socket.read(state->data() + request.offset, request.length)) {
+            return nullptr;
+        }
+    }
+    const chunk_request done{0, 0};
+    if(!socket.write((char*)&done, sizeof(done))) {
+        return nullptr;
+    }
+    return state;
+}
+
+bool send_buffer(tcp::socket& socket, const std::vector<char>& buffer) {
+    const uint64_t size = buffer.size();
+    iovec pieces[2] = {{(void*)&size, sizeof(size)}, {(void*)buffer.data(), size}};
+    return socket.write_vectored(pieces, 2);
+}
+
+bool receive_buffer(tcp::socket& socket, std::vector<char>& buffer) {
+    uint64_t size;
+    if(!socket.read((char*)&size, sizeof(size))) {
+        return false;
+    }
+    buffer.resize(size);
+    return socket.read(buffer.data(), size);
+}
+
+StateSender::~StateSender() {
+    for(auto& transfer : last_transfer_to) {
+        if(transfer.second.joinable()) {
+            transfer.second.join();
+        }
+    }
+}
+
+void StateSender::start(node_id_t receiver, std::function<void()> transfer) {
+    std::thread previous = std::move(last_transfer_to[receiver]);
+    last_transfer_to[receiver] = std::thread([previous = std::move(previous), transfer]() mutable {
+        pthread_setname_np(pthread_self(), "state_transfer");
+        place_this_thread("state_transfer");
+        if(previous.joinable()) {
+            previous.join();
+        }
+        transfer();
+    });
+}
+
+}  // namespace state_transfer
+}  // namespace derecho
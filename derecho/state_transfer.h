@@ -0,0 +1,107 @@
+/**
+ * @file state_transfer.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "rdmc/verbs_helper.h"
+#include "tcp/tcp.h"
+
+namespace derecho {
+
+using node_id_t = uint32_t;
+
+/**
+ * Copies the serialized state of a replicated object from a shard's old
+ * leader to a node joining the shard. The sender serializes the object into a
+ * registered buffer and offers it over their TCP socket; the receiver then
+ * pulls it in chunks with RDMA reads, several outstanding at once, over a
+ * queue pair set up through the same socket. If the reads fail or stall, or
+ * RDMA isn't available, the receiver asks for whatever chunks it is still
+ * missing over the socket instead, so an interrupted transfer carries on from
+ * where it stopped rather than starting over.
+ */
+namespace state_transfer {
+
+/** The size of each RDMA read */
+constexpr std::size_t chunk_size = 4 << 20;
+/** The number of reads the receiver keeps outstanding */
+constexpr std::size_t max_outstanding_reads = 8;
+/** How long the receiver waits for any read to complete before giving up on
+ * RDMA for the rest of the transfer */
+constexpr std::chrono::milliseconds read_stall_timeout{1000};
+
+/**
+ * A buffer holding a serialized object, registered for RDMA if possible.
+ */
+class StateBuffer {
+    std::unique_ptr<rdma::memory_region> mr;
+    std::unique_ptr<char[]> unregistered_buffer;
+    char* buffer;
+
+public:
+    const std::size_t size;
+
+    /** Allocates a buffer of this size, which is left unregistered if RDMA
+     * hasn't been initialized or registration fails. */
+    explicit StateBuffer(std::size_t size);
+    char* data() const { return buffer; }
+    /** @return The buffer's memory region, or nullptr if it isn't registered. */
+    const rdma::memory_region* region() const { return mr.get(); }
+};
+
+/**
+ * Sends a serialized object to a receiver calling receive_state() on the
+ * other end of the socket. Returns once the receiver has all of it.
+ * @return False if the socket broke before the end of the transfer.
+ */
+bool send_state(tcp::socket& socket, const StateBuffer& state);
+
+/**
+ * Receives a serialized object sent with send_state().
+ * @return The object, or nullptr if the socket broke before all of it arrived.
+ */
+std::unique_ptr<StateBuffer> receive_state(tcp::socket& socket);
+
+/**
+ * Sends a small buffer, preceded by its size, over the socket.
+ * @return False if the socket broke.
+ */
+bool send_buffer(tcp::socket& socket, const std::vector<char>& buffer);
+
+/**
+ * Receives a buffer sent with send_buffer().
+ * @return False if the socket broke.
+ */
+bool receive_buffer(tcp::socket& socket, std::vector<char>& buffer);
+
+/**
+ * Runs the sending side of state transfers in the background, so that the
+ * view change that started them doesn't wait for the joiners to copy their
+ * state. Transfers to the same receiver run one at a time in the order they
+ * were started, which is the order the receiver asks for them in.
+ */
+class StateSender {
+    /** The last transfer started to each receiver, which the next one to the
+     * same receiver waits for */
+    std::map<node_id_t, std::thread> last_transfer_to;
+
+public:
+    ~StateSender();
+    /** Starts a transfer to a receiver once the earlier ones to it are done.
+     * May only be called from one thread. */
+    void start(node_id_t receiver, std::function<void()> transfer);
+};
+
+}  // namespace state_transfer
+}  // namespace derecho
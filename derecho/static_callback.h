@@ -0,0 +1,62 @@
+/**
+ * @file static_callback.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+namespace derecho {
+
+template <typename Signature>
+class StaticCallback;
+
+/**
+ * A callback that is a plain function pointer and the object it was bound to,
+ * for the internal upcalls that run once per message. Calling it is one
+ * indirect call to a function generated for the bound method or callable,
+ * which the compiler can inline its target into, where a std::function would
+ * also go through its type-erased manager and may have to allocate. It does
+ * not own what it is bound to, which must outlive it.
+ */
+template <typename Ret, typename... Args>
+class StaticCallback<Ret(Args...)> {
+    Ret (*function)(void*, Args...) = nullptr;
+    void* context = nullptr;
+
+    StaticCallback(Ret (*function)(void*, Args...), void* context) : function(function), context(context) {}
+
+public:
+    StaticCallback() = default;
+    StaticCallback(std::nullptr_t) {}
+
+    /** @return A callback that calls method on object */
+    template <typename Class, Ret (Class::*method)(Args...)>
+    static StaticCallback bind(Class& object) {
+        return StaticCallback([](void* context, Args... args) -> Ret {
+            return (static_cast<Class*>(context)->*method)(std::forward<Args>(args)...);
+        },
+                              &object);
+    }
+
+    /** @return A callback that calls callable, such as a lambda that lives
+     * for as long as the callback is used */
+    template <typename Callable>
+    static StaticCallback to(Callable& callable) {
+        return StaticCallback([](void* context, Args... args) -> Ret {
+            return (*static_cast<Callable*>(context))(std::forward<Args>(args)...);
+        },
+                              const_cast<void*>(static_cast<const void*>(&callable)));
+    }
+
+    Ret operator()(Args... args) const {
+        return function(context, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const { return function != nullptr; }
+};
+
+}  // namespace derecho
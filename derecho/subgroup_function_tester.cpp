@@ -5,10 +5,20 @@
  * @author edward
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "derecho_internal.h"
+#include "sst_budget.h"
 #include "subgroup_function_tester.h"
 
 std::string ip_generator() {
@@ -25,8 +35,276 @@ struct TestType3 {};
 struct TestType4 {};
 struct TestType5 {};
 struct TestType6 {};
+struct TestType7 {};
+struct TestType8 {};
+struct TestType9 {};
+
+struct SimulatedType1 {};
+struct SimulatedType2 {};
+struct SimulatedType3 {};
+
+/** The allocation policies that the churn simulation compares */
+enum class SimulatedPolicy {
+    EVEN,
+    MINIMAL_MOVEMENT,
+    CAPACITY_WEIGHTED,
+    CROSS_PRODUCT,
+    MULTIPLEXED_CROSS_PRODUCT
+};
+
+const std::vector<SimulatedPolicy> simulated_policies{
+        SimulatedPolicy::EVEN, SimulatedPolicy::MINIMAL_MOVEMENT, SimulatedPolicy::CAPACITY_WEIGHTED,
+        SimulatedPolicy::CROSS_PRODUCT, SimulatedPolicy::MULTIPLEXED_CROSS_PRODUCT};
+
+const char* policy_name(SimulatedPolicy policy) {
+    switch(policy) {
+        case SimulatedPolicy::EVEN:
+            return "even";
+        case SimulatedPolicy::MINIMAL_MOVEMENT:
+            return "minimal-movement";
+        case SimulatedPolicy::CAPACITY_WEIGHTED:
+            return "capacity-weighted";
+        case SimulatedPolicy::CROSS_PRODUCT:
+            return "cross-product";
+        case SimulatedPolicy::MULTIPLEXED_CROSS_PRODUCT:
+            return "multiplexed-cross-product";
+    }
+    return "unknown";
+}
+
+/**
+ * Makes a fresh SubgroupInfo with about num_subgroups subgroups for
+ * num_members nodes; the allocators keep the last assignment they made, so
+ * each scenario needs its own. The shards of the policies that give every
+ * node one shard are sized to use two thirds of the nodes, leaving the rest
+ * to replace members that leave. The cross products put the shards of a
+ * target subgroup under a source subgroup of up to 10 members.
+ */
+derecho::SubgroupInfo make_simulated_subgroup_info(SimulatedPolicy policy, int num_members, int num_subgroups) {
+    using derecho::CrossProductAllocator;
+    using derecho::DefaultSubgroupAllocator;
+    const int nodes_per_shard = std::max(1, 2 * num_members / (3 * num_subgroups));
+    const std::type_index type1(typeid(SimulatedType1));
+    const std::type_index type2(typeid(SimulatedType2));
+    const std::type_index type3(typeid(SimulatedType3));
+    switch(policy) {
+        case SimulatedPolicy::EVEN:
+        case SimulatedPolicy::MINIMAL_MOVEMENT:
+        case SimulatedPolicy::CAPACITY_WEIGHTED: {
+            derecho::SubgroupAllocationPolicy subgroup_policy = derecho::identical_subgroups_policy(
+                    num_subgroups, derecho::even_sharding_policy(1, nodes_per_shard));
+            if(policy == SimulatedPolicy::MINIMAL_MOVEMENT) {
+                subgroup_policy = derecho::minimal_movement_policy(subgroup_policy);
+            } else if(policy == SimulatedPolicy::CAPACITY_WEIGHTED) {
+                //Nodes can be in several shards, so the shards can be twice as large
+                subgroup_policy = derecho::capacity_weighted_policy(derecho::identical_subgroups_policy(
+                        num_subgroups, derecho::even_sharding_policy(1, 2 * nodes_per_shard)));
+            }
+            return derecho::SubgroupInfo{{{type1, DefaultSubgroupAllocator(subgroup_policy)}}, {type1}};
+        }
+        case SimulatedPolicy::CROSS_PRODUCT:
+        case SimulatedPolicy::MULTIPLEXED_CROSS_PRODUCT: {
+            const int num_sources = std::min(10, num_subgroups);
+            const int num_target_shards = std::max(1, num_subgroups / num_sources);
+            const int target_shard_size = std::max(1, std::min(3, (2 * num_members / 3 - num_sources) / num_target_shards));
+            derecho::CrossProductPolicy cross_product_policy{
+                    {type1, 0}, {type2, 0}, policy == SimulatedPolicy::MULTIPLEXED_CROSS_PRODUCT};
+            return derecho::SubgroupInfo{
+                    {{type1, DefaultSubgroupAllocator(derecho::one_subgroup_policy(
+                                     derecho::even_sharding_policy(1, num_sources)))},
+                     {type2, DefaultSubgroupAllocator(derecho::one_subgroup_policy(
+                                     derecho::even_sharding_policy(num_target_shards, target_shard_size)))},
+                     {type3, CrossProductAllocator(cross_product_policy)}},
+                    {type1, type2, type3}};
+        }
+    }
+    throw std::invalid_argument("Unknown SimulatedPolicy");
+}
+
+/** One view change of a churn sequence */
+struct ChurnStep {
+    std::set<int> leave_ranks;
+    std::vector<derecho::node_id_t> joiner_ids;
+    std::vector<derecho::ip_addr> joiner_ips;
+    std::vector<derecho::NodeCapacity> joiner_capacities;
+};
+
+/** A random sequence of joins and leaves, and the capacities of the initial members */
+struct ChurnSequence {
+    unsigned int seed;
+    std::vector<derecho::NodeCapacity> initial_capacities;
+    std::vector<ChurnStep> steps;
+};
+
+std::string simulated_ip(derecho::node_id_t id) {
+    return "10." + std::to_string(id >> 16) + "." + std::to_string((id >> 8) & 0xff) + "." + std::to_string(id & 0xff);
+}
+
+/**
+ * Generates num_steps view changes that each remove and add up to 1% of
+ * num_members nodes (at least one), chosen at random. The membership's size
+ * doesn't depend on the policy, so every policy can be run on the same
+ * sequence. The node at rank 0 never leaves, since the views are built from
+ * its point of view. Nodes have 8, 16 or 32 cores.
+ */
+ChurnSequence make_churn_sequence(unsigned int seed, int num_members, int num_steps) {
+    std::mt19937 random(seed);
+    const std::vector<uint32_t> core_counts{8, 8, 8, 16, 16, 32};
+    auto random_capacity = [&]() {
+        return derecho::NodeCapacity{core_counts[random() % core_counts.size()], 25, 500};
+    };
+    ChurnSequence sequence{seed, {}, {}};
+    for(int rank = 0; rank < num_members; ++rank) {
+        sequence.initial_capacities.push_back(random_capacity());
+    }
+    const int max_churn = std::max(1, num_members / 100);
+    derecho::node_id_t next_node_id = num_members;
+    int current_members = num_members;
+    for(int step_num = 0; step_num < num_steps; ++step_num) {
+        ChurnStep step;
+        //A view change can't remove a majority of the members
+        const int num_leaves = std::min<int>(random() % (max_churn + 1), (current_members - 1) / 2);
+        while((int)step.leave_ranks.size() < num_leaves) {
+            step.leave_ranks.insert(1 + random() % (current_members - 1));
+        }
+        const int num_joins = random() % (max_churn + 1);
+        for(int j = 0; j < num_joins; ++j) {
+            step.joiner_ids.push_back(next_node_id);
+            step.joiner_ips.push_back(simulated_ip(next_node_id));
+            step.joiner_capacities.push_back(random_capacity());
+            ++next_node_id;
+        }
+        current_members += num_joins - num_leaves;
+        sequence.steps.emplace_back(std::move(step));
+    }
+    return sequence;
+}
+
+/** What a policy did over a churn sequence */
+struct ScenarioResult {
+    SimulatedPolicy policy;
+    unsigned int seed;
+    int num_views = 0;
+    int inadequate_views = 0;
+    std::size_t num_subgroups = 0;
+    double total_allocation_ms = 0;
+    double max_allocation_ms = 0;
+    std::size_t members_moved = 0;
+    uint64_t initial_row_bytes = 0;
+    uint64_t max_row_bytes = 0;
+};
+
+ScenarioResult run_scenario(SimulatedPolicy policy, const ChurnSequence& sequence,
+                            int num_members, int num_subgroups) {
+    ScenarioResult result;
+    result.policy = policy;
+    result.seed = sequence.seed;
+    const derecho::SubgroupInfo subgroup_info = make_simulated_subgroup_info(policy, num_members, num_subgroups);
+    const derecho::DerechoParams derecho_params(10240, 1024);
+
+    std::vector<derecho::node_id_t> members(num_members);
+    std::iota(members.begin(), members.end(), 0);
+    std::vector<derecho::ip_addr> member_ips;
+    std::transform(members.begin(), members.end(), std::back_inserter(member_ips), simulated_ip);
+    std::unique_ptr<derecho::View> prev_view;
+    auto curr_view = std::make_unique<derecho::View>(0, members, member_ips, std::vector<char>(num_members, 0),
+                                                     std::vector<derecho::node_id_t>{}, std::vector<derecho::node_id_t>{},
+                                                     0, 0, sequence.initial_capacities);
+    for(std::size_t step_num = 0; step_num <= sequence.steps.size(); ++step_num) {
+        if(step_num > 0) {
+            const ChurnStep& step = sequence.steps[step_num - 1];
+            prev_view = std::move(curr_view);
+            curr_view = derecho::make_next_view(*prev_view, step.leave_ranks, step.joiner_ids,
+                                                step.joiner_ips, step.joiner_capacities);
+            curr_view->previous_shard_layouts = derecho::make_previous_shard_layouts(subgroup_info, *prev_view);
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const bool adequate = derecho::test_provision_subgroups(subgroup_info, prev_view, *curr_view, false);
+        const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        result.num_views++;
+        result.total_allocation_ms += elapsed.count();
+        result.max_allocation_ms = std::max(result.max_allocation_ms, elapsed.count());
+        if(!adequate) {
+            result.inadequate_views++;
+            continue;
+        }
+        result.num_subgroups = curr_view->subgroup_shard_views.size();
+        if(prev_view && prev_view->is_adequately_provisioned) {
+            result.members_moved += derecho::count_members_moved(*curr_view);
+        }
+        const uint64_t row_bytes = derecho::plan_sst_budget(*curr_view, derecho_params).row_bytes;
+        if(step_num == 0) {
+            result.initial_row_bytes = row_bytes;
+        }
+        result.max_row_bytes = std::max(result.max_row_bytes, row_bytes);
+    }
+    return result;
+}
+
+/**
+ * Runs every simulated policy on num_seeds random churn sequences of
+ * num_view_changes view changes, spreading the scenarios over the machine's
+ * cores, and prints a row for each. Members moved counts the members that
+ * joined a shard they weren't in, over every view change after an adequate
+ * View; allocation time is the time the membership functions took.
+ */
+int run_churn_simulation(int num_members, int num_subgroups, int num_view_changes, int num_seeds) {
+    std::vector<ChurnSequence> sequences;
+    for(int seed = 1; seed <= num_seeds; ++seed) {
+        sequences.push_back(make_churn_sequence(seed, num_members, num_view_changes));
+    }
+    std::vector<std::pair<SimulatedPolicy, const ChurnSequence*>> scenarios;
+    for(const ChurnSequence& sequence : sequences) {
+        for(SimulatedPolicy policy : simulated_policies) {
+            scenarios.emplace_back(policy, &sequence);
+        }
+    }
+    std::vector<ScenarioResult> results(scenarios.size());
+    std::atomic<std::size_t> next_scenario{0};
+    auto run_scenarios = [&]() {
+        for(std::size_t s = next_scenario++; s < scenarios.size(); s = next_scenario++) {
+            results[s] = run_scenario(scenarios[s].first, *scenarios[s].second, num_members, num_subgroups);
+        }
+    };
+    const std::size_t num_threads = std::max<std::size_t>(
+            1, std::min<std::size_t>(std::thread::hardware_concurrency(), scenarios.size()));
+    std::vector<std::thread> threads;
+    for(std::size_t t = 1; t < num_threads; ++t) {
+        threads.emplace_back(run_scenarios);
+    }
+    run_scenarios();
+    for(auto& thread : threads) {
+        thread.join();
+    }
+
+    std::cout << "Simulated " << num_view_changes << " view changes of " << num_members << " members and about "
+              << num_subgroups << " subgroups, on " << num_threads << " threads" << std::endl;
+    std::cout << std::left << std::setw(27) << "policy" << std::right << std::setw(5) << "seed"
+              << std::setw(11) << "subgroups" << std::setw(12) << "inadequate" << std::setw(13) << "alloc ms"
+              << std::setw(13) << "max ms/view" << std::setw(9) << "moved" << std::setw(15) << "row bytes"
+              << std::setw(15) << "max row bytes" << std::endl;
+    for(const ScenarioResult& result : results) {
+        std::cout << std::left << std::setw(27) << policy_name(result.policy) << std::right << std::setw(5) << result.seed
+                  << std::setw(11) << result.num_subgroups << std::setw(7) << result.inadequate_views << "/"
+                  << std::setw(4) << result.num_views << std::fixed << std::setprecision(2)
+                  << std::setw(13) << result.total_allocation_ms << std::setw(13) << result.max_allocation_ms
+                  << std::setw(9) << result.members_moved << std::setw(15) << result.initial_row_bytes
+                  << std::setw(15) << result.max_row_bytes << std::endl;
+    }
+    return 0;
+}
 
 int main(int argc, char* argv[]) {
+    if(argc > 1 && std::string(argv[1]) == "--simulate") {
+        return run_churn_simulation(argc > 2 ? std::stoi(argv[2]) : 1000,
+                                    argc > 3 ? std::stoi(argv[3]) : 500,
+                                    argc > 4 ? std::stoi(argv[4]) : 20,
+                                    argc > 5 ? std::stoi(argv[5]) : 2);
+    }
+    if(argc > 1) {
+        std::cout << "Usage: " << argv[0] << " [--simulate [num_members] [num_subgroups] [num_view_changes] [num_seeds]]" << std::endl;
+        return -1;
+    }
     using derecho::SubgroupAllocationPolicy;
     using derecho::CrossProductPolicy;
     using derecho::DefaultSubgroupAllocator;
@@ -40,13 +318,24 @@ int main(int argc, char* argv[]) {
             derecho::custom_shards_policy({2, 5, 3}, three_ordered));
     SubgroupAllocationPolicy multiple_copies_policy = derecho::identical_subgroups_policy(
             2, derecho::even_sharding_policy(3, 4));
+    //Each shard gets a standby from the nodes left over, which replaces the first member of it to fail
+    SubgroupAllocationPolicy standby_policy = derecho::one_subgroup_policy(derecho::even_sharding_policy(2, 2, 1));
     SubgroupAllocationPolicy multiple_subgroups_policy{3, false, {derecho::even_sharding_policy(3, 3), derecho::custom_shards_policy({4, 3, 4}, three_ordered), derecho::even_sharding_policy(2, 2)}};
+    //Nodes with more cores are in more of these shards, so this takes fewer nodes than 3 * 2 * 2
+    SubgroupAllocationPolicy weighted_policy = derecho::capacity_weighted_policy(
+            derecho::identical_subgroups_policy(3, derecho::even_sharding_policy(2, 2)));
 
     //This will create subgroups that are the cross product of the "uneven_sharded_policy" and "sharded_policy" groups
     CrossProductPolicy uneven_to_even_cp{
         {std::type_index(typeid(TestType3)), 0},
         {std::type_index(typeid(TestType1)), 0}
     };
+    //The same cross product with one subgroup per target shard, in which all the sources send
+    CrossProductPolicy multiplexed_cp{
+        {std::type_index(typeid(TestType3)), 0},
+        {std::type_index(typeid(TestType1)), 0},
+        true
+    };
 
     //We're really just testing the allocation functions, so assign each one to a dummy Replicated type
     derecho::SubgroupInfo test_subgroups{
@@ -55,10 +344,14 @@ int main(int argc, char* argv[]) {
           {std::type_index(typeid(TestType3)), DefaultSubgroupAllocator(uneven_sharded_policy)},
           {std::type_index(typeid(TestType4)), DefaultSubgroupAllocator(multiple_copies_policy)},
           {std::type_index(typeid(TestType5)), DefaultSubgroupAllocator(multiple_subgroups_policy)},
-          {std::type_index(typeid(TestType6)), CrossProductAllocator(uneven_to_even_cp)}
+          {std::type_index(typeid(TestType6)), CrossProductAllocator(uneven_to_even_cp)},
+          {std::type_index(typeid(TestType7)), DefaultSubgroupAllocator(standby_policy)},
+          {std::type_index(typeid(TestType8)), CrossProductAllocator(multiplexed_cp)},
+          {std::type_index(typeid(TestType9)), DefaultSubgroupAllocator(weighted_policy)}
         },
         { std::type_index(typeid(TestType1)), std::type_index(typeid(TestType2)), std::type_index(typeid(TestType3)),
-        std::type_index(typeid(TestType4)), std::type_index(typeid(TestType5)), std::type_index(typeid(TestType6)) }
+        std::type_index(typeid(TestType4)), std::type_index(typeid(TestType5)), std::type_index(typeid(TestType6)),
+        std::type_index(typeid(TestType7)), std::type_index(typeid(TestType8)), std::type_index(typeid(TestType9)) }
     };
 
     std::vector<derecho::node_id_t> members(100);
@@ -66,7 +359,18 @@ int main(int argc, char* argv[]) {
     std::vector<derecho::ip_addr> member_ips(100);
     std::generate(member_ips.begin(), member_ips.end(), ip_generator);
     std::vector<char> none_failed(100, 0);
-    auto curr_view = std::make_unique<derecho::View>(0, members, member_ips, none_failed);
+    //A mixed fleet: every third node has 4 times the cores of the others, and every fifth twice as many
+    std::vector<derecho::NodeCapacity> member_capacities(100, derecho::NodeCapacity{8, 25, 500});
+    for(std::size_t rank = 0; rank < member_capacities.size(); ++rank) {
+        if(rank % 3 == 0) {
+            member_capacities[rank].cores = 32;
+        } else if(rank % 5 == 0) {
+            member_capacities[rank].cores = 16;
+        }
+    }
+    auto curr_view = std::make_unique<derecho::View>(0, members, member_ips, none_failed,
+                                                     std::vector<derecho::node_id_t>{}, std::vector<derecho::node_id_t>{},
+                                                     0, 0, member_capacities);
 
     std::cout << "TEST 1: Initial allocation" << std::endl;
     derecho::test_provision_subgroups(test_subgroups, nullptr, *curr_view);
@@ -101,7 +405,8 @@ int main(int argc, char* argv[]) {
     std::generate(new_member_ips.begin(), new_member_ips.end(), ip_generator);
     std::cout << "TEST 5: Adding new members 100-140" << std::endl;
     prev_view.swap(curr_view);
-    curr_view = derecho::make_next_view(*prev_view, {}, new_members, new_member_ips);
+    curr_view = derecho::make_next_view(*prev_view, {}, new_members, new_member_ips,
+                                        std::vector<derecho::NodeCapacity>(40, derecho::NodeCapacity{16, 25, 500}));
 
     derecho::test_provision_subgroups(test_subgroups, prev_view, *curr_view);
 
@@ -121,28 +426,76 @@ void print_subgroup_layout(const subgroup_shard_layout_t& layout) {
     }
 }
 
-void test_provision_subgroups(const SubgroupInfo& subgroup_info,
+void print_load_balance(const subgroup_shard_layout_t& layout, const View& view, CapacityResource resource) {
+    using std::cout;
+    std::map<node_id_t, int> num_shards_of;
+    for(const auto& subgroup : layout) {
+        for(const SubView& shard_view : subgroup) {
+            for(const node_id_t member : shard_view.members) {
+                num_shards_of[member]++;
+            }
+        }
+    }
+    //For each amount of the resource: the number of members in shards, and the fewest and most shards they're in
+    struct Balance {
+        int num_members = 0;
+        int total_shards = 0;
+        int min_shards = std::numeric_limits<int>::max();
+        int max_shards = 0;
+    };
+    std::map<uint32_t, Balance> balance_by_amount;
+    for(const auto& member_shards : num_shards_of) {
+        const uint32_t amount = capacity_amount(view.member_capacities[view.rank_of(member_shards.first)], resource);
+        Balance& balance = balance_by_amount[amount];
+        balance.num_members++;
+        balance.total_shards += member_shards.second;
+        balance.min_shards = std::min(balance.min_shards, member_shards.second);
+        balance.max_shards = std::max(balance.max_shards, member_shards.second);
+    }
+    cout << "Load balance of " << num_shards_of.size() << " members:" << std::endl;
+    for(const auto& amount_balance : balance_by_amount) {
+        const Balance& balance = amount_balance.second;
+        cout << "  capacity " << amount_balance.first << ": " << balance.num_members << " members, "
+             << balance.min_shards << "-" << balance.max_shards << " shards each, "
+             << (double)balance.total_shards / balance.num_members / amount_balance.first
+             << " shards per unit of capacity" << std::endl;
+    }
+}
+
+bool test_provision_subgroups(const SubgroupInfo& subgroup_info,
                               const std::unique_ptr<View>& prev_view,
-                              View& curr_view) {
+                              View& curr_view,
+                              bool print_layouts) {
     bool previous_was_ok = !prev_view || prev_view->is_adequately_provisioned;
     int32_t initial_next_unassigned_rank = curr_view.next_unassigned_rank;
-    std::cout << "View has these members: " << curr_view.members << std::endl;
+    if(print_layouts) {
+        std::cout << "View has these members: " << curr_view.members << std::endl;
+    }
+    int32_t type_position = 0;
     for(const auto& subgroup_type : subgroup_info.membership_function_order) {
         subgroup_shard_layout_t subgroup_shard_views;
+        curr_view.allocating_type_position = type_position++;
         try {
             auto temp = subgroup_info.subgroup_membership_functions.at(subgroup_type)(curr_view, curr_view.next_unassigned_rank, previous_was_ok);
             subgroup_shard_views = std::move(temp);
-            std::cout << "Subgroup type " << subgroup_type.name() << " got assignment: " << std::endl;
-            derecho::print_subgroup_layout(subgroup_shard_views);
-            std::cout << "next_unassigned_rank is " << curr_view.next_unassigned_rank << std::endl
-                      << std::endl;
+            if(print_layouts) {
+                std::cout << "Subgroup type " << subgroup_type.name() << " got assignment: " << std::endl;
+                derecho::print_subgroup_layout(subgroup_shard_views);
+                derecho::print_load_balance(subgroup_shard_views, curr_view, CapacityResource::CORES);
+                std::cout << "next_unassigned_rank is " << curr_view.next_unassigned_rank << std::endl
+                          << std::endl;
+            }
         } catch(derecho::subgroup_provisioning_exception& ex) {
+            curr_view.allocating_type_position = -1;
             curr_view.is_adequately_provisioned = false;
             curr_view.next_unassigned_rank = initial_next_unassigned_rank;
             curr_view.subgroup_shard_views.clear();
-            std::cout << "Subgroup type " << subgroup_type.name() << " failed to provision, marking View inadequate" << std::endl
-                      << std::endl;
-            return;
+            curr_view.subgroup_ids_by_type.clear();
+            if(print_layouts) {
+                std::cout << "Subgroup type " << subgroup_type.name() << " failed to provision, marking View inadequate" << std::endl
+                          << std::endl;
+            }
+            return false;
         }
         std::size_t num_subgroups = subgroup_shard_views.size();
         curr_view.subgroup_ids_by_type[subgroup_type] = std::vector<subgroup_id_t>(num_subgroups);
@@ -160,15 +513,7 @@ void test_provision_subgroups(const SubgroupInfo& subgroup_info,
                     subgroup_id_t prev_subgroup_id = prev_view->subgroup_ids_by_type
                                                              .at(subgroup_type)
                                                              .at(subgroup_index);
-                    SubView& prev_shard_view = prev_view->subgroup_shard_views[prev_subgroup_id][shard_num];
-                    std::set<node_id_t> prev_members(prev_shard_view.members.begin(), prev_shard_view.members.end());
-                    std::set<node_id_t> curr_members(shard_view.members.begin(), shard_view.members.end());
-                    std::set_difference(curr_members.begin(), curr_members.end(),
-                                        prev_members.begin(), prev_members.end(),
-                                        std::back_inserter(shard_view.joined));
-                    std::set_difference(prev_members.begin(), prev_members.end(),
-                                        curr_members.begin(), curr_members.end(),
-                                        std::back_inserter(shard_view.departed));
+                    shard_view.init_changes_from(prev_view->subgroup_shard_views[prev_subgroup_id][shard_num]);
                 }
             }
             /* Pull the shard->SubView mapping out of the subgroup membership list
@@ -178,16 +523,50 @@ void test_provision_subgroups(const SubgroupInfo& subgroup_info,
         }
 
     }
+    curr_view.allocating_type_position = -1;
+    return true;
+}
+
+std::vector<subgroup_shard_layout_t> make_previous_shard_layouts(const SubgroupInfo& subgroup_info,
+                                                                 const View& view) {
+    //An inadequate View has no layout, so the next one keeps the last good one
+    if(!view.is_adequately_provisioned) {
+        return view.previous_shard_layouts;
+    }
+    std::vector<subgroup_shard_layout_t> layouts;
+    for(const auto& subgroup_type : subgroup_info.membership_function_order) {
+        subgroup_shard_layout_t layout;
+        auto ids = view.subgroup_ids_by_type.find(subgroup_type);
+        if(ids != view.subgroup_ids_by_type.end()) {
+            for(subgroup_id_t subgroup_id : ids->second) {
+                layout.push_back(view.subgroup_shard_views[subgroup_id]);
+            }
+        }
+        layouts.emplace_back(std::move(layout));
+    }
+    return layouts;
+}
+
+std::size_t count_members_moved(const View& view) {
+    std::size_t moved = 0;
+    for(const auto& shard_views : view.subgroup_shard_views) {
+        for(const SubView& shard_view : shard_views) {
+            moved += shard_view.joined.size();
+        }
+    }
+    return moved;
 }
 
 std::unique_ptr<View> make_next_view(const View& curr_view,
                                      const std::set<int>& leave_ranks,
                                      const std::vector<node_id_t>& joiner_ids,
-                                     const std::vector<ip_addr>& joiner_ips) {
+                                     const std::vector<ip_addr>& joiner_ips,
+                                     const std::vector<NodeCapacity>& joiner_capacities) {
     int next_num_members = curr_view.num_members - leave_ranks.size() + joiner_ids.size();
     std::vector<node_id_t> joined, members(next_num_members), departed;
     std::vector<char> failed(next_num_members);
     std::vector<ip_addr> member_ips(next_num_members);
+    std::vector<NodeCapacity> member_capacities(next_num_members, unit_capacity());
     int next_unassigned_rank = curr_view.next_unassigned_rank;
     for(std::size_t i = 0; i < joiner_ids.size(); ++i) {
         joined.emplace_back(joiner_ids[i]);
@@ -195,6 +574,9 @@ std::unique_ptr<View> make_next_view(const View& curr_view,
         int new_member_rank = curr_view.num_members - leave_ranks.size() + i;
         members[new_member_rank] = joiner_ids[i];
         member_ips[new_member_rank] = joiner_ips[i];
+        if(!joiner_capacities.empty()) {
+            member_capacities[new_member_rank] = joiner_capacities[i];
+        }
     }
     for(const auto& leaver_rank : leave_ranks) {
         departed.emplace_back(curr_view.members[leaver_rank]);
@@ -210,6 +592,7 @@ std::unique_ptr<View> make_next_view(const View& curr_view,
         if(leave_ranks.find(n) == leave_ranks.end()) {
             members[m] = curr_view.members[n];
             member_ips[m] = curr_view.member_ips[n];
+            member_capacities[m] = curr_view.member_capacities[n];
             failed[m] = curr_view.failed[n];
             ++m;
         }
@@ -225,7 +608,8 @@ std::unique_ptr<View> make_next_view(const View& curr_view,
         }
     }
     return std::make_unique<View>(curr_view.vid + 1, members, member_ips, failed,
-                                  joined, departed, my_new_rank, next_unassigned_rank);
+                                  joined, departed, my_new_rank, next_unassigned_rank,
+                                  member_capacities);
 }
 
 } /* namespace derecho */
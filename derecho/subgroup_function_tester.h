@@ -47,12 +47,15 @@ namespace derecho {
  * @param joiner_ids The IDs of new nodes that are joining
  * @param joiner_ips The IP addresses of the new nodes that are joining, in the
  * same order as their corresponding IDs
+ * @param joiner_capacities The capacities the new nodes advertise, in the same
+ * order as their IDs, or empty if they all have unit_capacity()
  * @return A new View with the joins and leaves applied
  */
 std::unique_ptr<View> make_next_view(const View& curr_view,
                                      const std::set<int>& leave_ranks,
                                      const std::vector<node_id_t>& joiner_ids,
-                                     const std::vector<ip_addr>& joiner_ips);
+                                     const std::vector<ip_addr>& joiner_ips,
+                                     const std::vector<NodeCapacity>& joiner_capacities = {});
 
 /**
  * Prints the membership of a subgroup/shard layout to stdout
@@ -60,6 +63,16 @@ std::unique_ptr<View> make_next_view(const View& curr_view,
  */
 void print_subgroup_layout(const subgroup_shard_layout_t& layout);
 
+/**
+ * Prints how evenly the shards of a subgroup/shard layout are spread over
+ * its members for their capacity: for each amount of the resource that the
+ * members have, how many of them there are, and how many shards each is in.
+ * @param layout
+ * @param view The View the layout was made for
+ * @param resource The resource to weigh the members by
+ */
+void print_load_balance(const subgroup_shard_layout_t& layout, const View& view, CapacityResource resource);
+
 /**
  * Runs the same logic as ViewManager::make_subgroup_maps(), only without
  * actually saving the subgroup_to_x maps. curr_view is still updated with the
@@ -67,8 +80,28 @@ void print_subgroup_layout(const subgroup_shard_layout_t& layout);
  * @param subgroup_info The SubgroupInfo to use for provisioning subgroups
  * @param prev_view The previous view, if there was one, or nullptr
  * @param curr_view The current view in which to assign subgroup membership
+ * @param print_layouts Whether to print each subgroup type's assignment
+ * @return True if curr_view was adequately provisioned
  */
-void test_provision_subgroups(const SubgroupInfo& subgroup_info,
+bool test_provision_subgroups(const SubgroupInfo& subgroup_info,
                               const std::unique_ptr<View>& prev_view,
-                              View& curr_view);
+                              View& curr_view,
+                              bool print_layouts = true);
+
+/**
+ * Makes the previous_shard_layouts of the View after this one, the same way
+ * ViewManager::make_previous_shard_layouts() does.
+ * @param subgroup_info The SubgroupInfo the View was provisioned with
+ * @param view The View that is being replaced
+ */
+std::vector<subgroup_shard_layout_t> make_previous_shard_layouts(const SubgroupInfo& subgroup_info,
+                                                                 const View& view);
+
+/**
+ * Counts the members that the View's shards gained over the previous View,
+ * from the joined lists that test_provision_subgroups filled in, which is the
+ * number of members that had to be moved into a shard.
+ * @param view A View provisioned by test_provision_subgroups
+ */
+std::size_t count_members_moved(const View& view);
 }
@@ -4,6 +4,9 @@
  * @date Feb 28, 2017
  */
 
+#include <algorithm>
+#include <deque>
+#include <set>
 #include <vector>
 
 #include "derecho_internal.h"
@@ -26,18 +29,19 @@ subgroup_shard_layout_t one_subgroup_entire_view_raw(const View& curr_view, int&
     return subgroup_vector;
 }
 
-ShardAllocationPolicy even_sharding_policy(int num_shards, int nodes_per_shard) {
-    return ShardAllocationPolicy{num_shards, true, nodes_per_shard, Mode::ORDERED, {}, {}};
+ShardAllocationPolicy even_sharding_policy(int num_shards, int nodes_per_shard, int standbys_per_shard) {
+    return ShardAllocationPolicy{num_shards, true, nodes_per_shard, Mode::ORDERED, {}, {}, standbys_per_shard};
 }
 
-ShardAllocationPolicy raw_even_sharding_policy(int num_shards, int nodes_per_shard) {
-    return ShardAllocationPolicy{num_shards, true, nodes_per_shard, Mode::RAW, {}, {}};
+ShardAllocationPolicy raw_even_sharding_policy(int num_shards, int nodes_per_shard, int standbys_per_shard) {
+    return ShardAllocationPolicy{num_shards, true, nodes_per_shard, Mode::RAW, {}, {}, standbys_per_shard};
 }
 
 ShardAllocationPolicy custom_shards_policy(const std::vector<int>& num_nodes_by_shard,
-                                           const std::vector<Mode>& delivery_modes_by_shard) {
+                                           const std::vector<Mode>& delivery_modes_by_shard,
+                                           int standbys_per_shard) {
     return ShardAllocationPolicy{static_cast<int>(num_nodes_by_shard.size()), false, -1, Mode::ORDERED,
-                                 num_nodes_by_shard, delivery_modes_by_shard};
+                                 num_nodes_by_shard, delivery_modes_by_shard, standbys_per_shard};
 }
 
 SubgroupAllocationPolicy one_subgroup_policy(const ShardAllocationPolicy& policy) {
@@ -48,6 +52,17 @@ SubgroupAllocationPolicy identical_subgroups_policy(int num_subgroups, const Sha
     return SubgroupAllocationPolicy{num_subgroups, true, {subgroup_policy}};
 }
 
+SubgroupAllocationPolicy minimal_movement_policy(SubgroupAllocationPolicy policy) {
+    policy.minimize_movement = true;
+    return policy;
+}
+
+SubgroupAllocationPolicy capacity_weighted_policy(SubgroupAllocationPolicy policy, CapacityResource resource) {
+    policy.capacity_weighted = true;
+    policy.weighted_resource = resource;
+    return policy;
+}
+
 /**
  * Allocates members to a single subgroup, using that subgroup's
  * ShardAllocationPolicy, and pushes the resulting vector of SubViews onto the
@@ -79,10 +94,171 @@ void DefaultSubgroupAllocator::assign_subgroup(const View& curr_view, int& next_
     }
 }
 
+const ShardAllocationPolicy& DefaultSubgroupAllocator::shard_policy(int subgroup_num) const {
+    return policy.shard_policy_by_subgroup[policy.identical_subgroups ? 0 : subgroup_num];
+}
+
+/**
+ * The nodes taken are always the next ones in rank order, as in
+ * assign_subgroup, so the next_unassigned_rank cursor stays meaningful; a
+ * node with more capacity just ends up in more of the shards. With nodes of
+ * equal capacity, this makes the same assignment that assign_subgroup does.
+ */
+void DefaultSubgroupAllocator::assign_weighted(const View& curr_view, int& next_unassigned_rank) {
+    //A node is in at most one shard of a subgroup, so the largest subgroup needs that many distinct nodes
+    int num_nodes = 0;
+    for(int subgroup_num = 0; subgroup_num < policy.num_subgroups; ++subgroup_num) {
+        const ShardAllocationPolicy& subgroup_policy = shard_policy(subgroup_num);
+        int subgroup_size = 0;
+        for(int shard_num = 0; shard_num < subgroup_policy.num_shards; ++shard_num) {
+            subgroup_size += subgroup_policy.even_shards ? subgroup_policy.nodes_per_shard
+                                                         : subgroup_policy.num_nodes_by_shard[shard_num];
+        }
+        num_nodes = std::max(num_nodes, subgroup_size);
+    }
+    for(; next_unassigned_rank + num_nodes <= (int)curr_view.members.size(); ++num_nodes) {
+        if(try_assign_weighted(curr_view, next_unassigned_rank, num_nodes)) {
+            next_unassigned_rank += num_nodes;
+            return;
+        }
+    }
+    throw subgroup_provisioning_exception();
+}
+
+/**
+ * Each shard takes, one at a time, the nodes that would have the fewest
+ * shards per unit of capacity once they had this one, among those not
+ * already in the subgroup and not yet in as many shards as their capacity
+ * is a multiple of the smallest node's. Ties go to the lower rank.
+ */
+bool DefaultSubgroupAllocator::try_assign_weighted(const View& curr_view, int first_rank, int num_nodes) {
+    std::vector<uint64_t> amounts(num_nodes);
+    for(int node = 0; node < num_nodes; ++node) {
+        amounts[node] = capacity_amount(curr_view.member_capacities[first_rank + node], policy.weighted_resource);
+    }
+    const uint64_t smallest = *std::min_element(amounts.begin(), amounts.end());
+    std::vector<uint64_t> num_shards_of(num_nodes, 0);
+    auto assignment = std::make_unique<subgroup_shard_layout_t>();
+    for(int subgroup_num = 0; subgroup_num < policy.num_subgroups; ++subgroup_num) {
+        const ShardAllocationPolicy& subgroup_policy = shard_policy(subgroup_num);
+        std::vector<bool> in_subgroup(num_nodes, false);
+        assignment->emplace_back(std::vector<SubView>());
+        for(int shard_num = 0; shard_num < subgroup_policy.num_shards; ++shard_num) {
+            const int nodes_needed = subgroup_policy.even_shards ? subgroup_policy.nodes_per_shard
+                                                                 : subgroup_policy.num_nodes_by_shard[shard_num];
+            std::vector<node_id_t> desired_nodes;
+            for(int member = 0; member < nodes_needed; ++member) {
+                int best = -1;
+                for(int node = 0; node < num_nodes; ++node) {
+                    if(in_subgroup[node] || num_shards_of[node] >= amounts[node] / smallest) {
+                        continue;
+                    }
+                    //(shards + 1) / amount < (best's shards + 1) / best's amount
+                    if(best == -1 || (num_shards_of[node] + 1) * amounts[best] < (num_shards_of[best] + 1) * amounts[node]) {
+                        best = node;
+                    }
+                }
+                if(best == -1) {
+                    return false;
+                }
+                in_subgroup[best] = true;
+                num_shards_of[best]++;
+                desired_nodes.push_back(curr_view.members[first_rank + best]);
+            }
+            Mode delivery_mode = subgroup_policy.even_shards ? subgroup_policy.shards_mode : subgroup_policy.modes_by_shard[shard_num];
+            assignment->back().emplace_back(curr_view.make_subview(desired_nodes, delivery_mode));
+        }
+    }
+    previous_assignment = std::move(assignment);
+    return true;
+}
+
+/**
+ * The regular members of a shard come first in its SubView, followed by its
+ * standbys, which are the members that aren't senders. A regular member that
+ * has left is replaced by the first standby still in the view, which already
+ * has the shard's state, or by the next unassigned node if there are none.
+ */
+void DefaultSubgroupAllocator::repair_shard(const View& curr_view, int& next_unassigned_rank,
+                                            int subgroup_num, int shard_num) {
+    SubView& shard_view = (*previous_assignment)[subgroup_num][shard_num];
+    const ShardAllocationPolicy& subgroup_policy = shard_policy(subgroup_num);
+    const std::size_t num_regular = subgroup_policy.even_shards ? subgroup_policy.nodes_per_shard
+                                                                : subgroup_policy.num_nodes_by_shard[shard_num];
+    std::deque<node_id_t> standbys;
+    for(std::size_t shard_rank = num_regular; shard_rank < shard_view.members.size(); ++shard_rank) {
+        if(curr_view.rank_of(shard_view.members[shard_rank]) != -1) {
+            standbys.push_back(shard_view.members[shard_rank]);
+        }
+    }
+    std::vector<node_id_t> members(shard_view.members.begin(), shard_view.members.begin() + num_regular);
+    for(node_id_t& member : members) {
+        if(curr_view.rank_of(member) != -1) {
+            continue;
+        }
+        if(!standbys.empty()) {
+            member = standbys.front();
+            standbys.pop_front();
+        } else {
+            //This node is not in the current view, so take the next available one
+            if(next_unassigned_rank >= (int)curr_view.members.size()) {
+                throw subgroup_provisioning_exception();
+            }
+            member = curr_view.members[next_unassigned_rank];
+            next_unassigned_rank++;
+        }
+    }
+    std::vector<int> is_sender(members.size(), 1);
+    members.insert(members.end(), standbys.begin(), standbys.end());
+    is_sender.resize(members.size(), 0);
+    //joined and departed will be initialized from scratch by the calling ViewManager
+    shard_view = curr_view.make_subview(members, shard_view.mode, is_sender);
+}
+
+/**
+ * Standbys are only added once every shard in this allocator's subgroups has
+ * its regular members, and one at a time to each shard in turn, so that
+ * nodes left over are spread evenly and a shortage of standbys never makes
+ * the view inadequate.
+ */
+void DefaultSubgroupAllocator::add_standbys(const View& curr_view, int& next_unassigned_rank) {
+    bool added = true;
+    while(added && next_unassigned_rank < (int)curr_view.members.size()) {
+        added = false;
+        for(int subgroup_num = 0; subgroup_num < policy.num_subgroups; ++subgroup_num) {
+            const ShardAllocationPolicy& subgroup_policy = shard_policy(subgroup_num);
+            for(int shard_num = 0; shard_num < subgroup_policy.num_shards; ++shard_num) {
+                SubView& shard_view = (*previous_assignment)[subgroup_num][shard_num];
+                const std::size_t num_regular = subgroup_policy.even_shards ? subgroup_policy.nodes_per_shard
+                                                                            : subgroup_policy.num_nodes_by_shard[shard_num];
+                if(shard_view.members.size() >= num_regular + subgroup_policy.standbys_per_shard
+                   || next_unassigned_rank >= (int)curr_view.members.size()) {
+                    continue;
+                }
+                std::vector<node_id_t> members = shard_view.members;
+                std::vector<int> is_sender = shard_view.is_sender;
+                members.push_back(curr_view.members[next_unassigned_rank]);
+                is_sender.push_back(0);
+                next_unassigned_rank++;
+                shard_view = curr_view.make_subview(members, shard_view.mode, is_sender);
+                added = true;
+            }
+        }
+    }
+}
+
 subgroup_shard_layout_t DefaultSubgroupAllocator::operator()(const View& curr_view,
                                                              int& next_unassigned_rank,
                                                              bool previous_was_successful) {
-    if(previous_was_successful) {
+    if(policy.minimize_movement) {
+        //The previous View's layout is already the last good one
+        const subgroup_shard_layout_t* previous_layout = curr_view.previous_layout_of_allocating_type();
+        if(previous_layout && previous_layout->size() == (std::size_t)policy.num_subgroups) {
+            previous_assignment = std::make_unique<subgroup_shard_layout_t>(*previous_layout);
+        } else {
+            previous_assignment.reset();
+        }
+    } else if(previous_was_successful) {
         //Save the previous assignment since it was successful
         last_good_assignment = deep_pointer_copy(previous_assignment);
     } else {
@@ -91,43 +267,19 @@ subgroup_shard_layout_t DefaultSubgroupAllocator::operator()(const View& curr_vi
     }
     if(previous_assignment) {
         for(int subgroup_num = 0; subgroup_num < policy.num_subgroups; ++subgroup_num) {
-            int num_shards_in_subgroup;
-            if(policy.identical_subgroups) {
-                num_shards_in_subgroup = policy.shard_policy_by_subgroup[0].num_shards;
-            } else {
-                num_shards_in_subgroup = policy.shard_policy_by_subgroup[subgroup_num].num_shards;
-            }
-            for(int shard_num = 0; shard_num < num_shards_in_subgroup; ++shard_num) {
-                //Check each member of the shard in the previous assignment
-                for(std::size_t shard_rank = 0;
-                    shard_rank < (*previous_assignment)[subgroup_num][shard_num].members.size();
-                    ++shard_rank) {
-                    if(curr_view.rank_of((*previous_assignment)[subgroup_num][shard_num].members[shard_rank]) == -1) {
-                        //This node is not in the current view, so take the next available one
-                        if(next_unassigned_rank >= (int)curr_view.members.size()) {
-                            throw subgroup_provisioning_exception();
-                        }
-                        (*previous_assignment)[subgroup_num][shard_num].members[shard_rank] = curr_view.members[next_unassigned_rank];
-                        (*previous_assignment)[subgroup_num][shard_num].member_ips[shard_rank] = curr_view.member_ips[next_unassigned_rank];
-                        next_unassigned_rank++;
-                    } else {
-                    }
-                }
-                //These will be initialized from scratch by the calling ViewManager
-                (*previous_assignment)[subgroup_num][shard_num].joined.clear();
-                (*previous_assignment)[subgroup_num][shard_num].departed.clear();
+            for(int shard_num = 0; shard_num < shard_policy(subgroup_num).num_shards; ++shard_num) {
+                repair_shard(curr_view, next_unassigned_rank, subgroup_num, shard_num);
             }
         }
+    } else if(policy.capacity_weighted) {
+        assign_weighted(curr_view, next_unassigned_rank);
     } else {
         previous_assignment = std::make_unique<subgroup_shard_layout_t>();
         for(int subgroup_num = 0; subgroup_num < policy.num_subgroups; ++subgroup_num) {
-            if(policy.identical_subgroups) {
-                assign_subgroup(curr_view, next_unassigned_rank, policy.shard_policy_by_subgroup[0]);
-            } else {
-                assign_subgroup(curr_view, next_unassigned_rank, policy.shard_policy_by_subgroup[subgroup_num]);
-            }
+            assign_subgroup(curr_view, next_unassigned_rank, shard_policy(subgroup_num));
         }
     }
+    add_standbys(curr_view, next_unassigned_rank);
     return *previous_assignment;
 }
 
@@ -145,6 +297,9 @@ subgroup_shard_layout_t CrossProductAllocator::operator()(const View& curr_view,
         num_source_members += shard_view.members.size();
     }
     int num_target_shards = curr_view.subgroup_shard_views[target_subgroup_id].size();
+    if(policy.multiplex_sources) {
+        return multiplexed_assignment(curr_view, source_subgroup_id, target_subgroup_id);
+    }
     //Each subgroup will have only one shard, since they'll all overlap, so there are source * target subgroups
     subgroup_shard_layout_t assignment(num_source_members * num_target_shards);
     //I want a list of all members of the source subgroup, "flattened" out of shards, but we don't have that
@@ -172,4 +327,31 @@ subgroup_shard_layout_t CrossProductAllocator::operator()(const View& curr_view,
     }
     return assignment;
 }
+
+subgroup_shard_layout_t CrossProductAllocator::multiplexed_assignment(const View& curr_view,
+                                                                      subgroup_id_t source_subgroup_id,
+                                                                      subgroup_id_t target_subgroup_id) const {
+    //All the source members, flattened out of their shards in order
+    std::vector<node_id_t> source_members;
+    for(const auto& shard_view : curr_view.subgroup_shard_views[source_subgroup_id]) {
+        source_members.insert(source_members.end(), shard_view.members.begin(), shard_view.members.end());
+    }
+    const std::set<node_id_t> source_set(source_members.begin(), source_members.end());
+    const std::size_t num_target_shards = curr_view.subgroup_shard_views[target_subgroup_id].size();
+    subgroup_shard_layout_t assignment(num_target_shards);
+    for(std::size_t target_shard = 0; target_shard < num_target_shards; ++target_shard) {
+        //The sources come first, as the senders, then the target shard's members
+        //that aren't already among them
+        std::vector<node_id_t> desired_nodes(source_members);
+        for(const node_id_t target_node : curr_view.subgroup_shard_views[target_subgroup_id][target_shard].members) {
+            if(source_set.count(target_node) == 0) {
+                desired_nodes.push_back(target_node);
+            }
+        }
+        std::vector<int> sender_flags(desired_nodes.size(), false);
+        std::fill(sender_flags.begin(), sender_flags.begin() + source_members.size(), true);
+        assignment[target_shard].push_back(curr_view.make_subview(desired_nodes, Mode::ORDERED, sender_flags));
+    }
+    return assignment;
+}
 }
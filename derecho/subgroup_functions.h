@@ -10,6 +10,7 @@
 
 #include "derecho_internal.h"
 #include "derecho_modes.h"
+#include "node_capacity.h"
 #include "subgroup_info.h"
 
 namespace derecho {
@@ -52,6 +53,13 @@ struct ShardAllocationPolicy {
      * indicating which delivery mode it should use. (Ignored if even_shards is
      * true). */
     std::vector<Mode> modes_by_shard;
+    /** The number of standby members to add to each shard, after its regular
+     * members, if there are enough nodes left over once every subgroup of this
+     * type has its regular members. Standbys receive and deliver every message
+     * in the shard but never send, so they stay up to date with the shard's
+     * state, and when a regular member fails a standby takes its place without
+     * a state transfer. */
+    int standbys_per_shard = 0;
 };
 
 struct SubgroupAllocationPolicy {
@@ -63,6 +71,20 @@ struct SubgroupAllocationPolicy {
      * policy for all subgroups of this type. If identical_subgroups is false,
      * contains an entry for each subgroup describing that subgroup's shards. */
     std::vector<ShardAllocationPolicy> shard_policy_by_subgroup;
+    /** If true, each View's layout starts from the previous View's (from
+     * View::previous_shard_layouts) instead of from the allocator's own copy
+     * of the last one it made. Only shards that lost a member change, and
+     * every node, including one that has just joined, arrives at the same
+     * layout. */
+    bool minimize_movement = false;
+    /** If true, the first assignment gives each node a share of the shards
+     * that is proportional to how much of weighted_resource it advertised,
+     * instead of one shard to each node in rank order: a node with k times
+     * the capacity of the smallest node in the assignment can be a member of
+     * up to k shards, in different subgroups. */
+    bool capacity_weighted = false;
+    /** The resource that capacity-weighted assignment balances */
+    CapacityResource weighted_resource = CapacityResource::CORES;
 };
 
 /* Helper functions that construct ShardAllocationPolicy values for common cases. */
@@ -72,18 +94,22 @@ struct SubgroupAllocationPolicy {
  * the same number of nodes in each shard.
  * @param num_shards The number of shards to request in this policy.
  * @param nodes_per_shard The number of nodes per shard to request.
+ * @param standbys_per_shard The number of standby members per shard to
+ * request, in addition to nodes_per_shard.
  * @return A ShardAllocationPolicy value with these parameters.
  */
-ShardAllocationPolicy even_sharding_policy(int num_shards, int nodes_per_shard);
+ShardAllocationPolicy even_sharding_policy(int num_shards, int nodes_per_shard, int standbys_per_shard = 0);
 /**
  * Returns a ShardAllocationPolicy that specifies num_shards shards with
  * the same number of nodes in each shard, and every shard running in "raw"
  * delivery mode.
  * @param num_shards The number of shards to request in this policy.
  * @param nodes_per_shard The number of nodes per shard to request.
+ * @param standbys_per_shard The number of standby members per shard to
+ * request, in addition to nodes_per_shard.
  * @return A ShardAllocationPolicy value with these parameters.
  */
-ShardAllocationPolicy raw_even_sharding_policy(int num_shards, int nodes_per_shard);
+ShardAllocationPolicy raw_even_sharding_policy(int num_shards, int nodes_per_shard, int standbys_per_shard = 0);
 /**
  * Returnsa ShardAllocationPolicy for a subgroup that has a different number of
  * members in each shard, and possibly has each shard in a different delivery mode.
@@ -92,10 +118,13 @@ ShardAllocationPolicy raw_even_sharding_policy(int num_shards, int nodes_per_sha
  * shard; the ith shard will have num_nodes_by_shard[i] members.
  * @param delivery_modes_by_shard A vector specifying the delivery mode (Raw or
  * Ordered) for each shard, in the same order as the other vector.
+ * @param standbys_per_shard The number of standby members to request in each
+ * shard, in addition to its regular members.
  * @return A ShardAllocationPolicy that specifies these shard sizes and modes.
  */
 ShardAllocationPolicy custom_shards_policy(const std::vector<int>& num_nodes_by_shard,
-                                           const std::vector<Mode>& delivery_modes_by_shard);
+                                           const std::vector<Mode>& delivery_modes_by_shard,
+                                           int standbys_per_shard = 0);
 
 /**
  * Returns a SubgroupAllocationPolicy for a replicated type that only has a
@@ -116,6 +145,25 @@ SubgroupAllocationPolicy one_subgroup_policy(const ShardAllocationPolicy& policy
  */
 SubgroupAllocationPolicy identical_subgroups_policy(int num_subgroups, const ShardAllocationPolicy& subgroup_policy);
 
+/**
+ * Returns a copy of a SubgroupAllocationPolicy that keeps members in the
+ * shards they were in from one View to the next, moving only replacements
+ * for members that left.
+ * @param policy The policy to copy
+ * @return The same policy, with minimize_movement set
+ */
+SubgroupAllocationPolicy minimal_movement_policy(SubgroupAllocationPolicy policy);
+
+/**
+ * Returns a copy of a SubgroupAllocationPolicy that assigns shards to nodes
+ * in proportion to their capacity, so that larger nodes are in more shards.
+ * @param policy The policy to copy
+ * @param resource The resource that the shards are limited by
+ * @return The same policy, with capacity_weighted set
+ */
+SubgroupAllocationPolicy capacity_weighted_policy(SubgroupAllocationPolicy policy,
+                                                  CapacityResource resource = CapacityResource::CORES);
+
 /**
  * Functor of type shard_view_generator_t that implements the default subgroup
  * allocation algorithm, parameterized based on a SubgroupAllocationPolicy.
@@ -126,6 +174,18 @@ class DefaultSubgroupAllocator {
     const SubgroupAllocationPolicy policy;
 
     void assign_subgroup(const View& curr_view, int& next_unassigned_rank, const ShardAllocationPolicy& subgroup_policy);
+    const ShardAllocationPolicy& shard_policy(int subgroup_num) const;
+    /** Assigns every subgroup's regular members by capacity, taking as few
+     * unassigned nodes as there is room in for all of them. */
+    void assign_weighted(const View& curr_view, int& next_unassigned_rank);
+    /** Tries to assign every subgroup's regular members from the num_nodes
+     * nodes starting at first_rank, filling previous_assignment if it can. */
+    bool try_assign_weighted(const View& curr_view, int first_rank, int num_nodes);
+    /** Replaces the members of a shard in previous_assignment that aren't in
+     * the current view, promoting its standbys before taking unassigned nodes. */
+    void repair_shard(const View& curr_view, int& next_unassigned_rank, int subgroup_num, int shard_num);
+    /** Fills the shards' standby slots from the unassigned nodes, as far as they go. */
+    void add_standbys(const View& curr_view, int& next_unassigned_rank);
 
 public:
     DefaultSubgroupAllocator(const SubgroupAllocationPolicy& allocation_policy)
@@ -148,6 +208,10 @@ struct CrossProductPolicy {
      * Each shard in this subgroup will have all of its members assigned to S subgroups
      * as receivers, where S is the number of members in the source subgroup. */
     std::pair<std::type_index, uint32_t> target_subgroup;
+    /** If true, the cross-product has only T subgroups, one for each shard of
+     * the target subgroup, in which every member of the source subgroup is a
+     * sender, instead of one for each (source member, target shard) pair. */
+    bool multiplex_sources = false;
 };
 
 /**
@@ -160,10 +224,23 @@ struct CrossProductPolicy {
  * marked as the only senders in these subgroups. A node that has rank i within
  * the source subgroup can send a multicast to shard j of the target subgroup
  * by selecting the cross-product subgroup at index (i * T + j).
+ *
+ * With CrossProductPolicy::multiplex_sources, there are only T subgroups
+ * instead: subgroup j contains all of the source members, as its senders,
+ * and the members of target shard j. Any source member sends to shard j by
+ * selecting the subgroup at index j. This costs O(T) subgroups, and their
+ * SST columns and RDMC groups, rather than O(S * T), but the sources' messages
+ * to a shard are delivered in one order, so sources that rarely send should
+ * be used with DerechoParams::skip_idle_senders.
  */
 class CrossProductAllocator {
     const CrossProductPolicy policy;
 
+    /** The assignment of the multiplex_sources mode, with one subgroup per target shard. */
+    subgroup_shard_layout_t multiplexed_assignment(const View& curr_view,
+                                                   subgroup_id_t source_subgroup_id,
+                                                   subgroup_id_t target_subgroup_id) const;
+
 public:
     CrossProductAllocator(const CrossProductPolicy& allocation_policy) : policy(allocation_policy) {}
     CrossProductAllocator(const CrossProductAllocator& to_copy) : policy(to_copy.policy) {}
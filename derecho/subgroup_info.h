@@ -11,6 +11,7 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <set>
 #include <typeindex>
 #include <vector>
 
@@ -71,11 +72,21 @@ struct SubgroupInfo {
      * dependent function runs second.
      */
     const std::list<std::type_index> membership_function_order;
+    /**
+     * The Replicated Object types whose subgroups carry latency-critical
+     * traffic, such as small control RPCs, and must not wait behind the bulk
+     * data of the other subgroups. Their messages are sent by a sender thread
+     * of their own, their predicates are evaluated ahead of the others', and
+     * their RDMC groups use DerechoParams::critical_service_level.
+     */
+    const std::set<std::type_index> latency_critical_types;
 
     SubgroupInfo(std::map<std::type_index, shard_view_generator_t> subgroup_membership_functions,
-                 std::list<std::type_index> membership_function_order)
+                 std::list<std::type_index> membership_function_order,
+                 std::set<std::type_index> latency_critical_types = {})
             : subgroup_membership_functions(subgroup_membership_functions),
-              membership_function_order(membership_function_order) {
+              membership_function_order(membership_function_order),
+              latency_critical_types(latency_critical_types) {
     }
     SubgroupInfo(std::map<std::type_index, shard_view_generator_t> subgroup_membership_functions)
             : subgroup_membership_functions(subgroup_membership_functions),
@@ -0,0 +1,135 @@
+/**
+ * @file subgroup_map.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "derecho_internal.h"
+
+namespace derecho {
+
+/**
+ * A map from subgroup IDs to values, for the subgroups this node is a member
+ * of, kept as a vector indexed by subgroup ID. Subgroup IDs are the dense
+ * numbers ViewManager hands out in each view, so a lookup is an index into
+ * the vector instead of a walk down a tree, which matters on the paths that
+ * look up a subgroup on every message. It has the parts of std::map's
+ * interface that the group uses: iteration visits the subgroups in order of
+ * ID, as pairs of (subgroup ID, value).
+ */
+template <typename Value>
+class SubgroupMap {
+public:
+    using value_type = std::pair<subgroup_id_t, Value>;
+
+    class const_iterator {
+        const SubgroupMap* map;
+        std::vector<subgroup_id_t>::const_iterator position;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = SubgroupMap::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        const_iterator(const SubgroupMap* map, std::vector<subgroup_id_t>::const_iterator position)
+                : map(map), position(position) {}
+        reference operator*() const { return map->entries[*position]; }
+        pointer operator->() const { return &map->entries[*position]; }
+        const_iterator& operator++() {
+            ++position;
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator previous = *this;
+            ++position;
+            return previous;
+        }
+        bool operator==(const const_iterator& other) const { return position == other.position; }
+        bool operator!=(const const_iterator& other) const { return position != other.position; }
+    };
+
+private:
+    /** Indexed by subgroup ID; entries[i].first is always i, and the value is
+     * meaningful only if present[i] */
+    std::vector<value_type> entries;
+    std::vector<bool> present;
+    /** The IDs that have values, in increasing order */
+    std::vector<subgroup_id_t> ids;
+
+public:
+    SubgroupMap() = default;
+    /** Makes room for the subgroups of a view with num_subgroups subgroups */
+    explicit SubgroupMap(uint32_t num_subgroups) {
+        reserve(num_subgroups);
+    }
+
+    void reserve(uint32_t num_subgroups) {
+        entries.reserve(num_subgroups);
+        present.reserve(num_subgroups);
+        ids.reserve(num_subgroups);
+    }
+
+    /** @return The value for subgroup_id, inserting a default one if there isn't one */
+    Value& operator[](subgroup_id_t subgroup_id) {
+        while(entries.size() <= subgroup_id) {
+            entries.emplace_back(static_cast<subgroup_id_t>(entries.size()), Value{});
+            present.push_back(false);
+        }
+        if(!present[subgroup_id]) {
+            present[subgroup_id] = true;
+            // ViewManager adds subgroups in order of ID, so this is nearly always the end
+            ids.insert(std::upper_bound(ids.begin(), ids.end(), subgroup_id), subgroup_id);
+        }
+        return entries[subgroup_id].second;
+    }
+
+    Value& at(subgroup_id_t subgroup_id) {
+        if(!count(subgroup_id)) {
+            throw std::out_of_range("SubgroupMap has no entry for subgroup " + std::to_string(subgroup_id));
+        }
+        return entries[subgroup_id].second;
+    }
+
+    const Value& at(subgroup_id_t subgroup_id) const {
+        if(!count(subgroup_id)) {
+            throw std::out_of_range("SubgroupMap has no entry for subgroup " + std::to_string(subgroup_id));
+        }
+        return entries[subgroup_id].second;
+    }
+
+    std::size_t count(subgroup_id_t subgroup_id) const {
+        return subgroup_id < present.size() && present[subgroup_id] ? 1 : 0;
+    }
+
+    const_iterator find(subgroup_id_t subgroup_id) const {
+        if(!count(subgroup_id)) {
+            return end();
+        }
+        return const_iterator(this, std::lower_bound(ids.begin(), ids.end(), subgroup_id));
+    }
+
+    const_iterator begin() const { return const_iterator(this, ids.begin()); }
+    const_iterator end() const { return const_iterator(this, ids.end()); }
+    std::size_t size() const { return ids.size(); }
+    bool empty() const { return ids.empty(); }
+
+    void clear() {
+        entries.clear();
+        present.clear();
+        ids.clear();
+    }
+};
+
+}  // namespace derecho
@@ -0,0 +1,197 @@
+/**
+ * @file thread_placement.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace derecho {
+
+/**
+ * Where Derecho's background threads run and where its RDMA buffers live.
+ * Each thread is placed by its role, which is the name it gives itself
+ * (sender_thread, timer_wheel, sst_<predicate group>, sst_poll, rdmc_poll,
+ * rpc_thread, p2p_worker, reply_flush, delivery, persist_thread, writer_thread, clbk_thread, client_thread,
+ * heartbeat, state_writer, old_view, metrics, and so on). The placement of a role is a list of CPUs
+ * such as "2-5,8", or "nic" for the CPUs of the NUMA node that the RDMA
+ * device is attached to; the role "*" applies to every thread whose role has no entry
+ * of its own. Placements can be set with set_thread_placement() or in the
+ * DERECHO_THREAD_PLACEMENT environment variable, as entries of the form
+ * role=cpus separated by semicolons. Threads with no placement are not
+ * pinned. Everything here is header-only, since the SST, RDMC, and Derecho
+ * libraries all use it and must share one configuration.
+ */
+namespace thread_placement {
+
+struct Config {
+    std::mutex mutex;
+    bool loaded_environment = false;
+    std::map<std::string, std::string> cpus_by_role;
+    /** The NUMA node of the RDMA device, or -1 if it isn't known */
+    int nic_numa_node = -1;
+};
+
+inline Config& config() {
+    static Config instance;
+    return instance;
+}
+
+inline std::string read_first_line(const std::string& path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+/** Reads DERECHO_THREAD_PLACEMENT the first time any placement is needed. */
+inline void load_environment_locked(Config& c) {
+    if(c.loaded_environment) {
+        return;
+    }
+    c.loaded_environment = true;
+    const char* placement = getenv("DERECHO_THREAD_PLACEMENT");
+    if(!placement) {
+        return;
+    }
+    std::stringstream entries(placement);
+    std::string entry;
+    while(std::getline(entries, entry, ';')) {
+        const auto equals = entry.find('=');
+        if(equals == std::string::npos || equals == 0) {
+            std::cout << "Ignoring thread placement \"" << entry << "\", which is not of the form role=cpus" << std::endl;
+            continue;
+        }
+        // An entry set by the application takes precedence
+        c.cpus_by_role.emplace(entry.substr(0, equals), entry.substr(equals + 1));
+    }
+}
+
+/** Parses a list of CPUs like "0-3,8" into a CPU set. */
+inline bool parse_cpu_list(const std::string& list, cpu_set_t& cpu_set) {
+    CPU_ZERO(&cpu_set);
+    std::stringstream ranges(list);
+    std::string range;
+    bool any = false;
+    while(std::getline(ranges, range, ',')) {
+        if(range.empty()) {
+            continue;
+        }
+        char* end;
+        const long first = strtol(range.c_str(), &end, 10);
+        long last = first;
+        if(*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        if(*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for(long cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, &cpu_set);
+        }
+        any = true;
+    }
+    return any;
+}
+}  // namespace thread_placement
+
+/**
+ * Sets the CPUs that threads of a role are pinned to when they start,
+ * overriding DERECHO_THREAD_PLACEMENT. Threads that have already started
+ * are not moved.
+ */
+inline void set_thread_placement(const std::string& role, const std::string& cpus) {
+    auto& c = thread_placement::config();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    thread_placement::load_environment_locked(c);
+    c.cpus_by_role[role] = cpus;
+}
+
+/**
+ * Records which NUMA node the RDMA device is on, for "nic" placements and
+ * bind_to_nic_node(); called when the device is opened.
+ * @param ibdev_path The device's sysfs directory, from ibv_device::ibdev_path
+ */
+inline void record_nic_device(const std::string& ibdev_path) {
+    const std::string node = thread_placement::read_first_line(ibdev_path + "/device/numa_node");
+    auto& c = thread_placement::config();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    c.nic_numa_node = node.empty() ? -1 : atoi(node.c_str());
+}
+
+/** @return The NUMA node of the RDMA device, or -1 if it isn't known. */
+inline int nic_numa_node() {
+    auto& c = thread_placement::config();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    return c.nic_numa_node;
+}
+
+/**
+ * Pins the calling thread to the CPUs configured for its role, if any.
+ * Called by each of Derecho's threads as it starts.
+ */
+inline void place_this_thread(const std::string& role) {
+    std::string cpus;
+    int nic_node;
+    {
+        auto& c = thread_placement::config();
+        std::lock_guard<std::mutex> lock(c.mutex);
+        thread_placement::load_environment_locked(c);
+        auto it = c.cpus_by_role.find(role);
+        if(it == c.cpus_by_role.end()) {
+            it = c.cpus_by_role.find("*");
+        }
+        if(it == c.cpus_by_role.end()) {
+            return;
+        }
+        cpus = it->second;
+        nic_node = c.nic_numa_node;
+    }
+    if(cpus == "nic") {
+        if(nic_node < 0) {
+            return;
+        }
+        cpus = thread_placement::read_first_line("/sys/devices/system/node/node" + std::to_string(nic_node) + "/cpulist");
+    }
+    cpu_set_t cpu_set;
+    if(!thread_placement::parse_cpu_list(cpus, cpu_set)) {
+        std::cout << "Ignoring bad CPU list \"" << cpus << "\" for thread " << role << std::endl;
+        return;
+    }
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) {
+        std::cout << "Failed to pin thread " << role << " to CPUs " << cpus << std::endl;
+    }
+}
+
+/**
+ * Asks the kernel to put the pages of a region on the RDMA device's NUMA
+ * node, falling back to other nodes if it is full. It only affects pages
+ * that haven't been touched yet, so it must be called right after the
+ * region is mapped, before it is registered with the device. Does nothing
+ * if the device's node isn't known.
+ * @param addr The start of the region, which must be page-aligned
+ */
+inline void bind_to_nic_node(void* addr, std::size_t length) {
+    const int node = nic_numa_node();
+    if(node < 0 || node >= 64) {
+        return;
+    }
+    // MPOL_PREFERRED from <numaif.h>, which would need libnuma's headers
+    constexpr int mpol_preferred = 1;
+    unsigned long node_mask = 1ul << node;
+    syscall(SYS_mbind, addr, length, mpol_preferred, &node_mask, sizeof(node_mask) * 8, 0);
+}
+}  // namespace derecho
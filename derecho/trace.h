@@ -0,0 +1,318 @@
+/**
+ * @file trace.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <pthread.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "time/fast_clock.h"
+
+namespace derecho {
+
+/**
+ * Low-overhead event tracing for the SST, RDMC, and Derecho. Each thread
+ * records its events into a fixed-size ring of its own, stamped with the
+ * time stamp counter, so that recording an event takes no lock, makes no
+ * system call, and allocates nothing; once a ring is full, its oldest events
+ * are overwritten. The trace points are DERECHO_TRACE_POINT macros, which
+ * compile to nothing unless DERECHO_TRACE is defined, so that they cost
+ * nothing in a normal build. The events can be written out in the Chrome
+ * trace format, which Perfetto and chrome://tracing read, or in a binary
+ * dump; both carry realtime timestamps and the node ID, so that the traces of
+ * several nodes can be merged. Everything here is header-only, since the
+ * SST, RDMC, and Derecho libraries all use it and must share one registry.
+ */
+namespace trace {
+
+struct Event {
+    uint64_t tsc;
+    /** Both are string literals, so only their addresses are recorded */
+    const char* file;
+    const char* name;
+    int32_t line;
+    uint32_t group_number;
+    uint64_t message_number;
+    uint64_t block_number;
+};
+
+/** The number of events each thread keeps; a power of 2 */
+constexpr std::size_t events_per_thread = 1 << 13;
+
+/** The events of one thread. Only that thread writes to it. */
+struct Ring {
+    uint32_t thread_id;
+    std::string thread_name;
+    /** The number of events ever recorded; the next one goes in slot
+     * head % events_per_thread */
+    std::atomic<uint64_t> head{0};
+    /** The number of events flush() has already visited; guarded by the
+     * registry's mutex */
+    uint64_t flushed = 0;
+    std::unique_ptr<Event[]> events{new Event[events_per_thread]};
+};
+
+/** The TSC where it is invariant, and the monotonic clock where it isn't;
+ * Calibration converts either to the clocks */
+inline uint64_t read_tsc() {
+    return fast_clock::tsc_invariant() ? fast_clock::read_tsc() : fast_clock::clock_ns(CLOCK_MONOTONIC);
+}
+
+inline uint64_t clock_ns(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/** A time stamp counter reading and the clocks at the same moment */
+struct ClockSample {
+    uint64_t tsc;
+    uint64_t monotonic_ns;
+    uint64_t realtime_ns;
+};
+
+inline ClockSample sample_clocks() {
+    return ClockSample{read_tsc(), clock_ns(CLOCK_MONOTONIC), clock_ns(CLOCK_REALTIME)};
+}
+
+struct Registry {
+    std::mutex mutex;
+    /** Kept after their threads exit, so that their events can be exported */
+    std::vector<std::shared_ptr<Ring>> rings;
+    /** Taken when the first ring is registered, to calibrate the time stamp
+     * counter against the clocks */
+    ClockSample start = sample_clocks();
+};
+
+inline Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+inline std::shared_ptr<Ring> register_this_thread() {
+    auto ring = std::make_shared<Ring>();
+    ring->thread_id = syscall(SYS_gettid);
+    char name[16] = {0};
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    ring->thread_name = name;
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.rings.push_back(ring);
+    return ring;
+}
+
+inline Ring& this_thread_ring() {
+    thread_local std::shared_ptr<Ring> ring = register_this_thread();
+    return *ring;
+}
+
+/** Records an event in the calling thread's ring. */
+inline void record(const char* file, int line, uint32_t group_number, uint64_t message_number,
+                   uint64_t block_number, const char* name) {
+    Ring& ring = this_thread_ring();
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    ring.events[head & (events_per_thread - 1)] = Event{read_tsc(), file, name, line, group_number,
+                                                        message_number, block_number};
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+/**
+ * Converts time stamp counter readings to the clocks, by interpolating
+ * between the registry's start sample and a sample taken when it is made.
+ */
+struct Calibration {
+    ClockSample start;
+    double ns_per_tick;
+
+    Calibration() : start(registry().start) {
+        const ClockSample now = sample_clocks();
+        ns_per_tick = now.tsc > start.tsc
+                              ? double(now.monotonic_ns - start.monotonic_ns) / double(now.tsc - start.tsc)
+                              : 1.0;
+    }
+    uint64_t monotonic_ns(uint64_t tsc) const {
+        return start.monotonic_ns + int64_t((int64_t(tsc - start.tsc)) * ns_per_tick);
+    }
+    uint64_t realtime_ns(uint64_t tsc) const {
+        return start.realtime_ns + int64_t((int64_t(tsc - start.tsc)) * ns_per_tick);
+    }
+};
+
+/**
+ * Copies the events of a ring from the from-th one recorded on, skipping any
+ * that were overwritten before or while they were copied.
+ * @return The number of events recorded in the ring when the copy ended
+ */
+inline uint64_t copy_events(const Ring& ring, uint64_t from, std::vector<Event>& events) {
+    const uint64_t head = ring.head.load(std::memory_order_acquire);
+    const uint64_t first = std::max(from, head > events_per_thread ? head - events_per_thread : 0);
+    const std::size_t old_size = events.size();
+    for(uint64_t i = first; i < head; ++i) {
+        events.push_back(ring.events[i & (events_per_thread - 1)]);
+    }
+    // The writer may have been writing over the slot of event i since head
+    // reached i + events_per_thread, so such events may be torn
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t new_head = ring.head.load(std::memory_order_relaxed);
+    if(new_head >= first + events_per_thread) {
+        const std::size_t overwritten = std::min<uint64_t>(new_head - events_per_thread - first + 1, head - first);
+        events.erase(events.begin() + old_size, events.begin() + old_size + overwritten);
+    }
+    return head;
+}
+
+/**
+ * Visits each event recorded since the last flush, thread by thread, with the
+ * ring it came from. The events stay in the rings for the exporters.
+ */
+inline void flush(const std::function<void(const Ring&, const Event&)>& visitor) {
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    std::vector<Event> events;
+    for(auto& ring : r.rings) {
+        events.clear();
+        ring->flushed = copy_events(*ring, ring->flushed, events);
+        for(const Event& event : events) {
+            visitor(*ring, event);
+        }
+    }
+}
+
+inline const char* base_name(const char* path) {
+    const char* base = strrchr(path, '/');
+    return base ? base + 1 : path;
+}
+
+inline void write_json_string(std::ostream& out, const std::string& str) {
+    out << '"';
+    for(char c : str) {
+        if(c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if((unsigned char)c < 0x20) {
+            out << ' ';
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+/**
+ * Writes every event still in the rings as a Chrome trace (JSON object
+ * format), with one instant event per trace event, the node ID as the process
+ * ID, and realtime timestamps. The traceEvents arrays of several nodes'
+ * traces can be concatenated into one to merge them.
+ */
+inline void write_chrome_trace(std::ostream& out, uint32_t node_id) {
+    const Calibration calibration;
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    std::vector<Event> events;
+    for(auto& ring : r.rings) {
+        out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << node_id
+            << ",\"tid\":" << ring->thread_id << ",\"args\":{\"name\":";
+        write_json_string(out, ring->thread_name);
+        out << "}}";
+        first = false;
+        events.clear();
+        copy_events(*ring, 0, events);
+        for(const Event& event : events) {
+            const uint64_t ns = calibration.realtime_ns(event.tsc);
+            out << ",\n{\"name\":";
+            write_json_string(out, event.name);
+            out << ",\"ph\":\"i\",\"s\":\"t\",\"pid\":" << node_id << ",\"tid\":" << ring->thread_id
+                << ",\"ts\":" << ns / 1000 << '.' << std::to_string(1000 + ns % 1000).substr(1)
+                << ",\"args\":{\"location\":";
+            write_json_string(out, std::string(base_name(event.file)) + ":" + std::to_string(event.line));
+            out << ",\"group\":" << int64_t(int32_t(event.group_number))
+                << ",\"message\":" << int64_t(event.message_number)
+                << ",\"block\":" << int64_t(event.block_number) << "}}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+/** The first bytes of a binary trace dump */
+constexpr char binary_dump_magic[8] = {'D', 'R', 'C', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t binary_dump_version = 1;
+
+/**
+ * Writes every event still in the rings in a compact binary form: the magic
+ * bytes, then the version, the node ID, and the number of events as uint32,
+ * uint32, and uint64, then each event as its realtime timestamp in ns
+ * (uint64), thread ID (uint32), line (int32), group number (uint32), message
+ * number and block number (uint64 each), and its name and file as a uint16
+ * length followed by the characters, all in the host's byte order.
+ */
+inline void write_binary_dump(std::ostream& out, uint32_t node_id) {
+    const Calibration calibration;
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    std::vector<std::pair<uint32_t, Event>> events;
+    std::vector<Event> ring_events;
+    for(auto& ring : r.rings) {
+        ring_events.clear();
+        copy_events(*ring, 0, ring_events);
+        for(const Event& event : ring_events) {
+            events.emplace_back(ring->thread_id, event);
+        }
+    }
+    auto write = [&out](const auto& value) { out.write(reinterpret_cast<const char*>(&value), sizeof(value)); };
+    auto write_string = [&out, &write](const char* str) {
+        const uint16_t length = std::min<std::size_t>(strlen(str), UINT16_MAX);
+        write(length);
+        out.write(str, length);
+    };
+    out.write(binary_dump_magic, sizeof(binary_dump_magic));
+    write(binary_dump_version);
+    write(node_id);
+    write(uint64_t(events.size()));
+    for(const auto& entry : events) {
+        const Event& event = entry.second;
+        write(calibration.realtime_ns(event.tsc));
+        write(entry.first);
+        write(event.line);
+        write(event.group_number);
+        write(event.message_number);
+        write(event.block_number);
+        write_string(event.name);
+        write_string(base_name(event.file));
+    }
+}
+
+}  // namespace trace
+}  // namespace derecho
+
+/**
+ * A trace point: records an event with up to three numbers describing it, or
+ * compiles to nothing unless DERECHO_TRACE is defined. Numbers that don't
+ * apply are passed as -1.
+ */
+#ifdef DERECHO_TRACE
+#define DERECHO_TRACE_POINT(group_number, message_number, block_number, event_name)         \
+    do {                                                                                  \
+        ::derecho::trace::record(__FILE__, __LINE__, group_number, message_number, block_number, \
+                                 event_name);                                             \
+    } while(0)
+#else
+#define DERECHO_TRACE_POINT(group_number, message_number, block_number, event_name) \
+    do {                                                                          \
+    } while(0)
+#endif
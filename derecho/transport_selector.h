@@ -0,0 +1,114 @@
+/**
+ * @file transport_selector.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "sst/max_msg_size.h"
+
+namespace derecho {
+
+/**
+ * Decides, for each message a node sends in a subgroup, whether it should go
+ * by SST multicast or by RDMC. Messages larger than an SST slot always use
+ * RDMC. Below that, a fixed threshold can be used, or the choice can adapt:
+ * message sizes are grouped into power-of-2 buckets, and for each bucket the
+ * selector keeps a moving average of how long this node's own messages took
+ * to be delivered over each transport. Until both transports have enough
+ * samples in a bucket, sends in it alternate between them, which is the
+ * calibration probe; after that the faster one is used, with an occasional
+ * message over the other to notice if the crossover point moves.
+ * choose() is called by senders and record_delivery() by the delivery thread,
+ * so all the statistics are atomics and no lock is needed.
+ */
+class TransportSelector {
+public:
+    /** Buckets cover sizes up to 64 bytes, up to 128 bytes, ... up to 2^(6 + num_buckets - 1) */
+    static constexpr uint32_t num_buckets = 9;
+    /** The number of deliveries over each transport needed before the averages are trusted */
+    static constexpr uint64_t min_samples = 16;
+    /** Once calibrated, one in this many sends in a bucket uses the slower transport */
+    static constexpr uint64_t explore_interval = 128;
+
+private:
+    struct Bucket {
+        /** Moving averages of delivery latency, in nanoseconds: [0] for RDMC, [1] for SST */
+        std::atomic<uint64_t> latency_ns[2];
+        std::atomic<uint64_t> samples[2];
+        std::atomic<uint64_t> sends;
+        Bucket() : latency_ns{{0}, {0}}, samples{{0}, {0}}, sends{0} {}
+    };
+
+    uint32_t threshold = sst::max_msg_size;
+    bool adaptive = false;
+    Bucket buckets[num_buckets];
+
+    static uint32_t bucket_of(uint32_t msg_size) {
+        uint32_t bucket = 0;
+        uint32_t limit = 64;
+        while(msg_size > limit && bucket < num_buckets - 1) {
+            limit *= 2;
+            ++bucket;
+        }
+        return bucket;
+    }
+
+public:
+    /**
+     * @param sst_threshold The largest message that should be sent by SST
+     * multicast when not adapting; clamped to the size of an SST slot.
+     * @param adapt True if the choice should be calibrated from measured
+     * delivery latencies instead of using the threshold.
+     */
+    void configure(uint32_t sst_threshold, bool adapt) {
+        threshold = sst_threshold < sst::max_msg_size ? sst_threshold : sst::max_msg_size;
+        adaptive = adapt;
+    }
+
+    /** @return True if a message of this size (including its header) should be sent by SST multicast */
+    bool choose(uint32_t msg_size) {
+        if(msg_size > sst::max_msg_size) {
+            return false;
+        }
+        if(!adaptive) {
+            return msg_size <= threshold;
+        }
+        Bucket& bucket = buckets[bucket_of(msg_size)];
+        const uint64_t send_count = bucket.sends.fetch_add(1, std::memory_order_relaxed);
+        if(bucket.samples[0].load(std::memory_order_relaxed) < min_samples
+           || bucket.samples[1].load(std::memory_order_relaxed) < min_samples) {
+            return send_count % 2 == 0;
+        }
+        const bool sst_faster = bucket.latency_ns[1].load(std::memory_order_relaxed)
+                                <= bucket.latency_ns[0].load(std::memory_order_relaxed);
+        if(send_count % explore_interval == 0) {
+            return !sst_faster;
+        }
+        return sst_faster;
+    }
+
+    /**
+     * Records how long one of this node's messages took from being handed a
+     * send buffer to being delivered.
+     * @param msg_size The size of the message, including its header
+     * @param via_sst True if it was sent by SST multicast, false if by RDMC
+     * @param latency_ns The time it took, in nanoseconds
+     */
+    void record_delivery(uint32_t msg_size, bool via_sst, uint64_t latency_ns) {
+        if(!adaptive || msg_size > sst::max_msg_size) {
+            return;
+        }
+        Bucket& bucket = buckets[bucket_of(msg_size)];
+        const uint64_t samples = bucket.samples[via_sst].fetch_add(1, std::memory_order_relaxed);
+        const uint64_t old_latency = bucket.latency_ns[via_sst].load(std::memory_order_relaxed);
+        // An exponential moving average with weight 1/8 on the newest sample
+        const uint64_t new_latency = samples == 0 ? latency_ns : old_latency - old_latency / 8 + latency_ns / 8;
+        bucket.latency_ns[via_sst].store(new_latency, std::memory_order_relaxed);
+    }
+};
+}  // namespace derecho
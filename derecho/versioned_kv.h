@@ -0,0 +1,603 @@
+/**
+ * @file versioned_kv.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "derecho_exception.h"
+#include "register_rpc_functions.h"
+#include "shard_router.h"
+#include <mutils-serialization/SerializationSupport.hpp>
+#include <persistent/Persistent.hpp>
+
+namespace derecho {
+
+/** The answer to a lookup in a VersionedKV */
+template <typename V>
+struct KVLookup : public mutils::ByteRepresentable {
+    /** False if the key had no value at the time asked about */
+    bool found;
+    /** The version in which the key last changed, or INVALID_VERSION */
+    int64_t version;
+    V value;
+
+    KVLookup() : found(false), version(INVALID_VERSION), value() {}
+    KVLookup(bool found, int64_t version, const V& value)
+            : found(found), version(version), value(value) {}
+
+    DEFAULT_SERIALIZATION_SUPPORT(KVLookup, found, version, value);
+};
+
+/**
+ * The state of a VersionedKV: an open-addressing hash table, with linear
+ * probing and Fibonacci hashing, whose slots each keep the version in which
+ * their key last changed and the version in which it changed before that.
+ * Those links thread a chain through the Persistent<T> log for every key, so
+ * a key's value at an earlier version is found by visiting the log entries
+ * in which the key changed, newest first, without rebuilding the table as it
+ * was. A removed key keeps its slot, as a tombstone, to keep its chain.
+ *
+ * With IDeltaSupport, a new version logs only the keys that changed in it.
+ * Deltas and full checkpoints are both lists of records, each of them a key
+ * and value serialized with their sizes in front, so that a key's record can
+ * be found by comparing bytes, without deserializing the other keys. K and V
+ * must be default-constructible, and K must serialize the same way whenever
+ * it is equal, as the types mutils serializes do.
+ */
+template <typename K, typename V>
+class KVTable : public mutils::ByteRepresentable,
+                public ns_persistent::IDeltaSupport<KVTable<K, V>>,
+                public ns_persistent::IKeyIndexSupport<KVTable<K, V>> {
+public:
+    /** The version of a slot that changed since the last version was made */
+    static constexpr int64_t PENDING_VERSION = -2;
+
+    struct Slot {
+        /** Set once the slot holds a key; a removed key keeps it */
+        bool used = false;
+        bool present = false;
+        int64_t version = INVALID_VERSION;
+        /** The version in which the key changed before version */
+        int64_t previous = INVALID_VERSION;
+        K key;
+        V value;
+    };
+
+    /** A record of a checkpoint or a delta, pointing into the log entry */
+    struct RecordView {
+        const char* key;
+        uint64_t key_size;
+        bool present;
+        int64_t version;
+        int64_t previous;
+        const char* value;
+        uint64_t value_size;
+    };
+
+private:
+    std::vector<Slot> slots;
+    /** log2 of slots.size() */
+    uint32_t bits;
+    std::size_t num_used = 0;
+    /** The slots that changed since the last version */
+    std::vector<std::size_t> changed;
+    /** The version setDeltaVersion() stamped the changed slots with */
+    int64_t delta_version = INVALID_VERSION;
+
+    static constexpr uint32_t MIN_BITS = 4;
+
+    std::size_t home_of(const K& key) const {
+        // Fibonacci hashing takes the top bits, which differ from the ones
+        // ShardRouter's ring uses, so the keys of one shard still spread
+        return (std::size_t)(((uint64_t)std::hash<K>{}(key) * 0x9e3779b97f4a7c15ULL) >> (64 - bits));
+    }
+
+    /** @return The slot holding the key, or the empty slot it would go in */
+    std::size_t probe(const K& key) const {
+        const std::size_t mask = slots.size() - 1;
+        std::size_t index = home_of(key);
+        while(slots[index].used && !(slots[index].key == key)) {
+            index = (index + 1) & mask;
+        }
+        return index;
+    }
+
+    void rehash(uint32_t new_bits) {
+        std::vector<Slot> old_slots(std::size_t{1} << new_bits);
+        std::swap(old_slots, slots);
+        bits = new_bits;
+        changed.clear();
+        for(Slot& slot : old_slots) {
+            if(!slot.used) {
+                continue;
+            }
+            const std::size_t index = probe(slot.key);
+            if(slot.version == PENDING_VERSION) {
+                changed.push_back(index);
+            }
+            slots[index] = std::move(slot);
+        }
+    }
+
+    /** @return The slot for the key, taking a new one if it has none */
+    std::size_t slot_for(const K& key) {
+        std::size_t index = probe(key);
+        if(slots[index].used) {
+            return index;
+        }
+        // Keep the load at most 3/4, so that probes stay short
+        if((num_used + 1) * 4 > slots.size() * 3) {
+            rehash(bits + 1);
+            index = probe(key);
+        }
+        slots[index].used = true;
+        slots[index].key = key;
+        ++num_used;
+        return index;
+    }
+
+    /** Marks a slot as changed in the next version. */
+    void touch(std::size_t index) {
+        Slot& slot = slots[index];
+        if(slot.version != PENDING_VERSION) {
+            slot.previous = slot.version;
+            slot.version = PENDING_VERSION;
+            changed.push_back(index);
+        }
+    }
+
+    template <typename I>
+    static I load(const char*& buf) {
+        I value;
+        std::memcpy(&value, buf, sizeof(I));
+        buf += sizeof(I);
+        return value;
+    }
+
+    /** Posts a slot's record; version is the one the record is stamped with */
+    static void post_record(const std::function<void(char const* const, std::size_t)>& post,
+                            const Slot& slot, int64_t version) {
+        const uint64_t key_size = mutils::bytes_size(slot.key);
+        post((const char*)&key_size, sizeof(key_size));
+        mutils::post_object(post, slot.key);
+        const char present = slot.present;
+        post(&present, sizeof(present));
+        post((const char*)&version, sizeof(version));
+        post((const char*)&slot.previous, sizeof(slot.previous));
+        const uint64_t value_size = slot.present ? mutils::bytes_size(slot.value) : 0;
+        post((const char*)&value_size, sizeof(value_size));
+        if(slot.present) {
+            mutils::post_object(post, slot.value);
+        }
+    }
+
+    static std::size_t record_size(const Slot& slot) {
+        return 4 * sizeof(uint64_t) + 1 + mutils::bytes_size(slot.key)
+               + (slot.present ? mutils::bytes_size(slot.value) : 0);
+    }
+
+    /** Writes what post_record() posts into a buffer. */
+    static std::function<void(char const* const, std::size_t)> writer(char* buf, std::size_t& offset) {
+        return [buf, &offset](char const* const bytes, std::size_t size) {
+            std::memcpy(buf + offset, bytes, size);
+            offset += size;
+        };
+    }
+
+    /** Sets a slot from a record, without marking it changed. */
+    void apply_record(const RecordView& record) {
+        auto key = mutils::from_bytes<K>(nullptr, record.key);
+        Slot& slot = slots[slot_for(*key)];
+        slot.present = record.present;
+        slot.version = record.version;
+        slot.previous = record.previous;
+        if(record.present) {
+            slot.value = std::move(*mutils::from_bytes<V>(nullptr, record.value));
+        } else {
+            slot.value = V();
+        }
+        if(record.version == PENDING_VERSION) {
+            changed.push_back(&slot - slots.data());
+        }
+    }
+
+public:
+    KVTable() : slots(std::size_t{1} << MIN_BITS), bits(MIN_BITS) {}
+    virtual ~KVTable() {}
+
+    /** @return The key's slot, or nullptr if it never had a value */
+    const Slot* find(const K& key) const {
+        const Slot& slot = slots[probe(key)];
+        return slot.used ? &slot : nullptr;
+    }
+
+    KVLookup<V> lookup(const K& key) const {
+        const Slot* slot = find(key);
+        if(slot == nullptr || !slot->present) {
+            return KVLookup<V>(false, slot ? slot->version : INVALID_VERSION, V());
+        }
+        return KVLookup<V>(true, slot->version, slot->value);
+    }
+
+    void put(const K& key, const V& value) {
+        const std::size_t index = slot_for(key);
+        touch(index);
+        slots[index].present = true;
+        slots[index].value = value;
+    }
+
+    /** @return False if the key had no value */
+    bool remove(const K& key) {
+        const std::size_t index = probe(key);
+        if(!slots[index].used || !slots[index].present) {
+            return false;
+        }
+        touch(index);
+        slots[index].present = false;
+        slots[index].value = V();
+        return true;
+    }
+
+    /** @return The number of keys that have values */
+    std::size_t size() const {
+        std::size_t count = 0;
+        for(const Slot& slot : slots) {
+            count += slot.present;
+        }
+        return count;
+    }
+
+    /**
+     * Reads the next record of a checkpoint or delta.
+     * @return Where the record after it starts
+     */
+    static const char* read_record(const char* buf, RecordView& record) {
+        record.key_size = load<uint64_t>(buf);
+        record.key = buf;
+        buf += record.key_size;
+        record.present = load<char>(buf);
+        record.version = load<int64_t>(buf);
+        record.previous = load<int64_t>(buf);
+        record.value_size = load<uint64_t>(buf);
+        record.value = buf;
+        return buf + record.value_size;
+    }
+
+    /**
+     * Finds a key's record in a log entry, as Persistent::visitDeltaEntry()
+     * passes it.
+     * @param key The key as mutils serializes it
+     * @return False if the entry has no record of the key
+     */
+    static bool find_record(bool full, const char* pdat, const std::vector<char>& key, RecordView& record) {
+        if(!full) {
+            load<int64_t>(pdat);
+        }
+        const uint64_t count = load<uint64_t>(pdat);
+        for(uint64_t i = 0; i < count; ++i) {
+            pdat = read_record(pdat, record);
+            if(record.key_size == key.size() && std::memcmp(record.key, key.data(), key.size()) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // IKeyIndexSupport: the keys are hashed with std::hash
+    virtual void currentKeyHashes(std::vector<uint64_t>& hashes) {
+        for(std::size_t index : changed) {
+            hashes.push_back(std::hash<K>{}(slots[index].key));
+        }
+    }
+
+    // IDeltaSupport: a delta is the version, the number of records, and a
+    // record for each changed key
+    virtual void setDeltaVersion(const int64_t& ver) {
+        delta_version = ver;
+        for(std::size_t index : changed) {
+            slots[index].version = ver;
+        }
+    }
+
+    virtual std::size_t currentDeltaSize() {
+        std::size_t size = sizeof(int64_t) + sizeof(uint64_t);
+        for(std::size_t index : changed) {
+            size += record_size(slots[index]);
+        }
+        return size;
+    }
+
+    virtual std::size_t currentDeltaToBytes(char* const buf, std::size_t buf_size) {
+        std::size_t offset = 0;
+        auto post = writer(buf, offset);
+        const uint64_t count = changed.size();
+        post((const char*)&delta_version, sizeof(delta_version));
+        post((const char*)&count, sizeof(count));
+        for(std::size_t index : changed) {
+            post_record(post, slots[index], slots[index].version);
+        }
+        changed.clear();
+        return offset;
+    }
+
+    virtual void applyDelta(char const* const delta) {
+        const char* buf = delta;
+        load<int64_t>(buf);
+        const uint64_t count = load<uint64_t>(buf);
+        RecordView record;
+        for(uint64_t i = 0; i < count; ++i) {
+            buf = read_record(buf, record);
+            apply_record(record);
+        }
+    }
+
+    // A checkpoint is the number of records and a record for each used slot
+    void post_object(const std::function<void(char const* const, std::size_t)>& post) const {
+        const uint64_t count = num_used;
+        post((const char*)&count, sizeof(count));
+        for(const Slot& slot : slots) {
+            if(slot.used) {
+                post_record(post, slot, slot.version);
+            }
+        }
+    }
+
+    std::size_t bytes_size() const {
+        std::size_t size = sizeof(uint64_t);
+        for(const Slot& slot : slots) {
+            if(slot.used) {
+                size += record_size(slot);
+            }
+        }
+        return size;
+    }
+
+    std::size_t to_bytes(char* v) const {
+        std::size_t offset = 0;
+        post_object(writer(v, offset));
+        return offset;
+    }
+
+    void ensure_registered(mutils::DeserializationManager&) {}
+
+    static std::unique_ptr<KVTable> from_bytes(mutils::DeserializationManager*, char const* const v) {
+        auto table = std::make_unique<KVTable>();
+        const char* buf = v;
+        const uint64_t count = load<uint64_t>(buf);
+        uint32_t new_bits = MIN_BITS;
+        while(count * 4 > (std::size_t{1} << new_bits) * 3) {
+            ++new_bits;
+        }
+        table->rehash(new_bits);
+        RecordView record;
+        for(uint64_t i = 0; i < count; ++i) {
+            buf = read_record(buf, record);
+            table->apply_record(record);
+        }
+        return table;
+    }
+
+    static mutils::context_ptr<KVTable> from_bytes_noalloc(mutils::DeserializationManager* dm, char const* const v) {
+        return mutils::context_ptr<KVTable>{from_bytes(dm, v).release()};
+    }
+};
+
+/**
+ * A replicated, persistent key-value store with reads at past times. Each
+ * shard of its subgroup holds the keys that a ShardRouter places on it; the
+ * routed_* functions below send requests about keys to their shards. Writes
+ * are ordered_sends within a shard, and each delivered batch of them becomes
+ * one version of the shard's Persistent<KVTable>, which logs only the keys
+ * that changed. get_at() finds a key's value as of an HLC time in the one
+ * log entry that the key index of the Persistent<KVTable> points it to, or,
+ * where the index doesn't cover the time, by following the key's chain of
+ * versions back through the log, so its cost grows with the number of times
+ * the key changed since then, not with the size of the table. Queries at times the shard has not persisted everywhere yet fail,
+ * as Persistent<T>::get(hlc) does, and so do queries before the start of
+ * the log that the retention policy kept.
+ */
+template <typename K, typename V>
+class VersionedKV : public mutils::ByteRepresentable {
+    Persistent<KVTable<K, V>> table;
+
+    /**
+     * Reads the key's record in the log entry of a version in which it
+     * changed, into result if the version is at most at.
+     * @param key The key as mutils serializes it
+     * @return False if the key did not change in that version
+     * @throws derecho_exception if the log no longer has the version
+     */
+    bool read_change(const std::vector<char>& key, int64_t ver, int64_t at,
+                     KVLookup<V>& result, int64_t& previous) {
+        bool found = false;
+        if(!table.visitDeltaEntry(ver, [&](bool full, const char* pdat) {
+               typename KVTable<K, V>::RecordView record;
+               found = KVTable<K, V>::find_record(full, pdat, key, record) && record.version == ver;
+               if(!found) {
+                   return;
+               }
+               previous = record.previous;
+               if(ver <= at && record.present) {
+                   result = KVLookup<V>(true, ver, *mutils::from_bytes<V>(nullptr, record.value));
+               } else {
+                   result = KVLookup<V>(false, ver, V());
+               }
+           })) {
+            throw derecho_exception("The log no longer has version " + std::to_string(ver) + " of the key");
+        }
+        return found;
+    }
+
+public:
+    virtual ~VersionedKV() noexcept(true) {}
+
+    void put(const K& key, const V& value) {
+        (*table).put(key, value);
+    }
+
+    /** @return False if the key had no value */
+    bool remove(const K& key) {
+        return (*table).remove(key);
+    }
+
+    /** Puts several keys as one version, at the cost of one message. */
+    void put_batch(const std::vector<std::pair<K, V>>& entries) {
+        for(const auto& entry : entries) {
+            (*table).put(entry.first, entry.second);
+        }
+    }
+
+    KVLookup<V> get(const K& key) {
+        return (*table).lookup(key);
+    }
+
+    /** @return The lookups of the keys, in the same order */
+    std::vector<KVLookup<V>> get_batch(const std::vector<K>& keys) {
+        std::vector<KVLookup<V>> results;
+        results.reserve(keys.size());
+        for(const K& key : keys) {
+            results.push_back((*table).lookup(key));
+        }
+        return results;
+    }
+
+    /**
+     * @return The key's value in the latest version made at or before the
+     * HLC time
+     * @throws derecho_exception if the log no longer reaches back to the
+     * version needed
+     */
+    KVLookup<V> get_at(const K& key, const HLC& hlc) {
+        const int64_t at = table.getVersionAt(hlc);
+        const auto* slot = (*table).find(key);
+        if(at == INVALID_VERSION || slot == nullptr) {
+            return KVLookup<V>();
+        }
+        if(slot->version != KVTable<K, V>::PENDING_VERSION && slot->version <= at) {
+            return (*table).lookup(key);
+        }
+        std::vector<char> key_bytes(mutils::bytes_size(key));
+        mutils::to_bytes(key, key_bytes.data());
+        KVLookup<V> result;
+        int64_t previous;
+        // The key index points at the version of the last change up to at,
+        // unless it doesn't cover that far back, or a key with the same hash
+        // changed since
+        try {
+            const int64_t indexed = table.getKeyVersion(std::hash<K>{}(key), at);
+            if(indexed == INVALID_VERSION) {
+                return KVLookup<V>();
+            }
+            if(read_change(key_bytes, indexed, at, result, previous)) {
+                return result;
+            }
+        } catch(const uint64_t& exp) {
+            if(exp != PERSIST_EXP_KEY_INDEX_GAP) {
+                throw;
+            }
+        }
+        int64_t ver = slot->previous;
+        while(ver != INVALID_VERSION) {
+            if(!read_change(key_bytes, ver, at, result, previous)) {
+                throw derecho_exception("Version " + std::to_string(ver) + " has no record of the key");
+            }
+            if(ver <= at) {
+                return result;
+            }
+            ver = previous;
+        }
+        return KVLookup<V>();
+    }
+
+    /** get_at() for an RPC, with the time as HLC{rtc_us, 0} */
+    KVLookup<V> get_at_time(const K& key, uint64_t rtc_us) {
+        return get_at(key, HLC{rtc_us, 0});
+    }
+
+    REGISTER_RPC_FUNCTIONS(VersionedKV, put, remove, put_batch, get, get_batch, get_at_time);
+
+    // constructor for PersistentRegistry
+    VersionedKV(PersistentRegistry* pr) : table(nullptr, pr) {}
+    VersionedKV(Persistent<KVTable<K, V>>& init_table) : table(std::move(init_table)) {}
+    DEFAULT_SERIALIZATION_SUPPORT(VersionedKV, table);
+};
+
+/**
+ * Looks up a key on the member of its shard that the router picks.
+ */
+template <typename K, typename V>
+KVLookup<V> routed_get(ShardRouter<VersionedKV<K, V>>& router, const K& key) {
+    auto results = router.template p2p_query<RPC_NAME(get)>(key, key);
+    for(auto& reply : results.get()) {
+        return reply.second.get();
+    }
+    throw derecho_exception("The query of the key's shard had no reply");
+}
+
+/**
+ * @return The key's value at an HLC time, from a member of its shard
+ */
+template <typename K, typename V>
+KVLookup<V> routed_get_at(ShardRouter<VersionedKV<K, V>>& router, const K& key, uint64_t rtc_us) {
+    auto results = router.template p2p_query<RPC_NAME(get_at_time)>(key, key, rtc_us);
+    for(auto& reply : results.get()) {
+        return reply.second.get();
+    }
+    throw derecho_exception("The query of the key's shard had no reply");
+}
+
+/**
+ * Looks up keys with one get_batch to each shard that owns some of them, all
+ * of them sent before any reply is awaited. If the router's layout changes
+ * while they are sent, some keys may have gone to a shard that no longer
+ * owns them, so they are all sent again.
+ * @return The lookups of the keys, in the same order
+ */
+template <typename K, typename V>
+std::vector<KVLookup<V>> routed_get_batch(ShardRouter<VersionedKV<K, V>>& router, const std::vector<K>& keys) {
+    using results_t = decltype(router.template p2p_query<RPC_NAME(get_batch)>(keys.front(), keys));
+    std::vector<KVLookup<V>> lookups(keys.size());
+    if(keys.empty()) {
+        return lookups;
+    }
+    std::map<uint32_t, std::pair<std::vector<K>, std::vector<std::size_t>>> by_shard;
+    std::vector<results_t> results;
+    int32_t vid;
+    do {
+        vid = router.get_vid();
+        by_shard.clear();
+        results.clear();
+        for(std::size_t i = 0; i < keys.size(); ++i) {
+            auto& shard_keys = by_shard[router.shard_of(keys[i])];
+            shard_keys.first.push_back(keys[i]);
+            shard_keys.second.push_back(i);
+        }
+        for(auto& shard_keys : by_shard) {
+            // Any of the shard's keys routes the batch to it
+            results.push_back(router.template p2p_query<RPC_NAME(get_batch)>(
+                    shard_keys.second.first.front(), shard_keys.second.first));
+        }
+    } while(router.get_vid() != vid);
+    auto shard_results = results.begin();
+    for(auto& shard_keys : by_shard) {
+        for(auto& reply : shard_results->get()) {
+            std::vector<KVLookup<V>> shard_lookups = reply.second.get();
+            for(std::size_t j = 0; j < shard_lookups.size(); ++j) {
+                lookups[shard_keys.second.second[j]] = std::move(shard_lookups[j]);
+            }
+        }
+        ++shard_results;
+    }
+    return lookups;
+}
+}  // namespace derecho
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <iterator>
 #include <memory>
@@ -67,23 +68,46 @@ uint32_t SubView::num_senders() const {
     return num;
 }
 
+void SubView::init_changes_from(const SubView& previous) {
+    joined.clear();
+    departed.clear();
+    if(members == previous.members) {
+        return;
+    }
+    std::vector<node_id_t> prev_members(previous.members);
+    std::vector<node_id_t> curr_members(members);
+    std::sort(prev_members.begin(), prev_members.end());
+    std::sort(curr_members.begin(), curr_members.end());
+    std::set_difference(curr_members.begin(), curr_members.end(),
+                        prev_members.begin(), prev_members.end(),
+                        std::back_inserter(joined));
+    std::set_difference(prev_members.begin(), prev_members.end(),
+                        curr_members.begin(), curr_members.end(),
+                        std::back_inserter(departed));
+}
+
 View::View(const int32_t vid, const std::vector<node_id_t>& members, const std::vector<ip_addr>& member_ips,
            const std::vector<char>& failed, const int32_t num_failed, const std::vector<node_id_t>& joined,
            const std::vector<node_id_t>& departed, const int32_t num_members,
-           const int32_t next_unassigned_rank)
+           const int32_t next_unassigned_rank,
+           const std::vector<subgroup_shard_layout_t>& previous_shard_layouts,
+           const std::vector<NodeCapacity>& member_capacities)
         : vid(vid),
           members(members),
           member_ips(member_ips),
+          member_capacities(member_capacities),
           failed(failed),
           num_failed(num_failed),
           joined(joined),
           departed(departed),
           num_members(num_members),
           my_rank(0),  //This will always get overwritten by the receiver after deserializing
-          next_unassigned_rank(next_unassigned_rank) {
+          next_unassigned_rank(next_unassigned_rank),
+          previous_shard_layouts(previous_shard_layouts) {
     for(int rank = 0; rank < num_members; ++rank) {
         node_id_to_rank[members[rank]] = rank;
     }
+    this->member_capacities.resize(num_members, unit_capacity());
 }
 
 int View::rank_of_leader() const {
@@ -97,10 +121,12 @@ int View::rank_of_leader() const {
 
 View::View(const int32_t vid, const std::vector<node_id_t>& members, const std::vector<ip_addr>& member_ips,
            const std::vector<char>& failed, const std::vector<node_id_t>& joined,
-           const std::vector<node_id_t>& departed, const int32_t my_rank, const int32_t next_unassigned_rank)
+           const std::vector<node_id_t>& departed, const int32_t my_rank, const int32_t next_unassigned_rank,
+           const std::vector<NodeCapacity>& member_capacities)
         : vid(vid),
           members(members),
           member_ips(member_ips),
+          member_capacities(member_capacities),
           failed(failed),
           joined(joined),
           departed(departed),
@@ -110,6 +136,7 @@ View::View(const int32_t vid, const std::vector<node_id_t>& members, const std::
     for(int rank = 0; rank < num_members; ++rank) {
         node_id_to_rank[members[rank]] = rank;
     }
+    this->member_capacities.resize(num_members, unit_capacity());
     for(auto c : failed) {
         if(c) {
             num_failed++;
@@ -149,6 +176,14 @@ SubView View::make_subview(const std::vector<node_id_t>& with_members, const Mod
     return SubView(mode, with_members, is_sender, subview_member_ips);
 }
 
+const subgroup_shard_layout_t* View::previous_layout_of_allocating_type() const {
+    if(allocating_type_position < 0 || allocating_type_position >= (int)previous_shard_layouts.size()
+       || previous_shard_layouts[allocating_type_position].empty()) {
+        return nullptr;
+    }
+    return &previous_shard_layouts[allocating_type_position];
+}
+
 int View::subview_rank_of_shard_leader(subgroup_id_t subgroup_id, int shard_index) const {
     const SubView& shard_view = subgroup_shard_views.at(subgroup_id).at(shard_index);
     for(std::size_t rank = 0; rank < shard_view.members.size(); ++rank) {
@@ -225,6 +260,27 @@ void View::wedge() {
     gmsSST->put(gmsSST->wedged.get_base() - gmsSST->getBaseAddress(), sizeof(gmsSST->wedged[0]));
 }
 
+void View::wedge_subgroups(const std::set<subgroup_id_t>& subgroups) {
+    multicast_group->wedge_subgroups(subgroups);
+    for(subgroup_id_t subgroup_id : subgroups) {
+        gmssst::set(gmsSST->subgroup_wedged[my_rank][subgroup_id], true);
+    }
+    gmsSST->put(gmsSST->subgroup_wedged.get_base() - gmsSST->getBaseAddress(),
+                sizeof(gmsSST->subgroup_wedged[0][0]) * gmsSST->subgroup_wedged.size());
+}
+
+std::set<subgroup_id_t> View::subgroups_containing(const node_id_t who) const {
+    std::set<subgroup_id_t> subgroups;
+    for(subgroup_id_t subgroup_id = 0; subgroup_id < subgroup_shard_views.size(); ++subgroup_id) {
+        for(const SubView& shard_view : subgroup_shard_views[subgroup_id]) {
+            if(shard_view.rank_of(who) != -1) {
+                subgroups.insert(subgroup_id);
+            }
+        }
+    }
+    return subgroups;
+}
+
 std::string View::debug_string() const {
     // need to add member ips and other fields
     std::stringstream s;
@@ -253,33 +309,10 @@ std::string View::debug_string() const {
 }
 
 std::unique_ptr<View> load_view(const std::string& view_file_name) {
-    std::ifstream view_file(view_file_name);
-    std::ifstream view_file_swap(view_file_name + persistence::SWAP_FILE_EXTENSION);
-    std::unique_ptr<View> view;
-    std::unique_ptr<View> swap_view;
-    //The expected view file might not exist, in which case we'll fall back to the swap file
-    if(view_file.good()) {
-        //Each file contains the size of the view (an int copied as bytes),
-        //followed by a serialized view
-        std::size_t size_of_view;
-        view_file.read((char*)&size_of_view, sizeof(size_of_view));
-        char buffer[size_of_view];
-        view_file.read(buffer, size_of_view);
-        //If the view file doesn't contain a complete view (due to a crash
-        //during writing), the read() call will set failbit
-        if(!view_file.fail()) {
-            view = mutils::from_bytes<View>(nullptr, buffer);
-        }
-    }
-    if(view_file_swap.good()) {
-        std::size_t size_of_view;
-        view_file_swap.read((char*)&size_of_view, sizeof(size_of_view));
-        char buffer[size_of_view];
-        view_file_swap.read(buffer, size_of_view);
-        if(!view_file_swap.fail()) {
-            swap_view = mutils::from_bytes<View>(nullptr, buffer);
-        }
-    }
+    //The expected view file might not exist, or might be incomplete or
+    //corrupted after a crash, in which case we'll fall back to the swap file
+    std::unique_ptr<View> view = persistence::load_object_file<View>(view_file_name);
+    std::unique_ptr<View> swap_view = persistence::load_object_file<View>(view_file_name + persistence::SWAP_FILE_EXTENSION);
     if(swap_view == nullptr || (view != nullptr && view->vid >= swap_view->vid)) {
         return view;
     } else {
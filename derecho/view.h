@@ -8,12 +8,14 @@
 #include <cstdint>
 #include <iostream>
 #include <memory>
+#include <set>
 #include <vector>
 
 #include "derecho_internal.h"
 #include "derecho_modes.h"
 #include "derecho_sst.h"
 #include "multicast_group.h"
+#include "node_capacity.h"
 #include "sst/sst.h"
 #include <mutils-serialization/SerializationMacros.hpp>
 #include <mutils-serialization/SerializationSupport.hpp>
@@ -48,6 +50,11 @@ public:
     int sender_rank_of(uint32_t rank) const;
     /** returns the number of senders in the subview */
     uint32_t num_senders() const;
+    /** Sets joined and departed to the members that this shard gained and
+     * lost since it was previous, its SubView in the previous view. A shard
+     * whose members have not changed, which is most of them in a large
+     * group, is recognized without sorting anything. */
+    void init_changes_from(const SubView& previous);
     /** Creates an empty new SubView with num_members members.
      * The vectors will have room for num_members elements. */
     SubView(int32_t num_members);
@@ -74,6 +81,9 @@ public:
     const std::vector<node_id_t> members;
     /** IP addresses of members in the current view, indexed by their SST rank. */
     const std::vector<ip_addr> member_ips;
+    /** The capacities that members advertised when they joined, indexed by
+     * their SST rank. */
+    std::vector<NodeCapacity> member_capacities;
     /** failed[i] is true if members[i] is considered to have failed.
      * Once a member is failed, it will be removed from the members list in a future view. */
     std::vector<char> failed;  //Note: std::vector<bool> is broken, so we pretend these char values are C-style booleans
@@ -106,6 +116,17 @@ public:
     std::map<std::type_index, std::vector<subgroup_id_t>> subgroup_ids_by_type;
     /** Maps subgroup ID -> shard number -> SubView for that subgroup/shard */
     std::vector<std::vector<SubView>> subgroup_shard_views;
+    /** The shard layout of each subgroup type in the last adequately
+     * provisioned View before this one, in the order the subgroup membership
+     * functions are called, or empty if there was none. Membership functions
+     * can use it to keep members in the shards they were in; it is sent to
+     * joiners with the View, so they start from the same layout as everyone
+     * else. */
+    std::vector<subgroup_shard_layout_t> previous_shard_layouts;
+    /** While a subgroup membership function is running, the position of its
+     * subgroup type in the order membership functions are called; set by
+     * ViewManager. */
+    int32_t allocating_type_position = -1;
     /** Reverse index of members[]; maps node ID -> SST rank */
     std::map<node_id_t, uint32_t> node_id_to_rank;
 
@@ -122,6 +143,10 @@ public:
      */
     SubView make_subview(const std::vector<node_id_t>& with_members, const Mode mode = Mode::ORDERED, const std::vector<int>& is_sender = {}) const;
 
+    /** @return The layout that the subgroup type whose membership function is
+     * running had in previous_shard_layouts, or nullptr if it had none. */
+    const subgroup_shard_layout_t* previous_layout_of_allocating_type() const;
+
     /** Looks up the SST rank of an IP address. Returns -1 if that IP is not a member of this view. */
     int rank_of(const ip_addr& who) const;
     /** Looks up the SST rank of a node ID. Returns -1 if that node ID is not a member of this view. */
@@ -136,6 +161,11 @@ public:
     void merge_changes();
     /** Wedges the view, which means wedging both SST and DerechoGroup. */
     void wedge();
+    /** Wedges only some subgroups of the view, and reports them as wedged in
+     * this node's subgroup_wedged in the SST. */
+    void wedge_subgroups(const std::set<subgroup_id_t>& subgroups);
+    /** @return The IDs of the subgroups that have a node in any of their shards. */
+    std::set<subgroup_id_t> subgroups_containing(const node_id_t who) const;
 
     /** Computes the within-shard rank of a particular shard's leader, based on failed[].
      * This is not a member of SubView because it needs access to failed[], but it returns
@@ -146,14 +176,19 @@ public:
      *  Used for debugging only.*/
     std::string debug_string() const;
 
-    DEFAULT_SERIALIZATION_SUPPORT(View, vid, members, member_ips, failed, num_failed, joined, departed, num_members, next_unassigned_rank);
+    DEFAULT_SERIALIZATION_SUPPORT(View, vid, members, member_ips, failed, num_failed, joined, departed, num_members, next_unassigned_rank,
+                                  previous_shard_layouts, member_capacities);
 
-    /** Constructor used by deserialization: constructs a View given the values of its serialized fields. */
+    /** Constructor used by deserialization: constructs a View given the values
+     * of its serialized fields. Members with no capacity get unit_capacity(). */
     View(const int32_t vid, const std::vector<node_id_t>& members, const std::vector<ip_addr>& member_ips,
          const std::vector<char>& failed, const int32_t num_failed, const std::vector<node_id_t>& joined,
-         const std::vector<node_id_t>& departed, const int32_t num_members, const int32_t next_unassigned_rank);
+         const std::vector<node_id_t>& departed, const int32_t num_members, const int32_t next_unassigned_rank,
+         const std::vector<subgroup_shard_layout_t>& previous_shard_layouts = {},
+         const std::vector<NodeCapacity>& member_capacities = {});
 
-    /** Standard constructor for making a new View */
+    /** Standard constructor for making a new View. Members with no capacity
+     * get unit_capacity(). */
     View(const int32_t vid,
          const std::vector<node_id_t>& members,
          const std::vector<ip_addr>& member_ips,
@@ -161,7 +196,8 @@ public:
          const std::vector<node_id_t>& joined = {},
          const std::vector<node_id_t>& departed = {},
          const int32_t my_rank = 0,
-         const int32_t next_unassigned_rank = 0);
+         const int32_t next_unassigned_rank = 0,
+         const std::vector<NodeCapacity>& member_capacities = {});
 };
 
 /**
@@ -4,10 +4,19 @@
  * @date Feb 6, 2017
  */
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
+#include <cstring>
+#include <future>
+#include <iterator>
+#include <numeric>
+#include <sys/stat.h>
 
 #include "derecho_exception.h"
+#include "metrics.h"
 #include "persistence.h"
+#include "thread_placement.h"
 #include "view_manager.h"
 
 using namespace derecho::persistence;
@@ -18,6 +27,8 @@ using lock_guard_t = std::lock_guard<std::mutex>;
 using unique_lock_t = std::unique_lock<std::mutex>;
 using shared_lock_t = std::shared_lock<std::shared_timed_mutex>;
 
+constexpr std::chrono::milliseconds ViewManager::join_batch_window;
+
 ViewManager::ViewManager(const node_id_t my_id,
                          const ip_addr my_ip,
                          CallbackSet callbacks,
@@ -84,7 +95,6 @@ ViewManager::ViewManager(const node_id_t my_id,
     logger->debug("Initializing SST and RDMC for the first time.");
 
     construct_multicast_group(callbacks, derecho_params);
-    curr_view->gmsSST->vid[curr_view->my_rank] = curr_view->vid;
 }
 
 ViewManager::ViewManager(const std::string& recovery_filename,
@@ -119,14 +129,19 @@ ViewManager::ViewManager(const std::string& recovery_filename,
         curr_view = std::make_unique<View>(last_view->vid + 1,
                                            std::vector<node_id_t>{my_id},
                                            std::vector<ip_addr>{my_ip},
-                                           std::vector<char>{0});
-        initialize_rdmc_sst();
+                                           std::vector<char>{0},
+                                           std::vector<node_id_t>{},
+                                           std::vector<node_id_t>{},
+                                           0, 0,
+                                           std::vector<NodeCapacity>{local_node_capacity()});
         if(_derecho_params) {
             derecho_params = _derecho_params.value();
         } else {
             derecho_params = *(load_object<DerechoParams>(
                     std::string(recovery_filename + persistence::PARAMATERS_EXTENSION)));
         }
+        // The devices to initialize come from the parameters
+        initialize_rdmc_sst();
 
         await_second_member(my_id);
     }
@@ -141,7 +156,46 @@ ViewManager::ViewManager(const std::string& recovery_filename,
 
     logger->debug("Initializing SST and RDMC for the first time.");
     construct_multicast_group(callbacks, derecho_params);
-    curr_view->gmsSST->vid[curr_view->my_rank] = curr_view->vid;
+}
+
+ViewManager::ViewManager(const node_id_t my_id,
+                         const std::vector<node_id_t>& members,
+                         const std::vector<ip_addr>& member_ips,
+                         CallbackSet callbacks,
+                         const SubgroupInfo& subgroup_info,
+                         const DerechoParams& derecho_params,
+                         const persistence_manager_callbacks_t & _persistence_manager_callbacks,
+                         std::vector<view_upcall_t> _view_upcalls,
+                         const int gms_port)
+        : logger(spdlog::get("debug_log")),
+          gms_port(gms_port),
+          curr_view(std::make_unique<View>(0, members, member_ips, std::vector<char>(members.size(), 0))),
+          last_suspected(members.size()),
+          server_socket(gms_port),
+          thread_shutdown(false),
+          view_upcalls(_view_upcalls),
+          subgroup_info(subgroup_info),
+          derecho_params(derecho_params),
+          persistence_manager_callbacks(_persistence_manager_callbacks) {
+    if(member_ips.size() != members.size()) {
+        throw derecho_exception("A static membership needs an IP address for each member");
+    }
+    curr_view->my_rank = curr_view->rank_of(my_id);
+    if(curr_view->my_rank < 0) {
+        throw derecho_exception("Node " + std::to_string(my_id) + " is not in the static membership");
+    }
+    // Connects to every other member at once, since they all know view 0
+    initialize_rdmc_sst();
+
+    if(!derecho_params.filename.empty()) {
+        view_file_name = std::string(derecho_params.filename + persistence::PAXOS_STATE_EXTENSION);
+        std::string params_file_name(derecho_params.filename + persistence::PARAMATERS_EXTENSION);
+        persist_object(*curr_view, view_file_name);
+        persist_object(derecho_params, params_file_name);
+    }
+
+    logger->debug("Initializing SST and RDMC for the first time.");
+    construct_multicast_group(callbacks, derecho_params);
 }
 
 ViewManager::~ViewManager() {
@@ -155,6 +209,21 @@ ViewManager::~ViewManager() {
     if(old_view_cleanup_thread.joinable()) {
         old_view_cleanup_thread.join();
     }
+    checkpoint_requests_cv.notify_all();
+    if(checkpoint_thread.joinable()) {
+        checkpoint_thread.join();
+    }
+    // The Views left share nothing that their destructors touch, and each
+    // one's RDMC groups and SST take a while to tear down, so they are
+    // released side by side
+    std::vector<std::unique_ptr<View>> views;
+    while(!old_views.empty()) {
+        views.push_back(std::move(old_views.front()));
+        old_views.pop();
+    }
+    views.push_back(std::move(next_view));
+    views.push_back(std::move(curr_view));
+    release_in_parallel(views);
 }
 
 /* ----------  1. Constructor Components ------------- */
@@ -163,6 +232,9 @@ void ViewManager::receive_configuration(node_id_t my_id, tcp::socket& leader_con
     logger->debug("Successfully connected to leader, about to receive the View.");
     node_id_t leader_id = 0;
     leader_connection.exchange(my_id, leader_id);
+    //Advertise this node's capacity, which the leader puts in the View
+    const NodeCapacity my_capacity = local_node_capacity();
+    leader_connection.write((char*)&my_capacity, sizeof(my_capacity));
 
     //The leader will first send the size of the necessary buffer, then the serialized View
     std::size_t size_of_view;
@@ -185,6 +257,7 @@ void ViewManager::receive_configuration(node_id_t my_id, tcp::socket& leader_con
 void ViewManager::start() {
     curr_view->gmsSST->put();
     curr_view->gmsSST->sync_with_members();
+    warm_up(*curr_view->gmsSST);
     logger->debug("Done setting up initial SST and RDMC");
 
     if(curr_view->vid != 0) {
@@ -196,6 +269,9 @@ void ViewManager::start() {
     }
 
     create_threads();
+    if(derecho_params.metrics_port != 0) {
+        metrics::start_prometheus_endpoint(derecho_params.metrics_port);
+    }
     register_predicates();
     curr_view->gmsSST->start_predicate_evaluation();
     logger->debug("Starting predicate evaluation");
@@ -210,40 +286,89 @@ void ViewManager::await_second_member(const node_id_t my_id) {
     tcp::socket client_socket = server_socket.accept();
     node_id_t joiner_id = 0;
     client_socket.exchange(my_id, joiner_id);
+    NodeCapacity joiner_capacity;
+    client_socket.read((char*)&joiner_capacity, sizeof(joiner_capacity));
     ip_addr& joiner_ip = client_socket.remote_ip;
     ip_addr my_ip = client_socket.get_self_ip();
     curr_view = std::make_unique<View>(0,
                                        std::vector<node_id_t>{my_id, joiner_id},
                                        std::vector<ip_addr>{my_ip, joiner_ip},
                                        std::vector<char>{0, 0},
-                                       std::vector<node_id_t>{joiner_id});
-    auto bind_socket_write = [&client_socket](const char* bytes, std::size_t size) {
-        bool success = client_socket.write(bytes, size);
-        assert(success);
-    };
+                                       std::vector<node_id_t>{joiner_id},
+                                       std::vector<node_id_t>{},
+                                       0, 0,
+                                       std::vector<NodeCapacity>{local_node_capacity(), joiner_capacity});
+    tcp::buffered_writer writer(client_socket);
+    auto bind_socket_write = [&writer](const char* bytes, std::size_t size) { writer.write(bytes, size); };
 
     std::size_t size_of_view = mutils::bytes_size(*curr_view);
-    client_socket.write((char*)&size_of_view, sizeof(size_of_view));
+    writer.write_pod(size_of_view);
     mutils::post_object(bind_socket_write, *curr_view);
     std::size_t size_of_derecho_params = mutils::bytes_size(derecho_params);
-    client_socket.write((char*)&size_of_derecho_params, sizeof(size_of_derecho_params));
+    writer.write_pod(size_of_derecho_params);
     mutils::post_object(bind_socket_write, derecho_params);
     //Send a "0" as the size of the "old shard leaders" vector, since there are no old leaders
     mutils::post_object(bind_socket_write, std::size_t{0});
+    bool success = writer.flush();
+    assert(success);
     rdma::impl::verbs_add_connection(joiner_id, joiner_ip, my_id);
     sst::add_node(joiner_id, joiner_ip);
 }
 
+/** Parses DerechoParams::rdma_rails, a list of "device[:port]" separated by commas */
+static std::vector<rdma::rail_config> parse_rails(const std::string& rails) {
+    std::vector<rdma::rail_config> configs;
+    std::size_t start = 0;
+    while(start < rails.size()) {
+        std::size_t end = rails.find(',', start);
+        if(end == std::string::npos) {
+            end = rails.size();
+        }
+        const std::string rail = rails.substr(start, end - start);
+        rdma::rail_config config;
+        const std::size_t colon = rail.find(':');
+        config.device_name = rail.substr(0, colon);
+        if(colon != std::string::npos) {
+            config.port = std::stoi(rail.substr(colon + 1));
+        }
+        if(!config.device_name.empty()) {
+            configs.push_back(config);
+        }
+        start = end + 1;
+    }
+    return configs;
+}
+
 void ViewManager::initialize_rdmc_sst() {
     // construct member_ips
     auto member_ips_map = make_member_ips_map(*curr_view);
-    if(!rdmc::initialize(member_ips_map, curr_view->members[curr_view->my_rank])) {
+    const std::vector<rdma::rail_config> rails = parse_rails(derecho_params.rdma_rails);
+    rdmc::set_service_level(derecho_params.rdmc_service_level);
+    rdmc::set_pacing_rate(derecho_params.rdmc_pacing_rate);
+    rdmc::set_lock_memory(derecho_params.lock_memory);
+    sst::verbs_set_lock_memory(derecho_params.lock_memory);
+    sst::verbs_set_service_level(derecho_params.sst_service_level);
+    if(!rdmc::initialize(member_ips_map, curr_view->members[curr_view->my_rank], rails)) {
         std::cout << "Global setup failed" << std::endl;
         exit(0);
     }
+    if(!rails.empty()) {
+        if(derecho_params.sst_rail >= rails.size()) {
+            throw derecho_exception("sst_rail is not the index of one of the rdma_rails");
+        }
+        sst::verbs_set_device(rails[derecho_params.sst_rail].device_name,
+                              rails[derecho_params.sst_rail].port);
+    }
     sst::verbs_initialize(member_ips_map, curr_view->members[curr_view->my_rank]);
 }
 
+void ViewManager::warm_up(DerechoSST& gmsSST) {
+    for(unsigned int round = 0; round < derecho_params.warm_up_rounds; ++round) {
+        gmsSST.put();
+        gmsSST.sync_with_members();
+    }
+}
+
 std::map<node_id_t, ip_addr> ViewManager::make_member_ips_map(const View& view) {
     std::map<node_id_t, ip_addr> member_ips_map;
     size_t num_members = view.members.size();
@@ -258,6 +383,7 @@ std::map<node_id_t, ip_addr> ViewManager::make_member_ips_map(const View& view)
 void ViewManager::create_threads() {
     client_listener_thread = std::thread{[this]() {
         pthread_setname_np(pthread_self(), "client_thread");
+        place_this_thread("client_thread");
         while(!thread_shutdown) {
             tcp::socket client_socket = server_socket.accept();
             logger->debug("Background thread got a client connection from {}", client_socket.remote_ip);
@@ -268,6 +394,7 @@ void ViewManager::create_threads() {
 
     old_view_cleanup_thread = std::thread([this]() {
         pthread_setname_np(pthread_self(), "old_view");
+        place_this_thread("old_view");
         while(!thread_shutdown) {
             unique_lock_t old_views_lock(old_views_mutex);
             old_views_cv.wait(old_views_lock, [this]() {
@@ -280,6 +407,24 @@ void ViewManager::create_threads() {
         }
         std::cout << "Old View cleanup thread shutting down." << std::endl;
     });
+
+    checkpoint_thread = std::thread([this]() {
+        pthread_setname_np(pthread_self(), "checkpoint");
+        place_this_thread("checkpoint");
+        while(!thread_shutdown) {
+            unique_lock_t requests_lock(checkpoint_requests_mutex);
+            checkpoint_requests_cv.wait(requests_lock, [this]() {
+                return !checkpoint_requests.empty() || thread_shutdown;
+            });
+            if(thread_shutdown) {
+                break;
+            }
+            CheckpointRequest request = std::move(checkpoint_requests.front());
+            checkpoint_requests.pop();
+            requests_lock.unlock();
+            take_checkpoint(request);
+        }
+    });
 }
 
 void ViewManager::register_predicates() {
@@ -313,8 +458,14 @@ void ViewManager::register_predicates() {
 
                 logger->debug("GMS telling SST to freeze row {} which is node {}", q, Vc.members[q]);
                 gmsSST.freeze(q);  // Cease to accept new updates from q
-                Vc.multicast_group->wedge();
-                gmssst::set(gmsSST.wedged[myRank], true);  // RDMC has halted new sends and receives in theView
+                if(derecho_params.scoped_wedge) {
+                    // Only the subgroups q was in have to stop now; the others
+                    // stop once the view change has cleaned those up
+                    Vc.wedge_subgroups(Vc.subgroups_containing(Vc.members[q]));
+                } else {
+                    Vc.multicast_group->wedge();
+                    gmssst::set(gmsSST.wedged[myRank], true);  // RDMC has halted new sends and receives in theView
+                }
                 Vc.failed[q] = true;
                 Vc.num_failed++;
 
@@ -345,16 +496,48 @@ void ViewManager::register_predicates() {
     };
 
     /* This pair runs only on the leader and reacts to new client connections
-     * by proposing a new view */
+     * by proposing a new view. Clients that connect close together are all
+     * proposed at once, so they are added by a single view change; clients
+     * that find the list of changes full wait on their sockets until a later
+     * view has room for them. */
     auto start_join_pred = [this](const DerechoSST& sst) {
-        return curr_view->i_am_leader() && has_pending_join();
+        if(!curr_view->i_am_leader() || room_for_changes(sst) == 0) {
+            return false;
+        }
+        const std::size_t num_pending = pending_join_sockets.locked().access.size();
+        if(num_pending == 0) {
+            return false;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if(!first_pending_join_time) {
+            first_pending_join_time = now;
+        }
+        return now - *first_pending_join_time >= join_batch_window
+               || (int)num_pending >= room_for_changes(sst);
     };
     auto start_join_trig = [this](DerechoSST& sst) {
-        logger->debug("GMS handling a new client connection");
-        //C++'s ugly two-step dequeue: leave queue.front() in an invalid state, then delete it
-        proposed_join_sockets.emplace_back(std::move(pending_join_sockets.locked().access.front()));
-        pending_join_sockets.locked().access.pop_front();
-        receive_join(proposed_join_sockets.back());
+        first_pending_join_time = std::experimental::nullopt;
+        int num_proposed = 0;
+        while(room_for_changes(sst) > 0) {
+            //C++'s ugly two-step dequeue: leave queue.front() in an invalid state, then delete it
+            {
+                auto pending = pending_join_sockets.locked();
+                if(pending.access.empty()) {
+                    break;
+                }
+                proposed_join_sockets.emplace_back(std::move(pending.access.front()));
+                pending.access.pop_front();
+            }
+            receive_join(proposed_join_sockets.back());
+            num_proposed++;
+        }
+        logger->debug("GMS proposed {} joins at once", num_proposed);
+        if(!derecho_params.scoped_wedge) {
+            logger->debug("Wedging view {}", curr_view->vid);
+            curr_view->wedge();
+            logger->debug("Leader done wedging view.");
+        }
+        sst.put(sst.changes.get_base() - sst.getBaseAddress(), sst.num_committed.get_base() - sst.changes.get_base());
     };
 
     /* These run only on the leader. They monitor the acks received from followers
@@ -371,8 +554,8 @@ void ViewManager::register_predicates() {
     };
 
     /* These are mostly intended for non-leaders, and update nAcked to acknowledge
-     * a proposed change when the leader increments num_changes. Only one join can be
-     * proposed at once, but multiple failures could be proposed and acknowledged. */
+     * a proposed change when the leader increments num_changes. Several joins and
+     * failures can be proposed and acknowledged at once. */
     auto leader_proposed_change = [this](const DerechoSST& gmsSST) {
         return gmsSST.num_changes[curr_view->rank_of_leader()]
                > gmsSST.num_acked[gmsSST.get_local_index()];
@@ -389,18 +572,22 @@ void ViewManager::register_predicates() {
 
             // Echo (copy) the vector including the new changes
             gmssst::set(gmsSST.changes[myRank], gmsSST.changes[leader], gmsSST.changes.size());
-            // Echo the new member's IP
+            // Echo the new member's IP and capacity
             gmssst::set(gmsSST.joiner_ips[myRank], gmsSST.joiner_ips[leader], gmsSST.joiner_ips.size());
+            gmssst::set(gmsSST.joiner_capacities[myRank], gmsSST.joiner_capacities[leader], gmsSST.joiner_capacities.size());
             gmssst::set(gmsSST.num_committed[myRank], gmsSST.num_committed[leader]);
         }
 
         // Notice a new request, acknowledge it
         gmssst::set(gmsSST.num_acked[myRank], gmsSST.num_changes[myRank]);
         gmsSST.put(gmsSST.changes.get_base() - gmsSST.getBaseAddress(),
-                   gmsSST.num_received.get_base() - gmsSST.changes.get_base());
-        logger->debug("Wedging current view.");
-        curr_view->wedge();
-        logger->debug("Done wedging current view.");
+                   gmsSST.wedged.get_base() - gmsSST.changes.get_base());
+        // With a scoped wedge, what to wedge is only known once the change commits
+        if(!derecho_params.scoped_wedge) {
+            logger->debug("Wedging current view.");
+            curr_view->wedge();
+            logger->debug("Done wedging current view.");
+        }
 
     };
 
@@ -412,10 +599,12 @@ void ViewManager::register_predicates() {
     };
     auto start_view_change = [this](DerechoSST& gmsSST) {
         logger->debug("Starting view change to view {}", (curr_view->vid + 1));
+        view_change_start_ns = metrics::now_ns();
         // Disable all the other SST predicates, except suspected_changed and the one I'm about to register
         gmsSST.predicates.remove(start_join_handle);
         gmsSST.predicates.remove(change_commit_ready_handle);
         gmsSST.predicates.remove(leader_proposed_handle);
+        gmsSST.predicates.remove(checkpoint_requested_handle);
 
         View& Vc = *curr_view;
 
@@ -423,7 +612,9 @@ void ViewManager::register_predicates() {
         // These fields had better be synchronized.
         assert(gmsSST.get_local_index() == curr_view->my_rank);
 
-        Vc.wedge();
+        if(!derecho_params.scoped_wedge) {
+            Vc.wedge();
+        }
         std::set<int> leave_ranks;
         std::vector<int> join_indexes;
         //Look through pending changes up to num_committed and filter the joins and leaves
@@ -446,6 +637,7 @@ void ViewManager::register_predicates() {
         std::vector<node_id_t> joined, members(next_num_members), departed;
         std::vector<char> failed(next_num_members);
         std::vector<ip_addr> member_ips(next_num_members);
+        std::vector<NodeCapacity> member_capacities(next_num_members);
         int next_unassigned_rank = curr_view->next_unassigned_rank;
         for(std::size_t i = 0; i < join_indexes.size(); ++i) {
             const int join_index = join_indexes[i];
@@ -460,6 +652,7 @@ void ViewManager::register_predicates() {
             int new_member_rank = Vc.num_members - leave_ranks.size() + i;
             members[new_member_rank] = joiner_id;
             member_ips[new_member_rank] = joiner_ip;
+            member_capacities[new_member_rank] = const_cast<const NodeCapacity&>(gmsSST.joiner_capacities[myRank][join_index]);
             logger->debug("Next view will add new member with ID {}", joiner_id);
         }
         for(const auto& leaver_rank : leave_ranks) {
@@ -478,6 +671,7 @@ void ViewManager::register_predicates() {
             if(leave_ranks.find(n) == leave_ranks.end()) {
                 members[m] = Vc.members[n];
                 member_ips[m] = Vc.member_ips[n];
+                member_capacities[m] = Vc.member_capacities[n];
                 failed[m] = Vc.failed[n];
                 ++m;
             }
@@ -497,14 +691,99 @@ void ViewManager::register_predicates() {
         }
 
         next_view = std::make_unique<View>(Vc.vid + 1, members, member_ips, failed,
-                                           joined, departed, my_new_rank, next_unassigned_rank);
+                                           joined, departed, my_new_rank, next_unassigned_rank,
+                                           member_capacities);
         next_view->i_know_i_am_leader = Vc.i_know_i_am_leader;
+        next_view->previous_shard_layouts = make_previous_shard_layouts(Vc);
+
+        next_view_maps = SubgroupMaps();
+        next_view_maps.num_received_size = make_subgroup_maps(curr_view, *next_view,
+                                                              next_view_maps.subgroup_to_shard_and_rank,
+                                                              next_view_maps.subgroup_to_senders_and_sender_rank,
+                                                              next_view_maps.subgroup_to_num_received_offset,
+                                                              next_view_maps.subgroup_to_membership,
+                                                              next_view_maps.subgroup_to_mode);
+
+        // Each shard cleans up its ragged edge on its own, as soon as its own
+        // members are wedged and (for followers) its leader has posted
+        // global_min, so a slow or failed shard doesn't hold up delivery of
+        // the others' last messages. The rest of the view change continues
+        // once every shard this node is in is done and the whole view is
+        // wedged ("meta wedged").
+        auto cleanups_remaining = std::make_shared<std::size_t>(0);
+        auto register_cleanups = [this, cleanups_remaining](DerechoSST& gmsSST, const std::set<subgroup_id_t>& subgroups) {
+            View& Vc = *curr_view;
+            for(const auto& shard_rank_pair : Vc.multicast_group->get_subgroup_to_shard_and_rank()) {
+                const subgroup_id_t subgroup_id = shard_rank_pair.first;
+                if(subgroups.find(subgroup_id) == subgroups.end()) {
+                    continue;
+                }
+                const uint32_t shard_num = shard_rank_pair.second.first;
+                SubView& shard_view = Vc.subgroup_shard_views.at(subgroup_id).at(shard_num);
+                uint num_shard_senders = 0;
+                for(auto v : shard_view.is_sender) {
+                    if(v) num_shard_senders++;
+                }
+                if(!num_shard_senders) {
+                    continue;
+                }
+                const uint32_t num_received_offset = Vc.multicast_group->get_subgroup_to_num_received_offset().at(subgroup_id);
+                const std::vector<node_id_t> shard_members = shard_view.members;
+                const uint shard_leader_rank = Vc.rank_of(shard_members[Vc.subview_rank_of_shard_leader(subgroup_id, shard_num)]);
+                ++*cleanups_remaining;
+                if(shard_leader_rank == (uint)Vc.my_rank) {
+                    auto shard_is_wedged = [this, subgroup_id, shard_members](const DerechoSST& gmsSST) {
+                        for(const node_id_t member : shard_members) {
+                            const int rank = curr_view->rank_of(member);
+                            if(!curr_view->failed[rank] && !gmsSST.wedged[rank]
+                               && !gmsSST.subgroup_wedged[rank][subgroup_id]) {
+                                return false;
+                            }
+                        }
+                        return true;
+                    };
+                    auto leader_cleanup = [this, subgroup_id, num_received_offset, shard_members,
+                                           num_shard_senders, cleanups_remaining](DerechoSST& gmsSST) {
+                        std::unique_lock<std::shared_timed_mutex> write_lock(view_mutex);
+                        leader_ragged_edge_cleanup(*curr_view, subgroup_id, num_received_offset,
+                                                   shard_members, num_shard_senders);
+                        --*cleanups_remaining;
+                    };
+                    gmsSST.predicates.insert(shard_is_wedged, leader_cleanup, sst::PredicateType::ONE_TIME);
+                } else {
+                    auto leader_global_min_is_ready = [subgroup_id, shard_leader_rank](const DerechoSST& gmsSST) {
+                        return gmsSST.global_min_ready[shard_leader_rank][subgroup_id];
+                    };
+                    auto follower_cleanup = [this, subgroup_id, shard_leader_rank, num_received_offset,
+                                             shard_members, num_shard_senders, cleanups_remaining](DerechoSST& gmsSST) {
+                        std::unique_lock<std::shared_timed_mutex> write_lock(view_mutex);
+                        follower_ragged_edge_cleanup(*curr_view, subgroup_id, shard_leader_rank, num_received_offset,
+                                                     shard_members, num_shard_senders);
+                        --*cleanups_remaining;
+                    };
+                    gmsSST.predicates.insert(leader_global_min_is_ready, follower_cleanup, sst::PredicateType::ONE_TIME);
+                }
+            }
+        };
+        std::set<subgroup_id_t> all_subgroups;
+        for(subgroup_id_t subgroup_id = 0; subgroup_id < Vc.subgroup_shard_views.size(); ++subgroup_id) {
+            all_subgroups.insert(subgroup_id);
+        }
+        // With a scoped wedge, the subgroups the change leaves alone keep
+        // running in this view while the ones it changes are cleaned up
+        std::set<subgroup_id_t> changed_subgroups = all_subgroups;
+        if(derecho_params.scoped_wedge) {
+            changed_subgroups = subgroups_changed_by(Vc, *next_view);
+            logger->debug("View change to view {} changes {} of {} subgroups",
+                          next_view->vid, changed_subgroups.size(), all_subgroups.size());
+            Vc.wedge_subgroups(changed_subgroups);
+        }
+        register_cleanups(gmsSST, changed_subgroups);
 
-        // At this point we need to await "meta wedged."
-        // To do that, we create a predicate that will fire when meta wedged is
-        // true, and put the rest of the code in its trigger.
-
-        auto is_meta_wedged = [this](const DerechoSST& gmsSST) {
+        auto cleanups_done_and_meta_wedged = [this, cleanups_remaining](const DerechoSST& gmsSST) {
+            if(*cleanups_remaining > 0) {
+                return false;
+            }
             for(int n = 0; n < gmsSST.get_num_rows(); ++n) {
                 if(!curr_view->failed[n] && !gmsSST.wedged[n]) {
                     return false;
@@ -512,184 +791,154 @@ void ViewManager::register_predicates() {
             }
             return true;
         };
-        auto meta_wedged_continuation = [this](DerechoSST& gmsSST) {
-            logger->debug("MetaWedged is true; continuing view change");
+        auto finish_view_change = [this](DerechoSST& gmsSST) {
             std::unique_lock<std::shared_timed_mutex> write_lock(view_mutex);
             assert(next_view);
-
-            //First, for subgroups in which I'm the shard leader, do RaggedEdgeCleanup for the leader
-            auto follower_subgroups_and_shards = std::make_shared<std::map<subgroup_id_t, uint32_t>>();
-            for(const auto& shard_rank_pair : curr_view->multicast_group->get_subgroup_to_shard_and_rank()) {
-                const subgroup_id_t subgroup_id = shard_rank_pair.first;
-                const uint32_t shard_num = shard_rank_pair.second.first;
-                SubView& shard_view = curr_view->subgroup_shard_views.at(subgroup_id).at(shard_num);
-                uint num_shard_senders = 0;
-                for(auto v : shard_view.is_sender) {
-                    if(v) num_shard_senders++;
-                }
-                if(num_shard_senders) {
-                    if(shard_view.my_rank == curr_view->subview_rank_of_shard_leader(subgroup_id, shard_num)) {
-                        leader_ragged_edge_cleanup(*curr_view, subgroup_id,
-                                                   curr_view->multicast_group->get_subgroup_to_num_received_offset()
-                                                           .at(subgroup_id),
-                                                   shard_view.members, num_shard_senders);
-                    } else {
-                        //Keep track of which subgroups I'm a non-leader in, and what my corresponding shard ID is
-                        follower_subgroups_and_shards->emplace(subgroup_id, shard_num);
-                    }
+            metrics::Registry& registry = metrics::registry();
+            registry.ragged_edge_ns.record(metrics::now_ns() - view_change_start_ns);
+
+            logger->debug("Ragged-edge cleanup is done in every subgroup and MetaWedged is true; continuing view change");
+            //Calculate and save the IDs of shard leaders for the old view
+            //If the old view was inadequately provisioned, this will be empty
+            std::map<std::type_index, std::vector<std::vector<int64_t>>> old_shard_leaders_by_type
+                    = make_shard_leaders_map(*curr_view);
+
+            std::list<tcp::socket> joiner_sockets;
+            if(curr_view->i_am_leader() && next_view->joined.size() > 0) {
+                //If j joins have been committed, pop the next j sockets off proposed_join_sockets
+                //and send them the new View (must happen before we try to do SST setup)
+                for(std::size_t c = 0; c < next_view->joined.size(); ++c) {
+                    commit_join(*next_view, proposed_join_sockets.front());
+                    //save the socket for later
+                    joiner_sockets.emplace_back(std::move(proposed_join_sockets.front()));
+                    proposed_join_sockets.pop_front();
                 }
             }
 
-            //Wait for the shard leaders of subgroups I'm not a leader in to post global_min_ready before continuing
-            auto leader_global_mins_are_ready = [this, follower_subgroups_and_shards](const DerechoSST& gmsSST) {
-                for(const auto& subgroup_shard_pair : *follower_subgroups_and_shards) {
-                    SubView& shard_view = curr_view->subgroup_shard_views.at(subgroup_shard_pair.first)
-                                                  .at(subgroup_shard_pair.second);
-                    node_id_t shard_leader = shard_view.members[curr_view->subview_rank_of_shard_leader(
-                            subgroup_shard_pair.first, subgroup_shard_pair.second)];
-                    if(!gmsSST.global_min_ready[curr_view->rank_of(shard_leader)][subgroup_shard_pair.first])
-                        return false;
-                }
-                return true;
-            };
-
-            auto global_min_ready_continuation = [this, follower_subgroups_and_shards](DerechoSST& gmsSST) {
-                std::unique_lock<std::shared_timed_mutex> write_lock(view_mutex);
-                assert(next_view);
-
-                logger->debug("GlobalMins are ready for all {} subgroup leaders this node is waiting on", follower_subgroups_and_shards->size());
-                //Finish RaggedEdgeCleanup for subgroups in which I'm not the leader
-                for(const auto& subgroup_shard_pair : *follower_subgroups_and_shards) {
-                    SubView& shard_view = curr_view->subgroup_shard_views.at(subgroup_shard_pair.first)
-                                                  .at(subgroup_shard_pair.second);
-                    uint num_shard_senders = 0;
-                    for(auto v : shard_view.is_sender) {
-                        if(v) num_shard_senders++;
-                    }
-                    node_id_t shard_leader = shard_view.members[curr_view->subview_rank_of_shard_leader(
-                            subgroup_shard_pair.first, subgroup_shard_pair.second)];
-                    follower_ragged_edge_cleanup(*curr_view, subgroup_shard_pair.first,
-                                                 curr_view->rank_of(shard_leader),
-                                                 curr_view->multicast_group->get_subgroup_to_num_received_offset()
-                                                         .at(subgroup_shard_pair.first),
-                                                 shard_view.members,
-                                                 num_shard_senders);
-                }
-                //Calculate and save the IDs of shard leaders for the old view
-                //If the old view was inadequately provisioned, this will be empty
-                std::map<std::type_index, std::vector<std::vector<int64_t>>> old_shard_leaders_by_type
-                        = make_shard_leaders_map(*curr_view);
-
-                std::list<tcp::socket> joiner_sockets;
-                if(curr_view->i_am_leader() && next_view->joined.size() > 0) {
-                    //If j joins have been committed, pop the next j sockets off proposed_join_sockets
-                    //and send them the new View (must happen before we try to do SST setup)
-                    for(std::size_t c = 0; c < next_view->joined.size(); ++c) {
-                        commit_join(*next_view, proposed_join_sockets.front());
-                        //save the socket for later
-                        joiner_sockets.emplace_back(std::move(proposed_join_sockets.front()));
-                        proposed_join_sockets.pop_front();
-                    }
-                }
-
-                // Delete the last two GMS predicates from the old SST in preparation for deleting it
-                gmsSST.predicates.remove(leader_committed_handle);
-                gmsSST.predicates.remove(suspected_changed_handle);
-
-                node_id_t my_id = next_view->members[next_view->my_rank];
-                logger->debug("Starting creation of new SST and DerechoGroup for view {}", next_view->vid);
-                // if new members have joined, add their RDMA connections to SST and RDMC
-                for(std::size_t i = 0; i < next_view->joined.size(); ++i) {
-                    //The new members will be the last joined.size() elements of the members lists
-                    int joiner_rank = next_view->num_members - next_view->joined.size() + i;
-                    rdma::impl::verbs_add_connection(next_view->members[joiner_rank], next_view->member_ips[joiner_rank],
-                                                     my_id);
-                }
-                for(std::size_t i = 0; i < next_view->joined.size(); ++i) {
-                    int joiner_rank = next_view->num_members - next_view->joined.size() + i;
-                    sst::add_node(next_view->members[joiner_rank], next_view->member_ips[joiner_rank]);
-                }
-                // This will block until everyone responds to SST/RDMC initial handshakes
-                transition_multicast_group();
-
-                // Translate the old shard leaders' indices from types to new subgroup IDs
-                std::vector<std::vector<int64_t>> old_shard_leaders_by_id = translate_types_to_ids(old_shard_leaders_by_type, *next_view);
-
-                if(curr_view->i_am_leader()) {
-                    while(!joiner_sockets.empty()) {
-                        //Send the array of old shard leaders, so the new member knows who to receive from
-                        std::size_t size_of_vector = mutils::bytes_size(old_shard_leaders_by_id);
-                        joiner_sockets.front().write((char*)&size_of_vector, sizeof(std::size_t));
-                        mutils::post_object([&joiner_sockets](const char* bytes, std::size_t size) {
-                            joiner_sockets.front().write(bytes, size);
+            // Delete the last two GMS predicates from the old SST in preparation for deleting it
+            gmsSST.predicates.remove(leader_committed_handle);
+            gmsSST.predicates.remove(suspected_changed_handle);
+
+            node_id_t my_id = next_view->members[next_view->my_rank];
+            logger->debug("Starting creation of new SST and DerechoGroup for view {}", next_view->vid);
+            const uint64_t rebuild_start_ns = metrics::now_ns();
+            // if new members have joined, add their RDMA connections to SST and RDMC
+            for(std::size_t i = 0; i < next_view->joined.size(); ++i) {
+                //The new members will be the last joined.size() elements of the members lists
+                int joiner_rank = next_view->num_members - next_view->joined.size() + i;
+                rdma::impl::verbs_add_connection(next_view->members[joiner_rank], next_view->member_ips[joiner_rank],
+                                                 my_id);
+            }
+            for(std::size_t i = 0; i < next_view->joined.size(); ++i) {
+                int joiner_rank = next_view->num_members - next_view->joined.size() + i;
+                sst::add_node(next_view->members[joiner_rank], next_view->member_ips[joiner_rank]);
+            }
+            // This will block until everyone responds to SST/RDMC initial handshakes
+            transition_multicast_group();
+
+            // Translate the old shard leaders' indices from types to new subgroup IDs
+            std::vector<std::vector<int64_t>> old_shard_leaders_by_id = translate_types_to_ids(old_shard_leaders_by_type, *next_view);
+
+            if(curr_view->i_am_leader()) {
+                while(!joiner_sockets.empty()) {
+                    //Send the array of old shard leaders, so the new member knows who to receive from
+                    std::size_t size_of_vector = mutils::bytes_size(old_shard_leaders_by_id);
+                    {
+                        tcp::buffered_writer writer(joiner_sockets.front());
+                        writer.write_pod(size_of_vector);
+                        mutils::post_object([&writer](const char* bytes, std::size_t size) {
+                            writer.write(bytes, size);
                         },
                                             old_shard_leaders_by_id);
-                        joiner_sockets.pop_front();
                     }
+                    joiner_sockets.pop_front();
                 }
+            }
 
-                // New members can now proceed to view_manager.start(), which will call sync()
-                next_view->gmsSST->put();
-                next_view->gmsSST->sync_with_members();
-                logger->debug("Done setting up SST and DerechoGroup for view {}", next_view->vid);
-                {
-                    lock_guard_t old_views_lock(old_views_mutex);
-                    old_views.push(std::move(curr_view));
-                    old_views_cv.notify_all();
-                }
-                curr_view = std::move(next_view);
+            // New members can now proceed to view_manager.start(), which will call sync()
+            next_view->gmsSST->put();
+            next_view->gmsSST->sync_with_members();
+            // Joiners warm up the same way at the start of start()
+            warm_up(*next_view->gmsSST);
+            registry.transport_rebuild_ns.record(metrics::now_ns() - rebuild_start_ns);
+            logger->debug("Done setting up SST and DerechoGroup for view {}", next_view->vid);
+            {
+                lock_guard_t old_views_lock(old_views_mutex);
+                old_views.push(std::move(curr_view));
+                old_views_cv.notify_all();
+            }
+            curr_view = std::move(next_view);
 
-                //If in persistent mode, write the new view to disk before using it
-                if(!view_file_name.empty()) {
-                    persist_object(*curr_view, view_file_name);
-                }
+            //If in persistent mode, save the new view; it is serialized now,
+            //but written to disk in the background
+            if(!view_file_name.empty()) {
+                persist_object_async(*curr_view, view_file_name, view_writer);
+            }
 
-                //Resize last_suspected to match the new size of suspected[]
-                last_suspected.resize(curr_view->members.size());
+            //Resize last_suspected to match the new size of suspected[]
+            last_suspected.resize(curr_view->members.size());
 
-                // Register predicates in the new view
-                register_predicates();
-                curr_view->gmsSST->start_predicate_evaluation();
+            // Register predicates in the new view
+            register_predicates();
+            curr_view->gmsSST->start_predicate_evaluation();
 
-                // First task with my new view...
-                if(curr_view->i_am_new_leader())  // I'm the new leader and everyone who hasn't failed agrees
-                {
-                    curr_view->merge_changes();  // Create a combined list of Changes
-                }
+            // First task with my new view...
+            if(curr_view->i_am_new_leader())  // I'm the new leader and everyone who hasn't failed agrees
+            {
+                curr_view->merge_changes();  // Create a combined list of Changes
+            }
 
-                // Announce the new view to the application
-                for(auto& view_upcall : view_upcalls) {
-                    view_upcall(*curr_view);
-                }
-                // One of those view upcalls is to RPCManager, which will set up TCP connections to the new members
-                // After doing that, shard leaders can send them RPC objects
-                for(subgroup_id_t subgroup_id = 0; subgroup_id < old_shard_leaders_by_id.size(); ++subgroup_id) {
-                    for(uint32_t shard = 0; shard < old_shard_leaders_by_id[subgroup_id].size(); ++shard) {
-                        //if I was the leader of the shard in the old view...
-                        if(my_id == old_shard_leaders_by_id[subgroup_id][shard]) {
-                            //send its object state to the new members
-                            for(node_id_t shard_joiner : curr_view->subgroup_shard_views[subgroup_id][shard].joined) {
-                                if(shard_joiner != my_id) {
-                                    send_subgroup_object(subgroup_id, shard_joiner);
-                                }
+            // Announce the new view to the application
+            for(auto& view_upcall : view_upcalls) {
+                view_upcall(*curr_view);
+            }
+            // One of those view upcalls is to RPCManager, which will set up TCP connections to the new members
+            // After doing that, shard leaders can send them RPC objects
+            const uint64_t state_transfer_start_ns = metrics::now_ns();
+            for(subgroup_id_t subgroup_id = 0; subgroup_id < old_shard_leaders_by_id.size(); ++subgroup_id) {
+                for(uint32_t shard = 0; shard < old_shard_leaders_by_id[subgroup_id].size(); ++shard) {
+                    //if I was the leader of the shard in the old view...
+                    if(my_id == old_shard_leaders_by_id[subgroup_id][shard]) {
+                        //send its object state to the new members
+                        for(node_id_t shard_joiner : curr_view->subgroup_shard_views[subgroup_id][shard].joined) {
+                            if(shard_joiner != my_id) {
+                                send_subgroup_object(subgroup_id, shard_joiner);
                             }
                         }
                     }
                 }
+            }
 
-                // Re-initialize this node's RPC objects, which includes receiving them
-                // from shard leaders if it is newly a member of a subgroup
-                initialize_subgroup_objects(my_id, *curr_view, old_shard_leaders_by_id);
-                view_change_cv.notify_all();
-            };
-
-            //Last statement in meta_wedged_continuation: register global_min_ready_continuation
-            gmsSST.predicates.insert(leader_global_mins_are_ready, global_min_ready_continuation, sst::PredicateType::ONE_TIME);
-
+            // Re-initialize this node's RPC objects, which includes receiving them
+            // from shard leaders if it is newly a member of a subgroup
+            initialize_subgroup_objects(my_id, *curr_view, old_shard_leaders_by_id);
+            registry.state_transfer_ns.record(metrics::now_ns() - state_transfer_start_ns);
+            registry.view_change_ns.record(metrics::now_ns() - view_change_start_ns);
+            view_change_cv.notify_all();
         };
 
-        //Last statement in start_view_change: register meta_wedged_continuation
-        gmsSST.predicates.insert(is_meta_wedged, meta_wedged_continuation, sst::PredicateType::ONE_TIME);
+        //Last statement in start_view_change: register finish_view_change
+        if(!derecho_params.scoped_wedge) {
+            gmsSST.predicates.insert(cleanups_done_and_meta_wedged, finish_view_change, sst::PredicateType::ONE_TIME);
+            return;
+        }
+        // Once the changed subgroups are cleaned up, the others switch over
+        // to the next view as well: wedge them, clean them up and finish
+        auto changed_cleanups_done = [cleanups_remaining](const DerechoSST& gmsSST) {
+            return *cleanups_remaining == 0;
+        };
+        std::set<subgroup_id_t> unchanged_subgroups;
+        std::set_difference(all_subgroups.begin(), all_subgroups.end(),
+                            changed_subgroups.begin(), changed_subgroups.end(),
+                            std::inserter(unchanged_subgroups, unchanged_subgroups.end()));
+        auto wedge_unchanged = [this, register_cleanups, unchanged_subgroups,
+                                cleanups_done_and_meta_wedged, finish_view_change](DerechoSST& gmsSST) {
+            logger->debug("Changed subgroups are cleaned up; wedging the other {}", unchanged_subgroups.size());
+            curr_view->wedge();
+            register_cleanups(gmsSST, unchanged_subgroups);
+            gmsSST.predicates.insert(cleanups_done_and_meta_wedged, finish_view_change, sst::PredicateType::ONE_TIME);
+        };
+        gmsSST.predicates.insert(changed_cleanups_done, wedge_unchanged, sst::PredicateType::ONE_TIME);
 
     };
 
@@ -698,17 +947,59 @@ void ViewManager::register_predicates() {
     change_commit_ready_handle = curr_view->gmsSST->predicates.insert(change_commit_ready, commit_change, sst::PredicateType::RECURRENT);
     leader_proposed_handle = curr_view->gmsSST->predicates.insert(leader_proposed_change, ack_proposed_change, sst::PredicateType::RECURRENT);
     leader_committed_handle = curr_view->gmsSST->predicates.insert(leader_committed_next_view, start_view_change, sst::PredicateType::ONE_TIME);
+
+    /* This pair notices that a member has asked for a checkpoint and queues
+     * it for checkpoint_thread, with the shards this node leads; a node that
+     * leads none still queues it, to report that it is done. */
+    handled_checkpoint_cuts.assign(curr_view->num_members, 0);
+    auto checkpoint_requested = [this](const DerechoSST& gmsSST) {
+        for(uint32_t row = 0; row < handled_checkpoint_cuts.size(); ++row) {
+            if(gmsSST.checkpoint_cut[row] > handled_checkpoint_cuts[row]) {
+                return true;
+            }
+        }
+        return false;
+    };
+    auto queue_checkpoint = [this](DerechoSST& gmsSST) {
+        for(uint32_t row = 0; row < handled_checkpoint_cuts.size(); ++row) {
+            const uint64_t cut = gmsSST.checkpoint_cut[row];
+            if(cut <= handled_checkpoint_cuts[row]) {
+                continue;
+            }
+            // The target was written before the cut that says it is there
+            std::atomic_thread_fence(std::memory_order_acquire);
+            handled_checkpoint_cuts[row] = cut;
+            const char* target = const_cast<const char*>(gmsSST.checkpoint_target[row]);
+            CheckpointRequest request{curr_view->vid, row, cut,
+                                      std::string(target, strnlen(target, DerechoSST::max_checkpoint_target)),
+                                      {}};
+            for(subgroup_id_t subgroup = 0; subgroup < curr_view->subgroup_shard_views.size(); ++subgroup) {
+                for(uint32_t shard = 0; shard < curr_view->subgroup_shard_views[subgroup].size(); ++shard) {
+                    const int leader = curr_view->subview_rank_of_shard_leader(subgroup, shard);
+                    if(leader >= 0 && curr_view->subgroup_shard_views[subgroup][shard].members[leader]
+                                              == curr_view->members[curr_view->my_rank]) {
+                        request.shards.emplace_back(subgroup, shard);
+                    }
+                }
+            }
+            logger->debug("Queueing the checkpoint at {} that row {} asked for", cut, row);
+            std::lock_guard<std::mutex> lock(checkpoint_requests_mutex);
+            checkpoint_requests.push(std::move(request));
+        }
+        checkpoint_requests_cv.notify_one();
+    };
+    checkpoint_requested_handle = curr_view->gmsSST->predicates.insert(checkpoint_requested, queue_checkpoint, sst::PredicateType::RECURRENT);
 }
 
 /* ----------  2. Helper Functions for Predicates and Triggers ------------- */
 
 void ViewManager::construct_multicast_group(CallbackSet callbacks,
                                             const DerechoParams& derecho_params) {
-    std::map<subgroup_id_t, std::pair<uint32_t, uint32_t>> subgroup_to_shard_and_rank;
-    std::map<subgroup_id_t, std::pair<std::vector<int>, int>> subgroup_to_senders_and_sender_rank;
-    std::map<subgroup_id_t, uint32_t> subgroup_to_num_received_offset;
-    std::map<subgroup_id_t, std::vector<node_id_t>> subgroup_to_membership;
-    std::map<subgroup_id_t, Mode> subgroup_to_mode;
+    SubgroupMap<std::pair<uint32_t, uint32_t>> subgroup_to_shard_and_rank;
+    SubgroupMap<std::pair<std::vector<int>, int>> subgroup_to_senders_and_sender_rank;
+    SubgroupMap<uint32_t> subgroup_to_num_received_offset;
+    SubgroupMap<std::vector<node_id_t>> subgroup_to_membership;
+    SubgroupMap<Mode> subgroup_to_mode;
 
     uint32_t num_received_size = make_subgroup_maps(std::unique_ptr<View>(), *curr_view,
                                                     subgroup_to_shard_and_rank,
@@ -719,103 +1010,134 @@ void ViewManager::construct_multicast_group(CallbackSet callbacks,
     const auto num_subgroups = curr_view->subgroup_shard_views.size();
     curr_view->gmsSST = std::make_shared<DerechoSST>(
             sst::SSTParams(curr_view->members, curr_view->members[curr_view->my_rank],
-                           [this](const uint32_t node_id) { report_failure(node_id); }, curr_view->failed, false),
+                           [this](const uint32_t node_id) { report_failure(node_id); }, curr_view->failed, false,
+                           false, sst::PollPolicy(derecho_params.sst_poll_mode), false,
+                           derecho_params.shared_memory_sst),
             num_subgroups, num_received_size, derecho_params.window_size);
+    // Set before the MulticastGroup starts sending, since messages carry it
+    curr_view->gmsSST->vid[curr_view->my_rank] = curr_view->vid;
 
     curr_view->multicast_group = std::make_unique<MulticastGroup>(
             curr_view->members, curr_view->members[curr_view->my_rank],
-            curr_view->gmsSST, callbacks, num_subgroups, subgroup_to_shard_and_rank,
-            subgroup_to_senders_and_sender_rank,
-            subgroup_to_num_received_offset, subgroup_to_membership,
-            subgroup_to_mode,
+            curr_view->gmsSST, callbacks, num_subgroups, std::move(subgroup_to_shard_and_rank),
+            std::move(subgroup_to_senders_and_sender_rank),
+            std::move(subgroup_to_num_received_offset), std::move(subgroup_to_membership),
+            std::move(subgroup_to_mode),
+            latency_critical_subgroups(*curr_view),
             derecho_params, 
             persistence_manager_callbacks,
             curr_view->failed);
 }
 
+std::set<subgroup_id_t> ViewManager::latency_critical_subgroups(const View& view) const {
+    std::set<subgroup_id_t> subgroups;
+    for(const auto& subgroup_type : subgroup_info.latency_critical_types) {
+        auto ids = view.subgroup_ids_by_type.find(subgroup_type);
+        if(ids != view.subgroup_ids_by_type.end()) {
+            subgroups.insert(ids->second.begin(), ids->second.end());
+        }
+    }
+    return subgroups;
+}
+
 void ViewManager::transition_multicast_group() {
-    std::map<subgroup_id_t, std::pair<uint32_t, uint32_t>> subgroup_to_shard_and_rank;
-    std::map<subgroup_id_t, std::pair<std::vector<int>, int>> subgroup_to_senders_and_sender_rank;
-    std::map<subgroup_id_t, uint32_t> subgroup_to_num_received_offset;
-    std::map<subgroup_id_t, std::vector<node_id_t>> subgroup_to_membership;
-    std::map<subgroup_id_t, Mode> subgroup_to_mode;
-    uint32_t num_received_size = make_subgroup_maps(curr_view, *next_view, subgroup_to_shard_and_rank,
-                                                    subgroup_to_senders_and_sender_rank,
-                                                    subgroup_to_num_received_offset,
-                                                    subgroup_to_membership,
-                                                    subgroup_to_mode);
+    // next_view's subgroups were laid out when the view change started
+    const uint32_t num_received_size = next_view_maps.num_received_size;
     const auto num_subgroups = next_view->subgroup_shard_views.size();
     next_view->gmsSST = std::make_shared<DerechoSST>(
             sst::SSTParams(next_view->members, next_view->members[next_view->my_rank],
-                           [this](const uint32_t node_id) { report_failure(node_id); }, next_view->failed, false),
+                           [this](const uint32_t node_id) { report_failure(node_id); }, next_view->failed, false,
+                           false, sst::PollPolicy(derecho_params.sst_poll_mode), false,
+                           derecho_params.shared_memory_sst),
             num_subgroups, num_received_size, derecho_params.window_size);
+    // Set before the MulticastGroup starts sending, since messages carry it
+    gmssst::set(next_view->gmsSST->vid[next_view->my_rank], next_view->vid);
 
     next_view->multicast_group = std::make_unique<MulticastGroup>(
             next_view->members, next_view->members[next_view->my_rank], next_view->gmsSST,
             std::move(*curr_view->multicast_group), num_subgroups,
-            subgroup_to_shard_and_rank, subgroup_to_senders_and_sender_rank,
-            subgroup_to_num_received_offset, subgroup_to_membership,
-            subgroup_to_mode,
+            std::move(next_view_maps.subgroup_to_shard_and_rank),
+            std::move(next_view_maps.subgroup_to_senders_and_sender_rank),
+            std::move(next_view_maps.subgroup_to_num_received_offset),
+            std::move(next_view_maps.subgroup_to_membership),
+            std::move(next_view_maps.subgroup_to_mode),
+            latency_critical_subgroups(*next_view),
             persistence_manager_callbacks,
             next_view->failed);
 
     curr_view->multicast_group.reset();
+    next_view_maps = SubgroupMaps();
 
     // Initialize this node's row in the new SST
     int changes_installed = next_view->joined.size() + next_view->departed.size();
     next_view->gmsSST->init_local_row_from_previous((*curr_view->gmsSST), curr_view->my_rank, changes_installed);
-    gmssst::set(next_view->gmsSST->vid[next_view->my_rank], next_view->vid);
+}
+
+int ViewManager::room_for_changes(const DerechoSST& gmsSST) const {
+    // Proposed changes are stored from the first one not yet installed
+    const int num_uninstalled = gmsSST.num_changes[curr_view->my_rank] - gmsSST.num_installed[curr_view->my_rank];
+    return (int)gmsSST.changes.size() - num_uninstalled;
 }
 
 void ViewManager::receive_join(tcp::socket& client_socket) {
     DerechoSST& gmsSST = *curr_view->gmsSST;
-    if((gmsSST.num_changes[curr_view->my_rank] - gmsSST.num_committed[curr_view->my_rank]) == (int)gmsSST.changes.size()) {
-        //TODO: this shouldn't throw an exception, it should just block the client until the group stabilizes
-        throw derecho_exception("Too many changes to allow a Join right now");
-    }
+    assert(room_for_changes(gmsSST) > 0);
 
     struct in_addr joiner_ip_packed;
     inet_aton(client_socket.remote_ip.c_str(), &joiner_ip_packed);
 
     node_id_t joining_client_id = 0;
     client_socket.exchange(curr_view->members[curr_view->my_rank], joining_client_id);
+    NodeCapacity joiner_capacity;
+    client_socket.read((char*)&joiner_capacity, sizeof(joiner_capacity));
 
     logger->debug("Proposing change to add node {}", joining_client_id);
     size_t next_change = gmsSST.num_changes[curr_view->my_rank] - gmsSST.num_installed[curr_view->my_rank];
     gmssst::set(gmsSST.changes[curr_view->my_rank][next_change], joining_client_id);
     gmssst::set(gmsSST.joiner_ips[curr_view->my_rank][next_change], joiner_ip_packed.s_addr);
+    gmssst::set(&gmsSST.joiner_capacities[curr_view->my_rank][next_change], &joiner_capacity, 1);
 
     gmssst::increment(gmsSST.num_changes[curr_view->my_rank]);
-
-    logger->debug("Wedging view {}", curr_view->vid);
-    curr_view->wedge();
-    logger->debug("Leader done wedging view.");
-    gmsSST.put(gmsSST.changes.get_base() - gmsSST.getBaseAddress(), gmsSST.num_committed.get_base() - gmsSST.changes.get_base());
 }
 
 void ViewManager::commit_join(const View& new_view, tcp::socket& client_socket) {
     logger->debug("Sending client the new view");
-    auto bind_socket_write = [&client_socket](const char* bytes, std::size_t size) { client_socket.write(bytes, size); };
+    // Buffered, so that the view and parameters leave in a few writes
+    // instead of one for each of their fields
+    tcp::buffered_writer writer(client_socket);
+    auto bind_socket_write = [&writer](const char* bytes, std::size_t size) { writer.write(bytes, size); };
     std::size_t size_of_view = mutils::bytes_size(new_view);
-    client_socket.write((char*)&size_of_view, sizeof(size_of_view));
+    writer.write_pod(size_of_view);
     mutils::post_object(bind_socket_write, new_view);
     std::size_t size_of_derecho_params = mutils::bytes_size(derecho_params);
-    client_socket.write((char*)&size_of_derecho_params, sizeof(size_of_derecho_params));
+    writer.write_pod(size_of_derecho_params);
     mutils::post_object(bind_socket_write, derecho_params);
 }
 
 uint32_t ViewManager::make_subgroup_maps(const std::unique_ptr<View>& prev_view,
                                          View& curr_view,
-                                         std::map<subgroup_id_t, std::pair<uint32_t, uint32_t>>& subgroup_to_shard_and_rank,
-                                         std::map<subgroup_id_t, std::pair<std::vector<int>, int>>& subgroup_to_senders_and_sender_rank,
-                                         std::map<subgroup_id_t, uint32_t>& subgroup_to_num_received_offset,
-                                         std::map<subgroup_id_t, std::vector<node_id_t>>& subgroup_to_membership,
-                                         std::map<subgroup_id_t, Mode>& subgroup_to_mode) {
+                                         SubgroupMap<std::pair<uint32_t, uint32_t>>& subgroup_to_shard_and_rank,
+                                         SubgroupMap<std::pair<std::vector<int>, int>>& subgroup_to_senders_and_sender_rank,
+                                         SubgroupMap<uint32_t>& subgroup_to_num_received_offset,
+                                         SubgroupMap<std::vector<node_id_t>>& subgroup_to_membership,
+                                         SubgroupMap<Mode>& subgroup_to_mode) {
     uint32_t num_received_offset = 0;
     bool previous_was_ok = !prev_view || prev_view->is_adequately_provisioned;
     int32_t initial_next_unassigned_rank = curr_view.next_unassigned_rank;
+    curr_view.allocating_type_position = -1;
+    if(prev_view) {
+        //The layout rarely changes its number of subgroups, so size everything like the previous one
+        const uint32_t expected_num_subgroups = prev_view->subgroup_shard_views.size();
+        curr_view.subgroup_shard_views.reserve(expected_num_subgroups);
+        subgroup_to_shard_and_rank.reserve(expected_num_subgroups);
+        subgroup_to_senders_and_sender_rank.reserve(expected_num_subgroups);
+        subgroup_to_num_received_offset.reserve(expected_num_subgroups);
+        subgroup_to_membership.reserve(expected_num_subgroups);
+        subgroup_to_mode.reserve(expected_num_subgroups);
+    }
     for(const auto& subgroup_type : subgroup_info.membership_function_order) {
         subgroup_shard_layout_t subgroup_shard_views;
+        curr_view.allocating_type_position++;
         //This is the only place the subgroup membership functions are called; the results are then saved in the View
         try {
             auto temp = subgroup_info.subgroup_membership_functions.at(subgroup_type)(curr_view, curr_view.next_unassigned_rank, previous_was_ok);
@@ -823,6 +1145,7 @@ uint32_t ViewManager::make_subgroup_maps(const std::unique_ptr<View>& prev_view,
             subgroup_shard_views = std::move(temp);
         } catch(subgroup_provisioning_exception& ex) {
             //Mark the view as inadequate and roll back everything done by previous allocation functions
+            curr_view.allocating_type_position = -1;
             curr_view.is_adequately_provisioned = false;
             curr_view.next_unassigned_rank = initial_next_unassigned_rank;
             curr_view.subgroup_shard_views.clear();
@@ -865,15 +1188,7 @@ uint32_t ViewManager::make_subgroup_maps(const std::unique_ptr<View>& prev_view,
                     subgroup_id_t prev_subgroup_id = prev_view->subgroup_ids_by_type
                                                              .at(subgroup_type)
                                                              .at(subgroup_index);
-                    SubView& prev_shard_view = prev_view->subgroup_shard_views[prev_subgroup_id][shard_num];
-                    std::set<node_id_t> prev_members(prev_shard_view.members.begin(), prev_shard_view.members.end());
-                    std::set<node_id_t> curr_members(shard_view.members.begin(), shard_view.members.end());
-                    std::set_difference(curr_members.begin(), curr_members.end(),
-                                        prev_members.begin(), prev_members.end(),
-                                        std::back_inserter(shard_view.joined));
-                    std::set_difference(prev_members.begin(), prev_members.end(),
-                                        curr_members.begin(), curr_members.end(),
-                                        std::back_inserter(shard_view.departed));
+                    shard_view.init_changes_from(prev_view->subgroup_shard_views[prev_subgroup_id][shard_num]);
                 }
             }
             /* Pull the shard->SubView mapping out of the subgroup membership list
@@ -883,9 +1198,66 @@ uint32_t ViewManager::make_subgroup_maps(const std::unique_ptr<View>& prev_view,
             num_received_offset += max_shard_senders;
         }
     }
+    curr_view.allocating_type_position = -1;
     return num_received_offset;
 }
 
+std::vector<subgroup_shard_layout_t> ViewManager::make_previous_shard_layouts(const View& view) const {
+    //An inadequate View has no layout, so the next one keeps the last good one
+    if(!view.is_adequately_provisioned) {
+        return view.previous_shard_layouts;
+    }
+    std::vector<subgroup_shard_layout_t> layouts;
+    for(const auto& subgroup_type : subgroup_info.membership_function_order) {
+        subgroup_shard_layout_t layout;
+        auto ids = view.subgroup_ids_by_type.find(subgroup_type);
+        if(ids != view.subgroup_ids_by_type.end()) {
+            for(subgroup_id_t subgroup_id : ids->second) {
+                layout.push_back(view.subgroup_shard_views[subgroup_id]);
+            }
+        }
+        layouts.emplace_back(std::move(layout));
+    }
+    return layouts;
+}
+
+std::set<subgroup_id_t> ViewManager::subgroups_changed_by(const View& curr_view, const View& next_view) {
+    std::set<subgroup_id_t> changed;
+    for(subgroup_id_t subgroup_id = 0; subgroup_id < curr_view.subgroup_shard_views.size(); ++subgroup_id) {
+        changed.insert(subgroup_id);
+    }
+    if(!curr_view.is_adequately_provisioned || !next_view.is_adequately_provisioned) {
+        return changed;
+    }
+    for(const auto& type_ids : curr_view.subgroup_ids_by_type) {
+        auto next_ids = next_view.subgroup_ids_by_type.find(type_ids.first);
+        if(next_ids == next_view.subgroup_ids_by_type.end()) {
+            continue;
+        }
+        for(uint32_t subgroup_index = 0; subgroup_index < type_ids.second.size(); ++subgroup_index) {
+            if(subgroup_index >= next_ids->second.size()) {
+                break;
+            }
+            const subgroup_id_t subgroup_id = type_ids.second[subgroup_index];
+            const auto& curr_shards = curr_view.subgroup_shard_views[subgroup_id];
+            const auto& next_shards = next_view.subgroup_shard_views[next_ids->second[subgroup_index]];
+            if(curr_shards.size() != next_shards.size()) {
+                continue;
+            }
+            bool same = true;
+            for(std::size_t shard = 0; shard < curr_shards.size() && same; ++shard) {
+                same = curr_shards[shard].members == next_shards[shard].members
+                       && curr_shards[shard].is_sender == next_shards[shard].is_sender
+                       && curr_shards[shard].mode == next_shards[shard].mode;
+            }
+            if(same) {
+                changed.erase(subgroup_id);
+            }
+        }
+    }
+    return changed;
+}
+
 /**
  * Constructs a map from subgroup type -> index -> shard -> node ID of that shard's leader.
  * If a shard has no leader in the current view (because it has no members), the vector will
@@ -1094,7 +1466,10 @@ void ViewManager::leave() {
     curr_view->multicast_group->wedge();
     curr_view->gmsSST->predicates.clear();
     curr_view->gmsSST->suspected[curr_view->my_rank][curr_view->my_rank] = true;
-    curr_view->gmsSST->put((char*)std::addressof(curr_view->gmsSST->suspected[0][curr_view->my_rank]) - curr_view->gmsSST->getBaseAddress(), sizeof(curr_view->gmsSST->suspected[0][curr_view->my_rank]));
+    //Wait for the other members to have seen it, since tearing down the SST
+    //right after the write is posted could drop it, and then they would only
+    //find out by timing out
+    curr_view->gmsSST->put_with_completion((char*)std::addressof(curr_view->gmsSST->suspected[0][curr_view->my_rank]) - curr_view->gmsSST->getBaseAddress(), sizeof(curr_view->gmsSST->suspected[0][curr_view->my_rank]));
     thread_shutdown = true;
 }
 
@@ -1105,6 +1480,35 @@ char* ViewManager::get_sendbuffer_ptr(subgroup_id_t subgroup_num, unsigned long
     return curr_view->multicast_group->get_sendbuffer_ptr(subgroup_num, payload_size, pause_sending_turns, cooked_send, null_send);
 }
 
+char* ViewManager::wait_for_sendbuffer_ptr(subgroup_id_t subgroup_num, unsigned long long int payload_size,
+                                           std::chrono::nanoseconds timeout, uint64_t* wait_time_ns,
+                                           int pause_sending_turns, bool cooked_send, bool null_send) {
+    const auto start_time = std::chrono::steady_clock::now();
+    const auto deadline = (timeout == std::chrono::nanoseconds::max())
+                                  ? std::chrono::steady_clock::time_point::max()
+                                  : start_time + timeout;
+    char* buf = nullptr;
+    shared_lock_t lock(view_mutex);
+    while(true) {
+        buf = curr_view->multicast_group->wait_for_sendbuffer_ptr(subgroup_num, payload_size, deadline,
+                                                                  pause_sending_turns, cooked_send, null_send);
+        if(buf || std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+        // The multicast group only gives up early if it is wedged or could not
+        // be created, so release the view lock and retry once the view changes
+        const int32_t old_vid = curr_view->vid;
+        view_change_cv.wait_until(lock, std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(derecho_params.timeout_ms)),
+                                  [&]() { return curr_view->vid != old_vid; });
+    }
+    if(wait_time_ns) {
+        *wait_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+    }
+    return buf;
+}
+
 void ViewManager::send(subgroup_id_t subgroup_num) {
     shared_lock_t lock(view_mutex);
     while(true) {
@@ -1113,11 +1517,73 @@ void ViewManager::send(subgroup_id_t subgroup_num) {
     }
 }
 
+void ViewManager::send_stream(subgroup_id_t subgroup_num, const char* data, long long unsigned int size,
+                              bool cooked_send) {
+    {
+        shared_lock_t lock(view_mutex);
+        for(const SubView& shard_view : curr_view->subgroup_shard_views.at(subgroup_num)) {
+            if(shard_view.mode == Mode::RAW) {
+                throw derecho_exception("Subgroup " + std::to_string(subgroup_num)
+                                        + " is unordered, so it can't be sent streams");
+            }
+        }
+    }
+    std::mutex* stream_send_mutex;
+    {
+        std::lock_guard<std::mutex> lock(stream_send_mutexes_mutex);
+        stream_send_mutex = &stream_send_mutexes[subgroup_num];
+    }
+    std::lock_guard<std::mutex> stream_lock(*stream_send_mutex);
+    const long long unsigned int fragment_size = derecho_params.max_payload_size;
+    long long unsigned int offset = 0;
+    do {
+        const long long unsigned int length = std::min(fragment_size, size - offset);
+        char* buf = wait_for_sendbuffer_ptr(subgroup_num, length, std::chrono::nanoseconds::max(),
+                                            nullptr, 0, cooked_send);
+        if(!buf) {
+            throw derecho_exception("Subgroup " + std::to_string(subgroup_num) + " can't send fragments");
+        }
+        Fragment& fragment = ((header*)(buf - sizeof(header)))->fragment;
+        if(length == size) {
+            fragment = Fragment::WHOLE;
+        } else if(offset == 0) {
+            fragment = Fragment::FIRST;
+        } else if(offset + length == size) {
+            fragment = Fragment::LAST;
+        } else {
+            fragment = Fragment::MIDDLE;
+        }
+        memcpy(buf, data + offset, length);
+        send(subgroup_num);
+        offset += length;
+    } while(offset < size);
+}
+
+std::shared_ptr<RawSendRing> ViewManager::get_raw_send_ring(subgroup_id_t subgroup_num) {
+    shared_lock_t lock(view_mutex);
+    return curr_view->multicast_group->get_raw_send_ring(subgroup_num);
+}
+
+void ViewManager::set_receive_allocator(subgroup_id_t subgroup_num, receive_allocator_t allocator) {
+    shared_lock_t lock(view_mutex);
+    curr_view->multicast_group->set_receive_allocator(subgroup_num, std::move(allocator));
+}
+
+void ViewManager::set_send_limit(subgroup_id_t subgroup_num, const SendLimit& limit) {
+    shared_lock_t lock(view_mutex);
+    curr_view->multicast_group->set_send_limit(subgroup_num, limit);
+}
+
 const uint64_t ViewManager::compute_global_stability_frontier(subgroup_id_t subgroup_num) {
     shared_lock_t lock(view_mutex);
     return curr_view->multicast_group->compute_global_stability_frontier(subgroup_num);
 }
 
+persistence_version_t ViewManager::compute_global_persistence_frontier(subgroup_id_t subgroup_num) {
+    shared_lock_t lock(view_mutex);
+    return curr_view->multicast_group->compute_global_persistence_frontier(subgroup_num);
+}
+
 void ViewManager::add_view_upcall(const view_upcall_t& upcall) {
     view_upcalls.emplace_back(upcall);
 }
@@ -1129,7 +1595,305 @@ std::vector<node_id_t> ViewManager::get_members() {
 
 void ViewManager::barrier_sync() {
     shared_lock_t read_lock(view_mutex);
-    curr_view->gmsSST->sync_with_members();
+    std::vector<uint32_t> rows(curr_view->num_members);
+    std::iota(rows.begin(), rows.end(), 0);
+    dissemination_barrier(rows, 0);
+}
+
+void ViewManager::barrier_sync(subgroup_id_t subgroup_num) {
+    shared_lock_t read_lock(view_mutex);
+    dissemination_barrier(my_shard_rows(subgroup_num), subgroup_num + 1);
+}
+
+std::vector<uint32_t> ViewManager::my_shard_rows(subgroup_id_t subgroup_num) const {
+    if(subgroup_num >= curr_view->subgroup_shard_views.size()) {
+        throw invalid_subgroup_exception("There is no subgroup with ID " + std::to_string(subgroup_num));
+    }
+    for(const SubView& shard_view : curr_view->subgroup_shard_views[subgroup_num]) {
+        if(shard_view.my_rank < 0) {
+            continue;
+        }
+        std::vector<uint32_t> rows;
+        for(const node_id_t member : shard_view.members) {
+            rows.push_back(curr_view->rank_of(member));
+        }
+        return rows;
+    }
+    throw invalid_subgroup_exception("This node is not a member of subgroup " + std::to_string(subgroup_num));
+}
+
+std::vector<std::pair<int64_t, bool>> ViewManager::allgather_word(subgroup_id_t subgroup_num, int64_t word) {
+    shared_lock_t read_lock(view_mutex);
+    const std::vector<uint32_t> rows = my_shard_rows(subgroup_num);
+    std::lock_guard<std::mutex> lock(collective_mutex);
+    DerechoSST& sst = *curr_view->gmsSST;
+    const uint32_t my_row = curr_view->my_rank;
+    const uint32_t base = subgroup_num * DerechoSST::collective_words_per_subgroup;
+    const int64_t round = std::max(sst.collective_words[my_row][base + 2],
+                                   sst.collective_words[my_row][base + 3])
+                          + 1;
+    const uint32_t word_index = base + round % 2;
+    const uint32_t round_index = base + 2 + round % 2;
+    gmssst::set(sst.collective_words[my_row][word_index], word);
+    gmssst::set(sst.collective_words[my_row][round_index], round);
+    // The word is written before the round number that says it is there
+    std::vector<uint32_t> others;
+    std::copy_if(rows.begin(), rows.end(), std::back_inserter(others),
+                 [my_row](uint32_t row) { return row != my_row; });
+    sst.put(others, (char*)std::addressof(sst.collective_words[0][word_index]) - sst.getBaseAddress(),
+            sizeof(int64_t));
+    sst.put(others, (char*)std::addressof(sst.collective_words[0][round_index]) - sst.getBaseAddress(),
+            sizeof(int64_t));
+
+    std::vector<std::pair<int64_t, bool>> words;
+    for(const uint32_t row : rows) {
+        while(sst.collective_words[row][round_index] < round && !sst.suspected[my_row][row]) {
+            // spin, like the barriers
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const bool arrived = sst.collective_words[row][round_index] >= round;
+        words.emplace_back(arrived ? (int64_t)sst.collective_words[row][word_index] : 0, arrived);
+    }
+    return words;
+}
+
+uint64_t ViewManager::try_lock(subgroup_id_t subgroup_num, uint32_t lock_index) {
+    shared_lock_t read_lock(view_mutex);
+    const std::vector<uint32_t> rows = my_shard_rows(subgroup_num);
+    if(lock_index >= DerechoSST::locks_per_subgroup) {
+        throw derecho_exception("Shards have only " + std::to_string(DerechoSST::locks_per_subgroup) + " locks");
+    }
+    DerechoSST& sst = *curr_view->gmsSST;
+    const long long int offset = (char*)std::addressof(sst.lock_words[0][subgroup_num * DerechoSST::locks_per_subgroup + lock_index])
+                                 - sst.getBaseAddress();
+    const uint64_t holder = curr_view->members[curr_view->my_rank] + 1ull;
+    const auto key = std::make_pair(subgroup_num, lock_index);
+    uint64_t expected = 0;
+    {
+        std::lock_guard<std::mutex> lock(free_lock_words_mutex);
+        if(free_lock_words_vid != curr_view->vid) {
+            free_lock_words.clear();
+            free_lock_words_vid = curr_view->vid;
+        }
+        auto word = free_lock_words.find(key);
+        if(word != free_lock_words.end()) {
+            expected = word->second;
+        }
+    }
+    while(true) {
+        const uint64_t acquisition = (expected >> 32) + 1;
+        const auto previous = sst.compare_and_swap(rows[0], offset, expected, (acquisition << 32) | holder);
+        if(!previous) {
+            throw derecho_exception("Could not reach the leader of this node's shard of subgroup "
+                                    + std::to_string(subgroup_num) + " to acquire its lock");
+        }
+        if(*previous == expected) {
+            std::lock_guard<std::mutex> lock(free_lock_words_mutex);
+            if(free_lock_words_vid == curr_view->vid) {
+                free_lock_words[key] = acquisition << 32;
+            }
+            return ((uint64_t)curr_view->vid << 32) | acquisition;
+        }
+        if(*previous & 0xffffffff) {
+            return 0;
+        }
+        // Others acquired and released it since this node last did, so it
+        // takes a second round trip
+        expected = *previous;
+    }
+}
+
+uint64_t ViewManager::lock(subgroup_id_t subgroup_num, uint32_t lock_index) {
+    std::chrono::microseconds backoff(1);
+    while(true) {
+        if(const uint64_t token = try_lock(subgroup_num, lock_index)) {
+            return token;
+        }
+        std::this_thread::sleep_for(backoff);
+        backoff = std::min(backoff * 2, std::chrono::microseconds(256));
+    }
+}
+
+bool ViewManager::unlock(subgroup_id_t subgroup_num, uint32_t lock_index, uint64_t token) {
+    shared_lock_t read_lock(view_mutex);
+    const std::vector<uint32_t> rows = my_shard_rows(subgroup_num);
+    if(lock_index >= DerechoSST::locks_per_subgroup) {
+        throw derecho_exception("Shards have only " + std::to_string(DerechoSST::locks_per_subgroup) + " locks");
+    }
+    if((int32_t)(token >> 32) != curr_view->vid) {
+        return false;
+    }
+    DerechoSST& sst = *curr_view->gmsSST;
+    const long long int offset = (char*)std::addressof(sst.lock_words[0][subgroup_num * DerechoSST::locks_per_subgroup + lock_index])
+                                 - sst.getBaseAddress();
+    const uint64_t acquisition = token & 0xffffffff;
+    const uint64_t holder = curr_view->members[curr_view->my_rank] + 1ull;
+    const auto previous = sst.compare_and_swap(rows[0], offset, (acquisition << 32) | holder, acquisition << 32);
+    if(!previous) {
+        throw derecho_exception("Could not reach the leader of this node's shard of subgroup "
+                                + std::to_string(subgroup_num) + " to release its lock");
+    }
+    return *previous == ((acquisition << 32) | holder);
+}
+
+bool ViewManager::checkpoint(const std::string& target_path, uint64_t cut_us) {
+    if(target_path.empty() || target_path.size() >= DerechoSST::max_checkpoint_target) {
+        throw derecho_exception("A checkpoint's target path must have 1 to "
+                                + std::to_string(DerechoSST::max_checkpoint_target - 1) + " characters");
+    }
+    std::lock_guard<std::mutex> checkpoint_lock(checkpoint_mutex);
+    int32_t vid;
+    std::vector<uint32_t> leader_rows;
+    {
+        shared_lock_t read_lock(view_mutex);
+        vid = curr_view->vid;
+        if(cut_us == 0 || (vid == last_checkpoint_vid && cut_us <= last_checkpoint_cut)) {
+            throw derecho_exception("A checkpoint's cut must be later than the last one this node asked for");
+        }
+        last_checkpoint_cut = cut_us;
+        last_checkpoint_vid = vid;
+        for(subgroup_id_t subgroup = 0; subgroup < curr_view->subgroup_shard_views.size(); ++subgroup) {
+            for(uint32_t shard = 0; shard < curr_view->subgroup_shard_views[subgroup].size(); ++shard) {
+                const int leader = curr_view->subview_rank_of_shard_leader(subgroup, shard);
+                if(leader >= 0) {
+                    leader_rows.push_back(curr_view->rank_of(
+                            curr_view->subgroup_shard_views[subgroup][shard].members[leader]));
+                }
+            }
+        }
+        std::sort(leader_rows.begin(), leader_rows.end());
+        leader_rows.erase(std::unique(leader_rows.begin(), leader_rows.end()), leader_rows.end());
+        DerechoSST& sst = *curr_view->gmsSST;
+        const uint32_t my_row = curr_view->my_rank;
+        gmssst::set(sst.checkpoint_target[my_row], target_path);
+        gmssst::set(sst.checkpoint_cut[my_row], cut_us);
+        // The target is written before the cut that says it is there
+        sst.put(sst.checkpoint_target.get_base() - sst.getBaseAddress(), DerechoSST::max_checkpoint_target);
+        sst.put((char*)std::addressof(sst.checkpoint_cut[0]) - sst.getBaseAddress(), sizeof(uint64_t));
+    }
+    logger->debug("Asked {} shard leaders for a checkpoint at {} in {}", leader_rows.size(), cut_us, target_path);
+
+    // The view lock is released between polls, since the view may have to
+    // change for the leaders to finish
+    while(true) {
+        {
+            shared_lock_t read_lock(view_mutex);
+            if(curr_view->vid != vid) {
+                logger->warn("The view changed before the checkpoint at {} finished", cut_us);
+                return false;
+            }
+            DerechoSST& sst = *curr_view->gmsSST;
+            const uint32_t my_row = curr_view->my_rank;
+            const bool all_done = std::all_of(leader_rows.begin(), leader_rows.end(), [&](uint32_t row) {
+                return sst.checkpoint_done[row][my_row] >= cut_us;
+            });
+            if(all_done) {
+                // Each leader writes whether it succeeded before that it is done
+                std::atomic_thread_fence(std::memory_order_acquire);
+                const bool all_ok = std::all_of(leader_rows.begin(), leader_rows.end(), [&](uint32_t row) {
+                    return sst.checkpoint_ok[row][my_row];
+                });
+                if(!all_ok) {
+                    logger->error("A shard leader could not copy its logs for the checkpoint at {}", cut_us);
+                }
+                return all_ok;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+void ViewManager::take_checkpoint(const CheckpointRequest& request) {
+    // Each shard is copied as soon as it is stable past the cut, while the
+    // others are still waiting or copying
+    auto copy_shard = [this, &request](subgroup_id_t subgroup, uint32_t shard) {
+        while(true) {
+            if(thread_shutdown) {
+                return false;
+            }
+            {
+                shared_lock_t read_lock(view_mutex);
+                if(curr_view->vid != request.vid) {
+                    return false;
+                }
+                if(curr_view->multicast_group->compute_global_stability_frontier(subgroup) / 1000 > request.cut_us) {
+                    break;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        // Holding the view lock keeps the subgroup's objects in place while
+        // their logs are copied, so a view change waits for the copy; new
+        // messages are delivered and logged meanwhile
+        shared_lock_t read_lock(view_mutex);
+        if(curr_view->vid != request.vid) {
+            return false;
+        }
+        const std::string shard_path = request.target_path + "/subgroup-" + std::to_string(subgroup)
+                                       + "-shard-" + std::to_string(shard);
+        try {
+            const persistence_version_t version = checkpoint_subgroup
+                                                          ? checkpoint_subgroup(subgroup, shard_path, request.cut_us)
+                                                          : -1;
+            logger->debug("Copied subgroup {} up to version {} into {}", subgroup, version, shard_path);
+            return true;
+        } catch(const std::exception& e) {
+            logger->error("Could not copy subgroup {} into {}: {}", subgroup, shard_path, e.what());
+        } catch(...) {
+            logger->error("Could not copy subgroup {} into {}", subgroup, shard_path);
+        }
+        return false;
+    };
+    if(!request.shards.empty()) {
+        // Every leader makes the target at once, so it is fine if it exists
+        mkdir(request.target_path.c_str(), 0700);
+    }
+    std::vector<std::future<bool>> copies;
+    for(const auto& shard : request.shards) {
+        copies.emplace_back(std::async(std::launch::async, copy_shard, shard.first, shard.second));
+    }
+    bool ok = true;
+    for(auto& copy : copies) {
+        ok = copy.get() && ok;
+    }
+
+    shared_lock_t read_lock(view_mutex);
+    if(curr_view->vid != request.vid) {
+        return;
+    }
+    DerechoSST& sst = *curr_view->gmsSST;
+    const uint32_t my_row = curr_view->my_rank;
+    const std::vector<uint32_t> requester{request.requester_row};
+    gmssst::set(sst.checkpoint_ok[my_row][request.requester_row], ok);
+    gmssst::set(sst.checkpoint_done[my_row][request.requester_row], request.cut_us);
+    sst.put(requester, (char*)std::addressof(sst.checkpoint_ok[0][request.requester_row]) - sst.getBaseAddress(),
+            sizeof(bool));
+    sst.put(requester, (char*)std::addressof(sst.checkpoint_done[0][request.requester_row]) - sst.getBaseAddress(),
+            sizeof(uint64_t));
+}
+
+void ViewManager::dissemination_barrier(const std::vector<uint32_t>& rows, uint32_t scope) {
+    // See the dissemination barrier of Hensgen, Finkel and Manber, which
+    // rdmc::barrier_group also uses, here over the SST's queue pairs
+    std::lock_guard<std::mutex> lock(barrier_mutex);
+    DerechoSST& sst = *curr_view->gmsSST;
+    const uint32_t my_row = curr_view->my_rank;
+    const uint32_t num_rows = rows.size();
+    const uint32_t position = std::find(rows.begin(), rows.end(), my_row) - rows.begin();
+    const uint32_t total_steps = DerechoSST::barrier_steps_per_scope(num_rows);
+    const uint32_t base = scope * DerechoSST::barrier_steps_per_scope(curr_view->num_members);
+    const int64_t number = sst.barrier_steps[my_row][base] + 1;
+    for(uint32_t m = 0; m < total_steps; ++m) {
+        const uint32_t target = rows[(position + (1u << m)) % num_rows];
+        const uint32_t source = rows[(position + num_rows - (1u << m) % num_rows) % num_rows];
+        gmssst::set(sst.barrier_steps[my_row][base + m], number);
+        sst.put(std::vector<uint32_t>{target},
+                (char*)std::addressof(sst.barrier_steps[0][base + m]) - sst.getBaseAddress(),
+                sizeof(int64_t));
+        while(sst.barrier_steps[source][base + m] < number && !sst.suspected[my_row][source]) {
+            // spin, like rdmc::barrier_group
+        }
+    }
 }
 
 SharedLockedReference<View> ViewManager::get_current_view() {
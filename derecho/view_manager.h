@@ -5,8 +5,13 @@
  */
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <experimental/optional>
 #include <map>
 #include <mutex>
+#include <queue>
+#include <set>
 #include <shared_mutex>
 #include <string>
 #include <thread>
@@ -69,6 +74,7 @@ private:
     using pred_handle = sst::Predicates<DerechoSST>::pred_handle;
 
     using send_object_upcall_t = std::function<void(subgroup_id_t, node_id_t)>;
+    using checkpoint_upcall_t = std::function<persistence_version_t(subgroup_id_t, const std::string&, uint64_t)>;
     using initialize_rpc_objects_t = std::function<void(node_id_t, const View&, const std::vector<std::vector<int64_t>>&)>;
 
     //Allow RPCManager and Replicated to access curr_view and view_mutex directly
@@ -97,15 +103,75 @@ private:
     /** May hold a pointer to the partially-constructed next view, if we are
      *  in the process of transitioning to a new view. */
     std::unique_ptr<View> next_view;
+    /** The subgroup maps MulticastGroup's constructor needs for next_view,
+     * computed along with next_view's subgroup layout when the view change
+     * starts, so that the subgroups it changes are known before the
+     * current view is wedged. */
+    struct SubgroupMaps {
+        SubgroupMap<std::pair<uint32_t, uint32_t>> subgroup_to_shard_and_rank;
+        SubgroupMap<std::pair<std::vector<int>, int>> subgroup_to_senders_and_sender_rank;
+        SubgroupMap<uint32_t> subgroup_to_num_received_offset;
+        SubgroupMap<std::vector<node_id_t>> subgroup_to_membership;
+        SubgroupMap<Mode> subgroup_to_mode;
+        uint32_t num_received_size = 0;
+    } next_view_maps;
 
     /** Contains client sockets for pending joins that have not yet been handled.*/
     LockedQueue<tcp::socket> pending_join_sockets;
+    /** How long the leader waits after noticing a join for more clients to
+     * connect, so that nodes starting together join in one view change. */
+    static constexpr std::chrono::milliseconds join_batch_window{10};
+    /** When the leader noticed the oldest join it has not yet proposed, if
+     * any. Only used by the SST predicate thread. */
+    std::experimental::optional<std::chrono::steady_clock::time_point> first_pending_join_time;
+    /** When this node started the current view change, by metrics::now_ns().
+     * Only used by the SST predicate thread. */
+    uint64_t view_change_start_ns = 0;
 
     /** Contains old Views that need to be cleaned up*/
     std::queue<std::unique_ptr<View>> old_views;
     std::mutex old_views_mutex;
     std::condition_variable old_views_cv;
 
+    /** Held by the thread in a barrier, since a barrier's steps in the SST
+     * can only be used by one of them at a time */
+    std::mutex barrier_mutex;
+    /** Held by the thread in a collective, for the same reason */
+    std::mutex collective_mutex;
+    /** The last value seen of each free shard lock word, by subgroup ID and
+     * lock index, which an acquire expects to find; only for the view with
+     * ID free_lock_words_vid, since every view's words start at 0. */
+    std::map<std::pair<subgroup_id_t, uint32_t>, uint64_t> free_lock_words;
+    int32_t free_lock_words_vid = -1;
+    std::mutex free_lock_words_mutex;
+
+    /** A checkpoint some member asked for, which this node takes of the
+     * shards it leads on checkpoint_thread. */
+    struct CheckpointRequest {
+        int32_t vid;
+        uint32_t requester_row;
+        uint64_t cut_us;
+        std::string target_path;
+        /** The subgroups and shard numbers this node leads */
+        std::vector<std::pair<subgroup_id_t, uint32_t>> shards;
+    };
+    /** The checkpoint_cut of each row that has already been queued in this
+     * view, which the checkpoint predicate compares the SST against. */
+    std::vector<uint64_t> handled_checkpoint_cuts;
+    std::queue<CheckpointRequest> checkpoint_requests;
+    std::mutex checkpoint_requests_mutex;
+    std::condition_variable checkpoint_requests_cv;
+    /** The last cut this node asked for and the view it asked in, since a
+     * member's cuts must increase for as long as its row lasts. */
+    uint64_t last_checkpoint_cut = 0;
+    int32_t last_checkpoint_vid = -1;
+    std::mutex checkpoint_mutex;
+    /** Held by the thread sending a stream in a subgroup, by subgroup ID,
+     * since receivers put a sender's fragments together in the order they
+     * arrive and so can't tell two of its streams apart */
+    std::map<subgroup_id_t, std::mutex> stream_send_mutexes;
+    std::mutex stream_send_mutexes_mutex;
+
     /** The sockets connected to clients that will join in the next view, if any */
     std::list<tcp::socket> proposed_join_sockets;
     /** The node ID that has been assigned to the client that is currently joining, if any. */
@@ -120,6 +186,10 @@ private:
     /** The background thread that listens for clients connecting on our server socket. */
     std::thread client_listener_thread;
     std::thread old_view_cleanup_thread;
+    /** The background thread that takes the checkpoints other members ask
+     * for, so that waiting for a shard to reach the cut never blocks the
+     * predicate thread. */
+    std::thread checkpoint_thread;
 
     //Handles for all the predicates the GMS registered with the current view's SST.
     pred_handle suspected_changed_handle;
@@ -127,9 +197,13 @@ private:
     pred_handle change_commit_ready_handle;
     pred_handle leader_proposed_handle;
     pred_handle leader_committed_handle;
+    pred_handle checkpoint_requested_handle;
 
     /** Name of the file to use to persist the current view to disk. */
     std::string view_file_name;
+    /** Writes each new view to view_file_name in the background, so that
+     * view changes don't wait for the disk. */
+    persistence::SavedObjectWriter view_writer;
 
     /** Functions to be called whenever the view changes, to report the
      * new view to some other component. */
@@ -146,6 +220,10 @@ private:
      * after transitioning to a new view, in the case where the previous
      * view was inadequately provisioned. */
     initialize_rpc_objects_t initialize_subgroup_objects;
+    /** A function that will be called to copy a subgroup's persistent logs,
+     * up to a cut in microseconds, into a directory, returning the last
+     * version it copied. */
+    checkpoint_upcall_t checkpoint_subgroup;
 
     /** Sends a joining node the new view that has been constructed to include it.*/
     void commit_join(const View& new_view,
@@ -153,7 +231,12 @@ private:
 
     bool has_pending_join() { return pending_join_sockets.locked().access.size() > 0; }
 
-    /** Assuming this node is the leader, handles a join request from a client.*/
+    /** @return The number of changes that can still be proposed in the current view. */
+    int room_for_changes(const DerechoSST& gmsSST) const;
+
+    /** Assuming this node is the leader, handles a join request from a client
+     * by proposing a change to add it. The caller must make sure there is
+     * room for the change, and then wedge the view and push the proposals. */
     void receive_join(tcp::socket& client_socket);
 
     /** Helper for joining an existing group; receives the View and parameters from the leader. */
@@ -182,11 +265,18 @@ private:
     void create_threads();
     /** Constructor helper method to encapsulate creating all the predicates. */
     void register_predicates();
+    /** Waits for each shard in request to be stable past its cut, copies the
+     * shard's logs, and reports to the requester; runs on checkpoint_thread. */
+    void take_checkpoint(const CheckpointRequest& request);
     /** Constructor helper called when creating a new group; waits for a new
      * member to join, then sends it the view. */
     void await_second_member(const node_id_t my_id);
     /** Performs one-time global initialization of RDMC and SST, using the current view's membership. */
     void initialize_rdmc_sst();
+    /** Exchanges DerechoParams::warm_up_rounds full rows of a new view's SST
+     * with all its members, so that the NICs have translated the tables
+     * before the view is reported ready. */
+    void warm_up(DerechoSST& gmsSST);
 
     /** Creates the SST and MulticastGroup for the current view, using the current view's member list.
      * The parameters are all the possible parameters for constructing MulticastGroup. */
@@ -200,11 +290,14 @@ private:
      * this information. */
     uint32_t make_subgroup_maps(const std::unique_ptr<View>& prev_view,
                                 View& curr_view,
-                                std::map<subgroup_id_t, std::pair<uint32_t, uint32_t>>& subgroup_to_shard_n_index,
-                                std::map<subgroup_id_t, std::pair<std::vector<int>, int>>& subgroup_to_senders_n_sender_index,
-                                std::map<subgroup_id_t, uint32_t>& subgroup_to_num_received_offset,
-                                std::map<subgroup_id_t, std::vector<node_id_t>>& subgroup_to_membership,
-                                std::map<subgroup_id_t, Mode>& subgroup_to_mode);
+                                SubgroupMap<std::pair<uint32_t, uint32_t>>& subgroup_to_shard_n_index,
+                                SubgroupMap<std::pair<std::vector<int>, int>>& subgroup_to_senders_n_sender_index,
+                                SubgroupMap<uint32_t>& subgroup_to_num_received_offset,
+                                SubgroupMap<std::vector<node_id_t>>& subgroup_to_membership,
+                                SubgroupMap<Mode>& subgroup_to_mode);
+    /** @return The IDs, in a View whose subgroups have been laid out, of the
+     * subgroups of SubgroupInfo::latency_critical_types */
+    std::set<subgroup_id_t> latency_critical_subgroups(const View& view) const;
 
     /** The persistence request func is from persistence manager*/
     persistence_manager_callbacks_t persistence_manager_callbacks;
@@ -213,9 +306,31 @@ private:
     static std::map<node_id_t, ip_addr> make_member_ips_map(const View& view);
 
     static std::map<std::type_index, std::vector<std::vector<int64_t>>> make_shard_leaders_map(const View& view);
+    /** @return The shard layout of each subgroup type in the last adequately
+     * provisioned View up to this one, in membership function order, for
+     * View::previous_shard_layouts of the next View. */
+    std::vector<subgroup_shard_layout_t> make_previous_shard_layouts(const View& view) const;
+    /** @return The IDs, in curr_view, of the subgroups whose shard members or
+     * senders differ in next_view; every subgroup if either view is
+     * inadequately provisioned. */
+    static std::set<subgroup_id_t> subgroups_changed_by(const View& curr_view, const View& next_view);
     static std::vector<std::vector<int64_t>> translate_types_to_ids(
             const std::map<std::type_index, std::vector<std::vector<int64_t>>>& old_shard_leaders_by_type,
             const View& new_view);
+    /**
+     * Waits at a dissemination barrier among some rows of the current view's
+     * SST, which takes the ceiling of log2(rows.size()) steps. In step m,
+     * this member writes its barrier number to the member 2^m positions after
+     * it in rows, and waits for the one 2^m positions before it, unless that
+     * one is suspected. The caller holds a read lock on view_mutex.
+     * @param rows The SST rows of the members of the barrier, this one among them
+     * @param scope Which block of DerechoSST::barrier_steps the barrier uses
+     */
+    void dissemination_barrier(const std::vector<uint32_t>& rows, uint32_t scope);
+    /** @return The SST rows of the members of this node's shard of the
+     * subgroup, in shard rank order. The caller holds a read lock on view_mutex.
+     * @throws invalid_subgroup_exception if this node is not in the subgroup */
+    std::vector<uint32_t> my_shard_rows(subgroup_id_t subgroup_num) const;
 
 
 public:
@@ -295,6 +410,28 @@ public:
                 std::vector<view_upcall_t> _view_upcalls = {},
                 const int gms_port = derecho_gms_port);
 
+    /**
+     * Constructor for starting a new group from a membership that every
+     * member is given, instead of having each member join the leader in
+     * turn. All the members must be started with the same members,
+     * member_ips, subgroup_info and derecho_params; they connect to each
+     * other at once and install view 0 together in start(). Nodes that join
+     * later use the joining constructor as usual.
+     * @param my_id The node ID of this node, which must be one of members
+     * @param members The IDs of the members of view 0, in rank order; the
+     * first is the leader
+     * @param member_ips The IP addresses of the members, in the same order
+     */
+    ViewManager(const node_id_t my_id,
+                const std::vector<node_id_t>& members,
+                const std::vector<ip_addr>& member_ips,
+                CallbackSet callbacks,
+                const SubgroupInfo& subgroup_info,
+                const DerechoParams& derecho_params,
+                const persistence_manager_callbacks_t & _persistence_manager_callbacks,
+                std::vector<view_upcall_t> _view_upcalls = {},
+                const int gms_port = derecho_gms_port);
+
     ~ViewManager();
 
     /** Finishes initializing the ViewManager and starts the GMS (i.e. starts evaluating predicates). */
@@ -311,12 +448,58 @@ public:
     char* get_sendbuffer_ptr(subgroup_id_t subgroup_num, long long unsigned int payload_size,
 			     int pause_sending_turns = 0, bool cooked_send = false,
 			     bool null_send = false);
+    /**
+     * Blocking version of get_sendbuffer_ptr: if the send window is full,
+     * the calling thread sleeps until the window advances rather than
+     * spinning. Waiting continues across view changes.
+     * @param timeout The maximum amount of time to wait; the default waits
+     * until a buffer is available
+     * @param wait_time_ns If not null, set to the number of nanoseconds the
+     * caller spent waiting for the buffer
+     * @return A pointer into the send buffer, or nullptr if the timeout
+     * expired before a buffer became available
+     */
+    char* wait_for_sendbuffer_ptr(subgroup_id_t subgroup_num, long long unsigned int payload_size,
+                                  std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max(),
+                                  uint64_t* wait_time_ns = nullptr,
+                                  int pause_sending_turns = 0, bool cooked_send = false,
+                                  bool null_send = false);
     /** Instructs the managed DerechoGroup's to send the next message. This
      * returns immediately; the send is scheduled to happen some time in the future. */
     void send(subgroup_id_t subgroup_num);
+    /**
+     * Multicasts an object that may be larger than max_payload_size. An
+     * object that fits is sent as one message; a larger one is sent as a
+     * stream of messages of up to max_payload_size bytes each, and the
+     * members put it back together and deliver it once, as if it had been
+     * one message, when its last fragment is delivered. Fragments that were
+     * sent but not delivered when the view changes are sent again in the
+     * next view, like other messages, so the stream carries on there. A
+     * member that joins while an object is being streamed doesn't deliver
+     * that object. Blocks until every fragment has been handed to the
+     * multicast group, waiting for the window as wait_for_sendbuffer_ptr
+     * does; only one stream is sent at a time in each subgroup.
+     * @throws derecho_exception if the subgroup is in Mode::RAW, which
+     * doesn't keep a sender's messages in order
+     */
+    void send_stream(subgroup_id_t subgroup_num, const char* data, long long unsigned int size,
+                     bool cooked_send = false);
+    /** @return The current view's RawSendRing for a raw subgroup, or null if
+     * it sends without one in this view */
+    std::shared_ptr<RawSendRing> get_raw_send_ring(subgroup_id_t subgroup_num);
+    /** Sets the receive allocator of a subgroup; see MulticastGroup::set_receive_allocator */
+    void set_receive_allocator(subgroup_id_t subgroup_num, receive_allocator_t allocator);
+    /** Sets the send limit of a subgroup; see MulticastGroup::set_send_limit */
+    void set_send_limit(subgroup_id_t subgroup_num, const SendLimit& limit);
+    /** @return True if raw subgroups send through RawSendRings */
+    bool uses_raw_send_rings() const { return derecho_params.raw_send_rings; }
 
     const uint64_t compute_global_stability_frontier(subgroup_id_t subgroup_num);
 
+    /** @return The latest version that every member of this node's shard of
+     * the subgroup has persisted */
+    persistence_version_t compute_global_persistence_frontier(subgroup_id_t subgroup_num);
+
     /**
      * @return a reference to the current View, wrapped in a container that
      * holds a read-lock on it. This is mostly here to make it easier for
@@ -332,6 +515,63 @@ public:
     void report_failure(const node_id_t who);
     /** Waits until all members of the group have called this function. */
     void barrier_sync();
+    /** Waits until all members of this node's shard of the subgroup have
+     * called this function for it, without involving the rest of the group.
+     * @throws invalid_subgroup_exception if this node is not in the subgroup */
+    void barrier_sync(subgroup_id_t subgroup_num);
+    /**
+     * Exchanges a word with every member of this node's shard of the
+     * subgroup, through the SST: each member writes its word to the others
+     * and waits for theirs. A member that is suspected before its word
+     * arrives is left out.
+     * @return The words, indexed by shard rank, and for each whether it arrived
+     * @throws invalid_subgroup_exception if this node is not in the subgroup
+     */
+    std::vector<std::pair<int64_t, bool>> allgather_word(subgroup_id_t subgroup_num, int64_t word);
+
+    /**
+     * Tries to acquire one of the locks of this node's shard of the
+     * subgroup, with an RDMA compare-and-swap on the lock's word in the row
+     * of the shard's leader, so an uncontended acquire takes one round trip.
+     * The lock is held until it is released or the view changes, since every
+     * view starts with its locks free. A resource the lock guards should
+     * check the fencing token, so that a holder whose view has ended can't
+     * use it after the lock's next holder.
+     * @param lock_index Which of the shard's DerechoSST::locks_per_subgroup locks
+     * @return The fencing token of this acquisition, which is greater for
+     * every later acquisition of the lock, in this view or a later one, or 0
+     * if another member holds the lock
+     * @throws invalid_subgroup_exception if this node is not in the subgroup
+     * @throws derecho_exception if there is no such lock, or the leader
+     * could not be reached
+     */
+    uint64_t try_lock(subgroup_id_t subgroup_num, uint32_t lock_index);
+    /** Acquires a lock like try_lock, waiting for the member that holds it
+     * to release it or for the view to change. */
+    uint64_t lock(subgroup_id_t subgroup_num, uint32_t lock_index);
+    /**
+     * Releases a lock acquired with try_lock or lock, with one RDMA
+     * compare-and-swap.
+     * @param token The fencing token of the acquisition
+     * @return False if the lock was already released, since a new view had started
+     */
+    bool unlock(subgroup_id_t subgroup_num, uint32_t lock_index, uint64_t token);
+
+    /**
+     * Takes a checkpoint of every shard of every subgroup that is mutually
+     * consistent at a cut in time, without pausing the group. The leader of
+     * each shard waits until the shard is stable past the cut, then copies
+     * its persistent logs up to the cut into target_path while it goes on
+     * delivering messages; the shards do this at the same time.
+     * @param target_path A directory that names the same place on every
+     * member, such as one on a shared file system
+     * @param cut_us The cut, in microseconds of the clock the message
+     * timestamps use; it must be later than this node's last cut in the view
+     * @return True once every shard leader has copied its logs, or false if
+     * any of them failed or the view changed first, when the caller should
+     * take the checkpoint again
+     */
+    bool checkpoint(const std::string& target_path, uint64_t cut_us);
 
     void register_send_object_upcall(send_object_upcall_t upcall) {
         send_subgroup_object = std::move(upcall);
@@ -341,6 +581,10 @@ public:
         initialize_subgroup_objects = std::move(upcall);
     }
 
+    void register_checkpoint_upcall(checkpoint_upcall_t upcall) {
+        checkpoint_subgroup = std::move(upcall);
+    }
+
     void debug_print_status() const;
 };
 
@@ -0,0 +1,86 @@
+/**
+ * @file window_controller.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace derecho {
+
+/**
+ * Sets how many of its own messages a node may have in flight in a subgroup,
+ * within the window_size that the buffers and SST slots are allocated for.
+ * With adaptation on, the window starts at the largest size and moves by one
+ * message at a time, at most once per adjust_interval observations: it grows
+ * when a send had to wait for the window while the shard kept up with its
+ * deliveries, which means the window, not the receivers, was the limit, and
+ * it shrinks when the shard's members have received more of each sender's
+ * messages than half the window without delivering them yet, since a larger
+ * window then only queues more messages at slow receivers. Observations come
+ * from senders, so the state is all atomics.
+ */
+class WindowController {
+public:
+    /** The number of observations between adjustments of the window */
+    static constexpr uint32_t adjust_interval = 64;
+
+private:
+    uint32_t min_window = 1;
+    uint32_t max_window = 1;
+    bool adaptive = false;
+    std::atomic<uint32_t> current{1};
+    std::atomic<uint32_t> observations{0};
+    /** Set when a send has waited for the window since the last adjustment */
+    std::atomic<bool> stalled{false};
+
+public:
+    /**
+     * @param min_size The smallest the window may get
+     * @param max_size The window that buffers are allocated for
+     * @param adapt True if the window should adapt, false to always use max_size
+     */
+    void configure(uint32_t min_size, uint32_t max_size, bool adapt) {
+        max_window = max_size;
+        min_window = min_size < 1 ? 1 : (min_size > max_size ? max_size : min_size);
+        adaptive = adapt;
+        current = max_size;
+    }
+
+    /** @return The number of this node's messages that may be in flight */
+    uint32_t window() const {
+        return current.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Records what a sender saw when it asked for a send buffer, and adjusts
+     * the window every adjust_interval calls.
+     * @param delivery_backlog The most messages of each sender that some
+     * shard member has received but not yet delivered
+     * @param window_full True if the send had to wait for the window
+     */
+    void observe(long long int delivery_backlog, bool window_full) {
+        if(!adaptive) {
+            return;
+        }
+        if(window_full) {
+            stalled.store(true, std::memory_order_relaxed);
+        }
+        if(observations.fetch_add(1, std::memory_order_relaxed) % adjust_interval != adjust_interval - 1) {
+            return;
+        }
+        const uint32_t size = current.load(std::memory_order_relaxed);
+        if(2 * delivery_backlog > size) {
+            if(size > min_window) {
+                current.store(size - 1, std::memory_order_relaxed);
+            }
+        } else if(stalled.load(std::memory_order_relaxed) && size < max_window) {
+            current.store(size + 1, std::memory_order_relaxed);
+        }
+        stalled.store(false, std::memory_order_relaxed);
+    }
+};
+}  // namespace derecho
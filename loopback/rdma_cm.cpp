@@ -0,0 +1,66 @@
+/**
+ * @file rdma_cm.cpp
+ * The RDMA connection manager calls that the SST's UD multicast makes. The
+ * loopback device has no unreliable datagram queue pairs or multicast
+ * groups, so they all fail, and the SST falls back on sending to each
+ * member over its reliable queue pair.
+ *
+ * @date Oct 14, 2026
+ */
+
+#include <cerrno>
+
+#include <rdma/rdma_cma.h>
+
+extern "C" {
+
+struct rdma_event_channel* rdma_create_event_channel(void) {
+    errno = ENOSYS;
+    return nullptr;
+}
+
+void rdma_destroy_event_channel(struct rdma_event_channel* channel) {}
+
+int rdma_create_id(struct rdma_event_channel* channel, struct rdma_cm_id** id, void* context,
+                   enum rdma_port_space ps) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int rdma_destroy_id(struct rdma_cm_id* id) {
+    return 0;
+}
+
+int rdma_bind_addr(struct rdma_cm_id* id, struct sockaddr* addr) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int rdma_create_qp(struct rdma_cm_id* id, struct ibv_pd* pd, struct ibv_qp_init_attr* qp_init_attr) {
+    errno = ENOSYS;
+    return -1;
+}
+
+void rdma_destroy_qp(struct rdma_cm_id* id) {}
+
+int rdma_join_multicast(struct rdma_cm_id* id, struct sockaddr* addr, void* context) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int rdma_leave_multicast(struct rdma_cm_id* id, struct sockaddr* addr) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int rdma_get_cm_event(struct rdma_event_channel* channel, struct rdma_cm_event** event) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int rdma_ack_cm_event(struct rdma_cm_event* event) {
+    errno = ENOSYS;
+    return -1;
+}
+
+}  // extern "C"
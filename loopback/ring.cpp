@@ -0,0 +1,154 @@
+#include "ring.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace loopback {
+
+namespace {
+/** Comes before every record; a padding record's payload is no_payload. */
+struct record_header {
+    uint32_t size;
+    uint32_t payload;
+};
+const uint32_t no_payload = UINT32_MAX;
+
+uint64_t record_size(uint32_t payload) {
+    return (sizeof(record_header) + payload + 7) & ~uint64_t(7);
+}
+}  // namespace
+
+ring::~ring() {
+    close();
+}
+
+bool ring::create(const std::string& name, uint64_t capacity) {
+    close();
+    capacity = (capacity + 7) & ~uint64_t(7);
+    // A ring by this name is left over from a process that had this one's
+    // LID and died without destroying its queue pairs
+    shm_unlink(name.c_str());
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0) {
+        return false;
+    }
+    const size_t size = sizeof(ring_header) + capacity;
+    void* addr = ftruncate(fd, size) == 0
+                         ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                         : MAP_FAILED;
+    ::close(fd);
+    if(addr == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return false;
+    }
+    // The new object is all zeros, which is an empty, open ring
+    header = static_cast<ring_header*>(addr);
+    header->capacity = capacity;
+    header->owner_pid = getpid();
+    data = static_cast<char*>(addr) + sizeof(ring_header);
+    mapped_size = size;
+    this->name = name;
+    owner = true;
+    return true;
+}
+
+bool ring::open(const std::string& name) {
+    close();
+    const int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if(fd < 0) {
+        return false;
+    }
+    struct stat st;
+    void* addr = fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(ring_header)
+                         ? mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                         : MAP_FAILED;
+    ::close(fd);
+    if(addr == MAP_FAILED) {
+        return false;
+    }
+    header = static_cast<ring_header*>(addr);
+    data = static_cast<char*>(addr) + sizeof(ring_header);
+    mapped_size = st.st_size;
+    this->name = name;
+    owner = false;
+    return true;
+}
+
+void ring::close() {
+    if(!header) {
+        return;
+    }
+    if(owner) {
+        header->closed.store(1, std::memory_order_release);
+        shm_unlink(name.c_str());
+    }
+    munmap(header, mapped_size);
+    header = nullptr;
+    data = nullptr;
+    mapped_size = 0;
+    pending = 0;
+}
+
+uint64_t ring::max_record_size() const {
+    // Half the ring, so that a record fits whatever padding it needs
+    return header->capacity / 2 - sizeof(record_header);
+}
+
+void* ring::begin_write(uint32_t size) {
+    const uint64_t capacity = header->capacity;
+    const uint64_t total = record_size(size);
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    const uint64_t head = header->head.load(std::memory_order_acquire);
+    uint64_t offset = tail % capacity;
+    if(total > capacity - offset) {
+        const uint64_t skipped = capacity - offset;
+        if(tail - head + skipped + total > capacity) {
+            return nullptr;
+        }
+        record_header* padding = reinterpret_cast<record_header*>(data + offset);
+        padding->size = skipped;
+        padding->payload = no_payload;
+        tail += skipped;
+        header->tail.store(tail, std::memory_order_release);
+        offset = 0;
+    } else if(tail - head + total > capacity) {
+        return nullptr;
+    }
+    record_header* record = reinterpret_cast<record_header*>(data + offset);
+    record->size = total;
+    record->payload = size;
+    pending = total;
+    return record + 1;
+}
+
+void ring::end_write() {
+    const uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    header->tail.store(tail + pending, std::memory_order_release);
+    pending = 0;
+}
+
+const void* ring::begin_read(uint32_t& size) {
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    while(head != header->tail.load(std::memory_order_acquire)) {
+        const record_header* record = reinterpret_cast<const record_header*>(data + head % header->capacity);
+        if(record->payload == no_payload) {
+            head += record->size;
+            header->head.store(head, std::memory_order_release);
+            continue;
+        }
+        size = record->payload;
+        pending = record->size;
+        return record + 1;
+    }
+    return nullptr;
+}
+
+void ring::end_read() {
+    const uint64_t head = header->head.load(std::memory_order_relaxed);
+    header->head.store(head + pending, std::memory_order_release);
+    pending = 0;
+}
+
+}  // namespace loopback
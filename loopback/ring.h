@@ -0,0 +1,79 @@
+/**
+ * @file ring.h
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace loopback {
+
+/**
+ * The start of a ring's shared memory object; the ring's data follows it.
+ * The head and tail count every byte ever read and written, so the ring is
+ * full when they are a capacity apart, and each is written by one side only.
+ */
+struct ring_header {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) uint64_t capacity;
+    /** The process that created the ring and reads from it */
+    int32_t owner_pid;
+    /** Set by the owner when it stops reading, e.g. its queue pair is destroyed */
+    std::atomic<uint32_t> closed;
+};
+
+/**
+ * A single-producer, single-consumer ring of variable-sized records in a
+ * POSIX shared memory object, which is how the queue pairs of two processes
+ * on one host reach each other. The process that creates the ring reads it;
+ * the one that opens it by name writes to it. A record is never split across
+ * the end of the ring: when it doesn't fit there, the rest of the ring is
+ * skipped with a padding record.
+ */
+class ring {
+    ring_header* header = nullptr;
+    char* data = nullptr;
+    size_t mapped_size = 0;
+    std::string name;
+    bool owner = false;
+    /** The size, with its record header, of the record being written or read */
+    uint64_t pending = 0;
+
+public:
+    ring() = default;
+    ring(const ring&) = delete;
+    ring& operator=(const ring&) = delete;
+    ~ring();
+
+    /** Creates the shared memory object and maps it, replacing any stale one by that name. */
+    bool create(const std::string& name, uint64_t capacity);
+    /** Maps a ring another process created. */
+    bool open(const std::string& name);
+    /** Unmaps the ring, and removes its name if this process created it. */
+    void close();
+    bool is_open() const { return header != nullptr; }
+    ring_header* get_header() const { return header; }
+    /** The largest record that always fits, once the ring has been drained */
+    uint64_t max_record_size() const;
+
+    /**
+     * @return Where to write a record of size bytes, or nullptr if the ring
+     * has no room for it yet. The record is published by end_write().
+     */
+    void* begin_write(uint32_t size);
+    void end_write();
+
+    /**
+     * @return The next record, and its size, or nullptr if there is none.
+     * The record stays in the ring until end_read().
+     */
+    const void* begin_read(uint32_t& size);
+    void end_read();
+};
+
+}  // namespace loopback
@@ -0,0 +1,1287 @@
+/**
+ * @file verbs.cpp
+ * A verbs provider that needs no RDMA hardware: it implements the subset of
+ * libibverbs that the SST and RDMC use, and connects reliable queue pairs of
+ * processes on the same host through rings in shared memory. A progress
+ * thread in each process plays the part of the NIC, carrying out the work
+ * requests posted to the queue pairs, applying the writes, reads and sends
+ * that arrive from the other end, and acknowledging them, so completions
+ * mean what they do on a real device: a write is complete once it has been
+ * placed in the remote memory. Latency and bandwidth can be injected with
+ * DERECHO_LOOPBACK_LATENCY_US and DERECHO_LOOPBACK_BANDWIDTH_GBPS, which
+ * delay each packet as a link of that latency and bandwidth would.
+ *
+ * @date Oct 14, 2026
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <infiniband/verbs.h>
+}
+
+#include "ring.h"
+
+// Newer headers wrap these in inline functions that call the ones below
+#ifdef ibv_query_port
+#undef ibv_query_port
+#define LOOPBACK_COMPAT_QUERY_PORT
+#endif
+#ifdef ibv_reg_mr
+#undef ibv_reg_mr
+#endif
+#ifdef ibv_get_device_list
+#undef ibv_get_device_list
+#endif
+
+namespace loopback {
+
+namespace {
+
+/** The one port of the device, with a LID unique among the processes on the host */
+const uint8_t port_num = 1;
+const uint32_t max_inline_data = 1024;
+/** Messages are cut into packets of at most this much data */
+const uint32_t max_fragment_size = 64 * 1024;
+/** How much one queue pair may send each time the progress thread gets to it */
+const uint64_t max_bytes_per_turn = 256 * 1024;
+const int max_packets_per_turn = 64;
+/** How often a queue pair waiting on its peer checks that the peer is still there */
+const uint64_t peer_check_interval_ns = 100 * 1000 * 1000;
+/** How long the progress thread spins without work before it starts sleeping */
+const uint64_t spin_before_sleep_ns = 10 * 1000 * 1000;
+
+enum packet_type : uint8_t {
+    send_packet = 1,
+    write_packet,
+    read_request_packet,
+    read_response_packet,
+    ack_packet,
+    nak_packet
+};
+enum packet_flags : uint8_t {
+    first_fragment = 1,
+    last_fragment = 2,
+    with_immediate = 4
+};
+
+/** Each record in a ring is a packet, and the packet's data follows it. */
+struct packet {
+    /** When the packet reaches the other end, in CLOCK_MONOTONIC nanoseconds */
+    uint64_t deliver_at;
+    /** The number of the message on its queue pair, which responses refer to */
+    uint64_t sequence;
+    uint64_t remote_addr;
+    /** Where this packet's data starts in the message */
+    uint32_t offset;
+    /** The length of the whole message */
+    uint32_t length;
+    uint32_t rkey;
+    uint32_t imm_data;
+    uint8_t type;
+    uint8_t flags;
+    /** For a NAK, the status the request completes with */
+    uint8_t status;
+    uint8_t reserved[5];
+};
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct recv_request {
+    uint64_t wr_id;
+    std::vector<ibv_sge> sges;
+};
+
+struct send_request {
+    uint64_t wr_id;
+    ibv_wr_opcode opcode;
+    bool signaled;
+    uint32_t imm_data;
+    uint64_t remote_addr;
+    uint32_t rkey;
+    std::vector<ibv_sge> sges;
+    /** The data of an inline request, copied when it was posted */
+    std::vector<char> inline_data;
+    uint32_t length;
+    uint64_t sequence;
+    /** How much of the message has been put in the peer's ring */
+    uint32_t sent;
+};
+
+/** An ACK or NAK, or the data of a read, going back to the requester */
+struct response {
+    packet header;
+    const char* data;
+    uint32_t sent;
+};
+
+struct lb_context : ibv_context {};
+
+struct lb_comp_channel : ibv_comp_channel {
+    /** The other end of the pipe whose read end is fd; each event is a CQ pointer */
+    int write_fd;
+};
+
+struct lb_cq : ibv_cq {
+    std::mutex cq_mutex;
+    std::deque<ibv_wc> entries;
+    bool armed;
+};
+
+struct lb_srq : ibv_srq {
+    std::mutex srq_mutex;
+    std::deque<recv_request> recvs;
+    uint32_t max_wr;
+};
+
+struct lb_mr : ibv_mr {
+    uint64_t iova;
+    int access;
+};
+
+struct lb_qp : ibv_qp {
+    /** Guards everything below; the progress thread holds it while it works on the queue pair */
+    std::mutex qp_mutex;
+    bool sq_sig_all;
+    uint32_t max_send_wr;
+    uint32_t max_recv_wr;
+    uint32_t max_inline;
+    /** What the peer sends this queue pair */
+    ring inbound;
+    /** The peer's inbound ring, mapped when the queue pair becomes ready to receive */
+    ring outbound;
+    uint16_t dlid;
+    uint32_t dest_qp_num;
+    bool error;
+    uint64_t next_sequence;
+    /** Requests not yet entirely in the peer's ring, oldest first */
+    std::deque<send_request> to_send;
+    /** Requests in the peer's ring that wait for its response */
+    std::deque<send_request> in_flight;
+    std::deque<response> responses;
+    std::deque<recv_request> recvs;
+    /** The receive that the send arriving in fragments goes to, if receiving */
+    recv_request current_recv;
+    bool receiving;
+    /** Requests from the peer that wait for a receive to be posted, with their data */
+    std::deque<std::vector<char>> deferred;
+    uint64_t last_peer_check;
+};
+
+struct lid_table {
+    std::atomic<int32_t> pids[1 << 16];
+};
+
+/** The state shared by every context a process opens on the device. */
+struct device_state {
+    ibv_device device;
+    ibv_device* list[2];
+    uint16_t lid = 0;
+    lid_table* lids = nullptr;
+    std::atomic<uint32_t> next_qp_num{1};
+    std::atomic<uint32_t> next_key{1};
+    std::mutex qps_mutex;
+    std::map<uint32_t, lb_qp*> qps;
+    std::mutex mrs_mutex;
+    std::unordered_map<uint32_t, lb_mr*> mrs;
+    /** The injected one-way latency */
+    uint64_t latency_ns = 0;
+    /** The injected bandwidth, or 0 for as fast as memcpy goes */
+    double bytes_per_ns = 0;
+    /** When the link out of this process is done with the packets already sent */
+    uint64_t egress_free_at = 0;
+    uint64_t ring_capacity = 1 << 20;
+};
+
+device_state* the_device = nullptr;
+
+std::string ring_name(uint16_t lid, uint32_t qp_num) {
+    return "/derecho_lbv." + std::to_string(lid) + "." + std::to_string(qp_num);
+}
+
+void release_lid() {
+    int32_t pid = getpid();
+    the_device->lids->pids[the_device->lid].compare_exchange_strong(pid, 0);
+}
+
+/** Removes the rings of processes that had this LID and exited without destroying them. */
+void remove_stale_rings(uint16_t lid) {
+    const std::string prefix = "derecho_lbv." + std::to_string(lid) + ".";
+    DIR* shm_dir = opendir("/dev/shm");
+    if(!shm_dir) {
+        return;
+    }
+    while(dirent* entry = readdir(shm_dir)) {
+        const std::string name = entry->d_name;
+        if(name.compare(0, prefix.size(), prefix) == 0) {
+            shm_unlink(("/" + name).c_str());
+        }
+    }
+    closedir(shm_dir);
+}
+
+/**
+ * Takes a LID from the table every process on the host shares: one never
+ * used, or one of a process that has exited.
+ * @return The LID, or 0 if there is none to take
+ */
+uint16_t allocate_lid(device_state& device) {
+    const char* name = "/derecho_lbv.lids";
+    const int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if(fd < 0) {
+        fprintf(stderr, "loopback verbs: could not open %s, error code is %d\n", name, errno);
+        return 0;
+    }
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if(fstat(fd, &st) == 0
+       && ((size_t)st.st_size >= sizeof(lid_table) || ftruncate(fd, sizeof(lid_table)) == 0)) {
+        addr = mmap(nullptr, sizeof(lid_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(addr == MAP_FAILED) {
+        fprintf(stderr, "loopback verbs: could not map %s, error code is %d\n", name, errno);
+        return 0;
+    }
+    device.lids = static_cast<lid_table*>(addr);
+    const int32_t pid = getpid();
+    for(uint32_t lid = 1; lid < 0xffff; ++lid) {
+        int32_t owner = device.lids->pids[lid].load();
+        const bool exited = owner != 0 && kill(owner, 0) != 0 && errno == ESRCH;
+        if((owner == 0 || exited) && device.lids->pids[lid].compare_exchange_strong(owner, pid)) {
+            remove_stale_rings(lid);
+            return lid;
+        }
+    }
+    fprintf(stderr, "loopback verbs: no LID is free\n");
+    return 0;
+}
+
+void progress_loop();
+
+/** @return The device, set up on first use, or nullptr if it can't be */
+device_state* get_device() {
+    static std::once_flag init_flag;
+    std::call_once(init_flag, [] {
+        device_state* device = new device_state;
+        memset(&device->device, 0, sizeof(device->device));
+        device->device.node_type = IBV_NODE_CA;
+        device->device.transport_type = IBV_TRANSPORT_IB;
+        strcpy(device->device.name, "loopback0");
+        strcpy(device->device.dev_name, "uverbs_loopback0");
+        // Doesn't exist, so nothing is placed near this device's NUMA node
+        strcpy(device->device.ibdev_path, "/sys/class/infiniband/loopback0");
+        device->list[0] = &device->device;
+        device->list[1] = nullptr;
+        if(const char* latency = getenv("DERECHO_LOOPBACK_LATENCY_US")) {
+            device->latency_ns = atof(latency) * 1000;
+        }
+        if(const char* bandwidth = getenv("DERECHO_LOOPBACK_BANDWIDTH_GBPS")) {
+            device->bytes_per_ns = atof(bandwidth) / 8;
+        }
+        if(const char* ring_kb = getenv("DERECHO_LOOPBACK_RING_KB")) {
+            device->ring_capacity = std::max(4 * max_fragment_size, (uint32_t)atoi(ring_kb) * 1024);
+        }
+        device->lid = allocate_lid(*device);
+        if(!device->lid) {
+            return;
+        }
+        the_device = device;
+        atexit(release_lid);
+        std::thread(progress_loop).detach();
+    });
+    return the_device;
+}
+
+void push_completion(ibv_cq* ibcq, const ibv_wc& wc) {
+    lb_cq* cq = static_cast<lb_cq*>(ibcq);
+    std::lock_guard<std::mutex> lock(cq->cq_mutex);
+    cq->entries.push_back(wc);
+    if(cq->armed && cq->channel) {
+        cq->armed = false;
+        lb_comp_channel* channel = static_cast<lb_comp_channel*>(cq->channel);
+        if(write(channel->write_fd, &ibcq, sizeof(ibcq)) != sizeof(ibcq)) {
+            fprintf(stderr, "loopback verbs: could not signal a completion event\n");
+        }
+    }
+}
+
+ibv_wc_opcode completion_opcode(ibv_wr_opcode opcode) {
+    switch(opcode) {
+        case IBV_WR_SEND:
+        case IBV_WR_SEND_WITH_IMM:
+            return IBV_WC_SEND;
+        case IBV_WR_RDMA_READ:
+            return IBV_WC_RDMA_READ;
+        default:
+            return IBV_WC_RDMA_WRITE;
+    }
+}
+
+/** Completes a send request, which makes an entry if it was signaled or failed. */
+void complete_send(lb_qp* qp, const send_request& request, ibv_wc_status status) {
+    if(!request.signaled && status == IBV_WC_SUCCESS) {
+        return;
+    }
+    ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.wr_id = request.wr_id;
+    wc.status = status;
+    wc.opcode = completion_opcode(request.opcode);
+    wc.byte_len = request.length;
+    wc.qp_num = qp->qp_num;
+    push_completion(qp->send_cq, wc);
+}
+
+void complete_recv(lb_qp* qp, const recv_request& request, ibv_wc_opcode opcode,
+                   ibv_wc_status status, uint32_t byte_len, bool has_imm, uint32_t imm_data) {
+    ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.wr_id = request.wr_id;
+    wc.status = status;
+    wc.opcode = opcode;
+    wc.byte_len = byte_len;
+    wc.imm_data = imm_data;
+    wc.wc_flags = has_imm ? IBV_WC_WITH_IMM : 0;
+    wc.qp_num = qp->qp_num;
+    wc.src_qp = qp->dest_qp_num;
+    wc.slid = qp->dlid;
+    push_completion(qp->recv_cq, wc);
+}
+
+/**
+ * Moves the queue pair to the error state, flushing its requests; the
+ * oldest one that was sent gets first_status, the reason it failed.
+ */
+void fail(lb_qp* qp, ibv_wc_status first_status) {
+    if(qp->error) {
+        return;
+    }
+    qp->error = true;
+    qp->state = IBV_QPS_ERR;
+    bool first = true;
+    for(auto* requests : {&qp->in_flight, &qp->to_send}) {
+        for(const send_request& request : *requests) {
+            complete_send(qp, request, first ? first_status : IBV_WC_WR_FLUSH_ERR);
+            first = false;
+        }
+        requests->clear();
+    }
+    if(qp->receiving) {
+        complete_recv(qp, qp->current_recv, IBV_WC_RECV, IBV_WC_WR_FLUSH_ERR, 0, false, 0);
+        qp->receiving = false;
+    }
+    for(const recv_request& request : qp->recvs) {
+        complete_recv(qp, request, IBV_WC_RECV, IBV_WC_WR_FLUSH_ERR, 0, false, 0);
+    }
+    qp->recvs.clear();
+    qp->deferred.clear();
+    qp->responses.clear();
+}
+
+bool has_recv(lb_qp* qp) {
+    if(!qp->srq) {
+        return !qp->recvs.empty();
+    }
+    lb_srq* srq = static_cast<lb_srq*>(qp->srq);
+    std::lock_guard<std::mutex> lock(srq->srq_mutex);
+    return !srq->recvs.empty();
+}
+
+recv_request take_recv(lb_qp* qp) {
+    std::deque<recv_request>* recvs = &qp->recvs;
+    std::unique_lock<std::mutex> lock;
+    if(qp->srq) {
+        lb_srq* srq = static_cast<lb_srq*>(qp->srq);
+        lock = std::unique_lock<std::mutex>(srq->srq_mutex);
+        recvs = &srq->recvs;
+    }
+    recv_request request = std::move(recvs->front());
+    recvs->pop_front();
+    return request;
+}
+
+uint64_t capacity_of(const std::vector<ibv_sge>& sges) {
+    uint64_t capacity = 0;
+    for(const ibv_sge& sge : sges) {
+        capacity += sge.length;
+    }
+    return capacity;
+}
+
+void gather(const std::vector<ibv_sge>& sges, uint64_t offset, char* dst, uint64_t length) {
+    for(const ibv_sge& sge : sges) {
+        if(length == 0) {
+            break;
+        }
+        if(offset >= sge.length) {
+            offset -= sge.length;
+            continue;
+        }
+        const uint64_t n = std::min<uint64_t>(sge.length - offset, length);
+        memcpy(dst, reinterpret_cast<const char*>(sge.addr) + offset, n);
+        dst += n;
+        length -= n;
+        offset = 0;
+    }
+}
+
+void scatter(const std::vector<ibv_sge>& sges, uint64_t offset, const char* src, uint64_t length) {
+    for(const ibv_sge& sge : sges) {
+        if(length == 0) {
+            break;
+        }
+        if(offset >= sge.length) {
+            offset -= sge.length;
+            continue;
+        }
+        const uint64_t n = std::min<uint64_t>(sge.length - offset, length);
+        memcpy(reinterpret_cast<char*>(sge.addr) + offset, src, n);
+        src += n;
+        length -= n;
+        offset = 0;
+    }
+}
+
+/**
+ * @return Where remote address addr is in this process, if all of the
+ * length bytes there are in the memory region of rkey and it allows access.
+ * The caller holds mrs_mutex.
+ */
+char* local_address(uint32_t rkey, uint64_t addr, uint64_t length, int access) {
+    auto found = the_device->mrs.find(rkey);
+    if(found == the_device->mrs.end()) {
+        return nullptr;
+    }
+    const lb_mr* mr = found->second;
+    if(!(mr->access & access) || addr < mr->iova || addr - mr->iova > mr->length
+       || length > mr->length - (addr - mr->iova)) {
+        return nullptr;
+    }
+    return static_cast<char*>(mr->addr) + (addr - mr->iova);
+}
+
+void respond(lb_qp* qp, uint8_t type, uint64_t sequence, uint8_t status = 0) {
+    // An ACK acknowledges every message before it, so one not yet sent can
+    // stand for the next one too
+    if(type == ack_packet && !qp->responses.empty() && qp->responses.back().header.type == ack_packet) {
+        qp->responses.back().header.sequence = sequence;
+        return;
+    }
+    response r;
+    memset(&r, 0, sizeof(r));
+    r.header.type = type;
+    r.header.sequence = sequence;
+    r.header.status = status;
+    qp->responses.push_back(r);
+}
+
+/** Fails the queue pair because of a bad request from the peer, and tells the peer why. */
+void reject(lb_qp* qp, uint64_t sequence, ibv_wc_status status) {
+    fail(qp, IBV_WC_WR_FLUSH_ERR);
+    respond(qp, nak_packet, sequence, status);
+}
+
+/**
+ * Carries out a request from the peer.
+ * @return False if it needs a receive and none is posted, in which case it
+ * is tried again later, as a device retries after a receiver-not-ready NAK
+ */
+bool handle_request(lb_qp* qp, const packet& p, const char* data, uint32_t size) {
+    const bool last = p.flags & last_fragment;
+    const bool has_imm = p.flags & with_immediate;
+    switch(p.type) {
+        case write_packet: {
+            if(last && has_imm && !has_recv(qp)) {
+                return false;
+            }
+            if(size > 0) {
+                std::lock_guard<std::mutex> lock(the_device->mrs_mutex);
+                char* dst = local_address(p.rkey, p.remote_addr + p.offset, size, IBV_ACCESS_REMOTE_WRITE);
+                if(!dst) {
+                    reject(qp, p.sequence, IBV_WC_REM_ACCESS_ERR);
+                    return true;
+                }
+                memcpy(dst, data, size);
+            }
+            if(!last) {
+                return true;
+            }
+            if(has_imm) {
+                complete_recv(qp, take_recv(qp), IBV_WC_RECV_RDMA_WITH_IMM, IBV_WC_SUCCESS,
+                              p.length, true, p.imm_data);
+            }
+            respond(qp, ack_packet, p.sequence);
+            return true;
+        }
+        case send_packet: {
+            if(p.flags & first_fragment) {
+                if(!has_recv(qp)) {
+                    return false;
+                }
+                qp->current_recv = take_recv(qp);
+                qp->receiving = true;
+                if(p.length > capacity_of(qp->current_recv.sges)) {
+                    complete_recv(qp, qp->current_recv, IBV_WC_RECV, IBV_WC_LOC_LEN_ERR, 0, false, 0);
+                    qp->receiving = false;
+                    reject(qp, p.sequence, IBV_WC_REM_INV_REQ_ERR);
+                    return true;
+                }
+            }
+            scatter(qp->current_recv.sges, p.offset, data, size);
+            if(last) {
+                qp->receiving = false;
+                complete_recv(qp, qp->current_recv, IBV_WC_RECV, IBV_WC_SUCCESS,
+                              p.length, has_imm, p.imm_data);
+                respond(qp, ack_packet, p.sequence);
+            }
+            return true;
+        }
+        case read_request_packet: {
+            const char* src = nullptr;
+            if(p.length > 0) {
+                std::lock_guard<std::mutex> lock(the_device->mrs_mutex);
+                src = local_address(p.rkey, p.remote_addr, p.length, IBV_ACCESS_REMOTE_READ);
+                if(!src) {
+                    reject(qp, p.sequence, IBV_WC_REM_ACCESS_ERR);
+                    return true;
+                }
+            }
+            response r;
+            memset(&r, 0, sizeof(r));
+            r.header.type = read_response_packet;
+            r.header.sequence = p.sequence;
+            r.header.length = p.length;
+            r.data = src;
+            qp->responses.push_back(r);
+            return true;
+        }
+        default:
+            fprintf(stderr, "loopback verbs: unknown packet type %d\n", (int)p.type);
+            return true;
+    }
+}
+
+/** Completes every request up to and including number sequence. */
+void complete_through(lb_qp* qp, uint64_t sequence) {
+    while(!qp->in_flight.empty() && qp->in_flight.front().sequence <= sequence) {
+        complete_send(qp, qp->in_flight.front(), IBV_WC_SUCCESS);
+        qp->in_flight.pop_front();
+    }
+}
+
+/** Handles the peer's response to one of this queue pair's requests. */
+void handle_response(lb_qp* qp, const packet& p, const char* data, uint32_t size) {
+    if(p.type == ack_packet) {
+        complete_through(qp, p.sequence);
+        return;
+    }
+    complete_through(qp, p.sequence - 1);
+    if(qp->in_flight.empty() || qp->in_flight.front().sequence != p.sequence) {
+        return;
+    }
+    send_request& request = qp->in_flight.front();
+    if(p.type == nak_packet) {
+        complete_send(qp, request, static_cast<ibv_wc_status>(p.status));
+        qp->in_flight.pop_front();
+        fail(qp, IBV_WC_WR_FLUSH_ERR);
+        return;
+    }
+    scatter(request.sges, p.offset, data, size);
+    if(p.flags & last_fragment) {
+        complete_send(qp, request, IBV_WC_SUCCESS);
+        qp->in_flight.pop_front();
+    }
+}
+
+bool is_response(uint8_t type) {
+    return type == ack_packet || type == nak_packet || type == read_response_packet;
+}
+
+/** Handles what has arrived from the peer by now. @return Whether there was any */
+bool receive(lb_qp* qp, uint64_t now) {
+    bool busy = false;
+    while(!qp->deferred.empty() && !qp->error) {
+        const std::vector<char>& copy = qp->deferred.front();
+        const packet& p = *reinterpret_cast<const packet*>(copy.data());
+        if(!handle_request(qp, p, copy.data() + sizeof(packet), copy.size() - sizeof(packet))) {
+            break;
+        }
+        // Failing the queue pair drops the deferred requests
+        if(qp->error) {
+            return true;
+        }
+        qp->deferred.pop_front();
+        busy = true;
+    }
+    for(int n = 0; n < max_packets_per_turn && !qp->error; ++n) {
+        uint32_t size;
+        const char* record = static_cast<const char*>(qp->inbound.begin_read(size));
+        if(!record) {
+            break;
+        }
+        busy = true;
+        const packet& p = *reinterpret_cast<const packet*>(record);
+        if(p.deliver_at > now) {
+            break;
+        }
+        const char* data = record + sizeof(packet);
+        const uint32_t data_size = size - sizeof(packet);
+        if(is_response(p.type)) {
+            handle_response(qp, p, data, data_size);
+        } else if(!qp->deferred.empty() || !handle_request(qp, p, data, data_size)) {
+            // Responses still get through while requests wait for receives
+            qp->deferred.emplace_back(record, record + size);
+        }
+        qp->inbound.end_read();
+    }
+    return busy;
+}
+
+/** @return When a packet of size bytes sent now gets to the other end */
+uint64_t delivery_time(uint64_t size, uint64_t now) {
+    device_state& device = *the_device;
+    if(device.latency_ns == 0 && device.bytes_per_ns == 0) {
+        return 0;
+    }
+    uint64_t leaves = now;
+    if(device.bytes_per_ns > 0) {
+        device.egress_free_at = std::max(now, device.egress_free_at) + (uint64_t)(size / device.bytes_per_ns);
+        leaves = device.egress_free_at;
+    }
+    return leaves + device.latency_ns;
+}
+
+/** @return Where to put the packet's data in the peer's ring, or nullptr if it is full */
+char* begin_packet(lb_qp* qp, packet& p, uint32_t data_size, uint64_t now) {
+    char* record = static_cast<char*>(qp->outbound.begin_write(sizeof(packet) + data_size));
+    if(!record) {
+        return nullptr;
+    }
+    p.deliver_at = delivery_time(sizeof(packet) + data_size, now);
+    memcpy(record, &p, sizeof(packet));
+    return record + sizeof(packet);
+}
+
+uint32_t fragment_size(lb_qp* qp, uint32_t remaining) {
+    return std::min<uint64_t>({remaining, max_fragment_size, qp->outbound.max_record_size() - sizeof(packet)});
+}
+
+/** Sends as much as the peer's ring has room for. @return Whether anything was sent */
+bool transmit(lb_qp* qp, uint64_t now) {
+    bool busy = false;
+    uint64_t budget = max_bytes_per_turn;
+    while(!qp->responses.empty()) {
+        response& r = qp->responses.front();
+        do {
+            const uint32_t size = r.header.type == read_response_packet ? fragment_size(qp, r.header.length - r.sent) : 0;
+            packet p = r.header;
+            p.offset = r.sent;
+            p.flags = (r.sent == 0 ? first_fragment : 0) | (r.sent + size == r.header.length ? last_fragment : 0);
+            char* data = begin_packet(qp, p, size, now);
+            if(!data) {
+                return true;
+            }
+            if(size > 0) {
+                memcpy(data, r.data + r.sent, size);
+            }
+            qp->outbound.end_write();
+            r.sent += size;
+            budget -= std::min<uint64_t>(size, budget);
+            busy = true;
+        } while(r.sent < r.header.length && budget > 0);
+        if(r.sent < r.header.length) {
+            return true;
+        }
+        qp->responses.pop_front();
+        if(budget == 0) {
+            return true;
+        }
+    }
+    if(qp->error) {
+        return busy;
+    }
+    while(!qp->to_send.empty()) {
+        send_request& request = qp->to_send.front();
+        packet p;
+        memset(&p, 0, sizeof(p));
+        p.sequence = request.sequence;
+        p.remote_addr = request.remote_addr;
+        p.rkey = request.rkey;
+        p.length = request.length;
+        p.imm_data = request.imm_data;
+        if(request.opcode == IBV_WR_RDMA_READ) {
+            p.type = read_request_packet;
+            p.flags = first_fragment | last_fragment;
+            if(!begin_packet(qp, p, 0, now)) {
+                return true;
+            }
+            qp->outbound.end_write();
+        } else {
+            const bool is_send = request.opcode == IBV_WR_SEND || request.opcode == IBV_WR_SEND_WITH_IMM;
+            const bool has_imm = request.opcode == IBV_WR_SEND_WITH_IMM || request.opcode == IBV_WR_RDMA_WRITE_WITH_IMM;
+            p.type = is_send ? send_packet : write_packet;
+            do {
+                const uint32_t size = fragment_size(qp, request.length - request.sent);
+                p.offset = request.sent;
+                p.flags = (request.sent == 0 ? first_fragment : 0)
+                          | (request.sent + size == request.length ? last_fragment : 0)
+                          | (has_imm ? with_immediate : 0);
+                char* data = begin_packet(qp, p, size, now);
+                if(!data) {
+                    return true;
+                }
+                if(!request.inline_data.empty()) {
+                    memcpy(data, request.inline_data.data() + request.sent, size);
+                } else {
+                    gather(request.sges, request.sent, data, size);
+                }
+                qp->outbound.end_write();
+                request.sent += size;
+                budget -= std::min<uint64_t>(size, budget);
+            } while(request.sent < request.length && budget > 0);
+            if(request.sent < request.length) {
+                return true;
+            }
+        }
+        busy = true;
+        qp->in_flight.push_back(std::move(request));
+        qp->to_send.pop_front();
+        if(budget == 0) {
+            return true;
+        }
+    }
+    return busy;
+}
+
+/** @return True if the peer's process has exited or its queue pair is gone */
+bool peer_gone(lb_qp* qp) {
+    const ring_header* header = qp->outbound.get_header();
+    return header->closed.load(std::memory_order_acquire)
+           || (header->owner_pid > 0 && kill(header->owner_pid, 0) != 0 && errno == ESRCH);
+}
+
+bool progress(lb_qp* qp, uint64_t now) {
+    if(!qp->outbound.is_open()) {
+        return false;
+    }
+    bool busy = false;
+    if(!qp->error) {
+        busy |= receive(qp, now);
+    }
+    busy |= transmit(qp, now);
+    // Like a device whose retries run out, fails only if it is waiting on the peer
+    if(!qp->error && (!qp->to_send.empty() || !qp->in_flight.empty())
+       && now - qp->last_peer_check > peer_check_interval_ns) {
+        qp->last_peer_check = now;
+        if(peer_gone(qp)) {
+            fail(qp, IBV_WC_RETRY_EXC_ERR);
+        }
+    }
+    return busy;
+}
+
+void progress_loop() {
+    pthread_setname_np(pthread_self(), "loopback_nic");
+    device_state& device = *the_device;
+    uint64_t idle_since = now_ns();
+    while(true) {
+        const uint64_t now = now_ns();
+        bool busy = false;
+        {
+            std::lock_guard<std::mutex> qps_lock(device.qps_mutex);
+            for(auto& entry : device.qps) {
+                std::lock_guard<std::mutex> lock(entry.second->qp_mutex);
+                busy |= progress(entry.second, now);
+            }
+        }
+        if(busy) {
+            idle_since = now;
+        } else if(now - idle_since > spin_before_sleep_ns) {
+            timespec nap = {0, 50 * 1000};
+            nanosleep(&nap, nullptr);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+int poll_cq(ibv_cq* ibcq, int num_entries, ibv_wc* wc) {
+    lb_cq* cq = static_cast<lb_cq*>(ibcq);
+    std::lock_guard<std::mutex> lock(cq->cq_mutex);
+    const int n = std::min<size_t>(num_entries, cq->entries.size());
+    std::copy(cq->entries.begin(), cq->entries.begin() + n, wc);
+    cq->entries.erase(cq->entries.begin(), cq->entries.begin() + n);
+    return n;
+}
+
+int req_notify_cq(ibv_cq* ibcq, int solicited_only) {
+    lb_cq* cq = static_cast<lb_cq*>(ibcq);
+    std::lock_guard<std::mutex> lock(cq->cq_mutex);
+    cq->armed = true;
+    return 0;
+}
+
+std::vector<ibv_sge> sge_list(const ibv_sge* sg_list, int num_sge) {
+    return std::vector<ibv_sge>(sg_list, sg_list + std::max(num_sge, 0));
+}
+
+int post_send(ibv_qp* ibqp, ibv_send_wr* wr, ibv_send_wr** bad_wr) {
+    lb_qp* qp = static_cast<lb_qp*>(ibqp);
+    std::lock_guard<std::mutex> lock(qp->qp_mutex);
+    for(; wr; wr = wr->next) {
+        const bool supported = wr->opcode == IBV_WR_RDMA_WRITE || wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM
+                               || wr->opcode == IBV_WR_SEND || wr->opcode == IBV_WR_SEND_WITH_IMM
+                               || wr->opcode == IBV_WR_RDMA_READ;
+        if((qp->state != IBV_QPS_RTS && !qp->error) || !supported) {
+            *bad_wr = wr;
+            return EINVAL;
+        }
+        if(qp->to_send.size() + qp->in_flight.size() >= qp->max_send_wr) {
+            *bad_wr = wr;
+            return ENOMEM;
+        }
+        send_request request;
+        request.wr_id = wr->wr_id;
+        request.opcode = wr->opcode;
+        request.signaled = qp->sq_sig_all || (wr->send_flags & IBV_SEND_SIGNALED);
+        request.imm_data = wr->imm_data;
+        request.remote_addr = wr->wr.rdma.remote_addr;
+        request.rkey = wr->wr.rdma.rkey;
+        request.sges = sge_list(wr->sg_list, wr->num_sge);
+        request.length = capacity_of(request.sges);
+        request.sequence = qp->next_sequence++;
+        request.sent = 0;
+        if((wr->send_flags & IBV_SEND_INLINE) && wr->opcode != IBV_WR_RDMA_READ && request.length > 0) {
+            if(request.length > qp->max_inline) {
+                *bad_wr = wr;
+                return EINVAL;
+            }
+            request.inline_data.resize(request.length);
+            gather(request.sges, 0, request.inline_data.data(), request.length);
+        }
+        if(qp->error) {
+            complete_send(qp, request, IBV_WC_WR_FLUSH_ERR);
+            continue;
+        }
+        qp->to_send.push_back(std::move(request));
+    }
+    return 0;
+}
+
+int post_recv(ibv_qp* ibqp, ibv_recv_wr* wr, ibv_recv_wr** bad_wr) {
+    lb_qp* qp = static_cast<lb_qp*>(ibqp);
+    std::lock_guard<std::mutex> lock(qp->qp_mutex);
+    for(; wr; wr = wr->next) {
+        if(qp->srq || qp->state == IBV_QPS_RESET) {
+            *bad_wr = wr;
+            return EINVAL;
+        }
+        if(qp->recvs.size() >= qp->max_recv_wr) {
+            *bad_wr = wr;
+            return ENOMEM;
+        }
+        recv_request request{wr->wr_id, sge_list(wr->sg_list, wr->num_sge)};
+        if(qp->error) {
+            complete_recv(qp, request, IBV_WC_RECV, IBV_WC_WR_FLUSH_ERR, 0, false, 0);
+            continue;
+        }
+        qp->recvs.push_back(std::move(request));
+    }
+    return 0;
+}
+
+int post_srq_recv(ibv_srq* ibsrq, ibv_recv_wr* wr, ibv_recv_wr** bad_wr) {
+    lb_srq* srq = static_cast<lb_srq*>(ibsrq);
+    std::lock_guard<std::mutex> lock(srq->srq_mutex);
+    for(; wr; wr = wr->next) {
+        if(srq->recvs.size() >= srq->max_wr) {
+            *bad_wr = wr;
+            return ENOMEM;
+        }
+        srq->recvs.push_back(recv_request{wr->wr_id, sge_list(wr->sg_list, wr->num_sge)});
+    }
+    return 0;
+}
+
+int query_port(ibv_context* context, uint8_t port, ibv_port_attr* port_attr) {
+    if(port != port_num) {
+        return EINVAL;
+    }
+    memset(port_attr, 0, sizeof(*port_attr));
+    port_attr->state = IBV_PORT_ACTIVE;
+    port_attr->max_mtu = IBV_MTU_4096;
+    port_attr->active_mtu = IBV_MTU_4096;
+    port_attr->gid_tbl_len = 1;
+    port_attr->max_msg_sz = 1u << 31;
+    port_attr->pkey_tbl_len = 1;
+    port_attr->lid = the_device->lid;
+    port_attr->max_vl_num = 1;
+    port_attr->active_width = 1;
+    port_attr->active_speed = 1;
+    port_attr->phys_state = 5;
+    port_attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+    return 0;
+}
+
+}  // namespace
+}  // namespace loopback
+
+using namespace loopback;
+
+extern "C" {
+
+struct ibv_device** ibv_get_device_list(int* num_devices) {
+    static ibv_device* no_devices[1] = {nullptr};
+    device_state* device = get_device();
+    if(num_devices) {
+        *num_devices = device ? 1 : 0;
+    }
+    return device ? device->list : no_devices;
+}
+
+void ibv_free_device_list(struct ibv_device** list) {}
+
+const char* ibv_get_device_name(struct ibv_device* device) {
+    return device->name;
+}
+
+struct ibv_context* ibv_open_device(struct ibv_device* device) {
+    if(!get_device() || device != &the_device->device) {
+        errno = ENODEV;
+        return nullptr;
+    }
+    lb_context* context = new lb_context();
+    context->device = device;
+    context->cmd_fd = -1;
+    context->async_fd = -1;
+    context->num_comp_vectors = 1;
+    pthread_mutex_init(&context->mutex, nullptr);
+    context->ops.poll_cq = poll_cq;
+    context->ops.req_notify_cq = req_notify_cq;
+    context->ops.post_send = post_send;
+    context->ops.post_recv = post_recv;
+    context->ops.post_srq_recv = post_srq_recv;
+    return context;
+}
+
+int ibv_close_device(struct ibv_context* context) {
+    pthread_mutex_destroy(&context->mutex);
+    delete static_cast<lb_context*>(context);
+    return 0;
+}
+
+int ibv_query_device(struct ibv_context* context, struct ibv_device_attr* device_attr) {
+    memset(device_attr, 0, sizeof(*device_attr));
+    strcpy(device_attr->fw_ver, "loopback");
+    device_attr->node_guid = htobe64(the_device->lid);
+    device_attr->sys_image_guid = device_attr->node_guid;
+    device_attr->max_mr_size = UINT64_MAX;
+    device_attr->page_size_cap = 4096;
+    device_attr->max_qp = 1 << 16;
+    device_attr->max_qp_wr = 1 << 15;
+    device_attr->max_sge = 16;
+    device_attr->max_cq = 1 << 16;
+    device_attr->max_cqe = 1 << 20;
+    device_attr->max_mr = 1 << 20;
+    device_attr->max_pd = 1 << 16;
+    device_attr->max_qp_rd_atom = 16;
+    device_attr->max_qp_init_rd_atom = 16;
+    device_attr->max_srq = 1 << 10;
+    device_attr->max_srq_wr = 1 << 15;
+    device_attr->max_srq_sge = 16;
+    device_attr->max_pkeys = 1;
+    device_attr->phys_port_cnt = 1;
+    return 0;
+}
+
+#ifdef LOOPBACK_COMPAT_QUERY_PORT
+// The inline wrapper in the header passes a whole, zeroed ibv_port_attr
+int ibv_query_port(struct ibv_context* context, uint8_t port, struct _compat_ibv_port_attr* port_attr) {
+    return query_port(context, port, reinterpret_cast<ibv_port_attr*>(port_attr));
+}
+#else
+int ibv_query_port(struct ibv_context* context, uint8_t port, struct ibv_port_attr* port_attr) {
+    return query_port(context, port, port_attr);
+}
+#endif
+
+int ibv_query_gid(struct ibv_context* context, uint8_t port, int index, union ibv_gid* gid) {
+    if(port != port_num || index != 0) {
+        return -1;
+    }
+    gid->global.subnet_prefix = htobe64(0xfe80000000000000ull);
+    gid->global.interface_id = htobe64(the_device->lid);
+    return 0;
+}
+
+struct ibv_pd* ibv_alloc_pd(struct ibv_context* context) {
+    ibv_pd* pd = new ibv_pd();
+    pd->context = context;
+    return pd;
+}
+
+int ibv_dealloc_pd(struct ibv_pd* pd) {
+    delete pd;
+    return 0;
+}
+
+struct ibv_mr* ibv_reg_mr_iova2(struct ibv_pd* pd, void* addr, size_t length, uint64_t iova,
+                                unsigned int access) {
+    lb_mr* mr = new lb_mr();
+    const uint32_t key = the_device->next_key++;
+    mr->context = pd->context;
+    mr->pd = pd;
+    mr->addr = addr;
+    mr->length = length;
+    mr->handle = key;
+    mr->lkey = key;
+    mr->rkey = key;
+    mr->iova = iova;
+    mr->access = access;
+    std::lock_guard<std::mutex> lock(the_device->mrs_mutex);
+    the_device->mrs[key] = mr;
+    return mr;
+}
+
+struct ibv_mr* ibv_reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access) {
+    return ibv_reg_mr_iova2(pd, addr, length, reinterpret_cast<uintptr_t>(addr), access);
+}
+
+int ibv_dereg_mr(struct ibv_mr* ibmr) {
+    lb_mr* mr = static_cast<lb_mr*>(ibmr);
+    {
+        std::lock_guard<std::mutex> lock(the_device->mrs_mutex);
+        the_device->mrs.erase(mr->rkey);
+    }
+    delete mr;
+    return 0;
+}
+
+struct ibv_comp_channel* ibv_create_comp_channel(struct ibv_context* context) {
+    int fds[2];
+    if(pipe2(fds, O_CLOEXEC) != 0) {
+        return nullptr;
+    }
+    // The progress thread mustn't block on a full pipe; CQs are rearmed
+    // after each event anyway
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    lb_comp_channel* channel = new lb_comp_channel();
+    channel->context = context;
+    channel->fd = fds[0];
+    channel->write_fd = fds[1];
+    return channel;
+}
+
+int ibv_destroy_comp_channel(struct ibv_comp_channel* ibchannel) {
+    lb_comp_channel* channel = static_cast<lb_comp_channel*>(ibchannel);
+    close(channel->fd);
+    close(channel->write_fd);
+    delete channel;
+    return 0;
+}
+
+int ibv_get_cq_event(struct ibv_comp_channel* channel, struct ibv_cq** cq, void** cq_context) {
+    ibv_cq* event_cq;
+    ssize_t n;
+    do {
+        n = read(channel->fd, &event_cq, sizeof(event_cq));
+    } while(n < 0 && errno == EINTR);
+    if(n != sizeof(event_cq)) {
+        return -1;
+    }
+    *cq = event_cq;
+    *cq_context = event_cq->cq_context;
+    return 0;
+}
+
+void ibv_ack_cq_events(struct ibv_cq* cq, unsigned int nevents) {}
+
+struct ibv_cq* ibv_create_cq(struct ibv_context* context, int cqe, void* cq_context,
+                             struct ibv_comp_channel* channel, int comp_vector) {
+    lb_cq* cq = new lb_cq();
+    cq->context = context;
+    cq->channel = channel;
+    cq->cq_context = cq_context;
+    cq->cqe = cqe;
+    return cq;
+}
+
+int ibv_destroy_cq(struct ibv_cq* cq) {
+    delete static_cast<lb_cq*>(cq);
+    return 0;
+}
+
+struct ibv_srq* ibv_create_srq(struct ibv_pd* pd, struct ibv_srq_init_attr* srq_init_attr) {
+    lb_srq* srq = new lb_srq();
+    srq->context = pd->context;
+    srq->pd = pd;
+    srq->srq_context = srq_init_attr->srq_context;
+    srq->max_wr = std::max(srq_init_attr->attr.max_wr, 1u);
+    return srq;
+}
+
+int ibv_destroy_srq(struct ibv_srq* srq) {
+    delete static_cast<lb_srq*>(srq);
+    return 0;
+}
+
+struct ibv_qp* ibv_create_qp(struct ibv_pd* pd, struct ibv_qp_init_attr* qp_init_attr) {
+    if(qp_init_attr->qp_type != IBV_QPT_RC) {
+        errno = EOPNOTSUPP;
+        return nullptr;
+    }
+    if(qp_init_attr->cap.max_inline_data > max_inline_data) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    lb_qp* qp = new lb_qp();
+    qp->context = pd->context;
+    qp->qp_context = qp_init_attr->qp_context;
+    qp->pd = pd;
+    qp->send_cq = qp_init_attr->send_cq;
+    qp->recv_cq = qp_init_attr->recv_cq;
+    qp->srq = qp_init_attr->srq;
+    qp->qp_num = the_device->next_qp_num++ & 0xffffff;
+    qp->state = IBV_QPS_RESET;
+    qp->qp_type = IBV_QPT_RC;
+    // Responses refer to the message before the first as 0
+    qp->next_sequence = 1;
+    qp->sq_sig_all = qp_init_attr->sq_sig_all;
+    qp->max_send_wr = std::max(qp_init_attr->cap.max_send_wr, 1u);
+    qp->max_recv_wr = qp_init_attr->cap.max_recv_wr;
+    qp->max_inline = qp_init_attr->cap.max_inline_data;
+    if(!qp->inbound.create(ring_name(the_device->lid, qp->qp_num), the_device->ring_capacity)) {
+        fprintf(stderr, "loopback verbs: could not create the ring of queue pair %u, error code is %d\n",
+                qp->qp_num, errno);
+        delete qp;
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(the_device->qps_mutex);
+    the_device->qps[qp->qp_num] = qp;
+    return qp;
+}
+
+int ibv_modify_qp(struct ibv_qp* ibqp, struct ibv_qp_attr* attr, int attr_mask) {
+    lb_qp* qp = static_cast<lb_qp*>(ibqp);
+    std::lock_guard<std::mutex> lock(qp->qp_mutex);
+    if(!(attr_mask & IBV_QP_STATE)) {
+        return 0;
+    }
+    switch(attr->qp_state) {
+        case IBV_QPS_RESET:
+            qp->to_send.clear();
+            qp->in_flight.clear();
+            qp->responses.clear();
+            qp->recvs.clear();
+            qp->deferred.clear();
+            qp->outbound.close();
+            qp->error = false;
+            break;
+        case IBV_QPS_INIT:
+            if(qp->state != IBV_QPS_RESET && qp->state != IBV_QPS_INIT) {
+                return EINVAL;
+            }
+            break;
+        case IBV_QPS_RTR:
+            if(qp->state != IBV_QPS_INIT || !(attr_mask & IBV_QP_AV) || !(attr_mask & IBV_QP_DEST_QPN)) {
+                return EINVAL;
+            }
+            // The peer's ring exists as soon as its queue pair does
+            if(!qp->outbound.open(ring_name(attr->ah_attr.dlid, attr->dest_qp_num))) {
+                return ENOENT;
+            }
+            qp->dlid = attr->ah_attr.dlid;
+            qp->dest_qp_num = attr->dest_qp_num;
+            break;
+        case IBV_QPS_RTS:
+            if(qp->state != IBV_QPS_RTR && qp->state != IBV_QPS_RTS) {
+                return EINVAL;
+            }
+            break;
+        case IBV_QPS_ERR:
+            fail(qp, IBV_WC_WR_FLUSH_ERR);
+            break;
+        default:
+            return EINVAL;
+    }
+    qp->state = attr->qp_state;
+    return 0;
+}
+
+int ibv_destroy_qp(struct ibv_qp* ibqp) {
+    lb_qp* qp = static_cast<lb_qp*>(ibqp);
+    {
+        // Waits for the progress thread to be done with it
+        std::lock_guard<std::mutex> lock(the_device->qps_mutex);
+        the_device->qps.erase(qp->qp_num);
+    }
+    delete qp;
+    return 0;
+}
+
+struct ibv_ah* ibv_create_ah(struct ibv_pd* pd, struct ibv_ah_attr* attr) {
+    // There are no unreliable datagram queue pairs to address
+    errno = EOPNOTSUPP;
+    return nullptr;
+}
+
+int ibv_destroy_ah(struct ibv_ah* ah) {
+    return EINVAL;
+}
+
+const char* ibv_wc_status_str(enum ibv_wc_status status) {
+    static const char* const status_names[] = {
+            "success",
+            "local length error",
+            "local QP operation error",
+            "local EE context operation error",
+            "local protection error",
+            "Work Request Flushed Error",
+            "memory management operation error",
+            "bad response error",
+            "local access error",
+            "remote invalid request error",
+            "remote access error",
+            "remote operation error",
+            "transport retry counter exceeded",
+            "RNR retry counter exceeded",
+            "local RDD violation error",
+            "remote invalid RD request",
+            "aborted error",
+            "invalid EE context number",
+            "invalid EE context state",
+            "fatal error",
+            "response timeout error",
+            "general error"};
+    const size_t count = sizeof(status_names) / sizeof(status_names[0]);
+    return (size_t)status < count ? status_names[status] : "unknown";
+}
+
+}  // extern "C"
@@ -0,0 +1,244 @@
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <array>
+#include "ErasureCode.hpp"
+#include "PersistException.hpp"
+
+namespace ns_persistent {
+
+  // the fragments are coded in blocks of this many bytes, so that the
+  // parity being computed stays in the cache while every data fragment is
+  // added to it.
+  #define GF_BLOCK_SIZE ((uint64_t)(1UL<<14))
+
+  // log and exp tables of GF(2^8) with the polynomial x^8+x^4+x^3+x^2+1
+  // and the generator 2. exp is doubled so that log sums need no modulo.
+  struct GaloisTables {
+    std::array<uint8_t,512> exp;
+    std::array<uint8_t,256> log;
+    GaloisTables() {
+      uint32_t x = 1;
+      for (uint32_t i = 0; i < 255; i++) {
+        exp[i] = exp[i + 255] = (uint8_t)x;
+        log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) {
+          x ^= 0x11D;
+        }
+      }
+      exp[510] = exp[511] = exp[0];
+      log[0] = 0;
+    }
+  };
+
+  static const GaloisTables & gf() {
+    static const GaloisTables tables;
+    return tables;
+  }
+
+  static uint8_t gfMul(const uint8_t a, const uint8_t b) {
+    if (a == 0 || b == 0) {
+      return 0;
+    }
+    return gf().exp[gf().log[a] + gf().log[b]];
+  }
+
+  static uint8_t gfInv(const uint8_t a) {
+    return gf().exp[255 - gf().log[a]];
+  }
+
+  // the kernels take the products of coef with the low and the high nibbles.
+  static void gfMulAddScalar(const uint8_t * lo, const uint8_t * hi,
+    const uint8_t * src, uint8_t * dst, const uint64_t & len) {
+    for (uint64_t i = 0; i < len; i++) {
+      dst[i] ^= lo[src[i] & 0x0F] ^ hi[src[i] >> 4];
+    }
+  }
+
+#if defined(__x86_64__)
+  __attribute__((target("ssse3")))
+  static void gfMulAddSsse3(const uint8_t * lo, const uint8_t * hi,
+    const uint8_t * src, uint8_t * dst, const uint64_t & len) {
+    const __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    const __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    uint64_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+      const __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+      const __m128i l = _mm_shuffle_epi8(tlo,_mm_and_si128(s,mask));
+      const __m128i h = _mm_shuffle_epi8(thi,_mm_and_si128(_mm_srli_epi64(s,4),mask));
+      const __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+      _mm_storeu_si128((__m128i *)(dst + i),_mm_xor_si128(d,_mm_xor_si128(l,h)));
+    }
+    gfMulAddScalar(lo,hi,src + i,dst + i,len - i);
+  }
+
+  __attribute__((target("avx2")))
+  static void gfMulAddAvx2(const uint8_t * lo, const uint8_t * hi,
+    const uint8_t * src, uint8_t * dst, const uint64_t & len) {
+    const __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    const __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    uint64_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+      const __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+      const __m256i l = _mm256_shuffle_epi8(tlo,_mm256_and_si256(s,mask));
+      const __m256i h = _mm256_shuffle_epi8(thi,_mm256_and_si256(_mm256_srli_epi64(s,4),mask));
+      const __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+      _mm256_storeu_si256((__m256i *)(dst + i),_mm256_xor_si256(d,_mm256_xor_si256(l,h)));
+    }
+    gfMulAddScalar(lo,hi,src + i,dst + i,len - i);
+  }
+#endif
+
+  void gfMulAdd(const uint8_t coef, const uint8_t * src, uint8_t * dst,
+    const uint64_t & len) noexcept(true) {
+    if (coef == 0) {
+      return;
+    }
+    uint8_t lo[16], hi[16];
+    for (uint8_t n = 0; n < 16; n++) {
+      lo[n] = gfMul(coef,n);
+      hi[n] = gfMul(coef,(uint8_t)(n << 4));
+    }
+#if defined(__x86_64__)
+    // __builtin_cpu_supports also checks that the os saves the ymm registers.
+    enum GfKernel { SCALAR, SSSE3, AVX2 };
+    static const GfKernel kernel = []() {
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) {
+        return AVX2;
+      }
+      if (__builtin_cpu_supports("ssse3")) {
+        return SSSE3;
+      }
+      return SCALAR;
+    }();
+    switch (kernel) {
+    case AVX2:
+      gfMulAddAvx2(lo,hi,src,dst,len);
+      return;
+    case SSSE3:
+      gfMulAddSsse3(lo,hi,src,dst,len);
+      return;
+    default:
+      break;
+    }
+#endif
+    gfMulAddScalar(lo,hi,src,dst,len);
+  }
+
+  ReedSolomon::ReedSolomon(const uint32_t & k, const uint32_t & m)
+  noexcept(false) :
+    m_iData(k),
+    m_iParity(m),
+    m_vParityRows(k * m) {
+    if (k == 0 || k + m > 256) {
+      throw PERSIST_EXP_INV_ERASURE_CODE(k + m);
+    }
+    // the Cauchy matrix 1/(x_i + y_j) with x_i = k+i and y_j = j, whose
+    // square submatrices, even with rows of the identity, are all invertible.
+    for (uint32_t i = 0; i < m; i++) {
+      for (uint32_t j = 0; j < k; j++) {
+        this->m_vParityRows[i * k + j] = gfInv((uint8_t)((k + i) ^ j));
+      }
+    }
+  }
+
+  void ReedSolomon::encode(const uint8_t * const * data, uint8_t * const * parity,
+    const uint64_t & len) const noexcept(true) {
+    for (uint64_t ofst = 0; ofst < len; ofst += GF_BLOCK_SIZE) {
+      const uint64_t n = (len - ofst < GF_BLOCK_SIZE) ? (len - ofst) : GF_BLOCK_SIZE;
+      for (uint32_t i = 0; i < this->m_iParity; i++) {
+        memset(parity[i] + ofst,0,n);
+        for (uint32_t j = 0; j < this->m_iData; j++) {
+          gfMulAdd(this->m_vParityRows[i * this->m_iData + j],data[j] + ofst,parity[i] + ofst,n);
+        }
+      }
+    }
+  }
+
+  void ReedSolomon::reconstruct(uint8_t * const * fragments, const std::vector<bool> & present,
+    const uint64_t & len) const noexcept(false) {
+    const uint32_t k = this->m_iData;
+    // the first k fragments present are decoded from.
+    std::vector<uint32_t> rows;
+    bool bDataMissing = false;
+    for (uint32_t f = 0; f < k + this->m_iParity; f++) {
+      if (present[f] && rows.size() < k) {
+        rows.push_back(f);
+      }
+      if (!present[f] && f < k) {
+        bDataMissing = true;
+      }
+    }
+    if (rows.size() < k) {
+      throw PERSIST_EXP_RECONSTRUCT(rows.size());
+    }
+    if (bDataMissing) {
+      // invert the rows of the chosen fragments by Gauss-Jordan elimination;
+      // the rows of the inverse give the data fragments from the chosen ones.
+      std::vector<uint8_t> a(k * k,0), b(k * k,0);
+      for (uint32_t r = 0; r < k; r++) {
+        if (rows[r] < k) {
+          a[r * k + rows[r]] = 1;
+        } else {
+          memcpy(&a[r * k],&this->m_vParityRows[(rows[r] - k) * k],k);
+        }
+        b[r * k + r] = 1;
+      }
+      for (uint32_t c = 0; c < k; c++) {
+        uint32_t pivot = c;
+        while (pivot < k && a[pivot * k + c] == 0) {
+          pivot ++;
+        }
+        if (pivot == k) {
+          throw PERSIST_EXP_INV_ERASURE_CODE(c);
+        }
+        if (pivot != c) {
+          for (uint32_t j = 0; j < k; j++) {
+            std::swap(a[pivot * k + j],a[c * k + j]);
+            std::swap(b[pivot * k + j],b[c * k + j]);
+          }
+        }
+        const uint8_t scale = gfInv(a[c * k + c]);
+        for (uint32_t j = 0; j < k; j++) {
+          a[c * k + j] = gfMul(a[c * k + j],scale);
+          b[c * k + j] = gfMul(b[c * k + j],scale);
+        }
+        for (uint32_t r = 0; r < k; r++) {
+          const uint8_t factor = a[r * k + c];
+          if (r == c || factor == 0) {
+            continue;
+          }
+          for (uint32_t j = 0; j < k; j++) {
+            a[r * k + j] ^= gfMul(factor,a[c * k + j]);
+            b[r * k + j] ^= gfMul(factor,b[c * k + j]);
+          }
+        }
+      }
+      for (uint32_t d = 0; d < k; d++) {
+        if (present[d]) {
+          continue;
+        }
+        memset(fragments[d],0,len);
+        for (uint32_t r = 0; r < k; r++) {
+          gfMulAdd(b[d * k + r],fragments[rows[r]],fragments[d],len);
+        }
+      }
+    }
+    // the data is complete now, so the parity is encoded again.
+    for (uint32_t i = 0; i < this->m_iParity; i++) {
+      if (present[k + i]) {
+        continue;
+      }
+      memset(fragments[k + i],0,len);
+      for (uint32_t j = 0; j < k; j++) {
+        gfMulAdd(this->m_vParityRows[i * k + j],fragments[j],fragments[k + i],len);
+      }
+    }
+  }
+
+}
@@ -0,0 +1,51 @@
+#ifndef ERASURE_CODE_HPP
+#define ERASURE_CODE_HPP
+
+#include <inttypes.h>
+#include <vector>
+
+namespace ns_persistent {
+
+  // A systematic Reed-Solomon code over GF(2^8): k data fragments are kept
+  // as they are, and m parity fragments are computed from them with the rows
+  // of a Cauchy matrix, so that any k of the k+m fragments are enough to
+  // rebuild the others. The multiplications run 16 or 32 bytes at a time
+  // with the pshufb nibble tables of ISA-L where the cpu has SSSE3 or AVX2.
+  class ReedSolomon {
+  private:
+    const uint32_t m_iData;
+    const uint32_t m_iParity;
+    // the coefficients of the parity fragments, m rows of k.
+    std::vector<uint8_t> m_vParityRows;
+
+  public:
+    // @param k the number of data fragments, at least 1
+    // @param m the number of parity fragments; k+m is at most 256.
+    ReedSolomon(const uint32_t & k, const uint32_t & m) noexcept(false);
+
+    uint32_t dataFragments() const {
+      return this->m_iData;
+    }
+    uint32_t parityFragments() const {
+      return this->m_iParity;
+    }
+
+    // compute the m parity fragments of the k data fragments, all of len bytes.
+    void encode(const uint8_t * const * data, uint8_t * const * parity,
+      const uint64_t & len) const noexcept(true);
+
+    // rebuild the fragments that are not present from k that are. fragments
+    // holds the k+m fragments, data first, each of len bytes; the missing
+    // ones are overwritten. Throws PERSIST_EXP_RECONSTRUCT with the number
+    // of fragments present if there are fewer than k.
+    void reconstruct(uint8_t * const * fragments, const std::vector<bool> & present,
+      const uint64_t & len) const noexcept(false);
+  };
+
+  // dst ^= coef * src over GF(2^8)
+  void gfMulAdd(const uint8_t coef, const uint8_t * src, uint8_t * dst,
+    const uint64_t & len) noexcept(true);
+
+}
+
+#endif//ERASURE_CODE_HPP
@@ -1,14 +1,42 @@
+#include <dirent.h>
 #include <errno.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#include <array>
+#include <chrono>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+#ifdef PERSIST_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef PERSIST_HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include "util.hpp"
 #include "FilePersistLog.hpp"
 
+// for older c libraries; the kernel rejects them if it does not support them.
+#ifndef MAP_SHARED_VALIDATE
+#define MAP_SHARED_VALIDATE 0x03
+#endif
+#ifndef MAP_SYNC
+#define MAP_SYNC 0x80000
+#endif
+
 using namespace std;
 
 namespace ns_persistent{
@@ -23,23 +51,120 @@ namespace ns_persistent{
   // verify the existence of the log file
   static bool checkOrCreateLogFile(const string & logFile) noexcept(false);
 
-  // verify the existence of the data file
-  static bool checkOrCreateDataFile(const string & dataFile) noexcept(false);
+  // read the persisted header from a meta file, picking the newest valid
+  // slot if it holds header slots. Returns true if it does.
+  static bool readMetaHeader(const string & metaFile, MetaHeader * pHeader) noexcept(false);
+
+  // the checksum of a header slot, computed with the checksum field zeroed
+  static uint32_t metaChecksum(const MetaHeader & header);
+
+  // the crc32c of a range, continuing from crc, computed with the cpu's crc
+  // instructions where it has them.
+  static uint32_t crc32c(uint32_t crc, const void * data, uint64_t len) noexcept(true);
+
+  // write back the cache lines of a range to memory and wait for them.
+  static void flushCacheLines(const void * addr, const uint64_t & len) noexcept(true);
+
+  // copy a file through a swap file, so that the copy is either complete and
+  // on disk, or does not exist.
+  static void copyFileDurably(const string & from, const string & to) noexcept(false);
+
+  // write a buffer to a file through a swap file, like copyFileDurably().
+  static void writeFileDurably(const string & to, const void * buf, const uint64_t & len) noexcept(false);
+
+  // read len bytes of a file into buf, returning false if it cannot.
+  static bool readFileFully(const string & file, void * buf, const uint64_t & len) noexcept(true);
+
+  // put a copy of a data segment file at to, which shares the blocks of the
+  // file from where it can: a hard link to it if bLink, otherwise a reflink.
+  // Failing both, or if from is empty, the first len bytes of the segment,
+  // mapped at addr, are written to to like writeFileDurably().
+  static void cloneSegment(const string & from, const string & to, const void * addr,
+    const uint64_t & len, const bool bLink) noexcept(false);
+
+  // make the entries of a directory durable, such as the links made in it.
+  static void syncDir(const string & dirPath) noexcept(false);
+
+  // check the files of a log and start reading its live data into the page
+  // cache. Returns false if the log is invalid.
+  static bool preloadLog(const string & dataPath, const string & name) noexcept(true);
+
+  // get the data of a log entry, decompressing it into buf if needed.
+  static const void * inflateData(const LogEntry & entry, const void * pdat,
+    std::vector<char> & buf) noexcept(false);
+
+  // the buffers of the calling thread for compression in append() and for
+  // the compressed entries returned by the getters.
+  static thread_local std::vector<char> tl_deflated;
+  static thread_local std::vector<char> tl_inflated;
+
+  // compare the hlcs of log entries
+  static inline bool hlcLess(const LogEntry * e1, const LogEntry * e2) {
+    return (e1->fields.hlc_r < e2->fields.hlc_r) ||
+      (e1->fields.hlc_r == e2->fields.hlc_r && e1->fields.hlc_l < e2->fields.hlc_l);
+  }
+
+  static inline bool hlcLess(const HLC & hlc, const LogEntry * e) {
+    return (hlc.m_rtc_us < e->fields.hlc_r) ||
+      (hlc.m_rtc_us == e->fields.hlc_r && hlc.m_logic < e->fields.hlc_l);
+  }
+
+  static inline bool hlcLess(const LogEntry * e, const HLC & hlc) {
+    return (e->fields.hlc_r < hlc.m_rtc_us) ||
+      (e->fields.hlc_r == hlc.m_rtc_us && e->fields.hlc_l < hlc.m_logic);
+  }
 
   ////////////////////////
   // visible to outside //
   ////////////////////////
 
-  FilePersistLog::FilePersistLog(const string &name, const string &dataPath) 
+  FilePersistLog::FilePersistLog(const string &name, const string &dataPath,
+    const uint64_t &segmentSize, const bool asyncPersist, const bool mappedHeader,
+    const LogCompression codec, const uint64_t &compressThreshold,
+    const string &coldPath, const uint64_t &coldAge, const bool pmem,
+    const uint64_t &preallocSegments, const bool hugePages,
+    const std::vector<string> &coldFragmentPaths, const uint32_t &coldParity)
   noexcept(false) : PersistLog(name),
     m_sDataPath(dataPath),
     m_sMetaFile(dataPath + "/" + name + "." + META_FILE_SUFFIX),
     m_sLogFile(dataPath + "/" + name + "." + LOG_FILE_SUFFIX),
     m_sDataFile(dataPath + "/" + name + "." + DATA_FILE_SUFFIX),
     m_iLogFileDesc(-1),
-    m_iDataFileDesc(-1),
     m_pLog(MAP_FAILED),
-    m_pData(MAP_FAILED) {
+    m_iSegmentSize(segmentSize),
+    m_vSegments(MAX_DATA_SEGMENTS,nullptr),
+    m_vSegmentFds(MAX_DATA_SEGMENTS,-1),
+    m_iSegmentHead(0),
+    m_iSegmentTail(0),
+    m_iNextDataOfst(0),
+    // writeback cannot be started on persistent memory, and the header is
+    // flushed like the rest.
+    m_bAsyncPersist(asyncPersist && !pmem),
+    m_bMappedHeader(mappedHeader || pmem),
+    m_pMetaSlots(nullptr),
+    m_iMetaSeq(0),
+    m_codec(codec),
+    m_iCompressThreshold(compressThreshold),
+    m_sColdPath(coldPath),
+    m_sColdDataFile(coldPath + "/" + name + "." + DATA_FILE_SUFFIX),
+    m_iColdAge(coldAge),
+    m_vSegmentCold(MAX_DATA_SEGMENTS,false),
+    m_vFragmentPaths(coldFragmentPaths),
+    m_bStopCold(false),
+    m_bPmem(pmem),
+    m_iPreallocSegments(preallocSegments),
+    m_bHugePages(hugePages),
+    m_bPendingBatch(false),
+    m_iReleasableSeg(0),
+    m_iPins(0),
+    m_bHlcOrdered(true),
+    m_iSeq(0) {
+    if (segmentSize == 0 || segmentSize % PAGE_SIZE != 0) {
+      throw PERSIST_EXP_INV_SEGMENT_SIZE(segmentSize);
+    }
+    if (!codecAvailable(codec)) {
+      throw PERSIST_EXP_INV_CODEC(codec);
+    }
 #ifdef _DEBUG
     spdlog::set_level(spdlog::level::trace);
 #endif
@@ -49,9 +174,27 @@ namespace ns_persistent{
     if (pthread_mutex_init(&this->m_perslock,NULL) != 0) {
       throw PERSIST_EXP_MUTEX_INIT(errno);
     }
+    if (!coldFragmentPaths.empty()) {
+      if (coldFragmentPaths.size() <= coldParity) {
+        throw PERSIST_EXP_INV_ERASURE_CODE(coldFragmentPaths.size());
+      }
+      this->m_pColdCode.reset(new ReedSolomon(coldFragmentPaths.size() - coldParity,coldParity));
+      if (segmentSize % (this->m_pColdCode->dataFragments() * PAGE_SIZE) != 0) {
+        throw PERSIST_EXP_INV_SEGMENT_SIZE(segmentSize);
+      }
+      for (const string & path : coldFragmentPaths) {
+        checkOrCreateDir(path);
+        this->m_vFragmentFiles.push_back(path + "/" + name + "." + DATA_FILE_SUFFIX);
+      }
+    } else if (!this->m_sColdPath.empty()) {
+      checkOrCreateDir(this->m_sColdPath);
+    }
     dbg_trace("{0} constructor: before load()",name);
     load();
     dbg_trace("{0} constructor: after load()",name);
+    if (isTiered()) {
+      this->m_coldThread = std::thread(&FilePersistLog::coldLoop,this);
+    }
   }
 
   void FilePersistLog::load()
@@ -63,54 +206,45 @@ namespace ns_persistent{
     // STEP 1: check and create files.
     bool bCreate = checkOrCreateMetaFile(this->m_sMetaFile);
     checkOrCreateLogFile(this->m_sLogFile);
-    checkOrCreateDataFile(this->m_sDataFile);
-    dbg_trace("{0}:checkOrCreateDataFile passed.",this->m_sName);
+    dbg_trace("{0}:checkOrCreateLogFile passed.",this->m_sName);
     // STEP 2: open files
     this->m_iLogFileDesc = open(this->m_sLogFile.c_str(),O_RDWR);
     if (this->m_iLogFileDesc == -1) {
       throw PERSIST_EXP_OPEN_FILE(errno);
     }
-    this->m_iDataFileDesc = open(this->m_sDataFile.c_str(),O_RDWR);
-    if (this->m_iDataFileDesc == -1) {
-      throw PERSIST_EXP_OPEN_FILE(errno);
+    // allocate the whole ring up front, so that writing an entry never
+    // waits for the file system to allocate a block.
+    if (this->m_iPreallocSegments > 0 &&
+      fallocate(this->m_iLogFileDesc,0,0,MAX_LOG_SIZE) != 0 && errno != EOPNOTSUPP) {
+      throw (errno == ENOSPC) ? PERSIST_EXP_NOSPACE_LOG : PERSIST_EXP_TRUNCATE_FILE(errno);
     }
     // STEP 3: mmap to memory
-    //// we map the log entry and data twice to faciliate the search and data
-    //// retrieving then the data is rewinding across the buffer end as follow:
+    //// we map the log entry twice to faciliate the search when the log is
+    //// rewinding across the buffer end as follow:
     //// [1][2][3][4][5][6][1][2][3][4][5][6]
+    //// The data segments are mapped on demand.
     this->m_pLog = mmap(NULL,MAX_LOG_SIZE<<1,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
     if(this->m_pLog == MAP_FAILED) {
       dbg_trace("{0}:reserve map space for log failed.", this->m_sName);
       throw PERSIST_EXP_MMAP_FILE(errno);
     }
-    if(mmap(this->m_pLog,MAX_LOG_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,this->m_iLogFileDesc,0) == MAP_FAILED) {
+    if(mapFile(this->m_pLog,MAX_LOG_SIZE,PROT_READ|PROT_WRITE,MAP_FIXED,this->m_iLogFileDesc) == MAP_FAILED) {
       dbg_trace("{0}:map ringbuffer space for the first half of log failed. Is the size of log ringbuffer aligned to page?", this->m_sName);
       throw PERSIST_EXP_MMAP_FILE(errno);
     }
-    if(mmap((void*)((uint64_t)this->m_pLog+MAX_LOG_SIZE),MAX_LOG_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,this->m_iLogFileDesc,0) == MAP_FAILED) {
+    if(mapFile((void*)((uint64_t)this->m_pLog+MAX_LOG_SIZE),MAX_LOG_SIZE,PROT_READ|PROT_WRITE,MAP_FIXED,this->m_iLogFileDesc) == MAP_FAILED) {
       dbg_trace("{0}:map ringbuffer space for the second half of log failed. Is the size of log ringbuffer aligned to page?", this->m_sName);
       throw PERSIST_EXP_MMAP_FILE(errno);
     }
-    //// data ringbuffer
-    this->m_pData = mmap(NULL,(size_t)(MAX_DATA_SIZE<<1),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
-    if (this->m_pData == MAP_FAILED) {
-      dbg_trace("{0}:reserve map space for data failed.", this->m_sName);
-      throw PERSIST_EXP_MMAP_FILE(errno);
-    }
-    if(mmap(this->m_pData,(size_t)(MAX_DATA_SIZE),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,this->m_iDataFileDesc,0) == MAP_FAILED) {
-      dbg_trace("{0}:map ringbuffer space for the first half of data failed. Is the size of data ringbuffer aligned to page?", this->m_sName);
-      throw PERSIST_EXP_MMAP_FILE(errno);
-    }
-    if(mmap((void*)((uint64_t)this->m_pData + MAX_DATA_SIZE),(size_t)MAX_DATA_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,this->m_iDataFileDesc,0) == MAP_FAILED) {
-      dbg_trace("{0}:map ringbuffer space for the second half of data failed. Is the size of data ringbuffer aligned to page?", this->m_sName);
-      throw PERSIST_EXP_MMAP_FILE(errno);
-    }
-    dbg_trace("{0}:data/meta file mapped to memory",this->m_sName);
+    dbg_trace("{0}:log file mapped to memory",this->m_sName);
     // STEP 4: initialize the header for new created Metafile
     if (bCreate) {
+      memset((void*)META_HEADER,0,sizeof(MetaHeader));
       META_HEADER->fields.head = 0ll;
       META_HEADER->fields.tail = 0ll;
       META_HEADER->fields.ver = INVALID_VERSION;
+      META_HEADER->fields.dseg = this->m_iSegmentSize;
+      memset((void*)META_HEADER_PERS,0,sizeof(MetaHeader));
       META_HEADER_PERS->fields.head = -1ll; // -1 means uninitialized
       META_HEADER_PERS->fields.tail = -1ll; // -1 means uninitialized
       META_HEADER_PERS->fields.ver = INVALID_VERSION;
@@ -119,6 +253,9 @@ namespace ns_persistent{
       FPL_PERS_LOCK;
 
       try {
+        if (this->m_bMappedHeader) {
+          mapMetaSlots();
+        }
         persistMetaHeaderAtomically(META_HEADER);
       } catch (uint64_t e) {
         FPL_PERS_UNLOCK;
@@ -132,24 +269,63 @@ namespace ns_persistent{
       FPL_WRLOCK;
       FPL_PERS_LOCK;
       try {
-        int fd = open(this->m_sMetaFile.c_str(), O_RDONLY);
-        if (fd == -1) {
-          throw PERSIST_EXP_OPEN_FILE(errno);
+        const bool bSlots = readMetaHeader(this->m_sMetaFile, META_HEADER_PERS);
+        if (this->m_bMappedHeader) {
+          this->m_iMetaSeq = bSlots ? META_HEADER_PERS->fields.seq : 0;
+          mapMetaSlots();
+          // a single header becomes the first slot written
+          if (!bSlots) {
+            persistMetaHeaderAtomically(META_HEADER_PERS);
+          }
         }
-        ssize_t nRead = read(fd, (void*)META_HEADER_PERS, sizeof(MetaHeader));
-        if(nRead != sizeof(MetaHeader)) {
-          close(fd);
-          throw PERSIST_EXP_READ_FILE(errno);
-        }
-        close(fd);
         *META_HEADER = *META_HEADER_PERS;
-        // update mhlc index
-        for(int64_t idx = META_HEADER->fields.head;idx < META_HEADER->fields.tail;idx++) {
-          struct hlc_index_entry _ent;
-          _ent.hlc.m_rtc_us = LOG_ENTRY_AT(idx)->fields.hlc_r;
-          _ent.hlc.m_logic = LOG_ENTRY_AT(idx)->fields.hlc_l;
-          _ent.log_idx = idx;
-          this->hidx.insert(_ent);
+        // an existing log keeps the segment size it is created with.
+        if (META_HEADER->fields.dseg != 0 && META_HEADER->fields.dseg != this->m_iSegmentSize) {
+          dbg_warn("{0}:use the existing segment size {1} instead of {2}.",
+            this->m_sName, META_HEADER->fields.dseg, this->m_iSegmentSize);
+          this->m_iSegmentSize = META_HEADER->fields.dseg;
+        }
+        META_HEADER->fields.dseg = this->m_iSegmentSize;
+        if (this->m_pColdCode &&
+            this->m_iSegmentSize % (this->m_pColdCode->dataFragments() * PAGE_SIZE) != 0) {
+          throw PERSIST_EXP_INV_SEGMENT_SIZE(this->m_iSegmentSize);
+        }
+        // map the segments with live data
+        if (META_HEADER->fields.tail > 0) {
+          this->m_iNextDataOfst = LOG_ENTRY_AT(META_HEADER->fields.tail - 1)->fields.ofst +
+            LOG_ENTRY_AT(META_HEADER->fields.tail - 1)->fields.dlen;
+        }
+        this->m_iSegmentHead = this->m_iSegmentTail = (NUM_USED_SLOTS > 0) ?
+          DATA_SEGMENT_OF(LOG_ENTRY_AT(META_HEADER->fields.head)->fields.ofst) :
+          DATA_SEGMENT_OF(this->m_iNextDataOfst);
+        // an asynchronous persist or a crash of the device may have left
+        // the last entries incomplete.
+        verifyTail();
+        // the used log entries are all read below to build the hlc index,
+        // and the live data is most likely read soon after recovery
+        if (NUM_USED_SLOTS > 0) {
+          void * first = ALIGN_TO_PAGE(LOG_ENTRY_AT(META_HEADER->fields.head));
+          uint64_t len = (uint64_t)(LOG_ENTRY_AT(META_HEADER->fields.head) + NUM_USED_SLOTS) - (uint64_t)first;
+          if (madvise(first, len, MADV_WILLNEED) != 0) {
+            dbg_warn("{0}:madvise on the log entries failed with errno {1}.", this->m_sName, errno);
+          }
+        }
+        mapSegmentsUpTo(DATA_SEGMENT_OF(NEXT_DATA_OFST), true);
+        // the first append after recovery writes at the tail, so its pages
+        // are read in now instead of being faulted in by the first message
+        if (madvise(ALIGN_TO_PAGE(NEXT_LOG_ENTRY), PAGE_SIZE, MADV_WILLNEED) != 0 ||
+            madvise(ALIGN_TO_PAGE(DATA_AT(NEXT_DATA_OFST)), PAGE_SIZE, MADV_WILLNEED) != 0) {
+          dbg_warn("{0}:madvise on the log tail failed with errno {1}.", this->m_sName, errno);
+        }
+        // the hlc index is only needed if the log is not ordered by hlc
+        for(int64_t idx = META_HEADER->fields.head + 1;idx < META_HEADER->fields.tail;idx++) {
+          if (hlcLess(LOG_ENTRY_AT(idx), LOG_ENTRY_AT(idx-1))) {
+            this->m_bHlcOrdered = false;
+            break;
+          }
+        }
+        if (!this->m_bHlcOrdered) {
+          buildHlcIndex();
         }
       } catch (uint64_t e) {
         FPL_PERS_UNLOCK;
@@ -173,28 +349,111 @@ namespace ns_persistent{
 
   FilePersistLog::~FilePersistLog()
   noexcept(true){
+    if (this->m_coldThread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lck(this->m_coldMutex);
+        this->m_bStopCold = true;
+      }
+      this->m_coldCond.notify_all();
+      this->m_coldThread.join();
+    }
+    // do not lose the batch started by the last persist() in async mode.
+    if (this->m_bPendingBatch) {
+      try {
+        completeBatch(this->m_pendingBatch);
+      } catch (...) {
+        dbg_warn("{0}:failed to complete the pending flush.",this->m_sName);
+      }
+      this->m_bPendingBatch = false;
+    }
     pthread_rwlock_destroy(&this->m_rwlock);
     pthread_mutex_destroy(&this->m_perslock);
-    if (this->m_pData != MAP_FAILED){
-      munmap(m_pData,(size_t)(MAX_DATA_SIZE<<1));
+    for (int64_t seg = this->m_iSegmentHead; seg < this->m_iSegmentTail; seg++) {
+      if (DATA_SEGMENT_AT(seg) != nullptr) {
+        munmap(DATA_SEGMENT_AT(seg),this->m_iSegmentSize);
+        DATA_SEGMENT_AT(seg) = nullptr;
+      }
+      if (DATA_SEGMENT_FD(seg) != -1) {
+        close(DATA_SEGMENT_FD(seg));
+        DATA_SEGMENT_FD(seg) = -1;
+      }
     }
-    this->m_pData = nullptr; // prevent ~MemLog() destructor to release it again.
     if (this->m_pLog != MAP_FAILED){
-      munmap(m_pLog,MAX_LOG_SIZE);
+      munmap(m_pLog,MAX_LOG_SIZE<<1);
     }
     this->m_pLog = nullptr; // prevent ~MemLog() destructor to release it again.
     if (this->m_iLogFileDesc != -1){
       close(this->m_iLogFileDesc);
     }
-    if (this->m_iDataFileDesc != -1){
-      close(this->m_iDataFileDesc);
+    if (this->m_pMetaSlots != nullptr) {
+      munmap(this->m_pMetaSlots,META_SIZE*META_SLOTS);
+    }
+  }
+
+  std::vector<string> FilePersistLog::preload(const string &dataPath, unsigned int numThreads)
+  noexcept(false) {
+    std::vector<string> names;
+    DIR * dir = opendir(dataPath.c_str());
+    if (dir == nullptr) {
+      if (errno == ENOENT) {
+        return names; // nothing to recover
+      }
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    const string suffix = string(".") + META_FILE_SUFFIX;
+    struct dirent * ent;
+    while ((ent = readdir(dir)) != nullptr) {
+      const string fileName(ent->d_name);
+      if (fileName.size() > suffix.size() &&
+          fileName.compare(fileName.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        names.push_back(fileName.substr(0, fileName.size() - suffix.size()));
+      }
+    }
+    closedir(dir);
+
+    if (numThreads == 0) {
+      numThreads = MAX(std::thread::hardware_concurrency(), 1u);
+    }
+    numThreads = MIN(numThreads, (unsigned int)names.size());
+    std::atomic<size_t> next(0);
+    std::mutex invalidLock;
+    std::vector<string> invalid;
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < numThreads; i++) {
+      workers.emplace_back([&]() {
+        size_t idx;
+        while ((idx = next.fetch_add(1)) < names.size()) {
+          if (!preloadLog(dataPath, names[idx])) {
+            std::lock_guard<std::mutex> lck(invalidLock);
+            invalid.push_back(names[idx]);
+          }
+        }
+      });
+    }
+    for (auto & worker : workers) {
+      worker.join();
     }
+    dbg_info("preloaded {0} logs in {1} with {2} threads, {3} invalid.",
+      names.size(), dataPath, numThreads, invalid.size());
+    return invalid;
   }
 
   void FilePersistLog::append(const void *pdat, const uint64_t & size, const int64_t &ver, const HLC & mhlc)
   noexcept(false) {
     dbg_trace("{0} append event ({1},{2})",this->m_sName, mhlc.m_rtc_us, mhlc.m_logic);
-    FPL_RDLOCK;
+    // compress before taking the lock, so that readers are not held up.
+    const void * pdata = pdat;
+    uint64_t dlen = size;
+    LogCompression codec = LC_NONE;
+    if (this->m_codec != LC_NONE && size > 0 && size >= this->m_iCompressThreshold) {
+      const uint64_t clen = compressData(this->m_codec,pdat,size,tl_deflated);
+      if (clen > 0) {
+        pdata = tl_deflated.data();
+        dlen = clen;
+        codec = this->m_codec;
+      }
+    }
+    FPL_WRLOCK;
 
 #define __DO_VALIDATION \
     do { \
@@ -202,9 +461,9 @@ namespace ns_persistent{
         FPL_UNLOCK; \
         throw PERSIST_EXP_NOSPACE_LOG; \
       } \
-      if (NUM_FREE_BYTES < size) { \
-        dbg_trace("{0}-append exception no space for data: NUM_FREE_BYTES={1}, size={2}", \
-          this->m_sName, NUM_FREE_BYTES, size); \
+      if (placeData(dlen) < 0) { \
+        dbg_trace("{0}-append exception no space for data: NUM_USED_BYTES={1}, size={2}", \
+          this->m_sName, NUM_USED_BYTES, dlen); \
         FPL_UNLOCK; \
         throw PERSIST_EXP_NOSPACE_DATA; \
       } \
@@ -221,26 +480,29 @@ namespace ns_persistent{
 #pragma GCC diagnostic ignored "-Wunused-variable"
     __DO_VALIDATION;
 #pragma GCC diagnostic pop
-    FPL_UNLOCK;
-    dbg_trace("{0} append:validate check1 Finished.",this->m_sName);
-
-    FPL_WRLOCK;
-    //check
-#pragma GCC diagnostic ignored "-Wunused-variable"
-    __DO_VALIDATION;
-#pragma GCC diagnostic pop
-    dbg_trace("{0} append:validate check2 Finished.",this->m_sName);
+    dbg_trace("{0} append:validate check Finished.",this->m_sName);
 
     // copy data
-    memcpy(NEXT_DATA,pdat,size);
+    const uint64_t ofst = (uint64_t)placeData(dlen);
+    try {
+      mapSegmentsUpTo(DATA_SEGMENT_OF(ofst));
+    } catch (uint64_t e) {
+      FPL_UNLOCK;
+      throw e;
+    }
+    memcpy(DATA_AT(ofst),pdata,dlen);
     dbg_trace("{0} append:data is copied to log.",this->m_sName);
 
     // fill the log entry
     NEXT_LOG_ENTRY->fields.ver = ver;
-    NEXT_LOG_ENTRY->fields.dlen = size;
-    NEXT_LOG_ENTRY->fields.ofst = NEXT_DATA_OFST;
+    NEXT_LOG_ENTRY->fields.dlen = dlen;
+    NEXT_LOG_ENTRY->fields.ofst = ofst;
     NEXT_LOG_ENTRY->fields.hlc_r = mhlc.m_rtc_us;
     NEXT_LOG_ENTRY->fields.hlc_l = mhlc.m_logic;
+    NEXT_LOG_ENTRY->fields.rlen = size;
+    NEXT_LOG_ENTRY->fields.codec = codec;
+    // the slot may hold the checksum of an entry the ring wrapped over.
+    NEXT_LOG_ENTRY->fields.crc = 0;
 /* No Sync required here.
     if (msync(ALIGN_TO_PAGE(NEXT_LOG_ENTRY), 
         sizeof(LogEntry) + (((uint64_t)NEXT_LOG_ENTRY) % PAGE_SIZE),MS_SYNC) != 0) {
@@ -249,10 +511,28 @@ namespace ns_persistent{
     }
 */
 
-    // update meta header
-    this->hidx.insert(hlc_index_entry{mhlc,META_HEADER->fields.tail});
+    // update the hlc index, which is built once the log goes out of hlc order.
+    const bool bHlcOrdered = (NUM_USED_SLOTS == 0) ||
+      (this->m_bHlcOrdered && !hlcLess(NEXT_LOG_ENTRY, LOG_ENTRY_AT(CURR_LOG_IDX)));
+    try {
+      if (bHlcOrdered) {
+        this->hidx.clear();
+      } else {
+        if (this->m_bHlcOrdered) {
+          buildHlcIndex();
+        }
+        this->hidx.append(hlc_index_entry{mhlc,META_HEADER->fields.tail});
+      }
+    } catch (...) {
+      FPL_UNLOCK;
+      throw PERSIST_EXP_ALLOC(ENOMEM);
+    }
+    FPL_SEQ_WRITE_BEGIN;
+    this->m_bHlcOrdered = bHlcOrdered;
     META_HEADER->fields.tail ++;
     META_HEADER->fields.ver = ver;
+    this->m_iNextDataOfst = ofst + dlen;
+    FPL_SEQ_WRITE_END;
     dbg_trace("{0} append:log entry and meta data are updated.",this->m_sName);
 /* No sync
     if (msync(this->m_pMeta,sizeof(MetaHeader),MS_SYNC) != 0) {
@@ -269,7 +549,9 @@ namespace ns_persistent{
     noexcept(false) {
     FPL_WRLOCK;
     if (META_HEADER->fields.ver < ver){
+      FPL_SEQ_WRITE_BEGIN;
       META_HEADER->fields.ver = ver;
+      FPL_SEQ_WRITE_END;
     } else {
       FPL_UNLOCK;
       throw PERSIST_EXP_INV_VERSION;
@@ -281,14 +563,32 @@ namespace ns_persistent{
     noexcept(false) {
     int64_t ver_ret = INVALID_VERSION;
     FPL_PERS_LOCK;
-    FPL_RDLOCK;
 
-    if(*META_HEADER == *META_HEADER_PERS) {
-      if (CURR_LOG_IDX != -1){
-        //ver_ret = LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ver;
-        ver_ret = META_HEADER->fields.ver;
+    // everything up to the base header is either persisted or being
+    // written back.
+    const MetaHeader base = this->m_bPendingBatch ?
+      this->m_pendingBatch.header : *META_HEADER_PERS;
+    // the tail and the entries before it are read like the getters read
+    // them, so that persist() never holds up append().
+    FlushBatch batch;
+    const bool bNewBatch = seqRead([&](){
+      const bool bNew = !(*META_HEADER == base);
+      if (bNew) {
+        snapshotBatch(batch,base);
+      }
+      //get the latest flushed version
+      ver_ret = (NUM_USED_SLOTS > 0) ? META_HEADER->fields.ver : INVALID_VERSION;
+      return bNew;
+    });
+
+    if (!bNewBatch && !this->m_bPendingBatch) {
+      // release what a former pin kept.
+      try {
+        releaseTrimmedSegments();
+      } catch (uint64_t e) {
+        FPL_PERS_UNLOCK;
+        throw e;
       }
-      FPL_UNLOCK;
       FPL_PERS_UNLOCK;
       return ver_ret;
     }
@@ -296,41 +596,37 @@ namespace ns_persistent{
     //flush data
     dbg_trace("{0} flush data,log,and meta.", this->m_sName);
     try {
-      // shadow the current state
-      void * flush_dstart, * flush_lstart;
-      size_t flush_dlen = 0, flush_llen = 0;
-      MetaHeader shadow_header = *META_HEADER;
-      if ((NUM_USED_SLOTS > 0) && 
-          (NEXT_LOG_ENTRY > NEXT_LOG_ENTRY_PERS)){
-        flush_dlen = (LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ofst +
-          LOG_ENTRY_AT(CURR_LOG_IDX)->fields.dlen - 
-          NEXT_LOG_ENTRY_PERS->fields.ofst);
-        // flush data
-        flush_dstart = ALIGN_TO_PAGE(NEXT_DATA_PERS);
-        flush_dlen += ((int64_t)NEXT_DATA_PERS)%PAGE_SIZE;
-        // flush log
-        flush_lstart = ALIGN_TO_PAGE(NEXT_LOG_ENTRY_PERS);
-        flush_llen = ((size_t)NEXT_LOG_ENTRY-(size_t)NEXT_LOG_ENTRY_PERS) + 
-          ((int64_t)NEXT_LOG_ENTRY_PERS)%PAGE_SIZE;
-      }
-      if (NUM_USED_SLOTS > 0) {
-        //get the latest flushed version
-        //ver_ret = LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ver;
-        ver_ret = META_HEADER->fields.ver;
+      if (bNewBatch) {
+        sealEntries(batch.lstart,batch.lend);
       }
-      FPL_UNLOCK;
-      if (flush_dlen > 0) {
-        if (msync(flush_dstart,flush_dlen,MS_SYNC) != 0) {
-          throw PERSIST_EXP_MSYNC(errno);
+      if (!this->m_bAsyncPersist) {
+        completeBatch(batch);
+      } else {
+        // start the new batch before waiting for the previous one, so the
+        // device works on both.
+        if (bNewBatch) {
+          startWriteback(batch);
         }
-      }
-      if (flush_llen > 0) {
-        if (msync(flush_lstart,flush_llen,MS_SYNC) != 0) {
-          throw PERSIST_EXP_MSYNC(errno);
+        if (this->m_bPendingBatch) {
+          completeBatch(this->m_pendingBatch);
+          this->m_bPendingBatch = false;
+        }
+        if (bNewBatch) {
+          this->m_pendingBatch = batch;
+          this->m_bPendingBatch = true;
+          // INVALID_VERSION would tell the caller there is nothing to
+          // persist, so the very first batch is completed right away.
+          if (META_HEADER_PERS->fields.ver == INVALID_VERSION) {
+            completeBatch(this->m_pendingBatch);
+            this->m_bPendingBatch = false;
+          }
         }
+        // report only what is durable.
+        ver_ret = META_HEADER_PERS->fields.ver;
       }
-      // flush meta data
-      this->persistMetaHeaderAtomically(&shadow_header);
+      // get the next segments ready while append() is still filling the
+      // current one.
+      preallocateSegments();
     } catch (uint64_t e) {
       FPL_PERS_UNLOCK;
       throw e;
@@ -343,46 +639,39 @@ namespace ns_persistent{
 
   int64_t FilePersistLog::getLength ()
   noexcept(false) {
-
-    FPL_RDLOCK;
-    int64_t len = NUM_USED_SLOTS;
-    FPL_UNLOCK;
-
-    return len;
+    return seqRead([this](){
+      return (int64_t)NUM_USED_SLOTS;
+    });
   }
 
   int64_t FilePersistLog::getEarliestIndex ()
   noexcept(false) {
-    FPL_RDLOCK;
-    int64_t idx = (NUM_USED_SLOTS == 0)? INVALID_INDEX:META_HEADER->fields.head;
-    FPL_UNLOCK;
-    return idx;
+    return seqRead([this](){
+      return (NUM_USED_SLOTS == 0)? INVALID_INDEX:META_HEADER->fields.head;
+    });
   }
 
   int64_t FilePersistLog::getLatestIndex ()
   noexcept(false) {
-    FPL_RDLOCK;
-    int64_t idx = CURR_LOG_IDX;
-    FPL_UNLOCK;
-    return idx;
+    return seqRead([this](){
+      return (int64_t)CURR_LOG_IDX;
+    });
   }
 
   int64_t FilePersistLog::getEarliestVersion ()
   noexcept(false) {
-    FPL_RDLOCK;
-    int64_t idx = (NUM_USED_SLOTS == 0)? INVALID_INDEX:META_HEADER->fields.head;
-    int64_t ver = (idx == INVALID_INDEX)? INVALID_VERSION:(LOG_ENTRY_AT(idx)->fields.ver);
-    FPL_UNLOCK;
-    return ver;
+    return seqRead([this](){
+      return (NUM_USED_SLOTS == 0)? INVALID_VERSION:
+        LOG_ENTRY_AT(META_HEADER->fields.head)->fields.ver;
+    });
   }
 
   int64_t FilePersistLog::getLatestVersion ()
   noexcept(false) {
-    FPL_RDLOCK;
-    int64_t idx = CURR_LOG_IDX;
-    int64_t ver = (idx == INVALID_INDEX)? INVALID_VERSION:(LOG_ENTRY_AT(idx)->fields.ver);
-    FPL_UNLOCK;
-    return ver;
+    return seqRead([this](){
+      int64_t idx = CURR_LOG_IDX;
+      return (idx == -1)? INVALID_VERSION:(LOG_ENTRY_AT(idx)->fields.ver);
+    });
   }
 
 
@@ -400,17 +689,21 @@ namespace ns_persistent{
   const void * FilePersistLog::getEntryByIndex (const int64_t &eidx)
     noexcept(false) {
 
-    FPL_RDLOCK;
-    dbg_trace("{0}-getEntryByIndex-head:{1},tail:{2},eidx:{3}",
-      this->m_sName,META_HEADER->fields.head,META_HEADER->fields.tail,eidx);
-
-    int64_t ridx = (eidx < 0)?(META_HEADER->fields.tail + eidx):eidx;
-
-    if (META_HEADER->fields.tail <= ridx || ridx < META_HEADER->fields.head ) {
-      FPL_UNLOCK;
+    int64_t ridx = INVALID_INDEX;
+    LogEntry entry;
+    const void * pdat = seqRead([&](){
+      ridx = (eidx < 0)?(META_HEADER->fields.tail + eidx):eidx;
+      if (META_HEADER->fields.tail <= ridx || ridx < META_HEADER->fields.head ) {
+        ridx = INVALID_INDEX;
+        return (const void *)nullptr;
+      }
+      entry = *LOG_ENTRY_AT(ridx);
+      return (const void *)LOG_ENTRY_DATA(LOG_ENTRY_AT(ridx));
+    });
+    if (ridx == INVALID_INDEX) {
       throw PERSIST_EXP_INV_ENTRY_IDX(eidx);
     }
-    FPL_UNLOCK;
+    pdat = inflateData(entry,pdat,tl_inflated);
 
     dbg_trace("{0} getEntryByIndex at idx:{1} ver:{2} time:({3},{4})",
      this->m_sName,
@@ -419,7 +712,28 @@ namespace ns_persistent{
        (LOG_ENTRY_AT(ridx))->fields.hlc_r,
        (LOG_ENTRY_AT(ridx))->fields.hlc_l);
 
-    return LOG_ENTRY_DATA(LOG_ENTRY_AT(ridx));
+    return pdat;
+  }
+
+  void FilePersistLog::getEntryInfoByIndex (const int64_t &eidx,
+    int64_t &ver, HLC &hlc, uint64_t &size)
+    noexcept(false) {
+
+    const bool valid = seqRead([&](){
+      const int64_t ridx = (eidx < 0)?(META_HEADER->fields.tail + eidx):eidx;
+      if (META_HEADER->fields.tail <= ridx || ridx < META_HEADER->fields.head ) {
+        return false;
+      }
+      const LogEntry * ple = LOG_ENTRY_AT(ridx);
+      ver = ple->fields.ver;
+      hlc.m_rtc_us = ple->fields.hlc_r;
+      hlc.m_logic = ple->fields.hlc_l;
+      size = (ple->fields.codec == LC_NONE) ? ple->fields.dlen : ple->fields.rlen;
+      return true;
+    });
+    if (!valid) {
+      throw PERSIST_EXP_INV_ENTRY_IDX(eidx);
+    }
   }
 
   // binary search through the log
@@ -467,36 +781,249 @@ namespace ns_persistent{
     return pivot;
   }
 
-  const void * FilePersistLog::getEntry(const int64_t& ver)
+  int64_t FilePersistLog::searchVersion(const int64_t & ver) {
+    // Versions strictly increase along the log, so the entry at index i is
+    // at least i - head versions later than the head and at least
+    // tail - 1 - i versions earlier than the last entry. That bounds where
+    // the entry for ver can be: in a dense log the bounds meet and it is
+    // found without searching, and in a nearly dense one only a range as
+    // wide as the versions missing around it is searched.
+    const int64_t head = META_HEADER->fields.head;
+    const int64_t tail = META_HEADER->fields.tail;
+    if (tail <= head || ver < LOG_ENTRY_AT(head)->fields.ver) {
+      return -1;
+    }
+    const int64_t firstVer = LOG_ENTRY_AT(head)->fields.ver;
+    const int64_t lastVer = LOG_ENTRY_AT(tail - 1)->fields.ver;
+    if (ver >= lastVer) {
+      return tail - 1;
+    }
+    // the first entry later than ver is in (l,r]
+    int64_t l = MAX(head, tail - 1 - (lastVer - ver));
+    int64_t r = MIN(tail - 1, head + (ver - firstVer)) + 1;
+    while (l < r) {
+      const int64_t m = l + (r - l)/2;
+      if (LOG_ENTRY_AT(m)->fields.ver > ver) {
+        r = m;
+      } else {
+        l = m + 1;
+      }
+    }
+    return l - 1;
+  }
+
+  int64_t FilePersistLog::searchOrderedHlc(const HLC & rhlc) {
+    // the last entry no later than rhlc
+    int64_t l = META_HEADER->fields.head, r = META_HEADER->fields.tail;
+    while (l < r) {
+      const int64_t m = l + (r - l)/2;
+      if (hlcLess(rhlc, LOG_ENTRY_AT(m))) {
+        r = m;
+      } else {
+        l = m + 1;
+      }
+    }
+    if (l == META_HEADER->fields.head) {
+      return -1;
+    }
+    // the first entry with the same hlc
+    const LogEntry * found = LOG_ENTRY_AT(l - 1);
+    int64_t fl = META_HEADER->fields.head, fr = l - 1;
+    while (fl < fr) {
+      const int64_t m = fl + (fr - fl)/2;
+      if (hlcLess(LOG_ENTRY_AT(m), found)) {
+        fl = m + 1;
+      } else {
+        fr = m;
+      }
+    }
+    return fl;
+  }
+
+  int64_t FilePersistLog::searchHlcIndex(const HLC & rhlc) {
+//  We do not user binary search any more.
+//    //binary search
+//    int64_t head = META_HEADER->fields.head % MAX_LOG_ENTRY;
+//    int64_t tail = META_HEADER->fields.tail % MAX_LOG_ENTRY;
+//    if (tail < head) tail += MAX_LOG_ENTRY; //because we mapped it twice
+//    dbg_trace("{0} - begin binary search.",this->m_sName);
+//    int64_t l_idx = binarySearch<unsigned __int128>(
+//      [&](int64_t idx){
+//        return ((((unsigned __int128)LOG_ENTRY_AT(idx)->fields.hlc_r)<<64) | LOG_ENTRY_AT(idx)->fields.hlc_l);
+//      },
+//      key,head,tail);
+//    dbg_trace("{0} - end binary search.",this->m_sName);
+//    ple = (l_idx == -1) ? nullptr : LOG_ENTRY_AT(l_idx);
+    dbg_trace("getEntry for hlc({0},{1})",rhlc.m_rtc_us,rhlc.m_logic);
+    const int64_t idx = this->hidx.search(rhlc);
+    dbg_trace("hidx.size = {0}, getEntry returns idx:{1}",this->hidx.size(),idx);
+    return idx;
+  }
+
+  int64_t FilePersistLog::getVersionIndex(const int64_t & ver)
   noexcept(false) {
+    const int64_t idx = seqRead([&](){
+      return searchVersion(ver);
+    });
+    return (idx == -1) ? INVALID_INDEX : idx;
+  }
 
-    LogEntry * ple = nullptr;
+  int64_t FilePersistLog::getHLCIndex(const HLC & rhlc)
+  noexcept(false) {
+    // If the hlcs follow the index order, search the log itself without any
+    // lock. The result is the same as from the index: the first entry with
+    // the latest hlc no later than rhlc.
+    bool bOrdered = false;
+    int64_t idx = seqRead([&](){
+      bOrdered = this->m_bHlcOrdered;
+      return bOrdered ? searchOrderedHlc(rhlc) : (int64_t)-1;
+    });
+    if (!bOrdered) {
+      FPL_RDLOCK;
+      idx = searchHlcIndex(rhlc);
+      FPL_UNLOCK;
+    }
+    return (idx == -1) ? INVALID_INDEX : idx;
+  }
 
-    FPL_RDLOCK;
+  bool FilePersistLog::isZeroCopy(const void * pdata)
+  noexcept(true) {
+    const char * p = (const char *)pdata;
+    return tl_inflated.empty() || p < tl_inflated.data() ||
+      p >= tl_inflated.data() + tl_inflated.size();
+  }
+
+  template <typename RangeFunc, typename FilterFunc>
+  int64_t FilePersistLog::scan(const RangeFunc & range, const FilterFunc & filter,
+    const EntryVisitor & visitor) noexcept(false) {
+    struct ScanEntry {
+      LogEntry entry;
+      const void * pdata;
+    };
+    std::vector<ScanEntry> chunk(SCAN_CHUNK_ENTRIES);
+    // compressed entries are decompressed here one at a time
+    std::vector<char> inflated;
+    int64_t start = 0, end = 0, nVisited = 0;
+    pin();
+    try {
+      seqRead([&](){
+        range(start,end);
+        return 0;
+      });
+      for (int64_t idx = start; idx < end; idx += SCAN_CHUNK_ENTRIES) {
+        const int64_t n = MIN(end - idx, (int64_t)SCAN_CHUNK_ENTRIES);
+        // the slot of an entry is reused once the log wraps around
+        const bool bValid = seqRead([&](){
+          if (META_HEADER->fields.tail >= idx + (int64_t)MAX_LOG_ENTRY) {
+            return false;
+          }
+          for (int64_t i = 0; i < n; i++) {
+            chunk[i].entry = *LOG_ENTRY_AT(idx + i);
+            chunk[i].pdata = LOG_ENTRY_DATA(LOG_ENTRY_AT(idx + i));
+          }
+          return true;
+        });
+        if (!bValid) {
+          throw PERSIST_EXP_INV_ENTRY_IDX(idx);
+        }
+        for (int64_t i = 0; i < n; i++) {
+          const LogEntry & e = chunk[i].entry;
+          if (!filter(e)) {
+            continue;
+          }
+          nVisited ++;
+          const void * pdata = inflateData(e,chunk[i].pdata,inflated);
+          const uint64_t size = (e.fields.codec == LC_NONE) ? e.fields.dlen : e.fields.rlen;
+          if (!visitor(idx + i,e.fields.ver,HLC(e.fields.hlc_r,e.fields.hlc_l),
+                pdata,size)) {
+            unpin();
+            return nVisited;
+          }
+        }
+      }
+    } catch (...) {
+      unpin();
+      throw;
+    }
+    unpin();
+    return nVisited;
+  }
+
+  int64_t FilePersistLog::scanVersions(const int64_t & from, const int64_t & to,
+    const EntryVisitor & visitor) noexcept(false) {
+    return scan([&](int64_t & start, int64_t & end){
+        // the first entry not earlier than from
+        start = searchVersion(from);
+        if (start == -1) {
+          start = META_HEADER->fields.head;
+        } else if (LOG_ENTRY_AT(start)->fields.ver < from) {
+          start ++;
+        }
+        end = searchVersion(to);
+        end = (end == -1) ? start : end + 1;
+      },
+      [](const LogEntry &){ return true; },
+      visitor);
+  }
 
-    //binary search
-    int64_t head = META_HEADER->fields.head % MAX_LOG_ENTRY;
-    int64_t tail = META_HEADER->fields.tail % MAX_LOG_ENTRY;
-    if (tail < head) tail += MAX_LOG_ENTRY;
-    dbg_trace("{0} - begin binary search.",this->m_sName);
-    int64_t l_idx = binarySearch<int64_t>(
-      [&](int64_t idx){
-        return LOG_ENTRY_AT(idx)->fields.ver;
+  int64_t FilePersistLog::scanHLCs(const HLC & from, const HLC & to,
+    const EntryVisitor & visitor) noexcept(false) {
+    return scan([&](int64_t & start, int64_t & end){
+        // an unordered log is filtered as a whole
+        start = META_HEADER->fields.head;
+        end = META_HEADER->fields.tail;
+        if (!this->m_bHlcOrdered) {
+          return;
+        }
+        // the first entry not earlier than from
+        for (int64_t r = end; start < r;) {
+          const int64_t m = start + (r - start)/2;
+          if (hlcLess(LOG_ENTRY_AT(m),from)) {
+            start = m + 1;
+          } else {
+            r = m;
+          }
+        }
+        // the first entry later than to
+        for (int64_t l = start; l < end;) {
+          const int64_t m = l + (end - l)/2;
+          if (hlcLess(to,LOG_ENTRY_AT(m))) {
+            end = m;
+          } else {
+            l = m + 1;
+          }
+        }
+      },
+      [&](const LogEntry & e){
+        return !hlcLess(&e,from) && !hlcLess(to,&e);
       },
-      ver,head,tail);
-    ple = (l_idx == -1) ? nullptr : LOG_ENTRY_AT(l_idx);
-    dbg_trace("{0} - end binary search.",this->m_sName);
+      visitor);
+  }
 
-    FPL_UNLOCK;
+  const void * FilePersistLog::getEntry(const int64_t& ver)
+  noexcept(false) {
+
+    LogEntry * ple = nullptr;
+    LogEntry entry;
+
+    const void * pdat = seqRead([&](){
+      const int64_t l_idx = searchVersion(ver);
+      ple = (l_idx == -1) ? nullptr : LOG_ENTRY_AT(l_idx);
+      if (ple == nullptr) {
+        return (const void *)nullptr;
+      }
+      entry = *ple;
+      return (const void *)LOG_ENTRY_DATA(ple);
+    });
 
     // no object exists before the requested timestamp.
     if (ple == nullptr){
       return nullptr;
     }
 
-    dbg_trace("{0} getEntry at ({1},{2})",this->m_sName,ple->fields.hlc_r,ple->fields.hlc_l);
+    dbg_trace("{0} getEntry at ({1},{2})",this->m_sName,entry.fields.hlc_r,entry.fields.hlc_l);
 
-    return LOG_ENTRY_DATA(ple);
+    return inflateData(entry,pdat,tl_inflated);
   }
 
   const void * FilePersistLog::getEntry(const HLC &rhlc)
@@ -505,38 +1032,28 @@ namespace ns_persistent{
     LogEntry * ple = nullptr;
 //    unsigned __int128 key = ((((unsigned __int128)rhlc.m_rtc_us)<<64) | rhlc.m_logic);
 
-    FPL_RDLOCK;
-
-//  We do not user binary search any more.
-//    //binary search
-//    int64_t head = META_HEADER->fields.head % MAX_LOG_ENTRY;
-//    int64_t tail = META_HEADER->fields.tail % MAX_LOG_ENTRY;
-//    if (tail < head) tail += MAX_LOG_ENTRY; //because we mapped it twice
-//    dbg_trace("{0} - begin binary search.",this->m_sName);
-//    int64_t l_idx = binarySearch<unsigned __int128>(
-//      [&](int64_t idx){
-//        return ((((unsigned __int128)LOG_ENTRY_AT(idx)->fields.hlc_r)<<64) | LOG_ENTRY_AT(idx)->fields.hlc_l);
-//      },
-//      key,head,tail);
-//    dbg_trace("{0} - end binary search.",this->m_sName);
-//    ple = (l_idx == -1) ? nullptr : LOG_ENTRY_AT(l_idx);
-    dbg_trace("getEntry for hlc({0},{1})",rhlc.m_rtc_us,rhlc.m_logic);
-    struct hlc_index_entry skey(rhlc,0);
-    auto key = this->hidx.upper_bound(skey);
-    FPL_UNLOCK;
-
-#ifdef _DEBUG
-    dbg_trace("hidx.size = {}",this->hidx.size());
-    if(key == this->hidx.end())
-      dbg_trace("found upper bound = hidx.end()");
-    else
-      dbg_trace("found upper bound = hlc({},{}),idx{}",key->hlc.m_rtc_us,key->hlc.m_logic,key->log_idx);
-#endif//_DEBUG
-
-    if (key != this->hidx.begin() && this->hidx.size()>0) {
-      key--;
-      ple = LOG_ENTRY_AT(key->log_idx);
-      dbg_trace("getEntry returns: hlc:({0},{1}),idx:{2}",key->hlc.m_rtc_us,key->hlc.m_logic,key->log_idx);
+    // see getHLCIndex()
+    bool bOrdered = false;
+    LogEntry entry;
+    const void * pdat = seqRead([&](){
+      bOrdered = this->m_bHlcOrdered;
+      const int64_t l_idx = bOrdered ? searchOrderedHlc(rhlc) : -1;
+      ple = (l_idx == -1) ? nullptr : LOG_ENTRY_AT(l_idx);
+      if (ple == nullptr) {
+        return (const void *)nullptr;
+      }
+      entry = *ple;
+      return (const void *)LOG_ENTRY_DATA(ple);
+    });
+    if (!bOrdered) {
+      FPL_RDLOCK;
+      const int64_t l_idx = searchHlcIndex(rhlc);
+      ple = (l_idx == -1) ? nullptr : LOG_ENTRY_AT(l_idx);
+      if (ple != nullptr) {
+        entry = *ple;
+        pdat = LOG_ENTRY_DATA(ple);
+      }
+      FPL_UNLOCK;
     }
 
     // no object exists before the requested timestamp.
@@ -544,9 +1061,9 @@ namespace ns_persistent{
       return nullptr;
     }
 
-    dbg_trace("{0} getEntry at ({1},{2})",this->m_sName,ple->fields.hlc_r,ple->fields.hlc_l);
+    dbg_trace("{0} getEntry at ({1},{2})",this->m_sName,entry.fields.hlc_r,entry.fields.hlc_l);
 
-    return LOG_ENTRY_DATA(ple);
+    return inflateData(entry,pdat,tl_inflated);
   }
 
   // trim by index
@@ -568,36 +1085,72 @@ namespace ns_persistent{
       FPL_PERS_UNLOCK;
       return;
     }
-    META_HEADER->fields.head = idx + 1;
-    //TODO: remove entry from index...this is tricky because HLC 
-    // order does not agree with index order.
+    FPL_SEQ_WRITE_BEGIN;
+    dropEntriesUpTo(idx);
+    FPL_SEQ_WRITE_END;
     FPL_UNLOCK;
     FPL_PERS_UNLOCK;
-    throw PERSIST_EXP_UNIMPLEMENTED;
     dbg_trace("{0} trim at index: {1}...done",this->m_sName,idx);
   }
 
   void FilePersistLog::trim(const int64_t &ver) noexcept(false) {
     dbg_trace("{0} trim at version: {1}",this->m_sName,ver);
-    this->trim<int64_t>(ver,
-      [&](int64_t idx){return LOG_ENTRY_AT(idx)->fields.ver;});
+    // RDLOCK for validation
+    FPL_RDLOCK;
+    int64_t idx = searchVersion(ver);
+    FPL_UNLOCK;
+    if (idx == -1) {
+      return;
+    }
+    // search again in case some concurrent trim() and append() happens.
+    FPL_WRLOCK;
+    idx = searchVersion(ver);
+    if (idx != -1) {
+      FPL_SEQ_WRITE_BEGIN;
+      dropEntriesUpTo(idx);
+      FPL_SEQ_WRITE_END;
+    }
+    FPL_UNLOCK;
     dbg_trace("{0} trim at version: {1}...done",this->m_sName,ver);
   }
 
   void FilePersistLog::trim(const HLC & hlc) noexcept(false) {
     dbg_trace("{0} trim at time: {1}.{2}",this->m_sName,hlc.m_rtc_us,hlc.m_logic);
-//    this->trim<unsigned __int128>(
-//      ((((const unsigned __int128)hlc.m_rtc_us)<<64) | hlc.m_logic),
-//      [&](int64_t idx) {
-//        return ((((const unsigned __int128)LOG_ENTRY_AT(idx)->fields.hlc_r)<<64) | 
-//          LOG_ENTRY_AT(idx)->fields.hlc_l);
-//      });
-    //TODO: This is hard because HLC order does not agree with index order.
-    throw PERSIST_EXP_UNIMPLEMENTED;
+    // HLC order does not always agree with index order, so we trim the
+    // longest prefix of the log whose entries are no later than hlc. This
+    // only looks at the trimmed entries and the first one that is kept.
+    FPL_WRLOCK;
+    int64_t idx = META_HEADER->fields.head;
+    while (idx < META_HEADER->fields.tail &&
+           HLC(LOG_ENTRY_AT(idx)->fields.hlc_r,LOG_ENTRY_AT(idx)->fields.hlc_l) <= hlc) {
+      idx ++;
+    }
+    if (idx > META_HEADER->fields.head) {
+      FPL_SEQ_WRITE_BEGIN;
+      dropEntriesUpTo(idx - 1);
+      FPL_SEQ_WRITE_END;
+    }
+    FPL_UNLOCK;
     dbg_trace("{0} trim at time: {1}.{2}...done",this->m_sName,hlc.m_rtc_us,hlc.m_logic);
   }
 
   void FilePersistLog::persistMetaHeaderAtomically(MetaHeader *pShadowHeader) noexcept(false) {
+    if (this->m_bMappedHeader) {
+      // overwrite the older slot; a torn write leaves the newer one valid
+      const uint64_t seq = this->m_iMetaSeq + 1;
+      MetaHeader * pSlot = this->m_pMetaSlots + (seq % META_SLOTS);
+      *pSlot = *pShadowHeader;
+      pSlot->fields.seq = seq;
+      pSlot->fields.crc = metaChecksum(*pSlot);
+      flushRange(pSlot,sizeof(MetaHeader));
+      this->m_iMetaSeq = seq;
+      *META_HEADER_PERS = *pSlot;
+      return;
+    }
+    // a single header has no slot fields
+    pShadowHeader->fields.seq = 0;
+    pShadowHeader->fields.crc = 0;
+
     // STEP 1: get file name
     const string swpFile = this->m_sMetaFile + "." + SWAP_FILE_SUFFIX;
    
@@ -621,28 +1174,807 @@ namespace ns_persistent{
     *META_HEADER_PERS = *pShadowHeader;
   }
 
-  //////////////////////////
-  // invisible to outside //
-  //////////////////////////
-/* -- moved to util.hpp
-  void checkOrCreateDir(const string & dirPath) 
-  noexcept(false) {
+  void FilePersistLog::mapMetaSlots() noexcept(false) {
+    int fd = open(this->m_sMetaFile.c_str(), O_RDWR);
+    if (fd == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
     struct stat sb;
-    if (stat(dirPath.c_str(),&sb) == 0) {
-      if (! S_ISDIR(sb.st_mode)) {
-        throw PERSIST_EXP_INV_PATH;
-      }
-    } else { 
-      // create it
-      if (mkdir(dirPath.c_str(),0700) != 0) {
-        throw PERSIST_EXP_CREATE_PATH(errno);
-      }
+    if (fstat(fd, &sb) != 0) {
+      close(fd);
+      throw PERSIST_EXP_OPEN_FILE(errno);
     }
+    // the single header, if any, stays in slot 0 until slot 1 is written
+    if ((uint64_t)sb.st_size < META_SIZE*META_SLOTS &&
+        ftruncate(fd, META_SIZE*META_SLOTS) != 0) {
+      close(fd);
+      throw PERSIST_EXP_TRUNCATE_FILE(errno);
+    }
+    void * addr = mapFile(NULL,META_SIZE*META_SLOTS,PROT_READ|PROT_WRITE,0,fd);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      throw PERSIST_EXP_MMAP_FILE(errno);
+    }
+    this->m_pMetaSlots = (MetaHeader *)addr;
   }
 
-  bool checkOrCreateFileWithSize(const string & file, uint64_t size)
-  noexcept(false) {
-    bool bCreate = false;
+  void FilePersistLog::dropEntriesUpTo(const int64_t & idx) {
+    this->hidx.trimUpTo(idx);
+    META_HEADER->fields.head = idx + 1;
+  }
+
+  void FilePersistLog::buildHlcIndex() {
+    std::vector<hlc_index_entry> entries;
+    entries.reserve(NUM_USED_SLOTS);
+    for (int64_t idx = META_HEADER->fields.head; idx < META_HEADER->fields.tail; idx++) {
+      entries.emplace_back(LOG_ENTRY_AT(idx)->fields.hlc_r,LOG_ENTRY_AT(idx)->fields.hlc_l,idx);
+    }
+    this->hidx.assign(entries);
+  }
+
+  string FilePersistLog::getSegmentFileName(const int64_t & seg) const {
+    return this->m_sDataFile + "." + std::to_string(seg);
+  }
+
+  string FilePersistLog::getColdSegmentFileName(const int64_t & seg) const {
+    return this->m_sColdDataFile + "." + std::to_string(seg);
+  }
+
+  string FilePersistLog::getFragmentFileName(const int64_t & seg, const uint32_t & frag) const {
+    return this->m_vFragmentFiles[frag] + "." + std::to_string(seg);
+  }
+
+  bool FilePersistLog::coldSegmentExists(const int64_t & seg) const {
+    if (!this->m_pColdCode) {
+      return access(getColdSegmentFileName(seg).c_str(),F_OK) == 0;
+    }
+    for (uint32_t f = 0; f < this->m_vFragmentFiles.size(); f++) {
+      if (access(getFragmentFileName(seg,f).c_str(),F_OK) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void * FilePersistLog::mapColdSegment(const int64_t & seg, int & fd) noexcept(false) {
+    if (!this->m_pColdCode) {
+      fd = open(getColdSegmentFileName(seg).c_str(),O_RDONLY);
+      if (fd == -1) {
+        throw PERSIST_EXP_OPEN_FILE(errno);
+      }
+      // cold data is read on demand, so it is never prefaulted.
+      void * addr = mmap(NULL,this->m_iSegmentSize,PROT_READ,MAP_SHARED,fd,0);
+      if (addr == MAP_FAILED) {
+        const int err = errno;
+        close(fd);
+        dbg_trace("{0}:map data segment {1} failed.", this->m_sName, seg);
+        throw PERSIST_EXP_MMAP_FILE(err);
+      }
+      return addr;
+    }
+    fd = -1;
+    const uint32_t k = this->m_pColdCode->dataFragments();
+    const uint64_t fragSize = this->m_iSegmentSize / k;
+    std::vector<bool> present(this->m_vFragmentFiles.size());
+    bool bComplete = true;
+    for (uint32_t f = 0; f < present.size(); f++) {
+      present[f] = (access(getFragmentFileName(seg,f).c_str(),F_OK) == 0);
+      bComplete = bComplete && present[f];
+    }
+    // the data fragments are mapped over this, and the rebuilt ones that
+    // cannot be written back stay in it.
+    uint8_t * base = (uint8_t *)mmap(NULL,this->m_iSegmentSize,PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (base == MAP_FAILED) {
+      throw PERSIST_EXP_MMAP_FILE(errno);
+    }
+    try {
+      std::vector<bool> mapped(present);
+      if (!bComplete) {
+        std::vector<std::vector<uint8_t>> fragments;
+        rebuildFragments(seg,present,fragments);
+        for (uint32_t f = 0; f < present.size(); f++) {
+          if (present[f]) {
+            continue;
+          }
+          try {
+            writeFileDurably(getFragmentFileName(seg,f),fragments[f].data(),fragSize);
+            mapped[f] = true;
+          } catch (...) {
+            dbg_warn("{0}:cannot restore fragment {1} of data segment {2} in {3}.",
+              this->m_sName, f, seg, this->m_vFragmentPaths[f]);
+            if (f < k) {
+              memcpy(base + f * fragSize,fragments[f].data(),fragSize);
+            }
+          }
+        }
+        dbg_info("{0}:rebuilt the lost fragments of data segment {1}.", this->m_sName, seg);
+      }
+      for (uint32_t f = 0; f < k; f++) {
+        if (mapped[f]) {
+          mapFragment(seg,f,base + f * fragSize);
+        }
+      }
+      if (mprotect(base,this->m_iSegmentSize,PROT_READ) != 0) {
+        throw PERSIST_EXP_MMAP_FILE(errno);
+      }
+    } catch (...) {
+      munmap(base,this->m_iSegmentSize);
+      throw;
+    }
+    return base;
+  }
+
+  void FilePersistLog::mapFragment(const int64_t & seg, const uint32_t & frag, void * addr)
+  noexcept(false) {
+    const int fd = open(getFragmentFileName(seg,frag).c_str(),O_RDONLY);
+    if (fd == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    // the mapping keeps the file open.
+    const uint64_t fragSize = this->m_iSegmentSize / this->m_pColdCode->dataFragments();
+    if (mmap(addr,fragSize,PROT_READ,MAP_SHARED|MAP_FIXED,fd,0) == MAP_FAILED) {
+      const int err = errno;
+      close(fd);
+      throw PERSIST_EXP_MMAP_FILE(err);
+    }
+    close(fd);
+  }
+
+  void FilePersistLog::encodeSegment(const int64_t & seg) noexcept(false) {
+    const uint32_t k = this->m_pColdCode->dataFragments();
+    const uint32_t m = this->m_pColdCode->parityFragments();
+    const uint64_t fragSize = this->m_iSegmentSize / k;
+    const uint8_t * base = (const uint8_t *)DATA_SEGMENT_AT(seg);
+    std::vector<const uint8_t *> data(k);
+    for (uint32_t f = 0; f < k; f++) {
+      data[f] = base + f * fragSize;
+    }
+    std::vector<std::vector<uint8_t>> parity(m,std::vector<uint8_t>(fragSize));
+    std::vector<uint8_t *> pParity(m);
+    for (uint32_t f = 0; f < m; f++) {
+      pParity[f] = parity[f].data();
+    }
+    this->m_pColdCode->encode(data.data(),pParity.data(),fragSize);
+    for (uint32_t f = 0; f < k + m; f++) {
+      writeFileDurably(getFragmentFileName(seg,f),
+        (f < k) ? (const void *)data[f] : (const void *)pParity[f - k],fragSize);
+    }
+  }
+
+  void FilePersistLog::rebuildFragments(const int64_t & seg, const std::vector<bool> & present,
+    std::vector<std::vector<uint8_t>> & fragments) noexcept(false) {
+    const uint64_t fragSize = this->m_iSegmentSize / this->m_pColdCode->dataFragments();
+    fragments.assign(present.size(),std::vector<uint8_t>(fragSize));
+    std::vector<bool> read(present.size(),false);
+    std::vector<uint8_t *> pFragments(present.size());
+    for (uint32_t f = 0; f < present.size(); f++) {
+      pFragments[f] = fragments[f].data();
+      // a fragment that cannot be read counts as lost.
+      read[f] = present[f] && readFileFully(getFragmentFileName(seg,f),pFragments[f],fragSize);
+    }
+    this->m_pColdCode->reconstruct(pFragments.data(),read,fragSize);
+  }
+
+  void FilePersistLog::mapSegmentsUpTo(const int64_t & seg, const bool populate) noexcept(false) {
+    while (this->m_iSegmentTail <= seg) {
+      const string segFile = getSegmentFileName(this->m_iSegmentTail);
+      // a segment in the cold path is only there if it is not in the data
+      // path, unless the move was interrupted before the original was removed.
+      const bool bCold = isTiered() &&
+        access(segFile.c_str(),F_OK) != 0 &&
+        coldSegmentExists(this->m_iSegmentTail);
+      int fd;
+      void * addr = bCold ?
+        mapColdSegment(this->m_iSegmentTail,fd) :
+        mapHotSegment(this->m_iSegmentTail,populate,fd);
+      DATA_SEGMENT_AT(this->m_iSegmentTail) = addr;
+      DATA_SEGMENT_FD(this->m_iSegmentTail) = fd;
+      this->m_vSegmentCold[this->m_iSegmentTail % MAX_DATA_SEGMENTS] = bCold;
+      this->m_iSegmentTail ++;
+    }
+  }
+
+  void * FilePersistLog::mapHotSegment(const int64_t & seg, const bool populate, int & fd)
+  noexcept(false) {
+    const string segFile = getSegmentFileName(seg);
+    checkOrCreateFileWithSize(segFile,this->m_iSegmentSize);
+    fd = open(segFile.c_str(),O_RDWR);
+    if (fd == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    // allocate the blocks now rather than when the pages are first written
+    // back; the data already in an existing segment is left as it is. File
+    // systems without fallocate keep the file sparse.
+    if (fallocate(fd,0,0,this->m_iSegmentSize) != 0 && errno != EOPNOTSUPP) {
+      const int err = errno;
+      close(fd);
+      throw (err == ENOSPC) ? PERSIST_EXP_NOSPACE_DATA : PERSIST_EXP_TRUNCATE_FILE(err);
+    }
+    // a huge page mapping is only prefaulted after the advice, or it would
+    // be populated with small pages.
+    void * addr = mapFile(NULL,this->m_iSegmentSize,PROT_READ|PROT_WRITE,
+      (populate && !this->m_bHugePages) ? MAP_POPULATE : 0,fd);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      dbg_trace("{0}:map data segment {1} failed.", this->m_sName, seg);
+      throw PERSIST_EXP_MMAP_FILE(errno);
+    }
+    // the advice is only a hint, so failures are ignored.
+    madvise(addr,this->m_iSegmentSize,MADV_SEQUENTIAL);
+    if (this->m_bHugePages) {
+      if (madvise(addr,this->m_iSegmentSize,MADV_HUGEPAGE) != 0) {
+        dbg_warn("{0}:huge pages are not supported for {1}.", this->m_sName, segFile);
+      }
+#ifdef MADV_POPULATE_READ
+      if (populate) {
+        madvise(addr,this->m_iSegmentSize,MADV_POPULATE_READ);
+      }
+#endif
+    }
+    return addr;
+  }
+
+  void FilePersistLog::preallocateSegments() noexcept(false) {
+    if (this->m_iPreallocSegments == 0) {
+      return;
+    }
+    FPL_RDLOCK;
+    const int64_t last = DATA_SEGMENT_OF(NEXT_DATA_OFST) + (int64_t)this->m_iPreallocSegments;
+    int64_t seg = this->m_iSegmentTail;
+    FPL_UNLOCK;
+    // m_iSegmentHead only changes under FPL_PERS_LOCK, which we hold.
+    while (seg <= last && seg - this->m_iSegmentHead < (int64_t)MAX_DATA_SEGMENTS) {
+      int fd;
+      void * addr = mapHotSegment(seg,true,fd);
+      FPL_WRLOCK;
+      // append() may have mapped the segment itself in the meantime.
+      const bool bInstall = (this->m_iSegmentTail == seg);
+      if (bInstall) {
+        DATA_SEGMENT_AT(seg) = addr;
+        DATA_SEGMENT_FD(seg) = fd;
+        this->m_vSegmentCold[seg % MAX_DATA_SEGMENTS] = false;
+        this->m_iSegmentTail ++;
+      }
+      const int64_t tail = this->m_iSegmentTail;
+      FPL_UNLOCK;
+      if (!bInstall) {
+        munmap(addr,this->m_iSegmentSize);
+        close(fd);
+      }
+      seg = MAX(seg + 1, tail);
+    }
+  }
+
+  void FilePersistLog::releaseSegmentsBefore(const int64_t & seg) noexcept(false) {
+    struct Released {
+      void * addr;
+      int fd;
+      std::vector<string> files;
+    };
+    std::vector<Released> released;
+    // only take the segments out of the table under the lock; unmapping and
+    // removing the files is left to after it, so that append() does not wait.
+    FPL_WRLOCK;
+    while (this->m_iSegmentHead < seg && this->m_iSegmentHead < this->m_iSegmentTail) {
+      const bool bCold = this->m_vSegmentCold[this->m_iSegmentHead % MAX_DATA_SEGMENTS];
+      this->m_vSegmentCold[this->m_iSegmentHead % MAX_DATA_SEGMENTS] = false;
+      std::vector<string> files;
+      if (!bCold) {
+        files.push_back(getSegmentFileName(this->m_iSegmentHead));
+      } else if (!this->m_pColdCode) {
+        files.push_back(getColdSegmentFileName(this->m_iSegmentHead));
+      } else {
+        for (uint32_t f = 0; f < this->m_vFragmentFiles.size(); f++) {
+          files.push_back(getFragmentFileName(this->m_iSegmentHead,f));
+        }
+      }
+      released.push_back(Released{DATA_SEGMENT_AT(this->m_iSegmentHead),
+        DATA_SEGMENT_FD(this->m_iSegmentHead),files});
+      DATA_SEGMENT_AT(this->m_iSegmentHead) = nullptr;
+      DATA_SEGMENT_FD(this->m_iSegmentHead) = -1;
+      this->m_iSegmentHead ++;
+    }
+    FPL_UNLOCK;
+    for (const Released & r : released) {
+      if (r.addr != nullptr) {
+        munmap(r.addr,this->m_iSegmentSize);
+      }
+      if (r.fd != -1) {
+        close(r.fd);
+      }
+      for (const string & file : r.files) {
+        if (unlink(file.c_str()) != 0 && errno != ENOENT) {
+          throw PERSIST_EXP_REMOVE_FILE(errno);
+        }
+        dbg_trace("{0}:data segment {1} released.", this->m_sName, file);
+      }
+    }
+  }
+
+  int64_t FilePersistLog::offloadColdSegments() noexcept(false) {
+    if (!isTiered()) {
+      return 0;
+    }
+    std::vector<int64_t> segs;
+    int64_t nOffloaded = 0;
+    // the pin keeps the segments from being released while they are moved.
+    pin();
+    try {
+      FPL_PERS_LOCK;
+      FPL_RDLOCK;
+      // the segments before the one holding the last persisted entry are
+      // complete and on disk, and nothing writes to them any more.
+      const int64_t last = MIN(META_HEADER_PERS->fields.tail,META_HEADER->fields.tail) - 1;
+      const int64_t end = (last >= META_HEADER->fields.head) ?
+        MIN(DATA_SEGMENT_OF(LOG_ENTRY_AT(last)->fields.ofst),this->m_iSegmentTail) :
+        this->m_iSegmentHead;
+      for (int64_t seg = this->m_iSegmentHead; seg < end; seg++) {
+        if (DATA_SEGMENT_AT(seg) != nullptr && !this->m_vSegmentCold[seg % MAX_DATA_SEGMENTS]) {
+          segs.push_back(seg);
+        }
+      }
+      FPL_UNLOCK;
+      FPL_PERS_UNLOCK;
+      const time_t now = time(nullptr);
+      for (const int64_t seg : segs) {
+        struct stat sb;
+        if (stat(getSegmentFileName(seg).c_str(),&sb) != 0) {
+          throw PERSIST_EXP_OPEN_FILE(errno);
+        }
+        // the segments are written in order, so the rest are younger.
+        if ((uint64_t)(now - sb.st_mtime) < this->m_iColdAge) {
+          break;
+        }
+        offloadSegment(seg);
+        nOffloaded ++;
+      }
+    } catch (...) {
+      unpin();
+      throw;
+    }
+    unpin();
+    return nOffloaded;
+  }
+
+  void FilePersistLog::offloadSegment(const int64_t & seg) noexcept(false) {
+    const string hotFile = getSegmentFileName(seg);
+    int fd = -1;
+    // code or copy without any lock, since the segment does not change.
+    if (this->m_pColdCode) {
+      encodeSegment(seg);
+    } else {
+      const string coldFile = getColdSegmentFileName(seg);
+      copyFileDurably(hotFile,coldFile);
+      fd = open(coldFile.c_str(),O_RDONLY);
+      if (fd == -1) {
+        throw PERSIST_EXP_OPEN_FILE(errno);
+      }
+    }
+    FPL_PERS_LOCK;
+    FPL_WRLOCK;
+    // replace the mapping in place: the data at every address stays the
+    // same, so even the readers without a lock are not affected.
+    try {
+      if (this->m_pColdCode) {
+        const uint64_t fragSize = this->m_iSegmentSize / this->m_pColdCode->dataFragments();
+        for (uint32_t f = 0; f < this->m_pColdCode->dataFragments(); f++) {
+          mapFragment(seg,f,(uint8_t *)DATA_SEGMENT_AT(seg) + f * fragSize);
+        }
+      } else if (mmap(DATA_SEGMENT_AT(seg),this->m_iSegmentSize,PROT_READ,
+          MAP_SHARED|MAP_FIXED,fd,0) == MAP_FAILED) {
+        throw PERSIST_EXP_MMAP_FILE(errno);
+      }
+    } catch (...) {
+      FPL_UNLOCK;
+      FPL_PERS_UNLOCK;
+      if (fd != -1) {
+        close(fd);
+      }
+      throw;
+    }
+    close(DATA_SEGMENT_FD(seg));
+    DATA_SEGMENT_FD(seg) = fd;
+    this->m_vSegmentCold[seg % MAX_DATA_SEGMENTS] = true;
+    FPL_UNLOCK;
+    FPL_PERS_UNLOCK;
+    if (unlink(hotFile.c_str()) != 0) {
+      throw PERSIST_EXP_REMOVE_FILE(errno);
+    }
+    dbg_trace("{0}:data segment {1} moved to the cold tier.", this->m_sName, seg);
+  }
+
+  void FilePersistLog::coldLoop() noexcept(true) {
+    std::unique_lock<std::mutex> lck(this->m_coldMutex);
+    while (true) {
+      if (this->m_coldCond.wait_for(lck,std::chrono::seconds(COLD_SEGMENT_SCAN_INTERVAL),
+            [this](){ return this->m_bStopCold; })) {
+        return;
+      }
+      lck.unlock();
+      try {
+        offloadColdSegments();
+      } catch (...) {
+        // the segments stay in the data path and are tried again later.
+        dbg_warn("{0}:failed to move data segments to the cold tier.", this->m_sName);
+      }
+      lck.lock();
+    }
+  }
+
+  int64_t FilePersistLog::placeData(const uint64_t & size) {
+    if (size > this->m_iSegmentSize) {
+      return -1;
+    }
+    uint64_t ofst = NEXT_DATA_OFST;
+    // skip the rest of the segment if the data does not fit in.
+    if (size > 0 && DATA_SEGMENT_OF(ofst) != DATA_SEGMENT_OF(ofst + size - 1)) {
+      ofst = (DATA_SEGMENT_OF(ofst) + 1) * this->m_iSegmentSize;
+    }
+    // the oldest segment still in use; trimmed segments are only released
+    // when the trim is persisted.
+    const int64_t first_seg = MIN(this->m_iSegmentHead,
+      (NUM_USED_SLOTS > 0)?DATA_SEGMENT_OF(LOG_ENTRY_AT(META_HEADER->fields.head)->fields.ofst):DATA_SEGMENT_OF(ofst));
+    if (DATA_SEGMENT_OF(ofst) - first_seg >= (int64_t)MAX_DATA_SEGMENTS) {
+      return -1;
+    }
+    return (int64_t)ofst;
+  }
+
+  void FilePersistLog::flushData(const uint64_t & start, const uint64_t & end) noexcept(false) {
+    uint64_t ofst = start;
+    while (ofst < end) {
+      const uint64_t seg_end = MIN((DATA_SEGMENT_OF(ofst) + 1) * this->m_iSegmentSize, end);
+      flushRange(DATA_AT(ofst),seg_end - ofst);
+      ofst = seg_end;
+    }
+  }
+
+  void FilePersistLog::flushLog(const int64_t & start, const int64_t & end) noexcept(false) {
+    if (end <= start) {
+      return;
+    }
+    // the log is mapped twice, so the entries are contiguous in memory even
+    // if they wrap around the end of the ring buffer.
+    flushRange(LOG_ENTRY_AT(start),(end - start) * sizeof(LogEntry));
+  }
+
+  void * FilePersistLog::mapFile(void * addr, const uint64_t & len, const int prot,
+    const int flags, const int fd) noexcept(true) {
+    if (!this->m_bPmem) {
+      return mmap(addr,len,prot,MAP_SHARED|flags,fd,0);
+    }
+    // MAP_SYNC keeps the file system metadata of the mapped blocks durable,
+    // so a cache flush is all the data needs. Only dax mappings support it.
+    void * ret = mmap(addr,len,prot,MAP_SHARED_VALIDATE|MAP_SYNC|flags,fd,0);
+    if (ret == MAP_FAILED && errno == EOPNOTSUPP) {
+      dbg_warn("{0}:{1} is not on a file system mounted with dax.",
+        this->m_sName, this->m_sDataPath);
+    }
+    return ret;
+  }
+
+  void FilePersistLog::flushRange(const void * addr, const uint64_t & len) noexcept(false) {
+    if (len == 0) {
+      return;
+    }
+    if (this->m_bPmem) {
+      flushCacheLines(addr,len);
+      return;
+    }
+    void * start = ALIGN_TO_PAGE(addr);
+    if (msync(start,len + ((uint64_t)addr - (uint64_t)start),MS_SYNC) != 0) {
+      throw PERSIST_EXP_MSYNC(errno);
+    }
+  }
+
+  uint32_t FilePersistLog::entryChecksum(const LogEntry * pEntry) {
+    LogEntry entry = *pEntry;
+    entry.fields.crc = 0;
+    const uint32_t crc = crc32c(0,&entry.fields,sizeof(entry.fields));
+    return crc32c(crc,LOG_ENTRY_DATA(&entry),entry.fields.dlen);
+  }
+
+  void FilePersistLog::sealEntries(const int64_t & start, const int64_t & end) {
+    // the entries after the persisted tail are written only once by
+    // append(), and their data is not released until they are trimmed and
+    // persisted, so they can be read without the lock; the readers do not
+    // look at the checksum.
+    for (int64_t idx = start; idx < end; idx++) {
+      LOG_ENTRY_AT(idx)->fields.crc = entryChecksum(LOG_ENTRY_AT(idx));
+    }
+  }
+
+  void FilePersistLog::verifyTail() noexcept(false) {
+    if (NUM_USED_SLOTS == 0) {
+      return;
+    }
+    const int64_t head = META_HEADER->fields.head;
+    const int64_t tail = META_HEADER->fields.tail;
+    const int64_t start = MAX(head,tail - VERIFY_TAIL_ENTRIES);
+    // STEP 1: find the entries whose data is where it can be, without
+    // reading it, so that a corrupt offset does not map segments at random.
+    uint64_t prev_end = (start > head) ?
+      LOG_ENTRY_AT(start - 1)->fields.ofst + LOG_ENTRY_AT(start - 1)->fields.dlen :
+      this->m_iSegmentHead * this->m_iSegmentSize;
+    int64_t bad = start;
+    for (; bad < tail; bad++) {
+      const LogEntry * e = LOG_ENTRY_AT(bad);
+      if (e->fields.ofst < prev_end || e->fields.dlen > this->m_iSegmentSize ||
+          (e->fields.dlen > 0 &&
+           DATA_SEGMENT_OF(e->fields.ofst) != DATA_SEGMENT_OF(e->fields.ofst + e->fields.dlen - 1)) ||
+          DATA_SEGMENT_OF(e->fields.ofst) - this->m_iSegmentHead >= (int64_t)MAX_DATA_SEGMENTS) {
+        break;
+      }
+      prev_end = e->fields.ofst + e->fields.dlen;
+    }
+    // STEP 2: check the checksums in parallel. An entry whose checksum is 0
+    // is not checked: it was persisted before entries had checksums, or its
+    // checksum happens to be 0.
+    if (bad > start) {
+      mapSegmentsUpTo(DATA_SEGMENT_OF(LOG_ENTRY_AT(bad - 1)->fields.ofst),true);
+      const int64_t nThreads = MIN((int64_t)VERIFY_THREADS,
+        MAX((int64_t)1,(bad - start) / VERIFY_CHUNK_ENTRIES));
+      const int64_t chunk = (bad - start + nThreads - 1) / nThreads;
+      std::vector<int64_t> firstBad(nThreads,bad);
+      auto verify = [&](int64_t t) {
+        const int64_t end = MIN(bad,start + (t + 1) * chunk);
+        for (int64_t idx = start + t * chunk; idx < end; idx++) {
+          const uint32_t crc = LOG_ENTRY_AT(idx)->fields.crc;
+          if (crc != 0 && crc != entryChecksum(LOG_ENTRY_AT(idx))) {
+            firstBad[t] = idx;
+            return;
+          }
+        }
+      };
+      std::vector<std::thread> threads;
+      for (int64_t t = 1; t < nThreads; t++) {
+        threads.emplace_back(verify,t);
+      }
+      verify(0);
+      for (std::thread & thread : threads) {
+        thread.join();
+      }
+      for (int64_t t = 0; t < nThreads; t++) {
+        bad = MIN(bad,firstBad[t]);
+      }
+    }
+    if (bad == tail) {
+      return;
+    }
+    // STEP 3: truncate the log before the first bad entry.
+    dbg_warn("{0}:entry {1} is corrupt, dropping {2} entries at the tail.",
+      this->m_sName, bad, tail - bad);
+    // the data of the dropped entries is overwritten by the next appends.
+    this->m_iNextDataOfst = (bad > head) ?
+      LOG_ENTRY_AT(bad - 1)->fields.ofst + LOG_ENTRY_AT(bad - 1)->fields.dlen :
+      LOG_ENTRY_AT(head)->fields.ofst;
+    META_HEADER->fields.tail = bad;
+    META_HEADER->fields.ver = (bad > 0) ? LOG_ENTRY_AT(bad - 1)->fields.ver : INVALID_VERSION;
+    persistMetaHeaderAtomically(META_HEADER);
+  }
+
+  void FilePersistLog::snapshotBatch(FlushBatch & batch, const MetaHeader & base) {
+    batch.header = *META_HEADER;
+    // the segments before the one holding the first entry of the new
+    // persisted header are not needed any more.
+    batch.keep_seg = (NUM_USED_SLOTS > 0) ?
+      DATA_SEGMENT_OF(LOG_ENTRY_AT(META_HEADER->fields.head)->fields.ofst) :
+      DATA_SEGMENT_OF(NEXT_DATA_OFST);
+    batch.lstart = MAX(base.fields.tail,META_HEADER->fields.head);
+    batch.lend = META_HEADER->fields.tail;
+    if (batch.lend > batch.lstart) {
+      batch.dstart = LOG_ENTRY_AT(batch.lstart)->fields.ofst;
+      batch.dend = NEXT_DATA_OFST;
+    } else {
+      batch.lstart = batch.lend;
+      batch.dstart = batch.dend = 0;
+    }
+  }
+
+  void FilePersistLog::startWriteback(const FlushBatch & batch) noexcept(false) {
+    // data
+    uint64_t ofst = batch.dstart;
+    while (ofst < batch.dend) {
+      const int64_t seg = DATA_SEGMENT_OF(ofst);
+      const uint64_t seg_end = MIN((seg + 1) * this->m_iSegmentSize, batch.dend);
+      if (sync_file_range(DATA_SEGMENT_FD(seg),ofst%this->m_iSegmentSize,
+            seg_end - ofst, SYNC_FILE_RANGE_WRITE) != 0) {
+        throw PERSIST_EXP_MSYNC(errno);
+      }
+      ofst = seg_end;
+    }
+    // log, in up to two pieces if it wraps around.
+    int64_t idx = batch.lstart;
+    while (idx < batch.lend) {
+      const int64_t piece_end = MIN(batch.lend,
+        (int64_t)((idx/MAX_LOG_ENTRY + 1)*MAX_LOG_ENTRY));
+      if (sync_file_range(this->m_iLogFileDesc,(idx%MAX_LOG_ENTRY)*sizeof(LogEntry),
+            (piece_end - idx)*sizeof(LogEntry), SYNC_FILE_RANGE_WRITE) != 0) {
+        throw PERSIST_EXP_MSYNC(errno);
+      }
+      idx = piece_end;
+    }
+  }
+
+  void FilePersistLog::completeBatch(const FlushBatch & batch) noexcept(false) {
+    if (batch.dend > batch.dstart) {
+      flushData(batch.dstart,batch.dend);
+    }
+    flushLog(batch.lstart,batch.lend);
+    // flush meta data
+    MetaHeader shadow_header = batch.header;
+    this->persistMetaHeaderAtomically(&shadow_header);
+    // release trimmed segments
+    this->m_iReleasableSeg = MAX(this->m_iReleasableSeg,batch.keep_seg);
+    releaseTrimmedSegments();
+  }
+
+  void FilePersistLog::releaseTrimmedSegments() noexcept(false) {
+    // a reader pins before it looks up an entry, and the lookup cannot find
+    // an entry trimmed before the pin. So if there is no pin now, no reader
+    // can hold data in the segments to release.
+    if (this->m_iReleasableSeg > this->m_iSegmentHead && this->m_iPins.load() == 0) {
+      releaseSegmentsBefore(this->m_iReleasableSeg);
+    }
+  }
+
+  void FilePersistLog::pin() noexcept(true) {
+    this->m_iPins.fetch_add(1);
+  }
+
+  void FilePersistLog::unpin() noexcept(true) {
+    this->m_iPins.fetch_sub(1);
+  }
+
+  int64_t FilePersistLog::checkpoint(const string & targetPath, const int64_t & ver)
+  noexcept(false) {
+    checkOrCreateDir(targetPath);
+    const string metaFile = targetPath + "/" + this->m_sName + "." + META_FILE_SUFFIX;
+    const string logFile = targetPath + "/" + this->m_sName + "." + LOG_FILE_SUFFIX;
+    const string dataFile = targetPath + "/" + this->m_sName + "." + DATA_FILE_SUFFIX;
+    // a checkpoint never replaces a log.
+    if (access(metaFile.c_str(),F_OK) == 0) {
+      throw PERSIST_EXP_INV_PATH;
+    }
+    // the entries copied must be persisted, so that their checksums are set
+    // and their data is on disk. In async mode, the second persist()
+    // completes the batch the first one started.
+    const int64_t lastVer = seqRead([&](){
+      const int64_t idx = searchVersion(ver);
+      return (idx == -1) ? INVALID_VERSION : LOG_ENTRY_AT(idx)->fields.ver;
+    });
+    for (int attempt = 0; getLastPersisted() < lastVer; attempt++) {
+      if (attempt == 2) {
+        throw PERSIST_EXP_INV_VERSION;
+      }
+      persist();
+    }
+    MetaHeader header;
+    memset((void*)&header,0,sizeof(MetaHeader));
+    header.fields.ver = MIN(ver,getLastPersisted());
+    header.fields.dseg = this->m_iSegmentSize;
+    int64_t head = 0, last = -1, copiedVer = INVALID_VERSION;
+    uint64_t headOfst = 0, endOfst = 0;
+    std::vector<void *> segments;
+    // the data of the entries, and the entries in the ring, stay where they
+    // are while the log is pinned, even if they are trimmed.
+    pin();
+    try {
+      seqRead([&](){
+        // entries appended since are not persisted, even if they are no
+        // later than ver.
+        head = META_HEADER->fields.head;
+        last = searchVersion(header.fields.ver);
+        copiedVer = INVALID_VERSION;
+        segments.clear();
+        if (last >= head) {
+          copiedVer = LOG_ENTRY_AT(last)->fields.ver;
+          headOfst = LOG_ENTRY_AT(head)->fields.ofst;
+          endOfst = LOG_ENTRY_AT(last)->fields.ofst + LOG_ENTRY_AT(last)->fields.dlen;
+          for (int64_t seg = DATA_SEGMENT_OF(headOfst); seg <= DATA_SEGMENT_OF(endOfst); seg++) {
+            segments.push_back(DATA_SEGMENT_AT(seg));
+          }
+        }
+        return 0;
+      });
+      if (last >= head) {
+        // A segment before the one the copy ends in is never written again,
+        // by this log or by the copy if it is opened, so it can be shared.
+        // The copy's last segment is written from the mapping instead, up
+        // to where the copy ends; the loader extends it to the full size.
+        const int64_t firstSeg = DATA_SEGMENT_OF(headOfst);
+        const int64_t endSeg = DATA_SEGMENT_OF(endOfst);
+        for (int64_t seg = firstSeg; seg <= endSeg; seg++) {
+          const uint64_t len = (seg < endSeg) ? this->m_iSegmentSize : endOfst - seg * this->m_iSegmentSize;
+          if (len == 0) {
+            continue;
+          }
+          // a segment moved to the cold path in the meantime is no longer
+          // at the hot one, which then fails like a coded one.
+          string from;
+          if (!this->m_vSegmentCold[seg % MAX_DATA_SEGMENTS]) {
+            from = getSegmentFileName(seg);
+          } else if (!this->m_pColdCode) {
+            from = getColdSegmentFileName(seg);
+          }
+          cloneSegment(from,dataFile + "." + std::to_string(seg),segments[seg - firstSeg],len,seg < endSeg);
+        }
+        // the entries go in the same slots of the copy's ring, so the
+        // indexes and data offsets of the header and entries stay valid.
+        int fd = open(logFile.c_str(),O_RDWR|O_CREAT|O_TRUNC,S_IWUSR|S_IRUSR|S_IRGRP|S_IWGRP|S_IROTH);
+        if (fd == -1) {
+          throw PERSIST_EXP_CREATE_FILE(errno);
+        }
+        if (ftruncate(fd,MAX_LOG_SIZE) != 0) {
+          const int err = errno;
+          close(fd);
+          throw PERSIST_EXP_TRUNCATE_FILE(err);
+        }
+        LogEntry * pRing = (LogEntry *)mmap(NULL,MAX_LOG_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+        close(fd);
+        if ((void *)pRing == MAP_FAILED) {
+          throw PERSIST_EXP_MMAP_FILE(errno);
+        }
+        for (int64_t idx = head; idx <= last; idx += SCAN_CHUNK_ENTRIES) {
+          const int64_t n = MIN(last + 1 - idx, (int64_t)SCAN_CHUNK_ENTRIES);
+          // the slot of an entry is reused once the log wraps around
+          const bool bValid = seqRead([&](){
+            if (META_HEADER->fields.tail >= idx + (int64_t)MAX_LOG_ENTRY) {
+              return false;
+            }
+            for (int64_t i = idx; i < idx + n; i++) {
+              pRing[i % MAX_LOG_ENTRY] = *LOG_ENTRY_AT(i);
+            }
+            return true;
+          });
+          if (!bValid) {
+            munmap(pRing,MAX_LOG_SIZE);
+            throw PERSIST_EXP_INV_ENTRY_IDX(idx);
+          }
+        }
+        const int ret = msync(pRing,MAX_LOG_SIZE,MS_SYNC);
+        const int err = errno;
+        munmap(pRing,MAX_LOG_SIZE);
+        if (ret != 0) {
+          throw PERSIST_EXP_MSYNC(err);
+        }
+        header.fields.head = head;
+        header.fields.tail = last + 1;
+      }
+    } catch (...) {
+      unpin();
+      throw;
+    }
+    unpin();
+    // the header goes last, so the copy is only a log once it is complete.
+    writeFileDurably(metaFile,&header,sizeof(MetaHeader));
+    syncDir(targetPath);
+    return copiedVer;
+  }
+
+  //////////////////////////
+  // invisible to outside //
+  //////////////////////////
+/* -- moved to util.hpp
+  void checkOrCreateDir(const string & dirPath) 
+  noexcept(false) {
+    struct stat sb;
+    if (stat(dirPath.c_str(),&sb) == 0) {
+      if (! S_ISDIR(sb.st_mode)) {
+        throw PERSIST_EXP_INV_PATH;
+      }
+    } else { 
+      // create it
+      if (mkdir(dirPath.c_str(),0700) != 0) {
+        throw PERSIST_EXP_CREATE_PATH(errno);
+      }
+    }
+  }
+
+  bool checkOrCreateFileWithSize(const string & file, uint64_t size)
+  noexcept(false) {
+    bool bCreate = false;
     struct stat sb;
     int fd;
 
@@ -667,8 +1999,515 @@ namespace ns_persistent{
     return bCreate;
   }
 */
+  bool preloadLog(const string & dataPath, const string & name)
+  noexcept(true) {
+    const string prefix = dataPath + "/" + name + ".";
+    MetaHeader header;
+    try {
+      readMetaHeader(prefix + META_FILE_SUFFIX, &header);
+    } catch (uint64_t e) {
+      dbg_warn("{0}:cannot read the meta header, exception {1:x}.", name, e);
+      return false;
+    }
+    int fd;
+    const uint64_t segmentSize = (header.fields.dseg == 0) ?
+      DEFAULT_DATA_SEGMENT_SIZE : header.fields.dseg;
+    if (header.fields.head < 0 || header.fields.tail < header.fields.head ||
+        (uint64_t)(header.fields.tail - header.fields.head) >= MAX_LOG_ENTRY ||
+        segmentSize % PAGE_SIZE != 0) {
+      dbg_warn("{0}:invalid meta header: head={1},tail={2},dseg={3}.", name,
+        header.fields.head, header.fields.tail, header.fields.dseg);
+      return false;
+    }
+    if (header.fields.tail == header.fields.head) {
+      return true;
+    }
+
+    // read and check the used log entries, in chunks
+    fd = open((prefix + LOG_FILE_SUFFIX).c_str(), O_RDONLY);
+    if (fd == -1) {
+      dbg_warn("{0}:cannot open the log file, errno {1}.", name, errno);
+      return false;
+    }
+    const int64_t chunkEntries = 4096;
+    std::vector<LogEntry> chunk(chunkEntries);
+    LogEntry first, last;
+    bool valid = true;
+    for (int64_t idx = header.fields.head; valid && idx < header.fields.tail;) {
+      // a chunk does not wrap around the end of the ring buffer
+      const int64_t slot = idx % MAX_LOG_ENTRY;
+      const int64_t n = MIN(MIN(chunkEntries, header.fields.tail - idx), (int64_t)MAX_LOG_ENTRY - slot);
+      const ssize_t len = n * sizeof(LogEntry);
+      if (pread(fd, (void*)chunk.data(), len, slot * sizeof(LogEntry)) != len) {
+        dbg_warn("{0}:cannot read log entries [{1},{2}).", name, idx, idx + n);
+        valid = false;
+        break;
+      }
+      for (int64_t i = 0; i < n; i++, idx++) {
+        const LogEntry & e = chunk[i];
+        if (idx == header.fields.head) {
+          first = e;
+        } else if (e.fields.ver <= last.fields.ver || e.fields.ofst < last.fields.ofst + last.fields.dlen) {
+          dbg_warn("{0}:log entry {1} is out of order.", name, idx);
+          valid = false;
+          break;
+        }
+        if (e.fields.dlen > segmentSize || (e.fields.dlen > 0 &&
+            e.fields.ofst/segmentSize != (e.fields.ofst + e.fields.dlen - 1)/segmentSize)) {
+          dbg_warn("{0}:log entry {1} has an invalid data range.", name, idx);
+          valid = false;
+          break;
+        }
+        last = e;
+      }
+    }
+    close(fd);
+    if (!valid) {
+      return false;
+    }
+    if (last.fields.ver > header.fields.ver) {
+      dbg_warn("{0}:log entry version {1} is beyond the header version {2}.", name,
+        last.fields.ver, header.fields.ver);
+      return false;
+    }
+
+    // start reading the live data of each segment
+    const uint64_t end = last.fields.ofst + last.fields.dlen;
+    for (uint64_t seg = first.fields.ofst/segmentSize; seg*segmentSize < end; seg++) {
+      fd = open((prefix + DATA_FILE_SUFFIX + "." + std::to_string(seg)).c_str(), O_RDONLY);
+      if (fd == -1 && errno == ENOENT) {
+        // moved to the cold path of a tiered log, which is not read ahead.
+        continue;
+      }
+      if (fd == -1) {
+        dbg_warn("{0}:cannot open data segment {1}, errno {2}.", name, seg, errno);
+        return false;
+      }
+      const uint64_t start = MAX(first.fields.ofst, seg*segmentSize) - seg*segmentSize;
+      const uint64_t stop = MIN(end, (seg + 1)*segmentSize) - seg*segmentSize;
+      posix_fadvise(fd, start, stop - start, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+    return true;
+  }
+
+  void flushCacheLines(const void * addr, const uint64_t & len)
+  noexcept(true) {
+#if defined(__x86_64__)
+    // the best flush instruction the cpu has: clwb keeps the lines cached,
+    // clflushopt evicts them, and clflush is also serialized.
+    enum FlushInstruction { CLFLUSH, CLFLUSHOPT, CLWB };
+    static const FlushInstruction instruction = []() {
+      unsigned int eax, ebx, ecx, edx;
+      if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        if (ebx & (1u << 24)) {
+          return CLWB;
+        }
+        if (ebx & (1u << 23)) {
+          return CLFLUSHOPT;
+        }
+      }
+      return CLFLUSH;
+    }();
+    uintptr_t line = (uintptr_t)addr & ~((uintptr_t)CACHE_LINE_SIZE - 1);
+    const uintptr_t end = (uintptr_t)addr + len;
+    // spelled as prefixed opcodes so that older assemblers accept them
+    switch (instruction) {
+    case CLWB:
+      for (; line < end; line += CACHE_LINE_SIZE) {
+        asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)line));
+      }
+      break;
+    case CLFLUSHOPT:
+      for (; line < end; line += CACHE_LINE_SIZE) {
+        asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)line));
+      }
+      break;
+    default:
+      for (; line < end; line += CACHE_LINE_SIZE) {
+        asm volatile("clflush %0" : "+m" (*(volatile char *)line));
+      }
+      break;
+    }
+    asm volatile("sfence" ::: "memory");
+#else
+    // no user space flush here; the kernel makes the range durable.
+    void * start = ALIGN_TO_PAGE(addr);
+    msync(start,len + ((uint64_t)addr - (uint64_t)start),MS_SYNC);
+#endif
+  }
+
+  void copyFileDurably(const string & from, const string & to)
+  noexcept(false) {
+    const string swpFile = to + "." + SWAP_FILE_SUFFIX;
+    int in = open(from.c_str(),O_RDONLY);
+    if (in == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    int out = open(swpFile.c_str(),O_WRONLY|O_CREAT|O_TRUNC,S_IWUSR|S_IRUSR|S_IRGRP|S_IWGRP|S_IROTH);
+    if (out == -1) {
+      const int err = errno;
+      close(in);
+      throw PERSIST_EXP_CREATE_FILE(err);
+    }
+    // the copy is read once, so keep it from filling the page cache.
+    posix_fadvise(in,0,0,POSIX_FADV_SEQUENTIAL);
+    std::vector<char> buf(1ul<<20);
+    uint64_t ofst = 0;
+    while (true) {
+      const ssize_t nRead = pread(in,buf.data(),buf.size(),ofst);
+      if (nRead < 0 && errno == EINTR) {
+        continue;
+      }
+      if (nRead < 0) {
+        const int err = errno;
+        close(in);
+        close(out);
+        throw PERSIST_EXP_READ_FILE(err);
+      }
+      if (nRead == 0) {
+        break;
+      }
+      for (ssize_t nWritten = 0; nWritten < nRead;) {
+        const ssize_t n = pwrite(out,buf.data() + nWritten,nRead - nWritten,ofst + nWritten);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n < 0) {
+          const int err = errno;
+          close(in);
+          close(out);
+          throw PERSIST_EXP_WRITE_FILE(err);
+        }
+        nWritten += n;
+      }
+      ofst += nRead;
+    }
+    close(in);
+    if (fsync(out) != 0) {
+      const int err = errno;
+      close(out);
+      throw PERSIST_EXP_MSYNC(err);
+    }
+    posix_fadvise(out,0,0,POSIX_FADV_DONTNEED);
+    close(out);
+    if (rename(swpFile.c_str(),to.c_str()) != 0) {
+      throw PERSIST_EXP_RENAME_FILE(errno);
+    }
+  }
+
+  void writeFileDurably(const string & to, const void * buf, const uint64_t & len)
+  noexcept(false) {
+    const string swpFile = to + "." + SWAP_FILE_SUFFIX;
+    int out = open(swpFile.c_str(),O_WRONLY|O_CREAT|O_TRUNC,S_IWUSR|S_IRUSR|S_IRGRP|S_IWGRP|S_IROTH);
+    if (out == -1) {
+      throw PERSIST_EXP_CREATE_FILE(errno);
+    }
+    for (uint64_t nWritten = 0; nWritten < len;) {
+      const ssize_t n = pwrite(out,(const char *)buf + nWritten,len - nWritten,nWritten);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        const int err = errno;
+        close(out);
+        throw PERSIST_EXP_WRITE_FILE(err);
+      }
+      nWritten += n;
+    }
+    if (fsync(out) != 0) {
+      const int err = errno;
+      close(out);
+      throw PERSIST_EXP_MSYNC(err);
+    }
+    posix_fadvise(out,0,0,POSIX_FADV_DONTNEED);
+    close(out);
+    if (rename(swpFile.c_str(),to.c_str()) != 0) {
+      throw PERSIST_EXP_RENAME_FILE(errno);
+    }
+  }
+
+  void cloneSegment(const string & from, const string & to, const void * addr,
+    const uint64_t & len, const bool bLink)
+  noexcept(false) {
+    if (bLink && !from.empty() && link(from.c_str(),to.c_str()) == 0) {
+      return;
+    }
+#ifdef FICLONE
+    const int in = from.empty() ? -1 : open(from.c_str(),O_RDONLY);
+    if (in != -1) {
+      const int out = open(to.c_str(),O_WRONLY|O_CREAT|O_TRUNC,S_IWUSR|S_IRUSR|S_IRGRP|S_IWGRP|S_IROTH);
+      const bool bCloned = (out != -1) && ioctl(out,FICLONE,in) == 0 && fsync(out) == 0;
+      if (out != -1) {
+        close(out);
+      }
+      close(in);
+      if (bCloned) {
+        return;
+      }
+      unlink(to.c_str());
+    }
+#endif//FICLONE
+    writeFileDurably(to,addr,len);
+  }
+
+  void syncDir(const string & dirPath)
+  noexcept(false) {
+    const int fd = open(dirPath.c_str(),O_RDONLY|O_DIRECTORY);
+    if (fd == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    const int ret = fsync(fd);
+    const int err = errno;
+    close(fd);
+    if (ret != 0) {
+      throw PERSIST_EXP_MSYNC(err);
+    }
+  }
+
+  bool readFileFully(const string & file, void * buf, const uint64_t & len)
+  noexcept(true) {
+    int fd = open(file.c_str(),O_RDONLY);
+    if (fd == -1) {
+      return false;
+    }
+    uint64_t nRead = 0;
+    while (nRead < len) {
+      const ssize_t n = pread(fd,(char *)buf + nRead,len - nRead,nRead);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      nRead += n;
+    }
+    close(fd);
+    return nRead == len;
+  }
+
+  bool readMetaHeader(const string & metaFile, MetaHeader * pHeader)
+  noexcept(false) {
+    int fd = open(metaFile.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    MetaHeader slots[META_SLOTS];
+    ssize_t nRead = read(fd, (void*)slots, sizeof(slots));
+    close(fd);
+    if (nRead == (ssize_t)META_SIZE) {
+      *pHeader = slots[0];
+      return false;
+    }
+    if (nRead != (ssize_t)sizeof(slots)) {
+      throw PERSIST_EXP_READ_FILE(errno);
+    }
+    int newest = -1;
+    for (int i = 0; i < META_SLOTS; i++) {
+      if (slots[i].fields.seq > 0 && slots[i].fields.crc == metaChecksum(slots[i]) &&
+          (newest == -1 || slots[i].fields.seq > slots[newest].fields.seq)) {
+        newest = i;
+      }
+    }
+    if (newest == -1) {
+      // the meta file was extended from a single header, which is still in
+      // slot 0, but no slot has been written since.
+      *pHeader = slots[0];
+      return false;
+    }
+    *pHeader = slots[newest];
+    return true;
+  }
+
+  uint32_t metaChecksum(const MetaHeader & header) {
+    static const std::array<uint32_t, 256> table = []() {
+      std::array<uint32_t, 256> entries;
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t entry = i;
+        for (int bit = 0; bit < 8; bit++) {
+          entry = (entry & 1) ? (entry >> 1) ^ 0xEDB88320u : entry >> 1;
+        }
+        entries[i] = entry;
+      }
+      return entries;
+    }();
+    MetaHeader copy = header;
+    copy.fields.crc = 0;
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < sizeof(copy.bytes); i++) {
+      crc = table[(crc ^ copy.bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+  }
+
+  static uint32_t crc32cSoftware(uint32_t crc, const uint8_t * p, uint64_t len) {
+    static const std::array<uint32_t, 256> table = []() {
+      std::array<uint32_t, 256> entries;
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t entry = i;
+        for (int bit = 0; bit < 8; bit++) {
+          entry = (entry & 1) ? (entry >> 1) ^ 0x82F63B78u : entry >> 1;
+        }
+        entries[i] = entry;
+      }
+      return entries;
+    }();
+    for (uint64_t i = 0; i < len; i++) {
+      crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+  }
+
+#if defined(__x86_64__)
+  __attribute__((target("sse4.2")))
+  static uint32_t crc32cHardware(uint32_t crc, const uint8_t * p, uint64_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+      uint64_t word;
+      memcpy(&word,p,8);
+      crc64 = _mm_crc32_u64(crc64,word);
+    }
+    crc = (uint32_t)crc64;
+    for (; len > 0; p++, len--) {
+      crc = _mm_crc32_u8(crc,*p);
+    }
+    return crc;
+  }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  static uint32_t crc32cHardware(uint32_t crc, const uint8_t * p, uint64_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+      uint64_t word;
+      memcpy(&word,p,8);
+      crc = __crc32cd(crc,word);
+    }
+    for (; len > 0; p++, len--) {
+      crc = __crc32cb(crc,*p);
+    }
+    return crc;
+  }
+#endif
+
+  uint32_t crc32c(uint32_t crc, const void * data, uint64_t len)
+  noexcept(true) {
+    const uint8_t * p = (const uint8_t *)data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool bSse42 = []() {
+      unsigned int eax, ebx, ecx, edx;
+      return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 20));
+    }();
+    crc = bSse42 ? crc32cHardware(crc,p,len) : crc32cSoftware(crc,p,len);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc = crc32cHardware(crc,p,len);
+#else
+    crc = crc32cSoftware(crc,p,len);
+#endif
+    return ~crc;
+  }
+
+  bool codecAvailable(const LogCompression codec)
+  noexcept(true) {
+    switch (codec) {
+    case LC_NONE:
+      return true;
+#ifdef PERSIST_HAVE_LZ4
+    case LC_LZ4:
+      return true;
+#endif
+#ifdef PERSIST_HAVE_ZSTD
+    case LC_ZSTD:
+      return true;
+#endif
+    default:
+      return false;
+    }
+  }
+
+  uint64_t compressData(const LogCompression codec, const void * pdat,
+    const uint64_t & size, std::vector<char> & buf)
+  noexcept(false) {
+    // anything that does not save a byte is stored as it is.
+    const uint64_t capacity = size - 1;
+    try {
+      buf.resize(capacity);
+    } catch (...) {
+      throw PERSIST_EXP_ALLOC(ENOMEM);
+    }
+    switch (codec) {
+#ifdef PERSIST_HAVE_LZ4
+    case LC_LZ4:
+    {
+      if (size > LZ4_MAX_INPUT_SIZE) {
+        return 0;
+      }
+      const int clen = LZ4_compress_default((const char *)pdat,buf.data(),
+        (int)size,(int)MIN(capacity,(uint64_t)LZ4_compressBound((int)size)));
+      return (clen > 0) ? (uint64_t)clen : 0;
+    }
+#endif
+#ifdef PERSIST_HAVE_ZSTD
+    case LC_ZSTD:
+    {
+      const size_t clen = ZSTD_compress(buf.data(),capacity,pdat,size,
+        ZSTD_COMPRESSION_LEVEL);
+      return ZSTD_isError(clen) ? 0 : (uint64_t)clen;
+    }
+#endif
+    default:
+      return 0;
+    }
+  }
+
+  void inflateBytes(const LogCompression codec, const void * pdat,
+    const uint64_t & dlen, const uint64_t & rlen, std::vector<char> & buf)
+  noexcept(false) {
+    try {
+      buf.resize(rlen);
+    } catch (...) {
+      throw PERSIST_EXP_ALLOC(ENOMEM);
+    }
+    bool bInflated = false;
+    switch (codec) {
+#ifdef PERSIST_HAVE_LZ4
+    case LC_LZ4:
+      bInflated = (LZ4_decompress_safe((const char *)pdat,buf.data(),
+        (int)dlen,(int)rlen) == (int)rlen);
+      break;
+#endif
+#ifdef PERSIST_HAVE_ZSTD
+    case LC_ZSTD:
+      bInflated = (ZSTD_decompress(buf.data(),rlen,pdat,dlen) == rlen);
+      break;
+#endif
+    default:
+      break;
+    }
+    if (!bInflated) {
+      throw PERSIST_EXP_DECOMPRESS(codec);
+    }
+  }
+
+  const void * inflateData(const LogEntry & entry, const void * pdat,
+    std::vector<char> & buf)
+  noexcept(false) {
+    if (entry.fields.codec == LC_NONE) {
+      return pdat;
+    }
+    inflateBytes((LogCompression)entry.fields.codec,pdat,entry.fields.dlen,
+      entry.fields.rlen,buf);
+    return buf.data();
+  }
+
   bool checkOrCreateMetaFile(const string & metaFile)
   noexcept(false) {
+    // an existing meta file keeps its size, which tells how many headers it holds
+    struct stat sb;
+    if (stat(metaFile.c_str(),&sb) == 0) {
+      if (!S_ISREG(sb.st_mode)) {
+        throw PERSIST_EXP_INV_FILE;
+      }
+      return false;
+    }
     return checkOrCreateFileWithSize(metaFile,META_SIZE);
   }
 
@@ -677,8 +2516,4 @@ namespace ns_persistent{
     return checkOrCreateFileWithSize(logFile,MAX_LOG_SIZE);
   }
 
-  bool checkOrCreateDataFile(const string & dataFile)
-  noexcept(false) {
-    return checkOrCreateFileWithSize(dataFile,MAX_DATA_SIZE);
-  }
 }
@@ -1,9 +1,16 @@
 #ifndef FILE_PERSIST_LOG_HPP
 #define FILE_PERSIST_LOG_HPP
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <pthread.h>
 #include <string>
+#include <thread>
+#include <vector>
 #include "util.hpp"
+#include "ErasureCode.hpp"
 #include "PersistLog.hpp"
 
 namespace ns_persistent {
@@ -14,6 +21,15 @@ namespace ns_persistent {
   #define LOG_FILE_SUFFIX  ("log")
   #define DATA_FILE_SUFFIX ("data")
   #define SWAP_FILE_SUFFIX ("swp")
+  // In tiered mode, the data segments not written for DEFAULT_COLD_SEGMENT_AGE
+  // seconds are moved from the data path to the cold path, which is checked
+  // every COLD_SEGMENT_SCAN_INTERVAL seconds.
+  #define DEFAULT_COLD_PERSIST_LOG_DATA_PATH (".plog_cold")
+  #define DEFAULT_COLD_SEGMENT_AGE ((uint64_t)86400)
+  #define COLD_SEGMENT_SCAN_INTERVAL (10)
+  // where the logs of ST_PMEM objects are, on a file system mounted with dax
+  #define DEFAULT_PMEM_PERSIST_LOG_DATA_PATH ("/mnt/pmem0/.plog")
+  #define CACHE_LINE_SIZE       (64)
 
   // meta header format
   typedef union meta_header {
@@ -23,6 +39,9 @@ namespace ns_persistent {
       int64_t ver;      // the latest version number.
       // uint64_t d_head;  // the data head offset
       // uint64_t d_tail;  // the data tail offset
+      uint64_t dseg;    // the size of a data segment file
+      uint64_t seq;     // the sequence number of a header slot, see META_SLOTS
+      uint32_t crc;     // the checksum of a header slot
     } fields;
     uint8_t bytes[256];
     bool operator == (const union meta_header & other) {
@@ -40,19 +59,67 @@ namespace ns_persistent {
       uint64_t ofst;    // offset of the data in the memory buffer
       uint64_t hlc_r;   // realtime component of hlc
       uint64_t hlc_l;   // logic component of hlc
+      uint64_t rlen;    // length of the data before compression
+      uint32_t codec;   // how the data is compressed, see LogCompression
+      uint32_t crc;     // crc32c of the entry and its data, 0 until persisted
     } fields;
     uint8_t bytes[64];
   } LogEntry;
 
+  // How the data of an entry is stored. A log compresses the entries no
+  // smaller than its threshold with its codec, and stores the ones that do
+  // not shrink as they are. The codecs are available if the library is
+  // found at build time.
+  enum LogCompression : uint32_t {
+    LC_NONE = 0,
+    LC_LZ4 = 1,   // PERSIST_HAVE_LZ4
+    LC_ZSTD = 2   // PERSIST_HAVE_ZSTD
+  };
+  #define DEFAULT_COMPRESS_THRESHOLD ((uint64_t)4096)
+  #define ZSTD_COMPRESSION_LEVEL (1)
+
+  // check if a codec is built in
+  bool codecAvailable(const LogCompression codec) noexcept(true);
+
+  // compress size bytes at pdat into buf, returning the compressed size, or
+  // 0 if the data does not shrink or the codec is not built in.
+  uint64_t compressData(const LogCompression codec, const void * pdat,
+    const uint64_t & size, std::vector<char> & buf) noexcept(false);
+
+  // decompress dlen bytes at pdat into the rlen bytes of buf. Throws
+  // PERSIST_EXP_DECOMPRESS if they do not inflate to exactly rlen bytes.
+  void inflateBytes(const LogCompression codec, const void * pdat,
+    const uint64_t & dlen, const uint64_t & rlen, std::vector<char> & buf) noexcept(false);
+
   // TODO: make this hard-wired number configurable.
-  // Currently, we allow 1M(2^20-1) log entries and
-  // 512GB data size.
+  // Currently, we allow 1M(2^20-1) log entries.
   #define MAX_LOG_ENTRY         ((uint64_t)(1UL<<20))
   // #define MAX_LOG_ENTRY         (1UL<<6)
   #define MAX_LOG_SIZE          (sizeof(LogEntry)*MAX_LOG_ENTRY)
-  #define MAX_DATA_SIZE         ((uint64_t)(1UL<<39))
-  // #define MAX_DATA_SIZE         (1UL<<12)
+  // The data is stored in fixed-size segment files, which are mapped only
+  // when they are used and unmapped/removed once they are trimmed and the
+  // trim is persisted. The segment size is configurable per log; by default
+  // we allow 8K segments of 64MB, i.e. 512GB of live data.
+  #define DEFAULT_DATA_SEGMENT_SIZE ((uint64_t)(1UL<<26))
+  // The number of segments past the one being written that persist()
+  // allocates and maps in advance, so that append() finds them ready.
+  #define DEFAULT_PREALLOC_SEGMENTS ((uint64_t)1)
+  #define MAX_DATA_SEGMENTS     ((uint64_t)(1UL<<13))
+  #define MAX_DATA_SIZE         (this->m_iSegmentSize*MAX_DATA_SEGMENTS)
   #define META_SIZE             (sizeof(MetaHeader))
+  #define SCAN_CHUNK_ENTRIES    (256)
+  // On load, the last VERIFY_TAIL_ENTRIES persisted entries are checked
+  // against their checksums, split among up to VERIFY_THREADS threads of at
+  // least VERIFY_CHUNK_ENTRIES entries each, and the log is truncated before
+  // the first one that does not match.
+  #define VERIFY_TAIL_ENTRIES   ((int64_t)(1L<<14))
+  #define VERIFY_THREADS        (4)
+  #define VERIFY_CHUNK_ENTRIES  ((int64_t)1024)
+  // In mapped header mode, the meta file holds two header slots. They are
+  // written alternately through a shared mapping, each with the next sequence
+  // number and a checksum, and the newest valid one is loaded. Otherwise the
+  // meta file holds a single header, replaced by renaming a swap file.
+  #define META_SLOTS            (2)
 
   // helpers:
   ///// READ or WRITE LOCK on LOG REQUIRED to use the following MACROs!!!!
@@ -70,13 +137,18 @@ namespace ns_persistent {
   #define NEXT_LOG_ENTRY_PERS   LOG_ENTRY_AT( \
     MAX(META_HEADER_PERS->fields.tail,META_HEADER->fields.head))
   #define CURR_LOG_IDX        ((NUM_USED_SLOTS == 0)? -1 : META_HEADER->fields.tail - 1)
-  #define LOG_ENTRY_DATA(e)     ((void *)((uint8_t *)this->m_pData + \
-    (e)->fields.ofst%MAX_DATA_SIZE))
+  // data offsets are logical: they grow monotonically, and an offset maps to
+  // segment number (ofst / segment size). An entry never crosses a segment.
+  #define DATA_SEGMENT_OF(ofst) ((int64_t)((ofst)/this->m_iSegmentSize))
+  #define DATA_SEGMENT_AT(seg)  (this->m_vSegments[(seg)%MAX_DATA_SEGMENTS])
+  #define DATA_SEGMENT_FD(seg)  (this->m_vSegmentFds[(seg)%MAX_DATA_SEGMENTS])
+  #define DATA_AT(ofst)         ((void *)((uint8_t *)DATA_SEGMENT_AT(DATA_SEGMENT_OF(ofst)) + \
+    (ofst)%this->m_iSegmentSize))
+  #define LOG_ENTRY_DATA(e)     DATA_AT((e)->fields.ofst)
 
-  #define NEXT_DATA_OFST        ((CURR_LOG_IDX == -1)? 0 : \
+  #define NEXT_DATA_OFST        ((CURR_LOG_IDX == -1)? this->m_iNextDataOfst : \
     (LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ofst + \
      LOG_ENTRY_AT(CURR_LOG_IDX)->fields.dlen))
-  #define NEXT_DATA             ((void *)((uint64_t)this->m_pData + NEXT_DATA_OFST%MAX_DATA_SIZE))
   #define NEXT_DATA_PERS        ((NEXT_LOG_ENTRY > NEXT_LOG_ENTRY_PERS) ? \
     LOG_ENTRY_DATA(NEXT_LOG_ENTRY_PERS) : NULL)
 
@@ -84,7 +156,6 @@ namespace ns_persistent {
     ( LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ofst + \
       LOG_ENTRY_AT(CURR_LOG_IDX)->fields.dlen - \
       LOG_ENTRY_AT(META_HEADER->fields.head)->fields.ofst ))
-  #define NUM_FREE_BYTES        (MAX_DATA_SIZE - NUM_USED_BYTES)
 
   #define PAGE_SIZE             (getpagesize())
   #define ALIGN_TO_PAGE(x)      ((void *)(((uint64_t)(x))-((uint64_t)(x))%PAGE_SIZE))
@@ -93,6 +164,17 @@ namespace ns_persistent {
   template<typename TKey,typename KeyGetter>
     int64_t binarySearch(const KeyGetter &, const TKey &, const int64_t&, const int64_t&);
 
+  // a snapshot of the log state to be persisted: the header to write once the
+  // data and log entries it covers are flushed.
+  typedef struct flush_batch {
+    MetaHeader header;  // the header to persist
+    uint64_t dstart;    // the data to flush is in logical range [dstart,dend)
+    uint64_t dend;
+    int64_t lstart;     // the log entries to flush are in [lstart,lend)
+    int64_t lend;
+    int64_t keep_seg;   // segments before keep_seg can be released afterwards
+  } FlushBatch;
+
   // FilePersistLog is the default persist Log
   class FilePersistLog : public PersistLog {
   protected:
@@ -106,19 +188,87 @@ namespace ns_persistent {
     const string m_sMetaFile;
     // full log file name
     const string m_sLogFile;
-    // full data file name
+    // data file name prefix; segment N is stored in "<m_sDataFile>.N"
     const string m_sDataFile;
 
     // the log file descriptor
     int m_iLogFileDesc;
-    // the data file descriptor
-    int m_iDataFileDesc;
 
     // memory mapped Log RingBuffer
     void * m_pLog;
-    // memory mapped Data RingBuffer
-    void * m_pData;
-    // read/write lock
+    // size of a data segment
+    uint64_t m_iSegmentSize;
+    // memory mapped data segments, indexed by segment number % MAX_DATA_SEGMENTS.
+    // slots of unmapped segments are nullptr.
+    std::vector<void *> m_vSegments;
+    // file descriptors of the mapped data segments, kept open for writeback.
+    std::vector<int> m_vSegmentFds;
+    // the mapped data segments are [m_iSegmentHead, m_iSegmentTail)
+    int64_t m_iSegmentHead;
+    int64_t m_iSegmentTail;
+    // where the next data goes when the log is empty. Protected by m_rwlock.
+    uint64_t m_iNextDataOfst;
+    // In async mode, persist() only starts the writeback of the new entries
+    // and completes the batch started by the previous call, so flushing a
+    // batch overlaps with the appends of the next one.
+    const bool m_bAsyncPersist;
+    // In mapped header mode, the header slots of the meta file are mapped
+    // here, and m_iMetaSeq is the sequence number of the last one written.
+    // Both are protected by m_perslock.
+    const bool m_bMappedHeader;
+    MetaHeader * m_pMetaSlots;
+    uint64_t m_iMetaSeq;
+    // the codec and threshold for new entries, see LogCompression.
+    const LogCompression m_codec;
+    const uint64_t m_iCompressThreshold;
+    // In tiered mode, m_coldThread moves the segments older than m_iColdAge
+    // seconds to m_sColdPath, and the cold segments are mapped read-only
+    // from there. m_sColdPath is empty otherwise. m_vSegmentCold, indexed
+    // like m_vSegments, is protected by m_perslock and m_rwlock together.
+    const string m_sColdPath;
+    const string m_sColdDataFile;
+    const uint64_t m_iColdAge;
+    std::vector<bool> m_vSegmentCold;
+    // In coded mode, the cold segments are erasure-coded by m_pColdCode
+    // instead of copied to m_sColdPath: a segment is split into k data
+    // fragments, which are mapped in its place, and m parity fragments are
+    // computed from them. Fragment i is kept in m_vFragmentPaths[i], e.g. on
+    // the storage of another member of the shard. m_pColdCode is null
+    // otherwise.
+    const std::vector<string> m_vFragmentPaths;
+    std::vector<string> m_vFragmentFiles;
+    std::unique_ptr<ReedSolomon> m_pColdCode;
+    std::thread m_coldThread;
+    std::mutex m_coldMutex;
+    std::condition_variable m_coldCond;
+    bool m_bStopCold;
+    // In pmem mode, the files are mapped with MAP_SYNC from a file system
+    // on persistent memory, so that the data is durable once it is flushed
+    // out of the cpu caches, without msync.
+    const bool m_bPmem;
+    // the number of segments persist() prepares ahead of the tail, see
+    // preallocateSegments(), and whether the data segments are advised to
+    // be backed by huge pages.
+    const uint64_t m_iPreallocSegments;
+    const bool m_bHugePages;
+    // the batch whose writeback is started but not completed. Protected by
+    // m_perslock.
+    bool m_bPendingBatch;
+    FlushBatch m_pendingBatch;
+    // the segments before it are trimmed in the persisted header and can be
+    // released once nothing pins them. Protected by m_perslock.
+    int64_t m_iReleasableSeg;
+    // the number of pins on the data, see pin().
+    std::atomic<uint64_t> m_iPins;
+    // true if the hlcs of the entries in the log never decrease with the
+    // index, so that the log can be searched by hlc without the index.
+    // Protected by m_rwlock and m_iSeq.
+    bool m_bHlcOrdered;
+    // sequence number of the log state, odd while a writer is updating the
+    // meta header. The getters read without any lock and retry if it
+    // changed in the middle of the read.
+    std::atomic<uint64_t> m_iSeq;
+    // read/write lock; only writers, persist() and the hlc index use it.
     pthread_rwlock_t m_rwlock;
     // persistent lock
     pthread_mutex_t m_perslock;
@@ -147,6 +297,21 @@ namespace ns_persistent {
       dbg_trace("FPL_UNLOCK"); \
     } while (0)
 
+    // A writer holding FPL_WRLOCK brackets its updates of the meta header
+    // with these. Nothing in between may throw.
+    #define FPL_SEQ_WRITE_BEGIN \
+    do { \
+      this->m_iSeq.store(this->m_iSeq.load(std::memory_order_relaxed) + 1, \
+        std::memory_order_relaxed); \
+      std::atomic_thread_fence(std::memory_order_release); \
+    } while (0)
+
+    #define FPL_SEQ_WRITE_END \
+    do { \
+      this->m_iSeq.store(this->m_iSeq.load(std::memory_order_relaxed) + 1, \
+        std::memory_order_release); \
+    } while (0)
+
     #define FPL_PERS_LOCK \
     do { \
       if (pthread_mutex_lock(&this->m_perslock) != 0) { \
@@ -164,6 +329,27 @@ namespace ns_persistent {
     } while (0)
 
  
+    // Run a read-only function on a consistent snapshot of the log without
+    // taking a lock. The function may see a torn state and is retried in
+    // that case, so it must only read the meta header, the log entries and
+    // the segment table, and must not throw. Neither the log ring buffer nor
+    // the segment table is ever freed while the log is open, and segments
+    // are released only after a trim, which invalidates the snapshot.
+    template <typename ReadFunc>
+    auto seqRead(const ReadFunc & readFunc) -> decltype(readFunc()) {
+      while (true) {
+        const uint64_t seq = this->m_iSeq.load(std::memory_order_acquire);
+        if (seq & 1) {
+          continue;
+        }
+        auto ret = readFunc();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (this->m_iSeq.load(std::memory_order_relaxed) == seq) {
+          return ret;
+        }
+      }
+    }
+
     // load the log from files. This method may through exceptions if read from
     // file failed.
     virtual void load() noexcept(false);
@@ -172,16 +358,228 @@ namespace ns_persistent {
     // FPL_PERS_LOCK is acquired.
     virtual void persistMetaHeaderAtomically(MetaHeader *) noexcept(false);
 
+    // map the header slots of the meta file, extending a meta file that holds
+    // a single header. FPL_PERS_LOCK is required.
+    void mapMetaSlots() noexcept(false);
+
+    // trim the log entries up to and including idx and remove them from the
+    // hlc index. idx must be a valid index. FPL_WRLOCK is required.
+    void dropEntriesUpTo(const int64_t & idx);
+
+    // build the hlc index from the log entries. The index is only kept while
+    // the log is not ordered by hlc; otherwise the log is searched directly.
+    // FPL_WRLOCK is required.
+    void buildHlcIndex();
+
+    // search the log for the latest entry no later than a version or an
+    // hlc, returning its index or -1. searchVersion() and searchOrderedHlc()
+    // need a consistent snapshot, i.e. FPL_RDLOCK or seqRead();
+    // searchOrderedHlc() also requires m_bHlcOrdered. searchHlcIndex() uses
+    // the hlc index and requires FPL_RDLOCK.
+    int64_t searchVersion(const int64_t & ver);
+    int64_t searchOrderedHlc(const HLC & hlc);
+    int64_t searchHlcIndex(const HLC & hlc);
+
+    // visit the entries in an index range that pass a filter, see
+    // scanVersions(). The range function sets [start,end) and is called with
+    // seqRead() after the log is pinned, so that no entry in the range can
+    // have its data released. The entries are copied out of the log in
+    // chunks of SCAN_CHUNK_ENTRIES, each with seqRead().
+    template <typename RangeFunc, typename FilterFunc>
+    int64_t scan(const RangeFunc & range, const FilterFunc & filter,
+      const EntryVisitor & visitor) noexcept(false);
+
+    // map a file shared, with MAP_SYNC in pmem mode.
+    void * mapFile(void * addr, const uint64_t & len, const int prot,
+      const int flags, const int fd) noexcept(true);
+
+    // make a mapped range durable: flush it out of the cpu caches in pmem
+    // mode, or msync it otherwise.
+    void flushRange(const void * addr, const uint64_t & len) noexcept(false);
+
+    // get the data file name of a segment, in the data path or the cold path
+    string getSegmentFileName(const int64_t & seg) const;
+    string getColdSegmentFileName(const int64_t & seg) const;
+    // get the file name of a fragment of a coded segment
+    string getFragmentFileName(const int64_t & seg, const uint32_t & frag) const;
+
+    // true if old segments are moved to the cold path or coded
+    bool isTiered() const {
+      return !this->m_sColdPath.empty() || this->m_pColdCode != nullptr;
+    }
+
+    // true if a segment has a copy in the cold path, or any coded fragment
+    bool coldSegmentExists(const int64_t & seg) const;
+
+    // map a cold segment read-only and return the mapping, setting fd to
+    // the open cold file, or -1 in coded mode. The lost fragments of a coded
+    // segment are rebuilt from the others first. No lock is required, but
+    // the segment must not be mapped in the table yet.
+    void * mapColdSegment(const int64_t & seg, int & fd) noexcept(false);
+
+    // map a data fragment of a coded segment read-only at addr.
+    void mapFragment(const int64_t & seg, const uint32_t & frag, void * addr) noexcept(false);
+
+    // code a mapped segment and write all its fragments durably. The
+    // segment must be complete, persisted and pinned.
+    void encodeSegment(const int64_t & seg) noexcept(false);
+
+    // rebuild the fragments of a coded segment that are not present, into
+    // the buffers, which hold every fragment afterwards. Throws
+    // PERSIST_EXP_RECONSTRUCT if fewer than k fragments are left.
+    void rebuildFragments(const int64_t & seg, const std::vector<bool> & present,
+      std::vector<std::vector<uint8_t>> & fragments) noexcept(false);
+
+    // move a segment to the cold path and map it from there. The segment
+    // must be complete, persisted and pinned.
+    void offloadSegment(const int64_t & seg) noexcept(false);
+
+    // the loop of m_coldThread
+    void coldLoop() noexcept(true);
+
+    // map all segments up to and including seg, prefaulting them if populate
+    // is set. FPL_WRLOCK is required.
+    void mapSegmentsUpTo(const int64_t & seg, const bool populate = false) noexcept(false);
+
+    // create, allocate and map the data file of a segment in the data path,
+    // returning the mapping and setting fd. No lock is required, but the
+    // segment must not be mapped in the table yet.
+    void * mapHotSegment(const int64_t & seg, const bool populate, int & fd) noexcept(false);
+
+    // map the m_iPreallocSegments segments after the one being written,
+    // prefaulted, so that append() neither creates files nor takes page
+    // faults on new segments. The files are prepared without FPL_WRLOCK,
+    // which is taken only to put them in the table. FPL_PERS_LOCK is required.
+    void preallocateSegments() noexcept(false);
+
+    // unmap and remove all segments before seg. FPL_PERS_LOCK is required;
+    // FPL_WRLOCK is taken only while the segments are taken out of the table.
+    void releaseSegmentsBefore(const int64_t & seg) noexcept(false);
+
+    // get the logical data offset for a new entry of the given size. An entry
+    // does not cross segments, so it may skip the tail of the last segment.
+    // Returns -1 if there is no space for it. FPL_RDLOCK is required.
+    int64_t placeData(const uint64_t & size);
+
+    // flush data in logical range [start,end) to the disk. FPL_PERS_LOCK is required.
+    void flushData(const uint64_t & start, const uint64_t & end) noexcept(false);
+
+    // flush log entries in [start,end) to the disk. FPL_PERS_LOCK is required.
+    void flushLog(const int64_t & start, const int64_t & end) noexcept(false);
+
+    // the checksum of an entry and its data, see LogEntry. The entry's
+    // segment must be mapped.
+    uint32_t entryChecksum(const LogEntry * pEntry);
+
+    // checksum the entries in [start,end) before they are flushed.
+    // FPL_PERS_LOCK is required.
+    void sealEntries(const int64_t & start, const int64_t & end);
+
+    // check the last entries of a loaded log and truncate it before the
+    // first one whose data is out of place or does not match its checksum,
+    // persisting the truncated header. It maps the segments it reads, so
+    // m_iSegmentHead and m_iSegmentTail must be set. FPL_WRLOCK and
+    // FPL_PERS_LOCK are required.
+    void verifyTail() noexcept(false);
+
+    // capture everything appended after the base header into a batch.
+    // It needs a consistent snapshot, i.e. FPL_RDLOCK or seqRead().
+    void snapshotBatch(FlushBatch & batch, const MetaHeader & base);
+
+    // start writing back the data and log entries of a batch without
+    // waiting for it. FPL_PERS_LOCK is required.
+    void startWriteback(const FlushBatch & batch) noexcept(false);
+
+    // flush a batch, persist its header, and release the segments it
+    // trimmed. FPL_PERS_LOCK is required.
+    void completeBatch(const FlushBatch & batch) noexcept(false);
+
+    // release the segments before m_iReleasableSeg unless the data is
+    // pinned. FPL_PERS_LOCK is required.
+    void releaseTrimmedSegments() noexcept(false);
+
   public:
 
     //Constructor
-    FilePersistLog(const string &name,const string &dataPath) noexcept(false);
+    // @param segmentSize the size of a data segment. It should be a multiple of
+    //        the page size and no smaller than the largest entry. It is only
+    //        used for new logs; an existing log keeps its original segment size.
+    // @param asyncPersist if true, persist() is pipelined: it returns after
+    //        starting the writeback of new entries, and a version is reported
+    //        by persist()/getLastPersisted() only after a later persist() call
+    //        completes it.
+    // @param mappedHeader if true, the meta header is persisted to
+    //        alternating slots of the mapped meta file with a single msync,
+    //        instead of writing and renaming a swap file. See META_SLOTS.
+    // @param codec the codec new entries of at least compressThreshold bytes
+    //        are compressed with in append(). The getters return the data of
+    //        a compressed entry decompressed in a buffer of the calling
+    //        thread, see isZeroCopy(). Entries already in the log are read
+    //        whatever the codec they were written with.
+    // @param coldPath if not empty, the log is tiered: a background thread
+    //        moves the persisted data segments not written for coldAge
+    //        seconds to coldPath, e.g. on a disk or a mounted object store,
+    //        where they are still read through the same getters.
+    // @param pmem if true, dataPath must be on a file system mounted with
+    //        dax on persistent memory. persist() then flushes the cache lines
+    //        of the new entries and the header instead of calling msync, and
+    //        the header is always mapped. Durability needs MAP_SYNC, so the
+    //        log fails to load with PERSIST_EXP_MMAP_FILE(EOPNOTSUPP) if
+    //        dataPath is not on such a file system.
+    // @param preallocSegments the number of segments past the one being
+    //        written that persist() allocates and maps in advance, or 0 to
+    //        map them in append() when they are first written.
+    // @param hugePages if true, the data segments are advised to be backed
+    //        by transparent huge pages, which only takes effect on file
+    //        systems that support them, e.g. dax or tmpfs with huge=.
+    // @param coldFragmentPaths if not empty, the log is tiered, and the cold
+    //        segments are erasure-coded into one fragment per path instead of
+    //        moved to coldPath, which is not used then: coldParity of the
+    //        fragments are parity, and the rest hold the data, which is read
+    //        from them in place. Any coldParity fragments of a segment can be
+    //        lost; they are rebuilt from the others when the log is loaded.
+    //        The segment size must be a multiple of the number of data
+    //        fragments times the page size.
+    // @param coldParity the number of parity fragments
+    FilePersistLog(const string &name,const string &dataPath,
+      const uint64_t &segmentSize = DEFAULT_DATA_SEGMENT_SIZE,
+      const bool asyncPersist = false,
+      const bool mappedHeader = false,
+      const LogCompression codec = LC_NONE,
+      const uint64_t &compressThreshold = DEFAULT_COMPRESS_THRESHOLD,
+      const string &coldPath = "",
+      const uint64_t &coldAge = DEFAULT_COLD_SEGMENT_AGE,
+      const bool pmem = false,
+      const uint64_t &preallocSegments = DEFAULT_PREALLOC_SEGMENTS,
+      const bool hugePages = false,
+      const std::vector<string> &coldFragmentPaths = std::vector<string>(),
+      const uint32_t &coldParity = 0) noexcept(false);
     FilePersistLog(const string &name) noexcept(false):
       FilePersistLog(name,DEFAULT_FILE_PERSIST_LOG_DATA_PATH){
     };
     //Destructor
     virtual ~FilePersistLog() noexcept(true);
 
+    // Prepare every log in dataPath for a recovery on numThreads threads (the
+    // number of cores if 0): check the header and the used log entries of
+    // each log and start reading its live data into the page cache, so that
+    // the logs load quickly when their objects are constructed one by one.
+    // @return the names of the logs found invalid; their load() will throw.
+    static std::vector<string> preload(
+      const string &dataPath = DEFAULT_FILE_PERSIST_LOG_DATA_PATH,
+      unsigned int numThreads = 0) noexcept(false);
+
+    // In tiered mode, move the persisted segments not written for the cold
+    // age to the cold path now. The background thread calls this
+    // periodically, so it is only needed to offload on demand.
+    // @return the number of segments moved.
+    int64_t offloadColdSegments() noexcept(false);
+
+    // the directory of the files of the log.
+    const string & getDataPath() const noexcept(true) {
+      return this->m_sDataPath;
+    }
+
     //Derived from PersistLog
     virtual void append(const void * pdata,
       const uint64_t & size, const int64_t & ver,
@@ -193,14 +591,31 @@ namespace ns_persistent {
     virtual int64_t getEarliestVersion() noexcept(false);
     virtual int64_t getLatestVersion() noexcept(false);
     virtual const int64_t getLastPersisted() noexcept(false);
+    virtual int64_t getVersionIndex(const int64_t & ver) noexcept(false);
+    virtual int64_t getHLCIndex(const HLC & hlc) noexcept(false);
+    virtual bool isZeroCopy(const void * pdata) noexcept(true);
     virtual const void* getEntryByIndex(const int64_t &eno) noexcept(false);
+    virtual void getEntryInfoByIndex(const int64_t &eno, int64_t &ver,
+      HLC &hlc, uint64_t &size) noexcept(false);
     virtual const void* getEntry(const int64_t & ver) noexcept(false);
     virtual const void* getEntry(const HLC &hlc) noexcept(false);
+    virtual int64_t scanVersions(const int64_t & from, const int64_t & to,
+      const EntryVisitor & visitor) noexcept(false);
+    virtual int64_t scanHLCs(const HLC & from, const HLC & to,
+      const EntryVisitor & visitor) noexcept(false);
     //virtual const __int128 persist(const __int128 & ver = -1) noexcept(false);
     virtual const int64_t persist() noexcept(false);
     virtual void trimByIndex(const int64_t &eno) noexcept(false);
     virtual void trim(const int64_t &ver) noexcept(false);
     virtual void trim(const HLC & hlc) noexcept(false);
+    virtual void pin() noexcept(true);
+    virtual void unpin() noexcept(true);
+    // The data segments that neither this log nor the copy writes again are
+    // hard-linked into the copy, or reflinked on a file system without hard
+    // links between the two paths, and only the last one is copied, so a
+    // checkpoint of a large log costs little more than its log entries.
+    // The entries up to ver are persisted first if they are not yet.
+    virtual int64_t checkpoint(const string & targetPath, const int64_t & ver) noexcept(false);
 
     template <typename TKey,typename KeyGetter>
     void trim(const TKey &key,const KeyGetter &keyGetter) noexcept(false) {
@@ -226,10 +641,9 @@ namespace ns_persistent {
       if (tail < head) tail += MAX_LOG_ENTRY;
       idx = binarySearch<TKey>(keyGetter,key,head,tail);
       if (idx != -1) {
-        META_HEADER->fields.head += (idx-head+1);
-        //TODO:remove delete entries from the index. This is tricky because
-        // HLC order and idex order does not agree with each other.
-        throw PERSIST_EXP_UNIMPLEMENTED;
+        FPL_SEQ_WRITE_BEGIN;
+        dropEntriesUpTo(META_HEADER->fields.head + (idx-head));
+        FPL_SEQ_WRITE_END;
       } else {
         FPL_UNLOCK;
         return;
@@ -241,7 +655,7 @@ namespace ns_persistent {
 #ifdef _DEBUG
     //dbg functions
     void dbgDumpMeta() {
-      dbg_trace("m_pData={0},m_pLog={1}",(void*)this->m_pData,(void*)this->m_pLog);
+      dbg_trace("m_pLog={0},segments=[{1},{2})",(void*)this->m_pLog,this->m_iSegmentHead,this->m_iSegmentTail);
       dbg_trace("MEAT_HEADER:head={0},tail={1}",(int64_t)META_HEADER->fields.head,(int64_t)META_HEADER->fields.tail);
       dbg_trace("MEAT_HEADER_PERS:head={0},tail={1}",(int64_t)META_HEADER_PERS->fields.head,(int64_t)META_HEADER_PERS->fields.tail);
       dbg_trace("NEXT_LOG_ENTRY={0},NEXT_LOG_ENTRY_PERS={1}",(void*)NEXT_LOG_ENTRY,(void*)NEXT_LOG_ENTRY_PERS);
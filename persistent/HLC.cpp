@@ -1,10 +1,14 @@
 #include <time.h>
 #include <errno.h>
 #include "HLC.hpp"
+#include "../time/fast_clock.h"
 
-// return microsecond
+// return microsecond, from the TSC where it is usable
 uint64_t read_rtc_us () 
   noexcept(false) {
+  if (fast_clock::tsc_usable()) {
+    return fast_clock::realtime_ns()/1000;
+  }
   struct timespec tp;
   if ( clock_gettime(CLOCK_REALTIME,&tp) != 0 ) {
     throw HLC_EXP_READ_RTC(errno);
@@ -17,33 +21,10 @@ HLC::HLC ()
   noexcept(false) {
   this->m_rtc_us = read_rtc_us();
   this->m_logic = 0L;
-  if (pthread_spin_init(&this->m_oLck,PTHREAD_PROCESS_SHARED) != 0) {
-    throw HLC_EXP_SPIN_INIT(errno);
-  }
 }
 
-HLC::~HLC ()
-  noexcept(false) {
-  if (pthread_spin_destroy(&this->m_oLck) != 0) {
-    throw HLC_EXP_SPIN_DESTROY(errno);
-  }
-}
-
-#define HLC_LOCK \
-  if (pthread_spin_lock(&this->m_oLck) != 0) { \
-    throw HLC_EXP_SPIN_LOCK(errno); \
-  }
-#define HLC_UNLOCK \
-  if (pthread_spin_unlock(&this->m_oLck) != 0) { \
-    throw HLC_EXP_SPIN_UNLOCK(errno); \
-  }
-
-void HLC::tick (bool thread_safe)
+void HLC::tick ()
   noexcept(false) {
-  if (thread_safe) {
-    HLC_LOCK
-  }
-
   uint64_t rtc = read_rtc_us();
   if ( rtc <= this->m_rtc_us ) {
     this->m_logic ++;
@@ -51,18 +32,10 @@ void HLC::tick (bool thread_safe)
     this->m_rtc_us = rtc;
     this->m_logic = 0ull;
   }
-
-  if(thread_safe) {
-    HLC_UNLOCK
-  }
 }
 
-void HLC::tick (const HLC & msgHlc, bool thread_safe)
+void HLC::tick (const HLC & msgHlc)
   noexcept(false) {
-  if (thread_safe) {
-    HLC_LOCK
-  }
-
   uint64_t rtc = read_rtc_us();
   if ((rtc > this->m_rtc_us) && (rtc > msgHlc.m_rtc_us)) {
     // use rtc
@@ -76,40 +49,32 @@ void HLC::tick (const HLC & msgHlc, bool thread_safe)
     this->m_rtc_us = msgHlc.m_rtc_us;
     this->m_logic = msgHlc.m_logic + 1;
   }
-
-  if (thread_safe) {
-    HLC_UNLOCK
-  }
-}
-
-bool HLC::operator > (const HLC & hlc) const
-  noexcept(true) {
-  return (this->m_rtc_us > hlc.m_rtc_us) ||
-    (this->m_rtc_us == hlc.m_rtc_us && this->m_logic > hlc.m_logic);
-}
-
-bool HLC::operator < (const HLC & hlc) const
-  noexcept(true) {
-  return hlc > *this && !(hlc == *this);
 }
 
-bool HLC::operator == (const HLC & hlc) const
-  noexcept(true) {
-  return this->m_rtc_us == hlc.m_rtc_us && this->m_logic == hlc.m_logic;
+HLCClock::HLCClock ()
+  noexcept(false):
+  m_packed(pack(HLC(read_rtc_us(),0))) {
 }
 
-bool HLC::operator >= (const HLC &hlc) const
+HLC HLCClock::advance (const uint64_t & least)
   noexcept(true) {
-  return  ! (hlc > *this);
+  uint64_t curr = this->m_packed.load(std::memory_order_relaxed);
+  uint64_t next;
+  do {
+    next = (least > curr) ? least : curr + 1;
+  } while (!this->m_packed.compare_exchange_weak(curr,next,
+    std::memory_order_acq_rel,std::memory_order_relaxed));
+  return unpack(next);
 }
 
-bool HLC::operator <= (const HLC &hlc) const
-  noexcept(true) {
-  return ! (*this > hlc);
+HLC HLCClock::tick ()
+  noexcept(false) {
+  return advance(pack(HLC(read_rtc_us(),0)));
 }
 
-void HLC::operator = (const HLC &hlc)
-  noexcept(true) {
-  this->m_rtc_us = hlc.m_rtc_us;
-  this->m_logic = hlc.m_logic;
+HLC HLCClock::tick (const HLC & msgHlc)
+  noexcept(false) {
+  const uint64_t rtc = pack(HLC(read_rtc_us(),0));
+  const uint64_t msg = pack(msgHlc) + 1;
+  return advance((rtc > msg) ? rtc : msg);
 }
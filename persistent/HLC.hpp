@@ -2,50 +2,87 @@
 #define HLC_HPP
 #include <sys/types.h>
 #include <inttypes.h>
-#include <pthread.h>
+#include <atomic>
+#include <type_traits>
 
+// A hybrid logical clock timestamp. It is a plain 16-byte value, so it can
+// be stored in logs and indexes and compared without any overhead. A clock
+// shared by several threads is an HLCClock.
 class HLC{
-
-private:
-  pthread_spinlock_t m_oLck; // spinlock
-
 public:
   uint64_t m_rtc_us; // real-time clock in microseconds
   uint64_t m_logic;  // logic clock
 
   // constructors
+  // the default one reads the real-time clock
   HLC () noexcept(false);
 
-  HLC (uint64_t _r,uint64_t _l):
+  constexpr HLC (uint64_t _r,uint64_t _l):
     m_rtc_us(_r),m_logic(_l){
   }
 
-  // destructors
-  virtual ~HLC() noexcept(false);
-
-  // ticking method - thread safe
-  virtual void tick (bool thread_safe=true) noexcept(false);
-  virtual void tick (const HLC & msgHlc, bool thread_safe=true) noexcept(false);
+  // ticking methods, not thread safe
+  void tick () noexcept(false);
+  void tick (const HLC & msgHlc) noexcept(false);
 
   // comparators
-  virtual bool operator > (const HLC & hlc) const noexcept(true);
-  virtual bool operator < (const HLC & hlc) const noexcept(true);
-  virtual bool operator == (const HLC & hlc) const noexcept(true);
-  virtual bool operator >= (const HLC & hlc) const noexcept(true);
-  virtual bool operator <= (const HLC & hlc) const noexcept(true);
-
-  // evaluator
-  virtual void operator = (const HLC & hlc) noexcept(true);
+  constexpr bool operator > (const HLC & hlc) const noexcept(true) {
+    return (this->m_rtc_us > hlc.m_rtc_us) ||
+      (this->m_rtc_us == hlc.m_rtc_us && this->m_logic > hlc.m_logic);
+  }
+  constexpr bool operator < (const HLC & hlc) const noexcept(true) {
+    return hlc > *this;
+  }
+  constexpr bool operator == (const HLC & hlc) const noexcept(true) {
+    return this->m_rtc_us == hlc.m_rtc_us && this->m_logic == hlc.m_logic;
+  }
+  constexpr bool operator >= (const HLC & hlc) const noexcept(true) {
+    return !(hlc > *this);
+  }
+  constexpr bool operator <= (const HLC & hlc) const noexcept(true) {
+    return !(*this > hlc);
+  }
+};
+
+static_assert(std::is_trivially_copyable<HLC>::value && sizeof(HLC) == 16,
+  "HLC must be a plain 16-byte value");
+
+// A thread-safe hybrid logical clock without a lock. It is packed in 64 bits:
+// the real-time clock in microseconds above the low HLC_LOGIC_BITS bits, and
+// the logic clock in those, so that ticking is a single compare and
+// swap and a logic clock overflow carries into the real-time clock.
+#define HLC_LOGIC_BITS (12)
+class HLCClock {
+private:
+  std::atomic<uint64_t> m_packed;
+
+  static constexpr uint64_t pack(const HLC & hlc) {
+    return (hlc.m_rtc_us << HLC_LOGIC_BITS) + hlc.m_logic;
+  }
+  static constexpr HLC unpack(const uint64_t & packed) {
+    return HLC(packed >> HLC_LOGIC_BITS, packed & ((1ull << HLC_LOGIC_BITS) - 1));
+  }
+  // advance the clock to at least the given packed time and past its current one
+  HLC advance(const uint64_t & least) noexcept(true);
+
+public:
+  // start from the real-time clock
+  HLCClock () noexcept(false);
+
+  // tick for a local event
+  HLC tick () noexcept(false);
+  // tick for receiving a message stamped msgHlc
+  HLC tick (const HLC & msgHlc) noexcept(false);
+  // the time of the last tick
+  HLC now () const noexcept(true) {
+    return unpack(this->m_packed.load(std::memory_order_acquire));
+  }
 };
 
 #define HLC_EXP(errcode,usercode) \
   ( (((errcode)&0xffffffffull)<<32) | ((usercode)&0xffffffffull) )
 #define HLC_EXP_USERCODE(x) ((uint32_t)((x)&0xffffffffull))
 #define HLC_EXP_READ_RTC(x)                     HLC_EXP(0,(x))
-#define HLC_EXP_SPIN_INIT(x)                    HLC_EXP(1,(x))
-#define HLC_EXP_SPIN_DESTROY(x)                 HLC_EXP(2,(x))
-#define HLC_EXP_SPIN_LOCK(x)                    HLC_EXP(3,(x))
-#define HLC_EXP_SPIN_UNLOCK(x)                    HLC_EXP(4,(x))
 
 // read the rtc clock in microseconds
 uint64_t read_rtc_us() noexcept(false);
@@ -0,0 +1,228 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include "KeyIndex.hpp"
+#include "PersistLog.hpp"
+#include "util.hpp"
+
+namespace ns_persistent {
+
+  // The file is the first indexed entry, then the records in the order they
+  // were appended, so that their entries ascend.
+  #define KEY_INDEX_HEADER_SIZE (sizeof(int64_t))
+
+  static void writeFully(const int fd, const void * buf, const uint64_t & len,
+    const uint64_t & ofst) noexcept(false) {
+    for (uint64_t nWritten = 0; nWritten < len;) {
+      const ssize_t n = pwrite(fd,(const char *)buf + nWritten,len - nWritten,ofst + nWritten);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        throw PERSIST_EXP_WRITE_FILE(errno);
+      }
+      nWritten += n;
+    }
+  }
+
+  KeyIndex::KeyIndex(const std::string & file, const int64_t & next_idx)
+  noexcept(false) : m_sFile(file),
+    m_iFd(-1),
+    m_iCoveredFrom(next_idx),
+    m_iNextIdx(next_idx),
+    m_iSynced(0),
+    m_bRewrite(false),
+    m_iKeptTrimmed(0) {
+    if (this->m_sFile.empty()) {
+      return;
+    }
+    this->m_iFd = open(this->m_sFile.c_str(),O_RDWR|O_CREAT,S_IWUSR|S_IRUSR|S_IRGRP|S_IWGRP|S_IROTH);
+    if (this->m_iFd == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    struct stat st;
+    if (fstat(this->m_iFd,&st) != 0) {
+      throw PERSIST_EXP_READ_FILE(errno);
+    }
+    if ((uint64_t)st.st_size < KEY_INDEX_HEADER_SIZE) {
+      // a new index
+      this->m_bRewrite = true;
+      return;
+    }
+    // a record torn by a crash is ignored.
+    const uint64_t num = (st.st_size - KEY_INDEX_HEADER_SIZE) / sizeof(Record);
+    this->m_vRecords.resize(num);
+    int64_t coveredFrom;
+    if (pread(this->m_iFd,&coveredFrom,sizeof(coveredFrom),0) != (ssize_t)sizeof(coveredFrom) ||
+        (num > 0 && pread(this->m_iFd,this->m_vRecords.data(),num * sizeof(Record),KEY_INDEX_HEADER_SIZE)
+          != (ssize_t)(num * sizeof(Record)))) {
+      throw PERSIST_EXP_READ_FILE(errno);
+    }
+    this->m_iCoveredFrom = coveredFrom;
+    this->m_iNextIdx = (num > 0) ? this->m_vRecords.back().idx + 1 : coveredFrom;
+    this->m_iSynced = num;
+    this->m_bRewrite = ((uint64_t)st.st_size != KEY_INDEX_HEADER_SIZE + num * sizeof(Record));
+    relink();
+  }
+
+  KeyIndex::~KeyIndex() noexcept(true) {
+    if (this->m_iFd != -1) {
+      close(this->m_iFd);
+    }
+  }
+
+  void KeyIndex::link(const int64_t & rec) {
+    auto latest = this->m_mLatest.find(this->m_vRecords[rec].hash);
+    if (latest == this->m_mLatest.end()) {
+      this->m_vPrevious[rec] = -1;
+      this->m_mLatest.emplace(this->m_vRecords[rec].hash,rec);
+    } else {
+      this->m_vPrevious[rec] = latest->second;
+      latest->second = rec;
+    }
+  }
+
+  void KeyIndex::relink() {
+    this->m_mLatest.clear();
+    this->m_vPrevious.resize(this->m_vRecords.size());
+    for (int64_t rec = 0; rec < (int64_t)this->m_vRecords.size(); rec++) {
+      link(rec);
+    }
+  }
+
+  void KeyIndex::rewrite() noexcept(false) {
+    const std::string swpFile = this->m_sFile + ".swp";
+    int fd = open(swpFile.c_str(),O_RDWR|O_CREAT|O_TRUNC,S_IWUSR|S_IRUSR|S_IRGRP|S_IWGRP|S_IROTH);
+    if (fd == -1) {
+      throw PERSIST_EXP_CREATE_FILE(errno);
+    }
+    try {
+      writeFully(fd,&this->m_iCoveredFrom,sizeof(this->m_iCoveredFrom),0);
+      writeFully(fd,this->m_vRecords.data(),this->m_vRecords.size() * sizeof(Record),
+        KEY_INDEX_HEADER_SIZE);
+      if (fsync(fd) != 0) {
+        throw PERSIST_EXP_MSYNC(errno);
+      }
+      if (rename(swpFile.c_str(),this->m_sFile.c_str()) != 0) {
+        throw PERSIST_EXP_RENAME_FILE(errno);
+      }
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    close(this->m_iFd);
+    this->m_iFd = fd;
+    this->m_iSynced = this->m_vRecords.size();
+    this->m_bRewrite = false;
+  }
+
+  void KeyIndex::append(const std::vector<uint64_t> & hashes, const int64_t & ver,
+    const int64_t & idx) noexcept(false) {
+    std::lock_guard<std::mutex> lck(this->m_mtx);
+    if (idx != this->m_iNextIdx) {
+      // some entries were appended without the index.
+      this->m_vRecords.clear();
+      this->m_vPrevious.clear();
+      this->m_mLatest.clear();
+      this->m_iCoveredFrom = idx;
+      this->m_iKeptTrimmed = 0;
+      this->m_bRewrite = true;
+    }
+    for (const uint64_t & hash : hashes) {
+      this->m_vRecords.push_back(Record{hash,ver,idx});
+      this->m_vPrevious.push_back(-1);
+      link(this->m_vRecords.size() - 1);
+    }
+    this->m_iNextIdx = idx + 1;
+  }
+
+  void KeyIndex::sync() noexcept(false) {
+    std::lock_guard<std::mutex> lck(this->m_mtx);
+    if (this->m_sFile.empty()) {
+      return;
+    }
+    if (this->m_bRewrite) {
+      rewrite();
+      return;
+    }
+    if (this->m_iSynced == this->m_vRecords.size()) {
+      return;
+    }
+    writeFully(this->m_iFd,this->m_vRecords.data() + this->m_iSynced,
+      (this->m_vRecords.size() - this->m_iSynced) * sizeof(Record),
+      KEY_INDEX_HEADER_SIZE + this->m_iSynced * sizeof(Record));
+    if (fdatasync(this->m_iFd) != 0) {
+      throw PERSIST_EXP_MSYNC(errno);
+    }
+    this->m_iSynced = this->m_vRecords.size();
+  }
+
+  void KeyIndex::truncate(const int64_t & latest_idx) noexcept(false) {
+    std::lock_guard<std::mutex> lck(this->m_mtx);
+    if (this->m_iNextIdx <= latest_idx + 1) {
+      return;
+    }
+    auto end = std::upper_bound(this->m_vRecords.begin(),this->m_vRecords.end(),latest_idx,
+      [](const int64_t & idx, const Record & rec) { return idx < rec.idx; });
+    this->m_vRecords.erase(end,this->m_vRecords.end());
+    this->m_iCoveredFrom = MIN(this->m_iCoveredFrom,latest_idx + 1);
+    this->m_iNextIdx = latest_idx + 1;
+    this->m_iSynced = MIN(this->m_iSynced,(uint64_t)this->m_vRecords.size());
+    this->m_iKeptTrimmed = MIN(this->m_iKeptTrimmed,(uint64_t)this->m_vRecords.size());
+    this->m_bRewrite = true;
+    relink();
+  }
+
+  void KeyIndex::compact(const int64_t & earliest_idx) noexcept(false) {
+    std::lock_guard<std::mutex> lck(this->m_mtx);
+    const uint64_t trimmed = std::lower_bound(this->m_vRecords.begin(),this->m_vRecords.end(),earliest_idx,
+      [](const Record & rec, const int64_t & idx) { return rec.idx < idx; }) - this->m_vRecords.begin();
+    if ((trimmed - MIN(trimmed,this->m_iKeptTrimmed)) * 2 < this->m_vRecords.size()) {
+      return;
+    }
+    // keep the newest trimmed record of each chain
+    std::unordered_map<uint64_t,uint64_t> newest;
+    for (uint64_t rec = 0; rec < trimmed; rec++) {
+      newest[this->m_vRecords[rec].hash] = rec;
+    }
+    std::vector<Record> records;
+    records.reserve(this->m_vRecords.size() - trimmed + newest.size());
+    for (uint64_t rec = 0; rec < this->m_vRecords.size(); rec++) {
+      if (rec >= trimmed || newest[this->m_vRecords[rec].hash] == rec) {
+        records.push_back(this->m_vRecords[rec]);
+      }
+    }
+    this->m_vRecords.swap(records);
+    this->m_iKeptTrimmed = newest.size();
+    this->m_iSynced = 0;
+    this->m_bRewrite = true;
+    relink();
+  }
+
+  int64_t KeyIndex::lookup(const uint64_t & hash, const int64_t & ver) noexcept(true) {
+    std::lock_guard<std::mutex> lck(this->m_mtx);
+    auto latest = this->m_mLatest.find(hash);
+    if (latest == this->m_mLatest.end()) {
+      return INVALID_INDEX;
+    }
+    int64_t rec = latest->second;
+    while (rec != -1 && this->m_vRecords[rec].ver > ver) {
+      rec = this->m_vPrevious[rec];
+    }
+    return (rec == -1) ? INVALID_INDEX : this->m_vRecords[rec].idx;
+  }
+
+  int64_t KeyIndex::getCoveredFrom() noexcept(true) {
+    std::lock_guard<std::mutex> lck(this->m_mtx);
+    return this->m_iCoveredFrom;
+  }
+
+  int64_t KeyIndex::getNextIndex() noexcept(true) {
+    std::lock_guard<std::mutex> lck(this->m_mtx);
+    return this->m_iNextIdx;
+  }
+
+}
@@ -0,0 +1,102 @@
+#ifndef KEY_INDEX_HPP
+#define KEY_INDEX_HPP
+
+#include <inttypes.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ns_persistent {
+
+  // the suffix of the key index file next to the files of a FilePersistLog
+  #define KEY_INDEX_FILE_SUFFIX ("keyidx")
+
+  // A secondary index of the log of a Persistent<T> whose type changes some
+  // of its keys in each version: for each key hash, the chain of the log
+  // entries that changed a key with that hash, newest first, so that the
+  // value of a key at a version is found by reading one entry instead of
+  // scanning the log. Keys with the same hash share a chain; that is safe,
+  // since an entry on the chain of a key that did not change in it still has
+  // the key's value. The index covers the log entries from the first one it
+  // was appended with; an entry appended without it, e.g. by a catch-up,
+  // starts the coverage over.
+  //
+  // The records are kept in memory and, for a log in files, appended to the
+  // key index file by sync(), which must come before the log is persisted,
+  // so that after a crash the index has every persisted entry. The records
+  // past the log's tail are dropped at load time by truncate().
+  class KeyIndex {
+  private:
+    struct Record {
+      uint64_t hash;
+      int64_t ver;
+      int64_t idx;
+    };
+    // the file, or "" for an index kept in memory only.
+    const std::string m_sFile;
+    int m_iFd;
+    std::mutex m_mtx;
+    std::vector<Record> m_vRecords;
+    // the record before each record on its chain, or -1.
+    std::vector<int64_t> m_vPrevious;
+    // the newest record of each chain.
+    std::unordered_map<uint64_t,int64_t> m_mLatest;
+    // the entries from m_iCoveredFrom up to before m_iNextIdx are indexed.
+    int64_t m_iCoveredFrom;
+    int64_t m_iNextIdx;
+    // the records before this one are in the file.
+    uint64_t m_iSynced;
+    // set if the file must be rewritten by the next sync(), because records
+    // were dropped or the coverage started over.
+    bool m_bRewrite;
+    // the records of trimmed entries that the last compact() kept.
+    uint64_t m_iKeptTrimmed;
+
+    // add a record to the end of its chain.
+    void link(const int64_t & rec);
+    void relink();
+    // rewrite the file with the coverage and the records; m_mtx is held.
+    void rewrite() noexcept(false);
+
+  public:
+    // @param file The key index file, or "" to keep the index in memory.
+    //        A missing file starts an index covering the entries from
+    //        next_idx, the index of the next entry of the log.
+    // @param next_idx see above; 0 for a new log.
+    KeyIndex(const std::string & file, const int64_t & next_idx) noexcept(false);
+    virtual ~KeyIndex() noexcept(true);
+
+    // index the log entry idx of version ver, which changed the keys with
+    // these hashes. An entry that does not follow the last one indexed
+    // starts the coverage over.
+    void append(const std::vector<uint64_t> & hashes, const int64_t & ver,
+      const int64_t & idx) noexcept(false);
+
+    // write the new records to the file and flush them.
+    void sync() noexcept(false);
+
+    // drop the records of the entries after latest_idx, see above.
+    void truncate(const int64_t & latest_idx) noexcept(false);
+
+    // drop the records that a trim of the log up to before earliest_idx made
+    // useless: of the records of trimmed entries, only the newest of each
+    // chain is kept, since the entries after it still have its value. The
+    // file is only rewritten once at least half of it would go.
+    void compact(const int64_t & earliest_idx) noexcept(false);
+
+    // the index of the newest entry up to version ver on the chain of the
+    // hash, or INVALID_INDEX if no entry the index covers changed such a
+    // key up to that version.
+    int64_t lookup(const uint64_t & hash, const int64_t & ver) noexcept(true);
+
+    // the entries from getCoveredFrom() up to before getNextIndex() are
+    // indexed, so lookup() returning INVALID_INDEX only means that the key
+    // never changed if getCoveredFrom() is 0.
+    int64_t getCoveredFrom() noexcept(true);
+    int64_t getNextIndex() noexcept(true);
+  };
+
+}
+
+#endif//KEY_INDEX_HPP
@@ -0,0 +1,484 @@
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <vector>
+#include "util.hpp"
+#include "MemPersistLog.hpp"
+
+using namespace std;
+
+namespace ns_persistent{
+
+  // the hlc order of the entries
+  static inline bool hlcLess(const MemLogEntry * e1, const MemLogEntry * e2) {
+    return (e1->hlc_r < e2->hlc_r) ||
+      (e1->hlc_r == e2->hlc_r && e1->hlc_l < e2->hlc_l);
+  }
+
+  static inline bool hlcLess(const HLC & hlc, const MemLogEntry * e) {
+    return (hlc.m_rtc_us < e->hlc_r) ||
+      (hlc.m_rtc_us == e->hlc_r && hlc.m_logic < e->hlc_l);
+  }
+
+  static inline bool hlcLess(const MemLogEntry * e, const HLC & hlc) {
+    return (e->hlc_r < hlc.m_rtc_us) ||
+      (e->hlc_r == hlc.m_rtc_us && e->hlc_l < hlc.m_logic);
+  }
+
+  MemPersistLog::MemPersistLog(const string &name) noexcept(false)
+  : PersistLog(name),
+    m_iHead(0),
+    m_iTail(0),
+    m_iVer(INVALID_VERSION),
+    m_iPersistedVer(INVALID_VERSION),
+    m_iPins(0),
+    m_bHlcOrdered(true),
+    m_iSeq(0) {
+    for (int64_t b = 0; b < MEM_LOG_BLOCKS; b++) {
+      this->m_pBlocks[b].store(nullptr,std::memory_order_relaxed);
+    }
+    dbg_trace("{0} constructor: in-memory log created.",name);
+  }
+
+  MemPersistLog::~MemPersistLog() noexcept(true) {
+    for (int64_t b = 0; b < MEM_LOG_BLOCKS; b++) {
+      delete[] this->m_pBlocks[b].load(std::memory_order_relaxed);
+    }
+  }
+
+  const char * MemPersistLog::copyData(const void * pdata,
+    const uint64_t & size, const int64_t & idx) noexcept(false) {
+    if (this->m_dChunks.empty() ||
+        this->m_dChunks.back().size - this->m_dChunks.back().used < size) {
+      const uint64_t chunkSize = std::max(size,MEM_LOG_CHUNK_SIZE);
+      try {
+        this->m_dChunks.push_back(Chunk{std::unique_ptr<char[]>(new char[chunkSize]),
+          chunkSize,0,idx});
+      } catch (const std::bad_alloc &) {
+        throw PERSIST_EXP_ALLOC(ENOMEM);
+      }
+    }
+    Chunk & chunk = this->m_dChunks.back();
+    char * pdst = chunk.buf.get() + chunk.used;
+    if (size > 0) {
+      memcpy(pdst,pdata,size);
+    }
+    chunk.used += size;
+    chunk.last = idx;
+    return pdst;
+  }
+
+  void MemPersistLog::append(const void *pdata,
+    const uint64_t & size, const int64_t &ver,
+    const HLC &mhlc)
+  noexcept(false) {
+    dbg_trace("{0} append event ({1},{2})",this->m_sName,mhlc.m_rtc_us,mhlc.m_logic);
+    std::lock_guard<std::mutex> lck(this->m_mutex);
+
+    if (this->m_iTail - this->m_iHead >= MEM_LOG_MAX_ENTRY - 1) {
+      dbg_trace("{0}-append exception no free slots in log!",this->m_sName);
+      throw PERSIST_EXP_NOSPACE_LOG;
+    }
+    if ((this->m_iTail > this->m_iHead) && (ver <= this->m_iVer)) {
+      dbg_trace("{0}-append version already exists! cur_ver:{1} new_ver:{2}",
+        this->m_sName,this->m_iVer,ver);
+      throw PERSIST_EXP_INV_VERSION;
+    }
+
+    // the block of the entry is allocated the first time the log grows into
+    // it. Once the log wraps around, its slot is free because head has
+    // passed it.
+    std::atomic<MemLogEntry *> & block =
+      this->m_pBlocks[(this->m_iTail / MEM_LOG_BLOCK_ENTRIES) % MEM_LOG_BLOCKS];
+    if (block.load(std::memory_order_relaxed) == nullptr) {
+      MemLogEntry * pBlock = new (std::nothrow) MemLogEntry[MEM_LOG_BLOCK_ENTRIES];
+      if (pBlock == nullptr) {
+        throw PERSIST_EXP_ALLOC(ENOMEM);
+      }
+      block.store(pBlock,std::memory_order_release);
+    }
+
+    // copy data and fill the log entry
+    const char * pdst = copyData(pdata,size,this->m_iTail);
+    MemLogEntry * ple = entryAt(this->m_iTail);
+
+    // update the hlc index, which is built once the log goes out of hlc order.
+    const MemLogEntry next{ver,size,pdst,mhlc.m_rtc_us,mhlc.m_logic};
+    const bool bHlcOrdered = (this->m_iTail == this->m_iHead) ||
+      (this->m_bHlcOrdered && !hlcLess(&next, entryAt(this->m_iTail - 1)));
+    try {
+      if (bHlcOrdered) {
+        this->hidx.clear();
+      } else {
+        if (this->m_bHlcOrdered) {
+          std::vector<hlc_index_entry> entries;
+          entries.reserve(this->m_iTail - this->m_iHead);
+          for (int64_t idx = this->m_iHead; idx < this->m_iTail; idx++) {
+            entries.emplace_back(entryAt(idx)->hlc_r,entryAt(idx)->hlc_l,idx);
+          }
+          this->hidx.assign(entries);
+        }
+        this->hidx.append(hlc_index_entry{mhlc,this->m_iTail});
+      }
+    } catch (...) {
+      throw PERSIST_EXP_ALLOC(ENOMEM);
+    }
+    // a reader may still look at the slot of a trimmed entry it found
+    // before the trim, and retries when it sees the sequence has changed.
+    seqWriteBegin();
+    *ple = next;
+    this->m_bHlcOrdered = bHlcOrdered;
+    this->m_iTail ++;
+    this->m_iVer = ver;
+    seqWriteEnd();
+    dbg_trace("{0} append a log ver:{1} hlc:({2},{3})",this->m_sName,
+      ver, mhlc.m_rtc_us, mhlc.m_logic);
+  }
+
+  void MemPersistLog::advanceVersion(const int64_t & ver)
+    noexcept(false) {
+    std::lock_guard<std::mutex> lck(this->m_mutex);
+    if (this->m_iVer < ver) {
+      seqWriteBegin();
+      this->m_iVer = ver;
+      seqWriteEnd();
+    } else {
+      throw PERSIST_EXP_INV_VERSION;
+    }
+  }
+
+  const int64_t MemPersistLog::persist()
+    noexcept(false) {
+    // There is nothing to write, so the latest version is persisted as soon
+    // as it is appended. We only release the trimmed data here, like
+    // FilePersistLog does.
+    std::lock_guard<std::mutex> lck(this->m_mutex);
+    this->m_iPersistedVer.store(this->m_iVer);
+    if (this->m_iPins.load() == 0) {
+      // the last chunk is kept for the next entries.
+      while (this->m_dChunks.size() > 1 &&
+             this->m_dChunks.front().last < this->m_iHead) {
+        this->m_dChunks.pop_front();
+      }
+    }
+    return (this->m_iTail > this->m_iHead) ? this->m_iVer : INVALID_VERSION;
+  }
+
+  int64_t MemPersistLog::getLength ()
+  noexcept(false) {
+    return seqRead([this](){
+      return this->m_iTail - this->m_iHead;
+    });
+  }
+
+  int64_t MemPersistLog::getEarliestIndex ()
+  noexcept(false) {
+    return seqRead([this](){
+      return (this->m_iTail == this->m_iHead) ? INVALID_INDEX : this->m_iHead;
+    });
+  }
+
+  int64_t MemPersistLog::getLatestIndex ()
+  noexcept(false) {
+    return seqRead([this](){
+      return (this->m_iTail == this->m_iHead) ? (int64_t)-1 : this->m_iTail - 1;
+    });
+  }
+
+  int64_t MemPersistLog::getEarliestVersion ()
+  noexcept(false) {
+    return seqRead([this](){
+      return (this->m_iTail == this->m_iHead) ? INVALID_VERSION :
+        entryAt(this->m_iHead)->ver;
+    });
+  }
+
+  int64_t MemPersistLog::getLatestVersion ()
+  noexcept(false) {
+    return seqRead([this](){
+      return (this->m_iTail == this->m_iHead) ? INVALID_VERSION :
+        entryAt(this->m_iTail - 1)->ver;
+    });
+  }
+
+  const int64_t MemPersistLog::getLastPersisted ()
+  noexcept(false) {
+    return this->m_iPersistedVer.load();
+  }
+
+  const void * MemPersistLog::getEntryByIndex (const int64_t &eidx)
+    noexcept(false) {
+    bool valid = true;
+    const void * pdat = seqRead([&](){
+      const int64_t ridx = (eidx < 0) ? (this->m_iTail + eidx) : eidx;
+      valid = (ridx >= this->m_iHead && ridx < this->m_iTail);
+      return valid ? (const void *)entryAt(ridx)->pdata : nullptr;
+    });
+    if (!valid) {
+      throw PERSIST_EXP_INV_ENTRY_IDX(eidx);
+    }
+    return pdat;
+  }
+
+  void MemPersistLog::getEntryInfoByIndex (const int64_t &eidx,
+    int64_t &ver, HLC &hlc, uint64_t &size)
+    noexcept(false) {
+    const bool valid = seqRead([&](){
+      const int64_t ridx = (eidx < 0) ? (this->m_iTail + eidx) : eidx;
+      if (ridx < this->m_iHead || ridx >= this->m_iTail) {
+        return false;
+      }
+      const MemLogEntry * ple = entryAt(ridx);
+      ver = ple->ver;
+      hlc.m_rtc_us = ple->hlc_r;
+      hlc.m_logic = ple->hlc_l;
+      size = ple->dlen;
+      return true;
+    });
+    if (!valid) {
+      throw PERSIST_EXP_INV_ENTRY_IDX(eidx);
+    }
+  }
+
+  int64_t MemPersistLog::searchVersion(const int64_t & ver) const {
+    // the last entry no later than ver
+    int64_t l = this->m_iHead, r = this->m_iTail;
+    while (l < r) {
+      const int64_t m = l + (r - l)/2;
+      if (ver < entryAt(m)->ver) {
+        r = m;
+      } else {
+        l = m + 1;
+      }
+    }
+    return (l == this->m_iHead) ? -1 : l - 1;
+  }
+
+  int64_t MemPersistLog::searchOrderedHlc(const HLC & rhlc) const {
+    // the last entry no later than rhlc
+    int64_t l = this->m_iHead, r = this->m_iTail;
+    while (l < r) {
+      const int64_t m = l + (r - l)/2;
+      if (hlcLess(rhlc, entryAt(m))) {
+        r = m;
+      } else {
+        l = m + 1;
+      }
+    }
+    if (l == this->m_iHead) {
+      return -1;
+    }
+    // the first entry with the same hlc, as HlcIndex::search() returns
+    const MemLogEntry * found = entryAt(l - 1);
+    int64_t fl = this->m_iHead, fr = l - 1;
+    while (fl < fr) {
+      const int64_t m = fl + (fr - fl)/2;
+      if (hlcLess(entryAt(m), found)) {
+        fl = m + 1;
+      } else {
+        fr = m;
+      }
+    }
+    return fl;
+  }
+
+  int64_t MemPersistLog::getVersionIndex(const int64_t & ver)
+  noexcept(false) {
+    const int64_t idx = seqRead([&](){
+      return searchVersion(ver);
+    });
+    return (idx == -1) ? INVALID_INDEX : idx;
+  }
+
+  int64_t MemPersistLog::getHLCIndex(const HLC & rhlc)
+  noexcept(false) {
+    bool bOrdered = false;
+    int64_t idx = seqRead([&](){
+      bOrdered = this->m_bHlcOrdered;
+      return bOrdered ? searchOrderedHlc(rhlc) : (int64_t)-1;
+    });
+    if (!bOrdered) {
+      std::lock_guard<std::mutex> lck(this->m_mutex);
+      idx = this->hidx.search(rhlc);
+    }
+    return (idx == -1) ? INVALID_INDEX : idx;
+  }
+
+  bool MemPersistLog::isZeroCopy(const void * pdata)
+  noexcept(true) {
+    return true;
+  }
+
+  const void * MemPersistLog::getEntry(const int64_t& ver)
+  noexcept(false) {
+    return seqRead([&](){
+      const int64_t idx = searchVersion(ver);
+      return (idx == -1) ? nullptr : (const void *)entryAt(idx)->pdata;
+    });
+  }
+
+  const void * MemPersistLog::getEntry(const HLC &rhlc)
+  noexcept(false) {
+    bool bOrdered = false;
+    const void * pdat = seqRead([&](){
+      bOrdered = this->m_bHlcOrdered;
+      const int64_t idx = bOrdered ? searchOrderedHlc(rhlc) : -1;
+      return (idx == -1) ? nullptr : (const void *)entryAt(idx)->pdata;
+    });
+    if (!bOrdered) {
+      std::lock_guard<std::mutex> lck(this->m_mutex);
+      const int64_t idx = this->hidx.search(rhlc);
+      pdat = (idx == -1) ? nullptr : (const void *)entryAt(idx)->pdata;
+    }
+    return pdat;
+  }
+
+  template <typename RangeFunc, typename FilterFunc>
+  int64_t MemPersistLog::scan(const RangeFunc & range, const FilterFunc & filter,
+    const EntryVisitor & visitor) noexcept(false) {
+    std::vector<MemLogEntry> chunk(MEM_LOG_SCAN_ENTRIES);
+    int64_t start = 0, end = 0, nVisited = 0;
+    // the data of the entries stays while the log is pinned
+    pin();
+    try {
+      seqRead([&](){
+        range(start,end);
+        return 0;
+      });
+      for (int64_t idx = start; idx < end; idx += MEM_LOG_SCAN_ENTRIES) {
+        const int64_t n = std::min(end - idx, (int64_t)MEM_LOG_SCAN_ENTRIES);
+        // the slot of an entry is reused once the log wraps around
+        const bool bValid = seqRead([&](){
+          if (this->m_iTail >= idx + MEM_LOG_MAX_ENTRY) {
+            return false;
+          }
+          for (int64_t i = 0; i < n; i++) {
+            chunk[i] = *entryAt(idx + i);
+          }
+          return true;
+        });
+        if (!bValid) {
+          throw PERSIST_EXP_INV_ENTRY_IDX(idx);
+        }
+        for (int64_t i = 0; i < n; i++) {
+          const MemLogEntry & e = chunk[i];
+          if (!filter(e)) {
+            continue;
+          }
+          nVisited ++;
+          if (!visitor(idx + i,e.ver,HLC(e.hlc_r,e.hlc_l),e.pdata,e.dlen)) {
+            unpin();
+            return nVisited;
+          }
+        }
+      }
+    } catch (...) {
+      unpin();
+      throw;
+    }
+    unpin();
+    return nVisited;
+  }
+
+  int64_t MemPersistLog::scanVersions(const int64_t & from, const int64_t & to,
+    const EntryVisitor & visitor) noexcept(false) {
+    return scan([&](int64_t & start, int64_t & end){
+        // the first entry not earlier than from
+        start = searchVersion(from);
+        if (start == -1) {
+          start = this->m_iHead;
+        } else if (entryAt(start)->ver < from) {
+          start ++;
+        }
+        end = searchVersion(to);
+        end = (end == -1) ? start : end + 1;
+      },
+      [](const MemLogEntry &){ return true; },
+      visitor);
+  }
+
+  int64_t MemPersistLog::scanHLCs(const HLC & from, const HLC & to,
+    const EntryVisitor & visitor) noexcept(false) {
+    return scan([&](int64_t & start, int64_t & end){
+        // an unordered log is filtered as a whole
+        start = this->m_iHead;
+        end = this->m_iTail;
+        if (!this->m_bHlcOrdered) {
+          return;
+        }
+        // the first entry not earlier than from
+        for (int64_t r = end; start < r;) {
+          const int64_t m = start + (r - start)/2;
+          if (hlcLess(entryAt(m),from)) {
+            start = m + 1;
+          } else {
+            r = m;
+          }
+        }
+        // the first entry later than to
+        for (int64_t l = start; l < end;) {
+          const int64_t m = l + (end - l)/2;
+          if (hlcLess(to,entryAt(m))) {
+            end = m;
+          } else {
+            l = m + 1;
+          }
+        }
+      },
+      [&](const MemLogEntry & e){
+        return !hlcLess(&e,from) && !hlcLess(to,&e);
+      },
+      visitor);
+  }
+
+  void MemPersistLog::dropEntriesUpTo(const int64_t & idx) {
+    this->hidx.trimUpTo(idx);
+    this->m_iHead = idx + 1;
+  }
+
+  void MemPersistLog::trimByIndex(const int64_t &idx) noexcept(false) {
+    dbg_trace("{0} trim at index: {1}",this->m_sName,idx);
+    std::lock_guard<std::mutex> lck(this->m_mutex);
+    if (idx < this->m_iHead || idx >= this->m_iTail) {
+      return;
+    }
+    seqWriteBegin();
+    dropEntriesUpTo(idx);
+    seqWriteEnd();
+  }
+
+  void MemPersistLog::trim(const int64_t &ver) noexcept(false) {
+    dbg_trace("{0} trim at version: {1}",this->m_sName,ver);
+    std::lock_guard<std::mutex> lck(this->m_mutex);
+    const int64_t idx = searchVersion(ver);
+    if (idx != -1) {
+      seqWriteBegin();
+      dropEntriesUpTo(idx);
+      seqWriteEnd();
+    }
+  }
+
+  void MemPersistLog::trim(const HLC & hlc) noexcept(false) {
+    dbg_trace("{0} trim at time: {1}.{2}",this->m_sName,hlc.m_rtc_us,hlc.m_logic);
+    // see FilePersistLog::trim(const HLC &)
+    std::lock_guard<std::mutex> lck(this->m_mutex);
+    int64_t idx = this->m_iHead;
+    while (idx < this->m_iTail && !hlcLess(hlc,entryAt(idx))) {
+      idx ++;
+    }
+    if (idx > this->m_iHead) {
+      seqWriteBegin();
+      dropEntriesUpTo(idx - 1);
+      seqWriteEnd();
+    }
+  }
+
+  void MemPersistLog::pin() noexcept(true) {
+    this->m_iPins.fetch_add(1);
+  }
+
+  void MemPersistLog::unpin() noexcept(true) {
+    this->m_iPins.fetch_sub(1);
+  }
+}
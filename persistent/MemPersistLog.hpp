@@ -0,0 +1,164 @@
+#ifndef MEM_PERSIST_LOG_HPP
+#define MEM_PERSIST_LOG_HPP
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "PersistLog.hpp"
+
+namespace ns_persistent {
+
+  // The entries are kept in blocks, allocated when the log first grows into
+  // them and reused like a ring buffer afterwards. We allow 1M(2^20-1) log
+  // entries, like FilePersistLog.
+  #define MEM_LOG_BLOCK_ENTRIES ((int64_t)(1L<<12))
+  #define MEM_LOG_BLOCKS        ((int64_t)(1L<<8))
+  #define MEM_LOG_MAX_ENTRY     (MEM_LOG_BLOCK_ENTRIES*MEM_LOG_BLOCKS)
+  // The data is copied into chunks of this size, or of the size of an entry
+  // that does not fit in one.
+  #define MEM_LOG_CHUNK_SIZE    ((uint64_t)(1UL<<20))
+  // scans copy this many entries at a time
+  #define MEM_LOG_SCAN_ENTRIES  (256)
+
+  // log entry format
+  typedef struct mem_log_entry {
+    int64_t ver;          // version of the data
+    uint64_t dlen;        // length of the data
+    const char * pdata;   // the data
+    uint64_t hlc_r;       // realtime component of hlc
+    uint64_t hlc_l;       // logic component of hlc
+  } MemLogEntry;
+
+  // MemPersistLog is the log of volatile objects. It lives in the memory of
+  // the process only: append() copies the data into a chunk, persist() just
+  // records the latest version, and neither makes a system call unless a
+  // new chunk or block is needed. Readers search the entries without a lock
+  // like in FilePersistLog. Trimmed chunks are freed by persist() when the
+  // log is not pinned.
+  class MemPersistLog : public PersistLog {
+  protected:
+    // a piece of memory the data is copied into
+    struct Chunk {
+      std::unique_ptr<char[]> buf;
+      uint64_t size;
+      uint64_t used;
+      // the index of the last entry with data in this chunk
+      int64_t last;
+    };
+    // the entry blocks, indexed by (entry index / MEM_LOG_BLOCK_ENTRIES) %
+    // MEM_LOG_BLOCKS. A block is never freed while the log is alive.
+    std::atomic<MemLogEntry *> m_pBlocks[MEM_LOG_BLOCKS];
+    // the entries in the log are [m_iHead, m_iTail)
+    int64_t m_iHead;
+    int64_t m_iTail;
+    // the latest version
+    int64_t m_iVer;
+    // the latest version when persist() was called
+    std::atomic<int64_t> m_iPersistedVer;
+    // the chunks with live data, oldest first. Protected by m_mutex.
+    std::deque<Chunk> m_dChunks;
+    // the number of pins on the data, see pin().
+    std::atomic<uint64_t> m_iPins;
+    // true if the hlcs of the entries never decrease with the index, see
+    // FilePersistLog::m_bHlcOrdered.
+    bool m_bHlcOrdered;
+    // sequence number of the log state, odd while a writer is updating it.
+    std::atomic<uint64_t> m_iSeq;
+    // the lock of the writers and the hlc index.
+    std::mutex m_mutex;
+
+    // A writer holding m_mutex brackets its updates of the log state with
+    // these. Nothing in between may throw.
+    void seqWriteBegin() {
+      this->m_iSeq.store(this->m_iSeq.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    void seqWriteEnd() {
+      this->m_iSeq.store(this->m_iSeq.load(std::memory_order_relaxed) + 1,
+        std::memory_order_release);
+    }
+
+    // Run a read-only function on a consistent snapshot of the log without
+    // taking a lock, see FilePersistLog::seqRead().
+    template <typename ReadFunc>
+    auto seqRead(const ReadFunc & readFunc) -> decltype(readFunc()) {
+      while (true) {
+        const uint64_t seq = this->m_iSeq.load(std::memory_order_acquire);
+        if (seq & 1) {
+          continue;
+        }
+        auto ret = readFunc();
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (this->m_iSeq.load(std::memory_order_relaxed) == seq) {
+          return ret;
+        }
+      }
+    }
+
+    // the entry at an index, whose block must exist.
+    MemLogEntry * entryAt(const int64_t & idx) const {
+      return this->m_pBlocks[(idx / MEM_LOG_BLOCK_ENTRIES) % MEM_LOG_BLOCKS].load(
+        std::memory_order_acquire) + idx % MEM_LOG_BLOCK_ENTRIES;
+    }
+
+    // search the log for the latest entry no later than a version or an
+    // hlc, returning its index or -1. They need a consistent snapshot, and
+    // searchOrderedHlc() needs m_bHlcOrdered.
+    int64_t searchVersion(const int64_t & ver) const;
+    int64_t searchOrderedHlc(const HLC & hlc) const;
+
+    // trim the entries up to and including idx. m_mutex is required.
+    void dropEntriesUpTo(const int64_t & idx);
+
+    // copy data into a chunk for the entry at idx. m_mutex is required.
+    const char * copyData(const void * pdata, const uint64_t & size,
+      const int64_t & idx) noexcept(false);
+
+    // visit the entries in an index range that pass a filter, see
+    // FilePersistLog::scan().
+    template <typename RangeFunc, typename FilterFunc>
+    int64_t scan(const RangeFunc & range, const FilterFunc & filter,
+      const EntryVisitor & visitor) noexcept(false);
+
+  public:
+    //Constructor
+    MemPersistLog(const string &name) noexcept(false);
+    //Destructor
+    virtual ~MemPersistLog() noexcept(true);
+
+    //Derived from PersistLog
+    virtual void append(const void * pdata,
+      const uint64_t & size, const int64_t & ver,
+      const HLC &mhlc) noexcept(false);
+    virtual void advanceVersion(const int64_t & ver) noexcept(false);
+    virtual int64_t getLength() noexcept(false);
+    virtual int64_t getEarliestIndex() noexcept(false);
+    virtual int64_t getLatestIndex() noexcept(false);
+    virtual int64_t getEarliestVersion() noexcept(false);
+    virtual int64_t getLatestVersion() noexcept(false);
+    virtual const int64_t getLastPersisted() noexcept(false);
+    virtual int64_t getVersionIndex(const int64_t & ver) noexcept(false);
+    virtual int64_t getHLCIndex(const HLC & hlc) noexcept(false);
+    virtual bool isZeroCopy(const void * pdata) noexcept(true);
+    virtual const void* getEntryByIndex(const int64_t &eno) noexcept(false);
+    virtual void getEntryInfoByIndex(const int64_t &eno, int64_t &ver,
+      HLC &hlc, uint64_t &size) noexcept(false);
+    virtual const void* getEntry(const int64_t & ver) noexcept(false);
+    virtual const void* getEntry(const HLC &hlc) noexcept(false);
+    virtual int64_t scanVersions(const int64_t & from, const int64_t & to,
+      const EntryVisitor & visitor) noexcept(false);
+    virtual int64_t scanHLCs(const HLC & from, const HLC & to,
+      const EntryVisitor & visitor) noexcept(false);
+    virtual const int64_t persist() noexcept(false);
+    virtual void trimByIndex(const int64_t &eno) noexcept(false);
+    virtual void trim(const int64_t &ver) noexcept(false);
+    virtual void trim(const HLC & hlc) noexcept(false);
+    virtual void pin() noexcept(true);
+    virtual void unpin() noexcept(true);
+  };
+}
+
+#endif//MEM_PERSIST_LOG_HPP
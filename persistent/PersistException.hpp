@@ -42,6 +42,14 @@ namespace ns_persistent{
   #define PERSIST_EXP_NOSPACE_LOG                       PERSIST_EXP_NOSPACE(1)
   #define PERSIST_EXP_NOSPACE_DATA                      PERSIST_EXP_NOSPACE(2)
   #define PERSIST_EXP_BEYOND_GSF                        PERSIST_EXP(31,0)
+  #define PERSIST_EXP_INV_SEGMENT_SIZE(x)               PERSIST_EXP(32,(x))
+  #define PERSIST_EXP_REMOVE_FILE(x)                    PERSIST_EXP(33,(x))
+  #define PERSIST_EXP_INV_NAME                          PERSIST_EXP(34,0)
+  #define PERSIST_EXP_INV_CODEC(x)                      PERSIST_EXP(35,(x))
+  #define PERSIST_EXP_DECOMPRESS(x)                     PERSIST_EXP(36,(x))
+  #define PERSIST_EXP_INV_ERASURE_CODE(x)               PERSIST_EXP(37,(x))
+  #define PERSIST_EXP_RECONSTRUCT(x)                    PERSIST_EXP(38,(x))
+  #define PERSIST_EXP_KEY_INDEX_GAP                     PERSIST_EXP(39,0)
 }
 
 #endif//PERSISTENT_EXCEPTION_HPP
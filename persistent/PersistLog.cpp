@@ -1,8 +1,109 @@
+#include <algorithm>
+#include <limits>
+#include <unistd.h>
 #include "PersistLog.hpp"
+#include "FilePersistLog.hpp"
 #include "util.hpp"
 
 namespace ns_persistent {
 
+  bool HlcIndex::contains(const Entry & e) const {
+    auto sorted = std::lower_bound(m_vSorted.begin() + m_iFirst, m_vSorted.end(), e, entryLess);
+    if (sorted != m_vSorted.end() && !entryLess(e, *sorted)) {
+      return true;
+    }
+    auto side = std::lower_bound(m_vSide.begin(), m_vSide.end(), e, entryLess);
+    return side != m_vSide.end() && !entryLess(e, *side);
+  }
+
+  void HlcIndex::mergeSide() {
+    std::vector<Entry> merged;
+    merged.reserve(m_vSorted.size() - m_iFirst + m_vSide.size());
+    std::merge(m_vSorted.begin() + m_iFirst, m_vSorted.end(),
+      m_vSide.begin(), m_vSide.end(), std::back_inserter(merged), entryLess);
+    m_vSorted.swap(merged);
+    m_iFirst = 0;
+    m_vSide.clear();
+    m_bLogOrdered = false;
+  }
+
+  void HlcIndex::append(const hlc_index_entry & entry) {
+    const Entry e{entry.hlc.m_rtc_us,entry.hlc.m_logic,entry.log_idx};
+    if (m_vSorted.size() == m_iFirst || entryLess(m_vSorted.back(), e)) {
+      auto side = std::lower_bound(m_vSide.begin(), m_vSide.end(), e, entryLess);
+      if (side == m_vSide.end() || entryLess(e, *side)) {
+        m_vSorted.push_back(e);
+      }
+      return;
+    }
+    if (contains(e)) {
+      return;
+    }
+    m_vSide.insert(std::upper_bound(m_vSide.begin(), m_vSide.end(), e, entryLess), e);
+    if (m_vSide.size() > MAX_SIDE_ENTRIES) {
+      mergeSide();
+    }
+  }
+
+  void HlcIndex::assign(const std::vector<hlc_index_entry> & entries) {
+    clear();
+    m_vSorted.reserve(entries.size());
+    for (const auto & entry : entries) {
+      m_vSorted.push_back(Entry{entry.hlc.m_rtc_us,entry.hlc.m_logic,entry.log_idx});
+    }
+    // keep the first entry of each hlc
+    std::stable_sort(m_vSorted.begin(), m_vSorted.end(), entryLess);
+    m_vSorted.erase(std::unique(m_vSorted.begin(), m_vSorted.end(),
+      [](const Entry & e1, const Entry & e2) {
+        return !entryLess(e1, e2) && !entryLess(e2, e1);
+      }), m_vSorted.end());
+    m_bLogOrdered = std::is_sorted(m_vSorted.begin(), m_vSorted.end(),
+      [](const Entry & e1, const Entry & e2) {
+        return e1.log_idx < e2.log_idx;
+      });
+  }
+
+  void HlcIndex::trimUpTo(const int64_t & idx) {
+    auto trimmed = [&idx](const Entry & e) {
+      return e.log_idx <= idx;
+    };
+    if (m_bLogOrdered) {
+      while (m_iFirst < m_vSorted.size() && m_vSorted[m_iFirst].log_idx <= idx) {
+        m_iFirst ++;
+      }
+      // release the space of the trimmed entries once they are the majority
+      if (m_iFirst > m_vSorted.size()/2) {
+        m_vSorted.erase(m_vSorted.begin(), m_vSorted.begin() + m_iFirst);
+        m_iFirst = 0;
+      }
+    } else {
+      m_vSorted.erase(std::remove_if(m_vSorted.begin() + m_iFirst, m_vSorted.end(), trimmed),
+        m_vSorted.end());
+    }
+    m_vSide.erase(std::remove_if(m_vSide.begin(), m_vSide.end(), trimmed), m_vSide.end());
+  }
+
+  int64_t HlcIndex::search(const HLC & hlc) const {
+    const Entry key{hlc.m_rtc_us,hlc.m_logic,0};
+    const Entry * found = nullptr;
+    auto sorted = std::upper_bound(m_vSorted.begin() + m_iFirst, m_vSorted.end(), key, entryLess);
+    if (sorted != m_vSorted.begin() + m_iFirst) {
+      found = &*(sorted - 1);
+    }
+    auto side = std::upper_bound(m_vSide.begin(), m_vSide.end(), key, entryLess);
+    if (side != m_vSide.begin() && (found == nullptr || entryLess(*found, *(side - 1)))) {
+      found = &*(side - 1);
+    }
+    return (found == nullptr) ? -1 : found->log_idx;
+  }
+
+  void HlcIndex::clear() {
+    m_vSorted.clear();
+    m_iFirst = 0;
+    m_vSide.clear();
+    m_bLogOrdered = true;
+  }
+
   PersistLog::PersistLog(const string &name)
   noexcept(true): m_sName(name) {
   }
@@ -10,12 +111,30 @@ namespace ns_persistent {
   PersistLog::~PersistLog() noexcept(true){
   }
 
+  int64_t PersistLog::checkpoint(const string & targetPath, const int64_t & ver) noexcept(false) {
+    checkOrCreateDir(targetPath);
+    if (access((targetPath + "/" + this->m_sName + "." + META_FILE_SUFFIX).c_str(),F_OK) == 0) {
+      throw PERSIST_EXP_INV_PATH;
+    }
+    FilePersistLog copy(this->m_sName,targetPath);
+    int64_t latest = INVALID_VERSION;
+    scanVersions(std::numeric_limits<int64_t>::min(),ver,
+      [&copy,&latest](const int64_t &, const int64_t & ever, const HLC & ehlc,
+        const void * pdata, const uint64_t & size) {
+        copy.append(pdata,size,ever,ehlc);
+        latest = ever;
+        return true;
+      });
+    copy.persist();
+    return latest;
+  }
+
 #ifdef _DEBUG
   void PersistLog::dump_hidx() {
     dbg_trace("number of entry in hidx:{}.log_len={}.",hidx.size(),getLength());
-    for(auto itr=hidx.cbegin();itr!=hidx.cend();itr++) {
-      dbg_trace("hlc({0},{1})->idx({2})",itr->hlc.m_rtc_us,itr->hlc.m_logic,itr->log_idx);
-    }
+    hidx.forEach([](const hlc_index_entry & ent) {
+      dbg_trace("hlc({0},{1})->idx({2})",ent.hlc.m_rtc_us,ent.hlc.m_logic,ent.log_idx);
+    });
   }
 #endif//_DEBUG
 }
@@ -7,9 +7,10 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <functional>
 #include <map>
-#include <set>
 #include <string>
+#include <vector>
 #include "PersistException.hpp"
 #include "HLC.hpp"
 
@@ -21,7 +22,9 @@ namespace ns_persistent {
   enum StorageType{
     ST_FILE=0,
     ST_MEM,
-    ST_3DXP
+    ST_3DXP,
+    ST_TIERED,
+    ST_PMEM = ST_3DXP
   };
 
   //#define INVALID_VERSION ((__int128)-1L)
@@ -56,13 +59,79 @@ namespace ns_persistent {
     }
   };
 
+  // The hlc index of a log: for each hlc, the first entry appended with it.
+  // The hlcs of a log are nearly always in log order, so the index is a
+  // sorted array that appends in order go to the end of, plus a small sorted
+  // side array for the out-of-order ones, merged into the main array when it
+  // fills up. Entries are trimmed from the front of the log, which is the
+  // front of the main array unless out-of-order entries have been merged.
+  class HlcIndex {
+    // the compact form of an hlc_index_entry
+    struct Entry {
+      uint64_t hlc_r;
+      uint64_t hlc_l;
+      int64_t log_idx;
+    };
+    static bool entryLess(const Entry & e1, const Entry & e2) {
+      return (e1.hlc_r < e2.hlc_r) || (e1.hlc_r == e2.hlc_r && e1.hlc_l < e2.hlc_l);
+    }
+    // the main array; entries before m_iFirst are trimmed.
+    std::vector<Entry> m_vSorted;
+    size_t m_iFirst;
+    // the out-of-order entries
+    std::vector<Entry> m_vSide;
+    // true if the main array is in log order too
+    bool m_bLogOrdered;
+    // the largest side array
+    static constexpr size_t MAX_SIDE_ENTRIES = 256;
+
+    // whether the hlc of e is in the index
+    bool contains(const Entry & e) const;
+    // merge the side array into the main array
+    void mergeSide();
+  public:
+    HlcIndex():m_iFirst(0),m_bLogOrdered(true) {}
+    // add an entry, appended to the log after all the others in the index.
+    // It is ignored if its hlc is already in the index.
+    void append(const hlc_index_entry & entry);
+    // replace the index with these entries, in log order
+    void assign(const std::vector<hlc_index_entry> & entries);
+    // drop the entries up to and including log index idx
+    void trimUpTo(const int64_t & idx);
+    // the log index of the entry with the latest hlc no later than hlc, or -1
+    int64_t search(const HLC & hlc) const;
+    void clear();
+    size_t size() const {
+      return m_vSorted.size() - m_iFirst + m_vSide.size();
+    }
+    bool empty() const {
+      return size() == 0;
+    }
+    // call f on each entry, in no particular order
+    template <typename Func>
+    void forEach(const Func & f) const {
+      for (size_t i = m_iFirst; i < m_vSorted.size(); i++) {
+        f(hlc_index_entry{m_vSorted[i].hlc_r,m_vSorted[i].hlc_l,m_vSorted[i].log_idx});
+      }
+      for (const Entry & e : m_vSide) {
+        f(hlc_index_entry{e.hlc_r,e.hlc_l,e.log_idx});
+      }
+    }
+  };
+
+  // called on each entry of a scan with its index, version, hlc, data and
+  // data size. The data is valid until the scan returns. Returns false to
+  // stop the scan.
+  typedef std::function<bool(const int64_t & idx, const int64_t & ver,
+    const HLC & hlc, const void * pdata, const uint64_t & size)> EntryVisitor;
+
   // Persistent log interfaces
   class PersistLog{
   public:
     // LogName
     const string m_sName;
     // HLCIndex
-    std::set<hlc_index_entry,hlc_index_entry_comp> hidx;
+    HlcIndex hidx;
 #ifdef _DEBUG
     void dump_hidx();
 #endif//_DEBUG
@@ -113,9 +182,26 @@ namespace ns_persistent {
     // virtual const __int128 getLastPersisted() noexcept(false) = 0;
     virtual const int64_t getLastPersisted() noexcept(false) = 0;
 
+    // Get the index of the latest version equal or earlier than ver,
+    // or INVALID_INDEX if there is no such version.
+    virtual int64_t getVersionIndex(const int64_t & ver) noexcept(false) = 0;
+
+    // Get the index of the latest version equal or earlier than hlc,
+    // or INVALID_INDEX if there is no such version.
+    virtual int64_t getHLCIndex(const HLC & hlc) noexcept(false) = 0;
+
+    // Check if the data returned by one of the getters is the data in the
+    // log. If not, it is a copy, e.g. of a compressed entry, which is only
+    // valid until the calling thread gets the next such entry.
+    virtual bool isZeroCopy(const void * pdata) noexcept(true) = 0;
+
     // Get a version by entry number
     virtual const void* getEntryByIndex(const int64_t & eno) noexcept(false) = 0;
 
+    // Get the version, hlc and data length of an entry by entry number
+    virtual void getEntryInfoByIndex(const int64_t & eno, int64_t & ver,
+      HLC & hlc, uint64_t & size) noexcept(false) = 0;
+
     // Get the latest version equal or earlier than ver.
     //virtual const void* getEntry(const __int128 & ver) noexcept(false) = 0;
     virtual const void* getEntry(const int64_t & ver) noexcept(false) = 0;
@@ -125,6 +211,18 @@ namespace ns_persistent {
     // Get a version specified by hlc
     virtual const void* getEntry(const HLC & hlc) noexcept(false) = 0;
 
+    // Visit the entries with versions in [from,to], in log order, on one
+    // snapshot of the log: entries appended during the scan are not visited,
+    // and entries trimmed during the scan still are.
+    // Returns the number of entries visited.
+    virtual int64_t scanVersions(const int64_t & from, const int64_t & to,
+      const EntryVisitor & visitor) noexcept(false) = 0;
+
+    // Visit the entries with hlcs in [from,to], in log order, like
+    // scanVersions().
+    virtual int64_t scanHLCs(const HLC & from, const HLC & to,
+      const EntryVisitor & visitor) noexcept(false) = 0;
+
     /**
      * Persist the log till specified version
      * @return - the version till which has been persisted.
@@ -152,6 +250,29 @@ namespace ns_persistent {
      * @param hlc - all log entry before hlc will be trimmed.
      */
     virtual void trim(const HLC & hlc) noexcept(false) = 0;
+
+    /**
+     * Pin the data in the log. While the log is pinned, the memory returned
+     * by getEntry*() stays valid even if the entries are trimmed and the
+     * trim is persisted. Every pin() must be matched by an unpin().
+     */
+    virtual void pin() noexcept(true) = 0;
+
+    /**
+     * Unpin the data in the log.
+     */
+    virtual void unpin() noexcept(true) = 0;
+
+    /**
+     * Copy the log up to version ver, inclusively, to a log of the same name
+     * in targetPath, which a FilePersistLog opened there loads as if nothing
+     * after ver had been appended. The log keeps taking appends and being
+     * persisted while it is copied. This version appends the entries to the
+     * copy one by one; a log that keeps its entries in files can do better.
+     * @param targetPath - a directory with no log of this name in it
+     * @return - the latest version in the copy, or INVALID_VERSION if it is empty.
+     */
+    virtual int64_t checkpoint(const string & targetPath, const int64_t & ver) noexcept(false);
   };
 }
 
@@ -4,17 +4,30 @@
 
 #include <sys/types.h>
 #include <inttypes.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <string>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <functional>
+#include <future>
 #include <pthread.h>
 #include <map>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+#include <string.h>
+#include <thread>
 #include <time.h>
 #include "HLC.hpp"
 #include "PersistException.hpp"
 #include "PersistLog.hpp"
 #include "FilePersistLog.hpp"
+#include "KeyIndex.hpp"
+#include "MemPersistLog.hpp"
 #include "SerializationSupport.hpp"
 
 #if defined(_PERFORMANCE_DEBUG) || defined(_DEBUG)
@@ -50,6 +63,112 @@ namespace ns_persistent {
   class ITemporalQueryFrontierProvider {
   public:
     virtual const HLC getFrontier() = 0;
+    // the latest version that every replica has persisted. Retention never
+    // trims past it, since the versions after it may be needed for recovery
+    // or to bring a replica up to date. Without replicas, it is unlimited.
+    virtual int64_t getPersistenceFrontier() {
+      return INT64_MAX;
+    }
+  };
+
+  // A retention policy says which versions a Persistent<T> keeps; the older
+  // ones are trimmed in the background, see Persistent<T>::setRetention().
+  // A version is kept if any of the limits keeps it, and 0 means no limit.
+  // The latest version is always kept, and so is every version that is not
+  // yet persisted locally and by the other replicas.
+  struct RetentionPolicy {
+    // keep the last max_versions versions
+    uint64_t max_versions = 0;
+    // keep the versions whose hlc is at most max_age_us microseconds old
+    uint64_t max_age_us = 0;
+    // keep the latest versions that add up to at most max_bytes
+    uint64_t max_bytes = 0;
+    bool empty() const {
+      return max_versions == 0 && max_age_us == 0 && max_bytes == 0;
+    }
+  };
+  // how often the retention thread of a PersistentRegistry trims, by default
+  #define DEFAULT_RETENTION_PERIOD_MS (1000)
+
+  // IDeltaSupport is implemented by types that can tell what changed since
+  // the last version. Persistent<T> of such a type logs only the delta for a
+  // new version, plus a full checkpoint every so often, and rebuilds a version
+  // by applying the deltas after the nearest checkpoint.
+  template <typename DeltaObjectType>
+  class IDeltaSupport {
+  public:
+    virtual ~IDeltaSupport() {}
+    // the size of the changes since the last version
+    virtual std::size_t currentDeltaSize() = 0;
+    // serialize the changes since the last version to buf, then start
+    // tracking the changes for the next version.
+    virtual std::size_t currentDeltaToBytes(char * const buf, std::size_t buf_size) = 0;
+    // apply a delta serialized by currentDeltaToBytes()
+    virtual void applyDelta(char const * const delta) = 0;
+    // called with the version the current changes are about to be logged
+    // as, before currentDeltaToBytes(), for types that keep the versions of
+    // their parts; such a type also carries the version in its delta.
+    virtual void setDeltaVersion(const int64_t & ver) {}
+  };
+
+  // IKeyIndexSupport is implemented by key-value types, whose versions each
+  // change some of their keys. Persistent<T> of such a type keeps a KeyIndex
+  // of its log, so that the value of a key at a past version or time is
+  // read from the one entry that last changed it, see getKeyIndex().
+  template <typename KeyedObjectType>
+  class IKeyIndexSupport {
+  public:
+    virtual ~IKeyIndexSupport() {}
+    // append the hashes of the keys that changed since the last version. It
+    // is called before the version is logged, before currentDeltaToBytes()
+    // for a delta-enabled type.
+    virtual void currentKeyHashes(std::vector<uint64_t> & hashes) = 0;
+  };
+
+  // A log entry of a delta-enabled type starts with one of the two tags.
+  #define DELTA_ENTRY_FULL                  ((uint64_t)0)
+  #define DELTA_ENTRY_DELTA                 ((uint64_t)1)
+  #define DELTA_ENTRY_HEADER_SIZE           (sizeof(uint64_t))
+  // the number of deltas between two full checkpoints, by default
+  #define DEFAULT_DELTA_CHECKPOINT_INTERVAL (64)
+  // the number of reconstructed versions to cache
+  #define DELTA_CACHE_SIZE                  (8)
+
+  // A serialized Persistent<T> is its name, then one of these tags, then
+  // either its value or the version of its latest log entry.
+  #define PERSISTENT_SERIALIZED_VALUE       ((char)0)
+  #define PERSISTENT_SERIALIZED_REFERENCE   ((char)1)
+  // Each field in a catch-up built by PersistentRegistry::getCatchUp() is
+  // either the entries of its log the receiver is missing, or its value.
+  #define CATCH_UP_LOG_TAIL                 ((char)0)
+  #define CATCH_UP_VALUE                    ((char)1)
+
+  // ILogCatchUpSupport is how a PersistentRegistry brings a Persistent<T> on
+  // another node up to date with this one. If the other node's log is a
+  // prefix of this one, it only gets the entries it is missing; otherwise it
+  // gets the whole value.
+  class ILogCatchUpSupport {
+  public:
+    virtual ~ILogCatchUpSupport() {}
+    // get the version and hlc of the latest log entry, or return false if
+    // the log is empty.
+    virtual bool getLatestEntry(int64_t & ver, HLC & hlc) noexcept(false) = 0;
+    // append the entries after version ver up to version upto to buf, if the
+    // log has an entry at ver with the given hlc for them to follow on from.
+    // otherwise leave buf alone and return false. ver is INVALID_VERSION for
+    // an empty log, which can follow on from the start of a log that has
+    // never been trimmed.
+    virtual bool logTailToBytes(const int64_t & ver, const HLC & hlc,
+      const int64_t & upto, std::vector<char> & buf) noexcept(false) = 0;
+    // append the serialized value at version ver to buf.
+    virtual void versionToBytes(const int64_t & ver, std::vector<char> & buf) noexcept(false) = 0;
+    // append the entries written by logTailToBytes() to the log, and
+    // persist them.
+    virtual void applyLogTail(char const * tail, std::size_t size) noexcept(false) = 0;
+    // copy the log up to its latest entry no later than hlc to a log of the
+    // same name in targetPath, see PersistLog::checkpoint(), and return the
+    // latest version copied.
+    virtual int64_t checkpointLog(const std::string & targetPath, const HLC & hlc) noexcept(false) = 0;
   };
 
   // function types to be registered for create version
@@ -57,6 +176,9 @@ namespace ns_persistent {
   using VersionFunc = std::function<void(const int64_t &,const HLC &)>;
   using PersistFunc = std::function<const int64_t(void)>;
   using TrimFunc = std::function<void(const int64_t &)>;
+  // applies the retention policy of a Persistent<T>, given the persistence
+  // frontier
+  using RetentionFunc = std::function<void(const int64_t &)>;
   // this function is obsolete, now we use a shared pointer to persistence registry
   // using PersistentCallbackRegisterFunc = std::function<void(const char*,VersionFunc,PersistFunc,TrimFunc)>;
 
@@ -75,6 +197,8 @@ namespace ns_persistent {
     };
     virtual ~PersistentRegistry() {
       dbg_warn("PersistentRegistry@{} has been deallocated!",(void*)this);
+      stopPersistWorkers();
+      stopRetention();
       this->_registry.clear();
     };
     #define VERSION_FUNC_IDX (0)
@@ -86,14 +210,37 @@ namespace ns_persistent {
     };
     // persist data
     const int64_t persist() noexcept(false) {
-      return callFuncMin<PERSIST_FUNC_IDX,int64_t>();
+      if (this->_persistWorkers.empty() || this->_registry.size() < 2) {
+        return callFuncMin<PERSIST_FUNC_IDX,int64_t>();
+      }
+      return parallelPersist();
     };
+    // persist the registered Persistent<T>s concurrently on num_threads
+    // workers and the calling thread, so that their flushes overlap instead
+    // of waiting for each other. 0, the default, persists them one after
+    // another. It must not be called while persist() is running.
+    void setParallelPersist(const uint32_t & num_threads) {
+      stopPersistWorkers();
+      for (uint32_t i = 0; i < num_threads; i++) {
+        this->_persistWorkers.emplace_back([this](){
+          std::unique_lock<std::mutex> lck(this->_persistMutex);
+          while (!this->_persistStop) {
+            runPersistFuncs(lck);
+            this->_persistCond.wait(lck);
+          }
+        });
+      }
+    }
     // trim the log
     void trim(const int64_t & ver) noexcept(false) {
       callFunc<TRIM_FUNC_IDX>(ver);
     };
     // register a Persistent<T> along with its lambda
-    void registerPersist(const char* obj_name, const VersionFunc &vf,const PersistFunc &pf,const TrimFunc &tf) noexcept(false) {
+    void registerPersist(const char* obj_name, const VersionFunc &vf,const PersistFunc &pf,const TrimFunc &tf,
+      ILogCatchUpSupport * cus = nullptr) noexcept(false) {
+      if (cus != nullptr) {
+        this->_catchUpSupport[obj_name] = cus;
+      }
       //this->_registry.push_back(std::make_tuple(vf,pf,tf));
       auto tuple_val = std::make_tuple(vf,pf,tf);
       std::size_t key = std::hash<std::string>{}(obj_name);
@@ -104,6 +251,35 @@ namespace ns_persistent {
         this->_registry.insert(std::pair<std::size_t,std::tuple<VersionFunc,PersistFunc,TrimFunc>>(key,tuple_val));
       }
     };
+    // register the retention function of a Persistent<T>, which the
+    // retention thread calls every retention period, see setRetentionPeriod().
+    // The thread is started with the first one.
+    void registerRetention(const char* obj_name, const RetentionFunc & rf) noexcept(false) {
+      std::lock_guard<std::mutex> lck(this->_retentionMutex);
+      this->_retention[std::hash<std::string>{}(obj_name)] = rf;
+      if (!this->_retentionThread.joinable()) {
+        this->_retentionThread = std::thread([this](){
+          retentionLoop();
+        });
+      }
+    }
+    // stop calling the retention function of a Persistent<T>. If the
+    // retention thread is calling it, this waits until it returns.
+    void unregisterRetention(const char* obj_name) noexcept(true) {
+      std::lock_guard<std::mutex> lck(this->_retentionMutex);
+      this->_retention.erase(std::hash<std::string>{}(obj_name));
+    }
+    // set how often the retention thread trims.
+    void setRetentionPeriod(const uint64_t & period_ms) noexcept(true) {
+      std::lock_guard<std::mutex> lck(this->_retentionMutex);
+      this->_retentionPeriodMs = period_ms;
+      this->_retentionCond.notify_all();
+    }
+    // get the persistence frontier, see ITemporalQueryFrontierProvider.
+    int64_t getPersistenceFrontier() {
+      return (_temporal_query_frontier_provider != nullptr) ?
+        _temporal_query_frontier_provider->getPersistenceFrontier() : INT64_MAX;
+    }
     // get temporal query frontier
     inline const HLC getFrontier(){
       if (_temporal_query_frontier_provider != nullptr) {
@@ -121,6 +297,23 @@ namespace ns_persistent {
       }
     }
 
+    // wait until the temporal query frontier is past hlc, so that queries at
+    // hlc are answered, or until timeout_us microseconds have passed. The
+    // frontier advances on its own, so this polls it every poll_us.
+    // Returns true if the frontier is past hlc.
+    bool waitForFrontier(const HLC & hlc, const uint64_t & timeout_us,
+      const uint64_t & poll_us = 100) {
+      const auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::microseconds(timeout_us);
+      while (getFrontier() <= hlc) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+          return false;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(poll_us));
+      }
+      return true;
+    }
+
     // update temporal query frontier
     // we didn't use a lock on this becuase we assume this is only updated
     // object construction. please use this when you are sure there is no
@@ -128,10 +321,243 @@ namespace ns_persistent {
     void updateTemporalFrontierProvider(ITemporalQueryFrontierProvider* tqfp) {
       this->_temporal_query_frontier_provider = tqfp;
     }
+    // get the version and hlc of the latest log entry of each Persistent<T>,
+    // serialized for getCatchUp(). Empty logs are left out.
+    std::vector<char> getLogFrontier() noexcept(false) {
+      std::vector<char> buf;
+      appendBytes(buf,(uint64_t)0);
+      uint64_t count = 0;
+      for (auto & cus : this->_catchUpSupport) {
+        int64_t ver;
+        HLC hlc(0,0);
+        if (cus.second->getLatestEntry(ver,hlc)) {
+          appendString(buf,cus.first);
+          appendBytes(buf,ver);
+          appendBytes(buf,hlc.m_rtc_us);
+          appendBytes(buf,hlc.m_logic);
+          count ++;
+        }
+      }
+      memcpy(buf.data(),&count,sizeof(count));
+      return buf;
+    }
+
+    // build what a copy of these Persistent<T>s on another node needs to
+    // reach the versions in our_frontier, given the versions it already has
+    // in their_frontier. Both come from getLogFrontier(), ours from this
+    // registry; the entries after it in our logs are left out.
+    std::vector<char> getCatchUp(char const * their_frontier, char const * our_frontier) noexcept(false) {
+      const auto theirs = parseFrontier(their_frontier);
+      const auto ours = parseFrontier(our_frontier);
+      std::vector<char> buf;
+      appendBytes(buf,(uint64_t)ours.size());
+      for (auto & our_entry : ours) {
+        auto cus = this->_catchUpSupport.find(our_entry.first);
+        if (cus == this->_catchUpSupport.end()) {
+          throw PERSIST_EXP_INV_NAME;
+        }
+        appendString(buf,our_entry.first);
+        const std::size_t kind_ofst = buf.size();
+        buf.push_back(CATCH_UP_LOG_TAIL);
+        const std::size_t size_ofst = buf.size();
+        appendBytes(buf,(uint64_t)0);
+        auto their_entry = theirs.find(our_entry.first);
+        if (their_entry == theirs.end() ||
+            !cus->second->logTailToBytes(their_entry->second.first,their_entry->second.second,
+              our_entry.second.first,buf)) {
+          buf[kind_ofst] = CATCH_UP_VALUE;
+          cus->second->versionToBytes(our_entry.second.first,buf);
+        }
+        const uint64_t size = buf.size() - size_ofst - sizeof(uint64_t);
+        memcpy(buf.data() + size_ofst,&size,sizeof(size));
+      }
+      return buf;
+    }
+
+    // build a catch-up, like getCatchUp(), that streams our logs to a copy
+    // of these Persistent<T>s elsewhere: only the entries up to version upto
+    // are included, and the logs that are empty in their_frontier follow on
+    // from the start of ours where it is still there. Fields whose logs
+    // cannot be followed on from get their value at upto. Empty logs are
+    // left out, so the result may hold no fields at all.
+    std::vector<char> getLogShipment(char const * their_frontier, const int64_t & upto) noexcept(false) {
+      const auto theirs = parseFrontier(their_frontier);
+      std::vector<char> buf;
+      appendBytes(buf,(uint64_t)0);
+      uint64_t count = 0;
+      for (auto & cus : this->_catchUpSupport) {
+        int64_t ver;
+        HLC hlc(0,0);
+        if (!cus.second->getLatestEntry(ver,hlc)) {
+          continue;
+        }
+        auto their_entry = theirs.find(cus.first);
+        const int64_t their_ver = (their_entry == theirs.end()) ? INVALID_VERSION : their_entry->second.first;
+        const HLC their_hlc = (their_entry == theirs.end()) ? HLC(0,0) : their_entry->second.second;
+        if (their_ver >= MIN(ver,upto)) {
+          // they have everything up to upto already.
+          continue;
+        }
+        appendString(buf,cus.first);
+        const std::size_t kind_ofst = buf.size();
+        buf.push_back(CATCH_UP_LOG_TAIL);
+        const std::size_t size_ofst = buf.size();
+        appendBytes(buf,(uint64_t)0);
+        if (!cus.second->logTailToBytes(their_ver,their_hlc,upto,buf)) {
+          buf[kind_ofst] = CATCH_UP_VALUE;
+          cus.second->versionToBytes(MIN(ver,upto),buf);
+        }
+        const uint64_t size = buf.size() - size_ofst - sizeof(uint64_t);
+        memcpy(buf.data() + size_ofst,&size,sizeof(size));
+        count ++;
+      }
+      memcpy(buf.data(),&count,sizeof(count));
+      return buf;
+    }
+
+    // apply a catch-up from getCatchUp(). Log entries are appended to the
+    // logs right away; values are kept until the Persistent<T>s referring
+    // to them are deserialized, see takeCaughtUpValue().
+    void applyCatchUp(char const * catch_up) noexcept(false) {
+      uint64_t count;
+      catch_up = readBytes(catch_up,count);
+      for (uint64_t i = 0; i < count; i ++) {
+        std::string name;
+        catch_up = readString(catch_up,name);
+        const char kind = *catch_up++;
+        uint64_t size;
+        catch_up = readBytes(catch_up,size);
+        if (kind == CATCH_UP_VALUE) {
+          this->_caughtUpValues[name] = std::vector<char>(catch_up,catch_up + size);
+        } else {
+          auto cus = this->_catchUpSupport.find(name);
+          if (cus == this->_catchUpSupport.end()) {
+            throw PERSIST_EXP_INV_NAME;
+          }
+          cus->second->applyLogTail(catch_up,size);
+        }
+        catch_up += size;
+      }
+    }
+
+    // apply a shipment from getLogShipment(), appending its log entries like
+    // applyCatchUp(). A log cannot take a value, so the fields that came as
+    // values are left alone and their names returned.
+    std::vector<std::string> applyLogShipment(char const * shipment) noexcept(false) {
+      std::vector<std::string> values;
+      uint64_t count;
+      shipment = readBytes(shipment,count);
+      for (uint64_t i = 0; i < count; i ++) {
+        std::string name;
+        shipment = readString(shipment,name);
+        const char kind = *shipment++;
+        uint64_t size;
+        shipment = readBytes(shipment,size);
+        if (kind == CATCH_UP_VALUE) {
+          values.push_back(name);
+        } else {
+          auto cus = this->_catchUpSupport.find(name);
+          if (cus == this->_catchUpSupport.end()) {
+            throw PERSIST_EXP_INV_NAME;
+          }
+          cus->second->applyLogTail(shipment,size);
+        }
+        shipment += size;
+      }
+      return values;
+    }
+
+    // copy the log of every Persistent<T> up to its latest entry no later
+    // than hlc to targetPath, each on a thread of its own, so a consistent
+    // cut of the object is taken while it keeps being updated. Since every
+    // version is made at the same hlc in all the logs, the copies end at the
+    // same version, which is returned; INVALID_VERSION if they are empty.
+    int64_t checkpoint(const std::string & targetPath, const HLC & hlc) noexcept(false) {
+      checkOrCreateDir(targetPath);
+      std::vector<std::future<int64_t>> copies;
+      for (auto & cus : this->_catchUpSupport) {
+        ILogCatchUpSupport * field = cus.second;
+        copies.emplace_back(std::async(std::launch::async,[field,&targetPath,&hlc](){
+          return field->checkpointLog(targetPath,hlc);
+        }));
+      }
+      int64_t latest = INVALID_VERSION;
+      for (auto & copy : copies) {
+        latest = std::max(latest,copy.get());
+      }
+      return latest;
+    }
+
+    // take the value a catch-up brought for a Persistent<T>, if it brought
+    // one instead of log entries.
+    bool takeCaughtUpValue(const std::string & name, std::vector<char> & value) noexcept(true) {
+      auto itr = this->_caughtUpValues.find(name);
+      if (itr == this->_caughtUpValues.end()) {
+        return false;
+      }
+      value = std::move(itr->second);
+      this->_caughtUpValues.erase(itr);
+      return true;
+    }
+
+    // While set, Persistent<T>s registered here serialize the version of
+    // their latest log entry instead of their value, for a receiver that
+    // gets the value or the missing entries through getCatchUp().
+    void setSerializeByReference(bool by_reference) noexcept(true) {
+      this->_serializeByReference = by_reference;
+    }
+    bool serializesByReference() const noexcept(true) {
+      return this->_serializeByReference;
+    }
+
     PersistentRegistry(PersistentRegistry &&) = default;
     PersistentRegistry(const PersistentRegistry &) = delete;
 
   protected:
+    // the Persistent<T>s that can be caught up, by name
+    std::map<std::string,ILogCatchUpSupport*> _catchUpSupport;
+    // values brought by applyCatchUp(), by name
+    std::map<std::string,std::vector<char>> _caughtUpValues;
+    bool _serializeByReference = false;
+
+    template <typename T>
+    static void appendBytes(std::vector<char> & buf, const T & v) {
+      const char * p = (const char *)&v;
+      buf.insert(buf.end(),p,p + sizeof(T));
+    }
+    static void appendString(std::vector<char> & buf, const std::string & str) {
+      appendBytes(buf,(uint64_t)str.size());
+      buf.insert(buf.end(),str.begin(),str.end());
+    }
+    template <typename T>
+    static char const * readBytes(char const * p, T & v) {
+      memcpy(&v,p,sizeof(T));
+      return p + sizeof(T);
+    }
+    static char const * readString(char const * p, std::string & str) {
+      uint64_t size;
+      p = readBytes(p,size);
+      str.assign(p,size);
+      return p + size;
+    }
+    // parse a frontier into (version, hlc) by name
+    static std::map<std::string,std::pair<int64_t,HLC>> parseFrontier(char const * p) {
+      std::map<std::string,std::pair<int64_t,HLC>> frontier;
+      uint64_t count;
+      p = readBytes(p,count);
+      for (uint64_t i = 0; i < count; i ++) {
+        std::string name;
+        int64_t ver;
+        uint64_t r,l;
+        p = readString(p,name);
+        p = readBytes(p,ver);
+        p = readBytes(p,r);
+        p = readBytes(p,l);
+        frontier.emplace(name,std::make_pair(ver,HLC(r,l)));
+      }
+      return frontier;
+    }
+
     //std::vector<std::tuple<VersionFunc,PersistFunc,TrimFunc>> _registry;
     ITemporalQueryFrontierProvider * _temporal_query_frontier_provider;
     std::map<std::size_t,std::tuple<VersionFunc,PersistFunc,TrimFunc>> _registry;
@@ -142,6 +568,114 @@ namespace ns_persistent {
         std::get<funcIdx>(itr->second)(args ...);
       }
     };
+    // the parallel persist(), see setParallelPersist(). The persist
+    // functions of a round, their results, and the progress of the round
+    // are protected by _persistMutex.
+    std::vector<std::thread> _persistWorkers;
+    std::mutex _persistMutex;
+    std::condition_variable _persistCond;
+    std::condition_variable _persistDoneCond;
+    std::vector<const PersistFunc *> _persistFuncs;
+    std::vector<int64_t> _persistResults;
+    size_t _persistNext = 0;
+    size_t _persistPending = 0;
+    std::exception_ptr _persistError;
+    bool _persistStop = false;
+    // run the persist functions of the current round that no other thread
+    // has started. lck is held on entry and on return.
+    void runPersistFuncs(std::unique_lock<std::mutex> & lck) {
+      while (this->_persistNext < this->_persistFuncs.size()) {
+        const size_t i = this->_persistNext ++;
+        lck.unlock();
+        int64_t ret = -1;
+        std::exception_ptr error;
+        try {
+          ret = (*this->_persistFuncs[i])();
+        } catch (...) {
+          error = std::current_exception();
+        }
+        lck.lock();
+        this->_persistResults[i] = ret;
+        if (error && !this->_persistError) {
+          this->_persistError = error;
+        }
+        if (--this->_persistPending == 0) {
+          this->_persistDoneCond.notify_all();
+        }
+      }
+    }
+    int64_t parallelPersist() noexcept(false) {
+      std::unique_lock<std::mutex> lck(this->_persistMutex);
+      this->_persistFuncs.clear();
+      for (auto & entry : this->_registry) {
+        this->_persistFuncs.push_back(&std::get<PERSIST_FUNC_IDX>(entry.second));
+      }
+      this->_persistResults.assign(this->_persistFuncs.size(),-1);
+      this->_persistNext = 0;
+      this->_persistPending = this->_persistFuncs.size();
+      this->_persistError = nullptr;
+      this->_persistCond.notify_all();
+      runPersistFuncs(lck);
+      this->_persistDoneCond.wait(lck,[this](){
+        return this->_persistPending == 0;
+      });
+      if (this->_persistError) {
+        std::exception_ptr error = this->_persistError;
+        this->_persistError = nullptr;
+        lck.unlock();
+        std::rethrow_exception(error);
+      }
+      // like callFuncMin()
+      return *std::min_element(this->_persistResults.begin(),this->_persistResults.end());
+    }
+    void stopPersistWorkers() {
+      {
+        std::lock_guard<std::mutex> lck(this->_persistMutex);
+        this->_persistStop = true;
+      }
+      this->_persistCond.notify_all();
+      for (auto & worker : this->_persistWorkers) {
+        worker.join();
+      }
+      this->_persistWorkers.clear();
+      this->_persistStop = false;
+    }
+    // the retention functions by name, and the thread that calls them. All
+    // of them are protected by _retentionMutex, which is held while they
+    // run, so that a Persistent<T> can unregister before it goes away.
+    std::map<std::size_t,RetentionFunc> _retention;
+    std::thread _retentionThread;
+    std::mutex _retentionMutex;
+    std::condition_variable _retentionCond;
+    uint64_t _retentionPeriodMs = DEFAULT_RETENTION_PERIOD_MS;
+    bool _retentionStop = false;
+    void retentionLoop() noexcept(true) {
+      std::unique_lock<std::mutex> lck(this->_retentionMutex);
+      while (!this->_retentionStop) {
+        this->_retentionCond.wait_for(lck,std::chrono::milliseconds(this->_retentionPeriodMs));
+        if (this->_retentionStop) {
+          break;
+        }
+        const int64_t frontier = getPersistenceFrontier();
+        for (auto & entry : this->_retention) {
+          try {
+            entry.second(frontier);
+          } catch (uint64_t exp) {
+            dbg_warn("retention failed with exception:{:x}",exp);
+          }
+        }
+      }
+    }
+    void stopRetention() {
+      {
+        std::lock_guard<std::mutex> lck(this->_retentionMutex);
+        this->_retentionStop = true;
+      }
+      this->_retentionCond.notify_all();
+      if (this->_retentionThread.joinable()) {
+        this->_retentionThread.join();
+      }
+    }
     template<int funcIdx,typename ReturnType,typename ... Args>
     ReturnType callFuncMin(Args ... args) {
       ReturnType min_ret = -1; // -1 means invalid value.
@@ -158,6 +692,45 @@ namespace ns_persistent {
     }
   };
 
+  // PersistentView is a read-only view of a version of a Persistent<T>. The
+  // object is deserialized in place from the log with from_bytes_noalloc(), so
+  // nothing is copied for types that deserialize into a context_ptr pointing
+  // to the log data. The log is pinned while the view is alive: the data stays
+  // valid even if the version is trimmed. A view must not outlive the
+  // Persistent<T> it comes from, and should not be held for long because it
+  // keeps trimmed data on storage.
+  template <typename ObjectType>
+  class PersistentView {
+  private:
+    mutils::context_ptr<ObjectType> m_pObject;
+    PersistLog * m_pLog;
+  public:
+    /** constructor
+     * @param object The object deserialized from the log.
+     * @param log The log, which is pinned already.
+     */
+    PersistentView(mutils::context_ptr<ObjectType> && object, PersistLog * log) noexcept(true):
+      m_pObject(std::move(object)),m_pLog(log) {
+    }
+    PersistentView(PersistentView && other) noexcept(true):
+      m_pObject(std::move(other.m_pObject)),m_pLog(other.m_pLog) {
+      other.m_pLog = nullptr;
+    }
+    PersistentView(const PersistentView &) = delete;
+    virtual ~PersistentView() noexcept(true) {
+      m_pObject.reset();
+      if (m_pLog != nullptr) {
+        m_pLog->unpin();
+      }
+    }
+    const ObjectType & operator * () const {
+      return *m_pObject;
+    }
+    const ObjectType * operator -> () const {
+      return m_pObject.get();
+    }
+  };
+
   // Persistent represents a variable backed up by persistent storage. The
   // backend is PersistLog class. PersistLog handles only raw bytes and this
   // class is repsonsible for converting it back and forth between raw bytes
@@ -179,24 +752,58 @@ namespace ns_persistent {
   //     'pdata' buffer.
   // - StorageType: storage type is defined in PersistLog. The value could be
   //   ST_FILE/ST_MEM/ST_3DXP ... I will start with ST_FILE and extend it to
-  //   other persistent Storage.
+  //   other persistent Storage. ST_TIERED is ST_FILE with the data segments
+  //   not written for a day moved to DEFAULT_COLD_PERSIST_LOG_DATA_PATH,
+  //   which can be a link to a slower disk. ST_PMEM, the same as ST_3DXP,
+  //   keeps the log in DEFAULT_PMEM_PERSIST_LOG_DATA_PATH on persistent
+  //   memory and persists it with cache line flushes.
   // TODO:comments
   //TODO: Persistent<T> has to be serializable, extending from mutils::ByteRepresentable 
   template <typename ObjectType,
     StorageType storageType=ST_FILE>
-  class Persistent: public mutils::ByteRepresentable{
+  class Persistent: public mutils::ByteRepresentable, public ILogCatchUpSupport{
   protected:
       /** initialize from local state.
        *  @param object_name Object name
+       *  @param segment_size Size of the data segment files of the log
+       *  @param async_persist Pipeline the flushes of the log
+       *  @param mapped_header Persist the log header through a mapped file
+       *  @param compression The codec to compress large log entries with
+       *  @param compress_threshold The size from which entries are compressed
        */
-      inline void initialize_log(const char * object_name)
+      inline void initialize_log(const char * object_name,
+        const uint64_t segment_size = DEFAULT_DATA_SEGMENT_SIZE,
+        const bool async_persist = false,
+        const bool mapped_header = false,
+        const LogCompression compression = LC_NONE,
+        const uint64_t compress_threshold = DEFAULT_COMPRESS_THRESHOLD)
         noexcept(false){
         // STEP 1: initialize log
         this->m_pLog = nullptr;
         switch(storageType){
         // file system
         case ST_FILE:
-          this->m_pLog = std::make_unique<FilePersistLog>(object_name);
+          this->m_pLog = std::make_unique<FilePersistLog>(object_name,
+            DEFAULT_FILE_PERSIST_LOG_DATA_PATH, segment_size, async_persist, mapped_header,
+            compression, compress_threshold);
+          if(this->m_pLog == nullptr){
+            throw PERSIST_EXP_NEW_FAILED_UNKNOWN;
+          }
+          break;
+        // file system, with the old data moved to slower storage
+        case ST_TIERED:
+          this->m_pLog = std::make_unique<FilePersistLog>(object_name,
+            DEFAULT_FILE_PERSIST_LOG_DATA_PATH, segment_size, async_persist, mapped_header,
+            compression, compress_threshold, DEFAULT_COLD_PERSIST_LOG_DATA_PATH);
+          if(this->m_pLog == nullptr){
+            throw PERSIST_EXP_NEW_FAILED_UNKNOWN;
+          }
+          break;
+        // persistent memory
+        case ST_PMEM:
+          this->m_pLog = std::make_unique<FilePersistLog>(object_name,
+            DEFAULT_PMEM_PERSIST_LOG_DATA_PATH, segment_size, false, true,
+            compression, compress_threshold, "", DEFAULT_COLD_SEGMENT_AGE, true);
           if(this->m_pLog == nullptr){
             throw PERSIST_EXP_NEW_FAILED_UNKNOWN;
           }
@@ -204,8 +811,7 @@ namespace ns_persistent {
         // volatile
         case ST_MEM:
         {
-          const string tmpfsPath = "/dev/shm/volatile_t";
-          this->m_pLog = std::make_unique<FilePersistLog>(object_name, tmpfsPath);
+          this->m_pLog = std::make_unique<MemPersistLog>(object_name);
           if(this->m_pLog == nullptr){
             throw PERSIST_EXP_NEW_FAILED_UNKNOWN;
           }
@@ -226,6 +832,303 @@ namespace ns_persistent {
           this->m_pWrappedObject = std::make_unique<ObjectType>();
         }
       }
+      /** make a view of the entry returned by the lookup function.
+       *  @param lookup Returns a pointer to the serialized entry. It is called
+       *         after the log is pinned.
+       *  @param dm The deserialization manager.
+       */
+      template <typename Lookup>
+      PersistentView<ObjectType> make_view(const Lookup & lookup,
+        mutils::DeserializationManager *dm)
+        noexcept(false) {
+        this->m_pLog->pin();
+        try {
+          char const * pdat = lookup();
+          if (!this->m_pLog->isZeroCopy(pdat)) {
+            // a decompressed entry does not outlive the next read, so copy it.
+            PersistentView<ObjectType> view(
+              mutils::context_ptr<ObjectType>{mutils::from_bytes<ObjectType>(dm,pdat).release()},nullptr);
+            this->m_pLog->unpin();
+            return view;
+          }
+          return PersistentView<ObjectType>(
+            mutils::from_bytes_noalloc<ObjectType>(dm,pdat),this->m_pLog.get());
+        } catch (...) {
+          this->m_pLog->unpin();
+          throw;
+        }
+      }
+      // true_type if ObjectType logs deltas.
+      typedef std::integral_constant<bool,
+        std::is_base_of<IDeltaSupport<ObjectType>,ObjectType>::value> DeltaTag;
+      // true_type if ObjectType has a key index.
+      typedef std::integral_constant<bool,
+        std::is_base_of<IKeyIndexSupport<ObjectType>,ObjectType>::value> KeyIndexTag;
+
+      /** open the key index of a type with IKeyIndexSupport, next to the
+       * files of the log, or in memory for other logs.
+       */
+      void initialize_key_index(std::false_type) noexcept(false) {}
+      void initialize_key_index(std::true_type) noexcept(false) {
+        std::string file;
+        FilePersistLog * fpl = dynamic_cast<FilePersistLog*>(this->m_pLog.get());
+        if (fpl != nullptr) {
+          file = fpl->getDataPath() + "/" + this->m_pLog->m_sName + "." + KEY_INDEX_FILE_SUFFIX;
+        }
+        const int64_t next = this->m_pLog->getLatestIndex() + 1;
+        this->m_pKeyIndex = std::make_unique<KeyIndex>(file,next);
+        // the log may have lost entries the index has.
+        this->m_pKeyIndex->truncate(next - 1);
+      }
+      void key_hashes(std::vector<uint64_t> & hashes, std::false_type) noexcept(false) {}
+      void key_hashes(std::vector<uint64_t> & hashes, std::true_type) noexcept(false) {
+        IKeyIndexSupport<ObjectType> & kobj = *this->m_pWrappedObject;
+        kobj.currentKeyHashes(hashes);
+      }
+
+      /** look up a reconstructed version in the cache.
+       *  @return the object, or nullptr if the version is not cached.
+       */
+      std::unique_ptr<ObjectType> delta_cache_get(const int64_t & idx,
+        mutils::DeserializationManager *dm) noexcept(false) {
+        std::lock_guard<std::mutex> lck(this->m_mtxDeltaCache);
+        auto itr = this->m_mDeltaCache.find(idx);
+        if (itr == this->m_mDeltaCache.end()) {
+          return nullptr;
+        }
+        return mutils::from_bytes<ObjectType>(dm,itr->second.get());
+      }
+
+      /** cache a reconstructed version, evicting the oldest cached one.
+       */
+      void delta_cache_put(const int64_t & idx, const ObjectType & obj) noexcept(false) {
+        std::unique_ptr<char[]> buf(new char[mutils::bytes_size(obj)]);
+        mutils::to_bytes(obj,buf.get());
+        std::lock_guard<std::mutex> lck(this->m_mtxDeltaCache);
+        this->m_mDeltaCache[idx] = std::move(buf);
+        if (this->m_mDeltaCache.size() > DELTA_CACHE_SIZE) {
+          this->m_mDeltaCache.erase(this->m_mDeltaCache.begin());
+        }
+      }
+
+      /** rebuild a version of a delta-enabled type from the nearest
+       *  checkpoint or cached version before it.
+       *  @param idx The index of the version, negative to count back from
+       *         the latest one.
+       *  @param dm The deserialization manager.
+       */
+      std::unique_ptr<ObjectType> reconstruct(int64_t idx,
+        mutils::DeserializationManager *dm) noexcept(false) {
+        if (idx < 0) {
+          idx += this->m_pLog->getLatestIndex() + 1;
+        }
+        std::unique_ptr<ObjectType> obj;
+        // keep the entries mapped while we replay them.
+        this->m_pLog->pin();
+        try {
+          int64_t base = idx;
+          while (true) {
+            obj = delta_cache_get(base,dm);
+            if (obj != nullptr) {
+              break;
+            }
+            char const * pdat = (char const *)this->m_pLog->getEntryByIndex(base);
+            if (*(const uint64_t *)pdat == DELTA_ENTRY_FULL) {
+              obj = mutils::from_bytes<ObjectType>(dm,pdat + DELTA_ENTRY_HEADER_SIZE);
+              break;
+            }
+            base --;
+          }
+          for (int64_t i = base + 1; i <= idx; i++) {
+            char const * pdat = (char const *)this->m_pLog->getEntryByIndex(i);
+            obj->applyDelta(pdat + DELTA_ENTRY_HEADER_SIZE);
+          }
+          if (idx > base) {
+            delta_cache_put(idx,*obj);
+          }
+        } catch (...) {
+          this->m_pLog->unpin();
+          throw;
+        }
+        this->m_pLog->unpin();
+        return obj;
+      }
+
+      /** get a version by index from the version cache, deserializing and
+       *  caching it on a miss. The version is looked up in the log first, so
+       *  a trimmed version is never served from the cache.
+       */
+      std::shared_ptr<const ObjectType> shared_by_index(const int64_t & idx,
+        mutils::DeserializationManager *dm) noexcept(false) {
+        int64_t ver;
+        HLC hlc(0,0);
+        uint64_t size;
+        this->m_pLog->getEntryInfoByIndex(idx,ver,hlc,size);
+        {
+          std::lock_guard<std::mutex> lck(this->m_mtxVersionCache);
+          auto itr = this->m_mVersionCache.find(ver);
+          if (itr != this->m_mVersionCache.end()) {
+            // move it to the front as the most recently used.
+            this->m_lVersionCacheLRU.splice(this->m_lVersionCacheLRU.begin(),
+              this->m_lVersionCacheLRU,itr->second);
+            return itr->second->obj;
+          }
+        }
+        std::shared_ptr<const ObjectType> obj(load_by_index(idx,dm,DeltaTag{}));
+        const uint64_t obj_size = mutils::bytes_size(*obj);
+        std::lock_guard<std::mutex> lck(this->m_mtxVersionCache);
+        if (this->m_iVersionCacheCapacity == 0 ||
+            obj_size > this->m_iVersionCacheCapacity ||
+            this->m_mVersionCache.find(ver) != this->m_mVersionCache.end()) {
+          return obj;
+        }
+        this->m_lVersionCacheLRU.push_front({ver,obj_size,obj});
+        this->m_mVersionCache[ver] = this->m_lVersionCacheLRU.begin();
+        this->m_iVersionCacheBytes += obj_size;
+        version_cache_evict(this->m_iVersionCacheCapacity);
+        return obj;
+      }
+
+      /** evict the least recently used versions until the cache holds at
+       *  most max_bytes. The caller holds m_mtxVersionCache.
+       */
+      void version_cache_evict(const uint64_t & max_bytes) noexcept(true) {
+        while (this->m_iVersionCacheBytes > max_bytes) {
+          const CachedVersion & lru = this->m_lVersionCacheLRU.back();
+          this->m_iVersionCacheBytes -= lru.size;
+          this->m_mVersionCache.erase(lru.ver);
+          this->m_lVersionCacheLRU.pop_back();
+        }
+      }
+
+      // get a version by index, see getByIndex().
+      std::unique_ptr<ObjectType> load_by_index(const int64_t & idx,
+        mutils::DeserializationManager *dm, std::false_type) noexcept(false) {
+        return mutils::from_bytes<ObjectType>(dm,(char const *)this->m_pLog->getEntryByIndex(idx));
+      }
+      std::unique_ptr<ObjectType> load_by_index(const int64_t & idx,
+        mutils::DeserializationManager *dm, std::true_type) noexcept(false) {
+        return reconstruct(idx,dm);
+      }
+
+      // run a function on a version by index, see getByIndex().
+      template <typename Func>
+      auto run_by_index(const int64_t & idx, const Func & fun,
+        mutils::DeserializationManager *dm, std::false_type) noexcept(false) {
+        return mutils::deserialize_and_run<ObjectType>(dm,(char *)this->m_pLog->getEntryByIndex(idx),fun);
+      }
+      template <typename Func>
+      auto run_by_index(const int64_t & idx, const Func & fun,
+        mutils::DeserializationManager *dm, std::true_type) noexcept(false) {
+        return fun(*reconstruct(idx,dm));
+      }
+
+      // get a view of a version by index, see getViewByIndex().
+      PersistentView<ObjectType> view_by_index(const int64_t & idx,
+        mutils::DeserializationManager *dm, std::false_type) noexcept(false) {
+        return make_view([&](){
+          return (char const *)this->m_pLog->getEntryByIndex(idx);
+        },dm);
+      }
+      PersistentView<ObjectType> view_by_index(const int64_t & idx,
+        mutils::DeserializationManager *dm, std::true_type) noexcept(false) {
+        // a reconstructed version is not backed by the log.
+        return PersistentView<ObjectType>(
+          mutils::context_ptr<ObjectType>{reconstruct(idx,dm).release()},nullptr);
+      }
+
+      // make the log visitor of getRange().
+      template <typename Func>
+      EntryVisitor range_visitor(const Func & fun,
+        mutils::DeserializationManager *dm, std::false_type) {
+        return [&fun,dm](const int64_t &, const int64_t & ver, const HLC & hlc,
+          const void * pdata, const uint64_t &) {
+          mutils::deserialize_and_run<ObjectType>(dm,(char *)pdata,
+            [&](const ObjectType & obj){ fun(ver,hlc,obj); });
+          return true;
+        };
+      }
+      template <typename Func>
+      EntryVisitor range_visitor(const Func & fun,
+        mutils::DeserializationManager *dm, std::true_type) {
+        // consecutive entries are replayed on the same object
+        auto obj = std::make_shared<std::unique_ptr<ObjectType>>();
+        auto last = std::make_shared<int64_t>(-1);
+        return [this,&fun,dm,obj,last](const int64_t & idx, const int64_t & ver,
+          const HLC & hlc, const void * pdata, const uint64_t &) {
+          char const * pdat = (char const *)pdata;
+          if (*(const uint64_t *)pdat == DELTA_ENTRY_FULL) {
+            *obj = mutils::from_bytes<ObjectType>(dm,pdat + DELTA_ENTRY_HEADER_SIZE);
+          } else if (*obj == nullptr || *last != idx - 1) {
+            *obj = reconstruct(idx,dm);
+          } else {
+            (*obj)->applyDelta(pdat + DELTA_ENTRY_HEADER_SIZE);
+          }
+          *last = idx;
+          fun(ver,hlc,(const ObjectType &)**obj);
+          return true;
+        };
+      }
+
+      // make a version, see version().
+      void version_impl(const int64_t & ver, std::false_type) noexcept(false) {
+        this->set(*this->m_pWrappedObject,ver);
+      }
+      void version_impl(const int64_t & ver, std::true_type) noexcept(false) {
+        IDeltaSupport<ObjectType> & dobj = *this->m_pWrappedObject;
+        dobj.setDeltaVersion(ver);
+        const std::size_t dsize = dobj.currentDeltaSize();
+        std::unique_ptr<char[]> buf(new char[DELTA_ENTRY_HEADER_SIZE + dsize]);
+        // the delta is consumed either way.
+        dobj.currentDeltaToBytes(buf.get() + DELTA_ENTRY_HEADER_SIZE,dsize);
+        if (this->m_iDeltasSinceCheckpoint >= this->m_iDeltaCheckpointInterval ||
+            this->getNumOfVersions() == 0) {
+          this->set(*this->m_pWrappedObject,ver);
+        } else {
+          *(uint64_t *)buf.get() = DELTA_ENTRY_DELTA;
+          HLC mhlc;
+          this->m_pLog->append((void*)buf.get(),DELTA_ENTRY_HEADER_SIZE + dsize,ver,mhlc);
+          this->m_iDeltasSinceCheckpoint ++;
+        }
+      }
+
+      // trim the log, see trim().
+      template <typename TKey>
+      void trim_impl(const TKey & k, std::false_type) noexcept(false) {
+        this->m_pLog->trim(k);
+      }
+      template <typename TKey>
+      void trim_impl(const TKey & k, std::true_type) noexcept(false) {
+        // never trim the checkpoint the remaining deltas are based on.
+        const int64_t last = index_of(k);
+        const int64_t earliest = this->m_pLog->getEarliestIndex();
+        if (last == INVALID_INDEX || earliest == INVALID_INDEX || last < earliest) {
+          return;
+        }
+        int64_t keep = last + 1;
+        if (keep > this->m_pLog->getLatestIndex()) {
+          // nothing is left, so the next version has to be a checkpoint.
+          this->m_iDeltasSinceCheckpoint = this->m_iDeltaCheckpointInterval;
+        } else {
+          while (keep > earliest &&
+                 *(const uint64_t *)this->m_pLog->getEntryByIndex(keep) != DELTA_ENTRY_FULL) {
+            keep --;
+          }
+        }
+        if (keep > earliest) {
+          this->m_pLog->trimByIndex(keep - 1);
+        }
+        std::lock_guard<std::mutex> lck(this->m_mtxDeltaCache);
+        this->m_mDeltaCache.erase(this->m_mDeltaCache.begin(),
+          this->m_mDeltaCache.lower_bound(keep));
+      }
+      int64_t index_of(const int64_t & ver) noexcept(false) {
+        return this->m_pLog->getVersionIndex(ver);
+      }
+      int64_t index_of(const HLC & hlc) noexcept(false) {
+        return this->m_pLog->getHLCIndex(hlc);
+      }
+
       /** register the callbacks.
        */
       inline void register_callbacks() 
@@ -235,24 +1138,54 @@ namespace ns_persistent {
             this->m_pLog->m_sName.c_str(),
             std::bind(&Persistent<ObjectType,storageType>::version,this,std::placeholders::_1),
             std::bind(&Persistent<ObjectType,storageType>::persist,this),
-            std::bind(&Persistent<ObjectType,storageType>::trim<const int64_t>,this,std::placeholders::_1) //trim by version:(const int64_t)
+            std::bind(&Persistent<ObjectType,storageType>::trim<const int64_t>,this,std::placeholders::_1), //trim by version:(const int64_t)
+            this
           );
+          if (!this->m_retention.empty()) {
+            registerRetention();
+          }
         }
       }
+      void registerRetention() noexcept(false) {
+        this->m_pRegistry->registerRetention(
+          this->m_pLog->m_sName.c_str(),
+          std::bind(&Persistent<ObjectType,storageType>::enforceRetention,this,std::placeholders::_1));
+      }
   public:
       /** constructor 1 is for building a persistent<T> locally, load/create a
        * log and register itself to a persistent registry.
        * @param object_name This name is used for persistent data in file.
        * @param persistent_registry A normal pointer to the registry.
+       * @param segment_size The size of the data segment files. Objects with
+       *        small states can use smaller segments to save memory.
+       * @param async_persist If true, persist() starts flushing the latest
+       *        versions and returns the versions made durable by the previous
+       *        call, overlapping the flushes with the following updates.
+       * @param mapped_header If true, each persist() writes the log header to
+       *        one of two slots of the mapped meta file with a single msync,
+       *        instead of replacing the meta file. This saves several system
+       *        calls per persist(), which matters for small updates.
+       * @param compression The codec new versions of at least
+       *        compress_threshold bytes are compressed with, if they shrink.
+       *        Views of compressed versions are copies instead of zero-copy
+       *        views, see FilePersistLog::isZeroCopy().
+       * @param compress_threshold The size from which versions are compressed.
        */
       Persistent(
         const char * object_name = nullptr,
-        PersistentRegistry * persistent_registry = nullptr)
+        PersistentRegistry * persistent_registry = nullptr,
+        const uint64_t segment_size = DEFAULT_DATA_SEGMENT_SIZE,
+        const bool async_persist = false,
+        const bool mapped_header = false,
+        const LogCompression compression = LC_NONE,
+        const uint64_t compress_threshold = DEFAULT_COMPRESS_THRESHOLD)
         noexcept(false)
         : m_pRegistry(persistent_registry) {
         // Initialize log
         initialize_log((object_name==nullptr)?
-          (*Persistent::getNameMaker().make()).c_str() : object_name);
+          (*Persistent::getNameMaker().make()).c_str() : object_name, segment_size, async_persist,
+          mapped_header, compression, compress_threshold);
+        initialize_key_index(KeyIndexTag{});
         // Initialize object
         initialize_object_from_log();
         // Register Callbacks
@@ -264,9 +1197,26 @@ namespace ns_persistent {
        * @param other The other object.
        */
       Persistent(Persistent && other) noexcept(false) {
+        // the retention thread may be enforcing other's policy.
+        std::unique_lock<std::mutex> retention_lck(other.m_mtxRetention);
         this->m_pWrappedObject = std::move(other.m_pWrappedObject);
         this->m_pLog = std::move(other.m_pLog);
+        this->m_pKeyIndex = std::move(other.m_pKeyIndex);
         this->m_pRegistry = other.m_pRegistry;
+        this->m_iDeltaCheckpointInterval = other.m_iDeltaCheckpointInterval;
+        this->m_iDeltasSinceCheckpoint = other.m_iDeltasSinceCheckpoint;
+        this->m_mDeltaCache = std::move(other.m_mDeltaCache);
+        this->m_iVersionCacheCapacity = other.m_iVersionCacheCapacity;
+        this->m_iVersionCacheBytes = other.m_iVersionCacheBytes;
+        this->m_lVersionCacheLRU = std::move(other.m_lVersionCacheLRU);
+        this->m_mVersionCache = std::move(other.m_mVersionCache);
+        other.m_iVersionCacheBytes = 0;
+        this->m_retention = other.m_retention;
+        this->m_iRetainedFrom = other.m_iRetainedFrom;
+        this->m_iRetainedTo = other.m_iRetainedTo;
+        this->m_iRetainedBytes = other.m_iRetainedBytes;
+        other.m_retention = RetentionPolicy();
+        retention_lck.unlock();
         register_callbacks(); // this callback will override the previous registry entry.
       }
 
@@ -292,6 +1242,7 @@ namespace ns_persistent {
         } else {
           this->m_pLog = std::move(log_ptr);
         }
+        initialize_key_index(KeyIndexTag{});
         // Initialize Warpped Object
         if ( wrapped_obj_ptr == nullptr ) {
           initialize_object_from_log();
@@ -316,6 +1267,10 @@ namespace ns_persistent {
         // }
         //TODO:unregister the version creator and persist callback,
         // if the Persistent<T> is added to the pool dynamically.
+        // the retention thread must not call into a destroyed object.
+        if (this->m_pRegistry != nullptr && !this->m_retention.empty()) {
+          this->m_pRegistry->unregisterRetention(this->m_pLog->m_sName.c_str());
+        }
       };
 
       /**
@@ -352,7 +1307,7 @@ namespace ns_persistent {
         const Func& fun, 
         mutils::DeserializationManager *dm=nullptr)
         noexcept(false) {
-        return mutils::deserialize_and_run<ObjectType>(dm,(char *)this->m_pLog->getEntryByIndex(idx),fun);
+        return run_by_index(idx,fun,dm,DeltaTag{});
       };
 
       // get a version of value T. returns a unique pointer to the object
@@ -360,7 +1315,7 @@ namespace ns_persistent {
         int64_t idx, 
         mutils::DeserializationManager *dm=nullptr)
         noexcept(false) {
-        return mutils::from_bytes<ObjectType>(dm,(char const *)this->m_pLog->getEntryByIndex(idx));      
+        return load_by_index(idx,dm,DeltaTag{});
       };
 
       // get a version of Value T, specified by version. the user lambda will be fed with
@@ -373,6 +1328,13 @@ namespace ns_persistent {
         const Func& fun,
         mutils::DeserializationManager *dm=nullptr)
         noexcept(false) {
+        if (DeltaTag::value) {
+          const int64_t idx = this->m_pLog->getVersionIndex(ver);
+          if (idx == INVALID_INDEX) {
+            throw PERSIST_EXP_INV_VERSION;
+          }
+          return run_by_index(idx,fun,dm,DeltaTag{});
+        }
         char * pdat = (char*)this->m_pLog->getEntry(ver);
         if (pdat == nullptr) {
           throw PERSIST_EXP_INV_VERSION;
@@ -386,6 +1348,13 @@ namespace ns_persistent {
         const int64_t & ver,
         mutils::DeserializationManager *dm=nullptr)
         noexcept(false) {
+        if (DeltaTag::value) {
+          const int64_t idx = this->m_pLog->getVersionIndex(ver);
+          if (idx == INVALID_INDEX) {
+            throw PERSIST_EXP_INV_VERSION;
+          }
+          return load_by_index(idx,dm,DeltaTag{});
+        }
         char const * pdat = (char const *)this->m_pLog->getEntry(ver);
         if (pdat == nullptr) {
           throw PERSIST_EXP_INV_VERSION;
@@ -394,10 +1363,214 @@ namespace ns_persistent {
         return mutils::from_bytes<ObjectType>(dm,pdat);
       }
 
+      // get a read-only view of a version of T, specified by index
+      // zerocopy: the view is valid as long as it is alive. See PersistentView.
+      PersistentView<ObjectType> getViewByIndex(
+        int64_t idx,
+        mutils::DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        return view_by_index(idx,dm,DeltaTag{});
+      }
+
+      // get a read-only view of a version of T, specified by version
+      // zerocopy: the view is valid as long as it is alive. See PersistentView.
+      PersistentView<ObjectType> getView(
+        const int64_t & ver,
+        mutils::DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        if (DeltaTag::value) {
+          const int64_t idx = this->m_pLog->getVersionIndex(ver);
+          if (idx == INVALID_INDEX) {
+            throw PERSIST_EXP_INV_VERSION;
+          }
+          return view_by_index(idx,dm,DeltaTag{});
+        }
+        return make_view([&](){
+          char const * pdat = (char const *)this->m_pLog->getEntry(ver);
+          if (pdat == nullptr) {
+            throw PERSIST_EXP_INV_VERSION;
+          }
+          return pdat;
+        },dm);
+      }
+
+      // get a read-only view of a version of T, specified by HLC clock
+      // zerocopy: the view is valid as long as it is alive. See PersistentView.
+      PersistentView<ObjectType> getView(
+        const HLC& hlc,
+        mutils::DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        // global stability frontier test
+        if (m_pRegistry != nullptr && m_pRegistry->getFrontier() <= hlc) {
+          throw PERSIST_EXP_BEYOND_GSF;
+        }
+        if (DeltaTag::value) {
+          const int64_t idx = this->m_pLog->getHLCIndex(hlc);
+          if (idx == INVALID_INDEX) {
+            throw PERSIST_EXP_INV_HLC;
+          }
+          return view_by_index(idx,dm,DeltaTag{});
+        }
+        return make_view([&](){
+          char const * pdat = (char const *)this->m_pLog->getEntry(hlc);
+          if (pdat == nullptr) {
+            throw PERSIST_EXP_INV_HLC;
+          }
+          return pdat;
+        },dm);
+      }
+
+      // get a shared read-only copy of a version of T, specified by version.
+      // With the version cache on, repeated reads of a version share one
+      // deserialized copy, see setVersionCacheSize().
+      std::shared_ptr<const ObjectType> getShared(
+        const int64_t & ver,
+        mutils::DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        const int64_t idx = this->m_pLog->getVersionIndex(ver);
+        if (idx == INVALID_INDEX) {
+          throw PERSIST_EXP_INV_VERSION;
+        }
+        return shared_by_index(idx,dm);
+      }
+
+      // get a shared read-only copy of a version of T, specified by HLC clock.
+      // See getShared() by version.
+      std::shared_ptr<const ObjectType> getShared(
+        const HLC & hlc,
+        mutils::DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        // global stability frontier test
+        if (m_pRegistry != nullptr && m_pRegistry->getFrontier() <= hlc) {
+          throw PERSIST_EXP_BEYOND_GSF;
+        }
+        const int64_t idx = this->m_pLog->getHLCIndex(hlc);
+        if (idx == INVALID_INDEX) {
+          throw PERSIST_EXP_INV_HLC;
+        }
+        return shared_by_index(idx,dm);
+      }
+
+      /** set the size of the cache of deserialized versions used by
+       * getShared(). The versions read most recently are kept until the
+       * serialized sizes of the cached versions add up to max_bytes. The
+       * cache is off by default.
+       * @param max_bytes The size of the cache, 0 to turn it off.
+       */
+      void setVersionCacheSize(const uint64_t & max_bytes) noexcept(true) {
+        std::lock_guard<std::mutex> lck(this->m_mtxVersionCache);
+        this->m_iVersionCacheCapacity = max_bytes;
+        version_cache_evict(max_bytes);
+      }
+
+      /** set the retention policy. With a registry, the registry's retention
+       * thread enforces it; otherwise enforceRetention() has to be called.
+       * An empty policy keeps every version.
+       */
+      void setRetention(const RetentionPolicy & policy) noexcept(false) {
+        {
+          std::lock_guard<std::mutex> lck(this->m_mtxRetention);
+          this->m_retention = policy;
+        }
+        if (this->m_pRegistry != nullptr) {
+          if (policy.empty()) {
+            this->m_pRegistry->unregisterRetention(this->m_pLog->m_sName.c_str());
+          } else {
+            registerRetention();
+          }
+        }
+      }
+
+      /** trim the versions the retention policy does not keep, all at once,
+       * but none after the frontier or after the version persisted here.
+       * @param frontier The latest version every replica has persisted.
+       */
+      void enforceRetention(const int64_t & frontier = INT64_MAX) noexcept(false) {
+        std::lock_guard<std::mutex> lck(this->m_mtxRetention);
+        const RetentionPolicy & policy = this->m_retention;
+        if (policy.empty() || this->m_pLog->getLength() < 2) {
+          return;
+        }
+        const int64_t earliest = this->m_pLog->getEarliestIndex();
+        const int64_t latest = this->m_pLog->getLatestIndex();
+        int64_t ver;
+        HLC hlc(0,0);
+        uint64_t size;
+        // trim up to and including last
+        int64_t last = earliest - 1;
+        if (policy.max_versions > 0 && latest - earliest + 1 > (int64_t)policy.max_versions) {
+          last = latest - (int64_t)policy.max_versions;
+        }
+        if (policy.max_age_us > 0) {
+          const HLC now;
+          const uint64_t cutoff = (now.m_rtc_us > policy.max_age_us) ? now.m_rtc_us - policy.max_age_us : 0;
+          for (int64_t idx = MAX(earliest,last + 1); idx < latest; idx++) {
+            this->m_pLog->getEntryInfoByIndex(idx,ver,hlc,size);
+            if (hlc.m_rtc_us >= cutoff) {
+              break;
+            }
+            last = idx;
+          }
+        }
+        if (policy.max_bytes > 0) {
+          // the sizes of the entries in [m_iRetainedFrom,m_iRetainedTo) add
+          // up to m_iRetainedBytes, so only new entries are looked at.
+          if (this->m_iRetainedFrom < earliest) {
+            this->m_iRetainedFrom = this->m_iRetainedTo = earliest;
+            this->m_iRetainedBytes = 0;
+          }
+          for (; this->m_iRetainedTo <= latest; this->m_iRetainedTo ++) {
+            this->m_pLog->getEntryInfoByIndex(this->m_iRetainedTo,ver,hlc,size);
+            this->m_iRetainedBytes += size;
+          }
+          while (this->m_iRetainedBytes > policy.max_bytes && this->m_iRetainedFrom < latest) {
+            this->m_pLog->getEntryInfoByIndex(this->m_iRetainedFrom,ver,hlc,size);
+            this->m_iRetainedBytes -= size;
+            this->m_iRetainedFrom ++;
+          }
+          last = MAX(last,this->m_iRetainedFrom - 1);
+        }
+        // keep the latest version and everything not persisted everywhere.
+        const int64_t limit = MIN(frontier,this->m_pLog->getLastPersisted());
+        if (last < earliest || limit == INVALID_VERSION) {
+          return;
+        }
+        const int64_t limit_idx = this->m_pLog->getVersionIndex(limit);
+        if (limit_idx == INVALID_INDEX) {
+          return;
+        }
+        last = MIN(last,MIN(latest - 1,limit_idx));
+        if (last < earliest) {
+          return;
+        }
+        this->m_pLog->getEntryInfoByIndex(last,ver,hlc,size);
+        dbg_trace("retention trims up to version {}",ver);
+        trim(ver);
+      }
+
       template <typename TKey>
       void trim (const TKey &k) noexcept(false) {
         dbg_trace("trim.");
-        this->m_pLog->trim(k);
+        trim_impl(k,DeltaTag{});
+        if (this->m_pKeyIndex != nullptr) {
+          this->m_pKeyIndex->compact((this->m_pLog->getLength() > 0) ?
+            this->m_pLog->getEarliestIndex() : this->m_pLog->getLatestIndex() + 1);
+        }
+        {
+          // trimmed versions are never served, so just free them.
+          const int64_t earliest = (this->m_pLog->getLength() > 0) ?
+            this->m_pLog->getEarliestVersion() : INT64_MAX;
+          std::lock_guard<std::mutex> lck(this->m_mtxVersionCache);
+          for (auto itr = this->m_lVersionCacheLRU.begin(); itr != this->m_lVersionCacheLRU.end();) {
+            if (itr->ver < earliest) {
+              this->m_iVersionCacheBytes -= itr->size;
+              this->m_mVersionCache.erase(itr->ver);
+              itr = this->m_lVersionCacheLRU.erase(itr);
+            } else {
+              itr ++;
+            }
+          }
+        }
         dbg_trace("trim...done");
       }
 
@@ -415,6 +1588,13 @@ namespace ns_persistent {
         if (m_pRegistry != nullptr && m_pRegistry->getFrontier() <= hlc) {
           throw PERSIST_EXP_BEYOND_GSF;
         }
+        if (DeltaTag::value) {
+          const int64_t idx = this->m_pLog->getHLCIndex(hlc);
+          if (idx == INVALID_INDEX) {
+            throw PERSIST_EXP_INV_HLC;
+          }
+          return run_by_index(idx,fun,dm,DeltaTag{});
+        }
         char * pdat = (char*)this->m_pLog->getEntry(hlc);
         if (pdat == nullptr) {
           throw PERSIST_EXP_INV_HLC;
@@ -431,6 +1611,13 @@ namespace ns_persistent {
         if (m_pRegistry != nullptr && m_pRegistry->getFrontier() <= hlc) {
           throw PERSIST_EXP_BEYOND_GSF;
         }
+        if (DeltaTag::value) {
+          const int64_t idx = this->m_pLog->getHLCIndex(hlc);
+          if (idx == INVALID_INDEX) {
+            throw PERSIST_EXP_INV_HLC;
+          }
+          return load_by_index(idx,dm,DeltaTag{});
+        }
         char const * pdat = (char const *)this->m_pLog->getEntry(hlc);
         if (pdat == nullptr) {
           throw PERSIST_EXP_INV_HLC;
@@ -439,6 +1626,45 @@ namespace ns_persistent {
         return mutils::from_bytes<ObjectType>(dm,pdat);
       }
 
+      // wait until the versions at hlc are stable, so that the queries at hlc
+      // in this shard see the same versions as in every other shard. Used by
+      // the handlers of snapshot queries, see ShardIterator::p2p_query_at().
+      // return false if hlc is still beyond the frontier after timeout_us.
+      bool waitForFrontier(const HLC & hlc, const uint64_t & timeout_us) {
+        return (m_pRegistry == nullptr) || m_pRegistry->waitForFrontier(hlc,timeout_us);
+      }
+
+      // visit the versions of T in [from,to], oldest first: fun is fed with
+      // the version number, its hlc and the object. All of them are read from
+      // one snapshot of the log and deserialized one at a time.
+      // zerocopy: the object will not live once fun returns.
+      // return the number of versions visited.
+      template <typename Func>
+      int64_t getRange(
+        const int64_t & from,
+        const int64_t & to,
+        const Func & fun,
+        mutils::DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        return this->m_pLog->scanVersions(from,to,range_visitor(fun,dm,DeltaTag{}));
+      }
+
+      // visit the versions of T with hlcs in [from,to] in log order, see
+      // getRange() by version.
+      template <typename Func>
+      int64_t getRange(
+        const HLC & from,
+        const HLC & to,
+        const Func & fun,
+        mutils::DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        // global stability frontier test
+        if (m_pRegistry != nullptr && m_pRegistry->getFrontier() <= to) {
+          throw PERSIST_EXP_BEYOND_GSF;
+        }
+        return this->m_pLog->scanHLCs(from,to,range_visitor(fun,dm,DeltaTag{}));
+      }
+
       // syntax sugar: get a specified version of T without DSM
 /*
       std::unique_ptr<ObjectType> operator [](const int64_t idx)
@@ -459,6 +1685,100 @@ namespace ns_persistent {
         return this->get(hlc);
       }
 
+      // for a delta-enabled type, run fun(full, pdat) on the log entry of
+      // exactly version ver without rebuilding the object: full tells if the
+      // entry is a checkpoint, and pdat points to the serialized object or
+      // delta after the tag, valid only during the call. Returns false if the
+      // log does not have the version, e.g. because it has been trimmed.
+      template <typename Func>
+      bool visitDeltaEntry(const int64_t & ver, const Func & fun)
+        noexcept(false) {
+        static_assert(DeltaTag::value, "visitDeltaEntry() needs a type with IDeltaSupport");
+        this->m_pLog->pin();
+        try {
+          const int64_t idx = this->m_pLog->getVersionIndex(ver);
+          int64_t ever = INVALID_VERSION;
+          HLC ehlc(0,0);
+          uint64_t esize;
+          if (idx != INVALID_INDEX) {
+            this->m_pLog->getEntryInfoByIndex(idx,ever,ehlc,esize);
+          }
+          if (ever != ver) {
+            this->m_pLog->unpin();
+            return false;
+          }
+          char const * pdat = (char const *)this->m_pLog->getEntryByIndex(idx);
+          fun(*(const uint64_t *)pdat == DELTA_ENTRY_FULL, pdat + DELTA_ENTRY_HEADER_SIZE);
+        } catch (...) {
+          this->m_pLog->unpin();
+          throw;
+        }
+        this->m_pLog->unpin();
+        return true;
+      }
+
+      // get the latest version logged at or before an HLC clock, or
+      // INVALID_VERSION if there is none. Like get(hlc), it throws
+      // PERSIST_EXP_BEYOND_GSF for a clock past the global stability frontier.
+      int64_t getVersionAt(const HLC & hlc)
+        noexcept(false) {
+        if (m_pRegistry != nullptr && m_pRegistry->getFrontier() <= hlc) {
+          throw PERSIST_EXP_BEYOND_GSF;
+        }
+        const int64_t idx = this->m_pLog->getHLCIndex(hlc);
+        if (idx == INVALID_INDEX) {
+          return INVALID_VERSION;
+        }
+        int64_t ver;
+        HLC ehlc(0,0);
+        uint64_t size;
+        this->m_pLog->getEntryInfoByIndex(idx,ver,ehlc,size);
+        return ver;
+      }
+
+      // for a type with IKeyIndexSupport, get the latest version up to ver
+      // that changed a key with the hash, from the key index. The key has
+      // the same value in that version as in ver, so it can be read from
+      // that one entry. Returns INVALID_VERSION if no version up to ver
+      // changed the key. Throws PERSIST_EXP_KEY_INDEX_GAP if the index does
+      // not cover the versions needed, e.g. after a catch-up, until the next
+      // version made.
+      int64_t getKeyVersion(const uint64_t & key_hash, const int64_t & ver)
+        noexcept(false) {
+        static_assert(KeyIndexTag::value, "getKeyVersion() needs a type with IKeyIndexSupport");
+        if (this->m_pKeyIndex->getNextIndex() <= this->m_pLog->getLatestIndex()) {
+          throw PERSIST_EXP_KEY_INDEX_GAP;
+        }
+        int64_t idx = this->m_pKeyIndex->lookup(key_hash,ver);
+        if (idx == INVALID_INDEX) {
+          if (this->m_pKeyIndex->getCoveredFrom() > 0) {
+            throw PERSIST_EXP_KEY_INDEX_GAP;
+          }
+          return INVALID_VERSION;
+        }
+        int64_t ever;
+        HLC ehlc(0,0);
+        uint64_t esize;
+        // a trimmed entry's value is in the remaining ones up to ver.
+        const int64_t earliest = this->m_pLog->getEarliestIndex();
+        if (earliest != INVALID_INDEX && idx < earliest) {
+          this->m_pLog->getEntryInfoByIndex(earliest,ever,ehlc,esize);
+          if (ever > ver) {
+            throw PERSIST_EXP_INV_VERSION;
+          }
+          idx = earliest;
+        }
+        this->m_pLog->getEntryInfoByIndex(idx,ever,ehlc,esize);
+        return ever;
+      }
+
+      // the same, for the latest version logged at or before an HLC clock.
+      int64_t getKeyVersion(const uint64_t & key_hash, const HLC & hlc)
+        noexcept(false) {
+        const int64_t ver = getVersionAt(hlc);
+        return (ver == INVALID_VERSION) ? INVALID_VERSION : getKeyVersion(key_hash,ver);
+      }
+
       // get number of the versions
       virtual int64_t getNumOfVersions() noexcept(false) {
         return this->m_pLog->getLength();
@@ -488,12 +1808,18 @@ namespace ns_persistent {
       virtual void set(const ObjectType &v, const int64_t & ver, const HLC &mhlc) 
         noexcept(false) {
         dbg_trace("append to log with ver({}),hlc({},{})",ver,mhlc.m_rtc_us,mhlc.m_logic);
-        auto size = mutils::bytes_size(v);
+        // entries of delta-enabled types are tagged; this one is a checkpoint.
+        const std::size_t hdr_size = DeltaTag::value ? DELTA_ENTRY_HEADER_SIZE : 0;
+        auto size = mutils::bytes_size(v) + hdr_size;
         char *buf = new char[size];
         bzero(buf,size);
-        mutils::to_bytes(v,buf);
+        if (DeltaTag::value) {
+          *(uint64_t *)buf = DELTA_ENTRY_FULL;
+        }
+        mutils::to_bytes(v,buf + hdr_size);
         this->m_pLog->append((void*)buf,size,ver,mhlc);
         delete buf;
+        this->m_iDeltasSinceCheckpoint = 0;
       };
 
       // make a version with version
@@ -518,7 +1844,21 @@ namespace ns_persistent {
         noexcept(false) {
         //TODO: compare if value has been changed?
         dbg_trace("In Persistent<T>: make version {}.",ver);
-        this->set(*this->m_pWrappedObject,ver);
+        if (this->m_pKeyIndex == nullptr) {
+          version_impl(ver,DeltaTag{});
+          return;
+        }
+        std::vector<uint64_t> hashes;
+        key_hashes(hashes,KeyIndexTag{});
+        version_impl(ver,DeltaTag{});
+        this->m_pKeyIndex->append(hashes,ver,this->m_pLog->getLatestIndex());
+      }
+
+      /** set how often a delta-enabled type logs a full checkpoint
+       * @param interval The number of deltas between two checkpoints.
+       */
+      void setDeltaCheckpointInterval(const uint64_t & interval) noexcept(true) {
+        this->m_iDeltaCheckpointInterval = interval;
       }
 
       /** persist till version
@@ -527,6 +1867,10 @@ namespace ns_persistent {
        */
       virtual const int64_t persist()
         noexcept(false){
+        // the index must have every entry that is persisted.
+        if (this->m_pKeyIndex != nullptr) {
+          this->m_pKeyIndex->sync();
+        }
 #if defined(_PERFORMANCE_DEBUG) || defined(_DEBUG)
         struct timespec t1,t2;
         clock_gettime(CLOCK_REALTIME,&t1);
@@ -540,6 +1884,109 @@ namespace ns_persistent {
 #endif//_PERFORMANCE_DEBUG
       }
 
+      // get the version and hlc of the latest entry, see ILogCatchUpSupport.
+      virtual bool getLatestEntry(int64_t & ver, HLC & hlc) noexcept(false) {
+        if (this->m_pLog->getLength() == 0) {
+          return false;
+        }
+        uint64_t size;
+        this->m_pLog->getEntryInfoByIndex(-1L,ver,hlc,size);
+        return true;
+      }
+
+      // append the entries after ver up to upto, see ILogCatchUpSupport.
+      // Each entry is its version, hlc and length, followed by its data.
+      virtual bool logTailToBytes(const int64_t & ver, const HLC & hlc,
+        const int64_t & upto, std::vector<char> & buf) noexcept(false) {
+        std::vector<char> tail;
+        // keep the entries mapped while we copy them.
+        this->m_pLog->pin();
+        try {
+          int64_t ever;
+          HLC ehlc(0,0);
+          uint64_t esize;
+          int64_t first;
+          if (ver == INVALID_VERSION) {
+            first = this->m_pLog->getEarliestIndex();
+            if (first != 0) {
+              // the start of the log is gone, or there is none.
+              this->m_pLog->unpin();
+              return false;
+            }
+          } else {
+            const int64_t idx = this->m_pLog->getVersionIndex(ver);
+            if (idx == INVALID_INDEX) {
+              this->m_pLog->unpin();
+              return false;
+            }
+            this->m_pLog->getEntryInfoByIndex(idx,ever,ehlc,esize);
+            if (ever != ver || !(ehlc == hlc)) {
+              // the other log has diverged from this one.
+              this->m_pLog->unpin();
+              return false;
+            }
+            first = idx + 1;
+          }
+          const int64_t latest = this->m_pLog->getLatestIndex();
+          for (int64_t i = first; i <= latest; i ++) {
+            this->m_pLog->getEntryInfoByIndex(i,ever,ehlc,esize);
+            if (ever > upto) {
+              break;
+            }
+            const uint64_t entry[4] = {(uint64_t)ever,ehlc.m_rtc_us,ehlc.m_logic,esize};
+            tail.insert(tail.end(),(const char *)entry,(const char *)entry + sizeof(entry));
+            const char * pdat = (const char *)this->m_pLog->getEntryByIndex(i);
+            tail.insert(tail.end(),pdat,pdat + esize);
+          }
+        } catch (uint64_t e) {
+          // the entries were trimmed while we were copying them.
+          this->m_pLog->unpin();
+          if ((e >> 32) == (PERSIST_EXP_INV_ENTRY_IDX(0) >> 32)) {
+            return false;
+          }
+          throw;
+        }
+        this->m_pLog->unpin();
+        buf.insert(buf.end(),tail.begin(),tail.end());
+        return true;
+      }
+
+      // append the value at a version, see ILogCatchUpSupport.
+      virtual void versionToBytes(const int64_t & ver, std::vector<char> & buf) noexcept(false) {
+        std::unique_ptr<ObjectType> obj = this->get(ver);
+        const std::size_t ofst = buf.size();
+        buf.resize(ofst + mutils::bytes_size(*obj));
+        mutils::to_bytes(*obj,buf.data() + ofst);
+      }
+
+      // append the entries from logTailToBytes(), see ILogCatchUpSupport.
+      virtual void applyLogTail(char const * tail, std::size_t size) noexcept(false) {
+        char const * const end = tail + size;
+        while (tail < end) {
+          uint64_t entry[4];
+          memcpy(entry,tail,sizeof(entry));
+          tail += sizeof(entry);
+          this->m_pLog->append(tail,entry[3],(int64_t)entry[0],HLC(entry[1],entry[2]));
+          tail += entry[3];
+        }
+        this->m_pLog->persist();
+      }
+
+      // copy the log up to hlc, see ILogCatchUpSupport. A log whose entries
+      // up to hlc have been trimmed can't be copied as of hlc.
+      virtual int64_t checkpointLog(const std::string & targetPath, const HLC & hlc) noexcept(false) {
+        int64_t ver = INVALID_VERSION;
+        const int64_t idx = this->m_pLog->getHLCIndex(hlc);
+        if (idx != INVALID_INDEX) {
+          HLC ehlc(0,0);
+          uint64_t esize;
+          this->m_pLog->getEntryInfoByIndex(idx,ver,ehlc,esize);
+        } else if (this->m_pLog->getEarliestIndex() > 0) {
+          throw PERSIST_EXP_INV_HLC;
+        }
+        return this->m_pLog->checkpoint(targetPath,ver);
+      }
+
       // internal _NameMaker class
       class _NameMaker{
       public:
@@ -589,31 +2036,78 @@ namespace ns_persistent {
   protected:
       // PersistLog
       std::unique_ptr<PersistLog> m_pLog;
+      // the key index of a type with IKeyIndexSupport, or nullptr
+      std::unique_ptr<KeyIndex> m_pKeyIndex;
       // Persistence Registry
       PersistentRegistry* m_pRegistry;
+      // delta-enabled types log a full checkpoint every
+      // m_iDeltaCheckpointInterval versions. The first version is always one.
+      uint64_t m_iDeltaCheckpointInterval = DEFAULT_DELTA_CHECKPOINT_INTERVAL;
+      uint64_t m_iDeltasSinceCheckpoint = DEFAULT_DELTA_CHECKPOINT_INTERVAL;
+      // the serialized recently reconstructed versions, by index
+      std::map<int64_t,std::unique_ptr<char[]>> m_mDeltaCache;
+      std::mutex m_mtxDeltaCache;
+      // the deserialized versions shared by getShared(), most recently used
+      // first, and their serialized sizes.
+      struct CachedVersion {
+        int64_t ver;
+        uint64_t size;
+        std::shared_ptr<const ObjectType> obj;
+      };
+      uint64_t m_iVersionCacheCapacity = 0;
+      uint64_t m_iVersionCacheBytes = 0;
+      std::list<CachedVersion> m_lVersionCacheLRU;
+      std::map<int64_t,typename std::list<CachedVersion>::iterator> m_mVersionCache;
+      std::mutex m_mtxVersionCache;
+      // the retention policy, and the entries whose sizes enforceRetention()
+      // has added up so far. Protected by m_mtxRetention.
+      RetentionPolicy m_retention;
+      int64_t m_iRetainedFrom = 0;
+      int64_t m_iRetainedTo = 0;
+      uint64_t m_iRetainedBytes = 0;
+      std::mutex m_mtxRetention;
       // get the static name maker.
       static _NameMaker & getNameMaker();
 
   //serialization supports
   public:
+      // the version to serialize a reference to instead of the value, or
+      // INVALID_VERSION to serialize the value. See
+      // PersistentRegistry::setSerializeByReference().
+      int64_t reference_version() const {
+          if (this->m_pRegistry == nullptr || !this->m_pRegistry->serializesByReference()) {
+              return INVALID_VERSION;
+          }
+          return this->m_pLog->getLatestVersion();
+      }
       std::size_t to_bytes(char* ret) const {
-          std::size_t sz = 0; 
           // variable name
-          sz = mutils::to_bytes(this->m_pLog->m_sName.c_str(),ret+sz);
-          // wrapped object
-          sz = mutils::to_bytes(*this->m_pWrappedObject,ret+sz);
-          // TODO:the persistent log is missing for now. 
-          // we should add the log later... a more sophisticated but practical
-          // scenario is send a log delta here for a crashed node to catch up.
+          std::size_t sz = mutils::to_bytes(this->m_pLog->m_sName.c_str(),ret);
+          const int64_t ref_ver = reference_version();
+          if (ref_ver == INVALID_VERSION) {
+              // wrapped object
+              ret[sz++] = PERSISTENT_SERIALIZED_VALUE;
+              sz += mutils::to_bytes(*this->m_pWrappedObject,ret+sz);
+          } else {
+              ret[sz++] = PERSISTENT_SERIALIZED_REFERENCE;
+              memcpy(ret+sz,&ref_ver,sizeof(ref_ver));
+              sz += sizeof(ref_ver);
+          }
+          // The log itself is not serialized. A node catching up gets the
+          // entries it is missing through PersistentRegistry::getCatchUp().
           return sz;
       }
       std::size_t bytes_size() const {
-          return mutils::bytes_size(this->m_pLog->m_sName.c_str()) +
-              mutils::bytes_size(*this->m_pWrappedObject);
+          return mutils::bytes_size(this->m_pLog->m_sName.c_str()) + 1 +
+              ((reference_version() == INVALID_VERSION) ?
+                mutils::bytes_size(*this->m_pWrappedObject) : sizeof(int64_t));
       }
+      // always posts the value.
       void post_object(const std::function<void (char const * const, std::size_t)> &f)
       const {
           mutils::post_object(f,this->m_pLog->m_sName.c_str());
+          const char kind = PERSISTENT_SERIALIZED_VALUE;
+          f(&kind,1);
           mutils::post_object(f,*this->m_pWrappedObject);
       }
       // NOTE: we do not set up the registry here. This will only happen in the
@@ -621,10 +2115,27 @@ namespace ns_persistent {
       static std::unique_ptr<Persistent> from_bytes(mutils::DeserializationManager* p, char const *v){
           auto name = mutils::from_bytes<char*>(p,v);
           auto sz_name = mutils::bytes_size(*name);
-          auto wrapped_obj = mutils::from_bytes<ObjectType>(p, v + sz_name);
-          std::unique_ptr<PersistLog> null_log = nullptr;//TODO: deserialization
+          std::unique_ptr<ObjectType> wrapped_obj = nullptr;
+          std::unique_ptr<PersistLog> null_log = nullptr;
           PersistentRegistry & pr = p->template mgr<PersistentRegistry> ();
-          return std::make_unique<Persistent>(*name,wrapped_obj,null_log,&pr);
+          if (v[sz_name] == PERSISTENT_SERIALIZED_VALUE) {
+              wrapped_obj = mutils::from_bytes<ObjectType>(p, v + sz_name + 1);
+              return std::make_unique<Persistent>(*name,wrapped_obj,null_log,&pr);
+          }
+          // A reference: the catch-up applied to the registry has either
+          // brought the value, or the log entries up to this version.
+          int64_t ver;
+          memcpy(&ver,v + sz_name + 1,sizeof(ver));
+          std::vector<char> value;
+          const bool has_value = pr.takeCaughtUpValue(*name,value);
+          if (has_value) {
+              wrapped_obj = mutils::from_bytes<ObjectType>(p, value.data());
+          }
+          auto ret = std::make_unique<Persistent>(*name,wrapped_obj,null_log,&pr);
+          if (!has_value && ret->getLatestVersion() != ver) {
+              throw PERSIST_EXP_INV_VERSION;
+          }
+          return ret;
       }
       // derived from ByteRepresentable
       virtual void ensure_registered(mutils::DeserializationManager&){}
@@ -662,11 +2173,13 @@ namespace ns_persistent {
      * log and register itself to a persistent registry.
      * @param object_name This name is used for persistent data in file.
      * @param persistent_registry A normal pointer to the registry.
+     * @param segment_size The size of the data segment files.
      */
     Volatile(
       const char * object_name = nullptr,
-      PersistentRegistry * persistent_registry = nullptr) noexcept(false)
-      : Persistent<ObjectType,ST_MEM>(object_name,persistent_registry) {}
+      PersistentRegistry * persistent_registry = nullptr,
+      const uint64_t segment_size = DEFAULT_DATA_SEGMENT_SIZE) noexcept(false)
+      : Persistent<ObjectType,ST_MEM>(object_name,persistent_registry,segment_size) {}
 
     /** constructor 2 is move constructor. It "steals" the resource from
      * another object.
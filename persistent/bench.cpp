@@ -0,0 +1,411 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <spdlog/spdlog.h>
+#include <SerializationSupport.hpp>
+#include "Persistent.hpp"
+#include "FilePersistLog.hpp"
+#include "HLC.hpp"
+#include "util.hpp"
+
+using namespace ns_persistent;
+using namespace mutils;
+
+// Microbenchmarks of the storage layer: FilePersistLog directly, and
+// Persistent<T> on top of it. Each benchmark builds its logs from scratch in
+// BENCH_DATA_PATH (Persistent<T> in DEFAULT_FILE_PERSIST_LOG_DATA_PATH) and
+// removes them afterwards, and reports latencies as percentiles.
+#define BENCH_DATA_PATH (".plog_bench")
+#define BENCH_LOG_NAME ("bench")
+// the most bytes an append benchmark writes for one entry size
+#define BENCH_MAX_APPEND_BYTES (1UL<<28)
+
+// A blob serialized as its size followed by its bytes.
+class Blob : public ByteRepresentable{
+public:
+  std::size_t size;
+  const char * data;
+  std::unique_ptr<char[]> own_data;
+
+  Blob () : size(0), data(nullptr) {
+  }
+
+  Blob (const char * _data, const std::size_t _size, bool copy) : size(_size), data(_data) {
+    if (copy) {
+      own_data = std::make_unique<char[]>(size);
+      memcpy(own_data.get(),_data,size);
+      data = own_data.get();
+    }
+  }
+
+  virtual std::size_t to_bytes(char *v) const {
+    ((std::size_t*)v)[0] = size;
+    memcpy(v + sizeof(size),data,size);
+    return size + sizeof(size);
+  };
+
+  virtual void post_object(const std::function<void (char const * const,std::size_t)>& func) const {
+    func((char const *)&size,sizeof(size));
+    func(data,size);
+  };
+
+  virtual std::size_t bytes_size() const {
+    return size + sizeof(size);
+  };
+
+  virtual void ensure_registered(DeserializationManager &dsm) {
+  };
+
+  static std::unique_ptr<Blob> from_bytes(DeserializationManager *dsm, char const * const v) {
+    return std::make_unique<Blob>(v + sizeof(std::size_t),((std::size_t*)v)[0],true);
+  };
+};
+
+static void printhelp(){
+  cout << "usage:" << endl;
+  cout << "\tappend <num> <size> [size...]" << endl;
+  cout << "\tpersist <rounds> <size> <batch> [batch...]" << endl;
+  cout << "\tlookup <num> <length> [length...]" << endl;
+  cout << "\treaders <num> <length> <threads>" << endl;
+  cout << "\ttrim <length> <entries per trim>" << endl;
+  cout << "\tload <rounds> <size> <length> [length...]" << endl;
+  cout << "\tpersistent <num> <size>" << endl;
+  cout << "\tall" << endl;
+  cout << "Latencies are in microseconds. Logs are built in " << BENCH_DATA_PATH
+       << " and\nremoved afterwards; the file system it is on is what is measured." << endl;
+}
+
+static inline long now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static double percentile(const std::vector<long> & sorted_values, double q) {
+  if (sorted_values.empty()) {
+    return 0;
+  }
+  size_t rank = std::min(sorted_values.size() - 1, (size_t)std::ceil(q * sorted_values.size()) - 1);
+  return sorted_values[rank];
+}
+
+// print the distribution of latencies in nanoseconds, sorting them.
+static void print_latency(const string & what, std::vector<long> & latencies){
+  std::sort(latencies.begin(),latencies.end());
+  const double mean = latencies.empty() ? 0 :
+    std::accumulate(latencies.begin(),latencies.end(),0.0) / latencies.size();
+  cout << what << "(us):\tmean=" << mean/1e3
+       << "\tp50=" << percentile(latencies,0.5)/1e3
+       << "\tp90=" << percentile(latencies,0.9)/1e3
+       << "\tp99=" << percentile(latencies,0.99)/1e3
+       << "\tp99.9=" << percentile(latencies,0.999)/1e3
+       << "\tmax=" << (latencies.empty() ? 0 : latencies.back()/1e3) << endl;
+}
+
+// remove the files of a log, which FilePersistLog names <name>.<suffix>[.n]
+static void remove_log(const string & dataPath, const string & name){
+  DIR * dir = opendir(dataPath.c_str());
+  if (dir == nullptr) {
+    return;
+  }
+  const string prefix = name + ".";
+  struct dirent * ent;
+  while ((ent = readdir(dir)) != nullptr) {
+    if (strncmp(ent->d_name,prefix.c_str(),prefix.size()) == 0) {
+      unlink((dataPath + "/" + ent->d_name).c_str());
+    }
+  }
+  closedir(dir);
+}
+
+// a log that is removed when it goes out of scope
+class BenchLog {
+public:
+  std::unique_ptr<FilePersistLog> log;
+
+  BenchLog() {
+    remove_log(BENCH_DATA_PATH,BENCH_LOG_NAME);
+    open();
+  }
+  ~BenchLog() {
+    log.reset();
+    remove_log(BENCH_DATA_PATH,BENCH_LOG_NAME);
+  }
+  // (re)load the log from its files
+  void open() {
+    log.reset();
+    log = std::make_unique<FilePersistLog>(BENCH_LOG_NAME,BENCH_DATA_PATH);
+  }
+  // append num entries of size bytes, with version v and HLC (v+1,0) for the
+  // v-th, and persist them.
+  void fill(int64_t num, std::size_t size) {
+    std::vector<char> buf(size,'x');
+    int64_t ver = log->getLatestVersion() + 1;
+    for (int64_t i = 0; i < num; i++, ver++) {
+      log->append(buf.data(),size,ver,HLC(ver+1,0));
+      if (i % 4096 == 4095) {
+        log->persist();
+      }
+    }
+    log->persist();
+  }
+};
+
+// append throughput vs. entry size; the entries are persisted at the end.
+static void bench_append(int64_t nops, const std::vector<std::size_t> & sizes){
+  for (const std::size_t size : sizes) {
+    const int64_t num = std::min(nops,(int64_t)(BENCH_MAX_APPEND_BYTES/size));
+    BenchLog bl;
+    std::vector<char> buf(size,'x');
+    std::vector<long> latencies;
+    latencies.reserve(num);
+    const long ts = now_ns();
+    for (int64_t ver = 0; ver < num; ver++) {
+      const long t = now_ns();
+      bl.log->append(buf.data(),size,ver,HLC(ver+1,0));
+      latencies.push_back(now_ns() - t);
+    }
+    bl.log->persist();
+    const long nsec = now_ns() - ts;
+    cout << "APPEND(size=" << size << " byte, ops=" << num << ")" << endl;
+    cout << "throughput:\t" << (double)size*num/nsec*1000 << " MB/s\t"
+         << (double)num/nsec*1e9 << " ops/s, including the final persist" << endl;
+    print_latency("append",latencies);
+  }
+}
+
+// persist latency vs. the number of entries appended since the last persist.
+// The rounds of a batch are cut to what fits in the log.
+static void bench_persist(int rounds, std::size_t size, const std::vector<int64_t> & batches){
+  for (const int64_t batch : batches) {
+    const int n = (int)std::min((int64_t)rounds,(int64_t)MAX_LOG_ENTRY/batch);
+    BenchLog bl;
+    std::vector<char> buf(size,'x');
+    std::vector<long> latencies;
+    int64_t ver = 0;
+    for (int r = 0; r < n; r++) {
+      for (int64_t i = 0; i < batch; i++, ver++) {
+        bl.log->append(buf.data(),size,ver,HLC(ver+1,0));
+      }
+      const long t = now_ns();
+      bl.log->persist();
+      latencies.push_back(now_ns() - t);
+    }
+    cout << "PERSIST(size=" << size << " byte, batch=" << batch << ", rounds=" << rounds << ")" << endl;
+    print_latency("persist",latencies);
+  }
+}
+
+// time nops random lookups; lookup(i) looks up the entry i.
+static std::vector<long> time_lookups(int64_t nops, int64_t length,
+  const std::function<const void*(int64_t)> & lookup){
+  std::mt19937_64 engine{std::random_device{}()};
+  std::uniform_int_distribution<int64_t> dist(0,length-1);
+  std::vector<long> latencies;
+  latencies.reserve(nops);
+  for (int64_t i = 0; i < nops; i++) {
+    const int64_t v = dist(engine);
+    const long t = now_ns();
+    const void * pdata = lookup(v);
+    latencies.push_back(now_ns() - t);
+    if (pdata == nullptr) {
+      cout << "entry " << v << " not found" << endl;
+      break;
+    }
+  }
+  return latencies;
+}
+
+// getEntry(ver) and getEntry(HLC) latency vs. log length.
+static void bench_lookup(int64_t nops, const std::vector<int64_t> & lengths){
+  for (const int64_t length : lengths) {
+    BenchLog bl;
+    bl.fill(length,64);
+    cout << "LOOKUP(length=" << length << ", ops=" << nops << ")" << endl;
+    std::vector<long> latencies = time_lookups(nops,length,
+      [&](int64_t v){ return bl.log->getEntry(v); });
+    print_latency("getEntry(ver)",latencies);
+    latencies = time_lookups(nops,length,
+      [&](int64_t v){ return bl.log->getEntry(HLC(v+1,0)); });
+    print_latency("getEntry(HLC)",latencies);
+  }
+}
+
+// getEntry(ver) throughput and latency with 1,2,4...maxThreads readers.
+static void bench_readers(int64_t nops, int64_t length, int maxThreads){
+  BenchLog bl;
+  bl.fill(length,64);
+  for (int nthreads = 1; nthreads <= maxThreads; nthreads *= 2) {
+    std::vector<std::vector<long>> perThread(nthreads);
+    std::vector<std::thread> threads;
+    const long ts = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+      threads.emplace_back([&,i](){
+        perThread[i] = time_lookups(nops,length,
+          [&](int64_t v){ return bl.log->getEntry(v); });
+      });
+    }
+    for (auto & t : threads) {
+      t.join();
+    }
+    const long nsec = now_ns() - ts;
+    std::vector<long> latencies;
+    for (auto & l : perThread) {
+      latencies.insert(latencies.end(),l.begin(),l.end());
+    }
+    cout << "READERS(threads=" << nthreads << ", length=" << length << ", ops=" << nops << " per thread)" << endl;
+    cout << "throughput:\t" << (double)latencies.size()/nsec*1e9 << " ops/s" << endl;
+    print_latency("getEntry(ver)",latencies);
+  }
+}
+
+// the cost of trimming a log step entries at a time, and of the persist that
+// follows each trim.
+static void bench_trim(int64_t length, int64_t step){
+  BenchLog bl;
+  bl.fill(length,64);
+  std::vector<long> trims,persists;
+  for (int64_t ver = step - 1; ver < length; ver += step) {
+    long t = now_ns();
+    bl.log->trim(ver);
+    trims.push_back(now_ns() - t);
+    t = now_ns();
+    bl.log->persist();
+    persists.push_back(now_ns() - t);
+  }
+  cout << "TRIM(length=" << length << ", entries per trim=" << step << ")" << endl;
+  print_latency("trim",trims);
+  print_latency("persist after trim",persists);
+}
+
+// the time to load a log from its files vs. its length. The files are in the
+// page cache after the first round.
+static void bench_load(int rounds, std::size_t size, const std::vector<int64_t> & lengths){
+  for (const int64_t length : lengths) {
+    BenchLog bl;
+    bl.fill(length,size);
+    std::vector<long> latencies;
+    for (int r = 0; r < rounds; r++) {
+      bl.log.reset();
+      const long t = now_ns();
+      bl.open();
+      latencies.push_back(now_ns() - t);
+      if (bl.log->getLength() != length) {
+        cout << "loaded " << bl.log->getLength() << " entries instead of " << length << endl;
+      }
+    }
+    cout << "LOAD(length=" << length << ", size=" << size << " byte, rounds=" << rounds << ")" << endl;
+    print_latency("load",latencies);
+  }
+}
+
+// Persistent<T>: set() followed by persist(), and get() by version and HLC.
+static void bench_persistent(int64_t nops, std::size_t size){
+  const string name = string(BENCH_LOG_NAME) + "_persistent";
+  remove_log(DEFAULT_FILE_PERSIST_LOG_DATA_PATH,name);
+  {
+    Persistent<Blob> pvar(name.c_str());
+    std::unique_ptr<char[]> content = std::make_unique<char[]>(size);
+    memset(content.get(),'x',size);
+    Blob writeMe(content.get(),size,false);
+    std::vector<long> sets,persists;
+    for (int64_t ver = 0; ver < nops; ver++) {
+      long t = now_ns();
+      pvar.set(writeMe,ver,HLC(ver+1,0));
+      sets.push_back(now_ns() - t);
+      t = now_ns();
+      pvar.persist();
+      persists.push_back(now_ns() - t);
+    }
+    cout << "PERSISTENT(size=" << size << " byte, ops=" << nops << ")" << endl;
+    print_latency("set",sets);
+    print_latency("persist",persists);
+    std::size_t checksum = 0;
+    std::vector<long> latencies = time_lookups(nops,nops,[&](int64_t v){
+      auto obj = pvar.get(v);
+      checksum += obj->size;
+      return (const void*)obj->data;
+    });
+    print_latency("get(ver)",latencies);
+    latencies = time_lookups(nops,nops,[&](int64_t v){
+      auto obj = pvar.get(HLC(v+1,0));
+      checksum += obj->size;
+      return (const void*)obj->data;
+    });
+    print_latency("get(HLC)",latencies);
+    dbg_trace("checksum={}",checksum);
+  }
+  remove_log(DEFAULT_FILE_PERSIST_LOG_DATA_PATH,name);
+}
+
+template <typename T>
+static std::vector<T> parse_list(int argc, char ** argv, int from){
+  std::vector<T> values;
+  for (int i = from; i < argc; i++) {
+    values.push_back((T)atol(argv[i]));
+  }
+  return values;
+}
+
+int main(int argc,char ** argv){
+  spdlog::set_level(spdlog::level::info);
+
+  if(argc <2){
+    printhelp();
+    return 0;
+  }
+
+  try{
+    const string cmd = argv[1];
+    if (cmd == "append" && argc >= 4) {
+      bench_append(atol(argv[2]),parse_list<std::size_t>(argc,argv,3));
+    }
+    else if (cmd == "persist" && argc >= 5) {
+      bench_persist(atoi(argv[2]),atol(argv[3]),parse_list<int64_t>(argc,argv,4));
+    }
+    else if (cmd == "lookup" && argc >= 4) {
+      bench_lookup(atol(argv[2]),parse_list<int64_t>(argc,argv,3));
+    }
+    else if (cmd == "readers" && argc >= 5) {
+      bench_readers(atol(argv[2]),atol(argv[3]),atoi(argv[4]));
+    }
+    else if (cmd == "trim" && argc >= 4) {
+      bench_trim(atol(argv[2]),atol(argv[3]));
+    }
+    else if (cmd == "load" && argc >= 5) {
+      bench_load(atoi(argv[2]),atol(argv[3]),parse_list<int64_t>(argc,argv,4));
+    }
+    else if (cmd == "persistent" && argc >= 4) {
+      bench_persistent(atol(argv[2]),atol(argv[3]));
+    }
+    else if (cmd == "all") {
+      bench_append(100000,{64,1024,16384,262144});
+      bench_persist(1000,256,{1,16,256,4096});
+      bench_lookup(100000,{1024,65536,1000000});
+      bench_readers(100000,65536,(int)std::max(1u,std::thread::hardware_concurrency()));
+      bench_trim(100000,1000);
+      bench_load(5,256,{1024,65536,1000000});
+      bench_persistent(10000,1024);
+    }
+    else {
+      printhelp();
+    }
+  }catch (unsigned long long exp){
+    cerr<<"Exception captured:0x"<<std::hex<<exp<<endl;
+    return -1;
+  }
+
+  return 0;
+}
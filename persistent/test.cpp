@@ -1,7 +1,11 @@
+#include <functional>
 #include <iostream>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <thread>
+#include <vector>
 #include <spdlog/spdlog.h>
 #include <SerializationSupport.hpp>
 #include "Persistent.hpp"
@@ -20,14 +24,17 @@ public:
   }
 };
 
+// the largest value of VariableBytes, it must fit in a data segment.
+#define MAX_VARIABLE_BYTES_SIZE (1UL<<23)
+
 // A variable that can change the length of its value
 class VariableBytes : public ByteRepresentable{
 public:
   std::size_t data_len;
-  char buf[MAX_DATA_SIZE];
+  char buf[MAX_VARIABLE_BYTES_SIZE];
 
   VariableBytes () {
-    data_len = MAX_DATA_SIZE;
+    data_len = MAX_VARIABLE_BYTES_SIZE;
   }
 
   virtual std::size_t to_bytes(char *v) const {
@@ -60,19 +67,70 @@ public:
   };
 };
 
+// A blob that can be deserialized in place: from_bytes_noalloc() returns an
+// object pointing to the serialized bytes instead of copying them.
+class Blob : public ByteRepresentable{
+public:
+  std::size_t size;
+  const char * data;
+  std::unique_ptr<char[]> own_data;
+
+  Blob () : size(0), data(nullptr) {
+  }
+
+  Blob (const char * _data, const std::size_t _size, bool copy) : size(_size), data(_data) {
+    if (copy) {
+      own_data = std::make_unique<char[]>(size);
+      memcpy(own_data.get(),_data,size);
+      data = own_data.get();
+    }
+  }
+
+  virtual std::size_t to_bytes(char *v) const {
+    ((std::size_t*)v)[0] = size;
+    memcpy(v + sizeof(size),data,size);
+    return size + sizeof(size);
+  };
+
+  virtual void post_object(const std::function<void (char const * const,std::size_t)>& func) const {
+    func((char const *)&size,sizeof(size));
+    func(data,size);
+  };
+
+  virtual std::size_t bytes_size() const {
+    return size + sizeof(size);
+  };
+
+  virtual void ensure_registered(DeserializationManager &dsm) {
+  };
+
+  static std::unique_ptr<Blob> from_bytes(DeserializationManager *dsm, char const * const v) {
+    return std::make_unique<Blob>(v + sizeof(std::size_t),((std::size_t*)v)[0],true);
+  };
+
+  static context_ptr<Blob> from_bytes_noalloc(DeserializationManager *dsm, char const * const v) {
+    return context_ptr<Blob>{new Blob(v + sizeof(std::size_t),((std::size_t*)v)[0],false)};
+  };
+};
+
 static void printhelp(){
   cout << "usage:" << endl;
   cout << "\tgetbyidx <index>" << endl;
   cout << "\tgetbyver <version>" << endl;
   cout << "\tgetbytime <timestamp>" << endl;
+  cout << "\tgetrange <from version> <to version>" << endl;
+  cout << "\tgetshared <version> <num>" << endl;
   cout << "\tset value version" << endl;
   cout << "\ttrimbyidx <index>" << endl;
   cout << "\ttrimbyver <version>" << endl;
   cout << "\ttrimbytime <time>" << endl;
+  cout << "\tretain <versions> <bytes>" << endl;
   cout << "\tlist" << endl;
   cout << "\tvolatile" << endl;
   cout << "\thlc" << endl;
+  cout << "\tevalhlc <threads> <ticks per thread>" << endl;
   cout << "\teval <file|mem> <datasize> <num> [batch]" << endl;
+  cout << "\tevalread <datasize> <num>" << endl;
   cout << "NOTICE: test can crash if <datasize> is too large(>8MB).\n"
        << "This is probably due to the stack size is limited. Try \n"
        << "  \"ulimit -s unlimited\"\n"
@@ -105,6 +163,7 @@ void listvar(Persistent<OT,st> &var){
 }
 
 static void test_hlc();
+static void eval_hlc(int nthreads, int nticks);
 template <StorageType st=ST_FILE>
 static void eval_write (std::size_t osize, int nops, bool batch) {
   VariableBytes writeMe;
@@ -138,6 +197,44 @@ static void eval_write (std::size_t osize, int nops, bool batch) {
   cout << "latency:\t" << lat_us << " microseconds" << endl;
 }
 
+// compare reading versions by copy to reading them through views
+static void eval_read (std::size_t osize, int nops) {
+  Persistent<Blob> pvar("evalread_blob");
+  const int nvers = 16;
+  std::unique_ptr<char[]> content = std::make_unique<char[]>(osize);
+  memset(content.get(),'x',osize);
+  int64_t ver = pvar.getLatestVersion();
+  ver = (ver==INVALID_VERSION)?0:ver+1;
+  for (int i = 0; i < nvers; i++) {
+    Blob writeMe(content.get(),osize,false);
+    pvar.set(writeMe,ver++);
+  }
+  pvar.persist();
+  const int64_t latest = pvar.getLatestIndex();
+
+  struct timespec ts,te;
+  std::size_t checksum = 0;
+  long nsec[2];
+  for (int zerocopy = 0; zerocopy < 2; zerocopy ++) {
+    clock_gettime(CLOCK_REALTIME,&ts);
+    for (int cnt = 0; cnt < nops; cnt ++) {
+      const int64_t idx = latest - (cnt % nvers);
+      if (zerocopy) {
+        auto view = pvar.getViewByIndex(idx);
+        checksum += view->data[cnt % osize];
+      } else {
+        auto obj = pvar.getByIndex(idx);
+        checksum += obj->data[cnt % osize];
+      }
+    }
+    clock_gettime(CLOCK_REALTIME,&te);
+    nsec[zerocopy] = (te.tv_sec - ts.tv_sec)*1000000000 + te.tv_nsec - ts.tv_nsec;
+  }
+  cout << "READ TEST(size=" << osize << " byte, ops=" << nops << ", checksum=" << checksum << ")" << endl;
+  cout << "copy latency:\t" << (double)nsec[0]/nops/1000 << " microseconds" << endl;
+  cout << "view latency:\t" << (double)nsec[1]/nops/1000 << " microseconds" << endl;
+}
+
 int main(int argc,char ** argv){
   spdlog::set_level(spdlog::level::trace);
 
@@ -189,6 +286,28 @@ int main(int argc,char ** argv){
 */
       cout<<"["<<"[("<<hlc.m_rtc_us<<",0)]\t"<<npx.get(hlc)->to_string()<<"\t//by copy"<<endl;
     }
+    else if (strcmp(argv[1],"getrange") == 0){
+      int64_t from = atol(argv[2]);
+      int64_t to = atol(argv[3]);
+      int64_t n = npx.getRange(from,to,
+        [&](const int64_t & ver, const HLC & hlc, const VariableBytes & x) {
+          cout<<"["<<ver<<"]\t("<<hlc.m_rtc_us<<","<<hlc.m_logic<<")\t"<<x.buf<<endl;
+        });
+      cout<<n<<" versions in ["<<from<<","<<to<<"]"<<endl;
+    }
+    else if (strcmp(argv[1],"getshared") == 0){
+      int64_t ver = atol(argv[2]);
+      int num = atoi(argv[3]);
+      npx.setVersionCacheSize(1ull<<20);
+      std::shared_ptr<const VariableBytes> first = npx.getShared(ver);
+      int shared = 0;
+      for (int i = 1; i < num; i++) {
+        if (npx.getShared(ver) == first) {
+          shared ++;
+        }
+      }
+      cout<<"["<<ver<<"]\t"<<first->buf<<"\t//shared by "<<shared<<" of "<<(num-1)<<" later reads"<<endl;
+    }
     else if(strcmp(argv[1],"trimbyidx") == 0){
       int64_t nv = atol(argv[2]);
       npx.trim(nv);
@@ -209,6 +328,15 @@ int main(int argc,char ** argv){
       npx.persist();
       cout<<"trim till time "<<hlc.m_rtc_us<<" successfully"<<endl;
     }
+    else if(strcmp(argv[1],"retain") == 0){
+      RetentionPolicy policy;
+      policy.max_versions = atol(argv[2]);
+      policy.max_bytes = atol(argv[3]);
+      npx.setRetention(policy);
+      npx.enforceRetention();
+      npx.persist();
+      cout<<"retained "<<npx.getNumOfVersions()<<" versions"<<endl;
+    }
     else if (strcmp(argv[1],"set") == 0) {
       char* v = argv[2];
       int64_t ver = (int64_t)atoi(argv[3]);
@@ -241,6 +369,14 @@ int main(int argc,char ** argv){
     else if (strcmp(argv[1],"hlc") == 0) {
       test_hlc();
     }
+    else if (strcmp(argv[1],"evalhlc") == 0) {
+      // evalhlc nthreads nticks
+      if (argc < 4) {
+        printhelp();
+        return 0;
+      }
+      eval_hlc(atoi(argv[2]),atoi(argv[3]));
+    }
     else if (strcmp(argv[1],"eval") == 0) {
       // eval file|mem osize nops
       int osize = atoi(argv[3]);
@@ -259,6 +395,14 @@ int main(int argc,char ** argv){
         cout << "unknown storage type:" << argv[2] << endl;
       }
     }
+    else if (strcmp(argv[1],"evalread") == 0) {
+      // evalread osize nops
+      if (argc < 4) {
+        printhelp();
+        return 0;
+      }
+      eval_read(atoi(argv[2]),atoi(argv[3]));
+    }
     else {
       cout << "unknown command: " << argv[1] << endl;
       printhelp();
@@ -309,3 +453,56 @@ void test_hlc(){
   cout<<"h1<=h2\t"<<(h1<=h2)<<endl;
   cout<<"h1==h2\t"<<(h1==h2)<<endl;
 }
+
+// run body on nthreads threads at once and return the elapsed nanoseconds
+static long run_threads(int nthreads, const std::function<void()> & body){
+  struct timespec ts,te;
+  std::vector<std::thread> threads;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  for (int i=0;i<nthreads;i++) {
+    threads.emplace_back(body);
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  clock_gettime(CLOCK_REALTIME,&te);
+  return (te.tv_sec - ts.tv_sec)*1000000000L + te.tv_nsec - ts.tv_nsec;
+}
+
+// compare ticking a shared HLCClock with ticking an HLC under a spinlock, the
+// way a clock shared by the delivery and query threads used to be guarded
+void eval_hlc(int nthreads, int nticks){
+  HLCClock clock;
+  const HLC remote = clock.tick();
+  long nsec = run_threads(nthreads,[&](){
+    for (int i=0;i<nticks;i++) {
+      if (i%2) {
+        clock.tick();
+      } else {
+        clock.tick(remote);
+      }
+    }
+  });
+  const HLC last = clock.now();
+  cout << "HLCClock(threads=" << nthreads << ", ticks=" << nticks << ")" << endl;
+  cout << "latency:\t" << (double)nsec/nticks << " nanoseconds per tick per thread" << endl;
+
+  HLC hlc;
+  pthread_spinlock_t lck;
+  pthread_spin_init(&lck,PTHREAD_PROCESS_PRIVATE);
+  nsec = run_threads(nthreads,[&](){
+    for (int i=0;i<nticks;i++) {
+      pthread_spin_lock(&lck);
+      if (i%2) {
+        hlc.tick();
+      } else {
+        hlc.tick(remote);
+      }
+      pthread_spin_unlock(&lck);
+    }
+  });
+  pthread_spin_destroy(&lck);
+  cout << "HLC with a spinlock(threads=" << nthreads << ", ticks=" << nticks << ")" << endl;
+  cout << "latency:\t" << (double)nsec/nticks << " nanoseconds per tick per thread" << endl;
+  print_hlc("last HLCClock tick",last);
+}
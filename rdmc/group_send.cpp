@@ -1,10 +1,11 @@
 
 #include "group_send.h"
-#include "message.h"
 #include "util.h"
 
 #include <cassert>
+#include <cmath>
 #include <cstring>
+#include <thread>
 
 using namespace std;
 using namespace rdma;
@@ -16,14 +17,24 @@ extern mutex groups_lock;
 };
 
 decltype(polling_group::message_types) polling_group::message_types;
+bool polling_group::use_shared_queue_pairs = false;
+map<uint32_t, shared_ptr<queue_pair>> polling_group::shared_rfb_queue_pairs;
+unique_ptr<shared_receive_queue> polling_group::rfb_receive_queue;
+
+// The earliest time the next block can be posted at with a pacing rate
+static mutex pacing_mutex;
+static uint64_t next_block_time = 0;
 
 group::group(uint16_t _group_number, size_t _block_size,
              vector<uint32_t> _members, uint32_t _member_index,
              incoming_message_callback_t upcall,
              completion_callback_t callback,
-             unique_ptr<schedule> _schedule)
+             unique_ptr<schedule> _schedule,
+             bool adaptive_block_size)
         : members(_members),
           group_number(_group_number),
+          max_block_size(_block_size),
+          adaptive_block_size(adaptive_block_size),
           block_size(_block_size),
           num_members(members.size()),
           member_index(_member_index),
@@ -31,6 +42,17 @@ group::group(uint16_t _group_number, size_t _block_size,
           completion_callback(callback),
           incoming_message_upcall(upcall) {}
 group::~group() { unique_lock<mutex> lock(monitor); }
+void group::rebind(incoming_message_callback_t upcall,
+                   completion_callback_t callback) {
+    unique_lock<mutex> lock(monitor);
+    incoming_message_upcall = upcall;
+    completion_callback = callback;
+}
+bool group::idle() {
+    unique_lock<mutex> lock(monitor);
+    // mr is set from the start of a message until its completion callback
+    return !mr && queued_sends.empty();
+}
 
 void polling_group::initialize_message_types() {
     auto find_group = [](uint16_t group_number) {
@@ -44,12 +66,23 @@ void polling_group::initialize_message_types() {
         shared_ptr<group> g = find_group(parsed_tag.group_number);
         if(g) g->complete_block_send();
     };
+    auto fail_data_block = [find_group](uint64_t tag, uint32_t rail, size_t) {
+        ParsedTag parsed_tag = parse_tag(tag);
+        shared_ptr<group> g = find_group(parsed_tag.group_number);
+        if(g) g->fail_block_send(parsed_tag.target, rail);
+    };
     auto receive_data_block = [find_group](uint64_t tag, uint32_t immediate,
                                            size_t length) {
         ParsedTag parsed_tag = parse_tag(tag);
         shared_ptr<group> g = find_group(parsed_tag.group_number);
         if(g) g->receive_block(immediate, length);
     };
+    auto receive_written_block = [find_group](uint64_t tag, uint32_t immediate,
+                                              size_t length) {
+        ParsedTag parsed_tag = parse_tag(tag);
+        shared_ptr<group> g = find_group(parsed_tag.group_number);
+        if(g) g->receive_written_block(parsed_tag.target, immediate, length);
+    };
     auto send_ready_for_block = [](uint64_t, uint32_t, size_t) {};
     auto receive_ready_for_block = [find_group](
             uint64_t tag, uint32_t immediate, size_t length) {
@@ -57,37 +90,87 @@ void polling_group::initialize_message_types() {
         shared_ptr<group> g = find_group(parsed_tag.group_number);
         if(g) g->receive_ready_for_block(immediate, parsed_tag.target);
     };
+    // The tag of a receive from the shared queue says nothing about who it
+    // was from, so the group and sender come from the immediate. The sender
+    // only sends once its data queue pair to us is connected, which happens
+    // inside our create_group while it holds groups_lock, so the group is
+    // always found.
+    auto receive_shared_ready_for_block = [find_group](
+            uint64_t, uint32_t immediate, size_t) {
+        {
+            unique_lock<mutex> lock(groups_lock);
+            rfb_receive_queue->post_empty_recv(0, message_types.shared_ready_for_block);
+        }
+        ParsedReadyForBlock parsed = parse_ready_for_block_immediate(immediate);
+        shared_ptr<group> g = find_group(parsed.group_number);
+        if(g) g->receive_ready_for_block(0, parsed.sender);
+    };
 
-    message_types.data_block = message_type("rdmc.data_block", send_data_block, receive_data_block);
+    message_types.data_block = message_type("rdmc.data_block", send_data_block, receive_data_block,
+                                            nullptr, nullptr, fail_data_block);
+    // Written blocks complete through the write handler on the sender
+    message_types.data_write = message_type("rdmc.data_write", nullptr, receive_written_block,
+                                            send_data_block);
     message_types.ready_for_block = message_type(
             "rdmc.ready_for_block", send_ready_for_block, receive_ready_for_block);
+    message_types.shared_ready_for_block = message_type(
+            "rdmc.shared_ready_for_block", send_ready_for_block,
+            receive_shared_ready_for_block);
+}
+bool polling_group::set_shared_queue_pairs(bool enabled) {
+    unique_lock<mutex> lock(groups_lock);
+    if(enabled && !rfb_receive_queue) {
+        try {
+            rfb_receive_queue = make_unique<shared_receive_queue>(rfb_receive_queue_size);
+        } catch(rdma::creation_failure) {
+            return false;
+        }
+        for(uint32_t i = 0; i < rfb_receive_queue_size; ++i) {
+            rfb_receive_queue->post_empty_recv(0, message_types.shared_ready_for_block);
+        }
+    }
+    use_shared_queue_pairs = enabled;
+    return true;
 }
 polling_group::polling_group(uint16_t _group_number, size_t _block_size,
                              vector<uint32_t> _members, uint32_t _member_index,
                              incoming_message_callback_t upcall,
                              completion_callback_t callback,
-                             unique_ptr<schedule> _schedule)
+                             unique_ptr<schedule> _schedule,
+                             bool adaptive_block_size,
+                             size_t landing_size)
         : group(_group_number, _block_size, _members, _member_index, upcall,
-                callback, std::move(_schedule)),
-          first_block_buffer(nullptr) {
-    if(member_index != 0) {
-        first_block_buffer = unique_ptr<char[]>(new char[block_size]);
-        memset(first_block_buffer.get(), 0, block_size);
-
-        first_block_mr = make_unique<memory_region>(first_block_buffer.get(), block_size);
+                callback, std::move(_schedule), adaptive_block_size),
+          landing_size(landing_size) {
+    if(landing_size) {
+        // The sender is never written to, but still has to give its
+        // neighbors a region when they exchange them
+        landing_mr = memory_region::allocate(member_index > 0 ? landing_size : 1);
+    } else if(member_index != 0) {
+        first_block_mr = memory_region::allocate(max_block_size);
+        memset(first_block_mr->buffer, 0, max_block_size);
     }
 
+    // Groups are constructed while holding groups_lock
+    shared_rfb = use_shared_queue_pairs;
+    if(!shared_rfb && !landing_size) {
+        num_rails = ::rdma::impl::num_rails();
+    }
     auto connections = transfer_schedule->get_connections();
     for(auto c : connections) {
         connect(c);
     }
 
-    if(member_index > 0) {
+    if(landing_size) {
+        if(member_index > 0) {
+            send_ready_for_message();
+        }
+    } else if(member_index > 0) {
         auto transfer = transfer_schedule->get_first_block(num_blocks);
         first_block_number = transfer->block_number;
         post_recv(*transfer);
         incoming_block = transfer->block_number;
-        send_ready_for_block(transfer->target);
+        send_ready_for_transfer(*transfer);
         // puts("Issued Ready For Block CCCCCCCCC");
     }
 }
@@ -95,9 +178,16 @@ void polling_group::receive_block(uint32_t send_imm, size_t received_block_size)
     unique_lock<mutex> lock(monitor);
 
     assert(member_index > 0);
+    incoming_transfer = std::experimental::nullopt;
 
     if(receive_step == 0) {
-        num_blocks = parse_immediate(send_imm).total_blocks;
+        if(adaptive_block_size) {
+            ParsedAdaptiveImmediate parsed = parse_adaptive_immediate(send_imm);
+            num_blocks = parsed.total_blocks;
+            block_size = max_block_size >> parsed.block_shift;
+        } else {
+            num_blocks = parse_immediate(send_imm).total_blocks;
+        }
         first_block_number = min(transfer_schedule->get_first_block(num_blocks)->block_number,
                                  num_blocks - 1);
         message_size = num_blocks * block_size;
@@ -105,7 +195,8 @@ void polling_group::receive_block(uint32_t send_imm, size_t received_block_size)
             message_size = received_block_size;
         }
 
-        assert(*first_block_number == parse_immediate(send_imm).block_number);
+        assert(*first_block_number == (adaptive_block_size ? parse_adaptive_immediate(send_imm).block_number
+                                                            : parse_immediate(send_imm).block_number));
 
         //////////////////////////////////////////////////////
         auto destination = incoming_message_upcall(message_size);
@@ -148,7 +239,7 @@ void polling_group::receive_block(uint32_t send_imm, size_t received_block_size)
             // (int)*first_block_number, (int)get_total_steps());
             post_recv(*transfer);
             incoming_block = transfer->block_number;
-            send_ready_for_block(transfer->target);
+            send_ready_for_transfer(*transfer);
             // cout << "Issued Ready For Block AAAAAAAA (receive_step = "
             //      << receive_step << ", target = " << transfer->target << ")"
             //      << endl;
@@ -178,14 +269,16 @@ void polling_group::receive_block(uint32_t send_imm, size_t received_block_size)
     } else {
         //        assert(tag.index() <= tag.message_size());
         size_t block_number = incoming_block;
-        if(block_number != parse_immediate(send_imm).block_number) {
+        size_t received_block_number = adaptive_block_size ? parse_adaptive_immediate(send_imm).block_number
+                                                           : parse_immediate(send_imm).block_number;
+        if(block_number != received_block_number) {
             printf("Expected block #%d but got #%d on step %d\n",
                    (int)block_number,
-                   (int)parse_immediate(send_imm).block_number,
+                   (int)received_block_number,
                    (int)receive_step);
             fflush(stdout);
         }
-        assert(block_number == parse_immediate(send_imm).block_number);
+        assert(block_number == received_block_number);
 
         if(block_number == num_blocks - 1) {
             message_size = (num_blocks - 1) * block_size + received_block_size;
@@ -206,7 +299,7 @@ void polling_group::receive_block(uint32_t send_imm, size_t received_block_size)
         // Post a receive for it.
         if(transfer) {
             incoming_block = transfer->block_number;
-            send_ready_for_block(transfer->target);
+            send_ready_for_transfer(*transfer);
             // cout << "Issued Ready For Block BBBBBBBB (receive_step = "
             //      << receive_step << ", target = " << transfer->target
             //      << ", total_steps = " << get_total_steps() << ")" << endl;
@@ -231,15 +324,99 @@ void polling_group::receive_block(uint32_t send_imm, size_t received_block_size)
         }
     }
 }
+void polling_group::receive_written_block(uint32_t sender, uint32_t send_imm,
+                                          size_t received_block_size) {
+    unique_lock<mutex> lock(monitor);
+
+    assert(member_index > 0 && landing_size);
+
+    auto it = queue_pairs.find(sender);
+    assert(it != queue_pairs.end());
+    CHECK(it->second.post_empty_recv(form_tag(group_number, sender), message_types.data_write));
+
+    size_t block_number;
+    if(adaptive_block_size) {
+        ParsedAdaptiveImmediate parsed = parse_adaptive_immediate(send_imm);
+        num_blocks = parsed.total_blocks;
+        block_number = parsed.block_number;
+        block_size = max_block_size >> parsed.block_shift;
+    } else {
+        ParsedImmediate parsed = parse_immediate(send_imm);
+        num_blocks = parsed.total_blocks;
+        block_number = parsed.block_number;
+    }
+
+    // Blocks can come from different neighbors in any order, and the
+    // message only needs a destination once it is complete
+    if(num_received_blocks == 0) {
+        mr = landing_mr;
+        mr_offset = 0;
+        message_size = num_blocks * block_size;
+        received_blocks = vector<bool>(num_blocks);
+        // Some schedules send a block more than once when there are few of
+        // them, so count the transfers rather than the blocks
+        num_incoming_transfers = 0;
+        for(size_t step = 0; step < transfer_schedule->get_total_steps(num_blocks); ++step) {
+            if(transfer_schedule->get_incoming_transfer(num_blocks, step)) {
+                ++num_incoming_transfers;
+            }
+        }
+    }
+    if(block_number == num_blocks - 1) {
+        message_size = (num_blocks - 1) * block_size + received_block_size;
+    } else {
+        assert(received_block_size == block_size);
+    }
+    received_blocks[block_number] = true;
+    ++num_received_blocks;
+
+    LOG_EVENT(group_number, message_number, block_number, "received_block");
+
+    if(!sending) {
+        send_next_block();
+    }
+    if(num_received_blocks == num_incoming_transfers && !sending && send_step == transfer_schedule->get_total_steps(num_blocks)) {
+        complete_message();
+    }
+}
 void polling_group::receive_ready_for_block(uint32_t step, uint32_t sender) {
     unique_lock<mutex> lock(monitor);
 
-    auto it = rfb_queue_pairs.find(sender);
-    assert(it != rfb_queue_pairs.end());
-    it->second.post_empty_recv(form_tag(group_number, sender),
-                               message_types.ready_for_block);
+    // Shared queue pairs have their receives reposted by the message type
+    if(!shared_rfb) {
+        auto it = rfb_queue_pairs.find(sender);
+        assert(it != rfb_queue_pairs.end());
+        it->second->post_empty_recv(form_tag(group_number, sender),
+                                    message_types.ready_for_block);
+    }
 
-    receivers_ready.insert(sender);
+    if(landing_size) {
+        ++messages_ready[sender];
+    } else {
+        const ParsedRailImmediate parsed = shared_rfb ? ParsedRailImmediate{rail_event::READY, 0}
+                                                      : parse_rail_immediate(step);
+        if(parsed.event == rail_event::RESEND) {
+            // The sender couldn't deliver on that rail. If this node is still
+            // waiting on the receive posted there, it is posted again.
+            ::rdma::impl::mark_rail_failed(parsed.rail);
+            if(incoming_transfer && incoming_transfer->target == sender
+               && receive_rails[incoming_transfer->block_number] == parsed.rail) {
+                send_ready_for_transfer(*incoming_transfer);
+            } else {
+                send_rail_event(sender, rail_event::RECEIVED, parsed.rail);
+            }
+            return;
+        } else if(parsed.event == rail_event::RECEIVED) {
+            // The block got there before its send failed
+            if(resend_target && *resend_target == sender) {
+                resend_target = std::experimental::nullopt;
+                ++send_step;
+                finish_block_send();
+            }
+            return;
+        }
+        receivers_ready[sender] = parsed.rail;
+    }
 
     if(!sending && mr) {
         send_next_block();
@@ -251,12 +428,32 @@ void polling_group::complete_block_send() {
     LOG_EVENT(group_number, message_number, outgoing_block,
               "finished_sending_block");
 
+    finish_block_send();
+}
+void polling_group::fail_block_send(uint32_t target, uint32_t rail) {
+    unique_lock<mutex> lock(monitor);
+
+    // Errors on receives come here too, but only a send has to be redone
+    if(!sending || target != outgoing_target || rail != outgoing_rail) {
+        return;
+    }
+    LOG_EVENT(group_number, message_number, outgoing_block,
+              "failed_sending_block");
+
+    // The step is taken again once the receiver says where to send it, or
+    // skipped if the receiver already has the block
+    sending = false;
+    --send_step;
+    resend_target = target;
+    send_rail_event(target, rail_event::RESEND, rail);
+}
+void polling_group::finish_block_send() {
     send_next_block();
 
     // If we just send the last block, and were already done
     // receiving, then signal completion and prepare for the next
     // message.
-    if(!sending && send_step == transfer_schedule->get_total_steps(num_blocks) && (member_index == 0 || num_received_blocks == num_blocks)) {
+    if(!sending && send_step == transfer_schedule->get_total_steps(num_blocks) && (member_index == 0 || num_received_blocks == (landing_size ? num_incoming_transfers : num_blocks))) {
         complete_message();
     }
 }
@@ -269,17 +466,30 @@ void polling_group::send_message(shared_ptr<memory_region> message_mr, size_t of
     if(length == 0) throw rdmc::invalid_args();
     if(offset + length > message_mr->size) throw rdmc::invalid_args();
     if(member_index > 0) throw rdmc::nonroot_sender();
+    if(landing_size && length > landing_size) throw rdmc::invalid_args();
+    const size_t message_block_size = adaptive_block_size
+                                              ? max_block_size >> choose_block_shift(length)
+                                              : max_block_size;
+    if((length - 1) / message_block_size + 1 > (adaptive_block_size ? adaptive_max_blocks : std::numeric_limits<uint16_t>::max()))
+        throw rdmc::invalid_args();
 
-    // Queueing sends is not supported
-    if(receive_step > 0) throw rdmc::group_busy();
-    if(send_step > 0) throw rdmc::group_busy();
-
+    // The next message can't start until this node has sent all of its
+    // blocks of this one, but no longer needs the caller to wait for that
+    if(mr) {
+        queued_sends.push({message_mr, offset, length});
+        return;
+    }
+    start_message(message_mr, offset, length);
+}
+void polling_group::start_message(shared_ptr<memory_region> message_mr, size_t offset,
+                                  size_t length) {
     mr = message_mr;
     mr_offset = offset;
     message_size = length;
+    if(adaptive_block_size) {
+        block_size = max_block_size >> choose_block_shift(message_size);
+    }
     num_blocks = (message_size - 1) / block_size + 1;
-    if(num_blocks > std::numeric_limits<uint16_t>::max())
-        throw rdmc::invalid_args();
     // printf("message_size = %lu, block_size = %lu, num_blocks = %lu\n",
     //        message_size, block_size, num_blocks);
     LOG_EVENT(group_number, message_number, -1, "send_message");
@@ -306,36 +516,62 @@ void polling_group::send_next_block() {
 
     if(member_index > 0 && !received_blocks[block_number]) return;
 
-    if(receivers_ready.count(transfer->target) == 0) {
+    auto ready = receivers_ready.find(target);
+    if(landing_size ? messages_ready[target] <= message_number
+                    : ready == receivers_ready.end()) {
         LOG_EVENT(group_number, message_number, block_number,
                   "receiver_not_ready");
         return;
     }
 
-    receivers_ready.erase(transfer->target);
+    uint32_t rail = 0;
+    if(!landing_size) {
+        rail = ready->second;
+        receivers_ready.erase(ready);
+        if(!::rdma::impl::rail_is_up(rail)) {
+            // The receiver posted on a rail this node has given up on
+            resend_target = target;
+            send_rail_event(target, rail_event::RESEND, rail);
+            return;
+        }
+    }
     sending = true;
     ++send_step;
 
     // printf("sending block #%d to node #%d on step %d\n", (int)block_number,
     // 	   (int)target, (int)send_step-1);
     // fflush(stdout);
-    auto it = queue_pairs.find(target);
-    assert(it != queue_pairs.end());
+    queue_pair& qp = data_queue_pair(target, rail);
+    if(rdmc::pacing_rate) {
+        pace_block(min(block_size, message_size - block_number * block_size));
+    }
 
-    if(first_block_number && block_number == *first_block_number) {
-        CHECK(it->second.post_send(*first_block_mr, 0, block_size,
-                                   form_tag(group_number, target),
-                                   form_immediate(num_blocks, block_number),
-                                   message_types.data_block));
+    if(landing_size) {
+        size_t offset = block_number * block_size;
+        size_t nbytes = min(block_size, message_size - offset);
+        auto landing = remote_landings.find(target);
+        assert(landing != remote_landings.end());
+        CHECK(qp.post_write_with_immediate(*mr, mr_offset + offset, nbytes,
+                                           form_tag(group_number, target),
+                                           make_immediate(block_number),
+                                           landing->second, offset,
+                                           message_types.data_write));
+    } else if(first_block_number && block_number == *first_block_number) {
+        CHECK(qp.post_send(*first_block_mr, 0, block_size,
+                           form_tag(group_number, target),
+                           make_immediate(block_number),
+                           message_types.data_block));
     } else {
         size_t offset = block_number * block_size;
         size_t nbytes = min(block_size, message_size - offset);
-        CHECK(it->second.post_send(*mr, mr_offset + offset, nbytes,
-                                   form_tag(group_number, target),
-                                   form_immediate(num_blocks, block_number),
-                                   message_types.data_block));
+        CHECK(qp.post_send(*mr, mr_offset + offset, nbytes,
+                           form_tag(group_number, target),
+                           make_immediate(block_number),
+                           message_types.data_block));
     }
     outgoing_block = block_number;
+    outgoing_target = target;
+    outgoing_rail = rail;
     LOG_EVENT(group_number, message_number, block_number,
               "started_sending_block");
 }
@@ -358,12 +594,20 @@ void polling_group::complete_message() {
         //     first_block_buffer = tmp_buffer;
         // } else {
         memcpy(mr->buffer + mr_offset + block_size * (*first_block_number),
-               first_block_buffer.get(), block_size);
+               first_block_mr->buffer, block_size);
         // }
         LOG_EVENT(group_number, message_number, *first_block_number,
                   "finished_remap_first_block");
     }
-    completion_callback(mr->buffer + mr_offset, message_size);
+    if(landing_size && member_index > 0) {
+        // The landing buffer is reused by the next message
+        auto destination = incoming_message_upcall(message_size);
+        assert(destination.mr->size >= destination.offset + message_size);
+        memcpy(destination.mr->buffer + destination.offset, landing_mr->buffer, message_size);
+        completion_callback(destination.mr->buffer + destination.offset, message_size);
+    } else {
+        completion_callback(mr->buffer + mr_offset, message_size);
+    }
 
     ++message_number;
     sending = false;
@@ -379,58 +623,184 @@ void polling_group::complete_message() {
     // }
     first_block_number = std::experimental::nullopt;
 
-    if(member_index != 0) {
+    if(member_index != 0 && landing_size) {
+        num_received_blocks = 0;
+        received_blocks.clear();
+        send_ready_for_message();
+    } else if(member_index != 0) {
         num_received_blocks = 0;
         received_blocks.clear();
         auto transfer = transfer_schedule->get_first_block(num_blocks);
         assert(transfer);
         first_block_number = transfer->block_number;
+        receive_rails.clear();
         post_recv(*transfer);
         incoming_block = transfer->block_number;
-        send_ready_for_block(transfer->target);
+        send_ready_for_transfer(*transfer);
         // cout << "Issued Ready For Block DDDDDDD (target = " <<
         // transfer->target
         //      << ")" << endl;
+    } else if(!queued_sends.empty()) {
+        queued_message next = std::move(queued_sends.front());
+        queued_sends.pop();
+        start_message(std::move(next.mr), next.offset, next.length);
+    }
+}
+void polling_group::pace_block(size_t nbytes) {
+    const uint64_t rate = rdmc::pacing_rate;
+    if(rate == 0) return;
+    uint64_t post_time;
+    {
+        unique_lock<mutex> lock(pacing_mutex);
+        // Time spent idle doesn't build up into a burst
+        post_time = max(next_block_time, get_time());
+        next_block_time = post_time + nbytes * 1000000000ull / rate;
     }
+    while(get_time() < post_time) {
+        std::this_thread::yield();
+    }
+}
+uint32_t polling_group::choose_rail(size_t block_number) const {
+    for(uint32_t i = 0; i < num_rails; ++i) {
+        uint32_t rail = (block_number + i) % num_rails;
+        if(::rdma::impl::rail_is_up(rail)) {
+            return rail;
+        }
+    }
+    return 0;
+}
+queue_pair& polling_group::data_queue_pair(uint32_t neighbor, uint32_t rail) {
+    if(rail == 0) {
+        auto it = queue_pairs.find(neighbor);
+        assert(it != queue_pairs.end());
+        return it->second;
+    }
+    auto it = rail_queue_pairs.find(neighbor);
+    assert(it != rail_queue_pairs.end() && rail <= it->second.size());
+    return it->second[rail - 1];
 }
 void polling_group::post_recv(schedule::block_transfer transfer) {
-    auto it = queue_pairs.find(transfer.target);
-    assert(it != queue_pairs.end());
+    const uint32_t rail = choose_rail(transfer.block_number);
+    receive_rails[transfer.block_number] = rail;
+    queue_pair& qp = data_queue_pair(transfer.target, rail);
 
     // printf("Posting receive buffer for block #%d from node #%d\n",
     //        (int)transfer.block_number, (int)transfer.target);
     // fflush(stdout);
 
+    // The first block of a message arrives before its block size is known
     if(first_block_number && transfer.block_number == *first_block_number) {
-        CHECK(it->second.post_recv(*first_block_mr, 0, block_size,
-                                   form_tag(group_number, transfer.target),
-                                   message_types.data_block));
+        CHECK(qp.post_recv(*first_block_mr, 0, max_block_size,
+                           form_tag(group_number, transfer.target),
+                           message_types.data_block));
     } else {
         size_t offset = block_size * transfer.block_number;
         size_t length = min(block_size, (size_t)(message_size - offset));
 
         if(length > 0) {
-            CHECK(it->second.post_recv(*mr, mr_offset + offset, length,
-                                       form_tag(group_number, transfer.target),
-                                       message_types.data_block));
+            CHECK(qp.post_recv(*mr, mr_offset + offset, length,
+                               form_tag(group_number, transfer.target),
+                               message_types.data_block));
         }
     }
     LOG_EVENT(group_number, message_number, transfer.block_number,
               "posted_receive_buffer");
 }
+uint8_t polling_group::choose_block_shift(size_t message_size) const {
+    // Pipelining favors small blocks and per-block overhead favors large
+    // ones; the completion time of a pipelined send is smallest when the
+    // block size is about the square root of the message size times the
+    // per-block overhead, expressed in bytes
+    const double target = std::sqrt((double)message_size * rdmc::block_overhead_bytes);
+    uint8_t shift = 0;
+    while(shift < adaptive_max_block_shift && (max_block_size >> (shift + 1)) >= rdmc::min_block_size
+          && (double)(max_block_size >> (shift + 1)) >= target) {
+        ++shift;
+    }
+    // Use larger blocks if the message would otherwise have too many of them
+    while(shift > 0 && (message_size - 1) / (max_block_size >> shift) + 1 > adaptive_max_blocks) {
+        --shift;
+    }
+    return shift;
+}
+uint32_t polling_group::make_immediate(size_t block_number) const {
+    if(adaptive_block_size) {
+        uint8_t shift = 0;
+        while((max_block_size >> shift) > block_size) {
+            ++shift;
+        }
+        return form_adaptive_immediate(num_blocks, block_number, shift);
+    }
+    return form_immediate(num_blocks, block_number);
+}
 void polling_group::connect(uint32_t neighbor) {
-    queue_pairs.emplace(neighbor, queue_pair(members[neighbor]));
+    if(landing_size) {
+        // Written blocks take these receives, which need no buffers
+        auto post_landing_recvs = [this, neighbor](rdma::queue_pair* qp) {
+            for(uint32_t i = 0; i < landing_receive_depth; ++i) {
+                qp->post_empty_recv(form_tag(group_number, neighbor), message_types.data_write);
+            }
+        };
+        queue_pairs.emplace(neighbor, queue_pair(members[neighbor], post_landing_recvs));
+        // Both ends connect to each other in the same order, so they make
+        // this exchange at the same time
+        auto remote = ::rdma::impl::verbs_exchange_memory_regions({members[neighbor]}, members[member_index],
+                                                                  *landing_mr);
+        remote_landings.emplace(neighbor, remote.at(members[neighbor]));
+    } else {
+        queue_pairs.emplace(neighbor, queue_pair(members[neighbor]));
+        // Both ends open the same rails, and create these in the same order
+        for(uint32_t rail = 1; rail < num_rails; ++rail) {
+            rail_queue_pairs[neighbor].emplace_back(members[neighbor], rail,
+                                                    [](rdma::queue_pair*) {});
+        }
+    }
+
+    if(shared_rfb) {
+        // Both ends create their groups in the same order and agree on
+        // whether to share, so they agree on whether this already exists
+        auto& qp = shared_rfb_queue_pairs[members[neighbor]];
+        if(!qp) {
+            qp = make_shared<queue_pair>(members[neighbor], *rfb_receive_queue,
+                                         shared_rfb_max_send_wr);
+        }
+        rfb_queue_pairs.emplace(neighbor, qp);
+        return;
+    }
 
     auto post_recv = [this, neighbor](rdma::queue_pair* qp) {
         qp->post_empty_recv(form_tag(group_number, neighbor),
                             message_types.ready_for_block);
     };
 
-    rfb_queue_pairs.emplace(neighbor, queue_pair(members[neighbor], post_recv));
+    rfb_queue_pairs.emplace(neighbor, make_shared<queue_pair>(members[neighbor], post_recv));
+}
+void polling_group::send_ready_for_transfer(schedule::block_transfer transfer) {
+    auto rail = receive_rails.find(transfer.block_number);
+    assert(rail != receive_rails.end());
+    if(!::rdma::impl::rail_is_up(rail->second)) {
+        // The receive left on the failed rail is never completed
+        post_recv(transfer);
+    }
+    incoming_transfer = transfer;
+    send_ready_for_block(transfer.target, receive_rails[transfer.block_number]);
 }
-void polling_group::send_ready_for_block(uint32_t neighbor) {
+void polling_group::send_ready_for_block(uint32_t neighbor, uint32_t rail) {
+    send_rail_event(neighbor, rail_event::READY, rail);
+}
+void polling_group::send_rail_event(uint32_t neighbor, rail_event event, uint32_t rail) {
     auto it = rfb_queue_pairs.find(neighbor);
     assert(it != rfb_queue_pairs.end());
-    it->second.post_empty_send(form_tag(group_number, neighbor), 0,
-                               message_types.ready_for_block);
+    // Only readiness is ever sent on shared queue pairs
+    uint32_t immediate = shared_rfb ? form_ready_for_block_immediate(group_number, member_index)
+                                    : form_rail_immediate(event, rail);
+    bool signaled = shared_rfb || ++rfb_sends[neighbor] % rfb_signal_interval == 0;
+    it->second->post_empty_send(form_tag(group_number, neighbor), immediate,
+                                message_types.ready_for_block, signaled);
+}
+void polling_group::send_ready_for_message() {
+    // Any neighbor might send to this node, so all of them are told
+    for(const auto& neighbor : rfb_queue_pairs) {
+        send_ready_for_block(neighbor.first);
+    }
 }
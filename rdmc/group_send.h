@@ -2,6 +2,7 @@
 #ifndef GROUP_SEND_H
 #define GROUP_SEND_H
 
+#include "message.h"
 #include "rdmc.h"
 #include "schedule.h"
 #include "verbs_helper.h"
@@ -10,13 +11,14 @@
 #include <map>
 #include <memory>
 #include <mutex>
-#include <set>
+#include <queue>
 #include <vector>
 
 using std::experimental::optional;
 using std::vector;
 using std::map;
 using std::unique_ptr;
+using std::shared_ptr;
 using rdmc::incoming_message_callback_t;
 using rdmc::completion_callback_t;
 
@@ -24,7 +26,13 @@ class group {
 protected:
     const vector<uint32_t> members;  // first element is the sender
     const uint16_t group_number;
-    const size_t block_size;
+    /** The largest block size, which is also the block size of every message
+     * unless adaptive_block_size is set. */
+    const size_t max_block_size;
+    /** If true, each message's block size is chosen from its size. */
+    const bool adaptive_block_size;
+    /** The block size of the current message */
+    size_t block_size;
     const uint32_t num_members;
     const uint32_t member_index;  // our index in the members list
 
@@ -40,18 +48,38 @@ protected:
     completion_callback_t completion_callback;
     incoming_message_callback_t incoming_message_upcall;
 
+    struct queued_message {
+        std::shared_ptr<rdma::memory_region> mr;
+        size_t offset;
+        size_t length;
+    };
+    // Messages the sender was given while another was being sent, in order;
+    // each starts once the one before it is complete
+    std::queue<queued_message> queued_sends;
+
     group(uint16_t group_number, size_t block_size,
           vector<uint32_t> members, uint32_t member_index,
           incoming_message_callback_t upcall,
           completion_callback_t callback,
-          unique_ptr<schedule> transfer_schedule);
+          unique_ptr<schedule> transfer_schedule,
+          bool adaptive_block_size);
 
 public:
     virtual ~group();
 
+    /** Replaces the upcalls, which are only ever called with monitor held */
+    void rebind(incoming_message_callback_t upcall, completion_callback_t callback);
+    /** @return True if no message is being sent or received, or waiting to be sent */
+    bool idle();
+
     virtual void receive_block(uint32_t send_imm, size_t size) = 0;
+    /** Called when a neighbor has written a block into this node's landing
+     * buffer; only groups that advertise one get these */
+    virtual void receive_written_block(uint32_t sender, uint32_t send_imm, size_t size) {}
     virtual void receive_ready_for_block(uint32_t step, uint32_t sender) = 0;
     virtual void complete_block_send() = 0;
+    /** Called when a block send to the target failed on a rail after the first */
+    virtual void fail_block_send(uint32_t target, uint32_t rail) {}
     virtual void send_message(std::shared_ptr<rdma::memory_region> message_mr,
                               size_t offset, size_t length)
             = 0;
@@ -59,17 +87,19 @@ public:
 
 class polling_group : public group {
 private:
-    // Set of receivers who are ready to receive the next block from us.
-    std::set<uint32_t> receivers_ready;
+    // The receivers who are ready to receive the next block from us, and the
+    // rail each posted its receive on
+    map<uint32_t, uint32_t> receivers_ready;
 
     unique_ptr<rdma::memory_region> first_block_mr;
     optional<size_t> first_block_number;
-    unique_ptr<char[]> first_block_buffer;
 
     size_t incoming_block;
     size_t message_number = 0;
 
     size_t outgoing_block;
+    uint32_t outgoing_target;
+    uint32_t outgoing_rail;
     bool sending = false;  // Whether a block send is in progress
     size_t send_step = 0;  // Number of blocks sent/stalls so far
 
@@ -79,37 +109,112 @@ private:
     size_t receive_step = 0;
     vector<bool> received_blocks;
 
+    // The number of rails blocks are striped across. Landing buffers and
+    // shared ready-for-block queue pairs only use the first.
+    uint32_t num_rails = 1;
+    // The rail each posted receive is on, by block number
+    map<size_t, uint32_t> receive_rails;
+    // The transfer this node last said it was ready for, if it hasn't arrived
+    optional<schedule::block_transfer> incoming_transfer;
+    // The receiver that was asked to resend a block that failed on a rail,
+    // until it replies
+    optional<uint32_t> resend_target;
+
     // maps from member_indices to the queue pairs
     map<size_t, rdma::queue_pair> queue_pairs;
-    map<size_t, rdma::queue_pair> rfb_queue_pairs;
+    // The data queue pairs on rails after the first, by member index
+    map<size_t, vector<rdma::queue_pair>> rail_queue_pairs;
+    map<size_t, shared_ptr<rdma::queue_pair>> rfb_queue_pairs;
+    // Whether rfb_queue_pairs are the per-node ones shared by all groups
+    bool shared_rfb = false;
+    // The number of ready-for-block messages sent to each neighbor, so that
+    // only one in rfb_signal_interval of them is signaled
+    map<size_t, uint32_t> rfb_sends;
+
+    // If set, blocks are written straight into this buffer on each receiver,
+    // at their offsets in the message, instead of into receives posted for
+    // them, so a receiver only has to say once per message that it is ready
+    // instead of once per block. The message is copied out when complete.
+    const size_t landing_size;
+    shared_ptr<rdma::memory_region> landing_mr;
+    // The landing buffers of the neighbors, by member index
+    map<size_t, rdma::remote_memory_region> remote_landings;
+    // The number of messages each neighbor has said it is ready for, which
+    // with landing buffers stands in for receivers_ready
+    map<size_t, size_t> messages_ready;
+    // The number of blocks the schedule has this node receive in the
+    // current message, with landing buffers
+    size_t num_incoming_transfers = 0;
 
     static struct {
         rdma::message_type data_block;
+        rdma::message_type data_write;
         rdma::message_type ready_for_block;
+        rdma::message_type shared_ready_for_block;
     } message_types;
 
+    // The rest are protected by groups_lock
+    static bool use_shared_queue_pairs;
+    // The ready-for-block queue pairs shared by all groups, by node ID
+    static map<uint32_t, shared_ptr<rdma::queue_pair>> shared_rfb_queue_pairs;
+    static unique_ptr<rdma::shared_receive_queue> rfb_receive_queue;
+
 public:
+    // The most ready-for-block messages that can be waiting to be received
+    // on all the shared queue pairs together
+    static constexpr uint32_t rfb_receive_queue_size = 1024;
+    // The most ready-for-block sends to one node that can be in flight at once
+    static constexpr uint32_t shared_rfb_max_send_wr = 256;
+    // Half the send queue depth of a group's own ready-for-block queue pairs.
+    // Shared ones are posted to by many groups, so all their sends are signaled.
+    static constexpr uint32_t rfb_signal_interval = 8;
+    // The empty receives kept posted on each data queue pair for written
+    // blocks to take; a neighbor only writes one block at a time
+    static constexpr uint32_t landing_receive_depth = 8;
+
     static void initialize_message_types();
+    static bool set_shared_queue_pairs(bool enabled);
 
     polling_group(uint16_t group_number, size_t block_size,
                   vector<uint32_t> members, uint32_t member_index,
                   incoming_message_callback_t upcall,
                   completion_callback_t callback,
-                  unique_ptr<schedule> transfer_schedule);
+                  unique_ptr<schedule> transfer_schedule,
+                  bool adaptive_block_size = false,
+                  size_t landing_size = 0);
 
     virtual void receive_block(uint32_t send_imm, size_t size);
+    virtual void receive_written_block(uint32_t sender, uint32_t send_imm, size_t size);
     virtual void receive_ready_for_block(uint32_t step, uint32_t sender);
     virtual void complete_block_send();
+    virtual void fail_block_send(uint32_t target, uint32_t rail);
 
     virtual void send_message(std::shared_ptr<rdma::memory_region> message_mr,
                               size_t offset, size_t length);
 
 private:
+    /** @return The right shift of max_block_size to use as the block size of a message of this size */
+    uint8_t choose_block_shift(size_t message_size) const;
+    uint32_t make_immediate(size_t block_number) const;
+    /** @return The rail to receive the block on: its turn in the rotation, or the next one that is up */
+    uint32_t choose_rail(size_t block_number) const;
+    rdma::queue_pair& data_queue_pair(uint32_t neighbor, uint32_t rail);
     void post_recv(schedule::block_transfer transfer);
+    /** Says this node is ready for the transfer, whose receive has been
+     * posted; posts it again first if its rail has failed since */
+    void send_ready_for_transfer(schedule::block_transfer transfer);
+    /** What is left to do once a block has been sent, with monitor held */
+    void finish_block_send();
+    void start_message(shared_ptr<rdma::memory_region> message_mr, size_t offset, size_t length);
     void send_next_block();
+    /** With a pacing rate, waits until this node may post a block of this size */
+    static void pace_block(size_t nbytes);
     void complete_message();
     void prepare_for_next_message();
-    void send_ready_for_block(uint32_t neighbor);
+    void send_ready_for_block(uint32_t neighbor, uint32_t rail = 0);
+    void send_rail_event(uint32_t neighbor, rail_event event, uint32_t rail);
+    /** With landing buffers: tells every neighbor this node is ready for the next message */
+    void send_ready_for_message();
     void connect(uint32_t neighbor);
 };
 
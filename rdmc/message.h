@@ -33,4 +33,60 @@ inline uint32_t form_immediate(uint16_t total_blocks, uint16_t block_number) {
     return ((uint32_t)total_blocks) << 16 | ((uint32_t)block_number);
 }
 
+/** When ready-for-block queue pairs are shared between groups, the receive
+ * comes from a shared receive queue, so the immediate says which group and
+ * member it is from. */
+struct ParsedReadyForBlock {
+    uint16_t group_number;
+    uint16_t sender;
+};
+
+inline ParsedReadyForBlock parse_ready_for_block_immediate(uint32_t imm) {
+    return ParsedReadyForBlock{(uint16_t)(imm >> 16), (uint16_t)(imm & 0x0000ffff)};
+}
+inline uint32_t form_ready_for_block_immediate(uint16_t group_number, uint16_t sender) {
+    return ((uint32_t)group_number) << 16 | ((uint32_t)sender);
+}
+
+/** In groups with adaptive block sizes, the immediate also carries the block
+ * size, as a right shift of the group's maximum block size; the block counts
+ * give up 2 bits each to make room for it. */
+constexpr uint32_t adaptive_max_blocks = (1u << 14) - 1;
+constexpr uint32_t adaptive_max_block_shift = (1u << 4) - 1;
+
+struct ParsedAdaptiveImmediate {
+    uint16_t total_blocks;
+    uint16_t block_number;
+    uint8_t block_shift;
+};
+
+inline ParsedAdaptiveImmediate parse_adaptive_immediate(uint32_t imm) {
+    return ParsedAdaptiveImmediate{(uint16_t)((imm >> 14) & adaptive_max_blocks),
+                                   (uint16_t)(imm & adaptive_max_blocks),
+                                   (uint8_t)(imm >> 28)};
+}
+inline uint32_t form_adaptive_immediate(uint16_t total_blocks, uint16_t block_number,
+                                        uint8_t block_shift) {
+    return ((uint32_t)block_shift) << 28 | ((uint32_t)total_blocks) << 14 | ((uint32_t)block_number);
+}
+
+/** When blocks are striped across rails, a ready-for-block message on a
+ * group's own queue pairs says which rail the receive was posted on. A
+ * sender that can't deliver a block on that rail asks for a resend of it, and
+ * the receiver either posts the receive again and says where, or says it
+ * already has the block. */
+enum class rail_event : uint8_t { READY = 0, RESEND = 1, RECEIVED = 2 };
+
+struct ParsedRailImmediate {
+    rail_event event;
+    uint8_t rail;
+};
+
+inline ParsedRailImmediate parse_rail_immediate(uint32_t imm) {
+    return ParsedRailImmediate{(rail_event)(imm >> 30), (uint8_t)(imm & 0xff)};
+}
+inline uint32_t form_rail_immediate(rail_event event, uint8_t rail) {
+    return ((uint32_t)event) << 30 | ((uint32_t)rail);
+}
+
 #endif
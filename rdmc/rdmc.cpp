@@ -5,6 +5,7 @@
 #include "schedule.h"
 #include "util.h"
 #include "verbs_helper.h"
+#include "derecho/parallel_release.h"
 
 #include <atomic>
 #include <cmath>
@@ -29,11 +30,15 @@ atomic<bool> shutdown_flag;
 map<uint16_t, shared_ptr<group>> groups;
 mutex groups_lock;
 
-bool initialize(const map<uint32_t, string>& addresses, uint32_t _node_rank) {
+// map from node ID to rack ID, protected by groups_lock
+map<uint32_t, uint32_t> node_locations;
+
+bool initialize(const map<uint32_t, string>& addresses, uint32_t _node_rank,
+                const vector<rdma::rail_config>& rails) {
     if(shutdown_flag) return false;
 
     node_rank = _node_rank;
-    if(!::rdma::impl::verbs_initialize(addresses, node_rank)) {
+    if(!::rdma::impl::verbs_initialize(addresses, node_rank, rails)) {
         return false;
     }
 
@@ -43,12 +48,39 @@ bool initialize(const map<uint32_t, string>& addresses, uint32_t _node_rank) {
 void add_address(uint32_t index, const string& address) {
     ::rdma::impl::verbs_add_connection(index, address, node_rank);
 }
+atomic<size_t> block_overhead_bytes{64 << 10};
+void set_block_overhead_bytes(size_t bytes) {
+    block_overhead_bytes = bytes;
+}
+void set_node_locations(const map<uint32_t, uint32_t>& locations) {
+    unique_lock<mutex> lock(groups_lock);
+    node_locations = locations;
+}
+bool set_shared_queue_pairs(bool enabled) {
+    return polling_group::set_shared_queue_pairs(enabled);
+}
+void set_service_level(uint8_t service_level) {
+    ::rdma::impl::set_service_level(service_level);
+}
+atomic<uint64_t> pacing_rate{0};
+void set_pacing_rate(uint64_t bytes_per_second) {
+    pacing_rate = bytes_per_second;
+}
+void set_memory_arena_chunk_size(size_t chunk_size) {
+    ::rdma::impl::set_memory_arena_chunk_size(chunk_size);
+}
+void set_lock_memory(bool enabled) {
+    ::rdma::impl::set_lock_memory_mode(enabled);
+}
 
 bool create_group(uint16_t group_number, std::vector<uint32_t> members,
                   size_t block_size, send_algorithm algorithm,
                   incoming_message_callback_t incoming_upcall,
                   completion_callback_t callback,
-                  failure_callback_t failure_callback) {
+                  failure_callback_t failure_callback,
+                  bool adaptive_block_size,
+                  size_t landing_size,
+                  int service_level) {
     if(shutdown_flag) return false;
 
     schedule* send_schedule;
@@ -61,6 +93,16 @@ bool create_group(uint16_t group_number, std::vector<uint32_t> members,
         send_schedule = new chain_schedule(members.size(), member_index);
     } else if(algorithm == TREE_SEND) {
         send_schedule = new tree_schedule(members.size(), member_index);
+    } else if(algorithm == HIERARCHICAL_SEND) {
+        vector<uint32_t> member_racks(members.size(), 0);
+        unique_lock<mutex> lock(groups_lock);
+        for(size_t i = 0; i < members.size(); ++i) {
+            auto it = node_locations.find(members[i]);
+            if(it != node_locations.end()) {
+                member_racks[i] = it->second;
+            }
+        }
+        send_schedule = new hierarchical_schedule(members.size(), member_index, member_racks);
     } else {
         puts("Unsupported group type?!");
         fflush(stdout);
@@ -68,9 +110,19 @@ bool create_group(uint16_t group_number, std::vector<uint32_t> members,
     }
 
     unique_lock<mutex> lock(groups_lock);
+    // The group connects its queue pairs on this thread, as it is constructed
+    struct service_level_override {
+        explicit service_level_override(int level) {
+            ::rdma::impl::set_connecting_service_level(level);
+        }
+        ~service_level_override() {
+            ::rdma::impl::set_connecting_service_level(-1);
+        }
+    } override_service_level(service_level);
     auto g = make_shared<polling_group>(group_number, block_size, members,
                                         member_index, incoming_upcall, callback,
-                                        unique_ptr<schedule>(send_schedule));
+                                        unique_ptr<schedule>(send_schedule),
+                                        adaptive_block_size, landing_size);
     auto p = groups.emplace(group_number, std::move(g));
     return p.second;
 }
@@ -82,6 +134,46 @@ void destroy_group(uint16_t group_number) {
     LOG_EVENT(group_number, -1, -1, "destroy_group");
     groups.erase(group_number);
 }
+void destroy_groups(const vector<uint16_t>& group_numbers) {
+    if(shutdown_flag) return;
+
+    vector<shared_ptr<group>> destroyed;
+    {
+        unique_lock<mutex> lock(groups_lock);
+        for(uint16_t group_number : group_numbers) {
+            auto it = groups.find(group_number);
+            if(it == groups.end()) continue;
+            LOG_EVENT(group_number, -1, -1, "destroy_group");
+            destroyed.push_back(std::move(it->second));
+            groups.erase(it);
+        }
+    }
+    derecho::release_in_parallel(destroyed);
+}
+bool rebind_group(uint16_t group_number,
+                  incoming_message_callback_t incoming_upcall,
+                  completion_callback_t callback) {
+    shared_ptr<group> g;
+    {
+        unique_lock<mutex> lock(groups_lock);
+        auto it = groups.find(group_number);
+        if(it == groups.end()) return false;
+        g = it->second;
+    }
+    LOG_EVENT(group_number, -1, -1, "rebind_group");
+    g->rebind(incoming_upcall, callback);
+    return true;
+}
+bool group_is_idle(uint16_t group_number) {
+    shared_ptr<group> g;
+    {
+        unique_lock<mutex> lock(groups_lock);
+        auto it = groups.find(group_number);
+        if(it == groups.end()) return true;
+        g = it->second;
+    }
+    return g->idle();
+}
 void shutdown() { shutdown_flag = true; }
 bool send(uint16_t group_number, shared_ptr<memory_region> mr, size_t offset,
           size_t length) {
@@ -160,7 +252,7 @@ void barrier_group::barrier_wait() {
                    *number_mr.get(), 0, 8,
                    form_tag(0, (node_rank + (1 << m)) % group_size),
                    remote_memory_regions[m], m * 8, message_type::ignored(),
-                   false, true)) {
+                   number % barrier_signal_interval == 0, true)) {
             throw rdmc::connection_broken();
         }
 
@@ -5,6 +5,7 @@
 #include "verbs_helper.h"
 
 #include <array>
+#include <atomic>
 #include <experimental/optional>
 #include <functional>
 #include <map>
@@ -25,7 +26,9 @@ enum send_algorithm {
     BINOMIAL_SEND = 1,
     CHAIN_SEND = 2,
     SEQUENTIAL_SEND = 3,
-    TREE_SEND = 4
+    TREE_SEND = 4,
+    /** A binomial pipeline between racks, then within each rack; see set_node_locations */
+    HIERARCHICAL_SEND = 5
 };
 
 struct receive_destination {
@@ -39,11 +42,88 @@ typedef std::function<void(char* buffer, size_t size)> completion_callback_t;
 typedef std::function<void(std::experimental::optional<uint32_t> suspected_victim)>
         failure_callback_t;
 
+/**
+ * With more than one rail, the blocks of messages are striped across them by
+ * block number, and a rail that fails is left for the ones that remain. The
+ * first rail carries the control traffic, and is never given up on. Every
+ * node must be given the same number of rails.
+ */
 bool initialize(const std::map<uint32_t, std::string>& addresses,
-                uint32_t node_rank) __attribute__((warn_unused_result));
+                uint32_t node_rank,
+                const std::vector<rdma::rail_config>& rails = {}) __attribute__((warn_unused_result));
 void add_address(uint32_t index, const std::string& address);
 void shutdown();
 
+/**
+ * Tells RDMC which rack (or switch) each node is attached to, for groups that
+ * use HIERARCHICAL_SEND. Nodes that are not in the map are assumed to be in
+ * rack 0. This affects groups created after the call, and every member of a
+ * group must have been given the same locations.
+ * @param locations A map from node IDs to rack IDs
+ */
+void set_node_locations(const std::map<uint32_t, uint32_t>& locations);
+
+/**
+ * Makes groups created after the call share one ready-for-block queue pair
+ * per node, instead of each group having its own to each of its neighbors, and
+ * take those queue pairs' receives from a single shared receive queue. Each
+ * group still has its own data queue pairs, since their receives land
+ * directly in the group's buffers. This must be set the same way on every
+ * node, before any groups are created.
+ * @return False if the device does not support shared receive queues.
+ */
+bool set_shared_queue_pairs(bool enabled);
+
+/**
+ * Makes RDMC's own buffers, and any allocated with
+ * rdma::memory_region::allocate() such as Derecho's message buffers, come
+ * from a few large registered chunks of this size backed by huge pages,
+ * instead of each being registered on its own. 0, the default, turns this
+ * off. Call it after initialize() and before creating groups, so that it
+ * covers their buffers; a few chunks' worth of buffers is a good size.
+ */
+void set_memory_arena_chunk_size(size_t chunk_size);
+
+/**
+ * Makes the buffers allocated after the call, RDMC's own and those from
+ * rdma::memory_region::allocate() or the memory arena, locked into memory,
+ * so that all their pages are faulted in before the first message and the
+ * kernel never unmaps them to reclaim, compact or migrate them, which
+ * registration alone does not prevent. Off by default; it needs a memlock
+ * limit large enough for the buffers.
+ */
+void set_lock_memory(bool enabled);
+
+/**
+ * Sets the InfiniBand service level of the queue pairs of groups created
+ * after the call, and on RoCE the matching DSCP class selector, so that
+ * switches can keep RDMC's bulk traffic in a class of its own, away from
+ * the SST's control traffic.
+ */
+void set_service_level(uint8_t service_level);
+
+/** The rate in bytes per second that this node's blocks are posted at, across
+ * all its groups; 0, the default, posts each as soon as it can be sent. */
+extern std::atomic<uint64_t> pacing_rate;
+/**
+ * Paces the blocks this node sends to the given rate, so that large messages
+ * don't fill the NIC's and the switches' queues ahead of other traffic, at
+ * the cost of the thread that posts a block waiting for its turn.
+ */
+void set_pacing_rate(uint64_t bytes_per_second);
+
+/** The smallest block size chosen for groups with adaptive block sizes */
+constexpr size_t min_block_size = 4096;
+/** The fixed cost of sending a block, expressed as the number of bytes that
+ * could have been sent in the same time; used to choose adaptive block sizes. */
+extern std::atomic<size_t> block_overhead_bytes;
+/**
+ * Sets the per-block cost used to choose adaptive block sizes, e.g. from a
+ * sweep like derecho/experiments/block_size.cpp: the per-block latency times
+ * the link bandwidth. Defaults to 64KB, which suits 100Gb/s links.
+ */
+void set_block_overhead_bytes(size_t bytes);
+
 /**
  * Creates a new RDMC group.
  * @param group_number The group's unique identifier.
@@ -59,16 +139,61 @@ void shutdown();
  * message in this group
  * @param failure_callback The function to call when RDMC detects a failure in
  * this group. It will be called with the suspected failed node's ID.
+ * @param adaptive_block_size If true, block_size is only the largest block
+ * size, and each message's block size is chosen from its size so that small
+ * messages are not sent as a single oversized block and large ones are
+ * pipelined; the choice is carried along with each block.
+ * @param landing_size If nonzero, each receiver advertises a buffer of this
+ * size to its neighbors, and blocks are written into it with RDMA writes with
+ * immediate instead of being sent into receives posted for each block. A
+ * receiver then says it is ready once per message instead of once per block,
+ * so small blocks go out with less latency, at the cost of copying each
+ * message out of the buffer once it has arrived. Messages can be no larger
+ * than this, and every member must give the same size.
+ * @param service_level If nonnegative, the service level of the group's
+ * queue pairs, in place of the one given to set_service_level, so that a
+ * group carrying latency-critical traffic can have a class of its own.
+ * Every member must give the same one.
  * @return True if group creation succeeds, false if it fails.
  */
 bool create_group(uint16_t group_number, std::vector<uint32_t> members,
                   size_t block_size, send_algorithm algorithm,
                   incoming_message_callback_t incoming_receive,
                   completion_callback_t send_callback,
-                  failure_callback_t failure_callback)
+                  failure_callback_t failure_callback,
+                  bool adaptive_block_size = false,
+                  size_t landing_size = 0,
+                  int service_level = -1)
         __attribute__((warn_unused_result));
 void destroy_group(uint16_t group_number);
+/**
+ * Destroys several groups at once. Their queue pairs are torn down on a few
+ * threads side by side, which is much faster than destroying the groups one
+ * at a time when a node with many groups leaves or shuts down.
+ */
+void destroy_groups(const std::vector<uint16_t>& group_numbers);
+/**
+ * Replaces the functions a group calls for incoming and completed messages,
+ * so that a group whose members have not changed can be handed to a new owner
+ * instead of being destroyed and re-created with new connections. A message
+ * that is in progress finishes with the new functions.
+ * @return True if the group exists.
+ */
+bool rebind_group(uint16_t group_number,
+                  incoming_message_callback_t incoming_receive,
+                  completion_callback_t send_callback);
+/**
+ * @return True if no message is being sent or received by this node in the
+ * group, or if the group does not exist.
+ */
+bool group_is_idle(uint16_t group_number);
 
+/**
+ * Starts sending a message in a group of which this node is the sender. If it
+ * is still sending an earlier message, the new one is queued and started as
+ * soon as this node has finished its part of the earlier one, so a sender
+ * can keep several messages in flight.
+ */
 bool send(uint16_t group_number, std::shared_ptr<rdma::memory_region> mr,
           size_t offset, size_t length) __attribute__((warn_unused_result));
 
@@ -98,6 +223,10 @@ class barrier_group {
     // Number of steps per barrier.
     unsigned int total_steps;
 
+    // Only one barrier in this many signals its writes, which is enough to
+    // keep their queue pairs' send queues from filling up.
+    static constexpr int64_t barrier_signal_interval = 8;
+
     // Lock to ensure that only one barrier is in flight at a time.
     std::mutex lock;
 
@@ -1,8 +1,10 @@
 
 #include "schedule.h"
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
+#include <map>
 
 using std::experimental::optional;
 using std::min;
@@ -486,3 +488,95 @@ optional<schedule::block_transfer> binomial_schedule::get_first_block(size_t num
 
     return transfer;
 }
+
+hierarchical_schedule::hierarchical_schedule(uint32_t members, uint32_t index,
+                                             const vector<uint32_t>& member_racks)
+        : schedule(members, index), max_rack_size(0) {
+    assert(member_racks.size() == num_members);
+    std::map<uint32_t, vector<uint32_t>> racks;
+    for(uint32_t i = 0; i < num_members; ++i) {
+        auto& rack = racks[member_racks[i]];
+        if(rack.empty()) {
+            leaders.push_back(i);
+        }
+        rack.push_back(i);
+    }
+    for(const auto& rack : racks) {
+        max_rack_size = std::max(max_rack_size, (uint32_t)rack.second.size());
+    }
+    rack_members = racks[member_racks[member_index]];
+
+    auto leader_it = std::find(leaders.begin(), leaders.end(), member_index);
+    if(leader_it != leaders.end() && leaders.size() > 1) {
+        leader_schedule = std::make_unique<binomial_schedule>(leaders.size(), leader_it - leaders.begin());
+    }
+    if(rack_members.size() > 1) {
+        auto rack_index = std::find(rack_members.begin(), rack_members.end(), member_index) - rack_members.begin();
+        rack_schedule = std::make_unique<binomial_schedule>(rack_members.size(), rack_index);
+    }
+}
+optional<schedule::block_transfer> hierarchical_schedule::map_target(
+        const optional<block_transfer>& transfer, const vector<uint32_t>& indices) {
+    if(!transfer) {
+        return std::experimental::nullopt;
+    }
+    return block_transfer{indices[transfer->target], transfer->block_number};
+}
+size_t hierarchical_schedule::get_leader_steps(size_t num_blocks) const {
+    if(leaders.size() < 2) {
+        return 0;
+    }
+    return binomial_schedule(leaders.size(), 0).get_total_steps(num_blocks);
+}
+vector<uint32_t> hierarchical_schedule::get_connections() const {
+    vector<uint32_t> ret;
+    if(leader_schedule) {
+        for(auto c : leader_schedule->get_connections()) {
+            ret.push_back(leaders[c]);
+        }
+    }
+    if(rack_schedule) {
+        for(auto c : rack_schedule->get_connections()) {
+            ret.push_back(rack_members[c]);
+        }
+    }
+    return ret;
+}
+size_t hierarchical_schedule::get_total_steps(size_t num_blocks) const {
+    size_t rack_steps = max_rack_size > 1 ? binomial_schedule(max_rack_size, 0).get_total_steps(num_blocks) : 0;
+    return get_leader_steps(num_blocks) + rack_steps;
+}
+optional<schedule::block_transfer> hierarchical_schedule::get_outgoing_transfer(size_t num_blocks, size_t step) const {
+    size_t leader_steps = get_leader_steps(num_blocks);
+    if(step < leader_steps) {
+        if(!leader_schedule) {
+            return std::experimental::nullopt;
+        }
+        return map_target(leader_schedule->get_outgoing_transfer(num_blocks, step), leaders);
+    }
+    if(!rack_schedule || step - leader_steps >= rack_schedule->get_total_steps(num_blocks)) {
+        return std::experimental::nullopt;
+    }
+    return map_target(rack_schedule->get_outgoing_transfer(num_blocks, step - leader_steps), rack_members);
+}
+optional<schedule::block_transfer> hierarchical_schedule::get_incoming_transfer(size_t num_blocks, size_t step) const {
+    size_t leader_steps = get_leader_steps(num_blocks);
+    if(step < leader_steps) {
+        if(!leader_schedule) {
+            return std::experimental::nullopt;
+        }
+        return map_target(leader_schedule->get_incoming_transfer(num_blocks, step), leaders);
+    }
+    if(!rack_schedule || step - leader_steps >= rack_schedule->get_total_steps(num_blocks)) {
+        return std::experimental::nullopt;
+    }
+    return map_target(rack_schedule->get_incoming_transfer(num_blocks, step - leader_steps), rack_members);
+}
+optional<schedule::block_transfer> hierarchical_schedule::get_first_block(size_t num_blocks) const {
+    if(member_index == 0) return std::experimental::nullopt;
+    // Leaders get their first block from another leader, everyone else from their own rack
+    if(rack_members[0] == member_index) {
+        return map_target(leader_schedule->get_first_block(num_blocks), leaders);
+    }
+    return map_target(rack_schedule->get_first_block(num_blocks), rack_members);
+}
@@ -4,6 +4,7 @@
 
 #include <cmath>
 #include <experimental/optional>
+#include <memory>
 #include <vector>
 
 using std::experimental::optional;
@@ -104,4 +105,47 @@ public:
     size_t get_total_steps(size_t num_blocks) const;
 };
 
+/**
+ * A schedule for groups spread over several racks (or switches), which keeps
+ * as much traffic as possible off the links between them. The first member of
+ * each rack to appear in the group is its leader; the sender, member 0, always
+ * leads its own rack. The message is first sent to the leaders with a
+ * binomial pipeline among them only, and then each leader sends it to the
+ * rest of its rack with a binomial pipeline within the rack, so every block
+ * crosses into each rack once.
+ */
+class hierarchical_schedule : public schedule {
+private:
+    /** The member index of each rack's leader, in the order of the leaders' indices */
+    vector<uint32_t> leaders;
+    /** The member indices of this node's rack, starting with its leader */
+    vector<uint32_t> rack_members;
+    /** The size of the largest rack, which bounds the length of the second phase */
+    uint32_t max_rack_size;
+    /** The schedule among the leaders, if this node is one and there is more than one rack */
+    std::unique_ptr<binomial_schedule> leader_schedule;
+    /** The schedule within this node's rack, if it has more than one member */
+    std::unique_ptr<binomial_schedule> rack_schedule;
+
+    /** @return The number of steps before the within-rack phase starts */
+    size_t get_leader_steps(size_t num_blocks) const;
+    /** Converts a transfer from one of the phases' schedules to member indices. */
+    static optional<block_transfer> map_target(const optional<block_transfer>& transfer,
+                                               const vector<uint32_t>& indices);
+
+public:
+    /**
+     * @param members The number of members in the group
+     * @param index This node's index in the group
+     * @param member_racks The rack of each member, indexed by member index
+     */
+    hierarchical_schedule(uint32_t members, uint32_t index, const vector<uint32_t>& member_racks);
+
+    vector<uint32_t> get_connections() const;
+    optional<block_transfer> get_outgoing_transfer(size_t num_blocks, size_t send_step) const;
+    optional<block_transfer> get_incoming_transfer(size_t num_blocks, size_t receive_step) const;
+    optional<block_transfer> get_first_block(size_t num_blocks) const;
+    size_t get_total_steps(size_t num_blocks) const;
+};
+
 #endif /* SCHEDULE_H */
@@ -116,8 +116,6 @@ double compute_stddev(std::vector<double> v) {
     return std::sqrt(sq_sum / v.size() - mean * mean);
 }
 
-vector<event> events;
-std::mutex events_mutex;
 void start_flush_server() {
     auto flush_server = []() {
         while(true) {
@@ -129,12 +127,8 @@ void start_flush_server() {
     t.detach();
 }
 void flush_events() {
-    std::unique_lock<std::mutex> lock(events_mutex);
-
-    auto basename = [](const char *path) {
-        const char *base = strrchr(path, '/');
-        return base ? base + 1 : path;
-    };
+    static std::mutex print_mutex;
+    std::unique_lock<std::mutex> lock(print_mutex);
 
     static bool print_header = true;
     if(print_header) {
@@ -143,28 +137,26 @@ void flush_events() {
                 "block_number\n");
         print_header = false;
     }
-    for(const auto &e : events) {
+    const derecho::trace::Calibration calibration;
+    derecho::trace::flush([&](const derecho::trace::Ring &, const derecho::trace::Event &e) {
+        const double time = 1.0e-6 * (calibration.monotonic_ns(e.tsc) - epoch_start);
+        const char *file = derecho::trace::base_name(e.file);
         if(e.group_number == (uint32_t)(-1)) {
-            printf("%5.6f, %s:%d, %s\n", 1.0e-6 * (e.time - epoch_start),
-                   basename(e.file), e.line, e.event_name);
+            printf("%5.6f, %s:%d, %s\n", time, file, e.line, e.name);
 
-        } else if(e.message_number == (size_t)(-1)) {
-            printf("%5.6f, %s:%d, %s, %" PRIu32 "\n",
-                   1.0e-6 * (e.time - epoch_start), basename(e.file), e.line,
-                   e.event_name, e.group_number);
+        } else if(e.message_number == (uint64_t)(-1)) {
+            printf("%5.6f, %s:%d, %s, %" PRIu32 "\n", time, file, e.line,
+                   e.name, e.group_number);
 
-        } else if(e.block_number == (size_t)(-1)) {
-            printf("%5.6f, %s:%d, %s, %" PRIu32 ", %zu\n",
-                   1.0e-6 * (e.time - epoch_start), basename(e.file), e.line,
-                   e.event_name, e.group_number, e.message_number);
+        } else if(e.block_number == (uint64_t)(-1)) {
+            printf("%5.6f, %s:%d, %s, %" PRIu32 ", %" PRIu64 "\n", time, file,
+                   e.line, e.name, e.group_number, e.message_number);
 
         } else {
-            printf("%5.6f, %s:%d, %s, %" PRIu32 ", %zu, %zu\n",
-                   1.0e-6 * (e.time - epoch_start), basename(e.file), e.line,
-                   e.event_name, e.group_number, e.message_number,
-                   e.block_number);
+            printf("%5.6f, %s:%d, %s, %" PRIu32 ", %" PRIu64 ", %" PRIu64 "\n",
+                   time, file, e.line, e.name, e.group_number,
+                   e.message_number, e.block_number);
         }
-    }
+    });
     fflush(stdout);
-    events.clear();
 }
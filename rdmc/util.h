@@ -2,6 +2,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include "derecho/trace.h"
 #include "time/time.h"
 
 #include <cstdlib>
@@ -36,35 +37,15 @@ double compute_stddev(std::vector<double> v);
         put_flush(x); \
     } while(0)
 
-struct event {
-    const char *file;
-    const char *event_name;
-    uint64_t time;
-
-    int line;
-    uint32_t group_number;
-    size_t message_number;
-    size_t block_number;
-};
-extern std::vector<event> events;
-extern std::mutex events_mutex;
-inline void log_event(const char *file, int line, uint32_t group_number,
-                      size_t message_number, size_t block_number,
-                      const char *event_name) {
-    std::unique_lock<std::mutex> lock(events_mutex);
-    events.emplace_back(event{file, event_name, get_time(), line, group_number,
-                              message_number, block_number});
-}
 void flush_events();
 void start_flush_server();
-#define DERECHO_LOG(sender, message_number, event_name)                        \
-    do {                                                                       \
-        log_event(__FILE__, __LINE__, sender, message_number, -1, event_name); \
-    } while(0)
+// Both kinds of events are recorded by the tracing in derecho/trace.h, and so
+// are only recorded when DERECHO_TRACE is defined.
+#define DERECHO_LOG(sender, message_number, event_name) \
+    DERECHO_TRACE_POINT(sender, message_number, -1, event_name)
 
 #define LOG_EVENT(group_number, message_number, block_number, event_name) \
-    do {                                                                  \
-    } while(0)
+    DERECHO_TRACE_POINT(group_number, message_number, block_number, event_name)
 
 inline void CHECK(bool b) {
     if(!b) {
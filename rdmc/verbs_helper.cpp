@@ -5,10 +5,13 @@
 #include <list>
 #include <mutex>
 #include <poll.h>
+#include <sys/mman.h>
 #include <thread>
 #include <vector>
 
 #include "derecho/derecho_ports.h"
+#include "derecho/rdma_device.h"
+#include "derecho/thread_placement.h"
 #include "tcp/tcp.h"
 #include "util.h"
 #include "verbs_helper.h"
@@ -56,28 +59,82 @@ struct ibv_resources {
     ibv_comp_channel *cc;         // Completion channel
 } verbs_resources;
 
+// A device and port after the first; verbs_resources and local_config are
+// rail 0, and rail r is extra_rails[r - 1]
+struct rail_t {
+    config_t config;
+    ibv_resources resources;
+};
+static vector<rail_t> extra_rails;
+// Set once an operation fails on a rail, so that no more is posted on it
+static atomic<bool> rail_failed[max_rails];
+
+static ibv_resources &rail_resources(uint32_t rail) {
+    return rail == 0 ? verbs_resources : extra_rails.at(rail - 1).resources;
+}
+static config_t &rail_config_of(uint32_t rail) {
+    return rail == 0 ? local_config : extra_rails.at(rail - 1).config;
+}
+
 struct completion_handler_set {
     completion_handler send;
     completion_handler recv;
     completion_handler write;
+    completion_handler read;
+    completion_handler failure;
     string name;
 };
 static vector<completion_handler_set> completion_handlers;
 static std::mutex completion_handlers_mutex;
 
 static atomic<bool> interrupt_mode;
+static atomic<uint8_t> service_level{0};
+// If nonnegative, the service level of the queue pairs this thread connects
+static thread_local int connecting_service_level = -1;
 static atomic<bool> contiguous_memory_mode;
+static atomic<bool> lock_memory_mode;
 
 static feature_set supported_features;
 
+static std::mutex memory_arena_mutex;
+static shared_ptr<memory_arena> current_memory_arena;
+
+// The most user buffer registrations that are kept around for reuse
+static const size_t max_cached_registrations = 256;
+static std::mutex registration_cache_mutex;
+// Registrations of user buffers by start address, protected by
+// registration_cache_mutex along with implicit_mr
+static map<uintptr_t, shared_ptr<memory_region>> registration_cache;
+static ibv_mr *implicit_mr = nullptr;
+
+// Polls the rails' completion queues in turn, starting after the rail that
+// last had completions so that none of them is starved
+static int poll_rails(ibv_wc *work_completions, int max_work_completions,
+                      uint32_t &rail) {
+    const uint32_t count = 1 + extra_rails.size();
+    for(uint32_t i = 1; i <= count; ++i) {
+        const uint32_t r = (rail + i) % count;
+        int num_completions = ibv_poll_cq(rail_resources(r).cq, max_work_completions,
+                                          work_completions);
+        if(num_completions != 0) {
+            rail = r;
+            return num_completions;
+        }
+    }
+    return 0;
+}
+
 static atomic<bool> polling_loop_shutdown_flag;
 static void polling_loop() {
     pthread_setname_np(pthread_self(), "rdmc_poll");
+    derecho::place_this_thread("rdmc_poll");
     TRACE("Spawned main loop");
 
     const int max_work_completions = 1024;
     unique_ptr<ibv_wc[]> work_completions(new ibv_wc[max_work_completions]);
 
+    const uint32_t num_rails = 1 + extra_rails.size();
+    uint32_t rail = 0;
     while(true) {
         int num_completions = 0;
         while(num_completions == 0) {
@@ -85,33 +142,39 @@ static void polling_loop() {
             uint64_t poll_end = get_time() + (interrupt_mode ? 0L : 50000000L);
             do {
                 if(polling_loop_shutdown_flag) return;
-                num_completions = ibv_poll_cq(verbs_resources.cq, max_work_completions,
-                                              work_completions.get());
+                num_completions = poll_rails(work_completions.get(),
+                                             max_work_completions, rail);
             } while(num_completions == 0 && get_time() < poll_end);
 
             if(num_completions == 0) {
-                if(ibv_req_notify_cq(verbs_resources.cq, 0))
-                    throw rdma::exception();
+                for(uint32_t r = 0; r < num_rails; ++r) {
+                    if(ibv_req_notify_cq(rail_resources(r).cq, 0))
+                        throw rdma::exception();
+                }
 
-                num_completions = ibv_poll_cq(verbs_resources.cq, max_work_completions,
-                                              work_completions.get());
+                num_completions = poll_rails(work_completions.get(),
+                                             max_work_completions, rail);
 
                 if(num_completions == 0) {
-                    pollfd file_descriptor;
-                    file_descriptor.fd = verbs_resources.cc->fd;
-                    file_descriptor.events = POLLIN;
-                    file_descriptor.revents = 0;
+                    pollfd file_descriptors[max_rails];
+                    for(uint32_t r = 0; r < num_rails; ++r) {
+                        file_descriptors[r].fd = rail_resources(r).cc->fd;
+                        file_descriptors[r].events = POLLIN;
+                        file_descriptors[r].revents = 0;
+                    }
                     int rc = 0;
                     while(rc == 0 && !polling_loop_shutdown_flag) {
                         if(polling_loop_shutdown_flag) return;
-                        rc = poll(&file_descriptor, 1, 50);
+                        rc = poll(file_descriptors, num_rails, 50);
                     }
 
-                    if(rc > 0) {
-                        ibv_cq *ev_cq;
-                        void *ev_ctx;
-                        ibv_get_cq_event(verbs_resources.cc, &ev_cq, &ev_ctx);
-                        ibv_ack_cq_events(ev_cq, 1);
+                    for(uint32_t r = 0; rc > 0 && r < num_rails; ++r) {
+                        if(file_descriptors[r].revents) {
+                            ibv_cq *ev_cq;
+                            void *ev_ctx;
+                            ibv_get_cq_event(rail_resources(r).cc, &ev_cq, &ev_ctx);
+                            ibv_ack_cq_events(ev_cq, 1);
+                        }
                     }
                 }
             }
@@ -132,13 +195,17 @@ static void polling_loop() {
                 if(wc.opcode == IBV_WC_SEND) opcode = "IBV_WC_SEND";
                 if(wc.opcode == IBV_WC_RECV) opcode = "IBV_WC_RECV";
                 if(wc.opcode == IBV_WC_RDMA_WRITE) opcode = "IBV_WC_RDMA_WRITE";
+                if(wc.opcode == IBV_WC_RDMA_READ) opcode = "IBV_WC_RDMA_READ";
+                if(wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) opcode = "IBV_WC_RECV_RDMA_WITH_IMM";
 
                 // Failed operation
                 printf("wc.status = %d; wc.wr_id = 0x%llx; imm = 0x%x; "
-                       "opcode = %s\n",
+                       "opcode = %s; rail = %u\n",
                        (int)wc.status, (long long)wc.wr_id,
-                       (unsigned int)wc.imm_data, opcode.c_str());
+                       (unsigned int)wc.imm_data, opcode.c_str(),
+                       (unsigned int)rail);
                 fflush(stdout);
+                impl::mark_rail_failed(rail);
             }
 
             message_type::tag_type type = wc.wr_id >> message_type::shift_bits;
@@ -149,16 +216,27 @@ static void polling_loop() {
             if(type >= completion_handlers.size()) {
                 // Unrecognized message type
             } else if(wc.status != 0) {
-                // Failed operation
+                // Failed operation, which can be retried elsewhere if it was
+                // on a rail that has been given up on
+                if(rail != 0 && completion_handlers[type].failure) {
+                    completion_handlers[type].failure(masked_wr_id, rail, 0);
+                }
             } else if(wc.opcode == IBV_WC_SEND) {
                 completion_handlers[type].send(masked_wr_id, wc.imm_data,
                                                wc.byte_len);
-            } else if(wc.opcode == IBV_WC_RECV) {
+            } else if(wc.opcode == IBV_WC_RECV || wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                // The receive a write with immediate took is completed like
+                // any other, with the length of the write
                 completion_handlers[type].recv(masked_wr_id, wc.imm_data,
                                                wc.byte_len);
             } else if(wc.opcode == IBV_WC_RDMA_WRITE) {
                 completion_handlers[type].write(masked_wr_id, wc.imm_data,
                                                 wc.byte_len);
+            } else if(wc.opcode == IBV_WC_RDMA_READ) {
+                if(completion_handlers[type].read) {
+                    completion_handlers[type].read(masked_wr_id, wc.imm_data,
+                                                   wc.byte_len);
+                }
             } else {
                 puts("Sent unrecognized completion type?!");
             }
@@ -183,30 +261,32 @@ static int modify_qp_to_init(struct ibv_qp *qp, int ib_port) {
 
 static int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn,
                             uint16_t dlid, uint8_t *dgid, int ib_port,
-                            int gid_idx) {
+                            int gid_idx, ibv_mtu path_mtu) {
     struct ibv_qp_attr attr;
     int flags;
     int rc;
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_RTR;
-    attr.path_mtu = verbs_resources.port_attr.active_mtu;
+    attr.path_mtu = path_mtu;
     attr.dest_qp_num = remote_qpn;
     attr.rq_psn = 0;
     attr.max_dest_rd_atomic = 1;
     attr.min_rnr_timer = 16;
     attr.ah_attr.is_global = 1;
     attr.ah_attr.dlid = dlid;
-    attr.ah_attr.sl = 0;
+    const uint8_t level = connecting_service_level >= 0 ? connecting_service_level : service_level.load();
+    attr.ah_attr.sl = level;
     attr.ah_attr.src_path_bits = 0;
     attr.ah_attr.port_num = ib_port;
     if(gid_idx >= 0) {
         attr.ah_attr.is_global = 1;
-        attr.ah_attr.port_num = 1;
+        attr.ah_attr.port_num = ib_port;
         memcpy(&attr.ah_attr.grh.dgid, dgid, 16);
         attr.ah_attr.grh.flow_label = 0;
         attr.ah_attr.grh.hop_limit = 0xFF;
         attr.ah_attr.grh.sgid_index = gid_idx;
-        attr.ah_attr.grh.traffic_class = 0;
+        // On RoCE, the matching DSCP class selector
+        attr.ah_attr.grh.traffic_class = level << 5;
     }
     flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
     rc = ibv_modify_qp(qp, &attr, flags);
@@ -231,8 +311,75 @@ static int modify_qp_to_rts(struct ibv_qp *qp) {
     return rc;
 }
 
+// Opens a rail after the first, with a completion queue and protection domain
+// of its own
+static bool open_extra_rail(const rail_config &rail, ibv_device **dev_list,
+                            int num_devices) {
+    extra_rails.emplace_back();
+    rail_t &extra_rail = extra_rails.back();
+    memset(&extra_rail.resources, 0, sizeof(extra_rail.resources));
+    extra_rail.config.dev_name = strdup(rail.device_name.c_str());
+    extra_rail.config.ib_port = rail.port;
+    ibv_resources *res = &extra_rail.resources;
+
+    for(int i = 0; i < num_devices; i++) {
+        if(!strcmp(ibv_get_device_name(dev_list[i]), extra_rail.config.dev_name)) {
+            res->ib_ctx = ibv_open_device(dev_list[i]);
+            break;
+        }
+    }
+    if(!res->ib_ctx) {
+        fprintf(stderr, "failed to open IB device %s for a rail\n",
+                extra_rail.config.dev_name);
+        return false;
+    }
+    if(ibv_query_port(res->ib_ctx, extra_rail.config.ib_port, &res->port_attr)) {
+        fprintf(stderr, "ibv_query_port on port %u of %s failed\n",
+                extra_rail.config.ib_port, extra_rail.config.dev_name);
+        return false;
+    }
+    extra_rail.config.gid_idx = derecho::choose_gid_index(res->ib_ctx, extra_rail.config.ib_port,
+                                                          res->port_attr);
+    res->pd = ibv_alloc_pd(res->ib_ctx);
+    if(!res->pd) {
+        fprintf(stderr, "ibv_alloc_pd failed\n");
+        return false;
+    }
+    res->cc = ibv_create_comp_channel(res->ib_ctx);
+    if(!res->cc || fcntl(res->cc->fd, F_SETFL, fcntl(res->cc->fd, F_GETFL) | O_NONBLOCK)) {
+        fprintf(stderr, "failed to create a completion channel for a rail\n");
+        return false;
+    }
+    res->cq = ibv_create_cq(res->ib_ctx, 1024, NULL, res->cc, 0);
+    if(!res->cq) {
+        fprintf(stderr, "failed to create a CQ for a rail\n");
+        return false;
+    }
+    fprintf(stdout, "using port %d of %s as rail %u\n", extra_rail.config.ib_port,
+            extra_rail.config.dev_name, (unsigned int)extra_rails.size());
+    return true;
+}
+
+static void destroy_resources(ibv_resources &resources) {
+    if(resources.cq && ibv_destroy_cq(resources.cq)) {
+        fprintf(stderr, "failed to destroy CQ\n");
+    }
+    if(resources.cc && ibv_destroy_comp_channel(resources.cc)) {
+        fprintf(stderr, "failed to destroy Completion Channel\n");
+    }
+    if(resources.pd && ibv_dealloc_pd(resources.pd)) {
+        fprintf(stderr, "failed to deallocate PD\n");
+    }
+    if(resources.ib_ctx && ibv_close_device(resources.ib_ctx)) {
+        fprintf(stderr, "failed to close device context\n");
+    }
+}
+
 namespace impl {
 void verbs_destroy() {
+    for(rail_t &extra_rail : extra_rails) {
+        destroy_resources(extra_rail.resources);
+    }
     if(verbs_resources.cq && ibv_destroy_cq(verbs_resources.cq)) {
         fprintf(stderr, "failed to destroy CQ\n");
     }
@@ -248,21 +395,25 @@ void verbs_destroy() {
 }
 
 bool verbs_initialize(const map<uint32_t, string> &node_addresses,
-                      uint32_t node_rank) {
+                      uint32_t node_rank, const vector<rail_config> &rails) {
     memset(&verbs_resources, 0, sizeof(verbs_resources));
+    if(rails.size() > max_rails) {
+        fprintf(stderr, "at most %u rails can be used\n", (unsigned int)max_rails);
+        return false;
+    }
 
     connection_listener = make_unique<tcp::connection_listener>(derecho::rdmc_tcp_port);
 
     TRACE("Starting connection phase");
 
-    // Connect to other nodes in group. Since map traversal is ordered, we don't
-    // have to worry about circular waits, so deadlock can't occur.
+    // Connect to every other node in the group at once, rather than waiting
+    // for each before trying the next
+    sockets = tcp::connect_to_all(*connection_listener, node_addresses, node_rank,
+                                  derecho::rdmc_tcp_port);
     for(auto it = node_addresses.begin(); it != node_addresses.end(); it++) {
-        if(it->first != node_rank) {
-            if(!verbs_add_connection(it->first, it->second, node_rank)) {
-                fprintf(stderr, "WARNING: failed to connect to node %d at %s\n",
-                        (int)it->first, it->second.c_str());
-            }
+        if(it->first != node_rank && sockets.count(it->first) == 0) {
+            fprintf(stderr, "WARNING: failed to connect to node %d at %s\n",
+                    (int)it->first, it->second.c_str());
         }
     }
     TRACE("Done connecting");
@@ -288,10 +439,15 @@ bool verbs_initialize(const map<uint32_t, string> &node_addresses,
         goto resources_create_exit;
     }
 
-    local_config.dev_name = getenv("RDMC_DEVICE_NAME");
+    if(!rails.empty()) {
+        local_config.dev_name = strdup(rails[0].device_name.c_str());
+        local_config.ib_port = rails[0].port;
+    } else {
+        local_config.dev_name = getenv("RDMC_DEVICE_NAME");
+    }
     fprintf(stdout, "found %d device(s)\n", num_devices);
     /* search for the specific device we want to work with */
-    for(i = 1; i < num_devices; i++) {
+    for(i = 0; i < num_devices; i++) {
         if(!local_config.dev_name) {
             local_config.dev_name = strdup(ibv_get_device_name(dev_list[i]));
             fprintf(stdout, "device not specified, using first one found: %s\n",
@@ -309,10 +465,16 @@ bool verbs_initialize(const map<uint32_t, string> &node_addresses,
     }
     /* get device handle */
     res->ib_ctx = ibv_open_device(ib_dev);
+    derecho::record_nic_device(ib_dev->ibdev_path);
     if(!res->ib_ctx) {
         fprintf(stderr, "failed to open device %s\n", local_config.dev_name);
         goto resources_create_exit;
     }
+    for(size_t rail = 1; rail < rails.size(); ++rail) {
+        if(!open_extra_rail(rails[rail], dev_list, num_devices)) {
+            goto resources_create_exit;
+        }
+    }
     /* We are now done with device list, free it */
     ibv_free_device_list(dev_list);
     dev_list = NULL;
@@ -323,6 +485,8 @@ bool verbs_initialize(const map<uint32_t, string> &node_addresses,
                 local_config.ib_port);
         goto resources_create_exit;
     }
+    local_config.gid_idx = derecho::choose_gid_index(res->ib_ctx, local_config.ib_port,
+                                                     res->port_attr);
     /* allocate Protection Domain */
     res->pd = ibv_alloc_pd(res->ib_ctx);
     if(!res->pd) {
@@ -361,10 +525,12 @@ bool verbs_initialize(const map<uint32_t, string> &node_addresses,
         supported_features.contiguous_memory = true;
 
         ibv_exp_device_attr attr;
-        attr.comp_mask = 0;
+        attr.comp_mask = IBV_EXP_DEVICE_ATTR_EXP_CAP_FLAGS | IBV_EXP_DEVICE_ATTR_ODP;
         int ret = ibv_exp_query_device(res->ib_ctx, &attr);
         if(ret == 0) {
             supported_features.cross_channel = attr.exp_device_cap_flags & IBV_EXP_DEVICE_CROSS_CHANNEL;
+            supported_features.on_demand_paging = (attr.comp_mask & IBV_EXP_DEVICE_ATTR_ODP)
+                                                  && (attr.odp_caps.general_odp_caps & IBV_EXP_ODP_SUPPORT_IMPLICIT);
         }
     }
 #endif
@@ -394,12 +560,39 @@ resources_create_exit:
         ibv_close_device(res->ib_ctx);
         res->ib_ctx = NULL;
     }
+    for(rail_t &extra_rail : extra_rails) {
+        destroy_resources(extra_rail.resources);
+    }
+    extra_rails.clear();
     if(dev_list) {
         ibv_free_device_list(dev_list);
         dev_list = NULL;
     }
     return false;
 }
+
+void set_service_level(uint8_t level) {
+    service_level = level;
+}
+
+void set_connecting_service_level(int level) {
+    connecting_service_level = level;
+}
+
+uint32_t num_rails() {
+    return 1 + extra_rails.size();
+}
+
+bool rail_is_up(uint32_t rail) {
+    return rail == 0 || (rail < num_rails() && !rail_failed[rail]);
+}
+
+void mark_rail_failed(uint32_t rail) {
+    if(rail != 0 && !rail_failed[rail].exchange(true)) {
+        fprintf(stderr, "rail %u failed, so it will no longer be used\n",
+                (unsigned int)rail);
+    }
+}
 bool verbs_add_connection(uint32_t index, const string &address,
                           uint32_t node_rank) {
     if(index < node_rank) {
@@ -471,16 +664,27 @@ bool set_contiguous_memory_mode(bool enabled) {
     return false;
 #endif
 }
+void set_memory_arena_chunk_size(size_t chunk_size) {
+    lock_guard<mutex> l(memory_arena_mutex);
+    if(chunk_size == 0) {
+        current_memory_arena.reset();
+    } else {
+        current_memory_arena = make_shared<memory_arena>(chunk_size);
+    }
+}
+void set_lock_memory_mode(bool enabled) {
+    lock_memory_mode = enabled;
+}
 }
 
 using ibv_mr_unique_ptr = unique_ptr<ibv_mr, std::function<void(ibv_mr *)>>;
-static ibv_mr_unique_ptr create_mr(char *buffer, size_t size) {
+static ibv_mr_unique_ptr create_mr(char *buffer, size_t size, uint32_t rail = 0) {
     if(!buffer || size == 0) throw rdma::invalid_args();
 
     int mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
 
     ibv_mr_unique_ptr mr = ibv_mr_unique_ptr(
-            ibv_reg_mr(verbs_resources.pd, (void *)buffer, size, mr_flags),
+            ibv_reg_mr(rail_resources(rail).pd, (void *)buffer, size, mr_flags),
             [](ibv_mr *m) { ibv_dereg_mr(m); });
 
     if(!mr) {
@@ -488,6 +692,41 @@ static ibv_mr_unique_ptr create_mr(char *buffer, size_t size) {
     }
     return mr;
 }
+#ifdef DERECHO_GPUDIRECT
+// Registers GPU memory at the addresses of its CPU mapping, so that work
+// requests can use the same addresses as the rest of the code
+static ibv_mr_unique_ptr create_device_mr(char *device_buffer, char *host_mapping, size_t size,
+                                          int dmabuf_fd, uint64_t dmabuf_offset, uint32_t rail = 0) {
+    if(!device_buffer || !host_mapping || size == 0) throw rdma::invalid_args();
+
+    int mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+
+    ibv_mr *raw_mr;
+    if(dmabuf_fd != -1) {
+        raw_mr = ibv_reg_dmabuf_mr(rail_resources(rail).pd, dmabuf_offset, size,
+                                   (uint64_t)(uintptr_t)host_mapping, dmabuf_fd, mr_flags);
+    } else {
+        raw_mr = ibv_reg_mr_iova(rail_resources(rail).pd, (void *)device_buffer, size,
+                                 (uint64_t)(uintptr_t)host_mapping, mr_flags);
+    }
+    ibv_mr_unique_ptr mr = ibv_mr_unique_ptr(raw_mr, [](ibv_mr *m) { ibv_dereg_mr(m); });
+
+    if(!mr) {
+        throw rdma::mr_creation_failure();
+    }
+    return mr;
+}
+#endif
+// Locks a buffer into memory if lock_memory_mode is on, which faults in
+// every page now instead of on the first message
+static bool lock_buffer(void *buffer, size_t size) {
+    if(!lock_memory_mode) return false;
+    if(mlock(buffer, size) != 0) {
+        fprintf(stderr, "WARNING: could not lock a buffer of %zu bytes, errno %d\n", size, errno);
+        return false;
+    }
+    return true;
+}
 #ifdef MELLANOX_EXPERIMENTAL_VERBS
 static ibv_mr_unique_ptr create_contiguous_mr(size_t size) {
     if(size == 0) throw rdma::invalid_args();
@@ -512,21 +751,241 @@ memory_region::memory_region(size_t s, bool contiguous)
           size(s) {
     if(contiguous) {
         memset(buffer, 0, size);
+        register_on_rails();
     } else {
         allocated_buffer.reset(buffer);
+        locked = lock_buffer(buffer, size);
     }
 }
 #else
 memory_region::memory_region(size_t s, bool contiguous) : memory_region(new char[s], s) {
     allocated_buffer.reset(buffer);
+    locked = lock_buffer(buffer, size);
 }
 #endif
 
+memory_region::~memory_region() {
+    if(locked) {
+        munlock(buffer, size);
+    }
+}
+
 memory_region::memory_region(size_t s) : memory_region(s, contiguous_memory_mode) {}
-memory_region::memory_region(char *buf, size_t s) : mr(create_mr(buf, s)), buffer(buf), size(s) {}
+memory_region::memory_region(char *buf, size_t s) : mr(create_mr(buf, s)), buffer(buf), size(s) {
+    register_on_rails();
+}
+
+memory_region::memory_region(pair<char *, ibv_mr_unique_ptr> allocation, size_t s)
+        : mr(std::move(allocation.second)), buffer(allocation.first), size(s) {}
+
+void memory_region::register_on_rails() {
+    for(uint32_t rail = 1; rail <= extra_rails.size(); ++rail) {
+        rail_mrs.push_back(create_mr(buffer, size, rail));
+    }
+}
+
+uint32_t memory_region::get_lkey(uint32_t rail) const {
+    if(rail == 0) return mr->lkey;
+    // Regions are registered on every rail, which are all opened first
+    if(rail > rail_mrs.size()) throw invalid_args();
+    return rail_mrs[rail - 1]->lkey;
+}
 
 uint32_t memory_region::get_rkey() const { return mr->rkey; }
 
+unique_ptr<memory_region> memory_region::allocate(size_t size) {
+    shared_ptr<memory_arena> arena;
+    {
+        lock_guard<mutex> l(memory_arena_mutex);
+        arena = current_memory_arena;
+    }
+    if(arena) {
+        unique_ptr<memory_region> region(new memory_region(arena->allocate(size), size));
+        region->register_on_rails();
+        return region;
+    }
+    return unique_ptr<memory_region>(new memory_region(size, false));
+}
+
+#ifdef DERECHO_GPUDIRECT
+unique_ptr<memory_region> memory_region::for_device_buffer(char *device_buffer, char *host_mapping, size_t size,
+                                                           int dmabuf_fd, uint64_t dmabuf_offset) {
+    unique_ptr<memory_region> region(new memory_region(
+            {host_mapping, create_device_mr(device_buffer, host_mapping, size, dmabuf_fd, dmabuf_offset)}, size));
+    for(uint32_t rail = 1; rail <= extra_rails.size(); ++rail) {
+        region->rail_mrs.push_back(create_device_mr(device_buffer, host_mapping, size, dmabuf_fd, dmabuf_offset, rail));
+    }
+    region->device_memory = true;
+    return region;
+}
+#else
+unique_ptr<memory_region> memory_region::for_device_buffer(char *, char *, size_t, int, uint64_t) {
+    throw unsupported_feature();
+}
+#endif
+
+unique_ptr<memory_region> memory_region::for_user_buffer(char *buffer, size_t size) {
+    if(!buffer || size == 0) throw invalid_args();
+
+    lock_guard<mutex> l(registration_cache_mutex);
+#ifdef MELLANOX_EXPERIMENTAL_VERBS
+    // The implicit region is only on the first rail
+    if(supported_features.on_demand_paging && extra_rails.empty()) {
+        if(!implicit_mr) {
+            ibv_exp_reg_mr_in in;
+            memset(&in, 0, sizeof(in));
+            in.pd = verbs_resources.pd;
+            in.addr = 0;
+            in.length = IBV_EXP_IMPLICIT_MR_SIZE;
+            in.exp_access = IBV_EXP_ACCESS_ON_DEMAND | IBV_EXP_ACCESS_LOCAL_WRITE | IBV_EXP_ACCESS_REMOTE_READ | IBV_EXP_ACCESS_REMOTE_WRITE;
+            implicit_mr = ibv_exp_reg_mr(&in);
+        }
+        // The implicit memory region is never deregistered, so the handle
+        // doesn't own it
+        if(implicit_mr) {
+            return unique_ptr<memory_region>(new memory_region(
+                    {buffer, ibv_mr_unique_ptr(implicit_mr, [](ibv_mr *) {})}, size));
+        }
+    }
+#endif
+
+    const uintptr_t start = (uintptr_t)buffer;
+    shared_ptr<memory_region> registration;
+    auto it = registration_cache.upper_bound(start);
+    if(it != registration_cache.begin()) {
+        --it;
+        if(it->first + it->second->size >= start + size) {
+            registration = it->second;
+        }
+    }
+    if(!registration) {
+        if(registration_cache.size() >= max_cached_registrations) {
+            // Regions that are still in use keep their registrations alive
+            registration_cache.erase(registration_cache.begin());
+        }
+        registration = make_shared<memory_region>(buffer, size);
+        registration_cache[start] = registration;
+    }
+    unique_ptr<memory_region> region(new memory_region(
+            {buffer, ibv_mr_unique_ptr(registration->mr.get(), [registration](ibv_mr *) {})},
+            size));
+    for(const auto &rail_mr : registration->rail_mrs) {
+        region->rail_mrs.push_back(ibv_mr_unique_ptr(rail_mr.get(), [registration](ibv_mr *) {}));
+    }
+    return region;
+}
+
+void memory_region::forget_user_buffer(char *buffer, size_t size) {
+    const uintptr_t start = (uintptr_t)buffer;
+    lock_guard<mutex> l(registration_cache_mutex);
+    for(auto it = registration_cache.begin(); it != registration_cache.end();) {
+        if(it->first < start + size && it->first + it->second->size > start) {
+            it = registration_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Maps anonymous memory, using huge pages if the system has any to spare
+static char *map_memory(size_t size) {
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(addr == MAP_FAILED) {
+        addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(addr == MAP_FAILED) throw mr_creation_failure();
+        // Transparent huge pages are the next best thing
+        madvise(addr, size, MADV_HUGEPAGE);
+    }
+    // Before registering touches the pages, so they are allocated near the NIC
+    derecho::bind_to_nic_node(addr, size);
+    // Unmapping the chunk unlocks it
+    lock_buffer(addr, size);
+    return (char *)addr;
+}
+
+struct memory_arena::chunk {
+    char *base;
+    size_t size;
+    ibv_mr_unique_ptr mr;
+    // The pieces that aren't in use, from their offsets to their sizes
+    map<size_t, size_t> free_ranges;
+
+    chunk(size_t s) : base(map_memory(s)), size(s) {
+        try {
+            mr = create_mr(base, size);
+        } catch(...) {
+            munmap(base, size);
+            throw;
+        }
+        free_ranges[0] = size;
+    }
+    ~chunk() {
+        mr.reset();
+        munmap(base, size);
+    }
+};
+
+memory_arena::memory_arena(size_t chunk_size) : chunk_size(chunk_size) {}
+memory_arena::~memory_arena() {}
+
+pair<char *, ibv_mr_unique_ptr> memory_arena::allocate(size_t size) {
+    if(size == 0) throw invalid_args();
+    size = (size + alignment - 1) & ~(alignment - 1);
+
+    lock_guard<mutex> l(chunks_mutex);
+    chunk *c = nullptr;
+    size_t offset = 0;
+    for(auto &candidate : chunks) {
+        // First fit, which is good enough for the few sizes buffers come in
+        for(auto it = candidate->free_ranges.begin(); it != candidate->free_ranges.end(); ++it) {
+            if(it->second >= size) {
+                c = candidate.get();
+                offset = it->first;
+                break;
+            }
+        }
+        if(c) break;
+    }
+    if(!c) {
+        size_t new_chunk_size = std::max(chunk_size, size);
+        new_chunk_size = (new_chunk_size + huge_page_size - 1) & ~(huge_page_size - 1);
+        chunks.push_back(make_unique<chunk>(new_chunk_size));
+        c = chunks.back().get();
+        offset = 0;
+    }
+
+    auto it = c->free_ranges.find(offset);
+    size_t remaining = it->second - size;
+    c->free_ranges.erase(it);
+    if(remaining > 0) c->free_ranges[offset + size] = remaining;
+
+    // The memory region is the chunk's, so "deleting" it gives the piece back
+    auto self = shared_from_this();
+    ibv_mr_unique_ptr mr(c->mr.get(), [self, c, offset, size](ibv_mr *) {
+        self->free(c, offset, size);
+    });
+    return {c->base + offset, std::move(mr)};
+}
+
+void memory_arena::free(chunk *c, size_t offset, size_t size) {
+    lock_guard<mutex> l(chunks_mutex);
+    auto next = c->free_ranges.lower_bound(offset);
+    if(next != c->free_ranges.end() && offset + size == next->first) {
+        size += next->second;
+        next = c->free_ranges.erase(next);
+    }
+    if(next != c->free_ranges.begin()) {
+        auto prev = std::prev(next);
+        if(prev->first + prev->second == offset) {
+            prev->second += size;
+            return;
+        }
+    }
+    c->free_ranges[offset] = size;
+}
+
 completion_queue::completion_queue(bool cross_channel) {
     ibv_cq *cq_ptr = nullptr;
     if(!cross_channel) {
@@ -554,6 +1013,41 @@ completion_queue::completion_queue(bool cross_channel) {
     cq = decltype(cq)(cq_ptr, [](ibv_cq *q) { ibv_destroy_cq(q); });
 }
 
+shared_receive_queue::shared_receive_queue(uint32_t max_wr) {
+    ibv_srq_init_attr srq_init_attr;
+    memset(&srq_init_attr, 0, sizeof(srq_init_attr));
+    srq_init_attr.attr.max_wr = max_wr;
+    srq_init_attr.attr.max_sge = 1;
+
+    ibv_srq *srq_ptr = ibv_create_srq(verbs_resources.pd, &srq_init_attr);
+    if(!srq_ptr) {
+        fprintf(stderr, "failed to create SRQ\n");
+        throw srq_creation_failure();
+    }
+
+    srq = decltype(srq)(srq_ptr, [](ibv_srq *q) { ibv_destroy_srq(q); });
+}
+bool shared_receive_queue::post_empty_recv(uint64_t wr_id,
+                                           const message_type &type) {
+    if(wr_id >> type.shift_bits || !type.tag) throw invalid_args();
+
+    ibv_recv_wr rr;
+    ibv_recv_wr *bad_wr;
+
+    memset(&rr, 0, sizeof(rr));
+    rr.next = NULL;
+    rr.wr_id = wr_id | ((uint64_t)*type.tag << type.shift_bits);
+    rr.sg_list = NULL;
+    rr.num_sge = 0;
+
+    if(ibv_post_srq_recv(srq.get(), &rr, &bad_wr)) {
+        fprintf(stderr, "failed to post SRQ RR\n");
+        fflush(stdout);
+        return false;
+    }
+    return true;
+}
+
 queue_pair::~queue_pair() {
     //    if(qp) cout << "Destroying Queue Pair..." << endl;
 }
@@ -564,26 +1058,55 @@ queue_pair::queue_pair(size_t remote_index)
 // either end of the connection. This enables the user to avoid race conditions
 // between post_send() and post_recv().
 queue_pair::queue_pair(size_t remote_index,
-                       std::function<void(queue_pair *)> post_recvs) {
+                       std::function<void(queue_pair *)> post_recvs)
+        : queue_pair(remote_index, post_recvs, nullptr, 16) {}
+queue_pair::queue_pair(size_t remote_index, shared_receive_queue &srq,
+                       uint32_t max_send_wr)
+        : queue_pair(remote_index, [](queue_pair *) {}, srq.srq.get(),
+                     max_send_wr) {}
+queue_pair::queue_pair(tcp::socket &sock, uint32_t max_send_wr)
+        : queue_pair(sock, [](queue_pair *) {}, nullptr, max_send_wr) {}
+
+static tcp::socket &socket_to(size_t remote_index) {
     auto it = sockets.find(remote_index);
     if(it == sockets.end()) throw rdma::invalid_args();
-
-    auto &sock = it->second;
-
+    return it->second;
+}
+queue_pair::queue_pair(size_t remote_index, uint32_t rail,
+                       std::function<void(queue_pair *)> post_recvs)
+        : queue_pair(remote_index, post_recvs, nullptr, 16, rail) {}
+queue_pair::queue_pair(size_t remote_index,
+                       std::function<void(queue_pair *)> post_recvs,
+                       ibv_srq *srq, uint32_t max_send_wr, uint32_t rail)
+        : queue_pair(socket_to(remote_index), post_recvs, srq, max_send_wr, rail) {}
+queue_pair::queue_pair(tcp::socket &sock,
+                       std::function<void(queue_pair *)> post_recvs,
+                       ibv_srq *srq, uint32_t max_send_wr, uint32_t rail)
+        : rail(rail) {
+    ibv_resources &resources = rail_resources(rail);
+    const config_t &config = rail_config_of(rail);
     ibv_qp_init_attr qp_init_attr;
     memset(&qp_init_attr, 0, sizeof(qp_init_attr));
     qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.sq_sig_all = 1;
-    qp_init_attr.send_cq = verbs_resources.cq;
-    qp_init_attr.recv_cq = verbs_resources.cq;
-    qp_init_attr.cap.max_send_wr = 16;
-    qp_init_attr.cap.max_recv_wr = 16;
+    qp_init_attr.sq_sig_all = 0;
+    qp_init_attr.send_cq = resources.cq;
+    qp_init_attr.recv_cq = resources.cq;
+    qp_init_attr.srq = srq;
+    qp_init_attr.cap.max_send_wr = max_send_wr;
+    qp_init_attr.cap.max_recv_wr = srq ? 0 : 16;
     qp_init_attr.cap.max_send_sge = 1;
     qp_init_attr.cap.max_recv_sge = 1;
+    qp_init_attr.cap.max_inline_data = requested_max_inline_data;
 
+    ibv_qp *qp_ptr = ibv_create_qp(resources.pd, &qp_init_attr);
+    if(!qp_ptr) {
+        // Not every device supports inline data
+        qp_init_attr.cap.max_inline_data = 0;
+        qp_ptr = ibv_create_qp(resources.pd, &qp_init_attr);
+    }
+    max_inline_data = qp_init_attr.cap.max_inline_data;
     qp = unique_ptr<ibv_qp, std::function<void(ibv_qp *)>>(
-            ibv_create_qp(verbs_resources.pd, &qp_init_attr),
-            [](ibv_qp *q) { ibv_destroy_qp(q); });
+            qp_ptr, [](ibv_qp *q) { ibv_destroy_qp(q); });
 
     if(!qp) {
         fprintf(stderr, "failed to create QP\n");
@@ -596,12 +1119,12 @@ queue_pair::queue_pair(size_t remote_index,
     memset(&remote_con_data, 0, sizeof(remote_con_data));
     union ibv_gid my_gid;
 
-    if(local_config.gid_idx >= 0) {
-        int rc = ibv_query_gid(verbs_resources.ib_ctx, local_config.ib_port,
-                               local_config.gid_idx, &my_gid);
+    if(config.gid_idx >= 0) {
+        int rc = ibv_query_gid(resources.ib_ctx, config.ib_port,
+                               config.gid_idx, &my_gid);
         if(rc) {
             fprintf(stderr, "could not get gid for port %d, index %d\n",
-                    local_config.ib_port, local_config.gid_idx);
+                    config.ib_port, config.gid_idx);
             return;
         }
     } else {
@@ -610,7 +1133,7 @@ queue_pair::queue_pair(size_t remote_index,
 
     /* exchange using TCP sockets info required to connect QPs */
     local_con_data.qp_num = qp->qp_num;
-    local_con_data.lid = verbs_resources.port_attr.lid;
+    local_con_data.lid = resources.port_attr.lid;
     memcpy(local_con_data.gid, &my_gid, 16);
     // fprintf(stdout, "Local QP number  = 0x%x\n", qp->qp_num);
     // fprintf(stdout, "Local LID        = 0x%x\n",
@@ -619,7 +1142,7 @@ queue_pair::queue_pair(size_t remote_index,
     if(!sock.exchange(local_con_data, remote_con_data))
         throw rdma::qp_creation_failure();
 
-    bool success = !modify_qp_to_init(qp.get(), local_config.ib_port) && !modify_qp_to_rtr(qp.get(), remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid, local_config.ib_port, local_config.gid_idx) && !modify_qp_to_rts(qp.get());
+    bool success = !modify_qp_to_init(qp.get(), config.ib_port) && !modify_qp_to_rtr(qp.get(), remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid, config.ib_port, config.gid_idx, resources.port_attr.active_mtu) && !modify_qp_to_rts(qp.get());
 
     if(!success) printf("Failed to initialize QP\n");
 
@@ -645,7 +1168,7 @@ bool queue_pair::post_send(const memory_region &mr, size_t offset,
     memset(&sge, 0, sizeof(sge));
     sge.addr = (uintptr_t)(mr.buffer + offset);
     sge.length = length;
-    sge.lkey = mr.mr->lkey;
+    sge.lkey = mr.get_lkey(rail);
 
     // prepare the send work request
     memset(&sr, 0, sizeof(sr));
@@ -664,7 +1187,7 @@ bool queue_pair::post_send(const memory_region &mr, size_t offset,
     return true;
 }
 bool queue_pair::post_empty_send(uint64_t wr_id, uint32_t immediate,
-                                 const message_type &type) {
+                                 const message_type &type, bool signaled) {
     if(wr_id >> type.shift_bits || !type.tag) throw invalid_args();
 
     ibv_send_wr sr;
@@ -678,7 +1201,8 @@ bool queue_pair::post_empty_send(uint64_t wr_id, uint32_t immediate,
     sr.sg_list = NULL;
     sr.num_sge = 0;
     sr.opcode = IBV_WR_SEND_WITH_IMM;
-    sr.send_flags = IBV_SEND_SIGNALED;  // | IBV_SEND_INLINE;
+    // There is no payload, so there is nothing for the NIC to fetch
+    sr.send_flags = (signaled ? IBV_SEND_SIGNALED : 0) | IBV_SEND_INLINE;
 
     if(ibv_post_send(qp.get(), &sr, &bad_wr)) {
         fprintf(stderr, "failed to post SR\n");
@@ -701,7 +1225,7 @@ bool queue_pair::post_recv(const memory_region &mr, size_t offset,
     memset(&sge, 0, sizeof(sge));
     sge.addr = (uintptr_t)(mr.buffer + offset);
     sge.length = length;
-    sge.lkey = mr.mr->lkey;
+    sge.lkey = mr.get_lkey(rail);
 
     // prepare the receive work request
     memset(&rr, 0, sizeof(rr));
@@ -758,7 +1282,7 @@ bool queue_pair::post_write(const memory_region &mr, size_t offset,
     memset(&sge, 0, sizeof(sge));
     sge.addr = (uintptr_t)(mr.buffer + offset);
     sge.length = length;
-    sge.lkey = mr.mr->lkey;
+    sge.lkey = mr.get_lkey(rail);
 
     // prepare the send work request
     memset(&sr, 0, sizeof(sr));
@@ -767,7 +1291,85 @@ bool queue_pair::post_write(const memory_region &mr, size_t offset,
     sr.sg_list = &sge;
     sr.num_sge = 1;
     sr.opcode = IBV_WR_RDMA_WRITE;
-    sr.send_flags = (signaled ? IBV_SEND_SIGNALED : 0) | (send_inline ? IBV_SEND_INLINE : 0);
+    sr.send_flags = (signaled ? IBV_SEND_SIGNALED : 0)
+                    | (send_inline && length <= max_inline_data ? IBV_SEND_INLINE : 0);
+    sr.wr.rdma.remote_addr = remote_mr.buffer + remote_offset;
+    sr.wr.rdma.rkey = remote_mr.rkey;
+
+    if(ibv_post_send(qp.get(), &sr, &bad_wr)) {
+        fprintf(stderr, "failed to post SR\n");
+        return false;
+    }
+    return true;
+}
+bool queue_pair::post_write_with_immediate(const memory_region &mr, size_t offset,
+                                           size_t length, uint64_t wr_id,
+                                           uint32_t immediate,
+                                           remote_memory_region remote_mr,
+                                           size_t remote_offset,
+                                           const message_type &type) {
+    if(wr_id >> type.shift_bits || !type.tag) throw invalid_args();
+    if(mr.size < offset + length || remote_mr.size < remote_offset + length) {
+        cout << "mr.size = " << mr.size << " offset = " << offset
+             << " length = " << length << " remote_mr.size = " << remote_mr.size
+             << " remote_offset = " << remote_offset;
+        return false;
+    }
+
+    ibv_send_wr sr;
+    ibv_sge sge;
+    ibv_send_wr *bad_wr = NULL;
+
+    memset(&sge, 0, sizeof(sge));
+    sge.addr = (uintptr_t)(mr.buffer + offset);
+    sge.length = length;
+    sge.lkey = mr.get_lkey(rail);
+
+    memset(&sr, 0, sizeof(sr));
+    sr.next = NULL;
+    sr.wr_id = wr_id | ((uint64_t)*type.tag << type.shift_bits);
+    sr.imm_data = immediate;
+    sr.sg_list = &sge;
+    sr.num_sge = 1;
+    sr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    sr.send_flags = IBV_SEND_SIGNALED;
+    sr.wr.rdma.remote_addr = remote_mr.buffer + remote_offset;
+    sr.wr.rdma.rkey = remote_mr.rkey;
+
+    if(ibv_post_send(qp.get(), &sr, &bad_wr)) {
+        fprintf(stderr, "failed to post SR\n");
+        return false;
+    }
+    return true;
+}
+bool queue_pair::post_read(const memory_region &mr, size_t offset,
+                           size_t length, uint64_t wr_id,
+                           remote_memory_region remote_mr,
+                           size_t remote_offset, const message_type &type) {
+    if(wr_id >> type.shift_bits || !type.tag) throw invalid_args();
+    if(mr.size < offset + length || remote_mr.size < remote_offset + length) {
+        cout << "mr.size = " << mr.size << " offset = " << offset
+             << " length = " << length << " remote_mr.size = " << remote_mr.size
+             << " remote_offset = " << remote_offset;
+        return false;
+    }
+
+    ibv_send_wr sr;
+    ibv_sge sge;
+    ibv_send_wr *bad_wr = NULL;
+
+    memset(&sge, 0, sizeof(sge));
+    sge.addr = (uintptr_t)(mr.buffer + offset);
+    sge.length = length;
+    sge.lkey = mr.get_lkey(rail);
+
+    memset(&sr, 0, sizeof(sr));
+    sr.next = NULL;
+    sr.wr_id = wr_id | ((uint64_t)*type.tag << type.shift_bits);
+    sr.sg_list = &sge;
+    sr.num_sge = 1;
+    sr.opcode = IBV_WR_RDMA_READ;
+    sr.send_flags = IBV_SEND_SIGNALED;
     sr.wr.rdma.remote_addr = remote_mr.buffer + remote_offset;
     sr.wr.rdma.rkey = remote_mr.rkey;
 
@@ -843,7 +1445,7 @@ managed_queue_pair::managed_queue_pair(
     if(!sock.exchange(local_con_data, remote_con_data))
         throw rdma::qp_creation_failure();
 
-    bool success = !modify_qp_to_init(qp.get(), local_config.ib_port) && !modify_qp_to_rtr(qp.get(), remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid, local_config.ib_port, local_config.gid_idx) && !modify_qp_to_rts(qp.get());
+    bool success = !modify_qp_to_init(qp.get(), local_config.ib_port) && !modify_qp_to_rtr(qp.get(), remote_con_data.qp_num, remote_con_data.lid, remote_con_data.gid, local_config.ib_port, local_config.gid_idx, verbs_resources.port_attr.active_mtu) && !modify_qp_to_rts(qp.get());
 
     if(!success) throw rdma::qp_creation_failure();
 
@@ -882,7 +1484,7 @@ manager_queue_pair::manager_queue_pair() : queue_pair() {
         throw rdma::qp_creation_failure();
     }
 
-    bool success = !modify_qp_to_init(qp.get(), local_config.ib_port) && !modify_qp_to_rtr(qp.get(), qp->qp_num, 0, nullptr, local_config.ib_port, -1) && !modify_qp_to_rts(qp.get());
+    bool success = !modify_qp_to_init(qp.get(), local_config.ib_port) && !modify_qp_to_rtr(qp.get(), qp->qp_num, 0, nullptr, local_config.ib_port, -1, verbs_resources.port_attr.active_mtu) && !modify_qp_to_rts(qp.get());
 
     if(!success) throw rdma::qp_creation_failure();
 }
@@ -1059,7 +1661,9 @@ bool task::post() {
 
 message_type::message_type(const string &name, completion_handler send_handler,
                            completion_handler recv_handler,
-                           completion_handler write_handler) {
+                           completion_handler write_handler,
+                           completion_handler read_handler,
+                           completion_handler failure_handler) {
     std::lock_guard<std::mutex> l(completion_handlers_mutex);
 
     if(completion_handlers.size() >= std::numeric_limits<tag_type>::max())
@@ -1071,6 +1675,8 @@ message_type::message_type(const string &name, completion_handler send_handler,
     set.send = send_handler;
     set.recv = recv_handler;
     set.write = write_handler;
+    set.read = read_handler;
+    set.failure = failure_handler;
     set.name = name;
     completion_handlers.push_back(set);
 }
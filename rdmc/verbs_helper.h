@@ -7,12 +7,18 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 struct ibv_mr;
 struct ibv_qp;
 struct ibv_cq;
+struct ibv_srq;
+
+namespace tcp {
+class socket;
+}
 
 /**
  * Contains functions and classes for low-level RDMA operations, such as setting
@@ -29,9 +35,21 @@ class creation_failure : public exception {};
 class mr_creation_failure : public creation_failure {};
 class cq_creation_failure : public creation_failure {};
 class qp_creation_failure : public creation_failure {};
+class srq_creation_failure : public creation_failure {};
 class message_types_exhausted : public exception {};
 class unsupported_feature : public exception {};
 
+class memory_arena;
+
+/** The most devices or ports RDMC can stripe its blocks across */
+constexpr uint32_t max_rails = 4;
+
+/** A device and port that RDMC can send over; rails after the first carry extra data traffic */
+struct rail_config {
+    std::string device_name;
+    int port = 1;
+};
+
 /**
  * A C++ wrapper for the IB Verbs ibv_mr struct. Registers a memory region for
  * the provided buffer on construction, and deregisters it on destruction.
@@ -41,18 +59,99 @@ class unsupported_feature : public exception {};
 class memory_region {
     std::unique_ptr<ibv_mr, std::function<void(ibv_mr*)>> mr;
     std::unique_ptr<char[]> allocated_buffer;
+    // Set if allocated_buffer was locked into memory
+    bool locked = false;
+    // The registrations of the buffer on rails after the first, in order
+    std::vector<std::unique_ptr<ibv_mr, std::function<void(ibv_mr*)>>> rail_mrs;
+
+    void register_on_rails();
+    uint32_t get_lkey(uint32_t rail) const;
 
     memory_region(size_t size, bool contiguous);
+    memory_region(std::pair<char*, std::unique_ptr<ibv_mr, std::function<void(ibv_mr*)>>> allocation,
+                  size_t size);
     friend class queue_pair;
+    friend class shared_receive_queue;
     friend class task;
 
 public:
     memory_region(size_t size);
     memory_region(char* buffer, size_t size);
+    ~memory_region();
     uint32_t get_rkey() const;
 
+    /**
+     * Allocates a buffer and registers it. If the memory arena is enabled the
+     * buffer is carved out of it, so no new registration is needed;
+     * otherwise it is allocated and registered on its own, as by
+     * memory_region(size) without contiguous memory.
+     */
+    static std::unique_ptr<memory_region> allocate(size_t size);
+
+    /**
+     * Makes a memory region for a buffer that the caller owns, so that it can
+     * be sent without being copied. If the device supports on-demand paging
+     * this costs nothing; otherwise the buffer is registered, and the
+     * registration is cached by address range so that sending the same
+     * buffer again doesn't register it again. Cached registrations pin their
+     * pages, so forget_user_buffer() must be called before such a buffer is
+     * freed.
+     */
+    static std::unique_ptr<memory_region> for_user_buffer(char* buffer, size_t size);
+    /** Drops any cached registrations that overlap this buffer. */
+    static void forget_user_buffer(char* buffer, size_t size);
+
+    /**
+     * Registers GPU memory that the caller owns, so that RDMC moves messages
+     * in it between GPUs without copying them through host memory
+     * (GPUDirect RDMA). Derecho reads and writes message headers through
+     * host_mapping, a CPU mapping of the same memory such as gdrcopy's
+     * gdr_map gives, so the region is registered at the mapping's addresses
+     * and its buffer is host_mapping. The memory is registered through its
+     * dma-buf if dmabuf_fd is not -1, with dmabuf_offset being where it
+     * starts in the dma-buf, and otherwise through its device address, which
+     * needs the nvidia-peermem module. Throws unsupported_feature unless
+     * built with DERECHO_GPUDIRECT.
+     */
+    static std::unique_ptr<memory_region> for_device_buffer(char* device_buffer, char* host_mapping, size_t size,
+                                                            int dmabuf_fd = -1, uint64_t dmabuf_offset = 0);
+    /** @return True if the memory is on a GPU, from for_device_buffer() */
+    bool is_device_memory() const { return device_memory; }
+
     char* const buffer;
     const size_t size;
+
+private:
+    bool device_memory = false;
+};
+
+/**
+ * A few large buffers, backed by huge pages where possible, that are each
+ * registered once and then handed out in pieces by memory_region::allocate().
+ * This saves registering every buffer separately, and the NIC needs far fewer
+ * translation entries for them. A new chunk is mapped and registered whenever
+ * the existing ones are too full; chunks are never given back.
+ */
+class memory_arena : public std::enable_shared_from_this<memory_arena> {
+    struct chunk;
+    std::mutex chunks_mutex;
+    std::vector<std::unique_ptr<chunk>> chunks;
+
+    void free(chunk* c, size_t offset, size_t size);
+
+public:
+    /** Pieces are aligned to, and rounded up to a multiple of, this many bytes. */
+    static constexpr size_t alignment = 4096;
+    /** The size of a huge page on x86-64 */
+    static constexpr size_t huge_page_size = 2 << 20;
+    /** The size new chunks are given, unless a larger piece is asked for. */
+    const size_t chunk_size;
+
+    explicit memory_arena(size_t chunk_size);
+    ~memory_arena();
+    /** @return The buffer, and a handle to its chunk's memory region that
+     * gives the piece back when it is destroyed. */
+    std::pair<char*, std::unique_ptr<ibv_mr, std::function<void(ibv_mr*)>>> allocate(size_t size);
 };
 
 class remote_memory_region {
@@ -88,17 +187,42 @@ private:
     message_type(tag_type t) : tag(t) {}
 
     friend class queue_pair;
+    friend class shared_receive_queue;
     friend class task;
 
 public:
+    /**
+     * The failure handler, if there is one, is called when a send, write or
+     * read of this type fails on a rail other than the first, with the rail
+     * in place of the immediate.
+     */
     message_type(const std::string& name, completion_handler send_handler,
                  completion_handler recv_handler,
-                 completion_handler write_handler = nullptr);
+                 completion_handler write_handler = nullptr,
+                 completion_handler read_handler = nullptr,
+                 completion_handler failure_handler = nullptr);
     message_type() {}
 
     static message_type ignored();
 };
 
+/**
+ * A C++ wrapper for the IB Verbs ibv_srq struct. Queue pairs created with a
+ * shared receive queue take their receives from it instead of having their
+ * own, so the receive WQEs are pooled across all of them. The wr_id of a
+ * completed receive is whichever one was posted to the shared queue, so
+ * messages sent to these queue pairs have to identify their sender in the
+ * immediate instead.
+ */
+class shared_receive_queue {
+    std::unique_ptr<ibv_srq, std::function<void(ibv_srq*)>> srq;
+    friend class queue_pair;
+
+public:
+    explicit shared_receive_queue(uint32_t max_wr);
+    bool post_empty_recv(uint64_t wr_id, const message_type& type);
+};
+
 /**
  * A C++ wrapper for the IB Verbs ibv_qp struct and its associated functions.
  * Instances of this class can only be created after global Verbs initialization
@@ -107,15 +231,42 @@ public:
 class queue_pair {
 protected:
     std::unique_ptr<ibv_qp, std::function<void(ibv_qp*)>> qp;
+    // The largest send that can be posted inline, as granted by the device
+    uint32_t max_inline_data = 0;
+    // The rail the queue pair was created on
+    uint32_t rail = 0;
     explicit queue_pair() {}
+    queue_pair(size_t remote_index,
+               std::function<void(queue_pair*)> post_recvs, ibv_srq* srq,
+               uint32_t max_send_wr, uint32_t rail = 0);
+    queue_pair(tcp::socket& sock,
+               std::function<void(queue_pair*)> post_recvs, ibv_srq* srq,
+               uint32_t max_send_wr, uint32_t rail = 0);
 
     friend class task;
 
 public:
+    // The inline data asked for when creating a queue pair
+    static constexpr uint32_t requested_max_inline_data = 64;
+
     ~queue_pair();
     explicit queue_pair(size_t remote_index);
     queue_pair(size_t remote_index,
                std::function<void(queue_pair*)> post_recvs);
+    /** Creates a queue pair on a rail other than the first; the other end
+     * must create one on the same rail at the same time. */
+    queue_pair(size_t remote_index, uint32_t rail,
+               std::function<void(queue_pair*)> post_recvs);
+    /** Creates a queue pair whose receives come from a shared receive queue. */
+    queue_pair(size_t remote_index, shared_receive_queue& srq,
+               uint32_t max_send_wr);
+    /**
+     * Creates a queue pair by exchanging its details over the given socket
+     * instead of the connection to a node set up by verbs_initialize(), for
+     * callers that have a connection of their own. The other end must do the
+     * same over the same socket at the same time.
+     */
+    queue_pair(tcp::socket& sock, uint32_t max_send_wr);
     queue_pair(queue_pair&&) = default;
     bool post_send(const memory_region& mr, size_t offset, size_t length,
                    uint64_t wr_id, uint32_t immediate,
@@ -123,14 +274,36 @@ public:
     bool post_recv(const memory_region& mr, size_t offset, size_t length,
                    uint64_t wr_id, const message_type& type);
 
+    // Sends are only signaled if asked to be. An unsignaled send's slot in
+    // the send queue is freed when a later signaled send completes, so at
+    // least one in every max_send_wr must be signaled.
     bool post_empty_send(uint64_t wr_id, uint32_t immediate,
-                         const message_type& type);
+                         const message_type& type, bool signaled = true);
     bool post_empty_recv(uint64_t wr_id, const message_type& type);
 
+    uint32_t get_max_inline_data() const { return max_inline_data; }
+    uint32_t get_rail() const { return rail; }
+
     bool post_write(const memory_region& mr, size_t offset, size_t length,
                     uint64_t wr_id, remote_memory_region remote_mr,
                     size_t remote_offset, const message_type& type,
                     bool signaled = false, bool send_inline = false);
+    /**
+     * Writes to a remote memory region and delivers the immediate to the
+     * remote end, where it takes the next posted receive, which can be empty,
+     * and completes through the receive handler of that receive's type. The
+     * write is always signaled, and completes through the write handler of
+     * its type.
+     */
+    bool post_write_with_immediate(const memory_region& mr, size_t offset, size_t length,
+                                   uint64_t wr_id, uint32_t immediate,
+                                   remote_memory_region remote_mr, size_t remote_offset,
+                                   const message_type& type);
+    /** Reads from a remote memory region into a local one. Reads are always
+     * signaled, and complete through the read handler of their type. */
+    bool post_read(const memory_region& mr, size_t offset, size_t length,
+                   uint64_t wr_id, remote_memory_region remote_mr,
+                   size_t remote_offset, const message_type& type);
 };
 
 class managed_queue_pair : public queue_pair {
@@ -168,12 +341,29 @@ public:
 struct feature_set {
     bool contiguous_memory;
     bool cross_channel;
+    // Whether one implicit memory region, with on-demand paging, can cover
+    // every buffer in the address space
+    bool on_demand_paging;
 };
 feature_set get_supported_features();
 
 namespace impl {
+// With rails, the first is used in place of RDMC_DEVICE_NAME, and every
+// member of a group must be given the same number of them
 bool verbs_initialize(const std::map<uint32_t, std::string>& node_addresses,
-                      uint32_t node_rank);
+                      uint32_t node_rank,
+                      const std::vector<rail_config>& rails = {});
+/** Sets the service level of queue pairs connected after the call */
+void set_service_level(uint8_t service_level);
+/** If nonnegative, overrides that service level for the queue pairs the
+ * calling thread connects, until it is called again with -1 */
+void set_connecting_service_level(int service_level);
+/** The number of rails that were opened, at least 1 */
+uint32_t num_rails();
+/** @return False once an operation has failed on the rail. The first rail
+ * carries all the control traffic, so it is never given up on. */
+bool rail_is_up(uint32_t rail);
+void mark_rail_failed(uint32_t rail);
 bool verbs_add_connection(uint32_t index, const std::string& address,
                           uint32_t node_rank);
 void verbs_destroy();
@@ -190,6 +380,13 @@ std::map<uint32_t, remote_memory_region> verbs_exchange_memory_regions(
 
 bool set_interrupt_mode(bool enabled);
 bool set_contiguous_memory_mode(bool enabled);
+// Makes memory_region::allocate() carve buffers out of a memory arena with
+// chunks of this size; 0 turns the arena off. Buffers already allocated from
+// an earlier arena keep it alive until they are freed.
+void set_memory_arena_chunk_size(size_t chunk_size);
+// Makes the buffers and memory arena chunks allocated after the call locked
+// into memory
+void set_lock_memory_mode(bool enabled);
 
 } /* namespace impl */
 } /* namespace rdma */
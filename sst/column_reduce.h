@@ -0,0 +1,104 @@
+#pragma once
+
+/**
+ * @file column_reduce.h
+ * Minimum and maximum of one SST column over a list of rows, using vector
+ * gathers where the compiler targets AVX2 or AVX-512.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace sst {
+namespace column_reduce {
+
+/**
+ * Reduces the 64-bit signed integers found at column + row * row_len for
+ * each of the given rows.
+ * @tparam Max True for the maximum, false for the minimum
+ * @return The result, or the identity of the reduction if there are no rows.
+ */
+template <bool Max>
+int64_t reduce_int64(const volatile char* column, int row_len, const uint32_t* rows, std::size_t num_rows) {
+    // Other nodes write the table behind the compiler's back, so nothing
+    // read here may be carried over from an earlier call
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    int64_t result = Max ? std::numeric_limits<int64_t>::min() : std::numeric_limits<int64_t>::max();
+    std::size_t i = 0;
+#if defined(__AVX512F__)
+    if(num_rows >= 8) {
+        const char* base = const_cast<const char*>(column);
+        const __m512i stride = _mm512_set1_epi64(row_len);
+        __m512i acc = _mm512_set1_epi64(result);
+        for(; i + 8 <= num_rows; i += 8) {
+            const __m512i row_numbers = _mm512_cvtepu32_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows + i)));
+            const __m512i offsets = _mm512_mul_epu32(row_numbers, stride);
+            const __m512i values = _mm512_i64gather_epi64(offsets, base, 1);
+            acc = Max ? _mm512_max_epi64(acc, values) : _mm512_min_epi64(acc, values);
+        }
+        result = Max ? _mm512_reduce_max_epi64(acc) : _mm512_reduce_min_epi64(acc);
+    }
+#elif defined(__AVX2__)
+    if(num_rows >= 4) {
+        const char* base = const_cast<const char*>(column);
+        const __m256i stride = _mm256_set1_epi64x(row_len);
+        __m256i acc = _mm256_set1_epi64x(result);
+        for(; i + 4 <= num_rows; i += 4) {
+            const __m256i row_numbers = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rows + i)));
+            const __m256i offsets = _mm256_mul_epu32(row_numbers, stride);
+            const __m256i values = _mm256_i64gather_epi64(reinterpret_cast<const long long*>(base), offsets, 1);
+            // AVX2 has no 64-bit min or max, so blend on a comparison
+            const __m256i take_value = Max ? _mm256_cmpgt_epi64(values, acc) : _mm256_cmpgt_epi64(acc, values);
+            acc = _mm256_blendv_epi8(acc, values, take_value);
+        }
+        alignas(32) int64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+        for(int64_t lane : lanes) {
+            result = Max ? (lane > result ? lane : result) : (lane < result ? lane : result);
+        }
+    }
+#endif
+    for(; i < num_rows; ++i) {
+        const int64_t value = *reinterpret_cast<const volatile int64_t*>(column + static_cast<std::size_t>(rows[i]) * row_len);
+        result = Max ? (value > result ? value : result) : (value < result ? value : result);
+    }
+    return result;
+}
+
+/**
+ * Reduces a column of any type with a plain loop.
+ */
+template <bool Max, typename T>
+T reduce_scalar(const volatile char* column, int row_len, const uint32_t* rows, std::size_t num_rows) {
+    T result = Max ? std::numeric_limits<T>::lowest() : std::numeric_limits<T>::max();
+    for(std::size_t i = 0; i < num_rows; ++i) {
+        const T value = *reinterpret_cast<const volatile T*>(column + static_cast<std::size_t>(rows[i]) * row_len);
+        result = Max ? (value > result ? value : result) : (value < result ? value : result);
+    }
+    return result;
+}
+
+/** True for the column types that reduce_int64 can handle */
+template <typename T>
+using is_int64 = std::integral_constant<bool, std::is_integral<T>::value && std::is_signed<T>::value
+                                                      && sizeof(T) == sizeof(int64_t)>;
+
+template <bool Max, typename T>
+T reduce(const volatile char* column, int row_len, const uint32_t* rows, std::size_t num_rows, std::true_type) {
+    return static_cast<T>(reduce_int64<Max>(column, row_len, rows, num_rows));
+}
+
+template <bool Max, typename T>
+T reduce(const volatile char* column, int row_len, const uint32_t* rows, std::size_t num_rows, std::false_type) {
+    return reduce_scalar<Max, T>(column, row_len, rows, num_rows);
+}
+
+}  // namespace column_reduce
+}  // namespace sst
@@ -32,11 +32,15 @@ int main(int argc, char* argv[]) {
     const unsigned int num_messages = 1000000;
     if(argc < 2) {
         cout << "Insufficient number of command line arguments" << endl;
-        cout << "Enter num_senders" << endl;
+        cout << "Enter num_senders [max_batch_size] [ud_multicast_group_ip]" << endl;
         cout << "Thank you" << endl;
         exit(1);
     }
     int num_senders_selector = atoi(argv[1]);
+    // the number of messages coalesced into one RDMA write, 1 for no batching
+    const uint32_t max_batch_size = argc > 2 ? atoi(argv[2]) : 1;
+    // an IPv4 multicast address, such as 239.0.0.1, to send messages by UD multicast
+    const std::string ud_group_ip = argc > 3 ? argv[3] : "";
     // input number of nodes and the local node id
     uint32_t node_id, num_nodes;
     cin >> node_id >> num_nodes;
@@ -146,7 +150,13 @@ int main(int argc, char* argv[]) {
             is_sender[i] = 0;
         }
     }
-    sst::multicast_group<multicast_sst> g(sst, indices, window_size, is_sender);
+    std::shared_ptr<ud_multicast> ud;
+    if(!ud_group_ip.empty()) {
+        ud = std::make_shared<ud_multicast>(ip_addrs[node_id], ud_group_ip,
+                                            multicast_group<multicast_sst>::max_ud_packet_size());
+    }
+    sst::multicast_group<multicast_sst> g(sst, indices, window_size, is_sender, 0, 0, false, max_batch_size,
+                                          std::chrono::microseconds(5), ud);
     // now
     sst->predicates.insert(receiver_pred, receiver_trig,
                            sst::PredicateType::RECURRENT);
@@ -165,6 +175,7 @@ int main(int argc, char* argv[]) {
             // }
             g.send();
         }
+        g.flush();
     }
     // cout << "Done sending" << endl;
     while(!done) {
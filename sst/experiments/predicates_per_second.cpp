@@ -1,14 +1,15 @@
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <numeric>
 #include <string>
 #include <vector>
 
-#include "derecho/experiments//timing.h"
-#include "derecho/experiments/statistics.h"
+#include "sst/fused_predicates.h"
 #include "sst/sst.h"
-#include "sst/tcp.h"
+#include "timing.h"
 
 using std::vector;
 using std::map;
@@ -17,138 +18,155 @@ using std::cin;
 using std::cout;
 using std::endl;
 using std::ofstream;
-using std::ifstream;
-using std::tie;
 
-struct TestRow {
-    volatile int flag;
+class TestSST : public sst::SST<TestSST> {
+public:
+    sst::SSTField<int> flag;
+    sst::SSTField<int64_t> counter;
+    TestSST(const vector<uint32_t>& members, uint32_t my_id) : SST<TestSST>(this, sst::SSTParams{members, my_id}) {
+        SSTInit(flag, counter);
+    }
 };
 
-namespace sst {
-namespace tcp {
-extern int port;
-}
-}
-
-static int num_nodes, this_node_rank;
-
-static const int TIMING_NODE = 0;
+static const uint32_t TIMING_NODE = 0;
 
+/*
+ * Measures how many times per second the timing node can evaluate a set of
+ * four predicates over the first r + 1 rows, either as four separate
+ * predicates or fused into one kernel. Each node reads its ID, the number of
+ * nodes, and their IP addresses from stdin; the arguments are the mode
+ * (separate or fused) and the values of r to test.
+ */
 int main(int argc, char** argv) {
     using namespace sst;
 
-    if(argc < 2) {
-        cout << "Please provide a configuration file." << endl;
-        return -1;
-    }
     if(argc < 3) {
-        cout << "Please provide at least one value of r to test." << endl;
+        cout << "Usage: " << argv[0] << " <separate|fused> <r>..." << endl;
         return -1;
     }
-    cout << "Arguments were: ";
-    for(int i = 0; i < argc; ++i) {
-        cout << argv[i] << " ";
+    const string mode = argv[1];
+    if(mode != "separate" && mode != "fused") {
+        cout << "The mode must be separate or fused" << endl;
+        return -1;
     }
-    cout << endl;
 
     srand(time(NULL));
 
-    ifstream node_config_stream;
-    node_config_stream.open(argv[1]);
-
-    // input number of nodes and the local node id
-    node_config_stream >> num_nodes >> this_node_rank;
+    uint32_t node_id, num_nodes;
+    cin >> node_id >> num_nodes;
 
-    // input the ip addresses
     map<uint32_t, string> ip_addrs;
-    for(int i = 0; i < num_nodes; ++i) {
-        node_config_stream >> ip_addrs[i];
+    for(uint32_t i = 0; i < num_nodes; ++i) {
+        cin >> ip_addrs[i];
     }
 
-    node_config_stream >> tcp::port;
-
-    node_config_stream.close();
-
     // Get the values of R to test from the other arguments
-    vector<int> row_counts(argc - 2);
-    for(int i = 0; i < argc - 2; ++i) {
-        row_counts[i] = std::stoi(string(argv[i + 2]));
+    vector<uint32_t> row_counts;
+    for(int i = 2; i < argc; ++i) {
+        row_counts.push_back(std::min((uint32_t)std::stoi(argv[i]), num_nodes - 1));
     }
 
-    // initialize tcp connections
-    tcp::tcp_initialize(this_node_rank, ip_addrs);
+    verbs_initialize(ip_addrs, node_id);
 
-    // initialize the rdma resources
-    verbs_initialize();
-
-    // make all the nodes members of a group
-    vector<uint32_t> group_members(num_nodes);
-    for(int i = 0; i < num_nodes; ++i) {
-        group_members[i] = i;
+    vector<uint32_t> members(num_nodes);
+    for(uint32_t i = 0; i < num_nodes; ++i) {
+        members[i] = i;
     }
 
-    // create a new shared state table with all the members
-    SST<TestRow>* sst = new SST<TestRow>(group_members, this_node_rank);
-    const int local = sst->get_local_index();
-    if(this_node_rank == TIMING_NODE) {
-        (*sst)[local].flag = 1;
-    } else {
-        (*sst)[local].flag = 0;
-    }
-    sst->put();
+    TestSST sst(members, node_id);
+    const uint32_t local = sst.get_local_index();
+    sst.flag[local] = node_id == TIMING_NODE ? 1 : 0;
+    sst.counter[local] = node_id;
+    sst.put();
 
     //Make sure initial writes are finished
-    sst->sync_with_members();
+    sst.sync_with_members();
     //Warm up the processor
     experiments::busy_wait_for(3 * SECONDS_TO_NS);
 
-    int r = 0;
+    // The predicates read rows 0 to r
+    uint32_t r = 0;
     long long int count = 0;
-
-    if(this_node_rank == TIMING_NODE) {
-        auto test_pred = [&r](const SST<TestRow>& sst) {
-            for(int n = 0; n <= r; ++n) {
-                if(sst[n].flag != 0) {
-                    return false;
-                }
+    auto flag_clear = [](const TestSST& sst, uint32_t row) { return sst.flag[row] == 0; };
+    auto counter_of = [](const TestSST& sst, uint32_t row) { return (int64_t)sst.counter[row]; };
+
+    if(node_id == TIMING_NODE && mode == "separate") {
+        // Only the first predicate counts, so that count is the number of
+        // times the whole set was evaluated
+        sst.predicates.insert([&r, flag_clear](const TestSST& sst) {
+            bool result = true;
+            for(uint32_t row = 0; row <= r; ++row) {
+                result = result && flag_clear(sst, row);
             }
-            return true;
-        };
-        auto count_action = [&count](SST<TestRow>& sst) {
-            ++count;
-        };
-
-        sst->predicates.insert(test_pred, count_action, PredicateType::RECURRENT);
+            return result;
+        },
+                              [&count](TestSST&) { ++count; }, PredicateType::RECURRENT);
+        sst.predicates.insert([&r, counter_of](const TestSST& sst) {
+            int64_t min = std::numeric_limits<int64_t>::max();
+            for(uint32_t row = 0; row <= r; ++row) {
+                min = std::min(min, counter_of(sst, row));
+            }
+            return min >= 0;
+        },
+                              [](TestSST&) {}, PredicateType::RECURRENT);
+        sst.predicates.insert([&r, counter_of](const TestSST& sst) {
+            int64_t max = std::numeric_limits<int64_t>::lowest();
+            for(uint32_t row = 0; row <= r; ++row) {
+                max = std::max(max, counter_of(sst, row));
+            }
+            return max >= 0;
+        },
+                              [](TestSST&) {}, PredicateType::RECURRENT);
+        sst.predicates.insert([&r, flag_clear](const TestSST& sst) {
+            uint32_t num_clear = 0;
+            for(uint32_t row = 0; row <= r; ++row) {
+                num_clear += flag_clear(sst, row) ? 1 : 0;
+            }
+            return num_clear == r + 1;
+        },
+                              [](TestSST&) {}, PredicateType::RECURRENT);
     }
 
     //Run the experiment for each value of R
-    for(int rowcount : row_counts) {
+    for(uint32_t rowcount : row_counts) {
+        if(node_id != TIMING_NODE) {
+            continue;
+        }
         r = rowcount;
-
-        if(this_node_rank == TIMING_NODE) {
-            count = 0;
-
-            //Trigger the predicate to start being true by setting my own value to 0
-            (*sst)[local].flag = 0;
-            long long int start_time = experiments::get_realtime_clock();
-            experiments::busy_wait_for(100000000);
-            //Stop the predicate by setting my value to 1
-            (*sst)[local].flag = 1;
-            long long int end_time = experiments::get_realtime_clock();
-
-            long long int actual_run_time = end_time - start_time;
-            ofstream data_out_stream(string("predicates_per_sec_" + std::to_string(num_nodes) + ".csv").c_str(), ofstream::app);
-            data_out_stream << r << "," << count << "," << actual_run_time << endl;
-            data_out_stream.close();
+        vector<uint32_t> rows(r + 1);
+        std::iota(rows.begin(), rows.end(), 0);
+        Predicates<TestSST>::pred_handle fused_handle;
+        if(mode == "fused") {
+            // The fused predicate is given its rows, so it is inserted anew
+            // for each value of r
+            auto kernel = fuse<TestSST>(all_rows(flag_clear), min_over_rows(counter_of),
+                                        max_over_rows(counter_of), count_rows(flag_clear));
+            const uint32_t num_rows = rows.size();
+            fused_handle = insert_fused(sst.predicates, kernel, rows,
+                                        [num_rows](const auto& results) {
+                                            return std::get<0>(results) && std::get<1>(results) >= 0
+                                                   && std::get<2>(results) >= 0 && std::get<3>(results) == num_rows;
+                                        },
+                                        [&count](TestSST&, const auto&) { ++count; }, PredicateType::RECURRENT);
+        }
+        count = 0;
+
+        //Trigger the predicate to start being true by setting my own value to 0
+        sst.flag[local] = 0;
+        long long int start_time = experiments::get_realtime_clock();
+        experiments::busy_wait_for(100000000);
+        //Stop the predicate by setting my value to 1
+        sst.flag[local] = 1;
+        long long int end_time = experiments::get_realtime_clock();
+        if(mode == "fused") {
+            sst.predicates.remove(fused_handle);
         }
-    }
 
-    if(this_node_rank == TIMING_NODE) {
-        sst->sync_with_members();
-    } else {
-        //Other nodes will just block here until the end, they don't have anything to do
-        tcp::sync(TIMING_NODE);
+        long long int actual_run_time = end_time - start_time;
+        ofstream data_out_stream("predicates_per_sec_" + std::to_string(num_nodes) + ".csv", ofstream::app);
+        data_out_stream << mode << "," << r << "," << count << "," << actual_run_time << endl;
     }
 
+    sst.sync_with_members();
     return 0;
 }
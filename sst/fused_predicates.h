@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "sst.h"
+
+namespace sst {
+
+/**
+ * @file fused_predicates.h
+ * Fused evaluation of predicates over rows. The combinators in combinators.h
+ * build predicates such as E (true of every row) and Min as types, but
+ * whatever they build is evaluated through one std::function per predicate,
+ * each making its own pass over the rows. Here a set of such reductions is
+ * fused into one kernel at compile time: a single pass over the rows that
+ * computes every result together, with the row functions inlined into it.
+ * The kernel is registered as one predicate, so the detect loop makes a
+ * single std::function call for the whole set, and its trigger gets all the
+ * results at once, for instance to store them in the local row.
+ *
+ * The row functions are called as f(sst, row) with the SST and a row index.
+ */
+namespace fused {
+
+/** The type a row function returns when it is called on a DerivedSST */
+template <typename DerivedSST, typename RowFunction>
+using row_value_t = std::decay_t<std::result_of_t<const RowFunction&(const DerivedSST&, uint32_t)>>;
+
+/** E: true if the row function is true of every row */
+template <typename RowFunction>
+struct AllRows {
+    RowFunction f;
+    template <typename DerivedSST>
+    using result_type = bool;
+    template <typename DerivedSST>
+    bool initial() const { return true; }
+    template <typename DerivedSST>
+    void step(bool& result, const DerivedSST& sst, uint32_t row) const {
+        result = result && f(sst, row);
+    }
+};
+
+/** True if the row function is true of some row */
+template <typename RowFunction>
+struct AnyRow {
+    RowFunction f;
+    template <typename DerivedSST>
+    using result_type = bool;
+    template <typename DerivedSST>
+    bool initial() const { return false; }
+    template <typename DerivedSST>
+    void step(bool& result, const DerivedSST& sst, uint32_t row) const {
+        result = result || f(sst, row);
+    }
+};
+
+/** The number of rows the row function is true of */
+template <typename RowFunction>
+struct CountRows {
+    RowFunction f;
+    template <typename DerivedSST>
+    using result_type = uint32_t;
+    template <typename DerivedSST>
+    uint32_t initial() const { return 0; }
+    template <typename DerivedSST>
+    void step(uint32_t& result, const DerivedSST& sst, uint32_t row) const {
+        result += f(sst, row) ? 1 : 0;
+    }
+};
+
+/** The smallest value of the row function, or its type's largest value if there are no rows */
+template <typename RowFunction>
+struct MinOverRows {
+    RowFunction f;
+    template <typename DerivedSST>
+    using result_type = row_value_t<DerivedSST, RowFunction>;
+    template <typename DerivedSST>
+    result_type<DerivedSST> initial() const {
+        static_assert(std::is_arithmetic<result_type<DerivedSST>>::value, "Min needs an arithmetic row function");
+        return std::numeric_limits<result_type<DerivedSST>>::max();
+    }
+    template <typename DerivedSST>
+    void step(result_type<DerivedSST>& result, const DerivedSST& sst, uint32_t row) const {
+        const result_type<DerivedSST> value = f(sst, row);
+        if(value < result) {
+            result = value;
+        }
+    }
+};
+
+/** The largest value of the row function, or its type's lowest value if there are no rows */
+template <typename RowFunction>
+struct MaxOverRows {
+    RowFunction f;
+    template <typename DerivedSST>
+    using result_type = row_value_t<DerivedSST, RowFunction>;
+    template <typename DerivedSST>
+    result_type<DerivedSST> initial() const {
+        static_assert(std::is_arithmetic<result_type<DerivedSST>>::value, "Max needs an arithmetic row function");
+        return std::numeric_limits<result_type<DerivedSST>>::lowest();
+    }
+    template <typename DerivedSST>
+    void step(result_type<DerivedSST>& result, const DerivedSST& sst, uint32_t row) const {
+        const result_type<DerivedSST> value = f(sst, row);
+        if(value > result) {
+            result = value;
+        }
+    }
+};
+
+/** The sum of the row function over the rows */
+template <typename RowFunction>
+struct SumOverRows {
+    RowFunction f;
+    template <typename DerivedSST>
+    using result_type = row_value_t<DerivedSST, RowFunction>;
+    template <typename DerivedSST>
+    result_type<DerivedSST> initial() const { return 0; }
+    template <typename DerivedSST>
+    void step(result_type<DerivedSST>& result, const DerivedSST& sst, uint32_t row) const {
+        result += f(sst, row);
+    }
+};
+
+/**
+ * A set of reductions fused into one pass over rows of a DerivedSST. Calling
+ * it returns a tuple of their results, in the order the reductions were given.
+ */
+template <typename DerivedSST, typename... Reductions>
+class Kernel {
+public:
+    using results_t = std::tuple<typename Reductions::template result_type<DerivedSST>...>;
+
+    explicit Kernel(Reductions... reductions) : reductions(std::move(reductions)...) {}
+
+    results_t operator()(const DerivedSST& sst, const std::vector<uint32_t>& rows) const {
+        return evaluate(sst, rows, std::index_sequence_for<Reductions...>{});
+    }
+
+private:
+    std::tuple<Reductions...> reductions;
+
+    template <std::size_t... I>
+    results_t evaluate(const DerivedSST& sst, const std::vector<uint32_t>& rows, std::index_sequence<I...>) const {
+        results_t results{std::get<I>(reductions).template initial<DerivedSST>()...};
+        for(const uint32_t row : rows) {
+            // One inlined step of every reduction for this row
+            (void)std::initializer_list<int>{(std::get<I>(reductions).step(std::get<I>(results), sst, row), 0)...};
+        }
+        return results;
+    }
+};
+
+}  // namespace fused
+
+/** The reductions a kernel can fuse; each takes a row function */
+template <typename F>
+fused::AllRows<F> all_rows(F f) { return {f}; }
+template <typename F>
+fused::AnyRow<F> any_row(F f) { return {f}; }
+template <typename F>
+fused::CountRows<F> count_rows(F f) { return {f}; }
+template <typename F>
+fused::MinOverRows<F> min_over_rows(F f) { return {f}; }
+template <typename F>
+fused::MaxOverRows<F> max_over_rows(F f) { return {f}; }
+template <typename F>
+fused::SumOverRows<F> sum_over_rows(F f) { return {f}; }
+
+/** Fuses reductions over the rows of a DerivedSST into one kernel */
+template <typename DerivedSST, typename... Reductions>
+fused::Kernel<DerivedSST, Reductions...> fuse(Reductions... reductions) {
+    return fused::Kernel<DerivedSST, Reductions...>(std::move(reductions)...);
+}
+
+/**
+ * Registers a fused kernel as one predicate of a group. Each time the group
+ * is evaluated, the kernel makes one pass over the rows, and the predicate
+ * is condition(results); the trigger is called as trigger(sst, results) with
+ * the same results. The predicate depends only on the rows the kernel reads,
+ * so if the SST tracks row changes, it is skipped while none of them change.
+ */
+template <typename DerivedSST, typename... Reductions, typename Condition, typename Trigger>
+typename Predicates<DerivedSST>::pred_handle insert_fused(Predicates<DerivedSST>& group,
+                                                          const fused::Kernel<DerivedSST, Reductions...>& kernel,
+                                                          const std::vector<uint32_t>& rows,
+                                                          Condition condition, Trigger trigger,
+                                                          PredicateType type) {
+    // Both run on the group's detect thread, the trigger right after the
+    // predicate that found it true
+    auto results = std::make_shared<typename fused::Kernel<DerivedSST, Reductions...>::results_t>();
+    return group.insert(
+            [kernel, rows, condition, results](const DerivedSST& sst) {
+                *results = kernel(sst, rows);
+                return condition(*results);
+            },
+            [trigger, results](DerivedSST& sst) { trigger(sst, *results); },
+            type, rows);
+}
+
+} /* namespace sst */
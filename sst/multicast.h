@@ -1,24 +1,34 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <deque>
 #include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <pthread.h>
 #include <thread>
 #include <vector>
 
+#include "derecho/thread_placement.h"
 #include "sst/multicast_msg.h"
 #include "sst/sst.h"
+#include "sst/timer_wheel.h"
+#include "sst/ud_multicast.h"
 
 namespace sst {
 template <typename sstType>
 class multicast_group {
     // number of messages for which get_buffer has been called
     long long int queued_num = -1;
-    // number of messages for which RDMA write is complete
+    // number of messages for which send has been called
     uint64_t num_sent = 0;
+    // number of messages whose RDMA writes have been posted
+    uint64_t num_flushed = 0;
     // the number of messages acknowledged by all the nodes
     long long int finished_multicasts_num = -1;
     // row of the node in the sst
@@ -49,7 +59,58 @@ class multicast_group {
     // window size
     const uint32_t window_size;
 
-    std::thread timeout_thread;
+    /** Sends are batched until this many messages are waiting... */
+    const uint32_t max_batch_size;
+    /** ...or the oldest of them has waited this long */
+    const std::chrono::nanoseconds batch_latency_budget;
+    /** When send was called on the oldest message that has not been flushed */
+    std::chrono::steady_clock::time_point oldest_unflushed_time;
+    /** The timer that flushes the current batch once it has used up its
+     * latency budget, or 0 if none is pending; guarded by msg_send_mutex */
+    timer_wheel::timer_id flush_timer = 0;
+    std::atomic<bool> thread_shutdown{false};
+
+    /** True if messages are packed into a byte ring instead of one per slot */
+    const bool packed;
+
+    /** A message queued in the packed ring that has not been reclaimed. */
+    struct ring_entry {
+        /** The caller's tag for the message, used to reclaim its space */
+        long long int tag;
+        /** Where the message's bytes start, counting all bytes ever queued,
+         * including the wrap marker before the message if there is one */
+        uint64_t start_pos;
+        /** One past the end of the message's bytes */
+        uint64_t end_pos;
+    };
+    /** Messages in the packed ring, oldest first. The first flushed_entries
+     * have been written to the other nodes, the ones up to sent_entries are
+     * waiting to be flushed, and the rest have been queued but not sent. */
+    std::deque<ring_entry> ring_entries;
+    std::size_t flushed_entries = 0;
+    std::size_t sent_entries = 0;
+    /** If not null, messages are sent once to this hardware multicast group
+     * instead of being written to each member, and the RC connections are
+     * only used for acknowledgments and to retransmit lost messages. */
+    const std::shared_ptr<ud_multicast> ud;
+    /** Precedes each message in a datagram, saying where it goes */
+    struct ud_packet_header {
+        uint32_t sender_row;
+        uint32_t slot;
+        uint32_t size;
+        uint64_t next_seq;
+    };
+    /** Receives datagrams and retransmits messages that seem to be lost */
+    std::thread ud_thread;
+    /** For each member, the number of this node's messages it had received
+     * when last checked, and when that number last changed */
+    std::vector<long long int> ud_last_received;
+    std::vector<std::chrono::steady_clock::time_point> ud_last_progress;
+
+    /** The total number of bytes ever queued in the packed ring */
+    uint64_t ring_write_pos = 0;
+    /** Everything before this position has been reclaimed */
+    uint64_t ring_reclaimed_pos = 0;
 
     void initialize() {
         for(auto i : row_indices) {
@@ -60,18 +121,198 @@ class multicast_group {
                 sst->slots[i][j].buf[0] = 0;
                 sst->slots[i][j].next_seq = 0;
             }
+            if(packed) {
+                *published_count(i) = 0;
+            }
         }
         sst->sync_with_members(row_indices);
         std::cout << "Initialization complete" << std::endl;
     }
 
+    /**
+     * Writes every message that has been sent but not flushed to the other
+     * nodes, coalescing messages that are next to each other in memory into
+     * one RDMA write. msg_send_mutex must be held.
+     */
+    void flush_locked() {
+        if(num_flushed == num_sent) {
+            return;
+        }
+        if(packed) {
+            // Entries are queued back to back, so the whole batch is one range;
+            // its bytes must arrive before the count that announces them
+            put_ring_range(ring_entries[flushed_entries].start_pos, ring_entries[sent_entries - 1].end_pos);
+            flushed_entries = sent_entries;
+            *published_count(my_row) = num_sent;
+            sst->put(row_indices, (char*)published_count(0) - sst->getBaseAddress(), sizeof(uint64_t));
+        } else if(ud) {
+            // Each message is one datagram to the whole group, except those
+            // too large for one, which are written to each member as before
+            for(; num_flushed < num_sent; ++num_flushed) {
+                const uint32_t slot = num_flushed % window_size;
+                volatile Message& msg = sst->slots[my_row][slots_offset + slot];
+                const ud_packet_header header{my_row, slot, msg.size, msg.next_seq};
+                if(!ud->send(reinterpret_cast<const char*>(&header), sizeof(header), msg.buf, msg.size)) {
+                    sst->put(row_indices, (char*)std::addressof(msg) - sst->getBaseAddress(), sizeof(Message));
+                }
+            }
+        } else {
+            // Consecutive slots are contiguous until the window wraps around
+            while(num_flushed < num_sent) {
+                uint32_t first_slot = num_flushed % window_size;
+                uint32_t num_slots = std::min<uint64_t>(num_sent - num_flushed, window_size - first_slot);
+                sst->put(row_indices, (char*)std::addressof(sst->slots[0][slots_offset + first_slot]) - sst->getBaseAddress(),
+                         sizeof(Message) * num_slots);
+                num_flushed += num_slots;
+            }
+        }
+        num_flushed = num_sent;
+    }
+
+    /** Runs on the timer wheel when the oldest unflushed message may have
+     * used up its latency budget */
+    void flush_timeout() {
+        std::lock_guard<std::mutex> lock(msg_send_mutex);
+        flush_timer = 0;
+        if(thread_shutdown || num_flushed == num_sent) {
+            return;
+        }
+        // The batch the timer was set for may have been flushed and another
+        // one started since
+        const auto waited = std::chrono::steady_clock::now() - oldest_unflushed_time;
+        if(waited >= batch_latency_budget) {
+            flush_locked();
+        } else {
+            schedule_flush(batch_latency_budget - waited);
+        }
+    }
+
+    /** Sets flush_timer to go off after delay. msg_send_mutex must be held. */
+    void schedule_flush(std::chrono::nanoseconds delay) {
+        flush_timer = timer_wheel::shared().schedule_after(
+                std::chrono::duration_cast<std::chrono::microseconds>(delay), [this]() { flush_timeout(); });
+    }
+
+    /** Emits the RDMA writes for bytes [start, end) of this node's ring. */
+    void put_ring_range(uint64_t start, uint64_t end) {
+        const uint64_t size = ring_size();
+        const std::size_t base = (char*)ring_base(0) - sst->getBaseAddress();
+        while(start < end) {
+            const uint64_t offset = start % size;
+            const uint64_t length = std::min(end - start, size - offset);
+            sst->put(row_indices, base + offset, length);
+            start += length;
+        }
+    }
+
+    /** Copies a message that arrived by datagram into its sender's slot, as
+     * if the sender had written it there. */
+    void receive_datagram(const char* packet, uint32_t length) {
+        ud_packet_header header;
+        if(length < sizeof(header)) {
+            return;
+        }
+        memcpy(&header, packet, sizeof(header));
+        if(header.sender_row == my_row || header.sender_row >= (uint32_t)sst->get_num_rows()
+           || header.slot >= window_size || header.size > max_msg_size
+           || sizeof(header) + header.size > length) {
+            return;
+        }
+        volatile Message& msg = sst->slots[header.sender_row][slots_offset + header.slot];
+        // A duplicate or late datagram, or one whose message was already retransmitted
+        if(msg.next_seq >= header.next_seq) {
+            return;
+        }
+        memcpy(const_cast<char*>(msg.buf), packet + sizeof(header), header.size);
+        msg.size = header.size;
+        // Receivers take next_seq to mean the slot is filled, so it goes last
+        std::atomic_thread_fence(std::memory_order_release);
+        msg.next_seq = header.next_seq;
+    }
+
+    /**
+     * Writes this node's unacknowledged messages again to any member whose
+     * count of them has been stuck for a whole timeout, over its RC
+     * connection, since one of their datagrams was probably dropped.
+     */
+    void retransmit_stalled() {
+        if(my_sender_index < 0) {
+            return;
+        }
+        uint64_t flushed;
+        {
+            std::lock_guard<std::mutex> lock(msg_send_mutex);
+            flushed = num_flushed;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        for(uint32_t member = 0; member < num_members; ++member) {
+            const uint32_t row = row_indices[member];
+            if(row == my_row) {
+                continue;
+            }
+            const long long int received = sst->num_received_sst[row][num_received_offset + my_sender_index] + 1;
+            if(received != ud_last_received[member]) {
+                ud_last_received[member] = received;
+                ud_last_progress[member] = now;
+                continue;
+            }
+            if(received >= (long long int)flushed || now - ud_last_progress[member] < ud_retransmit_timeout) {
+                continue;
+            }
+            // Slots aren't reused until every member has acknowledged them,
+            // so all of [received, flushed) is still in the window
+            for(uint64_t first = received; first < flushed;) {
+                const uint32_t first_slot = first % window_size;
+                const uint32_t num_slots = std::min<uint64_t>(flushed - first, window_size - first_slot);
+                sst->put({row}, (char*)std::addressof(sst->slots[0][slots_offset + first_slot]) - sst->getBaseAddress(),
+                         sizeof(Message) * num_slots);
+                first += num_slots;
+            }
+            ud_last_progress[member] = now;
+        }
+    }
+
+    void ud_loop() {
+        pthread_setname_np(pthread_self(), "mcast_ud");
+        derecho::place_this_thread("mcast_ud");
+        auto handler = [this](const char* packet, uint32_t length) { receive_datagram(packet, length); };
+        auto last_check = std::chrono::steady_clock::now();
+        while(!thread_shutdown) {
+            while(ud->poll(handler)) {
+            }
+            const auto now = std::chrono::steady_clock::now();
+            if(now - last_check >= ud_retransmit_timeout) {
+                retransmit_stalled();
+                last_check = now;
+            }
+        }
+    }
+
 public:
+    /** A member whose acknowledgments stop advancing for this long while
+     * messages are outstanding is sent them again over RC. */
+    static constexpr std::chrono::microseconds ud_retransmit_timeout{1000};
+    /** The largest datagram a group sends, to size a ud_multicast with */
+    static constexpr uint32_t max_ud_packet_size() {
+        return sizeof(ud_packet_header) + max_msg_size;
+    }
+
+    /**
+     * @param ud A hardware multicast group joined by exactly the members of
+     * this group, to send messages through instead of writing them to each
+     * member, or null to use only the RC connections. Packed groups always
+     * use the RC connections.
+     */
     multicast_group(std::shared_ptr<sstType> sst,
                     std::vector<uint32_t> row_indices,
                     uint32_t window_size,
                     std::vector<int> is_sender = {},
                     uint32_t num_received_offset = 0,
-                    uint32_t slots_offset = 0)
+                    uint32_t slots_offset = 0,
+                    bool packed = false,
+                    uint32_t max_batch_size = 1,
+                    std::chrono::nanoseconds batch_latency_budget = std::chrono::microseconds(5),
+                    std::shared_ptr<ud_multicast> ud = nullptr)
             : my_row(sst->get_local_index()),
               sst(sst),
               row_indices(row_indices),
@@ -85,7 +326,13 @@ public:
               num_received_offset(num_received_offset),
               slots_offset(slots_offset),
               num_members(row_indices.size()),
-              window_size(window_size) {
+              window_size(window_size),
+              max_batch_size(std::max(max_batch_size, 1u)),
+              batch_latency_budget(batch_latency_budget),
+              packed(packed),
+              ud(packed ? nullptr : ud),
+              ud_last_received(num_members, 0),
+              ud_last_progress(num_members, std::chrono::steady_clock::now()) {
         // find my_member_index
         for(uint i = 0; i < num_members; ++i) {
             if(row_indices[i] == my_row) {
@@ -107,10 +354,141 @@ public:
             my_sender_index = -1;
         }
         initialize();
+        if(this->ud) {
+            ud_thread = std::thread(&multicast_group::ud_loop, this);
+        }
+    }
+
+    ~multicast_group() {
+        timer_wheel::timer_id pending_flush;
+        {
+            std::lock_guard<std::mutex> lock(msg_send_mutex);
+            thread_shutdown = true;
+            pending_flush = flush_timer;
+            flush_timer = 0;
+        }
+        // Waits for the timer's callback if it is running
+        if(pending_flush) {
+            timer_wheel::shared().cancel(pending_flush);
+        }
+        if(ud_thread.joinable()) {
+            ud_thread.join();
+        }
+    }
+
+    /** Entries in the packed ring start with a ring_header and are padded to this alignment */
+    static constexpr uint32_t ring_alignment = 8;
+    /** Written in place of a ring_header where the ring wraps around */
+    static constexpr uint64_t ring_wrap_marker = ~0ull;
+    /** The header of a message in the packed ring: the message's size */
+    using ring_header = uint64_t;
+
+    /** The start of a row's packed ring: its slots for this group, as bytes */
+    volatile char* ring_base(uint32_t row) {
+        return reinterpret_cast<volatile char*>(std::addressof(sst->slots[row][slots_offset]));
+    }
+    /** The size of the packed ring; the word after it counts the messages sent in it */
+    uint64_t ring_size() const {
+        return (window_size * sizeof(Message) - sizeof(uint64_t)) / ring_alignment * ring_alignment;
+    }
+    /** The number of messages a row has sent in its packed ring */
+    volatile uint64_t* published_count(uint32_t row) {
+        return reinterpret_cast<volatile uint64_t*>(ring_base(row) + ring_size());
+    }
+    /** The number of bytes a message of this size takes up in the packed ring */
+    static uint64_t ring_entry_size(uint32_t msg_size) {
+        return (sizeof(ring_header) + msg_size + ring_alignment - 1) / ring_alignment * ring_alignment;
+    }
+
+    /** True if this group packs messages into a byte ring */
+    bool is_packed() const { return packed; }
+
+    /** The largest number of messages of this size that fit in the packed ring at once */
+    uint32_t max_packed_messages(uint32_t msg_size) const {
+        return ring_size() / ring_entry_size(msg_size);
+    }
+
+    /**
+     * In packed mode, finds the next message a sender has sent in its ring.
+     * @param row The sender's row
+     * @param read_pos The receiver's position in the sender's ring, counting
+     * all bytes ever read; advanced past the message if there is one
+     * @param num_read The number of the sender's messages already read
+     * @param size Set to the size of the message, if there is one
+     * @return A pointer to the message, or nullptr if the sender has not sent
+     * a message past num_read.
+     */
+    volatile char* next_packed_message(uint32_t row, uint64_t& read_pos, uint64_t num_read, uint32_t& size) {
+        if(*published_count(row) <= num_read) {
+            return nullptr;
+        }
+        const uint64_t ring = ring_size();
+        volatile char* base = ring_base(row);
+        uint64_t offset = read_pos % ring;
+        ring_header header = *reinterpret_cast<volatile ring_header*>(base + offset);
+        if(header == ring_wrap_marker) {
+            read_pos += ring - offset;
+            offset = 0;
+            header = *reinterpret_cast<volatile ring_header*>(base);
+        }
+        size = static_cast<uint32_t>(header);
+        read_pos += ring_entry_size(size);
+        return base + offset + sizeof(ring_header);
+    }
+
+    /**
+     * In packed mode, frees the ring space of every message whose tag is at
+     * most the given one. A message's space must not be reclaimed until
+     * every receiver is done with the message's bytes.
+     */
+    void reclaim(long long int tag) {
+        std::lock_guard<std::mutex> lock(msg_send_mutex);
+        while(flushed_entries > 0 && ring_entries.front().tag <= tag) {
+            ring_reclaimed_pos = ring_entries.front().end_pos;
+            ring_entries.pop_front();
+            flushed_entries--;
+            sent_entries--;
+        }
+    }
+
+    /**
+     * In packed mode, reserves space for a message in the ring.
+     * @param msg_size The size of the message
+     * @param tag A number identifying the message, increasing from message
+     * to message, that will be passed to reclaim() once the message's space
+     * can be reused
+     * @return A pointer to the space, or nullptr if the ring is full.
+     */
+    volatile char* get_packed_buffer(uint32_t msg_size, long long int tag) {
+        assert(packed && my_sender_index >= 0);
+        std::lock_guard<std::mutex> lock(msg_send_mutex);
+        const uint64_t ring = ring_size();
+        const uint64_t entry_size = ring_entry_size(msg_size);
+        const uint64_t offset = ring_write_pos % ring;
+        // An entry never wraps around; the rest of the ring is skipped instead
+        const uint64_t skipped = offset + entry_size > ring ? ring - offset : 0;
+        if(entry_size > ring || ring_write_pos + skipped + entry_size - ring_reclaimed_pos > ring) {
+            return nullptr;
+        }
+        volatile char* base = ring_base(my_row);
+        const uint64_t start_pos = ring_write_pos;
+        if(skipped) {
+            *reinterpret_cast<volatile ring_header*>(base + offset) = ring_wrap_marker;
+            ring_write_pos += skipped;
+        }
+        volatile char* entry = base + ring_write_pos % ring;
+        *reinterpret_cast<volatile ring_header*>(entry) = msg_size;
+        ring_write_pos += entry_size;
+        queued_num++;
+        ring_entries.push_back({tag, start_pos, ring_write_pos});
+        return entry + sizeof(ring_header);
     }
 
     volatile char* get_buffer(uint32_t msg_size) {
         assert(my_sender_index >= 0);
+        if(packed) {
+            return get_packed_buffer(msg_size, queued_num + 1);
+        }
         std::lock_guard<std::mutex> lock(msg_send_mutex);
         assert(msg_size <= max_msg_size);
         while(true) {
@@ -138,16 +516,37 @@ public:
         }
     }
 
+    /**
+     * Sends the message in the buffer returned by the last call to
+     * get_buffer. If batching is enabled, the message may not be written to
+     * the other nodes until more messages are sent, the batch's latency
+     * budget runs out, or flush is called.
+     */
     void send() {
-        // std::cout << "In send: " << std::endl;
-        uint32_t slot = num_sent % window_size;
-        // std::cout << "slot = " << slot << std::endl;
-        // std::cout << "slots_offset = " << slots_offset << std::endl;
+        std::lock_guard<std::mutex> lock(msg_send_mutex);
+        if(packed) {
+            assert(sent_entries < ring_entries.size());
+            sent_entries++;
+        } else {
+            uint32_t slot = num_sent % window_size;
+            sst->slots[my_row][slots_offset + slot].next_seq++;
+        }
+        if(num_flushed == num_sent) {
+            oldest_unflushed_time = std::chrono::steady_clock::now();
+        }
         num_sent++;
-        sst->slots[my_row][slots_offset + slot].next_seq++;
-        sst->put(
-                (char*)std::addressof(sst->slots[0][slots_offset + slot]) - sst->getBaseAddress(),
-                sizeof(Message));
+        if(num_sent - num_flushed >= max_batch_size
+           || std::chrono::steady_clock::now() - oldest_unflushed_time >= batch_latency_budget) {
+            flush_locked();
+        } else if(!flush_timer) {
+            schedule_flush(batch_latency_budget);
+        }
+    }
+
+    /** Writes any batched messages to the other nodes immediately. */
+    void flush() {
+        std::lock_guard<std::mutex> lock(msg_send_mutex);
+        flush_locked();
     }
 
     void debug_print() {
@@ -168,4 +567,7 @@ public:
         cout << endl;
     }
 };
+
+template <typename sstType>
+constexpr std::chrono::microseconds multicast_group<sstType>::ud_retransmit_timeout;
 }
@@ -5,6 +5,7 @@
 #include <list>
 #include <mutex>
 #include <utility>
+#include <vector>
 
 #include "sst.h"
 
@@ -22,18 +23,38 @@ enum class PredicateType {
     RECURRENT,
     /** Transition predicates persist as long as the SST instance, but only fire
    * their triggers when they transition from false to true. */
-    TRANSITION
+    TRANSITION,
+    /** Urgent predicates are recurrent predicates that the detect loop
+   * evaluates before all the others, and again after every other trigger it
+   * runs, so that slow triggers of other predicates don't hold them up. */
+    URGENT
 };
 
 template <class DerivedSST>
 class Predicates {
     using pred = std::function<bool(const DerivedSST&)>;
     using trig = std::function<void(DerivedSST&)>;
-    using pred_list = std::list<std::unique_ptr<std::pair<pred, std::shared_ptr<trig>>>>;
+    /** A registered (predicate, trigger) pair, along with what it depends on. */
+    struct pred_entry : public std::pair<pred, std::shared_ptr<trig>> {
+        /** The rows the predicate reads; if empty, it is evaluated on every
+         * pass of the detect loop. */
+        std::vector<uint32_t> depends_on_rows;
+        /** The detect loop iteration in which the predicate was last evaluated,
+         * or 0 if it never has been. */
+        uint64_t last_evaluated = 0;
+        /** True if the predicate was true the last time it was evaluated. */
+        bool was_true = false;
+        pred_entry(const pred& predicate, const trig& trigger, const std::vector<uint32_t>& depends_on_rows)
+                : std::pair<pred, std::shared_ptr<trig>>(predicate, std::make_shared<trig>(trigger)),
+                  depends_on_rows(depends_on_rows) {}
+    };
+    using pred_list = std::list<std::unique_ptr<pred_entry>>;
     /** Predicate list for one-time predicates. */
     pred_list one_time_predicates;
     /** Predicate list for recurrent predicates */
     pred_list recurrent_predicates;
+    /** Predicate list for urgent predicates */
+    pred_list urgent_predicates;
     /** Predicate list for transition predicates */
     pred_list transition_predicates;
     /** Contains one entry for every predicate in `transition_predicates`, in parallel. */
@@ -43,6 +64,13 @@ class Predicates {
 
     std::mutex predicate_mutex;
 
+    /** The number of passes the detect loop has made over these predicates, starting from 1. */
+    uint64_t detect_iteration = 0;
+    /** The value of each row's generation counter the last time the detect loop read it. */
+    std::vector<uint64_t> last_seen_generations;
+    /** The detect loop iteration in which each row was last seen to change. */
+    std::vector<uint64_t> row_changed_iteration;
+
 public:
     class pred_handle {
         bool is_valid;
@@ -71,7 +99,18 @@ public:
 
     /** Inserts a single (predicate, trigger) pair to the appropriate predicate list. */
     pred_handle insert(pred predicate, trig trigger,
-                       PredicateType type = PredicateType::ONE_TIME);
+                       PredicateType type = PredicateType::ONE_TIME) {
+        return insert(predicate, trigger, type, {});
+    }
+
+    /**
+     * Inserts a (predicate, trigger) pair that only reads the given rows. If
+     * the SST tracks row changes, the predicate is then only re-evaluated
+     * after one of those rows has been written, or if it was true the last
+     * time it was evaluated; otherwise the rows are ignored.
+     */
+    pred_handle insert(pred predicate, trig trigger, PredicateType type,
+                       const std::vector<uint32_t>& depends_on_rows);
 
     /** Inserts a predicate with a list of triggers (which will be run in
      * sequence) to the appropriate predicate list. */
@@ -102,19 +141,20 @@ public:
  * PredicateType::ONE_TIME
  */
 template <class DerivedSST>
-auto Predicates<DerivedSST>::insert(pred predicate, trig trigger, PredicateType type) -> pred_handle {
+auto Predicates<DerivedSST>::insert(pred predicate, trig trigger, PredicateType type,
+                                    const std::vector<uint32_t>& depends_on_rows) -> pred_handle {
     std::lock_guard<std::mutex> lock(predicate_mutex);
     if(type == PredicateType::ONE_TIME) {
-        one_time_predicates.push_back(std::make_unique<std::pair<pred, std::shared_ptr<trig>>>(
-                predicate, std::make_shared<trig>(trigger)));
+        one_time_predicates.push_back(std::make_unique<pred_entry>(predicate, trigger, depends_on_rows));
         return pred_handle(--one_time_predicates.end(), type);
     } else if(type == PredicateType::RECURRENT) {
-        recurrent_predicates.push_back(std::make_unique<std::pair<pred, std::shared_ptr<trig>>>(
-                predicate, std::make_shared<trig>(trigger)));
+        recurrent_predicates.push_back(std::make_unique<pred_entry>(predicate, trigger, depends_on_rows));
         return pred_handle(--recurrent_predicates.end(), type);
+    } else if(type == PredicateType::URGENT) {
+        urgent_predicates.push_back(std::make_unique<pred_entry>(predicate, trigger, depends_on_rows));
+        return pred_handle(--urgent_predicates.end(), type);
     } else {
-        transition_predicates.push_back(std::make_unique<std::pair<pred, std::shared_ptr<trig>>>(
-                predicate, std::make_shared<trig>(trigger)));
+        transition_predicates.push_back(std::make_unique<pred_entry>(predicate, trigger, depends_on_rows));
         transition_predicate_states.push_back(false);
         return pred_handle(--transition_predicates.end(), type);
     }
@@ -133,11 +173,13 @@ void Predicates<DerivedSST>::remove(pred_handle& handle) {
 template <class DerivedSST>
 void Predicates<DerivedSST>::clear() {
     std::lock_guard<std::mutex> lock(predicate_mutex);
-    using ptr_to_pred = std::unique_ptr<std::pair<pred, std::shared_ptr<trig>>>;
+    using ptr_to_pred = std::unique_ptr<pred_entry>;
     std::for_each(one_time_predicates.begin(), one_time_predicates.end(),
                   [](ptr_to_pred& ptr) { ptr.reset(); });
     std::for_each(recurrent_predicates.begin(), recurrent_predicates.end(),
                   [](ptr_to_pred& ptr) { ptr.reset(); });
+    std::for_each(urgent_predicates.begin(), urgent_predicates.end(),
+                  [](ptr_to_pred& ptr) { ptr.reset(); });
     std::for_each(transition_predicates.begin(), transition_predicates.end(),
                   [](ptr_to_pred& ptr) { ptr.reset(); });
 }
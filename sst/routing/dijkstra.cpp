@@ -1,7 +1,12 @@
 #include "dijkstra.h"
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <iterator>
+#include <queue>
 #include <set>
+#include <thread>
 #include <utility>
 #include <iostream>
 
@@ -14,12 +19,52 @@ using std::vector;
 using std::pair;
 using std::make_pair;
 
+csr_adjacency_t::csr_adjacency_t(const adjacency_list_t& adjacency_list) {
+	row_start.reserve(adjacency_list.size() + 1);
+	row_start.push_back(0);
+	for (const vector<neighbor>& neighbors : adjacency_list) {
+		edges.insert(edges.end(), neighbors.begin(), neighbors.end());
+		std::sort(edges.begin() + row_start.back(), edges.end(),
+				[](const neighbor& a, const neighbor& b) { return a.target < b.target; });
+		row_start.push_back(edges.size());
+	}
+}
+
+weight_t csr_adjacency_t::SetWeight(vertex_t u, vertex_t v, weight_t weight) {
+	auto row_end = edges.begin() + row_start[u + 1];
+	auto edge = std::lower_bound(edges.begin() + row_start[u], row_end, v,
+			[](const neighbor& a, vertex_t target) { return a.target < target; });
+	bool found = edge != row_end && edge->target == v;
+	weight_t old_weight = found ? edge->weight : max_weight;
+	if (found && weight != max_weight) {
+		edge->weight = weight;
+	} else if (found || weight != max_weight) {
+		if (found) {
+			edges.erase(edge);
+		} else {
+			edges.insert(edge, neighbor(v, weight));
+		}
+		for (size_t later = u + 1; later < row_start.size(); ++later) {
+			row_start[later] += found ? -1 : 1;
+		}
+	}
+	return old_weight;
+}
+
 void DijkstraComputePaths(vertex_t source,
 		const adjacency_list_t& adjacency_list,
 		vector<weight_t>& min_distance,
 		vector<vertex_t>& previous_vertex)
 {
-	int n = adjacency_list.size();
+	DijkstraComputePaths(source, csr_adjacency_t(adjacency_list), min_distance, previous_vertex);
+}
+
+void DijkstraComputePaths(vertex_t source,
+		const csr_adjacency_t& adjacency,
+		vector<weight_t>& min_distance,
+		vector<vertex_t>& previous_vertex)
+{
+	int n = adjacency.num_vertices();
 	min_distance.clear();
 	min_distance.resize(n, max_weight);
 	min_distance[source] = 0;
@@ -35,13 +80,10 @@ void DijkstraComputePaths(vertex_t source,
 		vertex_queue.erase(vertex_queue.begin());
 
 		// Visit each edge exiting u
-		const vector<neighbor>& neighbors = adjacency_list[u];
-		for (vector<neighbor>::const_iterator neighbor_iter = neighbors.begin();
-				neighbor_iter != neighbors.end();
-				neighbor_iter++)
+		for (int e = adjacency.row_start[u]; e < adjacency.row_start[u + 1]; ++e)
 		{
-			vertex_t v = neighbor_iter->target;
-			weight_t weight = neighbor_iter->weight;
+			vertex_t v = adjacency.edges[e].target;
+			weight_t weight = adjacency.edges[e].weight;
 			weight_t distance_through_u = dist + weight;
 			if (distance_through_u < min_distance[v]) {
 				vertex_queue.erase(make_pair(min_distance[v], v));
@@ -57,6 +99,154 @@ void DijkstraComputePaths(vertex_t source,
 }
 
 
+void AllPairsShortestPaths(const csr_adjacency_t& adjacency,
+		unsigned int num_threads,
+		vector<vertex_t>& first_hops,
+		vector<weight_t>* distances)
+{
+	const int n = adjacency.num_vertices();
+	first_hops.assign(static_cast<size_t>(n) * n, -1);
+	if (distances) {
+		distances->assign(static_cast<size_t>(n) * n, max_weight);
+	}
+	std::atomic<int> next_source{0};
+	auto run_sources = [&]() {
+		vector<weight_t> min_distance(n);
+		vector<vertex_t> first_hop(n);
+		// A binary heap with stale entries skipped, which is cheaper than
+		// erasing from a std::set when there are thousands of vertexes
+		std::priority_queue<pair<weight_t, vertex_t>, vector<pair<weight_t, vertex_t>>,
+				std::greater<pair<weight_t, vertex_t>>> vertex_queue;
+		for (int source = next_source++; source < n; source = next_source++) {
+			std::fill(min_distance.begin(), min_distance.end(), max_weight);
+			std::fill(first_hop.begin(), first_hop.end(), -1);
+			min_distance[source] = 0;
+			first_hop[source] = source;
+			vertex_queue.push(make_pair(0, source));
+			while (!vertex_queue.empty()) {
+				weight_t dist = vertex_queue.top().first;
+				vertex_t u = vertex_queue.top().second;
+				vertex_queue.pop();
+				if (dist > min_distance[u]) {
+					continue;
+				}
+				for (int e = adjacency.row_start[u]; e < adjacency.row_start[u + 1]; ++e) {
+					vertex_t v = adjacency.edges[e].target;
+					weight_t distance_through_u = dist + adjacency.edges[e].weight;
+					if (distance_through_u < min_distance[v]) {
+						min_distance[v] = distance_through_u;
+						first_hop[v] = (u == source) ? v : first_hop[u];
+						vertex_queue.push(make_pair(distance_through_u, v));
+					}
+				}
+			}
+			std::copy(first_hop.begin(), first_hop.end(), first_hops.begin() + static_cast<size_t>(source) * n);
+			if (distances) {
+				std::copy(min_distance.begin(), min_distance.end(), distances->begin() + static_cast<size_t>(source) * n);
+			}
+		}
+	};
+	vector<std::thread> threads;
+	for (unsigned int t = 1; t < std::max(num_threads, 1u); ++t) {
+		threads.emplace_back(run_sources);
+	}
+	run_sources();
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+IncrementalShortestPaths::IncrementalShortestPaths(vertex_t source, const adjacency_list_t& adjacency_list)
+	: source(source), out_edges(adjacency_list) {
+	adjacency_list_t reversed(adjacency_list.size());
+	for (size_t u = 0; u < adjacency_list.size(); ++u) {
+		for (const neighbor& edge : adjacency_list[u]) {
+			reversed[edge.target].push_back(neighbor(u, edge.weight));
+		}
+	}
+	in_edges = csr_adjacency_t(reversed);
+	DijkstraComputePaths(source, out_edges, min_distance, previous_vertex);
+}
+
+void IncrementalShortestPaths::Relax(const vector<vertex_t>& changed) {
+	std::set<std::pair<weight_t, vertex_t>> vertex_queue;
+	for (vertex_t v : changed) {
+		if (min_distance[v] != max_weight) {
+			vertex_queue.insert(make_pair(min_distance[v], v));
+		}
+	}
+	while (!vertex_queue.empty()) {
+		weight_t dist = vertex_queue.begin()->first;
+		vertex_t u = vertex_queue.begin()->second;
+		vertex_queue.erase(vertex_queue.begin());
+		for (int e = out_edges.row_start[u]; e < out_edges.row_start[u + 1]; ++e) {
+			vertex_t v = out_edges.edges[e].target;
+			weight_t distance_through_u = dist + out_edges.edges[e].weight;
+			if (distance_through_u < min_distance[v]) {
+				vertex_queue.erase(make_pair(min_distance[v], v));
+				min_distance[v] = distance_through_u;
+				previous_vertex[v] = u;
+				vertex_queue.insert(make_pair(min_distance[v], v));
+			}
+		}
+	}
+}
+
+bool IncrementalShortestPaths::UpdateLink(vertex_t from, vertex_t to, weight_t weight) {
+	weight_t old_weight = out_edges.SetWeight(from, to, weight);
+	in_edges.SetWeight(to, from, weight);
+	if (old_weight == weight || to == source || min_distance[from] == max_weight) {
+		return false;
+	}
+	if (weight < old_weight) {
+		// Only paths through the cheaper link can get shorter
+		if (min_distance[from] + weight >= min_distance[to]) {
+			return false;
+		}
+		min_distance[to] = min_distance[from] + weight;
+		previous_vertex[to] = from;
+		Relax({to});
+		return true;
+	}
+	// A dearer link only lengthens the paths that use it, which are the
+	// paths to its target's subtree of the shortest-path tree
+	if (previous_vertex[to] != from) {
+		return false;
+	}
+	int n = min_distance.size();
+	vector<vector<vertex_t>> children(n);
+	for (vertex_t v = 0; v < n; ++v) {
+		if (previous_vertex[v] != -1) {
+			children[previous_vertex[v]].push_back(v);
+		}
+	}
+	vector<bool> in_subtree(n, false);
+	vector<vertex_t> subtree{to};
+	in_subtree[to] = true;
+	for (size_t i = 0; i < subtree.size(); ++i) {
+		for (vertex_t child : children[subtree[i]]) {
+			in_subtree[child] = true;
+			subtree.push_back(child);
+		}
+	}
+	// Start each vertex of the subtree from its best link from outside it,
+	// whose distances haven't changed, then let the subtree settle
+	for (vertex_t v : subtree) {
+		min_distance[v] = max_weight;
+		previous_vertex[v] = -1;
+		for (int e = in_edges.row_start[v]; e < in_edges.row_start[v + 1]; ++e) {
+			vertex_t u = in_edges.edges[e].target;
+			if (!in_subtree[u] && min_distance[u] != max_weight
+					&& min_distance[u] + in_edges.edges[e].weight < min_distance[v]) {
+				min_distance[v] = min_distance[u] + in_edges.edges[e].weight;
+				previous_vertex[v] = u;
+			}
+		}
+	}
+	Relax(subtree);
+	return true;
+}
+
 list<vertex_t> DijkstraGetShortestPathTo(vertex_t vertex,
 		const vector<vertex_t> &previous_vertex) {
 	list<vertex_t> path;
@@ -27,12 +27,90 @@ struct neighbor {
 
 typedef std::vector<std::vector<neighbor> > adjacency_list_t;
 
+/**
+ * An adjacency list in compressed sparse row form: the neighbors of vertex u
+ * are edges[row_start[u]] up to edges[row_start[u + 1]], sorted by target, so
+ * that a pass over a vertex's neighbors reads one contiguous array.
+ */
+struct csr_adjacency_t {
+	std::vector<int> row_start;
+	std::vector<neighbor> edges;
+
+	csr_adjacency_t() : row_start(1, 0) { }
+	explicit csr_adjacency_t(const adjacency_list_t& adjacency_list);
+
+	int num_vertices() const { return row_start.size() - 1; }
+
+	/**
+	 * Sets the weight of the edge from u to v, adding the edge if there isn't
+	 * one, or removes it if the weight is max_weight.
+	 * @return The edge's previous weight, or max_weight if there was none
+	 */
+	weight_t SetWeight(vertex_t u, vertex_t v, weight_t weight);
+};
 
 void DijkstraComputePaths(vertex_t source,
 		const adjacency_list_t& adjacency_list,
 		std::vector<weight_t>& min_distance,
 		std::vector<vertex_t>& previous_vertex);
 
+void DijkstraComputePaths(vertex_t source,
+		const csr_adjacency_t& adjacency,
+		std::vector<weight_t>& min_distance,
+		std::vector<vertex_t>& previous_vertex);
+
+/**
+ * Computes the shortest paths between all pairs of vertexes, for planning the
+ * routing tables of large topologies, with one run of Dijkstra's algorithm
+ * per source. The sources are handed out to num_threads threads, each with
+ * its own heap and scratch space, so the runs share nothing but the graph.
+ * @param[out] first_hops Set to a num_vertices x num_vertices matrix, in
+ * which first_hops[source * num_vertices + dest] is the vertex after source
+ * on the path to dest, which is every routing table at once; it is -1 if
+ * dest is unreachable and source if dest is source
+ * @param[out] distances If not null, set to the lengths of the paths,
+ * arranged the same way, with max_weight for unreachable vertexes
+ */
+void AllPairsShortestPaths(const csr_adjacency_t& adjacency,
+		unsigned int num_threads,
+		std::vector<vertex_t>& first_hops,
+		std::vector<weight_t>* distances = nullptr);
+
+/**
+ * Keeps the shortest paths from one vertex up to date as the weights of
+ * single edges change, by repairing the shortest-path tree instead of running
+ * Dijkstra's algorithm over the whole graph again. A cheaper edge only
+ * changes the vertexes it now gives shorter paths to, and a dearer one only
+ * changes the subtree below it, if the tree uses it at all. Where paths tie,
+ * the repaired tree may pick a different one than a full recomputation would.
+ */
+class IncrementalShortestPaths {
+	vertex_t source;
+	csr_adjacency_t out_edges;
+	/** The same edges, indexed by their targets */
+	csr_adjacency_t in_edges;
+	std::vector<weight_t> min_distance;
+	std::vector<vertex_t> previous_vertex;
+
+	/** Runs Dijkstra's algorithm onward from vertexes whose distances have
+	 * gone down, until no other distance goes down. */
+	void Relax(const std::vector<vertex_t>& changed);
+
+public:
+	IncrementalShortestPaths(vertex_t source, const adjacency_list_t& adjacency_list);
+
+	/**
+	 * Changes the weight of the link from one vertex to another, and updates
+	 * the shortest paths.
+	 * @param weight The link's new weight, or max_weight if it is gone
+	 * @return True if any vertex's distance or previous vertex changed
+	 */
+	bool UpdateLink(vertex_t from, vertex_t to, weight_t weight);
+
+	const std::vector<weight_t>& MinDistance() const { return min_distance; }
+	const std::vector<vertex_t>& PreviousVertex() const { return previous_vertex; }
+};
+
 
 std::list<vertex_t> DijkstraGetShortestPathTo(vertex_t vertex,
 		const std::vector<vertex_t> &previous_vertex);
@@ -1,10 +1,14 @@
 #include <libio.h>
+#include <cstdlib>
 #include <fstream>
+#include <random>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <vector>
 
 #include "sst/experiments/statistics.h"
+#include "dijkstra.h"
 #include "routing.h"
 #include "lsdb_row.h"
 
@@ -17,6 +21,9 @@ using std::unordered_set;
 
 static const long long int SECONDS_TO_NS = 1000000000LL;
 static const int EXPERIMENT_REPS = 1000;
+static const int ALL_PAIRS_REPS = 3;
+/** The number of links from each vertex in the all-pairs benchmark's topologies */
+static const int ALL_PAIRS_DEGREE = 8;
 
 void time_recompute_table(int num_nodes, vector<long long int>& start_times, std::vector<long long int>& end_times) {
 	using namespace sst;
@@ -52,6 +59,39 @@ void time_recompute_table(int num_nodes, vector<long long int>& start_times, std
 	}
 }
 
+/**
+ * Times computing the routing tables of every vertex of a random topology at
+ * once, in which each vertex has ALL_PAIRS_DEGREE links to other vertexes,
+ * including one to the next vertex so that every vertex is reachable.
+ */
+void time_all_pairs(int num_vertices, unsigned int num_threads, vector<long long int>& start_times, std::vector<long long int>& end_times) {
+	using namespace sst::path_finding;
+	std::mt19937 engine(num_vertices);
+	std::uniform_int_distribution<vertex_t> vertex_rand(0, num_vertices - 1);
+	std::uniform_int_distribution<weight_t> weight_rand(1, 10);
+	adjacency_list_t adjacency_list(num_vertices);
+	for(vertex_t source = 0; source < num_vertices; ++source) {
+		adjacency_list[source].push_back(neighbor((source + 1) % num_vertices, weight_rand(engine)));
+		for(int link = 1; link < ALL_PAIRS_DEGREE; ++link) {
+			vertex_t target = vertex_rand(engine);
+			if(target != source) {
+				adjacency_list[source].push_back(neighbor(target, weight_rand(engine)));
+			}
+		}
+	}
+	csr_adjacency_t adjacency(adjacency_list);
+	vector<vertex_t> first_hops;
+	for(size_t rep = 0; rep < start_times.size(); ++rep) {
+		struct timespec start_time;
+		clock_gettime(CLOCK_REALTIME, &start_time);
+		start_times[rep] = start_time.tv_sec * SECONDS_TO_NS + start_time.tv_nsec;
+		AllPairsShortestPaths(adjacency, num_threads, first_hops);
+		struct timespec end_time;
+		clock_gettime(CLOCK_REALTIME, &end_time);
+		end_times[rep] = end_time.tv_sec * SECONDS_TO_NS + end_time.tv_nsec;
+	}
+}
+
 int main (int argc, char** argv) {
 
 	std::ofstream data_out_stream(string("dijkstra_timing.csv").c_str());
@@ -65,5 +105,17 @@ int main (int argc, char** argv) {
 	}
 
 	data_out_stream.close();
+
+	//All-pairs routing for scenario planning, with the given number of threads
+	unsigned int num_threads = argc > 1 ? std::atoi(argv[1]) : std::thread::hardware_concurrency();
+	std::ofstream all_pairs_stream(string("all_pairs_timing.csv").c_str());
+	for(int num_vertices : {1000, 2000, 5000, 10000}) {
+		std::vector<long long int> start_times(ALL_PAIRS_REPS), end_times(ALL_PAIRS_REPS);
+		time_all_pairs(num_vertices, num_threads, start_times, end_times);
+		double mean, stdev;
+		tie(mean, stdev) = sst::experiments::compute_statistics(start_times, end_times);
+		all_pairs_stream << num_vertices << "," << num_threads << "," << mean << "," << stdev << std::endl;
+	}
+	all_pairs_stream.close();
 }
 
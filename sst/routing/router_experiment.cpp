@@ -129,8 +129,12 @@ int main (int argc, char** argv) {
   std::unique_ptr<RoutingSST::SST_Snapshot> linkstate_snapshot = linkstate_sst.get_snapshot();
 
   //Compute initial routing table
-  compute_routing_table(this_node_rank, num_nodes, forwarding_table, links_used, *linkstate_snapshot);
+  IncrementalRoutingTable routing_table(this_node_rank, num_nodes, *linkstate_snapshot);
+  routing_table.write_routing_table(forwarding_table, links_used);
 //  print_routing_table(forwarding_table);
+  //The time each recomputation took, and the number of link changes it applied
+  vector<long long int> recompute_times;
+  vector<int> recompute_link_events;
 
 
   //Predicate: If any links change that might invalidate our existing path choices
@@ -153,9 +157,13 @@ int main (int argc, char** argv) {
   };
 
   //Action: Recompute my local routing table
-  auto recompute_action = [&forwarding_table, &links_used, &linkstate_snapshot] (RoutingSST& sst) {
+  auto recompute_action = [&forwarding_table, &links_used, &linkstate_snapshot, &routing_table,
+							&recompute_times, &recompute_link_events] (RoutingSST& sst) {
 	  linkstate_snapshot = sst.get_snapshot();
-	  compute_routing_table(this_node_rank, num_nodes, forwarding_table, links_used, *linkstate_snapshot);
+	  long long int recompute_start = get_realtime_clock();
+	  int link_events = routing_table.update(*linkstate_snapshot, forwarding_table, links_used);
+	  recompute_times.push_back(get_realtime_clock() - recompute_start);
+	  recompute_link_events.push_back(link_events);
 	  //If the recompute was triggered by the experiment, not the reset...
 	  if((*linkstate_snapshot)[0].link_cost[1] == 10) {
 		  //Update the barrier
@@ -270,6 +278,22 @@ int main (int argc, char** argv) {
 	  sync(TIMING_NODE);
   }
 
+  //Report how long recomputing the routing table took per link that changed
+  long long int total_recompute_time = 0;
+  long long int total_link_events = 0;
+  ofstream recompute_stream(string("recompute_times_" + std::to_string(num_nodes) + "_"
+		  + std::to_string(this_node_rank)).c_str());
+  for(size_t i = 0; i < recompute_times.size(); ++i) {
+	  total_recompute_time += recompute_times[i];
+	  total_link_events += recompute_link_events[i];
+	  recompute_stream << recompute_link_events[i] << "," << recompute_times[i] << endl;
+  }
+  recompute_stream.close();
+  if(total_link_events > 0) {
+	  cout << "Recomputed the routing table " << recompute_times.size() << " times for " << total_link_events
+		   << " link events, " << total_recompute_time / total_link_events << " ns per link event" << endl;
+  }
+
   return 0;
 }
 
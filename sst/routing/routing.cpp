@@ -8,6 +8,7 @@
 #include <unordered_set>
 #include <utility>
 #include <vector>
+#include <algorithm>
 #include <cassert>
 
 #include "dijkstra.h"
@@ -28,6 +29,20 @@ namespace sst {
 
 namespace experiments {
 
+/** Builds a graph of the links with positive costs in the link state table. */
+static path_finding::adjacency_list_t build_adjacency_list(int num_nodes, RoutingSST::SST_Snapshot& linkstate_rows) {
+	path_finding::adjacency_list_t network_adjacency_list(num_nodes);
+	for (int source = 0; source < num_nodes; ++source) {
+		for (int target = 0; target < num_nodes; ++target) {
+			if (source != target && linkstate_rows[source].link_cost[target] > 0) {
+				network_adjacency_list[source].push_back(
+						path_finding::neighbor(target, linkstate_rows[source].link_cost[target]));
+			}
+		}
+	}
+	return network_adjacency_list;
+}
+
 /**
  * @details
  * Constructs a graph of network connectivity from the given link-state
@@ -52,15 +67,7 @@ void compute_routing_table(int this_node_num, int num_nodes, vector<int>& forwar
         RoutingSST::SST_Snapshot& linkstate_rows) {
     assert(forwarding_table.size() == static_cast<vector<int>::size_type>(num_nodes));
 	//Build a graph of the network from the link state table, then pass it to Dijkstra
-	path_finding::adjacency_list_t network_adjacency_list(num_nodes);
-	for (int source = 0; source < num_nodes; ++source) {
-		for (int target = 0; target < num_nodes; ++target) {
-			if (source != target && linkstate_rows[source].link_cost[target] > 0) {
-				network_adjacency_list[source].push_back(
-						path_finding::neighbor(target, linkstate_rows[source].link_cost[target]));
-			}
-		}
-	}
+	path_finding::adjacency_list_t network_adjacency_list = build_adjacency_list(num_nodes, linkstate_rows);
 	vector<path_finding::weight_t> min_distance; //Unused output parameter
 	vector<path_finding::vertex_t> previous_vertexes;
 	path_finding::DijkstraComputePaths(this_node_num, network_adjacency_list,
@@ -81,6 +88,72 @@ void compute_routing_table(int this_node_num, int num_nodes, vector<int>& forwar
 	}
 }
 
+IncrementalRoutingTable::IncrementalRoutingTable(int this_node_num, int num_nodes,
+		RoutingSST::SST_Snapshot& linkstate_rows)
+	: this_node_num(this_node_num),
+	  num_nodes(num_nodes),
+	  link_costs(num_nodes * num_nodes),
+	  shortest_paths(this_node_num, build_adjacency_list(num_nodes, linkstate_rows)) {
+	for (int source = 0; source < num_nodes; ++source) {
+		for (int target = 0; target < num_nodes; ++target) {
+			link_costs[source * num_nodes + target] = linkstate_rows[source].link_cost[target];
+		}
+	}
+}
+
+int IncrementalRoutingTable::update(RoutingSST::SST_Snapshot& linkstate_rows, vector<int>& forwarding_table,
+		unordered_set<pair<int, int>>& links_used) {
+	int links_changed = 0;
+	bool paths_changed = false;
+	for (int source = 0; source < num_nodes; ++source) {
+		for (int target = 0; target < num_nodes; ++target) {
+			int cost = linkstate_rows[source].link_cost[target];
+			if (source == target || cost == link_costs[source * num_nodes + target]) {
+				continue;
+			}
+			link_costs[source * num_nodes + target] = cost;
+			++links_changed;
+			paths_changed |= shortest_paths.UpdateLink(source, target, cost > 0 ? cost : path_finding::max_weight);
+		}
+	}
+	if (paths_changed) {
+		write_routing_table(forwarding_table, links_used);
+	}
+	return links_changed;
+}
+
+void IncrementalRoutingTable::write_routing_table(vector<int>& forwarding_table,
+		unordered_set<pair<int, int>>& links_used) const {
+	assert(forwarding_table.size() == static_cast<vector<int>::size_type>(num_nodes));
+	const vector<path_finding::vertex_t>& previous_vertexes = shortest_paths.PreviousVertex();
+	//Every path is a path in the shortest-path tree, so the links used are its edges,
+	//and a node's first hop is its parent's, unless its parent is this node
+	const int unknown = -2;
+	links_used.clear();
+	std::fill(forwarding_table.begin(), forwarding_table.end(), unknown);
+	forwarding_table[this_node_num] = this_node_num;
+	for (int dest_node = 0; dest_node < num_nodes; ++dest_node) {
+		vector<int> path_back;
+		int node = dest_node;
+		while (forwarding_table[node] == unknown) {
+			path_back.push_back(node);
+			if (previous_vertexes[node] == -1) {
+				break;
+			}
+			links_used.insert(make_pair(previous_vertexes[node], node));
+			node = previous_vertexes[node];
+		}
+		//Walk back down the path, from the node whose first hop is known
+		int first_hop = forwarding_table[node] == unknown ? -1 : forwarding_table[node];
+		for (auto path_node = path_back.rbegin(); path_node != path_back.rend(); ++path_node) {
+			if (previous_vertexes[*path_node] == this_node_num) {
+				first_hop = *path_node;
+			}
+			forwarding_table[*path_node] = first_hop;
+		}
+	}
+}
+
 /**
  * @param forwarding_table The routing table to print, as a vector mapping
  * destination node ranks to first hops on the path.
@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "sst/sst.h"
+#include "dijkstra.h"
 #include "lsdb_row.h"
 #include "std_hashes.h"
 
@@ -26,6 +27,38 @@ void compute_routing_table(int this_node_num, int num_nodes, std::vector<int>& f
 /** Prints a routing table to stdout. */
 void print_routing_table(std::vector<int>& forwarding_table);
 
+/**
+ * A routing table that is kept up to date one link change at a time, by
+ * repairing the shortest paths it was computed from instead of recomputing
+ * them all whenever a link-state row changes. Gives the same routes as
+ * compute_routing_table, except that where paths tie it may keep one that a
+ * recomputation wouldn't pick.
+ */
+class IncrementalRoutingTable {
+	int this_node_num;
+	int num_nodes;
+	/** The link costs the paths reflect, indexed by source * num_nodes + target */
+	std::vector<int> link_costs;
+	path_finding::IncrementalShortestPaths shortest_paths;
+
+public:
+	IncrementalRoutingTable(int this_node_num, int num_nodes, RoutingSST::SST_Snapshot& linkstate_rows);
+
+	/**
+	 * Applies, one at a time, every link whose cost in `linkstate_rows`
+	 * differs from the one last seen, and rewrites the routing table if any
+	 * path changed.
+	 * @return The number of links that changed
+	 */
+	int update(RoutingSST::SST_Snapshot& linkstate_rows, std::vector<int>& forwarding_table,
+			std::unordered_set<std::pair<int, int>>& links_used);
+
+	/** Writes out the routing table and the links its paths use, as
+	 * compute_routing_table does; unreachable destinations are routed via -1. */
+	void write_routing_table(std::vector<int>& forwarding_table,
+			std::unordered_set<std::pair<int, int>>& links_used) const;
+};
+
 }
 }
 
@@ -1,12 +1,15 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <bitset>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <iostream>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <numeric>
@@ -16,6 +19,8 @@
 #include <thread>
 #include <vector>
 
+#include "column_reduce.h"
+#include "derecho/thread_placement.h"
 #include "predicates.h"
 #include "verbs.h"
 
@@ -29,6 +34,56 @@ constexpr int padded_len(const int& len) {
     return (len < alignTo) ? alignTo : (len + alignTo) | (alignTo - 1);
 }
 
+/** The size of a cache line, which cache_line_break rounds row offsets up to. */
+constexpr int cache_line_size = 64;
+
+constexpr int round_up_to_cache_line(const int& offset) {
+    return (offset + cache_line_size - 1) / cache_line_size * cache_line_size;
+}
+
+/**
+ * Passed to SSTInit between fields to start the next field on a new cache
+ * line, so that a group of fields that are written often, such as per-message
+ * counters, doesn't share cache lines with fields that rarely change. If an
+ * SST uses any, its rows are padded to a whole number of cache lines too, so
+ * that the breaks fall on cache line boundaries in every row.
+ */
+struct CacheLineBreak {};
+constexpr CacheLineBreak cache_line_break{};
+
+/**
+ * A field as SSTInit would be given it, for working out the layout of a row
+ * without creating an SST, which needs RDMA.
+ */
+struct FieldLayout {
+    std::string name;
+    /** The length of the field in one row, as in _SSTField::field_len */
+    int field_len;
+    /** True if a cache_line_break comes before the field */
+    bool starts_cache_line = false;
+};
+
+/**
+ * Lays fields out the way SSTInit does, without row change tracking.
+ * @param fields The fields, in the order SSTInit would be given them
+ * @param offsets Set to the offset of each field in a row
+ * @return The length of a row
+ */
+inline int layout_row(const std::vector<FieldLayout>& fields, std::vector<int>& offsets) {
+    int row_len = 0;
+    bool padded = false;
+    offsets.clear();
+    for(const FieldLayout& field : fields) {
+        if(field.starts_cache_line) {
+            row_len = round_up_to_cache_line(row_len);
+            padded = true;
+        }
+        offsets.push_back(row_len);
+        row_len += padded_len(field.field_len);
+    }
+    return padded ? round_up_to_cache_line(row_len) : row_len;
+}
+
 /** Internal helper class, never exposed to the client. */
 class _SSTField {
 public:
@@ -117,6 +172,34 @@ public:
 
 typedef std::function<void(uint32_t)> failure_upcall_t;
 
+/** How an SST's detect threads wait when no predicate has fired for a while. */
+enum class PollMode {
+    /** Never stop polling; lowest latency, but uses a whole core per thread. */
+    BUSY_POLL,
+    /** After spinning, yield the processor between passes. */
+    SPIN_THEN_YIELD,
+    /** After spinning, sleep for a fixed time between passes. */
+    SPIN_THEN_SLEEP,
+    /** After spinning, sleep on a futex that the next local put wakes up, or
+     * until a fixed time has passed. Remote RDMA writes raise no event on
+     * this node, so the timeout bounds how late they can be noticed. */
+    SPIN_THEN_FUTEX
+};
+
+/** The polling policy of an SST's detect threads. */
+struct PollPolicy {
+    PollMode mode;
+    /** How long a detect thread keeps polling after the last predicate fired */
+    std::chrono::microseconds spin_time;
+    /** How long to sleep between passes once the thread has stopped spinning */
+    std::chrono::microseconds sleep_time;
+
+    PollPolicy(PollMode mode = PollMode::SPIN_THEN_SLEEP,
+               std::chrono::microseconds spin_time = std::chrono::milliseconds(1),
+               std::chrono::microseconds sleep_time = std::chrono::milliseconds(1))
+            : mode(mode), spin_time(spin_time), sleep_time(sleep_time) {}
+};
+
 /** Constructor parameter pack for SST. */
 struct SSTParams {
     const std::vector<uint32_t>& members;
@@ -124,6 +207,10 @@ struct SSTParams {
     const failure_upcall_t failure_upcall;
     const std::vector<char> already_failed;
     const bool start_predicate_thread;
+    const bool track_row_changes;
+    const PollPolicy poll_policy;
+    const bool versioned_rows;
+    const bool shared_memory;
 
     /**
      *
@@ -140,17 +227,39 @@ struct SSTParams {
      * should be started immediately on construction of the SST. If false,
      * predicate evaluation will not start until start_predicate_evalution()
      * is called.
+     * @param track_row_changes Whether every put should also update a
+     * generation counter at the end of the local row, so that predicates that
+     * declare which rows they depend on are only re-evaluated when one of
+     * those rows changes.
+     * @param poll_policy How the predicate evaluation threads wait when
+     * nothing is happening.
+     * @param versioned_rows Whether every put should bracket the data it
+     * writes with version words, so that read_consistent() can read fields
+     * of several rows as they all were at one moment. Implies
+     * track_row_changes.
+     * @param shared_memory Whether the table is kept in shared memory, so
+     * that members on the same host write their rows into it with plain
+     * stores rather than through the NIC. Their queue pairs are still
+     * connected, to carry completions and find out if they fail.
      */
     SSTParams(const std::vector<uint32_t>& _members,
               const uint32_t my_node_id,
               const failure_upcall_t failure_upcall = nullptr,
               const std::vector<char> already_failed = {},
-              const bool start_predicate_thread = true)
+              const bool start_predicate_thread = true,
+              const bool track_row_changes = false,
+              const PollPolicy poll_policy = PollPolicy(),
+              const bool versioned_rows = false,
+              const bool shared_memory = false)
             : members(_members),
               my_node_id(my_node_id),
               failure_upcall(failure_upcall),
               already_failed(already_failed),
-              start_predicate_thread(start_predicate_thread) {}
+              start_predicate_thread(start_predicate_thread),
+              track_row_changes(track_row_changes),
+              poll_policy(poll_policy),
+              versioned_rows(versioned_rows),
+              shared_memory(shared_memory) {}
 };
 
 template <class DerivedSST>
@@ -160,10 +269,76 @@ private:
     void init_SSTFields(Fields&... fields) {
         rowLen = 0;
         compute_rowLen(rowLen, fields...);
-        rows = new char[rowLen * num_members];
-        // snapshot = new char[rowLen * num_members];
+        generation_offset = rowLen;
+        if(track_row_changes) {
+            rowLen += sizeof(uint64_t);
+        }
+        if(versioned_rows) {
+            rowLen += sizeof(uint64_t);
+        }
+        if(padded_to_cache_lines) {
+            rowLen = round_up_to_cache_line(rowLen);
+        }
+        table_memory = std::make_unique<registered_buffer>(rowLen * num_members, shared_memory);
+        rows = table_memory->buffer;
         volatile char* base = rows;
         set_bases_and_rowLens(base, rowLen, fields...);
+        if(track_row_changes) {
+            for(unsigned int row = 0; row < num_members; ++row) {
+                *row_generation(row) = 0;
+            }
+        }
+        if(versioned_rows) {
+            for(unsigned int row = 0; row < num_members; ++row) {
+                *row_begin_version(row) = 0;
+            }
+        }
+    }
+
+    /** The counter at the end of a row that every put by its owner increments. */
+    volatile uint64_t* row_generation(unsigned int row) const {
+        return reinterpret_cast<volatile uint64_t*>(rows + row * rowLen + generation_offset);
+    }
+
+    /** The word after a row's generation counter, which a versioned put sets to
+     * the new generation before it writes any data. The generation counter is
+     * written after the data, so the two are equal when no put is under way. */
+    volatile uint64_t* row_begin_version(unsigned int row) const {
+        return reinterpret_cast<volatile uint64_t*>(rows + row * rowLen + generation_offset + sizeof(uint64_t));
+    }
+
+    /** Advances the local row's generation, and its begin version if rows are versioned. */
+    void advance_row_version() {
+        if(!track_row_changes) {
+            return;
+        }
+        const uint64_t version = __atomic_add_fetch(const_cast<uint64_t*>(row_generation(my_index)), 1, __ATOMIC_RELEASE);
+        if(versioned_rows) {
+            __atomic_store_n(const_cast<uint64_t*>(row_begin_version(my_index)), version, __ATOMIC_RELEASE);
+        }
+    }
+
+    /** @return The part of a put's range that holds fields, which is all
+     * there is to write if the version words are written separately */
+    long long int data_size(long long int offset, long long int size) const {
+        if(!versioned_rows) {
+            return size;
+        }
+        return std::max(0ll, std::min(offset + size, static_cast<long long int>(generation_offset)) - offset);
+    }
+
+    /** @return True if a predicate in this group must be evaluated in this pass of the detect loop */
+    template <typename Entry>
+    bool needs_evaluation(const Predicates<DerivedSST>& group, const Entry& entry) const {
+        if(!track_row_changes || entry.depends_on_rows.empty() || entry.last_evaluated == 0 || entry.was_true) {
+            return true;
+        }
+        for(auto row : entry.depends_on_rows) {
+            if(group.row_changed_iteration[row] > entry.last_evaluated) {
+                return true;
+            }
+        }
+        return false;
     }
 
     DerivedSST* derived_this;
@@ -171,18 +346,77 @@ private:
     std::vector<std::thread> background_threads;
     std::atomic<bool> thread_shutdown;
 
-    void detect();
+    /** Evaluates the predicates in a group, and runs their triggers, until shutdown. */
+    void detect(Predicates<DerivedSST>& group, const std::string& thread_name);
+
+    /** How the detect threads wait when idle. */
+    const PollPolicy poll_policy;
+    /** Incremented by every local put; the futex that idle detect threads sleep on. */
+    std::atomic<int> local_put_count{0};
+    /** The number of detect threads sleeping on local_put_count. */
+    std::atomic<int> num_sleeping_detectors{0};
+    /** Waits for the policy's sleep time, or until the next local put if the policy uses a futex. */
+    void idle_wait();
+    /** Wakes detect threads that are sleeping until the next local put. */
+    void wake_detectors();
+
+    /** The named predicate groups, each evaluated by its own thread. */
+    std::map<std::string, std::unique_ptr<Predicates<DerivedSST>>> predicate_groups;
+    /** Protects predicate_groups and background_threads. */
+    std::mutex predicate_groups_mutex;
 
 public:
+    /** The default predicate group, evaluated by the SST's detect thread. */
     Predicates<DerivedSST> predicates;
     friend class Predicates<DerivedSST>;
 
+    /**
+     * Gets a named group of predicates, creating it if it does not exist yet.
+     * Each group is evaluated by its own thread, so that slow triggers in one
+     * group do not delay predicates in the others. Triggers in different
+     * groups may therefore run at the same time, and must synchronize any
+     * state they share.
+     * @param name The name of the group
+     * @param cpu If the group is created and this is not negative, the CPU
+     * its thread is pinned to
+     * @return The group, into which predicates can be inserted as into
+     * predicates
+     */
+    Predicates<DerivedSST>& predicate_group(const std::string& name, int cpu = -1);
+
 private:
+    /** The memory the rows are stored in, registered once for all the queue
+     * pairs. Declared before res_vec so that it outlives them. */
+    std::unique_ptr<registered_buffer> table_memory;
+    /** The completion queue of this SST's queue pairs, which the threads in
+     * put_with_completion poll themselves; it also has to outlive them. */
+    std::unique_ptr<completion_queue> completions;
+    /** How many iterations of a detect loop go by between drains of the
+     * completion queue. */
+    static constexpr uint64_t completion_drain_interval = 256;
     /** Pointer to memory where the SST rows are stored. */
     volatile char* rows;
-    // char* snapshot;
     /** Length of each row in this SST, in bytes. */
     int rowLen;
+    /** True if each row ends with a generation counter that puts update. */
+    const bool track_row_changes;
+    /**
+     * True if each row's generation counter is followed by a begin version.
+     * The version words are small enough to be posted inline, so each carries
+     * the value it had when it was posted, and the writes of one put are
+     * placed in order: begin version, data, generation.
+     */
+    const bool versioned_rows;
+    /** Held while a versioned put posts its writes, so that the puts of
+     * several threads don't interleave their versions and data. */
+    std::mutex versioned_put_mutex;
+    /** True if the table is in shared memory that co-located members map. */
+    const bool shared_memory;
+    /** The offset of the generation counter in each row, if there is one. */
+    int generation_offset;
+    /** True if SSTInit was given a cache_line_break, so rows are padded to
+     * whole cache lines. */
+    bool padded_to_cache_lines = false;
     /** List of nodes in the SST; indexes are row numbers, values are node IDs. */
     const std::vector<uint32_t>& members;
     /** Equal to members.size() */
@@ -210,6 +444,41 @@ private:
     /** RDMA resources vector, one for each member. */
     std::vector<std::unique_ptr<resources>> res_vec;
 
+    /** How many RDMA atomics this node can have waiting at once, each with
+     * its own result word. */
+    static constexpr uint32_t num_atomic_slots = 64;
+    /** The registered words the NIC writes the results of RDMA atomics into,
+     * allocated by the first atomic. */
+    std::unique_ptr<registered_buffer> atomic_results;
+    /** Set while the result word of the same index is in use. */
+    std::unique_ptr<std::atomic<bool>[]> atomic_slot_busy;
+    /** A queue pair connected to itself, for RDMA atomics on the local row
+     * when the device's atomics aren't atomic with the CPU's. Created by the
+     * first one, along with atomic_results. */
+    std::unique_ptr<resources> loopback;
+    /** Protects the creation of atomic_results and loopback. */
+    std::mutex atomic_setup_mutex;
+    /** Posts an RDMA atomic on a word of a row, as its owner stores it, and
+     * waits for the word's previous value. */
+    std::experimental::optional<uint64_t> remote_atomic(uint32_t row_index, long long int offset,
+                                                        uint64_t compare_add, uint64_t swap, bool compare_and_swap);
+
+    /** put_dirty() compares the local row in pieces of this many bytes. */
+    static constexpr int dirty_line_size = 64;
+    /** Changed pieces closer together than this are sent as one write, since
+     * a few unchanged bytes cost less than another work request. */
+    static constexpr int dirty_merge_gap = 256;
+    /** For each row index, a copy of the local row as that node was last sent
+     * it, or null until put_dirty() has sent it the whole row. Allocated by
+     * the first put_dirty(), so SSTs that never call it pay nothing. */
+    std::vector<std::unique_ptr<char[]>> pushed_rows;
+    /** Set once pushed_rows has been allocated, so puts know to update it. */
+    std::atomic<bool> tracking_pushed_rows{false};
+    /** Protects pushed_rows. */
+    std::mutex pushed_rows_mutex;
+    /** Records that part of the local row was just sent to a node. */
+    void record_pushed(uint32_t index, long long int offset, long long int size);
+
     /** Indicates whether the predicate evaluation thread should start after being
      * forked in the constructor. */
     bool thread_start;
@@ -222,6 +491,10 @@ public:
     SST(DerivedSST* derived_class_pointer, const SSTParams& params)
             : derived_this(derived_class_pointer),
               thread_shutdown(false),
+              poll_policy(params.poll_policy),
+              track_row_changes(params.track_row_changes || params.versioned_rows),
+              versioned_rows(params.versioned_rows),
+              shared_memory(params.shared_memory),
               members(params.members),
               num_members(members.size()),
               all_indices(num_members),
@@ -260,7 +533,14 @@ public:
         //Initialize rows and set the "base" field of each SSTField
         init_SSTFields(fields...);
 
-        //Initialize res_vec with the correct offsets for each row
+        // Room for a put_with_completion to every row from a few threads at once
+        completions = std::make_unique<completion_queue>(std::max(1024u, 16 * num_members));
+
+        //Initialize res_vec with the correct offsets for each row. The
+        //queue pairs are all created first and then connected together, so
+        //that connecting them takes one all-to-all exchange rather than a
+        //round trip after another with each member.
+        std::vector<resources*> connections;
         unsigned int node_rank, sst_index;
         for(auto const& rank_index : members_by_id) {
             std::tie(node_rank, sst_index) = rank_index;
@@ -272,13 +552,19 @@ public:
                     continue;
                 }
                 res_vec[sst_index] = std::make_unique<resources>(
-                        node_rank, write_addr, read_addr, rowLen, rowLen);
+                        node_rank, write_addr, read_addr, rowLen, rowLen, table_memory->mr,
+                        completions->get(), false, shared_memory ? table_memory.get() : nullptr);
+                connections.push_back(res_vec[sst_index].get());
                 // update qp_num_to_index
                 qp_num_to_index[res_vec[sst_index].get()->qp->qp_num] = sst_index;
             }
         }
+        connect_all(connections);
+        // Every member has mapped the table by the time connect_all returns
+        table_memory->unlink();
 
-        std::thread detector(&SST::detect, this);
+        std::lock_guard<std::mutex> lock(predicate_groups_mutex);
+        std::thread detector(&SST::detect, this, std::ref(predicates), std::string("sst_detect"));
         background_threads.push_back(std::move(detector));
 
         std::cout << "Initialized SST and Started Threads" << std::endl;
@@ -305,6 +591,45 @@ public:
     /** Gets the index of the local row in the table. */
     int get_local_index() const { return my_index; }
 
+    /**
+     * @return The version of a row: its generation counter, which each put of
+     * the row advances, as far as the puts have reached this node. Requires
+     * track_row_changes or versioned_rows.
+     */
+    uint64_t row_version(uint32_t row) const {
+        return __atomic_load_n(const_cast<uint64_t*>(row_generation(row)), __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * Reads fields of several rows as they all were at one moment, without
+     * locks, like the read side of a seqlock: reader is called again until
+     * no put of any of the rows was placed while it ran. It should only read
+     * the fields it needs, from those rows, and return copies of them; it may
+     * run several times. Requires versioned_rows. This node's own row is
+     * written directly rather than by puts, so reading it consistently is up
+     * to whoever writes it.
+     * @return What the last call of reader returned
+     */
+    template <typename Reader>
+    auto read_consistent(const std::vector<uint32_t>& row_indices, Reader&& reader) const -> decltype(reader()) {
+        assert(versioned_rows);
+        std::vector<uint64_t> versions(row_indices.size());
+        while(true) {
+            for(std::size_t i = 0; i < row_indices.size(); ++i) {
+                versions[i] = row_version(row_indices[i]);
+            }
+            auto result = reader();
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            bool unchanged = true;
+            for(std::size_t i = 0; i < row_indices.size() && unchanged; ++i) {
+                unchanged = __atomic_load_n(const_cast<uint64_t*>(row_begin_version(row_indices[i])), __ATOMIC_RELAXED) == versions[i];
+            }
+            if(unchanged) {
+                return result;
+            }
+        }
+    }
+
     const char* getBaseAddress() {
         return const_cast<char*>(rows);
     }
@@ -341,11 +666,75 @@ public:
 
     void put_with_completion(const std::vector<uint32_t> receiver_ranks, long long int offset, long long int size);
 
+    /**
+     * Writes to all remote nodes only the parts of the local row that have
+     * changed since they were last sent to each node, as a few RDMA writes
+     * covering the changed cache lines. Changes are found by comparing the
+     * row against a copy of what each node was last sent, so writes through
+     * any field accessor are picked up. The first call sends the whole row.
+     */
+    void put_dirty() {
+        put_dirty(all_indices);
+    }
+
+    /** Writes the changed parts of the local row to some of the remote nodes. */
+    void put_dirty(const std::vector<uint32_t> receiver_ranks);
+
+    /**
+     * Atomically replaces an 8-byte word of a row, as the node that owns the
+     * row stores it, with desired if it equals expected, using an RDMA
+     * compare-and-swap (or a CPU one, if the row is the local row and the
+     * device's atomics are atomic with the CPU's), and waits for it. The word
+     * must be 8-byte aligned, must only be changed with these atomics, and is
+     * never sent by puts to the other nodes' copies of the row.
+     * @param row_index The row, whose owner holds the word
+     * @param offset The offset of the word in the row
+     * @return The value the word had before, or nothing if the row is frozen
+     * or the atomic failed
+     */
+    std::experimental::optional<uint64_t> compare_and_swap(uint32_t row_index, long long int offset,
+                                                           uint64_t expected, uint64_t desired) {
+        return remote_atomic(row_index, offset, expected, desired, true);
+    }
+
+    /** Atomically adds to an 8-byte word of a row, as the node that owns the
+     * row stores it, like compare_and_swap. */
+    std::experimental::optional<uint64_t> fetch_and_add(uint32_t row_index, long long int offset, uint64_t add) {
+        return remote_atomic(row_index, offset, add, 0, false);
+    }
+
+    /**
+     * @return The least value of one element of a vector field over some
+     * rows, or the largest value of T if there are none. For 64-bit signed
+     * fields this gathers several rows at a time with AVX2 or AVX-512, when
+     * the build targets them.
+     */
+    template <typename T>
+    T reduce_min(const SSTFieldVector<T>& field, std::size_t index, const std::vector<uint32_t>& row_indices) const {
+        return column_reduce::reduce<false, T>(field.base + index * sizeof(T), field.rowLen, row_indices.data(),
+                                               row_indices.size(), column_reduce::is_int64<T>());
+    }
+
+    /** @return The greatest value of one element of a vector field over some
+     * rows, or the smallest value of T if there are none. */
+    template <typename T>
+    T reduce_max(const SSTFieldVector<T>& field, std::size_t index, const std::vector<uint32_t>& row_indices) const {
+        return column_reduce::reduce<true, T>(field.base + index * sizeof(T), field.rowLen, row_indices.data(),
+                                              row_indices.size(), column_reduce::is_int64<T>());
+    }
+
 private:
     using char_p = volatile char*;
 
     void compute_rowLen(int&) {}
 
+    template <typename... Fields>
+    void compute_rowLen(int& rowLen, const CacheLineBreak&, Fields&... rest) {
+        rowLen = round_up_to_cache_line(rowLen);
+        padded_to_cache_lines = true;
+        compute_rowLen(rowLen, rest...);
+    }
+
     template <typename Field, typename... Fields>
     void compute_rowLen(int& rowLen, Field& f, Fields&... rest) {
         rowLen += padded_len(f.field_len);
@@ -354,25 +743,18 @@ private:
 
     void set_bases_and_rowLens(char_p&, const int) {}
 
+    template <typename... Fields>
+    void set_bases_and_rowLens(char_p& base, const int rlen, const CacheLineBreak&, Fields&... rest) {
+        base = rows + round_up_to_cache_line(base - rows);
+        set_bases_and_rowLens(base, rlen, rest...);
+    }
+
     template <typename Field, typename... Fields>
     void set_bases_and_rowLens(char_p& base, const int rlen, Field& f, Fields&... rest) {
         base += f.set_base(base);
         f.set_rowLen(rlen);
         set_bases_and_rowLens(base, rlen, rest...);
     }
-
-    // void take_snapshot() {
-    //   memcpy(snapshot, const_cast<char*>(rows), rowLen * num_members);
-    // }
-
-    // // returns snapshot == current
-    // bool compare_snapshot_and_current() {
-    //     int res = memcmp(const_cast<char*>(rows), snapshot, rowLen * num_members);
-    //     if(res == 0) {
-    //         return true;
-    //     }
-    //     return false;
-    // }
 };
 
 } /* namespace sst */
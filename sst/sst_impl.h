@@ -7,16 +7,21 @@
 #pragma once
 
 #include <chrono>
+#include <climits>
 #include <condition_variable>
+#include <linux/futex.h>
 #include <memory>
 #include <mutex>
 #include <pthread.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <thread>
 #include <time.h>
+#include <unistd.h>
 #include <vector>
 
-#include "poll_utils.h"
+#include "derecho/parallel_release.h"
+#include "derecho/trace.h"
 #include "predicates.h"
 #include "sst.h"
 
@@ -29,13 +34,17 @@ namespace sst {
 template <typename DerivedSST>
 SST<DerivedSST>::~SST() {
     thread_shutdown = true;
-    for(auto& thread : background_threads) {
-        if(thread.joinable()) thread.join();
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(predicate_groups_mutex);
+        threads.swap(background_threads);
     }
-
-    if(rows != nullptr) {
-        delete[](const_cast<char*>(rows));
+    for(auto& thread : threads) {
+        if(thread.joinable()) thread.join();
     }
+    // With many members, destroying the rows' queue pairs one after another
+    // is most of the time a shutdown takes
+    derecho::release_in_parallel(res_vec);
 }
 
 /**
@@ -50,16 +59,36 @@ void SST<DerivedSST>::start_predicate_evaluation() {
     thread_start_cv.notify_all();
 }
 
+template <typename DerivedSST>
+Predicates<DerivedSST>& SST<DerivedSST>::predicate_group(const std::string& name, int cpu) {
+    std::lock_guard<std::mutex> lock(predicate_groups_mutex);
+    auto& group = predicate_groups[name];
+    if(group) {
+        return *group;
+    }
+    group = std::make_unique<Predicates<DerivedSST>>();
+    // Thread names are limited to 15 characters
+    const std::string thread_name = ("sst_" + name).substr(0, 15);
+    if(cpu >= 0) {
+        // The thread places itself by its name as it starts
+        derecho::set_thread_placement(thread_name, std::to_string(cpu));
+    }
+    std::thread detector(&SST::detect, this, std::ref(*group), thread_name);
+    background_threads.push_back(std::move(detector));
+    return *group;
+}
+
 /**
  * This function is run in a detached background thread to detect predicate
- * events. It continuously evaluates predicates one by one, and runs the
- * trigger functions for each predicate that fires. In addition, it
- * continuously evaluates named functions one by one, and updates the local
+ * events. It continuously evaluates the predicates in one group one by one,
+ * and runs the trigger functions for each predicate that fires. In addition,
+ * it continuously evaluates named functions one by one, and updates the local
  * row's observed values of those functions.
  */
 template <typename DerivedSST>
-void SST<DerivedSST>::detect() {
-    pthread_setname_np(pthread_self(), "sst_detect");
+void SST<DerivedSST>::detect(Predicates<DerivedSST>& group, const std::string& thread_name) {
+    pthread_setname_np(pthread_self(), thread_name.c_str());
+    derecho::place_this_thread(thread_name);
     if(!thread_start) {
         std::unique_lock<std::mutex> lock(thread_start_mutex);
         thread_start_cv.wait(lock, [this]() { return thread_start; });
@@ -71,11 +100,68 @@ void SST<DerivedSST>::detect() {
         try {
             bool predicate_fired = false;
             // Take the predicate lock before reading the predicate lists
-            std::unique_lock<std::mutex> predicates_lock(predicates.predicate_mutex);
+            std::unique_lock<std::mutex> predicates_lock(group.predicate_mutex);
+
+            group.detect_iteration++;
+            // Retire completions that nobody waits for, such as the periodic
+            // signals of plain puts, before they can fill the queue
+            if(group.detect_iteration % completion_drain_interval == 0) {
+                completions->drain();
+            }
+            if(track_row_changes) {
+                group.last_seen_generations.resize(num_members, 0);
+                group.row_changed_iteration.resize(num_members, 0);
+                // Note which rows have been written since the last pass; a
+                // row's data always arrives before the generation that follows it
+                for(unsigned int row = 0; row < num_members; ++row) {
+                    uint64_t generation = *row_generation(row);
+                    if(generation != group.last_seen_generations[row]) {
+                        group.last_seen_generations[row] = generation;
+                        group.row_changed_iteration[row] = group.detect_iteration;
+                    }
+                }
+            }
+            // Evaluates a predicate if anything it depends on may have changed,
+            // and records the result
+            auto evaluate = [this, &group](typename Predicates<DerivedSST>::pred_entry& entry, bool& result) {
+                if(!needs_evaluation(group, entry)) {
+                    return false;
+                }
+                result = entry.first(*derived_this);
+                entry.last_evaluated = group.detect_iteration;
+                entry.was_true = result;
+                return true;
+            };
+            bool pred_result;
+            // Runs the triggers of the urgent predicates that are true; it
+            // is called first and after every other trigger
+            auto run_urgent = [&]() {
+                for(auto& pred : group.urgent_predicates) {
+                    bool urgent_result;
+                    if(pred != nullptr && evaluate(*pred, urgent_result) && urgent_result) {
+                        predicate_fired = true;
+                        std::shared_ptr<typename Predicates<DerivedSST>::trig> trigger(pred->second);
+                        predicates_lock.unlock();
+                        (*trigger)(*derived_this);
+                        predicates_lock.lock();
+                    }
+                }
+            };
+            // An urgent predicate evaluated again within the same pass must
+            // not be skipped as unchanged
+            auto run_urgent_again = [&]() {
+                for(auto& pred : group.urgent_predicates) {
+                    if(pred != nullptr) {
+                        pred->last_evaluated = 0;
+                    }
+                }
+                run_urgent();
+            };
+            run_urgent();
 
             // one time predicates need to be evaluated only until they become true
-            for(auto& pred : predicates.one_time_predicates) {
-                if(pred != nullptr && (pred->first(*derived_this) == true)) {
+            for(auto& pred : group.one_time_predicates) {
+                if(pred != nullptr && evaluate(*pred, pred_result) && pred_result) {
                     predicate_fired = true;
                     // Copy the trigger pointer locally, so it can continue running without
                     // segfaulting even if this predicate gets deleted when we unlock predicates_lock
@@ -85,28 +171,32 @@ void SST<DerivedSST>::detect() {
                     predicates_lock.lock();
                     // erase the predicate as it was just found to be true
                     pred.reset();
+                    run_urgent_again();
                 }
             }
 
             // recurrent predicates are evaluated each time they are found to be true
-            for(auto& pred : predicates.recurrent_predicates) {
-                if(pred != nullptr && (pred->first(*derived_this) == true)) {
+            for(auto& pred : group.recurrent_predicates) {
+                if(pred != nullptr && evaluate(*pred, pred_result) && pred_result) {
                     predicate_fired = true;
                     std::shared_ptr<typename Predicates<DerivedSST>::trig> trigger(pred->second);
                     predicates_lock.unlock();
                     (*trigger)(*derived_this);
                     predicates_lock.lock();
+                    run_urgent_again();
                 }
             }
 
             // transition predicates are only evaluated when they change from false to true
             // We need to use iterators here because we need to iterate over two lists in parallel
-            auto pred_it = predicates.transition_predicates.begin();
-            auto pred_state_it = predicates.transition_predicate_states.begin();
-            while(pred_it != predicates.transition_predicates.end()) {
+            auto pred_it = group.transition_predicates.begin();
+            auto pred_state_it = group.transition_predicate_states.begin();
+            while(pred_it != group.transition_predicates.end()) {
                 if(*pred_it != nullptr) {
                     //*pred_state_it is the previous state of the predicate at *pred_it
-                    bool curr_pred_state = (*pred_it)->first(*derived_this);
+                    // If the predicate was not evaluated, its state has not changed
+                    bool curr_pred_state = *pred_state_it;
+                    evaluate(**pred_it, curr_pred_state);
                     if(curr_pred_state == true && *pred_state_it == false) {
                         predicate_fired = true;
                         std::shared_ptr<typename Predicates<DerivedSST>::trig> trigger(
@@ -114,6 +204,7 @@ void SST<DerivedSST>::detect() {
                         predicates_lock.unlock();
                         (*trigger)(*derived_this);
                         predicates_lock.lock();
+                        run_urgent_again();
                     }
                     *pred_state_it = curr_pred_state;
 
@@ -123,17 +214,17 @@ void SST<DerivedSST>::detect() {
             }
 
             if(predicate_fired) {
+                DERECHO_TRACE_POINT(my_index, group.detect_iteration, -1, "sst_triggers_fired");
                 // update last time
                 clock_gettime(CLOCK_REALTIME, &last_time);
             } else {
                 clock_gettime(CLOCK_REALTIME, &cur_time);
-                // check if the system has been inactive for enough time to induce sleep
-                double time_elapsed_in_ms = (cur_time.tv_sec - last_time.tv_sec) * 1e3
-                                            + (cur_time.tv_nsec - last_time.tv_nsec) / 1e6;
-                if(time_elapsed_in_ms > 1) {
+                // check if the system has been inactive for enough time to stop spinning
+                double time_elapsed_in_us = (cur_time.tv_sec - last_time.tv_sec) * 1e6
+                                            + (cur_time.tv_nsec - last_time.tv_nsec) / 1e3;
+                if(poll_policy.mode != PollMode::BUSY_POLL && time_elapsed_in_us > poll_policy.spin_time.count()) {
                     predicates_lock.unlock();
-                    using namespace std::chrono_literals;
-                    std::this_thread::sleep_for(1ms);
+                    idle_wait();
                     predicates_lock.lock();
                 }
             }
@@ -145,40 +236,258 @@ void SST<DerivedSST>::detect() {
     }
 }
 
+template <typename DerivedSST>
+void SST<DerivedSST>::idle_wait() {
+    switch(poll_policy.mode) {
+        case PollMode::BUSY_POLL:
+            break;
+        case PollMode::SPIN_THEN_YIELD:
+            std::this_thread::yield();
+            break;
+        case PollMode::SPIN_THEN_SLEEP:
+            std::this_thread::sleep_for(poll_policy.sleep_time);
+            break;
+        case PollMode::SPIN_THEN_FUTEX: {
+            const int observed = local_put_count.load();
+            num_sleeping_detectors++;
+            auto seconds = std::chrono::duration_cast<std::chrono::seconds>(poll_policy.sleep_time);
+            struct timespec timeout = {static_cast<time_t>(seconds.count()),
+                                       static_cast<long>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                                 poll_policy.sleep_time - seconds)
+                                                                 .count())};
+            // Returns at once if a put has happened since observed was read
+            syscall(SYS_futex, reinterpret_cast<int*>(&local_put_count), FUTEX_WAIT_PRIVATE, observed, &timeout, nullptr, 0);
+            num_sleeping_detectors--;
+            break;
+        }
+    }
+}
+
+template <typename DerivedSST>
+void SST<DerivedSST>::wake_detectors() {
+    if(poll_policy.mode != PollMode::SPIN_THEN_FUTEX) {
+        return;
+    }
+    local_put_count++;
+    if(num_sleeping_detectors.load() > 0) {
+        syscall(SYS_futex, reinterpret_cast<int*>(&local_put_count), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+
 template <typename DerivedSST>
 void SST<DerivedSST>::put(const std::vector<uint32_t> receiver_ranks, long long int offset, long long int size) {
+    wake_detectors();
+    std::unique_lock<std::mutex> versioned_put_lock(versioned_put_mutex, std::defer_lock);
+    if(versioned_rows) {
+        versioned_put_lock.lock();
+    }
+    advance_row_version();
+    const long long int write_size = data_size(offset, size);
     for(auto index : receiver_ranks) {
         // don't write to yourself or a frozen row
         if(index == my_index || row_is_frozen[index]) {
             continue;
         }
+        record_pushed(index, offset, size);
+        DERECHO_TRACE_POINT(index, offset, size, "sst_put");
+        if(versioned_rows) {
+            res_vec[index]->post_remote_write(0, generation_offset + sizeof(uint64_t), sizeof(uint64_t));
+        }
         // perform a remote RDMA write on the owner of the row
-        res_vec[index]->post_remote_write(0, offset, size);
+        if(write_size > 0) {
+            res_vec[index]->post_remote_write(0, offset, write_size);
+        }
+        if(track_row_changes) {
+            // Writes on a queue pair are placed in order, so the new
+            // generation can't be seen before the data
+            res_vec[index]->post_remote_write(0, generation_offset, sizeof(uint64_t));
+        }
     }
     return;
 }
 
+template <typename DerivedSST>
+void SST<DerivedSST>::record_pushed(uint32_t index, long long int offset, long long int size) {
+    if(!tracking_pushed_rows) {
+        return;
+    }
+    // The generation counter is never compared, so it needn't be copied
+    const long long int end = std::min(offset + size, static_cast<long long int>(generation_offset));
+    std::lock_guard<std::mutex> lock(pushed_rows_mutex);
+    if(!pushed_rows[index] || offset >= end) {
+        return;
+    }
+    // Copied before the write is posted, so the NIC can only send this or
+    // something newer; anything newer is seen as a change next time
+    memcpy(pushed_rows[index].get() + offset, const_cast<char*>(rows) + rowLen * my_index + offset, end - offset);
+}
+
+template <typename DerivedSST>
+void SST<DerivedSST>::put_dirty(const std::vector<uint32_t> receiver_ranks) {
+    const char* local_row = const_cast<char*>(rows) + rowLen * my_index;
+    // Taken before pushed_rows_mutex, in the same order as put()
+    std::unique_lock<std::mutex> versioned_put_lock(versioned_put_mutex, std::defer_lock);
+    if(versioned_rows) {
+        versioned_put_lock.lock();
+    }
+    std::lock_guard<std::mutex> lock(pushed_rows_mutex);
+    if(!tracking_pushed_rows) {
+        pushed_rows.resize(num_members);
+        tracking_pushed_rows = true;
+    }
+    bool woke_detectors = false;
+    // Each range is an (offset, length) pair within the row
+    std::vector<std::pair<int, int>> ranges;
+    for(auto index : receiver_ranks) {
+        // don't write to yourself or a frozen row
+        if(index == my_index || row_is_frozen[index]) {
+            continue;
+        }
+        ranges.clear();
+        std::unique_ptr<char[]>& pushed = pushed_rows[index];
+        if(!pushed) {
+            // Nothing is known about the remote copy, which may have been
+            // initialized differently, so it gets everything once
+            pushed.reset(new char[generation_offset]);
+            ranges.emplace_back(0, generation_offset);
+        } else {
+            for(int line = 0; line < generation_offset; line += dirty_line_size) {
+                const int len = std::min(dirty_line_size, generation_offset - line);
+                if(memcmp(local_row + line, pushed.get() + line, len) == 0) {
+                    continue;
+                }
+                if(!ranges.empty() && line - (ranges.back().first + ranges.back().second) <= dirty_merge_gap) {
+                    ranges.back().second = line + len - ranges.back().first;
+                } else {
+                    ranges.emplace_back(line, len);
+                }
+            }
+        }
+        if(ranges.empty()) {
+            continue;
+        }
+        if(!woke_detectors) {
+            wake_detectors();
+            advance_row_version();
+            woke_detectors = true;
+        }
+        if(versioned_rows) {
+            res_vec[index]->post_remote_write(0, generation_offset + sizeof(uint64_t), sizeof(uint64_t));
+        }
+        for(const auto& range : ranges) {
+            memcpy(pushed.get() + range.first, local_row + range.first, range.second);
+            res_vec[index]->post_remote_write(0, range.first, range.second);
+        }
+        if(track_row_changes) {
+            res_vec[index]->post_remote_write(0, generation_offset, sizeof(uint64_t));
+        }
+    }
+}
+
+template <typename DerivedSST>
+std::experimental::optional<uint64_t> SST<DerivedSST>::remote_atomic(uint32_t row_index, long long int offset,
+                                                                     uint64_t compare_add, uint64_t swap,
+                                                                     bool compare_and_swap) {
+    if(row_index == my_index && verbs_atomics_are_global()) {
+        uint64_t* word = reinterpret_cast<uint64_t*>(const_cast<char*>(rows) + rowLen * my_index + offset);
+        if(compare_and_swap) {
+            uint64_t previous = compare_add;
+            __atomic_compare_exchange_n(word, &previous, swap, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            return previous;
+        }
+        return __atomic_fetch_add(word, compare_add, __ATOMIC_ACQ_REL);
+    }
+    if(!verbs_supports_atomics() || (row_index != my_index && (row_is_frozen[row_index] || !res_vec[row_index]))) {
+        return {};
+    }
+    {
+        std::lock_guard<std::mutex> lock(atomic_setup_mutex);
+        if(!atomic_results) {
+            atomic_results = std::make_unique<registered_buffer>(num_atomic_slots * sizeof(uint64_t));
+            atomic_slot_busy = std::make_unique<std::atomic<bool>[]>(num_atomic_slots);
+        }
+        if(row_index == my_index && !loopback) {
+            char* my_row = const_cast<char*>(rows) + rowLen * my_index;
+            loopback = std::make_unique<resources>(my_node_id, my_row, my_row, rowLen, rowLen, table_memory->mr,
+                                                   completions->get(), false);
+            loopback->connect_qp_to(loopback->local_connection_data());
+        }
+    }
+    resources* connection = row_index == my_index ? loopback.get() : res_vec[row_index].get();
+    // A queue pair's remote address is where its node keeps this node's row,
+    // and the owner's own row is in the same table, rowLen bytes per row away
+    const long long int remote_offset = ((long long int)row_index - (long long int)my_index) * rowLen + offset;
+
+    const uint32_t id = thread_request_id();
+    uint32_t slot = id % num_atomic_slots;
+    while(atomic_slot_busy[slot].exchange(true, std::memory_order_acquire)) {
+        slot = (slot + 1) % num_atomic_slots;
+    }
+    uint64_t* result = reinterpret_cast<uint64_t*>(atomic_results->buffer) + slot;
+    completions->discard(id);
+    const bool posted = compare_and_swap
+                                ? connection->post_remote_compare_and_swap(id, remote_offset, result,
+                                                                           atomic_results->mr->lkey, compare_add, swap)
+                                : connection->post_remote_fetch_and_add(id, remote_offset, result,
+                                                                        atomic_results->mr->lkey, compare_add);
+    if(!posted) {
+        atomic_slot_busy[slot].store(false, std::memory_order_release);
+        return {};
+    }
+    // Wait as long as put_with_completion does
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(2000);
+    std::experimental::optional<std::pair<int32_t, int32_t>> ce;
+    while(!(ce = completions->poll(id)) && std::chrono::steady_clock::now() < deadline) {
+    }
+    if(!ce) {
+        // The NIC may still write the result, so the slot is never reused
+        return {};
+    }
+    std::experimental::optional<uint64_t> previous;
+    if(ce->second == 1) {
+        previous = __atomic_load_n(result, __ATOMIC_ACQUIRE);
+    }
+    atomic_slot_busy[slot].store(false, std::memory_order_release);
+    return previous;
+}
+
 template <typename DerivedSST>
 void SST<DerivedSST>::put_with_completion(const std::vector<uint32_t> receiver_ranks, long long int offset, long long int size) {
     unsigned int num_writes_posted = 0;
     std::vector<bool> posted_write_to(num_members, false);
 
-    const auto tid = std::this_thread::get_id();
-    // get id first
-    uint32_t id = util::polling_data.get_index(tid);
-
-    util::polling_data.set_waiting(tid);
+    // Completions come back to this SST's own queue, tagged with this ID, and
+    // this thread polls for them itself
+    const uint32_t id = thread_request_id();
+    completions->discard(id);
 
+    wake_detectors();
+    std::unique_lock<std::mutex> versioned_put_lock(versioned_put_mutex, std::defer_lock);
+    if(versioned_rows) {
+        versioned_put_lock.lock();
+    }
+    advance_row_version();
+    const long long int write_size = data_size(offset, size);
     for(auto index : receiver_ranks) {
         // don't write to yourself or a frozen row
         if(index == my_index || row_is_frozen[index]) {
             continue;
         }
+        record_pushed(index, offset, size);
+        if(versioned_rows) {
+            res_vec[index]->post_remote_write(0, generation_offset + sizeof(uint64_t), sizeof(uint64_t));
+        }
         // perform a remote RDMA write on the owner of the row
-        res_vec[index]->post_remote_write_with_completion(id, offset, size);
+        res_vec[index]->post_remote_write_with_completion(id, offset, write_size);
+        if(track_row_changes) {
+            res_vec[index]->post_remote_write(0, generation_offset, sizeof(uint64_t));
+        }
         posted_write_to[index] = true;
         num_writes_posted++;
     }
+    if(versioned_put_lock.owns_lock()) {
+        versioned_put_lock.unlock();
+    }
 
     // track which nodes haven't failed yet
     std::vector<bool> polled_successfully_from(num_members, false);
@@ -201,7 +510,7 @@ void SST<DerivedSST>::put_with_completion(const std::vector<uint32_t> receiver_r
 
         while(true) {
             // check if polling result is available
-            ce = util::polling_data.get_completion_entry(tid);
+            ce = completions->poll(id);
             if(ce) {
                 break;
             }
@@ -242,8 +551,6 @@ void SST<DerivedSST>::put_with_completion(const std::vector<uint32_t> receiver_r
         }
     }
 
-    util::polling_data.reset_waiting(tid);
-
     for(auto index : failed_node_indexes) {
         freeze(index);
     }
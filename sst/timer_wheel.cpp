@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <pthread.h>
+
+#include "derecho/thread_placement.h"
+#include "timer_wheel.h"
+
+namespace sst {
+
+constexpr uint32_t timer_wheel::bits_per_level;
+constexpr uint32_t timer_wheel::slots_per_level;
+constexpr uint32_t timer_wheel::num_levels;
+constexpr uint64_t timer_wheel::max_delay;
+
+timer_wheel::timer_wheel() : start(std::chrono::steady_clock::now()) {
+    thread = std::thread(&timer_wheel::run, this);
+}
+
+timer_wheel::~timer_wheel() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutdown = true;
+    }
+    changed.notify_all();
+    thread.join();
+}
+
+timer_wheel& timer_wheel::shared() {
+    static timer_wheel instance;
+    return instance;
+}
+
+uint64_t timer_wheel::now_ticks() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+timer_wheel::timer_id timer_wheel::schedule_after(std::chrono::microseconds delay, callback_t callback) {
+    return add(std::max<int64_t>(delay.count(), 0), 0, std::move(callback));
+}
+
+timer_wheel::timer_id timer_wheel::schedule_every(std::chrono::microseconds period, callback_t callback) {
+    const uint64_t ticks = std::max<int64_t>(period.count(), 1);
+    return add(ticks, ticks, std::move(callback));
+}
+
+timer_wheel::timer_id timer_wheel::add(uint64_t delay, uint64_t period, callback_t callback) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const timer_id id = next_id++;
+    // The slot of the current tick has been run already
+    const uint64_t due = std::max(now_ticks() + delay, current + 1);
+    timers[id] = timer{due, period, std::move(callback)};
+    insert(slot_entry{id, due});
+    if(due < wake_tick) {
+        changed.notify_all();
+    }
+    return id;
+}
+
+bool timer_wheel::cancel(timer_id id) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if(running == id && std::this_thread::get_id() == thread.get_id()) {
+        // The callback is cancelling itself; run() removes it once it returns
+        running_cancelled = true;
+        return true;
+    }
+    changed.wait(lock, [&]() { return running != id; });
+    return timers.erase(id) > 0;
+}
+
+void timer_wheel::insert(const slot_entry& entry) {
+    if(entry.due <= current) {
+        // Only cascades put timers here, just before the slot is run
+        slots[0][current % slots_per_level].push_back(entry);
+        occupied[0] |= 1ull << (current % slots_per_level);
+        return;
+    }
+    const uint64_t delay = std::min(entry.due - current, max_delay);
+    const uint64_t target = current + delay;
+    uint32_t level = 0;
+    while(level + 1 < num_levels && (delay >> (bits_per_level * (level + 1)))) {
+        level++;
+    }
+    const uint32_t slot = (target >> (bits_per_level * level)) % slots_per_level;
+    slots[level][slot].push_back(entry);
+    occupied[level] |= 1ull << slot;
+}
+
+void timer_wheel::cascade(uint32_t level, uint32_t slot) {
+    if(!(occupied[level] & (1ull << slot))) {
+        return;
+    }
+    std::vector<slot_entry> entries;
+    entries.swap(slots[level][slot]);
+    occupied[level] &= ~(1ull << slot);
+    for(const slot_entry& entry : entries) {
+        auto timer = timers.find(entry.id);
+        if(timer != timers.end() && timer->second.due == entry.due) {
+            insert(entry);
+        }
+    }
+}
+
+uint64_t timer_wheel::next_tick() const {
+    uint64_t next = UINT64_MAX;
+    for(uint32_t level = 0; level < num_levels; ++level) {
+        if(!occupied[level]) {
+            continue;
+        }
+        const uint32_t shift = bits_per_level * level;
+        const uint64_t block = current >> shift;
+        const uint32_t index = block % slots_per_level;
+        const uint64_t later = index + 1 < slots_per_level ? occupied[level] & (~0ull << (index + 1)) : 0;
+        // A slot at or before the current one is reached in the next turn of its level
+        const uint64_t next_block = later ? block - index + __builtin_ctzll(later)
+                                          : block - index + slots_per_level + __builtin_ctzll(occupied[level]);
+        next = std::min(next, next_block << shift);
+    }
+    return next;
+}
+
+void timer_wheel::advance(uint64_t target, std::vector<timer_id>& due_timers) {
+    for(uint64_t tick = next_tick(); tick <= target; tick = next_tick()) {
+        current = tick;
+        // Each level whose block starts here hands its timers to the levels
+        // below, which empty their own slot for this tick first
+        for(uint32_t level = 1; level < num_levels && !(current & ((1ull << (bits_per_level * level)) - 1)); ++level) {
+            cascade(level, (current >> (bits_per_level * level)) % slots_per_level);
+        }
+        const uint32_t slot = current % slots_per_level;
+        std::vector<slot_entry> entries;
+        entries.swap(slots[0][slot]);
+        occupied[0] &= ~(1ull << slot);
+        for(const slot_entry& entry : entries) {
+            auto timer = timers.find(entry.id);
+            if(timer != timers.end() && timer->second.due == entry.due) {
+                due_timers.push_back(entry.id);
+            }
+        }
+    }
+    current = std::max(current, target);
+}
+
+void timer_wheel::run() {
+    pthread_setname_np(pthread_self(), "timer_wheel");
+    derecho::place_this_thread("timer_wheel");
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<timer_id> due_timers;
+    while(!shutdown) {
+        advance(now_ticks(), due_timers);
+        if(due_timers.empty()) {
+            wake_tick = next_tick();
+            if(wake_tick == UINT64_MAX) {
+                changed.wait(lock);
+            } else {
+                changed.wait_until(lock, start + std::chrono::microseconds(wake_tick));
+            }
+            wake_tick = UINT64_MAX;
+            continue;
+        }
+        for(timer_id id : due_timers) {
+            auto timer = timers.find(id);
+            // An earlier callback may have cancelled this timer
+            if(timer == timers.end()) {
+                continue;
+            }
+            // The map's elements stay put, and cancel waits for this callback
+            // before removing its timer
+            callback_t& callback = timer->second.callback;
+            running = id;
+            lock.unlock();
+            callback();
+            lock.lock();
+            running = 0;
+            timer = timers.find(id);
+            if(timer->second.period == 0 || running_cancelled) {
+                timers.erase(timer);
+            } else {
+                // Skip the runs that the callbacks have made this one miss
+                uint64_t due = timer->second.due + timer->second.period;
+                const uint64_t now = now_ticks();
+                if(due <= now) {
+                    due += ((now - due) / timer->second.period + 1) * timer->second.period;
+                }
+                timer->second.due = due;
+                insert(slot_entry{id, due});
+            }
+            running_cancelled = false;
+            changed.notify_all();
+        }
+        due_timers.clear();
+    }
+}
+
+}  // namespace sst
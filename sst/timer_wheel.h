@@ -0,0 +1,122 @@
+/**
+ * @file timer_wheel.h
+ * Contains a hierarchical timer wheel that runs the timeouts of every group
+ * in the process on one thread.
+ *
+ * @date Oct 14, 2026
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace sst {
+
+/**
+ * Runs callbacks at given times, or every given period, on a single thread
+ * shared by everything that uses it, so that a process with many groups
+ * doesn't have a sleeping thread for each of their timeouts. Time is counted
+ * in ticks of one microsecond since the wheel was created. Timers are kept in
+ * num_levels wheels of slots_per_level slots; level L holds the timers that
+ * are due within slots_per_level^(L+1) ticks, in the slot of the block of
+ * slots_per_level^L ticks they are due in, and each time the wheel reaches
+ * the start of a block its timers are moved down to the levels below. The
+ * thread sleeps until the next tick at which a slot has timers, so an idle
+ * wheel costs nothing.
+ *
+ * Callbacks run on the timer thread, one at a time, without any of the
+ * wheel's locks held; they can schedule and cancel timers, but should not
+ * block for long, since every other timer waits for them.
+ */
+class timer_wheel {
+public:
+    /** Identifies a timer; 0 is never the ID of a timer. */
+    using timer_id = uint64_t;
+    using callback_t = std::function<void()>;
+
+    timer_wheel();
+    ~timer_wheel();
+    timer_wheel(const timer_wheel&) = delete;
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    /** The timer wheel that the SST and Derecho schedule their timeouts on. */
+    static timer_wheel& shared();
+
+    /** Runs callback once, after delay. */
+    timer_id schedule_after(std::chrono::microseconds delay, callback_t callback);
+    /** Runs callback every period, starting one period from now. If a
+     * callback overruns its period, the runs it missed are skipped. */
+    timer_id schedule_every(std::chrono::microseconds period, callback_t callback);
+    /**
+     * Stops a timer. If its callback is running on the timer thread, waits
+     * for it to return, so that once this returns the callback will not be
+     * running, unless this is called from the callback itself.
+     * @return True if the timer had not yet run for the last time.
+     */
+    bool cancel(timer_id id);
+
+private:
+    static constexpr uint32_t bits_per_level = 6;
+    static constexpr uint32_t slots_per_level = 1 << bits_per_level;
+    static constexpr uint32_t num_levels = 6;
+    /** Timers due further ahead than this wait at the top level and are moved
+     * back into it until they are within reach (about 19 hours) */
+    static constexpr uint64_t max_delay = (1ull << (bits_per_level * num_levels)) - 1;
+
+    struct timer {
+        uint64_t due;
+        /** 0 for a one-shot timer */
+        uint64_t period;
+        callback_t callback;
+    };
+    /** A timer in a slot. Cancelled or rescheduled timers are taken out of
+     * their slots lazily: an entry whose due time no longer matches its
+     * timer's is ignored. */
+    struct slot_entry {
+        timer_id id;
+        uint64_t due;
+    };
+
+    std::mutex mutex;
+    /** Signalled when a timer due before the thread's wake-up time is added,
+     * and when a callback that cancel is waiting for returns. */
+    std::condition_variable changed;
+    const std::chrono::steady_clock::time_point start;
+    /** The last tick whose timers have been run */
+    uint64_t current = 0;
+    timer_id next_id = 1;
+    std::unordered_map<timer_id, timer> timers;
+    std::vector<slot_entry> slots[num_levels][slots_per_level];
+    /** A bit for each slot of a level that may have timers in it */
+    uint64_t occupied[num_levels] = {};
+    /** The timer whose callback is running, or 0 */
+    timer_id running = 0;
+    /** Set when the running callback cancels its own timer */
+    bool running_cancelled = false;
+    /** The tick the thread is sleeping until, if it is sleeping */
+    uint64_t wake_tick = UINT64_MAX;
+    bool shutdown = false;
+    std::thread thread;
+
+    uint64_t now_ticks() const;
+    timer_id add(uint64_t delay, uint64_t period, callback_t callback);
+    /** Puts an entry in the slot of the lowest level that reaches its due time */
+    void insert(const slot_entry& entry);
+    /** Moves the timers of a slot down into the levels below it */
+    void cascade(uint32_t level, uint32_t slot);
+    /** The first tick after current at which a slot has to be visited, or UINT64_MAX */
+    uint64_t next_tick() const;
+    /** Moves current up to target, appending the timers that are due to due_timers */
+    void advance(uint64_t target, std::vector<timer_id>& due_timers);
+    /** The main loop of the timer thread */
+    void run();
+};
+
+}  // namespace sst
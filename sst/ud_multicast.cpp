@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <errno.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <stdlib.h>
+
+#include "ud_multicast.h"
+
+using std::cout;
+using std::endl;
+
+namespace sst {
+
+static sockaddr_in ipv4_address(const std::string& ip, const char* what) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if(inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1) {
+        throw std::invalid_argument(std::string("Bad ") + what + " address for UD multicast: " + ip);
+    }
+    return addr;
+}
+
+/**
+ * Binds an RDMA connection manager ID to the local interface, creates a UD
+ * queue pair on its device, posts every receive buffer, and joins the group.
+ * Throws std::runtime_error if any of that fails, since the caller can still
+ * fall back to writing to each member over its reliable connection.
+ */
+ud_multicast::ud_multicast(const std::string& local_ip, const std::string& group_ip,
+                           uint32_t max_packet_size, uint32_t num_receive_buffers)
+        : num_receive_buffers(num_receive_buffers) {
+    try {
+        join(local_ip, group_ip, max_packet_size);
+    } catch(...) {
+        destroy();
+        throw;
+    }
+    cout << "Joined UD multicast group " << group_ip << " with packets of up to " << packet_size << " bytes" << endl;
+}
+
+void ud_multicast::join(const std::string& local_ip, const std::string& group_ip, uint32_t max_packet_size) {
+    sockaddr_in local_addr = ipv4_address(local_ip, "local");
+    group_addr = ipv4_address(group_ip, "group");
+
+    channel = rdma_create_event_channel();
+    if(!channel || rdma_create_id(channel, &id, nullptr, RDMA_PS_UDP)) {
+        throw std::runtime_error("Could not create an RDMA CM ID for UD multicast, error code is " + std::to_string(errno));
+    }
+    // Binding to an address is what picks the device and port
+    if(rdma_bind_addr(id, reinterpret_cast<sockaddr*>(&local_addr)) || !id->verbs) {
+        throw std::runtime_error("Could not bind UD multicast to " + local_ip + ", error code is " + std::to_string(errno));
+    }
+
+    struct ibv_port_attr port_attr;
+    if(ibv_query_port(id->verbs, id->port_num, &port_attr)) {
+        throw std::runtime_error("Could not query the port for UD multicast");
+    }
+    // IBV_MTU_256 is 1, IBV_MTU_512 is 2, and so on
+    const uint32_t mtu = 128u << port_attr.active_mtu;
+    packet_size = std::min(max_packet_size, mtu);
+
+    pd = ibv_alloc_pd(id->verbs);
+    send_cq = pd ? ibv_create_cq(id->verbs, send_depth, nullptr, nullptr, 0) : nullptr;
+    recv_cq = pd ? ibv_create_cq(id->verbs, num_receive_buffers, nullptr, nullptr, 0) : nullptr;
+    if(!send_cq || !recv_cq) {
+        throw std::runtime_error("Could not create the completion queues for UD multicast");
+    }
+
+    struct ibv_qp_init_attr qp_init_attr;
+    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+    qp_init_attr.qp_type = IBV_QPT_UD;
+    qp_init_attr.sq_sig_all = 1;
+    qp_init_attr.send_cq = send_cq;
+    qp_init_attr.recv_cq = recv_cq;
+    qp_init_attr.cap.max_send_wr = send_depth;
+    qp_init_attr.cap.max_recv_wr = num_receive_buffers;
+    qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_recv_sge = 1;
+    // Moves the queue pair all the way to ready-to-send, with the CM's Q_Key
+    if(rdma_create_qp(id, pd, &qp_init_attr)) {
+        throw std::runtime_error("Could not create the queue pair for UD multicast, error code is " + std::to_string(errno));
+    }
+
+    const int mr_flags = IBV_ACCESS_LOCAL_WRITE;
+    const size_t receive_buffer_size = grh_size + packet_size;
+    receive_buffers = static_cast<char*>(calloc(num_receive_buffers, receive_buffer_size));
+    send_buffers = static_cast<char*>(calloc(send_depth, packet_size));
+    if(!receive_buffers || !send_buffers) {
+        throw std::bad_alloc();
+    }
+    receive_mr = ibv_reg_mr(pd, receive_buffers, num_receive_buffers * receive_buffer_size, mr_flags);
+    send_mr = ibv_reg_mr(pd, send_buffers, send_depth * packet_size, mr_flags);
+    if(!receive_mr || !send_mr) {
+        throw std::runtime_error("Could not register the buffers for UD multicast, error code is " + std::to_string(errno));
+    }
+    // Receives must be posted before joining, or early packets are dropped
+    for(uint32_t i = 0; i < num_receive_buffers; ++i) {
+        post_receive(i);
+    }
+
+    if(rdma_join_multicast(id, reinterpret_cast<sockaddr*>(&group_addr), nullptr)) {
+        throw std::runtime_error("Could not join multicast group " + group_ip + ", error code is " + std::to_string(errno));
+    }
+    struct rdma_cm_event* event;
+    if(rdma_get_cm_event(channel, &event)) {
+        throw std::runtime_error("No reply to joining multicast group " + group_ip);
+    }
+    if(event->event != RDMA_CM_EVENT_MULTICAST_JOIN) {
+        const int event_type = event->event;
+        rdma_ack_cm_event(event);
+        throw std::runtime_error("Could not join multicast group " + group_ip + ", got event " + std::to_string(event_type));
+    }
+    ah = ibv_create_ah(pd, &event->param.ud.ah_attr);
+    remote_qpn = event->param.ud.qp_num;
+    remote_qkey = event->param.ud.qkey;
+    rdma_ack_cm_event(event);
+    if(!ah) {
+        throw std::runtime_error("Could not create the address handle for multicast group " + group_ip);
+    }
+}
+
+ud_multicast::~ud_multicast() {
+    destroy();
+}
+
+void ud_multicast::destroy() {
+    if(ah) {
+        rdma_leave_multicast(id, reinterpret_cast<sockaddr*>(&group_addr));
+        ibv_destroy_ah(ah);
+    }
+    if(id && id->qp) {
+        rdma_destroy_qp(id);
+    }
+    if(receive_mr) {
+        ibv_dereg_mr(receive_mr);
+    }
+    if(send_mr) {
+        ibv_dereg_mr(send_mr);
+    }
+    free(receive_buffers);
+    free(send_buffers);
+    if(send_cq) {
+        ibv_destroy_cq(send_cq);
+    }
+    if(recv_cq) {
+        ibv_destroy_cq(recv_cq);
+    }
+    if(pd) {
+        ibv_dealloc_pd(pd);
+    }
+    if(id) {
+        rdma_destroy_id(id);
+    }
+    if(channel) {
+        rdma_destroy_event_channel(channel);
+    }
+}
+
+void ud_multicast::post_receive(uint32_t buffer_index) {
+    const size_t receive_buffer_size = grh_size + packet_size;
+    struct ibv_sge sge;
+    sge.addr = reinterpret_cast<uint64_t>(receive_buffers + buffer_index * receive_buffer_size);
+    sge.length = receive_buffer_size;
+    sge.lkey = receive_mr->lkey;
+
+    struct ibv_recv_wr wr, *bad_wr = nullptr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = buffer_index;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    if(ibv_post_recv(id->qp, &wr, &bad_wr)) {
+        cout << "Could not post a UD multicast receive, error code is " << errno << endl;
+    }
+}
+
+bool ud_multicast::send(const char* header, uint32_t header_size,
+                        const volatile char* payload, uint32_t payload_size) {
+    if(header_size + payload_size > packet_size) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(send_mutex);
+    // A send buffer can only be reused once the NIC has finished with it
+    while(num_sends_posted - num_sends_completed >= send_depth) {
+        struct ibv_wc wc;
+        int num_completions = ibv_poll_cq(send_cq, 1, &wc);
+        if(num_completions > 0) {
+            if(wc.status != IBV_WC_SUCCESS) {
+                cout << "UD multicast send failed with status " << ibv_wc_status_str(wc.status) << endl;
+            }
+            num_sends_completed++;
+        }
+    }
+    char* buffer = send_buffers + (num_sends_posted % send_depth) * packet_size;
+    memcpy(buffer, header, header_size);
+    memcpy(buffer + header_size, const_cast<const char*>(payload), payload_size);
+
+    struct ibv_sge sge;
+    sge.addr = reinterpret_cast<uint64_t>(buffer);
+    sge.length = header_size + payload_size;
+    sge.lkey = send_mr->lkey;
+
+    struct ibv_send_wr wr, *bad_wr = nullptr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = num_sends_posted;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_SEND;
+    wr.wr.ud.ah = ah;
+    wr.wr.ud.remote_qpn = remote_qpn;
+    wr.wr.ud.remote_qkey = remote_qkey;
+    if(ibv_post_send(id->qp, &wr, &bad_wr)) {
+        cout << "Could not post a UD multicast send, error code is " << errno << endl;
+        return false;
+    }
+    num_sends_posted++;
+    return true;
+}
+
+bool ud_multicast::poll(const std::function<void(const char*, uint32_t)>& handler) {
+    struct ibv_wc wc;
+    if(ibv_poll_cq(recv_cq, 1, &wc) <= 0) {
+        return false;
+    }
+    const uint32_t buffer_index = wc.wr_id;
+    if(wc.status == IBV_WC_SUCCESS && wc.byte_len >= grh_size) {
+        const char* buffer = receive_buffers + buffer_index * (grh_size + packet_size);
+        handler(buffer + grh_size, wc.byte_len - grh_size);
+    }
+    post_receive(buffer_index);
+    return true;
+}
+
+}  // namespace sst
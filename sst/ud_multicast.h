@@ -0,0 +1,104 @@
+#ifndef UD_MULTICAST_H
+#define UD_MULTICAST_H
+
+/**
+ * @file ud_multicast.h
+ * Contains an unreliable datagram transport that sends each packet once to
+ * an InfiniBand multicast group, for the SST's small-message multicast.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include <infiniband/verbs.h>
+#include <rdma/rdma_cma.h>
+
+namespace sst {
+
+/**
+ * An unreliable datagram (UD) queue pair joined to a hardware multicast
+ * group, so that a packet posted once is replicated by the switches to every
+ * node that has joined the group, instead of the sender's NIC writing it to
+ * each of them separately. Delivery is best-effort: packets may be dropped,
+ * and nothing is retransmitted at this layer. The group is joined through
+ * the RDMA connection manager, so it has its own device context and
+ * protection domain, separate from the SST's verbs resources.
+ */
+class ud_multicast {
+    /** UD receives start with the global routing header, which is padding here */
+    static constexpr uint32_t grh_size = 40;
+    /** The number of sends that can be outstanding at once */
+    static constexpr uint32_t send_depth = 256;
+
+    struct rdma_event_channel* channel = nullptr;
+    struct rdma_cm_id* id = nullptr;
+    struct ibv_pd* pd = nullptr;
+    struct ibv_cq* send_cq = nullptr;
+    struct ibv_cq* recv_cq = nullptr;
+    struct ibv_ah* ah = nullptr;
+    struct sockaddr_in group_addr;
+    uint32_t remote_qpn;
+    uint32_t remote_qkey;
+
+    /** The largest packet this group sends, at most the path MTU */
+    uint32_t packet_size;
+    const uint32_t num_receive_buffers;
+    char* receive_buffers = nullptr;
+    char* send_buffers = nullptr;
+    struct ibv_mr* receive_mr = nullptr;
+    struct ibv_mr* send_mr = nullptr;
+
+    /** Serializes senders, and protects the send counters */
+    std::mutex send_mutex;
+    uint64_t num_sends_posted = 0;
+    uint64_t num_sends_completed = 0;
+
+    /** Does the work of the constructor, throwing if any of it fails */
+    void join(const std::string& local_ip, const std::string& group_ip, uint32_t max_packet_size);
+    /** Releases whatever has been created so far */
+    void destroy();
+    void post_receive(uint32_t buffer_index);
+
+public:
+    /**
+     * Joins a multicast group.
+     * @param local_ip The IPv4 address of this node's RDMA interface
+     * @param group_ip The IPv4 multicast address identifying the group, which
+     * every member must join with, and no other group may use
+     * @param max_packet_size The largest packet that will be sent; it is
+     * reduced to the port's MTU if that is smaller
+     * @param num_receive_buffers The number of packets that can arrive before
+     * poll() is called; packets arriving when all of them are full are dropped
+     */
+    ud_multicast(const std::string& local_ip, const std::string& group_ip,
+                 uint32_t max_packet_size, uint32_t num_receive_buffers = 1024);
+    ud_multicast(const ud_multicast&) = delete;
+    ud_multicast& operator=(const ud_multicast&) = delete;
+    /** Leaves the group and destroys the resources. */
+    ~ud_multicast();
+
+    /** @return The largest packet that can be sent. */
+    uint32_t max_packet_size() const { return packet_size; }
+
+    /**
+     * Sends a packet made of a header followed by a payload to every member
+     * of the group; the sender may receive its own packet too. Both parts
+     * are copied, so they can be reused as soon as this returns.
+     * @return False if the packet is larger than max_packet_size().
+     */
+    bool send(const char* header, uint32_t header_size,
+              const volatile char* payload, uint32_t payload_size);
+
+    /**
+     * Checks for a packet that has arrived, and if there is one, calls the
+     * handler on it before reusing its buffer. Only one thread may call this.
+     * @return True if a packet was handled.
+     */
+    bool poll(const std::function<void(const char*, uint32_t)>& handler);
+};
+
+}  // namespace sst
+
+#endif  // UD_MULTICAST_H
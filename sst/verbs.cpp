@@ -4,9 +4,12 @@
  */
 #include <arpa/inet.h>
 #include <byteswap.h>
+#include <cctype>
 #include <cstring>
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fstream>
 #include <getopt.h>
 #include <infiniband/verbs.h>
 #include <inttypes.h>
@@ -16,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -24,6 +28,8 @@
 
 #include "derecho/connection_manager.h"
 #include "derecho/derecho_ports.h"
+#include "derecho/rdma_device.h"
+#include "derecho/thread_placement.h"
 #include "poll_utils.h"
 #include "tcp/tcp.h"
 #include "verbs.h"
@@ -53,6 +59,10 @@ const char *dev_name = NULL;
 int ib_port = 1;
 /** GID index to use. */
 int gid_idx = 0;
+/** Service level of the queue pairs. */
+uint8_t service_level = 0;
+/** Whether registered tables are locked into memory. */
+bool lock_memory = false;
 
 tcp::tcp_connections *sst_connections;
 
@@ -77,6 +87,36 @@ struct global_resources *g_res;
 std::thread polling_thread;
 static bool shutdown = false;
 
+/** The number of the last shared table this process created. */
+static std::atomic<uint32_t> last_shm_table{0};
+
+/**
+ * Gets the kernel's boot ID, which is the same for every process on a host,
+ * and differs between hosts, as 16 bytes. They are all 0 if it can't be read.
+ */
+static const uint8_t *host_id() {
+    static uint8_t id[16] = {0};
+    static std::once_flag read_flag;
+    std::call_once(read_flag, [] {
+        std::ifstream boot_id_file("/proc/sys/kernel/random/boot_id");
+        std::string boot_id;
+        std::getline(boot_id_file, boot_id);
+        unsigned int digits = 0;
+        for(char c : boot_id) {
+            if(!isxdigit(c) || digits == 32) {
+                continue;
+            }
+            const uint8_t value = isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10);
+            id[digits / 2] |= digits % 2 ? value : value << 4;
+            ++digits;
+        }
+        if(digits < 32) {
+            memset(id, 0, sizeof(id));
+        }
+    });
+    return id;
+}
+
 /**
  * Initializes the resources. Registers write_addr and read_addr as the read
  * and write buffers and connects a queue pair with the specified remote node.
@@ -91,9 +131,29 @@ static bool shutdown = false;
  * @param size_r The size of the read buffer (in bytes).
  */
 resources::resources(int r_index, char *write_addr, char *read_addr, int size_w,
-                     int size_r) {
+                     int size_r)
+        : resources(r_index, write_addr, read_addr, size_w, size_r, nullptr) {}
+
+/**
+ * Initializes the resources, using a memory region that has already been
+ * registered and that contains both buffers instead of registering them
+ * separately. The memory region must outlive the resources.
+ *
+ * @param shared_mr The memory region holding write_addr and read_addr, or
+ * nullptr to register the buffers just for this connection.
+ * @param cq The completion queue for the queue pair, or nullptr to use the
+ * global one that the polling thread polls.
+ * @param table The shared registered_buffer holding both buffers, if the
+ * remote node may write through shared memory when it is on the same host.
+ */
+resources::resources(int r_index, char *write_addr, char *read_addr, int size_w,
+                     int size_r, struct ibv_mr *shared_mr, struct ibv_cq *cq,
+                     bool connect, const registered_buffer *table)
+        : owns_mrs(shared_mr == nullptr),
+          shared_table(table && table->shm_table ? table : nullptr) {
     // set the remote index
     remote_index = r_index;
+    unsignaled_writes = 0;
 
     write_buf = write_addr;
     if(!write_buf) {
@@ -107,11 +167,16 @@ resources::resources(int r_index, char *write_addr, char *read_addr, int size_w,
 
     // register the memory buffer
     int mr_flags = 0;
-    // allow access for only local writes and remote reads
-    mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    // allow local writes and remote reads, writes and atomics
+    mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
     // register memory with the protection domain and the buffer
-    write_mr = ibv_reg_mr(g_res->pd, write_buf, size_w, mr_flags);
-    read_mr = ibv_reg_mr(g_res->pd, read_buf, size_r, mr_flags);
+    if(owns_mrs) {
+        write_mr = ibv_reg_mr(g_res->pd, write_buf, size_w, mr_flags);
+        read_mr = ibv_reg_mr(g_res->pd, read_buf, size_r, mr_flags);
+    } else {
+        write_mr = shared_mr;
+        read_mr = shared_mr;
+    }
     if(!write_mr) {
         cout << "Could not register memory region : write_mr, error code is: " << errno << endl;
     }
@@ -125,23 +190,33 @@ resources::resources(int r_index, char *write_addr, char *read_addr, int size_w,
     qp_init_attr.qp_type = IBV_QPT_RC;
     qp_init_attr.sq_sig_all = 0;
     // same completion queue for both send and receive operations
-    qp_init_attr.send_cq = g_res->cq;
-    qp_init_attr.recv_cq = g_res->cq;
+    qp_init_attr.send_cq = cq ? cq : g_res->cq;
+    qp_init_attr.recv_cq = cq ? cq : g_res->cq;
     // allow a lot of requests at a time
     qp_init_attr.cap.max_send_wr = 10000;
     qp_init_attr.cap.max_recv_wr = 10000;
     qp_init_attr.cap.max_send_sge = 1;
     qp_init_attr.cap.max_recv_sge = 1;
+    qp_init_attr.cap.max_inline_data = requested_max_inline_data;
     // create the queue pair
     qp = ibv_create_qp(g_res->pd, &qp_init_attr);
+    if(!qp) {
+        // the device may not support that much inline data, or any at all
+        qp_init_attr.cap.max_inline_data = 0;
+        qp = ibv_create_qp(g_res->pd, &qp_init_attr);
+    }
+    // ibv_create_qp sets cap to what the queue pair actually supports
+    max_inline_data = qp ? qp_init_attr.cap.max_inline_data : 0;
 
     if(!qp) {
         cout << "Could not create queue pair, error code is: " << errno << endl;
     }
 
     // connect the QPs
-    connect_qp();
-    cout << "Established RDMA connection with node " << r_index << endl;
+    if(connect) {
+        connect_qp();
+        cout << "Established RDMA connection with node " << r_index << endl;
+    }
 }
 
 /**
@@ -149,6 +224,9 @@ resources::resources(int r_index, char *write_addr, char *read_addr, int size_w,
  */
 resources::~resources() {
     int rc = 0;
+    if(peer_table) {
+        munmap(peer_table, peer_table_size);
+    }
     if(qp) {
         rc = ibv_destroy_qp(qp);
         if(!qp) {
@@ -156,6 +234,9 @@ resources::~resources() {
         }
     }
 
+    if(!owns_mrs) {
+        return;
+    }
     if(write_mr) {
         rc = ibv_dereg_mr(write_mr);
         if(rc) {
@@ -182,8 +263,8 @@ void resources::set_qp_initialized() {
     attr.qp_state = IBV_QPS_INIT;
     attr.port_num = ib_port;
     attr.pkey_index = 0;
-    // give access to local writes and remote reads
-    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    // give access to local writes and remote reads, writes and atomics
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
     flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
     // modify the queue pair to init state
     rc = ibv_modify_qp(qp, &attr, flags);
@@ -207,18 +288,19 @@ void resources::set_qp_ready_to_receive() {
     attr.ah_attr.is_global = 0;
     // set the local id of the remote side
     attr.ah_attr.dlid = remote_props.lid;
-    attr.ah_attr.sl = 0;
+    attr.ah_attr.sl = service_level;
     attr.ah_attr.src_path_bits = 0;
     // the infiniband port to associate with
     attr.ah_attr.port_num = ib_port;
     if(gid_idx >= 0) {
         attr.ah_attr.is_global = 1;
-        attr.ah_attr.port_num = 1;
+        attr.ah_attr.port_num = ib_port;
         memcpy(&attr.ah_attr.grh.dgid, remote_props.gid, 16);
         attr.ah_attr.grh.flow_label = 0;
-        attr.ah_attr.grh.hop_limit = 1;
+        // RoCE v2 traffic can be routed between subnets
+        attr.ah_attr.grh.hop_limit = 0xFF;
         attr.ah_attr.grh.sgid_index = gid_idx;
-        attr.ah_attr.grh.traffic_class = 0;
+        attr.ah_attr.grh.traffic_class = service_level << 5;
     }
     flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
     rc = ibv_modify_qp(qp, &attr, flags);
@@ -245,18 +327,7 @@ void resources::set_qp_ready_to_send() {
     }
 }
 
-/**
- * This method implements the entire setup of the queue pairs, calling all the
- * `modify_qp_*` methods in the process.
- */
-void resources::connect_qp() {
-    // local connection data
-    struct cm_con_data_t local_con_data;
-    // remote connection data. Obtained via TCP
-    struct cm_con_data_t remote_con_data;
-    // this is used to ensure that host byte order is correct at each node
-    struct cm_con_data_t tmp_con_data;
-
+cm_con_data_t resources::local_connection_data() const {
     union ibv_gid my_gid;
     if(gid_idx >= 0) {
         int rc = ibv_query_gid(g_res->ib_ctx, ib_port, gid_idx, &my_gid);
@@ -267,23 +338,63 @@ void resources::connect_qp() {
         memset(&my_gid, 0, sizeof my_gid);
     }
 
-    // exchange using TCP sockets info required to connect QPs
+    struct cm_con_data_t local_con_data;
     local_con_data.addr = htonll((uintptr_t)(char *)write_buf);
     local_con_data.rkey = htonl(write_mr->rkey);
     local_con_data.qp_num = htonl(qp->qp_num);
     local_con_data.lid = htons(g_res->port_attr.lid);
     memcpy(local_con_data.gid, &my_gid, 16);
-    bool success = sst_connections->exchange(remote_index, local_con_data, tmp_con_data);
-    if(!success) {
-        cout << "Could not exchange qp data in connect_qp" << endl;
-    }
-    remote_con_data.addr = ntohll(tmp_con_data.addr);
-    remote_con_data.rkey = ntohl(tmp_con_data.rkey);
-    remote_con_data.qp_num = ntohl(tmp_con_data.qp_num);
-    remote_con_data.lid = ntohs(tmp_con_data.lid);
-    memcpy(remote_con_data.gid, tmp_con_data.gid, 16);
+    memcpy(local_con_data.host, host_id(), 16);
+    local_con_data.shm_pid = htonl(shared_table ? getpid() : 0);
+    local_con_data.shm_table = htonl(shared_table ? shared_table->shm_table : 0);
+    local_con_data.shm_size = htonll(shared_table ? shared_table->mapped_size : 0);
+    local_con_data.shm_offset = htonll(shared_table ? write_buf - shared_table->buffer : 0);
+    return local_con_data;
+}
+
+/**
+ * Maps the remote node's table if both it and this node's are shared and it
+ * is on the same host. If it can't be mapped, for instance because the other
+ * process is in a container with its own /dev/shm, writes go through the NIC.
+ */
+void resources::map_peer_table(const cm_con_data_t &remote_data) {
+    static const uint8_t unknown_host[16] = {0};
+    const uint32_t pid = ntohl(remote_data.shm_pid);
+    if(!shared_table || !pid || memcmp(remote_data.host, host_id(), 16) != 0
+       || memcmp(remote_data.host, unknown_host, 16) == 0) {
+        return;
+    }
+    const std::string name = registered_buffer::shm_name(pid, ntohl(remote_data.shm_table));
+    const int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if(fd < 0) {
+        cout << "Could not open shared table " << name << " of node " << remote_index
+             << ", error code is " << errno << "; writing to it through the NIC" << endl;
+        return;
+    }
+    const size_t size = ntohll(remote_data.shm_size);
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        cout << "Could not map shared table " << name << " of node " << remote_index
+             << ", error code is " << errno << "; writing to it through the NIC" << endl;
+        return;
+    }
+    peer_table = static_cast<char *>(addr);
+    peer_table_size = size;
+    peer_buf = peer_table + ntohll(remote_data.shm_offset);
+}
+
+void resources::connect_qp_to(const cm_con_data_t &remote_data) {
     // save the remote side attributes, we will need it for the post SR
-    remote_props = remote_con_data;
+    remote_props.addr = ntohll(remote_data.addr);
+    remote_props.rkey = ntohl(remote_data.rkey);
+    remote_props.qp_num = ntohl(remote_data.qp_num);
+    remote_props.lid = ntohs(remote_data.lid);
+    memcpy(remote_props.gid, remote_data.gid, 16);
+    map_peer_table(remote_data);
+
+    // The queue pair is connected even if writes are copied, since it
+    // carries their completions and errors out if the remote node fails
 
     // modify the QP to init
     set_qp_initialized();
@@ -293,6 +404,22 @@ void resources::connect_qp() {
 
     // modify it to RTS
     set_qp_ready_to_send();
+}
+
+/**
+ * This method implements the entire setup of the queue pairs, calling all the
+ * `modify_qp_*` methods in the process.
+ */
+void resources::connect_qp() {
+    // exchange using TCP sockets info required to connect QPs
+    struct cm_con_data_t local_con_data = local_connection_data();
+    // this is used to ensure that host byte order is correct at each node
+    struct cm_con_data_t tmp_con_data;
+    bool success = sst_connections->exchange(remote_index, local_con_data, tmp_con_data);
+    if(!success) {
+        cout << "Could not exchange qp data in connect_qp" << endl;
+    }
+    connect_qp_to(tmp_con_data);
 
     // sync to make sure that both sides are in states that they can connect to
     // prevent packet loss
@@ -302,7 +429,42 @@ void resources::connect_qp() {
         cout << "Could not sync in connect_qp after qp transition to RTS state" << endl;
     }
 }
-  
+
+void connect_all(const std::vector<resources *> &connections) {
+    // Every node sends to all of its peers before it receives from any, and
+    // the messages are far smaller than a socket buffer, so no one waits on
+    // anyone else until everything has been sent
+    for(resources *res : connections) {
+        cm_con_data_t local_con_data = res->local_connection_data();
+        if(!sst_connections->write(res->remote_index, (char *)&local_con_data, sizeof(local_con_data))) {
+            cout << "Could not send qp data to node " << res->remote_index << endl;
+        }
+    }
+    for(resources *res : connections) {
+        cm_con_data_t remote_con_data;
+        if(!sst_connections->read(res->remote_index, (char *)&remote_con_data, sizeof(remote_con_data))) {
+            cout << "Could not receive qp data from node " << res->remote_index << endl;
+            continue;
+        }
+        res->connect_qp_to(remote_con_data);
+    }
+    // The same sync as connect_qp's, with everyone at once
+    const int ready = 0;
+    for(resources *res : connections) {
+        if(!sst_connections->write(res->remote_index, (char *)&ready, sizeof(ready))) {
+            cout << "Could not sync with node " << res->remote_index << endl;
+        }
+    }
+    for(resources *res : connections) {
+        int remote_ready;
+        if(!sst_connections->read(res->remote_index, (char *)&remote_ready, sizeof(remote_ready))) {
+            cout << "Could not sync with node " << res->remote_index << endl;
+            continue;
+        }
+        cout << "Established RDMA connection with node " << res->remote_index << endl;
+    }
+}
+
 /**
  * This is used for both reads and writes.
  *
@@ -317,9 +479,19 @@ int resources::post_remote_send(const uint32_t id, const long long int offset, c
     struct ibv_sge sge;
     struct ibv_send_wr *bad_wr = NULL;
 
+    // A write to a node on this host is stored straight into its table.
+    // The fence orders it before later writes, as the queue pair would, and
+    // all that still goes through the queue pair is an empty write whenever
+    // this one would have been signaled.
+    const bool copied = op == 1 && peer_buf;
+    if(copied) {
+        memcpy(peer_buf + offset, read_buf + offset, size);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
     // don't care where the read buffer is saved
     sge.addr = (uintptr_t)(read_buf + offset);
-    sge.length = size;
+    sge.length = copied ? 0 : size;
     sge.lkey = read_mr->lkey;
     // prepare the send work request
     memset(&sr, 0, sizeof(sr));
@@ -327,7 +499,7 @@ int resources::post_remote_send(const uint32_t id, const long long int offset, c
     // set the id for the work request, useful at the time of polling
     sr.wr_id = id;
     sr.sg_list = &sge;
-    sr.num_sge = 1;
+    sr.num_sge = copied ? 0 : 1;
     // set opcode depending on op parameter
     if(op == 0) {
         sr.opcode = IBV_WR_RDMA_READ;
@@ -336,6 +508,17 @@ int resources::post_remote_send(const uint32_t id, const long long int offset, c
     }
     if(completion) {
         sr.send_flags = IBV_SEND_SIGNALED;
+    } else if(++unsignaled_writes % signal_interval == 0) {
+        // the send queue only frees unsignaled entries when a later signaled
+        // one completes
+        sr.wr_id = periodic_signal_wr_id;
+        sr.send_flags = IBV_SEND_SIGNALED;
+    } else if(copied) {
+        return 0;
+    }
+    // small writes don't need the NIC to fetch the data from host memory
+    if(op == 1 && !copied && size <= max_inline_data) {
+        sr.send_flags |= IBV_SEND_INLINE;
     }
     // set the remote rkey and virtual address
     sr.wr.rdma.remote_addr = remote_props.addr + offset;
@@ -404,11 +587,215 @@ void resources::post_remote_write_with_completion(const uint32_t id, const long
     }
 }
 
+/**
+ * Posts an RDMA atomic, with a completion, on the 8-byte word at an offset
+ * into remote memory, which must be 8-byte aligned. The NIC writes the value
+ * the word had before into result.
+ * @param result The registered word to put the previous value in
+ * @param result_lkey The local key of the memory region result is in
+ * @param compare_add The value to compare the word with, or to add to it
+ * @param swap The value to replace the word with if it equals compare_add;
+ * ignored by a fetch-and-add
+ * @param compare_and_swap True for a compare-and-swap, false for a fetch-and-add
+ */
+int resources::post_remote_atomic(const uint32_t id, const long long int offset, uint64_t *result,
+                                  const uint32_t result_lkey, const uint64_t compare_add,
+                                  const uint64_t swap, const bool compare_and_swap) {
+    struct ibv_send_wr sr;
+    struct ibv_sge sge;
+    struct ibv_send_wr *bad_wr = NULL;
+
+    sge.addr = (uintptr_t)result;
+    sge.length = sizeof(uint64_t);
+    sge.lkey = result_lkey;
+    memset(&sr, 0, sizeof(sr));
+    sr.next = NULL;
+    sr.wr_id = id;
+    sr.sg_list = &sge;
+    sr.num_sge = 1;
+    sr.opcode = compare_and_swap ? IBV_WR_ATOMIC_CMP_AND_SWP : IBV_WR_ATOMIC_FETCH_AND_ADD;
+    sr.send_flags = IBV_SEND_SIGNALED;
+    sr.wr.atomic.remote_addr = remote_props.addr + offset;
+    sr.wr.atomic.rkey = remote_props.rkey;
+    sr.wr.atomic.compare_add = compare_add;
+    sr.wr.atomic.swap = swap;
+    return ibv_post_send(qp, &sr, &bad_wr);
+}
+
+bool resources::post_remote_compare_and_swap(const uint32_t id, const long long int offset, uint64_t *result,
+                                             const uint32_t result_lkey, const uint64_t expected,
+                                             const uint64_t desired) {
+    int rc = post_remote_atomic(id, offset, result, result_lkey, expected, desired, true);
+    if(rc) {
+        cout << "Could not post RDMA compare-and-swap, error code is " << rc << ", remote_index is " << remote_index << endl;
+    }
+    return rc == 0;
+}
+
+bool resources::post_remote_fetch_and_add(const uint32_t id, const long long int offset, uint64_t *result,
+                                          const uint32_t result_lkey, const uint64_t add) {
+    int rc = post_remote_atomic(id, offset, result, result_lkey, add, 0, false);
+    if(rc) {
+        cout << "Could not post RDMA fetch-and-add, error code is " << rc << ", remote_index is " << remote_index << endl;
+    }
+    return rc == 0;
+}
+
+/**
+ * Allocates the buffer and registers it. Buffers of at least a huge page are
+ * backed by huge pages, if there are any to spare, so that the NIC needs
+ * fewer translation entries for them.
+ *
+ * @param size The size of the buffer, in bytes.
+ */
+registered_buffer::registered_buffer(size_t size, bool shared)
+        : size(size),
+          mapped_size(size < huge_page_size || shared ? size : (size + huge_page_size - 1) & ~(huge_page_size - 1)),
+          shm_table(shared ? ++last_shm_table : 0) {
+    void *addr = MAP_FAILED;
+    if(shared) {
+        const std::string name = shm_name(getpid(), shm_table);
+        const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if(fd < 0 || ftruncate(fd, mapped_size) != 0) {
+            cout << "Could not create shared table " << name << ", error code is " << errno << endl;
+        } else {
+            addr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if(fd >= 0) {
+            close(fd);
+        }
+        if(addr == MAP_FAILED) {
+            shm_unlink(name.c_str());
+        }
+    } else if(size >= huge_page_size) {
+        addr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if(addr == MAP_FAILED) {
+        addr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        // Other processes won't find a table by the name of this one
+        shm_table = 0;
+    }
+    if(addr == MAP_FAILED) {
+        cout << "Could not allocate a registered buffer of " << size << " bytes, error code is " << errno << endl;
+        throw std::bad_alloc();
+    }
+    buffer = static_cast<char *>(addr);
+    // Before registering touches the pages, so they are allocated near the NIC
+    derecho::bind_to_nic_node(buffer, mapped_size);
+    // Locking faults in every page now, instead of on the first put
+    if(lock_memory && mlock(buffer, mapped_size) != 0) {
+        cout << "Could not lock a registered buffer of " << mapped_size << " bytes, error code is " << errno << endl;
+    }
+
+    int mr_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
+    mr = ibv_reg_mr(g_res->pd, buffer, size, mr_flags);
+    if(!mr) {
+        cout << "Could not register memory region : registered_buffer, error code is: " << errno << endl;
+    }
+}
+
+registered_buffer::~registered_buffer() {
+    if(mr) {
+        int rc = ibv_dereg_mr(mr);
+        if(rc) {
+            cout << "Could not de-register memory region : registered_buffer, error code is " << rc << endl;
+        }
+    }
+    unlink();
+    munmap(buffer, mapped_size);
+}
+
+void registered_buffer::unlink() const {
+    if(shm_table) {
+        // Fails harmlessly if it was already unlinked
+        shm_unlink(shm_name(getpid(), shm_table).c_str());
+    }
+}
+
+std::string registered_buffer::shm_name(uint32_t pid, uint32_t table) {
+    return "/derecho_sst." + std::to_string(pid) + "." + std::to_string(table);
+}
+
+completion_queue::completion_queue(int size) {
+    cq = ibv_create_cq(g_res->ib_ctx, size, NULL, NULL, 0);
+    if(!cq) {
+        cout << "Could not create completion queue, error code is " << errno << endl;
+    }
+}
+
+completion_queue::~completion_queue() {
+    if(cq) {
+        int rc = ibv_destroy_cq(cq);
+        if(rc) {
+            cout << "Could not destroy completion queue, error code is " << rc << endl;
+        }
+    }
+}
+
+void completion_queue::poll_locked() {
+    const int batch_size = 16;
+    struct ibv_wc wcs[batch_size];
+    int num_polled = ibv_poll_cq(cq, batch_size, wcs);
+    if(num_polled < 0) {
+        cout << "Poll completion failed" << endl;
+        return;
+    }
+    for(int i = 0; i < num_polled; ++i) {
+        if(wcs[i].status != IBV_WC_SUCCESS) {
+            cout << "got bad completion with status: "
+                 << wcs[i].status << ", vendor syndrome: " << wcs[i].vendor_err << endl;
+        }
+        // a failed periodic signal is followed by flushed, failed writes
+        // that someone does wait for
+        if(wcs[i].wr_id == resources::periodic_signal_wr_id) {
+            continue;
+        }
+        stashed_completions[wcs[i].wr_id].emplace_back(wcs[i].qp_num, wcs[i].status == IBV_WC_SUCCESS ? 1 : -1);
+    }
+}
+
+std::experimental::optional<std::pair<int32_t, int32_t>> completion_queue::poll(uint32_t request_id) {
+    std::lock_guard<std::mutex> lock(poll_mutex);
+    auto &mine = stashed_completions[request_id];
+    if(mine.empty()) {
+        poll_locked();
+    }
+    if(mine.empty()) {
+        return {};
+    }
+    auto ce = mine.front();
+    mine.pop_front();
+    return ce;
+}
+
+void completion_queue::discard(uint32_t request_id) {
+    std::lock_guard<std::mutex> lock(poll_mutex);
+    stashed_completions.erase(request_id);
+}
+
+void completion_queue::drain() {
+    std::lock_guard<std::mutex> lock(poll_mutex);
+    poll_locked();
+}
+
+uint32_t thread_request_id() {
+    static std::atomic<uint32_t> next_request_id{0};
+    static thread_local uint32_t request_id = next_request_id++;
+    return request_id;
+}
+
 void polling_loop() {
     pthread_setname_np(pthread_self(), "sst_poll");
+    derecho::place_this_thread("sst_poll");
     cout << "Polling thread starting" << endl;
     while(!shutdown) {
         auto ce = verbs_poll_completion();
+        // failed periodic signals have no thread waiting for them
+        if(ce.first == resources::periodic_signal_wr_id) {
+            continue;
+        }
         util::polling_data.insert_completion_entry(ce.first, ce.second);
     }
     cout << "Polling thread ending" << endl;
@@ -435,6 +822,10 @@ std::pair<uint32_t, std::pair<int, int>> verbs_poll_completion() {
                 break;
             }
         }
+        // nobody waits for the completions that only retire unsignaled writes
+        if(poll_result > 0 && wc.wr_id == resources::periodic_signal_wr_id && wc.status == IBV_WC_SUCCESS) {
+            continue;
+        }
         if(poll_result) {
             break;
         }
@@ -482,7 +873,7 @@ void resources_create() {
         cout << "NO RDMA device present" << endl;
     }
     // search for the specific device we want to work with
-    for(i = 1; i < num_devices; i++) {
+    for(i = 0; i < num_devices; i++) {
         if(!dev_name) {
             dev_name = strdup(ibv_get_device_name(dev_list[i]));
             fprintf(stdout, "device not specified, using first one found: %s\n",
@@ -499,6 +890,9 @@ void resources_create() {
     }
     // get device handle
     g_res->ib_ctx = ibv_open_device(ib_dev);
+    if(ib_dev) {
+        derecho::record_nic_device(ib_dev->ibdev_path);
+    }
     if(!g_res->ib_ctx) {
         cout << "Could not open RDMA device" << endl;
     }
@@ -511,6 +905,7 @@ void resources_create() {
     if(rc) {
         cout << "Could not query port properties, error code is " << rc << endl;
     }
+    gid_idx = derecho::choose_gid_index(g_res->ib_ctx, ib_port, g_res->port_attr);
 
     // allocate Protection Domain
     g_res->pd = ibv_alloc_pd(g_res->ib_ctx);
@@ -552,6 +947,27 @@ bool sync(uint32_t r_index) {
  * @details
  * This must be called before creating or using any SST instance.
  */
+void verbs_set_service_level(uint8_t level) {
+    service_level = level;
+}
+
+void verbs_set_lock_memory(bool enabled) {
+    lock_memory = enabled;
+}
+
+bool verbs_supports_atomics() {
+    return g_res->device_attr.atomic_cap != IBV_ATOMIC_NONE;
+}
+
+bool verbs_atomics_are_global() {
+    return g_res->device_attr.atomic_cap == IBV_ATOMIC_GLOB;
+}
+
+void verbs_set_device(const std::string &name, int port) {
+    dev_name = strdup(name.c_str());
+    ib_port = port;
+}
+
 void verbs_initialize(const std::map<uint32_t, std::string> &ip_addrs, uint32_t node_rank) {
     sst_connections = new tcp::tcp_connections(node_rank, ip_addrs, derecho::sst_tcp_port);
 
@@ -7,7 +7,13 @@
  * including the Resources class and global setup functions.
  */
 
+#include <atomic>
+#include <experimental/optional>
+#include <list>
 #include <map>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include <infiniband/verbs.h>
 
@@ -25,24 +31,68 @@ struct cm_con_data_t {
     uint16_t lid;
     /** GID */
     uint8_t gid[16];
+    /** The kernel's boot ID, which identifies the host */
+    uint8_t host[16];
+    /** The process whose shared table holds the buffer, or 0 if it isn't
+     * shared */
+    uint32_t shm_pid;
+    /** Which of that process's shared tables holds the buffer */
+    uint32_t shm_table;
+    /** The size of that table */
+    uint64_t shm_size;
+    /** The offset of the buffer in the table */
+    uint64_t shm_offset;
 } __attribute__((packed));
 
+class registered_buffer;
+
 /**
  * Represents the set of RDMA resources needed to maintain a two-way connection
  * to a single remote node.
  */
 class resources {
+public:
+    /** The most bytes a write will be copied into its work request for,
+     * instead of being read from the registered buffer by the NIC. */
+    static constexpr uint32_t requested_max_inline_data = 256;
+    /** Writes posted without a completion are made signaled once in this many,
+     * so that their send queue entries are retired; must be well under the
+     * send queue depth. */
+    static constexpr uint32_t signal_interval = 1024;
+    /** The work request ID of those periodically signaled writes, whose
+     * completions verbs_poll_completion() skips. */
+    static constexpr uint32_t periodic_signal_wr_id = 0xffffffff;
+
 private:
+    /** The number of writes posted without a completion so far. */
+    std::atomic<uint32_t> unsignaled_writes;
+    /** False if the memory regions belong to someone else, such as a
+     * registered_buffer shared by many connections. */
+    const bool owns_mrs;
+    /** The shared table the buffers are in, if they are in one. */
+    const registered_buffer *shared_table;
+    /** The remote node's table, mapped into this process, if it is on the
+     * same host and its table is shared; writes are then copied into it. */
+    char *peer_table = nullptr;
+    size_t peer_table_size = 0;
+    /** Where the remote buffer is in peer_table. */
+    char *peer_buf = nullptr;
+    /** Maps the remote node's table if it is on this host and shared. */
+    void map_peer_table(const cm_con_data_t &remote_data);
     /** Initializes the queue pair. */
     void set_qp_initialized();
     /** Transitions the queue pair to the ready-to-receive state. */
     void set_qp_ready_to_receive();
     /** Transitions the queue pair to the ready-to-send state. */
     void set_qp_ready_to_send();
-    /** Connect the queue pairs. */
+    /** Connect the queue pairs, exchanging their details with the remote
+     * node over TCP. */
     void connect_qp();
     /** Post a remote RDMA operation. */
     int post_remote_send(const uint32_t id, const long long int offset, const long long int size, const int op, const bool completion);
+    /** Post a remote RDMA atomic, with a completion. */
+    int post_remote_atomic(const uint32_t id, const long long int offset, uint64_t *result, const uint32_t result_lkey,
+                           const uint64_t compare_add, const uint64_t swap, const bool compare_and_swap);
 
 public:
     /** Index of the remote node. */
@@ -53,6 +103,8 @@ public:
     struct ibv_mr *write_mr;
     /** Memory Region handle for the read buffer. */
     struct ibv_mr *read_mr;
+    /** The largest write that is posted inline on this queue pair. */
+    uint32_t max_inline_data;
     /** Connection data values needed to connect to remote side. */
     struct cm_con_data_t remote_props;
     /** Pointer to the memory buffer used for local writes.*/
@@ -65,6 +117,21 @@ public:
      */
     resources(int r_index, char *write_addr, char *read_addr, int size_w,
               int size_r);
+    /** Constructor that uses an already registered memory region containing
+     * both buffers, and optionally a completion queue other than the global
+     * one. If connect is false, the queue pair is only created, and must be
+     * connected with connect_all before it is used. If table is a shared
+     * registered_buffer holding both buffers, a remote node on the same host
+     * can map it, and writes to it are copied rather than posted. */
+    resources(int r_index, char *write_addr, char *read_addr, int size_w,
+              int size_r, struct ibv_mr *shared_mr, struct ibv_cq *cq = nullptr,
+              bool connect = true, const registered_buffer *table = nullptr);
+    /** @return The details the remote node needs to connect to this queue
+     * pair, in network byte order */
+    cm_con_data_t local_connection_data() const;
+    /** Transitions the queue pair to ready-to-send, connected to the remote
+     * queue pair that sent these details (in network byte order). */
+    void connect_qp_to(const cm_con_data_t &remote_data);
     /** Destroys the resources. */
     virtual ~resources();
     /*
@@ -82,10 +149,116 @@ public:
     void post_remote_write_with_completion(const uint32_t id, const long long int size);
     /** Post an RDMA write at an offset into remote memory. */
     void post_remote_write_with_completion(const uint32_t id, const long long int offset, const long long int size);
+    /** Post an RDMA compare-and-swap, with a completion, on the 8-byte word
+     * at an offset into remote memory; the word's previous value is written
+     * to result, in the memory region with the local key result_lkey.
+     * @return False if it could not be posted */
+    bool post_remote_compare_and_swap(const uint32_t id, const long long int offset, uint64_t *result,
+                                      const uint32_t result_lkey, const uint64_t expected, const uint64_t desired);
+    /** Post an RDMA fetch-and-add, with a completion, on the 8-byte word at
+     * an offset into remote memory, like post_remote_compare_and_swap. */
+    bool post_remote_fetch_and_add(const uint32_t id, const long long int offset, uint64_t *result,
+                                   const uint32_t result_lkey, const uint64_t add);
+};
+
+/**
+ * A buffer for RDMA that is registered once and can then be shared by any
+ * number of resources, instead of each of them registering its own part of
+ * it. The memory starts out zeroed. A shared buffer is a POSIX shared memory
+ * object, which other processes on the host can map by its name until it is
+ * unlinked.
+ */
+class registered_buffer {
+    /** The size of a huge page on x86-64 */
+    static constexpr size_t huge_page_size = 2 << 20;
+
+public:
+    /** The size that was asked for. */
+    const size_t size;
+    /** The size that was mapped, rounded up to a whole huge page if it used them. */
+    const size_t mapped_size;
+    char *buffer;
+    /** The memory region covering the whole buffer. */
+    struct ibv_mr *mr = nullptr;
+    /** This process's number for the buffer, if it is shared, or 0. */
+    uint32_t shm_table;
+
+    explicit registered_buffer(size_t size, bool shared = false);
+    registered_buffer(const registered_buffer &) = delete;
+    registered_buffer &operator=(const registered_buffer &) = delete;
+    ~registered_buffer();
+    /** Removes the name of a shared buffer, once everyone who maps it has;
+     * the memory stays mapped. */
+    void unlink() const;
+    /** @return The name of a shared buffer of a process */
+    static std::string shm_name(uint32_t pid, uint32_t table);
+};
+
+/**
+ * A completion queue for a set of connections, such as one SST's, that is
+ * polled directly by the threads waiting for their own writes to complete,
+ * instead of by the global polling thread. A thread that polls a completion
+ * meant for another thread keeps it for that thread, so threads don't have
+ * to take turns.
+ */
+class completion_queue {
+    struct ibv_cq *cq;
+    /** Protects the queue and stashed_completions */
+    std::mutex poll_mutex;
+    /** Completions that have been polled but not yet claimed, by request ID */
+    std::map<uint32_t, std::list<std::pair<int32_t, int32_t>>> stashed_completions;
+
+    void poll_locked();
+
+public:
+    explicit completion_queue(int size);
+    completion_queue(const completion_queue &) = delete;
+    completion_queue &operator=(const completion_queue &) = delete;
+    ~completion_queue();
+
+    struct ibv_cq *get() const { return cq; }
+    /**
+     * @return A completion for a write posted with this request ID, as the
+     * pair (queue pair number, 1 for success or -1 for failure), or nothing
+     * if none has arrived yet.
+     */
+    std::experimental::optional<std::pair<int32_t, int32_t>> poll(uint32_t request_id);
+    /** Forgets any completions for this request ID left over from writes
+     * that were given up on. */
+    void discard(uint32_t request_id);
+    /** Polls whatever has arrived, so that completions nobody waits for
+     * don't pile up until the queue overflows. */
+    void drain();
 };
 
+/** @return A request ID unique to the calling thread, to post writes with */
+uint32_t thread_request_id();
+
+/**
+ * Connects a set of resources that were created without connecting them, all
+ * at once: the details of every queue pair are sent to its node before any
+ * are received, then every queue pair is brought up, then every node is
+ * synced with, so that the whole set takes about one round trip rather than
+ * two per connection. Each resources must be to a different node.
+ */
+void connect_all(const std::vector<resources *> &connections);
+
 bool add_node(uint32_t new_id, const std::string new_ip_addr);
 bool sync(uint32_t r_index);
+/** @return True if the device can do RDMA atomics; call it after verbs_initialize. */
+bool verbs_supports_atomics();
+/** @return True if the device's RDMA atomics are atomic with respect to the
+ * CPU's atomics on the same memory, and not just to other RDMA atomics. */
+bool verbs_atomics_are_global();
+/** Makes verbs_initialize use this device and port instead of the first
+ * device it finds; call it before verbs_initialize. */
+void verbs_set_device(const std::string &name, int port);
+/** Sets the service level of the queue pairs connected after the call, and
+ * on RoCE the matching DSCP class selector. */
+void verbs_set_service_level(uint8_t service_level);
+/** Makes the tables registered after the call locked into memory, so that
+ * all their pages are faulted in before the first put. */
+void verbs_set_lock_memory(bool enabled);
 /** Initializes the global verbs resources. */
 void verbs_initialize(const std::map<uint32_t, std::string> &ip_addrs,
                       uint32_t node_rank);
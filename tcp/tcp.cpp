@@ -4,47 +4,134 @@
 #include <algorithm>
 #include <arpa/inet.h>
 #include <cerrno>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <climits>
 #include <iostream>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <thread>
 #include <unistd.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define TCP_HAVE_ZEROCOPY
+#endif
 
 namespace tcp {
 
 using namespace std;
 
-socket::socket(string servername, int port) {
-    sock = ::socket(AF_INET, SOCK_STREAM, 0);
-    if(sock < 0) throw connection_failure();
-
-    hostent *server;
-    server = gethostbyname(servername.c_str());
-    if(server == nullptr) throw connection_failure();
+/**
+ * The address in DERECHO_BIND_ADDRESS, or INADDR_ANY if it isn't set. A node
+ * whose sockets all listen and connect from its own address can share a host
+ * with others, so that each node of a group can run on one of the host's
+ * loopback addresses: 127.0.0.1, 127.0.0.2, and so on.
+ */
+static in_addr_t bind_address() {
+    static const in_addr_t address = [] {
+        in_addr parsed;
+        const char *configured = getenv("DERECHO_BIND_ADDRESS");
+        if(!configured) {
+            return (in_addr_t)htonl(INADDR_ANY);
+        }
+        if(inet_pton(AF_INET, configured, &parsed) != 1) {
+            fprintf(stderr, "WARNING: DERECHO_BIND_ADDRESS %s is not an IPv4 address\n", configured);
+            return (in_addr_t)htonl(INADDR_ANY);
+        }
+        return parsed.s_addr;
+    }();
+    return address;
+}
 
-    char server_ip_cstr[server->h_length];
-    inet_ntop(AF_INET, server->h_addr, server_ip_cstr, server->h_length);
-    remote_ip = string(server_ip_cstr);
+socket::socket(string servername, int port) : socket(servername, port, -1) {}
 
+socket::socket(string servername, int port, int timeout_ms) : sock(-1) {
+    // getaddrinfo rather than gethostbyname, since sockets are made on
+    // several threads at once
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *server = nullptr;
+    if(getaddrinfo(servername.c_str(), to_string(port).c_str(), &hints, &server) != 0 || server == nullptr) {
+        throw connection_failure();
+    }
     sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr,
-          server->h_length);
+    memcpy(&serv_addr, server->ai_addr, sizeof(serv_addr));
+    freeaddrinfo(server);
 
-    while(connect(sock, (sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
-        /* do nothing*/;
+    char server_ip_cstr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &serv_addr.sin_addr, server_ip_cstr, sizeof(server_ip_cstr));
+    remote_ip = string(server_ip_cstr);
+
+    const auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    auto remaining_ms = [&]() {
+        if(timeout_ms < 0) return -1;
+        auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+        return (int)max<chrono::milliseconds::rep>(remaining.count(), 0);
+    };
+    while(true) {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0) throw connection_failure();
+        if(bind_address() != htonl(INADDR_ANY)) {
+            // The other end learns this node's address from the connection
+            sockaddr_in local_addr;
+            memset(&local_addr, 0, sizeof(local_addr));
+            local_addr.sin_family = AF_INET;
+            local_addr.sin_addr.s_addr = bind_address();
+            if(bind(fd, (sockaddr *)&local_addr, sizeof(local_addr)) < 0) {
+                close(fd);
+                throw connection_failure();
+            }
+        }
+        const int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        int rc = connect(fd, (sockaddr *)&serv_addr, sizeof(serv_addr));
+        if(rc < 0 && errno == EINPROGRESS) {
+            pollfd pfd{fd, POLLOUT, 0};
+            do {
+                rc = poll(&pfd, 1, remaining_ms());
+            } while(rc < 0 && errno == EINTR);
+            int error = 0;
+            socklen_t len = sizeof(error);
+            rc = (rc > 0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0) ? 0 : -1;
+        }
+        if(rc == 0) {
+            fcntl(fd, F_SETFL, flags);
+            sock = fd;
+            return;
+        }
+        close(fd);
+        if(remaining_ms() == 0) throw connection_failure();
+        // The server isn't listening yet
+        this_thread::sleep_for(chrono::milliseconds(min(10, timeout_ms < 0 ? 10 : remaining_ms())));
+    }
 }
-socket::socket(socket &&s) : sock(s.sock), remote_ip(s.remote_ip) {
+socket::socket(socket &&s)
+        : sock(s.sock),
+          zerocopy_checked(s.zerocopy_checked),
+          zerocopy_enabled(s.zerocopy_enabled),
+          zerocopy_sends(s.zerocopy_sends),
+          zerocopy_completions(s.zerocopy_completions),
+          remote_ip(s.remote_ip) {
     s.sock = -1;
     s.remote_ip = std::string();
 }
 
 socket &socket::operator=(socket &&s) {
+    if(sock >= 0 && sock != s.sock) close(sock);
     sock = s.sock;
     s.sock = -1;
+    zerocopy_checked = s.zerocopy_checked;
+    zerocopy_enabled = s.zerocopy_enabled;
+    zerocopy_sends = s.zerocopy_sends;
+    zerocopy_completions = s.zerocopy_completions;
     remote_ip = std::move(s.remote_ip);
     return *this;
 }
@@ -55,6 +142,8 @@ socket::~socket() {
 
 bool socket::is_empty() { return sock == -1; }
 
+int socket::get_fd() const { return sock; }
+
 bool socket::read(char *buffer, size_t size) {
     if(sock < 0) {
         fprintf(stderr, "WARNING: Attempted to read from closed socket\n");
@@ -97,6 +186,150 @@ bool socket::write(const char *buffer, size_t size) {
     return true;
 }
 
+bool socket::write_vectored(const struct iovec *buffers, int count) {
+    if(sock < 0) {
+        fprintf(stderr, "WARNING: Attempted to write to closed socket\n");
+        return false;
+    }
+
+    // A copy, since partial writes move the start of the first buffer
+    vector<iovec> remaining(buffers, buffers + count);
+    size_t next = 0;
+    while(next < remaining.size()) {
+        const int batch = min<size_t>(remaining.size() - next, IOV_MAX);
+        ssize_t bytes_written = ::writev(sock, &remaining[next], batch);
+        if(bytes_written == -1) {
+            if(errno != EINTR) return false;
+            continue;
+        }
+        size_t written = bytes_written;
+        while(next < remaining.size() && written >= remaining[next].iov_len) {
+            written -= remaining[next].iov_len;
+            ++next;
+        }
+        if(written > 0) {
+            remaining[next].iov_base = (char *)remaining[next].iov_base + written;
+            remaining[next].iov_len -= written;
+        }
+    }
+    return true;
+}
+
+bool socket::read_vectored(const struct iovec *buffers, int count) {
+    if(sock < 0) {
+        fprintf(stderr, "WARNING: Attempted to read from closed socket\n");
+        return false;
+    }
+
+    vector<iovec> remaining(buffers, buffers + count);
+    size_t next = 0;
+    // Skip empty buffers first, so that a read of 0 bytes means the peer closed
+    while(next < remaining.size() && remaining[next].iov_len == 0) ++next;
+    while(next < remaining.size()) {
+        const int batch = min<size_t>(remaining.size() - next, IOV_MAX);
+        ssize_t bytes_read = ::readv(sock, &remaining[next], batch);
+        if(bytes_read == 0 || (bytes_read == -1 && errno != EINTR)) {
+            return false;
+        } else if(bytes_read == -1) {
+            continue;
+        }
+        size_t read = bytes_read;
+        while(next < remaining.size() && read >= remaining[next].iov_len) {
+            read -= remaining[next].iov_len;
+            ++next;
+        }
+        if(read > 0) {
+            remaining[next].iov_base = (char *)remaining[next].iov_base + read;
+            remaining[next].iov_len -= read;
+        }
+    }
+    return true;
+}
+
+bool socket::enable_zerocopy() {
+    if(!zerocopy_checked) {
+        zerocopy_checked = true;
+#ifdef TCP_HAVE_ZEROCOPY
+        int one = 1;
+        zerocopy_enabled = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#endif
+    }
+    return zerocopy_enabled;
+}
+
+bool socket::wait_for_zerocopy_completions() {
+#ifdef TCP_HAVE_ZEROCOPY
+    while(zerocopy_completions != zerocopy_sends) {
+        // Completions are queued on the error queue, which poll reports as POLLERR
+        pollfd pfd{sock, 0, 0};
+        if(poll(&pfd, 1, -1) == -1) {
+            if(errno != EINTR) return false;
+            continue;
+        }
+        char control[CMSG_SPACE(sizeof(sock_extended_err)) * 4];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(sock, &msg, MSG_ERRQUEUE) == -1) {
+            if(errno == EAGAIN || errno == EINTR) continue;
+            return false;
+        }
+        for(cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            const sock_extended_err *err = (const sock_extended_err *)CMSG_DATA(cm);
+            if(err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // The notification covers the sends numbered ee_info to ee_data,
+            // and TCP completes them in order
+            zerocopy_completions = err->ee_data + 1;
+        }
+    }
+#endif
+    return true;
+}
+
+bool socket::write_zerocopy(const char *buffer, size_t size) {
+#ifdef TCP_HAVE_ZEROCOPY
+    if(sock < 0 || size < zerocopy_threshold || !enable_zerocopy()) {
+        return write(buffer, size);
+    }
+
+    size_t total_bytes = 0;
+    while(total_bytes < size) {
+        ssize_t bytes_written = ::send(sock, buffer + total_bytes, size - total_bytes, MSG_ZEROCOPY);
+        if(bytes_written >= 0) {
+            total_bytes += bytes_written;
+            ++zerocopy_sends;
+        } else if(errno == ENOBUFS) {
+            // Out of the memory that pins pages; copy the rest
+            if(!write(buffer + total_bytes, size - total_bytes)) return false;
+            break;
+        } else if(errno != EINTR) {
+            return false;
+        }
+    }
+    // The caller may reuse the buffer once this returns
+    return wait_for_zerocopy_completions();
+#else
+    return write(buffer, size);
+#endif
+}
+
+bool socket::set_nodelay(bool nodelay) {
+    int value = nodelay ? 1 : 0;
+    return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) == 0;
+}
+
+bool socket::set_cork(bool cork) {
+#ifdef TCP_CORK
+    int value = cork ? 1 : 0;
+    return setsockopt(sock, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == 0;
+#else
+    return false;
+#endif
+}
+
 std::string socket::get_self_ip() {
     struct sockaddr_storage my_addr_info;
     socklen_t len = sizeof my_addr_info;
@@ -115,6 +348,43 @@ std::string socket::get_self_ip() {
     return std::string(my_ip_cstr);
 }
 
+buffered_writer::buffered_writer(socket &sock, bool zerocopy)
+        : sock(sock), zerocopy(zerocopy) {
+    buffer.reserve(buffer_size);
+}
+
+buffered_writer::~buffered_writer() {
+    flush();
+}
+
+void buffered_writer::write(const char *bytes, size_t size) {
+    if(!ok) return;
+    if(buffer.size() + size <= buffer_size) {
+        buffer.insert(buffer.end(), bytes, bytes + size);
+        return;
+    }
+    if(size < buffer_size) {
+        ok = flush();
+        buffer.insert(buffer.end(), bytes, bytes + size);
+        return;
+    }
+    if(zerocopy && size >= socket::zerocopy_threshold) {
+        ok = flush() && sock.write_zerocopy(bytes, size);
+        return;
+    }
+    iovec pieces[2] = {{buffer.data(), buffer.size()}, {(void *)bytes, size}};
+    ok = sock.write_vectored(pieces, 2);
+    buffer.clear();
+}
+
+bool buffered_writer::flush() {
+    if(ok && !buffer.empty()) {
+        ok = sock.write(buffer.data(), buffer.size());
+    }
+    buffer.clear();
+    return ok;
+}
+
 connection_listener::connection_listener(int port) {
     sockaddr_in serv_addr;
 
@@ -127,7 +397,7 @@ connection_listener::connection_listener(int port) {
 
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_addr.s_addr = bind_address();
     serv_addr.sin_port = htons(port);
     if(bind(listenfd, (sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
         fprintf(stderr,
@@ -135,17 +405,31 @@ connection_listener::connection_listener(int port) {
                 strerror(errno));
 	std::cout << "Port is: " << port << std::endl;
     }
-    listen(listenfd, 5);
+    // Room for a whole group connecting at once
+    listen(listenfd, SOMAXCONN);
 
     fd = unique_ptr<int, std::function<void(int *)>>(
             new int(listenfd), [](int *fd) { close(*fd); delete fd; });
 }
 
 socket connection_listener::accept() {
+    return accept(-1);
+}
+
+socket connection_listener::accept(int timeout_ms) {
     char client_ip_cstr[INET6_ADDRSTRLEN + 1];
     struct sockaddr_storage client_addr_info;
     socklen_t len = sizeof client_addr_info;
 
+    if(timeout_ms >= 0) {
+        pollfd pfd{*fd, POLLIN, 0};
+        int ready;
+        do {
+            ready = poll(&pfd, 1, timeout_ms);
+        } while(ready < 0 && errno == EINTR);
+        if(ready <= 0) throw connection_failure();
+    }
+
     int sock = ::accept(*fd, (struct sockaddr *)&client_addr_info, &len);
     if(sock < 0) throw connection_failure();
 
@@ -162,4 +446,84 @@ socket connection_listener::accept() {
 
     return socket(sock, std::string(client_ip_cstr));
 }
+
+map<uint32_t, socket> connect_to_all(connection_listener &listener,
+                                     const map<uint32_t, string> &addresses,
+                                     uint32_t my_id, int port, int timeout_ms) {
+    const auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    auto remaining_ms = [&]() {
+        if(timeout_ms < 0) return -1;
+        auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+        return (int)max<chrono::milliseconds::rep>(remaining.count(), 0);
+    };
+
+    // Each outgoing connection gets a thread and a slot of its own
+    vector<pair<uint32_t, socket>> outgoing;
+    size_t num_incoming = 0;
+    for(const auto &address : addresses) {
+        if(address.first < my_id) {
+            outgoing.emplace_back(address.first, socket());
+        } else if(address.first > my_id) {
+            ++num_incoming;
+        }
+    }
+    vector<thread> connectors;
+    for(auto &slot : outgoing) {
+        connectors.emplace_back([&slot, &addresses, &remaining_ms, my_id, port]() {
+            const string &address = addresses.at(slot.first);
+            socket s;
+            try {
+                s = socket(address, port, remaining_ms());
+            } catch(exception) {
+                cerr << "WARNING: failed to connect to node " << slot.first << " at "
+                     << address << ":" << port << endl;
+                return;
+            }
+            uint32_t remote_id = 0;
+            if(!s.exchange(my_id, remote_id)) {
+                cerr << "WARNING: failed to exchange ID with node " << slot.first
+                     << " at " << address << ":" << port << endl;
+            } else if(remote_id != slot.first) {
+                cerr << "WARNING: node at " << address << ":" << port
+                     << " replied with wrong ID (expected " << slot.first
+                     << " but got " << remote_id << ")" << endl;
+            } else {
+                slot.second = move(s);
+            }
+        });
+    }
+
+    map<uint32_t, socket> sockets;
+    size_t num_accepted = 0;
+    while(num_accepted < num_incoming) {
+        socket s;
+        try {
+            s = listener.accept(remaining_ms());
+        } catch(exception) {
+            cerr << "WARNING: stopped waiting for connections with "
+                 << num_incoming - num_accepted << " nodes missing" << endl;
+            break;
+        }
+        uint32_t remote_id = 0;
+        if(!s.exchange(my_id, remote_id)) {
+            cerr << "WARNING: failed to exchange ID with node at " << s.remote_ip << endl;
+            continue;
+        }
+        // Nodes that weren't asked for are kept too, but don't count
+        if(remote_id > my_id && addresses.count(remote_id) > 0 && sockets.count(remote_id) == 0) {
+            ++num_accepted;
+        }
+        sockets[remote_id] = move(s);
+    }
+
+    for(auto &connector : connectors) {
+        connector.join();
+    }
+    for(auto &slot : outgoing) {
+        if(!slot.second.is_empty()) {
+            sockets[slot.first] = move(slot.second);
+        }
+    }
+    return sockets;
+}
 }
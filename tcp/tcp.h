@@ -2,9 +2,13 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <cstdint>
 #include <functional>
+#include <map>
 #include <memory>
 #include <string>
+#include <sys/uio.h>
+#include <vector>
 
 namespace tcp {
 
@@ -13,18 +17,37 @@ struct connection_failure : public exception {};
 
 class socket {
     int sock;
+    /** Whether SO_ZEROCOPY has been tried on this socket, and whether it worked */
+    bool zerocopy_checked = false;
+    bool zerocopy_enabled = false;
+    /** The number of MSG_ZEROCOPY sends issued and completed; the kernel
+     * numbers the sends on a socket from 0 */
+    uint32_t zerocopy_sends = 0;
+    uint32_t zerocopy_completions = 0;
 
     explicit socket(int _sock) : sock(_sock), remote_ip() {}
     explicit socket(int _sock, std::string remote_ip)
             : sock(_sock), remote_ip(remote_ip) {}
 
+    bool enable_zerocopy();
+    bool wait_for_zerocopy_completions();
+
     friend class connection_listener;
 
 public:
     std::string remote_ip;
 
     socket() : sock(-1), remote_ip() {}
+    /** Connects to a server, retrying until it is listening. */
     socket(std::string servername, int port);
+    /**
+     * Connects to a server without blocking on the connect itself, retrying
+     * until it is listening or the timeout expires.
+     * @param timeout_ms The longest time to keep trying, in milliseconds, or
+     * a negative number to keep trying forever
+     * @throws connection_failure if the timeout expired first
+     */
+    socket(std::string servername, int port, int timeout_ms);
     socket(socket&& s);
 
     socket& operator=(socket& s) = delete;
@@ -33,12 +56,40 @@ public:
     ~socket();
 
     bool is_empty();
+    /** @return The socket's file descriptor, e.g. for registering it with epoll. */
+    int get_fd() const;
     std::string get_self_ip();
 
     bool read(char* buffer, size_t size);
     bool probe();
     bool write(char const* buffer, size_t size);
 
+    /**
+     * Gathers the buffers into one stream of bytes with as few writev calls
+     * as possible, retrying after partial writes.
+     * @return False if the socket failed
+     */
+    bool write_vectored(const struct iovec* buffers, int count);
+    /** Scatters the next bytes on the socket into the buffers in order,
+     * filling each before the next. */
+    bool read_vectored(const struct iovec* buffers, int count);
+
+    /**
+     * Sends a buffer with MSG_ZEROCOPY, so the kernel sends it from this
+     * memory instead of copying it, and returns once the kernel is done with
+     * it. That only pays for itself on large buffers, so smaller ones, and
+     * every buffer where the kernel doesn't support it, are written normally.
+     */
+    bool write_zerocopy(char const* buffer, size_t size);
+    /** Buffers smaller than this are copied even by write_zerocopy */
+    static constexpr size_t zerocopy_threshold = 64 * 1024;
+
+    /** Turns Nagle's algorithm off (true) or on (false) */
+    bool set_nodelay(bool nodelay);
+    /** While corked, the kernel only sends full segments, so that a run of
+     * small writes leaves as one; uncorking sends what is left. */
+    bool set_cork(bool cork);
+
     template <class T>
     bool exchange(T local, T& remote) {
         static_assert(std::is_pod<T>::value,
@@ -53,13 +104,74 @@ public:
     }
 };
 
+/**
+ * Coalesces a run of writes to a socket, such as the many small ones that
+ * mutils::post_object makes for a structured object and its size prefix, into
+ * as few system calls as possible: small pieces are copied into a buffer, and
+ * a large piece is written together with the buffer in one writev, or with
+ * MSG_ZEROCOPY if that was asked for. What is buffered is written by flush()
+ * or the destructor; once a write has failed, later ones are skipped.
+ */
+class buffered_writer {
+    socket& sock;
+    const bool zerocopy;
+    std::vector<char> buffer;
+    bool ok = true;
+
+public:
+    static constexpr size_t buffer_size = 64 * 1024;
+
+    explicit buffered_writer(socket& sock, bool zerocopy = false);
+    ~buffered_writer();
+
+    buffered_writer(const buffered_writer&) = delete;
+    buffered_writer& operator=(const buffered_writer&) = delete;
+
+    void write(char const* bytes, size_t size);
+    /** Writes what is buffered. @return False if any write has failed */
+    bool flush();
+    bool succeeded() const { return ok; }
+
+    /** Writes a POD value, such as a size prefix */
+    template <class T>
+    void write_pod(const T& value) {
+        static_assert(std::is_pod<T>::value, "Can't send non-pod type over TCP");
+        write((char const*)&value, sizeof(T));
+    }
+};
+
 class connection_listener {
     std::unique_ptr<int, std::function<void(int*)>> fd;
 
 public:
+    /** Listens on the port of DERECHO_BIND_ADDRESS, or of every address if it isn't set. */
     explicit connection_listener(int port);
     socket accept();
+    /** Waits at most timeout_ms (forever if it is negative) for a connection.
+     * @throws connection_failure if the timeout expired first */
+    socket accept(int timeout_ms);
 };
+
+/**
+ * Connects to a set of nodes all at once, the way every node in a group
+ * connects to every other: each node connects to the nodes with lower IDs
+ * and accepts connections from those with higher IDs, and the two ends of
+ * each connection exchange IDs. The outgoing connections are made in
+ * parallel, while the incoming ones are accepted in whatever order they
+ * arrive, so the time this takes barely grows with the number of nodes.
+ * @param listener The listener that nodes with higher IDs connect to
+ * @param addresses The address of each node to connect with, by ID
+ * @param my_id The ID of this node, which is skipped if it is in addresses
+ * @param port The port the other nodes listen on
+ * @param timeout_ms The longest time to wait for the nodes, in milliseconds,
+ * or a negative number to wait for as long as it takes
+ * @return The sockets connected to nodes, by their IDs. Nodes that couldn't
+ * be connected to by the timeout are missing, and nodes that connected
+ * without being asked for are included.
+ */
+std::map<uint32_t, socket> connect_to_all(connection_listener& listener,
+                                          const std::map<uint32_t, std::string>& addresses,
+                                          uint32_t my_id, int port, int timeout_ms = -1);
 }
 
 #endif /* CONNECTION_H */
@@ -0,0 +1,190 @@
+
+#ifndef TIME_FAST_CLOCK_H
+#define TIME_FAST_CLOCK_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+// A realtime clock read from the time stamp counter, for the timestamps that
+// are taken once or more per message. Readings are interpolated from a
+// calibration against CLOCK_REALTIME, which is refreshed every
+// resync_interval_ns so that the clock follows NTP adjustments and steps of
+// the realtime clock. Where the TSC is not invariant, or a resync finds that
+// its rate has changed, the clock falls back to clock_gettime for good.
+namespace fast_clock {
+
+// How often the calibration is refreshed against the realtime clock, once the
+// intervals between the first resyncs, which start at calibration_ns and
+// double, have grown to it
+constexpr uint64_t resync_interval_ns = 100000000;
+// How long the first calibration measures the TSC rate for
+constexpr uint64_t calibration_ns = 2000000;
+
+inline uint64_t clock_ns(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Returns true if the CPU's TSC runs at a constant rate in all power states,
+// so that it can be used as a clock.
+inline bool tsc_invariant() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool invariant = [] {
+        unsigned int eax, ebx, ecx, edx;
+        if(!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+            return false;
+        }
+        __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        return (edx & (1u << 8)) != 0;
+    }();
+    return invariant;
+#else
+    return false;
+#endif
+}
+
+// Returns the TSC, or the monotonic clock in nanoseconds on CPUs without one.
+inline uint64_t read_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return clock_ns(CLOCK_MONOTONIC);
+#endif
+}
+
+class Calibration {
+    // Odd while the fields below are being replaced, as in a seqlock
+    std::atomic<uint64_t> sequence{0};
+    std::atomic<uint64_t> base_tsc{0};
+    // The realtime clock when the TSC read base_tsc
+    std::atomic<uint64_t> base_ns{0};
+    // Nanoseconds per tick in 32.32 fixed point
+    std::atomic<uint64_t> ns_per_tick_q32{0};
+    std::atomic<uint64_t> next_resync_tsc{0};
+    std::atomic<bool> stable{false};
+
+    // Guards the samples below, which only resyncs use
+    std::mutex resync_mutex;
+    // The first sample, so that the rate is measured over the clock's lifetime
+    uint64_t first_tsc;
+    uint64_t first_monotonic_ns;
+    uint64_t last_tsc;
+    uint64_t last_monotonic_ns;
+    uint64_t interval_ns = calibration_ns;
+    double ns_per_tick;
+
+    // Publishes a new base; resync_mutex must be held
+    void publish(uint64_t tsc, uint64_t realtime_ns) {
+        const uint64_t seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        base_tsc.store(tsc, std::memory_order_relaxed);
+        base_ns.store(realtime_ns, std::memory_order_relaxed);
+        ns_per_tick_q32.store(uint64_t(ns_per_tick * 4294967296.0), std::memory_order_relaxed);
+        sequence.store(seq + 2, std::memory_order_release);
+        next_resync_tsc.store(tsc + uint64_t(interval_ns / ns_per_tick), std::memory_order_relaxed);
+    }
+
+public:
+    Calibration() {
+        if(!tsc_invariant()) {
+            return;
+        }
+        first_tsc = read_tsc();
+        first_monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+        do {
+            last_monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+            last_tsc = read_tsc();
+        } while(last_monotonic_ns - first_monotonic_ns < calibration_ns);
+        if(last_tsc <= first_tsc) {
+            return;
+        }
+        ns_per_tick = double(last_monotonic_ns - first_monotonic_ns) / double(last_tsc - first_tsc);
+        std::lock_guard<std::mutex> lock(resync_mutex);
+        publish(read_tsc(), clock_ns(CLOCK_REALTIME));
+        stable = true;
+    }
+
+    bool usable() const {
+        return stable.load(std::memory_order_relaxed);
+    }
+
+    // Refreshes the calibration, unless another thread already is; marks the
+    // clock unusable if the TSC went backwards or, once the intervals are
+    // full length, its rate over the last one strayed from its long-run rate
+    // by more than 1%.
+    void resync() {
+        std::unique_lock<std::mutex> lock(resync_mutex, std::try_to_lock);
+        if(!lock.owns_lock() || read_tsc() < next_resync_tsc.load(std::memory_order_relaxed)) {
+            return;
+        }
+        const uint64_t tsc = read_tsc();
+        const uint64_t monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+        const uint64_t realtime_ns = clock_ns(CLOCK_REALTIME);
+        if(tsc <= last_tsc) {
+            stable = false;
+            return;
+        }
+        const double interval_rate = double(monotonic_ns - last_monotonic_ns) / double(tsc - last_tsc);
+        if(interval_ns == resync_interval_ns
+           && (interval_rate > ns_per_tick * 1.01 || interval_rate < ns_per_tick * 0.99)) {
+            stable = false;
+            return;
+        }
+        interval_ns = std::min(2 * interval_ns, resync_interval_ns);
+        ns_per_tick = double(monotonic_ns - first_monotonic_ns) / double(tsc - first_tsc);
+        last_tsc = tsc;
+        last_monotonic_ns = monotonic_ns;
+        publish(tsc, realtime_ns);
+    }
+
+    uint64_t realtime_ns(uint64_t tsc) {
+        if(tsc >= next_resync_tsc.load(std::memory_order_relaxed)) {
+            resync();
+        }
+        uint64_t seq, tsc0, ns0, mult;
+        do {
+            seq = sequence.load(std::memory_order_acquire);
+            tsc0 = base_tsc.load(std::memory_order_relaxed);
+            ns0 = base_ns.load(std::memory_order_relaxed);
+            mult = ns_per_tick_q32.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while((seq & 1) || sequence.load(std::memory_order_relaxed) != seq);
+        // Another thread may have published a base later than our reading
+        const int64_t ticks = int64_t(tsc - tsc0);
+        const __int128 offset = (__int128)ticks * mult;
+        return ns0 + int64_t(offset >> 32);
+    }
+};
+
+inline Calibration& calibration() {
+    static Calibration instance;
+    return instance;
+}
+
+// Returns true if realtime_ns() is reading the TSC rather than the system clock.
+inline bool tsc_usable() {
+    return calibration().usable();
+}
+
+// Returns the number of nanoseconds since the epoch, like CLOCK_REALTIME.
+inline uint64_t realtime_ns() {
+    Calibration& c = calibration();
+    if(!c.usable()) {
+        return clock_ns(CLOCK_REALTIME);
+    }
+    return c.realtime_ns(read_tsc());
+}
+
+}  // namespace fast_clock
+
+#endif /* TIME_FAST_CLOCK_H */